@@ -166,8 +166,9 @@ template <typename T> class ProducerConsumerQueue {
   const uint32_t size_;
   T* const records_;
 
-  std::atomic<uint32_t> readIndex_;
-  std::atomic<uint32_t> writeIndex_;
+  // The indices are written by different threads, keep them on separate cache lines.
+  alignas(64) std::atomic<uint32_t> readIndex_;
+  alignas(64) std::atomic<uint32_t> writeIndex_;
 
   ProducerConsumerQueue(const ProducerConsumerQueue&) = delete;
   ProducerConsumerQueue& operator=(const ProducerConsumerQueue&) = delete;
@@ -262,18 +262,20 @@ class AquaHash {
       input_bytes = finalized;
       return hash;
     } else {
-      // process remaining AES blocks
+      // process remaining AES blocks, the tail is consumed in order like in LargeKeyAlgorithm.
+      const __m128i* tail = input;
       if (input_bytes & 32) {
-        block[0] = _mm_aesenc_si128(block[0], input[0]);
-        block[1] = _mm_aesenc_si128(block[1], input[1]);
+        block[0] = _mm_aesenc_si128(block[0], tail[0]);
+        block[1] = _mm_aesenc_si128(block[1], tail[1]);
+        tail += 2;
       }
 
       if (input_bytes & 16) {
-        block[2] = _mm_aesenc_si128(block[2], input[2]);
+        block[2] = _mm_aesenc_si128(block[2], *tail++);
       }
 
       // AES sub-block processor
-      const uint8_t* ptr8 = reinterpret_cast<const uint8_t*>(&input[3]);
+      const uint8_t* ptr8 = reinterpret_cast<const uint8_t*>(tail);
       if (input_bytes & 8) {
         __m128i b = _mm_set_epi64x(*reinterpret_cast<const uint64_t*>(ptr8), 0xa11202c9b468bea1);
         block[3] = _mm_aesenc_si128(block[3], b);
@@ -0,0 +1,296 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "base/async_log_sink.h"
+
+#ifdef USE_ABSL_LOG
+
+#include <absl/log/globals.h>
+#include <absl/log/log_entry.h>
+#include <absl/log/log_sink_registry.h>
+#include <absl/numeric/bits.h>
+#include <absl/time/time.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "base/logging.h"
+
+namespace base {
+
+using namespace std;
+
+namespace {
+
+constexpr unsigned kNumSites = 1024;
+
+atomic<uint64_t> next_sink_id{1};
+
+AsyncLogSink* installed_sink = nullptr;
+absl::LogSeverityAtLeast prev_stderr_threshold = absl::LogSeverityAtLeast::kInfo;
+
+}  // namespace
+
+// Single producer, single consumer byte queue. head and tail grow monotonically and the
+// producer publishes only whole lines, so the consumer never sees a partial one.
+struct AsyncLogSink::Ring {
+  explicit Ring(size_t size) : buf(new char[size]), mask(size - 1) {
+  }
+
+  size_t used() const {
+    return head.load(memory_order_relaxed) - tail.load(memory_order_relaxed);
+  }
+
+  // Pushes both pieces or nothing.
+  bool Push(string_view a, string_view b) {
+    uint64_t h = head.load(memory_order_relaxed);
+    if (h - tail.load(memory_order_acquire) + a.size() + b.size() > mask + 1)
+      return false;
+    Copy(h, a);
+    Copy(h + a.size(), b);
+    head.store(h + a.size() + b.size(), memory_order_release);
+    return true;
+  }
+
+  void PopAll(string* dest) {
+    uint64_t t = tail.load(memory_order_relaxed);
+    uint64_t h = head.load(memory_order_acquire);
+    if (h == t)
+      return;
+
+    size_t offs = t & mask, len = h - t;
+    size_t first = min(len, mask + 1 - offs);
+    dest->append(buf.get() + offs, first);
+    dest->append(buf.get(), len - first);
+    tail.store(h, memory_order_release);
+  }
+
+  void Copy(uint64_t pos, string_view src) {
+    size_t offs = pos & mask;
+    size_t first = min(src.size(), mask + 1 - offs);
+    memcpy(buf.get() + offs, src.data(), first);
+    memcpy(buf.get(), src.data() + first, src.size() - first);
+  }
+
+  unique_ptr<char[]> buf;
+  const size_t mask;
+
+  alignas(64) atomic<uint64_t> head{0};
+  alignas(64) atomic<uint64_t> tail{0};
+
+  // Set when the producer thread exits, the writer frees the ring once it is drained.
+  atomic_bool closed{false};
+};
+
+// Lines logged by a call site in the current second. Call sites that hash to the same slot
+// share the limit.
+struct AsyncLogSink::Site {
+  atomic<uint64_t> window{0};  // second << 32 | lines.
+  atomic<uint32_t> dropped{0};
+};
+
+struct AsyncLogSink::ThreadState {
+  ~ThreadState() {
+    if (ring)
+      ring->closed.store(true, memory_order_release);
+  }
+
+  uint64_t sink_id = 0;
+  shared_ptr<Ring> ring;
+};
+
+AsyncLogSink::AsyncLogSink(const Options& opts)
+    : fd_(opts.fd),
+      ring_size_(absl::bit_ceil(max<size_t>(opts.ring_size, 4096))),
+      lines_per_sec_(opts.lines_per_sec),
+      id_(next_sink_id.fetch_add(1, memory_order_relaxed)),
+      sites_(new Site[kNumSites]) {
+  writer_ = thread{&AsyncLogSink::WriterLoop, this};
+}
+
+AsyncLogSink::~AsyncLogSink() {
+  {
+    lock_guard lk(wake_mu_);
+    stopped_ = true;
+  }
+  wake_cv_.notify_one();
+  writer_.join();
+  Drain();
+}
+
+void AsyncLogSink::Send(const absl::LogEntry& entry) {
+  string_view text = entry.text_message_with_prefix_and_newline();
+
+  if (entry.log_severity() == absl::LogSeverity::kFatal) {
+    // The process is about to die, so the line is written right away, after the earlier ones.
+    lock_guard lk(drain_mu_);
+    DrainLocked();
+    WriteAll(text.data(), text.size());
+    return;
+  }
+
+  uint32_t suppressed = 0;
+  if (!Admit(entry, &suppressed))
+    return;
+
+  char note[128];
+  size_t note_len = 0;
+  if (suppressed) {
+    string_view file = entry.source_basename();
+    int res = snprintf(note, sizeof(note), "[%u lines from %.*s:%d were dropped]\n", suppressed,
+                       int(file.size()), file.data(), entry.source_line());
+    note_len = min<size_t>(res, sizeof(note) - 1);
+  }
+
+  Ring* ring = GetRing();
+  if (!ring->Push(string_view{note, note_len}, text)) {
+    dropped_full_.fetch_add(1, memory_order_relaxed);
+    return;
+  }
+  written_lines_.fetch_add(1, memory_order_relaxed);
+
+  if (ring->used() > ring_size_ / 2 && !wake_requested_.exchange(true, memory_order_relaxed))
+    wake_cv_.notify_one();
+}
+
+void AsyncLogSink::Flush() {
+  Drain();
+}
+
+auto AsyncLogSink::GetStats() const -> Stats {
+  Stats res;
+  res.written_lines = written_lines_.load(memory_order_relaxed);
+  res.dropped_full = dropped_full_.load(memory_order_relaxed);
+  res.dropped_rate = dropped_rate_.load(memory_order_relaxed);
+  return res;
+}
+
+AsyncLogSink* AsyncLogSink::Install(const Options& opts) {
+  CHECK(installed_sink == nullptr);
+  installed_sink = new AsyncLogSink(opts);
+  absl::AddLogSink(installed_sink);
+  prev_stderr_threshold = absl::StderrThreshold();
+  absl::SetStderrThreshold(absl::LogSeverityAtLeast::kInfinity);
+  return installed_sink;
+}
+
+void AsyncLogSink::Uninstall() {
+  if (!installed_sink)
+    return;
+  absl::SetStderrThreshold(prev_stderr_threshold);
+  absl::RemoveLogSink(installed_sink);
+  delete installed_sink;
+  installed_sink = nullptr;
+}
+
+auto AsyncLogSink::GetRing() -> Ring* {
+  static thread_local ThreadState state;
+
+  if (state.sink_id != id_) {
+    if (state.ring)
+      state.ring->closed.store(true, memory_order_release);
+    state.ring = make_shared<Ring>(ring_size_);
+    state.sink_id = id_;
+
+    lock_guard lk(rings_mu_);
+    rings_.push_back(state.ring);
+  }
+  return state.ring.get();
+}
+
+bool AsyncLogSink::Admit(const absl::LogEntry& entry, uint32_t* suppressed) {
+  if (lines_per_sec_ == 0)
+    return true;
+
+  // source_filename points to a string literal, so its address identifies the file.
+  uint64_t key = reinterpret_cast<uintptr_t>(entry.source_filename().data()) ^
+                 (uint64_t(entry.source_line()) << 48);
+  Site& site = sites_[(key * 0x9E3779B97F4A7C15ULL) >> 54];
+  static_assert(kNumSites == 1 << (64 - 54));
+
+  uint64_t now = absl::ToUnixSeconds(entry.timestamp()) & 0xFFFFFFFF;
+  uint64_t cur = site.window.load(memory_order_relaxed);
+  while (true) {
+    uint64_t next;
+    if ((cur >> 32) != now) {
+      next = (now << 32) | 1;
+    } else if (uint32_t(cur) >= lines_per_sec_) {
+      site.dropped.fetch_add(1, memory_order_relaxed);
+      dropped_rate_.fetch_add(1, memory_order_relaxed);
+      return false;
+    } else {
+      next = cur + 1;
+    }
+    if (site.window.compare_exchange_weak(cur, next, memory_order_relaxed))
+      break;
+  }
+
+  if (site.dropped.load(memory_order_relaxed))
+    *suppressed = site.dropped.exchange(0, memory_order_relaxed);
+  return true;
+}
+
+void AsyncLogSink::WriterLoop() {
+  unique_lock lk(wake_mu_);
+  while (!stopped_) {
+    wake_cv_.wait_for(lk, chrono::milliseconds(10),
+                      [this] { return stopped_ || wake_requested_.load(memory_order_relaxed); });
+    wake_requested_.store(false, memory_order_relaxed);
+    lk.unlock();
+    Drain();
+    lk.lock();
+  }
+}
+
+void AsyncLogSink::Drain() {
+  lock_guard lk(drain_mu_);
+  DrainLocked();
+}
+
+void AsyncLogSink::DrainLocked() {
+  {
+    lock_guard lk(rings_mu_);
+    drain_rings_ = rings_;
+  }
+
+  vector<Ring*> closed;
+  for (const auto& ring : drain_rings_) {
+    // A ring that was closed before it is drained will not receive more lines.
+    if (ring->closed.load(memory_order_acquire))
+      closed.push_back(ring.get());
+    ring->PopAll(&write_buf_);
+  }
+  drain_rings_.clear();
+
+  if (!closed.empty()) {
+    lock_guard lk(rings_mu_);
+    auto it = remove_if(rings_.begin(), rings_.end(), [&](const auto& ring) {
+      return find(closed.begin(), closed.end(), ring.get()) != closed.end();
+    });
+    rings_.erase(it, rings_.end());
+  }
+
+  if (!write_buf_.empty()) {
+    WriteAll(write_buf_.data(), write_buf_.size());
+    write_buf_.clear();
+  }
+}
+
+void AsyncLogSink::WriteAll(const char* data, size_t len) {
+  while (len > 0) {
+    ssize_t res = ::write(fd_, data, len);
+    if (res < 0) {
+      if (errno == EINTR)
+        continue;
+      return;  // nowhere to report the error, the lines are lost.
+    }
+    data += res;
+    len -= res;
+  }
+}
+
+}  // namespace base
+
+#endif  // USE_ABSL_LOG
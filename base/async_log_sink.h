@@ -0,0 +1,110 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#ifdef USE_ABSL_LOG
+
+#include <absl/log/log_sink.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace base {
+
+// Log sink that takes the log writes off the logging threads. Every thread copies its lines
+// into its own lock-free ring and a background thread writes the rings to the file descriptor.
+// A thread never blocks on the I/O: if its ring is full, the line is dropped and counted.
+// In addition, every call site (file:line) may log at most lines_per_sec lines per second,
+// so that a single noisy site can not flood the rings of all the others. The number of lines
+// suppressed by the limit is reported with the next line that the site logs.
+// FATAL lines bypass the limits and are written synchronously, after draining the rings.
+class AsyncLogSink : public absl::LogSink {
+ public:
+  struct Options {
+    int fd = STDERR_FILENO;
+
+    // Bytes per logging thread, rounded up to a power of 2.
+    size_t ring_size = 1 << 16;
+
+    // 0 disables the per call site limit.
+    unsigned lines_per_sec = 1000;
+  };
+
+  struct Stats {
+    uint64_t written_lines = 0;
+    uint64_t dropped_full = 0;  // dropped because the ring of the thread was full.
+    uint64_t dropped_rate = 0;  // dropped by the per call site limit.
+  };
+
+  explicit AsyncLogSink(const Options& opts);
+
+  // Writes the pending lines and stops the writer thread.
+  ~AsyncLogSink() override;
+
+  void Send(const absl::LogEntry& entry) final;
+
+  // Blocks until the lines sent before the call are written.
+  void Flush() final;
+
+  Stats GetStats() const;
+
+  // Registers a process-wide sink with absl and stops absl from writing to stderr
+  // synchronously. Must be called at most once before Uninstall.
+  static AsyncLogSink* Install(const Options& opts);
+
+  // Flushes and unregisters the installed sink, restores the stderr logging.
+  static void Uninstall();
+
+ private:
+  struct Ring;
+  struct Site;
+  struct ThreadState;
+
+  Ring* GetRing();
+
+  // Returns false if the line should be dropped. Sets *suppressed to the number of lines
+  // the site dropped since it logged the last time.
+  bool Admit(const absl::LogEntry& entry, uint32_t* suppressed);
+
+  void WriterLoop();
+
+  // Moves the contents of all rings to fd_. Thread-safe.
+  void Drain();
+  void DrainLocked();
+  void WriteAll(const char* data, size_t len);
+
+  const int fd_;
+  const size_t ring_size_;
+  const unsigned lines_per_sec_;
+  const uint64_t id_;
+
+  std::unique_ptr<Site[]> sites_;
+
+  std::mutex rings_mu_;
+  std::vector<std::shared_ptr<Ring>> rings_;
+
+  std::mutex drain_mu_;
+  std::vector<std::shared_ptr<Ring>> drain_rings_;
+  std::string write_buf_;
+
+  std::mutex wake_mu_;
+  std::condition_variable wake_cv_;
+  std::atomic_bool wake_requested_{false};
+  bool stopped_ = false;
+
+  std::atomic<uint64_t> written_lines_{0}, dropped_full_{0}, dropped_rate_{0};
+
+  std::thread writer_;
+};
+
+}  // namespace base
+
+#endif  // USE_ABSL_LOG
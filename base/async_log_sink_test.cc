@@ -0,0 +1,103 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "base/async_log_sink.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <thread>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace base {
+
+using namespace std;
+
+class AsyncLogSinkTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    char path[] = "/tmp/async_log_sink_testXXXXXX";
+    fd_ = mkstemp(path);
+    ASSERT_GE(fd_, 0);
+    unlink(path);
+  }
+
+  void TearDown() override {
+    close(fd_);
+  }
+
+  string ReadAll() {
+    string res(lseek(fd_, 0, SEEK_END), '\0');
+    EXPECT_EQ(ssize_t(res.size()), pread(fd_, res.data(), res.size(), 0));
+    return res;
+  }
+
+  int fd_ = -1;
+};
+
+TEST_F(AsyncLogSinkTest, Basic) {
+  AsyncLogSink::Options opts;
+  opts.fd = fd_;
+  AsyncLogSink sink(opts);
+
+  LOG(INFO).ToSinkOnly(&sink) << "first line";
+  LOG(ERROR).ToSinkOnly(&sink) << "second line";
+  sink.Flush();
+
+  string contents = ReadAll();
+  EXPECT_NE(string::npos, contents.find("first line\n"));
+  EXPECT_LT(contents.find("first line"), contents.find("second line"));
+  EXPECT_EQ(2u, sink.GetStats().written_lines);
+}
+
+TEST_F(AsyncLogSinkTest, Threads) {
+  AsyncLogSink::Options opts;
+  opts.fd = fd_;
+  opts.lines_per_sec = 0;
+  AsyncLogSink sink(opts);
+
+  constexpr unsigned kThreads = 4, kLines = 2000;
+  vector<thread> threads;
+  for (unsigned t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&, t] {
+      for (unsigned i = 0; i < kLines; ++i)
+        LOG(INFO).ToSinkOnly(&sink) << "thread " << t << " line " << i;
+    });
+  }
+  for (auto& th : threads)
+    th.join();
+  sink.Flush();
+
+  AsyncLogSink::Stats stats = sink.GetStats();
+  EXPECT_EQ(kThreads * kLines, stats.written_lines + stats.dropped_full);
+  EXPECT_EQ(0u, stats.dropped_rate);
+
+  string contents = ReadAll();
+  EXPECT_EQ(stats.written_lines, size_t(count(contents.begin(), contents.end(), '\n')));
+}
+
+TEST_F(AsyncLogSinkTest, RateLimit) {
+  AsyncLogSink::Options opts;
+  opts.fd = fd_;
+  opts.lines_per_sec = 10;
+  AsyncLogSink sink(opts);
+
+  for (unsigned i = 0; i < 1000; ++i) {
+    LOG(INFO).ToSinkOnly(&sink) << "noisy";
+  }
+  LOG(INFO).ToSinkOnly(&sink) << "quiet";
+  sink.Flush();
+
+  // The limit may restart once if the loop crosses a second boundary.
+  AsyncLogSink::Stats stats = sink.GetStats();
+  EXPECT_GE(stats.written_lines, 11u);
+  EXPECT_LE(stats.written_lines, 21u);
+  EXPECT_EQ(1001u, stats.written_lines + stats.dropped_rate);
+  EXPECT_NE(string::npos, ReadAll().find("quiet"));
+}
+
+}  // namespace base
@@ -0,0 +1,51 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <benchmark/benchmark.h>
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace base {
+
+// Implements the --bench_json=<path> convention of the benchmark binaries. If argv has the flag,
+// removes it and initializes the google benchmark library to report to the console and to
+// write the results to path in json format, which the bench target collects and
+// tools/bench_compare.py compares. Returns false without initializing the library otherwise.
+inline bool InitBenchJson(int* argc, char** argv) {
+  constexpr char kFlag[] = "--bench_json=";
+  constexpr size_t kFlagLen = sizeof(kFlag) - 1;
+
+  std::vector<char*> args;
+  std::string path;
+  for (int i = 0; i < *argc; ++i) {
+    if (strncmp(argv[i], kFlag, kFlagLen) == 0)
+      path = argv[i] + kFlagLen;
+    else
+      args.push_back(argv[i]);
+  }
+  if (path.empty())
+    return false;
+
+  // The library copies the values of its flags.
+  std::string out_flag = "--benchmark_out=" + path;
+  std::string format_flag = "--benchmark_out_format=json";
+  args.push_back(out_flag.data());
+  args.push_back(format_flag.data());
+
+  int num_args = args.size();
+  benchmark::Initialize(&num_args, args.data());
+
+  // The library removed its flags, so the rest fits into argv.
+  for (int i = 0; i < num_args; ++i)
+    argv[i] = args[i];
+  argv[num_args] = nullptr;
+  *argc = num_args;
+  return true;
+}
+
+}  // namespace base
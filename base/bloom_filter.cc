@@ -0,0 +1,214 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "base/bloom_filter.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "base/cpu_features.h"
+#include "base/logging.h"
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+namespace base {
+
+using namespace std;
+
+namespace {
+
+// The multipliers of the Parquet split block Bloom filter.
+alignas(32) constexpr uint32_t kSalts[8] = {0x47b6137bU, 0x44974d91U, 0x8824ad5bU,
+                                            0xa2b7289dU, 0x705495c7U, 0x2df1424bU,
+                                            0x9efc4947U, 0x5c6bfb31U};
+
+// How far ahead MayContainBatch prefetches the blocks.
+constexpr size_t kPrefetchDistance = 8;
+
+inline size_t BlockIndex(uint64_t hash, size_t num_blocks) {
+  return ((hash >> 32) * num_blocks) >> 32;
+}
+
+inline bool ProbeGeneric(const uint32_t* block, uint32_t key) {
+  for (unsigned i = 0; i < 8; ++i) {
+    uint32_t mask = 1U << ((key * kSalts[i]) >> 27);
+    if ((block[i] & mask) == 0)
+      return false;
+  }
+  return true;
+}
+
+void BatchGeneric(const uint32_t* blocks, size_t num_blocks, const uint64_t* hashes, size_t n,
+                  bool* results) {
+  for (size_t i = 0; i < n; ++i) {
+    if (i + kPrefetchDistance < n)
+      __builtin_prefetch(blocks + BlockIndex(hashes[i + kPrefetchDistance], num_blocks) * 8);
+    results[i] = ProbeGeneric(blocks + BlockIndex(hashes[i], num_blocks) * 8, hashes[i]);
+  }
+}
+
+#ifdef __x86_64__
+
+HELIO_TARGET_AVX2 inline __m256i MakeMaskAvx2(uint32_t key) {
+  __m256i salts = _mm256_load_si256(reinterpret_cast<const __m256i*>(kSalts));
+  __m256i shifts = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_set1_epi32(key), salts), 27);
+  return _mm256_sllv_epi32(_mm256_set1_epi32(1), shifts);
+}
+
+HELIO_TARGET_AVX2 void BatchAvx2(const uint32_t* blocks, size_t num_blocks,
+                                 const uint64_t* hashes, size_t n, bool* results) {
+  for (size_t i = 0; i < n; ++i) {
+    if (i + kPrefetchDistance < n)
+      __builtin_prefetch(blocks + BlockIndex(hashes[i + kPrefetchDistance], num_blocks) * 8);
+    const __m256i* block =
+        reinterpret_cast<const __m256i*>(blocks + BlockIndex(hashes[i], num_blocks) * 8);
+
+    // testc is set if all the bits of the mask are set in the block.
+    results[i] = _mm256_testc_si256(_mm256_load_si256(block), MakeMaskAvx2(hashes[i]));
+  }
+}
+
+#elif defined(__aarch64__)
+
+inline bool ProbeNeon(const uint32_t* block, uint32_t key) {
+  uint32x4_t k = vdupq_n_u32(key);
+  int32x4_t shift0 = vreinterpretq_s32_u32(vshrq_n_u32(vmulq_u32(k, vld1q_u32(kSalts)), 27));
+  int32x4_t shift1 =
+      vreinterpretq_s32_u32(vshrq_n_u32(vmulq_u32(k, vld1q_u32(kSalts + 4)), 27));
+  uint32x4_t mask0 = vshlq_u32(vdupq_n_u32(1), shift0);
+  uint32x4_t mask1 = vshlq_u32(vdupq_n_u32(1), shift1);
+
+  // The bits of the masks that are missing in the block.
+  uint32x4_t miss = vorrq_u32(vbicq_u32(mask0, vld1q_u32(block)),
+                              vbicq_u32(mask1, vld1q_u32(block + 4)));
+  return vmaxvq_u32(miss) == 0;
+}
+
+void BatchNeon(const uint32_t* blocks, size_t num_blocks, const uint64_t* hashes, size_t n,
+               bool* results) {
+  for (size_t i = 0; i < n; ++i) {
+    if (i + kPrefetchDistance < n)
+      __builtin_prefetch(blocks + BlockIndex(hashes[i + kPrefetchDistance], num_blocks) * 8);
+    results[i] = ProbeNeon(blocks + BlockIndex(hashes[i], num_blocks) * 8, hashes[i]);
+  }
+}
+
+#endif
+
+using BatchFn = void(const uint32_t*, size_t, const uint64_t*, size_t, bool*);
+
+const CpuDispatch<BatchFn>& BatchImpl() {
+  static const CpuDispatch<BatchFn> impl{
+#ifdef __x86_64__
+      {CpuLevel::kAVX2, BatchAvx2},
+#elif defined(__aarch64__)
+      {CpuLevel::kNEON, BatchNeon},
+#endif
+      {CpuLevel::kGeneric, BatchGeneric}};
+  return impl;
+}
+
+}  // namespace
+
+BlockBloomFilter::BlockBloomFilter(PMR_NS::memory_resource* mr)
+    : mr_(mr ? mr : PMR_NS::get_default_resource()) {
+}
+
+BlockBloomFilter::~BlockBloomFilter() {
+  Free();
+}
+
+void BlockBloomFilter::Init(size_t num_keys, double fpp, Hasher::Engine engine, uint64_t seed) {
+  CHECK(fpp > 0 && fpp < 1) << fpp;
+  CHECK_NE(engine, Hasher::kCRC32C) << "the filter requires 64-bit hashes";
+  Free();
+
+  // The bits per key of a split block filter with 8 bits per key, see the Parquet spec.
+  double bits = -8.0 * std::max<size_t>(num_keys, 1) / log(1 - pow(fpp, 1.0 / 8));
+  size_t num_blocks = std::max<size_t>(1, ceil(bits / (kBlockBytes * 8)));
+  CHECK_LE(num_blocks, UINT32_MAX);
+
+  blocks_ = static_cast<Block*>(mr_->allocate(num_blocks * kBlockBytes, 64));
+  memset(blocks_, 0, num_blocks * kBlockBytes);
+  num_blocks_ = num_blocks;
+  owned_ = true;
+  engine_ = engine == Hasher::kAuto ? Hasher::BestEngine() : engine;
+  seed_ = seed;
+}
+
+void BlockBloomFilter::AddHash(uint64_t hash) {
+  DCHECK(owned_) << "attached filters are read-only";
+
+  uint32_t* block = const_cast<Block*>(BlockOf(hash))->words;
+  uint32_t key = hash;
+  for (unsigned i = 0; i < 8; ++i)
+    block[i] |= 1U << ((key * kSalts[i]) >> 27);
+}
+
+bool BlockBloomFilter::MayContainHash(uint64_t hash) const {
+  DCHECK(blocks_);
+  const uint32_t* block = BlockOf(hash)->words;
+#if defined(__AVX2__)
+  return _mm256_testc_si256(_mm256_load_si256(reinterpret_cast<const __m256i*>(block)),
+                            MakeMaskAvx2(hash));
+#elif defined(__aarch64__)
+  return ProbeNeon(block, hash);
+#else
+  return ProbeGeneric(block, hash);
+#endif
+}
+
+void BlockBloomFilter::MayContainBatch(absl::Span<const uint64_t> hashes, bool* results) const {
+  DCHECK(blocks_);
+  BatchImpl()(reinterpret_cast<const uint32_t*>(blocks_), num_blocks_, hashes.data(),
+              hashes.size(), results);
+}
+
+void BlockBloomFilter::Serialize(char* dest) const {
+  Header header;
+  header.num_blocks = num_blocks_;
+  header.seed = seed_;
+  header.engine = engine_;
+  memcpy(dest, &header, sizeof(header));
+  memcpy(dest + sizeof(header), blocks_, num_blocks_ * kBlockBytes);
+}
+
+bool BlockBloomFilter::Attach(const char* buf, size_t len) {
+  Header header;
+  if (len < sizeof(header) || reinterpret_cast<uintptr_t>(buf) % kBlockBytes != 0)
+    return false;
+
+  memcpy(&header, buf, sizeof(header));
+  if (header.magic != Header::kMagic || header.version != Header::kVersion ||
+      header.num_blocks == 0 || header.num_blocks > UINT32_MAX ||
+      len < sizeof(header) + header.num_blocks * kBlockBytes)
+    return false;
+
+  Hasher::Engine engine = Hasher::Engine(header.engine);
+  if (engine == Hasher::kAuto || engine == Hasher::kCRC32C || !Hasher::IsSupported(engine))
+    return false;
+
+  Free();
+  blocks_ = reinterpret_cast<Block*>(const_cast<char*>(buf + sizeof(header)));
+  num_blocks_ = header.num_blocks;
+  seed_ = header.seed;
+  engine_ = engine;
+  owned_ = false;
+  return true;
+}
+
+void BlockBloomFilter::Free() {
+  if (owned_)
+    mr_->deallocate(blocks_, num_blocks_ * kBlockBytes, 64);
+  blocks_ = nullptr;
+  num_blocks_ = 0;
+  owned_ = false;
+}
+
+}  // namespace base
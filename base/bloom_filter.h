@@ -0,0 +1,116 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/types/span.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#include "base/hash.h"
+#include "base/pmr/memory_resource.h"
+
+namespace base {
+
+// Split block Bloom filter (Putze et al., "Cache-, Hash- and Space-Efficient Bloom Filters").
+// The filter is an array of 256-bit blocks. A key selects a single block by the high 32 bits
+// of its hash and sets one bit in each of the 8 32-bit words of the block, derived from the low
+// 32 bits with 8 odd multipliers. Hence a probe costs a single cache miss and compiles into
+// a few AVX2 or NEON instructions. The false positive rate is slightly higher than the one of
+// a standard Bloom filter of the same size, which Init compensates for.
+//
+// The keys are hashed with Hasher, the engine and the seed are part of the filter, so that a
+// serialized filter is probed with the same function. MayContainBatch prefetches the blocks
+// ahead, which hides the cache misses when probing many keys.
+//
+// The serialized form is a 64-byte Header followed by the blocks, so it can be written to a
+// file as is and probed in place after mapping the file, see Attach.
+class BlockBloomFilter {
+ public:
+  static constexpr size_t kBlockBytes = 32;
+
+  struct Header {
+    static constexpr uint32_t kMagic = 0x46424C48;  // "HLBF"
+    static constexpr uint32_t kVersion = 1;
+
+    uint32_t magic = kMagic;
+    uint32_t version = kVersion;
+    uint64_t num_blocks = 0;
+    uint64_t seed = 0;
+    uint8_t engine = Hasher::kXXH3;
+    uint8_t reserved[39] = {};
+  };
+  static_assert(sizeof(Header) == 64);
+
+  explicit BlockBloomFilter(PMR_NS::memory_resource* mr = nullptr);
+  ~BlockBloomFilter();
+
+  BlockBloomFilter(const BlockBloomFilter&) = delete;
+  BlockBloomFilter& operator=(const BlockBloomFilter&) = delete;
+
+  // Sizes the filter for num_keys with the false positive rate fpp and clears it.
+  // kAuto resolves to the best engine of this cpu, which may make the filter unreadable on
+  // other cpus.
+  void Init(size_t num_keys, double fpp = 0.01, Hasher::Engine engine = Hasher::kXXH3,
+            uint64_t seed = 0);
+
+  uint64_t Hash(std::string_view key) const {
+    return Hasher::Hash(engine_, key.data(), key.size(), seed_);
+  }
+
+  void Add(std::string_view key) {
+    AddHash(Hash(key));
+  }
+
+  bool MayContain(std::string_view key) const {
+    return MayContainHash(Hash(key));
+  }
+
+  void AddHash(uint64_t hash);
+  bool MayContainHash(uint64_t hash) const;
+
+  // Probes hashes, results[i] is set to MayContainHash(hashes[i]).
+  void MayContainBatch(absl::Span<const uint64_t> hashes, bool* results) const;
+
+  // Writes the serialized filter of SerializedSize() bytes into dest.
+  size_t SerializedSize() const {
+    return sizeof(Header) + num_blocks_ * kBlockBytes;
+  }
+  void Serialize(char* dest) const;
+
+  // Probes the serialized filter in buf without copying it, e.g. a mapped file. buf must be
+  // aligned to 32 bytes and outlive the filter, the filter is read-only afterwards.
+  // Returns false if buf is not a valid filter or its hash engine is not supported.
+  bool Attach(const char* buf, size_t len);
+
+  size_t num_blocks() const {
+    return num_blocks_;
+  }
+
+  size_t bytes() const {
+    return num_blocks_ * kBlockBytes;
+  }
+
+ private:
+  struct Block {
+    alignas(kBlockBytes) uint32_t words[8];
+  };
+
+  const Block* BlockOf(uint64_t hash) const {
+    return &blocks_[((hash >> 32) * num_blocks_) >> 32];
+  }
+
+  void Free();
+
+  PMR_NS::memory_resource* mr_;
+  Block* blocks_ = nullptr;
+  size_t num_blocks_ = 0;
+  uint64_t seed_ = 0;
+  Hasher::Engine engine_ = Hasher::kXXH3;
+  bool owned_ = false;
+};
+
+}  // namespace base
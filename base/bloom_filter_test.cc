@@ -0,0 +1,137 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "base/bloom_filter.h"
+
+#include <absl/strings/str_cat.h>
+
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace base {
+
+using namespace std;
+
+class BloomFilterTest : public testing::Test {};
+
+TEST_F(BloomFilterTest, Basic) {
+  constexpr unsigned kNumKeys = 100000;
+  BlockBloomFilter filter;
+  filter.Init(kNumKeys, 0.01);
+
+  for (unsigned i = 0; i < kNumKeys; ++i)
+    filter.Add(absl::StrCat("key:", i));
+
+  // No false negatives.
+  for (unsigned i = 0; i < kNumKeys; ++i)
+    ASSERT_TRUE(filter.MayContain(absl::StrCat("key:", i))) << i;
+
+  unsigned false_positives = 0;
+  for (unsigned i = 0; i < kNumKeys; ++i)
+    false_positives += filter.MayContain(absl::StrCat("other:", i));
+  double fpp = double(false_positives) / kNumKeys;
+  LOG(INFO) << "bytes per key " << double(filter.bytes()) / kNumKeys << ", fpp " << fpp;
+  EXPECT_LT(fpp, 0.015);
+}
+
+TEST_F(BloomFilterTest, Batch) {
+  BlockBloomFilter filter;
+  filter.Init(1000, 0.01);
+
+  vector<uint64_t> hashes;
+  for (unsigned i = 0; i < 2000; ++i) {
+    hashes.push_back(filter.Hash(absl::StrCat("key:", i)));
+    if (i % 2 == 0)
+      filter.AddHash(hashes.back());
+  }
+
+  unique_ptr<bool[]> results(new bool[hashes.size()]);
+  filter.MayContainBatch(hashes, results.get());
+  for (size_t i = 0; i < hashes.size(); ++i) {
+    ASSERT_EQ(filter.MayContainHash(hashes[i]), results[i]) << i;
+    if (i % 2 == 0)
+      ASSERT_TRUE(results[i]);
+  }
+}
+
+TEST_F(BloomFilterTest, Serialize) {
+  BlockBloomFilter filter;
+  filter.Init(1000, 0.01, Hasher::kXXH3, 42);
+  for (unsigned i = 0; i < 1000; ++i)
+    filter.Add(absl::StrCat("key:", i));
+
+  // Aligned like a mapped file.
+  struct alignas(64) Chunk {
+    char data[64];
+  };
+  size_t len = filter.SerializedSize();
+  vector<Chunk> storage(len / sizeof(Chunk) + 1);
+  char* buf = storage[0].data;
+  filter.Serialize(buf);
+
+  BlockBloomFilter view;
+  ASSERT_TRUE(view.Attach(buf, len));
+  EXPECT_EQ(filter.num_blocks(), view.num_blocks());
+  for (unsigned i = 0; i < 1000; ++i) {
+    string key = absl::StrCat("other:", i);
+    ASSERT_TRUE(view.MayContain(absl::StrCat("key:", i)));
+    ASSERT_EQ(filter.MayContain(key), view.MayContain(key));
+  }
+
+  EXPECT_FALSE(view.Attach(buf, len - 1));
+  EXPECT_FALSE(view.Attach(buf + 1, len - 1));
+  buf[0] ^= 1;
+  EXPECT_FALSE(view.Attach(buf, len));
+}
+
+static void BM_MayContain(benchmark::State& state) {
+  size_t num_keys = state.range(0);
+  BlockBloomFilter filter;
+  filter.Init(num_keys, 0.01);
+
+  mt19937_64 rng(42);
+  for (size_t i = 0; i < num_keys; ++i)
+    filter.AddHash(rng());
+
+  vector<uint64_t> hashes(1 << 16);
+  for (uint64_t& h : hashes)
+    h = rng();
+
+  size_t i = 0;
+  while (state.KeepRunning()) {
+    sink_result(filter.MayContainHash(hashes[i++ & (hashes.size() - 1)]));
+  }
+}
+BENCHMARK(BM_MayContain)->Arg(1 << 16)->Arg(1 << 24);
+
+static void BM_MayContainBatch(benchmark::State& state) {
+  size_t num_keys = state.range(0);
+  BlockBloomFilter filter;
+  filter.Init(num_keys, 0.01);
+
+  mt19937_64 rng(42);
+  for (size_t i = 0; i < num_keys; ++i)
+    filter.AddHash(rng());
+
+  vector<uint64_t> hashes(1 << 16);
+  for (uint64_t& h : hashes)
+    h = rng();
+
+  constexpr size_t kBatch = 64;
+  bool results[kBatch];
+  size_t i = 0;
+  while (state.KeepRunning()) {
+    filter.MayContainBatch(absl::MakeSpan(&hashes[i], kBatch), results);
+    i = (i + kBatch) & (hashes.size() - 1);
+  }
+  state.SetItemsProcessed(state.iterations() * kBatch);
+}
+BENCHMARK(BM_MayContainBatch)->Arg(1 << 16)->Arg(1 << 24);
+
+}  // namespace base
@@ -0,0 +1,796 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/base/optimization.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "base/pmr/memory_resource.h"
+
+namespace base {
+
+namespace bptree_internal {
+
+// Returns the number of keys[0..n) that are less than k, or greater than k if kGreater is true.
+// K is a 32-bit or 64-bit integer. Unsigned keys are compared as signed ones with the sign bit
+// flipped. The keys are compared a vector at a time without branches, which for the node sizes
+// of BPTreeMap beats the binary search with its unpredictable branches.
+template <bool kGreater, typename K> unsigned CountCmp(const K* keys, unsigned n, K k) {
+  static_assert(std::is_integral_v<K> && (sizeof(K) == 4 || sizeof(K) == 8));
+  using S = std::make_signed_t<K>;
+  constexpr S kBias = std::is_signed_v<K> ? 0 : std::numeric_limits<S>::min();
+
+  unsigned i = 0, res = 0;
+  S sk = S(k) ^ kBias;
+#if defined(__SSE2__)
+  if constexpr (sizeof(K) == 4) {
+    __m128i kv = _mm_set1_epi32(sk), bias = _mm_set1_epi32(kBias);
+    for (; i + 4 <= n; i += 4) {
+      __m128i v = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i)), bias);
+      __m128i m = kGreater ? _mm_cmpgt_epi32(v, kv) : _mm_cmpgt_epi32(kv, v);
+      res += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(m)));
+    }
+  }
+#endif
+#if defined(__SSE4_2__)
+  if constexpr (sizeof(K) == 8) {
+    __m128i kv = _mm_set1_epi64x(sk), bias = _mm_set1_epi64x(kBias);
+    for (; i + 2 <= n; i += 2) {
+      __m128i v = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i)), bias);
+      __m128i m = kGreater ? _mm_cmpgt_epi64(v, kv) : _mm_cmpgt_epi64(kv, v);
+      res += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(m)));
+    }
+  }
+#elif defined(__aarch64__)
+  if constexpr (sizeof(K) == 4) {
+    int32x4_t kv = vdupq_n_s32(sk), bias = vdupq_n_s32(kBias);
+    for (; i + 4 <= n; i += 4) {
+      int32x4_t v = veorq_s32(vld1q_s32(reinterpret_cast<const int32_t*>(keys + i)), bias);
+      uint32x4_t m = kGreater ? vcgtq_s32(v, kv) : vcgtq_s32(kv, v);
+      res += vaddvq_u32(vshrq_n_u32(m, 31));
+    }
+  } else {
+    int64x2_t kv = vdupq_n_s64(sk), bias = vdupq_n_s64(kBias);
+    for (; i + 2 <= n; i += 2) {
+      int64x2_t v = veorq_s64(vld1q_s64(reinterpret_cast<const int64_t*>(keys + i)), bias);
+      uint64x2_t m = kGreater ? vcgtq_s64(v, kv) : vcgtq_s64(kv, v);
+      res += vaddvq_u64(vshrq_n_u64(m, 63));
+    }
+  }
+#endif
+  for (; i < n; ++i) {
+    S v = S(keys[i]) ^ kBias;
+    res += kGreater ? v > sk : v < sk;
+  }
+  return res;
+}
+
+}  // namespace bptree_internal
+
+// Ordered map implemented as a B+tree. The nodes are about kNodeBytes wide and keep their keys
+// and values in separate arrays, so that a node search touches only the cache lines of its
+// keys. The entries reside in the leaves, which are linked in both directions, hence range
+// scans walk the leaves sequentially instead of chasing pointers through the tree. Integer keys
+// compared with std::less are searched within a node with SIMD compares, other keys with the
+// binary search.
+//
+// The iterators expose key() and value() rather than a std::pair. Any insertion or erasure
+// invalidates all the iterators. The nodes are allocated from the memory resource.
+template <typename K, typename V, typename Compare = std::less<K>, size_t kNodeBytes = 256>
+class BPTreeMap {
+  struct Node {
+    uint16_t count;  // the number of entries in a leaf or the number of keys in an inner node.
+    bool is_leaf;
+  };
+
+  static constexpr size_t kLeafHeader = sizeof(Node) + 2 * sizeof(void*);
+  static constexpr size_t kInnerHeader = sizeof(Node) + sizeof(void*);
+  static constexpr unsigned kLeafCap =
+      std::max<size_t>(4, (kNodeBytes - kLeafHeader) / (sizeof(K) + sizeof(V)));
+  static constexpr unsigned kInnerCap =
+      std::max<size_t>(4, (kNodeBytes - kInnerHeader) / (sizeof(K) + sizeof(void*)));
+  static_assert(kLeafCap <= UINT16_MAX && kInnerCap <= UINT16_MAX);
+
+  // Nodes are rebalanced when they have fewer entries, except for the root.
+  static constexpr unsigned kLeafMin = kLeafCap / 2;
+  static constexpr unsigned kInnerMin = kInnerCap / 2;
+
+  // With at least kInnerMin + 1 children per inner node, the height does not reach it.
+  static constexpr unsigned kMaxHeight = 48;
+
+  static constexpr bool kSimdKeys = std::is_integral_v<K> && !std::is_same_v<K, bool> &&
+                                    (sizeof(K) == 4 || sizeof(K) == 8) &&
+                                    std::is_same_v<Compare, std::less<K>>;
+
+  // Uninitialized storage, the first count elements are constructed.
+  template <typename T, size_t N> struct Array {
+    alignas(T) unsigned char buf[N * sizeof(T)];
+
+    T* data() {
+      return reinterpret_cast<T*>(buf);
+    }
+
+    const T* data() const {
+      return reinterpret_cast<const T*>(buf);
+    }
+  };
+
+  struct Leaf : Node {
+    Leaf* prev;
+    Leaf* next;
+    Array<K, kLeafCap> keys;
+    Array<V, kLeafCap> values;
+  };
+
+  // Child i holds the keys in [keys[i - 1], keys[i]).
+  struct Inner : Node {
+    Array<K, kInnerCap> keys;
+    Node* children[kInnerCap + 1];
+  };
+
+  static constexpr size_t kAlign = 64;
+
+ public:
+  using key_type = K;
+  using mapped_type = V;
+
+  template <bool kConst> class Iterator {
+    friend class BPTreeMap;
+    template <bool> friend class Iterator;
+
+   public:
+    using value_reference = std::conditional_t<kConst, const V&, V&>;
+
+    Iterator() = default;
+
+    // iterator converts to const_iterator.
+    template <bool kOther, typename = std::enable_if_t<kConst && !kOther>>
+    Iterator(const Iterator<kOther>& other) : leaf_(other.leaf_), pos_(other.pos_) {
+    }
+
+    const K& key() const {
+      return leaf_->keys.data()[pos_];
+    }
+
+    value_reference value() const {
+      return leaf_->values.data()[pos_];
+    }
+
+    Iterator& operator++() {
+      if (++pos_ == leaf_->count && leaf_->next) {
+        leaf_ = leaf_->next;
+        pos_ = 0;
+      }
+      return *this;
+    }
+
+    Iterator& operator--() {
+      if (pos_ == 0) {
+        leaf_ = leaf_->prev;
+        pos_ = leaf_->count;
+      }
+      --pos_;
+      return *this;
+    }
+
+    bool operator==(const Iterator& other) const {
+      return leaf_ == other.leaf_ && pos_ == other.pos_;
+    }
+
+    bool operator!=(const Iterator& other) const {
+      return !(*this == other);
+    }
+
+   private:
+    Iterator(Leaf* leaf, unsigned pos) : leaf_(leaf), pos_(pos) {
+    }
+
+    Leaf* leaf_ = nullptr;
+    unsigned pos_ = 0;
+  };
+
+  using iterator = Iterator<false>;
+  using const_iterator = Iterator<true>;
+
+  explicit BPTreeMap(PMR_NS::memory_resource* mr = nullptr, const Compare& comp = Compare())
+      : mr_(mr ? mr : PMR_NS::get_default_resource()), comp_(comp) {
+  }
+
+  ~BPTreeMap() {
+    clear();
+  }
+
+  BPTreeMap(const BPTreeMap&) = delete;
+  BPTreeMap& operator=(const BPTreeMap&) = delete;
+
+  BPTreeMap(BPTreeMap&& other) noexcept : mr_(other.mr_), comp_(other.comp_) {
+    swap(other);
+  }
+
+  // Both maps must use the same memory resource.
+  BPTreeMap& operator=(BPTreeMap&& other) noexcept {
+    swap(other);
+    return *this;
+  }
+
+  void swap(BPTreeMap& other) noexcept {
+    std::swap(root_, other.root_);
+    std::swap(first_, other.first_);
+    std::swap(last_, other.last_);
+    std::swap(height_, other.height_);
+    std::swap(size_, other.size_);
+    std::swap(num_leaves_, other.num_leaves_);
+    std::swap(num_inner_, other.num_inner_);
+  }
+
+  iterator begin() {
+    return iterator(first_, 0);
+  }
+
+  iterator end() {
+    return iterator(last_, last_ ? last_->count : 0);
+  }
+
+  const_iterator begin() const {
+    return const_cast<BPTreeMap*>(this)->begin();
+  }
+
+  const_iterator end() const {
+    return const_cast<BPTreeMap*>(this)->end();
+  }
+
+  iterator find(const K& key) {
+    if (!root_)
+      return end();
+    Leaf* leaf = FindLeaf(key);
+    unsigned pos = LowerBound(leaf->keys.data(), leaf->count, key);
+    if (pos < leaf->count && !comp_(key, leaf->keys.data()[pos]))
+      return iterator(leaf, pos);
+    return end();
+  }
+
+  const_iterator find(const K& key) const {
+    return const_cast<BPTreeMap*>(this)->find(key);
+  }
+
+  bool contains(const K& key) const {
+    return find(key) != end();
+  }
+
+  // Returns the first entry whose key is not less than key.
+  iterator lower_bound(const K& key) {
+    if (!root_)
+      return end();
+    Leaf* leaf = FindLeaf(key);
+    return Normalize(leaf, LowerBound(leaf->keys.data(), leaf->count, key));
+  }
+
+  const_iterator lower_bound(const K& key) const {
+    return const_cast<BPTreeMap*>(this)->lower_bound(key);
+  }
+
+  // Returns the first entry whose key is greater than key.
+  iterator upper_bound(const K& key) {
+    if (!root_)
+      return end();
+    Leaf* leaf = FindLeaf(key);
+    return Normalize(leaf, UpperBound(leaf->keys.data(), leaf->count, key));
+  }
+
+  const_iterator upper_bound(const K& key) const {
+    return const_cast<BPTreeMap*>(this)->upper_bound(key);
+  }
+
+  // Calls f(key, value) for the entries with keys in [lo, hi) in the ascending order.
+  // f must not modify the map.
+  template <typename F> void ForRange(const K& lo, const K& hi, F&& f) const {
+    if (!root_)
+      return;
+    const Leaf* leaf = FindLeaf(lo);
+    unsigned pos = LowerBound(leaf->keys.data(), leaf->count, lo);
+    for (; leaf; leaf = leaf->next, pos = 0) {
+      const K* keys = leaf->keys.data();
+      const V* values = leaf->values.data();
+      for (; pos < leaf->count; ++pos) {
+        if (!comp_(keys[pos], hi))
+          return;
+        f(keys[pos], values[pos]);
+      }
+    }
+  }
+
+  // Constructs the value from args if the key is not present.
+  template <typename... Args> std::pair<iterator, bool> try_emplace(const K& key, Args&&... args) {
+    return TryEmplace(key, std::forward<Args>(args)...);
+  }
+
+  template <typename... Args> std::pair<iterator, bool> try_emplace(K&& key, Args&&... args) {
+    return TryEmplace(std::move(key), std::forward<Args>(args)...);
+  }
+
+  std::pair<iterator, bool> insert(std::pair<K, V> val) {
+    return TryEmplace(std::move(val.first), std::move(val.second));
+  }
+
+  V& operator[](const K& key) {
+    return try_emplace(key).first.value();
+  }
+
+  size_t erase(const K& key) {
+    return EraseKey(key);
+  }
+
+  // Returns the iterator following it.
+  iterator erase(const_iterator it) {
+    const_iterator next = it;
+    ++next;
+    if (next == end()) {
+      EraseKey(K(it.key()));
+      return end();
+    }
+
+    K next_key = next.key();
+    EraseKey(K(it.key()));
+    return lower_bound(next_key);
+  }
+
+  void clear() {
+    if (root_)
+      FreeTree(root_);
+    root_ = nullptr;
+    first_ = last_ = nullptr;
+    height_ = 0;
+    size_ = 0;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  bool empty() const {
+    return size_ == 0;
+  }
+
+  // The number of levels, 0 for the empty map.
+  unsigned height() const {
+    return height_;
+  }
+
+  size_t bytes_allocated() const {
+    return num_leaves_ * sizeof(Leaf) + num_inner_ * sizeof(Inner);
+  }
+
+  static constexpr unsigned leaf_capacity() {
+    return kLeafCap;
+  }
+
+  static constexpr unsigned inner_capacity() {
+    return kInnerCap;
+  }
+
+ private:
+  struct PathEntry {
+    Inner* node;
+    unsigned index;  // of the child that the path follows.
+  };
+
+  // Returns the number of keys that are less than key.
+  unsigned LowerBound(const K* keys, unsigned n, const K& key) const {
+    if constexpr (kSimdKeys)
+      return bptree_internal::CountCmp<false>(keys, n, key);
+    else
+      return std::lower_bound(keys, keys + n, key, comp_) - keys;
+  }
+
+  // Returns the number of keys that are not greater than key.
+  unsigned UpperBound(const K* keys, unsigned n, const K& key) const {
+    if constexpr (kSimdKeys)
+      return n - bptree_internal::CountCmp<true>(keys, n, key);
+    else
+      return std::upper_bound(keys, keys + n, key, comp_) - keys;
+  }
+
+  Leaf* FindLeaf(const K& key) const {
+    Node* node = root_;
+    while (!node->is_leaf) {
+      Inner* inner = static_cast<Inner*>(node);
+      node = inner->children[UpperBound(inner->keys.data(), inner->count, key)];
+    }
+    return static_cast<Leaf*>(node);
+  }
+
+  // Descends to the leaf of key and records the path. Returns the path length.
+  unsigned Descend(const K& key, PathEntry* path, Leaf** leaf) const {
+    unsigned depth = 0;
+    Node* node = root_;
+    while (!node->is_leaf) {
+      Inner* inner = static_cast<Inner*>(node);
+      unsigned index = UpperBound(inner->keys.data(), inner->count, key);
+      path[depth++] = PathEntry{inner, index};
+      node = inner->children[index];
+    }
+    *leaf = static_cast<Leaf*>(node);
+    return depth;
+  }
+
+  // Moves the position past the end of a leaf to the start of the next one.
+  iterator Normalize(Leaf* leaf, unsigned pos) {
+    if (pos == leaf->count && leaf->next)
+      return iterator(leaf->next, 0);
+    return iterator(leaf, pos);
+  }
+
+  /* Element helpers: a holds n constructed elements followed by the uninitialized storage. */
+
+  template <typename T, typename... Args>
+  static void EmplaceAt(T* a, unsigned n, unsigned pos, Args&&... args) {
+    if (pos == n) {
+      new (a + n) T(std::forward<Args>(args)...);
+      return;
+    }
+    new (a + n) T(std::move(a[n - 1]));
+    std::move_backward(a + pos, a + n - 1, a + n);
+    a[pos] = T(std::forward<Args>(args)...);
+  }
+
+  template <typename T> static void EraseAt(T* a, unsigned n, unsigned pos) {
+    std::move(a + pos + 1, a + n, a + pos);
+    a[n - 1].~T();
+  }
+
+  // Moves n elements from src to the uninitialized dest and destroys them in src.
+  template <typename T> static void Relocate(T* src, unsigned n, T* dest) {
+    for (unsigned i = 0; i < n; ++i) {
+      new (dest + i) T(std::move(src[i]));
+      src[i].~T();
+    }
+  }
+
+  template <typename T> static void Destroy(T* a, unsigned n) {
+    if constexpr (!std::is_trivially_destructible_v<T>) {
+      for (unsigned i = 0; i < n; ++i)
+        a[i].~T();
+    }
+  }
+
+  /* Node allocation */
+
+  Leaf* NewLeaf() {
+    Leaf* leaf = new (mr_->allocate(sizeof(Leaf), kAlign)) Leaf;
+    leaf->count = 0;
+    leaf->is_leaf = true;
+    leaf->prev = leaf->next = nullptr;
+    ++num_leaves_;
+    return leaf;
+  }
+
+  Inner* NewInner() {
+    Inner* inner = new (mr_->allocate(sizeof(Inner), kAlign)) Inner;
+    inner->count = 0;
+    inner->is_leaf = false;
+    ++num_inner_;
+    return inner;
+  }
+
+  void FreeLeaf(Leaf* leaf) {
+    Destroy(leaf->keys.data(), leaf->count);
+    Destroy(leaf->values.data(), leaf->count);
+    leaf->~Leaf();
+    mr_->deallocate(leaf, sizeof(Leaf), kAlign);
+    --num_leaves_;
+  }
+
+  void FreeInner(Inner* inner) {
+    Destroy(inner->keys.data(), inner->count);
+    inner->~Inner();
+    mr_->deallocate(inner, sizeof(Inner), kAlign);
+    --num_inner_;
+  }
+
+  void FreeTree(Node* node) {
+    if (node->is_leaf) {
+      FreeLeaf(static_cast<Leaf*>(node));
+      return;
+    }
+    Inner* inner = static_cast<Inner*>(node);
+    for (unsigned i = 0; i <= inner->count; ++i)
+      FreeTree(inner->children[i]);
+    FreeInner(inner);
+  }
+
+  /* Insertion */
+
+  template <typename KeyArg, typename... Args>
+  std::pair<iterator, bool> TryEmplace(KeyArg&& key, Args&&... args) {
+    if (!root_) {
+      root_ = first_ = last_ = NewLeaf();
+      height_ = 1;
+    }
+
+    PathEntry path[kMaxHeight];
+    Leaf* leaf;
+    unsigned depth = Descend(key, path, &leaf);
+    unsigned pos = LowerBound(leaf->keys.data(), leaf->count, key);
+    if (pos < leaf->count && !comp_(key, leaf->keys.data()[pos]))
+      return {iterator(leaf, pos), false};
+
+    if (ABSL_PREDICT_FALSE(leaf->count == kLeafCap)) {
+      // Appending to the last leaf keeps it full, so that ordered loads fill the leaves.
+      unsigned mid = (pos == kLeafCap && !leaf->next) ? kLeafCap : kLeafCap / 2;
+      Leaf* right = SplitLeaf(leaf, mid);
+      if (pos >= mid) {
+        leaf = right;
+        pos -= mid;
+      }
+      EmplaceAt(leaf->keys.data(), leaf->count, pos, std::forward<KeyArg>(key));
+      EmplaceAt(leaf->values.data(), leaf->count, pos, std::forward<Args>(args)...);
+      ++leaf->count;
+      InsertUp(path, depth, K(right->keys.data()[0]), right);
+    } else {
+      EmplaceAt(leaf->keys.data(), leaf->count, pos, std::forward<KeyArg>(key));
+      EmplaceAt(leaf->values.data(), leaf->count, pos, std::forward<Args>(args)...);
+      ++leaf->count;
+    }
+    ++size_;
+    return {iterator(leaf, pos), true};
+  }
+
+  // Moves the entries [mid, count) of leaf into a new leaf that follows it.
+  Leaf* SplitLeaf(Leaf* leaf, unsigned mid) {
+    Leaf* right = NewLeaf();
+    unsigned moved = leaf->count - mid;
+    Relocate(leaf->keys.data() + mid, moved, right->keys.data());
+    Relocate(leaf->values.data() + mid, moved, right->values.data());
+    right->count = moved;
+    leaf->count = mid;
+
+    right->prev = leaf;
+    right->next = leaf->next;
+    if (leaf->next)
+      leaf->next->prev = right;
+    else
+      last_ = right;
+    leaf->next = right;
+    return right;
+  }
+
+  // Inserts the separator key and the node that follows it into the parents along the path,
+  // splitting the full ones.
+  void InsertUp(PathEntry* path, unsigned depth, K key, Node* right) {
+    while (depth > 0) {
+      PathEntry& pe = path[--depth];
+      Inner* inner = pe.node;
+      unsigned index = pe.index;
+
+      if (inner->count < kInnerCap) {
+        InsertInner(inner, index, std::move(key), right);
+        return;
+      }
+
+      // Splits around the middle key, which moves up.
+      constexpr unsigned kMid = kInnerCap / 2;
+      Inner* sibling = NewInner();
+      unsigned moved = kInnerCap - kMid - 1;
+      K* keys = inner->keys.data();
+      Relocate(keys + kMid + 1, moved, sibling->keys.data());
+      std::copy(inner->children + kMid + 1, inner->children + kInnerCap + 1, sibling->children);
+      sibling->count = moved;
+      K up = std::move(keys[kMid]);
+      keys[kMid].~K();
+      inner->count = kMid;
+
+      if (index <= kMid)
+        InsertInner(inner, index, std::move(key), right);
+      else
+        InsertInner(sibling, index - kMid - 1, std::move(key), right);
+
+      key = std::move(up);
+      right = sibling;
+    }
+
+    // The root has split.
+    Inner* root = NewInner();
+    new (root->keys.data()) K(std::move(key));
+    root->children[0] = root_;
+    root->children[1] = right;
+    root->count = 1;
+    root_ = root;
+    ++height_;
+  }
+
+  // Inserts key at index and child right after it.
+  static void InsertInner(Inner* inner, unsigned index, K&& key, Node* right) {
+    EmplaceAt(inner->keys.data(), inner->count, index, std::move(key));
+    std::copy_backward(inner->children + index + 1, inner->children + inner->count + 1,
+                       inner->children + inner->count + 2);
+    inner->children[index + 1] = right;
+    ++inner->count;
+  }
+
+  /* Erasure */
+
+  size_t EraseKey(const K& key) {
+    if (!root_)
+      return 0;
+
+    PathEntry path[kMaxHeight];
+    Leaf* leaf;
+    unsigned depth = Descend(key, path, &leaf);
+    unsigned pos = LowerBound(leaf->keys.data(), leaf->count, key);
+    if (pos == leaf->count || comp_(key, leaf->keys.data()[pos]))
+      return 0;
+
+    EraseAt(leaf->keys.data(), leaf->count, pos);
+    EraseAt(leaf->values.data(), leaf->count, pos);
+    --leaf->count;
+    --size_;
+
+    // The separators stay valid bounds when the first key of a leaf is erased.
+    if (depth == 0) {
+      if (leaf->count == 0) {
+        FreeLeaf(leaf);
+        root_ = first_ = last_ = nullptr;
+        height_ = 0;
+      }
+    } else if (leaf->count < kLeafMin) {
+      RebalanceLeaf(path, depth, leaf);
+    }
+    return 1;
+  }
+
+  void RebalanceLeaf(PathEntry* path, unsigned depth, Leaf* leaf) {
+    Inner* parent = path[depth - 1].node;
+    unsigned index = path[depth - 1].index;
+    Node** children = parent->children;
+    Leaf* left = index > 0 ? static_cast<Leaf*>(children[index - 1]) : nullptr;
+    Leaf* right = index < parent->count ? static_cast<Leaf*>(children[index + 1]) : nullptr;
+    K* pkeys = parent->keys.data();
+
+    if (left && left->count > kLeafMin) {
+      unsigned last = left->count - 1;
+      EmplaceAt(leaf->keys.data(), leaf->count, 0, std::move(left->keys.data()[last]));
+      EmplaceAt(leaf->values.data(), leaf->count, 0, std::move(left->values.data()[last]));
+      ++leaf->count;
+      EraseAt(left->keys.data(), left->count, last);
+      EraseAt(left->values.data(), left->count, last);
+      --left->count;
+      pkeys[index - 1] = leaf->keys.data()[0];
+      return;
+    }
+
+    if (right && right->count > kLeafMin) {
+      EmplaceAt(leaf->keys.data(), leaf->count, leaf->count, std::move(right->keys.data()[0]));
+      EmplaceAt(leaf->values.data(), leaf->count, leaf->count, std::move(right->values.data()[0]));
+      ++leaf->count;
+      EraseAt(right->keys.data(), right->count, 0);
+      EraseAt(right->values.data(), right->count, 0);
+      --right->count;
+      pkeys[index] = right->keys.data()[0];
+      return;
+    }
+
+    // Merges the right node of the pair into the left one.
+    if (left) {
+      right = leaf;
+      --index;
+    } else {
+      left = leaf;
+    }
+    Relocate(right->keys.data(), right->count, left->keys.data() + left->count);
+    Relocate(right->values.data(), right->count, left->values.data() + left->count);
+    left->count += right->count;
+    right->count = 0;
+
+    left->next = right->next;
+    if (right->next)
+      right->next->prev = left;
+    else
+      last_ = left;
+    FreeLeaf(right);
+
+    RemoveFromInner(parent, index);
+    RebalanceInner(path, depth - 1);
+  }
+
+  // Removes the key at index and the child that follows it.
+  static void RemoveFromInner(Inner* inner, unsigned index) {
+    EraseAt(inner->keys.data(), inner->count, index);
+    std::copy(inner->children + index + 2, inner->children + inner->count + 1,
+              inner->children + index + 1);
+    --inner->count;
+  }
+
+  // Rebalances the inner node at path[level].
+  void RebalanceInner(PathEntry* path, unsigned level) {
+    Inner* node = path[level].node;
+    if (level == 0) {
+      if (node->count == 0) {
+        root_ = node->children[0];
+        FreeInner(node);
+        --height_;
+      }
+      return;
+    }
+    if (node->count >= kInnerMin)
+      return;
+
+    Inner* parent = path[level - 1].node;
+    unsigned index = path[level - 1].index;
+    Node** children = parent->children;
+    Inner* left = index > 0 ? static_cast<Inner*>(children[index - 1]) : nullptr;
+    Inner* right = index < parent->count ? static_cast<Inner*>(children[index + 1]) : nullptr;
+    K* pkeys = parent->keys.data();
+
+    if (left && left->count > kInnerMin) {
+      // Rotates the last child of left through the parent.
+      unsigned last = left->count - 1;
+      EmplaceAt(node->keys.data(), node->count, 0, std::move(pkeys[index - 1]));
+      std::copy_backward(node->children, node->children + node->count + 1,
+                         node->children + node->count + 2);
+      node->children[0] = left->children[left->count];
+      ++node->count;
+      pkeys[index - 1] = std::move(left->keys.data()[last]);
+      left->keys.data()[last].~K();
+      --left->count;
+      return;
+    }
+
+    if (right && right->count > kInnerMin) {
+      // Rotates the first child of right through the parent.
+      EmplaceAt(node->keys.data(), node->count, node->count, std::move(pkeys[index]));
+      node->children[node->count + 1] = right->children[0];
+      ++node->count;
+      pkeys[index] = std::move(right->keys.data()[0]);
+      EraseAt(right->keys.data(), right->count, 0);
+      std::copy(right->children + 1, right->children + right->count + 1, right->children);
+      --right->count;
+      return;
+    }
+
+    // Merges the right node of the pair and the separator into the left one.
+    if (left) {
+      right = node;
+      --index;
+    } else {
+      left = node;
+    }
+    new (left->keys.data() + left->count) K(std::move(pkeys[index]));
+    Relocate(right->keys.data(), right->count, left->keys.data() + left->count + 1);
+    std::copy(right->children, right->children + right->count + 1,
+              left->children + left->count + 1);
+    left->count += right->count + 1;
+    right->count = 0;
+    FreeInner(right);
+
+    RemoveFromInner(parent, index);
+    RebalanceInner(path, level - 1);
+  }
+
+  PMR_NS::memory_resource* mr_;
+  Compare comp_;
+  Node* root_ = nullptr;
+  Leaf* first_ = nullptr;
+  Leaf* last_ = nullptr;
+  unsigned height_ = 0;
+  size_t size_ = 0;
+  size_t num_leaves_ = 0, num_inner_ = 0;
+};
+
+}  // namespace base
@@ -0,0 +1,262 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "base/bptree_map.h"
+
+#include <absl/container/btree_map.h>
+#include <absl/strings/str_cat.h>
+
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace base {
+
+using namespace std;
+
+class BPTreeMapTest : public testing::Test {};
+
+// Checks that the map and the reference hold the same entries in the same order.
+template <typename Map, typename Ref> void ExpectSame(const Map& map, const Ref& ref) {
+  ASSERT_EQ(ref.size(), map.size());
+  auto it = map.begin();
+  for (const auto& [k, v] : ref) {
+    ASSERT_TRUE(it != map.end());
+    ASSERT_EQ(k, it.key());
+    ASSERT_EQ(v, it.value());
+    ++it;
+  }
+  EXPECT_TRUE(it == map.end());
+}
+
+TEST_F(BPTreeMapTest, Basic) {
+  BPTreeMap<uint64_t, uint64_t> map;
+  EXPECT_TRUE(map.empty());
+  EXPECT_TRUE(map.begin() == map.end());
+  EXPECT_TRUE(map.find(1) == map.end());
+  EXPECT_EQ(0u, map.erase(1));
+
+  EXPECT_TRUE(map.try_emplace(5, 50).second);
+  EXPECT_FALSE(map.try_emplace(5, 51).second);
+  EXPECT_TRUE(map.insert({3, 30}).second);
+  map[7] = 70;
+  EXPECT_EQ(3u, map.size());
+  EXPECT_EQ(50u, map.find(5).value());
+  EXPECT_TRUE(map.contains(7));
+  EXPECT_FALSE(map.contains(4));
+
+  EXPECT_EQ(5u, map.lower_bound(4).key());
+  EXPECT_EQ(5u, map.lower_bound(5).key());
+  EXPECT_EQ(7u, map.upper_bound(5).key());
+  EXPECT_TRUE(map.upper_bound(7) == map.end());
+
+  EXPECT_EQ(1u, map.erase(5));
+  EXPECT_EQ(2u, map.size());
+  EXPECT_EQ(1u, map.erase(3));
+  EXPECT_EQ(1u, map.erase(7));
+  EXPECT_TRUE(map.empty());
+  EXPECT_EQ(0u, map.height());
+  EXPECT_EQ(0u, map.bytes_allocated());
+}
+
+TEST_F(BPTreeMapTest, Sequential) {
+  BPTreeMap<int32_t, int32_t> map;
+  constexpr int kNum = 100000;
+  for (int i = 0; i < kNum; ++i)
+    ASSERT_TRUE(map.try_emplace(i - kNum / 2, i).second);
+  EXPECT_EQ(size_t(kNum), map.size());
+
+  // Ordered loads fill the leaves.
+  size_t leaves = kNum / map.leaf_capacity();
+  EXPECT_LT(map.bytes_allocated(), leaves * 2 * 256);
+
+  int expected = -kNum / 2;
+  for (auto it = map.begin(); it != map.end(); ++it)
+    ASSERT_EQ(expected++, it.key());
+
+  auto it = map.end();
+  for (int i = kNum / 2 - 1; i >= -kNum / 2; --i) {
+    --it;
+    ASSERT_EQ(i, it.key());
+  }
+  EXPECT_TRUE(it == map.begin());
+
+  for (int i = 0; i < kNum; i += 2)
+    ASSERT_EQ(1u, map.erase(i - kNum / 2));
+  EXPECT_EQ(size_t(kNum / 2), map.size());
+  for (int i = 0; i < kNum; ++i)
+    ASSERT_EQ(i % 2 == 1, map.contains(i - kNum / 2)) << i;
+}
+
+TEST_F(BPTreeMapTest, Random) {
+  BPTreeMap<uint64_t, uint64_t> map;
+  std::map<uint64_t, uint64_t> ref;
+  mt19937_64 rng(42);
+
+  for (unsigned round = 0; round < 4; ++round) {
+    for (unsigned i = 0; i < 20000; ++i) {
+      uint64_t key = rng() % 30000;
+      if (rng() % 3) {
+        ASSERT_EQ(ref.try_emplace(key, i).second, map.try_emplace(key, i).second);
+      } else {
+        ASSERT_EQ(ref.erase(key), map.erase(key));
+      }
+    }
+    ExpectSame(map, ref);
+
+    for (unsigned i = 0; i < 1000; ++i) {
+      uint64_t key = rng() % 31000;
+      auto lb = map.lower_bound(key);
+      auto rlb = ref.lower_bound(key);
+      ASSERT_EQ(rlb == ref.end(), lb == map.end());
+      if (rlb != ref.end())
+        ASSERT_EQ(rlb->first, lb.key());
+
+      auto ub = map.upper_bound(key);
+      auto rub = ref.upper_bound(key);
+      ASSERT_EQ(rub == ref.end(), ub == map.end());
+      if (rub != ref.end())
+        ASSERT_EQ(rub->first, ub.key());
+    }
+  }
+
+  // Erases through the iterators.
+  auto it = map.begin();
+  while (it != map.end()) {
+    if (it.key() % 2) {
+      ref.erase(it.key());
+      it = map.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  ExpectSame(map, ref);
+
+  while (!ref.empty()) {
+    ASSERT_EQ(1u, map.erase(ref.begin()->first));
+    ref.erase(ref.begin());
+  }
+  EXPECT_TRUE(map.empty());
+  EXPECT_EQ(0u, map.bytes_allocated());
+}
+
+TEST_F(BPTreeMapTest, Range) {
+  BPTreeMap<int64_t, int64_t> map;
+  for (int64_t i = -1000; i < 1000; i += 3)
+    map[i] = i * 2;
+
+  vector<int64_t> keys;
+  map.ForRange(-10, 20, [&](int64_t k, int64_t v) {
+    EXPECT_EQ(k * 2, v);
+    keys.push_back(k);
+  });
+  EXPECT_EQ(vector<int64_t>({-7, -4, -1, 2, 5, 8, 11, 14, 17}), keys);
+
+  keys.clear();
+  map.ForRange(2000, 3000, [&](int64_t k, int64_t) { keys.push_back(k); });
+  EXPECT_TRUE(keys.empty());
+}
+
+TEST_F(BPTreeMapTest, StringKeys) {
+  BPTreeMap<string, string, std::less<string>, 512> map;
+  std::map<string, string> ref;
+  mt19937_64 rng(7);
+
+  for (unsigned i = 0; i < 20000; ++i) {
+    string key = absl::StrCat("key:", rng() % 5000, string(i % 3 ? 0 : 40, 'x'));
+    if (rng() % 4) {
+      ASSERT_EQ(ref.try_emplace(key, key + "_val").second,
+                map.try_emplace(key, key + "_val").second);
+    } else {
+      ASSERT_EQ(ref.erase(key), map.erase(key));
+    }
+  }
+  ExpectSame(map, ref);
+  map.clear();
+  EXPECT_TRUE(map.empty());
+}
+
+TEST_F(BPTreeMapTest, CountCmp) {
+  uint64_t keys[] = {1, 3, 5, 7, 9, 1ULL << 63, ~0ULL};
+  EXPECT_EQ(0u, bptree_internal::CountCmp<false>(keys, 7, uint64_t(0)));
+  EXPECT_EQ(2u, bptree_internal::CountCmp<false>(keys, 7, uint64_t(5)));
+  EXPECT_EQ(5u, bptree_internal::CountCmp<false>(keys, 7, uint64_t(1) << 63));
+  EXPECT_EQ(1u, bptree_internal::CountCmp<true>(keys, 7, uint64_t(1) << 63));
+
+  int32_t ikeys[] = {-5, -3, 0, 2, 4, 6, 8, 10, 12};
+  EXPECT_EQ(2u, bptree_internal::CountCmp<false>(ikeys, 9, 0));
+  EXPECT_EQ(6u, bptree_internal::CountCmp<true>(ikeys, 9, 0));
+  EXPECT_EQ(9u, bptree_internal::CountCmp<false>(ikeys, 9, 100));
+}
+
+template <typename Map> static void BM_Lookup(benchmark::State& state) {
+  size_t num = state.range(0);
+  Map map;
+  mt19937_64 rng(42);
+  vector<uint64_t> keys(num);
+  for (auto& k : keys) {
+    k = rng();
+    map.try_emplace(k, k);
+  }
+
+  size_t i = 0;
+  while (state.KeepRunning()) {
+    benchmark::DoNotOptimize(map.find(keys[i++ % num]));
+  }
+}
+BENCHMARK_TEMPLATE(BM_Lookup, BPTreeMap<uint64_t, uint64_t>)->Arg(1 << 10)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(BM_Lookup, absl::btree_map<uint64_t, uint64_t>)->Arg(1 << 10)->Arg(1 << 20);
+
+template <typename Map> static void BM_Insert(benchmark::State& state) {
+  size_t num = state.range(0);
+  mt19937_64 rng(42);
+  vector<uint64_t> keys(num);
+  for (auto& k : keys)
+    k = rng();
+
+  while (state.KeepRunning()) {
+    Map map;
+    for (uint64_t k : keys)
+      map.try_emplace(k, k);
+  }
+  state.SetItemsProcessed(state.iterations() * num);
+}
+BENCHMARK_TEMPLATE(BM_Insert, BPTreeMap<uint64_t, uint64_t>)->Arg(1 << 16);
+BENCHMARK_TEMPLATE(BM_Insert, absl::btree_map<uint64_t, uint64_t>)->Arg(1 << 16);
+
+// Sums the values of 100 consecutive keys.
+static void BM_RangeBPTree(benchmark::State& state) {
+  BPTreeMap<uint64_t, uint64_t> map;
+  for (uint64_t i = 0; i < (1 << 20); ++i)
+    map.try_emplace(i * 4, i);
+
+  mt19937_64 rng(42);
+  while (state.KeepRunning()) {
+    uint64_t lo = rng() % (4 << 20), sum = 0;
+    map.ForRange(lo, lo + 400, [&](uint64_t, uint64_t v) { sum += v; });
+    benchmark::DoNotOptimize(sum);
+  }
+}
+BENCHMARK(BM_RangeBPTree);
+
+static void BM_RangeAbsl(benchmark::State& state) {
+  absl::btree_map<uint64_t, uint64_t> map;
+  for (uint64_t i = 0; i < (1 << 20); ++i)
+    map.try_emplace(i * 4, i);
+
+  mt19937_64 rng(42);
+  while (state.KeepRunning()) {
+    uint64_t lo = rng() % (4 << 20), sum = 0;
+    for (auto it = map.lower_bound(lo); it != map.end() && it->first < lo + 400; ++it)
+      sum += it->second;
+    benchmark::DoNotOptimize(sum);
+  }
+}
+BENCHMARK(BM_RangeAbsl);
+
+}  // namespace base
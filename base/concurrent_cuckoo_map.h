@@ -0,0 +1,614 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+#include "base/hash.h"
+#include "base/logging.h"
+#include "base/spinlock.h"
+
+namespace base {
+
+/* Cuckoo hash map from uint64 keys to trivially copyable values that can be read from any
+   number of threads concurrently with writes. Meant for read-mostly data that is shared by
+   all the proactor threads instead of keeping a CuckooMap copy per thread.
+
+   Readers do not take locks. Every bucket is covered by a striped version that a writer makes
+   odd while it modifies the bucket, and a reader retries if the versions of its buckets
+   changed during the read (seqlock). Writers are serialized by a spinlock.
+
+   Resizing does not stop the world: the new table is populated incrementally by the
+   following writes, a few buckets at a time, while readers probe both tables. If the new
+   table fills up before the migration completes, the writer copies both tables into a larger
+   one at once.
+   Tables retired by resizes are kept until ReleaseRetired() or the destruction of the map,
+   because concurrent readers may still access them.
+*/
+template <typename T> class ConcurrentCuckooMap {
+  static_assert(std::is_trivially_copyable<T>::value, "T must be trivially copyable");
+
+ public:
+  using KeyType = uint64_t;
+
+  // empty_key can not be inserted into the map.
+  explicit ConcurrentCuckooMap(KeyType empty_key = 0, size_t capacity = 0);
+
+  ConcurrentCuckooMap(const ConcurrentCuckooMap&) = delete;
+  ConcurrentCuckooMap& operator=(const ConcurrentCuckooMap&) = delete;
+
+  // Returns true if key exists and copies its value into dest unless it is null.
+  // Thread-safe and lock-free with respect to other readers.
+  bool Find(KeyType key, T* dest) const;
+
+  bool Contains(KeyType key) const {
+    return Find(key, nullptr);
+  }
+
+  // Inserts key if it does not exist. Returns true if the key was inserted.
+  bool Insert(KeyType key, const T& val) {
+    return Upsert(key, val, false);
+  }
+
+  // Inserts key or overwrites its value. Returns true if the key was inserted.
+  bool InsertOrAssign(KeyType key, const T& val) {
+    return Upsert(key, val, true);
+  }
+
+  // Returns true if key was erased.
+  bool Erase(KeyType key);
+
+  // Completes the ongoing resize if there is one. Writes advance resizes gradually, and
+  // until a resize completes readers probe two tables.
+  void FinishResize();
+
+  // Frees the tables retired by the previous resizes. The caller must guarantee that
+  // no reader that started before the last resize has completed is still running.
+  void ReleaseRetired();
+
+  size_t size() const {
+    return size_.load(std::memory_order_relaxed);
+  }
+
+  bool empty() const {
+    return size() == 0;
+  }
+
+  // The number of slots in the current table.
+  size_t Capacity() const {
+    return (cur_.load(std::memory_order_acquire)->mask + 1) * kBucketLength;
+  }
+
+  bool resizing() const {
+    return old_.load(std::memory_order_acquire) != nullptr;
+  }
+
+ private:
+  static constexpr unsigned kBucketLength = 4;
+  static constexpr unsigned kValueWords = (sizeof(T) + 7) / 8;
+  static constexpr size_t kMaxStripes = 1024;
+
+  // The number of old buckets that each write migrates during a resize.
+  static constexpr unsigned kMigrateBuckets = 8;
+
+  // Limits of the breadth-first search for a cuckoo path.
+  static constexpr unsigned kMaxPathLen = 5;
+  static constexpr unsigned kMaxSearchNodes = 256;
+
+  // Values are stored as atomic words so that optimistic reads are not data races.
+  struct Bucket {
+    std::atomic<KeyType> key[kBucketLength];
+    std::atomic<uint64_t> val[kBucketLength][kValueWords];
+  };
+
+  struct Table {
+    Table(size_t bucket_cnt, KeyType empty_key);
+
+    std::atomic<uint64_t>& version(size_t bid) const {
+      return versions[bid & stripe_mask];
+    }
+
+    size_t mask;  // bucket count - 1, the bucket count is a power of 2.
+    size_t stripe_mask;
+    std::unique_ptr<Bucket[]> buckets;
+    std::unique_ptr<std::atomic<uint64_t>[]> versions;
+  };
+
+  // A node of the cuckoo path search.
+  struct PathNode {
+    size_t bid;
+    int parent;     // index of the parent node or -1 for the home buckets of the key.
+    unsigned slot;  // the slot in the parent bucket, whose key moves to this bucket.
+    unsigned depth;
+  };
+
+  static void BucketPair(const Table& t, KeyType key, size_t dest[2]);
+
+  // Returns the other home bucket of the key that resides in bid.
+  static size_t AltBucket(const Table& t, KeyType key, size_t bid);
+
+  // Writer side of the seqlock. There is a single writer at a time hence no atomic RMW.
+  static void LockStripe(std::atomic<uint64_t>& v) {
+    v.store(v.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  static void UnlockStripe(std::atomic<uint64_t>& v) {
+    v.store(v.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  static void CpuPause() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+  }
+
+  bool FindIn(const Table& t, KeyType key, T* dest) const;
+
+  // Writer only. Finds the slot of key in t.
+  bool FindSlot(const Table& t, KeyType key, size_t* bid, unsigned* slot) const;
+  int FreeSlot(const Bucket& bucket) const;
+
+  bool Upsert(KeyType key, const T& val, bool assign);
+
+  // Inserts key that does not exist in t. Returns false if t has no room for it.
+  bool InsertNew(Table* t, KeyType key, const uint64_t* words);
+
+  void WriteSlot(Table* t, size_t bid, unsigned slot, KeyType key, const uint64_t* words);
+  void MoveSlot(Table* t, size_t src_bid, unsigned src_slot, size_t dest_bid, unsigned dest_slot);
+
+  void Grow();
+  void Migrate(size_t bucket_cnt);
+
+  // Returns false if cur_ has no room for the keys of the bucket.
+  bool MigrateBucket(Table* old, size_t bid);
+
+  // Replaces old_ and cur_ with a larger table that holds the keys of both. Used when cur_
+  // has no room for the keys of old_ that are not migrated yet.
+  void Rebuild();
+
+  // Copies the keys of src that dest does not have yet. Returns false if dest has no room.
+  bool CopyKeys(const Table& src, Table* dest);
+
+  const KeyType empty_key_;
+
+  std::atomic<Table*> cur_;
+  std::atomic<Table*> old_{nullptr};  // the table being migrated into cur_.
+
+  // Incremented whenever cur_ or old_ change, lets readers detect resizes.
+  std::atomic<uint64_t> resize_seq_{0};
+  std::atomic<size_t> size_{0};
+
+  // Guarded by write_mu_.
+  SpinLock write_mu_;
+  size_t migrate_pos_ = 0;  // the next bucket of old_ to migrate.
+  std::vector<std::unique_ptr<Table>> tables_;
+  std::vector<PathNode> path_nodes_;
+};
+
+// Implementation
+/******************************************************************/
+template <typename T>
+ConcurrentCuckooMap<T>::Table::Table(size_t bucket_cnt, KeyType empty_key)
+    : mask(bucket_cnt - 1),
+      stripe_mask(std::min(bucket_cnt, kMaxStripes) - 1),
+      buckets(new Bucket[bucket_cnt]),
+      versions(new std::atomic<uint64_t>[stripe_mask + 1]) {
+  DCHECK_EQ(0u, bucket_cnt & mask);
+
+  for (size_t i = 0; i < bucket_cnt; ++i) {
+    for (unsigned j = 0; j < kBucketLength; ++j) {
+      buckets[i].key[j].store(empty_key, std::memory_order_relaxed);
+      for (unsigned w = 0; w < kValueWords; ++w)
+        buckets[i].val[j][w].store(0, std::memory_order_relaxed);
+    }
+  }
+  for (size_t i = 0; i <= stripe_mask; ++i)
+    versions[i].store(0, std::memory_order_relaxed);
+}
+
+template <typename T>
+ConcurrentCuckooMap<T>::ConcurrentCuckooMap(KeyType empty_key, size_t capacity)
+    : empty_key_(empty_key) {
+  // Leave some slack, cuckoo tables with 4-way buckets become hard to fill above ~90%.
+  size_t bucket_cnt = 2;
+  while (bucket_cnt * kBucketLength * 9 < capacity * 10)
+    bucket_cnt *= 2;
+
+  tables_.emplace_back(new Table(bucket_cnt, empty_key_));
+  cur_.store(tables_.back().get(), std::memory_order_release);
+}
+
+template <typename T>
+void ConcurrentCuckooMap<T>::BucketPair(const Table& t, KeyType key, size_t dest[2]) {
+  uint64_t h = XXH3_64bits(&key, sizeof(key));
+  dest[0] = h & t.mask;
+  dest[1] = ((h >> 32) | (h << 32)) & t.mask;
+
+  // handle the case when both hashes map to the same bucket.
+  if (dest[1] == dest[0])
+    dest[1] = (dest[0] + 1) & t.mask;
+}
+
+template <typename T>
+size_t ConcurrentCuckooMap<T>::AltBucket(const Table& t, KeyType key, size_t bid) {
+  size_t pair[2];
+  BucketPair(t, key, pair);
+  DCHECK(pair[0] == bid || pair[1] == bid);
+  return pair[0] == bid ? pair[1] : pair[0];
+}
+
+template <typename T> bool ConcurrentCuckooMap<T>::Find(KeyType key, T* dest) const {
+  while (true) {
+    uint64_t seq = resize_seq_.load(std::memory_order_acquire);
+
+    // Migration copies a key into cur_ before it removes it from old_, hence old_ is
+    // probed first. cur_ is loaded first since old_ is published before it.
+    const Table* cur = cur_.load(std::memory_order_acquire);
+    const Table* old = old_.load(std::memory_order_acquire);
+    if ((old && FindIn(*old, key, dest)) || FindIn(*cur, key, dest))
+      return true;
+
+    // A miss is reliable only if no resize has started or finished meanwhile.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (resize_seq_.load(std::memory_order_relaxed) == seq)
+      return false;
+  }
+}
+
+template <typename T>
+bool ConcurrentCuckooMap<T>::FindIn(const Table& t, KeyType key, T* dest) const {
+  size_t bids[2];
+  BucketPair(t, key, bids);
+
+  // Both buckets are validated together so that a key moving between them is not missed.
+  const std::atomic<uint64_t>& v0 = t.version(bids[0]);
+  const std::atomic<uint64_t>& v1 = t.version(bids[1]);
+  uint64_t words[kValueWords];
+
+  while (true) {
+    uint64_t s0 = v0.load(std::memory_order_acquire);
+    uint64_t s1 = v1.load(std::memory_order_acquire);
+    if ((s0 | s1) & 1) {
+      CpuPause();
+      continue;
+    }
+
+    bool found = false;
+    for (unsigned j = 0; j < 2 && !found; ++j) {
+      const Bucket& bucket = t.buckets[bids[j]];
+      for (unsigned i = 0; i < kBucketLength; ++i) {
+        if (bucket.key[i].load(std::memory_order_relaxed) == key) {
+          for (unsigned w = 0; dest && w < kValueWords; ++w)
+            words[w] = bucket.val[i][w].load(std::memory_order_relaxed);
+          found = true;
+          break;
+        }
+      }
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (v0.load(std::memory_order_relaxed) == s0 && v1.load(std::memory_order_relaxed) == s1) {
+      if (found && dest)
+        memcpy(dest, words, sizeof(T));
+      return found;
+    }
+  }
+}
+
+template <typename T>
+bool ConcurrentCuckooMap<T>::FindSlot(const Table& t, KeyType key, size_t* bid,
+                                      unsigned* slot) const {
+  size_t bids[2];
+  BucketPair(t, key, bids);
+  for (size_t b : bids) {
+    for (unsigned i = 0; i < kBucketLength; ++i) {
+      if (t.buckets[b].key[i].load(std::memory_order_relaxed) == key) {
+        *bid = b;
+        *slot = i;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+template <typename T> int ConcurrentCuckooMap<T>::FreeSlot(const Bucket& bucket) const {
+  for (unsigned i = 0; i < kBucketLength; ++i) {
+    if (bucket.key[i].load(std::memory_order_relaxed) == empty_key_)
+      return i;
+  }
+  return -1;
+}
+
+template <typename T>
+bool ConcurrentCuckooMap<T>::Upsert(KeyType key, const T& val, bool assign) {
+  DCHECK_NE(key, empty_key_);
+
+  uint64_t words[kValueWords] = {0};
+  memcpy(words, &val, sizeof(T));
+
+  std::lock_guard lk(write_mu_);
+  Migrate(kMigrateBuckets);
+
+  Table* cur = cur_.load(std::memory_order_relaxed);
+  Table* old = old_.load(std::memory_order_relaxed);
+  size_t bid;
+  unsigned slot;
+  for (Table* t : {cur, old}) {
+    if (t && FindSlot(*t, key, &bid, &slot)) {
+      if (assign)
+        WriteSlot(t, bid, slot, key, words);
+      return false;
+    }
+  }
+
+  while (!InsertNew(cur, key, words)) {
+    Grow();
+    cur = cur_.load(std::memory_order_relaxed);
+  }
+  size_.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+template <typename T> bool ConcurrentCuckooMap<T>::Erase(KeyType key) {
+  std::lock_guard lk(write_mu_);
+  Migrate(kMigrateBuckets);
+
+  size_t bid;
+  unsigned slot;
+  for (Table* t : {cur_.load(std::memory_order_relaxed), old_.load(std::memory_order_relaxed)}) {
+    if (t && FindSlot(*t, key, &bid, &slot)) {
+      std::atomic<uint64_t>& v = t->version(bid);
+      LockStripe(v);
+      t->buckets[bid].key[slot].store(empty_key_, std::memory_order_relaxed);
+      UnlockStripe(v);
+      size_.fetch_sub(1, std::memory_order_relaxed);
+      return true;
+    }
+  }
+  return false;
+}
+
+template <typename T>
+bool ConcurrentCuckooMap<T>::InsertNew(Table* t, KeyType key, const uint64_t* words) {
+  size_t bids[2];
+  BucketPair(*t, key, bids);
+  for (size_t b : bids) {
+    int slot = FreeSlot(t->buckets[b]);
+    if (slot >= 0) {
+      WriteSlot(t, b, slot, key, words);
+      return true;
+    }
+  }
+
+  // Breadth-first search for the shortest chain of displacements that ends in a free slot.
+  // Nothing is changed until the chain is found, so a failed search leaves t intact.
+  path_nodes_.clear();
+  path_nodes_.push_back(PathNode{bids[0], -1, 0, 0});
+  path_nodes_.push_back(PathNode{bids[1], -1, 0, 0});
+
+  auto visited = [this](size_t bid) {
+    for (const PathNode& n : path_nodes_) {
+      if (n.bid == bid)
+        return true;
+    }
+    return false;
+  };
+
+  for (size_t pos = 0; pos < path_nodes_.size(); ++pos) {
+    const PathNode node = path_nodes_[pos];
+    const Bucket& bucket = t->buckets[node.bid];
+
+    for (unsigned i = 0; i < kBucketLength; ++i) {
+      size_t alt = AltBucket(*t, bucket.key[i].load(std::memory_order_relaxed), node.bid);
+      int free_slot = FreeSlot(t->buckets[alt]);
+      if (free_slot >= 0) {
+        // Shift the keys along the chain starting from its end, so that every move
+        // lands in the slot freed by the previous one.
+        MoveSlot(t, node.bid, i, alt, free_slot);
+        const PathNode* n = &node;
+        unsigned freed = i;
+        for (; n->parent >= 0; n = &path_nodes_[n->parent]) {
+          MoveSlot(t, path_nodes_[n->parent].bid, n->slot, n->bid, freed);
+          freed = n->slot;
+        }
+        WriteSlot(t, n->bid, freed, key, words);
+        return true;
+      }
+
+      if (node.depth + 1 < kMaxPathLen && path_nodes_.size() < kMaxSearchNodes &&
+          !visited(alt)) {
+        path_nodes_.push_back(PathNode{alt, int(pos), i, node.depth + 1});
+      }
+    }
+  }
+
+  return false;
+}
+
+template <typename T>
+void ConcurrentCuckooMap<T>::WriteSlot(Table* t, size_t bid, unsigned slot, KeyType key,
+                                       const uint64_t* words) {
+  Bucket& bucket = t->buckets[bid];
+  std::atomic<uint64_t>& v = t->version(bid);
+
+  LockStripe(v);
+  for (unsigned w = 0; w < kValueWords; ++w)
+    bucket.val[slot][w].store(words[w], std::memory_order_relaxed);
+  bucket.key[slot].store(key, std::memory_order_relaxed);
+  UnlockStripe(v);
+}
+
+template <typename T>
+void ConcurrentCuckooMap<T>::MoveSlot(Table* t, size_t src_bid, unsigned src_slot,
+                                      size_t dest_bid, unsigned dest_slot) {
+  Bucket& src = t->buckets[src_bid];
+  Bucket& dest = t->buckets[dest_bid];
+  std::atomic<uint64_t>& v0 = t->version(src_bid);
+  std::atomic<uint64_t>& v1 = t->version(dest_bid);
+  DCHECK_EQ(empty_key_, dest.key[dest_slot].load(std::memory_order_relaxed));
+
+  // Readers validate both home buckets of a key, so it is never observed missing.
+  LockStripe(v0);
+  if (&v1 != &v0)
+    LockStripe(v1);
+  for (unsigned w = 0; w < kValueWords; ++w) {
+    dest.val[dest_slot][w].store(src.val[src_slot][w].load(std::memory_order_relaxed),
+                                 std::memory_order_relaxed);
+  }
+  dest.key[dest_slot].store(src.key[src_slot].load(std::memory_order_relaxed),
+                            std::memory_order_relaxed);
+  src.key[src_slot].store(empty_key_, std::memory_order_relaxed);
+  if (&v1 != &v0)
+    UnlockStripe(v1);
+  UnlockStripe(v0);
+}
+
+template <typename T> void ConcurrentCuckooMap<T>::Grow() {
+  if (old_.load(std::memory_order_relaxed)) {
+    // The current table got full during the migration, which is rare.
+    Rebuild();
+    return;
+  }
+
+  Table* cur = cur_.load(std::memory_order_relaxed);
+  tables_.emplace_back(new Table((cur->mask + 1) * 2, empty_key_));
+  VLOG(1) << "Growing ConcurrentCuckooMap to " << tables_.back()->mask + 1 << " buckets";
+
+  // old_ is published first, see Find().
+  old_.store(cur, std::memory_order_release);
+  cur_.store(tables_.back().get(), std::memory_order_release);
+  resize_seq_.fetch_add(1, std::memory_order_release);
+  migrate_pos_ = 0;
+}
+
+template <typename T> void ConcurrentCuckooMap<T>::Migrate(size_t bucket_cnt) {
+  Table* old = old_.load(std::memory_order_relaxed);
+  if (!old)
+    return;
+
+  size_t end = migrate_pos_ + std::min(bucket_cnt, old->mask + 1 - migrate_pos_);
+  for (; migrate_pos_ < end; ++migrate_pos_) {
+    if (!MigrateBucket(old, migrate_pos_)) {
+      Rebuild();
+      return;
+    }
+  }
+
+  if (migrate_pos_ > old->mask) {
+    old_.store(nullptr, std::memory_order_release);
+    resize_seq_.fetch_add(1, std::memory_order_release);
+  }
+}
+
+template <typename T> bool ConcurrentCuckooMap<T>::MigrateBucket(Table* old, size_t bid) {
+  Bucket& bucket = old->buckets[bid];
+  Table* cur = cur_.load(std::memory_order_relaxed);
+  bool has_keys = false;
+
+  // Copy the keys first and only then remove them from old, see Find().
+  for (unsigned i = 0; i < kBucketLength; ++i) {
+    KeyType key = bucket.key[i].load(std::memory_order_relaxed);
+    if (key == empty_key_)
+      continue;
+
+    uint64_t words[kValueWords];
+    for (unsigned w = 0; w < kValueWords; ++w)
+      words[w] = bucket.val[i][w].load(std::memory_order_relaxed);
+
+    // The keys copied so far stay in both tables, Rebuild skips the duplicates.
+    if (!InsertNew(cur, key, words))
+      return false;
+    has_keys = true;
+  }
+
+  if (!has_keys)
+    return true;
+
+  std::atomic<uint64_t>& v = old->version(bid);
+  LockStripe(v);
+  for (unsigned i = 0; i < kBucketLength; ++i)
+    bucket.key[i].store(empty_key_, std::memory_order_relaxed);
+  UnlockStripe(v);
+  return true;
+}
+
+template <typename T> void ConcurrentCuckooMap<T>::Rebuild() {
+  Table* cur = cur_.load(std::memory_order_relaxed);
+  Table* old = old_.load(std::memory_order_relaxed);
+  DCHECK(old);
+
+  // The new table is private until it is published, hence it is filled without migration.
+  // cur is copied first since its values are the latest ones.
+  size_t bucket_cnt = (cur->mask + 1) * 2;
+  std::unique_ptr<Table> next;
+  while (true) {
+    next.reset(new Table(bucket_cnt, empty_key_));
+    if (CopyKeys(*cur, next.get()) && CopyKeys(*old, next.get()))
+      break;
+    bucket_cnt *= 2;
+  }
+  VLOG(1) << "Rebuilding ConcurrentCuckooMap into " << bucket_cnt << " buckets";
+
+  // A reader that loaded cur_ before it changed may load old_ after it is reset and miss
+  // the keys of old that cur lacks. It observes the first increment then and retries.
+  tables_.push_back(std::move(next));
+  cur_.store(tables_.back().get(), std::memory_order_release);
+  resize_seq_.fetch_add(1, std::memory_order_release);
+  old_.store(nullptr, std::memory_order_release);
+  resize_seq_.fetch_add(1, std::memory_order_release);
+  migrate_pos_ = 0;
+}
+
+template <typename T>
+bool ConcurrentCuckooMap<T>::CopyKeys(const Table& src, Table* dest) {
+  size_t bid;
+  unsigned slot;
+  for (size_t b = 0; b <= src.mask; ++b) {
+    const Bucket& bucket = src.buckets[b];
+    for (unsigned i = 0; i < kBucketLength; ++i) {
+      KeyType key = bucket.key[i].load(std::memory_order_relaxed);
+      if (key == empty_key_ || FindSlot(*dest, key, &bid, &slot))
+        continue;
+
+      uint64_t words[kValueWords];
+      for (unsigned w = 0; w < kValueWords; ++w)
+        words[w] = bucket.val[i][w].load(std::memory_order_relaxed);
+      if (!InsertNew(dest, key, words))
+        return false;
+    }
+  }
+  return true;
+}
+
+template <typename T> void ConcurrentCuckooMap<T>::FinishResize() {
+  std::lock_guard lk(write_mu_);
+  Migrate(SIZE_MAX);
+}
+
+template <typename T> void ConcurrentCuckooMap<T>::ReleaseRetired() {
+  std::lock_guard lk(write_mu_);
+  const Table* cur = cur_.load(std::memory_order_relaxed);
+  const Table* old = old_.load(std::memory_order_relaxed);
+
+  std::vector<std::unique_ptr<Table>> keep;
+  for (auto& t : tables_) {
+    if (t.get() == cur || t.get() == old)
+      keep.push_back(std::move(t));
+  }
+  tables_.swap(keep);
+}
+
+}  // namespace base
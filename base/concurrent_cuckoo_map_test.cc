@@ -0,0 +1,193 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "base/concurrent_cuckoo_map.h"
+
+#include <random>
+#include <thread>
+
+#include "base/gtest.h"
+
+namespace base {
+
+using namespace std;
+
+// Both fields must match, otherwise the reader observed a torn value.
+struct Pair {
+  uint64_t a, b;
+};
+
+class ConcurrentCuckooMapTest : public testing::Test {};
+
+TEST_F(ConcurrentCuckooMapTest, Basic) {
+  ConcurrentCuckooMap<Pair> m;
+  EXPECT_FALSE(m.Contains(5));
+
+  EXPECT_TRUE(m.Insert(5, Pair{1, 1}));
+  EXPECT_FALSE(m.Insert(5, Pair{2, 2}));
+
+  Pair p;
+  ASSERT_TRUE(m.Find(5, &p));
+  EXPECT_EQ(1, p.a);
+
+  EXPECT_FALSE(m.InsertOrAssign(5, Pair{3, 3}));
+  ASSERT_TRUE(m.Find(5, &p));
+  EXPECT_EQ(3, p.b);
+  EXPECT_EQ(1, m.size());
+
+  EXPECT_TRUE(m.Erase(5));
+  EXPECT_FALSE(m.Erase(5));
+  EXPECT_FALSE(m.Contains(5));
+  EXPECT_TRUE(m.empty());
+}
+
+TEST_F(ConcurrentCuckooMapTest, Grow) {
+  ConcurrentCuckooMap<uint32_t> m;
+  size_t initial_capacity = m.Capacity();
+  mt19937_64 dre(10);
+
+  vector<uint64_t> keys;
+  bool resized = false;
+  for (uint32_t i = 0; i < 50000; ++i) {
+    uint64_t k = dre() | 1;
+    ASSERT_TRUE(m.Insert(k, i));
+    keys.push_back(k);
+    resized |= m.resizing();
+
+    // Keys must be found both in the middle of the migration and after it.
+    if (i % 997 == 0) {
+      for (uint32_t j = 0; j <= i; ++j) {
+        uint32_t val = 0;
+        ASSERT_TRUE(m.Find(keys[j], &val)) << j;
+        ASSERT_EQ(j, val);
+      }
+    }
+  }
+  EXPECT_TRUE(resized);
+  EXPECT_GT(m.Capacity(), initial_capacity);
+  EXPECT_EQ(keys.size(), m.size());
+
+  m.FinishResize();
+  EXPECT_FALSE(m.resizing());
+  m.ReleaseRetired();
+  for (uint32_t j = 0; j < keys.size(); ++j) {
+    uint32_t val = 0;
+    ASSERT_TRUE(m.Find(keys[j], &val));
+    ASSERT_EQ(j, val);
+    ASSERT_FALSE(m.Contains(keys[j] + 1));
+  }
+}
+
+TEST_F(ConcurrentCuckooMapTest, ConcurrentReaders) {
+  constexpr uint64_t kStable = 10000;
+  constexpr unsigned kReaders = 4;
+
+  ConcurrentCuckooMap<Pair> m;
+  for (uint64_t k = 1; k <= kStable; ++k) {
+    m.Insert(k, Pair{k, k});
+  }
+
+  atomic_bool done{false};
+  atomic_uint64_t errors{0};
+  vector<thread> readers;
+  for (unsigned i = 0; i < kReaders; ++i) {
+    readers.emplace_back([&, i] {
+      mt19937_64 dre(i);
+      while (!done.load(memory_order_relaxed)) {
+        uint64_t k = dre() % kStable + 1;
+        Pair p;
+
+        // Stable keys are never erased but their values are reassigned.
+        if (!m.Find(k, &p) || p.a != p.b || p.a % kStable != k % kStable)
+          errors.fetch_add(1, memory_order_relaxed);
+      }
+    });
+  }
+
+  // The writer grows the map several times and keeps updating the stable keys.
+  for (uint64_t k = kStable + 1; k <= kStable * 20; ++k) {
+    m.Insert(k, Pair{k, k});
+    uint64_t stable = k % kStable + 1;
+    uint64_t v = stable + kStable * (k & 0xFF);
+    m.InsertOrAssign(stable, Pair{v, v});
+    if (k % 3 == 0)
+      m.Erase(k);
+  }
+
+  done.store(true, memory_order_relaxed);
+  for (auto& t : readers)
+    t.join();
+  EXPECT_EQ(0, errors.load());
+}
+
+// The keys that share a home bucket pair fill the new table before the migration reaches
+// the old bucket that holds more of them.
+TEST_F(ConcurrentCuckooMapTest, FullDuringMigration) {
+  ConcurrentCuckooMap<uint64_t> m(0, 900);
+  const size_t old_buckets = m.Capacity() / 4;
+  ASSERT_EQ(256u, old_buckets);
+
+  // Keys with the home buckets {456, 230} in the grown table, hence {200, 230} in the current
+  // one. The migration reaches them long after the grown table runs out of room for them.
+  const size_t mask = old_buckets * 2 - 1;
+  vector<uint64_t> hot;
+  for (uint64_t k = 1; hot.size() < 16; ++k) {
+    uint64_t h = XXH3_64bits(&k, sizeof(k));
+    size_t b0 = h & mask, b1 = ((h >> 32) | (h << 32)) & mask;
+    if ((b0 == 456 && b1 == 230) || (b0 == 230 && b1 == 456))
+      hot.push_back(k);
+  }
+
+  vector<uint64_t> keys;
+  auto insert = [&](uint64_t k) {
+    ASSERT_TRUE(m.Insert(k, k * 3));
+    keys.push_back(k);
+  };
+
+  for (unsigned i = 0; i < 8; ++i)
+    insert(hot[i]);
+
+  mt19937_64 dre(30);
+  while (!m.resizing()) {
+    uint64_t k = dre() | (1ULL << 63);  // does not collide with the hot keys.
+    insert(k);
+  }
+  ASSERT_EQ(old_buckets * 2 * 4, m.Capacity());
+
+  for (unsigned i = 8; i < hot.size(); ++i)
+    insert(hot[i]);
+  m.FinishResize();
+
+  EXPECT_FALSE(m.resizing());
+  EXPECT_GT(m.Capacity(), old_buckets * 2 * 4);
+  EXPECT_EQ(keys.size(), m.size());
+  for (uint64_t k : keys) {
+    uint64_t val = 0;
+    ASSERT_TRUE(m.Find(k, &val)) << k;
+    ASSERT_EQ(k * 3, val);
+  }
+}
+
+static void BM_FindConcurrentCuckoo(benchmark::State& state) {
+  unsigned iters = state.range(0);
+  ConcurrentCuckooMap<uint64_t> m(0, iters);
+  std::mt19937_64 dre(20);
+
+  std::vector<uint64_t> vals(iters, 0);
+  for (unsigned i = 0; i < iters; ++i) {
+    vals[i] = dre() | 1;
+    m.Insert(vals[i], i);
+  }
+  uint64_t res = 0;
+  while (state.KeepRunning()) {
+    for (unsigned i = 0; i < iters; ++i) {
+      m.Find(vals[i], &res);       // hit
+      m.Find(vals[i] + 1, &res);   // miss
+    }
+  }
+  benchmark::DoNotOptimize(res);
+}
+BENCHMARK(BM_FindConcurrentCuckoo)->Arg(1 << 10)->Arg(1 << 16)->Arg(1 << 20);
+
+}  // namespace base
@@ -4,19 +4,29 @@
 
 #include "base/cpu_features.h"
 
+#include <strings.h>
+
+#include <atomic>
 #include <cstdint>
+#include <cstdlib>
 
-namespace base {
+#if defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#endif
 
-namespace {
+namespace base {
 
-// aarch64 is currently a noop.
 #ifdef __x86_64__
 
+namespace {
+
 // See <cpuid.h> for constants reference
 constexpr unsigned BIT_AVX2	= (1 << 5);
 constexpr unsigned BIT_AVX512F	= (1 << 16);
+constexpr unsigned BIT_AVX512BW	= (1 << 30);
 
+constexpr unsigned BIT_SSE42	= (1 << 20);
+constexpr unsigned BIT_AES	= (1 << 25);
 constexpr unsigned BIT_XSAVE	= (1 << 26);
 constexpr unsigned BIT_OSXSAVE	= (1 << 27);
 
@@ -39,7 +49,7 @@ uint32_t GetXCR0() {
   return xcr0;
 }
 
-}
+}  // namespace
 
 CpuFeatures GetCpuFeatures() {
   CpuFeatures res;
@@ -50,6 +60,8 @@ CpuFeatures GetCpuFeatures() {
     return res;
 
   leaf = GetCpuidLeaf(1);
+  res.has_sse42 = leaf.ecx & BIT_SSE42;
+  res.has_aes = leaf.ecx & BIT_AES;
 
   bool has_xcr0 = (leaf.ecx & BIT_OSXSAVE) && (leaf.ecx & BIT_XSAVE);
   if (!has_xcr0)
@@ -63,11 +75,97 @@ CpuFeatures GetCpuFeatures() {
 
   // See https://en.wikichip.org/wiki/x86/avx-512 for explanation about the variants
   res.has_avx2 = leaf.ebx & BIT_AVX2;
-  res.has_avx512f = leaf.ebx & BIT_AVX512F;
+
+  // The OS must also preserve the opmask and the upper ZMM registers.
+  if ((xcr0 & 0xE0) == 0xE0) {
+    res.has_avx512f = leaf.ebx & BIT_AVX512F;
+    res.has_avx512bw = leaf.ebx & BIT_AVX512BW;
+  }
 
   return res;
 }
 
+#elif defined(__aarch64__)
+
+CpuFeatures GetCpuFeatures() {
+  CpuFeatures res;
+#ifdef __linux__
+  res.has_crc32 = getauxval(AT_HWCAP) & HWCAP_CRC32;
+#elif defined(__ARM_FEATURE_CRC32)
+  res.has_crc32 = true;
 #endif
+  return res;
+}
+
+#endif
+
+namespace {
+
+CpuLevel ParseLevel(const char* name) {
+  for (CpuLevel level : {CpuLevel::kGeneric, CpuLevel::kSSE42, CpuLevel::kAVX2,
+                         CpuLevel::kAVX512, CpuLevel::kNEON}) {
+    if (strcasecmp(name, CpuLevelName(level)) == 0)
+      return level;
+  }
+  return CpuLevel::kNEON;
+}
+
+std::atomic<CpuLevel>& MaxLevel() {
+  static std::atomic<CpuLevel> level{[] {
+    const char* env = getenv("HELIO_MAX_CPU_LEVEL");
+    return env ? ParseLevel(env) : CpuLevel::kNEON;
+  }()};
+  return level;
+}
+
+bool HardwareSupports(CpuLevel level) {
+  static const CpuFeatures features = GetCpuFeatures();
+  (void)features;
+
+  switch (level) {
+    case CpuLevel::kGeneric:
+      return true;
+#ifdef __x86_64__
+    case CpuLevel::kSSE42:
+      return features.has_sse42;
+    case CpuLevel::kAVX2:
+      return features.has_avx2;
+    case CpuLevel::kAVX512:
+      return features.has_avx512f && features.has_avx512bw;
+#endif
+#ifdef __aarch64__
+    case CpuLevel::kNEON:
+      return features.has_neon;
+#endif
+    default:
+      return false;
+  }
+}
+
+}  // namespace
+
+bool CpuSupports(CpuLevel level) {
+  return level <= MaxLevel().load(std::memory_order_relaxed) && HardwareSupports(level);
+}
+
+void SetMaxCpuLevel(CpuLevel level) {
+  MaxLevel().store(level, std::memory_order_relaxed);
+}
+
+const char* CpuLevelName(CpuLevel level) {
+  switch (level) {
+    case CpuLevel::kGeneric:
+      return "generic";
+    case CpuLevel::kSSE42:
+      return "sse4.2";
+    case CpuLevel::kAVX2:
+      return "avx2";
+    case CpuLevel::kAVX512:
+      return "avx512";
+    case CpuLevel::kNEON:
+      return "neon";
+  }
+  return "unknown";
+}
 
 }  // namespace base
\ No newline at end of file
@@ -4,22 +4,31 @@
 
 #pragma once
 
+#include <cassert>
+#include <cstdint>
+#include <initializer_list>
+#include <utility>
+
 // Much slimmer version of https://github.com/google/cpu_features/
 // Assumes only relatively recent cpu families (found in the cloud)
 namespace base {
 
 struct CpuFeatures {
 #ifdef __x86_64__
+  bool has_sse42 = false;
+  bool has_aes = false;
   bool has_avx2 = false;
   bool has_avx512f = false;
+  bool has_avx512bw = false;
 #endif
 
 #ifdef __aarch64__
-// TBD
+  bool has_neon = true;  // mandatory on aarch64.
+  bool has_crc32 = false;
 #endif
 };
 
-#ifdef __x86_64__
+#if defined(__x86_64__) || defined(__aarch64__)
 CpuFeatures GetCpuFeatures();
 
 #else
@@ -32,4 +41,76 @@ inline CpuFeatures GetCpuFeatures() {
 
 #endif
 
-}  // namespace base
\ No newline at end of file
+// Instruction sets that kernel variants are compiled for, see CpuDispatch. A higher value is
+// preferred when several variants are supported. kAVX512 requires AVX512F and AVX512BW.
+// The kNEON variants are usually the SSE kernels compiled through base/sse2neon.h.
+enum class CpuLevel : uint8_t { kGeneric = 0, kSSE42 = 1, kAVX2 = 2, kAVX512 = 3, kNEON = 4 };
+
+// Whether the cpu supports the level, and it is not above the one set by SetMaxCpuLevel or
+// the HELIO_MAX_CPU_LEVEL environment variable, e.g. HELIO_MAX_CPU_LEVEL=avx2.
+bool CpuSupports(CpuLevel level);
+
+// Caps the levels that CpuSupports reports, e.g. to test the fallback variants. Affects only the
+// dispatchers that are constructed afterwards.
+void SetMaxCpuLevel(CpuLevel level);
+
+const char* CpuLevelName(CpuLevel level);
+
+#ifdef __x86_64__
+#define HELIO_TARGET_SSE42 __attribute__((target("sse4.2")))
+#define HELIO_TARGET_AVX2 __attribute__((target("avx2")))
+#define HELIO_TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
+#endif
+
+template <typename Sig> class CpuDispatch;
+
+// Selects the best supported variant of a kernel upon construction, so that a single binary
+// can use the instruction sets of the cpu it runs on. The variants are compiled for their
+// targets with the HELIO_TARGET_* attributes. Define the dispatcher as a function static so
+// that the selection runs once:
+//
+//   size_t Count(const char* p, size_t n) {
+//     static const CpuDispatch<size_t(const char*, size_t)> impl{
+//         {CpuLevel::kAVX2, CountAvx2}, {CpuLevel::kGeneric, CountGeneric}};
+//     return impl(p, n);
+//   }
+//
+// The calls go through a function pointer, hence the loops should be inside the kernels.
+// A kGeneric variant is required.
+template <typename R, typename... Args> class CpuDispatch<R(Args...)> {
+ public:
+  using Fn = R (*)(Args...);
+
+  struct Variant {
+    CpuLevel level;
+    Fn fn;
+  };
+
+  CpuDispatch(std::initializer_list<Variant> variants) {
+    for (const Variant& v : variants) {
+      if ((!fn_ || v.level > level_) && CpuSupports(v.level)) {
+        fn_ = v.fn;
+        level_ = v.level;
+      }
+    }
+    assert(fn_ && "kGeneric variant is missing");
+  }
+
+  template <typename... A> R operator()(A&&... args) const {
+    return fn_(std::forward<A>(args)...);
+  }
+
+  Fn get() const {
+    return fn_;
+  }
+
+  CpuLevel level() const {
+    return level_;
+  }
+
+ private:
+  Fn fn_ = nullptr;
+  CpuLevel level_ = CpuLevel::kGeneric;
+};
+
+}  // namespace base
@@ -166,12 +166,7 @@ CuckooMapTable::~CuckooMapTable() {
 }
 
 inline uint32 CuckooMapTable::CheckEmpty(const Bucket& bucket) const {
-  // I trust compiler to do loop unrolling in opt mode.
-  uint32 result = 0;
-  for (uint8 i = 0; i < kBucketLength; ++i) {
-    result |= ((bucket.key[i] == empty_value_) << i);
-  }
-  return result;
+  return MatchMask(bucket.key, empty_value_);
 }
 
 inline CuckooMapTable::BucketId CuckooMapTable::NextBucketId(BucketId current, key_type key) const {
@@ -184,14 +179,14 @@ inline CuckooMapTable::BucketId CuckooMapTable::NextBucketId(BucketId current, k
 
 CuckooMapTable::BucketIdPair CuckooMapTable::HashToIdPair(const key_type v) const {
   BucketId a = hash1(v);
-  __builtin_prefetch(buf_.get() + size_t(a) * bucket_size_, 0, 1);
+  __builtin_prefetch(buf_ + size_t(a) * bucket_size_, 0, 1);
 
   BucketId b = hash2(v);
   // __builtin_prefetch(buf_.get() + b * bucket_size_, 0, 1);
   // VLOG(2) << "HashToIdPair: " << v << " " << a_r << " " << b << " " << bucket_count_;
   // handle the case when 2 hash functions returns the same value.
   if (__builtin_expect(b == a, 0)) {
-    b = (b + 1) % bucket_count_;
+    b = NextBucket(b);
   }
 
   return BucketIdPair(a, b);
@@ -199,21 +194,47 @@ CuckooMapTable::BucketIdPair CuckooMapTable::HashToIdPair(const key_type v) cons
 
 inline CuckooMapTable::dense_id CuckooMapTable::FindInBucket(const BucketIdPair& id_pair,
                                                              const key_type k) const {
-  const key_type* a = GetBucketById(id_pair.id[0])->key;
-  for (uint8 i = 0; i < kBucketLength; ++i) {
-    if (a[i] == k)
-      return ToDenseId(id_pair.id[0], i);
-  }
-  a = GetBucketById(id_pair.id[1])->key;
-  for (uint8 i = 0; i < kBucketLength; ++i) {
-    if (a[i] == k)
-      return ToDenseId(id_pair.id[1], i);
-  }
+  uint32 mask = MatchMask(GetBucketById(id_pair.id[0])->key, k);
+  if (mask)
+    return ToDenseId(id_pair.id[0], __builtin_ctz(mask));
+
+  mask = MatchMask(GetBucketById(id_pair.id[1])->key, k);
+  if (mask)
+    return ToDenseId(id_pair.id[1], __builtin_ctz(mask));
   return npos;
 }
 
+void CuckooMapTable::FindBatch(const key_type* keys, size_t count, dense_id* dest) const {
+  // Large enough to overlap the memory latency of the batch, small enough to keep
+  // the prefetched lines in L1.
+  constexpr size_t kBatchSize = 16;
+  BucketId bids[kBatchSize][2];
+
+  for (size_t start = 0; start < count; start += kBatchSize) {
+    size_t batch = std::min(kBatchSize, count - start);
+    const key_type* k = keys + start;
+
+    for (size_t i = 0; i < batch; ++i) {
+      BucketId a = hash1(k[i]);
+      BucketId b = hash2(k[i]);
+      if (__builtin_expect(b == a, 0)) {
+        b = NextBucket(b);
+      }
+      bids[i][0] = a;
+      bids[i][1] = b;
+      __builtin_prefetch(GetBucketById(a), 0, 1);
+      __builtin_prefetch(GetBucketById(b), 0, 1);
+    }
+
+    for (size_t i = 0; i < batch; ++i) {
+      dest[start + i] = FindInBucket(BucketIdPair(bids[i][0], bids[i][1]), k[i]);
+    }
+  }
+}
+
 std::pair<CuckooMapTable::dense_id, bool> CuckooMapTable::Insert(key_type k, const uint8* data) {
   DCHECK(empty_value_set_);
+  DCHECK(!read_only_);
   DCHECK_NE(empty_value_, k);
 
   std::pair<CuckooMapTable::dense_id, bool> result;
@@ -270,7 +291,8 @@ inline void CuckooMapTable::SwapPending(Bucket* bucket, uint8 index) {
 }
 
 void CuckooMapTable::SetEmptyValues() {
-  uint8* ptr = buf_.get();
+  CHECK(!read_only_);
+  uint8* ptr = buf_;
   for (BucketId i = 0; i < bucket_count_; ++i, ptr += bucket_size_) {
     Bucket* bucket = reinterpret_cast<Bucket*>(ptr);
     std::fill(bucket->key, bucket->key + kBucketLength, empty_value_);
@@ -302,6 +324,185 @@ void CuckooMapTable::Reserve(size_t bigger_capacity) {
   }
 }
 
+void CuckooMapTable::BulkBuild(const key_type* keys, const uint8* values, size_t count,
+                               unsigned num_shards, const ParallelRunner& runner) {
+  CHECK(empty_value_set_);
+  CHECK(!read_only_);
+  CHECK(empty());
+  CHECK_GT(num_shards, 0u);
+
+  // Leave 10% of slack like Compact() does, it keeps the displacement chains short.
+  size_t bucket_cnt = std::max<size_t>(kMinBucketCount, 1 + BucketFromId(count * 1.1));
+  if (bucket_cnt > bucket_count_) {
+    SetBucketCount(GetPrimeNotLessThan(bucket_cnt));
+    DoAllocate();
+  }
+
+  const unsigned shards = num_shards;
+  auto run = [&](const std::function<void(unsigned)>& task) {
+    if (runner && shards > 1) {
+      runner(shards, task);
+    } else {
+      for (unsigned i = 0; i < shards; ++i)
+        task(i);
+    }
+  };
+
+  // Shard s owns the buckets [s * bucket_count_ / shards, (s + 1) * bucket_count_ / shards).
+  auto shard_of = [&](BucketId bid) -> unsigned { return uint64(bid) * shards / bucket_count_; };
+  auto shard_start = [&](unsigned s) -> BucketId { return uint64(s) * bucket_count_ / shards; };
+
+  // Pass 1: hash the keys and count how many of them belong to each shard.
+  // Keys are split into contiguous chunks, chunk i is handled by task i.
+  std::vector<BucketId> home(count);
+  std::vector<size_t> counts(size_t(shards) * shards, 0);
+  auto chunk_start = [&](unsigned i) { return count * i / shards; };
+
+  run([&](unsigned i) {
+    size_t* cnt = counts.data() + size_t(i) * shards;
+    for (size_t j = chunk_start(i); j < chunk_start(i + 1); ++j) {
+      DCHECK_NE(empty_value_, keys[j]);
+      home[j] = hash1(keys[j]);
+      ++cnt[shard_of(home[j])];
+    }
+  });
+
+  // Turn the counts into offsets so that the keys of every shard are laid out contiguously
+  // and in their original order, which preserves "the first occurrence wins".
+  std::vector<size_t> shard_offset(shards + 1, 0);
+  size_t offset = 0;
+  for (unsigned s = 0; s < shards; ++s) {
+    shard_offset[s] = offset;
+    for (unsigned i = 0; i < shards; ++i) {
+      size_t& c = counts[size_t(i) * shards + s];
+      size_t tmp = c;
+      c = offset;
+      offset += tmp;
+    }
+  }
+  shard_offset[shards] = offset;
+
+  // Pass 2: scatter key indices by shard.
+  std::vector<size_t> order(count);
+  run([&](unsigned i) {
+    size_t* pos = counts.data() + size_t(i) * shards;
+    for (size_t j = chunk_start(i); j < chunk_start(i + 1); ++j) {
+      order[pos[shard_of(home[j])]++] = j;
+    }
+  });
+
+  // Pass 3: every shard places its keys into the buckets it owns. A key goes to its first
+  // bucket or to its second one if the latter belongs to the same shard. Keys that do not
+  // fit are left for the sequential pass.
+  std::vector<std::vector<size_t>> leftovers(shards);
+  std::vector<size_t> placed(shards, 0);
+
+  run([&](unsigned s) {
+    BucketId start = shard_start(s), end = shard_start(s + 1);
+    for (size_t pos = shard_offset[s]; pos < shard_offset[s + 1]; ++pos) {
+      size_t j = order[pos];
+      const key_type k = keys[j];
+      BucketId bid[2] = {home[j], hash2(k)};
+      if (__builtin_expect(bid[1] == bid[0], 0)) {
+        bid[1] = NextBucket(bid[1]);
+      }
+      unsigned candidates = (bid[1] >= start && bid[1] < end) ? 2 : 1;
+
+      bool done = false;
+      for (unsigned c = 0; c < candidates && !done; ++c)
+        done = MatchMask(GetBucketById(bid[c])->key, k) != 0;  // a duplicate.
+
+      for (unsigned c = 0; c < candidates && !done; ++c) {
+        Bucket* bucket = GetBucketById(bid[c]);
+        uint32 empty_mask = CheckEmpty(*bucket);
+        if (empty_mask) {
+          unsigned index = __builtin_ctz(empty_mask);
+          bucket->key[index] = k;
+          if (value_size_)
+            memcpy(bucket->data + value_size_ * index, values + value_size_ * j, value_size_);
+          ++placed[s];
+          done = true;
+        }
+      }
+
+      if (!done)
+        leftovers[s].push_back(j);
+    }
+  });
+
+  for (size_t p : placed)
+    size_ += p;
+
+  // Pass 4: the remaining keys need displacements that may cross shards. Keys that
+  // the random walk can not place are handled by the exhaustive search, like in Compact().
+  std::vector<key_type> homeless_keys;
+  std::vector<uint8> homeless_values;
+  size_t leftover_cnt = 0;
+  for (const auto& v : leftovers) {
+    leftover_cnt += v.size();
+    for (size_t j : v) {
+      BucketIdPair id_pair = HashToIdPair(keys[j]);
+      if (FindInBucket(id_pair, keys[j]) != npos)
+        continue;
+
+      pending_key_ = keys[j];
+      if (value_size_)
+        memcpy(pending_ptr_, values + value_size_ * j, value_size_);
+      ++size_;
+      if (RollPending(shifts_limit_ * 2, id_pair) == npos) {
+        homeless_keys.push_back(pending_key_);
+        size_t sz = homeless_values.size();
+        homeless_values.resize(sz + value_size_);
+        memcpy(homeless_values.data() + sz, pending_ptr_, value_size_);
+      }
+    }
+  }
+
+  if (!homeless_keys.empty()) {
+    compaction_info_.assign(bucket_count_, BucketState());
+    for (size_t i = 0; i < homeless_keys.size(); ++i) {
+      const key_type k = homeless_keys[i];
+      const uint8* val = homeless_values.data() + value_size_ * i;
+      if (find(k) != npos) {  // a duplicate of a key that was rolled out.
+        --size_;
+        continue;
+      }
+
+      pending_key_ = k;
+      memcpy(pending_ptr_, val, value_size_);
+      if (!ShiftExhaustive(HashToIdPair(k).id[0])) {
+        // Give up on the current size, Insert() grows the table.
+        --size_;
+        Insert(k, val);
+        compaction_info_.assign(bucket_count_, BucketState());
+      }
+    }
+    compaction_info_.clear();
+    compaction_info_.shrink_to_fit();
+  }
+
+  VLOG(1) << "BulkBuild: " << count << " keys, " << leftover_cnt << " inserted sequentially, "
+          << homeless_keys.size() << " with exhaustive search, utilization " << Utilization();
+}
+
+bool CuckooMapTable::AttachReadOnly(const uint8* buf, size_t buf_len, size_t capacity,
+                                    size_t size, key_type empty_key) {
+  size_t bucket_cnt = BucketFromId(capacity);
+  if (capacity % kBucketLength != 0 || bucket_cnt == 0 || bucket_cnt > kuint32max ||
+      buf_len != bucket_cnt * bucket_size_ || size > capacity) {
+    return false;
+  }
+
+  SetBucketCount(bucket_cnt);
+  owned_buf_.reset();
+  buf_ = const_cast<uint8*>(buf);
+  read_only_ = true;
+  size_ = size;
+  empty_value_ = empty_key;
+  empty_value_set_ = true;
+  return true;
+}
+
 CuckooMapTable::dense_id CuckooMapTable::RollPending(uint32 shifts_limit,
                                                      const BucketIdPair& bucket_pair) {
   DCHECK(bucket_pair == HashToIdPair(pending_key_));
@@ -361,8 +562,10 @@ CuckooMapTable::dense_id CuckooMapTable::RollPending(uint32 shifts_limit,
 
 // There is an empty slot in the second bucket.
 void CuckooMapTable::Grow(size_t low_bucket_bound) {
+  CHECK(!read_only_);
+
   // Keep the old metadata
-  std::unique_ptr<uint8[]> old_buf(buf_.release());
+  std::unique_ptr<uint8[]> old_buf(std::move(owned_buf_));
   const size_t old_bucket_count = bucket_count_;
 
   // Enlarge the container.  Repeat as long as we cannot reinsert everything.
@@ -428,7 +631,7 @@ void CuckooMapTable::SetBucketCount(size_t bucket_cnt) {
   VLOG(1) << "SetBucketCount " << bucket_cnt;
 
   bucket_count_ = bucket_cnt;
-  shifts_limit_ = absl::countr_zero(bucket_count_) * 2;
+  shifts_limit_ = absl::bit_width(bucket_count_) * 2;
 
   divide_s_ = libdivide::libdivide_u64_gen(bucket_count_);
   divide_s_alg_ = libdivide::libdivide_u64_get_algorithm(&divide_s_);
@@ -438,19 +641,21 @@ void CuckooMapTable::SetBucketCount(size_t bucket_cnt) {
 
 void CuckooMapTable::DoAllocate() {
   size_t sz = bucket_count_ * bucket_size_;
-  buf_.reset(new (std::nothrow) uint8[sz]);
-  CHECK(buf_) << "Could not allocate " << sz << " bytes";
+  owned_buf_.reset(new (std::nothrow) uint8[sz]);
+  CHECK(owned_buf_) << "Could not allocate " << sz << " bytes";
+  buf_ = owned_buf_.get();
   SetEmptyValues();
 }
 
 bool CuckooMapTable::Compact(double ratio) {
   CHECK_GT(ratio, 1.001);
+  CHECK(!read_only_);
   if (bucket_count_ < 128) {
     // Do not bother compacting it.
     return true;
   }
   BucketId prev_reserved_buckets = bucket_count_;
-  std::unique_ptr<uint8[]> old_buf(buf_.release());
+  std::unique_ptr<uint8[]> old_buf(std::move(owned_buf_));
   BucketId bucket_count_from_size =
       std::max<size_t>(kMinBucketCount, 1 + BucketFromId(size() * ratio));
 
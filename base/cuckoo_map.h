@@ -4,6 +4,8 @@
 #ifndef _CUCKOO_MAP_H
 #define _CUCKOO_MAP_H
 
+#include <absl/types/span.h>
+
 #include <memory>
 #include <type_traits>
 #include <vector>
@@ -34,6 +36,12 @@ class CuckooSet : public CuckooMapTableWrapperBase {
   std::pair<DenseId, bool> Insert(KeyType v) {
     return table_.Insert(v, nullptr);
   }
+
+  // See CuckooMapTable::BulkBuild. The set must be empty.
+  void BulkBuild(absl::Span<const KeyType> keys, unsigned num_shards = 1,
+                 const ParallelRunner& runner = nullptr) {
+    table_.BulkBuild(keys.data(), nullptr, keys.size(), num_shards, runner);
+  }
   KeyType FromDenseId(DenseId d) const {
     return table_.FromDenseId(d).first;
   }
@@ -54,6 +62,14 @@ template <typename T> class CuckooMap : public CuckooMapTableWrapperBase {
     return table_.Insert(v, reinterpret_cast<const uint8*>(&t));
   }
 
+  // See CuckooMapTable::BulkBuild. The map must be empty.
+  void BulkBuild(absl::Span<const KeyType> keys, absl::Span<const T> values,
+                 unsigned num_shards = 1, const ParallelRunner& runner = nullptr) {
+    CHECK_EQ(keys.size(), values.size());
+    table_.BulkBuild(keys.data(), reinterpret_cast<const uint8*>(values.data()), keys.size(),
+                     num_shards, runner);
+  }
+
   std::pair<KeyType, T*> FromDenseId(DenseId d) {
     auto p = table_.FromDenseId(d);
     return std::pair<KeyType, T*>(p.first, reinterpret_cast<T*>(p.second));
@@ -3,13 +3,16 @@
 //
 #include "base/cuckoo_map.h"
 
+#include <absl/container/flat_hash_map.h>
 #include <absl/container/flat_hash_set.h>
 
 #include <random>
+#include <thread>
 #include <unordered_set>
 
 #include "base/flags.h"
 #include "base/gtest.h"
+#include "base/swiss_map.h"
 
 ABSL_FLAG(int32, shrink_items, 200, "");
 
@@ -142,6 +145,64 @@ constexpr int kLevel1 = 1000;
 constexpr int kLevel2 = 10000;
 constexpr int kLevel3 = 100000;
 
+TEST_F(CuckooMapTest, FindBatch) {
+  CuckooMap<int> m;
+  m.SetEmptyKey(0);
+  std::mt19937_64 dre(10);
+
+  vector<uint64> keys;
+  for (unsigned i = 0; i < 10000; ++i) {
+    uint64 k = dre() | 1;
+    m.Insert(k, i);
+    keys.push_back(k);
+    keys.push_back(k + 1);  // even, hence a miss.
+  }
+
+  vector<CuckooMapTable::dense_id> ids(keys.size());
+  m.FindBatch(keys.data(), keys.size(), ids.data());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    ASSERT_EQ(m.find(keys[i]), ids[i]) << i;
+    ASSERT_EQ(i % 2 == 0, ids[i] != CuckooMapTable::npos) << i;
+  }
+}
+
+TEST_F(CuckooMapTest, BulkBuild) {
+  std::mt19937_64 dre(15);
+  vector<uint64> keys;
+  vector<int> vals;
+  for (unsigned i = 0; i < 100000; ++i) {
+    keys.push_back(dre() | 1);
+    vals.push_back(i);
+  }
+
+  // A duplicate.
+  keys.push_back(keys[10]);
+  vals.push_back(-1);
+
+  auto runner = [](unsigned n, const std::function<void(unsigned)>& task) {
+    vector<std::thread> threads;
+    for (unsigned i = 0; i < n; ++i)
+      threads.emplace_back(task, i);
+    for (auto& t : threads)
+      t.join();
+  };
+
+  for (unsigned shards : {1, 4}) {
+    CuckooMap<int> m;
+    m.SetEmptyKey(0);
+    m.BulkBuild(keys, vals, shards, runner);
+    ASSERT_EQ(keys.size() - 1, m.size());
+
+    for (unsigned i = 0; i < keys.size() - 1; ++i) {
+      auto id = m.find(keys[i]);
+      ASSERT_NE(CuckooMapTable::npos, id) << i;
+      ASSERT_EQ(vals[i], *m.FromDenseId(id).second);
+    }
+    ASSERT_EQ(CuckooMapTable::npos, m.find(2));
+    EXPECT_GT(m.utilization(), 0.85);
+  }
+}
+
 static void BM_InsertDenseSet(benchmark::State& state) {
   unsigned iters = state.range(0);
 
@@ -296,6 +357,64 @@ static void BM_FindDenseSetRandom(benchmark::State& state) {
 }
 BENCHMARK(BM_FindDenseSetRandom)->Arg(kLevel1)->Arg(kLevel2)->Arg(kLevel3);
 
+static void BM_FindSwissMapRandom(benchmark::State& state) {
+  SwissMap<uint64, uint32, cityhash32> m;
+
+  std::mt19937_64 dre(10);
+  unsigned iters = state.range(0);
+  std::vector<uint64> vals(iters, 0);
+  for (unsigned i = 0; i < iters; ++i) {
+    vals[i] = dre();
+    m.try_emplace(vals[i], i);
+  }
+  while (state.KeepRunning()) {
+    for (unsigned i = 0; i < iters; ++i) {
+      sink_result(m.contains(vals[i]));
+      sink_result(m.contains(i + 1));
+      sink_result(m.contains(iters + i + 1));
+    }
+  }
+}
+BENCHMARK(BM_FindSwissMapRandom)->Arg(kLevel1)->Arg(kLevel2)->Arg(kLevel3);
+
+static void BM_InsertSwissMap(benchmark::State& state) {
+  unsigned iters = state.range(0);
+  while (state.KeepRunning()) {
+    SwissMap<uint64, uint32, cityhash32> m;
+    for (uint64 i = 0; i < iters; ++i) {
+      m.try_emplace(1 + (i + 1) * i, i);
+    }
+  }
+}
+BENCHMARK(BM_InsertSwissMap)->Arg(kLevel1)->Arg(kLevel2)->Arg(kLevel3);
+
+// Keeps the maps at a steady size while replacing the keys, which CuckooMap does not support.
+template <typename Map> void EraseInsertLoop(benchmark::State& state) {
+  unsigned iters = state.range(0);
+  Map m;
+  for (uint64 i = 0; i < iters; ++i)
+    m.try_emplace(i, i);
+
+  uint64 next = iters;
+  while (state.KeepRunning()) {
+    for (unsigned i = 0; i < iters; ++i, ++next) {
+      m.erase(next - iters);
+      m.try_emplace(next, i);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * iters);
+}
+
+static void BM_EraseInsertSwissMap(benchmark::State& state) {
+  EraseInsertLoop<SwissMap<uint64, uint32, cityhash32>>(state);
+}
+BENCHMARK(BM_EraseInsertSwissMap)->Arg(kLevel1)->Arg(kLevel3);
+
+static void BM_EraseInsertDenseMap(benchmark::State& state) {
+  EraseInsertLoop<absl::flat_hash_map<uint64, uint32, cityhash32>>(state);
+}
+BENCHMARK(BM_EraseInsertDenseMap)->Arg(kLevel1)->Arg(kLevel3);
+
 static void BM_FindCuckooRandom(benchmark::State& state) {
   unsigned iters = state.range(0);
   CuckooMapTable m(0, unsigned(iters * 1.3));
@@ -320,6 +439,30 @@ static void BM_FindCuckooRandom(benchmark::State& state) {
 }
 BENCHMARK(BM_FindCuckooRandom)->Arg(kLevel1)->Arg(kLevel2)->Arg(kLevel3);
 
+static void BM_FindBatchCuckooRandom(benchmark::State& state) {
+  unsigned iters = state.range(0);
+  CuckooMapTable m(0, unsigned(iters * 1.3));
+  m.SetEmptyKey(0);
+  std::mt19937_64 dre(20);
+
+  // Same mix of hits and misses as in BM_FindCuckooRandom.
+  std::vector<uint64> vals(iters * 3, 0);
+  for (unsigned i = 0; i < iters; ++i) {
+    vals[i] = dre();
+    if (vals[i] == 0)
+      vals[i] = 1;
+    m.Insert(vals[i], nullptr);
+    vals[iters + i] = i + 1;
+    vals[iters * 2 + i] = iters + i + 1;
+  }
+  std::vector<CuckooMapTable::dense_id> ids(vals.size());
+  while (state.KeepRunning()) {
+    m.FindBatch(vals.data(), vals.size(), ids.data());
+    sink_result(ids.back());
+  }
+}
+BENCHMARK(BM_FindBatchCuckooRandom)->Arg(kLevel1)->Arg(kLevel2)->Arg(kLevel3);
+
 static void BM_FindCuckooRandomAfterCompact(benchmark::State& state) {
   unsigned iters = state.range(0);
   CuckooMapTable m(0, unsigned(iters * 1.3));
@@ -177,4 +177,43 @@ TEST_F(CxxTest, CPUFeatures) {
   (void)features;
 }
 
+namespace {
+
+int LevelGeneric(int x) {
+  return x;
+}
+
+#ifdef __x86_64__
+HELIO_TARGET_AVX2 int LevelAvx2(int x) {
+  return x + 2;
+}
+#endif
+
+}  // namespace
+
+TEST_F(CxxTest, CpuDispatch) {
+  EXPECT_TRUE(CpuSupports(CpuLevel::kGeneric));
+
+  auto make = [] {
+    return CpuDispatch<int(int)>{
+#ifdef __x86_64__
+        {CpuLevel::kAVX2, LevelAvx2},
+#endif
+        {CpuLevel::kGeneric, LevelGeneric}};
+  };
+
+  auto best = make();
+  EXPECT_EQ(CpuSupports(best.level()), true);
+  if (best.level() == CpuLevel::kAVX2) {
+    EXPECT_EQ(3, best(1));
+  }
+
+  SetMaxCpuLevel(CpuLevel::kGeneric);
+  auto generic = make();
+  EXPECT_EQ(CpuLevel::kGeneric, generic.level());
+  EXPECT_EQ(1, generic(1));
+  EXPECT_FALSE(CpuSupports(CpuLevel::kAVX2));
+  SetMaxCpuLevel(CpuLevel::kNEON);
+}
+
 }  // namespace base
@@ -4,6 +4,11 @@
 #pragma once
 
 #include <absl/numeric/bits.h>
+#include <absl/types/span.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <cstdint>
 #include <cstring>
@@ -142,7 +147,7 @@ inline unsigned Parse64Fast(const uint8_t* src, uint64_t* v) {
 #else
   ++index;
 
-  val &= ((1ULL << index * 8) - 1);
+  val &= UINT64_MAX >> (64 - index * 8);  // index is in [1, 8].
 #endif
 
   *v = val >> index;
@@ -173,7 +178,7 @@ inline unsigned Parse64Safe(const uint8_t* begin, const uint8_t* end, uint64_t*
 
   detail::dispatch_impl<8>::visit(index, [&](unsigned len) { memcpy(v, begin, len); });
 
-  *v &= ((1ULL << index * 8) - 1);
+  *v &= UINT64_MAX >> (64 - index * 8);
   *v >>= index;
 
   return index;
@@ -256,7 +261,7 @@ template <typename T> unsigned ParseT(const uint8_t* src, T* dest) {
   }
 
   uint32_t index = absl::countr_zero(val) + 1;
-  val &= ((T(1) << index * 8) - 1);
+  val &= std::numeric_limits<T>::max() >> (sizeof(T) * 8 - index * 8);
   *dest = val >> index;
   return index;
 }
@@ -278,6 +283,152 @@ template <typename T> struct Trait {
   static constexpr size_t kMaxSize = sizeof(T) + 1 + (sizeof(T) - 1) / 8;
 };
 
+// Batch API. The encoding is identical to Encode64 applied to each value in order.
+
+// The number of readable bytes that DecodeBatch requires after the encoded data.
+constexpr size_t kBatchPadding = 8;
+
+// The size of dest buffer required by EncodeBatch.
+constexpr size_t EncodeBatchBound(size_t num) {
+  return num * Trait<uint64_t>::kMaxSize;
+}
+
+// Encodes src into dest and returns the number of bytes written.
+// dest must have at least EncodeBatchBound(src.size()) bytes.
+inline size_t EncodeBatch(absl::Span<const uint64_t> src, uint8_t* dest);
+
+// Decodes dest.size() numbers from src and returns the number of bytes consumed.
+// Assumes that the input is valid and requires kBatchPadding accessible bytes after it.
+inline size_t DecodeBatch(const uint8_t* src, absl::Span<uint64_t> dest);
+
+namespace detail {
+
+constexpr uint64_t kLowBytes = 0x0101010101010101ULL;
+constexpr uint64_t kLowWordBits = 0x0003000300030003ULL;
+constexpr uint64_t kLowWordHeader = 0x0002000200020002ULL;
+
+// Values of a group that share the same encoding length are encoded without recomputing it.
+template <unsigned kLen>
+inline uint8_t* EncodeFixed(const uint64_t* src, unsigned num, uint8_t* dest) {
+  for (unsigned i = 0; i < num; ++i) {
+    uint64_t v = ((src[i] << 1) + 1) << (kLen - 1);
+    LE::StoreT(v, dest);
+    dest += kLen;
+  }
+  return dest;
+}
+
+}  // namespace detail
+
+inline size_t EncodeBatch(absl::Span<const uint64_t> src, uint8_t* dest) {
+  constexpr unsigned kGroup = 8;
+  uint8_t* next = dest;
+  const uint64_t* v = src.data();
+  size_t i = 0;
+
+  for (; i + kGroup <= src.size(); i += kGroup, v += kGroup) {
+    uint64_t or_v = 0;
+    for (unsigned j = 0; j < kGroup; ++j)
+      or_v |= v[j];
+
+    if (or_v < 128) {  // 8 single byte values are packed into one word.
+      uint64_t w = 0;
+      for (unsigned j = 0; j < kGroup; ++j)
+        w |= ((v[j] << 1) | 1) << (8 * j);
+      LE::StoreT(w, next);
+      next += kGroup;
+      continue;
+    }
+
+    unsigned len = EncodingLength(or_v);
+    uint64_t min_v = v[0];
+    for (unsigned j = 1; j < kGroup; ++j)
+      min_v = std::min(min_v, v[j]);
+
+    if (len > 8 || EncodingLength(min_v) != len) {
+      for (unsigned j = 0; j < kGroup; ++j)
+        next += EncodeTFast(v[j], next);
+      continue;
+    }
+
+    switch (len) {
+      case 2:
+        next = detail::EncodeFixed<2>(v, kGroup, next);
+        break;
+      case 3:
+        next = detail::EncodeFixed<3>(v, kGroup, next);
+        break;
+      case 4:
+        next = detail::EncodeFixed<4>(v, kGroup, next);
+        break;
+      case 5:
+        next = detail::EncodeFixed<5>(v, kGroup, next);
+        break;
+      case 6:
+        next = detail::EncodeFixed<6>(v, kGroup, next);
+        break;
+      case 7:
+        next = detail::EncodeFixed<7>(v, kGroup, next);
+        break;
+      default:
+        next = detail::EncodeFixed<8>(v, kGroup, next);
+    }
+  }
+
+  for (; i < src.size(); ++i, ++v) {
+    next += EncodeTFast(*v, next);
+  }
+  return next - dest;
+}
+
+inline size_t DecodeBatch(const uint8_t* src, absl::Span<uint64_t> dest) {
+  const uint8_t* next = src;
+  uint64_t* out = dest.data();
+  uint64_t* end = out + dest.size();
+
+  while (out < end) {
+    size_t left = end - out;
+
+#ifdef __SSE2__
+    if (left >= 16) {
+      // The lowest bit of every byte is set - 16 single byte values.
+      __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(next));
+      if (_mm_movemask_epi8(_mm_slli_epi64(x, 7)) == 0xFFFF) {
+        for (unsigned j = 0; j < 16; ++j)
+          out[j] = next[j] >> 1;
+        out += 16;
+        next += 16;
+        continue;
+      }
+    }
+#endif
+
+    if (left >= 4) {
+      uint64_t w = LE::LoadT<uint64_t>(next);
+      if (left >= 8 && (w & detail::kLowBytes) == detail::kLowBytes) {
+        for (unsigned j = 0; j < 8; ++j)
+          out[j] = (w >> (8 * j + 1)) & 0x7F;
+        out += 8;
+        next += 8;
+        continue;
+      }
+
+      // Every 16-bit lane has the 2-byte header.
+      if ((w & detail::kLowWordBits) == detail::kLowWordHeader) {
+        for (unsigned j = 0; j < 4; ++j)
+          out[j] = (w >> (16 * j + 2)) & 0x3FFF;
+        out += 4;
+        next += 8;
+        continue;
+      }
+    }
+
+    next += Parse64Fast(next, out++);
+  }
+
+  return next - src;
+}
+
 }  // namespace flit
 
 // From protobuf documentation:
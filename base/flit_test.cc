@@ -97,6 +97,8 @@ TEST_F(FlitTest, Flit) {
   TEST_CONST((1 << 21) - 1, 3);
   TEST_CONST((1ULL << 32), 5);
   TEST_CONST((1ULL << 31), 5);
+  TEST_CONST((1ULL << 49), 8);
+  TEST_CONST((1ULL << 56) - 1, 8);
   TEST_CONST((1ULL << 56), 9);
   TEST_CONST((1ULL << 63), 9);
   TEST_CONST(85039090594426347ULL, 9);
@@ -106,9 +108,62 @@ static std::mt19937_64 rnd_engine;
 
 uint64_t RandUint64() {
   unsigned bit_len = (rnd_engine() % 64) + 1;
+  return rnd_engine() & (UINT64_MAX >> (64 - bit_len));
+}
+
+// Posting list deltas, mostly short.
+uint64_t RandDelta() {
+  unsigned bit_len = rnd_engine() % 100 < 90 ? (rnd_engine() % 7) + 1 : (rnd_engine() % 20) + 1;
   return rnd_engine() & ((1ULL << bit_len) - 1);
 }
 
+TEST_F(FlitTest, Batch) {
+  vector<uint64_t> input;
+  for (unsigned i = 0; i < 5000; ++i) {
+    switch (i / 1000) {
+      case 0:
+        input.push_back(RandUint64());
+        break;
+      case 1:
+        input.push_back(i % 128);
+        break;
+      case 2:
+        input.push_back(128 + i);
+        break;
+      case 3:
+        input.push_back(RandDelta());
+        break;
+      default:
+        input.push_back((1ULL << 50) + i);
+    }
+  }
+  input.push_back(0);
+  input.push_back(UINT64_MAX);
+
+  vector<uint8_t> buf(flit::EncodeBatchBound(input.size()) + flit::kBatchPadding);
+  size_t encoded = flit::EncodeBatch(input, buf.data());
+
+  vector<uint8_t> expected(buf.size());
+  uint8_t* next = expected.data();
+  for (uint64_t v : input)
+    next += flit::Encode64(v, next);
+  ASSERT_EQ(next - expected.data(), encoded);
+  ASSERT_EQ(0, memcmp(expected.data(), buf.data(), encoded));
+
+  vector<uint64_t> decoded(input.size());
+  ASSERT_EQ(encoded, flit::DecodeBatch(buf.data(), absl::MakeSpan(decoded)));
+  EXPECT_EQ(input, decoded);
+
+  // Partial batches.
+  for (size_t len : {0, 1, 7, 15, 33}) {
+    size_t sz = flit::EncodeBatch(absl::MakeSpan(input).subspan(1000, len), buf.data());
+    ASSERT_EQ(sz, flit::DecodeBatch(buf.data(), absl::MakeSpan(decoded).subspan(0, len)));
+    for (size_t i = 0; i < len; ++i) {
+      ASSERT_EQ(input[1000 + i], decoded[i]);
+    }
+  }
+}
+
 static void FillEncoded(uint8_t* buf, unsigned num) {
   for (unsigned i = 0; i < num; ++i) {
     volatile uint64_t val = RandUint64();
@@ -190,4 +245,42 @@ static void BM_FlitDecodeGold(benchmark::State& state) {
 }
 BENCHMARK(BM_FlitDecodeGold);
 
+static void BM_FlitEncodeBatch(benchmark::State& state) {
+  vector<uint64_t> input(kBatchLen);
+  std::generate(input.begin(), input.end(), RandDelta);
+  std::unique_ptr<uint8_t[]> buf(new uint8_t[flit::EncodeBatchBound(kBatchLen)]);
+
+  while (state.KeepRunning()) {
+    if (state.range(0)) {
+      sink_result(flit::EncodeBatch(input, buf.get()));
+    } else {
+      uint8_t* next = buf.get();
+      for (uint64_t v : input)
+        next += flit::EncodeTFast(v, next);
+      sink_result(next);
+    }
+  }
+}
+BENCHMARK(BM_FlitEncodeBatch)->Arg(0)->Arg(1);
+
+static void BM_FlitDecodeBatch(benchmark::State& state) {
+  vector<uint64_t> input(kBatchLen);
+  std::generate(input.begin(), input.end(), RandDelta);
+  std::unique_ptr<uint8_t[]> buf(new uint8_t[flit::EncodeBatchBound(kBatchLen)]);
+  flit::EncodeBatch(input, buf.get());
+  vector<uint64_t> output(kBatchLen);
+
+  while (state.KeepRunning()) {
+    if (state.range(0)) {
+      sink_result(flit::DecodeBatch(buf.get(), absl::MakeSpan(output)));
+    } else {
+      const uint8_t* rn = buf.get();
+      for (auto& v : output)
+        rn += flit::Parse64Fast(rn, &v);
+      sink_result(rn);
+    }
+  }
+}
+BENCHMARK(BM_FlitDecodeBatch)->Arg(0)->Arg(1);
+
 }  // namespace base
@@ -4,6 +4,7 @@
 #include <dirent.h>
 #include <gperftools/profiler.h>
 
+#include "base/bench_json.h"
 #include "base/gtest.h"
 #include "base/init.h"
 #include "base/logging.h"
@@ -94,7 +95,9 @@ int main(int argc, char** argv) {
   testing::InitGoogleTest(&argc, argv);
   ProfilerEnable();  // Dummy call to force linker to use profiler lib.
 
-  for (int i = 1; i < argc; ++i) {
+  // --bench_json implies --bench.
+  bool bench_json = base::InitBenchJson(&argc, argv);
+  for (int i = 1; i < argc && !bench_json; ++i) {
     if (strcmp(argv[i], "--bench") == 0) {
       benchmark::Initialize(&argc, argv);
       break;
@@ -107,7 +110,7 @@ int main(int argc, char** argv) {
 
   int res = RUN_ALL_TESTS();
 
-  if (absl::GetFlag(FLAGS_bench)) {
+  if (absl::GetFlag(FLAGS_bench) || bench_json) {
     benchmark::RunSpecifiedBenchmarks();
   }
   if (res == 0 && base::test_path[0]) {
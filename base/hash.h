@@ -4,6 +4,8 @@
 #ifndef BASE_HASH_H
 #define BASE_HASH_H
 
+#include <sys/uio.h>
+
 #include <cstdint>
 #include <optional>
 #include <string>
@@ -16,6 +18,8 @@
 
 namespace base {
 
+class IoBuf;
+
 uint32_t MurmurHash3_x86_32(const uint8_t* data, uint32_t len, uint32_t seed);
 
 inline uint32_t Murmur32(uint64_t val, uint32_t seed = 10) {
@@ -131,6 +135,65 @@ template <typename T, typename U> uint64_t XXHash64(const std::pair<T, U>& t) {
   return XXHash64(t.first, t.second);
 }
 
+// Streaming hash over a choice of engines. kAuto picks the fastest engine supported by the cpu,
+// see hash_test benchmarks. Engines produce different values, hence persistent checksums should
+// name the engine explicitly. Passing an engine that is not supported, see IsSupported, is
+// a fatal error, so that the checksums never change silently with the cpu.
+// The digest of a stream does not depend on how it was chunked.
+class Hasher {
+ public:
+  enum Engine : uint8_t {
+    kAuto = 0,
+    kXXH3 = 1,      // 64-bit XXH3.
+    kAquaHash = 2,  // AES-NI, the low 64 bits of the 128-bit hash. x86 only.
+    kCRC32C = 3,    // Castagnoli CRC, hardware accelerated where possible. 32-bit result.
+  };
+
+  explicit Hasher(Engine engine = kAuto, uint64_t seed = 0);
+
+  static bool IsSupported(Engine engine);
+  static Engine BestEngine();
+  static const char* EngineName(Engine engine);
+
+  // One-shot hash, equivalent to a single Update followed by Digest.
+  static uint64_t Hash(Engine engine, const void* data, size_t len, uint64_t seed = 0);
+
+  Engine engine() const {
+    return engine_;
+  }
+
+  void Reset();
+
+  void Update(const void* data, size_t len);
+
+  void Update(std::string_view str) {
+    Update(str.data(), str.size());
+  }
+
+  void Update(const iovec* v, size_t count) {
+    for (size_t i = 0; i < count; ++i)
+      Update(v[i].iov_base, v[i].iov_len);
+  }
+
+  // Hashes the input (unconsumed) bytes of buf.
+  void Update(const IoBuf& buf);
+
+  // Does not change the state, so more data can be appended afterwards.
+  uint64_t Digest() const;
+
+ private:
+  static constexpr size_t kAquaStateSize = 160;
+
+  Engine engine_;
+  uint32_t crc_ = 0;
+  uint64_t seed_;
+
+  union {
+    XXH3_state_t xxh3_;
+    alignas(16) uint8_t aqua_[kAquaStateSize];
+  };
+};
+
 // Hash functor for std::tuple.
 struct TupleHash {
   template <class... T> size_t operator()(const std::tuple<T...>& t) const {
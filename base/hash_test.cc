@@ -6,7 +6,9 @@
 #include <absl/random/random.h>
 
 #include "base/gtest.h"
+#include "base/io_buf.h"
 #include "base/logging.h"
+#include "base/random.h"
 #include "base/zipf_gen.h"
 
 using namespace std;
@@ -38,4 +40,128 @@ TEST_F(HashTest, Zipf) {
   }
 }
 
+TEST_F(HashTest, ZipfLarge) {
+  for (double theta : {0.5, 0.99}) {
+    for (uint64_t n : {100u, 10000u, 1000000u}) {
+      double exact = 0;
+      for (uint64_t i = 1; i <= n; ++i)
+        exact += 1 / pow(i, theta);
+      EXPECT_NEAR(exact, ZipfianGenerator::Zeta(n, theta), exact * 1e-12) << theta << " " << n;
+    }
+  }
+
+  // Does not loop over the items.
+  constexpr uint64_t kItems = 1ULL << 36;
+  ZipfianGenerator zipf(10, 10 + kItems - 1);
+  Xoroshiro128p gen(1);
+  vector<uint64_t> vals(100000);
+  zipf.NextN(gen, absl::MakeSpan(vals));
+
+  unsigned first = 0;
+  for (uint64_t val : vals) {
+    ASSERT_GE(val, 10u);
+    ASSERT_LT(val, 10 + kItems);
+    first += (val == 10);
+  }
+  double expected = vals.size() / ZipfianGenerator::Zeta(kItems, ZipfianGenerator::kZipfianConst);
+  EXPECT_NEAR(expected, first, expected * 0.1);
+}
+
+TEST_F(HashTest, Hasher) {
+  EXPECT_EQ(0xE3069283u, Hasher::Hash(Hasher::kCRC32C, "123456789", 9));
+  EXPECT_EQ(0u, Hasher::Hash(Hasher::kCRC32C, "", 0));
+  EXPECT_EQ(XXH3_64bits_withSeed("foo", 3, 5), Hasher::Hash(Hasher::kXXH3, "foo", 3, 5));
+  EXPECT_NE(Hasher::kAuto, Hasher(Hasher::kAuto).engine());
+
+  string data(1000, 'x');
+  for (size_t i = 0; i < data.size(); ++i)
+    data[i] = i * 7;
+
+  for (auto engine : {Hasher::kXXH3, Hasher::kAquaHash, Hasher::kCRC32C}) {
+    if (!Hasher::IsSupported(engine))
+      continue;
+    SCOPED_TRACE(Hasher::EngineName(engine));
+
+    for (size_t len = 0; len <= data.size(); len += (len < 200 ? 1 : 100)) {
+      uint64_t expected = Hasher::Hash(engine, data.data(), len, 17);
+      Hasher hasher(engine, 17);
+      ASSERT_EQ(engine, hasher.engine());
+      size_t chunk = len / 3 + 1;
+      for (size_t pos = 0; pos < len; pos += chunk)
+        hasher.Update(data.data() + pos, min(chunk, len - pos));
+      ASSERT_EQ(expected, hasher.Digest()) << len;
+      ASSERT_EQ(expected, hasher.Digest()) << len;
+    }
+
+    Hasher hasher(engine);
+    iovec v[2] = {{data.data(), 300}, {data.data() + 300, 700}};
+    hasher.Update(v, 2);
+    uint64_t expected = Hasher::Hash(engine, data.data(), data.size());
+    EXPECT_EQ(expected, hasher.Digest());
+
+    IoBuf buf;
+    buf.WriteAndCommit(data.data(), data.size());
+    hasher.Reset();
+    hasher.Update(buf);
+    EXPECT_EQ(expected, hasher.Digest());
+    EXPECT_NE(expected, Hasher::Hash(engine, data.data(), data.size(), 1));
+  }
+}
+
+TEST_F(HashTest, HasherUnsupported) {
+  Hasher::Engine engine = Hasher::Engine(7);
+  EXPECT_FALSE(Hasher::IsSupported(engine));
+  EXPECT_DEATH(Hasher{engine}, "Unsupported hash engine unknown");
+  EXPECT_DEATH(Hasher::Hash(engine, "foo", 3), "Unsupported hash engine unknown");
+  if (!Hasher::IsSupported(Hasher::kAquaHash)) {
+    EXPECT_DEATH(Hasher{Hasher::kAquaHash}, "Unsupported hash engine aquahash");
+  }
+}
+
+static void BM_Hasher(benchmark::State& state) {
+  Hasher::Engine engine = Hasher::Engine(state.range(0));
+  if (!Hasher::IsSupported(engine)) {
+    state.SkipWithError("not supported");
+    return;
+  }
+  string data(state.range(1), 'a');
+  while (state.KeepRunning()) {
+    sink_result(Hasher::Hash(engine, data.data(), data.size()));
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+  state.SetLabel(Hasher::EngineName(engine));
+}
+BENCHMARK(BM_Hasher)->ArgsProduct({{Hasher::kXXH3, Hasher::kAquaHash, Hasher::kCRC32C},
+                                   {16, 64, 1024, 16384}});
+
+static void BM_HasherStreaming(benchmark::State& state) {
+  Hasher::Engine engine = Hasher::Engine(state.range(0));
+  if (!Hasher::IsSupported(engine)) {
+    state.SkipWithError("not supported");
+    return;
+  }
+  string data(4096, 'a');
+  while (state.KeepRunning()) {
+    Hasher hasher(engine);
+    for (unsigned i = 0; i < 16; ++i)
+      hasher.Update(data);
+    sink_result(hasher.Digest());
+  }
+  state.SetBytesProcessed(state.iterations() * data.size() * 16);
+  state.SetLabel(Hasher::EngineName(engine));
+}
+BENCHMARK(BM_HasherStreaming)->DenseRange(Hasher::kXXH3, Hasher::kCRC32C);
+
+static void BM_ZipfNextN(benchmark::State& state) {
+  ZipfianGenerator zipf(0, state.range(0));
+  Xoroshiro128p gen(1);
+  vector<uint64_t> vals(1024);
+  while (state.KeepRunning()) {
+    zipf.NextN(gen, absl::MakeSpan(vals));
+    benchmark::DoNotOptimize(vals.data());
+  }
+  state.SetItemsProcessed(state.iterations() * vals.size());
+}
+BENCHMARK(BM_ZipfNextN)->Arg(1000)->Arg(1000000000);
+
 }  // namespace base
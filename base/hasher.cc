@@ -0,0 +1,246 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+// Hasher is implemented separately from hash.cc, which includes xxhash in the inline mode
+// and its XXH3 state type differs from the one used by hash.h.
+
+#include <string.h>
+
+#include <cassert>
+#include <limits>
+#include <new>
+
+#include "base/cpu_features.h"
+#include "base/hash.h"
+#include "base/io_buf.h"
+#include "base/logging.h"
+
+#ifdef __x86_64__
+// AES-NI and SSE4.2 code is compiled for the target explicitly and is called only if the cpu
+// supports it, so the rest of the binary does not require these extensions.
+#define HASHER_X86 1
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("aes,sse4.2"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("aes,sse4.2")
+#endif
+
+#include <nmmintrin.h>
+
+#include "base/aquahash.h"
+
+namespace base {
+namespace {
+
+static_assert(sizeof(AquaHash) <= 160);
+
+void AquaInit(void* dest, uint64_t seed) {
+  new (dest) AquaHash(_mm_set_epi64x(0, seed));
+}
+
+void AquaUpdate(void* state, const void* data, size_t len) {
+  reinterpret_cast<AquaHash*>(state)->Update(reinterpret_cast<const uint8_t*>(data), len);
+}
+
+uint64_t AquaDigest(const void* state) {
+  AquaHash copy = *reinterpret_cast<const AquaHash*>(state);
+  return _mm_cvtsi128_si64(copy.Finalize());
+}
+
+uint64_t AquaOneShot(const void* data, size_t len, uint64_t seed) {
+  return _mm_cvtsi128_si64(
+      AquaHash::Hash(reinterpret_cast<const uint8_t*>(data), len, _mm_set_epi64x(0, seed)));
+}
+
+uint32_t Crc32cHw(uint32_t crc, const uint8_t* p, size_t len) {
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    crc = _mm_crc32_u64(crc, v);
+  }
+  for (; len; ++p, --len)
+    crc = _mm_crc32_u8(crc, *p);
+  return crc;
+}
+
+}  // namespace
+}  // namespace base
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+
+#else
+#define HASHER_X86 0
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+namespace base {
+
+namespace {
+
+struct Crc32cTable {
+  uint32_t t[256];
+
+  Crc32cTable() {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t crc = i;
+      for (unsigned j = 0; j < 8; ++j)
+        crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+      t[i] = crc;
+    }
+  }
+};
+
+uint32_t Crc32cSw(uint32_t crc, const uint8_t* p, size_t len) {
+  static const Crc32cTable table;
+  for (; len; ++p, --len)
+    crc = table.t[(crc ^ *p) & 0xFF] ^ (crc >> 8);
+  return crc;
+}
+
+// Updates the running (inverted) crc.
+uint32_t Crc32cUpdate(uint32_t crc, const uint8_t* p, size_t len) {
+#if HASHER_X86
+  static const CpuDispatch<uint32_t(uint32_t, const uint8_t*, size_t)> impl{
+      {CpuLevel::kSSE42, Crc32cHw}, {CpuLevel::kGeneric, Crc32cSw}};
+  return impl(crc, p, len);
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    crc = __crc32cd(crc, v);
+  }
+  for (; len; ++p, --len)
+    crc = __crc32cb(crc, *p);
+  return crc;
+#else
+  return Crc32cSw(crc, p, len);
+#endif
+}
+
+}  // namespace
+
+Hasher::Hasher(Engine engine, uint64_t seed) : engine_(engine), seed_(seed) {
+  if (engine_ == kAuto)
+    engine_ = BestEngine();
+  CHECK(IsSupported(engine_)) << "Unsupported hash engine " << EngineName(engine_);
+  Reset();
+}
+
+bool Hasher::IsSupported(Engine engine) {
+  switch (engine) {
+    case kAuto:
+    case kXXH3:
+    case kCRC32C:
+      return true;
+    case kAquaHash:
+#if HASHER_X86
+      static const bool has_aes = GetCpuFeatures().has_aes;
+      return has_aes;
+#else
+      return false;
+#endif
+  }
+  return false;
+}
+
+auto Hasher::BestEngine() -> Engine {
+  // AquaHash processes 64 bytes per 4 AES rounds and is several times faster than XXH3
+  // for inputs above 64 bytes, see BM_Hasher.
+  return IsSupported(kAquaHash) ? kAquaHash : kXXH3;
+}
+
+const char* Hasher::EngineName(Engine engine) {
+  switch (engine) {
+    case kAuto:
+      return "auto";
+    case kXXH3:
+      return "xxh3";
+    case kAquaHash:
+      return "aquahash";
+    case kCRC32C:
+      return "crc32c";
+  }
+  return "unknown";
+}
+
+uint64_t Hasher::Hash(Engine engine, const void* data, size_t len, uint64_t seed) {
+  if (engine == kAuto)
+    engine = BestEngine();
+  CHECK(IsSupported(engine)) << "Unsupported hash engine " << EngineName(engine);
+
+  switch (engine) {
+    case kXXH3:
+      return XXH3_64bits_withSeed(data, len, seed);
+    case kCRC32C:
+      return ~Crc32cUpdate(~uint32_t(seed), reinterpret_cast<const uint8_t*>(data), len);
+#if HASHER_X86
+    case kAquaHash:
+      return AquaOneShot(data, len, seed);
+#endif
+    default:
+      break;
+  }
+
+  Hasher hasher(engine, seed);
+  hasher.Update(data, len);
+  return hasher.Digest();
+}
+
+void Hasher::Reset() {
+  switch (engine_) {
+    case kCRC32C:
+      crc_ = ~uint32_t(seed_);
+      break;
+#if HASHER_X86
+    case kAquaHash:
+      AquaInit(aqua_, seed_);
+      break;
+#endif
+    default:
+      XXH3_64bits_reset_withSeed(&xxh3_, seed_);
+  }
+}
+
+void Hasher::Update(const void* data, size_t len) {
+  switch (engine_) {
+    case kCRC32C:
+      crc_ = Crc32cUpdate(crc_, reinterpret_cast<const uint8_t*>(data), len);
+      break;
+#if HASHER_X86
+    case kAquaHash:
+      AquaUpdate(aqua_, data, len);
+      break;
+#endif
+    default:
+      XXH3_64bits_update(&xxh3_, data, len);
+  }
+}
+
+void Hasher::Update(const IoBuf& buf) {
+  IoBuf::ConstBytes bytes = buf.InputBuffer();
+  Update(bytes.data(), bytes.size());
+}
+
+uint64_t Hasher::Digest() const {
+  switch (engine_) {
+    case kCRC32C:
+      return ~crc_;
+#if HASHER_X86
+    case kAquaHash:
+      return AquaDigest(aqua_);
+#endif
+    default:
+      return XXH3_64bits_digest(&xxh3_);
+  }
+}
+
+}  // namespace base
@@ -0,0 +1,235 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "base/heap_sampler.h"
+
+#include <absl/debugging/stacktrace.h>
+#include <absl/debugging/symbolize.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_format.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+namespace base {
+
+using namespace std;
+
+namespace {
+
+constexpr unsigned kMaxDepth = 24;
+constexpr unsigned kSlotBits = 14;
+constexpr unsigned kNumSlots = 1u << kSlotBits;
+
+// Keeps the load factor of the open addressing table at most 1/2.
+constexpr unsigned kMaxSamples = kNumSlots / 2;
+
+// The disabled sampler rechecks the rate every that many allocated bytes.
+constexpr int64_t kDisabledRecheck = 1 << 20;
+
+struct Sample {
+  void* ptr;  // nullptr for an empty slot.
+  size_t size;
+  double weight;  // the number of allocations the sample represents.
+  uint32_t depth;
+  void* pc[kMaxDepth];
+};
+
+// Neither the mutex nor the table allocate with operator new, hence the allocation hooks
+// can use them.
+mutex sample_mu;
+Sample* slots = nullptr;
+HeapSampler::Stats stats;
+
+__attribute__((tls_model("initial-exec"))) thread_local uint64_t tl_rand = 0;
+
+unsigned SlotIndex(const void* ptr) {
+  return (uint64_t(uintptr_t(ptr) >> 3) * 0x9E3779B97F4A7C15ULL) >> (64 - kSlotBits);
+}
+
+// Draws the number of bytes until the next sample from the exponential distribution,
+// so that the samples form a poisson process over the allocated bytes.
+int64_t NextInterval(size_t rate) {
+  if (tl_rand == 0)
+    tl_rand = uintptr_t(&tl_rand) ^ 0x2545F4914F6CDD1DULL;
+
+  // xorshift64.
+  tl_rand ^= tl_rand << 13;
+  tl_rand ^= tl_rand >> 7;
+  tl_rand ^= tl_rand << 17;
+  double u = double((tl_rand >> 11) + 1) / double(1ULL << 53);  // in (0, 1].
+  return int64_t(-log(u) * rate) + 1;
+}
+
+string SymbolizedStack(const string& key, absl::flat_hash_map<void*, string>* symbols) {
+  size_t depth = key.size() / sizeof(void*);
+  string res;
+  for (size_t i = depth; i > 0; --i) {
+    void* pc;
+    memcpy(&pc, key.data() + (i - 1) * sizeof(void*), sizeof(pc));
+    auto [it, inserted] = symbols->try_emplace(pc);
+    if (inserted) {
+      char buf[1024];
+      if (absl::Symbolize(pc, buf, sizeof(buf))) {
+        it->second = buf;
+
+        // ';' separates the frames and ' ' the counts in the folded format.
+        replace(it->second.begin(), it->second.end(), ';', ':');
+        replace(it->second.begin(), it->second.end(), ' ', '_');
+      } else {
+        it->second = absl::StrFormat("%p", pc);
+      }
+    }
+    if (!res.empty())
+      res.push_back(';');
+    res.append(it->second);
+  }
+  return res.empty() ? "unknown" : res;
+}
+
+}  // namespace
+
+atomic_size_t HeapSampler::rate_{0};
+atomic_uint32_t HeapSampler::live_{0};
+atomic_uint16_t HeapSampler::filter_[1u << kFilterBits];
+thread_local int64_t HeapSampler::tl_until_sample_ __attribute__((tls_model("initial-exec"))) = 0;
+
+void HeapSampler::SetSamplingRate(size_t bytes) {
+  lock_guard lk(sample_mu);
+  if (bytes && !slots) {
+    slots = static_cast<Sample*>(calloc(kNumSlots, sizeof(Sample)));
+    if (!slots)
+      return;
+  }
+  rate_.store(bytes, memory_order_relaxed);
+}
+
+void HeapSampler::RecordSlow(void* ptr, size_t size) {
+  size_t rate = rate_.load(memory_order_relaxed);
+  if (rate == 0) {
+    tl_until_sample_ = kDisabledRecheck;
+    return;
+  }
+  tl_until_sample_ = NextInterval(rate);
+  if (!ptr)
+    return;
+
+  // Captured outside of the lock, skips RecordSlow and the allocation function.
+  void* pc[kMaxDepth];
+  int depth = absl::GetStackTrace(pc, kMaxDepth, 2);
+
+  lock_guard lk(sample_mu);
+  ++stats.sampled;
+  if (stats.live >= kMaxSamples) {
+    ++stats.dropped;
+    return;
+  }
+
+  unsigned index = SlotIndex(ptr);
+  while (slots[index].ptr)
+    index = (index + 1) % kNumSlots;
+
+  Sample& sample = slots[index];
+  sample.ptr = ptr;
+  sample.size = size;
+  sample.weight = 1.0 / (1.0 - exp(-double(size) / rate));
+  sample.depth = max(depth, 0);
+  memcpy(sample.pc, pc, sample.depth * sizeof(void*));
+
+  ++stats.live;
+  filter_[FilterIndex(ptr)].fetch_add(1, memory_order_relaxed);
+  live_.fetch_add(1, memory_order_relaxed);
+}
+
+void HeapSampler::RemoveSlow(void* ptr) {
+  lock_guard lk(sample_mu);
+  if (!slots)
+    return;
+
+  unsigned index = SlotIndex(ptr);
+  for (; slots[index].ptr != ptr; index = (index + 1) % kNumSlots) {
+    if (!slots[index].ptr)
+      return;  // a filter collision.
+  }
+
+  filter_[FilterIndex(ptr)].fetch_sub(1, memory_order_relaxed);
+  live_.fetch_sub(1, memory_order_relaxed);
+  --stats.live;
+
+  // Backward shift deletion, moves up the entries whose probe sequence passes the hole.
+  unsigned hole = index;
+  for (unsigned next = (hole + 1) % kNumSlots; slots[next].ptr; next = (next + 1) % kNumSlots) {
+    unsigned home = SlotIndex(slots[next].ptr);
+    if ((next - home) % kNumSlots >= (next - hole) % kNumSlots) {
+      slots[hole] = slots[next];
+      hole = next;
+    }
+  }
+  slots[hole].ptr = nullptr;
+}
+
+auto HeapSampler::GetProfile() -> Profile {
+  // Copies the samples under the lock without allocating, since the allocation hooks lock it.
+  vector<Sample> samples;
+  samples.reserve(kMaxSamples);
+  {
+    lock_guard lk(sample_mu);
+    if (slots) {
+      for (unsigned i = 0; i < kNumSlots; ++i) {
+        if (slots[i].ptr)
+          samples.push_back(slots[i]);
+      }
+    }
+  }
+
+  Profile res;
+  for (const Sample& sample : samples) {
+    string key(reinterpret_cast<const char*>(sample.pc), sample.depth * sizeof(void*));
+    Site& site = res[key];
+    ++site.samples;
+    site.bytes += sample.size;
+    site.est_count += llround(sample.weight);
+    site.est_bytes += llround(sample.weight * sample.size);
+  }
+  return res;
+}
+
+string HeapSampler::FoldedStacks(const Profile& profile) {
+  absl::flat_hash_map<void*, string> symbols;
+  string res;
+  for (const auto& [key, site] : profile) {
+    absl::StrAppend(&res, SymbolizedStack(key, &symbols), " ", site.est_bytes, "\n");
+  }
+  return res;
+}
+
+string HeapSampler::FoldedDiff(const Profile& base, const Profile& profile) {
+  absl::flat_hash_map<void*, string> symbols;
+  string res;
+  for (const auto& [key, site] : profile) {
+    auto it = base.find(key);
+    uint64_t base_bytes = it == base.end() ? 0 : it->second.est_bytes;
+    if (base_bytes != site.est_bytes) {
+      absl::StrAppend(&res, SymbolizedStack(key, &symbols), " ", base_bytes, " ", site.est_bytes,
+                      "\n");
+    }
+  }
+
+  for (const auto& [key, site] : base) {
+    if (!profile.contains(key))
+      absl::StrAppend(&res, SymbolizedStack(key, &symbols), " ", site.est_bytes, " 0\n");
+  }
+  return res;
+}
+
+auto HeapSampler::GetStats() -> Stats {
+  lock_guard lk(sample_mu);
+  return stats;
+}
+
+}  // namespace base
@@ -0,0 +1,100 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/base/optimization.h>
+#include <absl/container/flat_hash_map.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace base {
+
+// Samples live heap allocations together with their stacks, in the spirit of the tcmalloc
+// heap profiler. The allocator hooks, see util/http/heap_sampling_new_delete.h, report
+// every allocation with OnAlloc and every deallocation with OnFree. On average, one
+// allocation is sampled per sampling_rate allocated bytes, so larger allocations are more
+// likely to be sampled. Sampled allocations stay in a fixed-size table until they are freed.
+// OnFree of an unsampled pointer costs a single relaxed load of a counting filter in the
+// common case. Sampling is disabled by default.
+class HeapSampler {
+ public:
+  struct Site {
+    uint64_t samples = 0;  // live sampled allocations.
+    uint64_t bytes = 0;    // requested bytes of the samples.
+
+    // Unbiased estimates of the live allocations and bytes that the samples represent.
+    uint64_t est_count = 0;
+    uint64_t est_bytes = 0;
+  };
+
+  // Maps the raw program counters of an allocation stack, leaf first, to its site.
+  using Profile = absl::flat_hash_map<std::string, Site>;
+
+  struct Stats {
+    uint64_t sampled = 0;  // allocations sampled since the start.
+    uint64_t live = 0;     // sampled allocations not freed yet.
+    uint64_t dropped = 0;  // samples lost because the table was full.
+  };
+
+  // Average number of allocated bytes between two samples, 0 disables sampling.
+  // Freeing the allocations that are already sampled updates the table even when disabled.
+  static void SetSamplingRate(size_t bytes);
+
+  static size_t sampling_rate() {
+    return rate_.load(std::memory_order_relaxed);
+  }
+
+  static void OnAlloc(void* ptr, size_t size) {
+    tl_until_sample_ -= int64_t(size);
+    if (ABSL_PREDICT_FALSE(tl_until_sample_ < 0))
+      RecordSlow(ptr, size);
+  }
+
+  static void OnFree(void* ptr) {
+    if (ABSL_PREDICT_TRUE(live_.load(std::memory_order_relaxed) == 0))
+      return;
+    if (filter_[FilterIndex(ptr)].load(std::memory_order_relaxed) != 0)
+      RemoveSlow(ptr);
+  }
+
+  // Returns the live sampled allocations aggregated by stack.
+  static Profile GetProfile();
+
+  // Returns "outer_frame;...;leaf_frame bytes" lines with the estimated live bytes of each
+  // stack, i.e. the folded format of flamegraph.pl.
+  static std::string FoldedStacks(const Profile& profile);
+
+  // Returns "outer_frame;...;leaf_frame base_bytes bytes" lines, i.e. the differential
+  // format of flamegraph.pl. Lists the stacks whose estimated bytes changed from base.
+  static std::string FoldedDiff(const Profile& base, const Profile& profile);
+
+  static Stats GetStats();
+
+ private:
+  static constexpr unsigned kFilterBits = 16;
+
+  static unsigned FilterIndex(const void* ptr) {
+    // Fibonacci hashing of the pointer, allocations are at least 8 bytes aligned.
+    return (uint64_t(uintptr_t(ptr) >> 3) * 0x9E3779B97F4A7C15ULL) >> (64 - kFilterBits);
+  }
+
+  static void RecordSlow(void* ptr, size_t size);
+  static void RemoveSlow(void* ptr);
+
+  static std::atomic_size_t rate_;
+  static std::atomic_uint32_t live_;
+
+  // Counts the sampled pointers that fall into each bucket.
+  static std::atomic_uint16_t filter_[1u << kFilterBits];
+
+  // Bytes to allocate before the next sample, initial-exec so that the allocation hot path
+  // does not call __tls_get_addr.
+  static thread_local int64_t tl_until_sample_ __attribute__((tls_model("initial-exec")));
+};
+
+}  // namespace base
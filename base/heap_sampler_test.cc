@@ -0,0 +1,101 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "base/heap_sampler.h"
+
+#include <vector>
+
+#include "base/gtest.h"
+
+namespace base {
+
+using namespace std;
+
+class HeapSamplerTest : public testing::Test {
+ protected:
+  void TearDown() override {
+    HeapSampler::SetSamplingRate(0);
+  }
+
+  // The sampler does not dereference the pointers, hence fake aligned addresses suffice.
+  static void* Ptr(size_t i) {
+    return reinterpret_cast<void*>(0x10000 + i * 64);
+  }
+};
+
+TEST_F(HeapSamplerTest, Disabled) {
+  uint64_t sampled = HeapSampler::GetStats().sampled;
+  for (size_t i = 0; i < 100; ++i)
+    HeapSampler::OnAlloc(Ptr(i), 1 << 20);
+  EXPECT_EQ(sampled, HeapSampler::GetStats().sampled);
+  EXPECT_TRUE(HeapSampler::GetProfile().empty());
+}
+
+TEST_F(HeapSamplerTest, LiveSamples) {
+  // A sampling rate of a byte samples practically every allocation.
+  HeapSampler::SetSamplingRate(1);
+  constexpr size_t kNum = 1000;
+
+  // Flushes the countdown of the disabled sampler.
+  HeapSampler::OnAlloc(nullptr, 1 << 21);
+  for (size_t i = 0; i < kNum; ++i)
+    HeapSampler::OnAlloc(Ptr(i), 64);
+
+  HeapSampler::Stats stats = HeapSampler::GetStats();
+  EXPECT_EQ(kNum, stats.live);
+  EXPECT_EQ(0u, stats.dropped);
+
+  HeapSampler::Profile base = HeapSampler::GetProfile();
+  ASSERT_EQ(1u, base.size());
+  const HeapSampler::Site& site = base.begin()->second;
+  EXPECT_EQ(kNum, site.samples);
+  EXPECT_EQ(kNum * 64, site.bytes);
+  EXPECT_EQ(kNum, site.est_count);
+
+  // Frees every other allocation, the others must stay reachable after the deletion shifts.
+  for (size_t i = 0; i < kNum; i += 2)
+    HeapSampler::OnFree(Ptr(i));
+  HeapSampler::OnFree(Ptr(kNum + 1));  // not sampled.
+  EXPECT_EQ(kNum / 2, HeapSampler::GetStats().live);
+
+  HeapSampler::Profile profile = HeapSampler::GetProfile();
+  ASSERT_EQ(1u, profile.size());
+  EXPECT_EQ(kNum / 2, profile.begin()->second.samples);
+
+  string diff = HeapSampler::FoldedDiff(base, profile);
+  EXPECT_NE(string::npos, diff.find(" 64000 32000\n")) << diff;
+  EXPECT_TRUE(HeapSampler::FoldedDiff(profile, profile).empty());
+
+  // Sampling rate does not affect freeing.
+  HeapSampler::SetSamplingRate(0);
+  for (size_t i = 1; i < kNum; i += 2)
+    HeapSampler::OnFree(Ptr(i));
+  EXPECT_EQ(0u, HeapSampler::GetStats().live);
+  EXPECT_TRUE(HeapSampler::GetProfile().empty());
+}
+
+TEST_F(HeapSamplerTest, Estimate) {
+  HeapSampler::SetSamplingRate(4096);
+  HeapSampler::OnAlloc(nullptr, 1 << 21);
+
+  constexpr size_t kNum = 100000;
+  vector<void*> ptrs(kNum);
+  for (size_t i = 0; i < kNum; ++i) {
+    ptrs[i] = Ptr(i);
+    HeapSampler::OnAlloc(ptrs[i], 256);
+  }
+
+  uint64_t est_bytes = 0;
+  for (const auto& [key, site] : HeapSampler::GetProfile())
+    est_bytes += site.est_bytes;
+
+  // About 6000 samples, hence the estimate is accurate within a few percent.
+  EXPECT_NEAR(double(kNum * 256), double(est_bytes), kNum * 256 * 0.1);
+
+  for (void* ptr : ptrs)
+    HeapSampler::OnFree(ptr);
+  EXPECT_EQ(0u, HeapSampler::GetStats().live);
+}
+
+}  // namespace base
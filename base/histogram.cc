@@ -201,8 +201,7 @@ void Histogram::Clear() {
 }
 
 void Histogram::Add(double value, uint32 count) {
-  auto it = upper_bound(kBucketLimit, kBucketLimit + kNumBuckets - 1, value);
-  size_t b = it - kBucketLimit;
+  size_t b = BucketIndex(value);
   if (buckets_.size() <= b) {
     buckets_.resize(absl::bit_ceil(b + 1));
   }
@@ -258,7 +257,8 @@ double Histogram::Average() const {
 double Histogram::StdDev() const {
   if (num_ == 0)
     return 0;
-  double variance = (sum_squares_ * num_ - sum_ * sum_) / (num_ * num_);
+  double n = num_;
+  double variance = (sum_squares_ * n - sum_ * sum_) / (n * n);
   return sqrt(variance);
 }
 
@@ -315,7 +315,7 @@ double Histogram::SumFirstK(unsigned bucket, ulong position) const {
 string Histogram::ToString() const {
   string r;
   char buf[300];
-  snprintf(buf, sizeof(buf), "Count: %" PRIu32 " Average: %.4f  StdDev: %.2f\n", num_, Average(),
+  snprintf(buf, sizeof(buf), "Count: %" PRIu64 " Average: %.4f  StdDev: %.2f\n", num_, Average(),
            StdDev());
   r.append(buf);
   snprintf(buf, sizeof(buf), "Min: %.4f  Median: %.4f  Max: %.4f\n", (num_ == 0 ? 0.0 : min_),
@@ -366,4 +366,107 @@ double Histogram::InterpolateVal(unsigned bucket, ulong position) const {
   return r;
 }
 
+void FixedHistogram::Clear() {
+  min_ = Histogram::kBucketLimit[kNumBuckets - 1];
+  max_ = 0;
+  num_ = 0;
+  sum_ = 0;
+  sum_squares_ = 0;
+  memset(buckets_, 0, sizeof(buckets_));
+}
+
+void FixedHistogram::Merge(const FixedHistogram& other) {
+  if (other.min_ < min_)
+    min_ = other.min_;
+  if (other.max_ > max_)
+    max_ = other.max_;
+  num_ += other.num_;
+  sum_ += other.sum_;
+  sum_squares_ += other.sum_squares_;
+
+  for (unsigned b = 0; b < kNumBuckets; ++b) {
+    buckets_[b] += other.buckets_[b];
+  }
+}
+
+double FixedHistogram::Percentile(double p) const {
+  uint64 threshold = num_ * (p / 100.0);
+  uint64 sum = 0;
+  for (unsigned b = 0; b < kNumBuckets; b++) {
+    sum += buckets_[b];
+    if (sum >= threshold) {
+      // Scale linearly within this bucket
+      uint64 left_sum = sum - buckets_[b];
+      return InterpolateVal(b, threshold - left_sum);
+    }
+  }
+  return max_;
+}
+
+double FixedHistogram::Average() const {
+  if (num_ == 0)
+    return 0;
+  return sum_ / num_;
+}
+
+double FixedHistogram::StdDev() const {
+  if (num_ == 0)
+    return 0;
+  double n = num_;
+  double variance = (sum_squares_ * n - sum_ * sum_) / (n * n);
+  return sqrt(variance);
+}
+
+string FixedHistogram::ToString() const {
+  string r;
+  char buf[300];
+  snprintf(buf, sizeof(buf), "Count: %" PRIu64 " Average: %.4f  StdDev: %.2f\n", num_, Average(),
+           StdDev());
+  r.append(buf);
+  snprintf(buf, sizeof(buf), "Min: %.4f  Median: %.4f  Max: %.4f\n", (num_ == 0 ? 0.0 : min_),
+           Median(), max_);
+  r.append(buf);
+  r.append("------------------------------------------------------\n");
+  const double mult = 100.0 / num_;
+  double sum = 0;
+
+  char to_buf[100];
+  for (unsigned b = 0; b < kNumBuckets; b++) {
+    if (buckets_[b] == 0)
+      continue;
+    sum += buckets_[b];
+    double from = (b == 0) ? 0.0 : Histogram::kBucketLimit[b - 1];
+    if (b == kNumBuckets - 1) {
+      strcpy(to_buf, "INF");
+    } else {
+      snprintf(to_buf, sizeof(to_buf), "%7.0f", Histogram::kBucketLimit[b]);
+    }
+    snprintf(buf, sizeof(buf), "[ %7.0f, %s ) %" PRIu64 " %7.3f%% %7.3f%% ",
+             from,                // left
+             to_buf,              // right
+             buckets_[b],         // count
+             mult * buckets_[b],  // percentage
+             mult * sum);         // cumulative percentage
+    r.append(buf);
+
+    // Add hash marks based on percentage; 20 marks for 100%.
+    int marks = static_cast<int>(20 * (double(buckets_[b]) / num_) + 0.5);
+    r.append(marks, '#');
+    r.push_back('\n');
+  }
+  return r;
+}
+
+double FixedHistogram::InterpolateVal(unsigned bucket, uint64 position) const {
+  auto limits = Histogram::BucketLimits(bucket);
+
+  double pos = double(position) / double(buckets_[bucket] + 1);
+  double r = limits.first + (limits.second - limits.first) * pos;
+  if (r < min_)
+    r = min_;
+  if (r > max_)
+    r = max_;
+  return r;
+}
+
 }  // namespace base
@@ -26,6 +26,9 @@ class Histogram {
 
   std::string ToString() const;
 
+  // Returns the index of the bucket that holds value. O(1).
+  static unsigned BucketIndex(double value);
+
   unsigned long count() const {
     return num_;
   }
@@ -66,14 +69,114 @@ class Histogram {
   double max_;
   double sum_;
   double sum_squares_;
-  uint32 num_;
+  uint64 num_;
 
   enum { kNumBuckets = 154 };
   static const double kBucketLimit[kNumBuckets];
 
   std::vector<uint32> buckets_;
+
+  friend class FixedHistogram;
 };
 
+// Same buckets and semantics as Histogram but with a fixed array of 64-bit counters.
+// Add() and Merge() never allocate and counters do not overflow on long-lived servers.
+// Unlike Histogram, it is large (~1.3KB), so it is designed for long-lived
+// per-thread instances that are merged periodically.
+class alignas(64) FixedHistogram {
+ public:
+  FixedHistogram() {
+    Clear();
+  }
+
+  void Clear();
+
+  void Add(double value) {
+    Add(value, 1);
+  }
+
+  void Add(double value, uint64 count) {
+    buckets_[Histogram::BucketIndex(value)] += count;
+    if (min_ > value)
+      min_ = value;
+    if (max_ < value)
+      max_ = value;
+    num_ += count;
+    sum_ += value * count;
+    sum_squares_ += (value * value) * count;
+  }
+
+  void Merge(const FixedHistogram& other);
+
+  std::string ToString() const;
+
+  uint64 count() const {
+    return num_;
+  }
+
+  double Median() const {
+    return Percentile(50.0);
+  }
+
+  // p in [0, 100].
+  double Percentile(double p) const;
+  double Average() const;
+  double StdDev() const;
+
+  double max() const {
+    return max_;
+  }
+
+  double min() const {
+    return min_;
+  }
+
+ private:
+  static constexpr unsigned kNumBuckets = Histogram::kNumBuckets;
+
+  double InterpolateVal(unsigned bucket, uint64 position) const;
+
+  double min_;
+  double max_;
+  double sum_;
+  double sum_squares_;
+  uint64 num_;
+
+  uint64 buckets_[kNumBuckets];
+};
+
+inline unsigned Histogram::BucketIndex(double value) {
+  // kBucketLimit has 10 linear buckets below 10 and then 16 buckets per decade:
+  // 1.2, 1.4, 1.6, 1.8, 2, 2.5, 3, 3.5, 4, 4.5, 5, 6, 7, 8, 9, 10 times 10^d.
+  // Returns the index of the first limit that is greater than value.
+  if (!(value < kBucketLimit[kNumBuckets - 2]))  // also handles NaN.
+    return kNumBuckets - 1;
+  if (value < 10)
+    return value < 0 ? 0 : unsigned(value);
+
+  unsigned b = 10;
+  double scale = 10;
+  while (value >= scale * 10) {
+    scale *= 10;
+    b += 16;
+  }
+
+  double m = value / scale;  // [1, 10)
+  if (m < 2)
+    b += unsigned((m - 1) * 5);
+  else if (m < 5)
+    b += 5 + unsigned((m - 2) * 2);
+  else
+    b += 11 + unsigned(m - 5);
+
+  // Fix possible rounding errors around the limits.
+  if (value >= kBucketLimit[b])
+    ++b;
+  else if (value < kBucketLimit[b - 1])
+    --b;
+  return b;
+}
+
 }  // namespace base
 
 #endif  // _BASE_HISTOGRAM_H_
@@ -34,6 +34,29 @@ TEST_F(HistogramTest, Grow) {
   LOG(INFO) << hist_.ToString();
 }
 
+TEST_F(HistogramTest, Fixed) {
+  FixedHistogram fixed;
+  for (int i = 0; i < 100000; ++i) {
+    double val = (i % 1000) * 1.37 + (i % 7) * 1e5;
+    hist_.Add(val);
+    fixed.Add(val);
+  }
+
+  EXPECT_EQ(hist_.count(), fixed.count());
+  EXPECT_DOUBLE_EQ(hist_.Average(), fixed.Average());
+  for (double p : {1.0, 10.0, 50.0, 90.0, 99.0, 99.9}) {
+    EXPECT_DOUBLE_EQ(hist_.Percentile(p), fixed.Percentile(p)) << p;
+  }
+
+  FixedHistogram other;
+  other.Add(5, 3000000000);
+  other.Add(5, 3000000000);
+  fixed.Merge(other);
+  EXPECT_EQ(100000 + 6000000000ULL, fixed.count());
+  EXPECT_GE(fixed.Median(), 5);
+  EXPECT_LT(fixed.Median(), 6);
+}
+
 #if 0
 TEST_F(HistogramTest, FewNumbers) {
   for (int i = 0; i < 3; ++i) {
@@ -6,6 +6,8 @@
 
 #ifdef USE_ABSL_LOG
 #include <absl/log/initialize.h>
+
+#include "base/async_log_sink.h"
 #endif
 
 #include <atomic>
@@ -13,9 +15,19 @@
 
 #include "absl/debugging/failure_signal_handler.h"
 #include "absl/debugging/symbolize.h"
+#include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
 #include "base/logging.h"
 
+#ifdef USE_ABSL_LOG
+ABSL_FLAG(bool, log_async, false,
+          "If true, log lines are written to stderr by a background thread. "
+          "See base/async_log_sink.h");
+ABSL_FLAG(uint32_t, log_site_lines_per_sec, 1000,
+          "With --log_async, the maximal number of lines per second logged by a call site. "
+          "0 disables the limit");
+#endif
+
 // This overrides glibc's default assert handler in debug builds so
 // we can get a stack trace.
 #ifndef NDEBUG
@@ -63,6 +75,11 @@ MainInitGuard::MainInitGuard(int* argc, char*** argv, uint32_t flags) {
   absl::ParseCommandLine(*argc, *argv);
 #ifdef USE_ABSL_LOG
   absl::InitializeLog();
+  if (absl::GetFlag(FLAGS_log_async)) {
+    base::AsyncLogSink::Options opts;
+    opts.lines_per_sec = absl::GetFlag(FLAGS_log_site_lines_per_sec);
+    base::AsyncLogSink::Install(opts);
+  }
 #else
   if (!google::IsGoogleLoggingInitialized()) {
     google::InitGoogleLogging((*argv)[0]);
@@ -104,7 +121,9 @@ MainInitGuard::~MainInitGuard() {
     return;
 
   __internal__::ModuleInitializer::RunFtors(false);
-#ifndef USE_ABSL_LOG
+#ifdef USE_ABSL_LOG
+  base::AsyncLogSink::Uninstall();
+#else
   google::ShutdownGoogleLogging();
 #endif
 }
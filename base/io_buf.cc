@@ -6,7 +6,8 @@
 namespace base {
 
 IoBuf::~IoBuf() {
-  operator delete[](buf_, std::align_val_t{alignment_});
+  if (buf_)
+    Deallocate(buf_, capacity_);
 }
 
 void IoBuf::ConsumeInput(size_t sz) {
@@ -41,7 +42,7 @@ void IoBuf::Reserve(size_t sz) {
     return;
 
   sz = absl::bit_ceil(sz);
-  uint8_t* nb = new (std::align_val_t{alignment_}) uint8_t[sz];
+  uint8_t* nb = Allocate(sz);
   if (buf_) {
     if (size_ > offs_) {
       memcpy(nb, buf_ + offs_, size_ - offs_);
@@ -50,14 +51,28 @@ void IoBuf::Reserve(size_t sz) {
     } else {
       size_ = offs_ = 0;
     }
-    ::operator delete[](buf_, std::align_val_t{alignment_});
+    Deallocate(buf_, capacity_);
   }
 
   buf_ = nb;
   capacity_ = sz;
 }
 
+uint8_t* IoBuf::Allocate(size_t sz) {
+  if (mr_)
+    return static_cast<uint8_t*>(mr_->allocate(sz, alignment_));
+  return new (std::align_val_t{alignment_}) uint8_t[sz];
+}
+
+void IoBuf::Deallocate(uint8_t* buf, size_t sz) {
+  if (mr_)
+    mr_->deallocate(buf, sz, alignment_);
+  else
+    ::operator delete[](buf, std::align_val_t{alignment_});
+}
+
 void IoBuf::Swap(IoBuf& other) {
+  std::swap(mr_, other.mr_);
   std::swap(buf_, other.buf_);
   std::swap(offs_, other.offs_);
   std::swap(size_, other.size_);
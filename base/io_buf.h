@@ -8,6 +8,8 @@
 
 #include <cstring>
 
+#include "base/pmr/memory_resource.h"
+
 namespace base {
 
 // Generic buffer for reads and writes.
@@ -27,6 +29,12 @@ class IoBuf {
     Reserve(capacity);
   }
 
+  // Allocates the buffer from mr, e.g. to account it to a connection.
+  // Reserve throws std::bad_alloc if mr refuses to grow the buffer.
+  IoBuf(size_t capacity, PMR_NS::memory_resource* mr) : mr_(mr) {
+    Reserve(capacity);
+  }
+
   IoBuf(const IoBuf&) = delete;
   IoBuf& operator=(const IoBuf&) = delete;
 
@@ -127,6 +135,10 @@ class IoBuf {
  private:
   void Swap(IoBuf& other);
 
+  uint8_t* Allocate(size_t sz);
+  void Deallocate(uint8_t* buf, size_t sz);
+
+  PMR_NS::memory_resource* mr_ = nullptr;  // operator new if null.
   uint8_t* buf_ = nullptr;
   size_t offs_ = 0;
   size_t size_ = 0;
@@ -38,7 +38,9 @@ Minor changes by Roman Gershman (romange@gmail.com)
 
 namespace base {
 
-template <typename T> class mpmc_bounded_queue {
+// PadCells aligns each cell to a cache line, so that producers and consumers working on the
+// neighbouring cells do not share cache lines. It costs memory for small T.
+template <typename T, bool PadCells = false> class mpmc_bounded_queue {
  public:
   using item_type = T;
 
@@ -79,6 +81,13 @@ template <typename T> class mpmc_bounded_queue {
     return dif < 0;
   }
 
+  // Number of the enqueued items, may be stale by the time it returns.
+  size_t size_approx() const {
+    size_t deq = dequeue_pos_.load(std::memory_order_relaxed);
+    size_t enq = enqueue_pos_.load(std::memory_order_relaxed);
+    return enq > deq ? enq - deq : 0;
+  }
+
   // It's super important to leave try_enqueue as a template function of free type U.
   // Otherwise, moveable objects of different from T type (i.e. U) that can be
   // moved into T will be moved regardless if try_enqueue succeeds.
@@ -107,6 +116,76 @@ template <typename T> class mpmc_bounded_queue {
     return true;
   }
 
+  // Enqueues up to count items starting at first, claiming their cells with a single CAS.
+  // Returns the number of enqueued items, which is less than count if the queue has less free
+  // cells. Only the enqueued items are moved from.
+  template <typename It> size_t try_enqueue_bulk(It first, size_t count) {
+    size_t pos, n;
+
+    while (true) {
+      pos = enqueue_pos_.load(std::memory_order_relaxed);
+      intptr_t dif = 0;
+      for (n = 0; n < count; ++n) {
+        size_t seq = buffer_[(pos + n) & buffer_mask_].sequence.load(std::memory_order_acquire);
+        dif = intptr_t(seq) - intptr_t(pos + n);
+        if (dif != 0)
+          break;
+      }
+
+      if (n == 0) {
+        if (dif < 0 || count == 0)
+          return 0;  // the queue is full.
+        continue;    // another producer advanced the index.
+      }
+
+      if (enqueue_pos_.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed))
+        break;
+    }
+
+    for (size_t i = 0; i < n; ++i, ++first) {
+      cell_t* cell = &buffer_[(pos + i) & buffer_mask_];
+      new (&cell->storage) T(std::move(*first));
+      cell->sequence.store(pos + i + 1, std::memory_order_release);
+    }
+    return n;
+  }
+
+  // Dequeues up to count items into dest, claiming their cells with a single CAS.
+  // dest is an output iterator, e.g. a pointer to an array of T.
+  // Returns the number of dequeued items.
+  template <typename OutIt> size_t try_dequeue_bulk(OutIt dest, size_t count) {
+    size_t pos, n;
+
+    while (true) {
+      pos = dequeue_pos_.load(std::memory_order_relaxed);
+      intptr_t dif = 0;
+      for (n = 0; n < count; ++n) {
+        size_t seq = buffer_[(pos + n) & buffer_mask_].sequence.load(std::memory_order_acquire);
+        dif = intptr_t(seq) - intptr_t(pos + n + 1);
+        if (dif != 0)
+          break;
+      }
+
+      if (n == 0) {
+        if (dif < 0 || count == 0)
+          return 0;  // the queue is empty.
+        continue;    // another consumer advanced the index.
+      }
+
+      if (dequeue_pos_.compare_exchange_weak(pos, pos + n, std::memory_order_relaxed))
+        break;
+    }
+
+    for (size_t i = 0; i < n; ++i, ++dest) {
+      cell_t* cell = &buffer_[(pos + i) & buffer_mask_];
+      T& src = reinterpret_cast<T&>(cell->storage);
+      *dest = std::move(src);
+      src.~T();
+      cell->sequence.store(pos + i + buffer_mask_ + 1, std::memory_order_release);
+    }
+    return n;
+  }
+
   bool try_dequeue(T& data) {
     cell_t* cell;
     size_t pos;
@@ -151,7 +230,7 @@ template <typename T> class mpmc_bounded_queue {
 
  private:
   struct cell_t {
-    std::atomic<size_t> sequence;
+    alignas(PadCells ? 64 : alignof(std::atomic<size_t>)) std::atomic<size_t> sequence;
     std::aligned_storage_t<sizeof(T)> storage;
   };
 
@@ -5,6 +5,8 @@
 #include "base/mpmc_bounded_queue.h"
 
 #include <memory>
+#include <thread>
+#include <vector>
 
 #include "base/gtest.h"
 #include "base/logging.h"
@@ -113,4 +115,131 @@ TEST_F(MPMCTest, Moveable) {
   EXPECT_EQ(0, Moveable::ref);
 }
 
+TEST_F(MPMCTest, Bulk) {
+  mpmc_bounded_queue<int> q(8);
+  int src[10] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
+  EXPECT_EQ(5u, q.try_enqueue_bulk(src, 5));
+  EXPECT_EQ(3u, q.try_enqueue_bulk(src + 5, 5));
+  EXPECT_TRUE(q.is_full());
+  EXPECT_EQ(0u, q.try_enqueue_bulk(src + 8, 2));
+
+  int dest[10];
+  EXPECT_EQ(2u, q.try_dequeue_bulk(dest, 2));
+  EXPECT_EQ(6u, q.try_dequeue_bulk(dest + 2, 10));
+  for (int i = 0; i < 8; ++i)
+    EXPECT_EQ(i, dest[i]);
+  EXPECT_TRUE(q.empty());
+  EXPECT_EQ(0u, q.try_dequeue_bulk(dest, 10));
+
+  // Wraps around the buffer and interleaves with the single item calls.
+  EXPECT_EQ(6u, q.try_enqueue_bulk(src, 6));
+  int val = 0;
+  ASSERT_TRUE(q.try_dequeue(val));
+  EXPECT_EQ(0, val);
+  EXPECT_EQ(5u, q.try_dequeue_bulk(dest, 10));
+  EXPECT_EQ(5, dest[4]);
+}
+
+TEST_F(MPMCTest, BulkMoveable) {
+  mpmc_bounded_queue<Moveable, true> queue(4);
+  {
+    vector<Moveable> src(6);
+    EXPECT_EQ(4u, queue.try_enqueue_bulk(src.begin(), src.size()));
+    EXPECT_EQ(10, Moveable::ref);
+  }
+  EXPECT_EQ(4, Moveable::ref);
+
+  vector<Moveable> dest;
+  EXPECT_EQ(4u, queue.try_dequeue_bulk(back_inserter(dest), 8));
+  EXPECT_EQ(4, Moveable::ref);
+  dest.clear();
+  EXPECT_EQ(0, Moveable::ref);
+}
+
+TEST_F(MPMCTest, BulkMT) {
+  constexpr unsigned kProducers = 4, kItems = 100000, kBatch = 7;
+  mpmc_bounded_queue<uint64_t, true> q(256);
+
+  vector<thread> producers;
+  for (unsigned p = 0; p < kProducers; ++p) {
+    producers.emplace_back([&, p] {
+      uint64_t items[kBatch];
+      for (unsigned i = 0; i < kItems;) {
+        unsigned n = min(kBatch, kItems - i);
+        for (unsigned j = 0; j < n; ++j)
+          items[j] = uint64_t(p) << 32 | (i + j);
+        for (size_t added = 0; added < n;) {
+          size_t res = q.try_enqueue_bulk(items + added, n - added);
+          if (res == 0)
+            this_thread::yield();
+          added += res;
+        }
+        i += n;
+      }
+    });
+  }
+
+  // The items of each producer are dequeued in order.
+  vector<uint32_t> next(kProducers, 0);
+  uint64_t items[16];
+  for (size_t total = 0; total < kProducers * kItems;) {
+    size_t n = q.try_dequeue_bulk(items, 16);
+    if (n == 0)
+      this_thread::yield();
+    for (size_t i = 0; i < n; ++i) {
+      unsigned p = items[i] >> 32;
+      ASSERT_EQ(next[p], uint32_t(items[i]));
+      ++next[p];
+    }
+    total += n;
+  }
+
+  for (auto& t : producers)
+    t.join();
+}
+
+template <bool Pad, bool Bulk> void BM_Contended(benchmark::State& state) {
+  constexpr unsigned kItems = 1 << 16, kBatch = 8;
+  unsigned num_producers = state.range(0);
+
+  while (state.KeepRunning()) {
+    state.PauseTiming();
+    mpmc_bounded_queue<uint64_t, Pad> q(256);
+    atomic_bool start{false};
+    vector<thread> producers;
+    for (unsigned p = 0; p < num_producers; ++p) {
+      producers.emplace_back([&] {
+        while (!start.load(memory_order_acquire)) {
+        }
+        uint64_t items[kBatch] = {0};
+        for (unsigned i = 0; i < kItems;) {
+          size_t n = Bulk ? q.try_enqueue_bulk(items, kBatch) : q.try_enqueue(i);
+          if (n == 0)
+            this_thread::yield();
+          i += n;
+        }
+      });
+    }
+    state.ResumeTiming();
+
+    start.store(true, memory_order_release);
+    uint64_t items[kBatch];
+    for (size_t total = 0; total < num_producers * kItems;) {
+      size_t n = Bulk ? q.try_dequeue_bulk(items, kBatch) : q.try_dequeue(items[0]);
+      if (n == 0)
+        this_thread::yield();
+      total += n;
+    }
+
+    state.PauseTiming();
+    for (auto& t : producers)
+      t.join();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * num_producers * kItems);
+}
+BENCHMARK_TEMPLATE(BM_Contended, false, false)->Arg(1)->Arg(4)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Contended, true, false)->Arg(1)->Arg(4)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_Contended, true, true)->Arg(1)->Arg(4)->UseRealTime();
+
 }  // namespace base
@@ -70,6 +70,11 @@ template <typename T> class MPSCIntrusiveQueue {
     return nullptr;
   }
 
+  // Pops the items one by one and calls cb on each in FIFO order until the queue is empty.
+  // Waits for the pushes that are in the middle of linking their item.
+  // Returns the number of popped items.
+  template <typename F> size_t PopAll(F&& cb) noexcept(noexcept(cb(std::declval<T*>())));
+
   // Returns an item at the head if exists and a status whether the queue is empty.
   // There can be a state where the queue is in the middle of Push transaction
   // and Pop can not pull the element yet. In that case, PopWeak returns {null, false}.
@@ -84,6 +89,34 @@ template <typename T> class MPSCIntrusiveQueue {
   }
 };
 
+template <typename T>
+template <typename F>
+size_t MPSCIntrusiveQueue<T>::PopAll(F&& cb) noexcept(noexcept(cb(std::declval<T*>()))) {
+  size_t count = 0;
+  while (true) {
+    auto [elem, empty] = PopWeak();
+    if (elem) {
+      // Loading the next item is likely a cache miss, since a producer wrote it on another CPU,
+      // so we overlap it with cb.
+      __builtin_prefetch(head_);
+      cb(elem);
+      ++count;
+      continue;
+    }
+
+    if (empty)
+      break;
+
+    // A producer is between the exchange and the linking of its item, see Push.
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+  }
+  return count;
+}
+
 template <typename T> std::pair<T*, bool> MPSCIntrusiveQueue<T>::PopWeak() noexcept {
   // Unlike with tail_, this is the only thread that touches head_
   T* head = head_;
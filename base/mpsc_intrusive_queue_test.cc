@@ -4,6 +4,9 @@
 #include "base/mpsc_intrusive_queue.h"
 
 #include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
 
 #include "base/gtest.h"
 #include "base/logging.h"
@@ -14,6 +17,8 @@ namespace base {
 
 struct TestNode {
   std::atomic<TestNode*> next{nullptr};
+  unsigned producer = 0;
+  unsigned seq = 0;
 };
 
 void MPSC_intrusive_store_next(TestNode* dest, TestNode* next_node) {
@@ -48,4 +53,105 @@ TEST_F(MPSCTest, Basic) {
   EXPECT_TRUE(q_.Pop() == nullptr);
 }
 
+TEST_F(MPSCTest, PopAll) {
+  EXPECT_EQ(0u, q_.PopAll([](TestNode*) {}));
+
+  TestNode nodes[5];
+  for (auto& n : nodes)
+    q_.Push(&n);
+
+  vector<TestNode*> popped;
+  EXPECT_EQ(5u, q_.PopAll([&](TestNode* n) { popped.push_back(n); }));
+  ASSERT_EQ(5u, popped.size());
+  for (unsigned i = 0; i < 5; ++i)
+    EXPECT_EQ(&nodes[i], popped[i]);
+  EXPECT_TRUE(q_.Empty());
+
+  // The queue stays usable after it was drained.
+  q_.Push(&nodes[0]);
+  EXPECT_EQ(&nodes[0], q_.Pop());
+  EXPECT_TRUE(q_.Pop() == nullptr);
+}
+
+TEST_F(MPSCTest, PopAllMT) {
+  constexpr unsigned kProducers = 4, kItems = 100000;
+  vector<unique_ptr<TestNode[]>> nodes;
+  for (unsigned p = 0; p < kProducers; ++p)
+    nodes.emplace_back(new TestNode[kItems]);
+  vector<thread> producers;
+  for (unsigned p = 0; p < kProducers; ++p) {
+    producers.emplace_back([&, p] {
+      for (unsigned i = 0; i < kItems; ++i) {
+        nodes[p][i].producer = p;
+        nodes[p][i].seq = i;
+        q_.Push(&nodes[p][i]);
+      }
+    });
+  }
+
+  // The items of each producer are popped in the order they were pushed.
+  vector<unsigned> next_seq(kProducers, 0);
+  size_t total = 0;
+  while (total < kProducers * kItems) {
+    total += q_.PopAll([&](TestNode* n) {
+      ASSERT_EQ(next_seq[n->producer], n->seq);
+      ++next_seq[n->producer];
+    });
+  }
+
+  for (auto& t : producers)
+    t.join();
+  EXPECT_EQ(kProducers * kItems, total);
+  EXPECT_TRUE(q_.Empty());
+}
+
+void BM_PopAll(benchmark::State& state) {
+  MPSCIntrusiveQueue<TestNode> q;
+  vector<TestNode> nodes(state.range(0));
+  while (state.KeepRunning()) {
+    for (auto& n : nodes)
+      q.Push(&n);
+    benchmark::DoNotOptimize(q.PopAll([](TestNode* n) { benchmark::DoNotOptimize(n); }));
+  }
+  state.SetItemsProcessed(state.iterations() * nodes.size());
+}
+BENCHMARK(BM_PopAll)->Arg(1)->Arg(16)->Arg(256);
+
+// Remote wakeups: several producers push to a single consumer thread.
+void BM_FanIn(benchmark::State& state) {
+  constexpr unsigned kItems = 1 << 16;
+  unsigned num_producers = state.range(0);
+
+  while (state.KeepRunning()) {
+    state.PauseTiming();
+    MPSCIntrusiveQueue<TestNode> q;
+    vector<unique_ptr<TestNode[]>> nodes;
+    for (unsigned p = 0; p < num_producers; ++p)
+      nodes.emplace_back(new TestNode[kItems]);
+    atomic_bool start{false};
+    vector<thread> producers;
+    for (unsigned p = 0; p < num_producers; ++p) {
+      producers.emplace_back([&, p] {
+        while (!start.load(memory_order_acquire)) {
+        }
+        for (unsigned i = 0; i < kItems; ++i)
+          q.Push(&nodes[p][i]);
+      });
+    }
+    state.ResumeTiming();
+
+    start.store(true, memory_order_release);
+    size_t total = 0;
+    while (total < num_producers * kItems)
+      total += q.PopAll([](TestNode* n) { benchmark::DoNotOptimize(n); });
+
+    state.PauseTiming();
+    for (auto& t : producers)
+      t.join();
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * num_producers * kItems);
+}
+BENCHMARK(BM_FanIn)->Arg(1)->Arg(4)->UseRealTime();
+
 }  // namespace base
@@ -11,13 +11,16 @@ namespace base {
 static const int kBlockSize = 8192;
 using namespace std;
 
-PmrArena::PmrArena(PMR_NS::memory_resource* mr) : mr_(mr), blocks_(mr) {
+PmrArena::PmrArena(PMR_NS::memory_resource* mr) : mr_(mr), blocks_(mr), spare_blocks_(mr) {
 }
 
 PmrArena::~PmrArena() {
   for (size_t i = 0; i < blocks_.size(); i++) {
     mr_->deallocate(blocks_[i].ptr, blocks_[i].sz);
   }
+  for (char* ptr : spare_blocks_) {
+    mr_->deallocate(ptr, kBlockSize);
+  }
 }
 
 char* PmrArena::AllocateFallback(size_t bytes) {
@@ -58,17 +61,48 @@ char* PmrArena::AllocateAligned(size_t bytes) {
 }
 
 char* PmrArena::AllocateNewBlock(uint32_t block_bytes) {
-  char* result = reinterpret_cast<char*>(mr_->allocate(block_bytes));
-  blocks_memory_ += block_bytes;
+  char* result;
+  if (block_bytes == kBlockSize && !spare_blocks_.empty()) {
+    result = spare_blocks_.back();
+    spare_blocks_.pop_back();
+  } else {
+    result = reinterpret_cast<char*>(mr_->allocate(block_bytes));
+    blocks_memory_ += block_bytes;
+  }
   blocks_.push_back(Block{result, block_bytes});
   return result;
 }
 
+void PmrArena::RewindTo(const Mark& mark) {
+  assert(mark.num_blocks <= blocks_.size());
+  for (size_t i = mark.num_blocks; i < blocks_.size(); i++) {
+    if (blocks_[i].sz == kBlockSize) {
+      spare_blocks_.push_back(blocks_[i].ptr);
+    } else {
+      mr_->deallocate(blocks_[i].ptr, blocks_[i].sz);
+      blocks_memory_ -= blocks_[i].sz;
+    }
+  }
+  blocks_.resize(mark.num_blocks);
+  alloc_ptr_ = mark.alloc_ptr;
+  alloc_bytes_remaining_ = mark.alloc_bytes_remaining;
+}
+
+void PmrArena::Reset(size_t keep_blocks) {
+  RewindTo(Mark{});
+  while (spare_blocks_.size() > keep_blocks) {
+    mr_->deallocate(spare_blocks_.back(), kBlockSize);
+    blocks_memory_ -= kBlockSize;
+    spare_blocks_.pop_back();
+  }
+}
+
 void PmrArena::Swap(PmrArena& other) {
   swap(other.alloc_ptr_, alloc_ptr_);
   swap(other.alloc_bytes_remaining_, alloc_bytes_remaining_);
 
   swap(other.blocks_, blocks_);
+  swap(other.spare_blocks_, spare_blocks_);
   swap(other.blocks_memory_, blocks_memory_);
   std::swap(other.mr_, mr_);
 }
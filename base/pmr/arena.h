@@ -25,11 +25,31 @@ class PmrArena {
   // Allocate memory with the normal alignment guarantees provided by malloc
   char* AllocateAligned(size_t bytes);
 
+  // Allocation position of the arena.
+  struct Mark {
+    size_t num_blocks = 0;
+    char* alloc_ptr = nullptr;
+    size_t alloc_bytes_remaining = 0;
+  };
+
+  Mark GetMark() const {
+    return Mark{blocks_.size(), alloc_ptr_, alloc_bytes_remaining_};
+  }
+
+  // Frees everything that was allocated after mark was taken. Invalidates the marks taken
+  // after mark. Regular sized blocks are kept for reuse by the following allocations,
+  // oversized ones are returned to the memory resource.
+  void RewindTo(const Mark& mark);
+
+  // Frees all allocations and keeps up to keep_blocks regular sized blocks for reuse.
+  void Reset(size_t keep_blocks = 1);
+
   // Returns an estimate of the total memory usage of data allocated
   // by the arena (including space allocated but not yet used for user
-  // allocations).
+  // allocations and the blocks kept for reuse).
   size_t MemoryUsage() const {
-    return blocks_memory_ + blocks_.capacity() * sizeof(char*);
+    return blocks_memory_ + blocks_.capacity() * sizeof(char*) +
+           spare_blocks_.capacity() * sizeof(char*);
   }
 
   void Swap(PmrArena& other);
@@ -44,7 +64,7 @@ class PmrArena {
   char* alloc_ptr_ = nullptr;
   size_t alloc_bytes_remaining_ = 0;
 
-  // Bytes of memory in blocks allocated so far
+  // Bytes of memory in blocks allocated so far, including the spare blocks.
   size_t blocks_memory_ = 0;
 
   struct Block {
@@ -58,6 +78,9 @@ class PmrArena {
   using BlockAllocator = PMR_NS::polymorphic_allocator<Block>;
   std::vector<Block, BlockAllocator> blocks_;
 
+  // Regular sized blocks that were released by RewindTo or Reset.
+  std::vector<char*, PMR_NS::polymorphic_allocator<char*>> spare_blocks_;
+
   // No copying allowed
   PmrArena(const PmrArena&) = delete;
   void operator=(const PmrArena&) = delete;
@@ -66,4 +66,35 @@ TEST(PmrArenaTest, Simple) {
   }
 }
 
+TEST(PmrArenaTest, Rewind) {
+  PmrArena arena;
+  char* first = arena.Allocate(100);
+  PmrArena::Mark mark = arena.GetMark();
+  char* second = arena.Allocate(10);
+  for (unsigned i = 0; i < 100; ++i)
+    arena.Allocate(1000);
+  arena.Allocate(100000);
+  size_t usage = arena.MemoryUsage();
+
+  arena.RewindTo(mark);
+  EXPECT_LT(arena.MemoryUsage(), usage - 90000);
+  EXPECT_EQ(second, arena.Allocate(10));
+  EXPECT_NE(first, second);
+
+  // The blocks are reused.
+  usage = arena.MemoryUsage();
+  for (unsigned i = 0; i < 100; ++i)
+    arena.Allocate(1000);
+  EXPECT_EQ(usage, arena.MemoryUsage());
+
+  arena.Reset(2);
+  EXPECT_LT(arena.MemoryUsage(), 3 * 8192);
+  EXPECT_GE(arena.MemoryUsage(), 2 * 8192);
+  char* ptr = arena.Allocate(8000);
+  memset(ptr, 0, 8000);
+
+  arena.Reset(0);
+  EXPECT_LT(arena.MemoryUsage(), 8192);
+}
+
 }  // namespace base
@@ -0,0 +1,120 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "base/pmr/bit_array.h"
+
+#include <algorithm>
+
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
+namespace base {
+
+using namespace std;
+
+size_t CountOnes(const uint64_t* words, size_t n) {
+  // Independent accumulators, so that the popcnt instructions do not wait for each other.
+  size_t c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    c0 += absl::popcount(words[i]);
+    c1 += absl::popcount(words[i + 1]);
+    c2 += absl::popcount(words[i + 2]);
+    c3 += absl::popcount(words[i + 3]);
+  }
+  for (; i < n; ++i)
+    c0 += absl::popcount(words[i]);
+  return c0 + c1 + c2 + c3;
+}
+
+namespace {
+
+// Position of the set bit with rank k in w, which has more than k set bits.
+unsigned SelectInWord(uint64_t w, unsigned k) {
+#ifdef __BMI2__
+  return absl::countr_zero(_pdep_u64(uint64_t(1) << k, w));
+#else
+  unsigned shift = 0;
+  while (true) {
+    unsigned cnt = absl::popcount((w >> shift) & 0xFF);
+    if (k < cnt)
+      break;
+    k -= cnt;
+    shift += 8;
+  }
+  w >>= shift;
+  for (; k > 0; --k)
+    w &= w - 1;  // clears the lowest set bit.
+  return shift + absl::countr_zero(w);
+#endif
+}
+
+}  // namespace
+
+BitPackedArray::BitPackedArray(unsigned bit_width, PMR_NS::memory_resource* mr)
+    : words_(mr), width_(bit_width) {
+  assert(bit_width > 0 && bit_width <= 64);
+  mask_ = bit_width == 64 ? ~uint64_t(0) : (uint64_t(1) << bit_width) - 1;
+}
+
+void BitPackedArray::resize(size_t n) {
+  // The bits past the end are kept zero, so that growing yields zero elements.
+  if (n < size_) {
+    size_t bits = n * width_;
+    if (bits % 64)
+      words_[bits / 64] &= (uint64_t(1) << (bits % 64)) - 1;
+    words_.resize(words_for(bits));
+    words_.back() = 0;
+  } else {
+    words_.resize_fill(words_for(n * width_));
+  }
+  size_ = n;
+}
+
+void RankSelectBitmap::resize(size_t n) {
+  // The bits past the end are kept zero, like in BitPackedArray.
+  if (n < size_ && n % 64)
+    words_[n / 64] &= (uint64_t(1) << (n % 64)) - 1;
+  words_.resize_fill((n + 63) / 64);
+  size_ = n;
+  indexed_ = false;
+}
+
+void RankSelectBitmap::BuildIndex() {
+  size_t num_blocks = (words_.size() + kBlockWords - 1) / kBlockWords;
+  ranks_.resize_uninitialized(num_blocks + 1);
+
+  uint64_t total = 0;
+  for (size_t b = 0; b < num_blocks; ++b) {
+    ranks_[b] = total;
+    size_t start = b * kBlockWords;
+    total += CountOnes(words_.data() + start, min(kBlockWords, words_.size() - start));
+  }
+  ranks_[num_blocks] = total;
+  indexed_ = true;
+}
+
+size_t RankSelectBitmap::select(size_t k) const {
+  assert(indexed_);
+  if (k >= ranks_.back())
+    return size_;
+
+  // The last block that starts with at most k set bits contains the bit.
+  size_t block = upper_bound(ranks_.begin(), ranks_.end(), k) - ranks_.begin() - 1;
+  k -= ranks_[block];
+
+  size_t word = block * kBlockWords;
+  while (true) {
+    unsigned cnt = absl::popcount(words_[word]);
+    if (k < cnt)
+      break;
+    k -= cnt;
+    ++word;
+  }
+
+  return word * 64 + SelectInWord(words_[word], k);
+}
+
+}  // namespace base
@@ -0,0 +1,178 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/numeric/bits.h>
+
+#include <cassert>
+#include <cstdint>
+
+#include "base/pmr/pod_array.h"
+
+namespace base {
+
+// Returns the number of set bits in words[0, n).
+size_t CountOnes(const uint64_t* words, size_t n);
+
+// Array of unsigned integers of a fixed bit width in [1, 64], packed without gaps into 64-bit
+// words. The words are allocated from the memory resource, like PODArray.
+class BitPackedArray {
+ public:
+  explicit BitPackedArray(unsigned bit_width, PMR_NS::memory_resource* mr = nullptr);
+
+  uint64_t get(size_t i) const {
+    assert(i < size_);
+    size_t pos = i * width_;
+    const uint64_t* w = words_.data() + pos / 64;
+    unsigned offs = pos % 64;
+
+    // The array keeps a zero word past the last one, so the next word can always be read.
+    // Shifting by 1 and then by 63 - offs avoids the undefined shift by 64 when offs is 0.
+    uint64_t val = (w[0] >> offs) | ((w[1] << 1) << (63 - offs));
+    return val & mask_;
+  }
+
+  // val must fit into bit_width bits.
+  void set(size_t i, uint64_t val) {
+    assert(i < size_ && (val & ~mask_) == 0);
+    size_t pos = i * width_;
+    uint64_t* w = words_.data() + pos / 64;
+    unsigned offs = pos % 64;
+
+    w[0] = (w[0] & ~(mask_ << offs)) | (val << offs);
+    if (offs + width_ > 64) {
+      unsigned shift = 64 - offs;
+      w[1] = (w[1] & ~(mask_ >> shift)) | (val >> shift);
+    }
+  }
+
+  void push_back(uint64_t val) {
+    resize(size_ + 1);
+    set(size_ - 1, val);
+  }
+
+  // The new elements are zero.
+  void resize(size_t n);
+
+  void clear() {
+    resize(0);
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  unsigned bit_width() const {
+    return width_;
+  }
+
+  uint64_t max_value() const {
+    return mask_;
+  }
+
+  size_t allocated_size() const {
+    return words_.allocated_size();
+  }
+
+ private:
+  static size_t words_for(size_t bits) {
+    return (bits + 63) / 64 + 1;  // plus the padding word.
+  }
+
+  PODArray<uint64_t> words_;
+  size_t size_ = 0;
+  unsigned width_;
+  uint64_t mask_;
+};
+
+// Bitmap with rank and select queries. rank and select use an index of cumulative counts per
+// 512 bits, i.e. 12.5% of the bitmap size, that is built by BuildIndex and is invalidated by
+// any change of the bitmap.
+class RankSelectBitmap {
+ public:
+  explicit RankSelectBitmap(PMR_NS::memory_resource* mr = nullptr) : words_(mr), ranks_(mr) {
+  }
+
+  RankSelectBitmap(size_t n, PMR_NS::memory_resource* mr) : RankSelectBitmap(mr) {
+    resize(n);
+  }
+
+  bool test(size_t i) const {
+    assert(i < size_);
+    return (words_[i / 64] >> (i % 64)) & 1;
+  }
+
+  void set(size_t i) {
+    assert(i < size_);
+    words_[i / 64] |= uint64_t(1) << (i % 64);
+    indexed_ = false;
+  }
+
+  void reset(size_t i) {
+    assert(i < size_);
+    words_[i / 64] &= ~(uint64_t(1) << (i % 64));
+    indexed_ = false;
+  }
+
+  void assign(size_t i, bool val) {
+    val ? set(i) : reset(i);
+  }
+
+  void push_back(bool val) {
+    resize(size_ + 1);
+    assign(size_ - 1, val);
+  }
+
+  // The new bits are cleared.
+  void resize(size_t n);
+
+  size_t size() const {
+    return size_;
+  }
+
+  // Number of set bits.
+  size_t count() const {
+    return CountOnes(words_.data(), words_.size());
+  }
+
+  void BuildIndex();
+
+  // Number of set bits in [0, i), i <= size(). Requires the index.
+  size_t rank(size_t i) const {
+    assert(indexed_ && i <= size_);
+    size_t word = i / 64;
+    size_t res = ranks_[i / kBlockBits];
+    for (size_t w = i / kBlockBits * kBlockWords; w < word; ++w)
+      res += absl::popcount(words_[w]);
+    if (i % 64)
+      res += absl::popcount(words_[word] & ((uint64_t(1) << (i % 64)) - 1));
+    return res;
+  }
+
+  // Position of the set bit with rank k, i.e. the k-th set bit counting from 0, or size()
+  // if there are k or fewer set bits. Requires the index.
+  size_t select(size_t k) const;
+
+  size_t allocated_size() const {
+    return words_.allocated_size() + ranks_.allocated_size();
+  }
+
+  const uint64_t* words() const {
+    return words_.data();
+  }
+
+ private:
+  static constexpr size_t kBlockWords = 8;
+  static constexpr size_t kBlockBits = kBlockWords * 64;
+
+  PODArray<uint64_t> words_;
+
+  // ranks_[b] is the number of set bits before the block b, the last entry is the total.
+  PODArray<uint64_t> ranks_;
+  size_t size_ = 0;
+  bool indexed_ = false;
+};
+
+}  // namespace base
@@ -0,0 +1,129 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "base/pmr/bit_array.h"
+
+#include <random>
+#include <vector>
+
+#include "base/gtest.h"
+
+namespace base {
+
+using namespace std;
+
+class BitArrayTest : public testing::Test {};
+
+TEST_F(BitArrayTest, Packed) {
+  mt19937_64 rng(1);
+  for (unsigned width : {1u, 3u, 7u, 13u, 32u, 63u, 64u}) {
+    SCOPED_TRACE(width);
+    BitPackedArray arr(width);
+    vector<uint64_t> expected(1000);
+    for (auto& val : expected) {
+      val = rng() & arr.max_value();
+      arr.push_back(val);
+    }
+    ASSERT_EQ(expected.size(), arr.size());
+    EXPECT_LE(arr.allocated_size(), 2 * (expected.size() * width / 8 + 16));
+
+    for (size_t i = 0; i < expected.size(); i += 3) {
+      expected[i] = rng() & arr.max_value();
+      arr.set(i, expected[i]);
+    }
+    for (size_t i = 0; i < expected.size(); ++i)
+      ASSERT_EQ(expected[i], arr.get(i)) << i;
+
+    arr.resize(100);
+    arr.resize(200);
+    for (size_t i = 0; i < 100; ++i)
+      ASSERT_EQ(expected[i], arr.get(i)) << i;
+    for (size_t i = 100; i < 200; ++i)
+      ASSERT_EQ(0u, arr.get(i)) << i;
+  }
+}
+
+TEST_F(BitArrayTest, MemoryResource) {
+  PMR_NS::monotonic_buffer_resource arena;
+  BitPackedArray arr(5, &arena);
+  for (unsigned i = 0; i < 10000; ++i)
+    arr.push_back(i % 32);
+  for (unsigned i = 0; i < 10000; ++i)
+    ASSERT_EQ(i % 32, arr.get(i));
+
+  RankSelectBitmap bitmap(1000, &arena);
+  bitmap.set(999);
+  bitmap.BuildIndex();
+  EXPECT_EQ(999u, bitmap.select(0));
+}
+
+TEST_F(BitArrayTest, RankSelect) {
+  mt19937_64 rng(2);
+  RankSelectBitmap bitmap;
+  vector<size_t> ones;
+  for (size_t i = 0; i < 5000; ++i) {
+    bool val = rng() % 5 == 0;
+    bitmap.push_back(val);
+    if (val)
+      ones.push_back(i);
+  }
+  ASSERT_EQ(ones.size(), bitmap.count());
+
+  bitmap.BuildIndex();
+  size_t rank = 0;
+  for (size_t i = 0; i <= bitmap.size(); ++i) {
+    ASSERT_EQ(rank, bitmap.rank(i)) << i;
+    if (i < bitmap.size() && bitmap.test(i))
+      ++rank;
+  }
+  for (size_t k = 0; k < ones.size(); ++k)
+    ASSERT_EQ(ones[k], bitmap.select(k)) << k;
+  EXPECT_EQ(bitmap.size(), bitmap.select(ones.size()));
+
+  bitmap.reset(ones[0]);
+  bitmap.resize(64);
+  bitmap.resize(128);
+  bitmap.BuildIndex();
+  EXPECT_EQ(bitmap.count(), bitmap.rank(128));
+  for (size_t i = 64; i < 128; ++i)
+    ASSERT_FALSE(bitmap.test(i));
+}
+
+static void BM_Rank(benchmark::State& state) {
+  mt19937_64 rng(3);
+  RankSelectBitmap bitmap(1 << 24, nullptr);
+  for (size_t i = 0; i < bitmap.size(); i += 3)
+    bitmap.set(i);
+  bitmap.BuildIndex();
+
+  while (state.KeepRunning()) {
+    sink_result(bitmap.rank(rng() % bitmap.size()));
+  }
+}
+BENCHMARK(BM_Rank);
+
+static void BM_Select(benchmark::State& state) {
+  mt19937_64 rng(4);
+  RankSelectBitmap bitmap(1 << 24, nullptr);
+  for (size_t i = 0; i < bitmap.size(); i += 3)
+    bitmap.set(i);
+  bitmap.BuildIndex();
+
+  size_t total = bitmap.count();
+  while (state.KeepRunning()) {
+    sink_result(bitmap.select(rng() % total));
+  }
+}
+BENCHMARK(BM_Select);
+
+static void BM_CountOnes(benchmark::State& state) {
+  vector<uint64_t> words(state.range(0), 0x5555555555555555ULL);
+  while (state.KeepRunning()) {
+    sink_result(CountOnes(words.data(), words.size()));
+  }
+  state.SetBytesProcessed(state.iterations() * words.size() * 8);
+}
+BENCHMARK(BM_CountOnes)->Arg(1 << 10)->Arg(1 << 16);
+
+}  // namespace base
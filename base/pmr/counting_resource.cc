@@ -0,0 +1,99 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "base/pmr/counting_resource.h"
+
+#include <cassert>
+#include <cstdint>
+#include <new>
+
+namespace base {
+
+using namespace std;
+
+CountingMemoryResource::CountingMemoryResource(PMR_NS::memory_resource* upstream,
+                                               CountingMemoryResource* parent)
+    : upstream_(upstream), parent_(parent) {
+}
+
+CountingMemoryResource::~CountingMemoryResource() {
+  assert(used() == 0);
+
+  // In release builds, the leaked bytes are not counted by the parents forever.
+  set_parent(nullptr);
+}
+
+size_t CountingMemoryResource::Available() const {
+  size_t res = SIZE_MAX;
+  for (const CountingMemoryResource* mr = this; mr; mr = mr->parent_) {
+    size_t limit = mr->limit();
+    if (limit == 0)
+      continue;
+    size_t used = mr->used();
+    res = min(res, used < limit ? limit - used : 0);
+  }
+  return res;
+}
+
+bool CountingMemoryResource::TryCharge(size_t size) {
+  if (!CanAllocate(size)) {
+    rejected_.store(rejected() + 1, memory_order_relaxed);
+    return false;
+  }
+  Add(size);
+  return true;
+}
+
+void CountingMemoryResource::Release(size_t size) {
+  Sub(size);
+}
+
+void CountingMemoryResource::set_parent(CountingMemoryResource* parent) {
+  size_t cur = used();
+  if (parent_)
+    parent_->Sub(cur);
+  parent_ = parent;
+  if (parent_)
+    parent_->Add(cur);
+}
+
+void CountingMemoryResource::set_upstream(PMR_NS::memory_resource* upstream) {
+  assert(used() == 0);
+  upstream_ = upstream;
+}
+
+void* CountingMemoryResource::do_allocate(size_t size, size_t align) {
+  if (!TryCharge(size))
+    throw bad_alloc();
+
+  try {
+    return upstream_->allocate(size, align);
+  } catch (...) {
+    Sub(size);
+    throw;
+  }
+}
+
+void CountingMemoryResource::do_deallocate(void* ptr, size_t size, size_t align) {
+  upstream_->deallocate(ptr, size, align);
+  Sub(size);
+}
+
+void CountingMemoryResource::Add(size_t delta) {
+  for (CountingMemoryResource* mr = this; mr; mr = mr->parent_) {
+    size_t used = mr->used() + delta;
+    mr->used_.store(used, memory_order_relaxed);
+    if (used > mr->peak())
+      mr->peak_.store(used, memory_order_relaxed);
+  }
+}
+
+void CountingMemoryResource::Sub(size_t delta) {
+  for (CountingMemoryResource* mr = this; mr; mr = mr->parent_) {
+    assert(mr->used() >= delta);
+    mr->used_.store(mr->used() - delta, memory_order_relaxed);
+  }
+}
+
+}  // namespace base
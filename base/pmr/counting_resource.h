@@ -0,0 +1,113 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "memory_resource.h"
+
+namespace base {
+
+// Memory resource that counts the bytes allocated through it and enforces an optional limit.
+// Resources form a chain through their parents: every allocation is charged to the resource
+// and to all its parents, and fails if any of them would exceed its limit. The parents only
+// count, the memory itself comes from the upstream resource. For example, every connection
+// owns a resource whose parent counts the memory of all the connections of its thread.
+//
+// A resource and its parents are updated by a single thread at a time and without atomic
+// read-modify-write operations, but the counters can be read from any thread.
+// An allocation above the limits throws std::bad_alloc, like the other resources. Code that
+// wants to degrade gracefully instead checks CanAllocate() first or uses TryCharge() for
+// memory that is allocated elsewhere.
+class CountingMemoryResource : public PMR_NS::memory_resource {
+ public:
+  explicit CountingMemoryResource(
+      PMR_NS::memory_resource* upstream = PMR_NS::new_delete_resource(),
+      CountingMemoryResource* parent = nullptr);
+  ~CountingMemoryResource();
+
+  CountingMemoryResource(const CountingMemoryResource&) = delete;
+  CountingMemoryResource& operator=(const CountingMemoryResource&) = delete;
+
+  // 0 means unlimited. Lowering the limit below used() does not free anything, it fails
+  // the next allocations.
+  void set_limit(size_t limit) {
+    limit_.store(limit, std::memory_order_relaxed);
+  }
+
+  size_t limit() const {
+    return limit_.load(std::memory_order_relaxed);
+  }
+
+  // Bytes in use, including the ones of the children.
+  size_t used() const {
+    return used_.load(std::memory_order_relaxed);
+  }
+
+  size_t peak() const {
+    return peak_.load(std::memory_order_relaxed);
+  }
+
+  // Number of allocations and charges that failed because of the limits.
+  uint64_t rejected() const {
+    return rejected_.load(std::memory_order_relaxed);
+  }
+
+  // Returns how many bytes can be allocated before hitting the lowest limit of the chain,
+  // SIZE_MAX if no resource in the chain has a limit.
+  size_t Available() const;
+
+  bool CanAllocate(size_t size) const {
+    return size <= Available();
+  }
+
+  // Accounts for memory that is not allocated through the resource, e.g. the capacity of
+  // a std::string. Returns false and charges nothing if the limits would be exceeded.
+  bool TryCharge(size_t size);
+  void Release(size_t size);
+
+  CountingMemoryResource* parent() const {
+    return parent_;
+  }
+
+  // Drops the bytes in use from the counters of the chain, for example when the upstream
+  // resource frees the allocations in bulk.
+  void Forget() {
+    Sub(used());
+  }
+
+  // Moves the bytes in use from the current parent to parent, which may be null.
+  void set_parent(CountingMemoryResource* parent);
+
+  // Can be changed only when nothing is allocated.
+  void set_upstream(PMR_NS::memory_resource* upstream);
+
+  PMR_NS::memory_resource* upstream() const {
+    return upstream_;
+  }
+
+ private:
+  void* do_allocate(std::size_t size, std::size_t align) final;
+  void do_deallocate(void* ptr, std::size_t size, std::size_t align) final;
+
+  bool do_is_equal(const PMR_NS::memory_resource& o) const noexcept final {
+    return this == &o;
+  }
+
+  // Adds delta to the chain unconditionally.
+  void Add(size_t delta);
+  void Sub(size_t delta);
+
+  PMR_NS::memory_resource* upstream_;
+  CountingMemoryResource* parent_;
+  std::atomic_size_t limit_{0};
+  std::atomic_size_t used_{0};
+  std::atomic_size_t peak_{0};
+  std::atomic_uint64_t rejected_{0};
+};
+
+}  // namespace base
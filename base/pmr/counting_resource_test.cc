@@ -0,0 +1,87 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "base/pmr/counting_resource.h"
+
+#include <vector>
+
+#include "base/gtest.h"
+#include "base/io_buf.h"
+
+namespace base {
+
+using namespace std;
+
+class CountingResourceTest : public ::testing::Test {
+ protected:
+  CountingMemoryResource parent_;
+};
+
+TEST_F(CountingResourceTest, Chain) {
+  CountingMemoryResource child(PMR_NS::new_delete_resource(), &parent_);
+  void* p1 = child.allocate(100);
+  void* p2 = parent_.allocate(50);
+  EXPECT_EQ(100, child.used());
+  EXPECT_EQ(150, parent_.used());
+
+  child.deallocate(p1, 100);
+  EXPECT_EQ(0, child.used());
+  EXPECT_EQ(100, child.peak());
+  EXPECT_EQ(50, parent_.used());
+  EXPECT_EQ(150, parent_.peak());
+  parent_.deallocate(p2, 50);
+}
+
+TEST_F(CountingResourceTest, Limits) {
+  CountingMemoryResource child(PMR_NS::new_delete_resource(), &parent_);
+  EXPECT_EQ(SIZE_MAX, child.Available());
+
+  parent_.set_limit(1000);
+  child.set_limit(600);
+  EXPECT_EQ(600, child.Available());
+  EXPECT_TRUE(child.TryCharge(500));
+  EXPECT_FALSE(child.TryCharge(200));
+  EXPECT_EQ(1, child.rejected());
+
+  // The parent limit applies to the child as well.
+  EXPECT_TRUE(parent_.TryCharge(450));
+  EXPECT_EQ(50, child.Available());
+  EXPECT_THROW(child.allocate(64), std::bad_alloc);
+  EXPECT_EQ(2, child.rejected());
+  EXPECT_EQ(950, parent_.used());
+
+  parent_.Release(450);
+  child.Release(500);
+  EXPECT_EQ(0, parent_.used());
+}
+
+TEST_F(CountingResourceTest, Reparent) {
+  CountingMemoryResource other;
+  CountingMemoryResource child(PMR_NS::new_delete_resource(), &parent_);
+  PMR_NS::vector<char> vec(1000, &child);
+  EXPECT_EQ(1000, parent_.used());
+
+  child.set_parent(&other);
+  EXPECT_EQ(0, parent_.used());
+  EXPECT_EQ(1000, other.used());
+
+  vec = PMR_NS::vector<char>(&child);
+  EXPECT_EQ(0, other.used());
+  child.set_parent(nullptr);
+}
+
+TEST_F(CountingResourceTest, IoBuf) {
+  parent_.set_limit(4096);
+  {
+    IoBuf buf(1024, &parent_);
+    EXPECT_EQ(1024, parent_.used());
+    buf.EnsureCapacity(2048);
+    EXPECT_EQ(2048, parent_.used());
+    EXPECT_THROW(buf.EnsureCapacity(4096), std::bad_alloc);
+    EXPECT_EQ(2048, buf.Capacity());
+  }
+  EXPECT_EQ(0, parent_.used());
+}
+
+}  // namespace base
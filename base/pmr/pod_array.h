@@ -8,10 +8,14 @@
 #include <absl/base/macros.h>
 #include <absl/numeric/bits.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #include <algorithm>
+#include <cassert>
 #include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <new>
 
 #include "base/pmr/memory_resource.h"
 
@@ -26,6 +30,11 @@ namespace base {
  * Please note that for ALIGNMENT > 16 needs to be supported by memory_resource.
  * The default memory resource provides only 16 bytes alignment. For larger alignments use
  * custom memory resource, for example, one that wraps tcmalloc directly.
+ *
+ * Capacities are rounded up to a power of two below kLargeSize and to a multiple of
+ * kHugePageSize above it. With the new_delete_resource, large arrays are mapped directly and
+ * grow with mremap on linux, which moves the pages instead of copying the data, so loading
+ * huge arrays does not copy them on each doubling.
  */
 
 template <size_t ELEM_SIZE, size_t ALIGNMENT> class PODArrayBase {
@@ -36,20 +45,62 @@ template <size_t ELEM_SIZE, size_t ALIGNMENT> class PODArrayBase {
   char* c_end_ = nullptr;
   char* c_end_of_storage_ = nullptr;  /// Не включает в себя pad_right.
   PMR_NS::memory_resource* mr_;
+  bool mmapped_ = false;  // c_start_ was mapped directly rather than allocated from mr_.
 
   PODArrayBase(PMR_NS::memory_resource* mr) : mr_(mr ? mr : PMR_NS::get_default_resource()) {
   }
 
+  static constexpr size_t round_up(size_t bytes) {
+    return bytes < kLargeSize ? absl::bit_ceil(bytes)
+                              : (bytes + kHugePageSize - 1) & ~(kHugePageSize - 1);
+  }
+
+  bool use_mmap(size_t bytes) const {
+#ifdef __linux__
+    return ALIGNMENT <= 4096 && bytes >= kLargeSize && mr_ == PMR_NS::new_delete_resource();
+#else
+    return false;
+#endif
+  }
+
+  // The mapping is aligned to kHugePageSize, so that it can be backed by huge pages.
+  static char* map(size_t bytes) {
+    void* ptr = mmap(nullptr, bytes + kHugePageSize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED)
+      throw std::bad_alloc();
+
+    char* start = reinterpret_cast<char*>(ptr);
+    char* aligned = reinterpret_cast<char*>(
+        (reinterpret_cast<uintptr_t>(start) + kHugePageSize - 1) & ~(kHugePageSize - 1));
+    if (aligned > start)
+      munmap(start, aligned - start);
+    munmap(aligned + bytes, start + kHugePageSize - aligned);
+    advise(aligned, bytes);
+    return aligned;
+  }
+
+  static void advise(char* ptr, size_t bytes) {
+#ifdef MADV_HUGEPAGE
+    madvise(ptr, bytes, MADV_HUGEPAGE);
+#endif
+  }
+
   void alloc(size_t bytes) {
-    bytes = absl::bit_ceil(bytes);
-    c_start_ = c_end_ = reinterpret_cast<char*>(mr_->allocate(bytes, ALIGNMENT));
+    bytes = round_up(bytes);
+    mmapped_ = use_mmap(bytes);
+    c_start_ = mmapped_ ? map(bytes) : reinterpret_cast<char*>(mr_->allocate(bytes, ALIGNMENT));
+    c_end_ = c_start_;
     c_end_of_storage_ = c_start_ + bytes;
   }
 
   void dealloc() {
     if (c_start_ == nullptr)
       return;
-    mr_->deallocate(c_start_, allocated_size(), ALIGNMENT);
+    if (mmapped_)
+      munmap(c_start_, allocated_size());
+    else
+      mr_->deallocate(c_start_, allocated_size(), ALIGNMENT);
   }
 
   /// Количество памяти, занимаемое num_elements элементов.
@@ -70,18 +121,46 @@ template <size_t ELEM_SIZE, size_t ALIGNMENT> class PODArrayBase {
   void realloc(size_t bytes) {
     if (c_start_ == nullptr)
       return alloc(bytes);
-    bytes = absl::bit_ceil(bytes);
-    char* new_start = reinterpret_cast<char*>(mr_->allocate(bytes, ALIGNMENT));
+    bytes = round_up(bytes);
     ptrdiff_t sz = c_end_ - c_start_;
-    memcpy(new_start, c_start_, sz);
+    char* new_start;
+
+#ifdef __linux__
+    if (mmapped_) {
+      // Grows in place if possible. Otherwise moves the pages into a new mapping, which is
+      // aligned like the one of map(), since MREMAP_MAYMOVE alone may pick any address.
+      void* ptr = mremap(c_start_, allocated_size(), bytes, 0);
+      if (ptr == MAP_FAILED) {
+        char* dest = map(bytes);
+        ptr = mremap(c_start_, allocated_size(), bytes, MREMAP_MAYMOVE | MREMAP_FIXED, dest);
+        if (ptr == MAP_FAILED) {
+          munmap(dest, bytes);
+          throw std::bad_alloc();
+        }
+      }
+      new_start = reinterpret_cast<char*>(ptr);
+      advise(new_start, bytes);
+    } else
+#endif
+    {
+      bool mmapped = use_mmap(bytes);
+      new_start = mmapped ? map(bytes) : reinterpret_cast<char*>(mr_->allocate(bytes, ALIGNMENT));
+      memcpy(new_start, c_start_, sz);
+      mr_->deallocate(c_start_, allocated_size(), ALIGNMENT);
+      mmapped_ = mmapped;
+    }
 
-    mr_->deallocate(c_start_, allocated_size(), ALIGNMENT);
     c_end_ = new_start + sz;
     c_start_ = new_start;
     c_end_of_storage_ = c_start_ + bytes;
   }
 
  public:
+  static constexpr size_t kHugePageSize = 1 << 21;
+
+  // Capacities from this size are rounded up to multiples of kHugePageSize.
+  static constexpr size_t kLargeSize = 1 << 25;
+
   size_t allocated_size() const {
     return c_end_of_storage_ - c_start_;
   }
@@ -95,21 +174,28 @@ template <size_t ELEM_SIZE, size_t ALIGNMENT> class PODArrayBase {
     }
   }
 
+  // Like std::vector::resize, the new elements are zeroed.
   void resize(size_t n) {
-    reserve(n);
-    resize_assume_reserved(n);
+    resize_fill(n);
   }
 
   void resize_assume_reserved(const size_t n) {
     c_end_ = c_start_ + byte_size(n);
   }
 
+  // Same as resize, but the new elements are not initialized. For the call sites that fill
+  // them afterwards, e.g. reading into data().
+  void resize_uninitialized(size_t n) {
+    reserve(n);
+    resize_assume_reserved(n);
+  }
+
   /// Как resize, но обнуляет новые элементы.
   void resize_fill(size_t n) {
     size_t old_size = size();
     if (n > old_size) {
       reserve(n);
-      memset(c_end_, 0, n - old_size);
+      memset(c_end_, 0, byte_size(n - old_size));
     }
     c_end_ = c_start_ + byte_size(n);
   }
@@ -129,6 +215,7 @@ template <size_t ELEM_SIZE, size_t ALIGNMENT> class PODArrayBase {
     std::swap(c_start_, other.c_start_);
     std::swap(c_end_, other.c_end_);
     std::swap(c_end_of_storage_, other.c_end_of_storage_);
+    std::swap(mmapped_, other.mmapped_);
   }
 
   PMR_NS::memory_resource* mr() {
@@ -179,6 +266,12 @@ class PODArray : public PODArrayBase<sizeof(T), ALIGNMENT> {
       realloc(minimum_memory_for_elements(capacity() * 2));
   }
 
+  // Reserves at least n elements, at least doubling the capacity so that appends are amortized.
+  void grow(size_t n) {
+    if (n > capacity())
+      ParentClass::reserve(std::max(n, capacity() * 2));
+  }
+
  public:
   using value_type = T;
   using const_iterator = const T*;
@@ -190,6 +283,8 @@ class PODArray : public PODArrayBase<sizeof(T), ALIGNMENT> {
   using ParentClass::reserve;
   using ParentClass::resize;
   using ParentClass::resize_assume_reserved;
+  using ParentClass::resize_fill;
+  using ParentClass::resize_uninitialized;
   using ParentClass::size;
 
   PODArray(PMR_NS::memory_resource* mr = nullptr) : ParentClass(mr) {
@@ -295,6 +390,19 @@ class PODArray : public PODArrayBase<sizeof(T), ALIGNMENT> {
     c_end_ += byte_size(1);
   }
 
+  // Same as push_back and emplace_back, but the capacity must have been reserved beforehand.
+  void push_back_unchecked(const T& x) {
+    assert(c_end_ < c_end_of_storage_);
+    *t_end() = x;
+    c_end_ += byte_size(1);
+  }
+
+  template <typename... Args> void emplace_back_unchecked(Args&&... args) {
+    assert(c_end_ < c_end_of_storage_);
+    new (t_end()) T(std::forward<Args>(args)...);
+    c_end_ += byte_size(1);
+  }
+
   void pop_back() {
     c_end_ -= byte_size(1);
   }
@@ -302,10 +410,7 @@ class PODArray : public PODArrayBase<sizeof(T), ALIGNMENT> {
   /// Не вставляйте в массив кусок самого себя. Потому что при ресайзе,
   // итераторы на самого себя могут инвалидироваться.
   template <typename It1, typename It2> void insert(It1 from_begin, It2 from_end) {
-    size_t required_capacity = size() + (from_end - from_begin);
-    if (required_capacity > capacity())
-      reserve(absl::bit_ceil(required_capacity));
-
+    grow(size() + (from_end - from_begin));
     insert_assume_reserved(from_begin, from_end);
   }
 
@@ -317,8 +422,7 @@ class PODArray : public PODArrayBase<sizeof(T), ALIGNMENT> {
     // we compute bytes_to_move before reserve() call, otherwise 'it' can be invalidated.
     size_t bytes_to_move = (end() - it) * sizeof(T);
 
-    if (required_capacity > capacity())
-      reserve(absl::bit_ceil(required_capacity));
+    grow(required_capacity);
 
     if (ABSL_PREDICT_FALSE(bytes_to_move))
       memmove(c_end_ + bytes_to_copy - bytes_to_move, c_end_ - bytes_to_move, bytes_to_move);
@@ -334,14 +438,13 @@ class PODArray : public PODArrayBase<sizeof(T), ALIGNMENT> {
   }
 
   void assign(size_t n, const T& x) {
-    resize(n);
+    resize_uninitialized(n);
     std::fill(begin(), end(), x);
   }
 
   template <typename It1, typename It2> void assign(It1 from_begin, It2 from_end) {
     size_t required_capacity = from_end - from_begin;
-    if (required_capacity > capacity())
-      reserve(absl::bit_ceil(required_capacity));
+    reserve(required_capacity);
 
     size_t bytes_to_copy = byte_size(required_capacity);
     memcpy(c_start_, reinterpret_cast<const void*>(&*from_begin), bytes_to_copy);
@@ -4,9 +4,14 @@
 
 #include "base/pod_array.h"
 
+#include <vector>
+
 #include "base/gtest.h"
 
 namespace base {
+
+using namespace std;
+
 class PodArrayTest {};
 
 TEST(BitsTest, Padded) {
@@ -30,4 +35,106 @@ TEST(BitsTest, Padded) {
   EXPECT_EQ(2048, arr.capacity());
 }
 
+TEST(BitsTest, ResizeFill) {
+  PODArray<uint32_t> arr;
+  arr.resize_uninitialized(4);
+  for (unsigned i = 0; i < 4; ++i)
+    arr[i] = 7;
+  arr.resize_fill(100);
+  ASSERT_EQ(100, arr.size());
+  EXPECT_EQ(7, arr[3]);
+  for (unsigned i = 4; i < 100; ++i)
+    ASSERT_EQ(0, arr[i]) << i;
+}
+
+TEST(BitsTest, ResizeUninitialized) {
+  PODArray<uint32_t> arr;
+  arr.resize(4);
+  for (unsigned i = 0; i < 4; ++i)
+    ASSERT_EQ(0, arr[i]) << i;
+  arr[3] = 7;
+
+  // Growing within the capacity keeps the stale values, unlike resize.
+  arr.resize(2);
+  arr.resize_uninitialized(4);
+  EXPECT_EQ(7, arr[3]);
+  arr.resize(2);
+  arr.resize(4);
+  EXPECT_EQ(0, arr[3]);
+}
+
+TEST(BitsTest, Unchecked) {
+  PODArray<uint64_t> arr;
+  arr.reserve(100);
+  for (unsigned i = 0; i < 100; ++i)
+    arr.push_back_unchecked(i);
+  arr.pop_back();
+  arr.emplace_back_unchecked(1000);
+  ASSERT_EQ(100, arr.size());
+  EXPECT_EQ(98, arr[98]);
+  EXPECT_EQ(1000, arr.back());
+}
+
+TEST(BitsTest, Large) {
+  using Array = PODArray<uint64_t>;
+  Array arr(PMR_NS::new_delete_resource());
+  constexpr size_t kNum = Array::kLargeSize / sizeof(uint64_t) * 3;
+  for (size_t i = 0; i < kNum; ++i)
+    arr.push_back(i);
+  for (size_t i = 0; i < kNum; i += 4099)
+    ASSERT_EQ(i, arr[i]);
+  EXPECT_EQ(kNum - 1, arr.back());
+  EXPECT_EQ(0, arr.allocated_size() % Array::kHugePageSize);
+  EXPECT_EQ(0, reinterpret_cast<uintptr_t>(arr.data()) % Array::kHugePageSize);
+
+  vector<uint64_t> chunk(1000, 5);
+  for (unsigned i = 0; i < 100; ++i)
+    arr.insert(chunk.begin(), chunk.end());
+  EXPECT_EQ(kNum + 100000, arr.size());
+  EXPECT_EQ(kNum - 1, arr[kNum - 1]);
+  EXPECT_EQ(5, arr.back());
+  EXPECT_EQ(0, reinterpret_cast<uintptr_t>(arr.data()) % Array::kHugePageSize);
+
+  Array other(std::move(arr));
+  EXPECT_EQ(kNum + 100000, other.size());
+  EXPECT_EQ(0, arr.size());
+}
+
+static void BM_PushBack(benchmark::State& state) {
+  size_t num = state.range(0);
+  while (state.KeepRunning()) {
+    PODArray<uint64_t> arr(PMR_NS::new_delete_resource());
+    for (size_t i = 0; i < num; ++i)
+      arr.push_back(i);
+    sink_result(arr.back());
+  }
+  state.SetItemsProcessed(state.iterations() * num);
+}
+BENCHMARK(BM_PushBack)->Arg(1 << 12)->Arg(1 << 24);
+
+static void BM_VectorPushBack(benchmark::State& state) {
+  size_t num = state.range(0);
+  while (state.KeepRunning()) {
+    vector<uint64_t> arr;
+    for (size_t i = 0; i < num; ++i)
+      arr.push_back(i);
+    sink_result(arr.back());
+  }
+  state.SetItemsProcessed(state.iterations() * num);
+}
+BENCHMARK(BM_VectorPushBack)->Arg(1 << 12)->Arg(1 << 24);
+
+static void BM_BulkInsert(benchmark::State& state) {
+  size_t num = state.range(0);
+  vector<uint64_t> chunk(1024, 1);
+  while (state.KeepRunning()) {
+    PODArray<uint64_t> arr(PMR_NS::new_delete_resource());
+    for (size_t i = 0; i < num; i += chunk.size())
+      arr.insert(chunk.begin(), chunk.end());
+    sink_result(arr.size());
+  }
+  state.SetItemsProcessed(state.iterations() * num);
+}
+BENCHMARK(BM_BulkInsert)->Arg(1 << 16)->Arg(1 << 26);
+
 }  // namespace base
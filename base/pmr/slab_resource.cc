@@ -0,0 +1,261 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "base/pmr/slab_resource.h"
+
+#include <atomic>
+#include <cassert>
+#include <thread>
+
+#include "base/mpsc_intrusive_queue.h"
+
+namespace base {
+
+using namespace std;
+
+namespace {
+
+struct FreeBlock {
+  atomic<FreeBlock*> next;
+  uint32_t cls;  // set for remote frees, the owner does not know the span size otherwise.
+};
+
+FreeBlock* MPSC_intrusive_load_next(const FreeBlock& src) {
+  return src.next.load(memory_order_acquire);
+}
+
+void MPSC_intrusive_store_next(FreeBlock* dest, FreeBlock* next_node) {
+  dest->next.store(next_node, memory_order_release);
+}
+
+}  // namespace
+
+static_assert(SlabMemoryResource::ClassSize(SlabMemoryResource::kNumClasses - 1) ==
+              SlabMemoryResource::kMaxSlabSize);
+static_assert(sizeof(FreeBlock) <= SlabMemoryResource::ClassSize(0));
+
+namespace {
+
+constexpr size_t kSmallSpanSize = 1 << 16;
+constexpr size_t kLargeSpanSize = 1 << 18;
+
+// Spans hold at least 15 blocks.
+constexpr size_t SpanSize(unsigned cls) {
+  return SlabMemoryResource::ClassSize(cls) <= 4096 ? kSmallSpanSize : kLargeSpanSize;
+}
+
+atomic_uint64_t next_resource_id{1};
+
+struct TlHeap {
+  uint64_t resource_id;
+  void* heap;
+};
+
+// Most threads use a single resource, so a few entries are enough to avoid the mutex.
+constexpr unsigned kTlHeaps = 4;
+thread_local TlHeap tl_heaps[kTlHeaps];
+thread_local unsigned tl_next_heap = 0;
+
+}  // namespace
+
+struct SlabMemoryResource::Heap {
+  struct SpanHeader {
+    Heap* owner;
+    SpanHeader* next;
+    size_t size;
+  };
+
+  // The first block starts after the header and keeps the slab alignment.
+  static constexpr size_t kHeaderSize = 64;
+  static_assert(sizeof(SpanHeader) <= kHeaderSize);
+
+  struct Class {
+    FreeBlock* free_list = nullptr;
+    char* next = nullptr;  // bump pointer in the last span.
+    char* end = nullptr;
+    ClassStats stats;
+  };
+
+  std::thread::id tid;
+  SpanHeader* spans = nullptr;
+  Class classes[kNumClasses];
+  uint64_t span_bytes = 0;
+  uint64_t large_allocs = 0;
+  uint64_t large_frees = 0;
+
+  MPSCIntrusiveQueue<FreeBlock> remote_frees;
+
+  Heap() {
+    for (unsigned i = 0; i < kNumClasses; ++i)
+      classes[i].stats.block_size = ClassSize(i);
+  }
+
+  static SpanHeader* GetSpan(void* ptr, unsigned cls) {
+    return reinterpret_cast<SpanHeader*>(reinterpret_cast<uintptr_t>(ptr) & ~(SpanSize(cls) - 1));
+  }
+
+  void PushFree(FreeBlock* block, unsigned cls) {
+    Class& c = classes[cls];
+    block->next.store(c.free_list, memory_order_relaxed);
+    c.free_list = block;
+    ++c.stats.frees;
+    --c.stats.used_blocks;
+  }
+
+  void DrainRemote() {
+    while (true) {
+      // Stop on a push in progress, the block will be picked up next time.
+      FreeBlock* block = remote_frees.PopWeak().first;
+      if (!block)
+        break;
+      unsigned cls = block->cls;
+      PushFree(block, cls);
+      ++classes[cls].stats.remote_frees;
+    }
+  }
+};
+
+SlabMemoryResource::SlabMemoryResource(PMR_NS::memory_resource* upstream)
+    : upstream_(upstream), id_(next_resource_id.fetch_add(1, memory_order_relaxed)) {
+}
+
+SlabMemoryResource::~SlabMemoryResource() {
+  for (Heap* heap : heaps_) {
+    auto* span = heap->spans;
+    while (span) {
+      auto* next = span->next;
+      upstream_->deallocate(span, span->size, span->size);
+      span = next;
+    }
+    delete heap;
+  }
+}
+
+unsigned SlabMemoryResource::SizeClass(size_t size) {
+  assert(size <= kMaxSlabSize);
+  if (size <= 128)
+    return size ? (size - 1) / 16 : 0;
+
+  // 2^(b-1) < size <= 2^b, there are 4 classes in this range.
+  unsigned b = 64 - __builtin_clzll(size - 1);
+  size_t lower = size_t(1) << (b - 1);
+  return 8 + (b - 8) * 4 + (size - 1 - lower) / (lower / 4);
+}
+
+auto SlabMemoryResource::LocalHeap(bool create) const -> Heap* {
+  for (unsigned i = 0; i < kTlHeaps; ++i) {
+    if (tl_heaps[i].resource_id == id_)
+      return static_cast<Heap*>(tl_heaps[i].heap);
+  }
+
+  if (!create)
+    return nullptr;
+
+  std::thread::id tid = this_thread::get_id();
+  Heap* res = nullptr;
+  {
+    lock_guard lk(mu_);
+    for (Heap* heap : heaps_) {
+      if (heap->tid == tid) {
+        res = heap;
+        break;
+      }
+    }
+    if (!res) {
+      res = new Heap;
+      res->tid = tid;
+      heaps_.push_back(res);
+    }
+  }
+
+  tl_heaps[tl_next_heap] = TlHeap{id_, res};
+  tl_next_heap = (tl_next_heap + 1) % kTlHeaps;
+  return res;
+}
+
+void* SlabMemoryResource::AllocateSpan(Heap* heap, unsigned cls) {
+  size_t span_size = SpanSize(cls);
+  auto* span = static_cast<Heap::SpanHeader*>(upstream_->allocate(span_size, span_size));
+  span->owner = heap;
+  span->next = heap->spans;
+  span->size = span_size;
+  heap->spans = span;
+  heap->span_bytes += span_size;
+
+  Heap::Class& c = heap->classes[cls];
+  c.next = reinterpret_cast<char*>(span) + Heap::kHeaderSize;
+  c.end = reinterpret_cast<char*>(span) + span_size;
+  return span;
+}
+
+void* SlabMemoryResource::do_allocate(std::size_t size, std::size_t align) {
+  if (size > kMaxSlabSize || align > kSlabAlignment) {
+    Heap* heap = LocalHeap(true);
+    ++heap->large_allocs;
+    return upstream_->allocate(size, align);
+  }
+
+  unsigned cls = SizeClass(size);
+  Heap* heap = LocalHeap(true);
+  Heap::Class& c = heap->classes[cls];
+
+  if (!c.free_list)
+    heap->DrainRemote();
+
+  void* res;
+  if (c.free_list) {
+    res = c.free_list;
+    c.free_list = c.free_list->next.load(memory_order_relaxed);
+  } else {
+    size_t block_size = ClassSize(cls);
+    if (size_t(c.end - c.next) < block_size)
+      AllocateSpan(heap, cls);
+    res = c.next;
+    c.next += block_size;
+    ++c.stats.reserved_blocks;
+  }
+
+  ++c.stats.allocs;
+  ++c.stats.used_blocks;
+  return res;
+}
+
+void SlabMemoryResource::do_deallocate(void* ptr, std::size_t size, std::size_t align) {
+  if (size > kMaxSlabSize || align > kSlabAlignment) {
+    Heap* heap = LocalHeap(true);
+    ++heap->large_frees;
+    upstream_->deallocate(ptr, size, align);
+    return;
+  }
+
+  unsigned cls = SizeClass(size);
+  Heap* owner = Heap::GetSpan(ptr, cls)->owner;
+  FreeBlock* block = static_cast<FreeBlock*>(ptr);
+
+  if (owner == LocalHeap(false)) {
+    owner->PushFree(block, cls);
+  } else {
+    block->cls = cls;
+    owner->remote_frees.Push(block);
+  }
+}
+
+auto SlabMemoryResource::GetLocalStats() const -> Stats {
+  Stats res;
+  Heap* heap = LocalHeap(false);
+  if (!heap) {
+    for (unsigned i = 0; i < kNumClasses; ++i)
+      res.classes[i].block_size = ClassSize(i);
+    return res;
+  }
+
+  for (unsigned i = 0; i < kNumClasses; ++i)
+    res.classes[i] = heap->classes[i].stats;
+  res.span_bytes = heap->span_bytes;
+  res.large_allocs = heap->large_allocs;
+  res.large_frees = heap->large_frees;
+  return res;
+}
+
+}  // namespace base
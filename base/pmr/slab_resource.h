@@ -0,0 +1,92 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "memory_resource.h"
+
+namespace base {
+
+// Size-class slab allocator. Every thread that allocates from the resource gets its own heap
+// with a free list per size class, so allocations and local frees do not synchronize.
+// Blocks are carved from spans that are aligned to their size, and the span header records
+// the owning heap. A block freed on another thread is pushed into the owner's MPSC queue
+// and is returned to its free list by the owner on a later allocation.
+//
+// Requests larger than kMaxSlabSize or with alignment larger than kSlabAlignment are passed
+// to the upstream resource. Spans are never returned to upstream before the resource is
+// destroyed; the resource must outlive all the threads that use it, like a proactor pool.
+// Heaps of threads that exited are kept, and blocks freed into them are not reused.
+class SlabMemoryResource : public PMR_NS::memory_resource {
+ public:
+  static constexpr size_t kMaxSlabSize = 16384;
+  static constexpr size_t kSlabAlignment = 16;
+  static constexpr unsigned kNumClasses = 36;
+
+  struct ClassStats {
+    uint32_t block_size = 0;
+    uint64_t allocs = 0;
+    uint64_t frees = 0;         // including remote frees.
+    uint64_t remote_frees = 0;  // freed by other threads and returned to this heap.
+    uint64_t used_blocks = 0;
+    uint64_t reserved_blocks = 0;  // blocks carved from the spans so far.
+  };
+
+  struct Stats {
+    ClassStats classes[kNumClasses];
+    uint64_t span_bytes = 0;
+    uint64_t large_allocs = 0;  // passed to upstream.
+    uint64_t large_frees = 0;
+  };
+
+  explicit SlabMemoryResource(PMR_NS::memory_resource* upstream = PMR_NS::new_delete_resource());
+  ~SlabMemoryResource();
+
+  SlabMemoryResource(const SlabMemoryResource&) = delete;
+  SlabMemoryResource& operator=(const SlabMemoryResource&) = delete;
+
+  // Returns the stats of the calling thread heap. The allocations of other threads are not
+  // included, so in a proactor pool they are collected per proactor thread.
+  Stats GetLocalStats() const;
+
+  static constexpr size_t ClassSize(unsigned cls) {
+    // 16 byte steps up to 128 and 4 classes per power of 2 after that.
+    return cls < 8 ? 16 * (cls + 1)
+                   : (128u << ((cls - 8) / 4)) + ((cls - 8) % 4 + 1) * (32u << ((cls - 8) / 4));
+  }
+
+  static unsigned SizeClass(size_t size);
+
+  PMR_NS::memory_resource* upstream() const {
+    return upstream_;
+  }
+
+ private:
+  struct Heap;
+
+  void* do_allocate(std::size_t size, std::size_t align) final;
+  void do_deallocate(void* ptr, std::size_t size, std::size_t align) final;
+
+  bool do_is_equal(const PMR_NS::memory_resource& o) const noexcept final {
+    return this == &o;
+  }
+
+  // Returns the heap of the calling thread, creates one if create is true.
+  Heap* LocalHeap(bool create) const;
+
+  void* AllocateSpan(Heap* heap, unsigned cls);
+
+  PMR_NS::memory_resource* upstream_;
+  const uint64_t id_;
+
+  mutable std::mutex mu_;
+  mutable std::vector<Heap*> heaps_;
+};
+
+}  // namespace base
@@ -0,0 +1,114 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "base/pmr/slab_resource.h"
+
+#include <thread>
+
+#include "base/gtest.h"
+#include "base/pod_array.h"
+
+namespace base {
+
+using namespace std;
+
+class SlabResourceTest : public ::testing::Test {
+ protected:
+  SlabMemoryResource mr_;
+};
+
+TEST_F(SlabResourceTest, SizeClass) {
+  for (size_t sz = 1; sz <= SlabMemoryResource::kMaxSlabSize; ++sz) {
+    unsigned cls = SlabMemoryResource::SizeClass(sz);
+    ASSERT_LT(cls, SlabMemoryResource::kNumClasses);
+    ASSERT_LE(sz, SlabMemoryResource::ClassSize(cls));
+    if (cls > 0) {
+      ASSERT_GT(sz, SlabMemoryResource::ClassSize(cls - 1));
+    }
+  }
+  EXPECT_EQ(160, SlabMemoryResource::ClassSize(8));
+  EXPECT_EQ(320, SlabMemoryResource::ClassSize(12));
+}
+
+TEST_F(SlabResourceTest, Reuse) {
+  void* p1 = mr_.allocate(40);
+  void* p2 = mr_.allocate(48);
+  EXPECT_EQ(0, reinterpret_cast<uintptr_t>(p1) % SlabMemoryResource::kSlabAlignment);
+  EXPECT_NE(p1, p2);
+  mr_.deallocate(p1, 40);
+  EXPECT_EQ(p1, mr_.allocate(33));
+
+  SlabMemoryResource::Stats stats = mr_.GetLocalStats();
+  const auto& cs = stats.classes[SlabMemoryResource::SizeClass(48)];
+  EXPECT_EQ(48, cs.block_size);
+  EXPECT_EQ(3, cs.allocs);
+  EXPECT_EQ(1, cs.frees);
+  EXPECT_EQ(2, cs.used_blocks);
+  EXPECT_EQ(2, cs.reserved_blocks);
+  EXPECT_EQ(1 << 16, stats.span_bytes);
+
+  void* large = mr_.allocate(1 << 20);
+  mr_.deallocate(large, 1 << 20);
+  stats = mr_.GetLocalStats();
+  EXPECT_EQ(1, stats.large_allocs);
+  EXPECT_EQ(1, stats.large_frees);
+  EXPECT_EQ(1 << 16, stats.span_bytes);
+}
+
+TEST_F(SlabResourceTest, PODArray) {
+  {
+    PODArray<uint64_t> arr(&mr_);
+    for (uint64_t i = 0; i < 1000; ++i)
+      arr.push_back(i);
+    for (uint64_t i = 0; i < 1000; ++i) {
+      ASSERT_EQ(i, arr[i]);
+    }
+  }
+
+  SlabMemoryResource::Stats stats = mr_.GetLocalStats();
+  for (const auto& cs : stats.classes) {
+    EXPECT_EQ(0, cs.used_blocks) << cs.block_size;
+  }
+}
+
+TEST_F(SlabResourceTest, RemoteFree) {
+  constexpr unsigned kNum = 1000;
+  vector<void*> blocks(kNum);
+  for (unsigned i = 0; i < kNum; ++i)
+    blocks[i] = mr_.allocate(64);
+
+  thread([&] {
+    for (void* p : blocks)
+      mr_.deallocate(p, 64);
+    // The frees were returned to the owner heap.
+    EXPECT_EQ(0, mr_.GetLocalStats().classes[SlabMemoryResource::SizeClass(64)].frees);
+  }).join();
+
+  const auto& stats = mr_.GetLocalStats().classes[SlabMemoryResource::SizeClass(64)];
+  EXPECT_EQ(kNum, stats.used_blocks);
+
+  // Remote frees are reused by the owner.
+  void* p = mr_.allocate(64);
+  EXPECT_NE(find(blocks.begin(), blocks.end(), p), blocks.end());
+
+  const auto& stats2 = mr_.GetLocalStats().classes[SlabMemoryResource::SizeClass(64)];
+  EXPECT_EQ(kNum, stats2.remote_frees);
+  EXPECT_EQ(1, stats2.used_blocks);
+  EXPECT_EQ(kNum, stats2.reserved_blocks);
+}
+
+static void BM_Allocate(benchmark::State& state) {
+  SlabMemoryResource mr;
+  vector<void*> blocks(256);
+  size_t size = state.range(0);
+  while (state.KeepRunning()) {
+    for (auto& p : blocks)
+      p = mr.allocate(size);
+    for (void* p : blocks)
+      mr.deallocate(p, size);
+  }
+}
+BENCHMARK(BM_Allocate)->Arg(32)->Arg(256)->Arg(4096);
+
+}  // namespace base
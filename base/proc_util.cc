@@ -8,6 +8,10 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <fstream>
+#include <string>
+#include <vector>
+
 #include "base/integral_types.h"
 #include "base/logging.h"
 
@@ -45,6 +49,130 @@ void GetKernelVersion(KernelVersion* version) {
   CHECK(res == 3 || res == 4) << res;
 }
 
+namespace {
+
+struct CpuCgroup {
+  bool v2 = false;
+  std::vector<std::string> dirs;  // the cgroup and its ancestors, the cgroup first.
+};
+
+// Finds the directory of the cpu controller of the process in /sys/fs/cgroup. Within a cgroup
+// namespace, e.g. in a container, /proc/self/cgroup shows "/" and the root of the mount is
+// the cgroup of the process.
+CpuCgroup FindCpuCgroup(std::string_view root) {
+  const std::string prefix(root);
+  std::ifstream file(prefix + "/proc/self/cgroup");
+  std::string line, v1_path, v2_path;
+  bool has_v1 = false;
+
+  // Lines have the "hierarchy-id:controllers:path" format, the unified v2 hierarchy has
+  // id 0 and no controllers.
+  while (std::getline(file, line)) {
+    size_t first = line.find(':');
+    size_t second = first == std::string::npos ? first : line.find(':', first + 1);
+    if (second == std::string::npos)
+      continue;
+
+    std::string id = line.substr(0, first);
+    std::string controllers = "," + line.substr(first + 1, second - first - 1) + ",";
+    std::string path = line.substr(second + 1);
+    if (id == "0" && controllers == ",,") {
+      v2_path = path;
+    } else if (controllers.find(",cpu,") != std::string::npos) {
+      v1_path = path;
+      has_v1 = true;
+    }
+  }
+
+  CpuCgroup res;
+  std::string mount, path;
+  if (has_v1) {
+    for (const char* dir : {"/sys/fs/cgroup/cpu,cpuacct", "/sys/fs/cgroup/cpu"}) {
+      if (access((prefix + dir).c_str(), F_OK) == 0) {
+        mount = prefix + dir;
+        break;
+      }
+    }
+    path = v1_path;
+  } else if (!v2_path.empty()) {
+    mount = prefix + "/sys/fs/cgroup";
+    path = v2_path;
+    res.v2 = true;
+  }
+  if (mount.empty())
+    return res;
+
+  if (access((mount + path).c_str(), F_OK) != 0)
+    path = "/";  // namespaced.
+
+  while (true) {
+    res.dirs.push_back(path == "/" ? mount : mount + path);
+    if (path.size() <= 1)
+      break;
+    size_t pos = path.rfind('/');
+    path = pos == 0 ? "/" : path.substr(0, pos);
+  }
+  return res;
+}
+
+bool ReadLine(const std::string& path, std::string* line) {
+  std::ifstream file(path);
+  return bool(std::getline(file, *line));
+}
+
+}  // namespace
+
+double GetCgroupCpuQuota(std::string_view root) {
+  CpuCgroup cgroup = FindCpuCgroup(root);
+  double res = 0;
+  for (const std::string& dir : cgroup.dirs) {
+    double quota = 0, period = 0;
+    std::string line;
+    if (cgroup.v2) {
+      // "max 100000" or "<quota> <period>".
+      if (!ReadLine(dir + "/cpu.max", &line) ||
+          sscanf(line.c_str(), "%lf %lf", &quota, &period) != 2)
+        continue;
+    } else {
+      std::string period_line;
+      if (!ReadLine(dir + "/cpu.cfs_quota_us", &line) ||
+          !ReadLine(dir + "/cpu.cfs_period_us", &period_line))
+        continue;
+      quota = atof(line.c_str());  // -1 if unlimited.
+      period = atof(period_line.c_str());
+    }
+
+    if (quota > 0 && period > 0 && (res == 0 || quota / period < res))
+      res = quota / period;
+  }
+  return res;
+}
+
+bool GetCgroupCpuStats(CgroupCpuStats* stats, std::string_view root) {
+  CpuCgroup cgroup = FindCpuCgroup(root);
+  if (cgroup.dirs.empty())
+    return false;
+
+  std::ifstream file(cgroup.dirs.front() + "/cpu.stat");
+  if (!file)
+    return false;
+
+  *stats = CgroupCpuStats{};
+  std::string key;
+  uint64_t val;
+  while (file >> key >> val) {
+    if (key == "nr_periods")
+      stats->periods = val;
+    else if (key == "nr_throttled")
+      stats->throttled_periods = val;
+    else if (key == "throttled_usec")  // v2
+      stats->throttled_usec = val;
+    else if (key == "throttled_time")  // v1, in nanoseconds.
+      stats->throttled_usec = val / 1000;
+  }
+  return true;
+}
+
 }  // namespace sys
 
 int sh_exec(const char* cmd) {
@@ -7,6 +7,9 @@
 
 #pragma once
 
+#include <cstdint>
+#include <string_view>
+
 namespace base {
 
 namespace sys {
@@ -18,6 +21,25 @@ struct KernelVersion {
 };
 
 void GetKernelVersion(KernelVersion* version);
+
+// Returns the cpu bandwidth limit of the cgroup of the process in cpus, e.g. 2.5 for a quota
+// of 250ms per 100ms period, or 0 if it is unlimited or unknown. The limit is the smallest
+// of the cgroup and its visible ancestors, read from cpu.max with cgroup v2 and from
+// cpu.cfs_quota_us and cpu.cfs_period_us with v1. Note that the cpuset of the cgroup does not
+// need to be read, it is already reflected in the affinity mask of the process.
+// root prefixes the paths of /proc/self/cgroup and /sys/fs/cgroup, e.g. for tests.
+double GetCgroupCpuQuota(std::string_view root = {});
+
+struct CgroupCpuStats {
+  uint64_t periods = 0;  // enforcement periods that elapsed.
+  uint64_t throttled_periods = 0;
+  uint64_t throttled_usec = 0;  // total time the threads of the cgroup were throttled for.
+};
+
+// Reads the throttling statistics of the cgroup of the process. Returns false if it has no
+// cpu controller. root is as in GetCgroupCpuQuota.
+bool GetCgroupCpuStats(CgroupCpuStats* stats, std::string_view root = {});
+
 }  // namespace sys
 
 // Runs sh with the command. Returns 0 if succeeded. Child status is ignored.
@@ -0,0 +1,86 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "base/proc_util.h"
+
+#include <filesystem>
+#include <fstream>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace base {
+namespace sys {
+
+using namespace std;
+namespace fs = std::filesystem;
+
+// Mirrors /proc/self/cgroup and /sys/fs/cgroup in a temporary directory.
+class CgroupTest : public testing::Test {
+ protected:
+  void SetUp() final {
+    root_ = GetTestTempPath(testing::UnitTest::GetInstance()->current_test_info()->name());
+    fs::remove_all(root_);
+    fs::create_directories(root_ + "/proc/self");
+  }
+
+  void Write(const string& path, const string& contents) {
+    fs::path full = root_ + path;
+    fs::create_directories(full.parent_path());
+    ofstream(full) << contents;
+  }
+
+  string root_;
+};
+
+TEST_F(CgroupTest, V2Unlimited) {
+  Write("/proc/self/cgroup", "0::/app\n");
+  Write("/sys/fs/cgroup/app/cpu.max", "max 100000\n");
+  EXPECT_EQ(0, GetCgroupCpuQuota(root_));
+}
+
+TEST_F(CgroupTest, V2Quota) {
+  Write("/proc/self/cgroup", "0::/app\n");
+  Write("/sys/fs/cgroup/app/cpu.max", "250000 100000\n");
+  Write("/sys/fs/cgroup/app/cpu.stat",
+        "usage_usec 100\nnr_periods 10\nnr_throttled 3\nthrottled_usec 4000\n");
+  EXPECT_DOUBLE_EQ(2.5, GetCgroupCpuQuota(root_));
+
+  CgroupCpuStats stats;
+  ASSERT_TRUE(GetCgroupCpuStats(&stats, root_));
+  EXPECT_EQ(10u, stats.periods);
+  EXPECT_EQ(3u, stats.throttled_periods);
+  EXPECT_EQ(4000u, stats.throttled_usec);
+}
+
+TEST_F(CgroupTest, V1Unlimited) {
+  Write("/proc/self/cgroup", "5:memory:/app\n4:cpu,cpuacct:/app\n0::/\n");
+  Write("/sys/fs/cgroup/cpu,cpuacct/app/cpu.cfs_quota_us", "-1\n");
+  Write("/sys/fs/cgroup/cpu,cpuacct/app/cpu.cfs_period_us", "100000\n");
+  EXPECT_EQ(0, GetCgroupCpuQuota(root_));
+}
+
+TEST_F(CgroupTest, NestedAncestor) {
+  // The ancestor limits its children to a smaller quota.
+  Write("/proc/self/cgroup", "0::/a/b\n");
+  Write("/sys/fs/cgroup/a/b/cpu.max", "400000 100000\n");
+  Write("/sys/fs/cgroup/a/cpu.max", "150000 100000\n");
+  EXPECT_DOUBLE_EQ(1.5, GetCgroupCpuQuota(root_));
+}
+
+TEST_F(CgroupTest, Namespaced) {
+  // In a container the mount root is the cgroup of the process.
+  Write("/proc/self/cgroup", "0::/\n");
+  Write("/sys/fs/cgroup/cpu.max", "50000 100000\n");
+  EXPECT_DOUBLE_EQ(0.5, GetCgroupCpuQuota(root_));
+}
+
+TEST_F(CgroupTest, NoController) {
+  EXPECT_EQ(0, GetCgroupCpuQuota(root_));
+  CgroupCpuStats stats;
+  EXPECT_FALSE(GetCgroupCpuStats(&stats, root_));
+}
+
+}  // namespace sys
+}  // namespace base
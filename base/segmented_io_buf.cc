@@ -0,0 +1,194 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+#include "base/segmented_io_buf.h"
+
+#include <algorithm>
+#include <cassert>
+
+namespace base {
+
+using namespace std;
+
+SegmentedIoBuf::SegmentedIoBuf(size_t block_size, PMR_NS::memory_resource* mr)
+    : block_size_(block_size), mr_(mr) {
+  assert(block_size > 0);
+}
+
+SegmentedIoBuf::~SegmentedIoBuf() {
+  for (uint8_t* block : blocks_)
+    mr_->deallocate(block, block_size_);
+  if (spare_)
+    mr_->deallocate(spare_, block_size_);
+}
+
+auto SegmentedIoBuf::InputBuffer() const -> ConstBytes {
+  if (input_len_ == 0)
+    return {};
+  return ConstBytes{blocks_.front() + read_offs_, InputEnd(0) - read_offs_};
+}
+
+size_t SegmentedIoBuf::InputBuffers(iovec* dest, size_t max_count) const {
+  size_t count = 0;
+  if (input_len_ == 0)
+    return 0;
+
+  for (size_t i = 0; i <= write_index_ && count < max_count; ++i) {
+    size_t start = i == 0 ? read_offs_ : 0;
+    size_t end = InputEnd(i);
+    if (end > start)
+      dest[count++] = iovec{blocks_[i] + start, end - start};
+  }
+  return count;
+}
+
+void SegmentedIoBuf::ConsumeInput(size_t num_read) {
+  num_read = min(num_read, input_len_);
+  input_len_ -= num_read;
+
+  while (num_read > 0) {
+    size_t step = min(num_read, InputEnd(0) - read_offs_);
+    read_offs_ += step;
+    num_read -= step;
+
+    if (read_offs_ == block_size_) {
+      FreeBlock(blocks_.front());
+      blocks_.pop_front();
+      read_offs_ = 0;
+      if (write_index_ > 0) {
+        --write_index_;
+      } else {
+        // The write block was full and it was the last one.
+        write_offs_ = 0;
+      }
+    }
+  }
+
+  if (input_len_ == 0)
+    Trim();
+}
+
+void SegmentedIoBuf::ReadAndConsume(size_t num_write, void* dest) {
+  assert(num_write <= input_len_);
+  uint8_t* next = reinterpret_cast<uint8_t*>(dest);
+  size_t left = num_write;
+
+  for (size_t i = 0; i <= write_index_ && left > 0; ++i) {
+    size_t start = i == 0 ? read_offs_ : 0;
+    size_t len = min(left, InputEnd(i) - start);
+    memcpy(next, blocks_[i] + start, len);
+    next += len;
+    left -= len;
+  }
+  ConsumeInput(num_write);
+}
+
+size_t SegmentedIoBuf::AppendLen() const {
+  if (blocks_.empty())
+    return 0;
+  return (blocks_.size() - write_index_) * block_size_ - write_offs_;
+}
+
+auto SegmentedIoBuf::AppendBuffer() -> Bytes {
+  if (blocks_.empty()) {
+    blocks_.push_back(AllocateBlock());
+  } else if (write_offs_ == block_size_) {
+    if (write_index_ + 1 == blocks_.size())
+      blocks_.push_back(AllocateBlock());
+    ++write_index_;
+    write_offs_ = 0;
+  }
+  return Bytes{blocks_[write_index_] + write_offs_, block_size_ - write_offs_};
+}
+
+size_t SegmentedIoBuf::AppendBuffers(iovec* dest, size_t max_count) {
+  size_t count = 0;
+  size_t offs = write_offs_;
+  for (size_t i = write_index_; i < blocks_.size() && count < max_count; ++i) {
+    if (offs < block_size_)
+      dest[count++] = iovec{blocks_[i] + offs, block_size_ - offs};
+    offs = 0;
+  }
+  return count;
+}
+
+void SegmentedIoBuf::CommitWrite(size_t num_written) {
+  assert(num_written <= AppendLen());
+  input_len_ += num_written;
+
+  while (num_written > 0) {
+    if (write_offs_ == block_size_) {
+      ++write_index_;
+      write_offs_ = 0;
+    }
+    size_t step = min(num_written, block_size_ - write_offs_);
+    write_offs_ += step;
+    num_written -= step;
+  }
+}
+
+void SegmentedIoBuf::WriteAndCommit(const void* source, size_t num_copy) {
+  const uint8_t* next = reinterpret_cast<const uint8_t*>(source);
+  while (num_copy > 0) {
+    Bytes dest = AppendBuffer();
+    size_t len = min(num_copy, dest.size());
+    memcpy(dest.data(), next, len);
+    CommitWrite(len);
+    next += len;
+    num_copy -= len;
+  }
+}
+
+void SegmentedIoBuf::EnsureCapacity(size_t sz) {
+  while (AppendLen() < sz)
+    blocks_.push_back(AllocateBlock());
+}
+
+void SegmentedIoBuf::Clear() {
+  input_len_ = 0;
+  write_index_ = 0;
+  Trim();
+}
+
+void SegmentedIoBuf::Trim() {
+  assert(input_len_ == 0);
+  read_offs_ = write_offs_ = 0;
+  if (blocks_.empty())
+    return;
+
+  // When the input is empty, the read block is the write block.
+  uint8_t* block = blocks_[write_index_];
+  for (size_t i = 0; i < blocks_.size(); ++i) {
+    if (i != write_index_)
+      FreeBlock(blocks_[i]);
+  }
+  blocks_.clear();
+  blocks_.push_back(block);
+  write_index_ = 0;
+}
+
+uint8_t* SegmentedIoBuf::AllocateBlock() {
+  if (spare_)
+    return exchange(spare_, nullptr);
+  return reinterpret_cast<uint8_t*>(mr_->allocate(block_size_));
+}
+
+void SegmentedIoBuf::FreeBlock(uint8_t* block) {
+  if (spare_)
+    mr_->deallocate(block, block_size_);
+  else
+    spare_ = block;
+}
+
+void SegmentedIoBuf::Swap(SegmentedIoBuf& other) {
+  swap(block_size_, other.block_size_);
+  swap(mr_, other.mr_);
+  swap(blocks_, other.blocks_);
+  swap(spare_, other.spare_);
+  swap(read_offs_, other.read_offs_);
+  swap(write_index_, other.write_index_);
+  swap(write_offs_, other.write_offs_);
+  swap(input_len_, other.input_len_);
+}
+
+}  // namespace base
@@ -0,0 +1,127 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+#pragma once
+
+#include <absl/types/span.h>
+#include <sys/uio.h>
+
+#include <deque>
+
+#include "base/io_buf.h"
+#include "base/pmr/memory_resource.h"
+
+namespace base {
+
+// IoBuf variant that keeps its contents in a chain of fixed size blocks. Growing never moves
+// the data and consumed blocks are released immediately, so a large request does not leave
+// a large buffer behind. Blocks are allocated from mr, pass a pooling resource like
+// SlabMemoryResource to recycle them between buffers.
+// The input and the append areas are exposed as iovec arrays for vectored io.
+class SegmentedIoBuf {
+ public:
+  using Bytes = IoBuf::Bytes;
+  using ConstBytes = IoBuf::ConstBytes;
+
+  explicit SegmentedIoBuf(size_t block_size = 4096,
+                          PMR_NS::memory_resource* mr = PMR_NS::get_default_resource());
+
+  SegmentedIoBuf(const SegmentedIoBuf&) = delete;
+  SegmentedIoBuf& operator=(const SegmentedIoBuf&) = delete;
+
+  SegmentedIoBuf(SegmentedIoBuf&& other) : SegmentedIoBuf(other.block_size_, other.mr_) {
+    Swap(other);
+  }
+
+  SegmentedIoBuf& operator=(SegmentedIoBuf&& other) {
+    Swap(other);
+    return *this;
+  }
+
+  ~SegmentedIoBuf();
+
+  // ============== INPUT =======================
+
+  size_t InputLen() const {
+    return input_len_;
+  }
+
+  // Returns the contiguous input in the first block.
+  ConstBytes InputBuffer() const;
+
+  // Fills up to max_count entries of dest with the input segments in order and returns the
+  // number of entries filled.
+  size_t InputBuffers(iovec* dest, size_t max_count) const;
+
+  // Mark num_read bytes from the input as read.
+  void ConsumeInput(size_t num_read);
+
+  // Write num_write bytes to dest and mark them as read.
+  void ReadAndConsume(size_t num_write, void* dest);
+
+  // ============== OUTPUT ============
+
+  // The append space of all the allocated blocks.
+  size_t AppendLen() const;
+
+  // Returns the contiguous append space in the current block, allocates a block if it is full.
+  Bytes AppendBuffer();
+
+  // Like InputBuffers for the append space. Call EnsureCapacity before to size it.
+  size_t AppendBuffers(iovec* dest, size_t max_count);
+
+  // Mark num_written bytes as written, they may span several blocks.
+  void CommitWrite(size_t num_written);
+
+  void WriteAndCommit(const void* source, size_t num_copy);
+
+  // Ensure required append space, allocates blocks as needed.
+  void EnsureCapacity(size_t sz);
+
+  // ============== GENERIC ===========
+
+  // Clear all input and release all the blocks but one.
+  void Clear();
+
+  size_t block_size() const {
+    return block_size_;
+  }
+
+  size_t NumBlocks() const {
+    return blocks_.size();
+  }
+
+  IoBuf::MemoryUsage GetMemoryUsage() const {
+    return {
+        .consumed = read_offs_,
+        .input_length = InputLen(),
+        .append_length = AppendLen() + (spare_ ? block_size_ : 0),
+    };
+  }
+
+ private:
+  void Swap(SegmentedIoBuf& other);
+
+  uint8_t* AllocateBlock();
+  void FreeBlock(uint8_t* block);
+
+  // Releases the blocks after the write block once the input is empty.
+  void Trim();
+
+  size_t InputEnd(size_t index) const {
+    return index == write_index_ ? write_offs_ : block_size_;
+  }
+
+  size_t block_size_;
+  PMR_NS::memory_resource* mr_;
+
+  std::deque<uint8_t*> blocks_;
+  uint8_t* spare_ = nullptr;  // a released block that is kept to avoid churn.
+
+  size_t read_offs_ = 0;  // in blocks_.front().
+  size_t write_index_ = 0;
+  size_t write_offs_ = 0;  // in blocks_[write_index_].
+  size_t input_len_ = 0;
+};
+
+}  // namespace base
@@ -0,0 +1,115 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+#include "base/segmented_io_buf.h"
+
+#include <random>
+
+#include "base/gtest.h"
+#include "base/pmr/slab_resource.h"
+
+namespace base {
+
+using namespace std;
+
+class SegmentedIoBufTest : public testing::Test {
+ protected:
+  static string Input(const SegmentedIoBuf& buf) {
+    iovec v[64];
+    size_t count = buf.InputBuffers(v, 64);
+    string res;
+    for (size_t i = 0; i < count; ++i)
+      res.append(reinterpret_cast<const char*>(v[i].iov_base), v[i].iov_len);
+    return res;
+  }
+};
+
+TEST_F(SegmentedIoBufTest, Basic) {
+  SegmentedIoBuf buf(16);
+  EXPECT_EQ(0, buf.InputLen());
+  EXPECT_EQ(0, buf.AppendLen());
+  EXPECT_TRUE(buf.InputBuffer().empty());
+
+  string data = "0123456789abcdefghijklmnopqrstuvwxyz";
+  buf.WriteAndCommit(data.data(), data.size());
+  EXPECT_EQ(data.size(), buf.InputLen());
+  EXPECT_EQ(3, buf.NumBlocks());
+  EXPECT_EQ(16, buf.InputBuffer().size());
+  EXPECT_EQ(data, Input(buf));
+
+  char dest[20];
+  buf.ReadAndConsume(20, dest);
+  EXPECT_EQ(data.substr(0, 20), string(dest, 20));
+  EXPECT_EQ(2, buf.NumBlocks());
+  EXPECT_EQ(data.substr(20), Input(buf));
+
+  buf.ConsumeInput(100);
+  EXPECT_EQ(0, buf.InputLen());
+  EXPECT_EQ(1, buf.NumBlocks());
+  EXPECT_EQ(16, buf.AppendLen());
+}
+
+TEST_F(SegmentedIoBufTest, Vectored) {
+  SegmentedIoBuf buf(64);
+  buf.EnsureCapacity(1000);
+  EXPECT_GE(buf.AppendLen(), 1000);
+
+  // Emulate a RecvMsg into the append space.
+  iovec v[32];
+  size_t count = buf.AppendBuffers(v, 32);
+  ASSERT_EQ(16, count);
+  string expected;
+  size_t written = 0;
+  for (size_t i = 0; i < count && written < 1000; ++i) {
+    size_t len = min<size_t>(v[i].iov_len, 1000 - written);
+    for (size_t j = 0; j < len; ++j) {
+      char c = 'a' + (written + j) % 26;
+      reinterpret_cast<char*>(v[i].iov_base)[j] = c;
+      expected.push_back(c);
+    }
+    written += len;
+  }
+  buf.CommitWrite(written);
+  EXPECT_EQ(expected, Input(buf));
+
+  // Emulate a partial WriteSome.
+  buf.ConsumeInput(130);
+  expected.erase(0, 130);
+  EXPECT_EQ(expected, Input(buf));
+  EXPECT_EQ(64 - 2, buf.InputBuffer().size());
+
+  buf.Clear();
+  EXPECT_EQ(0, buf.InputLen());
+  EXPECT_EQ(1, buf.NumBlocks());
+}
+
+TEST_F(SegmentedIoBufTest, Random) {
+  SlabMemoryResource mr;
+  SegmentedIoBuf buf(128, &mr);
+  std::mt19937 rand(7);
+  string expected;
+  uint64_t seq = 0;
+
+  for (unsigned i = 0; i < 10000; ++i) {
+    if (rand() % 2) {
+      string data(rand() % 500, '\0');
+      for (auto& c : data)
+        c = seq++;
+      buf.WriteAndCommit(data.data(), data.size());
+      expected += data;
+    } else {
+      size_t len = rand() % 600;
+      buf.ConsumeInput(len);
+      expected.erase(0, len);
+    }
+    ASSERT_EQ(expected.size(), buf.InputLen());
+    ASSERT_GE(buf.NumBlocks() * 128, expected.size());
+  }
+  EXPECT_EQ(expected, Input(buf));
+
+  SegmentedIoBuf other = std::move(buf);
+  EXPECT_EQ(0, buf.InputLen());
+  EXPECT_EQ(expected.size(), other.InputLen());
+}
+
+}  // namespace base
@@ -0,0 +1,128 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <sched.h>
+
+#include <atomic>
+#include <cstdint>
+
+#include "base/port.h"
+
+namespace base {
+
+// A reader-writer spinlock for read-mostly data that is accessed by many threads. Unlike
+// folly::RWSpinLock, whose single word is written by every reader, the readers are counted
+// in kNumSlots cache lines. Each thread uses the slot of the cpu that it ran on when it
+// first took the lock, so that pinned threads never share their line with the threads of
+// other cpus. A writer flags the lock and then waits for all the slots to drain, hence
+// writers are slow and should be rare. Writers are preferred, new readers wait while
+// a writer is pending. Takes kNumSlots * 64 bytes. Not recursive, the read lock must be
+// released by the thread that took it. Compatible with std::unique_lock and
+// std::shared_lock.
+class ShardedRWSpinLock {
+ public:
+  static constexpr unsigned kNumSlots = 64;
+
+  ShardedRWSpinLock() = default;
+  ShardedRWSpinLock(const ShardedRWSpinLock&) = delete;
+  void operator=(const ShardedRWSpinLock&) = delete;
+
+  void lock() {
+    unsigned count = 0;
+    while (writer_.exchange(true, std::memory_order_seq_cst))
+      Backoff(&count);
+
+    for (Slot& slot : slots_) {
+      while (slot.readers.load(std::memory_order_seq_cst) != 0)
+        Backoff(&count);
+    }
+  }
+
+  bool try_lock() {
+    if (writer_.exchange(true, std::memory_order_seq_cst))
+      return false;
+
+    for (Slot& slot : slots_) {
+      if (slot.readers.load(std::memory_order_seq_cst) != 0) {
+        // The flag was ours, the blocked readers may proceed.
+        writer_.store(false, std::memory_order_release);
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void unlock() {
+    writer_.store(false, std::memory_order_release);
+  }
+
+  void lock_shared() {
+    std::atomic_int32_t& readers = slots_[ThreadSlot()].readers;
+    unsigned count = 0;
+    while (true) {
+      // Both the increment and the check are sequentially consistent and so are
+      // the operations of the writer: either we see its flag or it sees our count.
+      readers.fetch_add(1, std::memory_order_seq_cst);
+      if (PREDICT_TRUE(!writer_.load(std::memory_order_seq_cst)))
+        return;
+
+      readers.fetch_sub(1, std::memory_order_release);
+      while (writer_.load(std::memory_order_relaxed))
+        Backoff(&count);
+    }
+  }
+
+  bool try_lock_shared() {
+    std::atomic_int32_t& readers = slots_[ThreadSlot()].readers;
+    readers.fetch_add(1, std::memory_order_seq_cst);
+    if (PREDICT_TRUE(!writer_.load(std::memory_order_seq_cst)))
+      return true;
+    readers.fetch_sub(1, std::memory_order_release);
+    return false;
+  }
+
+  void unlock_shared() {
+    slots_[ThreadSlot()].readers.fetch_sub(1, std::memory_order_release);
+  }
+
+ private:
+  struct alignas(64) Slot {
+    std::atomic_int32_t readers{0};
+  };
+
+  // Spins for a while and then yields, like folly::RWSpinLock.
+  static void Backoff(unsigned* count) {
+    if (++*count > 1000) {
+      sched_yield();
+      return;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+  }
+
+  static unsigned ThreadSlot() {
+    thread_local unsigned slot = AssignSlot();
+    return slot;
+  }
+
+  static unsigned AssignSlot() {
+#ifdef __linux__
+    int cpu = sched_getcpu();
+    if (cpu >= 0)
+      return unsigned(cpu) % kNumSlots;
+#endif
+    static std::atomic_uint32_t next{0};
+    return next.fetch_add(1, std::memory_order_relaxed) % kNumSlots;
+  }
+
+  Slot slots_[kNumSlots];
+  alignas(64) std::atomic_bool writer_{false};
+};
+
+}  // namespace base
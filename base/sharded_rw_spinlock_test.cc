@@ -0,0 +1,113 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "base/sharded_rw_spinlock.h"
+
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+#include "base/RWSpinLock.h"
+#include "base/gtest.h"
+#include "base/logging.h"
+
+using namespace std;
+
+namespace base {
+
+class ShardedRWSpinLockTest : public testing::Test {};
+
+TEST_F(ShardedRWSpinLockTest, TryLock) {
+  ShardedRWSpinLock lock;
+
+  EXPECT_TRUE(lock.try_lock_shared());
+  EXPECT_TRUE(lock.try_lock_shared());
+  EXPECT_FALSE(lock.try_lock());
+  lock.unlock_shared();
+  lock.unlock_shared();
+
+  EXPECT_TRUE(lock.try_lock());
+  EXPECT_FALSE(lock.try_lock());
+  EXPECT_FALSE(lock.try_lock_shared());
+  lock.unlock();
+
+  // The readers of other threads count too.
+  atomic_int stage{0};
+  thread reader([&] {
+    lock.lock_shared();
+    stage = 1;
+    while (stage != 2)
+      this_thread::yield();
+    lock.unlock_shared();
+  });
+  while (stage != 1)
+    this_thread::yield();
+  EXPECT_FALSE(lock.try_lock());
+  stage = 2;
+  reader.join();
+  EXPECT_TRUE(lock.try_lock());
+  lock.unlock();
+}
+
+TEST_F(ShardedRWSpinLockTest, Exclusion) {
+  ShardedRWSpinLock lock;
+  uint64_t a = 0, b = 0;  // the writers keep them equal.
+  atomic_bool torn{false};
+
+  constexpr unsigned kIters = 20000;
+  vector<thread> threads;
+  for (unsigned i = 0; i < 8; ++i) {
+    threads.emplace_back([&, i] {
+      for (unsigned j = 0; j < kIters; ++j) {
+        if (j % 16 == i % 2) {
+          unique_lock lk(lock);
+          ++a;
+          ++b;
+        } else {
+          shared_lock lk(lock);
+          if (a != b)
+            torn = true;
+        }
+      }
+    });
+  }
+  for (auto& t : threads)
+    t.join();
+
+  EXPECT_FALSE(torn);
+  EXPECT_EQ(a, b);
+  EXPECT_EQ(8u * kIters / 16, a);
+}
+
+// Takes the read lock write_ratio - 1 times per a write lock.
+template <typename Lock> void BM_Lock(benchmark::State& state, Lock* lock) {
+  const int64_t write_ratio = state.range(0);
+  unsigned data = 0;  // the critical section.
+  int64_t i = 0;
+  for (auto _ : state) {
+    if (write_ratio && ++i % write_ratio == 0) {
+      unique_lock lk(*lock);
+      ++data;
+    } else {
+      shared_lock lk(*lock);
+      benchmark::DoNotOptimize(data);
+    }
+  }
+}
+
+folly::RWSpinLock rw_spinlock;
+ShardedRWSpinLock sharded_spinlock;
+
+void BM_RWSpinLock(benchmark::State& state) {
+  BM_Lock(state, &rw_spinlock);
+}
+BENCHMARK(BM_RWSpinLock)->Arg(0)->Arg(1000)->ThreadRange(1, 64)->UseRealTime();
+
+void BM_ShardedRWSpinLock(benchmark::State& state) {
+  BM_Lock(state, &sharded_spinlock);
+}
+BENCHMARK(BM_ShardedRWSpinLock)->Arg(0)->Arg(1000)->ThreadRange(1, 64)->UseRealTime();
+
+}  // namespace base
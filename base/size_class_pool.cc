@@ -0,0 +1,146 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "base/size_class_pool.h"
+
+#include <algorithm>
+
+#include "base/logging.h"
+
+namespace base {
+
+SizeClassPool::SizeClassPool(unsigned size) {
+  std::fill(std::begin(heads_), std::end(heads_), kNil);
+  Grow(size);
+}
+
+std::optional<unsigned> SizeClassPool::Request(unsigned length) {
+  length = std::max(length, 1u);
+  ++stats_.requests;
+
+  uint32_t offset = kNil;
+  unsigned cls = SizeClass(length);
+
+  // Any range from a higher class is large enough. From the same class we check the head
+  // first, and walk the rest of its list only if there is no higher class, so the request is
+  // constant-time unless the pool is almost exhausted.
+  uint32_t higher = cls + 1 < kNumClasses ? class_mask_ >> (cls + 1) : 0;
+  if (heads_[cls] != kNil && nodes_[heads_[cls]].len >= length) {
+    offset = heads_[cls];
+  } else if (higher) {
+    offset = heads_[cls + 1 + __builtin_ctz(higher)];
+  } else {
+    for (uint32_t it = heads_[cls]; it != kNil; it = nodes_[it].next) {
+      if (nodes_[it].len >= length) {
+        offset = it;
+        break;
+      }
+    }
+    if (offset == kNil) {
+      ++stats_.failures;
+      return std::nullopt;
+    }
+  }
+
+  Unlink(offset);
+  uint32_t len = nodes_[offset].len;
+  if (len > length) {
+    Link(offset + length, len - length);
+  }
+
+  nodes_[offset].len = length;
+  stats_.used_units += length;
+  return offset;
+}
+
+void SizeClassPool::Return(unsigned offset) {
+  DCHECK_LT(offset, size_);
+  DCHECK(!nodes_[offset].free);
+
+  uint32_t len = nodes_[offset].len;
+  DCHECK_GE(stats_.used_units, len);
+  stats_.used_units -= len;
+  Release(offset, len);
+}
+
+void SizeClassPool::Grow(unsigned additional) {
+  if (additional == 0)
+    return;
+
+  uint32_t offset = size_;
+  size_ += additional;
+  nodes_.resize(size_);
+  Release(offset, additional);
+}
+
+unsigned SizeClassPool::LargestFreeRange() const {
+  if (class_mask_ == 0)
+    return 0;
+
+  unsigned cls = SizeClass(class_mask_);
+  uint32_t res = 0;
+  for (uint32_t it = heads_[cls]; it != kNil; it = nodes_[it].next) {
+    res = std::max(res, nodes_[it].len);
+  }
+  return res;
+}
+
+void SizeClassPool::Link(uint32_t offset, uint32_t len) {
+  unsigned cls = SizeClass(len);
+  Node& node = nodes_[offset];
+  node.len = len;
+  node.free = true;
+  node.prev = kNil;
+  node.next = heads_[cls];
+  nodes_[offset + len - 1].start = offset;
+
+  if (node.next != kNil)
+    nodes_[node.next].prev = offset;
+  heads_[cls] = offset;
+  class_mask_ |= (1u << cls);
+  ++stats_.free_ranges;
+}
+
+void SizeClassPool::Unlink(uint32_t offset) {
+  Node& node = nodes_[offset];
+  DCHECK(node.free);
+
+  unsigned cls = SizeClass(node.len);
+  if (node.prev != kNil) {
+    nodes_[node.prev].next = node.next;
+  } else {
+    heads_[cls] = node.next;
+    if (node.next == kNil)
+      class_mask_ &= ~(1u << cls);
+  }
+
+  if (node.next != kNil)
+    nodes_[node.next].prev = node.prev;
+  node.free = false;
+  --stats_.free_ranges;
+}
+
+void SizeClassPool::Release(uint32_t offset, uint32_t len) {
+  // Merge with the right neighbour.
+  uint32_t right = offset + len;
+  if (right < size_ && nodes_[right].free) {
+    len += nodes_[right].len;
+    Unlink(right);
+  }
+
+  // Merge with the left neighbour. The start index at the unit before us is valid only if
+  // it belongs to a free range, which we verify by checking that the range ends right here.
+  if (offset > 0) {
+    uint32_t left = nodes_[offset - 1].start;
+    if (nodes_[left].free && left + nodes_[left].len == offset) {
+      len += nodes_[left].len;
+      Unlink(left);
+      offset = left;
+    }
+  }
+
+  Link(offset, len);
+}
+
+}  // namespace base
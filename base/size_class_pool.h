@@ -0,0 +1,84 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+namespace base {
+
+// Pool for borrowing subsegments of a large segment, measured in abstract units.
+// Free ranges are kept in segregated lists by size class (floor(log2(length))) and are
+// coalesced with their neighbours upon return, so unlike SegmentPool it does not leak space
+// between borrowed segments.
+// Return() runs in constant time and so does Request(), unless the only ranges that are
+// large enough belong to the same size class as the request. Then Request() walks the list of
+// that class. Keeps 20 bytes of metadata per unit.
+class SizeClassPool {
+ public:
+  struct Stats {
+    uint64_t requests = 0;
+    uint64_t failures = 0;    // requests that could not be satisfied.
+    unsigned used_units = 0;
+    unsigned free_ranges = 0;  // number of free ranges, a measure of fragmentation.
+  };
+
+  explicit SizeClassPool(unsigned size = 0);
+
+  // Request segment of specified length, returns offset if a free segment found.
+  std::optional<unsigned /* offset */> Request(unsigned length);
+
+  // Return segment by offset returned from Request().
+  void Return(unsigned offset);
+
+  // Grow internal segment size. The new units are appended after the existing ones.
+  void Grow(unsigned additional);
+
+  unsigned Size() const {
+    return size_;
+  }
+
+  // Length of the segment borrowed at offset.
+  unsigned SegmentLength(unsigned offset) const {
+    return nodes_[offset].len;
+  }
+
+  // Linear in the number of free ranges of the largest size class.
+  unsigned LargestFreeRange() const;
+
+  const Stats& stats() const {
+    return stats_;
+  }
+
+ private:
+  static constexpr uint32_t kNil = UINT32_MAX;
+  static constexpr unsigned kNumClasses = 32;
+
+  struct Node {
+    uint32_t len = 0;  // valid for the first unit of a range.
+    uint32_t next = kNil, prev = kNil;
+    uint32_t start = 0;  // valid for the last unit of a free range.
+    bool free = false;
+  };
+
+  static unsigned SizeClass(uint32_t len) {
+    return 31 - __builtin_clz(len);
+  }
+
+  void Link(uint32_t offset, uint32_t len);
+  void Unlink(uint32_t offset);
+
+  // Marks [offset, offset + len) as free and merges it with adjacent free ranges.
+  void Release(uint32_t offset, uint32_t len);
+
+  std::vector<Node> nodes_;
+  uint32_t heads_[kNumClasses];
+  uint32_t class_mask_ = 0;  // bit i is set if heads_[i] is not empty.
+  unsigned size_ = 0;
+  Stats stats_;
+};
+
+}  // namespace base
@@ -0,0 +1,137 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "base/size_class_pool.h"
+
+#include <gtest/gtest.h>
+
+#include <map>
+#include <random>
+
+#include "base/gtest.h"
+
+namespace base {
+
+class SizeClassPoolTest : public testing::Test {};
+
+TEST_F(SizeClassPoolTest, Basic) {
+  SizeClassPool pool(12);
+
+  auto off = pool.Request(3);
+  ASSERT_TRUE(off);
+  EXPECT_EQ(3u, pool.SegmentLength(*off));
+  EXPECT_FALSE(pool.Request(12));
+  EXPECT_EQ(9u, pool.LargestFreeRange());
+
+  pool.Return(*off);
+  EXPECT_EQ(12u, pool.LargestFreeRange());
+  EXPECT_EQ(1u, pool.stats().free_ranges);
+
+  off = pool.Request(12);
+  ASSERT_TRUE(off);
+  EXPECT_EQ(0u, *off);
+  EXPECT_FALSE(pool.Request(1));
+  EXPECT_EQ(2u, pool.stats().failures);
+  pool.Return(*off);
+
+  EXPECT_EQ(0u, pool.stats().used_units);
+}
+
+TEST_F(SizeClassPoolTest, Coalesce) {
+  SizeClassPool pool(16);
+  unsigned offs[8];
+  for (unsigned i = 0; i < 8; ++i) {
+    auto off = pool.Request(2);
+    ASSERT_TRUE(off);
+    offs[i] = *off;
+  }
+  EXPECT_FALSE(pool.Request(1));
+
+  // Free every other segment, the holes should not merge.
+  for (unsigned i = 0; i < 8; i += 2)
+    pool.Return(offs[i]);
+  EXPECT_EQ(4u, pool.stats().free_ranges);
+  EXPECT_EQ(2u, pool.LargestFreeRange());
+  EXPECT_FALSE(pool.Request(3));
+
+  for (unsigned i = 1; i < 8; i += 2)
+    pool.Return(offs[i]);
+  EXPECT_EQ(1u, pool.stats().free_ranges);
+  EXPECT_EQ(16u, pool.LargestFreeRange());
+}
+
+TEST_F(SizeClassPoolTest, SameClass) {
+  SizeClassPool pool(16);
+  auto a = pool.Request(3);
+  auto b = pool.Request(1);
+  auto c = pool.Request(2);
+  ASSERT_TRUE(a && b && c);
+  ASSERT_TRUE(pool.Request(10));
+
+  // Both free ranges belong to the same class, the range of 2 units is at the head.
+  pool.Return(*a);
+  pool.Return(*c);
+  auto off = pool.Request(3);
+  ASSERT_TRUE(off);
+  EXPECT_EQ(*a, *off);
+  EXPECT_FALSE(pool.Request(3));
+}
+
+TEST_F(SizeClassPoolTest, Grow) {
+  SizeClassPool pool(4);
+  auto off = pool.Request(4);
+  ASSERT_TRUE(off);
+  EXPECT_FALSE(pool.Request(4));
+
+  pool.Grow(4);
+  EXPECT_EQ(8u, pool.Size());
+  auto off2 = pool.Request(4);
+  ASSERT_TRUE(off2);
+  EXPECT_EQ(4u, *off2);
+
+  pool.Return(*off);
+  pool.Return(*off2);
+  EXPECT_EQ(8u, pool.LargestFreeRange());
+}
+
+TEST_F(SizeClassPoolTest, Random) {
+  constexpr unsigned kSize = 1024;
+  SizeClassPool pool(kSize);
+  std::map<unsigned, unsigned> taken;  // offset -> length
+  std::mt19937 gen(42);
+
+  for (unsigned i = 0; i < 100000; ++i) {
+    if (taken.empty() || gen() % 2) {
+      unsigned len = 1 + gen() % 64;
+      auto off = pool.Request(len);
+      if (!off)
+        continue;
+
+      // Must not overlap with neighbours.
+      auto it = taken.lower_bound(*off);
+      if (it != taken.end())
+        ASSERT_GE(it->first, *off + len);
+      if (it != taken.begin()) {
+        --it;
+        ASSERT_LE(it->first + it->second, *off);
+      }
+      ASSERT_LE(*off + len, kSize);
+      taken.emplace(*off, len);
+    } else {
+      auto it = taken.begin();
+      std::advance(it, gen() % taken.size());
+      pool.Return(it->first);
+      taken.erase(it);
+    }
+  }
+
+  for (const auto& [off, len] : taken)
+    pool.Return(off);
+
+  EXPECT_EQ(0u, pool.stats().used_units);
+  EXPECT_EQ(1u, pool.stats().free_ranges);
+  EXPECT_EQ(kSize, pool.LargestFreeRange());
+}
+
+}  // namespace base
@@ -0,0 +1,70 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <type_traits>
+
+#include "base/function2.hpp"
+
+namespace base {
+
+namespace detail {
+
+inline std::atomic_uint64_t small_function_heap_allocs{0};
+
+}  // namespace detail
+
+// Returns the number of callables, across all threads, that did not fit into the inline
+// storage of a SmallFunction and were allocated on the heap.
+inline uint64_t SmallFunctionHeapAllocs() {
+  return detail::small_function_heap_allocs.load(std::memory_order_relaxed);
+}
+
+// Move-only function wrapper that keeps callables of up to Capacity bytes inline.
+// Larger callables are allocated on the heap and counted by SmallFunctionHeapAllocs.
+// The object takes Capacity + 16 bytes. Calling an empty function is undefined.
+template <size_t Capacity, typename Signature>
+class SmallFunction
+    : public fu2::function_base<true /*owns*/, false /*non-copyable*/,
+                                fu2::capacity_fixed<Capacity, 8>, false /* non-throwing*/,
+                                false /* strong exceptions guarantees*/, Signature> {
+  using Base = fu2::function_base<true, false, fu2::capacity_fixed<Capacity, 8>, false, false,
+                                  Signature>;
+
+  template <typename F>
+  using EnableIfCallable =
+      std::enable_if_t<!std::is_same_v<std::decay_t<F>, SmallFunction> &&
+                           !std::is_same_v<std::decay_t<F>, std::nullptr_t>,
+                       int>;
+
+ public:
+  template <typename F> static constexpr bool kFitsInline = sizeof(F) <= Capacity && alignof(F) <= 8;
+
+  SmallFunction() = default;
+  SmallFunction(std::nullptr_t) : Base(nullptr) {
+  }
+
+  template <typename F, EnableIfCallable<F> = 0> SmallFunction(F&& f) : Base(std::forward<F>(f)) {
+    if constexpr (!kFitsInline<std::decay_t<F>>) {
+      detail::small_function_heap_allocs.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  SmallFunction(SmallFunction&&) = default;
+  SmallFunction& operator=(SmallFunction&&) = default;
+
+  template <typename F, EnableIfCallable<F> = 0> SmallFunction& operator=(F&& f) {
+    return *this = SmallFunction(std::forward<F>(f));
+  }
+
+  SmallFunction& operator=(std::nullptr_t) {
+    Base::operator=(nullptr);
+    return *this;
+  }
+};
+
+}  // namespace base
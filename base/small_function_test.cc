@@ -0,0 +1,54 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "base/small_function.h"
+
+#include <memory>
+
+#include "base/gtest.h"
+
+namespace base {
+
+using namespace std;
+
+class SmallFunctionTest : public testing::Test {};
+
+TEST_F(SmallFunctionTest, Inline) {
+  using Func = SmallFunction<48, int(int)>;
+  static_assert(sizeof(Func) == 64);
+
+  uint64_t heap_allocs = SmallFunctionHeapAllocs();
+  uint64_t a = 1, b = 2, c = 3;
+  Func f = [a, b, c](int x) { return a + b + c + x; };
+  EXPECT_EQ(16, f(10));
+
+  // Move-only captures are supported.
+  auto ptr = make_unique<int>(5);
+  f = [ptr = std::move(ptr)](int x) { return *ptr + x; };
+  EXPECT_EQ(6, f(1));
+
+  Func g = std::move(f);
+  EXPECT_EQ(7, g(2));
+  EXPECT_FALSE(f);
+
+  g = nullptr;
+  EXPECT_FALSE(g);
+  EXPECT_EQ(heap_allocs, SmallFunctionHeapAllocs());
+}
+
+TEST_F(SmallFunctionTest, HeapFallback) {
+  using Func = SmallFunction<16, uint64_t()>;
+
+  uint64_t heap_allocs = SmallFunctionHeapAllocs();
+  uint64_t arr[4] = {1, 2, 3, 4};
+  Func f = [arr] { return arr[0] + arr[1] + arr[2] + arr[3]; };
+  EXPECT_EQ(10u, f());
+  EXPECT_EQ(heap_allocs + 1, SmallFunctionHeapAllocs());
+
+  Func g = std::move(f);
+  EXPECT_EQ(10u, g());
+  EXPECT_EQ(heap_allocs + 1, SmallFunctionHeapAllocs());
+}
+
+}  // namespace base
@@ -0,0 +1,157 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "base/spinlock.h"
+
+#include <sched.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#include <unistd.h>
+
+#include <algorithm>
+
+namespace base {
+
+using namespace std;
+
+namespace {
+
+// The counters are updated once per contended acquisition, so they are cheap compared to
+// the contention they measure.
+struct Counters {
+  atomic_uint64_t contended{0};
+  atomic_uint64_t spins{0};
+  atomic_uint64_t parks{0};
+
+  void Add(uint64_t num_spins, uint64_t num_parks) {
+    contended.fetch_add(1, memory_order_relaxed);
+    spins.fetch_add(num_spins, memory_order_relaxed);
+    if (num_parks)
+      parks.fetch_add(num_parks, memory_order_relaxed);
+  }
+
+  SpinLockStats Get() const {
+    SpinLockStats res;
+    res.contended = contended.load(memory_order_relaxed);
+    res.spins = spins.load(memory_order_relaxed);
+    res.parks = parks.load(memory_order_relaxed);
+    return res;
+  }
+};
+
+alignas(64) Counters spinlock_counters;
+alignas(64) Counters mcslock_counters;
+
+// Spinning on a single cpu only delays the holder.
+const bool kSingleCpu = sysconf(_SC_NPROCESSORS_ONLN) <= 1;
+
+inline void CpuRelax(unsigned count) {
+  for (unsigned i = 0; i < count; ++i) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+  }
+}
+
+void FutexWait(atomic_uint32_t* word, uint32_t val) {
+#ifdef __linux__
+  syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, val, nullptr, nullptr, 0);
+#else
+  sched_yield();
+#endif
+}
+
+void FutexWakeOne(atomic_uint32_t* word) {
+#ifdef __linux__
+  syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#endif
+}
+
+}  // namespace
+
+SpinLockStats GetSpinLockStats() {
+  return spinlock_counters.Get();
+}
+
+SpinLockStats GetMCSLockStats() {
+  return mcslock_counters.Get();
+}
+
+void SpinLock::LockSlow() {
+  uint64_t spins = 0;
+  unsigned pauses = 1;
+  for (unsigned round = kSingleCpu ? kSpinRounds : 0; round < kSpinRounds; ++round) {
+    CpuRelax(pauses);
+    spins += pauses;
+    pauses = std::min(pauses * 2, kMaxPauses);
+
+    uint32_t val = state_.load(memory_order_relaxed);
+    if (val == kFree && state_.compare_exchange_weak(val, kLocked, memory_order_acquire)) {
+      spinlock_counters.Add(spins, 0);
+      return;
+    }
+  }
+
+  // Marks the lock as having sleepers so that unlock() wakes one of them up. A woken up
+  // waiter keeps the mark because it does not know whether others still sleep.
+  uint64_t parks = 0;
+  while (state_.exchange(kParked, memory_order_acquire) != kFree) {
+    FutexWait(&state_, kParked);
+    ++parks;
+  }
+  spinlock_counters.Add(spins, parks);
+}
+
+void SpinLock::UnlockSlow() {
+  FutexWakeOne(&state_);
+}
+
+void MCSLock::LockSlow(Node* prev, Node* node) {
+  prev->next.store(node, memory_order_release);
+
+  uint64_t spins = 0;
+  unsigned pauses = 1;
+  for (unsigned round = kSingleCpu ? SpinLock::kSpinRounds : 0; round < SpinLock::kSpinRounds;
+       ++round) {
+    CpuRelax(pauses);
+    spins += pauses;
+    pauses = std::min(pauses * 2, SpinLock::kMaxPauses);
+
+    if (node->state.load(memory_order_acquire) == kGranted) {
+      mcslock_counters.Add(spins, 0);
+      return;
+    }
+  }
+
+  uint32_t val = kWaiting;
+  uint64_t parks = 0;
+  if (node->state.compare_exchange_strong(val, kParked, memory_order_acquire)) {
+    do {
+      FutexWait(&node->state, kParked);
+      ++parks;
+    } while (node->state.load(memory_order_acquire) != kGranted);
+  }
+  mcslock_counters.Add(spins, parks);
+}
+
+auto MCSLock::WaitForNext(Node* node) -> Node* {
+  // The successor swapped the tail but did not link itself yet, this window is a few
+  // instructions long.
+  Node* next;
+  while ((next = node->next.load(memory_order_acquire)) == nullptr)
+    CpuRelax(1);
+  return next;
+}
+
+void MCSLock::WakeUp(Node* node) {
+  // The waiter may have seen the grant and moved on, then the wake up is lost harmlessly.
+  FutexWakeOne(&node->state);
+}
+
+}  // namespace base
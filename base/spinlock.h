@@ -4,30 +4,159 @@
 
 #pragma once
 
-#include <absl/base/internal/spinlock.h>
+#include <atomic>
+#include <cstdint>
+
+#include "base/logging.h"
+#include "base/port.h"
 
 namespace base {
 
+// Contention counters of a lock type, aggregated over all its instances in the process.
+// Uncontended acquisitions are not counted.
+struct SpinLockStats {
+  uint64_t contended = 0;  // acquisitions that did not get the lock on the first attempt.
+  uint64_t spins = 0;      // pause instructions executed by the contended acquisitions.
+  uint64_t parks = 0;      // times a waiter went to sleep on a futex.
+};
+
+SpinLockStats GetSpinLockStats();
+SpinLockStats GetMCSLockStats();
+
+// A spin-then-park lock for short critical sections. A contended lock() spins with a bounded
+// exponential backoff of pause instructions, re-checking the lock word only between the
+// rounds so that the waiters do not hammer its cache line, and after kSpinRounds rounds
+// sleeps on a futex until unlock() wakes it up. Hence waiters stop burning cpu when the holder
+// is descheduled or the lock is saturated. Neither lock spins on a single cpu machine, where
+// spinning only delays the holder. Takes 4 bytes.
 class SpinLock {
  public:
+  static constexpr unsigned kSpinRounds = 16;
+  static constexpr unsigned kMaxPauses = 64;  // the bound of the backoff of a round.
+
   SpinLock() = default;
   SpinLock(const SpinLock&) = delete;
   SpinLock& operator=(const SpinLock&) = delete;
 
   void lock() {
-    lock_.Lock();
+    uint32_t expected = kFree;
+    if (PREDICT_FALSE(
+            !state_.compare_exchange_strong(expected, kLocked, std::memory_order_acquire))) {
+      LockSlow();
+    }
+  }
+
+  void unlock() {
+    if (PREDICT_FALSE(state_.exchange(kFree, std::memory_order_release) == kParked))
+      UnlockSlow();
+  }
+
+  bool try_lock() {
+    uint32_t expected = kFree;
+    return state_.load(std::memory_order_relaxed) == kFree &&
+           state_.compare_exchange_strong(expected, kLocked, std::memory_order_acquire);
+  }
+
+ private:
+  enum : uint32_t { kFree = 0, kLocked = 1, kParked = 2 /* locked and may have sleepers */ };
+
+  void LockSlow();
+  void UnlockSlow();
+
+  std::atomic_uint32_t state_{kFree};
+};
+
+// A queued (MCS) lock for locks that many threads contend for. The waiters line up in fifo
+// order and each spins on a flag in its own cache line, which the previous holder clears
+// when it hands the lock over, so a release invalidates the line of a single waiter instead
+// of those of all of them. The waiters back off and park like SpinLock waiters, but each
+// sleeps on its own node and is woken up when the lock is handed to it. Being fair, the lock
+// hands over more slowly than SpinLock when there are more waiters than cpus. The queue
+// nodes are kept in a per-thread stack, hence a thread may hold up to kMaxNesting MCS locks
+// at once and must release them in the reverse order of their acquisition, as the scoped
+// guards do. Takes 8 bytes.
+class MCSLock {
+ public:
+  static constexpr unsigned kMaxNesting = 8;
+
+  MCSLock() = default;
+  MCSLock(const MCSLock&) = delete;
+  MCSLock& operator=(const MCSLock&) = delete;
+
+  void lock() {
+    Node* node = PushNode();
+    Node* prev = tail_.exchange(node, std::memory_order_acq_rel);
+    if (PREDICT_FALSE(prev != nullptr))
+      LockSlow(prev, node);
   }
 
   void unlock() {
-    lock_.Unlock();
+    Node* node = PopNode();
+    Node* next = node->next.load(std::memory_order_acquire);
+    if (next == nullptr) {
+      Node* expected = node;
+      if (PREDICT_TRUE(tail_.compare_exchange_strong(expected, nullptr,
+                                                     std::memory_order_release))) {
+        return;
+      }
+      next = WaitForNext(node);
+    }
+    if (next->state.exchange(kGranted, std::memory_order_release) == kParked)
+      WakeUp(next);
   }
 
   bool try_lock() {
-    return lock_.TryLock();
+    if (tail_.load(std::memory_order_relaxed) != nullptr)
+      return false;
+
+    Node* node = PushNode();
+    Node* expected = nullptr;
+    if (tail_.compare_exchange_strong(expected, node, std::memory_order_acquire))
+      return true;
+    PopNode();
+    return false;
   }
 
  private:
-  absl::base_internal::SpinLock lock_;
+  struct alignas(64) Node {
+    std::atomic<Node*> next;
+    std::atomic_uint32_t state;
+  };
+
+  enum : uint32_t { kGranted = 0, kWaiting = 1, kParked = 2 };
+
+  struct NodeStack {
+    Node nodes[kMaxNesting];
+    unsigned depth = 0;
+  };
+
+  static NodeStack& LocalNodes() {
+    thread_local NodeStack stack;
+    return stack;
+  }
+
+  static Node* PushNode() {
+    NodeStack& stack = LocalNodes();
+    DCHECK_LT(stack.depth, kMaxNesting);
+    Node* node = &stack.nodes[stack.depth++];
+    node->next.store(nullptr, std::memory_order_relaxed);
+    node->state.store(kWaiting, std::memory_order_relaxed);
+    return node;
+  }
+
+  static Node* PopNode() {
+    NodeStack& stack = LocalNodes();
+    DCHECK_GT(stack.depth, 0u);
+    return &stack.nodes[--stack.depth];
+  }
+
+  void LockSlow(Node* prev, Node* node);
+
+  // Waits for the thread that enqueued itself after node to link itself.
+  static Node* WaitForNext(Node* node);
+  static void WakeUp(Node* node);
+
+  std::atomic<Node*> tail_{nullptr};
 };
 
 }  // namespace base
@@ -0,0 +1,143 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "base/spinlock.h"
+
+#include <absl/base/internal/spinlock.h>
+
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+using namespace std;
+
+namespace base {
+
+template <typename Lock> class SpinLockTest : public testing::Test {};
+
+using LockTypes = testing::Types<SpinLock, MCSLock>;
+TYPED_TEST_SUITE(SpinLockTest, LockTypes);
+
+TYPED_TEST(SpinLockTest, TryLock) {
+  TypeParam lock;
+  EXPECT_TRUE(lock.try_lock());
+  EXPECT_FALSE(lock.try_lock());
+  lock.unlock();
+
+  atomic_int stage{0};
+  thread holder([&] {
+    lock_guard lk(lock);
+    stage = 1;
+    while (stage != 2)
+      this_thread::yield();
+  });
+  while (stage != 1)
+    this_thread::yield();
+  EXPECT_FALSE(lock.try_lock());
+  stage = 2;
+  holder.join();
+  EXPECT_TRUE(lock.try_lock());
+  lock.unlock();
+}
+
+TYPED_TEST(SpinLockTest, Exclusion) {
+  TypeParam lock;
+  uint64_t a = 0, b = 0;  // the holders keep them equal.
+  atomic_bool torn{false};
+
+  constexpr unsigned kIters = 50000;
+  vector<thread> threads;
+  for (unsigned i = 0; i < 8; ++i) {
+    threads.emplace_back([&] {
+      for (unsigned j = 0; j < kIters; ++j) {
+        lock_guard lk(lock);
+        if (a != b)
+          torn = true;
+        ++a;
+        ++b;
+      }
+    });
+  }
+  for (auto& t : threads)
+    t.join();
+
+  EXPECT_FALSE(torn);
+  EXPECT_EQ(8u * kIters, a);
+  EXPECT_EQ(a, b);
+}
+
+TEST(MCSLockTest, Nested) {
+  MCSLock outer, inner;
+  uint64_t count = 0;
+
+  vector<thread> threads;
+  for (unsigned i = 0; i < 4; ++i) {
+    threads.emplace_back([&] {
+      for (unsigned j = 0; j < 10000; ++j) {
+        lock_guard lk1(outer);
+        lock_guard lk2(inner);
+        ++count;
+      }
+    });
+  }
+  for (auto& t : threads)
+    t.join();
+  EXPECT_EQ(40000u, count);
+}
+
+TEST(SpinLockStatsTest, Contended) {
+  SpinLock lock;
+  SpinLockStats before = GetSpinLockStats();
+
+  lock.lock();
+  thread waiter([&] {
+    lock.lock();
+    lock.unlock();
+  });
+
+  // Long enough for the waiter to exhaust its spinning.
+  this_thread::sleep_for(50ms);
+  lock.unlock();
+  waiter.join();
+
+  SpinLockStats after = GetSpinLockStats();
+  EXPECT_GT(after.contended, before.contended);
+  EXPECT_GT(after.parks, before.parks);
+}
+
+template <typename Lock> void BM_Lock(benchmark::State& state, Lock* lock) {
+  static uint64_t data = 0;  // the critical section.
+  for (auto _ : state) {
+    lock_guard lk(*lock);
+    ++data;
+    benchmark::DoNotOptimize(data);
+  }
+}
+
+absl::base_internal::SpinLock absl_spinlock;
+SpinLock spinlock;
+MCSLock mcs_lock;
+
+void BM_AbslSpinLock(benchmark::State& state) {
+  for (auto _ : state) {
+    absl::base_internal::SpinLockHolder lk(&absl_spinlock);
+    benchmark::ClobberMemory();
+  }
+}
+BENCHMARK(BM_AbslSpinLock)->ThreadRange(1, 64)->UseRealTime();
+
+void BM_SpinLock(benchmark::State& state) {
+  BM_Lock(state, &spinlock);
+}
+BENCHMARK(BM_SpinLock)->ThreadRange(1, 64)->UseRealTime();
+
+void BM_MCSLock(benchmark::State& state) {
+  BM_Lock(state, &mcs_lock);
+}
+BENCHMARK(BM_MCSLock)->ThreadRange(1, 64)->UseRealTime();
+
+}  // namespace base
@@ -0,0 +1,216 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/numeric/bits.h>
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string_view>
+
+#include "base/RWSpinLock.h"
+#include "base/pmr/arena.h"
+#include "base/string_view_sso.h"
+#include "base/swiss_map.h"
+
+namespace base {
+
+// Stores every distinct string once and identifies it by a dense 32-bit id, the ids are
+// assigned in the interning order starting from 0. Strings longer than
+// string_view_sso::kInlineLen are copied into an arena, shorter ones live inline in their
+// string_view_sso handle. Interned strings are never freed, so the handles returned by Get
+// stay valid for the lifetime of the interner. Lookups hash with string_view_sso::Hash and
+// probe the SIMD groups of SwissMap.
+//
+// Not thread-safe, with the exception that Get may run concurrently with Intern for the ids
+// that the caller has already obtained. See SharedStringInterner.
+class StringInterner {
+ public:
+  using Id = uint32_t;
+  static constexpr Id kInvalidId = UINT32_MAX;
+
+  explicit StringInterner(PMR_NS::memory_resource* mr = nullptr)
+      : mr_(mr ? mr : PMR_NS::get_default_resource()), arena_(mr_), map_(mr_) {
+  }
+
+  StringInterner(const StringInterner&) = delete;
+  StringInterner& operator=(const StringInterner&) = delete;
+
+  // Returns the id of str, interns it if needed.
+  Id Intern(std::string_view str) {
+    auto it = map_.find(str);
+    if (it != map_.end())
+      return it->second;
+    return Add(str);
+  }
+
+  // Returns kInvalidId if str was not interned.
+  Id Find(std::string_view str) const {
+    auto it = map_.find(str);
+    return it == map_.end() ? kInvalidId : it->second;
+  }
+
+  string_view_sso Get(Id id) const {
+    assert(id < size());
+    unsigned chunk = ChunkOf(id);
+    const string_view_sso* entries = chunks_[chunk].load(std::memory_order_acquire);
+    return entries[id - ChunkStart(chunk)];
+  }
+
+  size_t size() const {
+    return size_.load(std::memory_order_acquire);
+  }
+
+  size_t MemoryUsage() const {
+    return arena_.MemoryUsage() + map_.bytes_allocated();
+  }
+
+ private:
+  // Chunk i of the id table holds kFirstChunk << i entries, the chunks are never moved.
+  static constexpr unsigned kFirstChunkShift = 8;
+  static constexpr unsigned kMaxChunks = 32 - kFirstChunkShift + 1;
+
+  static unsigned ChunkOf(Id id) {
+    return absl::bit_width((id >> kFirstChunkShift) + 1) - 1;
+  }
+
+  static Id ChunkStart(unsigned chunk) {
+    return ((1U << chunk) - 1) << kFirstChunkShift;
+  }
+
+  Id Add(std::string_view str) {
+    Id id = size_.load(std::memory_order_relaxed);
+    assert(id != kInvalidId);
+
+    const char* ptr = str.data();
+    if (str.size() > string_view_sso::kInlineLen) {
+      char* dest = arena_.Allocate(str.size());
+      memcpy(dest, str.data(), str.size());
+      ptr = dest;
+    }
+    string_view_sso sv{ptr, str.size()};
+
+    unsigned chunk = ChunkOf(id);
+    string_view_sso* entries = chunks_[chunk].load(std::memory_order_relaxed);
+    if (!entries) {
+      size_t bytes = sizeof(string_view_sso) << (kFirstChunkShift + chunk);
+      entries = reinterpret_cast<string_view_sso*>(arena_.AllocateAligned(bytes));
+      chunks_[chunk].store(entries, std::memory_order_release);
+    }
+    new (entries + id - ChunkStart(chunk)) string_view_sso(sv);
+    size_.store(id + 1, std::memory_order_release);
+
+    map_.try_emplace(sv, id);
+    return id;
+  }
+
+  PMR_NS::memory_resource* mr_;
+  PmrArena arena_;
+  SwissMap<string_view_sso, Id, SsoHash, SsoEq> map_;
+  std::atomic<string_view_sso*> chunks_[kMaxChunks] = {};
+  std::atomic<Id> size_{0};
+};
+
+// Thread-safe StringInterner. Intern takes a read lock if the string is already interned and
+// a write lock otherwise, Get does not lock. Threads that intern the same strings over and over,
+// e.g. the proactor threads that resolve metric labels or keys, should go through their own
+// LocalCache that resolves the strings it has seen without touching the shared lock.
+class SharedStringInterner {
+ public:
+  using Id = StringInterner::Id;
+  static constexpr Id kInvalidId = StringInterner::kInvalidId;
+
+  class LocalCache;
+
+  explicit SharedStringInterner(PMR_NS::memory_resource* mr = nullptr) : table_(mr) {
+  }
+
+  Id Intern(std::string_view str) {
+    {
+      folly::RWSpinLock::ReadHolder rh(lock_);
+      Id id = table_.Find(str);
+      if (id != kInvalidId)
+        return id;
+    }
+
+    folly::RWSpinLock::WriteHolder wh(lock_);
+    return table_.Intern(str);
+  }
+
+  Id Find(std::string_view str) const {
+    folly::RWSpinLock::ReadHolder rh(lock_);
+    return table_.Find(str);
+  }
+
+  string_view_sso Get(Id id) const {
+    return table_.Get(id);
+  }
+
+  size_t size() const {
+    return table_.size();
+  }
+
+  size_t MemoryUsage() const {
+    folly::RWSpinLock::ReadHolder rh(lock_);
+    return table_.MemoryUsage();
+  }
+
+ private:
+  mutable folly::RWSpinLock lock_;
+  StringInterner table_;
+};
+
+// Per-thread cache of SharedStringInterner, not thread-safe. Keeps up to max_entries strings
+// that were interned through it and drops all of them when it is full. The cached keys are
+// the handles of the shared table, so the cache does not copy the strings.
+class SharedStringInterner::LocalCache {
+ public:
+  explicit LocalCache(SharedStringInterner* owner, size_t max_entries = 1024,
+                      PMR_NS::memory_resource* mr = nullptr)
+      : owner_(owner), max_entries_(max_entries), map_(mr) {
+  }
+
+  Id Intern(std::string_view str) {
+    auto it = map_.find(str);
+    if (it != map_.end()) {
+      ++hits_;
+      return it->second;
+    }
+
+    ++misses_;
+    Id id = owner_->Intern(str);
+    if (map_.size() >= max_entries_)
+      map_.clear();
+    map_.try_emplace(owner_->Get(id), id);
+    return id;
+  }
+
+  string_view_sso Get(Id id) const {
+    return owner_->Get(id);
+  }
+
+  size_t size() const {
+    return map_.size();
+  }
+
+  uint64_t hits() const {
+    return hits_;
+  }
+
+  uint64_t misses() const {
+    return misses_;
+  }
+
+ private:
+  SharedStringInterner* owner_;
+  size_t max_entries_;
+  SwissMap<string_view_sso, Id, SsoHash, SsoEq> map_;
+  uint64_t hits_ = 0, misses_ = 0;
+};
+
+}  // namespace base
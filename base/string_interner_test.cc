@@ -0,0 +1,108 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "base/string_interner.h"
+
+#include <absl/strings/str_cat.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace base {
+
+using namespace std;
+
+class StringInternerTest : public testing::Test {};
+
+TEST_F(StringInternerTest, Basic) {
+  StringInterner interner;
+  string long_str(100, 'x');
+
+  EXPECT_EQ(StringInterner::kInvalidId, interner.Find("foo"));
+  EXPECT_EQ(0u, interner.Intern("foo"));
+  EXPECT_EQ(1u, interner.Intern(long_str));
+  EXPECT_EQ(2u, interner.Intern(""));
+  EXPECT_EQ(0u, interner.Intern(string("foo")));
+  EXPECT_EQ(1u, interner.Find(long_str));
+  EXPECT_EQ(3u, interner.size());
+
+  EXPECT_EQ("foo", interner.Get(0));
+  EXPECT_EQ(long_str, interner.Get(1));
+  EXPECT_EQ("", interner.Get(2));
+
+  // Long strings are copied into the arena.
+  string_view_sso handle = interner.Get(1);
+  EXPECT_NE(long_str.data(), handle.data());
+  long_str.assign(100, 'y');
+  EXPECT_EQ(string(100, 'x'), handle);
+}
+
+TEST_F(StringInternerTest, Many) {
+  StringInterner interner;
+  constexpr unsigned kNum = 100000;
+
+  vector<string_view_sso> handles;
+  for (unsigned i = 0; i < kNum; ++i) {
+    string str = i % 2 ? absl::StrCat("key:", i) : absl::StrCat("a_much_longer_key_name:", i);
+    ASSERT_EQ(i, interner.Intern(str));
+    handles.push_back(interner.Get(i));
+  }
+
+  // The handles do not move when the table grows.
+  for (unsigned i = 0; i < kNum; ++i) {
+    string str = i % 2 ? absl::StrCat("key:", i) : absl::StrCat("a_much_longer_key_name:", i);
+    ASSERT_EQ(str, interner.Get(i));
+    ASSERT_EQ(str, handles[i]);
+    ASSERT_EQ(i, interner.Find(str));
+  }
+  EXPECT_EQ(kNum, interner.size());
+  EXPECT_GT(interner.MemoryUsage(), kNum * sizeof(string_view_sso));
+}
+
+TEST_F(StringInternerTest, Shared) {
+  SharedStringInterner interner;
+  constexpr unsigned kThreads = 4, kKeys = 5000;
+
+  vector<vector<SharedStringInterner::Id>> ids(kThreads);
+  vector<thread> threads;
+  for (unsigned t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&, t] {
+      SharedStringInterner::LocalCache cache(&interner, kKeys);
+      for (unsigned round = 0; round < 3; ++round) {
+        for (unsigned i = 0; i < kKeys; ++i) {
+          string key = absl::StrCat("label_", (i + t * 97) % kKeys);
+          SharedStringInterner::Id id = cache.Intern(key);
+          ASSERT_EQ(key, cache.Get(id));
+          if (round == 0)
+            ids[t].push_back(id);
+        }
+      }
+      EXPECT_EQ(2 * kKeys, cache.hits());
+      EXPECT_EQ(kKeys, cache.size());
+    });
+  }
+  for (auto& th : threads)
+    th.join();
+
+  EXPECT_EQ(kKeys, interner.size());
+
+  // All the threads agree on the ids.
+  for (unsigned t = 0; t < kThreads; ++t) {
+    for (unsigned i = 0; i < kKeys; ++i) {
+      string key = absl::StrCat("label_", (i + t * 97) % kKeys);
+      ASSERT_EQ(interner.Find(key), ids[t][i]);
+    }
+  }
+
+  SharedStringInterner::LocalCache cache(&interner);
+  EXPECT_EQ(interner.Find("label_7"), cache.Intern("label_7"));
+  EXPECT_EQ(interner.Find("label_7"), cache.Intern("label_7"));
+  EXPECT_EQ(1u, cache.hits());
+}
+
+}  // namespace base
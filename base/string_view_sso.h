@@ -5,6 +5,8 @@
 #pragma once
 
 #include <absl/base/optimization.h>
+#include <absl/container/internal/hash_function_defaults.h>
+#include <xxhash.h>
 
 #include <array>
 #include <cstdint>
@@ -42,6 +44,10 @@ class string_view_sso {
 
   static constexpr size_type npos = static_cast<size_type>(-1);
 
+  // Strings of up to kInlineLen bytes reside in the local buffer padded with zeros, hence they
+  // are compared and hashed as two 64-bit words.
+  static constexpr size_type kInlineLen = 15;
+
   // Null `string_view_sso` constructor
   constexpr string_view_sso() noexcept : size_(0) {
   }
@@ -297,6 +303,10 @@ class string_view_sso {
   // on the respective sizes of the two `string_view`s to determine which is
   // smaller, equal, or greater.
   constexpr int compare(string_view_sso x) const noexcept {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    if (!__builtin_is_constant_evaluated() && size_ <= kInlineLen && x.size_ <= kInlineLen)
+      return CompareInline(x);
+#endif
     std::string_view me = static_cast<std::string_view>(*this);
     std::string_view her = static_cast<std::string_view>(x);
     return me.compare(her);
@@ -410,7 +420,72 @@ class string_view_sso {
     return operator<<(o, static_cast<std::string_view>(piece));
   }
 
+  // Hashing
+
+  // Returns the same value for a string_view_sso and for a string_view with the same
+  // contents, so it can be used for heterogeneous lookups.
+  static size_t Hash(std::string_view str) noexcept {
+    if (str.size() <= kInlineLen) {
+      uint64_t w[2] = {0, 0};
+      if (!str.empty())
+        memcpy(w, str.data(), str.size());
+      return HashWords(w, str.size());
+    }
+    return XXH3_64bits(str.data(), str.size());
+  }
+
+  size_t hash() const noexcept {
+    if (size_ <= kInlineLen) {
+      uint64_t w[2];
+      LoadWords(w);
+      return HashWords(w, size_);
+    }
+    return XXH3_64bits(ptr(), size_);
+  }
+
+  template <typename H> friend H AbslHashValue(H h, string_view_sso s) {
+    return H::combine(std::move(h), static_cast<std::string_view>(s));
+  }
+
+  friend constexpr bool operator==(string_view_sso x, string_view_sso y) noexcept;
+
  private:
+  void LoadWords(uint64_t* w) const {
+    memcpy(w, buffer_.local.data(), 16);
+  }
+
+  static uint64_t MulFold(uint64_t a, uint64_t b) {
+    __uint128_t res = static_cast<__uint128_t>(a) * b;
+    return static_cast<uint64_t>(res) ^ static_cast<uint64_t>(res >> 64);
+  }
+
+  static size_t HashWords(const uint64_t* w, size_t len) {
+    uint64_t h0 = MulFold(w[0] ^ 0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL);
+    uint64_t h1 = MulFold(w[1] ^ len ^ 0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL);
+    return MulFold(h0 ^ h1, 0x1d8e4e27c47d124fULL);
+  }
+
+  bool EqualInline(const string_view_sso& x) const {
+    uint64_t a[2], b[2];
+    LoadWords(a);
+    x.LoadWords(b);
+    return ((a[0] ^ b[0]) | (a[1] ^ b[1])) == 0;
+  }
+
+  // Compares inline strings as big-endian words, which preserves the lexicographic order on
+  // little-endian hosts. The zero padding is resolved by the sizes when the words are equal.
+  int CompareInline(const string_view_sso& x) const {
+    uint64_t a[2], b[2];
+    LoadWords(a);
+    x.LoadWords(b);
+    for (unsigned i = 0; i < 2; ++i) {
+      if (a[i] != b[i]) {
+        return __builtin_bswap64(a[i]) < __builtin_bswap64(b[i]) ? -1 : 1;
+      }
+    }
+    return CompareImpl(size_, x.size_, 0);
+  }
+
   static constexpr size_t Min(size_type length_a, size_type length_b) {
     return length_a < length_b ? length_a : length_b;
   }
@@ -431,6 +506,8 @@ class string_view_sso {
 #endif
   };
 
+  static_assert(kInlineLen <= LOCAL_CAPACITY, "");
+
   constexpr const char* ptr() const {
     return size_ <= LOCAL_CAPACITY ? buffer_.local.data() : buffer_.begin;
   }
@@ -439,7 +516,8 @@ class string_view_sso {
     const char* begin;
     std::array<char, LOCAL_CAPACITY + 1> local;
 
-    constexpr Buffer() : begin(nullptr) {
+    // Zeroes the whole local buffer, see kInlineLen.
+    constexpr Buffer() : local{} {
     }
     constexpr Buffer(const char* s, size_t len) : local{} {
       if (len <= LOCAL_CAPACITY) {
@@ -461,6 +539,10 @@ class string_view_sso {
 // one of the arguments is a literal, the compiler can elide a lot of the
 // following comparisons.
 constexpr bool operator==(string_view_sso x, string_view_sso y) noexcept {
+  if (x.size_ != y.size_)
+    return false;
+  if (!__builtin_is_constant_evaluated() && x.size_ <= string_view_sso::kInlineLen)
+    return x.EqualInline(y);
   return static_cast<std::string_view>(x) == static_cast<std::string_view>(y);
 }
 
@@ -486,10 +568,39 @@ constexpr bool operator>=(string_view_sso x, string_view_sso y) noexcept {
 
 }  // namespace base
 
-// expected: hash support
+namespace base {
+
+// Transparent hash and equality for containers keyed by string_view_sso, which must pass them
+// explicitly, e.g. absl::flat_hash_map<string_view_sso, T, SsoHash, SsoEq>. They accept
+// string_view, std::string and const char* without building a string_view_sso.
+struct SsoHash {
+  using is_transparent = void;
+
+  size_t operator()(string_view_sso s) const noexcept {
+    return s.hash();
+  }
+
+  template <typename S> size_t operator()(const S& s) const noexcept {
+    return string_view_sso::Hash(static_cast<std::string_view>(s));
+  }
+};
+
+struct SsoEq {
+  using is_transparent = void;
+
+  bool operator()(string_view_sso a, string_view_sso b) const noexcept {
+    return a == b;
+  }
+
+  template <typename A, typename B> bool operator()(const A& a, const B& b) const noexcept {
+    return static_cast<std::string_view>(a) == static_cast<std::string_view>(b);
+  }
+};
+
+}  // namespace base
 
 template <> struct std::hash<base::string_view_sso> {
   size_t operator()(base::string_view_sso arg) const {
-    return hash<string_view>{}(static_cast<string_view>(arg));
+    return arg.hash();
   }
 };
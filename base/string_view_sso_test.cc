@@ -3,6 +3,8 @@
 //
 #include "base/string_view_sso.h"
 
+#include <absl/container/flat_hash_map.h>
+
 #include "base/flags.h"
 #include "base/gtest.h"
 
@@ -25,4 +27,84 @@ TEST_F(StringViewSSOTest, SSO) {
   }
 }
 
+TEST_F(StringViewSSOTest, Compare) {
+  const char* strs[] = {"", "a", "ab", "b", "abcdefgh", "abcdefgi", "abcdefghijklmno",
+                        "abcdefghijklmnop", "abcdefghijklmnopqrstuvwxyz0123"};
+  for (const char* a : strs) {
+    for (const char* b : strs) {
+      string_view_sso x(a), y(b);
+      string_view sa(a), sb(b);
+      ASSERT_EQ(sa == sb, x == y) << a << " " << b;
+      int expected = sa.compare(sb);
+      int res = x.compare(y);
+      ASSERT_EQ(expected < 0, res < 0) << a << " " << b;
+      ASSERT_EQ(expected > 0, res > 0) << a << " " << b;
+    }
+  }
+
+  // Embedded zeros are not confused with the padding.
+  string_view_sso zero(string_view("a\0", 2));
+  EXPECT_NE(zero, string_view_sso("a"));
+  EXPECT_LT(string_view_sso("a"), zero);
+  EXPECT_LT(zero, string_view_sso(string_view("a\0\0", 3)));
+  EXPECT_LT(string_view_sso(""), string_view_sso(string_view("\0", 1)));
+}
+
+TEST_F(StringViewSSOTest, Hash) {
+  for (int i = 0; i < 50; ++i) {
+    string s(i, 'x');
+    string_view_sso sv(s);
+    EXPECT_EQ(sv.hash(), string_view_sso::Hash(s));
+    EXPECT_EQ(sv.hash(), SsoHash{}(s));
+    EXPECT_EQ(sv.hash(), std::hash<string_view_sso>{}(sv));
+    EXPECT_NE(sv.hash(), string_view_sso::Hash(string(i + 1, 'x')));
+  }
+  EXPECT_NE(string_view_sso("a").hash(), string_view_sso(string_view("a\0", 2)).hash());
+}
+
+TEST_F(StringViewSSOTest, FlatHashMap) {
+  absl::flat_hash_map<string_view_sso, int, SsoHash, SsoEq> m;
+
+  vector<string> keys;
+  for (int i = 0; i < 100; ++i) {
+    keys.push_back(string(i % 40, 'a' + i % 26) + to_string(i));
+  }
+  for (int i = 0; i < 100; ++i) {
+    m[keys[i]] = i;
+  }
+  for (int i = 0; i < 100; ++i) {
+    auto it = m.find(string_view(keys[i]));
+    ASSERT_TRUE(it != m.end());
+    EXPECT_EQ(i, it->second);
+    EXPECT_TRUE(m.contains(keys[i]));
+  }
+  EXPECT_FALSE(m.contains("missing"));
+}
+
+static void BM_HashSSO(benchmark::State& state) {
+  vector<string_view_sso> keys;
+  vector<string> storage(1024);
+  for (unsigned i = 0; i < storage.size(); ++i) {
+    storage[i] = string(state.range(0), 'a') + to_string(i);
+    keys.emplace_back(storage[i]);
+  }
+  while (state.KeepRunning()) {
+    for (const auto& k : keys)
+      benchmark::DoNotOptimize(k.hash());
+  }
+}
+BENCHMARK(BM_HashSSO)->Arg(4)->Arg(10)->Arg(32);
+
+static void BM_EqualSSO(benchmark::State& state) {
+  vector<string_view_sso> keys;
+  for (unsigned i = 0; i < 1024; ++i) {
+    keys.emplace_back(to_string(i * 7919));
+  }
+  while (state.KeepRunning()) {
+    for (unsigned i = 1; i < keys.size(); ++i)
+      benchmark::DoNotOptimize(keys[i] == keys[i - 1]);
+  }
+}
+BENCHMARK(BM_EqualSSO);
+
 }  // namespace base
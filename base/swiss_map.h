@@ -0,0 +1,572 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/hash/hash.h>
+#include <absl/numeric/bits.h>
+#include <string.h>
+
+#include <cstdint>
+#include <functional>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "base/pmr/memory_resource.h"
+
+namespace base {
+
+namespace swiss_internal {
+
+// Every slot has a control byte: its H2, i.e. the low 7 bits of the hash, if the slot is full,
+// otherwise one of the negative values below.
+using ctrl_t = int8_t;
+
+constexpr ctrl_t kEmpty = -128;
+constexpr ctrl_t kDeleted = -2;
+constexpr ctrl_t kSentinel = -1;  // marks the end of the table for the iterators.
+
+// Control bytes of the tables without slots, so that lookups do not check for them.
+alignas(16) inline constexpr ctrl_t kEmptyGroup[16] = {
+    kSentinel, kEmpty, kEmpty, kEmpty, kEmpty, kEmpty, kEmpty, kEmpty,
+    kEmpty,    kEmpty, kEmpty, kEmpty, kEmpty, kEmpty, kEmpty, kEmpty};
+
+// Set of the slots of a group that match a condition, kShift is log2 of the number of mask bits
+// per slot.
+template <unsigned kWidth, unsigned kShift> class BitMask {
+ public:
+  explicit BitMask(uint64_t mask) : mask_(mask) {
+  }
+
+  explicit operator bool() const {
+    return mask_ != 0;
+  }
+
+  // Iterates over the slots from the lowest one.
+  BitMask& operator++() {
+    mask_ &= mask_ - 1;
+    return *this;
+  }
+
+  unsigned Lowest() const {
+    return absl::countr_zero(mask_) >> kShift;
+  }
+
+  // The number of slots before the first match and after the last match, the mask must not be
+  // empty.
+  unsigned TrailingZeros() const {
+    return Lowest();
+  }
+
+  unsigned LeadingZeros() const {
+    constexpr unsigned kExtraBits = 64 - (kWidth << kShift);
+    return (absl::countl_zero(mask_) - kExtraBits) >> kShift;
+  }
+
+ private:
+  uint64_t mask_;
+};
+
+#if defined(__SSE2__)
+
+struct Group {
+  static constexpr unsigned kWidth = 16;
+  using Mask = BitMask<16, 0>;
+
+  explicit Group(const ctrl_t* pos) : ctrl(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pos))) {
+  }
+
+  Mask Match(ctrl_t h2) const {
+    return Mask(uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), ctrl))));
+  }
+
+  Mask MaskEmpty() const {
+    return Match(kEmpty);
+  }
+
+  Mask MaskEmptyOrDeleted() const {
+    return Mask(uint32_t(_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(kSentinel), ctrl))));
+  }
+
+  __m128i ctrl;
+};
+
+#else
+
+// SWAR implementation over 8 control bytes, as in absl. Match may return false positives,
+// which the key comparison filters out.
+struct Group {
+  static constexpr unsigned kWidth = 8;
+  using Mask = BitMask<8, 3>;
+
+  static constexpr uint64_t kMsbs = 0x8080808080808080ULL;
+  static constexpr uint64_t kLsbs = 0x0101010101010101ULL;
+
+  static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__);
+
+  explicit Group(const ctrl_t* pos) {
+    memcpy(&ctrl, pos, sizeof(ctrl));
+  }
+
+  Mask Match(ctrl_t h2) const {
+    uint64_t x = ctrl ^ (kLsbs * uint8_t(h2));
+    return Mask((x - kLsbs) & ~x & kMsbs);
+  }
+
+  // Only kEmpty has the msb set and bit 1 cleared.
+  Mask MaskEmpty() const {
+    return Mask(ctrl & ~(ctrl << 6) & kMsbs);
+  }
+
+  // kEmpty and kDeleted have the msb set and bit 0 cleared.
+  Mask MaskEmptyOrDeleted() const {
+    return Mask(ctrl & ~(ctrl << 7) & kMsbs);
+  }
+
+  uint64_t ctrl;
+};
+
+#endif
+
+}  // namespace swiss_internal
+
+// Open addressing hash map with the SwissTable layout of absl::flat_hash_map: the slots are
+// probed a group of control bytes at a time, so a lookup usually compares a single key.
+// Unlike CuckooMap, K and V may be any movable types and erase is O(1): it leaves a tombstone
+// only if the slot was part of a probe sequence that crossed a full group.
+//
+// The memory is allocated from the memory resource. The slots are moved when the table grows,
+// which invalidates the iterators, pointers and references. In the stable mode, kStable = true,
+// every element is allocated separately, so that the pointers and references stay valid until
+// the element is erased, at the cost of an indirection per lookup. Erase invalidates only the
+// iterators to the erased element in both modes.
+template <typename K, typename V, typename Hash = absl::Hash<K>, typename Eq = std::equal_to<K>,
+          bool kStable = false>
+class SwissMap {
+  using ctrl_t = swiss_internal::ctrl_t;
+  using Group = swiss_internal::Group;
+
+ public:
+  using key_type = K;
+  using mapped_type = V;
+  using value_type = std::pair<K, V>;  // the keys must not be modified.
+  using Slot = std::conditional_t<kStable, value_type*, value_type>;
+
+  template <bool kConst> class Iterator {
+    friend class SwissMap;
+    template <bool> friend class Iterator;
+
+   public:
+    using reference = std::conditional_t<kConst, const value_type&, value_type&>;
+    using pointer = std::conditional_t<kConst, const value_type*, value_type*>;
+
+    Iterator() = default;
+
+    // iterator converts to const_iterator.
+    template <bool kOther, typename = std::enable_if_t<kConst && !kOther>>
+    Iterator(const Iterator<kOther>& other) : ctrl_(other.ctrl_), slot_(other.slot_) {
+    }
+
+    reference operator*() const {
+      return Node(*slot_);
+    }
+
+    pointer operator->() const {
+      return &Node(*slot_);
+    }
+
+    Iterator& operator++() {
+      ++ctrl_;
+      ++slot_;
+      SkipFree();
+      return *this;
+    }
+
+    bool operator==(const Iterator& other) const {
+      return ctrl_ == other.ctrl_;
+    }
+
+    bool operator!=(const Iterator& other) const {
+      return ctrl_ != other.ctrl_;
+    }
+
+   private:
+    Iterator(const ctrl_t* ctrl, Slot* slot) : ctrl_(ctrl), slot_(slot) {
+    }
+
+    // Stops at a full slot or at the sentinel.
+    void SkipFree() {
+      while (*ctrl_ < swiss_internal::kSentinel) {
+        ++ctrl_;
+        ++slot_;
+      }
+    }
+
+    const ctrl_t* ctrl_ = nullptr;
+    Slot* slot_ = nullptr;
+  };
+
+  using iterator = Iterator<false>;
+  using const_iterator = Iterator<true>;
+
+  explicit SwissMap(PMR_NS::memory_resource* mr = nullptr)
+      : mr_(mr ? mr : PMR_NS::get_default_resource()) {
+  }
+
+  ~SwissMap() {
+    DestroyAll();
+    Deallocate();
+  }
+
+  SwissMap(const SwissMap&) = delete;
+  SwissMap& operator=(const SwissMap&) = delete;
+
+  SwissMap(SwissMap&& other) noexcept : mr_(other.mr_) {
+    swap(other);
+  }
+
+  // Both maps must use the same memory resource.
+  SwissMap& operator=(SwissMap&& other) noexcept {
+    swap(other);
+    return *this;
+  }
+
+  void swap(SwissMap& other) noexcept {
+    std::swap(ctrl_, other.ctrl_);
+    std::swap(slots_, other.slots_);
+    std::swap(capacity_, other.capacity_);
+    std::swap(size_, other.size_);
+    std::swap(growth_left_, other.growth_left_);
+  }
+
+  iterator begin() {
+    iterator it(ctrl_, slots_);
+    it.SkipFree();
+    return it;
+  }
+
+  iterator end() {
+    return iterator(ctrl_ + capacity_, slots_ + capacity_);
+  }
+
+  const_iterator begin() const {
+    return const_cast<SwissMap*>(this)->begin();
+  }
+
+  const_iterator end() const {
+    return const_cast<SwissMap*>(this)->end();
+  }
+
+  iterator find(const K& key) {
+    size_t index = FindIndex(key, HashOf(key));
+    return index == kNpos ? end() : IteratorAt(index);
+  }
+
+  const_iterator find(const K& key) const {
+    return const_cast<SwissMap*>(this)->find(key);
+  }
+
+  bool contains(const K& key) const {
+    return FindIndex(key, HashOf(key)) != kNpos;
+  }
+
+  // Constructs the value from args if the key is not present.
+  template <typename... Args> std::pair<iterator, bool> try_emplace(const K& key, Args&&... args) {
+    return TryEmplace(key, std::forward<Args>(args)...);
+  }
+
+  template <typename... Args> std::pair<iterator, bool> try_emplace(K&& key, Args&&... args) {
+    return TryEmplace(std::move(key), std::forward<Args>(args)...);
+  }
+
+  std::pair<iterator, bool> insert(value_type val) {
+    return TryEmplace(std::move(val.first), std::move(val.second));
+  }
+
+  V& operator[](const K& key) {
+    return try_emplace(key).first->second;
+  }
+
+  size_t erase(const K& key) {
+    size_t index = FindIndex(key, HashOf(key));
+    if (index == kNpos)
+      return 0;
+    EraseAt(index);
+    return 1;
+  }
+
+  void erase(const_iterator it) {
+    EraseAt(it.ctrl_ - ctrl_);
+  }
+
+  // Keeps the capacity.
+  void clear() {
+    DestroyAll();
+    if (capacity_) {
+      ResetCtrl();
+      growth_left_ = CapacityToGrowth(capacity_);
+    }
+    size_ = 0;
+  }
+
+  // Allocates the table for n elements.
+  void reserve(size_t n) {
+    if (n > size_ + growth_left_)
+      Resize(NormalizeCapacity(GrowthToCapacity(n)));
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  bool empty() const {
+    return size_ == 0;
+  }
+
+  size_t capacity() const {
+    return capacity_;
+  }
+
+  size_t bytes_allocated() const {
+    size_t res = capacity_ ? AllocSize(capacity_) : 0;
+    if constexpr (kStable)
+      res += size_ * sizeof(value_type);
+    return res;
+  }
+
+ private:
+  static constexpr size_t kNpos = size_t(-1);
+  static constexpr size_t kNumCloned = Group::kWidth - 1;
+
+  static value_type& Node(Slot& slot) {
+    if constexpr (kStable)
+      return *slot;
+    else
+      return slot;
+  }
+
+  static const value_type& Node(const Slot& slot) {
+    if constexpr (kStable)
+      return *slot;
+    else
+      return slot;
+  }
+
+  // Mixes the hash, so that both the low and the high bits are usable with weak hash
+  // functions like std::hash of integers, which is the identity.
+  size_t HashOf(const K& key) const {
+    __uint128_t m = __uint128_t(uint64_t(hash_(key))) * 0x9E3779B97F4A7C15ULL;
+    return uint64_t(m) ^ uint64_t(m >> 64);
+  }
+
+  static size_t H1(size_t hash) {
+    return hash >> 7;
+  }
+
+  static ctrl_t H2(size_t hash) {
+    return hash & 0x7F;
+  }
+
+  // The load factor is 7/8, except for the smallest tables.
+  static size_t CapacityToGrowth(size_t capacity) {
+    if (Group::kWidth == 8 && capacity == 7)
+      return 6;
+    return capacity - capacity / 8;
+  }
+
+  static size_t GrowthToCapacity(size_t growth) {
+    if (Group::kWidth == 8 && growth == 7)
+      return 8;
+    return growth + (growth - 1) / 7;
+  }
+
+  // Capacities are 2^k - 1, so that capacity_ is the mask of the slot index.
+  static size_t NormalizeCapacity(size_t n) {
+    return n ? ~size_t{} >> absl::countl_zero(n) : 1;
+  }
+
+  // The control bytes are followed by the sentinel and by the copies of the first kNumCloned
+  // control bytes, so that the groups can be loaded at any slot. The slots follow.
+  static size_t SlotOffset(size_t capacity) {
+    size_t ctrl_bytes = capacity + 1 + kNumCloned;
+    return (ctrl_bytes + alignof(Slot) - 1) & ~(alignof(Slot) - 1);
+  }
+
+  static size_t AllocSize(size_t capacity) {
+    return SlotOffset(capacity) + capacity * sizeof(Slot);
+  }
+
+  static constexpr size_t kAlign = alignof(Slot) > 16 ? alignof(Slot) : 16;
+
+  iterator IteratorAt(size_t index) {
+    return iterator(ctrl_ + index, slots_ + index);
+  }
+
+  void SetCtrl(size_t index, ctrl_t h) {
+    ctrl_[index] = h;
+    ctrl_[((index - kNumCloned) & capacity_) + (kNumCloned & capacity_)] = h;
+  }
+
+  void ResetCtrl() {
+    memset(ctrl_, swiss_internal::kEmpty, capacity_ + 1 + kNumCloned);
+    ctrl_[capacity_] = swiss_internal::kSentinel;
+  }
+
+  size_t FindIndex(const K& key, size_t hash) const {
+    ctrl_t h2 = H2(hash);
+    size_t offset = H1(hash) & capacity_;
+    for (size_t step = Group::kWidth;; step += Group::kWidth) {
+      Group g(ctrl_ + offset);
+      for (auto m = g.Match(h2); m; ++m) {
+        size_t index = (offset + m.Lowest()) & capacity_;
+        if (ABSL_PREDICT_TRUE(eq_(Node(slots_[index]).first, key)))
+          return index;
+      }
+      if (ABSL_PREDICT_TRUE(g.MaskEmpty()))
+        return kNpos;
+
+      // Triangular probing visits every group since the number of slots is a power of 2.
+      offset = (offset + step) & capacity_;
+    }
+  }
+
+  size_t FindFirstNonFull(size_t hash) const {
+    size_t offset = H1(hash) & capacity_;
+    for (size_t step = Group::kWidth;; step += Group::kWidth) {
+      auto m = Group(ctrl_ + offset).MaskEmptyOrDeleted();
+      if (m)
+        return (offset + m.Lowest()) & capacity_;
+      offset = (offset + step) & capacity_;
+    }
+  }
+
+  template <typename KeyArg, typename... Args>
+  std::pair<iterator, bool> TryEmplace(KeyArg&& key, Args&&... args) {
+    size_t hash = HashOf(key);
+    size_t index = FindIndex(key, hash);
+    if (index != kNpos)
+      return {IteratorAt(index), false};
+
+    index = PrepareInsert(hash);
+    Construct(slots_ + index, std::piecewise_construct,
+              std::forward_as_tuple(std::forward<KeyArg>(key)),
+              std::forward_as_tuple(std::forward<Args>(args)...));
+    return {IteratorAt(index), true};
+  }
+
+  size_t PrepareInsert(size_t hash) {
+    size_t index = FindFirstNonFull(hash);
+    if (ABSL_PREDICT_FALSE(growth_left_ == 0 && ctrl_[index] != swiss_internal::kDeleted)) {
+      // Drops the tombstones instead of growing if they take much of the table.
+      if (capacity_ > Group::kWidth && size_ * 32 <= capacity_ * 25)
+        Resize(capacity_);
+      else
+        Resize(capacity_ * 2 + 1);
+      index = FindFirstNonFull(hash);
+    }
+    ++size_;
+    growth_left_ -= ctrl_[index] == swiss_internal::kEmpty;
+    SetCtrl(index, H2(hash));
+    return index;
+  }
+
+  void EraseAt(size_t index) {
+    Destroy(slots_ + index);
+    --size_;
+
+    // If there was an empty slot in every window of kWidth slots that contains the index, no
+    // probe sequence continued past it, so it can become empty rather than a tombstone.
+    size_t index_before = (index - Group::kWidth) & capacity_;
+    auto empty_after = Group(ctrl_ + index).MaskEmpty();
+    auto empty_before = Group(ctrl_ + index_before).MaskEmpty();
+    bool was_never_full = empty_before && empty_after &&
+                          empty_after.TrailingZeros() + empty_before.LeadingZeros() < Group::kWidth;
+
+    SetCtrl(index, was_never_full ? swiss_internal::kEmpty : swiss_internal::kDeleted);
+    growth_left_ += was_never_full;
+  }
+
+  void Resize(size_t new_capacity) {
+    ctrl_t* old_ctrl = ctrl_;
+    Slot* old_slots = slots_;
+    size_t old_capacity = capacity_;
+
+    char* mem = static_cast<char*>(mr_->allocate(AllocSize(new_capacity), kAlign));
+    ctrl_ = reinterpret_cast<ctrl_t*>(mem);
+    slots_ = reinterpret_cast<Slot*>(mem + SlotOffset(new_capacity));
+    capacity_ = new_capacity;
+    ResetCtrl();
+    growth_left_ = CapacityToGrowth(new_capacity) - size_;
+
+    for (size_t i = 0; i < old_capacity; ++i) {
+      if (old_ctrl[i] >= 0) {
+        size_t hash = HashOf(Node(old_slots[i]).first);
+        size_t index = FindFirstNonFull(hash);
+        SetCtrl(index, H2(hash));
+        Transfer(slots_ + index, old_slots + i);
+      }
+    }
+
+    if (old_capacity)
+      mr_->deallocate(old_ctrl, AllocSize(old_capacity), kAlign);
+  }
+
+  template <typename... Args> void Construct(Slot* slot, Args&&... args) {
+    if constexpr (kStable) {
+      void* ptr = mr_->allocate(sizeof(value_type), alignof(value_type));
+      *slot = new (ptr) value_type(std::forward<Args>(args)...);
+    } else {
+      new (slot) value_type(std::forward<Args>(args)...);
+    }
+  }
+
+  void Destroy(Slot* slot) {
+    if constexpr (kStable) {
+      (*slot)->~value_type();
+      mr_->deallocate(*slot, sizeof(value_type), alignof(value_type));
+    } else {
+      slot->~value_type();
+    }
+  }
+
+  void Transfer(Slot* dest, Slot* src) {
+    if constexpr (kStable) {
+      *dest = *src;
+    } else {
+      new (dest) value_type(std::move(*src));
+      src->~value_type();
+    }
+  }
+
+  void DestroyAll() {
+    if constexpr (std::is_trivially_destructible_v<value_type> && !kStable)
+      return;
+    for (size_t i = 0; i < capacity_; ++i) {
+      if (ctrl_[i] >= 0)
+        Destroy(slots_ + i);
+    }
+  }
+
+  void Deallocate() {
+    if (capacity_)
+      mr_->deallocate(ctrl_, AllocSize(capacity_), kAlign);
+  }
+
+  ctrl_t* ctrl_ = const_cast<ctrl_t*>(swiss_internal::kEmptyGroup);
+  Slot* slots_ = nullptr;
+  size_t capacity_ = 0;
+  size_t size_ = 0;
+  size_t growth_left_ = 0;
+  PMR_NS::memory_resource* mr_;
+
+  Hash hash_;
+  Eq eq_;
+};
+
+}  // namespace base
@@ -0,0 +1,128 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "base/swiss_map.h"
+
+#include <absl/container/flat_hash_map.h>
+
+#include <memory>
+#include <random>
+#include <string>
+
+#include "base/gtest.h"
+
+namespace base {
+
+using namespace std;
+
+class SwissMapTest : public testing::Test {};
+
+TEST_F(SwissMapTest, Basic) {
+  SwissMap<uint64_t, uint64_t> m;
+  EXPECT_TRUE(m.empty());
+  EXPECT_TRUE(m.find(1) == m.end());
+  EXPECT_TRUE(m.begin() == m.end());
+  EXPECT_EQ(0u, m.erase(1));
+
+  constexpr uint64_t kNum = 100000;
+  for (uint64_t i = 0; i < kNum; ++i) {
+    auto [it, inserted] = m.try_emplace(i, i * 3);
+    ASSERT_TRUE(inserted);
+    ASSERT_EQ(i, it->first);
+  }
+  EXPECT_FALSE(m.try_emplace(5, 0).second);
+  EXPECT_EQ(kNum, m.size());
+
+  for (uint64_t i = 0; i < kNum; ++i) {
+    auto it = m.find(i);
+    ASSERT_TRUE(it != m.end()) << i;
+    ASSERT_EQ(i * 3, it->second);
+  }
+  EXPECT_FALSE(m.contains(kNum));
+
+  size_t cnt = 0;
+  uint64_t sum = 0;
+  for (const auto& [k, v] : m) {
+    ++cnt;
+    sum += k;
+  }
+  EXPECT_EQ(kNum, cnt);
+  EXPECT_EQ(kNum * (kNum - 1) / 2, sum);
+
+  m[kNum] = 7;
+  EXPECT_EQ(7u, m.find(kNum)->second);
+  m.clear();
+  EXPECT_TRUE(m.empty());
+  EXPECT_TRUE(m.begin() == m.end());
+  EXPECT_FALSE(m.contains(1));
+}
+
+TEST_F(SwissMapTest, Erase) {
+  // Interleaves inserts and erases against absl::flat_hash_map, so that the tombstones are
+  // reused and dropped by the same-capacity rehash.
+  SwissMap<uint32_t, string, std::hash<uint32_t>> m;
+  absl::flat_hash_map<uint32_t, string> expected;
+  mt19937 rng(1);
+
+  for (unsigned i = 0; i < 200000; ++i) {
+    uint32_t key = rng() % 5000;
+    if (rng() % 2) {
+      string val = to_string(i);
+      bool inserted = m.try_emplace(key, val).second;
+      ASSERT_EQ(expected.emplace(key, val).second, inserted);
+    } else {
+      ASSERT_EQ(expected.erase(key), m.erase(key)) << key;
+    }
+  }
+
+  ASSERT_EQ(expected.size(), m.size());
+  for (const auto& [k, v] : expected) {
+    auto it = m.find(k);
+    ASSERT_TRUE(it != m.end()) << k;
+    ASSERT_EQ(v, it->second);
+  }
+  EXPECT_LT(m.capacity(), 16384u);
+
+  // Erase by iterator while iterating.
+  for (auto it = m.begin(); it != m.end(); ++it) {
+    if (it->first % 2)
+      m.erase(it);
+  }
+  for (const auto& [k, v] : m)
+    ASSERT_EQ(0u, k % 2);
+}
+
+TEST_F(SwissMapTest, Stable) {
+  PMR_NS::monotonic_buffer_resource mr;
+  SwissMap<int, unique_ptr<int>, absl::Hash<int>, equal_to<int>, true> m(&mr);
+  m.try_emplace(0, make_unique<int>(10));
+  pair<int, unique_ptr<int>>* first = &*m.find(0);
+
+  for (int i = 1; i < 10000; ++i)
+    m.try_emplace(i, make_unique<int>(i + 10));
+  EXPECT_EQ(first, &*m.find(0));
+  EXPECT_EQ(10, *first->second);
+  EXPECT_GT(m.bytes_allocated(), 10000 * sizeof(pair<int, unique_ptr<int>>));
+
+  m.reserve(100000);
+  EXPECT_EQ(first, &*m.find(0));
+  EXPECT_EQ(9999 + 10, *m.find(9999)->second);
+}
+
+TEST_F(SwissMapTest, Reserve) {
+  SwissMap<int, int> m;
+  m.reserve(1000);
+  size_t cap = m.capacity();
+  EXPECT_GE(cap, 1000u);
+  for (int i = 0; i < 1000; ++i)
+    m[i] = i;
+  EXPECT_EQ(cap, m.capacity());
+
+  SwissMap<int, int> other(std::move(m));
+  EXPECT_EQ(1000u, other.size());
+  EXPECT_EQ(0u, m.size());
+  EXPECT_EQ(5, other.find(5)->second);
+}
+
+}  // namespace base
@@ -0,0 +1,421 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string_view>
+#include <utility>
+
+#include "base/pmr/memory_resource.h"
+#include "base/string_view_sso.h"
+#include "base/swiss_map.h"
+
+namespace base {
+
+// Count-min sketch of 4-bit counters that estimates the access frequencies of the keys of
+// TinyLfuCache. Every key maps to a counter in each of 4 rows, the estimate is the minimum
+// of them. The counters are halved once the number of increments reaches 10 times the
+// capacity, so that the frequencies of the keys that are no longer accessed decay.
+// The rows are interleaved, 16 counters per word, so a key touches 4 words.
+class FrequencySketch {
+ public:
+  explicit FrequencySketch(PMR_NS::memory_resource* mr) : mr_(mr) {
+  }
+
+  ~FrequencySketch() {
+    Deallocate();
+  }
+
+  FrequencySketch(const FrequencySketch&) = delete;
+  FrequencySketch& operator=(const FrequencySketch&) = delete;
+
+  // Sizes the sketch for capacity keys and resets the counters.
+  void Resize(size_t capacity) {
+    Deallocate();
+    size_t words = 1;
+    while (words < capacity / 4 + 1)
+      words <<= 1;
+    table_ = static_cast<uint64_t*>(mr_->allocate(words * 8, 64));
+    memset(table_, 0, words * 8);
+    mask_ = words - 1;
+    sample_size_ = 10 * (capacity ? capacity : 1);
+    additions_ = 0;
+  }
+
+  void Increment(uint64_t hash) {
+    if (!table_)
+      return;
+
+    bool added = false;
+    for (unsigned i = 0; i < 4; ++i) {
+      uint64_t& word = table_[WordIndex(hash, i)];
+      unsigned shift = CounterShift(hash, i);
+      if (((word >> shift) & 0xF) != 0xF) {
+        word += 1ULL << shift;
+        added = true;
+      }
+    }
+
+    if (added && ++additions_ >= sample_size_)
+      Halve();
+  }
+
+  unsigned Estimate(uint64_t hash) const {
+    if (!table_)
+      return 0;
+
+    unsigned res = 0xF;
+    for (unsigned i = 0; i < 4; ++i) {
+      unsigned cnt = (table_[WordIndex(hash, i)] >> CounterShift(hash, i)) & 0xF;
+      res = cnt < res ? cnt : res;
+    }
+    return res;
+  }
+
+  size_t bytes_allocated() const {
+    return table_ ? (mask_ + 1) * 8 : 0;
+  }
+
+ private:
+  static constexpr uint64_t kSeeds[4] = {0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL,
+                                         0x9ae16a3b2f90404fULL, 0xcbf29ce484222325ULL};
+
+  size_t WordIndex(uint64_t hash, unsigned i) const {
+    uint64_t h = (hash + kSeeds[i]) * kSeeds[i];
+    return (h >> 32) & mask_;
+  }
+
+  // Each row uses a different quarter of the word, so the counters of a key never collide.
+  static unsigned CounterShift(uint64_t hash, unsigned i) {
+    return ((i << 2) + ((hash >> (i << 3)) & 3)) << 2;
+  }
+
+  void Halve() {
+    for (size_t i = 0; i <= mask_; ++i)
+      table_[i] = (table_[i] >> 1) & 0x7777777777777777ULL;
+    additions_ /= 2;
+  }
+
+  void Deallocate() {
+    if (table_)
+      mr_->deallocate(table_, (mask_ + 1) * 8, 64);
+    table_ = nullptr;
+  }
+
+  PMR_NS::memory_resource* mr_;
+  uint64_t* table_ = nullptr;
+  size_t mask_ = 0;
+  size_t sample_size_ = 0;
+  size_t additions_ = 0;
+};
+
+// Single threaded cache with the W-TinyLFU policy (Einziger et al., "TinyLFU: A Highly
+// Efficient Cache Admission Policy"). New entries enter a small LRU window that absorbs
+// bursts. The entries that leave the window are admitted into the main SLRU area only if the
+// FrequencySketch estimates that they are accessed more often than the entry they would
+// evict, so that one-hit wonders do not flush the popular entries. The main area has a
+// probation and a protected segment, a hit in probation promotes the entry to protected.
+//
+// The cache is bounded by a memory budget: each entry is charged its allocation, including
+// its key, plus the charge of the value that the caller passes to Insert. The window gets 1%
+// of the budget and the protected segment 80% of the main area.
+// Keys are copied into the allocation of their entry and kept as string_view_sso, short
+// keys are inline. All the memory is allocated from the memory resource.
+// Pointers returned by Find stay valid until the entry is erased or evicted.
+template <typename V> class TinyLfuCache {
+ public:
+  struct Stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t rejections = 0;  // entries that were not admitted from the window.
+  };
+
+  explicit TinyLfuCache(size_t max_bytes, PMR_NS::memory_resource* mr = nullptr)
+      : mr_(mr ? mr : PMR_NS::get_default_resource()), map_(mr_), sketch_(mr_) {
+    SetMaxBytes(max_bytes);
+  }
+
+  ~TinyLfuCache() {
+    Clear();
+  }
+
+  TinyLfuCache(const TinyLfuCache&) = delete;
+  TinyLfuCache& operator=(const TinyLfuCache&) = delete;
+
+  // Returns the value of key or nullptr. Counts the access in both cases.
+  V* Find(std::string_view key) {
+    uint64_t hash = string_view_sso::Hash(key);
+    sketch_.Increment(hash);
+
+    auto it = map_.find(key);
+    if (it == map_.end()) {
+      ++stats_.misses;
+      return nullptr;
+    }
+
+    ++stats_.hits;
+    Entry* e = it->second;
+    OnHit(e);
+    return &e->value;
+  }
+
+  // Returns the value of key or nullptr without affecting the policy.
+  const V* Peek(std::string_view key) const {
+    auto it = map_.find(key);
+    return it == map_.end() ? nullptr : &it->second->value;
+  }
+
+  // Inserts or replaces the value of key. charge is the memory that the value owns beyond
+  // sizeof(V). Returns false if the entry exceeds the budget and was not inserted.
+  bool Insert(std::string_view key, V value, size_t charge = 0) {
+    Erase(key);
+
+    size_t alloc_size = AllocSize(key.size());
+    size_t total = alloc_size + charge;
+    if (total > max_bytes_)
+      return false;
+
+    void* ptr = mr_->allocate(alloc_size, alignof(Entry));
+    char* key_ptr = static_cast<char*>(ptr) + sizeof(Entry);
+    if (key.size() > string_view_sso::kInlineLen)
+      memcpy(key_ptr, key.data(), key.size());
+    else
+      key_ptr = const_cast<char*>(key.data());
+
+    Entry* e = new (ptr) Entry(string_view_sso{key_ptr, key.size()}, std::move(value));
+    e->charge = total;
+    map_.try_emplace(e->key, e);
+
+    e->segment = kWindow;
+    PushFront(&window_, e);
+    window_bytes_ += total;
+    EvictWindow();
+    return true;
+  }
+
+  bool Erase(std::string_view key) {
+    auto it = map_.find(key);
+    if (it == map_.end())
+      return false;
+    Entry* e = it->second;
+    map_.erase(it);
+    Unlink(e);
+    Free(e);
+    return true;
+  }
+
+  void Clear() {
+    for (Links* list : {&window_, &probation_, &protected_}) {
+      while (list->next != list) {
+        Entry* e = static_cast<Entry*>(list->next);
+        Unlink(e);
+        Free(e);
+      }
+    }
+    map_.clear();
+  }
+
+  // Changes the budget, evicting the entries that do not fit. Resizes the sketch as well,
+  // which forgets the frequencies.
+  void SetMaxBytes(size_t max_bytes) {
+    max_bytes_ = max_bytes;
+    window_max_ = max_bytes / 100;
+    main_max_ = max_bytes - window_max_;
+    protected_max_ = main_max_ / 5 * 4;
+
+    // Assumes entries of 64 bytes on average, capped to keep the sketch small for large
+    // budgets of large entries.
+    size_t capacity = max_bytes / 64;
+    sketch_.Resize(capacity < (1 << 24) ? capacity : (1 << 24));
+
+    while (protected_bytes_ > protected_max_)
+      Demote();
+    while (main_bytes_ > main_max_)
+      Evict(Victim());
+    EvictWindow();
+  }
+
+  size_t size() const {
+    return map_.size();
+  }
+
+  // Bytes charged for the entries.
+  size_t used_bytes() const {
+    return window_bytes_ + main_bytes_;
+  }
+
+  size_t max_bytes() const {
+    return max_bytes_;
+  }
+
+  // Overhead of the index and the sketch, not charged to the budget.
+  size_t overhead_bytes() const {
+    return map_.bytes_allocated() + sketch_.bytes_allocated();
+  }
+
+  const Stats& stats() const {
+    return stats_;
+  }
+
+  // Returns the estimated access frequency of key, for tests.
+  unsigned EstimateFrequency(std::string_view key) const {
+    return sketch_.Estimate(string_view_sso::Hash(key));
+  }
+
+ private:
+  enum Segment : uint8_t { kWindow, kProbation, kProtected };
+
+  struct Links {
+    Links* prev = this;
+    Links* next = this;
+  };
+
+  struct Entry : public Links {
+    Entry(string_view_sso k, V&& v) : key(k), value(std::move(v)) {
+    }
+
+    string_view_sso key;
+    size_t charge = 0;
+    Segment segment = kWindow;
+    V value;
+  };
+
+  using Map = SwissMap<string_view_sso, Entry*, SsoHash, SsoEq>;
+
+  static size_t AllocSize(size_t key_size) {
+    return sizeof(Entry) + (key_size > string_view_sso::kInlineLen ? key_size : 0);
+  }
+
+  static void PushFront(Links* list, Entry* e) {
+    e->prev = list;
+    e->next = list->next;
+    list->next->prev = e;
+    list->next = e;
+  }
+
+  static Entry* Back(Links* list) {
+    return list->prev == list ? nullptr : static_cast<Entry*>(list->prev);
+  }
+
+  // Removes e from its list and from the byte counts of its segment.
+  void Unlink(Entry* e) {
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    switch (e->segment) {
+      case kWindow:
+        window_bytes_ -= e->charge;
+        break;
+      case kProbation:
+        main_bytes_ -= e->charge;
+        break;
+      case kProtected:
+        main_bytes_ -= e->charge;
+        protected_bytes_ -= e->charge;
+        break;
+    }
+  }
+
+  void Free(Entry* e) {
+    size_t alloc_size = AllocSize(e->key.size());
+    e->~Entry();
+    mr_->deallocate(e, alloc_size, alignof(Entry));
+  }
+
+  void OnHit(Entry* e) {
+    switch (e->segment) {
+      case kWindow:
+        Unlink(e);
+        PushFront(&window_, e);
+        window_bytes_ += e->charge;
+        break;
+      case kProbation:
+        Unlink(e);
+        e->segment = kProtected;
+        PushFront(&protected_, e);
+        main_bytes_ += e->charge;
+        protected_bytes_ += e->charge;
+        while (protected_bytes_ > protected_max_)
+          Demote();
+        break;
+      case kProtected:
+        Unlink(e);
+        PushFront(&protected_, e);
+        main_bytes_ += e->charge;
+        protected_bytes_ += e->charge;
+        break;
+    }
+  }
+
+  // Moves the LRU entry of protected to the front of probation.
+  void Demote() {
+    Entry* e = Back(&protected_);
+    Unlink(e);
+    e->segment = kProbation;
+    PushFront(&probation_, e);
+    main_bytes_ += e->charge;
+  }
+
+  // Returns the entry of the main area that is evicted first.
+  Entry* Victim() {
+    Entry* e = Back(&probation_);
+    return e ? e : Back(&protected_);
+  }
+
+  // Moves the entries beyond the window budget into the main area if they are admitted.
+  void EvictWindow() {
+    while (window_bytes_ > window_max_) {
+      Entry* candidate = Back(&window_);
+      Unlink(candidate);
+      Admit(candidate);
+    }
+  }
+
+  void Admit(Entry* candidate) {
+    while (main_bytes_ + candidate->charge > main_max_) {
+      Entry* victim = Victim();
+      if (!victim)
+        break;
+
+      // Ties go to the victim, which already proved itself in the main area.
+      uint64_t cand_hash = candidate->key.hash(), victim_hash = victim->key.hash();
+      if (sketch_.Estimate(cand_hash) <= sketch_.Estimate(victim_hash)) {
+        ++stats_.rejections;
+        EvictUnlinked(candidate);
+        return;
+      }
+      Evict(victim);
+    }
+
+    candidate->segment = kProbation;
+    PushFront(&probation_, candidate);
+    main_bytes_ += candidate->charge;
+  }
+
+  void Evict(Entry* e) {
+    Unlink(e);
+    EvictUnlinked(e);
+  }
+
+  void EvictUnlinked(Entry* e) {
+    ++stats_.evictions;
+    map_.erase(e->key);
+    Free(e);
+  }
+
+  PMR_NS::memory_resource* mr_;
+  Map map_;
+  FrequencySketch sketch_;
+
+  Links window_, probation_, protected_;
+  size_t window_bytes_ = 0, main_bytes_ = 0, protected_bytes_ = 0;
+  size_t max_bytes_ = 0, window_max_ = 0, main_max_ = 0, protected_max_ = 0;
+  Stats stats_;
+};
+
+}  // namespace base
@@ -0,0 +1,180 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "base/tiny_lfu_cache.h"
+
+#include <absl/strings/str_cat.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "base/zipf_gen.h"
+
+namespace base {
+
+using namespace std;
+
+class TinyLfuCacheTest : public testing::Test {};
+
+// Counts the bytes that are allocated and not freed.
+class CountingResource : public PMR_NS::memory_resource {
+ public:
+  size_t used = 0;
+
+ private:
+  void* do_allocate(size_t bytes, size_t alignment) final {
+    used += bytes;
+    return PMR_NS::new_delete_resource()->allocate(bytes, alignment);
+  }
+
+  void do_deallocate(void* p, size_t bytes, size_t alignment) final {
+    used -= bytes;
+    PMR_NS::new_delete_resource()->deallocate(p, bytes, alignment);
+  }
+
+  bool do_is_equal(const PMR_NS::memory_resource& o) const noexcept final {
+    return this == &o;
+  }
+};
+
+TEST_F(TinyLfuCacheTest, Basic) {
+  TinyLfuCache<int> cache(1 << 20);
+  EXPECT_EQ(nullptr, cache.Find("a"));
+  EXPECT_TRUE(cache.Insert("a", 1));
+  EXPECT_TRUE(cache.Insert(string(100, 'b'), 2));
+
+  ASSERT_TRUE(cache.Find("a"));
+  EXPECT_EQ(1, *cache.Find("a"));
+  EXPECT_EQ(2, *cache.Find(string(100, 'b')));
+  EXPECT_EQ(3u, cache.stats().hits);
+  EXPECT_EQ(1u, cache.stats().misses);
+
+  // Replaces the value.
+  EXPECT_TRUE(cache.Insert("a", 3));
+  EXPECT_EQ(3, *cache.Peek("a"));
+  EXPECT_EQ(2u, cache.size());
+
+  EXPECT_TRUE(cache.Erase("a"));
+  EXPECT_FALSE(cache.Erase("a"));
+  EXPECT_EQ(1u, cache.size());
+
+  // Larger than the budget.
+  EXPECT_FALSE(cache.Insert("c", 4, 2 << 20));
+  EXPECT_EQ(nullptr, cache.Peek("c"));
+}
+
+TEST_F(TinyLfuCacheTest, Budget) {
+  CountingResource mr;
+  {
+    TinyLfuCache<string> cache(64 << 10, &mr);
+    for (unsigned i = 0; i < 10000; ++i) {
+      string val(100, 'x');
+      ASSERT_TRUE(cache.Insert(absl::StrCat("key:", i, ":", string(20, 'k')), val, val.size()));
+      ASSERT_LE(cache.used_bytes(), cache.max_bytes());
+    }
+    EXPECT_LT(cache.size(), 10000u);
+    EXPECT_GT(cache.stats().evictions + cache.stats().rejections, 0u);
+
+    // The entries and the keys are allocated from the resource.
+    EXPECT_GE(mr.used, cache.used_bytes() - cache.size() * 100);
+
+    cache.SetMaxBytes(8 << 10);
+    EXPECT_LE(cache.used_bytes(), 8u << 10);
+  }
+  EXPECT_EQ(0u, mr.used);
+}
+
+TEST_F(TinyLfuCacheTest, Admission) {
+  TinyLfuCache<int> cache(100 * 64);
+
+  // Make the hot keys frequent and resident.
+  for (unsigned round = 0; round < 5; ++round) {
+    for (unsigned i = 0; i < 20; ++i) {
+      string key = absl::StrCat("hot", i);
+      if (!cache.Find(key))
+        cache.Insert(key, i);
+    }
+  }
+
+  // A scan of keys that are accessed once does not flush the hot keys, which are still
+  // accessed, although less often than the scanned ones.
+  for (unsigned i = 0; i < 10000; ++i) {
+    string key = absl::StrCat("scan", i);
+    if (!cache.Find(key))
+      cache.Insert(key, i);
+    if (i % 4 == 0)
+      cache.Find(absl::StrCat("hot", i / 4 % 20));
+  }
+
+  unsigned resident = 0;
+  for (unsigned i = 0; i < 20; ++i)
+    resident += cache.Peek(absl::StrCat("hot", i)) != nullptr;
+  EXPECT_EQ(20u, resident);
+  EXPECT_GT(cache.stats().rejections, 0u);
+}
+
+TEST_F(TinyLfuCacheTest, Sketch) {
+  FrequencySketch sketch(PMR_NS::get_default_resource());
+  sketch.Resize(1024);
+  EXPECT_EQ(0u, sketch.Estimate(1));
+
+  for (unsigned i = 0; i < 20; ++i)
+    sketch.Increment(1);
+  EXPECT_EQ(15u, sketch.Estimate(1));  // saturated.
+
+  // Aging halves the counters.
+  for (uint64_t i = 0; i < 10 * 1024; ++i)
+    sketch.Increment(i * 0x9E3779B97F4A7C15ULL + 7);
+  EXPECT_LE(sketch.Estimate(1), 8u);
+}
+
+// Hit rate under a zipfian workload with a cache that fits a tenth of the keys.
+TEST_F(TinyLfuCacheTest, ZipfHitRate) {
+  constexpr unsigned kNumKeys = 100000;
+  ZipfianGenerator gen(kNumKeys);
+  mt19937_64 rng(42);
+
+  TinyLfuCache<uint64_t> cache(kNumKeys / 10 * 128);
+  for (unsigned i = 0; i < 1000000; ++i) {
+    uint64_t id = gen.Next(rng);
+    string key = absl::StrCat("key:", id);
+    if (!cache.Find(key))
+      cache.Insert(key, id);
+  }
+
+  const auto& stats = cache.stats();
+  double hit_rate = double(stats.hits) / (stats.hits + stats.misses);
+  LOG(INFO) << "hit rate " << hit_rate << ", entries " << cache.size();
+  EXPECT_GT(hit_rate, 0.6);
+}
+
+static void BM_ZipfLookup(benchmark::State& state) {
+  size_t num_keys = state.range(0);
+  vector<string> keys(num_keys);
+  for (size_t i = 0; i < num_keys; ++i)
+    keys[i] = absl::StrCat("key:", i);
+
+  ZipfianGenerator gen(num_keys);
+  mt19937_64 rng(42);
+  vector<uint64_t> sample(1 << 16);
+  gen.NextN(rng, absl::MakeSpan(sample));
+
+  // Holds about a tenth of the keys.
+  TinyLfuCache<uint64_t> cache(num_keys / 10 * 128);
+  size_t i = 0;
+  while (state.KeepRunning()) {
+    const string& key = keys[sample[i++ & (sample.size() - 1)]];
+    if (!cache.Find(key))
+      cache.Insert(key, i);
+  }
+
+  const auto& stats = cache.stats();
+  state.counters["hit_rate"] = double(stats.hits) / (stats.hits + stats.misses);
+}
+BENCHMARK(BM_ZipfLookup)->Arg(1 << 16)->Arg(1 << 20);
+
+}  // namespace base
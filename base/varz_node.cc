@@ -39,28 +39,41 @@ VarzListNode::~VarzListNode() {
 
 string VarzListNode::Format(const AnyValue& av) {
   string result;
+  FormatTo(av, &result);
+  return result;
+}
 
+void VarzListNode::FormatTo(const AnyValue& av, string* dest) {
   switch (av.type) {
     case VarzValue::STRING:
-      StrAppend(&result, "\"", av.str, "\"");
+      StrAppend(dest, "\"", av.str, "\"");
       break;
     case VarzValue::NUM:
     case VarzValue::TIME:
-      StrAppend(&result, av.num);
+      StrAppend(dest, av.num);
       break;
     case VarzValue::DOUBLE:
-      StrAppend(&result, av.dbl);
+      StrAppend(dest, av.dbl);
       break;
     case VarzValue::MAP:
-      result.append("{ ");
+      dest->append("{ ");
       for (const auto& k_v : av.key_value_array) {
-        StrAppend(&result, "\"", k_v.first, "\": ", Format(k_v.second), ",");
+        StrAppend(dest, "\"", k_v.first, "\": ");
+        FormatTo(k_v.second, dest);
+        dest->push_back(',');
       }
-      result.back() = ' ';
-      result.append("}");
+      dest->back() = ' ';
+      dest->append("}");
       break;
   }
-  return result;
+}
+
+void VarzListNode::AppendValues(string* dest) {
+  Iterate([dest](const char* name, AnyValue&& av) {
+    StrAppend(dest, "\"", name, "\": ");
+    FormatTo(av, dest);
+    dest->append(",\n");
+  });
 }
 
 VarzListNode*& VarzListNode::global_list() {
@@ -27,12 +27,16 @@ class VarzListNode {
     Iterate([&](const char* name, AnyValue&& av) { cb(name, Format(av)); });
   }
 
+  // Appends '"name": value,\n' of each active node to dest, without intermediate strings.
+  static void AppendValues(std::string* dest);
+
  protected:
   virtual AnyValue GetData() const = 0;
 
   const char* name_;
 
   static std::string Format(const AnyValue& av);
+  static void FormatTo(const AnyValue& av, std::string* dest);
 
  private:
   // Returns the head to varz linked list. Note that the list becomes invalid after at least one
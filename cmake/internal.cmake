@@ -150,10 +150,38 @@ SET_PROPERTY(GLOBAL PROPERTY "test_list_property" "")
 
 add_custom_target(check COMMAND ${CMAKE_CTEST_COMMAND})
 
+# Builds and runs all the benchmarks, see cxx_bench.
+add_custom_target(bench)
+SET_PROPERTY(GLOBAL PROPERTY "last_bench_property" "")
+set(BENCH_ARGS "--benchmark_repetitions=5" CACHE STRING "Extra arguments of the bench runs")
+set(BENCH_OUT_DIR "${CMAKE_BINARY_DIR}/bench_results" CACHE PATH "Output directory of the bench runs")
+
+# Registers target, a google benchmark binary, with the bench target, which runs it with
+# --bench_json=${BENCH_OUT_DIR}/<target>.json followed by the rest of the arguments.
+# The runs are chained, so that the benchmarks do not compete for the cpus even with parallel
+# builds. Compare the results of two runs with tools/bench_compare.py.
+function(cxx_bench target)
+  add_custom_target(bench_${target}
+                    COMMAND ${CMAKE_COMMAND} -E make_directory ${BENCH_OUT_DIR}
+                    COMMAND $<TARGET_FILE:${target}> --bench_json=${BENCH_OUT_DIR}/${target}.json
+                            ${ARGN} ${BENCH_ARGS}
+                    COMMENT "Benchmarking ${target}" USES_TERMINAL VERBATIM)
+  add_dependencies(bench_${target} ${target})
+
+  get_property(last_bench GLOBAL PROPERTY "last_bench_property")
+  if (last_bench)
+    add_dependencies(bench_${target} ${last_bench})
+  endif()
+  SET_PROPERTY(GLOBAL PROPERTY "last_bench_property" bench_${target})
+  add_dependencies(bench bench_${target})
+endfunction()
+
+# cxx_test(path libs... [BENCH] [LABELS labels...])
+# BENCH registers the test with the bench target, which runs only its benchmarks.
 function(cxx_test path)
   get_filename_component(name ${path} NAME)
   add_executable(${name} ${path}.cc)
-  CMAKE_PARSE_ARGUMENTS(parsed "" "" "LABELS" ${ARGN})
+  CMAKE_PARSE_ARGUMENTS(parsed "BENCH" "" "LABELS" ${ARGN})
 
   if (NOT parsed_LABELS)
     set(parsed_LABELS "unit")
@@ -172,6 +200,10 @@ function(cxx_test path)
   SET_PROPERTY(GLOBAL PROPERTY "test_list_property" "${cur_list}")
   add_dependencies(check ${name})
 
+  if (parsed_BENCH)
+    cxx_bench(${name} --gtest_filter=-*)
+  endif()
+
   # add_custom_command(TARGET ${name} POST_BUILD
   #                    COMMAND ${name} WORKING_DIRECTORY ${CMAKE_CURRENT_BINARY_DIR}
   #                    COMMENT "Running ${name}" VERBATIM)
@@ -349,6 +349,32 @@ add_third_party(
   BUILD_IN_SOURCE 1
 )
 
+add_third_party(
+  lz4
+  URL https://github.com/lz4/lz4/archive/refs/tags/v1.9.4.tar.gz
+  SOURCE_SUBDIR build/cmake
+  CMAKE_PASS_FLAGS "-DBUILD_SHARED_LIBS=OFF -DBUILD_STATIC_LIBS=ON -DLZ4_BUILD_CLI=OFF \
+                    -DLZ4_BUILD_LEGACY_LZ4C=OFF -DCMAKE_POSITION_INDEPENDENT_CODE=ON \
+                    -DCMAKE_INSTALL_LIBDIR=lib"
+)
+
+add_third_party(
+  zstd
+  URL https://github.com/facebook/zstd/releases/download/v1.5.6/zstd-1.5.6.tar.gz
+  SOURCE_SUBDIR build/cmake
+  CMAKE_PASS_FLAGS "-DZSTD_BUILD_SHARED=OFF -DZSTD_BUILD_STATIC=ON -DZSTD_BUILD_PROGRAMS=OFF \
+                    -DZSTD_BUILD_TESTS=OFF -DZSTD_MULTITHREAD_SUPPORT=OFF \
+                    -DCMAKE_POSITION_INDEPENDENT_CODE=ON -DCMAKE_INSTALL_LIBDIR=lib"
+)
+
+add_third_party(
+  nghttp2
+  URL https://github.com/nghttp2/nghttp2/releases/download/v1.59.0/nghttp2-1.59.0.tar.gz
+  CMAKE_PASS_FLAGS "-DENABLE_LIB_ONLY=ON -DBUILD_SHARED_LIBS=OFF -DBUILD_STATIC_LIBS=ON \
+                    -DBUILD_TESTING=OFF -DENABLE_DOC=OFF -DCMAKE_POSITION_INDEPENDENT_CODE=ON \
+                    -DCMAKE_INSTALL_LIBDIR=lib"
+)
+
 add_third_party(
   rapidjson
   GIT_REPOSITORY https://github.com/Tencent/rapidjson.git
@@ -358,6 +384,13 @@ add_third_party(
   LIB "none"
 )
 
+add_third_party(
+  simdjson
+  URL https://github.com/simdjson/simdjson/archive/refs/tags/v3.10.1.tar.gz
+  CMAKE_PASS_FLAGS "-DSIMDJSON_DEVELOPER_MODE=OFF -DBUILD_SHARED_LIBS=OFF \
+                    -DCMAKE_INSTALL_LIBDIR=lib"
+)
+
 add_third_party(
   pugixml
   URL https://github.com/zeux/pugixml/archive/refs/tags/v1.13.tar.gz
@@ -19,6 +19,7 @@
 #include "util/fibers/pool.h"
 #include "util/fibers/synchronization.h"
 #include "util/http/http_handler.h"
+#include "util/socket_dispatch.h"
 #include "util/varz.h"
 
 using namespace util;
@@ -63,16 +64,18 @@ class EchoConnection : public Connection {
  private:
   void HandleRequests() final;
 
-  std::error_code ReadMsg(size_t* sz);
+  // Instantiated per socket type, see VisitSocket.
+  template <typename S> void EchoLoop(S* sock, bool is_raw);
+  template <typename S> std::error_code ReadMsg(S* sock, size_t* sz);
 
   std::unique_ptr<uint8_t[]> work_buf_;
   size_t req_len_ = 0;
 };
 
-std::error_code EchoConnection::ReadMsg(size_t* sz) {
+template <typename S> std::error_code EchoConnection::ReadMsg(S* sock, size_t* sz) {
   io::MutableBytes mb(work_buf_.get(), req_len_);
 
-  auto res = socket_->Recv(mb, 0);
+  auto res = sock->Recv(mb, 0);
   if (res) {
     *sz = *res;
     CHECK_EQ(*sz, req_len_);
@@ -84,14 +87,47 @@ std::error_code EchoConnection::ReadMsg(size_t* sz) {
 
 static thread_local base::Histogram send_hist;
 
-void EchoConnection::HandleRequests() {
-  ThisFiber::SetName("HandleRequests");
-
+template <typename S> void EchoConnection::EchoLoop(S* sock, bool is_raw) {
   std::error_code ec;
   size_t sz;
   iovec vec[2];
   uint8_t buf[8];
 
+  while (true) {
+    ec = ReadMsg(sock, &sz);
+    if (FiberSocketBase::IsConnClosed(ec)) {
+      VLOG(1) << "Closing " << sock->RemoteEndpoint();
+      break;
+    }
+    CHECK(!ec) << ec;
+    ping_qps.Inc();
+
+    vec[0].iov_base = buf;
+    vec[0].iov_len = 4;
+    absl::little_endian::Store32(buf, sz);
+    vec[1].iov_base = work_buf_.get();
+    vec[1].iov_len = sz;
+
+    if (is_raw) {
+      auto prev = absl::GetCurrentTimeNanos();
+      // send(sock->native_handle(), work_buf_.get(), sz, 0);
+      ec = WriteExactly(sock, vec + 1, 1);
+      // socket_->Send(io::Bytes{work_buf_.get(), sz}, 0);
+      auto now = absl::GetCurrentTimeNanos();
+      send_hist.Add((now - prev) / 1000);
+    } else {
+      ec = WriteExactly(sock, vec, 2);
+    }
+    if (ec)
+      break;
+  }
+}
+
+void EchoConnection::HandleRequests() {
+  ThisFiber::SetName("HandleRequests");
+
+  uint8_t buf[8];
+
   int yes = 1;
   if (GetFlag(FLAGS_tcp_nodelay)) {
     CHECK_EQ(0, setsockopt(socket_->native_handle(), IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes)));
@@ -99,9 +135,6 @@ void EchoConnection::HandleRequests() {
 
   connections.IncBy(1);
 
-  vec[0].iov_base = buf;
-  vec[0].iov_len = 8;
-
   auto ep = socket_->RemoteEndpoint();
 
   VLOG(1) << "New connection from " << ep;
@@ -132,34 +165,7 @@ void EchoConnection::HandleRequests() {
   work_buf_.reset(new uint8_t[req_len_]);
 
   // after the handshake.
-  while (true) {
-    ec = ReadMsg(&sz);
-    if (FiberSocketBase::IsConnClosed(ec)) {
-      VLOG(1) << "Closing " << ep;
-      break;
-    }
-    CHECK(!ec) << ec;
-    ping_qps.Inc();
-
-    vec[0].iov_base = buf;
-    vec[0].iov_len = 4;
-    absl::little_endian::Store32(buf, sz);
-    vec[1].iov_base = work_buf_.get();
-    vec[1].iov_len = sz;
-
-    if (is_raw) {
-      auto prev = absl::GetCurrentTimeNanos();
-      // send(sock->native_handle(), work_buf_.get(), sz, 0);
-      ec = socket_->Write(vec + 1, 1);
-      // socket_->Send(io::Bytes{work_buf_.get(), sz}, 0);
-      auto now = absl::GetCurrentTimeNanos();
-      send_hist.Add((now - prev) / 1000);
-    } else {
-      ec = socket_->Write(vec, 2);
-    }
-    if (ec)
-      break;
-  }
+  VisitSocket(socket_.get(), [&](auto* sock) { EchoLoop(sock, is_raw); });
 
   VLOG(1) << "Connection ended " << ep;
   connections.IncBy(-1);
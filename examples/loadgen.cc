@@ -0,0 +1,404 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+// Load generator for RESP or HTTP servers with zipfian or uniform key distributions, e.g.
+//   loadgen --host=localhost --port=6379 --c=16 --duration_sec=30 --keys=1000000 --dist=zipf
+//   loadgen --protocol=http --port=8080 --rate=50000 --get_ratio=1
+//
+// With --pipeline=N every connection sends N requests with a single write and then reads their
+// replies, like memtier_benchmark --pipeline. All of them are charged the latency of the batch.
+//
+// With --rate=0 every connection sends its next request once the previous reply arrives
+// (closed loop) and the latency is measured from the send. With --rate > 0 the requests are
+// scheduled at the given total arrival rate (open loop), evenly or with exponential gaps if
+// --poisson is set, and the latency is measured from the scheduled time rather than from the
+// actual send. Therefore, a server that falls behind is charged for the time the requests
+// spent waiting to be sent, i.e. the results are not subject to coordinated omission and match
+// what clients arriving at the given rate would see. The service time, measured from the send,
+// is reported separately.
+
+#include <absl/strings/ascii.h>
+#include <absl/strings/match.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <tuple>
+
+#include "base/histogram.h"
+#include "base/init.h"
+#include "base/random.h"
+#include "base/zipf_gen.h"
+#include "util/fibers/dns_resolve.h"
+#include "util/fibers/pool.h"
+
+ABSL_FLAG(std::string, host, "localhost", "Server host");
+ABSL_FLAG(uint16_t, port, 6379, "Server port");
+ABSL_FLAG(std::string, protocol, "resp", "Protocol: resp or http");
+ABSL_FLAG(uint32_t, c, 10, "Connections per proactor thread");
+ABSL_FLAG(uint32_t, duration_sec, 10, "Test duration");
+ABSL_FLAG(uint64_t, rate, 0,
+          "Total requests per second over all connections. 0 runs a closed loop test");
+ABSL_FLAG(bool, poisson, false, "Open loop only: exponential gaps between the requests");
+ABSL_FLAG(uint64_t, keys, 100000, "Number of distinct keys");
+ABSL_FLAG(std::string, dist, "zipf", "Key distribution: zipf or uniform");
+ABSL_FLAG(double, zipf_theta, base::ZipfianGenerator::kZipfianConst, "Zipfian skew, in (0, 1)");
+ABSL_FLAG(double, get_ratio, 0.9, "Fraction of the requests that are reads");
+ABSL_FLAG(uint32_t, value_size, 64, "Size of the written values");
+ABSL_FLAG(std::string, key_prefix, "key:", "Prefix of the keys");
+ABSL_FLAG(bool, epoll, false, "If true, uses epoll api instead of iouring");
+ABSL_FLAG(uint32_t, pipeline, 1, "Number of requests sent together by a connection");
+
+using namespace util;
+using namespace std;
+
+using absl::GetFlag;
+using fb2::Fiber;
+using tcp = ::boost::asio::ip::tcp;
+using Clock = chrono::steady_clock;
+
+namespace {
+
+struct Config {
+  bool http = false;
+  bool zipf = true;
+  bool poisson = false;
+  uint64_t keys = 0;
+  double get_ratio = 0;
+  string key_prefix;
+  string value;
+  string host;
+  uint32_t pipeline = 1;
+
+  // Per connection, 0 in closed loop mode.
+  double interval_ns = 0;
+};
+
+struct Result {
+  uint64_t requests = 0;
+  uint64_t errors = 0;  // error replies, not connection errors.
+
+  base::FixedHistogram latency;  // usec, from the scheduled time in open loop mode.
+  base::FixedHistogram service;  // usec, from the send.
+};
+
+// Returns the length of the first complete reply in buf or 0 if more data is needed.
+// Sets *is_error for RESP error replies and non-2xx HTTP statuses.
+size_t ParseResp(string_view buf, bool* is_error) {
+  size_t eol = buf.find("\r\n");
+  if (eol == string_view::npos)
+    return 0;
+
+  switch (buf[0]) {
+    case '-':
+      *is_error = true;
+      [[fallthrough]];
+    case '+':
+    case ':':
+      return eol + 2;
+    case '$': {
+      int64_t len;
+      CHECK(absl::SimpleAtoi(buf.substr(1, eol - 1), &len)) << "Bad bulk string header";
+      if (len < 0)
+        return eol + 2;
+      size_t total = eol + 2 + len + 2;
+      return buf.size() >= total ? total : 0;
+    }
+    default:
+      LOG(FATAL) << "Unsupported reply type " << buf[0];
+  }
+  return 0;
+}
+
+size_t ParseHttp(string_view buf, bool* is_error) {
+  size_t hdr_end = buf.find("\r\n\r\n");
+  if (hdr_end == string_view::npos)
+    return 0;
+
+  string_view header = buf.substr(0, hdr_end);
+  size_t body_len = 0;
+  bool status_line = true;
+  for (string_view line : absl::StrSplit(header, "\r\n")) {
+    if (status_line) {
+      // HTTP/1.1 200 OK
+      vector<string_view> parts = absl::StrSplit(line, absl::MaxSplits(' ', 2));
+      CHECK_GE(parts.size(), 2u) << "Bad status line " << line;
+      *is_error = parts[1].empty() || parts[1][0] != '2';
+      status_line = false;
+      continue;
+    }
+    constexpr string_view kContentLength = "content-length:";
+    if (absl::StartsWithIgnoreCase(line, kContentLength)) {
+      string_view val = absl::StripAsciiWhitespace(line.substr(kContentLength.size()));
+      CHECK(absl::SimpleAtoi(val, &body_len)) << "Bad content length " << line;
+    }
+  }
+
+  size_t total = hdr_end + 4 + body_len;
+  return buf.size() >= total ? total : 0;
+}
+
+class LoadConnection {
+ public:
+  LoadConnection(const Config& cfg, const base::ZipfianGenerator& zipf, uint64_t seed)
+      : cfg_(cfg), zipf_(zipf), rng_(seed) {
+  }
+
+  void Connect(ProactorBase* p, const tcp::endpoint& ep) {
+    socket_.reset(p->CreateSocket());
+    error_code ec = socket_->Connect(ep);
+    CHECK(!ec) << "Connect failed: " << ec.message();
+  }
+
+  // Runs until the deadline or until the connection fails.
+  void Run(Clock::time_point deadline, Result* res);
+
+  void Close() {
+    std::ignore = socket_->Close();
+  }
+
+ private:
+  // Appends a request to req_.
+  void BuildRequest();
+
+  // Returns false if the connection failed.
+  bool ReadReply(bool* is_error);
+
+  Clock::duration NextGap() {
+    double ns = cfg_.interval_ns;
+    if (cfg_.poisson)
+      ns = exponential_distribution<double>{1.0 / ns}(rng_);
+    return chrono::nanoseconds(uint64_t(ns));
+  }
+
+  const Config& cfg_;
+  base::ZipfianGenerator zipf_;
+  base::Xoroshiro128p rng_;
+  unique_ptr<FiberSocketBase> socket_;
+
+  string req_, key_;
+  string buf_ = string(4096, '\0');
+  size_t buf_len_ = 0;
+};
+
+void LoadConnection::BuildRequest() {
+  uint64_t index =
+      cfg_.zipf ? zipf_.Next(rng_) : uniform_int_distribution<uint64_t>{0, cfg_.keys - 1}(rng_);
+  bool is_get = uniform_real_distribution<double>{0, 1}(rng_) < cfg_.get_ratio;
+
+  key_.clear();
+  absl::StrAppend(&key_, cfg_.key_prefix, index);
+
+  if (cfg_.http) {
+    if (is_get) {
+      absl::StrAppend(&req_, "GET /", key_, " HTTP/1.1\r\nHost: ", cfg_.host, "\r\n\r\n");
+    } else {
+      absl::StrAppend(&req_, "PUT /", key_, " HTTP/1.1\r\nHost: ", cfg_.host,
+                      "\r\nContent-Length: ", cfg_.value.size(), "\r\n\r\n", cfg_.value);
+    }
+    return;
+  }
+
+  if (is_get) {
+    absl::StrAppend(&req_, "*2\r\n$3\r\nGET\r\n$", key_.size(), "\r\n", key_, "\r\n");
+  } else {
+    absl::StrAppend(&req_, "*3\r\n$3\r\nSET\r\n$", key_.size(), "\r\n", key_, "\r\n$",
+                    cfg_.value.size(), "\r\n", cfg_.value, "\r\n");
+  }
+}
+
+bool LoadConnection::ReadReply(bool* is_error) {
+  while (true) {
+    if (buf_len_ > 0) {
+      string_view data{buf_.data(), buf_len_};
+      size_t len = cfg_.http ? ParseHttp(data, is_error) : ParseResp(data, is_error);
+      if (len > 0) {
+        buf_len_ -= len;
+        memmove(buf_.data(), buf_.data() + len, buf_len_);
+        return true;
+      }
+    }
+
+    if (buf_len_ == buf_.size())
+      buf_.resize(buf_.size() * 2);
+
+    io::MutableBytes dest{reinterpret_cast<uint8_t*>(buf_.data()) + buf_len_,
+                          buf_.size() - buf_len_};
+    io::Result<size_t> res = socket_->Recv(dest);
+    if (!res) {
+      LOG(ERROR) << "Recv failed: " << res.error().message();
+      return false;
+    }
+    if (*res == 0) {
+      LOG(ERROR) << "Connection closed by the server";
+      return false;
+    }
+    buf_len_ += *res;
+  }
+}
+
+void LoadConnection::Run(Clock::time_point deadline, Result* res) {
+  bool open_loop = cfg_.interval_ns > 0;
+
+  // Spreads the first requests of the connections over one interval.
+  Clock::time_point scheduled = Clock::now();
+  if (open_loop)
+    scheduled += chrono::nanoseconds(uint64_t(cfg_.interval_ns * (rng_() % 1024) / 1024));
+
+  while (true) {
+    if (open_loop && scheduled > Clock::now())
+      ThisFiber::SleepUntil(scheduled);
+
+    Clock::time_point sent = Clock::now();
+    if (sent >= deadline)
+      break;
+
+    req_.clear();
+    for (uint32_t i = 0; i < cfg_.pipeline; ++i)
+      BuildRequest();
+    error_code ec = socket_->Write(io::Buffer(req_));
+    if (ec) {
+      LOG(ERROR) << "Write failed: " << ec.message();
+      break;
+    }
+
+    uint32_t replies = 0;
+    while (replies < cfg_.pipeline) {
+      bool is_error = false;
+      if (!ReadReply(&is_error))
+        break;
+      res->errors += is_error;
+      ++replies;
+    }
+    if (replies < cfg_.pipeline)
+      break;
+
+    Clock::time_point now = Clock::now();
+    res->requests += replies;
+    double service_usec = chrono::duration<double, micro>(now - sent).count();
+    // Measured from the scheduled time in the open loop mode, so a late send counts as
+    // latency too.
+    double latency_usec =
+        open_loop ? chrono::duration<double, micro>(now - scheduled).count() : service_usec;
+    for (uint32_t i = 0; i < replies; ++i) {
+      res->service.Add(service_usec);
+      res->latency.Add(latency_usec);
+    }
+    if (open_loop)
+      scheduled += NextGap();
+  }
+}
+
+void PrintPercentiles(string_view title, const base::FixedHistogram& hist) {
+  CONSOLE_INFO << title << " (usec): p50 " << hist.Percentile(50) << " p90 "
+               << hist.Percentile(90) << " p99 " << hist.Percentile(99) << " p99.9 "
+               << hist.Percentile(99.9) << " p99.99 " << hist.Percentile(99.99) << " max "
+               << hist.max();
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  MainInitGuard guard(&argc, &argv);
+
+  Config cfg;
+  string protocol = GetFlag(FLAGS_protocol);
+  CHECK(protocol == "resp" || protocol == "http") << "Unknown protocol " << protocol;
+  cfg.http = protocol == "http";
+
+  string dist = GetFlag(FLAGS_dist);
+  CHECK(dist == "zipf" || dist == "uniform") << "Unknown distribution " << dist;
+  cfg.zipf = dist == "zipf";
+  cfg.poisson = GetFlag(FLAGS_poisson);
+  cfg.keys = GetFlag(FLAGS_keys);
+  CHECK_GE(cfg.keys, 2u);
+  cfg.get_ratio = GetFlag(FLAGS_get_ratio);
+  cfg.key_prefix = GetFlag(FLAGS_key_prefix);
+  cfg.value.assign(GetFlag(FLAGS_value_size), 'x');
+  cfg.host = GetFlag(FLAGS_host);
+  cfg.pipeline = GetFlag(FLAGS_pipeline);
+  CHECK_GT(cfg.pipeline, 0u);
+
+  double theta = GetFlag(FLAGS_zipf_theta);
+  CHECK(theta > 0 && theta < 1) << "zipf_theta must be in (0, 1)";
+
+  // The generator is created once and copied to the connections.
+  base::ZipfianGenerator zipf(0, cfg.keys - 1, theta);
+
+  unique_ptr<ProactorPool> pp;
+#ifdef __linux__
+  if (GetFlag(FLAGS_epoll)) {
+    pp.reset(fb2::Pool::Epoll());
+  } else {
+    pp.reset(fb2::Pool::IOUring(256));
+  }
+#else
+  pp.reset(fb2::Pool::Epoll());
+#endif
+  pp->Run();
+
+  uint32_t conns = GetFlag(FLAGS_c);
+  CHECK_GT(conns, 0u);
+  uint64_t total_conns = uint64_t(conns) * pp->size();
+  if (uint64_t rate = GetFlag(FLAGS_rate); rate > 0) {
+    // Every arrival sends a pipeline of requests.
+    cfg.interval_ns = 1e9 * total_conns * cfg.pipeline / rate;
+  }
+
+  char ip_addr[INET6_ADDRSTRLEN];
+  auto* proactor = pp->GetNextProactor();
+  error_code ec =
+      proactor->Await([&] { return fb2::DnsResolve(cfg.host, 0, ip_addr, proactor); });
+  CHECK(!ec) << "Could not resolve " << cfg.host << " " << ec.message();
+  tcp::endpoint ep{::boost::asio::ip::make_address(ip_addr), GetFlag(FLAGS_port)};
+
+  vector<vector<unique_ptr<LoadConnection>>> clients(pp->size());
+  pp->AwaitFiberOnAll([&](unsigned index, ProactorBase* p) {
+    for (uint32_t i = 0; i < conns; ++i) {
+      auto conn = make_unique<LoadConnection>(cfg, zipf, uint64_t(index) << 32 | i);
+      conn->Connect(p, ep);
+      clients[index].push_back(std::move(conn));
+    }
+  });
+
+  CONSOLE_INFO << "Running " << (cfg.interval_ns > 0 ? "open" : "closed") << " loop test with "
+               << total_conns << " connections for " << GetFlag(FLAGS_duration_sec) << "s";
+
+  Result total;
+  mutex mu;
+  auto start = Clock::now();
+  auto deadline = start + chrono::seconds(GetFlag(FLAGS_duration_sec));
+  pp->AwaitFiberOnAll([&](unsigned index, ProactorBase* p) {
+    Result local;
+    vector<Fiber> fibers;
+    for (auto& conn : clients[index]) {
+      fibers.emplace_back(absl::StrCat("load/", fibers.size()),
+                          [&, c = conn.get()] { c->Run(deadline, &local); });
+    }
+    for (auto& fb : fibers)
+      fb.Join();
+    for (auto& conn : clients[index])
+      conn->Close();
+
+    lock_guard lk(mu);
+    total.requests += local.requests;
+    total.errors += local.errors;
+    total.latency.Merge(local.latency);
+    total.service.Merge(local.service);
+  });
+  double dur_sec = max(chrono::duration<double>(Clock::now() - start).count(), 1e-3);
+
+  CONSOLE_INFO << "Requests: " << total.requests << ", error replies: " << total.errors
+               << ", qps: " << uint64_t(total.requests / dur_sec);
+  PrintPercentiles("Latency", total.latency);
+  if (cfg.interval_ns > 0)
+    PrintPercentiles("Service time", total.service);
+  CONSOLE_INFO << "Latency histogram (usec)\n" << total.latency.ToString();
+
+  pp->Stop();
+  return 0;
+}
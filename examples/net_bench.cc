@@ -0,0 +1,380 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+// Non-interactive echo benchmark that runs both the server and the clients in the same
+// process over loopback tcp or a unix domain socket. It sweeps all the combinations of the
+// comma separated lists below and prints one json object per configuration, e.g.
+//   net_bench --backends=epoll,uring --sizes=64,4096 --p=1,16 --c=1,32 --tls=false,true
+// {"backend":"uring","transport":"tcp","direct_fd":false,"tls":false,"size":64,"p":1,"c":1,
+//  "requests":20000,"qps":51234,"p50_usec":18.2,"p90_usec":21.0,"p99_usec":30.1,...}
+
+#include <absl/flags/declare.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+#include <openssl/ssl.h>
+#include <sys/un.h>
+
+#include <fstream>
+#include <iostream>
+
+#include "base/histogram.h"
+#include "base/init.h"
+#include "util/accept_server.h"
+#include "util/fibers/pool.h"
+#include "util/fibers/synchronization.h"
+#include "util/listener_interface.h"
+#include "util/tls/tls_socket.h"
+
+ABSL_DECLARE_FLAG(bool, enable_direct_fd);
+
+ABSL_FLAG(std::string, backends, "epoll,uring", "Proactor backends to sweep: epoll, uring");
+ABSL_FLAG(std::string, transports, "tcp,uds", "Transports to sweep: tcp, uds");
+ABSL_FLAG(std::string, direct_fd, "false,true", "Direct fd modes to sweep, uring only");
+ABSL_FLAG(std::string, tls, "false", "TLS modes to sweep");
+ABSL_FLAG(std::string, sizes, "64,1024,16384", "Message sizes to sweep");
+ABSL_FLAG(std::string, p, "1,16", "Pipelining factors to sweep");
+ABSL_FLAG(std::string, c, "1,16", "Connections per client thread to sweep");
+ABSL_FLAG(uint32_t, n, 10000, "Number of round trips per connection");
+ABSL_FLAG(uint32_t, server_threads, 2, "Number of server proactor threads");
+ABSL_FLAG(uint32_t, client_threads, 2, "Number of client proactor threads");
+ABSL_FLAG(std::string, uds_path, "/tmp/net_bench.sock", "Unix socket path");
+ABSL_FLAG(std::string, out, "", "If set, appends the json results to this file");
+
+using namespace util;
+using namespace std;
+
+using absl::GetFlag;
+using fb2::Fiber;
+using tcp = ::boost::asio::ip::tcp;
+using fb2::Pool;
+
+namespace {
+
+struct Config {
+  string backend;
+  string transport;
+  bool direct_fd = false;
+  bool tls = false;
+  uint32_t size = 0;
+  uint32_t pipeline = 1;
+  uint32_t conns = 1;
+};
+
+template <typename T> vector<T> ParseList(const string& flag_val);
+
+template <> vector<string> ParseList(const string& flag_val) {
+  return absl::StrSplit(flag_val, ',', absl::SkipEmpty());
+}
+
+template <> vector<uint32_t> ParseList(const string& flag_val) {
+  vector<uint32_t> res;
+  for (string_view item : absl::StrSplit(flag_val, ',', absl::SkipEmpty())) {
+    uint32_t val;
+    CHECK(absl::SimpleAtoi(item, &val)) << "Invalid number " << item;
+    res.push_back(val);
+  }
+  return res;
+}
+
+template <> vector<bool> ParseList(const string& flag_val) {
+  vector<bool> res;
+  for (string_view item : absl::StrSplit(flag_val, ',', absl::SkipEmpty())) {
+    bool val;
+    CHECK(absl::SimpleAtob(item, &val)) << "Invalid bool " << item;
+    res.push_back(val);
+  }
+  return res;
+}
+
+// Anonymous DH ciphers, so that the benchmark does not need certificates.
+SSL_CTX* CreateSslCntx() {
+  SSL_CTX* ctx = SSL_CTX_new(TLS_method());
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+  SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+  SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, nullptr);
+  SSL_CTX_set_security_level(ctx, 0);
+  CHECK_EQ(1, SSL_CTX_set_cipher_list(ctx, "ADH"));
+  return ctx;
+}
+
+class EchoConnection : public Connection {
+ public:
+  EchoConnection(SSL_CTX* ssl_ctx) : ssl_ctx_(ssl_ctx) {
+  }
+
+ private:
+  void HandleRequests() final;
+
+  SSL_CTX* ssl_ctx_;
+};
+
+void EchoConnection::HandleRequests() {
+  if (ssl_ctx_) {
+    auto* tls_sock = new tls::TlsSocket(socket_.release());
+    tls_sock->InitSSL(ssl_ctx_);
+    SetSocket(tls_sock);
+    auto res = tls_sock->Accept();
+    if (!res) {
+      VLOG(1) << "TLS handshake failed " << res.error().message();
+      return;
+    }
+  }
+
+  constexpr size_t kBufLen = 1 << 16;
+  unique_ptr<uint8_t[]> buf(new uint8_t[kBufLen]);
+  while (true) {
+    io::Result<size_t> res = socket_->Recv(io::MutableBytes(buf.get(), kBufLen));
+    if (!res)
+      break;
+    error_code ec = socket_->Write(io::Bytes(buf.get(), *res));
+    if (ec)
+      break;
+  }
+}
+
+class EchoListener : public ListenerInterface {
+ public:
+  EchoListener(SSL_CTX* ssl_ctx) : ssl_ctx_(ssl_ctx) {
+  }
+
+  Connection* NewConnection(ProactorBase*) final {
+    return new EchoConnection(ssl_ctx_);
+  }
+
+ private:
+  SSL_CTX* ssl_ctx_;
+};
+
+class Client {
+ public:
+  static constexpr size_t kInlineWriteLimit = 1 << 15;
+
+  Client(const Config& cfg, SSL_CTX* ssl_ctx) : cfg_(cfg), ssl_ctx_(ssl_ctx) {
+  }
+
+  error_code Connect(ProactorBase* p, const tcp::endpoint& ep);
+
+  // Returns the number of completed requests.
+  uint64_t Run(base::Histogram* hist);
+
+  void Close() {
+    std::ignore = sock_->Close();
+  }
+
+ private:
+  error_code ConnectUDS(const string& path);
+
+  const Config& cfg_;
+  SSL_CTX* ssl_ctx_;
+  unique_ptr<FiberSocketBase> sock_;
+};
+
+error_code Client::ConnectUDS(const string& path) {
+  error_code ec = sock_->Create(AF_UNIX);
+  if (ec)
+    return ec;
+
+  // FiberSocketBase::Connect supports only tcp endpoints.
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  while (connect(sock_->native_handle(), (sockaddr*)&addr, sizeof(addr)) != 0) {
+    if (errno != EAGAIN)
+      return error_code(errno, system_category());
+    ThisFiber::SleepFor(1ms);  // The accept queue is full.
+  }
+  return {};
+}
+
+error_code Client::Connect(ProactorBase* p, const tcp::endpoint& ep) {
+  sock_.reset(p->CreateSocket());
+  error_code ec =
+      cfg_.transport == "uds" ? ConnectUDS(GetFlag(FLAGS_uds_path)) : sock_->Connect(ep);
+  if (ec || !ssl_ctx_)
+    return ec;
+
+  auto* tls_sock = new tls::TlsSocket(sock_.release());
+  sock_.reset(tls_sock);
+  tls_sock->InitSSL(ssl_ctx_);
+  return tls_sock->Connect(ep);
+}
+
+uint64_t Client::Run(base::Histogram* hist) {
+  unique_ptr<uint8_t[]> msg(new uint8_t[cfg_.size]);
+  memset(msg.get(), 'x', cfg_.size);
+  size_t batch_len = size_t(cfg_.size) * cfg_.pipeline;
+  unique_ptr<uint8_t[]> resp(new uint8_t[batch_len]);
+
+  uint64_t num_reqs = 0;
+  for (uint32_t i = 0; i < GetFlag(FLAGS_n); ++i) {
+    uint64_t start = absl::GetCurrentTimeNanos();
+    error_code ec;
+    auto write_cb = [&] {
+      for (uint32_t j = 0; j < cfg_.pipeline && !ec; ++j)
+        ec = sock_->Write(io::Bytes(msg.get(), cfg_.size));
+    };
+
+    // Large batches would fill both socket buffers before we start reading the echo.
+    Fiber writer;
+    if (batch_len > kInlineWriteLimit)
+      writer = Fiber(write_cb);
+    else
+      write_cb();
+
+    size_t received = 0;
+    while (received < batch_len && !ec) {
+      io::Result<size_t> res =
+          sock_->Recv(io::MutableBytes(resp.get() + received, batch_len - received));
+      if (!res) {
+        ec = res.error();
+        break;
+      }
+      received += *res;
+    }
+    writer.JoinIfNeeded();
+    if (ec) {
+      LOG(ERROR) << "Connection failed " << ec.message();
+      return num_reqs;
+    }
+    hist->Add((absl::GetCurrentTimeNanos() - start) / 1000.0);
+    num_reqs += cfg_.pipeline;
+  }
+  return num_reqs;
+}
+
+unique_ptr<ProactorPool> CreatePool(const Config& cfg, uint32_t threads) {
+  if (cfg.backend == "uring") {
+#ifdef __linux__
+    return unique_ptr<ProactorPool>(Pool::IOUring(256, threads));
+#else
+    LOG(FATAL) << "io_uring is not supported";
+#endif
+  }
+  CHECK_EQ(cfg.backend, "epoll") << "Unknown backend";
+  return unique_ptr<ProactorPool>(Pool::Epoll(threads));
+}
+
+string RunConfig(const Config& cfg, SSL_CTX* ssl_ctx) {
+  // Read when the proactors are initialized.
+  absl::SetFlag(&FLAGS_enable_direct_fd, cfg.direct_fd);
+
+  unique_ptr<ProactorPool> server_pool = CreatePool(cfg, GetFlag(FLAGS_server_threads));
+  unique_ptr<ProactorPool> client_pool = CreatePool(cfg, GetFlag(FLAGS_client_threads));
+  server_pool->Run();
+  client_pool->Run();
+
+  tcp::endpoint ep;
+  string res;
+  {
+    AcceptServer acceptor(server_pool.get(), false);
+    acceptor.set_back_log(1024);
+    if (cfg.transport == "uds") {
+      const string& path = GetFlag(FLAGS_uds_path);
+      unlink(path.c_str());
+      error_code ec = acceptor.AddUDSListener(path.c_str(), 0700, new EchoListener(ssl_ctx));
+      CHECK(!ec) << ec.message();
+    } else {
+      CHECK_EQ(cfg.transport, "tcp") << "Unknown transport";
+      uint16_t port = acceptor.AddListener(0, new EchoListener(ssl_ctx));
+      ep = tcp::endpoint{boost::asio::ip::make_address("127.0.0.1"), port};
+    }
+    acceptor.Run();
+
+    vector<vector<unique_ptr<Client>>> clients(client_pool->size());
+    client_pool->AwaitFiberOnAll([&](unsigned index, ProactorBase* p) {
+      for (uint32_t i = 0; i < cfg.conns; ++i) {
+        auto client = make_unique<Client>(cfg, ssl_ctx);
+        error_code ec = client->Connect(p, ep);
+        CHECK(!ec) << "Connect failed: " << ec.message();
+        clients[index].push_back(std::move(client));
+      }
+    });
+
+    base::Histogram hist;
+    fb2::Mutex mu;
+    atomic_uint64_t num_reqs{0};
+    uint64_t start = absl::GetCurrentTimeNanos();
+    client_pool->AwaitFiberOnAll([&](unsigned index, ProactorBase* p) {
+      base::Histogram local_hist;
+      vector<Fiber> fibers;
+      for (auto& client : clients[index]) {
+        fibers.emplace_back([&, c = client.get()] {
+          num_reqs.fetch_add(c->Run(&local_hist), memory_order_relaxed);
+        });
+      }
+      for (auto& fb : fibers)
+        fb.Join();
+      for (auto& client : clients[index])
+        client->Close();
+
+      lock_guard lk(mu);
+      hist.Merge(local_hist);
+    });
+    uint64_t dur_ns = std::max<uint64_t>(1, absl::GetCurrentTimeNanos() - start);
+
+    acceptor.Stop(true);
+
+    res = absl::StrCat(
+        R"({"backend":")", cfg.backend, R"(","transport":")", cfg.transport,
+        R"(","direct_fd":)", cfg.direct_fd ? "true" : "false", R"(,"tls":)",
+        cfg.tls ? "true" : "false", R"(,"size":)", cfg.size, R"(,"p":)", cfg.pipeline,
+        R"(,"c":)", cfg.conns, R"(,"server_threads":)", server_pool->size(),
+        R"(,"client_threads":)", client_pool->size(), R"(,"requests":)", num_reqs.load(),
+        R"(,"qps":)", uint64_t(num_reqs.load() * 1e9 / dur_ns),
+        R"(,"p50_usec":)", hist.Percentile(50), R"(,"p90_usec":)", hist.Percentile(90),
+        R"(,"p99_usec":)", hist.Percentile(99), R"(,"p999_usec":)", hist.Percentile(99.9),
+        R"(,"max_usec":)", hist.max(), "}");
+  }
+
+  client_pool->Stop();
+  server_pool->Stop();
+  return res;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  MainInitGuard guard(&argc, &argv);
+
+  SSL_CTX* ssl_ctx = CreateSslCntx();
+  ofstream out;
+  if (!GetFlag(FLAGS_out).empty()) {
+    out.open(GetFlag(FLAGS_out), ios::app);
+    CHECK(out) << "Could not open " << GetFlag(FLAGS_out);
+  }
+
+  Config cfg;
+  for (const string& backend : ParseList<string>(GetFlag(FLAGS_backends))) {
+    cfg.backend = backend;
+    for (bool direct_fd : ParseList<bool>(GetFlag(FLAGS_direct_fd))) {
+      if (direct_fd && backend != "uring")
+        continue;
+      cfg.direct_fd = direct_fd;
+      for (const string& transport : ParseList<string>(GetFlag(FLAGS_transports))) {
+        cfg.transport = transport;
+        for (bool tls : ParseList<bool>(GetFlag(FLAGS_tls))) {
+          cfg.tls = tls;
+          for (uint32_t size : ParseList<uint32_t>(GetFlag(FLAGS_sizes))) {
+            cfg.size = size;
+            for (uint32_t p : ParseList<uint32_t>(GetFlag(FLAGS_p))) {
+              cfg.pipeline = p;
+              for (uint32_t c : ParseList<uint32_t>(GetFlag(FLAGS_c))) {
+                cfg.conns = c;
+                string res = RunConfig(cfg, tls ? ssl_ctx : nullptr);
+                cout << res << endl;
+                if (out.is_open())
+                  out << res << endl;
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+
+  SSL_CTX_free(ssl_ctx);
+  return 0;
+}
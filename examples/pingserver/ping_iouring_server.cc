@@ -10,6 +10,7 @@
 #include "util/accept_server.h"
 #include "util/asio_stream_adapter.h"
 #include "util/fiber_socket_base.h"
+#include "util/fibers/fiberqueue_threadpool.h"
 #include "util/fibers/pool.h"
 #include "util/http/http_handler.h"
 #include "util/tls/tls_socket.h"
@@ -32,11 +33,17 @@ ABSL_FLAG(bool, tls_verify_peer, false,
           "server certificates (not sure why).");
 ABSL_FLAG(bool, use_incoming_cpu, false,
           "If true uses incoming cpu of a socket in order to distribute incoming connections");
+ABSL_FLAG(bool, reuseport_accept, false,
+          "If true, each io thread accepts redis connections on its own SO_REUSEPORT socket. "
+          "Together with use_incoming_cpu steers connections by their incoming cpu");
 ABSL_FLAG(string, tls_cert, "", "");
 ABSL_FLAG(string, tls_key, "", "");
+ABSL_FLAG(uint32_t, tls_handshake_threads, 0,
+          "If positive, runs tls handshakes on a separate thread pool of this size");
 ABSL_FLAG(string, unixsocket, "", "");
 
 VarzQps ping_qps("ping-qps");
+fb2::FiberQueueThreadPool* handshake_pool = nullptr;
 
 inline void ToUpper(const RespParser::Buffer* val) {
   for (auto& c : *val) {
@@ -71,6 +78,7 @@ void PingConnection::HandleRequests() {
   if (ctx_) {
     tls_sock.reset(new tls::TlsSocket(std::move(socket_)));
     tls_sock->InitSSL(ctx_);
+    tls_sock->set_handshake_offload(handshake_pool);
 
     FiberSocketBase::AcceptResult aresult = tls_sock->Accept();
     socket_ = std::move(tls_sock);
@@ -87,7 +95,8 @@ void PingConnection::HandleRequests() {
   base::IoBuf io_buf{1024};
   RespParser resp_parser;
   uint32_t consumed = 0;
-  vector<RespParser::Buffer> args;
+  RespParser::CmdBatch batch;
+  string reply;
   while (true) {
     auto dest = io_buf.AppendBuffer();
     asio::mutable_buffer mb(dest.data(), dest.size());
@@ -99,34 +108,32 @@ void PingConnection::HandleRequests() {
     CHECK(!ec) << ec << "/" << ec.message();
     VLOG(1) << "Read " << res << " bytes";
     io_buf.CommitWrite(res);
-    RespParser::Status st = resp_parser.Parse(io_buf.InputBuffer(), &consumed, &args);
-    io_buf.ConsumeInput(consumed);
 
-    if (st == RespParser::RESP_OK) {
-      if (args.empty())
-        continue;
+    // Parse all the pipelined commands and reply to them with a single write.
+    RespParser::Status st = resp_parser.ParseBatch(io_buf.InputBuffer(), &consumed, &batch);
+    if (st == RespParser::MORE_INPUT) {
+      io_buf.ConsumeInput(consumed);
+      continue;
+    }
+    if (st != RespParser::RESP_OK)
+      break;
+
+    reply.clear();
+    for (size_t i = 0; i < batch.size(); ++i) {
+      auto args = batch[i];
       ToUpper(&args[0]);
       std::string_view cmd = ToAbsl(args.front());
       if (cmd == "PING") {
         ping_qps.Inc();
-        const char kReply[] = "+PONG\r\n";
-        auto b = boost::asio::buffer(kReply, sizeof(kReply) - 1);
-
-        asa.write_some(b, ec);
-        if (ec) {
-          break;
-        }
+        reply.append("+PONG\r\n");
       } else {
-        const char kReply[] = "+OK\r\n";
-        auto b = boost::asio::buffer(kReply, sizeof(kReply) - 1);
-        asa.write_some(b, ec);
-        if (ec) {
-          break;
-        }
+        reply.append("+OK\r\n");
       }
-    } else if (st == RespParser::MORE_INPUT) {
-      continue;
-    } else {
+    }
+
+    // The arguments point to io_buf, so we consume it only after we are done with them.
+    io_buf.ConsumeInput(consumed);
+    if (peer->Write(::io::Buffer(reply))) {
       break;
     }
   }
@@ -149,34 +156,10 @@ class PingListener : public ListenerInterface {
     return new PingConnection(ctx_);
   }
 
-  ProactorBase* PickConnectionProactor(FiberSocketBase* sock) final;
-
  private:
   SSL_CTX* ctx_;
 };
 
-ProactorBase* PingListener::PickConnectionProactor(FiberSocketBase* sock) {
-#ifdef __linux__
-  int fd = sock->native_handle();
-
-  int cpu;
-  socklen_t len = sizeof(cpu);
-
-  CHECK_EQ(0, getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len));
-  VLOG(1) << "Got socket from cpu " << cpu;
-  bool use_incoming = GetFlag(FLAGS_use_incoming_cpu);
-
-  if (use_incoming) {
-    vector<unsigned> ids = pool()->MapCpuToThreads(cpu);
-    if (!ids.empty()) {
-      return pool()->at(ids.front());
-    }
-  }
-#endif
-
-  return pool()->GetNextProactor();
-}
-
 static int MyVerifyCb(int preverify_ok, X509_STORE_CTX* x509_ctx) {
   LOG(INFO) << "preverify " << preverify_ok;
   return 1;
@@ -229,8 +212,13 @@ int main(int argc, char* argv[]) {
 
   SSL_CTX* ctx = nullptr;
 
+  unique_ptr<fb2::FiberQueueThreadPool> tls_pool;
   if (GetFlag(FLAGS_tls)) {
     ctx = CreateSslCntx();
+    if (uint32_t threads = GetFlag(FLAGS_tls_handshake_threads); threads > 0) {
+      tls_pool.reset(new fb2::FiberQueueThreadPool(threads));
+      handshake_pool = tls_pool.get();
+    }
   }
 
   unique_ptr<util::ProactorPool> pp;
@@ -245,9 +233,14 @@ int main(int argc, char* argv[]) {
 
   AcceptServer acceptor(pp.get());
   PingListener* listener = new PingListener(ctx);
+  if (GetFlag(FLAGS_use_incoming_cpu))
+    listener->SetConnectionPlacement(ListenerInterface::ConnectionPlacement::INCOMING_CPU);
 
   if (uds.empty()) {
+    acceptor.set_reuseport_sharding(GetFlag(FLAGS_reuseport_accept),
+                                    GetFlag(FLAGS_use_incoming_cpu));
     acceptor.AddListener(port, listener);
+    acceptor.set_reuseport_sharding(false);
   } else {
     unlink(uds.c_str());
     error_code ec = acceptor.AddUDSListener(uds.c_str(), 0700, listener);
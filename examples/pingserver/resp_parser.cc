@@ -8,15 +8,62 @@
 #include "absl/strings/ascii.h"
 #include "base/logging.h"
 
-namespace redis {
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define USE_SIMD_SCAN 1
+#elif defined(__aarch64__)
+#include "base/sse2neon.h"
+#define USE_SIMD_SCAN 1
+#endif
 
-namespace {}  // namespace
+namespace redis {
 
 using namespace std;
 
 constexpr int kMaxArrayLen = 1024;
 constexpr int64_t kMaxBulkLen = 64 * (1ul << 20);  // 64MB.
 
+namespace {
+
+// Lengths are short, so we look for '\r' only within the first 16 bytes.
+const uint8_t* FindCr(const uint8_t* p, const uint8_t* end) {
+#ifdef USE_SIMD_SCAN
+  if (end - p >= 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+    return mask ? p + __builtin_ctz(mask) : nullptr;
+  }
+#endif
+  return reinterpret_cast<const uint8_t*>(memchr(p, '\r', std::min<ptrdiff_t>(end - p, 16)));
+}
+
+// Parses "<int>\r\n" starting at p. Returns the position past '\n' or null if the line is
+// incomplete or invalid.
+const uint8_t* ParseLen(const uint8_t* p, const uint8_t* end, int64_t* res) {
+  const uint8_t* cr = FindCr(p, end);
+  if (!cr || cr + 1 == end || cr[1] != '\n')
+    return nullptr;
+
+  bool negative = p < cr && *p == '-';
+  if (negative)
+    ++p;
+  if (p == cr)
+    return nullptr;
+
+  int64_t val = 0;
+  for (; p < cr; ++p) {
+    unsigned digit = *p - '0';
+    if (digit > 9)
+      return nullptr;
+    val = val * 10 + digit;
+  }
+
+  *res = negative ? -val : val;
+  return cr + 2;
+}
+
+}  // namespace
+
 auto RespParser::Parse(Buffer str, uint32_t* consumed, vector<Buffer>* res) -> Status {
   *consumed = 0;
   res->clear();
@@ -85,6 +132,91 @@ auto RespParser::Parse(Buffer str, uint32_t* consumed, vector<Buffer>* res) -> S
   return last_status_;
 }
 
+auto RespParser::ParseBatch(Buffer str, uint32_t* consumed, CmdBatch* batch) -> Status {
+  *consumed = 0;
+  batch->Clear();
+
+  // A command that was broken by the previous call must be finished by the slow path.
+  bool pending = state_ != START && state_ != CMD_COMPLETE;
+
+  while (*consumed < str.size()) {
+    Buffer rest = str.subspan(*consumed);
+    if (!pending) {
+      size_t len = ParseComplete(rest, batch);
+      if (len) {
+        *consumed += len;
+        continue;
+      }
+
+      // Leave the incomplete or invalid command to the next call.
+      if (!batch->empty())
+        break;
+    }
+
+    uint32_t slow_consumed = 0;
+    Status st = Parse(rest, &slow_consumed, &slow_args_);
+    *consumed += slow_consumed;
+    if (st != RESP_OK)
+      return st;
+
+    pending = false;
+    if (!slow_args_.empty()) {
+      batch->args_.insert(batch->args_.end(), slow_args_.begin(), slow_args_.end());
+      batch->ends_.push_back(batch->args_.size());
+    }
+  }
+
+  return batch->empty() ? MORE_INPUT : RESP_OK;
+}
+
+size_t RespParser::ParseComplete(Buffer str, CmdBatch* batch) {
+  const uint8_t* p = str.data();
+  const uint8_t* end = p + str.size();
+  auto& args = batch->args_;
+  size_t mark = args.size();
+
+  if (*p == '*') {
+    int64_t num_args;
+    p = ParseLen(p + 1, end, &num_args);
+    if (!p || num_args <= 0 || num_args > kMaxArrayLen)
+      return 0;
+
+    for (int64_t i = 0; i < num_args; ++i) {
+      int64_t len;
+      if (p == end || *p != '$' || !(p = ParseLen(p + 1, end, &len)) || len < 0 ||
+          len > kMaxBulkLen || end - p < len + 2 || p[len] != '\r' || p[len + 1] != '\n') {
+        args.resize(mark);
+        return 0;
+      }
+      args.emplace_back(const_cast<uint8_t*>(p), len);
+      p += len + 2;
+    }
+  } else if (*p == '$' || *p == ':') {
+    return 0;
+  } else {
+    const uint8_t* eol = reinterpret_cast<const uint8_t*>(memchr(p, '\n', end - p));
+    if (!eol)
+      return 0;
+
+    while (p < eol) {
+      while (p < eol && *p <= 32)
+        ++p;
+      const uint8_t* token_start = p;
+      while (p < eol && *p > 32)
+        ++p;
+      if (p > token_start)
+        args.emplace_back(const_cast<uint8_t*>(token_start), p - token_start);
+    }
+    p = eol + 1;
+
+    if (args.size() == mark)  // empty line.
+      return p - str.data();
+  }
+
+  batch->ends_.push_back(args.size());
+  return p - str.data();
+}
+
 void RespParser::InitStart(uint8_t prefix_b, vector<Buffer>* res) {
   buf_stash_.clear();
   ast_vec_.clear();
@@ -125,15 +257,21 @@ void RespParser::CacheState(vector<Buffer>* res) {
 
     for (; last_cached_index_ < cur.size(); ++last_cached_index_) {
       auto& e = cur[last_cached_index_];
-      if (!e.empty()) {
+      bool stashed = !buf_stash_.empty() && e.data() == buf_stash_.back().get();
+      if (!e.empty() && !stashed) {
         BlobPtr ptr(new uint8_t[e.size()]);
         memcpy(ptr.get(), e.data(), e.size());
         e = Buffer{ptr.get(), e.size()};
         buf_stash_.push_back(std::move(ptr));
       }
     }
-    if (last_cached_level_ + 1 == ast_vec_.size())
+    if (last_cached_level_ + 1 == ast_vec_.size()) {
+      // The last argument can still be empty and filled by the following calls,
+      // so we revisit it next time.
+      if (!cur.empty())
+        last_cached_index_ = cur.size() - 1;
       break;
+    }
     ++last_cached_level_;
     last_cached_index_ = 0;
   }
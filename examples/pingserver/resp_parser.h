@@ -22,6 +22,35 @@ class RespParser {
   };
   using Buffer = absl::Span<uint8_t>;
 
+  // Reusable storage for the commands parsed by ParseBatch. Arguments of all the commands are
+  // kept in a single vector, so after warmup parsing a batch does not allocate.
+  class CmdBatch {
+   public:
+    size_t size() const {
+      return ends_.size();
+    }
+
+    bool empty() const {
+      return ends_.empty();
+    }
+
+    absl::Span<const Buffer> operator[](size_t i) const {
+      uint32_t start = i == 0 ? 0 : ends_[i - 1];
+      return absl::MakeConstSpan(args_.data() + start, ends_[i] - start);
+    }
+
+    void Clear() {
+      args_.clear();
+      ends_.clear();
+    }
+
+   private:
+    friend class RespParser;
+
+    std::vector<Buffer> args_;
+    std::vector<uint32_t> ends_;  // ends_[i] is the end index of command i in args_.
+  };
+
   explicit RespParser() {
   }
 
@@ -32,6 +61,13 @@ class RespParser {
   // threshold was passed and COMMAN_READY is not reached.
   Status Parse(Buffer str, uint32_t* consumed, std::vector<Buffer>* res);
 
+  // Parses all the complete pipelined commands in str into batch. Commands that are fully
+  // contained in str are parsed by a fast path that locates CRLFs with SIMD, the rest is
+  // delegated to Parse(). Returns RESP_OK if at least one command was parsed. The incomplete
+  // tail is either left unconsumed or cached like in Parse(), in which case MORE_INPUT is
+  // returned if no command was completed. Empty inline commands are skipped.
+  Status ParseBatch(Buffer str, uint32_t* consumed, CmdBatch* batch);
+
  private:
   enum ParseResult : uint8_t {
     OK,
@@ -39,6 +75,10 @@ class RespParser {
     INVALID,
   };
 
+  // Parses a complete command without touching the parser state. Returns the number of bytes
+  // consumed or 0 if the command is incomplete or invalid.
+  size_t ParseComplete(Buffer str, CmdBatch* batch);
+
   void InitStart(uint8_t prefix_b, std::vector<Buffer>* res);
   void CacheState(std::vector<Buffer>* res);
 
@@ -76,6 +116,7 @@ class RespParser {
   using BlobPtr = std::unique_ptr<uint8_t[]>;
   std::vector<BlobPtr> buf_stash_;
   std::vector<Buffer>* top_ = nullptr;
+  std::vector<Buffer> slow_args_;  // used by ParseBatch for the slow path.
   bool is_broken_token_ = false;
 };
 
@@ -0,0 +1,127 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "examples/pingserver/resp_parser.h"
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+using namespace std;
+
+namespace redis {
+
+class RespParserTest : public testing::Test {
+ protected:
+  RespParser::Buffer Buf(string* s) {
+    return RespParser::Buffer{reinterpret_cast<uint8_t*>(s->data()), s->size()};
+  }
+
+  static string_view ToSV(RespParser::Buffer b) {
+    return string_view{reinterpret_cast<char*>(b.data()), b.size()};
+  }
+
+  RespParser parser_;
+  RespParser::CmdBatch batch_;
+};
+
+static string Pipeline(unsigned depth) {
+  string res;
+  for (unsigned i = 0; i < depth; ++i) {
+    res.append(i % 2 ? "*1\r\n$4\r\nPING\r\n" : "*3\r\n$3\r\nSET\r\n$3\r\nfoo\r\n$5\r\nvalue\r\n");
+  }
+  return res;
+}
+
+TEST_F(RespParserTest, Batch) {
+  string input = Pipeline(4) + "PING arg\r\n\r\n*2\r\n$3\r\nGET\r\n$3\r\nfo";
+  uint32_t consumed = 0;
+
+  ASSERT_EQ(RespParser::RESP_OK, parser_.ParseBatch(Buf(&input), &consumed, &batch_));
+  ASSERT_EQ(5u, batch_.size());
+  ASSERT_EQ(3u, batch_[0].size());
+  EXPECT_EQ("SET", ToSV(batch_[0][0]));
+  EXPECT_EQ("value", ToSV(batch_[0][2]));
+  ASSERT_EQ(1u, batch_[1].size());
+  EXPECT_EQ("PING", ToSV(batch_[1][0]));
+  ASSERT_EQ(2u, batch_[4].size());
+  EXPECT_EQ("arg", ToSV(batch_[4][1]));
+
+  // The empty line is consumed, the incomplete command is left for the next call.
+  string tail = input.substr(consumed);
+  EXPECT_EQ("*2\r\n$3\r\nGET\r\n$3\r\nfo", tail);
+
+  tail.append("o\r\n*1\r\n$4\r\nPING\r\n");
+  ASSERT_EQ(RespParser::RESP_OK, parser_.ParseBatch(Buf(&tail), &consumed, &batch_));
+  EXPECT_EQ(tail.size(), consumed);
+  ASSERT_EQ(2u, batch_.size());
+  EXPECT_EQ("foo", ToSV(batch_[0][1]));
+  EXPECT_EQ("PING", ToSV(batch_[1][0]));
+}
+
+TEST_F(RespParserTest, BatchSplit) {
+  // Feed the input byte by byte to exercise the slow path, as a socket could.
+  string input = Pipeline(3);
+  string buf;
+  vector<string> cmds;
+  uint32_t consumed = 0;
+
+  for (char c : input) {
+    buf.push_back(c);
+    RespParser::Status st = parser_.ParseBatch(Buf(&buf), &consumed, &batch_);
+    ASSERT_TRUE(st == RespParser::RESP_OK || st == RespParser::MORE_INPUT) << st;
+    for (size_t i = 0; i < batch_.size(); ++i) {
+      cmds.emplace_back(ToSV(batch_[i][0]));
+    }
+    buf.erase(0, consumed);
+  }
+
+  EXPECT_TRUE(buf.empty());
+  EXPECT_EQ(vector<string>({"SET", "PING", "SET"}), cmds);
+}
+
+TEST_F(RespParserTest, BatchInvalid) {
+  string input = "*1\r\n$4\r\nPING\r\n*1\r\n$x\r\n";
+  uint32_t consumed = 0;
+
+  ASSERT_EQ(RespParser::RESP_OK, parser_.ParseBatch(Buf(&input), &consumed, &batch_));
+  EXPECT_EQ(1u, batch_.size());
+
+  string tail = input.substr(consumed);
+  EXPECT_NE(RespParser::RESP_OK, parser_.ParseBatch(Buf(&tail), &consumed, &batch_));
+  EXPECT_NE(RespParser::MORE_INPUT, parser_.ParseBatch(Buf(&tail), &consumed, &batch_));
+}
+
+static void BM_ParseOneByOne(benchmark::State& state) {
+  string input = Pipeline(state.range(0));
+  RespParser parser;
+  vector<RespParser::Buffer> args;
+  uint32_t consumed = 0;
+
+  while (state.KeepRunning()) {
+    RespParser::Buffer buf{reinterpret_cast<uint8_t*>(input.data()), input.size()};
+    while (!buf.empty()) {
+      CHECK_EQ(RespParser::RESP_OK, parser.Parse(buf, &consumed, &args));
+      buf.remove_prefix(consumed);
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * input.size());
+}
+BENCHMARK(BM_ParseOneByOne)->Arg(1)->Arg(16)->Arg(128);
+
+static void BM_ParseBatch(benchmark::State& state) {
+  string input = Pipeline(state.range(0));
+  RespParser parser;
+  RespParser::CmdBatch batch;
+  uint32_t consumed = 0;
+
+  while (state.KeepRunning()) {
+    RespParser::Buffer buf{reinterpret_cast<uint8_t*>(input.data()), input.size()};
+    CHECK_EQ(RespParser::RESP_OK, parser.ParseBatch(buf, &consumed, &batch));
+    CHECK_EQ(batch.size(), size_t(state.range(0)));
+  }
+  state.SetBytesProcessed(state.iterations() * input.size());
+}
+BENCHMARK(BM_ParseBatch)->Arg(1)->Arg(16)->Arg(128);
+
+}  // namespace redis
@@ -0,0 +1,367 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+// Reference RESP server with a shared-nothing keyspace: every proactor thread owns a shard,
+// a TaggedDict that only this thread touches. A connection parses all the pipelined commands
+// it received, routes the key commands to their shards by the hash of the key, runs the local
+// ones inline and sends the rest to the owning proactors with one DispatchBrief hop per shard.
+// Then it writes all the replies with a single writev. Supports PING, ECHO, GET, SET, DEL,
+// EXISTS, DBSIZE, COMMAND and QUIT, enough for redis-benchmark, memtier_benchmark and loadgen:
+//
+//   resp_server --port=6380
+//   loadgen --port=6380 --c=16 --pipeline=8 --keys=1000000 --dist=zipf
+
+#include <absl/strings/ascii.h>
+#include <absl/strings/str_cat.h>
+#include <sys/uio.h>
+#include <xxhash.h>
+
+#include "base/init.h"
+#include "base/io_buf.h"
+#include "base/pmr/slab_resource.h"
+#include "examples/pingserver/resp_parser.h"
+#include "examples/redis_dict/tagged_dict.h"
+#include "util/accept_server.h"
+#include "util/fibers/pool.h"
+#include "util/fibers/synchronization.h"
+#include "util/http/http_handler.h"
+#include "util/varz.h"
+
+using namespace std;
+using namespace util;
+using absl::GetFlag;
+using fb2::Pool;
+using fb2::ProactorBase;
+using redis::RespParser;
+using redis::TaggedDict;
+
+ABSL_FLAG(int32_t, http_port, 8080, "Http port, -1 disables it.");
+ABSL_FLAG(int32_t, port, 6380, "Redis port");
+ABSL_FLAG(uint32_t, iouring_depth, 512, "Io uring depth");
+ABSL_FLAG(bool, epoll, false, "If true, uses epoll api instead of iouring");
+ABSL_FLAG(bool, coalesce_hops, true,
+          "If true, the hops to the same shard within one loop iteration are sent as a single "
+          "task queue entry");
+ABSL_FLAG(uint32_t, rehash_budget_usec, 20, "Time budget of every idle rehash step");
+
+VarzQps cmd_qps("cmd-qps");
+VarzQps hop_qps("hop-qps");
+
+namespace {
+
+using CmdArgs = absl::Span<const RespParser::Buffer>;
+
+inline string_view ToSV(RespParser::Buffer b) {
+  return string_view{reinterpret_cast<char*>(b.data()), b.size()};
+}
+
+void AppendBulk(string_view str, string* dest) {
+  absl::StrAppend(dest, "$", str.size(), "\r\n", str, "\r\n");
+}
+
+void AppendInt(int64_t val, string* dest) {
+  absl::StrAppend(dest, ":", val, "\r\n");
+}
+
+void AppendWrongArgs(string_view cmd, string* dest) {
+  absl::StrAppend(dest, "-ERR wrong number of arguments for '", absl::AsciiStrToLower(cmd),
+                  "' command\r\n");
+}
+
+// The keyspace part owned by a proactor thread. The values are sds strings.
+class Shard {
+ public:
+  explicit Shard(PMR_NS::memory_resource* mr)
+      : dict_(mr, [](void* val) { sdsfree(static_cast<sds>(val)); }) {
+  }
+
+  // Runs a key command, args[0] is the upper-cased name and the arity is already checked.
+  void Execute(CmdArgs args, string* reply);
+
+  size_t size() const {
+    return dict_.size();
+  }
+
+  TaggedDict* dict() {
+    return &dict_;
+  }
+
+  uint32_t idle_task = 0;
+
+ private:
+  TaggedDict dict_;
+};
+
+void Shard::Execute(CmdArgs args, string* reply) {
+  string_view cmd = ToSV(args[0]);
+  string_view key = ToSV(args[1]);
+
+  if (cmd == "GET") {
+    void** val = dict_.Find(key);
+    if (val) {
+      sds s = static_cast<sds>(*val);
+      AppendBulk(string_view{s, sdslen(s)}, reply);
+    } else {
+      reply->append("$-1\r\n");
+    }
+  } else if (cmd == "SET") {
+    string_view val = ToSV(args[2]);
+    dict_.Replace(key, sdsnewlen(val.data(), val.size()));
+    reply->append("+OK\r\n");
+  } else if (cmd == "DEL") {
+    AppendInt(dict_.Delete(key), reply);
+  } else {
+    DCHECK_EQ(cmd, "EXISTS");
+    AppendInt(dict_.Find(key) != nullptr, reply);
+  }
+}
+
+// Returns the arity of the key commands (including the name), or 0 for other commands.
+unsigned KeyCommandArity(string_view cmd) {
+  if (cmd == "GET" || cmd == "DEL" || cmd == "EXISTS")
+    return 2;
+  if (cmd == "SET")
+    return 3;
+  return 0;
+}
+
+class RespConnection : public Connection {
+ public:
+  RespConnection(const vector<unique_ptr<Shard>>* shards, ProactorPool* pool)
+      : shards_(*shards), pool_(pool) {
+  }
+
+ private:
+  void HandleRequests() final;
+
+  // Fills replies_[i] for every command of the batch.
+  void ExecuteBatch(const RespParser::CmdBatch& batch);
+
+  // Handles the commands that do not access the keyspace.
+  void ExecuteGeneric(CmdArgs args, string* reply);
+
+  unsigned ShardOf(string_view key) const {
+    // Seeded differently from the hash of TaggedDict, which indexes the buckets with the low
+    // bits, so that the keys of a shard spread over all the buckets.
+    return XXH3_64bits_withSeed(key.data(), key.size(), 0x9ae16a3b2f90404fULL) % shards_.size();
+  }
+
+  error_code WriteReplies(size_t count);
+
+  const vector<unique_ptr<Shard>>& shards_;
+  ProactorPool* pool_;  // shard i is owned by pool_->at(i).
+  vector<string> replies_;
+  vector<vector<uint32_t>> routed_;  // command indices per shard.
+  vector<iovec> iovs_;
+  bool quit_ = false;
+};
+
+void RespConnection::HandleRequests() {
+  base::IoBuf io_buf{1024};
+  RespParser parser;
+  RespParser::CmdBatch batch;
+  uint32_t consumed = 0;
+  routed_.resize(shards_.size());
+
+  while (!quit_) {
+    // Keeps room for a read, the incomplete commands stay in the buffer.
+    if (io_buf.AppendLen() < 256)
+      io_buf.EnsureCapacity(io_buf.Capacity());
+
+    io::Result<size_t> res = socket_->Recv(io_buf.AppendBuffer());
+    if (!res || *res == 0)
+      break;
+    io_buf.CommitWrite(*res);
+
+    RespParser::Status st = parser.ParseBatch(io_buf.InputBuffer(), &consumed, &batch);
+    if (st == RespParser::MORE_INPUT) {
+      io_buf.ConsumeInput(consumed);
+      continue;
+    }
+    if (st != RespParser::RESP_OK) {
+      std::ignore = socket_->Write(io::Buffer("-ERR Protocol error\r\n"));
+      break;
+    }
+
+    ExecuteBatch(batch);
+
+    // The arguments point to io_buf, so it is consumed only after the commands ran.
+    io_buf.ConsumeInput(consumed);
+    if (WriteReplies(batch.size()))
+      break;
+  }
+
+  VLOG(1) << "Connection shutting down";
+  std::ignore = socket_->Shutdown(SHUT_RDWR);
+}
+
+void RespConnection::ExecuteBatch(const RespParser::CmdBatch& batch) {
+  if (replies_.size() < batch.size())
+    replies_.resize(batch.size());
+
+  unsigned local = ProactorBase::me()->GetPoolIndex();
+  for (size_t i = 0; i < batch.size(); ++i) {
+    CmdArgs args = batch[i];
+    for (uint8_t& c : args[0])
+      c = absl::ascii_toupper(c);
+
+    string* reply = &replies_[i];
+    reply->clear();
+    string_view cmd = ToSV(args[0]);
+    unsigned arity = KeyCommandArity(cmd);
+    if (arity == 0) {
+      ExecuteGeneric(args, reply);
+    } else if (args.size() != arity) {
+      AppendWrongArgs(cmd, reply);
+    } else {
+      routed_[ShardOf(ToSV(args[1]))].push_back(i);
+    }
+  }
+  cmd_qps.IncBy(batch.size());
+
+  // The remote shards run their commands in their proactor loops while the local ones run
+  // here. The commands of a shard keep their order, the commands of different shards are
+  // independent since they access different keys.
+  unsigned hops = 0;
+  for (unsigned sid = 0; sid < shards_.size(); ++sid)
+    hops += sid != local && !routed_[sid].empty();
+
+  fb2::BlockingCounter bc{hops};
+  for (unsigned sid = 0; sid < shards_.size(); ++sid) {
+    if (sid == local || routed_[sid].empty())
+      continue;
+    hop_qps.Inc();
+    Shard* shard = shards_[sid].get();
+    pool_->at(sid)->DispatchBrief([this, shard, &batch, &cmds = routed_[sid], bc]() mutable {
+      for (uint32_t i : cmds)
+        shard->Execute(batch[i], &replies_[i]);
+      bc->Dec();
+    });
+  }
+
+  for (uint32_t i : routed_[local])
+    shards_[local]->Execute(batch[i], &replies_[i]);
+
+  bc->Wait();
+  for (auto& cmds : routed_)
+    cmds.clear();
+}
+
+void RespConnection::ExecuteGeneric(CmdArgs args, string* reply) {
+  string_view cmd = ToSV(args[0]);
+  if (cmd == "PING") {
+    if (args.size() == 1)
+      reply->append("+PONG\r\n");
+    else if (args.size() == 2)
+      AppendBulk(ToSV(args[1]), reply);
+    else
+      AppendWrongArgs(cmd, reply);
+  } else if (cmd == "ECHO") {
+    if (args.size() == 2)
+      AppendBulk(ToSV(args[1]), reply);
+    else
+      AppendWrongArgs(cmd, reply);
+  } else if (cmd == "DBSIZE") {
+    atomic_size_t total{0};
+    pool_->AwaitBrief([&](unsigned index, ProactorBase*) {
+      total.fetch_add(shards_[index]->size(), memory_order_relaxed);
+    });
+    AppendInt(total.load(), reply);
+  } else if (cmd == "COMMAND") {
+    // redis-cli and memtier_benchmark ask for the command table upon connecting.
+    reply->append("*0\r\n");
+  } else if (cmd == "QUIT") {
+    reply->append("+OK\r\n");
+    quit_ = true;
+  } else {
+    absl::StrAppend(reply, "-ERR unknown command '", cmd, "'\r\n");
+  }
+}
+
+error_code RespConnection::WriteReplies(size_t count) {
+  iovs_.clear();
+  for (size_t i = 0; i < count; ++i)
+    iovs_.push_back(iovec{replies_[i].data(), replies_[i].size()});
+
+  // A single writev unless the pipeline is deeper than the iovec limit.
+  for (size_t start = 0; start < count; start += IOV_MAX) {
+    uint32_t len = min<size_t>(IOV_MAX, count - start);
+    if (error_code ec = socket_->Write(iovs_.data() + start, len); ec)
+      return ec;
+  }
+  return {};
+}
+
+class RespListener : public ListenerInterface {
+ public:
+  explicit RespListener(const vector<unique_ptr<Shard>>* shards) : shards_(shards) {
+  }
+
+  Connection* NewConnection(ProactorBase* proactor) final {
+    return new RespConnection(shards_, pool());
+  }
+
+ private:
+  const vector<unique_ptr<Shard>>* shards_;
+};
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  MainInitGuard guard(&argc, &argv);
+  int port = GetFlag(FLAGS_port);
+  CHECK_GT(port, 0);
+
+  // Allocates the keys of all the shards, each thread gets its own heap. Must outlive the pool.
+  base::SlabMemoryResource key_mr;
+
+  unique_ptr<ProactorPool> pp;
+#ifdef __linux__
+  if (GetFlag(FLAGS_epoll)) {
+    pp.reset(Pool::Epoll());
+  } else {
+    pp.reset(Pool::IOUring(GetFlag(FLAGS_iouring_depth)));
+  }
+#else
+  pp.reset(Pool::Epoll());
+#endif
+  pp->Run();
+  cmd_qps.Init(pp.get());
+  hop_qps.Init(pp.get());
+
+  chrono::microseconds budget{GetFlag(FLAGS_rehash_budget_usec)};
+  bool coalesce = GetFlag(FLAGS_coalesce_hops);
+  vector<unique_ptr<Shard>> shards(pp->size());
+  pp->AwaitBrief([&](unsigned index, ProactorBase* p) {
+    Shard* shard = new Shard(&key_mr);
+    shards[index].reset(shard);
+
+    // Rehashes the dictionary when the loop is idle, spinning until the rehash completes.
+    shard->idle_task = p->AddOnIdleTask([shard, budget]() -> uint32_t {
+      return shard->dict()->RehashFor(budget) ? ProactorBase::kOnIdleMaxLevel : 0;
+    });
+    p->SetDispatchCoalescing(coalesce);
+  });
+
+  AcceptServer acceptor(pp.get());
+  acceptor.AddListener(port, new RespListener(&shards));
+
+  int http_port = GetFlag(FLAGS_http_port);
+  if (http_port >= 0) {
+    uint16_t port = acceptor.AddListener(http_port, new HttpListener<>);
+    LOG(INFO) << "Started http server on port " << port;
+  }
+
+  acceptor.Run();
+  acceptor.Wait();
+
+  // The connections are closed, each shard is destroyed in its own thread.
+  pp->AwaitBrief([&](unsigned index, ProactorBase* p) {
+    p->RemoveOnIdleTask(shards[index]->idle_task);
+    shards[index].reset();
+  });
+  pp->Stop();
+
+  return 0;
+}
@@ -0,0 +1,337 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "examples/redis_dict/tagged_dict.h"
+
+#include <absl/numeric/bits.h>
+#include <xxhash.h>
+
+#include <cstring>
+#include <utility>
+
+#include "base/logging.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define USE_SIMD_TAGS 1
+#elif defined(__aarch64__)
+#include "base/sse2neon.h"
+#define USE_SIMD_TAGS 1
+#endif
+
+namespace redis {
+
+using namespace std;
+
+namespace {
+
+constexpr uint32_t kFullMask = (1u << 14) - 1;
+
+// Returns the bitmask of the slots of the 16-byte tag header that equal tag.
+inline uint32_t MatchTags(const uint8_t* tags, uint8_t tag) {
+#ifdef USE_SIMD_TAGS
+  __m128i v = _mm_load_si128(reinterpret_cast<const __m128i*>(tags));
+  __m128i eq = _mm_cmpeq_epi8(v, _mm_set1_epi8(char(tag)));
+  return uint32_t(_mm_movemask_epi8(eq)) & kFullMask;
+#else
+  uint32_t res = 0;
+  for (unsigned i = 0; i < 14; ++i)
+    res |= uint32_t(tags[i] == tag) << i;
+  return res;
+#endif
+}
+
+size_t SdsHdrSize(char type) {
+  switch (type & SDS_TYPE_MASK) {
+    case SDS_TYPE_8:
+      return sizeof(sdshdr8);
+    case SDS_TYPE_16:
+      return sizeof(sdshdr16);
+    case SDS_TYPE_32:
+      return sizeof(sdshdr32);
+    case SDS_TYPE_64:
+      return sizeof(sdshdr64);
+  }
+  return 1;
+}
+
+template <typename Hdr> sds InitHdr(char* ptr, size_t len, char type) {
+  Hdr* hdr = reinterpret_cast<Hdr*>(ptr);
+  hdr->len = len;
+  hdr->alloc = len;
+  hdr->flags = type;
+  return hdr->buf;
+}
+
+inline bool KeyEq(const sds s, string_view key) {
+  return sdslen(s) == key.size() && memcmp(s, key.data(), key.size()) == 0;
+}
+
+}  // namespace
+
+sds PmrSdsNew(PMR_NS::memory_resource* mr, string_view str) {
+  // Type 5 strings have no alloc field, hence the smallest header is sdshdr8, like in sdsnewlen
+  // for the strings that may grow.
+  char type = str.size() < (1u << 8)    ? SDS_TYPE_8
+              : str.size() < (1u << 16) ? SDS_TYPE_16
+              : str.size() < (1ull << 32) ? SDS_TYPE_32
+                                          : SDS_TYPE_64;
+  size_t hdr_len = SdsHdrSize(type);
+  char* ptr = static_cast<char*>(mr->allocate(hdr_len + str.size() + 1, 1));
+
+  sds s;
+  switch (type) {
+    case SDS_TYPE_8:
+      s = InitHdr<sdshdr8>(ptr, str.size(), type);
+      break;
+    case SDS_TYPE_16:
+      s = InitHdr<sdshdr16>(ptr, str.size(), type);
+      break;
+    case SDS_TYPE_32:
+      s = InitHdr<sdshdr32>(ptr, str.size(), type);
+      break;
+    default:
+      s = InitHdr<sdshdr64>(ptr, str.size(), type);
+  }
+  memcpy(s, str.data(), str.size());
+  s[str.size()] = '\0';
+  return s;
+}
+
+void PmrSdsFree(PMR_NS::memory_resource* mr, sds s) {
+  size_t hdr_len = SdsHdrSize(s[-1]);
+  mr->deallocate(s - hdr_len, hdr_len + sdslen(s) + sdsavail(s) + 1, 1);
+}
+
+TaggedDict::TaggedDict(PMR_NS::memory_resource* mr, ValDestructor val_dtor)
+    : mr_(mr), val_dtor_(val_dtor) {
+}
+
+TaggedDict::~TaggedDict() {
+  FreeTable(&cur_);
+  FreeTable(&old_);
+}
+
+uint64_t TaggedDict::Hash(string_view key) {
+  return XXH3_64bits(key.data(), key.size());
+}
+
+auto TaggedDict::FindIn(const Table& t, string_view key, uint64_t hash) -> Pos {
+  if (!t.buckets)
+    return Pos{nullptr, 0};
+
+  uint8_t tag = Tag(hash);
+  size_t step = ProbeStep(hash);
+  size_t idx = hash & t.mask;
+
+  for (size_t i = 0; i <= t.mask; ++i) {
+    Bucket* b = t.buckets + idx;
+    for (uint32_t m = MatchTags(b->tags, tag); m; m &= m - 1) {
+      unsigned slot = absl::countr_zero(m);
+      if (KeyEq(b->slots[slot].key, key))
+        return Pos{b, slot};
+    }
+    if (b->overflow == 0)
+      break;
+    idx = (idx + step) & t.mask;
+  }
+  return Pos{nullptr, 0};
+}
+
+void TaggedDict::InsertInto(Table* t, sds key, void* val, uint64_t hash) {
+  size_t step = ProbeStep(hash);
+  size_t idx = hash & t->mask;
+
+  // The caller keeps the load below the capacity, so there is an empty slot.
+  while (true) {
+    Bucket* b = t->buckets + idx;
+    uint32_t empty = MatchTags(b->tags, 0);
+    if (empty) {
+      unsigned slot = absl::countr_zero(empty);
+      b->tags[slot] = Tag(hash);
+      b->slots[slot] = Slot{key, val};
+      ++t->used;
+      return;
+    }
+    if (b->overflow < UINT8_MAX)
+      ++b->overflow;
+    idx = (idx + step) & t->mask;
+  }
+}
+
+void TaggedDict::EraseFrom(Table* t, Pos pos, uint64_t hash) {
+  pos.bucket->tags[pos.slot] = 0;
+  --t->used;
+
+  // Uncounts the key in the buckets it skipped. The saturated counters stay.
+  size_t step = ProbeStep(hash);
+  for (size_t idx = hash & t->mask; t->buckets + idx != pos.bucket; idx = (idx + step) & t->mask) {
+    Bucket* b = t->buckets + idx;
+    if (b->overflow < UINT8_MAX)
+      --b->overflow;
+  }
+}
+
+auto TaggedDict::FindEntry(string_view key, uint64_t hash, Table** table) -> Pos {
+  Pos pos = FindIn(cur_, key, hash);
+  *table = &cur_;
+  if (!pos.bucket && old_.buckets) {
+    pos = FindIn(old_, key, hash);
+    *table = &old_;
+  }
+  return pos;
+}
+
+bool TaggedDict::Add(string_view key, void* val) {
+  RehashBuckets(1);
+
+  uint64_t hash = Hash(key);
+  Table* table;
+  if (FindEntry(key, hash, &table).bucket)
+    return false;
+
+  MaybeGrow();
+  InsertInto(&cur_, PmrSdsNew(mr_, key), val, hash);
+  return true;
+}
+
+bool TaggedDict::Replace(string_view key, void* val) {
+  RehashBuckets(1);
+
+  uint64_t hash = Hash(key);
+  Table* table;
+  Pos pos = FindEntry(key, hash, &table);
+  if (pos.bucket) {
+    void* prev = std::exchange(pos.bucket->slots[pos.slot].val, val);
+    if (val_dtor_)
+      val_dtor_(prev);
+    return false;
+  }
+
+  MaybeGrow();
+  InsertInto(&cur_, PmrSdsNew(mr_, key), val, hash);
+  return true;
+}
+
+bool TaggedDict::Delete(string_view key) {
+  RehashBuckets(1);
+
+  uint64_t hash = Hash(key);
+  Table* table;
+  Pos pos = FindEntry(key, hash, &table);
+  if (!pos.bucket)
+    return false;
+
+  Slot slot = pos.bucket->slots[pos.slot];
+  EraseFrom(table, pos, hash);
+  PmrSdsFree(mr_, slot.key);
+  if (val_dtor_)
+    val_dtor_(slot.val);
+  return true;
+}
+
+void** TaggedDict::Find(string_view key) {
+  uint64_t hash = Hash(key);
+  Table* table;
+  Pos pos = FindEntry(key, hash, &table);
+  return pos.bucket ? &pos.bucket->slots[pos.slot].val : nullptr;
+}
+
+bool TaggedDict::RehashBuckets(size_t n) {
+  if (!old_.buckets)
+    return false;
+
+  for (; n > 0 && old_.used > 0 && rehash_pos_ <= old_.mask; --n) {
+    MoveBucket(old_.buckets + rehash_pos_++);
+  }
+
+  if (old_.used == 0) {
+    FreeTable(&old_);
+    rehash_pos_ = 0;
+    return false;
+  }
+  return true;
+}
+
+bool TaggedDict::RehashFor(chrono::nanoseconds budget) {
+  constexpr size_t kBatch = 16;  // buckets between the clock reads.
+
+  auto deadline = chrono::steady_clock::now() + budget;
+  while (RehashBuckets(kBatch)) {
+    if (chrono::steady_clock::now() >= deadline)
+      return true;
+  }
+  return false;
+}
+
+void TaggedDict::MoveBucket(Bucket* b) {
+  // The overflow counter is kept, as the keys that skipped the bucket may still be in old_.
+  for (uint32_t m = ~MatchTags(b->tags, 0) & kFullMask; m; m &= m - 1) {
+    unsigned slot = absl::countr_zero(m);
+    const Slot& s = b->slots[slot];
+    InsertInto(&cur_, s.key, s.val, Hash(string_view{s.key, sdslen(s.key)}));
+    b->tags[slot] = 0;
+    --old_.used;
+  }
+}
+
+void TaggedDict::MaybeGrow() {
+  // The load limit is 6/7, i.e. 12 keys per bucket on average.
+  size_t num_buckets = cur_.num_buckets();
+  if ((cur_.used + old_.used + 1) * 7 <= num_buckets * kSlots * 6)
+    return;
+
+  // The table is full before the rehash completed, which happens only if the idle rehash
+  // fell behind many insertions.
+  if (old_.buckets)
+    RehashBuckets(SIZE_MAX);
+
+  if (cur_.used == 0) {
+    FreeTable(&cur_);
+    cur_ = AllocTable(num_buckets ? num_buckets * 2 : 1);
+    return;
+  }
+  old_ = cur_;
+  cur_ = AllocTable(num_buckets * 2);
+  rehash_pos_ = 0;
+}
+
+auto TaggedDict::AllocTable(size_t num_buckets) -> Table {
+  DCHECK_EQ(num_buckets & (num_buckets - 1), 0u);
+
+  Table t;
+  t.buckets =
+      static_cast<Bucket*>(mr_->allocate(num_buckets * sizeof(Bucket), alignof(Bucket)));
+  memset(static_cast<void*>(t.buckets), 0, num_buckets * sizeof(Bucket));
+  t.mask = num_buckets - 1;
+  return t;
+}
+
+void TaggedDict::FreeTable(Table* t) {
+  if (!t->buckets)
+    return;
+
+  for (size_t i = 0; i <= t->mask && t->used > 0; ++i) {
+    Bucket& b = t->buckets[i];
+    for (uint32_t m = ~MatchTags(b.tags, 0) & kFullMask; m; m &= m - 1) {
+      Slot& s = b.slots[absl::countr_zero(m)];
+      PmrSdsFree(mr_, s.key);
+      if (val_dtor_)
+        val_dtor_(s.val);
+      --t->used;
+    }
+  }
+  mr_->deallocate(t->buckets, t->num_buckets() * sizeof(Bucket), alignof(Bucket));
+  *t = Table{};
+}
+
+size_t TaggedDict::capacity() const {
+  return (cur_.num_buckets() + old_.num_buckets()) * kSlots;
+}
+
+size_t TaggedDict::bytes_allocated() const {
+  return (cur_.num_buckets() + old_.num_buckets()) * sizeof(Bucket);
+}
+
+}  // namespace redis
@@ -0,0 +1,153 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#include "base/pmr/memory_resource.h"
+
+extern "C" {
+#include "examples/redis_dict/sds.h"
+}
+
+namespace redis {
+
+// Allocates an sds string from mr. Its header is a regular sds header, so that the read-only
+// sds functions, like sdslen, work with it, but it must not be grown or freed by the sds
+// functions, which use the hiredis allocator. Free it with PmrSdsFree.
+sds PmrSdsNew(PMR_NS::memory_resource* mr, std::string_view str);
+void PmrSdsFree(PMR_NS::memory_resource* mr, sds s);
+
+// Cache-friendly variant of dict with string keys and void* values. The table is an array of
+// buckets with 14 slots, each bucket has a byte tag per slot with 7 bits of the hash, so a
+// lookup compares the tags of a bucket with a single SIMD instruction and usually reads
+// a single key. A key that did not fit its home bucket is placed in the next bucket of
+// its probe sequence, and the buckets it skipped count it in their overflow counters, so that
+// the lookups of absent keys stop at the first bucket without overflow.
+//
+// When the table grows, the entries are moved to the new table incrementally: every Add,
+// Replace and Delete moves a bucket, like in Redis, and the rest is moved by RehashFor, which
+// is bounded by time and suits the idle tasks of the proactor:
+//
+//   uint32_t id = proactor->AddOnIdleTask([&dict] {
+//     return dict.RehashFor(20us) ? ProactorBase::kOnIdleMaxLevel : 0;
+//   });
+//
+// The keys are copied into sds strings allocated from the memory resource, the values are
+// owned by the caller unless a destructor is passed. Not thread-safe.
+class TaggedDict {
+ public:
+  using ValDestructor = void (*)(void* val);
+
+  explicit TaggedDict(PMR_NS::memory_resource* mr = PMR_NS::get_default_resource(),
+                      ValDestructor val_dtor = nullptr);
+  ~TaggedDict();
+
+  TaggedDict(const TaggedDict&) = delete;
+  TaggedDict& operator=(const TaggedDict&) = delete;
+
+  // Returns false if the key already exists.
+  bool Add(std::string_view key, void* val);
+
+  // Sets the value of the key, destroying the previous one. Returns true if the key was added.
+  bool Replace(std::string_view key, void* val);
+
+  // Returns false if the key does not exist.
+  bool Delete(std::string_view key);
+
+  // Returns the address of the value of the key or nullptr. The address is valid until
+  // the next modification or rehash step.
+  void** Find(std::string_view key);
+
+  // Moves the entries of the old table for up to budget. Returns true if the rehash is still
+  // in progress.
+  bool RehashFor(std::chrono::nanoseconds budget);
+
+  // Moves up to n buckets of the old table. Returns true if the rehash is still in progress.
+  bool RehashBuckets(size_t n);
+
+  bool IsRehashing() const {
+    return old_.buckets != nullptr;
+  }
+
+  size_t size() const {
+    return cur_.used + old_.used;
+  }
+
+  // The number of slots in both tables.
+  size_t capacity() const;
+
+  size_t bytes_allocated() const;
+
+ private:
+  static constexpr unsigned kSlots = 14;
+
+  struct Slot {
+    sds key;
+    void* val;
+  };
+
+  struct alignas(16) Bucket {
+    uint8_t tags[kSlots];  // 0 marks an empty slot, the tags of full slots have the msb set.
+    uint8_t overflow;      // how many keys were displaced past this bucket, saturates.
+    uint8_t unused;
+    Slot slots[kSlots];
+  };
+
+  static_assert(sizeof(Bucket) == 240);
+
+  struct Table {
+    Bucket* buckets = nullptr;
+    size_t mask = 0;  // the number of buckets minus 1.
+    size_t used = 0;
+
+    size_t num_buckets() const {
+      return buckets ? mask + 1 : 0;
+    }
+  };
+
+  struct Pos {
+    Bucket* bucket;
+    unsigned slot;
+  };
+
+  static uint64_t Hash(std::string_view key);
+
+  static uint8_t Tag(uint64_t hash) {
+    return uint8_t(hash >> 56) | 0x80;
+  }
+
+  // An odd step visits all the buckets because their number is a power of 2.
+  static size_t ProbeStep(uint64_t hash) {
+    return size_t(Tag(hash)) * 2 + 1;
+  }
+
+  static Pos FindIn(const Table& t, std::string_view key, uint64_t hash);
+  static void InsertInto(Table* t, sds key, void* val, uint64_t hash);
+  static void EraseFrom(Table* t, Pos pos, uint64_t hash);
+
+  // Finds the key in both tables, sets *table to the one that contains it.
+  Pos FindEntry(std::string_view key, uint64_t hash, Table** table);
+
+  // Starts a rehash into a table twice as large or finishes the current one if the table
+  // reached its load limit.
+  void MaybeGrow();
+  void MoveBucket(Bucket* b);
+
+  Table AllocTable(size_t num_buckets);
+  void FreeTable(Table* t);
+
+  PMR_NS::memory_resource* mr_;
+  ValDestructor val_dtor_;
+
+  Table cur_;  // receives the insertions.
+  Table old_;  // drained during the rehash.
+  size_t rehash_pos_ = 0;  // the next bucket of old_ to move.
+};
+
+}  // namespace redis
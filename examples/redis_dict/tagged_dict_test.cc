@@ -0,0 +1,244 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "examples/redis_dict/tagged_dict.h"
+
+#include <absl/strings/str_cat.h>
+
+#include <random>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "base/pmr/slab_resource.h"
+#include "base/zipf_gen.h"
+#include "util/fibers/fibers.h"
+#include "util/fibers/pool.h"
+
+extern "C" {
+#include "examples/redis_dict/dict.h"
+}
+
+using namespace std;
+
+namespace redis {
+
+class TaggedDictTest : public testing::Test {
+ protected:
+  static void* Val(uint64_t i) {
+    return reinterpret_cast<void*>(uintptr_t(i + 1));
+  }
+
+  base::SlabMemoryResource mr_;
+};
+
+TEST_F(TaggedDictTest, Basic) {
+  TaggedDict dict(&mr_);
+  EXPECT_EQ(nullptr, dict.Find("foo"));
+  EXPECT_TRUE(dict.Add("foo", Val(1)));
+  EXPECT_FALSE(dict.Add("foo", Val(2)));
+  EXPECT_TRUE(dict.Add("", Val(3)));
+  EXPECT_EQ(2u, dict.size());
+
+  void** val = dict.Find("foo");
+  ASSERT_TRUE(val);
+  EXPECT_EQ(Val(1), *val);
+  EXPECT_EQ(Val(3), *dict.Find(""));
+
+  EXPECT_FALSE(dict.Replace("foo", Val(4)));
+  EXPECT_EQ(Val(4), *dict.Find("foo"));
+  EXPECT_TRUE(dict.Replace("bar", Val(5)));
+
+  EXPECT_TRUE(dict.Delete("foo"));
+  EXPECT_FALSE(dict.Delete("foo"));
+  EXPECT_EQ(nullptr, dict.Find("foo"));
+  EXPECT_EQ(2u, dict.size());
+}
+
+TEST_F(TaggedDictTest, PmrSds) {
+  string long_str(70000, 'x');
+  for (size_t len : {0ul, 10ul, 255ul, 256ul, 70000ul}) {
+    sds s = PmrSdsNew(&mr_, string_view{long_str.data(), len});
+    EXPECT_EQ(len, sdslen(s));
+    EXPECT_EQ(0u, sdsavail(s));
+    EXPECT_EQ('\0', s[len]);
+    PmrSdsFree(&mr_, s);
+  }
+  EXPECT_EQ(0u, mr_.GetLocalStats().classes[base::SlabMemoryResource::SizeClass(14)].used_blocks);
+}
+
+TEST_F(TaggedDictTest, Rehash) {
+  constexpr unsigned kNum = 20000;
+  TaggedDict dict(&mr_);
+
+  bool rehashed = false;
+  for (unsigned i = 0; i < kNum; ++i) {
+    ASSERT_TRUE(dict.Add(absl::StrCat("key:", i), Val(i)));
+    if (dict.IsRehashing()) {
+      rehashed = true;
+
+      // The keys are found in both tables in the middle of the rehash.
+      ASSERT_EQ(Val(i / 2), *dict.Find(absl::StrCat("key:", i / 2))) << i;
+    }
+  }
+  EXPECT_TRUE(rehashed);
+  EXPECT_EQ(kNum, dict.size());
+  EXPECT_GE(dict.capacity(), kNum);
+
+  for (unsigned i = 0; i < kNum; i += 2) {
+    ASSERT_TRUE(dict.Delete(absl::StrCat("key:", i)));
+  }
+  while (dict.RehashFor(1ms)) {
+  }
+  EXPECT_FALSE(dict.IsRehashing());
+
+  for (unsigned i = 0; i < kNum; ++i) {
+    void** val = dict.Find(absl::StrCat("key:", i));
+    if (i % 2) {
+      ASSERT_TRUE(val) << i;
+      ASSERT_EQ(Val(i), *val);
+    } else {
+      ASSERT_FALSE(val) << i;
+    }
+  }
+  EXPECT_EQ(kNum / 2, dict.size());
+}
+
+TEST_F(TaggedDictTest, ValDestructor) {
+  static unsigned destroyed = 0;
+  {
+    TaggedDict dict(&mr_, [](void*) { ++destroyed; });
+    for (unsigned i = 0; i < 100; ++i)
+      dict.Add(absl::StrCat(i), Val(i));
+    dict.Replace("0", Val(0));
+    dict.Delete("1");
+    EXPECT_EQ(2u, destroyed);
+  }
+  EXPECT_EQ(101u, destroyed);
+}
+
+TEST_F(TaggedDictTest, IdleRehash) {
+  unique_ptr<util::ProactorPool> pool(util::fb2::Pool::Epoll(1));
+  pool->Run();
+
+  pool->at(0)->Await([] {
+    TaggedDict dict;
+
+    // The idle task runs while the fiber sleeps.
+    util::ProactorBase* p = util::ProactorBase::me();
+    uint32_t id = p->AddOnIdleTask([&dict] {
+      return dict.RehashFor(20us) ? util::ProactorBase::kOnIdleMaxLevel : 0;
+    });
+
+    for (unsigned i = 0; i < 10000; ++i)
+      dict.Add(absl::StrCat(i), nullptr);
+
+    while (dict.IsRehashing())
+      util::ThisFiber::SleepFor(1ms);
+
+    p->RemoveOnIdleTask(id);
+    EXPECT_EQ(10000u, dict.size());
+  });
+
+  pool->Stop();
+}
+
+namespace {
+
+unsigned SdsHash(const void* key) {
+  return dictGenHashFunction(static_cast<const unsigned char*>(key), sdslen((const sds)key));
+}
+
+int SdsCompare(void*, const void* k1, const void* k2) {
+  return sdscmp((const sds)k1, (const sds)k2) == 0;
+}
+
+void SdsDestructor(void*, void* key) {
+  sdsfree(static_cast<sds>(key));
+}
+
+dictType sds_dict_type = {SdsHash, nullptr, nullptr, SdsCompare, SdsDestructor, nullptr};
+
+// Zipfian sample of the key indices, YCSB style.
+vector<uint64_t> ZipfSample(uint64_t num_keys, size_t count) {
+  base::ZipfianGenerator gen(num_keys);
+  mt19937_64 rng(42);
+  vector<uint64_t> res(count);
+  gen.NextN(rng, absl::MakeSpan(res));
+  return res;
+}
+
+vector<string> MakeKeys(size_t num) {
+  vector<string> res(num);
+  for (size_t i = 0; i < num; ++i)
+    res[i] = absl::StrCat("key:", i);
+  return res;
+}
+
+}  // namespace
+
+static void BM_FindDict(benchmark::State& state) {
+  vector<string> keys = MakeKeys(state.range(0));
+  dict* d = dictCreate(&sds_dict_type, nullptr);
+  for (size_t i = 0; i < keys.size(); ++i)
+    dictAdd(d, sdsnewlen(keys[i].data(), keys[i].size()), nullptr);
+
+  // The hiredis dict looks up sds keys.
+  vector<sds> lookup;
+  for (uint64_t i : ZipfSample(keys.size(), 1 << 16))
+    lookup.push_back(sdsnewlen(keys[i].data(), keys[i].size()));
+
+  size_t i = 0;
+  while (state.KeepRunning()) {
+    CHECK(dictFind(d, lookup[i++ & (lookup.size() - 1)]));
+  }
+  for (sds s : lookup)
+    sdsfree(s);
+  dictRelease(d);
+}
+BENCHMARK(BM_FindDict)->Arg(1 << 10)->Arg(1 << 16)->Arg(1 << 20);
+
+static void BM_FindTagged(benchmark::State& state) {
+  vector<string> keys = MakeKeys(state.range(0));
+  base::SlabMemoryResource mr;
+  TaggedDict d(&mr);
+  for (const string& k : keys)
+    d.Add(k, nullptr);
+
+  vector<string_view> lookup;
+  for (uint64_t i : ZipfSample(keys.size(), 1 << 16))
+    lookup.push_back(keys[i]);
+
+  size_t i = 0;
+  while (state.KeepRunning()) {
+    CHECK(d.Find(lookup[i++ & (lookup.size() - 1)]));
+  }
+}
+BENCHMARK(BM_FindTagged)->Arg(1 << 10)->Arg(1 << 16)->Arg(1 << 20);
+
+// Measures the insertions including the rehash stalls.
+static void BM_InsertDict(benchmark::State& state) {
+  vector<string> keys = MakeKeys(state.range(0));
+  while (state.KeepRunning()) {
+    dict* d = dictCreate(&sds_dict_type, nullptr);
+    for (const string& k : keys)
+      dictAdd(d, sdsnewlen(k.data(), k.size()), nullptr);
+    dictRelease(d);
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+BENCHMARK(BM_InsertDict)->Arg(1 << 16)->Arg(1 << 20);
+
+static void BM_InsertTagged(benchmark::State& state) {
+  vector<string> keys = MakeKeys(state.range(0));
+  base::SlabMemoryResource mr;
+  while (state.KeepRunning()) {
+    TaggedDict d(&mr);
+    for (const string& k : keys)
+      d.Add(k, nullptr);
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+BENCHMARK(BM_InsertTagged)->Arg(1 << 16)->Arg(1 << 20);
+
+}  // namespace redis
@@ -1,16 +1,25 @@
 // Copyright 2023, Roman Gershman.  All rights reserved.
 // See LICENSE for licensing terms.
 
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+#include <absl/time/clock.h>
 #include <aws/core/auth/AWSCredentialsProvider.h>
 #include <aws/s3/S3Client.h>
-#include <aws/s3/model/ListObjectsV2Request.h>
 #include <aws/s3/model/PutObjectRequest.h>
 
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
 #include "base/flags.h"
+#include "base/histogram.h"
 #include "base/init.h"
 #include "base/logging.h"
 #include "util/aws/aws.h"
 #include "util/aws/credentials_provider_chain.h"
+#include "util/aws/s3_batch.h"
 #include "util/aws/s3_endpoint_provider.h"
 #include "util/aws/s3_read_file.h"
 #include "util/aws/s3_write_file.h"
@@ -22,14 +31,21 @@ ABSL_FLAG(std::string, key, "", "S3 file key");
 ABSL_FLAG(std::string, endpoint, "", "S3 endpoint");
 ABSL_FLAG(size_t, upload_size, 100 << 20, "Upload file size");
 ABSL_FLAG(size_t, chunk_size, 1024, "File chunk size");
+ABSL_FLAG(uint32_t, readahead, 0, "Number of chunks to download in parallel when reading");
+ABSL_FLAG(uint32_t, upload_inflight, 1, "Number of parts to upload in parallel");
+ABSL_FLAG(uint32_t, list_concurrency, 32, "Number of key ranges to list in parallel");
 ABSL_FLAG(bool, https, false, "Whether to use HTTPS");
 ABSL_FLAG(bool, epoll, false, "Whether to use epoll instead of io_uring");
+ABSL_FLAG(std::string, bench_ops, "upload,download", "Operations of the bench command");
+ABSL_FLAG(std::string, bench_concurrency, "1,4,16", "Numbers of parallel streams to sweep");
+ABSL_FLAG(std::string, bench_part_mb, "8", "Part and chunk sizes in MB to sweep");
+ABSL_FLAG(std::string, bench_object_mb, "64", "Object sizes in MB to sweep");
 
 std::shared_ptr<Aws::S3::S3Client> OpenS3Client() {
   Aws::S3::S3ClientConfiguration s3_conf{};
   s3_conf.payloadSigningPolicy = Aws::Client::AWSAuthV4Signer::PayloadSigningPolicy::ForceNever;
   std::shared_ptr<Aws::Auth::AWSCredentialsProvider> credentials_provider =
-      std::make_shared<util::aws::CredentialsProviderChain>();
+      util::aws::CredentialsProviderChain::Shared();
   std::shared_ptr<Aws::S3::S3EndpointProviderBase> endpoint_provider =
       std::make_shared<util::aws::S3EndpointProvider>(absl::GetFlag(FLAGS_endpoint),
                                                       absl::GetFlag(FLAGS_https));
@@ -49,38 +65,56 @@ void ListBuckets() {
   }
 }
 
-void ListObjects(const std::string& bucket) {
+// Lists the objects under prefix in parallel, see S3ParallelLister.
+std::vector<util::aws::S3Object> ListObjects(util::ProactorPool* pp, const std::string& bucket,
+                                             const std::string& prefix) {
+  util::aws::S3ParallelLister lister(OpenS3Client(), pp);
+  util::aws::S3ParallelLister::Options opts;
+  opts.concurrency = absl::GetFlag(FLAGS_list_concurrency);
+  util::aws::S3ObjectChannel* channel = lister.Start(bucket, prefix, opts);
+
+  std::vector<util::aws::S3Object> objects;
+  util::aws::S3ObjectPage page;
+  while (channel->Pop(page)) {
+    std::move(page.begin(), page.end(), std::back_inserter(objects));
+  }
+  if (std::error_code ec = lister.Wait(); ec) {
+    LOG(ERROR) << "failed to list objects: " << ec.message();
+  }
+
+  // The ranges are listed in parallel.
+  std::sort(objects.begin(), objects.end(),
+            [](const auto& a, const auto& b) { return a.key < b.key; });
+  return objects;
+}
+
+void ListObjects(util::ProactorPool* pp, const std::string& bucket, const std::string& prefix) {
   if (bucket == "") {
     LOG(ERROR) << "missing bucket name";
     return;
   }
 
-  std::shared_ptr<Aws::S3::S3Client> s3 = OpenS3Client();
+  std::cout << "objects in " << bucket << ":" << std::endl;
+  for (const util::aws::S3Object& object : ListObjects(pp, bucket, prefix)) {
+    std::cout << "* " << object.key << " " << object.size << std::endl;
+  }
+}
 
-  std::string continuation_token;
-  std::vector<std::string> keys;
-  do {
-    Aws::S3::Model::ListObjectsV2Request request;
-    request.SetBucket(bucket);
-    if (continuation_token != "") {
-      request.SetContinuationToken(continuation_token);
-    }
+void DeleteObjects(util::ProactorPool* pp, const std::string& bucket, const std::string& prefix) {
+  if (bucket == "") {
+    LOG(ERROR) << "missing bucket name";
+    return;
+  }
 
-    Aws::S3::Model::ListObjectsV2Outcome outcome = s3->ListObjectsV2(request);
-    if (outcome.IsSuccess()) {
-      continuation_token = outcome.GetResult().GetNextContinuationToken();
-      for (const auto& object : outcome.GetResult().GetContents()) {
-        keys.push_back(object.GetKey());
-      }
-    } else {
-      LOG(ERROR) << "failed to list objects: " << outcome.GetError().GetExceptionName();
-      return;
-    }
-  } while (continuation_token != "");
+  std::vector<std::string> keys;
+  for (util::aws::S3Object& object : ListObjects(pp, bucket, prefix)) {
+    keys.push_back(std::move(object.key));
+  }
 
-  std::cout << "objects in " << bucket << ":" << std::endl;
-  for (const std::string& key : keys) {
-    std::cout << "* " << key << std::endl;
+  LOG(INFO) << "deleting " << keys.size() << " objects";
+  std::error_code ec = util::aws::DeleteObjects(OpenS3Client().get(), pp, bucket, keys);
+  if (ec) {
+    LOG(ERROR) << "failed to delete objects: " << ec.message();
   }
 }
 
@@ -97,7 +131,8 @@ void Upload(const std::string& bucket, const std::string& key, size_t upload_siz
   }
 
   std::shared_ptr<Aws::S3::S3Client> s3 = OpenS3Client();
-  io::Result<util::aws::S3WriteFile> file = util::aws::S3WriteFile::Open(bucket, key, s3);
+  io::Result<util::aws::S3WriteFile> file = util::aws::S3WriteFile::Open(
+      bucket, key, s3, util::aws::kDefaultPartSize, absl::GetFlag(FLAGS_upload_inflight));
   if (!file) {
     LOG(ERROR) << "failed to open s3 write file: " << file.error();
     return;
@@ -134,7 +169,8 @@ void Download(const std::string& bucket, const std::string& key) {
   }
 
   std::shared_ptr<Aws::S3::S3Client> s3 = OpenS3Client();
-  std::unique_ptr<io::ReadonlyFile> file = std::make_unique<util::aws::S3ReadFile>(bucket, key, s3);
+  std::unique_ptr<io::ReadonlyFile> file = std::make_unique<util::aws::S3ReadFile>(
+      bucket, key, s3, util::aws::kDefaultChunkSize, absl::GetFlag(FLAGS_readahead));
 
   LOG(INFO) << "downloading s3 file";
 
@@ -154,6 +190,137 @@ void Download(const std::string& bucket, const std::string& key) {
   }
 }
 
+std::vector<size_t> ParseSizes(const std::string& flag_val) {
+  std::vector<size_t> res;
+  for (std::string_view item : absl::StrSplit(flag_val, ',', absl::SkipEmpty())) {
+    size_t val;
+    CHECK(absl::SimpleAtoi(item, &val)) << "Invalid number " << item;
+    res.push_back(val);
+  }
+  return res;
+}
+
+struct BenchConfig {
+  std::string op;
+  size_t concurrency;
+  size_t part_size;
+  size_t object_size;
+};
+
+// Writes or reads a single object in calls of part_size, adding the latency of every call
+// to hist in msec. Returns the number of bytes transferred.
+io::Result<size_t> RunBenchStream(const BenchConfig& cfg, const std::string& bucket,
+                                  const std::string& key, base::Histogram* hist) {
+  std::shared_ptr<Aws::S3::S3Client> s3 = OpenS3Client();
+  std::vector<uint8_t> buf(cfg.part_size, 0xff);
+  auto timed = [hist](auto op) {
+    uint64_t start = absl::GetCurrentTimeNanos();
+    auto res = op();
+    hist->Add((absl::GetCurrentTimeNanos() - start) / 1e6);
+    return res;
+  };
+
+  if (cfg.op == "upload") {
+    io::Result<util::aws::S3WriteFile> file = util::aws::S3WriteFile::Open(
+        bucket, key, s3, cfg.part_size, absl::GetFlag(FLAGS_upload_inflight));
+    if (!file)
+      return nonstd::make_unexpected(file.error());
+
+    for (size_t written = 0; written < cfg.object_size;) {
+      size_t len = std::min(buf.size(), cfg.object_size - written);
+      std::error_code ec = timed([&] { return file->Write(io::Bytes(buf.data(), len)); });
+      if (ec)
+        return nonstd::make_unexpected(ec);
+      written += len;
+    }
+    if (std::error_code ec = timed([&] { return file->Close(); }); ec)
+      return nonstd::make_unexpected(ec);
+    return cfg.object_size;
+  }
+
+  util::aws::S3ReadFile file(bucket, key, s3, cfg.part_size, absl::GetFlag(FLAGS_readahead));
+  size_t read_n = 0;
+  while (true) {
+    io::Result<size_t> n =
+        timed([&] { return file.Read(read_n, io::MutableBytes(buf.data(), buf.size())); });
+    if (!n)
+      return n;
+    if (*n == 0)
+      return read_n;
+    read_n += *n;
+  }
+}
+
+// Sweeps the operations over the concurrency, the part size and the object size. Every stream
+// uploads or downloads its own object under the key prefix, spread over all the proactors.
+// The downloads read the objects of the preceding uploads with the same object size, so
+// a download only sweep expects the objects of a previous run.
+// The latencies are of the Write and Read calls of part size, which roughly correspond to
+// the part uploads and the chunk downloads, and of the whole objects.
+void Bench(util::ProactorPool* pp, const std::string& bucket, const std::string& prefix) {
+  if (bucket == "") {
+    LOG(ERROR) << "missing bucket name";
+    return;
+  }
+
+  BenchConfig cfg;
+  for (size_t object_mb : ParseSizes(absl::GetFlag(FLAGS_bench_object_mb))) {
+    cfg.object_size = object_mb << 20;
+    for (size_t part_mb : ParseSizes(absl::GetFlag(FLAGS_bench_part_mb))) {
+      cfg.part_size = part_mb << 20;
+      for (size_t concurrency : ParseSizes(absl::GetFlag(FLAGS_bench_concurrency))) {
+        cfg.concurrency = concurrency;
+        for (std::string_view op : absl::StrSplit(absl::GetFlag(FLAGS_bench_ops), ',',
+                                                  absl::SkipEmpty())) {
+          cfg.op = std::string(op);
+          CHECK(op == "upload" || op == "download") << "Unknown bench op " << op;
+
+          std::mutex mu;
+          base::Histogram call_hist, object_hist;
+          std::atomic_uint64_t bytes{0}, errors{0};
+          uint64_t start = absl::GetCurrentTimeNanos();
+          pp->AwaitFiberOnAll([&](unsigned index, util::ProactorBase*) {
+            std::vector<util::fb2::Fiber> fibers;
+            for (size_t i = index; i < cfg.concurrency; i += pp->size()) {
+              fibers.emplace_back([&, i] {
+                std::string key = absl::StrCat(prefix, object_mb, "mb-", i);
+                base::Histogram local_hist;
+                uint64_t stream_start = absl::GetCurrentTimeNanos();
+                io::Result<size_t> res = RunBenchStream(cfg, bucket, key, &local_hist);
+                double object_ms = (absl::GetCurrentTimeNanos() - stream_start) / 1e6;
+                if (!res) {
+                  LOG(ERROR) << cfg.op << " of " << key << " failed: " << res.error().message();
+                  errors.fetch_add(1, std::memory_order_relaxed);
+                  return;
+                }
+                bytes.fetch_add(*res, std::memory_order_relaxed);
+
+                std::lock_guard lk(mu);
+                call_hist.Merge(local_hist);
+                object_hist.Add(object_ms);
+              });
+            }
+            for (auto& fb : fibers)
+              fb.Join();
+          });
+          double dur_sec = (absl::GetCurrentTimeNanos() - start) / 1e9;
+
+          std::cout << absl::StrCat(
+                           R"({"op":")", cfg.op, R"(","concurrency":)", cfg.concurrency,
+                           R"(,"part_mb":)", part_mb, R"(,"object_mb":)", object_mb,
+                           R"(,"errors":)", errors.load(), R"(,"mb_s":)",
+                           bytes.load() / double(1 << 20) / dur_sec, R"(,"call_p50_ms":)",
+                           call_hist.Percentile(50), R"(,"call_p99_ms":)",
+                           call_hist.Percentile(99), R"(,"call_max_ms":)", call_hist.max(),
+                           R"(,"object_p50_ms":)", object_hist.Percentile(50),
+                           R"(,"object_max_ms":)", object_hist.max(), "}")
+                    << std::endl;
+        }
+      }
+    }
+  }
+}
+
 int main(int argc, char* argv[]) {
   MainInitGuard guard(&argc, &argv);
 
@@ -179,12 +346,17 @@ int main(int argc, char* argv[]) {
     if (cmd == "list-buckets") {
       ListBuckets();
     } else if (cmd == "list-objects") {
-      ListObjects(absl::GetFlag(FLAGS_bucket));
+      ListObjects(pp.get(), absl::GetFlag(FLAGS_bucket), absl::GetFlag(FLAGS_key));
+    } else if (cmd == "delete-objects") {
+      DeleteObjects(pp.get(), absl::GetFlag(FLAGS_bucket), absl::GetFlag(FLAGS_key));
     } else if (cmd == "upload") {
       Upload(absl::GetFlag(FLAGS_bucket), absl::GetFlag(FLAGS_key),
              absl::GetFlag(FLAGS_upload_size), absl::GetFlag(FLAGS_chunk_size));
     } else if (cmd == "download") {
       Download(absl::GetFlag(FLAGS_bucket), absl::GetFlag(FLAGS_key));
+    } else if (cmd == "bench") {
+      std::string prefix = absl::GetFlag(FLAGS_key);
+      Bench(pp.get(), absl::GetFlag(FLAGS_bucket), prefix.empty() ? "s3_demo_bench/" : prefix);
     } else {
       LOG(ERROR) << "unknown command: " << cmd;
     }
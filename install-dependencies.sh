@@ -2,7 +2,7 @@
 
 set -e
 
-apt install -y cmake libunwind-dev zip bison ninja-build autoconf-archive libtool
+apt install -y cmake libunwind-dev zip bison ninja-build autoconf-archive libtool zlib1g-dev
 apt install -y curl
 g++ --version
 
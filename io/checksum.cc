@@ -0,0 +1,38 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "io/checksum.h"
+
+#include <algorithm>
+
+namespace io {
+
+namespace {
+
+// Hashes the first n bytes of (v, len).
+void UpdatePrefix(const iovec* v, uint32_t len, size_t n, base::Hasher* hasher) {
+  for (uint32_t i = 0; i < len && n > 0; ++i) {
+    size_t sz = std::min(v[i].iov_len, n);
+    hasher->Update(v[i].iov_base, sz);
+    n -= sz;
+  }
+}
+
+}  // namespace
+
+Result<size_t> ChecksumSink::WriteSome(const iovec* v, uint32_t len) {
+  Result<size_t> res = upstream_->WriteSome(v, len);
+  if (res)
+    UpdatePrefix(v, len, *res, &hasher_);
+  return res;
+}
+
+Result<size_t> ChecksumSource::ReadSome(const iovec* v, uint32_t len) {
+  Result<size_t> res = upstream_->ReadSome(v, len);
+  if (res)
+    UpdatePrefix(v, len, *res, &hasher_);
+  return res;
+}
+
+}  // namespace io
@@ -0,0 +1,73 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include "base/hash.h"
+#include "io/io.h"
+
+namespace io {
+
+// Pass-through adapters that checksum the bytes while they move, so that the buffers are
+// hashed while they are still in the cache instead of in a second pass. Only the bytes that
+// were actually written or read are hashed, i.e. the partial results of WriteSome and
+// ReadSome are accounted for. Use base::Hasher::kCRC32C for checksums that are verified by
+// other systems, e.g. S3, and kXXH3 for the fastest in-process verification.
+class ChecksumSink final : public Sink {
+ public:
+  explicit ChecksumSink(Sink* upstream, base::Hasher::Engine engine = base::Hasher::kCRC32C,
+                        uint64_t seed = 0)
+      : upstream_(upstream), hasher_(engine, seed) {
+  }
+
+  using Sink::WriteSome;
+  Result<size_t> WriteSome(const iovec* v, uint32_t len) final;
+
+  // The checksum of all the bytes written so far.
+  uint64_t Digest() const {
+    return hasher_.Digest();
+  }
+
+  void Reset() {
+    hasher_.Reset();
+  }
+
+  base::Hasher::Engine engine() const {
+    return hasher_.engine();
+  }
+
+ private:
+  Sink* upstream_;
+  base::Hasher hasher_;
+};
+
+class ChecksumSource final : public Source {
+ public:
+  explicit ChecksumSource(Source* upstream, base::Hasher::Engine engine = base::Hasher::kCRC32C,
+                          uint64_t seed = 0)
+      : upstream_(upstream), hasher_(engine, seed) {
+  }
+
+  using Source::ReadSome;
+  Result<size_t> ReadSome(const iovec* v, uint32_t len) final;
+
+  // The checksum of all the bytes read so far.
+  uint64_t Digest() const {
+    return hasher_.Digest();
+  }
+
+  void Reset() {
+    hasher_.Reset();
+  }
+
+  base::Hasher::Engine engine() const {
+    return hasher_.engine();
+  }
+
+ private:
+  Source* upstream_;
+  base::Hasher hasher_;
+};
+
+}  // namespace io
@@ -0,0 +1,392 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "io/compress.h"
+
+#define LZ4F_STATIC_LINKING_ONLY  // for the dictionary api.
+#include <lz4frame.h>
+#include <zstd.h>
+
+#include "base/logging.h"
+
+namespace io {
+
+using namespace std;
+using nonstd::make_unexpected;
+
+namespace detail {
+
+class Compressor {
+ public:
+  virtual ~Compressor() = default;
+
+  // Appends the compressed in to out. Starts a frame if none is open and ends it if end_frame
+  // is set.
+  virtual error_code Compress(Bytes in, bool end_frame, vector<uint8_t>* out) = 0;
+};
+
+class Decompressor {
+ public:
+  virtual ~Decompressor() = default;
+
+  virtual error_code Decompress(Bytes in, MutableBytes out, size_t* consumed,
+                                size_t* produced) = 0;
+
+  // Whether the last call stopped in the middle of a frame.
+  bool in_frame() const {
+    return in_frame_;
+  }
+
+ protected:
+  bool in_frame_ = false;
+};
+
+}  // namespace detail
+
+namespace {
+
+error_code CorruptedInput() {
+  return make_error_code(errc::illegal_byte_sequence);
+}
+
+class ZstdCompressor final : public detail::Compressor {
+ public:
+  explicit ZstdCompressor(const CompressOptions& opts);
+  ~ZstdCompressor() {
+    ZSTD_freeCCtx(cctx_);
+  }
+
+  error_code Compress(Bytes in, bool end_frame, vector<uint8_t>* out) final;
+
+ private:
+  ZSTD_CCtx* cctx_;
+};
+
+ZstdCompressor::ZstdCompressor(const CompressOptions& opts) : cctx_(ZSTD_createCCtx()) {
+  CHECK(cctx_);
+  if (opts.level)
+    ZSTD_CCtx_setParameter(cctx_, ZSTD_c_compressionLevel, opts.level);
+  ZSTD_CCtx_setParameter(cctx_, ZSTD_c_checksumFlag, 1);
+
+  if (!opts.dictionary.empty()) {
+    // The dictionary is sticky, it is used for all the following frames.
+    size_t res = ZSTD_CCtx_loadDictionary(cctx_, opts.dictionary.data(), opts.dictionary.size());
+    CHECK(!ZSTD_isError(res)) << ZSTD_getErrorName(res);
+  }
+}
+
+error_code ZstdCompressor::Compress(Bytes in, bool end_frame, vector<uint8_t>* out) {
+  ZSTD_inBuffer src{in.data(), in.size(), 0};
+  ZSTD_EndDirective mode = end_frame ? ZSTD_e_end : ZSTD_e_continue;
+  const size_t chunk = ZSTD_CStreamOutSize();
+
+  while (true) {
+    size_t pos = out->size();
+    out->resize(pos + chunk);
+    ZSTD_outBuffer dst{out->data() + pos, chunk, 0};
+    size_t res = ZSTD_compressStream2(cctx_, &dst, &src, mode);
+    out->resize(pos + dst.pos);
+    if (ZSTD_isError(res)) {
+      LOG(ERROR) << "zstd compression failed: " << ZSTD_getErrorName(res);
+      return make_error_code(errc::invalid_argument);
+    }
+
+    // res is the number of bytes that are still to be flushed for ZSTD_e_end.
+    if (end_frame ? res == 0 : src.pos == src.size)
+      break;
+  }
+  return {};
+}
+
+class Lz4Compressor final : public detail::Compressor {
+ public:
+  explicit Lz4Compressor(const CompressOptions& opts);
+  ~Lz4Compressor();
+
+  error_code Compress(Bytes in, bool end_frame, vector<uint8_t>* out) final;
+
+ private:
+  LZ4F_cctx* cctx_ = nullptr;
+  LZ4F_CDict* cdict_ = nullptr;
+  LZ4F_preferences_t prefs_;
+  bool frame_open_ = false;
+};
+
+Lz4Compressor::Lz4Compressor(const CompressOptions& opts) {
+  size_t res = LZ4F_createCompressionContext(&cctx_, LZ4F_VERSION);
+  CHECK(!LZ4F_isError(res)) << LZ4F_getErrorName(res);
+
+  prefs_ = LZ4F_preferences_t{};
+  prefs_.compressionLevel = opts.level;
+  prefs_.frameInfo.blockSizeID = LZ4F_max256KB;
+  prefs_.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+
+  if (!opts.dictionary.empty()) {
+    cdict_ = LZ4F_createCDict(opts.dictionary.data(), opts.dictionary.size());
+    CHECK(cdict_);
+  }
+}
+
+Lz4Compressor::~Lz4Compressor() {
+  LZ4F_freeCDict(cdict_);
+  LZ4F_freeCompressionContext(cctx_);
+}
+
+error_code Lz4Compressor::Compress(Bytes in, bool end_frame, vector<uint8_t>* out) {
+  size_t pos = out->size();
+  auto append = [&](size_t bound, auto&& func) {
+    out->resize(pos + bound);
+    size_t res = func(out->data() + pos, bound);
+    if (LZ4F_isError(res)) {
+      LOG(ERROR) << "lz4 compression failed: " << LZ4F_getErrorName(res);
+      return false;
+    }
+    pos += res;
+    return true;
+  };
+
+  bool ok = true;
+  if (!frame_open_) {
+    ok = append(LZ4F_HEADER_SIZE_MAX, [&](uint8_t* dst, size_t cap) {
+      return cdict_ ? LZ4F_compressBegin_usingCDict(cctx_, dst, cap, cdict_, &prefs_)
+                    : LZ4F_compressBegin(cctx_, dst, cap, &prefs_);
+    });
+    frame_open_ = ok;
+  }
+
+  if (ok && !in.empty()) {
+    ok = append(LZ4F_compressBound(in.size(), &prefs_), [&](uint8_t* dst, size_t cap) {
+      return LZ4F_compressUpdate(cctx_, dst, cap, in.data(), in.size(), nullptr);
+    });
+  }
+
+  if (ok && end_frame) {
+    ok = append(LZ4F_compressBound(0, &prefs_), [&](uint8_t* dst, size_t cap) {
+      return LZ4F_compressEnd(cctx_, dst, cap, nullptr);
+    });
+    frame_open_ = !ok;
+  }
+
+  out->resize(pos);
+  return ok ? error_code{} : make_error_code(errc::invalid_argument);
+}
+
+class ZstdDecompressor final : public detail::Decompressor {
+ public:
+  explicit ZstdDecompressor(const DecompressOptions& opts);
+  ~ZstdDecompressor() {
+    ZSTD_freeDCtx(dctx_);
+  }
+
+  error_code Decompress(Bytes in, MutableBytes out, size_t* consumed, size_t* produced) final;
+
+ private:
+  ZSTD_DCtx* dctx_;
+};
+
+ZstdDecompressor::ZstdDecompressor(const DecompressOptions& opts) : dctx_(ZSTD_createDCtx()) {
+  CHECK(dctx_);
+  if (!opts.dictionary.empty()) {
+    size_t res = ZSTD_DCtx_loadDictionary(dctx_, opts.dictionary.data(), opts.dictionary.size());
+    CHECK(!ZSTD_isError(res)) << ZSTD_getErrorName(res);
+  }
+}
+
+error_code ZstdDecompressor::Decompress(Bytes in, MutableBytes out, size_t* consumed,
+                                        size_t* produced) {
+  ZSTD_inBuffer src{in.data(), in.size(), 0};
+  ZSTD_outBuffer dst{out.data(), out.size(), 0};
+
+  // Starts the next frame by itself after the end of the previous one.
+  size_t res = ZSTD_decompressStream(dctx_, &dst, &src);
+  if (ZSTD_isError(res)) {
+    VLOG(1) << "zstd decompression failed: " << ZSTD_getErrorName(res);
+    return CorruptedInput();
+  }
+
+  *consumed = src.pos;
+  *produced = dst.pos;
+  in_frame_ = res != 0;
+  return {};
+}
+
+class Lz4Decompressor final : public detail::Decompressor {
+ public:
+  explicit Lz4Decompressor(const DecompressOptions& opts);
+  ~Lz4Decompressor() {
+    LZ4F_freeDecompressionContext(dctx_);
+  }
+
+  error_code Decompress(Bytes in, MutableBytes out, size_t* consumed, size_t* produced) final;
+
+ private:
+  LZ4F_dctx* dctx_ = nullptr;
+  Bytes dict_;
+};
+
+Lz4Decompressor::Lz4Decompressor(const DecompressOptions& opts) : dict_(opts.dictionary) {
+  size_t res = LZ4F_createDecompressionContext(&dctx_, LZ4F_VERSION);
+  CHECK(!LZ4F_isError(res)) << LZ4F_getErrorName(res);
+}
+
+error_code Lz4Decompressor::Decompress(Bytes in, MutableBytes out, size_t* consumed,
+                                       size_t* produced) {
+  size_t src_size = in.size(), dst_size = out.size();
+
+  // Returns 0 once a frame is fully decoded, the next call starts a new frame.
+  size_t res = LZ4F_decompress_usingDict(dctx_, out.data(), &dst_size, in.data(), &src_size,
+                                         dict_.data(), dict_.size(), nullptr);
+  if (LZ4F_isError(res)) {
+    VLOG(1) << "lz4 decompression failed: " << LZ4F_getErrorName(res);
+    return CorruptedInput();
+  }
+
+  *consumed = src_size;
+  *produced = dst_size;
+  in_frame_ = res != 0;
+  return {};
+}
+
+}  // namespace
+
+CompressingSink::CompressingSink(Sink* upstream, const CompressOptions& opts)
+    : upstream_(upstream), offload_(opts.offload), block_size_(max<size_t>(opts.block_size, 1)) {
+  if (opts.codec == Codec::LZ4) {
+    compressor_ = make_unique<Lz4Compressor>(opts);
+  } else {
+    compressor_ = make_unique<ZstdCompressor>(opts);
+  }
+  block_.reserve(block_size_);
+}
+
+CompressingSink::~CompressingSink() {
+  LOG_IF(WARNING, frame_open_ || !block_.empty()) << "CompressingSink destroyed without Flush";
+}
+
+Result<size_t> CompressingSink::WriteSome(const iovec* v, uint32_t len) {
+  size_t total = 0;
+  for (const iovec* end = v + len; v != end; ++v) {
+    Bytes src(static_cast<const uint8_t*>(v->iov_base), v->iov_len);
+    while (!src.empty()) {
+      error_code ec;
+
+      // Whole blocks of large writes are compressed in place, without copying them.
+      if (block_.empty() && src.size() >= block_size_) {
+        Bytes blocks = src.first(src.size() - src.size() % block_size_);
+        ec = CompressBlock(blocks, false);
+        src.remove_prefix(blocks.size());
+        total += blocks.size();
+      } else {
+        size_t n = min(block_size_ - block_.size(), src.size());
+        block_.insert(block_.end(), src.begin(), src.begin() + n);
+        src.remove_prefix(n);
+        total += n;
+
+        if (block_.size() == block_size_) {
+          ec = CompressBlock(Bytes{block_.data(), block_.size()}, false);
+          block_.clear();
+        }
+      }
+
+      if (ec)
+        return make_unexpected(ec);
+    }
+  }
+  return total;
+}
+
+error_code CompressingSink::Flush() {
+  if (block_.empty() && !frame_open_)
+    return {};
+
+  error_code ec = CompressBlock(Bytes{block_.data(), block_.size()}, true);
+  block_.clear();
+  return ec;
+}
+
+error_code CompressingSink::WriteCompressedFrame(Bytes frame) {
+  if (error_code ec = Flush(); ec)
+    return ec;
+
+  compressed_bytes_ += frame.size();
+  return upstream_->Write(frame);
+}
+
+error_code CompressingSink::CompressBlock(Bytes block, bool end_frame) {
+  error_code ec;
+  auto compress = [&] { ec = compressor_->Compress(block, end_frame, &out_); };
+  if (offload_) {
+    offload_(compress);
+  } else {
+    compress();
+  }
+
+  if (ec)
+    return ec;
+
+  raw_bytes_ += block.size();
+  frame_open_ = !end_frame;
+  if (out_.empty())
+    return {};
+
+  compressed_bytes_ += out_.size();
+  ec = upstream_->Write(Bytes{out_.data(), out_.size()});
+  out_.clear();
+  return ec;
+}
+
+DecompressingSource::DecompressingSource(Source* upstream, const DecompressOptions& opts)
+    : upstream_(upstream), buf_(max<size_t>(opts.buf_size, 1)) {
+  if (opts.codec == Codec::LZ4) {
+    decompressor_ = make_unique<Lz4Decompressor>(opts);
+  } else {
+    decompressor_ = make_unique<ZstdDecompressor>(opts);
+  }
+}
+
+DecompressingSource::~DecompressingSource() {
+}
+
+Result<size_t> DecompressingSource::ReadSome(const iovec* v, uint32_t len) {
+  const iovec* end = v + len;
+  while (v != end && v->iov_len == 0)
+    ++v;
+  if (v == end)
+    return 0;
+
+  // Returning less than requested is allowed, hence we fill only the first entry.
+  MutableBytes dest(static_cast<uint8_t*>(v->iov_base), v->iov_len);
+  while (true) {
+    // The decompressor may hold decoded bytes even when the input is exhausted.
+    if (buf_pos_ < buf_len_ || decompressor_->in_frame()) {
+      size_t consumed = 0, produced = 0;
+      Bytes src{buf_.data() + buf_pos_, buf_len_ - buf_pos_};
+      error_code ec = decompressor_->Decompress(src, dest, &consumed, &produced);
+      if (ec)
+        return make_unexpected(ec);
+
+      buf_pos_ += consumed;
+      if (produced > 0)
+        return produced;
+
+      if (consumed > 0)  // consumed a header or a checksum.
+        continue;
+      DCHECK_EQ(buf_pos_, buf_len_);
+    }
+
+    Result<size_t> res = upstream_->ReadSome(MutableBytes{buf_.data(), buf_.size()});
+    if (!res)
+      return res;
+
+    if (*res == 0) {
+      if (decompressor_->in_frame())
+        return make_unexpected(make_error_code(errc::io_error));
+      return 0;
+    }
+    buf_pos_ = 0;
+    buf_len_ = *res;
+  }
+}
+
+}  // namespace io
@@ -0,0 +1,114 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "io/io.h"
+
+namespace io {
+
+enum class Codec : uint8_t { LZ4, ZSTD };
+
+namespace detail {
+class Compressor;
+class Decompressor;
+}  // namespace detail
+
+// Runs the function and returns once it completes, e.g. via FiberQueueThreadPool::Await,
+// so that the fiber waits without blocking its proactor thread.
+using OffloadFn = std::function<void(const std::function<void()>&)>;
+
+struct CompressOptions {
+  Codec codec = Codec::ZSTD;
+  int level = 0;  // 0 selects the default level of the codec.
+
+  // The input is buffered and compressed in blocks of this size.
+  size_t block_size = 1 << 17;
+
+  // Optional dictionary, must outlive the sink. The same dictionary must be passed to
+  // DecompressingSource.
+  Bytes dictionary;
+
+  // If set, the blocks are compressed via offload.
+  OffloadFn offload;
+};
+
+// Compresses the bytes written into it into standard LZ4 or ZSTD frames that are written to
+// upstream. The output is a sequence of frames that the lz4 and zstd tools can decompress.
+// Flush() must be called after the last write to end the frame.
+class CompressingSink : public Sink {
+ public:
+  CompressingSink(Sink* upstream, const CompressOptions& opts);
+  ~CompressingSink();
+
+  CompressingSink(const CompressingSink&) = delete;
+  CompressingSink& operator=(const CompressingSink&) = delete;
+
+  Result<size_t> WriteSome(const iovec* v, uint32_t len) final;
+
+  // Compresses the buffered bytes and ends the current frame. The following writes start a
+  // new frame.
+  std::error_code Flush();
+
+  // Ends the current frame and writes frame to upstream as is, without copying it.
+  // frame must consist of complete frames of the same codec, e.g. a block that was compressed
+  // before and is being forwarded.
+  std::error_code WriteCompressedFrame(Bytes frame);
+
+  uint64_t raw_bytes() const {
+    return raw_bytes_;
+  }
+
+  uint64_t compressed_bytes() const {
+    return compressed_bytes_;
+  }
+
+ private:
+  std::error_code CompressBlock(Bytes block, bool end_frame);
+
+  Sink* upstream_;
+  OffloadFn offload_;
+  std::unique_ptr<detail::Compressor> compressor_;
+
+  std::vector<uint8_t> block_;
+  size_t block_size_;
+  std::vector<uint8_t> out_;
+  bool frame_open_ = false;
+
+  uint64_t raw_bytes_ = 0, compressed_bytes_ = 0;
+};
+
+struct DecompressOptions {
+  Codec codec = Codec::ZSTD;
+  Bytes dictionary;  // must outlive the source.
+
+  size_t buf_size = 1 << 16;  // size of the reads from upstream.
+};
+
+// Reads the frames that CompressingSink writes, or any concatenation of LZ4 or ZSTD frames,
+// and returns the decompressed bytes. Fails with illegal_byte_sequence upon corrupted input
+// and with io_error if upstream ends in the middle of a frame.
+class DecompressingSource : public Source {
+ public:
+  DecompressingSource(Source* upstream, const DecompressOptions& opts);
+  ~DecompressingSource();
+
+  DecompressingSource(const DecompressingSource&) = delete;
+  DecompressingSource& operator=(const DecompressingSource&) = delete;
+
+  Result<size_t> ReadSome(const iovec* v, uint32_t len) final;
+
+ private:
+  Source* upstream_;
+  std::unique_ptr<detail::Decompressor> decompressor_;
+
+  std::vector<uint8_t> buf_;
+  size_t buf_pos_ = 0, buf_len_ = 0;
+};
+
+}  // namespace io
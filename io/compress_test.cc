@@ -0,0 +1,166 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "io/compress.h"
+
+#include <absl/strings/str_cat.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace io {
+
+using namespace std;
+
+class CompressTest : public testing::TestWithParam<Codec> {
+ protected:
+  static string MakeInput(size_t size) {
+    string res;
+    for (unsigned i = 0; res.size() < size; ++i)
+      absl::StrAppend(&res, "key:", i % 1000, " value:", i * 7, "\n");
+    res.resize(size);
+    return res;
+  }
+
+  // Reads src to the end with small reads, to cover the partial outputs.
+  static Result<string> ReadAll(Source* src) {
+    string res;
+    char buf[1000];
+    while (true) {
+      Result<size_t> n = src->ReadSome(MutableBuffer(buf));
+      if (!n)
+        return n.get_unexpected();
+      if (*n == 0)
+        return res;
+      res.append(buf, *n);
+    }
+  }
+};
+
+INSTANTIATE_TEST_SUITE_P(Codecs, CompressTest, testing::Values(Codec::LZ4, Codec::ZSTD),
+                         [](const auto& info) {
+                           return info.param == Codec::LZ4 ? string("LZ4") : string("ZSTD");
+                         });
+
+TEST_P(CompressTest, RoundTrip) {
+  string input = MakeInput(1 << 20);
+
+  StringSink compressed;
+  CompressOptions opts;
+  opts.codec = GetParam();
+  opts.block_size = 1 << 16;
+  unsigned offloaded = 0;
+  opts.offload = [&](const function<void()>& f) {
+    ++offloaded;
+    f();
+  };
+
+  CompressingSink sink(&compressed, opts);
+
+  // Small writes go through the block buffer, the large one is compressed in place.
+  ASSERT_FALSE(sink.Write(Buffer(string_view(input).substr(0, 100))));
+  ASSERT_FALSE(sink.Write(Buffer(string_view(input).substr(100, 500000))));
+  ASSERT_FALSE(sink.Write(Buffer(string_view(input).substr(500100))));
+  ASSERT_FALSE(sink.Flush());
+
+  EXPECT_EQ(input.size(), sink.raw_bytes());
+  EXPECT_EQ(compressed.str().size(), sink.compressed_bytes());
+  EXPECT_LT(compressed.str().size(), input.size() / 2);
+  EXPECT_GT(offloaded, 1u);
+
+  BytesSource src(compressed.str());
+  DecompressOptions dopts;
+  dopts.codec = GetParam();
+  DecompressingSource dsrc(&src, dopts);
+  Result<string> res = ReadAll(&dsrc);
+  ASSERT_TRUE(res) << res.error();
+  EXPECT_TRUE(*res == input);
+}
+
+TEST_P(CompressTest, Dictionary) {
+  string dict = MakeInput(4096);
+  string input = "key:17 value:119\nkey:18 value:126\n";
+
+  CompressOptions opts;
+  opts.codec = GetParam();
+  opts.dictionary = Buffer(dict);
+
+  StringSink with_dict, without_dict;
+  {
+    CompressingSink sink(&with_dict, opts);
+    ASSERT_FALSE(sink.Write(Buffer(input)));
+    ASSERT_FALSE(sink.Flush());
+  }
+  {
+    opts.dictionary = {};
+    CompressingSink sink(&without_dict, opts);
+    ASSERT_FALSE(sink.Write(Buffer(input)));
+    ASSERT_FALSE(sink.Flush());
+  }
+  EXPECT_LT(with_dict.str().size(), without_dict.str().size());
+
+  BytesSource src(with_dict.str());
+  DecompressOptions dopts;
+  dopts.codec = GetParam();
+  dopts.dictionary = Buffer(dict);
+  DecompressingSource dsrc(&src, dopts);
+  Result<string> res = ReadAll(&dsrc);
+  ASSERT_TRUE(res) << res.error();
+  EXPECT_EQ(input, *res);
+}
+
+TEST_P(CompressTest, CompressedFramePassThrough) {
+  CompressOptions opts;
+  opts.codec = GetParam();
+
+  StringSink frame;
+  {
+    CompressingSink sink(&frame, opts);
+    ASSERT_FALSE(sink.Write(Buffer("forwarded ")));
+    ASSERT_FALSE(sink.Flush());
+  }
+
+  StringSink out;
+  CompressingSink sink(&out, opts);
+  ASSERT_FALSE(sink.Write(Buffer("local ")));
+  ASSERT_FALSE(sink.WriteCompressedFrame(Buffer(frame.str())));
+  ASSERT_FALSE(sink.Write(Buffer("tail")));
+  ASSERT_FALSE(sink.Flush());
+
+  BytesSource src(out.str());
+  DecompressOptions dopts;
+  dopts.codec = GetParam();
+  DecompressingSource dsrc(&src, dopts);
+  Result<string> res = ReadAll(&dsrc);
+  ASSERT_TRUE(res) << res.error();
+  EXPECT_EQ("local forwarded tail", *res);
+}
+
+TEST_P(CompressTest, Truncated) {
+  string input = MakeInput(10000);
+  CompressOptions opts;
+  opts.codec = GetParam();
+
+  StringSink compressed;
+  CompressingSink sink(&compressed, opts);
+  ASSERT_FALSE(sink.Write(Buffer(input)));
+  ASSERT_FALSE(sink.Flush());
+
+  string truncated = compressed.str().substr(0, compressed.str().size() - 3);
+  BytesSource src(truncated);
+  DecompressOptions dopts;
+  dopts.codec = GetParam();
+  DecompressingSource dsrc(&src, dopts);
+  Result<string> res = ReadAll(&dsrc);
+  ASSERT_FALSE(res);
+  EXPECT_EQ(errc::io_error, res.error());
+
+  string corrupted = compressed.str();
+  corrupted[corrupted.size() / 2] ^= 0xFF;
+  BytesSource src2(corrupted);
+  DecompressingSource dsrc2(&src2, dopts);
+  EXPECT_FALSE(ReadAll(&dsrc2));
+}
+
+}  // namespace io
@@ -194,6 +194,10 @@ bool Delete(std::string_view name) {
 ReadonlyFile::~ReadonlyFile() {
 }
 
+Result<Bytes> ReadonlyFile::ReadView(size_t offset, size_t len) {
+  return make_unexpected(make_error_code(errc::operation_not_supported));
+}
+
 expected<ReadonlyFile*, ::error_code> OpenRead(std::string_view name,
                                                const ReadonlyFile::Options& opts) {
   int fd = open(name.data(), O_RDONLY);
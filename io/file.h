@@ -55,6 +55,11 @@ class ReadonlyFile {
   // If 0 is returned then EOF is definitely reached.
   ABSL_MUST_USE_RESULT virtual Result<size_t> Read(size_t offset, const iovec* v, uint32_t len) = 0;
 
+  // Returns a zero-copy view of up to len bytes at offset, shorter at the end of the file.
+  // The view stays valid until Close(). Only the memory-mapped implementations support it,
+  // the others return errc::operation_not_supported.
+  ABSL_MUST_USE_RESULT virtual Result<Bytes> ReadView(size_t offset, size_t len);
+
   // releases the system handle for this file. Does not delete `this` instance.
   ABSL_MUST_USE_RESULT virtual ::std::error_code Close() = 0;
 
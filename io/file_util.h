@@ -22,6 +22,9 @@ using StatShortVec = std::vector<StatShort>;
 
 Result<StatShortVec> StatFiles(std::string_view path);
 
+// Returns the paths that match the glob pattern, without stating them.
+Result<std::vector<std::string>> ExpandGlob(std::string_view path);
+
 // Create a file and write a std::string to it.
 void WriteStringToFileOrDie(std::string_view contents, std::string_view name);
 
@@ -0,0 +1,135 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "io/flat_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "base/hash.h"
+#include "base/logging.h"
+#include "io/file.h"
+
+namespace io {
+
+using namespace std;
+using nonstd::make_unexpected;
+
+static_assert(sizeof(FlatFileHeader) <= kFlatPayloadOffset);
+
+namespace {
+
+error_code InvalidFile(string_view path, string_view reason) {
+  VLOG(1) << "Invalid flat file " << path << ": " << reason;
+  return make_error_code(errc::invalid_argument);
+}
+
+}  // namespace
+
+error_code WriteFlatFile(string_view path, FlatFileHeader header,
+                         absl::Span<const uint8_t> payload) {
+  header.payload_offset = kFlatPayloadOffset;
+  header.payload_size = payload.size();
+  header.checksum = XXH3_64bits(payload.data(), payload.size());
+
+  string tmp_path = string(path) + ".tmp";
+  Result<WriteFile*> res = OpenWrite(tmp_path);
+  if (!res)
+    return res.error();
+  unique_ptr<WriteFile> file(*res);
+
+  uint8_t header_page[kFlatPayloadOffset] = {0};
+  memcpy(header_page, &header, sizeof(header));
+
+  error_code ec = file->Write(header_page, sizeof(header_page));
+  if (!ec && !payload.empty())
+    ec = file->Write(payload);
+  error_code close_ec = file->Close();
+  if (!ec)
+    ec = close_ec;
+
+  if (!ec && rename(tmp_path.c_str(), string(path).c_str()) != 0)
+    ec = StatusFileError();
+  if (ec)
+    Delete(tmp_path);
+  return ec;
+}
+
+auto MappedFlatFile::Open(string_view path, FlatKind kind, const Options& opts)
+    -> Result<unique_ptr<MappedFlatFile>> {
+  string spath(path);
+  int fd = open(spath.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return make_unexpected(StatusFileError());
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    error_code ec = StatusFileError();
+    close(fd);
+    return make_unexpected(ec);
+  }
+
+  size_t size = st.st_size;
+  if (size < kFlatPayloadOffset) {
+    close(fd);
+    return make_unexpected(InvalidFile(path, "too short"));
+  }
+
+  int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+  if (opts.populate)
+    flags |= MAP_POPULATE;
+#endif
+
+  void* map = mmap(nullptr, size, PROT_READ, flags, fd, 0);
+  error_code ec = map == MAP_FAILED ? StatusFileError() : error_code{};
+  close(fd);  // the mapping keeps the file referenced.
+  if (ec)
+    return make_unexpected(ec);
+
+  unique_ptr<MappedFlatFile> res(new MappedFlatFile(reinterpret_cast<const uint8_t*>(map), size));
+  const FlatFileHeader& header = res->header();
+
+  if (header.magic != FlatFileHeader::kMagic)
+    return make_unexpected(InvalidFile(path, "bad magic"));
+  if (header.version != FlatFileHeader::kVersion)
+    return make_unexpected(InvalidFile(path, "unsupported version"));
+  if (header.byte_order != FlatFileHeader::kByteOrderMark)
+    return make_unexpected(InvalidFile(path, "different byte order"));
+  if (header.kind != uint32_t(kind))
+    return make_unexpected(InvalidFile(path, "wrong kind"));
+  if (header.payload_offset < sizeof(FlatFileHeader) || header.payload_offset > size ||
+      header.payload_size > size - header.payload_offset) {
+    return make_unexpected(InvalidFile(path, "truncated"));
+  }
+
+  if (opts.verify_checksum) {
+    absl::Span<const uint8_t> payload = res->payload();
+    if (XXH3_64bits(payload.data(), payload.size()) != header.checksum)
+      return make_unexpected(InvalidFile(path, "checksum mismatch"));
+  }
+
+  return res;
+}
+
+MappedFlatFile::~MappedFlatFile() {
+  munmap(const_cast<uint8_t*>(map_), map_size_);
+}
+
+error_code SaveCuckooMap(const base::CuckooMapTableWrapperBase& map, string_view path) {
+  pair<const uint8_t*, size_t> buf;
+  map.GetBufferData(&buf);
+
+  FlatFileHeader header;
+  header.kind = uint32_t(FlatKind::kCuckooMap);
+  header.elem_size = map.value_size();
+  header.count = map.size();
+  header.capacity = map.Capacity();
+  header.empty_key = map.empty_value();
+  return WriteFlatFile(path, header, {buf.first, buf.second});
+}
+
+}  // namespace io
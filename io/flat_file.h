@@ -0,0 +1,157 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/types/span.h>
+
+#include <memory>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+
+#include "base/cuckoo_map.h"
+#include "base/pod_array.h"
+#include "io/io.h"
+
+namespace io {
+
+/* Flat file format for in-memory structures that can be used directly from a read-only
+   memory mapping, without parsing or copying.
+
+   A file consists of a FlatFileHeader padded to kFlatPayloadOffset followed by the payload,
+   which is the raw memory image of the structure. The payload has no pointers, hence it is
+   position independent. The layout is of the host that wrote the file: the header records
+   the byte order and the element size, and files that do not match are rejected.
+*/
+enum class FlatKind : uint32_t {
+  kCuckooMap = 1,
+  kPODArray = 2,
+};
+
+struct FlatFileHeader {
+  static constexpr uint64_t kMagic = 0x454C4946'54414C46ULL;  // "FLATFILE".
+  static constexpr uint32_t kVersion = 1;
+  static constexpr uint32_t kByteOrderMark = 0x01020304;
+
+  uint64_t magic = kMagic;
+  uint32_t version = kVersion;
+  uint32_t byte_order = kByteOrderMark;
+  uint32_t kind = 0;       // FlatKind
+  uint32_t elem_size = 0;  // value size for CuckooMap, element size for PODArray.
+  uint64_t payload_offset = 0;
+  uint64_t payload_size = 0;
+  uint64_t count = 0;      // the number of items.
+  uint64_t capacity = 0;   // the number of slots for CuckooMap.
+  uint64_t empty_key = 0;  // CuckooMap only.
+  uint64_t checksum = 0;   // XXH3 of the payload.
+};
+
+// The payload starts at a page boundary, so the mapped payload is page aligned.
+constexpr size_t kFlatPayloadOffset = 4096;
+
+// Writes header and payload into path. The file is written under a temporary name and
+// renamed at the end, hence path is either intact or fully written.
+// header.payload_offset, payload_size and checksum are filled by this function.
+std::error_code WriteFlatFile(std::string_view path, FlatFileHeader header,
+                              absl::Span<const uint8_t> payload);
+
+// Read-only mapping of a flat file.
+class MappedFlatFile {
+ public:
+  struct Options {
+    bool verify_checksum = false;  // reads the whole payload.
+    bool populate = false;         // prefaults the mapping.
+    Options() {
+    }
+  };
+
+  // Maps the file and validates its header. Fails with errc::invalid_argument if the file
+  // is not a flat file of the given kind or was written by an incompatible version.
+  static Result<std::unique_ptr<MappedFlatFile>> Open(std::string_view path, FlatKind kind,
+                                                      const Options& opts = Options{});
+
+  MappedFlatFile(const MappedFlatFile&) = delete;
+  MappedFlatFile& operator=(const MappedFlatFile&) = delete;
+
+  ~MappedFlatFile();
+
+  const FlatFileHeader& header() const {
+    return *reinterpret_cast<const FlatFileHeader*>(map_);
+  }
+
+  absl::Span<const uint8_t> payload() const {
+    return {map_ + header().payload_offset, header().payload_size};
+  }
+
+ private:
+  MappedFlatFile(const uint8_t* map, size_t size) : map_(map), map_size_(size) {
+  }
+
+  const uint8_t* map_;
+  size_t map_size_;
+};
+
+// CuckooMap, CuckooSet or any other CuckooMapTableWrapperBase.
+std::error_code SaveCuckooMap(const base::CuckooMapTableWrapperBase& map, std::string_view path);
+
+// Read-only CuckooMap whose buckets reside in a mapped flat file.
+template <typename T> class MappedCuckooMap {
+ public:
+  static Result<std::unique_ptr<MappedCuckooMap>> Open(
+      std::string_view path, const MappedFlatFile::Options& opts = MappedFlatFile::Options{});
+
+  const base::CuckooMap<T>& map() const {
+    return map_;
+  }
+
+ private:
+  MappedCuckooMap() = default;
+
+  std::unique_ptr<MappedFlatFile> file_;
+  base::CuckooMap<T> map_;
+};
+
+template <typename T, size_t A>
+std::error_code SavePODArray(const base::PODArray<T, A>& arr, std::string_view path) {
+  FlatFileHeader header;
+  header.kind = uint32_t(FlatKind::kPODArray);
+  header.elem_size = sizeof(T);
+  header.count = arr.size();
+  return WriteFlatFile(
+      path, header, {reinterpret_cast<const uint8_t*>(arr.data()), arr.size() * sizeof(T)});
+}
+
+// Returns the elements of a flat file written by SavePODArray. The span is valid as long as
+// file is alive. Returns an empty span if the element size does not match.
+template <typename T> absl::Span<const T> FlatArray(const MappedFlatFile& file) {
+  static_assert(std::is_trivially_copyable<T>::value, "");
+  const FlatFileHeader& header = file.header();
+  if (header.kind != uint32_t(FlatKind::kPODArray) || header.elem_size != sizeof(T))
+    return {};
+  return {reinterpret_cast<const T*>(file.payload().data()), header.count};
+}
+
+// Implementation
+/******************************************************************/
+template <typename T>
+auto MappedCuckooMap<T>::Open(std::string_view path, const MappedFlatFile::Options& opts)
+    -> Result<std::unique_ptr<MappedCuckooMap>> {
+  auto file = MappedFlatFile::Open(path, FlatKind::kCuckooMap, opts);
+  if (!file)
+    return nonstd::make_unexpected(file.error());
+
+  std::unique_ptr<MappedCuckooMap> res(new MappedCuckooMap);
+  const FlatFileHeader& header = (*file)->header();
+  absl::Span<const uint8_t> payload = (*file)->payload();
+  if (header.elem_size != sizeof(T) ||
+      !res->map_.AttachReadOnly(payload.data(), payload.size(), header.capacity, header.count,
+                                header.empty_key)) {
+    return nonstd::make_unexpected(std::make_error_code(std::errc::invalid_argument));
+  }
+  res->file_ = std::move(*file);
+  return res;
+}
+
+}  // namespace io
@@ -0,0 +1,79 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "io/flat_file.h"
+
+#include "base/gtest.h"
+#include "io/file_util.h"
+
+namespace io {
+
+using namespace std;
+
+class FlatFileTest : public ::testing::Test {
+ protected:
+};
+
+TEST_F(FlatFileTest, CuckooMap) {
+  base::CuckooMap<uint64_t> m;
+  m.SetEmptyKey(0);
+  for (uint64_t k = 1; k <= 10000; ++k) {
+    m.Insert(k * 7, k);
+  }
+
+  string path = base::GetTestTempPath("map.flat");
+  ASSERT_FALSE(SaveCuckooMap(m, path));
+
+  MappedFlatFile::Options opts;
+  opts.verify_checksum = true;
+  auto res = MappedCuckooMap<uint64_t>::Open(path, opts);
+  ASSERT_TRUE(res) << res.error().message();
+
+  const base::CuckooMap<uint64_t>& mapped = (*res)->map();
+  EXPECT_EQ(m.size(), mapped.size());
+  EXPECT_EQ(m.Capacity(), mapped.Capacity());
+  for (uint64_t k = 1; k <= 10000; ++k) {
+    auto id = mapped.find(k * 7);
+    ASSERT_EQ(m.find(k * 7), id);
+    ASSERT_EQ(k, *mapped.FromDenseId(id).second);
+  }
+  EXPECT_EQ(base::CuckooMapTable::npos, mapped.find(8));
+
+  // The size of the value must match.
+  EXPECT_FALSE(MappedCuckooMap<uint32_t>::Open(path));
+}
+
+TEST_F(FlatFileTest, PODArray) {
+  base::PODArray<uint32_t> arr;
+  for (uint32_t i = 0; i < 1000; ++i) {
+    arr.push_back(i * i);
+  }
+
+  string path = base::GetTestTempPath("arr.flat");
+  ASSERT_FALSE(SavePODArray(arr, path));
+
+  auto res = MappedFlatFile::Open(path, FlatKind::kPODArray);
+  ASSERT_TRUE(res);
+  absl::Span<const uint32_t> span = FlatArray<uint32_t>(**res);
+  ASSERT_EQ(arr.size(), span.size());
+  for (uint32_t i = 0; i < 1000; ++i) {
+    ASSERT_EQ(i * i, span[i]);
+  }
+  EXPECT_TRUE(FlatArray<uint64_t>(**res).empty());
+  EXPECT_FALSE(MappedFlatFile::Open(path, FlatKind::kCuckooMap));
+}
+
+TEST_F(FlatFileTest, Invalid) {
+  string path = base::GetTestTempPath("bad.flat");
+  WriteStringToFileOrDie(string(kFlatPayloadOffset, 'x'), path);
+  auto res = MappedFlatFile::Open(path, FlatKind::kPODArray);
+  ASSERT_FALSE(res);
+  EXPECT_EQ(errc::invalid_argument, res.error());
+
+  WriteStringToFileOrDie("short", path);
+  EXPECT_FALSE(MappedFlatFile::Open(path, FlatKind::kPODArray));
+  EXPECT_FALSE(MappedFlatFile::Open(base::GetTestTempPath("missing.flat"), FlatKind::kPODArray));
+}
+
+}  // namespace io
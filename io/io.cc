@@ -4,10 +4,12 @@
 #include "io/io.h"
 
 #include <absl/container/fixed_array.h>
+#include <absl/container/inlined_vector.h>
 
 #include <cstring>
 
 #include "base/logging.h"
+#include "io/shared_buf.h"
 
 using namespace std;
 
@@ -33,6 +35,7 @@ struct AsyncWriteState {
   AsyncSink::AsyncCb cb;
   iovec* cur;
   AsyncSink* owner;
+  absl::InlinedVector<SharedBuf, 2> refs;  // keep the shared buffers alive until cb is called.
 
   AsyncWriteState(AsyncSink* sink, const iovec* v, uint32_t length) : arr(length), owner(sink) {
     cur = arr.data();
@@ -165,10 +168,80 @@ Result<size_t> StringSink::WriteSome(const iovec* ptr, uint32_t len) {
   return res;
 }
 
+BufferedSink::BufferedSink(Sink* upstream, size_t buf_size)
+    : upstream_(upstream), buf_(new uint8_t[buf_size]), capacity_(buf_size) {
+  DCHECK_GT(buf_size, 0u);
+}
+
+Result<size_t> BufferedSink::WriteSome(const iovec* v, uint32_t len) {
+  // Copies the small entries while they fit.
+  uint32_t i = 0;
+  size_t copied = 0;
+  for (; i < len; ++i) {
+    size_t sz = v[i].iov_len;
+    if (sz >= capacity_ / 2 || sz > capacity_ - size_)
+      break;
+    memcpy(buf_.get() + size_, v[i].iov_base, sz);
+    size_ += sz;
+    copied += sz;
+  }
+
+  if (i == len)
+    return copied;
+
+  // Gathers the buffered bytes and the rest of the entries into one write.
+  constexpr uint32_t kMaxIov = 64;
+  absl::InlinedVector<iovec, 16> iov;
+  if (size_)
+    iov.push_back(iovec{buf_.get(), size_});
+  size_t passed = 0;
+  for (; i < len && iov.size() < kMaxIov; ++i) {
+    iov.push_back(v[i]);
+    passed += v[i].iov_len;
+  }
+
+  error_code ec = upstream_->Write(iov.data(), iov.size());
+  if (ec)
+    return nonstd::make_unexpected(ec);
+  size_ = 0;
+  return copied + passed;
+}
+
+error_code BufferedSink::Flush() {
+  if (size_ == 0)
+    return {};
+
+  error_code ec = upstream_->Write(Bytes{buf_.get(), size_});
+  if (!ec)
+    size_ = 0;
+  return ec;
+}
+
 void AsyncSink::AsyncWrite(const iovec* v, uint32_t len, AsyncCb cb) {
   AsyncWriteState* state = new AsyncWriteState(this, v, len);
   state->cb = std::move(cb);
   AsyncWriteSome(state->arr.data(), len, [state](Result<size_t> res) { state->OnCb(res); });
 }
 
+void AsyncSink::AsyncWrite(absl::Span<const SharedBuf> bufs, AsyncCb cb) {
+  absl::InlinedVector<iovec, 4> v;
+  for (const SharedBuf& buf : bufs) {
+    if (!buf.empty())
+      v.push_back(buf.AsIovec());
+  }
+  if (v.empty()) {
+    cb(error_code{});
+    return;
+  }
+
+  AsyncWriteState* state = new AsyncWriteState(this, v.data(), v.size());
+  state->cb = std::move(cb);
+  state->refs.assign(bufs.begin(), bufs.end());
+  AsyncWriteSome(state->arr.data(), v.size(), [state](Result<size_t> res) { state->OnCb(res); });
+}
+
+void AsyncSink::AsyncWrite(const SharedBuf& buf, AsyncCb cb) {
+  AsyncWrite(absl::MakeConstSpan(&buf, 1), std::move(cb));
+}
+
 }  // namespace io
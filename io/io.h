@@ -7,13 +7,17 @@
 #include <absl/types/span.h>
 #include <sys/uio.h>
 
+#include <memory>
 #include <string_view>
 
 #include "base/expected.hpp"
+#include "base/small_function.h"
 #include "io/io_buf.h"
 
 namespace io {
 
+class SharedBuf;
+
 using MutableBytes = absl::Span<uint8_t>;
 using Bytes = absl::Span<const uint8_t>;
 
@@ -160,8 +164,9 @@ class Sink {
 
 class AsyncSink {
  public:
-  using AsyncProgressCb = std::function<void(Result<size_t>)>;
-  using AsyncCb = std::function<void(std::error_code)>;
+  // Move-only, closures of up to 48 bytes do not allocate.
+  using AsyncProgressCb = base::SmallFunction<48, void(Result<size_t>)>;
+  using AsyncCb = base::SmallFunction<48, void(std::error_code)>;
 
   // Dispatches the write call asynchronously and immediately exits.
   // The caller must make sure that (v, len) are valid until cb is called.
@@ -175,6 +180,13 @@ class AsyncSink {
     iovec v{const_cast<uint8_t*>(buf.data()), buf.size()};
     AsyncWrite(&v, 1, std::move(cb));
   }
+
+  // Writes the buffers to completion and keeps references to them until cb is called, so the
+  // caller may drop its own references right away and queue the same buffers to other sinks.
+  // Sockets complete zero-copy writes only once the kernel has released the data, hence
+  // the buffers are not freed while the kernel still references them.
+  void AsyncWrite(absl::Span<const SharedBuf> bufs, AsyncCb cb);
+  void AsyncWrite(const SharedBuf& buf, AsyncCb cb);
 };
 
 // Transparently prefixes any source with a byte slice.
@@ -259,6 +271,28 @@ class StringSink final : public Sink {
   std::string str_;
 };
 
+// Coalesces small writes into a buffer that is written to upstream once it fills up or upon
+// Flush(). Writes of at least half of the buffer are not copied: they are gathered with the
+// buffered bytes and the rest of the vector into a single upstream write. Does not flush upon
+// destruction, Flush() must be called explicitly.
+class BufferedSink final : public Sink {
+ public:
+  explicit BufferedSink(Sink* upstream, size_t buf_size = 1 << 16);
+
+  Result<size_t> WriteSome(const iovec* v, uint32_t len) final;
+
+  std::error_code Flush();
+
+  size_t buffered() const {
+    return size_;
+  }
+
+ private:
+  Sink* upstream_;
+  std::unique_ptr<uint8_t[]> buf_;
+  size_t capacity_, size_ = 0;
+};
+
 template <typename SomeFunc>
 std::error_code ApplyExactly(const iovec* v, uint32_t len, SomeFunc&& func) {
   const iovec* endv = v + len;
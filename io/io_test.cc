@@ -4,18 +4,26 @@
 
 #include "io/io.h"
 
+#include <absl/strings/str_cat.h>
 #include <gmock/gmock.h>
 
+#include <sys/syscall.h>
+
 #include <deque>
+#include <thread>
 
 #include "base/gtest.h"
 #include "base/logging.h"
+#include "io/checksum.h"
 #include "io/line_reader.h"
 #include "io/proc_reader.h"
+#include "io/shared_buf.h"
 
 using namespace std;
 using ::testing::_;
 using testing::Pair;
+using testing::ElementsAre;
+using testing::IsEmpty;
 using testing::UnorderedElementsAre;
 
 namespace io {
@@ -50,6 +58,51 @@ Result<size_t> FakeSink::WriteSome(const iovec* v, uint32_t len) {
   return io_res;
 }
 
+// Writes up to 3 bytes per call and completes the call only upon Complete().
+class FakeAsyncSink : public AsyncSink {
+ public:
+  void AsyncWriteSome(const iovec* v, uint32_t len, AsyncProgressCb cb) final {
+    pending_sz = std::min<size_t>(v->iov_len, 3);
+    value.append(reinterpret_cast<char*>(v->iov_base), pending_sz);
+    pending = std::move(cb);
+  }
+
+  // Returns false if no call is pending.
+  bool Complete() {
+    if (!pending)
+      return false;
+    AsyncProgressCb cb = std::move(pending);
+    pending = nullptr;
+    cb(pending_sz);
+    return true;
+  }
+
+  AsyncProgressCb pending;
+  size_t pending_sz = 0;
+  string value;
+};
+
+// Counts the bytes that are allocated and not freed.
+class CountingResource : public PMR_NS::memory_resource {
+ public:
+  size_t used = 0;
+
+ private:
+  void* do_allocate(size_t bytes, size_t alignment) final {
+    used += bytes;
+    return PMR_NS::new_delete_resource()->allocate(bytes, alignment);
+  }
+
+  void do_deallocate(void* p, size_t bytes, size_t alignment) final {
+    used -= bytes;
+    PMR_NS::new_delete_resource()->deallocate(p, bytes, alignment);
+  }
+
+  bool do_is_equal(const PMR_NS::memory_resource& o) const noexcept final {
+    return this == &o;
+  }
+};
+
 class IoTest : public testing::Test {
  protected:
 };
@@ -72,6 +125,74 @@ TEST_F(IoTest, Write) {
   EXPECT_EQ("0123456789abcdefghij9876543210", sink.value);
 }
 
+TEST_F(IoTest, BufferedSink) {
+  class CountingSink : public Sink {
+   public:
+    Result<size_t> WriteSome(const iovec* v, uint32_t len) final {
+      ++calls;
+      return str.WriteSome(v, len);
+    }
+
+    StringSink str;
+    unsigned calls = 0;
+  };
+
+  CountingSink upstream;
+  BufferedSink sink(&upstream, 1024);
+  string expected;
+  for (unsigned i = 0; i < 1000; ++i) {
+    string rec = absl::StrCat("record ", i, "\n");
+    ASSERT_FALSE(sink.Write(Buffer(rec)));
+    expected.append(rec);
+  }
+  EXPECT_LT(upstream.calls, 20u);
+
+  // The large write is gathered with the buffered bytes and the small one that follows it.
+  unsigned calls = upstream.calls;
+  string large(4096, 'x'), small("tail");
+  iovec v[2] = {{large.data(), large.size()}, {small.data(), small.size()}};
+  ASSERT_FALSE(sink.Write(v, 2));
+  EXPECT_EQ(calls + 1, upstream.calls);
+  EXPECT_EQ(0u, sink.buffered());
+  expected.append(large).append(small);
+
+  ASSERT_FALSE(sink.Write(Buffer("end")));
+  EXPECT_EQ(3u, sink.buffered());
+  ASSERT_FALSE(sink.Flush());
+  expected.append("end");
+  EXPECT_EQ(expected, upstream.str.str());
+}
+
+TEST_F(IoTest, Checksum) {
+  string data;
+  for (unsigned i = 0; i < 1000; ++i)
+    data.append(absl::StrCat(i, ","));
+
+  for (auto engine : {base::Hasher::kCRC32C, base::Hasher::kXXH3}) {
+    uint64_t expected = base::Hasher::Hash(engine, data.data(), data.size());
+
+    // Partial writes are hashed only up to what upstream has accepted.
+    FakeSink fake;
+    for (size_t i = 0; i < data.size(); i += 7)
+      fake.call_sz.push_back(7);
+    ChecksumSink sink(&fake, engine);
+    ASSERT_FALSE(sink.Write(Buffer(data)));
+    EXPECT_EQ(data, fake.value);
+    EXPECT_EQ(expected, sink.Digest());
+
+    BytesSource bsrc(data);
+    ChecksumSource src(&bsrc, engine);
+    char buf[100];
+    while (true) {
+      auto res = src.ReadSome(MutableBuffer(buf));
+      ASSERT_TRUE(res);
+      if (*res == 0)
+        break;
+    }
+    EXPECT_EQ(expected, src.Digest());
+  }
+}
+
 TEST_F(IoTest, LineReader) {
   BytesSource ss("one\ntwo\r\nthree");
   LineReader lr(&ss, DO_NOT_TAKE_OWNERSHIP);
@@ -85,6 +206,63 @@ TEST_F(IoTest, LineReader) {
   EXPECT_EQ("three", result);
 }
 
+TEST_F(IoTest, LineReaderBatch) {
+  string contents;
+  vector<string> expected;
+  for (unsigned i = 0; i < 2000; ++i) {
+    // Some lines are longer than the buffer of the reader.
+    string line(i % 7 == 0 ? (i * 31) % 3000 : i % 50, 'a' + i % 26);
+    contents.append(line).append(i % 3 ? "\n" : "\r\n");
+    expected.push_back(std::move(line));
+  }
+  contents.append("last");
+  expected.push_back("last");
+
+  BytesSource ss(contents);
+  LineReader lr(&ss, DO_NOT_TAKE_OWNERSHIP, 11);
+
+  size_t index = 0;
+  while (true) {
+    auto batch = lr.NextBatch();
+    if (batch.empty())
+      break;
+    for (string_view line : batch) {
+      ASSERT_LT(index, expected.size());
+      ASSERT_EQ(expected[index], line) << index;
+      ++index;
+    }
+  }
+
+  EXPECT_FALSE(lr.status());
+  EXPECT_EQ(expected.size(), index);
+  EXPECT_EQ(expected.size(), lr.line_num());
+}
+
+TEST_F(IoTest, LineReaderBatchLimit) {
+  // The long line crosses the buffer boundary in the first case and is buffered in the second.
+  for (size_t prefix : {3000u, 10u}) {
+    string contents = string(prefix, 'a') + "\nshort\n" + string(100, 'b') + "\nafter\n";
+    BytesSource ss(contents);
+    LineReader lr(&ss, DO_NOT_TAKE_OWNERSHIP, 11);
+    lr.set_line_len_limit(50);
+
+    vector<string> lines;
+    while (true) {
+      auto batch = lr.NextBatch();
+      if (batch.empty())
+        break;
+      lines.insert(lines.end(), batch.begin(), batch.end());
+    }
+
+    EXPECT_EQ(errc::message_size, lr.status()) << prefix;
+    if (prefix < 50) {
+      EXPECT_THAT(lines, ElementsAre(string(prefix, 'a'), "short")) << prefix;
+    } else {
+      EXPECT_THAT(lines, IsEmpty()) << prefix;
+    }
+  }
+}
+
 TEST_F(IoTest, ProcReader) {
 #ifdef __APPLE__
   GTEST_SKIP() << "Skipped IoTest.ProcReader test on MacOS";
@@ -111,6 +289,29 @@ TEST_F(IoTest, ProcReader) {
   EXPECT_GT(self_stat->start_time_sec, 0);
   EXPECT_EQ(0, self_stat->maj_flt);
 
+  auto thread_stat = ReadThreadStat();
+  ASSERT_TRUE(thread_stat);
+  EXPECT_GE(thread_stat->cpu, 0);
+
+  uint64_t cpu_usec = thread_stat->user_usec + thread_stat->system_usec;
+  std::thread([cpu_usec, tid = syscall(SYS_gettid)] {
+    auto other = ReadThreadStat(tid);
+    ASSERT_TRUE(other);
+    EXPECT_GE(other->user_usec + other->system_usec, cpu_usec);
+    EXPECT_FALSE(ReadThreadStat(1 << 30));
+  }).join();
+
+  // PSI and cgroup v2 are not available everywhere.
+  auto pressure = ReadMemoryPressure();
+  if (pressure) {
+    EXPECT_GE(pressure->some_total_usec, pressure->full_total_usec);
+    EXPECT_GE(pressure->some_avg10, pressure->full_avg10);
+  }
+
+  auto mem_events = ReadCgroupMemoryEvents();
+  if (mem_events)
+    EXPECT_FALSE(CgroupV2Dir().empty());
+
   auto dist_info = ReadDistributionInfo();
   EXPECT_TRUE(dist_info);
   const DistributionInfo& dinfo = *dist_info;
@@ -156,4 +357,55 @@ TEST_F(IoTest, IoBuf) {
   ASSERT_EQ(fetched, test);
 }
 
+TEST_F(IoTest, SharedBuf) {
+  SharedBuf empty;
+  EXPECT_EQ(0u, empty.use_count());
+  EXPECT_TRUE(empty.Slice(1).empty());
+
+  CountingResource mr;
+  SharedBuf buf = SharedBuf::Copy(Buffer("hello world"), &mr);
+  EXPECT_GT(mr.used, 11u);
+  EXPECT_EQ(1u, buf.use_count());
+
+  SharedBuf hello = buf.Slice(0, 5), world = buf.Slice(6);
+  EXPECT_EQ("hello", View(hello.bytes()));
+  EXPECT_EQ("world", View(world.bytes()));
+  EXPECT_TRUE(buf.Slice(20).empty());
+  EXPECT_EQ(4u, buf.use_count());
+
+  // Fans out the slices to several sinks, the last completion frees the buffer.
+  FakeAsyncSink sinks[3];
+  unsigned num_done = 0;
+  SharedBuf parts[] = {hello, buf.Slice(5, 1), world, SharedBuf{}};
+  for (auto& sink : sinks) {
+    sink.AsyncWrite(parts, [&](error_code ec) {
+      EXPECT_FALSE(ec);
+      ++num_done;
+    });
+  }
+  for (auto& part : parts)
+    part.Reset();
+  buf.Reset();
+  hello.Reset();
+  world.Reset();
+  EXPECT_GT(mr.used, 0u);
+
+  bool progress = true;
+  while (progress) {
+    progress = false;
+    for (auto& sink : sinks)
+      progress |= sink.Complete();
+  }
+  EXPECT_EQ(3u, num_done);
+  EXPECT_EQ(0u, mr.used);
+  for (auto& sink : sinks)
+    EXPECT_EQ("hello world", sink.value);
+
+  // Empty buffers complete right away.
+  FakeAsyncSink sink;
+  sink.AsyncWrite(SharedBuf{}, [&](error_code ec) { ++num_done; });
+  EXPECT_EQ(4u, num_done);
+  EXPECT_FALSE(sink.Complete());
+}
+
 }  // namespace io
@@ -11,10 +11,52 @@
 #include "base/logging.h"
 #include "io/file.h"
 
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#define USE_SIMD_SCAN 1
+#elif defined(__aarch64__)
+#include "base/sse2neon.h"
+#define USE_SIMD_SCAN 1
+#endif
+
 namespace io {
 
 using namespace std;
 
+namespace {
+
+// Calls cb(eol) for every '\n' in [begin, end) in ascending order.
+template <typename F> void ForEachNewline(char* begin, char* end, F&& cb) {
+  char* ptr = begin;
+
+#ifdef __AVX2__
+  const __m256i nl32 = _mm256_set1_epi8('\n');
+  for (; ptr + 32 <= end; ptr += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr));
+    uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl32));
+    for (; mask; mask &= mask - 1)
+      cb(ptr + __builtin_ctz(mask));
+  }
+#endif
+
+#ifdef USE_SIMD_SCAN
+  const __m128i nl16 = _mm_set1_epi8('\n');
+  for (; ptr + 16 <= end; ptr += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr));
+    uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl16));
+    for (; mask; mask &= mask - 1)
+      cb(ptr + __builtin_ctz(mask));
+  }
+#endif
+
+  for (; ptr < end; ++ptr) {
+    if (*ptr == '\n')
+      cb(ptr);
+  }
+}
+
+}  // namespace
+
 LineReader::Iterator::Iterator(LineReader* lr) : master_(lr) {
   if (master_) {
     this->operator++();
@@ -66,6 +108,10 @@ bool LineReader::Next(std::string_view* result, std::string* scratch) {
 
       if (touched_scratch) {
         scratch->append(next_, ptr);
+
+        // "\r\n" could be split between the buffer fills.
+        if (delta == 1 && ptr == next_ && !scratch->empty() && scratch->back() == '\r')
+          scratch->pop_back();
         *result = *scratch;
       } else {
         *result = std::string_view(next_, ptr - next_);
@@ -139,6 +185,57 @@ bool LineReader::Next(std::string_view* result, std::string* scratch) {
   return false;
 }
 
+absl::Span<const std::string_view> LineReader::NextBatch() {
+  batch_.clear();
+
+  // The batch that preceded a line over the limit was returned, the error stays.
+  if (status_)
+    return {};
+
+  // Next() handles the lines that cross the buffer boundary and the refills.
+  string_view line;
+  if (!Next(&line))
+    return {};
+
+  if (line.size() >= line_len_limit_) {
+    status_ = make_error_code(errc::message_size);
+    return {};
+  }
+
+  batch_.push_back(line);
+  AppendBufferedLines();
+  return batch_;
+}
+
+void LineReader::AppendBufferedLines() {
+  char* start = next_;
+  uint64_t num_lines = 0;
+
+  // The masks are computed before we overwrite the EOLs with '\0', so it is safe
+  // to modify the buffer in the callback.
+  ForEachNewline(next_, end_, [&](char* eol) {
+    if (status_)
+      return;
+
+    // Stops at the line over the limit, the lines before it are returned.
+    if (uint64_t(eol - start) >= line_len_limit_) {
+      status_ = make_error_code(errc::message_size);
+      return;
+    }
+
+    char* line_end = eol;
+    if (eol > start && eol[-1] == '\r')
+      --line_end;
+    *line_end = '\0';
+    batch_.emplace_back(start, line_end - start);
+    start = eol + 1;
+    ++num_lines;
+  });
+
+  line_num_ += num_lines;
+  next_ = start;
+}
+
 namespace ini {
 
 io::Result<Contents> Parse(Source* source, Ownership ownership) {
@@ -3,7 +3,10 @@
 //
 #pragma once
 
+#include <absl/types/span.h>
+
 #include <unordered_map>
+#include <vector>
 
 #include "base/integral_types.h"
 #include "io/io.h"
@@ -55,6 +58,14 @@ class LineReader {
   // Returns true if new line was found or false if end of stream was reached.
   bool Next(std::string_view* result, std::string* scratch = nullptr);
 
+  // Returns the next line together with all the following lines that are fully contained
+  // in the internal buffer, refilling it if needed. The buffered lines are found with
+  // a vectorized scan. The result is valid until the next call to Next or NextBatch.
+  // Returns an empty span if end of stream was reached or an error occurred. A line of
+  // line_len_limit() bytes or more ends the batch before it and fails the following call
+  // with errc::message_size.
+  absl::Span<const std::string_view> NextBatch();
+
   ::std::error_code status() const {
     return status_;
   }
@@ -78,6 +89,9 @@ class LineReader {
  private:
   void Init(uint32_t buf_log);
 
+  // Appends the complete lines in [next_, end_) to batch_.
+  void AppendBufferedLines();
+
   Source* source_;
   uint64_t line_num_ = 0;  // MSB bit means EOF was reached.
   uint64_t line_len_limit_ = -1;
@@ -89,6 +103,7 @@ class LineReader {
   uint32_t page_size_;
   std::string scratch_;
   std::error_code status_;
+  std::vector<std::string_view> batch_;
 
   static constexpr uint64_t kEofMask = 1ULL << 63;
 };
@@ -5,10 +5,15 @@
 #include "io/proc_reader.h"
 
 #include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
 #include <absl/strings/strip.h>
 #include <fcntl.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
+#include <charconv>
+
 #include "base/io_buf.h"
 #include "base/logging.h"
 
@@ -72,30 +77,188 @@ error_code ReadProcFile(const char* name, char c, function<void(string_view, str
   return error_code{};
 }
 
+// A /proc file that is opened once and then re-read with pread. Each thread keeps its own
+// instances, so the descriptors need no synchronization. Descriptors of /proc/self files refer
+// to the process that opened them, therefore they are reopened in a forked child.
+class ProcFile {
+ public:
+  explicit ProcFile(string_view path) {
+    CHECK_LT(path.size(), sizeof(path_));
+    memcpy(path_, path.data(), path.size());
+    path_[path.size()] = '\0';
+  }
+
+  ProcFile(const ProcFile&) = delete;
+
+  ~ProcFile() {
+    if (fd_ >= 0)
+      close(fd_);
+  }
+
+  // Returns the contents of the file, truncated to the size of the thread buffer.
+  Result<string_view> Read();
+
+ private:
+  static constexpr size_t kBufSize = 8192;
+
+  char path_[64];
+  int fd_ = -1;
+  pid_t pid_ = 0;
+};
+
+Result<string_view> ProcFile::Read() {
+  static thread_local unique_ptr<char[]> buf;
+
+  pid_t pid = getpid();
+  if (fd_ < 0 || pid != pid_) {
+    if (fd_ >= 0)
+      close(fd_);
+    fd_ = open(path_, O_RDONLY | O_CLOEXEC);
+    if (fd_ < 0)
+      return make_unexpected(error_code{errno, system_category()});
+    pid_ = pid;
+  }
+
+  if (!buf)
+    buf.reset(new char[kBufSize]);
+
+  ssize_t res = pread(fd_, buf.get(), kBufSize, 0);
+  if (res < 0)
+    return make_unexpected(error_code{errno, system_category()});
+  return string_view{buf.get(), size_t(res)};
+}
+
+// Calls cb(key, value) for each complete "key<c> value" line of contents.
+template <typename F> void ForEachLine(string_view contents, char c, F&& cb) {
+  while (true) {
+    size_t eol = contents.find('\n');
+    if (eol == string_view::npos)
+      break;
+    string_view line = contents.substr(0, eol);
+    contents.remove_prefix(eol + 1);
+
+    size_t pos = line.find(c);
+    if (pos != string_view::npos)
+      cb(line.substr(0, pos), absl::StripLeadingAsciiWhitespace(line.substr(pos + 1)));
+  }
+}
+
+// Parses the leading number of str, i.e. "123 kB" yields 123.
+inline bool ParseNum(string_view str, uint64_t* dest) {
+  return from_chars(str.data(), str.data() + str.size(), *dest).ec == errc{};
+}
+
 inline void ParseKb(string_view num, size_t* dest) {
-  CHECK(SimpleAtoi(num, dest));
-  *dest *= 1024;
+  uint64_t val = 0;
+  CHECK(ParseNum(num, &val)) << num;
+  *dest = val * 1024;
+};
+
+// Field numbers of /proc/<pid>/stat as they appear in proc(5).
+enum StatField : unsigned {
+  kStatMinFlt = 10,
+  kStatMajFlt = 12,
+  kStatUtime = 14,
+  kStatStime = 15,
+  kStatStartTime = 22,
+  kStatProcessor = 39,
 };
 
-size_t find_nth(string_view str, char c, uint32_t index) {
-  for (size_t i = 0; i < str.size(); ++i) {
-    if (str[i] == c) {
-      if (index-- == 0)
-        return i;
+// Fields of a stat line, numbered like in proc(5), starting with the state field (3).
+class StatFields {
+ public:
+  // Returns false if the line is malformed.
+  bool Parse(string_view line) {
+    // The command name may contain spaces and parentheses, but it is followed by the last ')'.
+    size_t pos = line.rfind(')');
+    if (pos == string_view::npos)
+      return false;
+    line.remove_prefix(pos + 1);
+
+    size_ = 0;
+    while (size_ < kMaxFields) {
+      while (!line.empty() && (line.front() == ' ' || line.front() == '\n'))
+        line.remove_prefix(1);
+      if (line.empty())
+        break;
+      size_t end = min(line.find(' '), line.size());
+      fields_[size_++] = line.substr(0, end);
+      line.remove_prefix(end);
     }
+    return true;
   }
-  return string_view::npos;
+
+  bool Get(StatField field, uint64_t* dest) const {
+    unsigned index = field - kFirstField;
+    return index < size_ && ParseNum(fields_[index], dest);
+  }
+
+ private:
+  static constexpr unsigned kFirstField = 3;
+  static constexpr unsigned kMaxFields = kStatProcessor - kFirstField + 1;
+
+  string_view fields_[kMaxFields];
+  unsigned size_ = 0;
+};
+
+long ClockTicksPerSec() {
+  static const long ticks = sysconf(_SC_CLK_TCK);
+  return ticks;
+}
+
+uint64_t TicksToUsec(uint64_t ticks) {
+  return ticks * 1000000 / ClockTicksPerSec();
+}
+
+Result<ThreadStat> ParseThreadStat(string_view contents) {
+  StatFields fields;
+  ThreadStat res;
+  uint64_t utime = 0, stime = 0, cpu = 0;
+  if (!fields.Parse(contents) || !fields.Get(kStatMinFlt, &res.min_flt) ||
+      !fields.Get(kStatMajFlt, &res.maj_flt) || !fields.Get(kStatUtime, &utime) ||
+      !fields.Get(kStatStime, &stime)) {
+    return make_unexpected(error_code{EILSEQ, system_category()});
+  }
+
+  res.user_usec = TicksToUsec(utime);
+  res.system_usec = TicksToUsec(stime);
+  if (fields.Get(kStatProcessor, &cpu))
+    res.cpu = cpu;
+  return res;
+}
+
+// Parses "some avg10=0.00 avg60=0.00 avg300=0.00 total=0" into its avg10, avg60 and total.
+bool ParsePressureLine(string_view line, double* avg10, double* avg60, uint64_t* total) {
+  bool has_total = false;
+  for (string_view field : absl::StrSplit(line, ' ', absl::SkipEmpty())) {
+    size_t pos = field.find('=');
+    if (pos == string_view::npos)
+      return false;
+    string_view key = field.substr(0, pos), value = field.substr(pos + 1);
+    if (key == "avg10") {
+      if (!absl::SimpleAtod(value, avg10))
+        return false;
+    } else if (key == "avg60") {
+      if (!absl::SimpleAtod(value, avg60))
+        return false;
+    } else if (key == "total") {
+      has_total = ParseNum(value, total);
+    }
+  }
+  return has_total;
 }
 
 }  // namespace
 
 Result<StatusData> ReadStatusInfo() {
-  StatusData sdata;
+  static thread_local ProcFile file("/proc/self/status");
 
-  auto cb = [&sdata](string_view key, string_view value) {
-    size_t space = value.find(' ');
-    string_view num = value.substr(0, space);
+  Result<string_view> contents = file.Read();
+  if (!contents)
+    return make_unexpected(contents.error());
 
+  StatusData sdata;
+  ForEachLine(*contents, ':', [&sdata](string_view key, string_view num) {
     if (key == "VmPeak") {
       ParseKb(num, &sdata.vm_peak);
     } else if (key == "VmSize") {
@@ -107,22 +270,20 @@ Result<StatusData> ReadStatusInfo() {
     } else if (key == "HugetlbPages") {
       ParseKb(num, &sdata.hugetlb_pages);
     }
-  };
-
-  error_code ec = ReadProcFile("/proc/self/status", ':', std::move(cb));
-  if (ec)
-    return make_unexpected(ec);
+  });
 
   return sdata;
 }
 
 Result<MemInfoData> ReadMemInfo() {
-  MemInfoData mdata;
+  static thread_local ProcFile file("/proc/meminfo");
 
-  auto cb = [&mdata](string_view key, string_view value) {
-    size_t space = value.find(' ');
-    string_view num = value.substr(0, space);
+  Result<string_view> contents = file.Read();
+  if (!contents)
+    return make_unexpected(contents.error());
 
+  MemInfoData mdata;
+  ForEachLine(*contents, ':', [&mdata](string_view key, string_view num) {
     if (key == "MemTotal") {
       ParseKb(num, &mdata.mem_total);
     } else if (key == "MemFree") {
@@ -142,11 +303,7 @@ Result<MemInfoData> ReadMemInfo() {
     } else if (key == "SwapFree") {
       ParseKb(num, &mdata.swap_free);
     }
-  };
-
-  error_code ec = ReadProcFile("/proc/meminfo", ':', std::move(cb));
-  if (ec)
-    return make_unexpected(ec);
+  });
 
   return mdata;
 }
@@ -168,45 +325,103 @@ Result<SelfStat> ReadSelfStat() {
       return make_unexpected(ec);
   }
 
-  int fd = open("/proc/self/stat", O_RDONLY | O_CLOEXEC);
-  if (fd < 0)
-    return make_unexpected(error_code{errno, system_category()});
-
-  long jiffies_per_second = sysconf(_SC_CLK_TCK);
+  static thread_local ProcFile file("/proc/self/stat");
+  Result<string_view> contents = file.Read();
+  if (!contents)
+    return make_unexpected(contents.error());
 
+  StatFields fields;
+  SelfStat res;
   uint64_t start_since_boot = 0;
-  constexpr size_t kBufSize = 2048;
-  std::unique_ptr<char[]> buf(new char[kBufSize]);
+  if (!fields.Parse(*contents) || !fields.Get(kStatMajFlt, &res.maj_flt) ||
+      !fields.Get(kStatStartTime, &start_since_boot)) {
+    return make_unexpected(error_code{EILSEQ, system_category()});
+  }
 
-  ssize_t bytes_read = read(fd, buf.get(), kBufSize);
-  close(fd);
-  if (bytes_read <= 0)
-    return make_unexpected(error_code{errno, system_category()});
+  res.start_time_sec = btime + start_since_boot / ClockTicksPerSec();
+  return res;
+}
 
-  SelfStat res;
-  string_view str(buf.get(), bytes_read);
-  size_t pos = find_nth(str, ' ', 10);
-  str.remove_prefix(pos);
-  if (str.empty())
-    return make_unexpected(error_code{EILSEQ, system_category()});
+Result<ThreadStat> ReadThreadStat() {
+#ifdef __linux__
+  pid_t tid = syscall(SYS_gettid);
+#else
+  pid_t tid = 0;
+#endif
+  static thread_local ProcFile file(absl::StrCat("/proc/self/task/", tid, "/stat"));
+
+  Result<string_view> contents = file.Read();
+  if (!contents)
+    return make_unexpected(contents.error());
+  return ParseThreadStat(*contents);
+}
 
-  size_t next = str.find(' ', 1);
-  uint64_t maj_flt = 0;
-  if (next == string_view::npos || !absl::SimpleAtoi(str.substr(1, next - 1), &maj_flt))
-    return make_unexpected(error_code{EILSEQ, system_category()});
-  str.remove_prefix(next + 1);
+Result<ThreadStat> ReadThreadStat(pid_t tid) {
+  ProcFile file(absl::StrCat("/proc/self/task/", tid, "/stat"));
 
-  pos = find_nth(str, ' ', 8);
-  str.remove_prefix(pos);
-  if (str.empty())
+  Result<string_view> contents = file.Read();
+  if (!contents)
+    return make_unexpected(contents.error());
+  return ParseThreadStat(*contents);
+}
+
+Result<PressureData> ReadMemoryPressure() {
+  static thread_local ProcFile file("/proc/pressure/memory");
+
+  Result<string_view> contents = file.Read();
+  if (!contents)
+    return make_unexpected(contents.error());
+
+  PressureData res;
+  bool valid = true;
+  ForEachLine(*contents, ' ', [&](string_view key, string_view fields) {
+    if (key == "some") {
+      valid &= ParsePressureLine(fields, &res.some_avg10, &res.some_avg60, &res.some_total_usec);
+    } else if (key == "full") {
+      valid &= ParsePressureLine(fields, &res.full_avg10, &res.full_avg60, &res.full_total_usec);
+    }
+  });
+
+  if (!valid)
     return make_unexpected(error_code{EILSEQ, system_category()});
+  return res;
+}
+
+string CgroupV2Dir() {
+  string dir;
+  auto cb = [&dir](string_view key, string_view value) {
+    // The cgroup v2 line is "0::<path>", the controllers list of the unified hierarchy is empty.
+    if (key == "0" && absl::ConsumePrefix(&value, ":"))
+      dir = absl::StrCat("/sys/fs/cgroup", value == "/" ? "" : value);
+  };
 
-  next = str.find(' ', 1);
-  CHECK(absl::SimpleAtoi(str.substr(1, next - 1), &start_since_boot));
-  start_since_boot /= jiffies_per_second;
+  if (ReadProcFile("/proc/self/cgroup", ':', std::move(cb)))
+    return {};
+  return dir;
+}
 
-  res.start_time_sec = btime + start_since_boot;
-  res.maj_flt = maj_flt;
+Result<CgroupMemoryEvents> ReadCgroupMemoryEvents() {
+  string dir = CgroupV2Dir();
+  if (dir.empty())
+    return make_unexpected(make_error_code(errc::no_such_file_or_directory));
+
+  // The cgroup may change, so unlike the files above the path is resolved on every call.
+  CgroupMemoryEvents res;
+  auto cb = [&res](string_view key, string_view num) {
+    if (key == "high") {
+      ParseNum(num, &res.high);
+    } else if (key == "max") {
+      ParseNum(num, &res.max);
+    } else if (key == "oom") {
+      ParseNum(num, &res.oom);
+    } else if (key == "oom_kill") {
+      ParseNum(num, &res.oom_kill);
+    }
+  };
+
+  string path = absl::StrCat(dir, "/memory.events");
+  if (error_code ec = ReadProcFile(path.c_str(), ' ', std::move(cb)); ec)
+    return make_unexpected(ec);
   return res;
 }
 
@@ -4,7 +4,11 @@
 
 #pragma once
 
+#include <sys/types.h>
+
+#include <string>
 #include <vector>
+
 #include "io/io.h"
 
 namespace io {
@@ -39,10 +43,55 @@ struct SelfStat {
   uint64_t maj_flt = 0;
 };
 
+// Per thread stats from /proc/self/task/<tid>/stat. CPU times are in microseconds.
+struct ThreadStat {
+  uint64_t user_usec = 0;
+  uint64_t system_usec = 0;
+  uint64_t min_flt = 0;
+  uint64_t maj_flt = 0;
+  int cpu = -1;  // the cpu the thread ran on last.
+};
+
+// Pressure stall information of a resource, see Documentation/accounting/psi.rst.
+// The averages are the percents of the time in which some or all the non-idle tasks were
+// stalled on the resource, the totals are the cumulative stall times in microseconds.
+struct PressureData {
+  double some_avg10 = 0, some_avg60 = 0;
+  double full_avg10 = 0, full_avg60 = 0;
+  uint64_t some_total_usec = 0;
+  uint64_t full_total_usec = 0;
+};
+
+// Counters of memory.events of the cgroup v2 of the process.
+struct CgroupMemoryEvents {
+  uint64_t high = 0;  // times the usage went over memory.high and the cgroup was throttled.
+  uint64_t max = 0;   // times the usage was about to go over memory.max.
+  uint64_t oom = 0;
+  uint64_t oom_kill = 0;
+};
+
+// The readers below keep their /proc files open per calling thread, re-read them with pread
+// and parse them in place, so they are cheap enough to be called frequently.
 Result<StatusData> ReadStatusInfo();
 Result<MemInfoData> ReadMemInfo();
 Result<SelfStat> ReadSelfStat();
 
+// Stats of the calling thread.
+Result<ThreadStat> ReadThreadStat();
+
+// Stats of thread tid of this process. Opens the stat file on every call.
+Result<ThreadStat> ReadThreadStat(pid_t tid);
+
+// Reads /proc/pressure/memory, fails with ENOENT if the kernel does not support PSI.
+Result<PressureData> ReadMemoryPressure();
+
+// Fails with ENOENT if the process is not in a cgroup v2 hierarchy with a memory controller.
+Result<CgroupMemoryEvents> ReadCgroupMemoryEvents();
+
+// Returns the directory of the cgroup v2 of the process, i.e. /sys/fs/cgroup/<path>,
+// or an empty string if it is not in a cgroup v2 hierarchy.
+std::string CgroupV2Dir();
+
 // key,value list from /etc/os-release
 using DistributionInfo = std::vector<std::pair<std::string, std::string>>;
 
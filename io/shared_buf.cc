@@ -0,0 +1,53 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "io/shared_buf.h"
+
+#include <cstring>
+#include <new>
+
+namespace io {
+
+using namespace std;
+
+SharedBuf SharedBuf::Copy(Bytes data, PMR_NS::memory_resource* mr) {
+  MutableBytes dest;
+  SharedBuf res = Allocate(data.size(), &dest, mr);
+  if (!data.empty())
+    memcpy(dest.data(), data.data(), data.size());
+  return res;
+}
+
+SharedBuf SharedBuf::Allocate(size_t size, MutableBytes* dest, PMR_NS::memory_resource* mr) {
+  if (!mr)
+    mr = PMR_NS::get_default_resource();
+
+  size_t alloc_size = sizeof(Block) + size;
+  void* ptr = mr->allocate(alloc_size, alignof(Block));
+  Block* block = new (ptr) Block{{1}, alloc_size, mr};
+
+  SharedBuf res;
+  res.block_ = block;
+  res.data_ = reinterpret_cast<uint8_t*>(block + 1);
+  res.size_ = size;
+  *dest = MutableBytes{reinterpret_cast<uint8_t*>(block + 1), size};
+  return res;
+}
+
+SharedBuf SharedBuf::Slice(size_t offset, size_t len) const {
+  SharedBuf res(*this);
+  offset = min(offset, size_);
+  res.data_ += offset;
+  res.size_ = min(len, size_ - offset);
+  return res;
+}
+
+void SharedBuf::Free(Block* block) {
+  PMR_NS::memory_resource* mr = block->mr;
+  size_t alloc_size = block->alloc_size;
+  block->~Block();
+  mr->deallocate(block, alloc_size, alignof(Block));
+}
+
+}  // namespace io
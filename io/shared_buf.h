@@ -0,0 +1,104 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <sys/uio.h>
+
+#include <atomic>
+#include <cstdint>
+#include <utility>
+
+#include "base/pmr/memory_resource.h"
+#include "io/io.h"
+
+namespace io {
+
+// Immutable reference counted buffer. The copies of a SharedBuf and the slices taken from it
+// share a single allocation that is freed with the last reference, so the same data can be
+// queued to many sinks, e.g. replicated to many sockets with AsyncSink::AsyncWrite, without
+// copying it per sink. The reference count is atomic, hence the references may be dropped on
+// different threads. The data must not be modified once the buffer is shared.
+class SharedBuf {
+ public:
+  SharedBuf() = default;
+
+  // Copies data, e.g. the input of an IoBuf, into a new buffer allocated from mr.
+  static SharedBuf Copy(Bytes data, PMR_NS::memory_resource* mr = nullptr);
+
+  // Allocates a buffer of size bytes and points dest to its data, which the caller fills before
+  // sharing the buffer.
+  static SharedBuf Allocate(size_t size, MutableBytes* dest,
+                            PMR_NS::memory_resource* mr = nullptr);
+
+  SharedBuf(const SharedBuf& other) : block_(other.block_), data_(other.data_), size_(other.size_) {
+    if (block_)
+      block_->refs.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  SharedBuf(SharedBuf&& other) noexcept
+      : block_(std::exchange(other.block_, nullptr)), data_(other.data_), size_(other.size_) {
+    other.size_ = 0;
+  }
+
+  SharedBuf& operator=(SharedBuf other) noexcept {
+    std::swap(block_, other.block_);
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+    return *this;
+  }
+
+  ~SharedBuf() {
+    Reset();
+  }
+
+  // Drops the reference, the buffer becomes empty.
+  void Reset() {
+    if (block_ && block_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      Free(block_);
+    block_ = nullptr;
+    data_ = nullptr;
+    size_ = 0;
+  }
+
+  Bytes bytes() const {
+    return Bytes{data_, size_};
+  }
+
+  iovec AsIovec() const {
+    return iovec{const_cast<uint8_t*>(data_), size_};
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  bool empty() const {
+    return size_ == 0;
+  }
+
+  // Returns a reference to [offset, offset + len) of this buffer, clipped to its size.
+  SharedBuf Slice(size_t offset, size_t len = SIZE_MAX) const;
+
+  // The number of references to the allocation, 0 for a buffer that was never allocated.
+  uint32_t use_count() const {
+    return block_ ? block_->refs.load(std::memory_order_relaxed) : 0;
+  }
+
+ private:
+  // Header of the allocation, followed by the data.
+  struct Block {
+    std::atomic_uint32_t refs;
+    size_t alloc_size;
+    PMR_NS::memory_resource* mr;
+  };
+
+  static void Free(Block* block);
+
+  Block* block_ = nullptr;
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+};
+
+}  // namespace io
@@ -14,78 +14,142 @@ limitations under the License.
 
 #include "strings/human_readable.h"
 
-#include <absl/strings/str_format.h>
-
-#include "base/integral_types.h"
-#include "base/logging.h"
+#include <algorithm>
+#include <charconv>
+#include <cmath>
 
 namespace strings {
-using absl::StrAppendFormat;
 
-std::string HumanReadableNum(int64 value) {
-  std::string s;
+namespace {
+
+// Writes into the fixed buffer, which fits all the outputs, see kHumanReadableBufSize.
+class BufWriter {
+ public:
+  explicit BufWriter(char (&buf)[kHumanReadableBufSize]) : begin_(buf), cur_(buf) {
+  }
+
+  void Put(std::string_view str) {
+    cur_ = std::copy(str.begin(), str.end(), cur_);
+  }
+
+  void Put(char c) {
+    *cur_++ = c;
+  }
+
+  void Put(uint64_t val) {
+    cur_ = std::to_chars(cur_, end(), val).ptr;
+  }
+
+  void Put(double val, std::chars_format fmt, int precision) {
+    cur_ = std::to_chars(cur_, end(), val, fmt, precision).ptr;
+  }
+
+  std::string_view str() const {
+    return std::string_view(begin_, cur_ - begin_);
+  }
+
+ private:
+  char* end() const {
+    return begin_ + kHumanReadableBufSize;
+  }
+
+  char* begin_;
+  char* cur_;
+};
+
+// Formats as "%0.3g".
+void PutG3(double val, BufWriter* w) {
+  w->Put(val, std::chars_format::general, 3);
+}
+
+bool ConsumeNumber(std::string_view* str, double* val) {
+  const char* end = str->data() + str->size();
+  auto [ptr, ec] = std::from_chars(str->data(), end, *val);
+  if (ec != std::errc{} || !std::isfinite(*val))
+    return false;
+  str->remove_prefix(ptr - str->data());
+  if (!str->empty() && str->front() == ' ')
+    str->remove_prefix(1);
+  return true;
+}
+
+bool EqualsIgnoreCase(std::string_view a, std::string_view b) {
+  return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+           return (x | 0x20) == (y | 0x20);  // units consist of letters only.
+         });
+}
+
+}  // namespace
+
+std::string_view HumanReadableNum(int64_t value, char (&buf)[kHumanReadableBufSize]) {
+  BufWriter w(buf);
+  uint64_t uval = value;
   if (value < 0) {
-    s += "-";
-    value = -value;
-  }
-  if (value < 1000) {
-    StrAppendFormat(&s, "%lld", static_cast<long long>(value));
-  } else if (value >= static_cast<int64>(1e15)) {
-    // Number bigger than 1E15; use that notation.
-    StrAppendFormat(&s, "%0.3G", static_cast<double>(value));
+    w.Put('-');
+    uval = -uval;
+  }
+
+  if (uval < 1000) {
+    w.Put(uval);
+  } else if (uval >= 1000000000000000ULL) {
+    // Number bigger than 1E15; use that notation, as "%0.3G".
+    char* start = buf + w.str().size();
+    PutG3(double(uval), &w);
+    std::transform(start, buf + w.str().size(), start, [](char c) { return c == 'e' ? 'E' : c; });
   } else {
     static const char units[] = "kMBT";
 
     const char* unit = units;
-    while (value >= static_cast<int64>(1000000)) {
-      value /= static_cast<int64>(1000);
+    while (uval >= 1000000) {
+      uval /= 1000;
       ++unit;
-      CHECK(unit < units + ABSL_ARRAYSIZE(units));
     }
-    StrAppendFormat(&s, "%.2f%c", value / 1000.0, *unit);
+    w.Put(uval / 1000.0, std::chars_format::fixed, 2);
+    w.Put(*unit);
   }
-  return s;
+  return w.str();
 }
 
-std::string HumanReadableNumBytes(int64_t num_bytes) {
-  if (num_bytes == kint64min) {
+std::string_view HumanReadableNumBytes(int64_t num_bytes, char (&buf)[kHumanReadableBufSize]) {
+  BufWriter w(buf);
+  if (num_bytes == INT64_MIN) {
     // Special case for number with not representable negation.
-    return "-8E";
+    w.Put("-8E");
+    return w.str();
   }
 
-  const char* neg_str = (num_bytes < 0) ? "-" : "";
   if (num_bytes < 0) {
+    w.Put('-');
     num_bytes = -num_bytes;
   }
 
   // Special case for bytes.
   if (num_bytes < 1024) {
     // No fractions for bytes.
-    char buf[8];  // Longest possible string is '-XXXXB'
-    snprintf(buf, sizeof(buf), "%s%lldB", neg_str, static_cast<long long>(num_bytes));
-    return std::string(buf);
+    w.Put(uint64_t(num_bytes));
+    w.Put('B');
+    return w.str();
   }
 
   static const char units[] = "KMGTPE";  // int64 only goes up to E.
   const char* unit = units;
-  while (num_bytes >= static_cast<int64>(1024) * 1024) {
+  while (num_bytes >= int64_t(1024) * 1024) {
     num_bytes /= 1024;
     ++unit;
-    CHECK(unit < units + ABSL_ARRAYSIZE(units));
   }
 
   // We use SI prefixes.
-  char buf[16];
-  snprintf(buf, sizeof(buf), ((*unit == 'K') ? "%s%.1f%ciB" : "%s%.2f%ciB"), neg_str,
-           num_bytes / 1024.0, *unit);
-  return std::string(buf);
+  w.Put(num_bytes / 1024.0, std::chars_format::fixed, *unit == 'K' ? 1 : 2);
+  w.Put(*unit);
+  w.Put("iB");
+  return w.str();
 }
 
-std::string HumanReadableElapsedTime(double seconds) {
-  std::string human_readable;
+std::string_view HumanReadableElapsedTime(double seconds, char (&buf)[kHumanReadableBufSize]) {
+  BufWriter w(buf);
 
   if (seconds < 0) {
-    human_readable = "-";
+    w.Put('-');
     seconds = -seconds;
   }
 
@@ -94,44 +158,103 @@ std::string HumanReadableElapsedTime(double seconds) {
   // the tested condition and returning, e.g., "1e+03 us" instead of "1 ms".
   const double microseconds = seconds * 1.0e6;
   if (microseconds < 999.5) {
-    StrAppendFormat(&human_readable, "%0.3g us", microseconds);
-    return human_readable;
+    PutG3(microseconds, &w);
+    w.Put(" us");
+    return w.str();
   }
   double milliseconds = seconds * 1e3;
   if (milliseconds >= .995 && milliseconds < 1) {
-    // Round half to even in Appendf would convert this to 0.999 ms.
+    // Round half to even would convert this to 0.999 ms.
     milliseconds = 1.0;
   }
   if (milliseconds < 999.5) {
-    StrAppendFormat(&human_readable, "%0.3g ms", milliseconds);
-    return human_readable;
+    PutG3(milliseconds, &w);
+    w.Put(" ms");
+    return w.str();
   }
+
+  std::string_view unit;
   if (seconds < 60.0) {
-    StrAppendFormat(&human_readable, "%0.3g s", seconds);
-    return human_readable;
+    unit = " s";
+  } else if ((seconds /= 60.0) < 60.0) {
+    unit = " min";
+  } else if ((seconds /= 60.0) < 24.0) {
+    unit = " h";
+  } else if ((seconds /= 24.0) < 30.0) {
+    unit = " days";
+  } else if (seconds < 365.2425) {
+    seconds /= 30.436875;
+    unit = " months";
+  } else {
+    seconds /= 365.2425;
+    unit = " years";
   }
-  seconds /= 60.0;
-  if (seconds < 60.0) {
-    StrAppendFormat(&human_readable, "%0.3g min", seconds);
-    return human_readable;
-  }
-  seconds /= 60.0;
-  if (seconds < 24.0) {
-    StrAppendFormat(&human_readable, "%0.3g h", seconds);
-    return human_readable;
-  }
-  seconds /= 24.0;
-  if (seconds < 30.0) {
-    StrAppendFormat(&human_readable, "%0.3g days", seconds);
-    return human_readable;
-  }
-  if (seconds < 365.2425) {
-    StrAppendFormat(&human_readable, "%0.3g months", seconds / 30.436875);
-    return human_readable;
-  }
-  seconds /= 365.2425;
-  StrAppendFormat(&human_readable, "%0.3g years", seconds);
-  return human_readable;
+  PutG3(seconds, &w);
+  w.Put(unit);
+  return w.str();
+}
+
+std::string HumanReadableNum(int64_t value) {
+  char buf[kHumanReadableBufSize];
+  return std::string(HumanReadableNum(value, buf));
+}
+
+std::string HumanReadableNumBytes(int64_t num_bytes) {
+  char buf[kHumanReadableBufSize];
+  return std::string(HumanReadableNumBytes(num_bytes, buf));
+}
+
+std::string HumanReadableElapsedTime(double seconds) {
+  char buf[kHumanReadableBufSize];
+  return std::string(HumanReadableElapsedTime(seconds, buf));
+}
+
+bool ParseHumanReadableBytes(std::string_view str, int64_t* num_bytes) {
+  double val;
+  if (!ConsumeNumber(&str, &val))
+    return false;
+
+  double mult = 1;
+  if (!str.empty() && !EqualsIgnoreCase(str, "b")) {
+    static const char units[] = "kmgtpe";
+    const char* unit = std::find(units, units + 6, str.front() | 0x20);
+    if (unit == units + 6)
+      return false;
+    str.remove_prefix(1);
+    if (!str.empty() && !EqualsIgnoreCase(str, "b") && !EqualsIgnoreCase(str, "ib"))
+      return false;
+    mult = std::ldexp(1.0, 10 * (unit - units + 1));
+  }
+
+  val *= mult;
+  // 2^63 is the first double that does not fit.
+  if (val >= 9223372036854775808.0 || val < -9223372036854775808.0)
+    return false;
+  *num_bytes = std::llround(val);
+  return true;
+}
+
+bool ParseHumanReadableElapsedTime(std::string_view str, double* seconds) {
+  static const struct {
+    std::string_view name;
+    double seconds;
+  } kUnits[] = {
+      {"us", 1e-6},   {"ms", 1e-3},          {"s", 1},
+      {"min", 60},    {"h", 3600},           {"days", 86400},
+      {"months", 86400 * 30.436875}, {"years", 86400 * 365.2425},
+  };
+
+  double val;
+  if (!ConsumeNumber(&str, &val))
+    return false;
+
+  for (const auto& unit : kUnits) {
+    if (str == unit.name) {
+      *seconds = val * unit.seconds;
+      return true;
+    }
+  }
+  return false;
 }
 
 }  // namespace strings
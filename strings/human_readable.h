@@ -16,7 +16,9 @@ limitations under the License.
 #ifndef HUMAN_READABLE_NUMBERS_H_
 #define HUMAN_READABLE_NUMBERS_H_
 
+#include <cstddef>
 #include <cstdint>
+#include <string>
 #include <string_view>
 
 namespace strings {
@@ -39,6 +41,27 @@ std::string HumanReadableNumBytes(int64_t num_bytes);
 //   -10         -> "-10 s"
 std::string HumanReadableElapsedTime(double seconds);
 
+// Fits the output of the functions below.
+constexpr size_t kHumanReadableBufSize = 32;
+
+// The same as the functions above but write into buf instead of allocating a string.
+// Return the written part of buf, for example:
+//   char buf[strings::kHumanReadableBufSize];
+//   LOG(INFO) << "Used " << strings::HumanReadableNumBytes(used, buf);
+std::string_view HumanReadableNum(int64_t value, char (&buf)[kHumanReadableBufSize]);
+std::string_view HumanReadableNumBytes(int64_t num_bytes, char (&buf)[kHumanReadableBufSize]);
+std::string_view HumanReadableElapsedTime(double seconds, char (&buf)[kHumanReadableBufSize]);
+
+// Parses a number of bytes followed by an optional unit, possibly separated by a space, e.g.
+// "4096", "11.77MiB" or "2 GB". The units are B, K, M, G, T, P and E, optionally followed by
+// B or iB. They are case insensitive and all of them are powers of 1024. Returns false
+// if str is malformed or the number does not fit into int64.
+bool ParseHumanReadableBytes(std::string_view str, int64_t* num_bytes);
+
+// Parses a time interval with a unit, e.g. the output of HumanReadableElapsedTime.
+// The units are us, ms, s, min, h, days, months and years.
+bool ParseHumanReadableElapsedTime(std::string_view str, double* seconds);
+
 }  // namespace strings
 
 #endif  // HUMAN_READABLE_NUMBERS_H_
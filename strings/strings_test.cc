@@ -66,4 +66,59 @@ TEST(HumanReadableElapsedTime, Basic) {
   EXPECT_EQ(HumanReadableElapsedTime(382386614.40), "12.1 years");
   EXPECT_EQ(HumanReadableElapsedTime(DBL_MAX), "5.7e+300 years");
 }
+
+TEST(HumanReadable, Buffer) {
+  char buf[kHumanReadableBufSize];
+  for (int64_t val : {int64_t(0), int64_t(-999), int64_t(1927), int64_t(12345678),
+                      int64_t(123456789012345678), kint64max, kint64min}) {
+    EXPECT_EQ(HumanReadableNum(val), HumanReadableNum(val, buf));
+    EXPECT_EQ(HumanReadableNumBytes(val), HumanReadableNumBytes(val, buf));
+  }
+  for (double val : {-0.001, 0.0000012, 1.12, 87480.0, 382386614.40, -DBL_MAX}) {
+    EXPECT_EQ(HumanReadableElapsedTime(val), HumanReadableElapsedTime(val, buf));
+  }
+}
+
+TEST(HumanReadable, ParseBytes) {
+  int64_t val = 0;
+  EXPECT_TRUE(ParseHumanReadableBytes("4096", &val));
+  EXPECT_EQ(4096, val);
+  EXPECT_TRUE(ParseHumanReadableBytes("1023B", &val));
+  EXPECT_EQ(1023, val);
+  EXPECT_TRUE(ParseHumanReadableBytes("1.5KiB", &val));
+  EXPECT_EQ(1536, val);
+  EXPECT_TRUE(ParseHumanReadableBytes("2 GB", &val));
+  EXPECT_EQ(2LL << 30, val);
+  EXPECT_TRUE(ParseHumanReadableBytes("-1m", &val));
+  EXPECT_EQ(-(1 << 20), val);
+  EXPECT_TRUE(ParseHumanReadableBytes("7EiB", &val));
+  EXPECT_EQ(7LL << 60, val);
+
+  EXPECT_FALSE(ParseHumanReadableBytes("", &val));
+  EXPECT_FALSE(ParseHumanReadableBytes("KiB", &val));
+  EXPECT_FALSE(ParseHumanReadableBytes("1XiB", &val));
+  EXPECT_FALSE(ParseHumanReadableBytes("1KiBs", &val));
+  EXPECT_FALSE(ParseHumanReadableBytes("8EiB", &val));
+  EXPECT_FALSE(ParseHumanReadableBytes("inf", &val));
+
+  char buf[kHumanReadableBufSize];
+  EXPECT_TRUE(ParseHumanReadableBytes(HumanReadableNumBytes(1 << 30, buf), &val));
+  EXPECT_EQ(1 << 30, val);
+}
+
+TEST(HumanReadable, ParseElapsedTime) {
+  double val = 0;
+  EXPECT_TRUE(ParseHumanReadableElapsedTime("120 ms", &val));
+  EXPECT_DOUBLE_EQ(0.12, val);
+  EXPECT_TRUE(ParseHumanReadableElapsedTime("1.5 min", &val));
+  EXPECT_DOUBLE_EQ(90, val);
+  EXPECT_TRUE(ParseHumanReadableElapsedTime("-10s", &val));
+  EXPECT_DOUBLE_EQ(-10, val);
+  EXPECT_TRUE(ParseHumanReadableElapsedTime("2.5 years", &val));
+  EXPECT_DOUBLE_EQ(78892380, val);
+
+  EXPECT_FALSE(ParseHumanReadableElapsedTime("10", &val));
+  EXPECT_FALSE(ParseHumanReadableElapsedTime("10 sec", &val));
+}
+
 }  // namespace strings
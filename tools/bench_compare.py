@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+"""Compares two runs of the benchmarks and flags the statistically significant regressions.
+
+The inputs are the json files that the benchmark binaries write with --bench_json, or the
+directories with such files, e.g. the bench_results directories of two builds:
+
+  cmake --build build-old --target bench
+  cmake --build build-new --target bench
+  tools/bench_compare.py build-old/bench_results build-new/bench_results
+
+Every benchmark is compared by its repetitions (see BENCH_ARGS, --benchmark_repetitions=5 by
+default) with the two-sided Mann-Whitney U test, which does not assume normally distributed
+timings. A benchmark regressed if its median time grew by more than --threshold and the
+p-value is below --alpha. Exits with status 1 if any benchmark regressed.
+Requires only the python standard library.
+"""
+
+import argparse
+import json
+import math
+import os
+import statistics
+import sys
+
+TIME_UNITS = {"ns": 1.0, "us": 1e3, "ms": 1e6, "s": 1e9}
+
+
+def load_file(path, results):
+    with open(path) as f:
+        data = json.load(f)
+    prefix = os.path.splitext(os.path.basename(path))[0]
+    for b in data.get("benchmarks", []):
+        # The aggregates (mean, median, stddev) are computed from the repetitions again.
+        if b.get("run_type", "iteration") != "iteration" or b.get("error_occurred"):
+            continue
+        name = "%s/%s" % (prefix, b.get("run_name", b["name"]))
+        scale = TIME_UNITS[b.get("time_unit", "ns")]
+        results.setdefault(name, []).append(b[ARGS.metric] * scale)
+
+
+def load(path):
+    results = {}
+    if os.path.isdir(path):
+        for fname in sorted(os.listdir(path)):
+            if fname.endswith(".json"):
+                load_file(os.path.join(path, fname), results)
+    else:
+        load_file(path, results)
+    return results
+
+
+def exact_u_cdf(n1, n2):
+    """Returns the distribution of U for samples without ties as a list of probabilities."""
+    # counts[m][n][u] = number of orderings of m and n values with the statistic u.
+    counts = [[None] * (n2 + 1) for _ in range(n1 + 1)]
+    for m in range(n1 + 1):
+        for n in range(n2 + 1):
+            if m == 0 or n == 0:
+                counts[m][n] = [1]
+                continue
+            size = m * n + 1
+            cur = [0] * size
+            for u, c in enumerate(counts[m - 1][n]):
+                cur[u + n] += c
+            for u, c in enumerate(counts[m][n - 1]):
+                cur[u] += c
+            counts[m][n] = cur
+    total = math.comb(n1 + n2, n1)
+    return [c / total for c in counts[n1][n2]]
+
+
+def mann_whitney_p(a, b):
+    """Two-sided p-value of the Mann-Whitney U test."""
+    n1, n2 = len(a), len(b)
+    values = sorted([(v, 0) for v in a] + [(v, 1) for v in b])
+
+    # Average ranks of the ties.
+    ranks, tie_groups, i = [0.0] * len(values), [], 0
+    while i < len(values):
+        j = i
+        while j + 1 < len(values) and values[j + 1][0] == values[i][0]:
+            j += 1
+        for k in range(i, j + 1):
+            ranks[k] = (i + j) / 2 + 1
+        tie_groups.append(j - i + 1)
+        i = j + 1
+
+    r1 = sum(r for r, (_, side) in zip(ranks, values) if side == 0)
+    u = r1 - n1 * (n1 + 1) / 2
+    has_ties = any(t > 1 for t in tie_groups)
+
+    if not has_ties and n1 + n2 <= 40:
+        dist = exact_u_cdf(n1, n2)
+        u = int(round(u))
+        p = 2 * min(sum(dist[: u + 1]), sum(dist[u:]))
+        return min(1.0, p)
+
+    # Normal approximation with the tie and the continuity corrections.
+    n = n1 + n2
+    mean = n1 * n2 / 2
+    tie_term = sum(t**3 - t for t in tie_groups) / (n * (n - 1))
+    sigma = math.sqrt(n1 * n2 / 12 * ((n + 1) - tie_term))
+    if sigma == 0:
+        return 1.0
+    z = (abs(u - mean) - 0.5) / sigma
+    return min(1.0, math.erfc(max(z, 0) / math.sqrt(2)))
+
+
+def format_time(ns):
+    for unit, scale in (("s", 1e9), ("ms", 1e6), ("us", 1e3)):
+        if ns >= scale:
+            return "%.3g%s" % (ns / scale, unit)
+    return "%.3gns" % ns
+
+
+def main():
+    base, contender = load(ARGS.baseline), load(ARGS.contender)
+    rows, regressions = [], 0
+    for name in sorted(set(base) & set(contender)):
+        a, b = base[name], contender[name]
+        med_a, med_b = statistics.median(a), statistics.median(b)
+        change = (med_b - med_a) / med_a if med_a > 0 else 0.0
+        if len(a) < 2 or len(b) < 2:
+            p, verdict = None, "few samples"
+        else:
+            p = mann_whitney_p(a, b)
+            verdict = ""
+            if p < ARGS.alpha and abs(change) > ARGS.threshold:
+                verdict = "REGRESSION" if change > 0 else "improvement"
+        regressions += verdict == "REGRESSION"
+        if verdict or not ARGS.only_changed:
+            rows.append((name, format_time(med_a), format_time(med_b), "%+.1f%%" % (change * 100),
+                         "-" if p is None else "%.4f" % p, verdict))
+
+    header = ("benchmark", "baseline", "contender", "change", "p-value", "")
+    widths = [max(len(r[i]) for r in rows + [header]) for i in range(len(header))]
+    for row in [header] + rows:
+        print("  ".join(cell.ljust(w) for cell, w in zip(row, widths)).rstrip())
+
+    for name in sorted(set(base) ^ set(contender)):
+        print("only in %s: %s" % ("baseline" if name in base else "contender", name),
+              file=sys.stderr)
+    print("\n%d regressions of %d benchmarks" % (regressions, len(set(base) & set(contender))))
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("baseline", help="json file or directory of the baseline run")
+    parser.add_argument("contender", help="json file or directory of the new run")
+    parser.add_argument("--metric", default="real_time", choices=["real_time", "cpu_time"])
+    parser.add_argument("--alpha", type=float, default=0.05, help="significance level")
+    parser.add_argument("--threshold", type=float, default=0.05,
+                        help="minimal relative change of the median to report")
+    parser.add_argument("--only_changed", action="store_true",
+                        help="print only the significant changes")
+    ARGS = parser.parse_args()
+    sys.exit(main())
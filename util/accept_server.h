@@ -4,8 +4,11 @@
 
 #pragma once
 
+#include <chrono>
 #include <functional>
 #include <memory>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "base/pmr/memory_resource.h"
@@ -26,6 +29,8 @@ class AcceptServer {
       : AcceptServer(pool, nullptr, break_on_int) {
   }
 
+  // mr is used for the connection fiber stacks, nullptr means malloc. It is shared by all
+  // the proactor threads, base::SlabMemoryResource keeps per-thread heaps for that.
   AcceptServer(ProactorPool* pool, PMR_NS::memory_resource* mr, bool break_on_int);
 
   ~AcceptServer();
@@ -38,6 +43,63 @@ class AcceptServer {
 
   void Wait();
 
+  struct DrainProgress {
+    enum Phase : uint8_t {
+      DRAINING,    // waiting for the connections to finish their requests.
+      CANCELLING,  // the deadline passed, cancelling the io of the remaining connections.
+      DONE         // the server stopped.
+    };
+
+    Phase phase = DRAINING;
+    uint64_t initial_connections = 0;  // open when the drain started.
+    uint64_t open_connections = 0;
+    std::chrono::milliseconds elapsed{0};
+  };
+
+  struct DrainOptions {
+    // How long the connections have to finish their in-flight requests and close.
+    std::chrono::milliseconds deadline{30000};
+
+    // If set, called from the calling thread every progress_period and when the drain
+    // enters its next phase.
+    std::function<void(const DrainProgress&)> on_progress;
+    std::chrono::milliseconds progress_period{1000};
+  };
+
+  // Stops the server gracefully. Stops accepting connections, asks the connections to finish
+  // via Connection::OnDrain and waits for them to close until opts.deadline. Then cancels
+  // the outstanding io of the remaining connections in bulk and shuts them down. Every step
+  // runs on all the proactors in parallel. Blocks until the server stops, Wait() is not
+  // needed afterwards. Returns the progress of the DONE phase.
+  DrainProgress Drain(const DrainOptions& opts);
+
+  // Changes the number of active proactors of the pool at runtime, see
+  // ProactorPool::SetActiveSize. When the pool shrinks, the connections of the listeners
+  // on the parked proactors are asked to migrate to the active ones, which they do when they
+  // call Connection::MaybeMigrate, e.g. HttpConnection does between requests. The connections
+  // that do not call it keep running on the parked proactor until they close. When the pool grows, the new connections and
+  // ConnectionRebalancer fill the reactivated proactors. Must be called after Run().
+  void SetActiveProactors(size_t n);
+
+  // Hot restart. The running process calls HandOverListeners and its successor calls
+  // InheritListeners with the same uds_path before adding its listeners. The listening sockets,
+  // including the reuseport shards, are passed over the unix socket with SCM_RIGHTS. The
+  // successor adopts the sockets whose addresses match the ones of its AddListener and
+  // AddUDSListener calls instead of binding new ones. Once the successor runs, this server
+  // stops accepting but keeps serving its open connections, which should be finished
+  // with Drain. The pending connections in the kernel queues are accepted by the successor,
+  // hence no connection is dropped. The open connections are not handed over.
+  // Both calls block the calling thread until the exchange completes or timeout passes.
+
+  // Must be called after Run(). Listens on uds_path and waits for the successor to connect.
+  // If it fails, this server continues accepting.
+  std::error_code HandOverListeners(const char* uds_path, std::chrono::milliseconds timeout);
+
+  // Must be called before adding the listeners. Connects to the predecessor listening on
+  // uds_path and receives its listening sockets. The predecessor stops accepting
+  // when Run() is called, the sockets that no listener adopted are closed then.
+  std::error_code InheritListeners(const char* uds_path, std::chrono::milliseconds timeout);
+
   // Returns the port number to which the listener was bound.
   // Check-fails in case of an error.
   uint16_t AddListener(uint16_t port, ListenerInterface* listener);
@@ -58,9 +120,29 @@ class AcceptServer {
     backlog_ = backlog;
   }
 
+  // Enables accept sharding for the TCP listeners added afterwards: each proactor listens
+  // on its own SO_REUSEPORT socket and handles the connections it accepts, without
+  // a cross-thread handoff. PickConnectionProactor is not called in this mode.
+  // By default the kernel hashes connections across the sockets. If steer_by_cpu is set,
+  // a reuseport BPF program steers each connection to the proactor of the cpu that
+  // received it. The steering requires that proactor i is pinned to cpu i, otherwise
+  // it is not attached.
+  void set_reuseport_sharding(bool enable, bool steer_by_cpu = false) {
+    reuseport_sharding_ = enable;
+    steer_by_cpu_ = steer_by_cpu;
+  }
+
  private:
   void BreakListeners();
 
+  // Opens the SO_REUSEPORT sockets of the other proactors for the listener bound
+  // on main_sock.
+  std::error_code AddShardSockets(FiberSocketBase* main_sock, ListenerInterface* listener);
+
+  // Attaches the inherited sockets of a listener, the first one is its main socket
+  // and the rest are its reuseport shards.
+  std::error_code AdoptListener(std::vector<int> fds, ListenerInterface* listener);
+
   ProactorPool* pool_;
   PMR_NS::memory_resource* mr_;
 
@@ -72,7 +154,14 @@ class AcceptServer {
 
   bool was_run_ = false;
 
+  // The sockets received by InheritListeners keyed by their local address, and the connection
+  // to the predecessor, which is notified by Run().
+  std::unordered_map<std::string, std::vector<int>> inherited_;
+  int handover_fd_ = -1;
+
   uint16_t backlog_ = 128;
+  bool reuseport_sharding_ = false;
+  bool steer_by_cpu_ = false;
 };
 
 }  // namespace util
@@ -3,15 +3,20 @@
 //
 #include "util/accept_server.h"
 
+#include <absl/strings/str_cat.h>
+
 #include <thread>
 
+#include <boost/beast/core/flat_buffer.hpp>
 #include <boost/beast/http/dynamic_body.hpp>
 #include <boost/beast/http/string_body.hpp>
 #include <boost/beast/http/write.hpp>
 
 #include "base/gtest.h"
 #include "base/logging.h"
+#include "util/admission_controller.h"
 #include "util/asio_stream_adapter.h"
+#include "util/connection_rebalancer.h"
 #include "util/fibers/pool.h"
 #include "util/listener_interface.h"
 
@@ -27,6 +32,72 @@ using fb2::Pool;
 #define USE_URING 0
 #endif
 
+// Serves data in reads of at most max_read bytes and records the requested sizes.
+class FakeStreamSocket {
+ public:
+  FakeStreamSocket(string data, size_t max_read) : data_(std::move(data)), max_read_(max_read) {
+  }
+
+  io::Result<size_t> Recv(const io::MutableBytes& mb) {
+    iovec v{mb.data(), mb.size()};
+    return Recv(&v, 1);
+  }
+
+  io::Result<size_t> Recv(const iovec* v, uint32_t len) {
+    size_t requested = 0, total = 0;
+    for (uint32_t i = 0; i < len; ++i) {
+      requested += v[i].iov_len;
+      size_t n = min({v[i].iov_len, data_.size() - pos_, max_read_ - total});
+      memcpy(v[i].iov_base, data_.data() + pos_, n);
+      pos_ += n;
+      total += n;
+    }
+    reads.push_back(requested);
+    return total;
+  }
+
+  vector<size_t> reads;
+
+ private:
+  string data_;
+  size_t pos_ = 0, max_read_;
+};
+
+TEST(AsioStreamAdapterTest, ReadStringMessageDirect) {
+  string body(100000, 'x');
+  for (size_t i = 0; i < body.size(); i += 7)
+    body[i] = 'a' + i % 26;
+  string req = absl::StrCat("POST /big HTTP/1.1\r\nContent-Length: ", body.size(),
+                            "\r\n\r\n", body, "GET /next HTTP/1.1\r\n\r\n");
+  FakeStreamSocket sock(req, 30000);
+  AsioStreamAdapter<FakeStreamSocket> asa(sock);
+  boost::beast::flat_buffer buf;
+  boost::system::error_code ec;
+
+  h2::request_parser<h2::string_body> parser;
+  parser.body_limit(1 << 20);
+  ReadStringMessage(asa, buf, parser, 1 << 14, ec);
+  ASSERT_FALSE(ec) << ec.message();
+  h2::request<h2::string_body> msg = parser.release();
+  EXPECT_EQ("/big", msg.target());
+  EXPECT_TRUE(body == msg.body());
+  EXPECT_GE(msg.body().capacity(), body.size() + kBodyTailRoom);
+
+  // The header is read into buf, the rest of the body directly, in reads as large as what is
+  // left of it. The next request stays in the socket.
+  ASSERT_GE(sock.reads.size(), 3u);
+  EXPECT_GT(sock.reads[1], body.size() - 1000);
+  for (size_t i = 2; i < sock.reads.size(); ++i)
+    EXPECT_EQ(sock.reads[i - 1] - 30000, sock.reads[i]) << i;
+  EXPECT_EQ(0u, buf.size());
+
+  h2::request_parser<h2::string_body> next_parser;
+  ReadStringMessage(asa, buf, next_parser, 1 << 14, ec);
+  ASSERT_FALSE(ec) << ec.message();
+  EXPECT_EQ("/next", next_parser.get().target());
+  EXPECT_EQ(h2::verb::get, next_parser.get().method());
+}
+
 class TestConnection : public Connection {
  public:
   TestConnection(ProactorPool* pp) : pp_(pp) {
@@ -55,6 +126,12 @@ void TestConnection::HandleRequests() {
       break;
 
     CHECK(!ec) << ec << "/" << ec.message();
+    MarkActive();
+    MaybeMigrate();
+    if (ShouldShedRequest()) {
+      asa.write_some(boost::asio::buffer("busy", 4), ec);
+      continue;
+    }
     string_view sv(buf, res);
     if (sv == "migrate") {
       ++migrations;
@@ -73,6 +150,36 @@ void TestConnection::HandleRequests() {
   VLOG(1) << "TestConnection exit";
 }
 
+// Ignores the drain requests, so that the drain has to cancel it.
+class StubbornConnection : public TestConnection {
+ public:
+  using TestConnection::TestConnection;
+
+ protected:
+  void OnDrain() final {
+  }
+};
+
+// Echoes without ever calling MaybeMigrate, hence it stays on its proactor.
+class PinnedConnection : public Connection {
+ protected:
+  void HandleRequests() final {
+    char buf[128];
+    while (true) {
+      io::Result<size_t> res = socket_->Recv(io::MutableBuffer(buf));
+      if (!res || *res == 0 || socket_->Write(io::Buffer(string_view(buf, *res))))
+        break;
+    }
+  }
+};
+
+class PinnedListener : public ListenerInterface {
+ public:
+  Connection* NewConnection(ProactorBase* context) final {
+    return new PinnedConnection;
+  }
+};
+
 const char* kMaxConnectionsError = "max connections received";
 
 class TestListener : public ListenerInterface {
@@ -86,6 +193,76 @@ class TestListener : public ListenerInterface {
   }
 };
 
+// Every second connection ignores the drain requests.
+class DrainListener : public ListenerInterface {
+ public:
+  Connection* NewConnection(ProactorBase* context) final {
+    if (count_++ % 2)
+      return new StubbornConnection(pool());
+    return new TestConnection(pool());
+  }
+
+ private:
+  atomic_uint count_{0};
+};
+
+class CountingListener : public ListenerInterface {
+ public:
+  Connection* NewConnection(ProactorBase* context) final {
+    ++accepted;
+    return new TestConnection(pool());
+  }
+
+  atomic_uint accepted{0};
+};
+
+class RecyclableConnection : public TestConnection {
+ public:
+  using TestConnection::TestConnection;
+
+ protected:
+  bool Recycle() final {
+    migrations = 0;
+    return true;
+  }
+};
+
+class RecyclingListener : public ListenerInterface {
+ public:
+  Connection* NewConnection(ProactorBase* context) final {
+    CHECK(context == ProactorBase::me());
+    ++created;
+    return new RecyclableConnection(pool());
+  }
+
+  atomic_uint created{0};
+};
+
+// Checks that the connections run on a proactor pinned to their incoming cpu, if there is one.
+class PlacementListener : public ListenerInterface {
+ public:
+  Connection* NewConnection(ProactorBase* context) final {
+    return new TestConnection(pool());
+  }
+
+  atomic_uint started{0}, misplaced{0};
+
+ protected:
+  void OnConnectionStart(Connection* conn) final {
+    ++started;
+#ifdef __linux__
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    int fd = conn->socket()->native_handle();
+    CHECK_EQ(0, getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len));
+    const vector<unsigned>& ids = pool()->MapCpuToThreads(cpu);
+    unsigned index = ProactorBase::me()->GetPoolIndex();
+    if (!ids.empty() && find(ids.begin(), ids.end(), index) == ids.end())
+      ++misplaced;
+#endif
+  }
+};
+
 class AcceptServerTest : public testing::Test {
  protected:
   void SetUp() override;
@@ -235,6 +412,102 @@ TEST_F(AcceptServerTest, UDS) {
   as.Stop(true);
 }
 
+TEST_F(AcceptServerTest, IdleTimeout) {
+  const uint16_t kPort = 1235;
+  AcceptServer as{pp_.get(), false};
+  TestListener* listener = new TestListener;
+  listener->SetIdleTimeout(100ms);
+  auto ec = as.AddListener("localhost", kPort, listener);
+  ASSERT_FALSE(ec) << ec;
+  as.Run();
+
+  ProactorBase* pb = pp_->GetNextProactor();
+  unique_ptr<FiberSocketBase> idle(pb->CreateSocket()), active(pb->CreateSocket());
+  pb->Await([&] {
+    FiberSocketBase::endpoint_type ep{ep_.address(), kPort};
+    ASSERT_FALSE(idle->Connect(ep));
+    ASSERT_FALSE(active->Connect(ep));
+
+    // Keeps one of the connections busy for a few timeouts.
+    uint8_t buf[16];
+    for (unsigned i = 0; i < 15; ++i) {
+      ASSERT_FALSE(active->Write(io::Buffer("ping")));
+      ASSERT_TRUE(active->Recv(io::MutableBytes(buf)).has_value());
+      ThisFiber::SleepFor(20ms);
+    }
+
+    io::Result<size_t> res = idle->Recv(io::MutableBytes(buf));
+    EXPECT_TRUE(!res || *res == 0);  // closed by the server.
+    std::ignore = idle->Close();
+    std::ignore = active->Close();
+  });
+
+  ListenerInterface::IdleStats stats = listener->GetIdleStats();
+  EXPECT_EQ(1u, stats.closed);
+  EXPECT_GT(stats.rescheduled, 0u);
+  as.Stop(true);
+}
+
+TEST_F(AcceptServerTest, Admission) {
+  AdmissionController::Options opts;
+  opts.max_loop_lag = 5ms;
+  opts.overload_periods = 1;
+  opts.recover_periods = 1000;  // stays overloaded during the test.
+  AdmissionController ac(pp_.get(), opts);
+  ac.Start();
+
+  const uint16_t kPort = 1236;
+  AcceptServer as{pp_.get(), false};
+  TestListener* listener = new TestListener;
+  listener->SetAdmissionController(&ac, true);
+  auto ec = as.AddListener("localhost", kPort, listener);
+  ASSERT_FALSE(ec) << ec;
+  as.Run();
+
+  ProactorBase* pb = pp_->GetNextProactor();
+  FiberSocketBase::endpoint_type ep{ep_.address(), kPort};
+  unique_ptr<FiberSocketBase> admitted(pb->CreateSocket()), rejected(pb->CreateSocket());
+  uint8_t buf[16];
+  pb->Await([&] {
+    ASSERT_FALSE(admitted->Connect(ep));
+    ASSERT_FALSE(admitted->Write(io::Buffer("ping")));
+    auto res = admitted->Read(io::MutableBytes(buf, 4));
+    ASSERT_TRUE(res && *res == 4);
+    EXPECT_EQ("ping", string_view(reinterpret_cast<char*>(buf), 4));
+  });
+
+  // Stalls the event loops, so that their periodic samples run late.
+  pp_->AwaitBrief([](unsigned, ProactorBase*) {
+    auto until = chrono::steady_clock::now() + 50ms;
+    while (chrono::steady_clock::now() < until) {
+    }
+  });
+  for (unsigned i = 0; i < 200 && !(ac.IsOverloaded(0) && ac.IsOverloaded(1)); ++i)
+    this_thread::sleep_for(5ms);
+  ASSERT_TRUE(ac.IsOverloaded(0) && ac.IsOverloaded(1));
+  EXPECT_EQ(nullptr, ac.PickProactor());
+
+  pb->Await([&] {
+    ASSERT_FALSE(admitted->Write(io::Buffer("ping")));
+    auto res = admitted->Read(io::MutableBytes(buf, 4));
+    ASSERT_TRUE(res && *res == 4);
+    EXPECT_EQ("busy", string_view(reinterpret_cast<char*>(buf), 4));
+
+    ASSERT_FALSE(rejected->Connect(ep));
+    res = rejected->Recv(io::MutableBytes(buf));
+    EXPECT_TRUE(!res || *res == 0);  // closed by the server.
+    std::ignore = admitted->Close();
+    std::ignore = rejected->Close();
+  });
+
+  AdmissionController::Stats stats = ac.GetStats();
+  EXPECT_EQ(1u, stats.rejected);
+  EXPECT_EQ(1u, stats.shed);
+  EXPECT_GE(stats.overloads, 2u);
+  as.Stop(true);
+  ac.Stop();
+}
+
 TEST_F(AcceptServerTest, Migrate) {
   // Make sure the connection is active.
   client_sock_->proactor()->Await([&] { RunClient(client_sock_.get()); });
@@ -264,6 +537,57 @@ TEST_F(AcceptServerTest, Migrate) {
   ASSERT_EQ(200, conn->migrations);
 }
 
+TEST_F(AcceptServerTest, Rebalance) {
+  auto ping = [&] {
+    client_sock_->proactor()->Await([&] {
+      uint8_t buf[4];
+      auto ec = client_sock_->Write(io::Buffer("ping"));
+      ASSERT_FALSE(ec);
+      auto res = client_sock_->Read(io::MutableBytes(buf, 4));
+      ASSERT_TRUE(res && *res == 4);
+    });
+  };
+  ping();
+
+  ProactorBase* conn_pb = nullptr;
+  auto find_conn = [&] {
+    listener_->TraverseConnections(
+        [&](unsigned, Connection* c) { conn_pb = c->socket()->proactor(); });
+  };
+  find_conn();
+  ASSERT_TRUE(conn_pb);
+
+  // Overload the proactor of the connection.
+  atomic_bool stop{false};
+  fb2::Fiber busy = conn_pb->LaunchFiber([&] {
+    while (!stop.load(memory_order_relaxed)) {
+      auto deadline = chrono::steady_clock::now() + 1ms;
+      while (chrono::steady_clock::now() < deadline) {
+      }
+      ThisFiber::Yield();
+    }
+  });
+
+  ConnectionRebalancer::Options opts;
+  opts.period = 10ms;
+  opts.hysteresis_periods = 2;
+  ConnectionRebalancer rebalancer(listener_, pp_.get(), opts);
+  rebalancer.Start();
+
+  ProactorBase* start_pb = conn_pb;
+  for (unsigned i = 0; i < 500 && conn_pb == start_pb; ++i) {
+    ping();
+    this_thread::sleep_for(2ms);
+    find_conn();
+  }
+  rebalancer.Stop();
+  stop = true;
+  busy.Join();
+
+  EXPECT_NE(start_pb, conn_pb);
+  EXPECT_GE(rebalancer.stats().migrations_requested, 1u);
+}
+
 TEST_F(AcceptServerTest, Shutdown) {
   listener_->SetMaxClients(1 << 16);
   auto* proactor = client_sock_->proactor();
@@ -308,4 +632,282 @@ TEST_F(AcceptServerTest, Shutdown) {
   });
 }
 
+TEST_F(AcceptServerTest, Drain) {
+  const uint16_t kPort = 1236;
+  AcceptServer as{pp_.get(), false};
+  auto ec = as.AddListener("localhost", kPort, new DrainListener);
+  ASSERT_FALSE(ec) << ec;
+  as.Run();
+
+  ProactorBase* pb = pp_->GetNextProactor();
+  unique_ptr<FiberSocketBase> graceful(pb->CreateSocket()), stubborn(pb->CreateSocket());
+  pb->Await([&] {
+    FiberSocketBase::endpoint_type ep{ep_.address(), kPort};
+    uint8_t buf[16];
+    for (FiberSocketBase* sock : {graceful.get(), stubborn.get()}) {
+      ASSERT_FALSE(sock->Connect(ep));
+      ASSERT_FALSE(sock->Write(io::Buffer("ping")));
+      ASSERT_TRUE(sock->Recv(io::MutableBytes(buf)).has_value());
+    }
+  });
+
+  vector<AcceptServer::DrainProgress> reports;
+  AcceptServer::DrainOptions opts;
+  opts.deadline = 200ms;
+  opts.progress_period = 10ms;
+  opts.on_progress = [&](const AcceptServer::DrainProgress& p) { reports.push_back(p); };
+  AcceptServer::DrainProgress res = as.Drain(opts);
+
+  EXPECT_EQ(AcceptServer::DrainProgress::DONE, res.phase);
+  EXPECT_EQ(2u, res.initial_connections);
+  EXPECT_EQ(0u, res.open_connections);
+  EXPECT_GE(res.elapsed, opts.deadline);
+
+  // The graceful connection closes as soon as it is asked to, the stubborn one is cancelled.
+  ASSERT_GE(reports.size(), 3u);
+  EXPECT_EQ(AcceptServer::DrainProgress::DRAINING, reports.front().phase);
+  EXPECT_EQ(1u, reports[reports.size() - 3].open_connections);
+  EXPECT_EQ(AcceptServer::DrainProgress::CANCELLING, reports[reports.size() - 2].phase);
+  EXPECT_EQ(1u, reports[reports.size() - 2].open_connections);
+
+  pb->Await([&] {
+    uint8_t buf[16];
+    for (FiberSocketBase* sock : {graceful.get(), stubborn.get()}) {
+      io::Result<size_t> res = sock->Recv(io::MutableBytes(buf));
+      EXPECT_TRUE(!res || *res == 0);  // closed by the server.
+      std::ignore = sock->Close();
+    }
+  });
+}
+
+TEST_F(AcceptServerTest, HandOverListeners) {
+  const uint16_t kPort = 1237;
+  const string path = testing::TempDir() + "accept_server_handover.sock";
+  AcceptServer old_as{pp_.get(), false}, new_as{pp_.get(), false};
+  CountingListener* old_listener = new CountingListener;
+  CountingListener* new_listener = new CountingListener;
+
+  auto ec = old_as.AddListener("127.0.0.1", kPort, old_listener);
+  ASSERT_FALSE(ec) << ec;
+  old_as.Run();
+
+  ProactorBase* pb = pp_->GetNextProactor();
+  FiberSocketBase::endpoint_type ep{ep_.address(), kPort};
+  auto ping = [&](FiberSocketBase* sock) {
+    uint8_t buf[16];
+    ASSERT_FALSE(sock->Write(io::Buffer("ping")));
+    io::Result<size_t> res = sock->Recv(io::MutableBytes(buf));
+    ASSERT_TRUE(res.has_value());
+    EXPECT_EQ("ping", string_view(reinterpret_cast<char*>(buf), *res));
+  };
+
+  unique_ptr<FiberSocketBase> old_client(pb->CreateSocket()), new_client(pb->CreateSocket());
+  pb->Await([&] {
+    ASSERT_FALSE(old_client->Connect(ep));
+    ping(old_client.get());
+  });
+
+  error_code handover_ec;
+  thread handover([&] { handover_ec = old_as.HandOverListeners(path.c_str(), 5s); });
+  ec = new_as.InheritListeners(path.c_str(), 5s);
+  ASSERT_FALSE(ec) << ec;
+  ec = new_as.AddListener("127.0.0.1", kPort, new_listener);
+  ASSERT_FALSE(ec) << ec;
+  new_as.Run();
+  handover.join();
+  ASSERT_FALSE(handover_ec) << handover_ec;
+
+  // The old server keeps serving its connection, the successor accepts the new ones.
+  pb->Await([&] {
+    ping(old_client.get());
+    ASSERT_FALSE(new_client->Connect(ep));
+    ping(new_client.get());
+  });
+  EXPECT_EQ(1u, old_listener->accepted);
+  EXPECT_EQ(1u, new_listener->accepted);
+
+  pb->Await([&] {
+    std::ignore = old_client->Close();
+    std::ignore = new_client->Close();
+  });
+  old_as.Stop(true);
+  new_as.Stop(true);
+}
+
+TEST_F(AcceptServerTest, PlacementByIncomingCpu) {
+  const uint16_t kPort = 1238;
+  AcceptServer as{pp_.get(), false};
+  PlacementListener* listener = new PlacementListener;
+  listener->SetConnectionPlacement(ListenerInterface::ConnectionPlacement::INCOMING_CPU);
+  auto ec = as.AddListener("127.0.0.1", kPort, listener);
+  ASSERT_FALSE(ec) << ec;
+  as.Run();
+
+  constexpr unsigned kNumConns = 8;
+  vector<unique_ptr<FiberSocketBase>> clients(kNumConns);
+  FiberSocketBase::endpoint_type ep{ep_.address(), kPort};
+  for (unsigned i = 0; i < kNumConns; ++i) {
+    ProactorBase* pb = pp_->at(i % pp_->size());
+    clients[i].reset(pb->CreateSocket());
+    pb->Await([&] {
+      uint8_t buf[16];
+      ASSERT_FALSE(clients[i]->Connect(ep));
+      ASSERT_FALSE(clients[i]->Write(io::Buffer("ping")));
+      ASSERT_TRUE(clients[i]->Recv(io::MutableBytes(buf)).has_value());
+    });
+  }
+
+  EXPECT_EQ(kNumConns, listener->started);
+  EXPECT_EQ(0u, listener->misplaced);
+
+  for (auto& client : clients)
+    client->proactor()->Await([&] { std::ignore = client->Close(); });
+  as.Stop(true);
+}
+
+TEST_F(AcceptServerTest, RecycleConnections) {
+  const uint16_t kPort = 1239;
+  AcceptServer as{pp_.get(), false};
+  RecyclingListener* listener = new RecyclingListener;
+  listener->SetConnectionRecycling(4);
+  auto ec = as.AddListener("127.0.0.1", kPort, listener);
+  ASSERT_FALSE(ec) << ec;
+  as.Run();
+
+  constexpr unsigned kNumConns = 10;
+  ProactorBase* pb = pp_->GetNextProactor();
+  FiberSocketBase::endpoint_type ep{ep_.address(), kPort};
+  pb->Await([&] {
+    for (unsigned i = 0; i < kNumConns; ++i) {
+      unique_ptr<FiberSocketBase> client(pb->CreateSocket());
+      uint8_t buf[16];
+      ASSERT_FALSE(client->Connect(ep));
+      ASSERT_FALSE(client->Write(io::Buffer("ping")));
+      ASSERT_TRUE(client->Recv(io::MutableBytes(buf)).has_value());
+      std::ignore = client->Close();
+
+      // Waits for the server to close the connection, so that the next one can reuse it.
+      for (unsigned j = 0; j < 1000 && listener->GetRecycleStats().recycled <= i; ++j)
+        ThisFiber::SleepFor(1ms);
+    }
+  });
+
+  ListenerInterface::RecycleStats stats = listener->GetRecycleStats();
+  EXPECT_EQ(kNumConns, stats.recycled);
+  EXPECT_EQ(0u, stats.discarded);
+  EXPECT_LE(listener->created, pp_->size());
+  EXPECT_EQ(kNumConns, listener->created + stats.reused);
+  as.Stop(true);
+}
+
+TEST_F(AcceptServerTest, ParkProactors) {
+  const uint16_t kPort = 1240;
+  AcceptServer as{pp_.get(), false};
+  TestListener* listener = new TestListener;
+  auto ec = as.AddListener("127.0.0.1", kPort, listener);
+  ASSERT_FALSE(ec) << ec;
+  as.Run();
+
+  constexpr unsigned kNumConns = 4;
+  vector<unique_ptr<FiberSocketBase>> clients(kNumConns + 1);
+  ProactorBase* pb = pp_->at(0);
+  FiberSocketBase::endpoint_type ep{ep_.address(), kPort};
+  auto ping = [](FiberSocketBase* client) {
+    uint8_t buf[16];
+    ASSERT_FALSE(client->Write(io::Buffer("ping")));
+    ASSERT_TRUE(client->Recv(io::MutableBytes(buf)).has_value());
+  };
+  auto connect = [&](unique_ptr<FiberSocketBase>& client) {
+    client.reset(pb->CreateSocket());
+    ASSERT_FALSE(client->Connect(ep));
+    ping(client.get());
+  };
+  auto count_parked = [&] {
+    atomic_uint parked{0};
+    listener->TraverseConnections([&](unsigned index, Connection*) {
+      if (!pp_->IsActive(index))
+        ++parked;
+    });
+    return parked.load();
+  };
+
+  pb->Await([&] {
+    for (unsigned i = 0; i < kNumConns; ++i)
+      connect(clients[i]);
+  });
+
+  as.SetActiveProactors(1);
+  EXPECT_EQ(1u, pp_->active_size());
+  EXPECT_EQ(pp_->at(0), pp_->GetNextProactor());
+
+  // The connections migrate when they handle their next request.
+  pb->Await([&] {
+    for (unsigned i = 0; i < kNumConns; ++i)
+      ping(clients[i].get());
+    connect(clients[kNumConns]);
+  });
+  EXPECT_EQ(0u, count_parked());
+
+  as.SetActiveProactors(2);
+  EXPECT_EQ(2u, pp_->active_size());
+
+  pb->Await([&] {
+    for (auto& client : clients)
+      std::ignore = client->Close();
+  });
+  as.Stop(true);
+}
+
+TEST_F(AcceptServerTest, ParkProactorsPinned) {
+  const uint16_t kPort = 1241;
+  AcceptServer as{pp_.get(), false};
+  PinnedListener* listener = new PinnedListener;
+  auto ec = as.AddListener("127.0.0.1", kPort, listener);
+  ASSERT_FALSE(ec) << ec;
+  as.Run();
+
+  constexpr unsigned kNumConns = 4;
+  vector<unique_ptr<FiberSocketBase>> clients(kNumConns);
+  ProactorBase* pb = pp_->at(0);
+  FiberSocketBase::endpoint_type ep{ep_.address(), kPort};
+  auto ping = [](FiberSocketBase* client) {
+    uint8_t buf[16];
+    ASSERT_FALSE(client->Write(io::Buffer("ping")));
+    ASSERT_TRUE(client->Recv(io::MutableBytes(buf)).has_value());
+  };
+  auto count_on = [&](unsigned proactor) {
+    atomic_uint count{0};
+    listener->TraverseConnections([&](unsigned index, Connection*) {
+      if (index == proactor)
+        ++count;
+    });
+    return count.load();
+  };
+
+  pb->Await([&] {
+    for (auto& client : clients) {
+      client.reset(pb->CreateSocket());
+      ASSERT_FALSE(client->Connect(ep));
+      ping(client.get());
+    }
+  });
+  unsigned parked = count_on(1);
+  ASSERT_GT(parked, 0u);
+
+  // The connections that do not call MaybeMigrate keep serving from the parked proactor.
+  as.SetActiveProactors(1);
+  pb->Await([&] {
+    for (auto& client : clients)
+      ping(client.get());
+  });
+  EXPECT_EQ(parked, count_on(1));
+
+  as.SetActiveProactors(2);
+  pb->Await([&] {
+    for (auto& client : clients)
+      std::ignore = client->Close();
+  });
+  as.Stop(true);
+}
+
 }  // namespace util
@@ -0,0 +1,109 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace util {
+
+class ProactorPool;
+
+namespace fb2 {
+class ProactorBase;
+}  // namespace fb2
+
+// Tracks the load of the proactors of a pool and marks the overloaded ones, so that listeners
+// stop handing them new connections (see ListenerInterface::SetAdmissionController) and
+// connections may shed requests (see Connection::ShouldShedRequest). Every period each proactor
+// samples its own signals from a periodic task: the number of ready fibers, how late the task
+// ran, i.e. the lag of the event loop, and how many times the loop stalled waiting for I/O.
+// A proactor becomes overloaded once any signal crosses its threshold during overload_periods
+// consecutive periods, and recovers after all of them stay below during recover_periods.
+class AdmissionController {
+ public:
+  struct Options {
+    std::chrono::milliseconds period{10};
+
+    uint32_t max_ready_fibers = 1000;
+    std::chrono::microseconds max_loop_lag{5000};
+
+    // A loop that never stalls in a period is saturated. 0 disables the signal, which
+    // is advisable with spinning idle policies, see ProactorBase::SetIdlePolicy.
+    uint32_t min_stalls_per_period = 0;
+
+    unsigned overload_periods = 2;
+    unsigned recover_periods = 5;
+
+    // How long an accept loop may wait for a proactor that is not overloaded before it rejects
+    // the connection. Waiting leaves the pending connections in the kernel backlog, which
+    // throttles the clients instead of making them reconnect. 0 rejects right away.
+    std::chrono::milliseconds max_accept_delay{0};
+  };
+
+  struct Stats {
+    uint64_t overloads = 0;  // transitions of proactors into the overloaded state.
+    uint64_t redirected = 0;  // connections moved from an overloaded proactor to another one.
+    uint64_t delayed = 0;  // connections that waited for a proactor to recover.
+    uint64_t rejected = 0;
+    uint64_t shed = 0;  // requests for which Connection::ShouldShedRequest returned true.
+  };
+
+  AdmissionController(ProactorPool* pool, const Options& opts);
+  explicit AdmissionController(ProactorPool* pool) : AdmissionController(pool, Options{}) {
+  }
+
+  ~AdmissionController();
+
+  // Starts sampling on all the proactors of the pool.
+  void Start();
+
+  // Stops sampling and clears the overloaded states. Must be called before destruction.
+  void Stop();
+
+  // Can be called from any thread.
+  bool IsOverloaded(unsigned pool_index) const {
+    return states_[pool_index].overloaded.load(std::memory_order_relaxed);
+  }
+
+  // Returns a proactor that is not overloaded, or nullptr if all of them are.
+  // Can be called from any thread.
+  fb2::ProactorBase* PickProactor();
+
+  // Decides where a new connection that was assigned to *dest should run. May wait up to
+  // max_accept_delay, must be called from a fiber. Returns false if the connection should be
+  // rejected.
+  bool AdmitConnection(fb2::ProactorBase** dest);
+
+  // Returns true and counts the request as shed if the calling proactor is overloaded.
+  bool ShouldShed();
+
+  Stats GetStats() const;
+
+ private:
+  struct alignas(64) ProactorState {
+    std::atomic_bool overloaded{false};
+
+    // Accessed only by the proactor thread.
+    uint64_t last_sample_ns = 0;
+    uint64_t last_stalls = 0;
+    unsigned hot_periods = 0, cool_periods = 0;
+  };
+
+  void Sample(unsigned index, fb2::ProactorBase* pb);
+
+  ProactorPool* pool_;
+  Options opts_;
+  std::unique_ptr<ProactorState[]> states_;
+  std::vector<uint32_t> periodic_ids_;
+  std::atomic_uint32_t next_pick_{0};
+
+  std::atomic<uint64_t> overloads_{0}, redirected_{0}, delayed_{0}, rejected_{0}, shed_{0};
+};
+
+}  // namespace util
@@ -4,8 +4,17 @@
 
 #pragma once
 
+#include <absl/strings/internal/resize_uninitialized.h>
+
 #include <boost/asio/detail/buffer_sequence_adapter.hpp>
+#include <boost/beast/core/buffers_prefix.hpp>
+#include <boost/beast/core/buffers_range.hpp>
+#include <boost/beast/http/error.hpp>
+#include <boost/beast/http/parser.hpp>
+#include <boost/beast/http/read.hpp>
+#include <boost/beast/http/string_body.hpp>
 #include <boost/system/error_code.hpp>
+#include <string>
 
 #include "util/fiber_socket_base.h"
 
@@ -20,7 +29,14 @@ template <typename Socket = FiberSocketBase> class AsioStreamAdapter {
   explicit AsioStreamAdapter(Socket& s) : s_(s) {
   }
 
+  Socket& socket() {
+    return s_;
+  }
+
   // Read/Write functions should be called from IoContext thread.
+  // The buffer sequences are passed to the socket as iovec arrays, without copying. Sequences
+  // of more than 64 buffers are read or written partially, as permitted by
+  // read_some/write_some.
   // (fiber) SyncRead interface:
   // https://www.boost.org/doc/libs/1_69_0/doc/html/boost_asio/reference/SyncReadStream.html
   template <typename MBS> size_t read_some(const MBS& bufs, error_code& ec);
@@ -44,8 +60,14 @@ size_t AsioStreamAdapter<Socket>::read_some(const MBS& bufs, error_code& ec) {
   using badapter =
       ::boost::asio::detail::buffer_sequence_adapter<boost::asio::mutable_buffer, const MBS&>;
   badapter bsa(bufs);
-
-  auto res = s_.Recv(bsa.buffers(), bsa.count());
+  if (bsa.all_empty())
+    return 0;
+
+  // A single buffer does not need a msghdr.
+  const iovec* v = bsa.buffers();
+  auto res = bsa.count() == 1
+                 ? s_.Recv(io::MutableBytes{static_cast<uint8_t*>(v->iov_base), v->iov_len})
+                 : s_.Recv(v, bsa.count());
   if (res)
     return res.value();
   ec = error_code(std::move(res.error()).value(), boost::system::system_category());
@@ -59,8 +81,9 @@ size_t AsioStreamAdapter<Socket>::write_some(const BS& bufs, error_code& ec) {
   using badapter =
       ::boost::asio::detail::buffer_sequence_adapter<boost::asio::const_buffer, const BS&>;
   badapter bsa(bufs);
+  if (bsa.all_empty())
+    return 0;
 
-  std::error_code lec;
   auto res = s_.WriteSome(bsa.buffers(), bsa.count());
   if (res) {
     return res.value();
@@ -70,4 +93,70 @@ size_t AsioStreamAdapter<Socket>::write_some(const BS& bufs, error_code& ec) {
   return 0;
 }
 
+// Bytes reserved past the end of the bodies that ReadStringMessage reads directly, so that
+// SIMD parsers, e.g. simdjson, can parse them in place.
+constexpr size_t kBodyTailRoom = 64;
+
+namespace detail {
+
+// Grows s to n bytes without zeroing the new ones where the standard library allows it, i.e.
+// with resize_and_overwrite of C++23 or the default-init resize of libc++.
+inline void ResizeUninitialized(std::string* s, size_t n) {
+#ifdef __cpp_lib_string_resize_and_overwrite
+  s->resize_and_overwrite(n, [](char*, size_t len) { return len; });
+#else
+  absl::strings_internal::STLStringResizeUninitialized(s, n);
+#endif
+}
+
+}  // namespace detail
+
+// Reads a message like ::boost::beast::http::read, except that a body of at least
+// min_direct bytes with a known length bypasses buf and the parser: it is read from the socket
+// directly into the body, with reads as large as the rest of the body. Upon success the message
+// is complete and should be released from parser, buf holds the bytes that follow it.
+template <typename Socket, typename DynamicBuffer, bool isRequest>
+void ReadStringMessage(
+    AsioStreamAdapter<Socket>& asa, DynamicBuffer& buf,
+    ::boost::beast::http::parser<isRequest, ::boost::beast::http::string_body>& parser,
+    size_t min_direct, ::boost::system::error_code& ec) {
+  namespace h2 = ::boost::beast::http;
+
+  h2::read_header(asa, buf, parser, ec);
+  if (ec || parser.is_done())
+    return;
+
+  auto length = parser.content_length_remaining();
+  if (parser.chunked() || !length || *length < min_direct) {
+    h2::read(asa, buf, parser, ec);
+    return;
+  }
+
+  // The parser enforced the body limit already.
+  std::string& body = parser.get().body();
+  size_t left = *length;
+  body.reserve(left + kBodyTailRoom);
+  size_t buffered = std::min<size_t>(buf.size(), left);
+  auto prefix = ::boost::beast::buffers_prefix(buffered, buf.data());
+  for (auto b : ::boost::beast::buffers_range_ref(prefix))
+    body.append(static_cast<const char*>(b.data()), b.size());
+  buf.consume(buffered);
+  left -= buffered;
+
+  // The reads overwrite the new bytes, there is no need to zero them.
+  size_t pos = body.size();
+  detail::ResizeUninitialized(&body, pos + left);
+  while (left) {
+    size_t n = asa.read_some(::boost::asio::mutable_buffer(body.data() + pos, left), ec);
+    if (ec)
+      return;
+    if (n == 0) {
+      ec = h2::error::partial_message;
+      return;
+    }
+    pos += n;
+    left -= n;
+  }
+}
+
 }  // namespace util
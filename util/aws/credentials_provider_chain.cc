@@ -7,10 +7,22 @@
 #include <aws/core/platform/Environment.h>
 
 #include "base/logging.h"
+#include "util/fibers/proactor_base.h"
 
 namespace util {
 namespace aws {
 
+using namespace std;
+
+namespace {
+
+// Milliseconds until the credentials expire, negative if they have expired.
+int64_t MillisToExpiration(const Aws::Auth::AWSCredentials& creds) {
+  return creds.GetExpiration().Millis() - Aws::Utils::DateTime::Now().Millis();
+}
+
+}  // namespace
+
 CredentialsProviderChain::CredentialsProviderChain() {
   providers_.push_back(std::make_pair(
       "environment", std::make_shared<Aws::Auth::EnvironmentAWSCredentialsProvider>()));
@@ -29,17 +41,111 @@ CredentialsProviderChain::CredentialsProviderChain() {
   }
 }
 
+CredentialsProviderChain::~CredentialsProviderChain() {
+  CHECK(!refresher_.IsJoinable()) << "StopRefresh must be called before destruction";
+}
+
 Aws::Auth::AWSCredentials CredentialsProviderChain::GetAWSCredentials() {
+  CredentialsPtr creds = Current();
+  if (!IsFresh(creds))
+    creds = Refresh(false);
+
+  return creds ? *creds : Aws::Auth::AWSCredentials{};
+}
+
+void CredentialsProviderChain::StartRefresh(fb2::ProactorBase* pb, const RefreshOptions& opts) {
+  CHECK(!refresher_.IsJoinable());
+  opts_ = opts;
+  background_.store(true, memory_order_relaxed);
+  refresher_ = pb->LaunchFiber("AwsCredsRefresh", [this] { RunRefresh(); });
+}
+
+void CredentialsProviderChain::StopRefresh() {
+  if (!refresher_.IsJoinable())
+    return;
+
+  stop_refresh_.Notify();
+  refresher_.Join();
+  background_.store(false, memory_order_relaxed);
+}
+
+shared_ptr<CredentialsProviderChain> CredentialsProviderChain::Shared() {
+  static shared_ptr<CredentialsProviderChain> chain = make_shared<CredentialsProviderChain>();
+  return chain;
+}
+
+auto CredentialsProviderChain::Load() -> CredentialsPtr {
   for (const auto& provider : providers_) {
     Aws::Auth::AWSCredentials credentials = provider.second->GetAWSCredentials();
     if (!credentials.GetAWSAccessKeyId().empty() && !credentials.GetAWSSecretKey().empty()) {
       LOG_FIRST_N(INFO, 1) << "aws: loaded credentials; provider=" << provider.first;
-      return credentials;
+      return make_shared<const Aws::Auth::AWSCredentials>(std::move(credentials));
     }
   }
 
   LOG(ERROR) << "aws: failed to load credentials; no credential provider found";
-  return Aws::Auth::AWSCredentials{};
+  return nullptr;
+}
+
+auto CredentialsProviderChain::Refresh(bool force) -> CredentialsPtr {
+  lock_guard lk(load_mu_);
+
+  // Another fiber might have loaded them while we waited.
+  CredentialsPtr creds = Current();
+  if (!force && IsFresh(creds))
+    return creds;
+
+  // Keeps serving the old credentials until they expire.
+  CredentialsPtr fallback = creds && MillisToExpiration(*creds) > 0 ? creds : nullptr;
+  auto now = chrono::steady_clock::now();
+  if (!force && now < retry_at_)
+    return fallback;
+
+  CredentialsPtr loaded = Load();
+  if (!loaded) {
+    // The refresher retries with its own interval.
+    if (!force) {
+      retry_backoff_ = min<chrono::milliseconds>(max(retry_backoff_ * 2, 1000ms),
+                                                 opts_.retry_interval);
+      retry_at_ = now + retry_backoff_;
+    }
+    return fallback;
+  }
+
+  retry_backoff_ = 0ms;
+  retry_at_ = {};
+  lock_guard cur_lk(mu_);
+  current_ = loaded;
+  return loaded;
+}
+
+bool CredentialsProviderChain::IsFresh(const CredentialsPtr& creds) const {
+  if (!creds)
+    return false;
+
+  // The refresher reloads the credentials refresh_ahead before they expire, the requests
+  // load them synchronously only when the refresher is late.
+  int64_t margin_ms =
+      background_.load(memory_order_relaxed) ? 0 : opts_.refresh_ahead.count() * 1000;
+  return MillisToExpiration(*creds) > margin_ms;
+}
+
+chrono::milliseconds CredentialsProviderChain::NextRefresh(const CredentialsPtr& creds) const {
+  if (!creds)
+    return opts_.retry_interval;
+
+  chrono::milliseconds delay =
+      chrono::milliseconds(MillisToExpiration(*creds)) - opts_.refresh_ahead;
+  return clamp<chrono::milliseconds>(delay, opts_.retry_interval, opts_.max_interval);
+}
+
+void CredentialsProviderChain::RunRefresh() {
+  CredentialsPtr creds = Current();
+  chrono::milliseconds delay = creds ? NextRefresh(creds) : 0ms;
+
+  while (!stop_refresh_.WaitFor(delay)) {
+    delay = NextRefresh(Refresh(true));
+  }
 }
 
 }  // namespace aws
@@ -5,7 +5,20 @@
 
 #include <aws/core/auth/AWSCredentialsProviderChain.h>
 
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+
+#include "util/fibers/fibers.h"
+#include "util/fibers/synchronization.h"
+
 namespace util {
+
+namespace fb2 {
+class ProactorBase;
+}  // namespace fb2
+
 namespace aws {
 
 // Loads a chain of providers:
@@ -16,14 +29,81 @@ namespace aws {
 //
 // Note we avoid using the default credentials chain to avoid blocking the
 // thread, such as we don't support the process credential provider.
+//
+// The loaded credentials are cached. GetAWSCredentials loads them only if the cache is empty
+// or the credentials expire soon, and a single caller loads while the others wait for it.
+// After a failed load the callers do not load again until an exponential backoff, capped by
+// retry_interval, elapses. With StartRefresh, a fiber reloads the credentials before they
+// expire, so that the requests never wait for IMDS or STS. Sharing one chain between the
+// clients, see Shared(), also keeps the signing keys that AWSAuthV4Signer derives per day,
+// region and service valid, since they are derived again only when the secret key changes.
 class CredentialsProviderChain : public Aws::Auth::AWSCredentialsProviderChain {
  public:
+  struct RefreshOptions {
+    // Credentials are reloaded when they expire within this duration.
+    std::chrono::seconds refresh_ahead{300};
+
+    // Credentials without an expiration, e.g. from the environment, are reloaded with this
+    // period, so that rotated files are picked up.
+    std::chrono::seconds max_interval{900};
+
+    // The delay before retrying a failed load. Also caps the backoff of the loads by
+    // GetAWSCredentials.
+    std::chrono::seconds retry_interval{10};
+  };
+
   CredentialsProviderChain();
+  ~CredentialsProviderChain();
 
   virtual Aws::Auth::AWSCredentials GetAWSCredentials() override;
 
+  // Starts a fiber on pb that refreshes the credentials in the background.
+  void StartRefresh(fb2::ProactorBase* pb, const RefreshOptions& opts);
+  void StartRefresh(fb2::ProactorBase* pb) {
+    StartRefresh(pb, RefreshOptions{});
+  }
+
+  // Must be called before the proactor stops if StartRefresh was called.
+  void StopRefresh();
+
+  // The chain shared by the clients of the process.
+  static std::shared_ptr<CredentialsProviderChain> Shared();
+
  private:
+  using CredentialsPtr = std::shared_ptr<const Aws::Auth::AWSCredentials>;
+
+  // Loads the credentials from the first provider that has them. Returns null if none has.
+  CredentialsPtr Load();
+
+  // Loads and caches the credentials, unless another fiber refreshed them in the meantime.
+  CredentialsPtr Refresh(bool force);
+
+  CredentialsPtr Current() const {
+    std::lock_guard lk(mu_);
+    return current_;
+  }
+
+  bool IsFresh(const CredentialsPtr& creds) const;
+
+  // The delay of the next background refresh after loading creds.
+  std::chrono::milliseconds NextRefresh(const CredentialsPtr& creds) const;
+  void RunRefresh();
+
   std::vector<std::pair<std::string, std::shared_ptr<AWSCredentialsProvider>>> providers_;
+
+  mutable std::mutex mu_;  // protects current_ only.
+  CredentialsPtr current_;
+
+  fb2::Mutex load_mu_;  // serializes the loads.
+
+  // The backoff of the loads by GetAWSCredentials after a failure, protected by load_mu_.
+  std::chrono::milliseconds retry_backoff_{0};
+  std::chrono::steady_clock::time_point retry_at_;
+
+  RefreshOptions opts_;
+  std::atomic_bool background_{false};  // whether refresher_ runs.
+  fb2::Fiber refresher_;
+  fb2::Done stop_refresh_;
 };
 
 }  // namespace aws
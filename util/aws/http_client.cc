@@ -3,21 +3,29 @@
 
 #include "util/aws/http_client.h"
 
+#include <absl/container/node_hash_map.h>
 #include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
 #include <aws/core/http/HttpRequest.h>
 #include <aws/core/http/HttpResponse.h>
 #include <aws/core/http/standard/StandardHttpResponse.h>
 
+#include <algorithm>
+#include <atomic>
 #include <boost/beast/http/message.hpp>
+#include <boost/beast/http/parser.hpp>
 #include <boost/beast/http/read.hpp>
 #include <boost/beast/http/string_body.hpp>
 #include <boost/beast/http/write.hpp>
 #include <boost/interprocess/streams/bufferstream.hpp>
+#include <optional>
 
 #include "base/logging.h"
 #include "util/asio_stream_adapter.h"
 #include "util/fibers/dns_resolve.h"
+#include "util/fibers/synchronization.h"
 #include "util/http/http_client.h"
+#include "util/tls/tls_session_cache.h"
 #include "util/tls/tls_socket.h"
 
 namespace util {
@@ -29,6 +37,14 @@ namespace {
 
 constexpr unsigned kHttpVersion1_1 = 11;
 
+// S3 closes connections that are idle for about 20 seconds, we drop them a bit earlier
+// to avoid sending requests into half closed connections.
+constexpr auto kMaxIdleTime = std::chrono::seconds(15);
+
+std::string_view MethodName(Aws::Http::HttpMethod method) {
+  return Aws::Http::HttpMethodMapper::GetNameForHttpMethod(method);
+}
+
 h2::verb BoostMethod(Aws::Http::HttpMethod method) {
   switch (method) {
     case Aws::Http::HttpMethod::HTTP_GET:
@@ -49,14 +65,143 @@ h2::verb BoostMethod(Aws::Http::HttpMethod method) {
   }
 }
 
+// Requests that can be sent again if the server may already have processed them. PUT and
+// POST are not, e.g. UploadPart and CompleteMultipartUpload.
+bool IsIdempotent(Aws::Http::HttpMethod method) {
+  return method == Aws::Http::HttpMethod::HTTP_GET ||
+         method == Aws::Http::HttpMethod::HTTP_HEAD ||
+         method == Aws::Http::HttpMethod::HTTP_DELETE;
+}
+
+enum class SendStatus {
+  OK,
+  ERROR,
+  // The connection was closed by the peer before we received any response bytes.
+  // If the connection came from the pool, it was most likely idle for too long. The request
+  // can be retried on a new connection if it was not written or if it is idempotent.
+  CLOSED,
+};
+
 }  // namespace
 
+// Idle connections of a single proactor. Accessed only from the proactor thread, therefore
+// does not need locking.
+class HttpClient::ConnectionPool {
+ public:
+  // Waits until the endpoint has less than limit connections in use and takes one.
+  // Returns an idle connection to the endpoint, or null if the caller should establish
+  // a new one. In both cases the caller must call Release when done.
+  std::unique_ptr<FiberSocketBase> Acquire(const std::string& key, unsigned limit);
+
+  // Returns the connection acquired for key. Closes conn unless reusable is set.
+  // conn may be null if the caller failed to connect.
+  void Release(const std::string& key, std::unique_ptr<FiberSocketBase> conn, bool reusable,
+               unsigned limit);
+
+  void CloseAll();
+
+  void AddStats(PoolStats* stats) const {
+    stats->hits += hits_.load(std::memory_order_relaxed);
+    stats->misses += misses_.load(std::memory_order_relaxed);
+    stats->evictions += evictions_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  struct IdleConn {
+    std::unique_ptr<FiberSocketBase> sock;
+    std::chrono::steady_clock::time_point since;
+  };
+
+  struct Endpoint {
+    std::vector<IdleConn> idle;  // the most recently used connection is at the back.
+    unsigned in_use = 0;
+    fb2::EventCount released;
+  };
+
+  void CloseIdle(IdleConn* conn) {
+    std::ignore = conn->sock->Close();
+    evictions_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // node_hash_map since waiters reference their endpoint while suspended.
+  absl::node_hash_map<std::string, Endpoint> endpoints_;
+
+  // Written only by the proactor thread, but read by GetPoolStats from any thread.
+  std::atomic_uint64_t hits_{0}, misses_{0}, evictions_{0};
+};
+
+auto HttpClient::ConnectionPool::Acquire(const std::string& key, unsigned limit)
+    -> std::unique_ptr<FiberSocketBase> {
+  Endpoint& ep = endpoints_[key];
+  ep.released.await([&] { return ep.in_use < limit; });
+  ep.in_use++;
+
+  const auto now = std::chrono::steady_clock::now();
+  while (!ep.idle.empty()) {
+    IdleConn conn = std::move(ep.idle.back());
+    ep.idle.pop_back();
+    if (now - conn.since < kMaxIdleTime) {
+      hits_.fetch_add(1, std::memory_order_relaxed);
+      return std::move(conn.sock);
+    }
+
+    // The older connections are at the front, so they are expired as well.
+    CloseIdle(&conn);
+    for (IdleConn& c : ep.idle) {
+      CloseIdle(&c);
+    }
+    ep.idle.clear();
+  }
+
+  misses_.fetch_add(1, std::memory_order_relaxed);
+  return nullptr;
+}
+
+void HttpClient::ConnectionPool::Release(const std::string& key,
+                                         std::unique_ptr<FiberSocketBase> conn, bool reusable,
+                                         unsigned limit) {
+  auto it = endpoints_.find(key);
+  DCHECK(it != endpoints_.end());
+  Endpoint& ep = it->second;
+
+  if (conn) {
+    if (reusable) {
+      ep.idle.push_back(IdleConn{std::move(conn), std::chrono::steady_clock::now()});
+      if (ep.idle.size() > limit) {
+        CloseIdle(&ep.idle.front());
+        ep.idle.erase(ep.idle.begin());
+      }
+    } else {
+      std::ignore = conn->Close();
+    }
+  }
+
+  DCHECK_GT(ep.in_use, 0u);
+  ep.in_use--;
+  ep.released.notify();
+}
+
+void HttpClient::ConnectionPool::CloseAll() {
+  for (auto& [key, ep] : endpoints_) {
+    DCHECK_EQ(ep.in_use, 0u) << key;
+    for (IdleConn& c : ep.idle) {
+      std::ignore = c.sock->Close();
+    }
+    ep.idle.clear();
+  }
+}
+
 HttpClient::HttpClient(const Aws::Client::ClientConfiguration& client_conf)
     : client_conf_{client_conf} {
   ctx_ = util::http::TlsClient::CreateSslContext();
 }
 
 HttpClient::~HttpClient() {
+  // Sockets must be closed in the threads of their proactors.
+  for (auto& [proactor, pool] : pools_) {
+    proactor->Await([pool = pool.get()] { pool->CloseAll(); });
+  }
+  pools_.clear();
   SSL_CTX_free(ctx_);
 }
 
@@ -107,80 +252,95 @@ std::shared_ptr<Aws::Http::HttpResponse> HttpClient::MakeRequest(
   std::shared_ptr<Aws::Http::HttpResponse> response =
       std::make_shared<Aws::Http::Standard::StandardHttpResponse>(request);
 
-  // To keep the HTTP client simple and thread safe, reconect on each request.
-  // Given we have large request/responses (8MB) the cost of reconnecting
-  // is negligible.
-  io::Result<std::unique_ptr<FiberSocketBase>> connect_res =
-      Connect(request->GetUri().GetAuthority(), request->GetUri().GetPort(), proactor);
-  if (!connect_res) {
-    response->SetClientErrorType(Aws::Client::CoreErrors::NETWORK_CONNECTION);
-    response->SetClientErrorMessage("Failed to connect to host");
-    return response;
-  }
+  const Aws::Http::URI& uri = request->GetUri();
+  const std::string key =
+      absl::StrCat(Aws::Http::SchemeMapper::ToString(uri.GetScheme()), "://", uri.GetAuthority(),
+                   ":", uri.GetPort());
+  const unsigned limit = std::max(client_conf_.maxConnections, 1u);
+  ConnectionPool* pool = GetPool(proactor);
+
+  std::optional<h2::response_parser<h2::string_body>> parser;
+  while (true) {
+    std::unique_ptr<FiberSocketBase> conn = pool->Acquire(key, limit);
+    const bool reused = bool(conn);
+    if (!conn) {
+      io::Result<std::unique_ptr<FiberSocketBase>> connect_res = Connect(uri, key, proactor);
+      if (!connect_res) {
+        pool->Release(key, nullptr, false, limit);
+        response->SetClientErrorType(Aws::Client::CoreErrors::NETWORK_CONNECTION);
+        response->SetClientErrorMessage("Failed to connect to host");
+        return response;
+      }
+      conn = std::move(*connect_res);
+    }
 
-  std::unique_ptr<FiberSocketBase> conn = std::move(*connect_res);
-  if (request->GetUri().GetScheme() == Aws::Http::Scheme::HTTPS) {
-    std::unique_ptr<util::tls::TlsSocket> tls_conn(
-        std::make_unique<util::tls::TlsSocket>(conn.release()));
-    tls_conn->InitSSL(ctx_);
-
-    const std::string& hn = request->GetUri().GetAuthority();
-    const char* host = hn.c_str();
-    SSL* ssl_handle = tls_conn->ssl_handle();
-    // Add SNI.
-    SSL_set_tlsext_host_name(ssl_handle, host);
-    // Verify server cert using server hostname.
-    SSL_dane_enable(ssl_handle, host);
-    std::error_code ec = tls_conn->Connect(FiberSocketBase::endpoint_type{});
-    if (ec) {
-      LOG(WARNING) << "aws: http clent: tls connect failed; error=" << ec;
-      response->SetClientErrorType(Aws::Client::CoreErrors::NETWORK_CONNECTION);
-      std::ignore = tls_conn->Close();
-      return response;
+    // The parser is not reusable, so we reconstruct it for each attempt.
+    parser.emplace();
+    if (boost_req.method() == h2::verb::head) {
+      // Responses to HEAD have no body even if they declare content-length.
+      parser->skip(true);
     }
-    conn.reset(tls_conn.release());
-  }
 
-  boost::system::error_code bec;
-  AsioStreamAdapter<> adapter(*conn);
-  h2::write(adapter, boost_req, bec);
-  if (bec) {
-    LOG(WARNING) << "aws: http client: failed to send request; method="
-                 << Aws::Http::HttpMethodMapper::GetNameForHttpMethod(request->GetMethod())
-                 << "; url=" << request->GetUri().GetURIString() << "; error=" << bec;
-    response->SetClientErrorType(Aws::Client::CoreErrors::NETWORK_CONNECTION);
-    std::ignore = conn->Close();
-    return response;
-  }
+    SendStatus status = SendStatus::OK;
+    boost::system::error_code bec;
+    AsioStreamAdapter<> adapter(*conn);
+    h2::write(adapter, boost_req, bec);
+    if (bec) {
+      LOG_IF(WARNING, !reused) << "aws: http client: failed to send request; method="
+                               << MethodName(request->GetMethod())
+                               << "; url=" << uri.GetURIString() << "; error=" << bec;
+      status = SendStatus::CLOSED;
+    }
 
-  std::error_code ec;
-  // As described above, if we have a known type write the body directly
-  // without copying (the headers are written in h2::write.
-  if (buf_body) {
-    auto [buf, size] = buf_body->buffer();
-    ec = conn->Write(io::Bytes{reinterpret_cast<const uint8_t*>(buf), size});
-    if (ec) {
-      LOG(WARNING) << "aws: http client: failed to send request body; method="
-                   << Aws::Http::HttpMethodMapper::GetNameForHttpMethod(request->GetMethod())
-                   << "; url=" << request->GetUri().GetURIString() << "; error=" << ec;
-      response->SetClientErrorType(Aws::Client::CoreErrors::NETWORK_CONNECTION);
-      std::ignore = conn->Close();
-      return response;
+    // As described above, if we have a known type write the body directly
+    // without copying (the headers are written in h2::write.
+    if (status == SendStatus::OK && buf_body) {
+      auto [buf, size] = buf_body->buffer();
+      std::error_code ec = conn->Write(io::Bytes{reinterpret_cast<const uint8_t*>(buf), size});
+      if (ec) {
+        LOG_IF(WARNING, !reused) << "aws: http client: failed to send request body; method="
+                                 << MethodName(request->GetMethod())
+                                 << "; url=" << uri.GetURIString() << "; error=" << ec;
+        status = SendStatus::CLOSED;
+      }
+    }
+
+    // Once the request is written, the server may have processed it even if the connection
+    // is closed before it responds.
+    const bool sent = status == SendStatus::OK;
+    if (status == SendStatus::OK) {
+      boost::beast::flat_buffer buf;
+      h2::read(adapter, buf, *parser, bec);
+      if (bec) {
+        status = parser->got_some() ? SendStatus::ERROR : SendStatus::CLOSED;
+        LOG_IF(WARNING, !reused || status == SendStatus::ERROR)
+            << "aws: http client: failed to read response; method="
+            << MethodName(request->GetMethod()) << "; url=" << uri.GetURIString()
+            << "; error=" << bec;
+      }
+    }
+
+    if (status == SendStatus::OK) {
+      const bool reusable = parser->is_done() && parser->get().keep_alive();
+      pool->Release(key, std::move(conn), reusable, limit);
+      break;
+    }
+
+    pool->Release(key, std::move(conn), false, limit);
+    if (status == SendStatus::CLOSED && reused && (!sent || IsIdempotent(request->GetMethod()))) {
+      // The pooled connection went stale, retry with another one. Unless the request is
+      // idempotent we retry only if writing it failed, because a server that closes the
+      // connection without a response may still have processed the request.
+      VLOG(1) << "aws: http client: pooled connection closed, retrying; url="
+              << uri.GetURIString();
+      continue;
     }
-  }
 
-  h2::response<h2::string_body> boost_resp;
-  boost::beast::flat_buffer buf;
-  h2::read(adapter, buf, boost_resp, bec);
-  if (bec) {
-    LOG(WARNING) << "aws: http client: failed to read response; method="
-                 << Aws::Http::HttpMethodMapper::GetNameForHttpMethod(request->GetMethod())
-                 << "; url=" << request->GetUri().GetURIString() << "; error=" << bec;
     response->SetClientErrorType(Aws::Client::CoreErrors::NETWORK_CONNECTION);
-    std::ignore = conn->Close();
     return response;
   }
 
+  const h2::response<h2::string_body>& boost_resp = parser->get();
   response->SetResponseCode(static_cast<Aws::Http::HttpResponseCode>(boost_resp.result_int()));
   for (const auto& h : boost_resp.base()) {
     response->AddHeader(std::string(h.name_string()), std::string(h.value()));
@@ -193,8 +353,6 @@ std::shared_ptr<Aws::Http::HttpResponse> HttpClient::MakeRequest(
     DVLOG(2) << "aws: http client: response; header=" << h.first << "=" << h.second;
   }
 
-  ec = conn->Close();
-
   return response;
 }
 
@@ -216,9 +374,29 @@ void HttpClient::RetryRequestSleep(std::chrono::milliseconds sleep_time) {
   ThisFiber::SleepFor(sleep_time);
 }
 
-io::Result<std::unique_ptr<FiberSocketBase>> HttpClient::Connect(const std::string& host,
-                                                                 uint16_t port,
+auto HttpClient::GetPoolStats() const -> PoolStats {
+  PoolStats res;
+  std::lock_guard lk(pools_mu_);
+  for (const auto& [proactor, pool] : pools_) {
+    pool->AddStats(&res);
+  }
+  return res;
+}
+
+auto HttpClient::GetPool(ProactorBase* proactor) const -> ConnectionPool* {
+  std::lock_guard lk(pools_mu_);
+  auto& pool = pools_[proactor];
+  if (!pool) {
+    pool = std::make_unique<ConnectionPool>();
+  }
+  return pool.get();
+}
+
+io::Result<std::unique_ptr<FiberSocketBase>> HttpClient::Connect(const Aws::Http::URI& uri,
+                                                                 const std::string& key,
                                                                  ProactorBase* proactor) const {
+  const std::string& host = uri.GetAuthority();
+  const uint16_t port = uri.GetPort();
   VLOG(1) << "aws: http client: connecting; host=" << host << "; port=" << port;
 
   io::Result<boost::asio::ip::address> addr = Resolve(host, proactor);
@@ -248,26 +426,53 @@ io::Result<std::unique_ptr<FiberSocketBase>> HttpClient::Connect(const std::stri
     }
   }
 
-  return socket;
+  if (uri.GetScheme() != Aws::Http::Scheme::HTTPS) {
+    return socket;
+  }
+
+  std::unique_ptr<util::tls::TlsSocket> tls_conn(
+      std::make_unique<util::tls::TlsSocket>(socket.release()));
+  tls_conn->InitSSL(ctx_);
+
+  SSL* ssl_handle = tls_conn->ssl_handle();
+  // Add SNI.
+  SSL_set_tlsext_host_name(ssl_handle, host.c_str());
+  // Verify server cert using server hostname.
+  SSL_dane_enable(ssl_handle, host.c_str());
+  if (auto* cache = tls::ClientSessionCache::Get(ctx_)) {
+    cache->Attach(ssl_handle, key);
+  }
+
+  ec = tls_conn->Connect(FiberSocketBase::endpoint_type{});
+  if (ec) {
+    LOG(WARNING) << "aws: http clent: tls connect failed; error=" << ec;
+    std::ignore = tls_conn->Close();
+    return nonstd::make_unexpected(ec);
+  }
+
+  return tls_conn;
 }
 
 io::Result<boost::asio::ip::address> HttpClient::Resolve(const std::string& host,
                                                          ProactorBase* proactor) const {
   VLOG(1) << "aws: http client: resolving host; host=" << host;
 
-  char ip[INET6_ADDRSTRLEN];
-  std::error_code ec = fb2::DnsResolve(host.data(), client_conf_.connectTimeoutMs, ip, proactor);
-  if (ec) {
-    LOG(WARNING) << "aws: http client: failed to resolve host; host=" << host << "; error=" << ec;
-    return nonstd::make_unexpected(ec);
+  DCHECK(ProactorBase::me() == proactor);
+  auto addrs = fb2::DnsCache::Local()->Resolve(host, client_conf_.connectTimeoutMs);
+  if (!addrs) {
+    LOG(WARNING) << "aws: http client: failed to resolve host; host=" << host
+                 << "; error=" << addrs.error();
+    return nonstd::make_unexpected(addrs.error());
   }
 
-  boost::system::error_code bec;
-  boost::asio::ip::address address = boost::asio::ip::make_address(ip, bec);
-  if (bec) {
-    LOG(ERROR) << "aws: http client: resolved invalid address; error=" << ec;
-    return nonstd::make_unexpected(ec);
+  // Spread the connections across the addresses of the preferred family.
+  const fb2::DnsAddresses& list = **addrs;
+  size_t num_preferred = 1;
+  while (num_preferred < list.size() &&
+         list[num_preferred].is_v4() == list.front().is_v4()) {
+    ++num_preferred;
   }
+  boost::asio::ip::address address = list[next_address_.fetch_add(1, std::memory_order_relaxed) % num_preferred];
 
   VLOG(1) << "aws: http client: resolved host; host=" << host << "; ip=" << address;
 
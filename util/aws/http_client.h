@@ -3,11 +3,14 @@
 
 #pragma once
 
+#include <absl/container/flat_hash_map.h>
 #include <aws/core/client/ClientConfiguration.h>
 #include <aws/core/http/HttpClient.h>
 #include <openssl/ssl.h>
 
+#include <atomic>
 #include <boost/beast/core/flat_buffer.hpp>
+#include <mutex>
 
 #include "util/fibers/proactor_base.h"
 
@@ -16,9 +19,18 @@ namespace aws {
 
 // HTTP client manages connecting to and sending HTTP requests.
 //
-// This is stateless so can be accessed by multiple threads.
+// Can be accessed by multiple threads. Connections are pooled per proactor and per
+// endpoint, so requests reuse warm TCP (and TLS) connections. Each proactor has at most
+// ClientConfiguration::maxConnections connections in use per endpoint, additional requests
+// wait for a connection to be released.
 class HttpClient : public Aws::Http::HttpClient {
  public:
+  struct PoolStats {
+    uint64_t hits = 0;       // requests that reused an idle connection.
+    uint64_t misses = 0;     // requests that had to establish a new connection.
+    uint64_t evictions = 0;  // idle connections closed due to timeout or overflow.
+  };
+
   HttpClient(const Aws::Client::ClientConfiguration& client_conf);
 
   ~HttpClient();
@@ -45,8 +57,17 @@ class HttpClient : public Aws::Http::HttpClient {
 
   void RetryRequestSleep(std::chrono::milliseconds sleep_time) override;
 
+  // Returns the connection pool stats, aggregated over all the proactors.
+  PoolStats GetPoolStats() const;
+
  private:
-  io::Result<std::unique_ptr<FiberSocketBase>> Connect(const std::string& host, uint16_t port,
+  class ConnectionPool;
+
+  ConnectionPool* GetPool(ProactorBase* proactor) const;
+
+  // Establishes a new connection for the request, including the TLS handshake for https.
+  io::Result<std::unique_ptr<FiberSocketBase>> Connect(const Aws::Http::URI& uri,
+                                                       const std::string& key,
                                                        ProactorBase* proactor) const;
 
   io::Result<boost::asio::ip::address> Resolve(const std::string& host,
@@ -57,6 +78,12 @@ class HttpClient : public Aws::Http::HttpClient {
   Aws::Client::ClientConfiguration client_conf_;
 
   SSL_CTX* ctx_;
+
+  mutable std::mutex pools_mu_;
+
+  // Round robin over the resolved addresses.
+  mutable std::atomic_uint32_t next_address_{0};
+  mutable absl::flat_hash_map<ProactorBase*, std::unique_ptr<ConnectionPool>> pools_;
 };
 
 }  // namespace aws
@@ -0,0 +1,228 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+
+#include "util/aws/s3_batch.h"
+
+#include <absl/strings/str_cat.h>
+#include <aws/s3/model/DeleteObjectsRequest.h>
+#include <aws/s3/model/HeadObjectRequest.h>
+#include <aws/s3/model/ListObjectsV2Request.h>
+
+#include <algorithm>
+
+#include "base/logging.h"
+
+namespace util {
+namespace aws {
+
+using namespace std;
+
+namespace {
+
+// The maximum number of keys of a DeleteObjects request.
+constexpr size_t kMaxDeleteBatch = 1000;
+
+// Launches `workers` fibers round robin over the proactors of pool, each running func(index).
+template <typename F>
+vector<fb2::Fiber> LaunchWorkers(ProactorPool* pool, unsigned workers, string_view name, F func) {
+  vector<fb2::Fiber> fibers;
+  fibers.reserve(workers);
+  for (unsigned i = 0; i < workers; ++i) {
+    ProactorPool::ProactorBase* pb = pool->at(i % pool->size());
+    fibers.push_back(pb->LaunchFiber(absl::StrCat(name, i), [func, i] { func(i); }));
+  }
+  return fibers;
+}
+
+// Runs func(i) for every i in [0, n) with at most concurrency calls at once.
+template <typename F> void RunBounded(ProactorPool* pool, size_t n, unsigned concurrency,
+                                      string_view name, F func) {
+  atomic_size_t next{0};
+  unsigned workers = min<size_t>(max(concurrency, 1u), n);
+  vector<fb2::Fiber> fibers = LaunchWorkers(pool, workers, name, [&](unsigned) {
+    for (size_t i = next.fetch_add(1, memory_order_relaxed); i < n;
+         i = next.fetch_add(1, memory_order_relaxed)) {
+      func(i);
+    }
+  });
+  for (auto& fb : fibers)
+    fb.Join();
+}
+
+template <typename E> error_code LogError(string_view op, const E& error) {
+  LOG(ERROR) << "aws: s3 batch: failed to " << op << ": " << error.GetExceptionName() << " "
+             << error.GetMessage();
+  return make_error_code(errc::io_error);
+}
+
+}  // namespace
+
+// Keys in (after, last], or all the keys after `after` if last is empty.
+struct S3ParallelLister::Range {
+  string after;
+  string last;
+};
+
+S3ParallelLister::S3ParallelLister(shared_ptr<Aws::S3::S3Client> client, ProactorPool* pool)
+    : client_(std::move(client)), pool_(pool) {
+}
+
+S3ParallelLister::~S3ParallelLister() {
+  CHECK(fibers_.empty()) << "Wait must be called before destruction";
+}
+
+S3ObjectChannel* S3ParallelLister::Start(const string& bucket, const string& prefix,
+                                         const Options& opts) {
+  CHECK(fibers_.empty());
+  bucket_ = bucket;
+  prefix_ = prefix;
+
+  string split_chars = opts.split_chars;
+  // S3 orders the keys by their utf-8 bytes.
+  sort(split_chars.begin(), split_chars.end(),
+       [](char a, char b) { return uint8_t(a) < uint8_t(b); });
+  split_chars.erase(unique(split_chars.begin(), split_chars.end()), split_chars.end());
+
+  ranges_.clear();
+  string after;
+  for (char c : split_chars) {
+    string last = absl::StrCat(prefix, string_view{&c, 1});
+    ranges_.push_back(Range{std::move(after), last});
+    after = std::move(last);
+  }
+  ranges_.push_back(Range{std::move(after), string{}});
+
+  next_range_.store(0, memory_order_relaxed);
+  cancelled_.store(false, memory_order_relaxed);
+
+  unsigned workers = min<size_t>(max(opts.concurrency, 1u), ranges_.size());
+  channel_ = make_unique<S3ObjectChannel>(opts.channel_pages, workers);
+  errors_.assign(workers, error_code{});
+
+  fibers_ = LaunchWorkers(pool_, workers, "s3_list", [this](unsigned index) {
+    for (size_t i = next_range_.fetch_add(1, memory_order_relaxed); i < ranges_.size();
+         i = next_range_.fetch_add(1, memory_order_relaxed)) {
+      if (cancelled_.load(memory_order_relaxed))
+        break;
+      if (error_code ec = ListRange(ranges_[i]); ec && !errors_[index])
+        errors_[index] = ec;
+    }
+    channel_->StartClosing();
+  });
+
+  return channel_.get();
+}
+
+error_code S3ParallelLister::Wait() {
+  for (auto& fb : fibers_)
+    fb.Join();
+  fibers_.clear();
+
+  for (error_code ec : errors_) {
+    if (ec)
+      return ec;
+  }
+  return {};
+}
+
+error_code S3ParallelLister::ListRange(const Range& range) {
+  Aws::S3::Model::ListObjectsV2Request request;
+  request.SetBucket(bucket_);
+  if (!prefix_.empty())
+    request.SetPrefix(prefix_);
+  if (!range.after.empty())
+    request.SetStartAfter(range.after);
+
+  while (!cancelled_.load(memory_order_relaxed)) {
+    Aws::S3::Model::ListObjectsV2Outcome outcome = client_->ListObjectsV2(request);
+    if (!outcome.IsSuccess())
+      return LogError("list objects", outcome.GetError());
+
+    const auto& result = outcome.GetResult();
+    S3ObjectPage page;
+    page.reserve(result.GetContents().size());
+    bool done = result.GetNextContinuationToken().empty();
+    for (const auto& object : result.GetContents()) {
+      if (!range.last.empty() && object.GetKey() > range.last) {
+        done = true;
+        break;
+      }
+      page.push_back(S3Object{object.GetKey(), size_t(object.GetSize())});
+    }
+
+    VLOG(2) << "aws: s3 list range; after=" << range.after << "; objects=" << page.size();
+    if (!page.empty())
+      channel_->Push(std::move(page));
+    if (done)
+      break;
+
+    request.SetContinuationToken(result.GetNextContinuationToken());
+  }
+
+  return {};
+}
+
+error_code DeleteObjects(Aws::S3::S3Client* client, ProactorPool* pool, const string& bucket,
+                         absl::Span<const string> keys, unsigned concurrency) {
+  size_t batches = (keys.size() + kMaxDeleteBatch - 1) / kMaxDeleteBatch;
+  vector<error_code> errors(batches);
+
+  RunBounded(pool, batches, concurrency, "s3_delete", [&](size_t batch) {
+    absl::Span<const string> batch_keys = keys.subspan(batch * kMaxDeleteBatch, kMaxDeleteBatch);
+
+    Aws::S3::Model::Delete del;
+    for (const string& key : batch_keys)
+      del.AddObjects(Aws::S3::Model::ObjectIdentifier().WithKey(key));
+    del.SetQuiet(true);  // reports only the failed keys.
+
+    Aws::S3::Model::DeleteObjectsRequest request;
+    request.SetBucket(bucket);
+    request.SetDelete(std::move(del));
+
+    Aws::S3::Model::DeleteObjectsOutcome outcome = client->DeleteObjects(request);
+    if (!outcome.IsSuccess()) {
+      errors[batch] = LogError("delete objects", outcome.GetError());
+      return;
+    }
+
+    const auto& failed = outcome.GetResult().GetErrors();
+    if (!failed.empty()) {
+      LOG(ERROR) << "aws: s3 batch: failed to delete " << failed.size() << " objects, first "
+                 << failed.front().GetKey() << ": " << failed.front().GetCode();
+      errors[batch] = make_error_code(errc::io_error);
+    }
+  });
+
+  for (error_code ec : errors) {
+    if (ec)
+      return ec;
+  }
+  return {};
+}
+
+vector<io::Result<size_t>> HeadObjects(Aws::S3::S3Client* client, ProactorPool* pool,
+                                       const string& bucket, absl::Span<const string> keys,
+                                       unsigned concurrency) {
+  vector<io::Result<size_t>> res(keys.size());
+
+  RunBounded(pool, keys.size(), concurrency, "s3_head", [&](size_t i) {
+    Aws::S3::Model::HeadObjectRequest request;
+    request.SetBucket(bucket);
+    request.SetKey(keys[i]);
+
+    Aws::S3::Model::HeadObjectOutcome outcome = client->HeadObject(request);
+    if (outcome.IsSuccess()) {
+      res[i] = size_t(outcome.GetResult().GetContentLength());
+    } else if (outcome.GetError().GetResponseCode() ==
+               Aws::Http::HttpResponseCode::NOT_FOUND) {
+      res[i] = nonstd::make_unexpected(make_error_code(errc::no_such_file_or_directory));
+    } else {
+      res[i] = nonstd::make_unexpected(LogError("head object", outcome.GetError()));
+    }
+  });
+
+  return res;
+}
+
+}  // namespace aws
+}  // namespace util
@@ -0,0 +1,111 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+
+#pragma once
+
+#include <absl/types/span.h>
+#include <aws/s3/S3Client.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "base/mpmc_bounded_queue.h"
+#include "io/io.h"
+#include "util/fibers/fibers.h"
+#include "util/fibers/simple_channel.h"
+#include "util/proactor_pool.h"
+
+namespace util {
+namespace aws {
+
+struct S3Object {
+  std::string key;
+  size_t size = 0;
+};
+
+// A page of listed objects, ordered by key within the page.
+using S3ObjectPage = std::vector<S3Object>;
+using S3ObjectChannel = fb2::SimpleChannel<S3ObjectPage, base::mpmc_bounded_queue<S3ObjectPage>>;
+
+// Lists the objects under a prefix with parallel ListObjectsV2 calls.
+//
+// S3 only pages a listing sequentially, hence the key space under the prefix is split into
+// ranges at prefix + c for every c in split_chars, and each range is paged separately with
+// StartAfter. The ranges are contiguous, so every key is listed exactly once whatever the key
+// distribution is, though only the ranges that hold keys speed the listing up. The ranges
+// are listed by `concurrency` fibers spread over the proactors of the pool.
+//
+// The pages are streamed into the channel as they arrive, in no particular order across the
+// ranges. The consumer must pop until Pop returns false, as the producers block when the
+// channel is full, then call Wait.
+class S3ParallelLister {
+ public:
+  static constexpr std::string_view kDefaultSplitChars =
+      "-./0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ_abcdefghijklmnopqrstuvwxyz";
+
+  struct Options {
+    std::string split_chars{kDefaultSplitChars};
+
+    unsigned concurrency = 32;
+
+    // Capacity of the channel in pages, must be a power of 2.
+    size_t channel_pages = 64;
+  };
+
+  S3ParallelLister(std::shared_ptr<Aws::S3::S3Client> client, ProactorPool* pool);
+  ~S3ParallelLister();
+
+  // Starts listing bucket. The returned channel is owned by the lister and is closed once all
+  // the ranges are listed or failed.
+  S3ObjectChannel* Start(const std::string& bucket, const std::string& prefix,
+                         const Options& opts);
+  S3ObjectChannel* Start(const std::string& bucket, const std::string& prefix) {
+    return Start(bucket, prefix, Options{});
+  }
+
+  // Stops the listing after the pages in flight. The channel must still be drained.
+  void Cancel() {
+    cancelled_.store(true, std::memory_order_relaxed);
+  }
+
+  // Waits for the listing fibers and returns the first error. A failed range does not stop
+  // the others.
+  std::error_code Wait();
+
+ private:
+  struct Range;
+
+  std::error_code ListRange(const Range& range);
+
+  std::shared_ptr<Aws::S3::S3Client> client_;
+  ProactorPool* pool_;
+
+  std::string bucket_, prefix_;
+  std::vector<Range> ranges_;
+  std::atomic_size_t next_range_{0};
+  std::atomic_bool cancelled_{false};
+
+  std::unique_ptr<S3ObjectChannel> channel_;
+  std::vector<fb2::Fiber> fibers_;
+  std::vector<std::error_code> errors_;  // per fiber.
+};
+
+// Deletes keys with DeleteObjects requests of up to 1000 keys, running at most concurrency
+// requests at once over the proactors of the pool. Returns the first error; the other
+// batches are still deleted.
+std::error_code DeleteObjects(Aws::S3::S3Client* client, ProactorPool* pool,
+                              const std::string& bucket, absl::Span<const std::string> keys,
+                              unsigned concurrency = 16);
+
+// Sends a HEAD request per key, running at most concurrency requests at once over the
+// proactors of the pool. Returns the object sizes in the order of keys, or the error of every
+// key that failed, e.g. that does not exist.
+std::vector<io::Result<size_t>> HeadObjects(Aws::S3::S3Client* client, ProactorPool* pool,
+                                            const std::string& bucket,
+                                            absl::Span<const std::string> keys,
+                                            unsigned concurrency = 64);
+
+}  // namespace aws
+}  // namespace util
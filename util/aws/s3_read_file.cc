@@ -8,14 +8,53 @@
 #include <absl/strings/str_split.h>
 #include <aws/s3/model/GetObjectRequest.h>
 
+#include <algorithm>
+
 #include "base/logging.h"
+#include "util/fibers/fibers.h"
 
 namespace util {
 namespace aws {
 
+namespace {
+
+// Prefetched chunks are sized so each request takes about this long at the observed
+// throughput. Long enough to amortize the request latency, short enough to have
+// many chunks in flight.
+constexpr auto kTargetChunkTime = std::chrono::milliseconds(500);
+
+constexpr size_t kMinChunkSize = 256 << 10;
+
+std::string ByteRange(size_t offset, size_t len) {
+  return absl::StrFormat("bytes=%d-%d", offset, offset + len - 1);
+}
+
+}  // namespace
+
+struct S3ReadFile::Chunk {
+  explicit Chunk(size_t l) : len{l}, buf{l} {
+  }
+
+  size_t len;
+  base::IoBuf buf;
+  std::error_code ec;
+  fb2::Fiber fiber;
+};
+
 S3ReadFile::S3ReadFile(const std::string& bucket, const std::string& key,
-                       std::shared_ptr<Aws::S3::S3Client> client, size_t chunk_size)
-    : bucket_{bucket}, key_{key}, buf_(chunk_size), client_{client} {
+                       std::shared_ptr<Aws::S3::S3Client> client, size_t chunk_size,
+                       unsigned readahead)
+    : bucket_{bucket},
+      key_{key},
+      buf_(chunk_size),
+      client_{client},
+      readahead_{readahead},
+      max_chunk_size_{chunk_size},
+      chunk_size_{chunk_size} {
+}
+
+S3ReadFile::~S3ReadFile() {
+  std::ignore = Close();
 }
 
 io::Result<size_t> S3ReadFile::Read(size_t offset, const iovec* v, uint32_t len) {
@@ -39,6 +78,11 @@ io::Result<size_t> S3ReadFile::Read(size_t offset, const iovec* v, uint32_t len)
 }
 
 std::error_code S3ReadFile::Close() {
+  // The prefetch fibers reference this file.
+  for (auto& chunk : prefetch_) {
+    chunk->fiber.JoinIfNeeded();
+  }
+  prefetch_.clear();
   return std::error_code{};
 }
 
@@ -89,23 +133,98 @@ std::error_code S3ReadFile::DownloadChunk() {
     return std::error_code{};
   }
 
+  // Verify we've ready the full chunk before downloading another to ensure
+  // we have capacity.
+  CHECK_EQ(buf_.InputLen(), 0U);
+
+  // The first chunk is always downloaded synchronously, as we need the file size to
+  // schedule the prefetching.
+  if (readahead_ > 0 && file_size_ > 0) {
+    return NextPrefetchedChunk();
+  }
+
+  std::error_code ec = Download(NextByteRange(), &buf_);
+  if (!ec && readahead_ > 0) {
+    prefetch_offset_ = file_read_ + buf_.InputLen();
+    SchedulePrefetch();
+  }
+  return ec;
+}
+
+std::error_code S3ReadFile::NextPrefetchedChunk() {
+  SchedulePrefetch();
+  if (prefetch_.empty()) {
+    LOG(ERROR) << "aws: s3 read file: no chunks to prefetch; file_read=" << file_read_
+               << "; file_size=" << file_size_;
+    return std::make_error_code(std::errc::io_error);
+  }
+
+  std::unique_ptr<Chunk> chunk = std::move(prefetch_.front());
+  prefetch_.pop_front();
+  chunk->fiber.Join();
+  if (chunk->ec) {
+    return chunk->ec;
+  }
+  if (chunk->buf.InputLen() != chunk->len) {
+    LOG(ERROR) << "aws: s3 read file: unexpected chunk length; expected=" << chunk->len
+               << "; actual=" << chunk->buf.InputLen();
+    return std::make_error_code(std::errc::io_error);
+  }
+
+  buf_ = std::move(chunk->buf);
+
+  // Replace the consumed chunk right away to keep readahead_ chunks in flight.
+  SchedulePrefetch();
+  return std::error_code{};
+}
+
+void S3ReadFile::SchedulePrefetch() {
+  while (prefetch_.size() < readahead_ && prefetch_offset_ < file_size_) {
+    auto chunk = std::make_unique<Chunk>(std::min(chunk_size_, file_size_ - prefetch_offset_));
+
+    VLOG(2) << "aws: s3 read file: prefetching chunk; offset=" << prefetch_offset_
+            << "; length=" << chunk->len;
+    chunk->fiber = fb2::Fiber("s3_prefetch", [this, c = chunk.get(), offset = prefetch_offset_] {
+      auto start = std::chrono::steady_clock::now();
+      c->ec = Download(ByteRange(offset, c->len), &c->buf);
+      if (!c->ec) {
+        AdaptChunkSize(c->len, std::chrono::steady_clock::now() - start);
+      }
+    });
+
+    prefetch_offset_ += chunk->len;
+    prefetch_.push_back(std::move(chunk));
+  }
+}
+
+void S3ReadFile::AdaptChunkSize(size_t len, std::chrono::steady_clock::duration elapsed) {
+  using namespace std::chrono;
+  const uint64_t elapsed_us = duration_cast<microseconds>(elapsed).count();
+  if (elapsed_us == 0) {
+    return;
+  }
+
+  const uint64_t target_us = duration_cast<microseconds>(kTargetChunkTime).count();
+  const size_t target = len * target_us / elapsed_us;
+  chunk_size_ = std::clamp(target, std::min(kMinChunkSize, max_chunk_size_), max_chunk_size_);
+  VLOG(2) << "aws: s3 read file: adapted chunk size; throughput="
+          << len * 1000000 / elapsed_us << "B/s; chunk_size=" << chunk_size_;
+}
+
+std::error_code S3ReadFile::Download(const std::string& range, base::IoBuf* buf) {
   Aws::S3::Model::GetObjectRequest request;
   request.SetBucket(bucket_);
   request.SetKey(key_);
-  request.SetRange(NextByteRange());
+  request.SetRange(range);
   Aws::S3::Model::GetObjectOutcome outcome = client_->GetObject(request);
   if (outcome.IsSuccess()) {
-    VLOG(2) << "aws: s3 read file: downloaded chunk: length="
-            << outcome.GetResult().GetContentLength();
-
-    // Verify we've ready the full chunk before downloading another to ensure
-    // we have capacity.
-    CHECK_EQ(buf_.InputLen(), 0U);
+    const size_t length = outcome.GetResult().GetContentLength();
+    VLOG(2) << "aws: s3 read file: downloaded chunk: length=" << length;
 
-    io::MutableBytes append_buf = buf_.AppendBuffer();
-    outcome.GetResult().GetBody().read(reinterpret_cast<char*>(append_buf.data()),
-                                       outcome.GetResult().GetContentLength());
-    buf_.CommitWrite(outcome.GetResult().GetContentLength());
+    buf->EnsureCapacity(length);
+    io::MutableBytes append_buf = buf->AppendBuffer();
+    outcome.GetResult().GetBody().read(reinterpret_cast<char*>(append_buf.data()), length);
+    buf->CommitWrite(length);
 
     // If this is the first download, read the file size.
     if (file_size_ == 0) {
@@ -141,7 +260,7 @@ std::error_code S3ReadFile::DownloadChunk() {
 }
 
 std::string S3ReadFile::NextByteRange() const {
-  return absl::StrFormat("bytes=%d-%d", file_read_, file_read_ + buf_.Capacity() - 1);
+  return ByteRange(file_read_, buf_.Capacity());
 }
 
 std::error_code S3ReadFile::ParseFileSize(const Aws::S3::Model::GetObjectResult& result) {
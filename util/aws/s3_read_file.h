@@ -6,6 +6,9 @@
 #include <aws/s3/S3Client.h>
 #include <aws/s3/model/GetObjectResult.h>
 
+#include <chrono>
+#include <deque>
+
 #include "base/io_buf.h"
 #include "io/file.h"
 #include "io/io.h"
@@ -21,10 +24,17 @@ constexpr size_t kDefaultChunkSize = 8 * (1 << 20);
 // This downloads chunks of the file with the given chunk size, then Read
 // consumes from the buffered chunk. Once a chunk has been read, it downloads
 // another.
+//
+// If readahead is set, it keeps readahead chunks downloading in parallel in background
+// fibers, ahead of the reader. In that mode chunk_size is the upper bound and the actual
+// chunk size adapts to the observed throughput. Must be used in a proactor thread.
 class S3ReadFile final : public io::ReadonlyFile {
  public:
   S3ReadFile(const std::string& bucket, const std::string& key,
-             std::shared_ptr<Aws::S3::S3Client> client, size_t chunk_size = kDefaultChunkSize);
+             std::shared_ptr<Aws::S3::S3Client> client, size_t chunk_size = kDefaultChunkSize,
+             unsigned readahead = 0);
+
+  ~S3ReadFile();
 
   io::Result<size_t> Read(size_t offset, const iovec* v, uint32_t len) override;
 
@@ -37,8 +47,21 @@ class S3ReadFile final : public io::ReadonlyFile {
  private:
   io::Result<size_t> Read(iovec v);
 
+  struct Chunk;
+
   std::error_code DownloadChunk();
 
+  // Downloads the given range and appends it to buf.
+  std::error_code Download(const std::string& range, base::IoBuf* buf);
+
+  // Moves the next prefetched chunk into buf_.
+  std::error_code NextPrefetchedChunk();
+
+  // Starts downloading chunks until readahead_ chunks are in flight.
+  void SchedulePrefetch();
+
+  void AdaptChunkSize(size_t len, std::chrono::steady_clock::duration elapsed);
+
   std::string NextByteRange() const;
 
   std::error_code ParseFileSize(const Aws::S3::Model::GetObjectResult& result);
@@ -56,6 +79,19 @@ class S3ReadFile final : public io::ReadonlyFile {
   size_t file_size_ = 0;
 
   std::shared_ptr<Aws::S3::S3Client> client_;
+
+  const unsigned readahead_;
+
+  const size_t max_chunk_size_;
+
+  // Size of the next prefetched chunk.
+  size_t chunk_size_;
+
+  // Offset of the next prefetched chunk.
+  size_t prefetch_offset_ = 0;
+
+  // Chunks in flight, in the file order.
+  std::deque<std::unique_ptr<Chunk>> prefetch_;
 };
 
 }  // namespace aws
@@ -7,13 +7,75 @@
 #include <aws/s3/model/CreateMultipartUploadRequest.h>
 #include <aws/s3/model/UploadPartRequest.h>
 
+#include <algorithm>
 #include <boost/interprocess/streams/bufferstream.hpp>
 
 #include "base/logging.h"
+#include "util/fibers/fibers.h"
+#include "util/fibers/synchronization.h"
 
 namespace util {
 namespace aws {
 
+struct S3WriteFile::Uploads {
+  explicit Uploads(unsigned max) : max_inflight(max) {
+  }
+
+  const unsigned max_inflight;
+  unsigned inflight = 0;
+
+  // Etags of the uploaded parts, indexed by part number - 1.
+  std::vector<PartMetadata> parts;
+
+  // Buffers of completed uploads, ready to be reused.
+  std::vector<std::vector<uint8_t>> free_bufs;
+
+  // The first upload error.
+  std::error_code ec;
+
+  fb2::EventCount done;
+};
+
+namespace {
+
+std::error_code UploadPart(Aws::S3::S3Client* client,
+                           const Aws::S3::Model::UploadPartRequest& request,
+                           PartMetadata* metadata) {
+  Aws::S3::Model::UploadPartOutcome outcome = client->UploadPart(request);
+  if (outcome.IsSuccess()) {
+    VLOG(2) << "aws: s3 write file: upload part; part_number=" << request.GetPartNumber();
+
+    metadata->etag = outcome.GetResult().GetETag();
+    metadata->crc32 = outcome.GetResult().GetChecksumCRC32();
+    return std::error_code{};
+  } else if (outcome.GetError().GetExceptionName() == "PermanentRedirect") {
+    LOG(ERROR) << "aws: s3 write file: failed to upload part: permanent redirect; ensure your "
+                  "configured AWS region matches the S3 bucket region";
+    return std::make_error_code(std::errc::io_error);
+  } else if (outcome.GetError().GetErrorType() == Aws::S3::S3Errors::NO_SUCH_BUCKET) {
+    LOG(ERROR) << "aws: s3 write file: failed to upload part: bucket not found: " +
+                      request.GetBucket();
+    return std::make_error_code(std::errc::io_error);
+  } else if (outcome.GetError().GetErrorType() == Aws::S3::S3Errors::INVALID_ACCESS_KEY_ID) {
+    LOG(ERROR) << "aws: s3 write file: failed to upload part: invalid access key id";
+    return std::make_error_code(std::errc::io_error);
+  } else if (outcome.GetError().GetErrorType() == Aws::S3::S3Errors::SIGNATURE_DOES_NOT_MATCH) {
+    LOG(ERROR) << "aws: s3 write file: failed to upload part: invalid signature; check your "
+                  "credentials are correct";
+    return std::make_error_code(std::errc::io_error);
+  } else if (outcome.GetError().GetExceptionName() == "InvalidToken") {
+    LOG(ERROR) << "aws: s3 write file: failed to upload part: invalid token; check your "
+                  "credentials are correct";
+    return std::make_error_code(std::errc::io_error);
+  } else {
+    LOG(ERROR) << "aws: s3 write file: failed to upload part: "
+               << outcome.GetError().GetExceptionName();
+    return std::make_error_code(std::errc::io_error);
+  }
+}
+
+}  // namespace
+
 io::Result<size_t> S3WriteFile::WriteSome(const iovec* v, uint32_t len) {
   // Fill the pending buffer until we reach the part size, then flush and
   // keep writing.
@@ -50,16 +112,23 @@ io::Result<size_t> S3WriteFile::WriteSome(const iovec* v, uint32_t len) {
 // will not be uploaded unless Close is called.
 std::error_code S3WriteFile::Close() {
   std::error_code ec = Flush();
+
+  // Wait for all the uploads, even on error, as they reference our buffers.
+  uploads_->done.await([this] { return uploads_->inflight == 0; });
   if (ec) {
     return ec;
   }
+  if (uploads_->ec) {
+    return uploads_->ec;
+  }
 
+  const std::vector<PartMetadata>& parts = uploads_->parts;
   Aws::S3::Model::CompletedMultipartUpload completed_upload;
-  for (size_t i = 0; i != parts_.size(); i++) {
+  for (size_t i = 0; i != parts.size(); i++) {
     Aws::S3::Model::CompletedPart part;
     part.SetPartNumber(i + 1);
-    part.SetETag(parts_[i].etag);
-    part.SetChecksumCRC32(parts_[i].crc32);
+    part.SetETag(parts[i].etag);
+    part.SetChecksumCRC32(parts[i].crc32);
     completed_upload.AddParts(part);
   }
 
@@ -72,7 +141,7 @@ std::error_code S3WriteFile::Close() {
   Aws::S3::Model::CompleteMultipartUploadOutcome outcome =
       client_->CompleteMultipartUpload(request);
   if (outcome.IsSuccess()) {
-    VLOG(2) << "aws: s3 write file: completed multipart upload; parts=" << parts_.size();
+    VLOG(2) << "aws: s3 write file: completed multipart upload; parts=" << parts.size();
   } else if (outcome.GetError().GetExceptionName() == "PermanentRedirect") {
     LOG(ERROR) << "aws: s3 write file: failed to complete multipart upload: permanent redirect; "
                   "ensure your configured AWS region matches the S3 bucket region";
@@ -103,7 +172,7 @@ std::error_code S3WriteFile::Close() {
 
 io::Result<S3WriteFile> S3WriteFile::Open(const std::string& bucket, const std::string& key,
                                           std::shared_ptr<Aws::S3::S3Client> client,
-                                          size_t part_size) {
+                                          size_t part_size, unsigned max_inflight) {
   Aws::S3::Model::CreateMultipartUploadRequest request;
   request.SetBucket(bucket);
   request.SetKey(key);
@@ -113,7 +182,8 @@ io::Result<S3WriteFile> S3WriteFile::Open(const std::string& bucket, const std::
   if (outcome.IsSuccess()) {
     VLOG(2) << "aws: s3 write file: created multipart upload; upload_id="
             << outcome.GetResult().GetUploadId();
-    return S3WriteFile{bucket, key, outcome.GetResult().GetUploadId(), client, part_size};
+    return S3WriteFile{bucket,    key,         outcome.GetResult().GetUploadId(), client,
+                       part_size, max_inflight};
   } else if (outcome.GetError().GetExceptionName() == "PermanentRedirect") {
     LOG(ERROR) << "aws: s3 write file: failed to create multipart upload: permanent redirect; "
                   "ensure your configured AWS region matches the S3 bucket region";
@@ -142,9 +212,10 @@ io::Result<S3WriteFile> S3WriteFile::Open(const std::string& bucket, const std::
 
 S3WriteFile::S3WriteFile(const std::string& bucket, const std::string& key,
                          const std::string& upload_id, std::shared_ptr<Aws::S3::S3Client> client,
-                         size_t part_size)
+                         size_t part_size, unsigned max_inflight)
     : io::WriteFile{""}, bucket_{bucket}, key_{key}, upload_id_{upload_id},
-      buf_(part_size), client_{client} {
+      uploads_{std::make_shared<Uploads>(std::max(max_inflight, 1u))}, buf_(part_size),
+      client_{client} {
 }
 
 std::error_code S3WriteFile::Flush() {
@@ -152,52 +223,57 @@ std::error_code S3WriteFile::Flush() {
     return std::error_code{};
   }
 
+  // Apply backpressure until there is room in the upload window.
+  uploads_->done.await([this] { return uploads_->inflight < uploads_->max_inflight; });
+  if (uploads_->ec) {
+    return uploads_->ec;
+  }
+
+  const size_t part_number = uploads_->parts.size() + 1;
+  uploads_->parts.emplace_back();
+
   Aws::S3::Model::UploadPartRequest request;
   request.SetBucket(bucket_);
   request.SetKey(key_);
-  request.SetPartNumber(parts_.size() + 1);
+  request.SetPartNumber(part_number);
   request.SetUploadId(upload_id_);
   request.SetChecksumAlgorithm(Aws::S3::Model::ChecksumAlgorithm::CRC32);
 
   // Avoid copying by creating a stream that directly references the underlying
-  // buffer. This is ok since we won't modify buf_ until the request completes.
+  // buffer. This is ok since the buffer is owned by the upload fiber until the request
+  // completes.
+  std::vector<uint8_t> buf = std::move(buf_);
   std::shared_ptr<Aws::IOStream> stream = std::make_shared<boost::interprocess::bufferstream>(
-      reinterpret_cast<char*>(buf_.data()), offset_);
+      reinterpret_cast<char*>(buf.data()), offset_);
   request.SetBody(stream);
 
-  Aws::S3::Model::UploadPartOutcome outcome = client_->UploadPart(request);
-  if (outcome.IsSuccess()) {
-    VLOG(2) << "aws: s3 write file: upload part; part_number=" << parts_.size() + 1;
-
-    PartMetadata metadata;
-    metadata.etag = outcome.GetResult().GetETag();
-    metadata.crc32 = outcome.GetResult().GetChecksumCRC32();
-    parts_.push_back(metadata);
-    offset_ = 0;
-    return std::error_code{};
-  } else if (outcome.GetError().GetExceptionName() == "PermanentRedirect") {
-    LOG(ERROR) << "aws: s3 write file: failed to upload part: permanent redirect; ensure your "
-                  "configured AWS region matches the S3 bucket region";
-    return std::make_error_code(std::errc::io_error);
-  } else if (outcome.GetError().GetErrorType() == Aws::S3::S3Errors::NO_SUCH_BUCKET) {
-    LOG(ERROR) << "aws: s3 write file: failed to upload part: bucket not found: " + bucket_;
-    return std::make_error_code(std::errc::io_error);
-  } else if (outcome.GetError().GetErrorType() == Aws::S3::S3Errors::INVALID_ACCESS_KEY_ID) {
-    LOG(ERROR) << "aws: s3 write file: failed to upload part: invalid access key id";
-    return std::make_error_code(std::errc::io_error);
-  } else if (outcome.GetError().GetErrorType() == Aws::S3::S3Errors::SIGNATURE_DOES_NOT_MATCH) {
-    LOG(ERROR) << "aws: s3 write file: failed to upload part: invalid signature; check your "
-                  "credentials are correct";
-    return std::make_error_code(std::errc::io_error);
-  } else if (outcome.GetError().GetExceptionName() == "InvalidToken") {
-    LOG(ERROR) << "aws: s3 write file: failed to upload part: invalid token; check your "
-                  "credentials are correct";
-    return std::make_error_code(std::errc::io_error);
+  // Continue writing into a recycled buffer.
+  const size_t part_size = buf.size();
+  if (uploads_->free_bufs.empty()) {
+    buf_.resize(part_size);
   } else {
-    LOG(ERROR) << "aws: s3 write file: failed to upload part: "
-               << outcome.GetError().GetExceptionName();
-    return std::make_error_code(std::errc::io_error);
+    buf_ = std::move(uploads_->free_bufs.back());
+    uploads_->free_bufs.pop_back();
   }
+  offset_ = 0;
+
+  uploads_->inflight++;
+  fb2::Fiber("s3_upload_part", [uploads = uploads_, client = client_, request = std::move(request),
+                                buf = std::move(buf)]() mutable {
+    PartMetadata metadata;
+    std::error_code ec = UploadPart(client.get(), request, &metadata);
+    if (ec) {
+      if (!uploads->ec)
+        uploads->ec = ec;
+    } else {
+      uploads->parts[request.GetPartNumber() - 1] = std::move(metadata);
+    }
+
+    uploads->free_bufs.push_back(std::move(buf));
+    uploads->inflight--;
+    uploads->done.notifyAll();
+  }).Detach();
+
   return std::error_code{};
 }
 
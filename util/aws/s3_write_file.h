@@ -13,6 +13,8 @@ namespace aws {
 
 constexpr size_t kDefaultPartSize = 1ULL << 23;  // 8MB.
 
+constexpr unsigned kDefaultMaxInflightParts = 1;
+
 struct PartMetadata {
   std::string etag;
   std::string crc32;
@@ -22,6 +24,11 @@ struct PartMetadata {
 //
 // This uses multipart uploads, where it will buffer upto the configured part
 // size before uploading.
+//
+// Parts are uploaded in background fibers, with at most max_inflight uploads running
+// concurrently. Once the limit is reached, writes block until an upload completes.
+// Part buffers are reused, so the file holds at most max_inflight + 1 of them.
+// Must be used in a proactor thread.
 class S3WriteFile : public io::WriteFile {
  public:
   // Writes bytes to the S3 object. This will either buffer internally or
@@ -34,13 +41,19 @@ class S3WriteFile : public io::WriteFile {
 
   static io::Result<S3WriteFile> Open(const std::string& bucket, const std::string& key,
                                       std::shared_ptr<Aws::S3::S3Client> client,
-                                      size_t part_size = kDefaultPartSize);
+                                      size_t part_size = kDefaultPartSize,
+                                      unsigned max_inflight = kDefaultMaxInflightParts);
 
  private:
+  // State shared with the upload fibers. Kept on heap since the file is movable
+  // and may be destroyed before the uploads complete.
+  struct Uploads;
+
   S3WriteFile(const std::string& bucket, const std::string& key, const std::string& upload_id,
-              std::shared_ptr<Aws::S3::S3Client> client, size_t part_size = kDefaultPartSize);
+              std::shared_ptr<Aws::S3::S3Client> client, size_t part_size,
+              unsigned max_inflight);
 
-  // Uploads the data buffered in buf_. Note this must not be called until
+  // Starts uploading the data buffered in buf_. Note this must not be called until
   // there are at least 5MB bytes in buf_, unless it is the last upload.
   std::error_code Flush();
 
@@ -50,8 +63,7 @@ class S3WriteFile : public io::WriteFile {
 
   std::string upload_id_;
 
-  // Etags of the uploaded parts.
-  std::vector<PartMetadata> parts_;
+  std::shared_ptr<Uploads> uploads_;
 
   // A buffer containing the pending bytes waiting to be uploaded. Only offset_
   // bytes have been written.
@@ -7,6 +7,7 @@
 #include <functional>
 #include <memory>
 #include <boost/smart_ptr/intrusive_ref_counter.hpp>
+#include "base/pmr/counting_resource.h"
 #include "util/fiber_socket_base.h"
 #include "util/fibers/proactor_base.h"
 
@@ -14,6 +15,10 @@ namespace util {
 
 class ListenerInterface;
 
+namespace metrics {
+class TcpInfoMetrics;
+}  // namespace metrics
+
 /**
  * @brief A connection object that represents a client tcp connection, managed by a listener.
  *
@@ -26,13 +31,22 @@ class Connection : public boost::intrusive_ref_counter<Connection, boost::thread
   using connection_hook_t = ::boost::intrusive::list_member_hook<
       ::boost::intrusive::link_mode<::boost::intrusive::safe_link>>;
 
+  using idle_hook_t = ::boost::intrusive::list_member_hook<
+      ::boost::intrusive::link_mode<::boost::intrusive::auto_unlink>>;
+
   connection_hook_t hook_;
+  idle_hook_t idle_hook_;  // links the connection into the idle wheel of its listener.
 
  public:
   using member_hook_t =
       ::boost::intrusive::member_hook<Connection, connection_hook_t, &Connection::hook_>;
+  using idle_member_hook_t =
+      ::boost::intrusive::member_hook<Connection, idle_hook_t, &Connection::idle_hook_>;
 
   virtual ~Connection() {
+    // The heap frees the allocations that are still alive in bulk.
+    if (heap_)
+      memory_.Forget();
   }
 
   void SetSocket(FiberSocketBase* s) {
@@ -55,6 +69,55 @@ class Connection : public boost::intrusive_ref_counter<Connection, boost::thread
   // calls OnShutdown().
   void Shutdown();
 
+  // Asks the connection to move to dest the next time it calls MaybeMigrate.
+  // Must be called from the thread of the connection.
+  void RequestMigration(fb2::ProactorBase* dest) {
+    migration_dest_ = dest;
+  }
+
+  // Records that the connection is in use, so that the idle reaper of the listener does not
+  // close it, see ListenerInterface::SetIdleTimeout. Cheap enough to be called per request.
+  // Must be called from the thread of the connection.
+  void MarkActive() {
+    last_active_ns_ = fb2::ProactorBase::GetMonotonicTimeNs();
+  }
+
+  // Returns true if the listener sheds requests and the proactor of the connection is
+  // overloaded, see ListenerInterface::SetAdmissionController. HandleRequests implementations
+  // should then answer the request with a retriable error instead of serving it.
+  // Must be called from the thread of the connection.
+  bool ShouldShedRequest();
+
+  // Returns true if the server is draining, see AcceptServer::Drain. HandleRequests
+  // implementations should then close the connection once they finish the request that they
+  // serve, e.g. with "Connection: close". Must be called from the thread of the connection.
+  bool IsDraining() const;
+
+  // Cumulative cpu time of the connection fiber in cycles. Updated only while fiber run
+  // stats are enabled.
+  uint64_t run_cycles() const {
+    return fiber_ ? fiber_->run_stats().run_cycles : 0;
+  }
+
+  // The last TCP_INFO sample of the socket taken by metrics::TcpInfoMetrics, zeroes if the
+  // connection was not sampled yet. Must be called from the thread of the connection.
+  const TcpInfo& tcp_info() const {
+    return tcp_info_;
+  }
+
+  // Memory attributed to the connection. Allocations through it, e.g. with an IoBuf or a pmr
+  // container, are counted against the memory limits of the listener and throw
+  // std::bad_alloc above them, see ListenerInterface::SetMemoryLimits. Memory that is not
+  // allocated through the resource can be accounted with TryCharge/Release.
+  // Must be used from the thread of the connection.
+  base::CountingMemoryResource* memory() {
+    return &memory_;
+  }
+
+  size_t memory_usage() const {
+    return memory_.used();
+  }
+
  protected:
   // The main loop for a connection. Runs in the same proactor thread as of socket_.
   virtual void HandleRequests() = 0;
@@ -62,11 +125,32 @@ class Connection : public boost::intrusive_ref_counter<Connection, boost::thread
   virtual void OnShutdown() {
   }
 
+  // Called after the connection has closed if its listener recycles connections, see
+  // ListenerInterface::SetConnectionRecycling. An implementation that returns true must reset
+  // the state of the connection so that it can serve another socket, and may keep its buffers
+  // warm for it. The default implementation returns false and the connection is destroyed.
+  // Runs in the thread of the connection and must not preempt.
+  virtual bool Recycle() {
+    return false;
+  }
+
+  // Called when the server starts to drain, see AcceptServer::Drain. The connection should
+  // finish its in-flight requests and close. The default implementation shuts the socket down
+  // for reading, so that HandleRequests reads EOF once it has handled the requests that it
+  // has read, while the writes of their responses still succeed. Runs in the thread of the
+  // connection and may preempt.
+  virtual void OnDrain();
+
   virtual void OnPreMigrateThread() {
   }
   virtual void OnPostMigrateThread() {
   }
 
+  // Migrates the connection if it was requested via RequestMigration, for example by
+  // ConnectionRebalancer. Should be called by HandleRequests at points where it does not
+  // hold thread-local resources. Returns true if the connection has migrated.
+  bool MaybeMigrate();
+
   ListenerInterface* listener() const {
     return listener_;
   }
@@ -74,8 +158,38 @@ class Connection : public boost::intrusive_ref_counter<Connection, boost::thread
   std::unique_ptr<FiberSocketBase> socket_;
 
  private:
+  // Resets the bookkeeping of the listener before the connection is reused.
+  void ResetForReuse() {
+    migration_dest_ = nullptr;
+    sampled_cycles_ = period_cycles_ = 0;
+    migrated_period_ = 0;
+    tcp_info_ = TcpInfo{};
+  }
+
   ListenerInterface* listener_ = nullptr;
+  fb2::detail::FiberInterface* fiber_ = nullptr;  // the fiber that runs HandleRequests.
+  fb2::ProactorBase* migration_dest_ = nullptr;
+  uint64_t last_active_ns_ = 0;
+
+  // Bookkeeping of ConnectionRebalancer.
+  uint64_t sampled_cycles_ = 0, period_cycles_ = 0;
+  uint64_t migrated_period_ = 0;
+
+  // Bookkeeping of metrics::TcpInfoMetrics.
+  TcpInfo tcp_info_;
+
+  // memory_.rejected() that was already reported to the listener, for recycled connections.
+  uint64_t reported_rejected_ = 0;
+
+  // Created by the memory factory of the listener, if any, and destroyed after memory_.
+  std::unique_ptr<PMR_NS::memory_resource> heap_;
+
+  // Its parent is the memory counter of the listener on the thread of the connection.
+  base::CountingMemoryResource memory_;
+
   friend class ListenerInterface;
+  friend class ConnectionRebalancer;
+  friend class metrics::TcpInfoMetrics;
 };
 
 }  // namespace util
@@ -0,0 +1,99 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include "util/fibers/fibers.h"
+#include "util/fibers/synchronization.h"
+
+namespace util {
+
+class Connection;
+class ListenerInterface;
+class ProactorPool;
+
+// Moves busy connections of a listener from overloaded proactors to idle ones.
+// Every period it samples the load of each proactor, i.e. the share of the time its loop
+// did not spend idle, and the cpu time of the connection fibers. If the busiest proactor
+// stays overloaded compared to the least busy one during hysteresis_periods, the rebalancer
+// asks its hottest connection that fits into the gap to migrate, see
+// Connection::RequestMigration. Connections only migrate from Connection::MaybeMigrate calls,
+// so HandleRequests implementations opt in by calling it between requests.
+// Enables fiber run stats while it runs, see EnableFiberRunStats.
+class ConnectionRebalancer {
+ public:
+  struct Options {
+    std::chrono::milliseconds period{1000};
+
+    // Load in [0, 1] of the source proactor required for migrating from it.
+    double high_load = 0.75;
+
+    // Minimal load difference between the source and the destination proactors.
+    double min_load_gap = 0.25;
+
+    // Number of consecutive periods the imbalance must persist.
+    unsigned hysteresis_periods = 3;
+
+    // Number of periods a migrated connection stays on its new proactor.
+    unsigned cooldown_periods = 10;
+
+    unsigned max_migrations_per_period = 1;
+  };
+
+  struct Stats {
+    uint64_t periods = 0;
+    uint64_t migrations_requested = 0;
+  };
+
+  ConnectionRebalancer(ListenerInterface* listener, ProactorPool* pool, const Options& opts);
+  ConnectionRebalancer(ListenerInterface* listener, ProactorPool* pool)
+      : ConnectionRebalancer(listener, pool, Options{}) {
+  }
+
+  ~ConnectionRebalancer();
+
+  // Starts the rebalancing fiber in the first proactor of the pool.
+  // The listener must already be accepting connections.
+  void Start();
+
+  // Stops the rebalancing fiber. Must be called before the listener shuts down.
+  void Stop();
+
+  // Can be accessed after Stop or from the rebalancer proactor thread.
+  const Stats& stats() const {
+    return stats_;
+  }
+
+ private:
+  struct ProactorSample {
+    uint64_t wall_usec = 0, idle_usec = 0;
+    double load = 0;
+  };
+
+  void Run();
+
+  // Samples the proactors and connections, returns false if there is no previous sample.
+  bool Sample();
+
+  void Rebalance();
+
+  ListenerInterface* listener_;
+  ProactorPool* pool_;
+  Options opts_;
+  Stats stats_;
+
+  std::vector<ProactorSample> samples_;
+  unsigned overloaded_src_ = UINT32_MAX;
+  unsigned streak_ = 0;
+
+  fb2::Fiber fiber_;
+  fb2::Done done_;
+  bool prev_run_stats_ = false;  // the run stats state to restore on Stop.
+};
+
+}  // namespace util
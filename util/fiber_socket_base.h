@@ -5,12 +5,17 @@
 #pragma once
 
 #include <absl/base/attributes.h>
+#include <sys/socket.h>
 
 // for tcp::endpoint. Consider introducing our own.
 #include <boost/asio/ip/tcp.hpp>
 #include <functional>
+#include <memory>
 
 #include "io/io.h"
+#include "util/fibers/cycle_clock.h"
+
+struct sock_extended_err;
 
 namespace util {
 
@@ -18,6 +23,37 @@ namespace fb2 {
 class ProactorBase;
 }  // namespace fb2
 
+// Delays measured with kernel timestamps, see LinuxSocketBase::EnableTimestamping.
+// In cycles, so that they can be exported like the other CycleHistograms.
+struct SocketTimestampStats {
+  // From the reception of the data by the kernel, or by the NIC if only hardware timestamps
+  // are enabled, to the return of the receive call in the reading fiber.
+  fb2::CycleHistogram rx_wakeup;
+
+  // From the reception by the NIC to the reception by the kernel.
+  fb2::CycleHistogram rx_nic;
+
+  // From a write call to the handoff of its last byte to the NIC driver.
+  fb2::CycleHistogram tx_send;
+};
+
+// The stats of all the sockets of the calling thread.
+const SocketTimestampStats& ThreadSocketTimestampStats();
+
+// A subset of TCP_INFO of a tcp socket, see LinuxSocketBase::GetTcpInfo.
+struct TcpInfo {
+  uint32_t rtt_usec = 0;  // smoothed round trip time.
+  uint32_t rtt_var_usec = 0;
+  uint32_t snd_cwnd = 0;       // congestion window in segments.
+  uint32_t unacked = 0;        // segments in flight.
+  uint32_t lost = 0;           // segments in flight that are considered lost.
+  uint32_t total_retrans = 0;  // segments retransmitted since the connection was established.
+};
+
+// Reads the TCP_INFO of the socket fd. Works for any socket that wraps a tcp descriptor,
+// for example via FiberSocketBase::native_handle.
+std::error_code GetTcpInfo(int fd, TcpInfo* info);
+
 class FiberSocketBase : public io::Sink, public io::AsyncSink, public io::Source {
   FiberSocketBase(const FiberSocketBase&) = delete;
   void operator=(const FiberSocketBase&) = delete;
@@ -25,8 +61,7 @@ class FiberSocketBase : public io::Sink, public io::AsyncSink, public io::Source
   FiberSocketBase& operator=(FiberSocketBase&& other) = delete;
 
  protected:
-  explicit FiberSocketBase(fb2::ProactorBase* pb) : proactor_(pb) {
-  }
+  explicit FiberSocketBase(fb2::ProactorBase* pb);
 
  public:
   using endpoint_type = ::boost::asio::ip::tcp::endpoint;
@@ -35,6 +70,8 @@ class FiberSocketBase : public io::Sink, public io::AsyncSink, public io::Source
   using io::AsyncSink::AsyncProgressCb;
   using ProactorBase = fb2::ProactorBase;
 
+  ~FiberSocketBase();
+
   ABSL_MUST_USE_RESULT virtual error_code Shutdown(int how) = 0;
 
   ABSL_MUST_USE_RESULT virtual AcceptResult Accept() = 0;
@@ -57,6 +94,89 @@ class FiberSocketBase : public io::Sink, public io::AsyncSink, public io::Source
 
   virtual ::io::Result<size_t> Recv(const io::MutableBytes& mb, int flags = 0) = 0;
 
+  // A received buffer that is owned by the socket implementation, for example a buffer that
+  // the kernel selected from an io_uring provided buffer ring.
+  struct ProvidedBuffer {
+    io::Bytes buffer;
+    uint32_t cookie = 0;  // implementation specific handle used by ReturnProvided.
+  };
+
+  // Zero-copy receive. Blocks until data is available and fills dest with up to max_bufs
+  // received buffers. Returns the number of filled buffers. Each of them must be handed back
+  // via ReturnProvided once the data is consumed.
+  // Sockets that do not support this mode return operation_not_supported.
+  virtual ::io::Result<unsigned> RecvProvided(unsigned max_bufs, ProvidedBuffer* dest);
+  virtual void ReturnProvided(const ProvidedBuffer& pbuf);
+
+  // Switches a listening socket into multishot accept mode: a single request keeps accepting
+  // the incoming connections and Accept() hands them out, so that a burst of connections
+  // costs a single submission. The request is canceled once about max_queued connections wait
+  // to be handed out, and it is armed again when they are drained. Since the kernel accepts
+  // connections only while the request is armed, max_queued bounds how far the listener can
+  // run ahead of its consumer. Can be called again to change the limit, and with 0
+  // Accept() accepts a single connection per call.
+  // Sockets that do not support this mode return operation_not_supported.
+  virtual error_code EnableAcceptMultishot(unsigned max_queued);
+
+  // Blocks until the socket has data to read, without consuming it, so that the caller
+  // can defer allocating its read buffer. Returns an error if the stream has ended.
+  // The default implementation peeks a single byte with MSG_PEEK.
+  virtual error_code WaitReadable();
+
+  // Makes the pending reads and writes of the socket fail with an error, so that the fibers
+  // blocked on them resume, e.g. upon cancellation. The position in the stream is undefined
+  // afterwards. io_uring sockets cancel the requests and stay open, the default
+  // implementation shuts the socket down. Must be called from the socket proactor thread.
+  virtual void CancelPendingIo();
+
+  // Like CancelPendingIo, but does not wait for the cancellation to take effect, so that the io
+  // of many sockets can be cancelled at once. io_uring sockets queue the cancellation requests,
+  // which the proactor submits together with the rest of its requests. The default
+  // implementation calls CancelPendingIo. Must be called from the socket proactor thread.
+  virtual void CancelPendingIoAsync() {
+    CancelPendingIo();
+  }
+
+  // Enables zero-copy sends (IORING_OP_SEND_ZC or MSG_ZEROCOPY) for WriteSome/AsyncWriteSome
+  // calls with at least threshold bytes in total. Smaller writes are copied as usual.
+  // A zero-copy write completes only after the kernel releases the buffers, so the caller may
+  // reuse them once the call returns. threshold 0 disables zero-copy.
+  // Sockets that do not support this mode return operation_not_supported.
+  virtual error_code EnableZeroCopySend(size_t threshold);
+
+  // Sends len bytes of the file fd, e.g. io::ReadonlyFile::Handle() or fb2::LinuxFile::GetFd(),
+  // starting at offset. Does not change the file offset. Returns the number of bytes sent,
+  // which is less than len only if the file has ended.
+  // io_uring sockets splice the file through a pipe and epoll sockets use sendfile(2), so that
+  // the data is not copied through user space. The default implementation, used for example by
+  // TLS sockets, reads the file with pread and writes it, which blocks the thread on disk reads.
+  virtual ::io::Result<size_t> SendFile(int fd, off_t offset, size_t len);
+
+#ifdef __linux__
+  // Batched datagram io, see LinuxSocketBase::CreateDatagram.
+  // Receives datagrams with recvmmsg. Blocks until at least one datagram arrives and returns
+  // the number of filled messages, each with its msg_len set. Unlike with Recv, an empty
+  // datagram does not mean that the peer has closed the socket.
+  // Sockets that do not support this mode return operation_not_supported.
+  virtual ::io::Result<unsigned> RecvMMsg(mmsghdr* msgs, unsigned len);
+
+  // Sends datagrams with sendmmsg. Blocks until at least one message is sent and returns
+  // the number of sent messages.
+  virtual ::io::Result<unsigned> SendMMsg(mmsghdr* msgs, unsigned len);
+#endif
+
+  // Enables write coalescing (corking). WriteSome calls copy the data into an output buffer
+  // instead of sending it. The buffer is sent with a single write when the proactor loop is
+  // about to poll for io, i.e. once the running fibers suspend, before receiving from this
+  // socket, when the buffer would exceed limit bytes, or upon Flush(). Writes larger than
+  // limit are sent directly. Errors of the deferred sends are returned by the following writes.
+  // Must not be mixed with AsyncWriteSome calls. limit 0 flushes and disables coalescing.
+  // Must be called from the socket proactor thread.
+  error_code SetWriteCoalescing(size_t limit);
+
+  // Sends the coalesced data and waits until all the deferred sends complete.
+  error_code Flush();
+
   static bool IsConnClosed(const error_code& ec) {
     return (ec == std::errc::connection_aborted) || (ec == std::errc::connection_reset);
   }
@@ -115,10 +235,41 @@ class FiberSocketBase : public io::Sink, public io::AsyncSink, public io::Source
   virtual void OnResetProactor() {
   }
 
+  // Called by the WriteSome implementations. Returns true if the write has been absorbed by
+  // the coalescing buffer, in which case res holds the result.
+  bool CorkWrite(const iovec* v, uint32_t len, io::Result<size_t>* res) {
+    return cork_ && CorkWriteInternal(v, len, res);
+  }
+
+  // Called by the receive implementations, since the peer may wait for our data,
+  // and upon shutdown.
+  void FlushCork() {
+    if (cork_)
+      FlushInternal();
+  }
+
+  // Must be called by Close implementations while the socket is still open.
+  void ResetCork();
+
+  // Whether AsyncWriteSome never blocks the calling context. Otherwise the coalesced writes
+  // are flushed from the proactor loop with non-blocking sends.
+  virtual bool HasAsyncWriteSome() const {
+    return false;
+  }
+
  private:
+  friend class fb2::ProactorBase;
+  struct Cork;
+
+  bool CorkWriteInternal(const iovec* v, uint32_t len, io::Result<size_t>* res);
+  error_code FlushInternal();
+  void FlushCorkAsync();
+  void ScheduleCorkFlush();
+
   // We must reference proactor in each socket so that we could support write_some/read_some
   // with predefined interface and be compliant with SyncWriteStream/SyncReadStream concepts.
   ProactorBase* proactor_;
+  std::unique_ptr<Cork> cork_;
 };
 
 class LinuxSocketBase : public FiberSocketBase {
@@ -136,6 +287,64 @@ class LinuxSocketBase : public FiberSocketBase {
   /// Creates a socket. By default with AF_INET family (2).
   error_code Create(unsigned short protocol_family = 2) override;
 
+  // Takes ownership over fd, a listening or a connected stream socket that was created
+  // elsewhere, e.g. received from another process, and registers it with the proactor.
+  // Must be called from the proactor thread.
+  ABSL_MUST_USE_RESULT error_code Attach(int fd);
+
+  // Makes the pending and the future Accept calls fail with connection_aborted, like Shutdown
+  // does, but does not shut down the listening socket itself, so that the processes that share
+  // it keep accepting. Close() must still be called. Must be called from the proactor thread.
+  virtual void StopAccepting() = 0;
+
+  // Creates a datagram socket, e.g. a udp socket with AF_INET. Bind it to receive, and set
+  // the peer with ConnectDatagram or with msg_name of the sent messages.
+  error_code CreateDatagram(unsigned short protocol_family = 2);
+
+  // Sets the default peer of a datagram socket. Does not block.
+  ABSL_MUST_USE_RESULT error_code ConnectDatagram(const endpoint_type& ep);
+
+#ifdef __linux__
+  // UDP generic segmentation offload: the kernel splits each sent message into datagrams of
+  // segment_size bytes, the last one may be shorter. This way a SendMMsg batch of a few large
+  // buffers carries many datagrams. 0 disables it. Requires kernel 4.18.
+  ABSL_MUST_USE_RESULT error_code SetUdpSegmentSize(uint16_t segment_size);
+
+  // UDP generic receive offload: the kernel may coalesce consecutive datagrams of a flow into
+  // a single message. The receivers provide msg_control of kUdpGroControlLen bytes and split
+  // the messages by UdpGroSegmentSize. Requires kernel 5.0.
+  ABSL_MUST_USE_RESULT error_code EnableUdpGro(bool enable);
+#endif
+
+  enum TimestampFlags : uint8_t {
+    TS_RX_SOFTWARE = 1,  // the kernel stamps the received packets.
+    TS_RX_HARDWARE = 2,  // the NIC stamps the received packets, requires hardware support.
+    TS_TX_SOFTWARE = 4,  // the kernel stamps the sent data when it passes it to the driver.
+  };
+
+  // Enables kernel timestamping (SO_TIMESTAMPING) of the stream with flags, 0 disables it.
+  // The socket records the delays into its timestamp_stats() and the stats of the thread,
+  // so that the kernel and NIC queueing can be told apart from the proactor scheduling:
+  //  - RX timestamps measure the wakeup delay of the reader. Recv receives the timestamps
+  //    of the data by itself, RecvMsg callers should provide msg_control of
+  //    kTimestampControlLen bytes. Receives in multishot mode are not measured.
+  //  - With both RX flags, the NIC to kernel delay is measured as well, which makes sense only
+  //    if the clock of the NIC is synchronized with the system clock.
+  //  - TX timestamps measure the send delay of one write at a time. They are delivered via
+  //    the error queue, which raises POLLERR, hence RegisterOnErrorCb of io_uring sockets
+  //    should not be used with them.
+  // Requires kernel 4.18. Must be called from the proactor thread.
+  ABSL_MUST_USE_RESULT error_code EnableTimestamping(uint8_t flags);
+
+  // Null unless timestamping is enabled.
+  const SocketTimestampStats* timestamp_stats() const;
+
+  // Reads the TCP_INFO of the socket with a single getsockopt call, cheap enough to sample
+  // many connections periodically. Fails for sockets that are not tcp.
+  ABSL_MUST_USE_RESULT error_code GetTcpInfo(TcpInfo* info) const {
+    return ::util::GetTcpInfo(native_handle(), info);
+  }
+
   ABSL_MUST_USE_RESULT error_code Bind(const struct sockaddr* bind_addr,
                                        unsigned addr_len) override;
   ABSL_MUST_USE_RESULT error_code Listen(unsigned backlog) override;
@@ -180,10 +389,42 @@ class LinuxSocketBase : public FiberSocketBase {
  protected:
   constexpr static unsigned kFdShift = 4;
 
-  LinuxSocketBase(int fd, ProactorBase* pb)
-      : FiberSocketBase(pb), fd_(fd > 0 ? fd << kFdShift : fd) {
+  // Timestamping hooks of the implementations, no-ops unless timestamping is enabled.
+  // The writes call TxStart before sending and OnSent with its result and the sends that
+  // bypass WriteSome call OnSent(0, bytes), since the kernel identifies the sent data by its
+  // offset in the stream. The receives call OnRecv with the received message.
+  uint64_t TxStart() const {
+    return ts_ ? TxStartInternal() : 0;
+  }
+
+  void OnSent(uint64_t tx_start, size_t bytes) {
+    if (ts_)
+      OnSentInternal(tx_start, bytes);
+  }
+
+  void OnRecv(const msghdr& msg) {
+    if (ts_)
+      OnRecvInternal(msg);
+  }
+
+  bool HasRxTimestamps() const {
+    return ts_flags_ & (TS_RX_SOFTWARE | TS_RX_HARDWARE);
   }
 
+  // Receives into mb with RecvMsg and a control buffer for the timestamps.
+  ::io::Result<size_t> RecvTimestamped(const io::MutableBytes& mb, int flags);
+
+#ifdef __linux__
+  // Reads the error queue of the socket without blocking. Handles the tx timestamps and
+  // passes the other errors, e.g. zero-copy notifications, to OnErrorQueue.
+  void DrainErrorQueue();
+
+  virtual void OnErrorQueue(const sock_extended_err& serr) {
+  }
+#endif
+
+  LinuxSocketBase(int fd, ProactorBase* pb);
+
   int ShiftedFd() const {
     return fd_ >> kFdShift;
   }
@@ -201,11 +442,33 @@ class LinuxSocketBase : public FiberSocketBase {
   int32_t fd_;
 
   private:
+    struct TimestampState;
+
+    error_code CreateWithType(unsigned short protocol_family, int type);
+
+    uint64_t TxStartInternal() const;
+    void OnSentInternal(uint64_t tx_start, size_t bytes);
+    void OnRecvInternal(const msghdr& msg);
+
     uint32_t timeout_ = UINT32_MAX;
+    uint8_t ts_flags_ = 0;
+    std::unique_ptr<TimestampState> ts_;
 };
 
 void SetNonBlocking(int fd);
 
 void SetCloexec(int fd);
 
+#ifdef __linux__
+// The size of msg_control that receives the UDP_GRO segment size.
+constexpr size_t kUdpGroControlLen = CMSG_SPACE(sizeof(int));
+
+// Returns the size of the datagrams that UDP_GRO coalesced into a received message, the last
+// one may be shorter. Returns 0 if the message holds a single datagram.
+uint16_t UdpGroSegmentSize(const msghdr& msg);
+
+// The size of msg_control that receives the timestamps, see EnableTimestamping.
+constexpr size_t kTimestampControlLen = CMSG_SPACE(sizeof(timespec) * 3);
+#endif
+
 }  // namespace util
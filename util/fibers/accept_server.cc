@@ -4,9 +4,20 @@
 
 #include "util/accept_server.h"
 
+#include <arpa/inet.h>
+#include <poll.h>
 #include <signal.h>
+#include <sys/un.h>
 
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
+
+#include <absl/cleanup/cleanup.h>
+#include <absl/strings/match.h>
 #include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+
 #include "base/logging.h"
 #include "util/fiber_socket_base.h"
 #include "util/listener_interface.h"
@@ -17,6 +28,153 @@ namespace util {
 using namespace boost;
 using namespace std;
 
+namespace {
+
+error_code EnableReusePort(int fd) {
+  const int val = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) < 0)
+    return error_code(errno, system_category());
+  return {};
+}
+
+#ifdef __linux__
+// Steers connections received on cpu c to the socket with index (c - first) % num_socks
+// in the reuseport group. The indices follow the order in which the sockets started listening.
+void AttachCpuSteering(int fd, unsigned first, unsigned num_socks) {
+  sock_filter code[] = {
+      {BPF_LD | BPF_W | BPF_ABS, 0, 0, uint32_t(SKF_AD_OFF + SKF_AD_CPU)},
+      {BPF_ALU | BPF_ADD | BPF_K, 0, 0, num_socks - first},
+      {BPF_ALU | BPF_MOD | BPF_K, 0, 0, num_socks},
+      {BPF_RET | BPF_A, 0, 0, 0},
+  };
+  sock_fprog prog{sizeof(code) / sizeof(code[0]), code};
+  if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0) {
+    LOG(WARNING) << "Could not attach reuseport steering program: " << strerror(errno);
+  }
+}
+#endif
+
+// The messages of the hot restart protocol over a SOCK_SEQPACKET unix socket: "L <address>"
+// with the sockets of a listener, "E" after the last listener and "A" from the successor
+// once it runs.
+constexpr char kListenerMsg[] = "L ";
+constexpr char kEndMsg[] = "E";
+constexpr char kAckMsg[] = "A";
+
+// The kernel limit of the descriptors per SCM_RIGHTS message (SCM_MAX_FD).
+constexpr size_t kMaxFdsPerMsg = 253;
+
+// Returns the key of a listening socket in the hot restart protocol.
+string SockAddrKey(const sockaddr* sa) {
+  char buf[INET6_ADDRSTRLEN];
+  switch (sa->sa_family) {
+    case AF_INET: {
+      const sockaddr_in* in = reinterpret_cast<const sockaddr_in*>(sa);
+      inet_ntop(AF_INET, &in->sin_addr, buf, sizeof(buf));
+      return absl::StrCat(buf, ":", ntohs(in->sin_port));
+    }
+    case AF_INET6: {
+      const sockaddr_in6* in6 = reinterpret_cast<const sockaddr_in6*>(sa);
+      inet_ntop(AF_INET6, &in6->sin6_addr, buf, sizeof(buf));
+      return absl::StrCat("[", buf, "]:", ntohs(in6->sin6_port));
+    }
+    case AF_UNIX:
+      return reinterpret_cast<const sockaddr_un*>(sa)->sun_path;
+  }
+  return {};
+}
+
+error_code LocalKey(int fd, string* key) {
+  sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  if (getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) < 0)
+    return error_code(errno, system_category());
+  *key = SockAddrKey(reinterpret_cast<sockaddr*>(&addr));
+  return {};
+}
+
+// Returns false if deadline passed before fd became readable.
+bool WaitReadable(int fd, chrono::steady_clock::time_point deadline) {
+  while (true) {
+    auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now());
+    pollfd pfd{fd, POLLIN, 0};
+    int res = poll(&pfd, 1, max<int64_t>(left.count(), 0));
+    if (res > 0)
+      return true;
+    if (res == 0 || errno != EINTR)
+      return false;
+  }
+}
+
+error_code SendFds(int fd, string_view payload, const vector<int>& fds) {
+  DCHECK_LE(fds.size(), kMaxFdsPerMsg);
+
+  iovec iov{const_cast<char*>(payload.data()), payload.size()};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  unique_ptr<char[]> control;
+  if (!fds.empty()) {
+    size_t len = CMSG_SPACE(sizeof(int) * fds.size());
+    control.reset(new char[len]());
+    msg.msg_control = control.get();
+    msg.msg_controllen = len;
+
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+  }
+
+  while (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) {
+    if (errno != EINTR)
+      return error_code(errno, system_category());
+  }
+  return {};
+}
+
+// Appends the received descriptors to fds.
+error_code RecvFds(int fd, chrono::steady_clock::time_point deadline, string* payload,
+                   vector<int>* fds) {
+  if (!WaitReadable(fd, deadline))
+    return make_error_code(errc::timed_out);
+
+  char buf[512];
+  iovec iov{buf, sizeof(buf)};
+  unique_ptr<char[]> control(new char[CMSG_SPACE(sizeof(int) * kMaxFdsPerMsg)]);
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.get();
+  msg.msg_controllen = CMSG_SPACE(sizeof(int) * kMaxFdsPerMsg);
+
+  ssize_t res;
+  while ((res = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) < 0) {
+    if (errno != EINTR)
+      return error_code(errno, system_category());
+  }
+  if (res == 0)
+    return make_error_code(errc::connection_aborted);
+
+  for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    size_t start = fds->size();
+    fds->resize(start + count);
+    memcpy(fds->data() + start, CMSG_DATA(cmsg), sizeof(int) * count);
+  }
+
+  if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+    return make_error_code(errc::message_size);
+  payload->assign(buf, res);
+  return {};
+}
+
+}  // namespace
+
 AcceptServer::AcceptServer(ProactorPool* pool, PMR_NS::memory_resource* mr, bool break_on_int)
     : pool_(pool), mr_(mr), ref_bc_(0) {
   if (break_on_int) {
@@ -33,6 +191,14 @@ AcceptServer::AcceptServer(ProactorPool* pool, PMR_NS::memory_resource* mr, bool
 
 AcceptServer::~AcceptServer() {
   list_interface_.clear();
+
+  // InheritListeners was called without Run().
+  for (const auto& [key, fds] : inherited_) {
+    for (int fd : fds)
+      close(fd);
+  }
+  if (handover_fd_ >= 0)
+    close(handover_fd_);
 }
 
 void AcceptServer::Run() {
@@ -53,6 +219,21 @@ void AcceptServer::Run() {
     }
   }
   was_run_ = true;
+
+  if (handover_fd_ >= 0) {
+    for (const auto& [key, fds] : inherited_) {
+      LOG(WARNING) << "Closing the inherited socket " << key << " that no listener adopted";
+      for (int fd : fds)
+        close(fd);
+    }
+    inherited_.clear();
+
+    // The predecessor stops accepting now.
+    error_code ec = SendFds(handover_fd_, kAckMsg, {});
+    LOG_IF(WARNING, ec) << "Could not notify the predecessor: " << ec.message();
+    close(handover_fd_);
+    handover_fd_ = -1;
+  }
 }
 
 // If wait is false - does not wait for the server to stop.
@@ -76,6 +257,247 @@ void AcceptServer::Wait() {
   }
 }
 
+void AcceptServer::SetActiveProactors(size_t n) {
+  pool_->SetActiveSize(n);
+  for (auto& listener : list_interface_)
+    listener->MigrateParkedConnections();
+}
+
+auto AcceptServer::Drain(const DrainOptions& opts) -> DrainProgress {
+  using Clock = chrono::steady_clock;
+  Clock::time_point start = Clock::now();
+  Clock::time_point deadline = start + opts.deadline;
+
+  DrainProgress progress;
+  auto update = [&](DrainProgress::Phase phase) {
+    progress.phase = phase;
+    progress.open_connections = 0;
+    for (auto& lw : list_interface_)
+      progress.open_connections += lw->open_connections_.load(memory_order_relaxed);
+    progress.elapsed = chrono::duration_cast<chrono::milliseconds>(Clock::now() - start);
+    if (opts.on_progress)
+      opts.on_progress(progress);
+  };
+
+  // The new connections are closed right away while the listeners still run.
+  for (auto& lw : list_interface_) {
+    lw->pause_accepting();
+    lw->draining_.store(true, memory_order_relaxed);
+  }
+
+  for (auto& lw : list_interface_)
+    progress.initial_connections += lw->open_connections_.load(memory_order_relaxed);
+  LOG(INFO) << "Draining " << progress.initial_connections << " connections";
+
+  pool_->AwaitFiberOnAll([this](auto* pb) {
+    for (auto& lw : list_interface_)
+      lw->DrainConnectionsOnThread();
+  });
+
+  update(DrainProgress::DRAINING);
+  while (progress.open_connections > 0) {
+    Clock::time_point now = Clock::now();
+    if (now >= deadline)
+      break;
+    ThisFiber::SleepFor(min<Clock::duration>(opts.progress_period, deadline - now));
+    update(DrainProgress::DRAINING);
+  }
+
+  if (progress.open_connections > 0) {
+    LOG(INFO) << "Cancelling " << progress.open_connections << " connections after "
+              << progress.elapsed.count() << "ms";
+    update(DrainProgress::CANCELLING);
+    pool_->AwaitFiberOnAll([this](auto* pb) {
+      for (auto& lw : list_interface_)
+        lw->CancelConnectionsOnThread();
+    });
+  }
+
+  Stop(true);
+  update(DrainProgress::DONE);
+  LOG(INFO) << "Drained " << progress.initial_connections << " connections in "
+            << progress.elapsed.count() << "ms";
+  return progress;
+}
+
+error_code AcceptServer::HandOverListeners(const char* uds_path, chrono::milliseconds timeout) {
+  CHECK(was_run_);
+  auto deadline = chrono::steady_clock::now() + timeout;
+
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (strlen(uds_path) >= sizeof(addr.sun_path))
+    return make_error_code(errc::filename_too_long);
+  strcpy(addr.sun_path, uds_path);
+
+  int lfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (lfd < 0)
+    return error_code(errno, system_category());
+
+  unlink(uds_path);
+  absl::Cleanup close_lfd = [&] {
+    close(lfd);
+    unlink(uds_path);
+  };
+  if (bind(lfd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(lfd, 1) < 0)
+    return error_code(errno, system_category());
+
+  LOG(INFO) << "Waiting for the successor on " << uds_path;
+  if (!WaitReadable(lfd, deadline))
+    return make_error_code(errc::timed_out);
+
+  int fd = accept4(lfd, nullptr, nullptr, SOCK_CLOEXEC);
+  if (fd < 0)
+    return error_code(errno, system_category());
+  absl::Cleanup close_fd = [fd] { close(fd); };
+
+  error_code ec;
+  for (auto& lw : list_interface_) {
+    vector<FiberSocketBase*> socks{lw->socket()};
+    for (auto& shard : lw->shard_socks_)
+      socks.push_back(shard.get());
+
+    // Direct descriptors of io_uring are translated by their proactors.
+    vector<int> fds;
+    for (FiberSocketBase* sock : socks)
+      fds.push_back(sock->proactor()->AwaitBrief([sock] { return sock->native_handle(); }));
+    if (fds.size() > kMaxFdsPerMsg)
+      return make_error_code(errc::argument_list_too_long);
+
+    string key;
+    ec = LocalKey(fds.front(), &key);
+    if (!ec)
+      ec = SendFds(fd, absl::StrCat(kListenerMsg, key), fds);
+    if (ec)
+      return ec;
+    VLOG(1) << "Handed over " << key << " with " << fds.size() << " sockets";
+  }
+
+  ec = SendFds(fd, kEndMsg, {});
+  if (ec)
+    return ec;
+
+  // Both processes accept from the shared sockets until the successor runs.
+  string msg;
+  vector<int> no_fds;
+  ec = RecvFds(fd, deadline, &msg, &no_fds);
+  if (!ec && msg != kAckMsg)
+    ec = make_error_code(errc::protocol_error);
+  if (ec)
+    return ec;
+
+  for (auto& lw : list_interface_) {
+    lw->socket()->proactor()->Await([li = lw.get()] {
+      li->handed_over_ = true;
+      static_cast<LinuxSocketBase*>(li->socket())->StopAccepting();
+    });
+    for (auto& shard : lw->shard_socks_) {
+      shard->proactor()->Await(
+          [sock = shard.get()] { static_cast<LinuxSocketBase*>(sock)->StopAccepting(); });
+    }
+  }
+  LOG(INFO) << "Handed over " << list_interface_.size() << " listeners";
+  return ec;
+}
+
+error_code AcceptServer::InheritListeners(const char* uds_path, chrono::milliseconds timeout) {
+  CHECK(!was_run_ && list_interface_.empty());
+  auto deadline = chrono::steady_clock::now() + timeout;
+
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (strlen(uds_path) >= sizeof(addr.sun_path))
+    return make_error_code(errc::filename_too_long);
+  strcpy(addr.sun_path, uds_path);
+
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return error_code(errno, system_category());
+  absl::Cleanup close_fd = [&] {
+    if (fd >= 0)
+      close(fd);
+  };
+
+  // The predecessor may not listen yet.
+  while (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+    if ((errno != ENOENT && errno != ECONNREFUSED && errno != EINTR) ||
+        chrono::steady_clock::now() >= deadline) {
+      return error_code(errno, system_category());
+    }
+    ThisFiber::SleepFor(10ms);
+  }
+
+  error_code ec;
+  while (true) {
+    string msg;
+    vector<int> fds;
+    ec = RecvFds(fd, deadline, &msg, &fds);
+    if (!ec && msg != kEndMsg && !absl::StartsWith(msg, kListenerMsg))
+      ec = make_error_code(errc::protocol_error);
+
+    if (ec || msg == kEndMsg) {
+      for (int sock_fd : fds)
+        close(sock_fd);
+      break;
+    }
+
+    string key = msg.substr(strlen(kListenerMsg));
+    VLOG(1) << "Inherited " << key << " with " << fds.size() << " sockets";
+    vector<int>& dest = inherited_[key];
+    dest.insert(dest.end(), fds.begin(), fds.end());
+  }
+
+  if (ec) {
+    for (const auto& [key, fds] : inherited_) {
+      for (int sock_fd : fds)
+        close(sock_fd);
+    }
+    inherited_.clear();
+    return ec;
+  }
+
+  LOG(INFO) << "Inherited " << inherited_.size() << " listeners from " << uds_path;
+  handover_fd_ = std::exchange(fd, -1);
+  return ec;
+}
+
+error_code AcceptServer::AdoptListener(vector<int> fds, ListenerInterface* listener) {
+  DCHECK(!fds.empty());
+
+  vector<unique_ptr<FiberSocketBase>> socks;
+  error_code ec;
+  unsigned first = 0;
+  for (size_t i = 0; i < fds.size(); ++i) {
+    // Keeps the shards on separate proactors, like AddShardSockets does.
+    ProactorBase* p = i == 0 ? pool_->GetNextProactor() : pool_->at((first + i) % pool_->size());
+    if (i == 0)
+      first = p->GetPoolIndex();
+
+    unique_ptr<LinuxSocketBase> sock{static_cast<LinuxSocketBase*>(p->CreateSocket())};
+    ec = p->Await([&] { return sock->Attach(fds[i]); });
+    if (ec) {
+      for (size_t j = i; j < fds.size(); ++j)
+        close(fds[j]);
+      break;
+    }
+    socks.emplace_back(std::move(sock));
+  }
+
+  if (ec) {
+    for (auto& sock : socks)
+      sock->proactor()->Await([&] { std::ignore = sock->Close(); });
+    return ec;
+  }
+
+  VLOG(1) << "Adopted " << socks.size() << " inherited sockets";
+  listener->InitByAcceptServer(pool_, mr_);
+  listener->sock_ = std::move(socks.front());
+  listener->shard_socks_.assign(std::make_move_iterator(socks.begin() + 1),
+                                std::make_move_iterator(socks.end()));
+  list_interface_.emplace_back(listener);
+  return ec;
+}
+
 // Returns the port number to which the listener was bound.
 unsigned short AcceptServer::AddListener(unsigned short port, ListenerInterface* lii) {
   error_code ec = AddListener(nullptr, port, lii);
@@ -107,6 +529,16 @@ error_code AcceptServer::AddListener(const char* bind_addr, uint16_t port,
   }
   CHECK(servinfo);
 
+  for (addrinfo* p = servinfo; p != NULL && !inherited_.empty(); p = p->ai_next) {
+    auto it = inherited_.find(SockAddrKey(p->ai_addr));
+    if (it != inherited_.end()) {
+      vector<int> fds = std::move(it->second);
+      inherited_.erase(it);
+      freeaddrinfo(servinfo);
+      return AdoptListener(std::move(fds), listener);
+    }
+  }
+
   ProactorBase* next = pool_->GetNextProactor();
 
   unique_ptr<FiberSocketBase> fs{next->CreateSocket()};
@@ -129,6 +561,12 @@ error_code AcceptServer::AddListener(const char* bind_addr, uint16_t port,
         if (ec)
           break;
 
+        if (reuseport_sharding_) {
+          ec = EnableReusePort(fs->native_handle());
+          if (ec)
+            break;
+        }
+
         ec = fs->Bind(p->ai_addr, p->ai_addrlen);
         if (ec)
           break;
@@ -149,6 +587,14 @@ error_code AcceptServer::AddListener(const char* bind_addr, uint16_t port,
 
   freeaddrinfo(servinfo);
 
+  if (success && reuseport_sharding_) {
+    ec = AddShardSockets(fs.get(), listener);
+    if (ec) {
+      next->Await([&] { std::ignore = fs->Close(); });
+      success = false;
+    }
+  }
+
   if (success) {
     DCHECK(fs->IsOpen());
 
@@ -165,6 +611,12 @@ error_code AcceptServer::AddUDSListener(const char* path, mode_t permissions,
   CHECK(listener && !listener->socket());
   CHECK(!was_run_);
 
+  if (auto it = inherited_.find(path); it != inherited_.end()) {
+    vector<int> fds = std::move(it->second);
+    inherited_.erase(it);
+    return AdoptListener(std::move(fds), listener);
+  }
+
   ProactorBase* next = pool_->GetNextProactor();
   unique_ptr<FiberSocketBase> fs{next->CreateSocket()};
 
@@ -189,11 +641,82 @@ error_code AcceptServer::AddUDSListener(const char* path, mode_t permissions,
   return ec;
 }
 
+error_code AcceptServer::AddShardSockets(FiberSocketBase* main_sock,
+                                         ListenerInterface* listener) {
+  ProactorBase* main_proactor = main_sock->proactor();
+  sockaddr_storage addr;
+  socklen_t addr_len = sizeof(addr);
+
+  // Binds to the actual address of the main socket, in case it was bound on port 0.
+  if (getsockname(main_sock->native_handle(), reinterpret_cast<sockaddr*>(&addr), &addr_len) < 0)
+    return error_code(errno, system_category());
+
+  const unsigned num_socks = pool_->size();
+  const unsigned first = main_proactor->GetPoolIndex();
+  vector<unique_ptr<FiberSocketBase>> shards;
+  error_code ec;
+
+  for (unsigned i = 1; i < num_socks && !ec; ++i) {
+    ProactorBase* p = pool_->at((first + i) % num_socks);
+    unique_ptr<FiberSocketBase> shard{p->CreateSocket()};
+    ec = p->Await([&] {
+      error_code ec = shard->Create(addr.ss_family);
+      if (ec)
+        return ec;
+
+      ec = listener->ConfigureServerSocket(shard->native_handle());
+      if (!ec)
+        ec = EnableReusePort(shard->native_handle());
+      if (!ec)
+        ec = shard->Bind(reinterpret_cast<sockaddr*>(&addr), addr_len);
+      if (!ec)
+        ec = shard->Listen(backlog_);
+      if (ec)
+        std::ignore = shard->Close();
+      return ec;
+    });
+
+    if (!ec)
+      shards.push_back(std::move(shard));
+  }
+
+  if (ec) {
+    for (auto& shard : shards) {
+      shard->proactor()->Await([&] { std::ignore = shard->Close(); });
+    }
+    return ec;
+  }
+
+#ifdef __linux__
+  if (steer_by_cpu_) {
+    bool pinned = true;
+    for (unsigned i = 0; i < num_socks && pinned; ++i) {
+      const vector<unsigned>& ids = pool_->MapCpuToThreads(i);
+      pinned = find(ids.begin(), ids.end(), i) != ids.end();
+    }
+
+    if (pinned) {
+      main_proactor->Await(
+          [&] { AttachCpuSteering(main_sock->native_handle(), first, num_socks); });
+    } else {
+      LOG(WARNING) << "Proactors are not pinned to their cpus, connections are not steered";
+    }
+  }
+#endif
+
+  VLOG(1) << "Opened " << shards.size() << " reuseport shards for "
+          << main_sock->native_handle();
+  listener->shard_socks_ = std::move(shards);
+  return ec;
+}
+
 void AcceptServer::BreakListeners() {
   for (auto& lw : list_interface_) {
     ProactorBase* proactor = lw->socket()->proactor();
-    proactor->Dispatch([sock = lw->socket()] {
-      if (sock->IsOpen()) {
+    proactor->Dispatch([li = lw.get(), sock = lw->socket()] {
+      if (li->handed_over_) {
+        li->stop_handed_over_.Notify();
+      } else if (sock->IsOpen()) {
         auto ec = sock->Shutdown(SHUT_RDWR);
         LOG_IF(WARNING, ec) << "Error shutting down a socket " << ec.message();
       }
@@ -0,0 +1,142 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/admission_controller.h"
+
+#include <absl/time/clock.h>
+
+#include "base/logging.h"
+#include "util/proactor_pool.h"
+
+namespace util {
+
+using namespace std;
+
+AdmissionController::AdmissionController(ProactorPool* pool, const Options& opts)
+    : pool_(pool), opts_(opts), states_(new ProactorState[pool->size()]) {
+  CHECK_GT(opts_.period.count(), 0);
+  CHECK_GT(opts_.overload_periods, 0u);
+  CHECK_GT(opts_.recover_periods, 0u);
+}
+
+AdmissionController::~AdmissionController() {
+  CHECK(periodic_ids_.empty()) << "Stop must be called before destruction";
+}
+
+void AdmissionController::Start() {
+  CHECK(periodic_ids_.empty());
+  periodic_ids_.resize(pool_->size());
+  pool_->AwaitBrief([this](unsigned index, ProactorBase* pb) {
+    ProactorState& st = states_[index];
+    st.last_sample_ns = 0;
+    st.hot_periods = st.cool_periods = 0;
+    periodic_ids_[index] =
+        pb->AddPeriodic(opts_.period.count(), [this, index, pb] { Sample(index, pb); });
+  });
+}
+
+void AdmissionController::Stop() {
+  if (periodic_ids_.empty())
+    return;
+
+  // CancelPeriodic must run in a fiber.
+  pool_->AwaitFiberOnAll([this](unsigned index, ProactorBase* pb) {
+    pb->CancelPeriodic(periodic_ids_[index]);
+    states_[index].overloaded.store(false, memory_order_relaxed);
+  });
+  periodic_ids_.clear();
+}
+
+fb2::ProactorBase* AdmissionController::PickProactor() {
+  unsigned size = pool_->active_size();
+  unsigned start = next_pick_.fetch_add(1, memory_order_relaxed);
+  for (unsigned i = 0; i < size; ++i) {
+    unsigned index = (start + i) % size;
+    if (!IsOverloaded(index))
+      return pool_->at(index);
+  }
+  return nullptr;
+}
+
+bool AdmissionController::AdmitConnection(fb2::ProactorBase** dest) {
+  if (!IsOverloaded((*dest)->GetPoolIndex()))
+    return true;
+
+  auto deadline = chrono::steady_clock::now() + opts_.max_accept_delay;
+  bool delayed = false;
+  while (true) {
+    if (ProactorBase* pb = PickProactor()) {
+      *dest = pb;
+      (delayed ? delayed_ : redirected_).fetch_add(1, memory_order_relaxed);
+      return true;
+    }
+    if (chrono::steady_clock::now() >= deadline)
+      break;
+
+    // The state changes at most once per period.
+    ThisFiber::SleepFor(
+        min<chrono::steady_clock::duration>(opts_.period, opts_.max_accept_delay));
+    delayed = true;
+  }
+
+  rejected_.fetch_add(1, memory_order_relaxed);
+  return false;
+}
+
+bool AdmissionController::ShouldShed() {
+  if (!IsOverloaded(ProactorBase::me()->GetPoolIndex()))
+    return false;
+  shed_.fetch_add(1, memory_order_relaxed);
+  return true;
+}
+
+auto AdmissionController::GetStats() const -> Stats {
+  Stats res;
+  res.overloads = overloads_.load(memory_order_relaxed);
+  res.redirected = redirected_.load(memory_order_relaxed);
+  res.delayed = delayed_.load(memory_order_relaxed);
+  res.rejected = rejected_.load(memory_order_relaxed);
+  res.shed = shed_.load(memory_order_relaxed);
+  return res;
+}
+
+// Runs from the I/O loop of pb.
+void AdmissionController::Sample(unsigned index, fb2::ProactorBase* pb) {
+  ProactorState& st = states_[index];
+
+  // The cached loop time is not precise enough for measuring the lag.
+  uint64_t now = absl::GetCurrentTimeNanos();
+  uint64_t stalls = pb->stats().num_stalls;
+  uint64_t expected =
+      st.last_sample_ns + chrono::duration_cast<chrono::nanoseconds>(opts_.period).count();
+  bool first = st.last_sample_ns == 0;
+  uint64_t lag_usec = (!first && now > expected) ? (now - expected) / 1000 : 0;
+  uint64_t stall_cnt = stalls - st.last_stalls;
+  st.last_sample_ns = now;
+  st.last_stalls = stalls;
+  if (first)
+    return;
+
+  bool hot = fb2::ReadyFibersCount() > opts_.max_ready_fibers ||
+             lag_usec > uint64_t(opts_.max_loop_lag.count()) ||
+             stall_cnt < opts_.min_stalls_per_period;
+
+  if (hot) {
+    st.cool_periods = 0;
+    if (++st.hot_periods >= opts_.overload_periods &&
+        !st.overloaded.load(memory_order_relaxed)) {
+      VLOG(1) << "Proactor " << index << " is overloaded, lag " << lag_usec << "us";
+      st.overloaded.store(true, memory_order_relaxed);
+      overloads_.fetch_add(1, memory_order_relaxed);
+    }
+  } else {
+    st.hot_periods = 0;
+    if (++st.cool_periods >= opts_.recover_periods && st.overloaded.load(memory_order_relaxed)) {
+      VLOG(1) << "Proactor " << index << " recovered";
+      st.overloaded.store(false, memory_order_relaxed);
+    }
+  }
+}
+
+}  // namespace util
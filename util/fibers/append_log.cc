@@ -0,0 +1,200 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/fibers/append_log.h"
+
+#include <cstring>
+
+#include "base/logging.h"
+#include "util/fibers/uring_file.h"
+#include "util/fibers/uring_proactor.h"
+
+namespace util {
+namespace fb2 {
+
+using namespace std;
+using nonstd::make_unexpected;
+
+namespace {
+
+constexpr size_t kMinBatchLimit = UringBuf::kAlign;
+
+UringProactor* GetProactor() {
+  ProactorBase* me = ProactorBase::me();
+  DCHECK(me && me->GetKind() == ProactorBase::IOURING);
+  return static_cast<UringProactor*>(me);
+}
+
+}  // namespace
+
+AppendLog::AppendLog(LinuxFile* file, off_t offset, const Options& opts)
+    : file_(file), opts_(opts), start_offset_(offset), appended_(offset), durable_(offset) {
+  buf_size_ = (std::max<size_t>(opts.buf_size, 1) + UringBuf::kAlign - 1) / UringBuf::kAlign *
+              UringBuf::kAlign;
+  batch_limit_ = buf_size_;
+
+  UringProactor* proactor = GetProactor();
+  bool registered = proactor->GetRegisteredBufferStats().regions > 0;
+  for (Buffer& buf : bufs_) {
+    if (registered) {
+      if (auto ubuf = proactor->RequestBuffer(buf_size_); ubuf) {
+        buf.data = ubuf->bytes.data();
+        buf.buf_idx = ubuf->buf_idx;
+        continue;
+      }
+    }
+    buf.data = static_cast<uint8_t*>(aligned_alloc(UringBuf::kAlign, buf_size_));
+    CHECK(buf.data);
+  }
+
+  flusher_ = Fiber("AppendLogFlusher", [this] { FlushLoop(); });
+}
+
+AppendLog::~AppendLog() {
+  if (flusher_.IsJoinable()) {
+    error_code ec = Close();
+    LOG_IF(WARNING, ec) << "Error closing the append log: " << ec;
+  }
+}
+
+bool AppendLog::Fits(size_t size) const {
+  const Buffer& buf = bufs_[fill_];
+
+  // A record larger than the batch limit is allowed into an empty buffer.
+  return buf.len == 0 || buf.len + size <= batch_limit_;
+}
+
+io::Result<off_t> AppendLog::Append(io::Bytes record) {
+  DCHECK(!closing_);
+  if (record.size() > buf_size_)
+    return make_unexpected(make_error_code(errc::message_size));
+
+  // Records are not split, so that the bytes of concurrent appends do not interleave.
+  space_ec_.await([&] { return ec_ || Fits(record.size()); });
+  if (ec_)
+    return make_unexpected(ec_);
+
+  Buffer& buf = bufs_[fill_];
+  memcpy(buf.data + buf.len, record.data(), record.size());
+  buf.len += record.size();
+
+  off_t offset = appended_;
+  appended_ += record.size();
+  ++num_records_;
+  data_ec_.notify();
+
+  off_t end = appended_;
+  durable_ec_.await([&] { return ec_ || durable_ >= end; });
+  if (durable_ < end)
+    return make_unexpected(ec_);
+
+  return offset;
+}
+
+void AppendLog::FlushLoop() {
+  while (true) {
+    data_ec_.await([this] { return closing_ || bufs_[fill_].len > 0; });
+
+    Buffer& buf = bufs_[fill_];
+    if (buf.len == 0)  // closing
+      break;
+
+    // The appends that arrive while this batch is in flight form the next batch.
+    fill_ ^= 1;
+    DCHECK_EQ(0u, bufs_[fill_].len);
+    space_ec_.notifyAll();
+
+    uint64_t start = ProactorBase::GetMonotonicTimeNs();
+    error_code ec = WriteBatch(buf, durable_);
+    if (!ec)
+      ec = opts_.datasync ? file_->DataSync() : file_->Sync();
+
+    if (ec) {
+      LOG(ERROR) << "Error writing the append log: " << ec.message();
+      ec_ = ec;
+      durable_ec_.notifyAll();
+      space_ec_.notifyAll();
+      break;
+    }
+
+    durable_ += buf.len;
+    ++num_batches_;
+    AdaptBatchLimit(buf.len, ProactorBase::GetMonotonicTimeNs() - start);
+    buf.len = 0;
+
+    durable_ec_.notifyAll();
+    space_ec_.notifyAll();
+  }
+}
+
+error_code AppendLog::WriteBatch(const Buffer& buf, off_t offset) {
+  size_t written = 0;
+  while (written < buf.len) {
+    int res = 0;
+    bool done = false;
+    auto cb = [&](int io_res) {
+      res = io_res;
+      done = true;
+      io_ec_.notify();
+    };
+
+    io::Bytes src(buf.data + written, buf.len - written);
+    if (buf.buf_idx) {
+      file_->WriteFixedAsync(src, offset + written, *buf.buf_idx, std::move(cb));
+    } else {
+      file_->WriteAsync(src, offset + written, std::move(cb));
+    }
+    io_ec_.await([&] { return done; });
+
+    if (res < 0)
+      return error_code{-res, system_category()};
+    if (res == 0)  // short writes happen only when the device is full.
+      return make_error_code(errc::no_space_on_device);
+    written += res;
+  }
+  return {};
+}
+
+void AppendLog::AdaptBatchLimit(size_t batch_len, uint64_t latency_ns) {
+  uint64_t target_ns = chrono::nanoseconds(opts_.target_latency).count();
+  if (target_ns == 0)
+    return;
+
+  if (latency_ns > target_ns) {
+    batch_limit_ = std::max(batch_limit_ / 2, kMinBatchLimit);
+  } else if (latency_ns < target_ns / 2 && batch_len >= batch_limit_) {
+    batch_limit_ = std::min(batch_limit_ * 2, buf_size_);
+  }
+}
+
+error_code AppendLog::Close() {
+  closing_ = true;
+  data_ec_.notify();
+  flusher_.JoinIfNeeded();
+
+  UringProactor* proactor = GetProactor();
+  for (Buffer& buf : bufs_) {
+    if (!buf.data)
+      continue;
+    if (buf.buf_idx) {
+      proactor->ReturnBuffer(UringBuf{{buf.data, buf_size_}, buf.buf_idx});
+    } else {
+      free(buf.data);
+    }
+    buf.data = nullptr;
+  }
+  return ec_;
+}
+
+auto AppendLog::GetStats() const -> Stats {
+  Stats res;
+  res.records = num_records_;
+  res.batches = num_batches_;
+  res.bytes = durable_ - start_offset_;
+  res.batch_limit = batch_limit_;
+  return res;
+}
+
+}  // namespace fb2
+}  // namespace util
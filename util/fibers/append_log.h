@@ -0,0 +1,107 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <chrono>
+#include <optional>
+
+#include "io/io.h"
+#include "util/fibers/fibers.h"
+#include "util/fibers/synchronization.h"
+
+namespace util {
+namespace fb2 {
+
+class LinuxFile;
+
+// Append-only log with group commit. Many fibers call Append() and the records that accumulate
+// while a batch is being written and synced form the next batch, which costs a single write
+// and a single sync. Hence, the batches grow with the load and each append waits for at most
+// two batches. Records are laid out in the file in the order their Append calls got buffer
+// space, and the appends complete in that order.
+// The records are copied into two 4KB-aligned buffers, taken from the registered buffers of
+// the proactor if possible. Must be used in the proactor thread of the file. Does not own the
+// file, which should not be opened with O_DIRECT since the batches are not padded.
+class AppendLog {
+ public:
+  struct Options {
+    // Capacity of each buffer and the largest record, rounded up to 4KB.
+    size_t buf_size = 1 << 20;
+
+    // If a batch takes longer to write and sync, the batch size limit is halved. It is
+    // doubled back when full batches complete within half of it. 0 disables the adaptation.
+    std::chrono::microseconds target_latency{2000};
+
+    bool datasync = true;  // fdatasync or fsync.
+  };
+
+  // Appends to file starting at offset.
+  AppendLog(LinuxFile* file, off_t offset) : AppendLog(file, offset, Options{}) {
+  }
+
+  AppendLog(LinuxFile* file, off_t offset, const Options& opts);
+  ~AppendLog();
+
+  AppendLog(const AppendLog&) = delete;
+  AppendLog& operator=(const AppendLog&) = delete;
+
+  // Suspends until the record is durable and returns its offset in the file.
+  // Once a write or a sync fails, the error is returned for all the pending and the following
+  // appends.
+  io::Result<off_t> Append(io::Bytes record);
+
+  // Waits for the buffered records and stops the log. Must not be called concurrently with
+  // Append. Does not close the file.
+  std::error_code Close();
+
+  struct Stats {
+    uint64_t records = 0;
+    uint64_t batches = 0;
+    uint64_t bytes = 0;      // durable bytes.
+    size_t batch_limit = 0;  // current limit of the batch size.
+  };
+
+  Stats GetStats() const;
+
+ private:
+  struct Buffer {
+    uint8_t* data = nullptr;
+    std::optional<unsigned> buf_idx;  // set if the buffer is registered.
+    size_t len = 0;
+  };
+
+  void FlushLoop();
+  std::error_code WriteBatch(const Buffer& buf, off_t offset);
+  void AdaptBatchLimit(size_t batch_len, uint64_t latency_ns);
+
+  // Whether a record of size bytes fits into the buffer that is being filled.
+  bool Fits(size_t size) const;
+
+  LinuxFile* file_;
+  Options opts_;
+  size_t buf_size_;
+  size_t batch_limit_;
+
+  Buffer bufs_[2];
+  unsigned fill_ = 0;  // index of the buffer that is being filled.
+
+  off_t start_offset_;
+  off_t appended_;  // end offset of the buffered records.
+  off_t durable_;   // end offset of the synced records.
+  bool closing_ = false;
+  std::error_code ec_;  // sticky error of the writes and syncs.
+
+  uint64_t num_records_ = 0;
+  uint64_t num_batches_ = 0;
+
+  EventCount data_ec_;     // the flusher waits for records.
+  EventCount space_ec_;    // the appenders wait for buffer space.
+  EventCount durable_ec_;  // the appenders wait for their sync.
+  EventCount io_ec_;       // the flusher waits for its writes.
+  Fiber flusher_;
+};
+
+}  // namespace fb2
+}  // namespace util
@@ -0,0 +1,143 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/connection_rebalancer.h"
+
+#include <algorithm>
+
+#include "base/logging.h"
+#include "util/connection.h"
+#include "util/listener_interface.h"
+#include "util/proactor_pool.h"
+
+namespace util {
+
+using namespace std;
+
+ConnectionRebalancer::ConnectionRebalancer(ListenerInterface* listener, ProactorPool* pool,
+                                           const Options& opts)
+    : listener_(listener), pool_(pool), opts_(opts) {
+  CHECK_GT(opts_.period.count(), 0);
+  CHECK_GT(opts_.max_migrations_per_period, 0u);
+}
+
+ConnectionRebalancer::~ConnectionRebalancer() {
+  CHECK(!fiber_.IsJoinable()) << "Stop must be called before destruction";
+}
+
+void ConnectionRebalancer::Start() {
+  CHECK(!fiber_.IsJoinable());
+  done_.Reset();
+  prev_run_stats_ = fb2::FiberRunStatsEnabled();
+  fb2::EnableFiberRunStats(true);
+  fiber_ = pool_->at(0)->LaunchFiber("ConnRebalancer", [this] { Run(); });
+}
+
+void ConnectionRebalancer::Stop() {
+  if (!fiber_.IsJoinable())
+    return;
+  done_.Notify();
+  fiber_.Join();
+  fb2::EnableFiberRunStats(prev_run_stats_);
+}
+
+void ConnectionRebalancer::Run() {
+  while (!done_.WaitFor(opts_.period)) {
+    ++stats_.periods;
+    if (Sample())
+      Rebalance();
+  }
+}
+
+bool ConnectionRebalancer::Sample() {
+  bool has_prev = !samples_.empty();
+  samples_.resize(pool_->size());
+
+  pool_->AwaitFiberOnAll([this](unsigned index, ProactorBase* pb) {
+    const ProactorBase::Stats& st = pb->stats();
+    ProactorSample& sample = samples_[index];
+    uint64_t wall_usec = ProactorBase::GetMonotonicTimeNs() / 1000;
+    uint64_t idle_usec = st.sleep_usec + st.spin_usec;
+
+    if (sample.wall_usec && wall_usec > sample.wall_usec) {
+      double idle_share = double(idle_usec - sample.idle_usec) / (wall_usec - sample.wall_usec);
+      sample.load = 1.0 - min(1.0, idle_share);
+    }
+    sample.wall_usec = wall_usec;
+    sample.idle_usec = idle_usec;
+
+    listener_->TraverseConnectionsOnThread([](unsigned, Connection* conn) {
+      uint64_t cycles = conn->run_cycles();
+      conn->period_cycles_ = cycles - conn->sampled_cycles_;
+      conn->sampled_cycles_ = cycles;
+    });
+  });
+
+  return has_prev;
+}
+
+void ConnectionRebalancer::Rebalance() {
+  // The connections do not move to the parked proactors, see ProactorPool::SetActiveSize.
+  unsigned src = 0, dest = 0;
+  for (unsigned i = 1; i < samples_.size(); ++i) {
+    if (samples_[i].load > samples_[src].load)
+      src = i;
+    if (samples_[i].load < samples_[dest].load && pool_->IsActive(i))
+      dest = i;
+  }
+
+  double gap = samples_[src].load - samples_[dest].load;
+  if (samples_[src].load < opts_.high_load || gap < opts_.min_load_gap) {
+    streak_ = 0;
+    return;
+  }
+
+  if (src != overloaded_src_) {
+    overloaded_src_ = src;
+    streak_ = 0;
+  }
+
+  if (++streak_ < opts_.hysteresis_periods)
+    return;
+  streak_ = 0;
+
+  VLOG(1) << "Proactor " << src << " is overloaded: " << samples_[src].load << " vs "
+          << samples_[dest].load << " of " << dest;
+
+  // A connection that takes more than half of the gap would just swap the roles of the
+  // proactors upon migration.
+  const double max_cycles = gap / 2 * opts_.period.count() * fb2::detail::g_tsc_cycles_per_ms;
+  const uint64_t period = stats_.periods;
+  ProactorBase* dest_pb = pool_->at(dest);
+
+  unsigned requested = pool_->at(src)->Await([&] {
+    vector<Connection*> candidates;
+    listener_->TraverseConnectionsOnThread([&](unsigned, Connection* conn) {
+      bool cooldown =
+          conn->migrated_period_ && period < conn->migrated_period_ + opts_.cooldown_periods;
+      if (conn->migration_dest_ || cooldown || conn->period_cycles_ == 0 ||
+          conn->period_cycles_ > max_cycles) {
+        return;
+      }
+      candidates.push_back(conn);
+    });
+
+    // The traversal does not preempt, hence the candidates are still alive.
+    size_t num = min<size_t>(candidates.size(), opts_.max_migrations_per_period);
+    partial_sort(candidates.begin(), candidates.begin() + num, candidates.end(),
+                 [](const Connection* l, const Connection* r) {
+                   return l->period_cycles_ > r->period_cycles_;
+                 });
+    for (size_t i = 0; i < num; ++i) {
+      candidates[i]->RequestMigration(dest_pb);
+      candidates[i]->migrated_period_ = period;
+    }
+    return unsigned(num);
+  });
+
+  VLOG(1) << "Requested " << requested << " migrations from " << src << " to " << dest;
+  stats_.migrations_requested += requested;
+}
+
+}  // namespace util
@@ -1,8 +1,8 @@
-// Copyright 2023, Roman Gershman.  All rights reserved.
+// Copyright 2024, Roman Gershman.  All rights reserved.
 // See LICENSE for licensing terms.
 //
 
-#include "util/fibers/detail/utils.h"
+#include "util/fibers/cycle_clock.h"
 
 #include <time.h>
 
@@ -11,7 +11,6 @@
 namespace util {
 namespace fb2 {
 
-namespace detail {
 namespace {
 
 #if defined(__x86_64__)
@@ -22,11 +21,11 @@ inline uint64_t clock_nanos() {
   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-constexpr uint64_t kDelayNs = 1000000; // 1ms
+constexpr uint64_t kDelayNs = 1000000;  // 1ms
 
 // Returns the number of cycles per millisecond.
 uint64_t do_sample() {
-  asm volatile ("" : : : "memory");   // compiler fence to prevent reordering
+  asm volatile("" : : : "memory");  // compiler fence to prevent reordering
   uint64_t start = clock_nanos();
   uint64_t tscbefore = CycleClock::Now();
   uint64_t now;
@@ -39,7 +38,7 @@ uint64_t do_sample() {
 }
 
 // Returns the number of cycles per microsecond.
-static uint64_t tsc_from_cal() {
+uint64_t tsc_from_cal() {
   constexpr unsigned kSamples = 74;
   uint64_t samples[kSamples];
 
@@ -58,9 +57,8 @@ static uint64_t tsc_from_cal() {
   return (avg + 500) / 1000;
 }
 #endif
-}  // namespace
 
-uint64_t CycleClock::FrequencyUsec() {
+uint64_t FrequencyUsecInternal() {
   uint64_t res;
 #if defined(__x86_64__)
   res = tsc_from_cal();
@@ -71,6 +69,19 @@ uint64_t CycleClock::FrequencyUsec() {
   return res;
 }
 
-}  // namespace detail
+}  // namespace
+
+auto CycleClock::GlobalParams() -> Params {
+  static const Params params = [] {
+    Params res;
+    res.freq_usec = FrequencyUsecInternal();
+    CHECK_GT(res.freq_usec, 0u);
+    res.nsec_mult = (uint64_t(1000) << kMultShift) / res.freq_usec;
+    VLOG(1) << "Cycle clock frequency: " << res.freq_usec << "/usec";
+    return res;
+  }();
+  return params;
+}
+
 }  // namespace fb2
-}  // namespace util
\ No newline at end of file
+}  // namespace util
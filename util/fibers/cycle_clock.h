@@ -0,0 +1,90 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstdint>
+
+namespace util {
+namespace fb2 {
+
+// Reads the cycle counter of the CPU, i.e. TSC on x86-64 and the virtual counter on aarch64,
+// which costs a few nanoseconds as opposed to a clock_gettime call. The counters are assumed
+// to be invariant and synchronized between the cores, so the values of different threads
+// can be compared. Unlike ProactorBase::GetMonotonicTimeNs, which is updated once per loop
+// iteration, the clock is precise enough to time individual I/O operations.
+class CycleClock {
+ public:
+  static uint64_t Now() {
+#if defined(__x86_64__)
+    uint64_t low, high;
+    __asm__ volatile("rdtsc" : "=a"(low), "=d"(high));
+    return (high << 32) | low;
+#elif defined(__aarch64__)
+    uint64_t val;
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(val));
+    return val;
+#else
+#error "Unsupported architecture"
+#endif
+  }
+
+  // Number of cycles per microsecond. Calibrated upon the first call, which takes ~75ms on
+  // x86-64, where the frequency of the TSC is not exposed to the user space.
+  static uint64_t FrequencyUsec() {
+    return Calibration().freq_usec;
+  }
+
+  static uint64_t ToNsec(uint64_t cycles) {
+    // Fixed point multiplication, does not divide on the hot path.
+    return (static_cast<unsigned __int128>(cycles) * Calibration().nsec_mult) >> kMultShift;
+  }
+
+  static uint64_t ToUsec(uint64_t cycles) {
+    return ToNsec(cycles) / 1000;
+  }
+
+  // Elapsed nanoseconds since start, which was returned by Now(). Returns 0 if the counter
+  // went backwards, e.g. after the machine was suspended.
+  static uint64_t NsecSince(uint64_t start) {
+    uint64_t now = Now();
+    return now > start ? ToNsec(now - start) : 0;
+  }
+
+ private:
+  static constexpr unsigned kMultShift = 32;
+
+  struct Params {
+    uint64_t freq_usec;
+    uint64_t nsec_mult;  // nanoseconds per cycle scaled by 2^kMultShift.
+  };
+
+  static const Params& Calibration() {
+    // Each thread caches the parameters, so that the conversion neither checks the guard of
+    // the global static nor shares its cache line with the writes of other threads.
+    static thread_local const Params params = GlobalParams();
+    return params;
+  }
+
+  static Params GlobalParams();
+};
+
+// Distribution of durations in cycles with power-of-2 buckets, so that recording a duration
+// costs a couple of instructions. Bucket i counts the durations in [2^(i-1), 2^i), the last
+// bucket counts the longer ones too. Not thread-safe, each thread records into its own.
+struct CycleHistogram {
+  static constexpr unsigned kNumBuckets = 48;
+
+  uint64_t buckets[kNumBuckets] = {};
+  uint64_t sum = 0;  // in cycles.
+
+  void Add(uint64_t cycles) {
+    unsigned index = cycles ? 64 - __builtin_clzll(cycles) : 0;
+    ++buckets[index < kNumBuckets ? index : kNumBuckets - 1];
+    sum += cycles;
+  }
+};
+
+}  // namespace fb2
+}  // namespace util
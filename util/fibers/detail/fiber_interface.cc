@@ -3,13 +3,17 @@
 //
 #include "util/fibers/detail/fiber_interface.h"
 
+#include <absl/container/flat_hash_set.h>
 #include <absl/time/clock.h>
 
 #include <mutex>  // for g_scheduler_lock
 
 #include "base/logging.h"
+#include "base/pmr/arena.h"
 #include "util/fibers/detail/scheduler.h"
 #include "util/fibers/detail/utils.h"
+#include "util/fibers/event_log.h"
+#include "util/fibers/fibers.h"
 
 namespace util {
 namespace fb2 {
@@ -41,10 +45,41 @@ class MainFiberImpl final : public FiberInterface {
 mutex g_scheduler_lock;
 
 TL_FiberInitializer* g_fiber_thread_list = nullptr;
-uint64_t g_tsc_cycles_per_ms = 0;
+
+void (*local_dtors[kMaxFiberLocals])(void*) = {};
+atomic_uint32_t next_local_slot{0};
+
+// The interned fiber names. Leaked on purpose, since fibers may outlive static destructors.
+struct FiberNames {
+  mutex mu;
+  absl::flat_hash_set<string_view> names;
+};
+
+FiberNames* fiber_names = new FiberNames;
+
+// The names that the thread has already interned, so that it does not lock fiber_names->mu.
+thread_local absl::flat_hash_set<string_view> tl_fiber_names;
+
+// The free stacks of RecyclingStackAllocator.
+struct StackFreeList {
+  vector<void*> stacks;
+
+  ~StackFreeList() {
+    for (void* stack : stacks)
+      free(stack);
+  }
+};
+
+thread_local StackFreeList tl_stack_free_list;
+
+atomic_bool run_next_enabled{false};
 
 }  // namespace
 
+std::atomic_bool fiber_run_stats_enabled{false};
+std::atomic_bool stack_painting_enabled{false};
+std::atomic_uint32_t time_slice_usec[2] = {1000, 200};
+uint64_t g_tsc_cycles_per_ms = 0;
 PMR_NS::memory_resource* default_stack_resource = nullptr;
 size_t default_stack_size = 64 * 1024;
 
@@ -60,11 +95,13 @@ struct TL_FiberInitializer {
   Scheduler* sched;
   uint64_t epoch = 0;
   uint64_t switch_delay_cycles = 0;  // switch delay in cycles.
+  CycleHistogram ready_delay;        // of the worker fibers.
 
   // Tracks fiber runtimes that took longer than 1ms.
   uint64_t long_runtime_cnt = 0;
   uint64_t long_runtime_usec = 0;
 
+  uint64_t auto_yield_cnt = 0;  // yields by MaybeYield.
   uint32_t atomic_section = 0;
 
   TL_FiberInitializer(const TL_FiberInitializer&) = delete;
@@ -122,19 +159,44 @@ FiberInterface* FiberActive() noexcept {
   return FbInitializer().active;
 }
 
+const char* InternFiberName(string_view nm) {
+  if (nm.empty())
+    return "";
+
+  nm = nm.substr(0, kMaxFiberNameLen);
+  auto it = tl_fiber_names.find(nm);
+  if (it != tl_fiber_names.end())
+    return it->data();
+
+  string_view res;
+  {
+    lock_guard lk(fiber_names->mu);
+    auto it = fiber_names->names.find(nm);
+    if (it != fiber_names->names.end()) {
+      res = *it;
+    } else if (fiber_names->names.size() >= kMaxFiberNames) {
+      return "other";
+    } else {
+      char* copy = new char[nm.size() + 1];
+      memcpy(copy, nm.data(), nm.size());
+      copy[nm.size()] = 0;
+      res = string_view{copy, nm.size()};
+      fiber_names->names.insert(res);
+    }
+  }
+  tl_fiber_names.insert(res);
+  return res.data();
+}
+
 FiberInterface::FiberInterface(Type type, uint32_t cnt, string_view nm)
-    : use_count_(cnt), type_(type) {
+    : use_count_(cnt), type_(type), name_(InternFiberName(nm)) {
   remote_next_.store((FiberInterface*)kRemoteFree, memory_order_relaxed);
-  size_t len = std::min(nm.size(), sizeof(name_) - 1);
-  name_[len] = 0;
-  if (len) {
-    memcpy(name_, nm.data(), len);
-  }
   cpu_tsc_ = CycleClock::Now();
 }
 
 FiberInterface::~FiberInterface() {
   DVLOG(2) << "Destroying " << name_;
+  ReleaseLocals();
   DCHECK_EQ(use_count_.load(), 0u);
   DCHECK(join_q_.empty());
   DCHECK(!list_hook.is_linked());
@@ -143,9 +205,58 @@ FiberInterface::~FiberInterface() {
 void FiberInterface::SetName(std::string_view nm) {
   if (nm.empty())
     return;
-  size_t len = std::min(nm.size(), sizeof(name_) - 1);
-  memcpy(name_, nm.data(), len);
-  name_[len] = 0;
+  name_ = InternFiberName(nm);
+}
+
+unsigned AllocateFiberLocalSlot(void (*dtor)(void*)) {
+  unsigned slot = next_local_slot.fetch_add(1, memory_order_relaxed);
+  CHECK_LT(slot, kMaxFiberLocals) << "Too many FiberLocal instances";
+  local_dtors[slot] = dtor;
+  return slot;
+}
+
+constexpr uint8_t kStackPaintByte = 0xA5;
+constexpr uint64_t kStackPaintWord = 0xA5A5A5A5A5A5A5A5ULL;
+
+void FiberInterface::PaintStack(const ctx::preallocated& palloc) {
+  size_t reserved = palloc.sctx.size - palloc.size;
+  if (reserved == 0 || reserved > UINT16_MAX)
+    return;
+
+  // The control block is placed at palloc.sp, the usable stack is right below it.
+  memset(static_cast<char*>(palloc.sp) - palloc.size, kStackPaintByte, palloc.size);
+  stack_reserved_ = reserved;
+}
+
+size_t FiberInterface::StackHighWatermark() const {
+  if (stack_reserved_ == 0)
+    return 0;
+
+  const char* top = reinterpret_cast<const char*>(this);
+  const uint64_t* bottom = reinterpret_cast<const uint64_t*>(top - (stack_size_ - stack_reserved_));
+  const uint64_t* end = reinterpret_cast<const uint64_t*>(top);
+  const uint64_t* ptr = bottom;
+  while (ptr < end && *ptr == kStackPaintWord)
+    ++ptr;
+  return top - reinterpret_cast<const char*>(ptr);
+}
+
+base::PmrArena* FiberInterface::arena() {
+  if (!arena_)
+    arena_ = new base::PmrArena;
+  return arena_;
+}
+
+void FiberInterface::ReleaseLocals() {
+  for (unsigned i = 0; i < kMaxFiberLocals; ++i) {
+    if (void* val = locals_[i]) {
+      locals_[i] = nullptr;
+      local_dtors[i](val);
+    }
+  }
+
+  delete arena_;
+  arena_ = nullptr;
 }
 
 // We can not destroy this instance within the context of the fiber it's been running in.
@@ -157,6 +268,9 @@ ctx::fiber_context FiberInterface::Terminate() {
   DCHECK(this == FiberActive());
   DCHECK(!list_hook.is_linked());
 
+  // The destructors of the fiber-local values run in the context of the fiber.
+  ReleaseLocals();
+
   scheduler_->ScheduleTermination(this);
   DVLOG(2) << "Terminating " << name_;
 
@@ -182,6 +296,7 @@ ctx::fiber_context FiberInterface::Terminate() {
 void FiberInterface::Start(Launch launch) {
   auto& fb_init = detail::FbInitializer();
   fb_init.sched->Attach(this);
+  trace_ctx_ = fb_init.active->trace_ctx_;
 
   switch (launch) {
     case Launch::post:
@@ -230,10 +345,26 @@ void FiberInterface::Join() {
 }
 
 void FiberInterface::Yield() {
+  DispatchPolicy* policy = scheduler_->policy();
+  if (migratable_ && policy && policy->ShareYielded(this))
+    return;
+
   scheduler_->AddReady(this);
   scheduler_->Preempt();
 }
 
+bool FiberInterface::YieldExpired() {
+  auto& fb_initializer = FbInitializer();
+  if (type_ == DISPATCH || fb_initializer.atomic_section)
+    return false;
+
+  ++fb_initializer.auto_yield_cnt;
+  if (fiber_run_stats_enabled.load(std::memory_order_relaxed))
+    ++run_stats_.auto_yields;
+  Yield();
+  return true;
+}
+
 void FiberInterface::ActivateOther(FiberInterface* other) {
   DCHECK(other->scheduler_);
 
@@ -243,8 +374,16 @@ void FiberInterface::ActivateOther(FiberInterface* other) {
 
     // In case `other` times out on wait, it could be added to the ready queue already by
     // ProcessSleep.
-    if (!other->list_hook.is_linked())
-      scheduler_->AddReady(other);
+    if (!other->list_hook.is_linked()) {
+      // Only a worker that wakes a peer hands off to it, the wakeups by the dispatcher
+      // (i.e. I/O completions) keep their FIFO order.
+      if (type_ == WORKER && other->type_ == WORKER && other->priority_ == FiberPriority::NORMAL &&
+          run_next_enabled.load(memory_order_relaxed)) {
+        scheduler_->AddReadyNext(other);
+      } else {
+        scheduler_->AddReady(other);
+      }
+    }
   } else {
     // The fiber belongs to another thread. We need to schedule it on that thread.
     // Note, that in this case it is assumed that ActivateOther was called by WaitQueue
@@ -254,6 +393,14 @@ void FiberInterface::ActivateOther(FiberInterface* other) {
   }
 }
 
+void FiberInterface::SetPriority(FiberPriority prio) {
+  DCHECK(type_ != DISPATCH);
+  if (scheduler_)
+    scheduler_->SetPriority(this, prio);
+  else
+    priority_ = prio;
+}
+
 void FiberInterface::DetachScheduler() {
   scheduler_->DetachWorker(this);
   scheduler_ = nullptr;
@@ -344,18 +491,28 @@ FiberInterface* FiberInterface::SwitchSetup() {
     ++fb_initializer.epoch;
     DCHECK_GE(tsc, prev->cpu_tsc_);
     fb_initializer.switch_delay_cycles += (tsc - cpu_tsc_);
+    if (type_ == WORKER)
+      fb_initializer.ready_delay.Add(tsc - cpu_tsc_);
 
     // prev tsc points to the fiber that was active before this call.
     uint64_t delta_cycles = tsc - prev->cpu_tsc_;
     if (delta_cycles > g_tsc_cycles_per_ms) {
       fb_initializer.long_runtime_cnt++;
 
-      // improve precision, instead of "delta_cycles / (g_tsc_cycles_per_ms / 1000)"
-      fb_initializer.long_runtime_usec += (delta_cycles * 1000) / g_tsc_cycles_per_ms;
+      fb_initializer.long_runtime_usec += CycleClock::ToUsec(delta_cycles);
+    }
+
+    if (fiber_run_stats_enabled.load(std::memory_order_relaxed)) {
+      if (tsc > prev->run_start_tsc_)
+        prev->run_stats_.run_cycles += tsc - prev->run_start_tsc_;
+      run_stats_.ready_cycles += tsc - cpu_tsc_;
+      ++run_stats_.switches;
     }
   }
 
   cpu_tsc_ = tsc;
+  run_start_tsc_ = tsc;
+  LogEvent(EventType::kFiberSwitch, reinterpret_cast<uintptr_t>(this), 0, name_);
   return prev;
 }
 
@@ -385,6 +542,63 @@ void ExecuteOnAllFiberStacks(FiberInterface::PrintFn fn) {
 
 }  // namespace detail
 
+auto RecyclingStackAllocator::allocate() -> stack_context {
+  mr_ = detail::default_stack_resource;
+  if (mr_)
+    return FixedStackAllocator(mr_, detail::default_stack_size).allocate();
+
+  size_t size = boost::context::stack_traits::default_size();
+  vector<void*>& stacks = detail::tl_stack_free_list.stacks;
+  void* vp;
+  if (stacks.empty()) {
+    vp = malloc(size);
+    if (!vp)
+      throw bad_alloc();
+  } else {
+    vp = stacks.back();
+    stacks.pop_back();
+  }
+
+  stack_context sctx;
+  sctx.size = size;
+  sctx.sp = static_cast<char*>(vp) + size;
+  return sctx;
+}
+
+void RecyclingStackAllocator::deallocate(stack_context& sctx) BOOST_NOEXCEPT_OR_NOTHROW {
+  if (mr_) {
+    FixedStackAllocator(mr_, detail::default_stack_size).deallocate(sctx);
+    return;
+  }
+
+  void* vp = static_cast<char*>(sctx.sp) - sctx.size;
+  vector<void*>& stacks = detail::tl_stack_free_list.stacks;
+  if (stacks.size() < kMaxCached) {
+    stacks.push_back(vp);
+  } else {
+    free(vp);
+  }
+}
+
+unsigned RecyclingStackAllocator::Prefill(unsigned count) {
+  if (detail::default_stack_resource)
+    return 0;
+
+  size_t size = boost::context::stack_traits::default_size();
+  vector<void*>& stacks = detail::tl_stack_free_list.stacks;
+  count = min(count, kMaxCached);
+  while (stacks.size() < count) {
+    void* vp = malloc(size);
+    if (!vp)
+      break;
+    // Writes a byte per page. malloc + memset may be folded into calloc, which does not fault.
+    for (size_t offs = 0; offs < size; offs += 4096)
+      static_cast<volatile char*>(vp)[offs] = 0;
+    stacks.push_back(vp);
+  }
+  return stacks.size();
+}
+
 void SetCustomDispatcher(DispatchPolicy* policy) {
   detail::TL_FiberInitializer& fb_init = detail::FbInitializer();
   fb_init.sched->AttachCustomPolicy(policy);
@@ -395,8 +609,12 @@ uint64_t FiberSwitchEpoch() noexcept {
 }
 
 uint64_t FiberSwitchDelayUsec() noexcept {
-  // in nanoseconds, so lets convert from cycles
-  return detail::FbInitializer().switch_delay_cycles * 1000 / detail::g_tsc_cycles_per_ms;
+  // Unlike "cycles * 1000 / g_tsc_cycles_per_ms", does not overflow on long running threads.
+  return CycleClock::ToUsec(detail::FbInitializer().switch_delay_cycles);
+}
+
+const CycleHistogram& FiberReadyDelayHistogram() noexcept {
+  return detail::FbInitializer().ready_delay;
 }
 
 uint64_t FiberLongRunCnt() noexcept {
@@ -407,6 +625,72 @@ uint64_t FiberLongRunSumUsec() noexcept {
   return detail::FbInitializer().long_runtime_usec;
 }
 
+uint64_t FiberAutoYieldCnt() noexcept {
+  return detail::FbInitializer().auto_yield_cnt;
+}
+
+void SetFiberTimeSlice(FiberPriority prio, std::chrono::microseconds slice) {
+  detail::time_slice_usec[unsigned(prio)].store(slice.count(), std::memory_order_relaxed);
+}
+
+std::chrono::microseconds GetFiberTimeSlice(FiberPriority prio) {
+  return std::chrono::microseconds(
+      detail::time_slice_usec[unsigned(prio)].load(std::memory_order_relaxed));
+}
+
+void EnableFiberRunStats(bool enable) {
+  detail::fiber_run_stats_enabled.store(enable, std::memory_order_relaxed);
+}
+
+bool FiberRunStatsEnabled() {
+  return detail::fiber_run_stats_enabled.load(std::memory_order_relaxed);
+}
+
+void EnableStackPainting(bool enable) {
+  detail::stack_painting_enabled.store(enable, std::memory_order_relaxed);
+}
+
+bool StackPaintingEnabled() {
+  return detail::stack_painting_enabled.load(std::memory_order_relaxed);
+}
+
+FiberStackStatsMap GetFiberStackStats() {
+  FiberStackStatsMap res;
+  detail::FbInitializer().sched->AggregateStackStats(
+      [&](string_view name, const detail::Scheduler::StackStats& ss) {
+        FiberStackStats& dest = res[name];
+        dest.num_fibers += ss.num_fibers;
+        dest.max_used = std::max(dest.max_used, ss.max_used);
+        dest.sum_used += ss.sum_used;
+        dest.stack_size = std::max(dest.stack_size, ss.stack_size);
+      });
+  return res;
+}
+
+FiberTypeStatsMap GetFiberTypeStats() {
+  FiberTypeStatsMap res;
+  auto to_usec = [](uint64_t cycles) { return CycleClock::ToUsec(cycles); };
+
+  detail::FbInitializer().sched->AggregateRunStats([&](string_view name, uint64_t num_fibers,
+                                                       const detail::FiberRunStats& rs) {
+    FiberTypeStats& dest = res[name];
+    dest.num_fibers += num_fibers;
+    dest.run_usec += to_usec(rs.run_cycles);
+    dest.switches += rs.switches;
+    dest.ready_usec += to_usec(rs.ready_cycles);
+    dest.auto_yields += rs.auto_yields;
+  });
+  return res;
+}
+
+void EnableRunNext(bool enable) {
+  detail::run_next_enabled.store(enable, std::memory_order_relaxed);
+}
+
+bool RunNextEnabled() {
+  return detail::run_next_enabled.load(std::memory_order_relaxed);
+}
+
 size_t WorkerFibersStackSize() {
   return detail::FbInitializer().sched->worker_stack_size();
 }
@@ -415,5 +699,9 @@ size_t WorkerFibersCount() {
   return detail::FbInitializer().sched->num_worker_fibers();
 }
 
+size_t ReadyFibersCount() {
+  return detail::FbInitializer().sched->ReadyCount();
+}
+
 }  // namespace fb2
 }  // namespace util
@@ -12,8 +12,13 @@
 
 #include "base/mpsc_intrusive_queue.h"
 #include "base/pmr/memory_resource.h"
+#include "util/fibers/cycle_clock.h"
 #include "util/fibers/detail/wait_queue.h"
 
+namespace base {
+class PmrArena;
+}  // namespace base
+
 namespace util {
 namespace fb2 {
 
@@ -22,6 +27,25 @@ enum class Launch {
   post       // enqueue the fiber for activation but continue with the current fiber.
 };
 
+// Scheduling class of a fiber. Ready NORMAL fibers run before the BACKGROUND ones, unless the
+// oldest ready BACKGROUND fiber has been waiting for longer than Scheduler::kBackgroundMaxDelayMs.
+// Suitable for snapshotting, compaction and similar work that should not compete with
+// serving fibers.
+enum class FiberPriority : uint8_t { NORMAL, BACKGROUND };
+
+// Identifies the request that a fiber works on and the span it is in, see trace.h.
+// Fibers inherit the context of the fiber that starts them and the proactor and
+// FiberQueueThreadPool hops carry it to the functions they run.
+struct TraceContext {
+  uint64_t trace_id = 0;  // 0 if there is no trace.
+  uint64_t span_id = 0;   // the current span, 0 for the root.
+  bool sampled = false;   // whether the spans of the trace are recorded.
+
+  explicit operator bool() const {
+    return trace_id != 0;
+  }
+};
+
 // based on boost::context::fixedsize_stack but uses pmr::memory_resource for allocation.
 class FixedStackAllocator {
  public:
@@ -49,6 +73,29 @@ class FixedStackAllocator {
   std::size_t size_;
 };
 
+// Stack allocator for short-lived fibers, e.g. the fibers of ProactorBase::Dispatch. Every
+// thread keeps up to kMaxCached stacks of the terminated fibers and hands them out again.
+// Since the control block of a fiber is placed at the top of its stack, both are recycled
+// together and launching a fiber neither allocates nor faults pages in.
+// Uses the default stack resource instead, if one is set, see SetDefaultStackResource().
+class RecyclingStackAllocator {
+ public:
+  using stack_context = boost::context::stack_context;
+
+  static constexpr unsigned kMaxCached = 64;
+
+  stack_context allocate();
+  void deallocate(stack_context& sctx) BOOST_NOEXCEPT_OR_NOTHROW;
+
+  // Fills the cache of the calling thread with up to count stacks whose pages are faulted in,
+  // so that the first fibers do not fault either. Does nothing if a default stack resource is
+  // set. Returns the number of cached stacks.
+  static unsigned Prefill(unsigned count = kMaxCached);
+
+ private:
+  PMR_NS::memory_resource* mr_ = nullptr;  // the default stack resource upon allocate().
+};
+
 namespace detail {
 
 using FI_ListHook =
@@ -57,10 +104,56 @@ using FI_ListHook =
 using FI_SleepHook =
     boost::intrusive::set_member_hook<boost::intrusive::link_mode<boost::intrusive::safe_link>>;
 
+using FI_WheelHook =
+    boost::intrusive::list_member_hook<boost::intrusive::link_mode<boost::intrusive::auto_unlink>>;
+
 class Scheduler;
 
+// Per-fiber runtime statistics in cycles. Updated only when fiber run stats are enabled,
+// see EnableFiberRunStats().
+struct FiberRunStats {
+  uint64_t run_cycles = 0;    // cumulative time the fiber was running.
+  uint64_t switches = 0;      // number of times the fiber was switched to.
+  uint64_t ready_cycles = 0;  // cumulative time the fiber spent in the ready queue.
+  uint64_t auto_yields = 0;   // number of yields by ThisFiber::MaybeYield().
+
+  FiberRunStats& operator+=(const FiberRunStats& o) {
+    run_cycles += o.run_cycles;
+    switches += o.switches;
+    ready_cycles += o.ready_cycles;
+    auto_yields += o.auto_yields;
+    return *this;
+  }
+};
+
+extern std::atomic_bool fiber_run_stats_enabled;
+extern std::atomic_bool stack_painting_enabled;
+
+// Time slices in microseconds indexed by FiberPriority, see SetFiberTimeSlice().
+extern std::atomic_uint32_t time_slice_usec[2];
+
+// TSC frequency, set when the first fiber thread is initialized.
+extern uint64_t g_tsc_cycles_per_ms;
+
+// Maximal number of FiberLocal instances in the process.
+constexpr unsigned kMaxFiberLocals = 8;
+
+// Reserves a fiber-local slot. dtor destroys the non-null values of the slot when their
+// fibers terminate.
+unsigned AllocateFiberLocalSlot(void (*dtor)(void*));
+
+constexpr size_t kMaxFiberNameLen = 63;
+constexpr size_t kMaxFiberNames = 1 << 14;
+
+// Returns a null-terminated copy of nm, truncated to kMaxFiberNameLen, that lives as long as
+// the process. Equal names share the copy, hence fibers point to their names instead of
+// storing them. The copies are never freed, so the names should have a low cardinality:
+// once kMaxFiberNames names were interned, the new ones are replaced by "other".
+const char* InternFiberName(std::string_view nm);
+
 class FiberInterface {
   friend class Scheduler;
+  friend class TimerWheel;
 
   static constexpr uint64_t kRemoteFree = 1;
 
@@ -84,7 +177,23 @@ class FiberInterface {
 
   // public hooks for intrusive data structures.
   FI_ListHook list_hook;  // used to add to ready/terminate queues.
+
+ protected:
+  // The fields that are accessed upon every switch share the first cache line with the vtable
+  // pointer, entry_ and list_hook, see SwitchSetup. The fields below them are colder.
+  Scheduler* scheduler_ = nullptr;
+  std::atomic<FiberInterface*> remote_next_{nullptr};
+
+  // A tsc of when this fiber becames ready or becomes active (in cycles).
+  uint64_t cpu_tsc_ = 0;
+  std::atomic<uint32_t> use_count_;  // used for intrusive_ptr refcounting.
+  std::atomic<uint16_t> flags_{0};
+  Type type_;
+  FiberPriority priority_ = FiberPriority::NORMAL;
+
+ public:
   FI_SleepHook sleep_hook;
+  FI_WheelHook wheel_hook;  // used instead of sleep_hook for coarse deadlines.
   FI_ListHook fibers_hook;  // For a list of all fibers in the thread
 
   // init_count is the initial use_count of the fiber.
@@ -111,8 +220,9 @@ class FiberInterface {
 
   void Yield();
 
-  // inline
-  bool WaitUntil(std::chrono::steady_clock::time_point tp);
+  // inline. If coarse is set, tp may be rounded up to the scheduler timer tick, which makes
+  // arming and cancelling the deadline cheaper. Suitable for I/O timeouts.
+  bool WaitUntil(std::chrono::steady_clock::time_point tp, bool coarse = false);
 
   // Schedules another fiber without switching to it.
   // other can belong to another thread.
@@ -198,6 +308,9 @@ class FiberInterface {
 
   void PullMyselfFromRemoteReadyQueue();
 
+  // The slow path of MaybeYield.
+  bool YieldExpired();
+
   bool IsScheduledRemotely() const {
     return uint64_t(remote_next_.load(std::memory_order_relaxed)) != kRemoteFree;
   }
@@ -206,6 +319,69 @@ class FiberInterface {
     return stack_size_;
   }
 
+  // Fills the stack below the control block with a pattern, see EnableStackPainting().
+  void PaintStack(const boost::context::preallocated& palloc);
+
+  // Returns the number of bytes of the painted stack that have been used so far, 0 if the
+  // stack is not painted. Linear in the unused part of the stack.
+  size_t StackHighWatermark() const;
+
+  // Migratable fibers may be moved to another thread when they yield, see
+  // DispatchPolicy::ShareYielded.
+  void SetMigratable(bool migratable) {
+    migratable_ = migratable;
+  }
+
+  bool IsMigratable() const {
+    return migratable_;
+  }
+
+  // Must be called from the thread of the fiber. Moves the fiber to the ready queue of its new
+  // class if it's ready. The dispatcher fiber always has NORMAL priority.
+  void SetPriority(FiberPriority prio);
+
+  FiberPriority priority() const {
+    return priority_;
+  }
+
+  const FiberRunStats& run_stats() const {
+    return run_stats_;
+  }
+
+  // Whether the fiber has been running for longer than the time slice of its priority
+  // since it was switched to.
+  bool TimeSliceExpired() const {
+    uint64_t slice = time_slice_usec[unsigned(priority_)].load(std::memory_order_relaxed);
+    return CycleClock::Now() - run_start_tsc_ > slice * g_tsc_cycles_per_ms / 1000;
+  }
+
+  // Yields if the time slice expired and the fiber is not in an atomic section.
+  // Returns true if it yielded.
+  bool MaybeYield() {
+    return TimeSliceExpired() && YieldExpired();
+  }
+
+  // Fiber-local storage, see FiberLocal. Must be accessed from the fiber itself.
+  void* GetLocal(unsigned slot) const {
+    return locals_[slot];
+  }
+
+  void SetLocal(unsigned slot, void* val) {
+    locals_[slot] = val;
+  }
+
+  const TraceContext& trace_context() const {
+    return trace_ctx_;
+  }
+
+  void set_trace_context(const TraceContext& ctx) {
+    trace_ctx_ = ctx;
+  }
+
+  // Returns the arena of the fiber, creates it on first access. The arena is released
+  // when the fiber terminates.
+  base::PmrArena* arena();
+
   uint64_t DEBUG_remote_epoch = 0;
 
  protected:
@@ -217,7 +393,8 @@ class FiberInterface {
 
   ::boost::context::fiber_context Terminate();
 
-  std::atomic<uint32_t> use_count_;  // used for intrusive_ptr refcounting.
+  // Destroys the fiber-local values and the arena.
+  void ReleaseLocals();
 
   // trace_ variable - used only for debugging purposes.
   enum TraceState : uint8_t {
@@ -226,24 +403,30 @@ class FiberInterface {
     TRACE_TERMINATE,
     TRACE_READY
   } trace_ = TRACE_NONE;
-  Type type_;
+  bool migratable_ = false;
 
-  std::atomic<uint16_t> flags_{0};
+  // The bytes at the top of the stack above the painted area, 0 if the stack is not painted.
+  uint16_t stack_reserved_ = 0;
+  uint32_t stack_size_ = 0;
+
+  // A tsc of when this fiber became active. Unlike cpu_tsc_ it is not reset when the running
+  // fiber adds itself to the ready queue, i.e. upon Yield().
+  uint64_t run_start_tsc_ = 0;
 
   // FiberInterfaces that join on this fiber to terminate are added here.
   WaitQueue join_q_;
 
-  Scheduler* scheduler_ = nullptr;
-
-  std::atomic<FiberInterface*> remote_next_{nullptr};
-
   // used for sleeping with a timeout. Specifies the time when this fiber should be woken up.
   std::chrono::steady_clock::time_point tp_;
 
-  // A tsc of when this fiber becames ready or becomes active (in cycles).
-  uint64_t cpu_tsc_ = 0;
-  char name_[24];
-  uint32_t stack_size_ = 0;
+  // Interned, hence it is not copied for every fiber, see InternFiberName.
+  const char* name_;
+  FiberRunStats run_stats_;
+
+  void* locals_[kMaxFiberLocals] = {};
+  base::PmrArena* arena_ = nullptr;
+  TraceContext trace_ctx_;
+
  private:
   // Handles all the stats and also updates the involved data structure before actually switching
   // the fiber context. Returns the active fiber before the context switch.
@@ -260,6 +443,8 @@ template <typename Fn, typename... Arg> class WorkerFiberImpl : public FiberInte
       : FiberInterface(WORKER, 1, name), fn_(std::forward<Fn>(fn)),
         arg_(std::forward<Arg>(arg)...) {
     stack_size_ = palloc.sctx.size;
+    if (stack_painting_enabled.load(std::memory_order_relaxed))
+      PaintStack(palloc);
     entry_ = FbCntx(std::allocator_arg, palloc, std::forward<StackAlloc>(salloc),
                     [this](FbCntx&& caller) { return run_(std::move(caller)); });
 #if defined(BOOST_USE_UCONTEXT)
@@ -345,6 +530,9 @@ inline void ActivateSameThread(FiberInterface* active, FiberInterface* other) {
 extern PMR_NS::memory_resource* default_stack_resource;
 extern size_t default_stack_size;
 
+// Returns the stack size set by SetFiberStackSize() for the fibers named name, 0 if none.
+size_t StackSizeOverride(std::string_view name);
+
 }  // namespace detail
 }  // namespace fb2
 }  // namespace util
@@ -9,8 +9,8 @@ namespace util {
 namespace fb2 {
 namespace detail {
 
-inline bool FiberInterface::WaitUntil(std::chrono::steady_clock::time_point tp) {
-  return scheduler_->WaitUntil(tp, this);
+inline bool FiberInterface::WaitUntil(std::chrono::steady_clock::time_point tp, bool coarse) {
+  return scheduler_->WaitUntil(tp, this, coarse);
 }
 
 inline void FiberInterface::Suspend() {
@@ -204,9 +204,7 @@ ctx::fiber_context Scheduler::Preempt() {
   DCHECK(!IsFiberAtomicSection()) << "Preempting inside of atomic section";
   DCHECK(!ready_queue_.empty());  // dispatcher fiber is always in the ready queue.
 
-  DCHECK(!ready_queue_.empty());
-  FiberInterface* fi = &ready_queue_.front();
-  ready_queue_.pop_front();
+  FiberInterface* fi = PopReady();
 
   return fi->SwitchTo();
 }
@@ -216,15 +214,61 @@ void Scheduler::AddReady(FiberInterface* fibi) {
   DVLOG(2) << "Adding " << fibi->name() << " to ready_queue_";
 
   fibi->cpu_tsc_ = CycleClock::Now();
-  ready_queue_.push_back(*fibi);
+  ReadyQueue(fibi->priority_).push_back(*fibi);
   fibi->trace_ = FiberInterface::TRACE_READY;
 
   // Case of notifications coming to a sleeping fiber.
   if (fibi->sleep_hook.is_linked()) {
     sleep_queue_.erase(sleep_queue_.iterator_to(*fibi));
+  } else if (fibi->wheel_hook.is_linked()) {
+    timer_wheel_.Remove(fibi);
   }
 }
 
+void Scheduler::AddReadyNext(FiberInterface* fibi) {
+  DCHECK(fibi->priority_ == FiberPriority::NORMAL);
+  if (run_next_streak_ >= kRunNextMaxStreak) {
+    AddReady(fibi);
+    return;
+  }
+
+  // The previous fiber loses its slot, it is still in the queue since PopReady resets run_next_.
+  if (run_next_) {
+    ready_queue_.erase(FI_Queue::s_iterator_to(*run_next_));
+    ready_queue_.push_back(*run_next_);
+  }
+
+  AddReady(fibi);
+  ready_queue_.erase(FI_Queue::s_iterator_to(*fibi));
+  ready_queue_.push_front(*fibi);
+  run_next_ = fibi;
+}
+
+void Scheduler::SetPriority(FiberInterface* fibi, FiberPriority prio) {
+  DCHECK(fibi->scheduler_ == this);
+  if (fibi->priority_ == prio)
+    return;
+
+  // Terminated fibers are linked into terminate_queue_ via the same hook.
+  bool is_ready = fibi->list_hook.is_linked() &&
+                  (fibi->flags_.load(memory_order_relaxed) & FiberInterface::kTerminatedBit) == 0;
+  if (is_ready) {
+    // Keep cpu_tsc_ so that the fiber preserves its waiting time.
+    ReadyQueue(fibi->priority_).erase(FI_Queue::s_iterator_to(*fibi));
+    ReadyQueue(prio).push_back(*fibi);
+    if (fibi == run_next_)
+      run_next_ = nullptr;
+  }
+  fibi->priority_ = prio;
+}
+
+bool Scheduler::BackgroundStarved() const {
+  DCHECK(!background_queue_.empty());
+  uint64_t now = CycleClock::Now();
+  uint64_t since = background_queue_.front().cpu_tsc_;
+  return now > since && now - since > g_tsc_cycles_per_ms * kBackgroundMaxDelayMs;
+}
+
 // Is called only from ActivateOther.
 void Scheduler::ScheduleFromRemote(FiberInterface* cntx) {
   // This function is called from FiberInterface::ActivateOther from a remote scheduler.
@@ -290,6 +334,46 @@ void Scheduler::ScheduleTermination(FiberInterface* cntx) {
   if (cntx->type() == FiberInterface::WORKER) {
     --num_worker_fibers_;
     worker_stack_size_ -= cntx->stack_size();
+
+    if (fiber_run_stats_enabled.load(memory_order_relaxed)) {
+      // cntx is still running, so account its last time slice here.
+      FiberRunStats rs = cntx->run_stats();
+      uint64_t now = CycleClock::Now();
+      if (now > cntx->run_start_tsc_)
+        rs.run_cycles += now - cntx->run_start_tsc_;
+
+      TerminatedStats& ts = terminated_stats_[cntx->name()];
+      ++ts.num_fibers;
+      ts.run_stats += rs;
+    }
+
+    if (size_t used = cntx->StackHighWatermark(); used > 0) {
+      StackStats& ss = stack_stats_[cntx->name()];
+      ++ss.num_fibers;
+      ss.max_used = std::max<uint64_t>(ss.max_used, used);
+      ss.sum_used += used;
+      ss.stack_size = std::max<uint64_t>(ss.stack_size, cntx->stack_size());
+    }
+  }
+}
+
+void Scheduler::AggregateStackStats(StackStatsCb cb) const {
+  for (const auto& [name, ss] : stack_stats_) {
+    cb(name, ss);
+  }
+}
+
+void Scheduler::AggregateRunStats(RunStatsCb cb) const {
+  for (const auto& [name, ts] : terminated_stats_) {
+    cb(name, ts.num_fibers, ts.run_stats);
+  }
+
+  for (const FiberInterface& fi : fibers_) {
+    // Terminated fibers stay in fibers_ until DestroyTerminated, they are already accounted for.
+    bool terminated = fi.flags_.load(memory_order_relaxed) & FiberInterface::kTerminatedBit;
+    if (fi.type() == FiberInterface::WORKER && !terminated) {
+      cb(fi.name(), 1, fi.run_stats());
+    }
   }
 }
 
@@ -306,15 +390,19 @@ void Scheduler::DestroyTerminated() {
   }
 }
 
-bool Scheduler::WaitUntil(chrono::steady_clock::time_point tp, FiberInterface* me) {
+bool Scheduler::WaitUntil(chrono::steady_clock::time_point tp, FiberInterface* me,
+                          bool coarse) {
   DCHECK(!me->sleep_hook.is_linked());
+  DCHECK(!me->wheel_hook.is_linked());
   DCHECK(!me->list_hook.is_linked());
 
   me->tp_ = tp;
-  sleep_queue_.insert(*me);
+  if (!coarse || !timer_wheel_.Add(me))
+    sleep_queue_.insert(*me);
   auto fc = Preempt();
   DCHECK(!fc);
   DCHECK(!me->sleep_hook.is_linked());
+  DCHECK(!me->wheel_hook.is_linked());
   bool has_timed_out = (me->tp_ == chrono::steady_clock::time_point::max());
 
   return has_timed_out;
@@ -322,38 +410,9 @@ bool Scheduler::WaitUntil(chrono::steady_clock::time_point tp, FiberInterface* m
 
 bool Scheduler::ProcessRemoteReady(FiberInterface* active) {
   bool res = false;
-  unsigned iteration = 0;
   uint64_t epoch = active ? remote_epoch_.load(memory_order_relaxed) : 0;
 
-  while (true) {
-    auto [fi, qempty] = remote_ready_queue_.PopWeak();
-    if (!fi) {
-      if (qempty) {
-        if (active && !res) {
-          // UB state. Try to recover.
-          FiberInterface* next = active->remote_next_.load(std::memory_order_acquire);
-          bool qempty = remote_ready_queue_.Empty();
-          LOG(ERROR) << "Failed to pull active fiber from remote_ready_queue, iteration "
-                     << iteration << " remote_empty: " << qempty << ", current_epoch: " << epoch
-                     << ", push_epoch: " << active->DEBUG_remote_epoch
-                     << ", next:" << (uint64_t)next;
-
-          if (next != (FiberInterface*)FiberInterface::kRemoteFree) {
-            if (iteration < 100) {
-              // Work around the inconsistency by retrying.
-              ++iteration;
-              continue;
-            }
-          }
-        }
-        break;
-      } else {  // qempty == false, retry.
-        ++iteration;
-        VLOG(1) << "Retrying " << iteration;
-        continue;
-      }
-    }
-
+  auto process = [&](FiberInterface* fi) {
     // Marks as free.
     fi->remote_next_.store((FiberInterface*)FiberInterface::kRemoteFree, memory_order_relaxed);
     fi->DEBUG_remote_epoch = 0;
@@ -383,32 +442,55 @@ bool Scheduler::ProcessRemoteReady(FiberInterface* active) {
       DVLOG(2) << "set ready " << fi->name();
       AddReady(fi);
     }
+  };
+
+  for (unsigned iteration = 0;; ++iteration) {
+    remote_ready_queue_.PopAll(process);
+    if (!active || res)
+      break;
+
+    // UB state. Try to recover.
+    FiberInterface* next = active->remote_next_.load(std::memory_order_acquire);
+    bool qempty = remote_ready_queue_.Empty();
+    LOG(ERROR) << "Failed to pull active fiber from remote_ready_queue, iteration " << iteration
+               << " remote_empty: " << qempty << ", current_epoch: " << epoch
+               << ", push_epoch: " << active->DEBUG_remote_epoch << ", next:" << (uint64_t)next;
+
+    // Work around the inconsistency by retrying.
+    if (next == (FiberInterface*)FiberInterface::kRemoteFree || iteration >= 100)
+      break;
   }
 
   return res;
 }
 
 unsigned Scheduler::ProcessSleep() {
-  DCHECK(!sleep_queue_.empty());
+  DCHECK(HasSleepingFibers());
   std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
   DVLOG(3) << "now " << now.time_since_epoch().count();
 
   unsigned result = 0;
-  do {
+  auto wake = [&](FiberInterface* fi) {
+    DCHECK(!fi->list_hook.is_linked());
+    fi->tp_ = chrono::steady_clock::time_point::max();  // meaning it has timed out.
+    fi->cpu_tsc_ = CycleClock::Now();
+    ReadyQueue(fi->priority_).push_back(*fi);
+    fi->trace_ = FiberInterface::TRACE_SLEEP_WAKE;
+    ++result;
+  };
+
+  while (!sleep_queue_.empty()) {
     auto it = sleep_queue_.begin();
     if (it->tp_ > now)
       break;
 
     FiberInterface& fi = *it;
     sleep_queue_.erase(it);
+    wake(&fi);
+  }
 
-    DCHECK(!fi.list_hook.is_linked());
-    fi.tp_ = chrono::steady_clock::time_point::max();  // meaning it has timed out.
-    fi.cpu_tsc_ = CycleClock::Now();
-    ready_queue_.push_back(fi);
-    fi.trace_ = FiberInterface::TRACE_SLEEP_WAKE;
-    ++result;
-  } while (!sleep_queue_.empty());
+  if (!timer_wheel_.empty())
+    timer_wheel_.Expire(now, wake);
 
   return result;
 }
@@ -440,8 +522,9 @@ void Scheduler::SuspendAndExecuteOnDispatcher(std::function<void()> fn) {
 
 void Scheduler::PrintAllFiberStackTraces() {
   auto* active = FiberActive();
-  if (!sleep_queue_.empty()) {
-    LOG(INFO) << "Sleep queue size " << sleep_queue_.size();
+  if (!sleep_queue_.empty() || !timer_wheel_.empty()) {
+    LOG(INFO) << "Sleep queue size " << sleep_queue_.size() << ", timer wheel size "
+              << timer_wheel_.size();
   }
   auto print_fn = [active](FiberInterface* fb) {
     string state = "suspended";
@@ -449,7 +532,7 @@ void Scheduler::PrintAllFiberStackTraces() {
       state = "ready";
     } else if (active == fb) {
       state = "active";
-    } else if (fb->sleep_hook.is_linked()) {
+    } else if (fb->sleep_hook.is_linked() || fb->wheel_hook.is_linked()) {
       state = absl::StrCat("sleeping until ", fb->tp_.time_since_epoch().count(), " now is ",
                            chrono::steady_clock::now().time_since_epoch().count());
     }
@@ -4,11 +4,16 @@
 
 #pragma once
 
+#include <absl/container/flat_hash_map.h>
+#include <absl/functional/function_ref.h>
+
+#include <string>
 #include <vector>
 #include <boost/smart_ptr/intrusive_ptr.hpp>
 #define __FIBERS_SCHEDULER_H__
 #include "util/fibers/detail/fiber_interface.h"
 #undef __FIBERS_SCHEDULER_H__
+#include "util/fibers/detail/timer_wheel.h"
 
 namespace util {
 namespace fb2 {
@@ -28,6 +33,13 @@ class Scheduler {
 
   void AddReady(FiberInterface* fibi);
 
+  // Like AddReady but puts fibi at the head of the ready queue, so that it runs as soon as the
+  // active fiber suspends, with its data still in the cpu caches. Similar to Go's runnext,
+  // a fiber that was added this way and has not run yet is moved to the tail.
+  // To keep a pair of fibers that wake each other from starving the rest, at most
+  // kRunNextMaxStreak fibers in a row run this way, the next ones are added with AddReady.
+  void AddReadyNext(FiberInterface* fibi);
+
   // ScheduleFromRemote is called from a different thread than the one that runs the scheduler.
   // fibi must exist during the run of this function.
   void ScheduleFromRemote(FiberInterface* fibi);
@@ -38,22 +50,44 @@ class Scheduler {
   void ScheduleTermination(FiberInterface* fibi);
 
   bool HasReady() const {
-    return !ready_queue_.empty();
+    return !ready_queue_.empty() || !background_queue_.empty();
+  }
+
+  // Walks the ready queues, meant for sampling.
+  size_t ReadyCount() const {
+    return ready_queue_.size() + background_queue_.size();
   }
 
   ::boost::context::fiber_context Preempt();
 
-  // Returns true if the fiber timed out by reaching tp.
-  bool WaitUntil(std::chrono::steady_clock::time_point tp, FiberInterface* me);
+  // Returns true if the fiber timed out by reaching tp. Coarse deadlines are kept in
+  // the timer wheel, the precise ones and the ones out of the wheel range in sleep_queue_.
+  bool WaitUntil(std::chrono::steady_clock::time_point tp, FiberInterface* me, bool coarse);
 
-  // Assumes HasReady() is true.
+  // Assumes HasReady() is true. Prefers NORMAL fibers over BACKGROUND ones, see FiberPriority.
   FiberInterface* PopReady() {
-    assert(!ready_queue_.empty());
-    FiberInterface* res = &ready_queue_.front();
-    ready_queue_.pop_front();
+    FI_Queue& q = (background_queue_.empty() || (!ready_queue_.empty() && !BackgroundStarved()))
+                      ? ready_queue_
+                      : background_queue_;
+    assert(!q.empty());
+    FiberInterface* res = &q.front();
+    q.pop_front();
+    if (res == run_next_) {
+      run_next_ = nullptr;
+      ++run_next_streak_;
+    } else {
+      run_next_streak_ = 0;
+    }
     return res;
   }
 
+  // How long a ready BACKGROUND fiber may be bypassed by NORMAL fibers.
+  static constexpr unsigned kBackgroundMaxDelayMs = 10;
+
+  static constexpr unsigned kRunNextMaxStreak = 64;
+
+  void SetPriority(FiberInterface* fibi, FiberPriority prio);
+
   FiberInterface* main_context() {
     return main_cntx_;
   }
@@ -67,11 +101,15 @@ class Scheduler {
   }
 
   bool HasSleepingFibers() const {
-    return !sleep_queue_.empty();
+    return !sleep_queue_.empty() || !timer_wheel_.empty();
   }
 
+  // Requires HasSleepingFibers().
   std::chrono::steady_clock::time_point NextSleepPoint() const {
-    return sleep_queue_.begin()->tp_;
+    if (timer_wheel_.empty())
+      return sleep_queue_.begin()->tp_;
+    auto tp = timer_wheel_.NextEvent();
+    return sleep_queue_.empty() ? tp : std::min(tp, sleep_queue_.begin()->tp_);
   }
 
   void DestroyTerminated();
@@ -99,6 +137,25 @@ class Scheduler {
   size_t worker_stack_size() const {
     return worker_stack_size_;
   }
+
+  using RunStatsCb =
+      absl::FunctionRef<void(std::string_view name, uint64_t num_fibers, const FiberRunStats&)>;
+
+  // Calls cb for the live fibers and for each name of the terminated ones.
+  void AggregateRunStats(RunStatsCb cb) const;
+
+  // Stack usage of the terminated fibers with painted stacks.
+  struct StackStats {
+    uint64_t num_fibers = 0;
+    uint64_t max_used = 0, sum_used = 0;
+    uint64_t stack_size = 0;  // the largest stack of the fibers.
+  };
+
+  using StackStatsCb = absl::FunctionRef<void(std::string_view name, const StackStats&)>;
+
+  // Calls cb for each name of the terminated fibers with painted stacks.
+  void AggregateStackStats(StackStatsCb cb) const;
+
  private:
   // We use intrusive::list and not slist because slist has O(N) complexity for some operations
   // which may be time consuming for long lists.
@@ -125,18 +182,42 @@ class Scheduler {
 
   static constexpr size_t kQSize = sizeof(FI_Queue);
 
+  FI_Queue& ReadyQueue(FiberPriority prio) {
+    return prio == FiberPriority::BACKGROUND ? background_queue_ : ready_queue_;
+  }
+
+  // Whether the oldest ready BACKGROUND fiber waited for longer than kBackgroundMaxDelayMs.
+  bool BackgroundStarved() const;
+
   FiberInterface* main_cntx_;
   DispatchPolicy* custom_policy_ = nullptr;
 
   boost::intrusive_ptr<FiberInterface> dispatch_cntx_;
   FI_Queue ready_queue_, terminate_queue_;
+  FI_Queue background_queue_;  // ready BACKGROUND fibers.
   SleepQueue sleep_queue_;
+  TimerWheel timer_wheel_;
   base::MPSCIntrusiveQueue<FiberInterface> remote_ready_queue_;
   std::atomic_uint64_t remote_epoch_{0};
 
+  // The fiber at the head of ready_queue_ that was added by AddReadyNext and has not run yet.
+  FiberInterface* run_next_ = nullptr;
+  unsigned run_next_streak_ = 0;  // consecutive runs of run_next_ fibers.
+
   // A list of all fibers in the thread.
   FI_List fibers_;
 
+  struct TerminatedStats {
+    uint64_t num_fibers = 0;
+    FiberRunStats run_stats;
+  };
+
+  // Run stats of terminated fibers by name, updated while fiber run stats are enabled.
+  absl::flat_hash_map<std::string, TerminatedStats> terminated_stats_;
+
+  // Keyed by the interned names of the fibers, see InternFiberName.
+  absl::flat_hash_map<const char*, StackStats> stack_stats_;
+
   bool shutdown_ = false;
   uint32_t num_worker_fibers_ = 0;
   size_t worker_stack_size_ = 0;
@@ -150,6 +231,13 @@ class DispatchPolicy {
 
   virtual void Run(detail::Scheduler* sched) = 0;
   virtual void Notify() = 0;
+
+  // Called when a migratable fiber yields. The policy may hand fi over to another thread.
+  // In that case it suspends fi and returns true after fi has been resumed, possibly
+  // on another thread. Returns false if fi should yield locally.
+  virtual bool ShareYielded(detail::FiberInterface* fi) {
+    return false;
+  }
 };
 
 void SetCustomDispatcher(DispatchPolicy* policy);
@@ -0,0 +1,147 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/fibers/detail/timer_wheel.h"
+
+#include <absl/numeric/bits.h>
+
+#include "base/logging.h"
+
+namespace util {
+namespace fb2 {
+namespace detail {
+
+using namespace std;
+
+namespace {
+
+constexpr uint64_t kNanosPerTick = 1000000;
+
+// Returns the smallest k in [1, 64] such that the bit (from + k) % 64 of mask is set.
+// Requires mask != 0.
+inline unsigned SlotDistance(uint64_t mask, unsigned from) {
+  unsigned rot = (from + 1) % 64;
+  return absl::countr_zero(absl::rotr(mask, rot)) + 1;
+}
+
+}  // namespace
+
+uint64_t TimerWheel::ToTick(time_point tp) {
+  uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(tp.time_since_epoch()).count();
+  return ns / kNanosPerTick + (ns % kNanosPerTick != 0);
+}
+
+bool TimerWheel::Add(FiberInterface* fi) {
+  DCHECK(!fi->wheel_hook.is_linked());
+
+  if (size_ == 0) {
+    uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(
+                      chrono::steady_clock::now().time_since_epoch())
+                      .count();
+    current_ = ns / kNanosPerTick;
+  }
+
+  uint64_t tick = max(ToTick(fi->tp_), current_ + 1);
+  if (tick - current_ >= (1ULL << (kLevelBits * kLevels)))
+    return false;
+
+  Place(fi, tick);
+  ++size_;
+  return true;
+}
+
+void TimerWheel::Remove(FiberInterface* fi) {
+  DCHECK(fi->wheel_hook.is_linked());
+  DCHECK_GT(size_, 0u);
+
+  fi->wheel_hook.unlink();
+  --size_;
+  if (size_ == 0) {
+    // All the slots are empty now.
+    fill(begin(occupied_), end(occupied_), 0);
+  }
+}
+
+auto TimerWheel::NextEvent() const -> time_point {
+  DCHECK(!empty());
+  return time_point{chrono::nanoseconds(NextEventTick() * kNanosPerTick)};
+}
+
+void TimerWheel::Expire(time_point now, absl::FunctionRef<void(FiberInterface*)> cb) {
+  uint64_t target =
+      chrono::duration_cast<chrono::nanoseconds>(now.time_since_epoch()).count() / kNanosPerTick;
+
+  while (size_ > 0 && current_ < target) {
+    uint64_t next = NextEventTick();
+    if (next > target) {
+      current_ = target;
+      break;
+    }
+    current_ = next;
+
+    // Higher levels first, so that the cascaded entries can cascade further down.
+    for (unsigned level = kLevels - 1; level > 0; --level) {
+      if ((current_ & ((1ULL << (kLevelBits * level)) - 1)) == 0)
+        Cascade(level);
+    }
+
+    unsigned idx = current_ % kSlots;
+    Slot& slot = slots_[0][idx];
+    occupied_[0] &= ~(1ULL << idx);
+    while (!slot.empty()) {
+      FiberInterface* fi = &slot.front();
+      slot.pop_front();
+      --size_;
+      cb(fi);
+    }
+  }
+}
+
+void TimerWheel::Place(FiberInterface* fi, uint64_t tick) {
+  DCHECK_GE(tick, current_);
+
+  uint64_t delta = tick - current_;
+  unsigned level = 0;
+  while (delta >= (1ULL << (kLevelBits * (level + 1))))
+    ++level;
+  DCHECK_LT(level, kLevels);
+
+  unsigned idx = (tick >> (kLevelBits * level)) % kSlots;
+  slots_[level][idx].push_back(*fi);
+  occupied_[level] |= 1ULL << idx;
+}
+
+uint64_t TimerWheel::NextEventTick() const {
+  uint64_t res = UINT64_MAX;
+
+  // For the upper levels the event is the start of the slot, when it cascades.
+  for (unsigned level = 0; level < kLevels; ++level) {
+    if (occupied_[level] == 0)
+      continue;
+    unsigned shift = kLevelBits * level;
+    uint64_t slot = current_ >> shift;
+    slot += SlotDistance(occupied_[level], slot % kSlots);
+    res = min(res, slot << shift);
+  }
+
+  DCHECK_NE(res, UINT64_MAX);
+  return res;
+}
+
+void TimerWheel::Cascade(unsigned level) {
+  unsigned idx = (current_ >> (kLevelBits * level)) % kSlots;
+  Slot& slot = slots_[level][idx];
+  occupied_[level] &= ~(1ULL << idx);
+
+  // The entries land on lower levels, hence we do not touch slot while placing them.
+  while (!slot.empty()) {
+    FiberInterface* fi = &slot.front();
+    slot.pop_front();
+    Place(fi, max(ToTick(fi->tp_), current_));
+  }
+}
+
+}  // namespace detail
+}  // namespace fb2
+}  // namespace util
@@ -0,0 +1,82 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/functional/function_ref.h>
+
+#define __FIBERS_SCHEDULER_H__
+#include "util/fibers/detail/fiber_interface.h"
+#undef __FIBERS_SCHEDULER_H__
+
+namespace util {
+namespace fb2 {
+namespace detail {
+
+// Hierarchical timer wheel for coarse fiber deadlines. Deadlines are rounded up to
+// millisecond ticks, so fibers never wake before their tp_. Adding and removing a fiber
+// is O(1) and each fiber is moved between levels at most kLevels - 1 times.
+// The wheel covers about 4.6 hours ahead, farther deadlines are rejected by Add().
+// Not thread-safe, owned by the Scheduler.
+class TimerWheel {
+ public:
+  using time_point = std::chrono::steady_clock::time_point;
+
+  TimerWheel() = default;
+  TimerWheel(const TimerWheel&) = delete;
+  TimerWheel& operator=(const TimerWheel&) = delete;
+
+  // Adds fi with the deadline fi->tp_. Returns false if the deadline is out of range.
+  bool Add(FiberInterface* fi);
+
+  // Removes fi that was added before and has not expired yet.
+  void Remove(FiberInterface* fi);
+
+  bool empty() const {
+    return size_ == 0;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  // Returns the next point the wheel should be advanced at. It may precede the earliest
+  // deadline, in which case the wheel just moves the entries closer to expiration.
+  // Requires !empty().
+  time_point NextEvent() const;
+
+  // Unlinks the fibers whose deadline is not later than now and passes them to cb.
+  void Expire(time_point now, absl::FunctionRef<void(FiberInterface*)> cb);
+
+ private:
+  static constexpr unsigned kLevelBits = 6;
+  static constexpr unsigned kSlots = 1u << kLevelBits;
+  static constexpr unsigned kLevels = 4;
+
+  using Slot = boost::intrusive::list<
+      FiberInterface,
+      boost::intrusive::member_hook<FiberInterface, FI_WheelHook, &FiberInterface::wheel_hook>,
+      boost::intrusive::constant_time_size<false>>;
+
+  static uint64_t ToTick(time_point tp);
+
+  void Place(FiberInterface* fi, uint64_t tick);
+  uint64_t NextEventTick() const;
+
+  // Moves the entries of the slot that starts at current_ on the given level to lower levels.
+  void Cascade(unsigned level);
+
+  Slot slots_[kLevels][kSlots];
+
+  // Bit i of occupied_[level] is set if slots_[level][i] may be non-empty. Removals do not
+  // clear the bits, empty slots are detected lazily.
+  uint64_t occupied_[kLevels] = {0};
+
+  uint64_t current_ = 0;  // the last processed tick.
+  size_t size_ = 0;
+};
+
+}  // namespace detail
+}  // namespace fb2
+}  // namespace util
@@ -6,6 +6,8 @@
 
 #include <cstdint>
 
+#include "util/fibers/cycle_clock.h"
+
 namespace util {
 namespace fb2 {
 
@@ -23,26 +25,8 @@ inline void CpuPause() {
 #endif
 }
 
-class CycleClock {
- public:
-  static uint64_t Now() {
-#if defined(__x86_64__)
-    uint64_t low, high;
-    __asm__ volatile("rdtsc" : "=a"(low), "=d"(high));
-    return (high << 32) | low;
-#elif defined(__aarch64__)
-    uint64_t val;
-    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(val));
-    return val;
-#else
-#error "Unsupported architecture"
-#endif
-  }
-
-  // number of cycles per millisecond.
-  static uint64_t FrequencyUsec();
-};
+using fb2::CycleClock;
 
 }  // namespace detail
 }  // namespace fb2
-}  // namespace util
\ No newline at end of file
+}  // namespace util
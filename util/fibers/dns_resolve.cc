@@ -2,14 +2,21 @@
 // See LICENSE for licensing terms.
 //
 
+#include "util/fibers/dns_resolve.h"
+
 #include <ares.h>
 #include <netdb.h>
 #include <sys/socket.h>
 
+#include <algorithm>
+#include <cstring>
+
 #include "base/logging.h"
 #include "base/stl_util.h"
 #include "util/fibers/epoll_proactor.h"
+#include "util/fibers/fibers.h"
 #include "util/fibers/proactor_base.h"
+#include "util/fibers/synchronization.h"
 
 #ifdef __linux__
 #include "util/fibers/uring_proactor.h"
@@ -23,7 +30,8 @@ using namespace std;
 namespace {
 
 struct DnsResolveCallbackArgs {
-  char* dest_ip = nullptr;
+  DnsAddresses* dest = nullptr;
+  uint32_t ttl_sec = UINT32_MAX;
   std::error_code ec;
   bool done = false;  // Should we use optional<ec> above instead of the additional bool field?
 };
@@ -110,45 +118,82 @@ void DnsResolveCallback(void* ares_arg, int status, int timeouts, struct ares_ad
   auto* cb_args = static_cast<DnsResolveCallbackArgs*>(ares_arg);
   cb_args->done = true;
 
-  if (status != ARES_SUCCESS || res->nodes == nullptr) {
-    cb_args->ec = make_error_code(errc::address_not_available);
+  if (status != ARES_SUCCESS || res == nullptr || res->nodes == nullptr) {
+    cb_args->ec = make_error_code(status == ARES_ECANCELLED || status == ARES_ETIMEOUT
+                                      ? errc::timed_out
+                                      : errc::address_not_available);
+    if (res)
+      ares_freeaddrinfo(res);
     return;
   }
 
-  auto* node = res->nodes;
-
-  // If IpV4 is available, prefer it
-  if (node->ai_family == AF_INET6 && node->ai_next != nullptr &&
-      node->ai_next->ai_family == AF_INET)
-    node = node->ai_next;
-
-  switch (node->ai_family) {
-    case AF_INET: {
-      auto* addr_in = reinterpret_cast<sockaddr_in*>(node->ai_addr);
-      ares_inet_ntop(AF_INET, &addr_in->sin_addr, cb_args->dest_ip, INET6_ADDRSTRLEN);
-      break;
-    }
-    case AF_INET6: {
-      auto* addr_in6 = reinterpret_cast<sockaddr_in6*>(node->ai_addr);
-      ares_inet_ntop(AF_INET6, &addr_in6->sin6_addr, cb_args->dest_ip, INET6_ADDRSTRLEN);
-      break;
+  for (auto* node = res->nodes; node != nullptr; node = node->ai_next) {
+    switch (node->ai_family) {
+      case AF_INET: {
+        auto* addr_in = reinterpret_cast<sockaddr_in*>(node->ai_addr);
+        cb_args->dest->emplace_back(boost::asio::ip::address_v4(ntohl(addr_in->sin_addr.s_addr)));
+        break;
+      }
+      case AF_INET6: {
+        auto* addr_in6 = reinterpret_cast<sockaddr_in6*>(node->ai_addr);
+        boost::asio::ip::address_v6::bytes_type bytes;
+        memcpy(bytes.data(), &addr_in6->sin6_addr, bytes.size());
+        cb_args->dest->emplace_back(
+            boost::asio::ip::address_v6(bytes, addr_in6->sin6_scope_id));
+        break;
+      }
+      default:
+        continue;
     }
-    default:
-      cb_args->ec = make_error_code(errc::invalid_argument);
+    cb_args->ttl_sec = min<uint32_t>(cb_args->ttl_sec, max(node->ai_ttl, 0));
   }
+  ares_freeaddrinfo(res);
+
+  if (cb_args->dest->empty()) {
+    cb_args->ec = make_error_code(errc::invalid_argument);
+    return;
+  }
+
+  // If IpV4 is available, prefer it
+  stable_partition(cb_args->dest->begin(), cb_args->dest->end(),
+                   [](const auto& addr) { return addr.is_v4(); });
 }
 
-void ProcessChannel(ares_channel channel, AresChannelState* state, DnsResolveCallbackArgs* args) {
+void ProcessChannel(ares_channel channel, AresChannelState* state, DnsResolveCallbackArgs* args,
+                    uint32_t wait_ms) {
+  using Clock = chrono::steady_clock;
   auto* myself = detail::FiberActive();
+  auto deadline = wait_ms ? Clock::now() + chrono::milliseconds(wait_ms) : Clock::time_point::max();
 
   while (!args->done) {
+    // c-ares needs to be called upon its own timeouts as well, to retry or to fail queries.
+    timeval tv;
+    Clock::time_point tp = deadline;
+    if (ares_timeout(channel, nullptr, &tv)) {
+      tp = min(tp, Clock::now() + chrono::seconds(tv.tv_sec) + chrono::microseconds(tv.tv_usec));
+    }
+
     // It's important to set and reset fiber_ctx close to Suspend, to avoid the case
     // where EPOLL callbacks wake up the fiber in the wrong place.
     // ares_process_fd calls helio code that in turn can suspend a fiber as well.
+    bool timed_out = false;
     state->fiber_ctx = myself;
-    myself->Suspend();
+    if (tp == Clock::time_point::max()) {
+      myself->Suspend();
+    } else {
+      timed_out = myself->WaitUntil(tp);
+    }
     state->fiber_ctx = nullptr;
 
+    if (timed_out) {
+      if (Clock::now() >= deadline) {
+        ares_cancel(channel);  // calls DnsResolveCallback with ARES_ECANCELLED.
+      } else {
+        ares_process_fd(channel, ARES_SOCKET_BAD, ARES_SOCKET_BAD);
+      }
+      continue;
+    }
+
     for (const auto& [socket, socket_state] : state->sockets_state) {
       int read_sock = HasReads(socket_state.mask) ? socket : ARES_SOCKET_BAD;
       int write_sock = HasWrites(socket_state.mask) ? socket : ARES_SOCKET_BAD;
@@ -159,9 +204,10 @@ void ProcessChannel(ares_channel channel, AresChannelState* state, DnsResolveCal
 
 }  // namespace
 
-error_code DnsResolve(string host, uint32_t wait_ms, char dest_ip[], ProactorBase* proactor) {
+error_code DnsResolve(string_view host, uint32_t wait_ms, ProactorBase* proactor,
+                      DnsAddresses* dest, uint32_t* ttl_sec) {
   DCHECK(ProactorBase::me() == proactor) << "must call from the proactor thread";
-  VLOG(1) << "DnsResolveStart";
+  VLOG(1) << "DnsResolveStart " << host;
 
   AresChannelState state;
   state.proactor = proactor;
@@ -173,19 +219,135 @@ error_code DnsResolve(string host, uint32_t wait_ms, char dest_ip[], ProactorBas
   ares_channel channel;
   CHECK_EQ(ares_init_options(&channel, &options, ARES_OPT_SOCK_STATE_CB), ARES_SUCCESS);
 
+  dest->clear();
   DnsResolveCallbackArgs cb_args;
-  cb_args.dest_ip = dest_ip;
-
+  cb_args.dest = dest;
 
   // Same hints as for  hostentares_gethostbyname
   ares_addrinfo_hints hints{ARES_AI_CANONNAME, AF_UNSPEC, 0, 0};
-  ares_getaddrinfo(channel, host.c_str(), nullptr, &hints, &DnsResolveCallback, &cb_args);
+  string host_str(host);
+  ares_getaddrinfo(channel, host_str.c_str(), nullptr, &hints, &DnsResolveCallback, &cb_args);
 
-  ProcessChannel(channel, &state, &cb_args);
+  ProcessChannel(channel, &state, &cb_args, wait_ms);
   ares_destroy(channel);
 
+  if (ttl_sec)
+    *ttl_sec = cb_args.ec ? 0 : cb_args.ttl_sec;
   return cb_args.ec;
 }
 
+error_code DnsResolve(string host, uint32_t wait_ms, char dest_ip[], ProactorBase* proactor) {
+  DnsAddresses addrs;
+  error_code ec = DnsResolve(host, wait_ms, proactor, &addrs);
+  if (ec)
+    return ec;
+
+  string ip = addrs.front().to_string();
+  DCHECK_LT(ip.size(), size_t(INET6_ADDRSTRLEN));
+  memcpy(dest_ip, ip.c_str(), ip.size() + 1);
+  return ec;
+}
+
+struct DnsCache::Entry {
+  AddressesPtr addrs;
+  uint64_t expire_ns = 0, refresh_ns = 0;
+  error_code ec;  // of the last lookup.
+  bool inflight = false;
+  EventCount resolved;
+};
+
+DnsCache* DnsCache::Local() {
+  // Leaked on purpose, background refreshes may still run when the thread locals are destroyed.
+  static thread_local DnsCache* cache = new DnsCache;
+  return cache;
+}
+
+DnsCache::~DnsCache() {
+}
+
+auto DnsCache::Resolve(string_view host, uint32_t wait_ms) -> io::Result<AddressesPtr> {
+  DCHECK(ProactorBase::me()) << "must call from the proactor thread";
+
+  uint64_t now = ProactorBase::GetMonotonicTimeNs();
+  auto it = entries_.find(host);
+  if (it == entries_.end()) {
+    if (entries_.size() >= max(opts_.max_entries, 1u))
+      Evict(now);
+    it = entries_.emplace(string(host), make_shared<Entry>()).first;
+  }
+  shared_ptr<Entry> entry = it->second;
+  if (entry->addrs && now < entry->expire_ns) {
+    ++stats_.hits;
+    if (now >= entry->refresh_ns && !entry->inflight) {
+      entry->inflight = true;
+      ++stats_.refreshes;
+      Fiber("dns_refresh", [this, entry, host = string(host), wait_ms] {
+        Lookup(host, wait_ms, entry.get());
+      }).Detach();
+    }
+    return entry->addrs;
+  }
+
+  if (entry->inflight) {
+    ++stats_.shared_lookups;
+    entry->resolved.await([&] { return !entry->inflight; });
+  } else {
+    ++stats_.misses;
+    entry->inflight = true;
+    Lookup(string(host), wait_ms, entry.get());
+  }
+
+  // A failed refresh keeps the previous addresses until they expire.
+  if (entry->addrs && ProactorBase::GetMonotonicTimeNs() < entry->expire_ns)
+    return entry->addrs;
+
+  return nonstd::make_unexpected(entry->ec ? entry->ec
+                                           : make_error_code(errc::address_not_available));
+}
+
+void DnsCache::Lookup(const string& host, uint32_t wait_ms, Entry* entry) {
+  DCHECK(entry->inflight);
+
+  DnsAddresses addrs;
+  uint32_t ttl_sec = 0;
+  entry->ec = DnsResolve(host, wait_ms, ProactorBase::me(), &addrs, &ttl_sec);
+  if (entry->ec) {
+    ++stats_.failures;
+    VLOG(1) << "Failed to resolve " << host << ": " << entry->ec.message();
+  } else {
+    ttl_sec = clamp(ttl_sec, opts_.min_ttl_sec, max(opts_.min_ttl_sec, opts_.max_ttl_sec));
+    uint64_t ttl_ns = uint64_t(ttl_sec) * 1000000000;
+    entry->expire_ns = ProactorBase::GetMonotonicTimeNs() + ttl_ns;
+    entry->refresh_ns = entry->expire_ns - uint64_t(ttl_ns * opts_.refresh_ahead);
+    entry->addrs = make_shared<const DnsAddresses>(std::move(addrs));
+  }
+
+  entry->inflight = false;
+  entry->resolved.notifyAll();
+}
+
+// Drops the expired entries and, if that does not free a quarter of the cache, others until it
+// is 3/4 full, so that the sweeps are amortized over the inserts. The entries being resolved
+// are kept, their fibers hold them anyway.
+void DnsCache::Evict(uint64_t now) {
+  size_t before = entries_.size();
+  for (auto it = entries_.begin(); it != entries_.end();) {
+    const Entry& entry = *it->second;
+    if (!entry.inflight && now >= entry.expire_ns)
+      entries_.erase(it++);
+    else
+      ++it;
+  }
+
+  size_t target = opts_.max_entries - opts_.max_entries / 4;
+  for (auto it = entries_.begin(); it != entries_.end() && entries_.size() > target;) {
+    if (it->second->inflight)
+      ++it;
+    else
+      entries_.erase(it++);
+  }
+  stats_.evictions += before - entries_.size();
+}
+
 }  // namespace fb2
 }  // namespace util
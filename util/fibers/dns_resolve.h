@@ -4,17 +4,96 @@
 
 #pragma once
 
+#include <absl/container/flat_hash_map.h>
+
+#include <boost/asio/ip/address.hpp>
 #include <cstdint>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <system_error>
+#include <vector>
+
+#include "io/io.h"
 
 namespace util {
 namespace fb2 {
 
 class ProactorBase;
+
+using DnsAddresses = std::vector<boost::asio::ip::address>;
+
 // Resolve addresss - either ipv4 or ipv6. dest_ip must be able to hold INET6_ADDRSTRLEN
 std::error_code DnsResolve(std::string host, uint32_t wait_ms, char dest_ip[],
                            ProactorBase* proactor);
 
+// Resolves all A and AAAA records of host, ipv4 addresses first. If ttl_sec is not null
+// it receives the smallest ttl of the records. wait_ms = 0 means no deadline.
+std::error_code DnsResolve(std::string_view host, uint32_t wait_ms, ProactorBase* proactor,
+                           DnsAddresses* dest, uint32_t* ttl_sec = nullptr);
+
+// Per-thread cache of DNS lookups that respects the records ttl. Concurrent lookups of
+// the same host share a single query. Entries that are used close to their expiration are
+// refreshed by a background fiber, so hot hosts are never resolved in the request path.
+// Must be used from a proactor thread.
+class DnsCache {
+ public:
+  struct Options {
+    uint32_t min_ttl_sec = 1;    // used for records with a smaller ttl.
+    uint32_t max_ttl_sec = 300;  // caps the ttl of records.
+
+    // Fraction of the ttl before the expiration during which a hit triggers a refresh.
+    double refresh_ahead = 0.2;
+
+    // When a new host does not fit, the expired entries are evicted, and others if needed.
+    uint32_t max_entries = 1024;
+  };
+
+  struct Stats {
+    uint64_t hits = 0, misses = 0;
+    uint64_t shared_lookups = 0;  // lookups that waited for an in-flight query.
+    uint64_t refreshes = 0, failures = 0;
+    uint64_t evictions = 0;
+  };
+
+  using AddressesPtr = std::shared_ptr<const DnsAddresses>;
+
+  // Returns the cache of the calling thread.
+  static DnsCache* Local();
+
+  ~DnsCache();
+
+  // Returns the addresses of host, resolving them if they are not cached or expired.
+  io::Result<AddressesPtr> Resolve(std::string_view host, uint32_t wait_ms);
+
+  void SetOptions(const Options& opts) {
+    opts_ = opts;
+  }
+
+  void Clear() {
+    entries_.clear();
+  }
+
+  const Stats& stats() const {
+    return stats_;
+  }
+
+ private:
+  struct Entry;
+
+  DnsCache() = default;
+
+  void Lookup(const std::string& host, uint32_t wait_ms, Entry* entry);
+
+  // Makes room for a new entry, see Options::max_entries.
+  void Evict(uint64_t now);
+
+  Options opts_;
+  Stats stats_;
+
+  // Entries are shared with the fibers that resolve them, so Clear() is safe at any time.
+  absl::flat_hash_map<std::string, std::shared_ptr<Entry>> entries_;
+};
+
 }  // namespace fb2
 }  // namespace util
@@ -17,6 +17,7 @@
 #include "base/logging.h"
 #include "base/proc_util.h"
 #include "util/fibers/epoll_socket.h"
+#include "util/fibers/event_log.h"
 
 #define EV_CHECK(x)                                                           \
   do {                                                                        \
@@ -53,7 +54,26 @@ int EpollCreate() {
   return res;
 }
 
-int EpollWait(int epoll_fd, EventsBatch* batch, int timeout) {
+#ifdef SYS_epoll_pwait2
+atomic_bool has_epoll_pwait2{true};
+#endif
+
+// timeout_ns is -1 for blocking indefinitely.
+int EpollWait(int epoll_fd, EventsBatch* batch, int64_t timeout_ns) {
+#ifdef SYS_epoll_pwait2
+  // Requires kernel 5.11, allows sleeping for less than a millisecond.
+  if (timeout_ns > 0 && has_epoll_pwait2.load(memory_order_relaxed)) {
+    timespec ts{.tv_sec = timeout_ns / 1000000000, .tv_nsec = timeout_ns % 1000000000};
+    int res = syscall(SYS_epoll_pwait2, epoll_fd, batch->cqe, kEvBatchSize, &ts, nullptr, 0);
+    if (res >= 0 || errno != ENOSYS)
+      return res;
+    has_epoll_pwait2.store(false, memory_order_relaxed);
+  }
+#endif
+
+  // epoll_wait() uses millisecond precision. If we block for less than the precise deadline,
+  // we cause unnesessary spinning and an elevated CPU usage. Therefore, we round up.
+  int timeout = timeout_ns > 0 ? (timeout_ns + 1000'000 - 1) / 1000'000 : timeout_ns;
   return epoll_wait(epoll_fd, batch->cqe, kEvBatchSize, timeout);
 }
 
@@ -61,7 +81,7 @@ void EpollDel(int epoll_fd, int fd) {
   CHECK_EQ(0, epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL));
 }
 
-#define USER_DATA(cqe) (cqe).data.u32
+#define USER_DATA(cqe) (cqe).data.u64
 #define KEV_MASK(cqe) (cqe).events
 #define KEV_ERROR(cqe) (0)
 
@@ -83,12 +103,13 @@ int EpollCreate() {
   return res;
 }
 
-int EpollWait(int epoll_fd, EventsBatch* batch, int tm_ms) {
+int EpollWait(int epoll_fd, EventsBatch* batch, int64_t timeout_ns) {
   struct timespec ts {
-    .tv_sec = tm_ms / 1000, .tv_nsec = (tm_ms % 1000) * 1000000
+    .tv_sec = timeout_ns / 1000000000, .tv_nsec = timeout_ns % 1000000000
   };
 
-  int epoll_res = kevent(epoll_fd, NULL, 0, batch->cqe, kEvBatchSize, tm_ms < 0 ? NULL : &ts);
+  int epoll_res =
+      kevent(epoll_fd, NULL, 0, batch->cqe, kEvBatchSize, timeout_ns < 0 ? NULL : &ts);
   return epoll_res;
 }
 
@@ -130,7 +151,7 @@ uint32_t KevMask(const struct kevent& kev) {
 
 }  // namespace
 
-EpollProactor::EpollProactor() : ProactorBase() {
+EpollProactor::EpollProactor(size_t task_queue_len) : ProactorBase(task_queue_len) {
   epoll_fd_ = EpollCreate();
 
   VLOG(1) << "Created epoll_fd_ " << epoll_fd_;
@@ -188,11 +209,13 @@ void EpollProactor::MainLoop(detail::Scheduler* scheduler) {
 
   while (true) {
     ++stats_.loop_cnt;
+    OnLoopIteration();
     bool task_queue_exhausted = true;
 
     tq_seq = tq_seq_.load(memory_order_acquire);
 
     if (task_queue_.try_dequeue(task)) {
+      EndIdleSpin();
       uint32_t cnt = 0;
       uint64_t task_start = GetClockNanos();
 
@@ -218,6 +241,7 @@ void EpollProactor::MainLoop(detail::Scheduler* scheduler) {
       } while (task_queue_.try_dequeue(task));
 
       stats_.num_task_runs += cnt;
+      LogEvent(EventType::kTaskBatch, cnt);
       DVLOG(2) << "Tasks runs " << stats_.num_task_runs << "/" << spin_loops;
 
       // We notify at the end that the queue is not full.
@@ -225,46 +249,59 @@ void EpollProactor::MainLoop(detail::Scheduler* scheduler) {
       task_queue_avail_.notifyAll();
     }
 
+    if (DrainLanes())
+      task_queue_exhausted = false;
+
     // We process remote fibers inside tq_seq section and also before we check for HasReady().
     scheduler->ProcessRemoteReady(nullptr);
 
-    int timeout = 0;  // By default we do not block on epoll_wait.
+    if (!scheduler->HasReady()) {
+      TryStealFiber();
+    }
+
+    FlushCorkedSockets();
+    if (FlushDispatchBatches())
+      task_queue_exhausted = false;
+
+    int64_t timeout_ns = 0;  // By default we do not block on epoll_wait.
 
     // Check if we can block on I/O.
     // There are few ground rules before we can set timeout=-1 (i.e. block indefinitely)
     // 1. No other fibers are active.
     // 2. Specifically SuspendIoLoop was called and returned true.
     // 3. Task queue is empty otherwise we should spin more to unload it.
-    if (task_queue_exhausted && !scheduler->HasReady() && spin_loops >= kMaxSpinLimit) {
+    // 4. The idle policy does not want to spin more.
+    if (task_queue_exhausted && !scheduler->HasReady() && spin_loops >= kMaxSpinLimit &&
+        !ContinueIdleSpin(false)) {
       spin_loops = 0;
 
       if (tq_seq_.compare_exchange_weak(tq_seq, WAIT_SECTION_STATE, memory_order_acquire)) {
         // We check stop condition when all the pending events were processed.
         // It's up to the app-user to make sure that the incoming flow of events is stopped before
         // stopping EpollProactor.
-        if (is_stopped_)
-          break;
+        if (is_stopped_) {
+          if (!ReclaimSharedFibers())
+            break;
+          tq_seq_.store(0, memory_order_release);
+          continue;
+        }
         ++stats_.num_stalls;
-        timeout = -1;  // We gonna block on epoll_wait.
+        timeout_ns = -1;  // We gonna block on epoll_wait.
       }
     }
 
-    DVLOG(2) << "EpollWait " << timeout << " " << tq_seq;
+    DVLOG(2) << "EpollWait " << timeout_ns << " " << tq_seq;
 
-    if (timeout == -1 && scheduler->HasSleepingFibers()) {
+    if (timeout_ns == -1 && scheduler->HasSleepingFibers()) {
       auto tp = scheduler->NextSleepPoint();
       auto now = chrono::steady_clock::now();
-      if (now < tp) {
-        auto ns = chrono::duration_cast<chrono::nanoseconds>(tp - now).count();
-        // epoll_wait() uses millisecond precision. If we block for less than the precise deadline,
-        // we cause unnesessary spinning and an elevated CPU usage. Therefore, we round up.
-        timeout = (ns + 1000'000 - 1) / 1000'000;
-      } else {
-        timeout = 0;
-      }
+      timeout_ns = now < tp ? chrono::duration_cast<chrono::nanoseconds>(tp - now).count() : 0;
     }
 
-    int epoll_res = EpollWait(epoll_fd_, &ev_batch, timeout);
+    uint64_t wait_start = timeout_ns != 0 ? GetClockNanos() : 0;
+    int epoll_res = EpollWait(epoll_fd_, &ev_batch, timeout_ns);
+    if (wait_start)
+      OnIdleWakeup(wait_start);
     if (epoll_res < 0) {
       epoll_res = errno;
       if (epoll_res == EINTR)
@@ -313,12 +350,13 @@ void EpollProactor::MainLoop(detail::Scheduler* scheduler) {
     }
 
     if (cqe_count) {
+      EndIdleSpin();
       continue;
     }
 
     // TODO: to handle idle tasks.
     scheduler->DestroyTerminated();
-    Pause(spin_loops);
+    Pause(std::min<uint32_t>(spin_loops, kMaxSpinLimit));
     ++spin_loops;
   }
 
@@ -344,10 +382,13 @@ unsigned EpollProactor::Arm(int fd, CbType cb, uint32_t event_mask) {
   e.cb = std::move(cb);
   e.index = -1;
 
+  // The generation tells apart the events of a previous arming of the entry.
+  uint64_t ud = (uint64_t(e.generation) << 32) | (ret + kUserDataCbIndex);
+
 #ifdef __linux__
   epoll_event ev;
   ev.events = event_mask;
-  ev.data.u32 = ret + kUserDataCbIndex;
+  ev.data.u64 = ud;
   DCHECK_LT(ret, centries_.size());
 
   CHECK_EQ(0, epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev));
@@ -355,7 +396,6 @@ unsigned EpollProactor::Arm(int fd, CbType cb, uint32_t event_mask) {
   // FreeBsd
   struct kevent kev[2];
   unsigned index = 0;
-  uint64_t ud = ret + kUserDataCbIndex;
   if (event_mask & EPOLL_IN)
     EV_SET(&kev[index++], fd /* ident*/, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, (void*)ud);
   if (event_mask & EPOLL_OUT)
@@ -375,6 +415,7 @@ void EpollProactor::Disarm(int fd, unsigned arm_index) {
 
   centries_[arm_index].cb = nullptr;
   centries_[arm_index].index = next_free_ce_;
+  ++centries_[arm_index].generation;
 
   next_free_ce_ = arm_index;
   EpollDel(epoll_fd_, fd);
@@ -388,6 +429,8 @@ LinuxSocketBase* EpollProactor::CreateSocket() {
 }
 
 void EpollProactor::SchedulePeriodic(uint32_t id, PeriodicItem* item) {
+  item->deadline_ns = GetClockNanos() + item->period_ns();
+
 #ifdef __linux__
   int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
   CHECK_GE(tfd, 0);
@@ -456,8 +499,13 @@ void EpollProactor::WakeRing() {
 void EpollProactor::PeriodicCb(PeriodicItem* item) {
   CHECK_GT(item->ref_cnt, 0u);
 
-  DCHECK(item->task);
-  item->task();
+  uint64_t start = RunPeriodic(item);
+
+  // The timers are periodic, so the next deadline keeps the phase of the first one.
+  uint64_t period = item->period_ns();
+  item->deadline_ns += period;
+  if (item->deadline_ns <= start && period > 0)
+    item->deadline_ns += (start - item->deadline_ns) / period * period + period;
 
 #ifdef __linux__
   uint64_t res;
@@ -484,21 +532,19 @@ void EpollProactor::DispatchCompletions(const void* cevents, unsigned count) {
 #endif
 
     // I allocate range of 1024 reserved values for the internal EpollProactor use.
-    uint32_t user_data = USER_DATA(cqe);
+    // The high 32 bits hold the generation of the completion entry.
+    uint64_t cqe_data = USER_DATA(cqe);
+    uint32_t user_data = uint32_t(cqe_data);
 
     if (user_data >= kUserDataCbIndex) {  // our heap range surely starts higher than 1k.
       size_t index = user_data - kUserDataCbIndex;
       DCHECK_LT(index, centries_.size());
-      const auto& item = centries_[index];
+      auto& item = centries_[index];
 
       // we do not move and reset cb, because epoll events are multishot.
-      // We could disarm an event and get this completion afterwards.
-      // This is why we check for cb and item.index.
-      //
-      // TODO: However it's still not enough because someone could arm the same index
-      // and we would dispatch the wrong event to the new callback.
-      // Solution - we can use another 32bits in cqe.data for generation number.
-      if (item.index == -1 && item.cb) {
+      // A callback earlier in the batch could disarm an event, and even arm the same index
+      // for another fd, before we dispatch its completion. The generation filters out both.
+      if (item.index == -1 && item.cb && item.generation == uint32_t(cqe_data >> 32)) {
         uint32_t ev_mask = KEV_MASK(cqe);
         int ev_err = KEV_ERROR(cqe);
 
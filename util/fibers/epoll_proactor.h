@@ -15,7 +15,7 @@ class Scheduler;
 
 class EpollProactor : public ProactorBase {
  public:
-  EpollProactor();
+  explicit EpollProactor(size_t task_queue_len = kTaskQueueLen);
   ~EpollProactor();
 
   // should be called from the thread that owns this EpollProactor before calling Run.
@@ -25,7 +25,7 @@ class EpollProactor : public ProactorBase {
 
   // event_mask passed from epoll_event.events or from kevent.
   // int error is kevent specific.
-  using CbType = std::function<void(uint32_t, int, EpollProactor*)>;
+  using CbType = base::SmallFunction<48, void(uint32_t, int, EpollProactor*)>;
 
   // Returns the handler id for the armed event.
   unsigned Arm(int fd, CbType cb, uint32_t event_mask);
@@ -61,7 +61,9 @@ class EpollProactor : public ProactorBase {
     // serves for linked list management when unused. Also can store an additional payload
     // field when in flight.
     int32_t index = -1;
-    int32_t unused = -1;
+
+    // Incremented upon disarm, passed with the armed events.
+    uint32_t generation = 0;
   };
 
   std::vector<CompletionEntry> centries_;
@@ -9,7 +9,9 @@
 #include "absl/cleanup/cleanup.h"
 
 #ifdef __linux__
+#include <linux/errqueue.h>
 #include <sys/epoll.h>
+#include <sys/sendfile.h>
 #else
 #include <sys/event.h>
 #endif
@@ -124,6 +126,7 @@ auto EpollSocket::Close() -> error_code {
 
     int fd = native_handle();
     DVSOCK(1) << "Closing socket";
+    ResetCork();
     if (arm_index_ >= 0)
       GetProactor()->Disarm(fd, arm_index_);
     posix_err_wrap(::close(fd), &ec);
@@ -257,6 +260,10 @@ auto EpollSocket::WriteSome(const iovec* ptr, uint32_t len) -> Result<size_t> {
   CHECK_GT(len, 0U);
   CHECK_GE(fd_, 0);
 
+  Result<size_t> cork_res;
+  if (CorkWrite(ptr, len, &cork_res))
+    return cork_res;
+
   CHECK(write_context_ == NULL);
 
   msghdr msg;
@@ -264,10 +271,23 @@ auto EpollSocket::WriteSome(const iovec* ptr, uint32_t len) -> Result<size_t> {
   msg.msg_iov = const_cast<iovec*>(ptr);
   msg.msg_iovlen = len;
 
+  int send_flags = MSG_NOSIGNAL;
+#ifdef __linux__
+  if (zc_threshold_ > 0) {
+    size_t total = 0;
+    for (uint32_t i = 0; i < len; ++i) {
+      total += ptr[i].iov_len;
+    }
+    if (total >= zc_threshold_)
+      send_flags |= MSG_ZEROCOPY;
+  }
+#endif
+
   ssize_t res;
   int fd = native_handle();
   write_context_ = detail::FiberActive();
   absl::Cleanup clean = [this]() { write_context_ = nullptr; };
+  uint64_t tx_start = TxStart();
 
   while (true) {
     if (fd_ & IS_SHUTDOWN) {
@@ -275,8 +295,22 @@ auto EpollSocket::WriteSome(const iovec* ptr, uint32_t len) -> Result<size_t> {
       break;
     }
 
-    res = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    res = sendmsg(fd, &msg, send_flags);
     if (res >= 0) {
+      OnSent(tx_start, res);
+#ifdef __linux__
+      if (send_flags & MSG_ZEROCOPY) {
+        // Each successful MSG_ZEROCOPY call gets a sequential id. Wait until the kernel
+        // releases our buffers, so that the caller could reuse them.
+        uint32_t id = zc_sent_++;
+        while (int32_t(zc_done_ - id) <= 0 && (fd_ & IS_SHUTDOWN) == 0) {
+          DrainErrorQueue();
+          if (int32_t(zc_done_ - id) > 0)
+            break;
+          write_context_->Suspend();
+        }
+      }
+#endif
       return res;
     }
 
@@ -306,6 +340,35 @@ auto EpollSocket::WriteSome(const iovec* ptr, uint32_t len) -> Result<size_t> {
   return nonstd::make_unexpected(std::move(ec));
 }
 
+auto EpollSocket::EnableZeroCopySend(size_t threshold) -> error_code {
+#ifdef __linux__
+  CHECK_GE(fd_, 0);
+  if (threshold > 0) {
+    int val = 1;
+    if (setsockopt(native_handle(), SOL_SOCKET, SO_ZEROCOPY, &val, sizeof(val)) < 0)
+      return from_errno();
+  }
+  zc_threshold_ = threshold;
+  return {};
+#else
+  return make_error_code(errc::operation_not_supported);
+#endif
+}
+
+#ifdef __linux__
+void EpollSocket::OnErrorQueue(const sock_extended_err& serr) {
+  if (serr.ee_errno != 0 || serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+    return;
+
+  // [ee_info, ee_data] is the range of released sends.
+  uint32_t done = serr.ee_data + 1;
+  if (int32_t(done - zc_done_) > 0)
+    zc_done_ = done;
+  DVSOCK(2) << "Zerocopy notification " << serr.ee_info << "-" << serr.ee_data
+            << ((serr.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) ? " copied" : "");
+}
+#endif
+
 void EpollSocket::AsyncWriteSome(const iovec* v, uint32_t len, AsyncProgressCb cb) {
   auto res = WriteSome(v, len);
   cb(res);
@@ -317,6 +380,7 @@ auto EpollSocket::RecvMsg(const msghdr& msg, int flags) -> Result<size_t> {
   CHECK_GT(size_t(msg.msg_iovlen), 0U);
 
   CHECK(read_context_ == NULL);
+  FlushCork();
 
   int fd = native_handle();
   read_context_ = detail::FiberActive();
@@ -332,6 +396,7 @@ auto EpollSocket::RecvMsg(const msghdr& msg, int flags) -> Result<size_t> {
 
     res = recvmsg(fd, const_cast<msghdr*>(&msg), flags);
     if (res > 0) {  // if res is 0, that means a peer closed the socket.
+      OnRecv(msg);
       return res;
     }
 
@@ -366,7 +431,118 @@ auto EpollSocket::RecvMsg(const msghdr& msg, int flags) -> Result<size_t> {
   return nonstd::make_unexpected(std::move(ec));
 }
 
+#ifdef __linux__
+auto EpollSocket::RecvMMsg(mmsghdr* msgs, unsigned len) -> Result<unsigned> {
+  CHECK(proactor());
+  CHECK_GE(fd_, 0);
+  CHECK(read_context_ == NULL);
+
+  int fd = native_handle();
+  read_context_ = detail::FiberActive();
+  absl::Cleanup clean = [this]() { read_context_ = nullptr; };
+
+  error_code ec;
+  while (true) {
+    if (fd_ & IS_SHUTDOWN)
+      return nonstd::make_unexpected(make_error_code(errc::connection_aborted));
+
+    int res = recvmmsg(fd, msgs, len, MSG_DONTWAIT, nullptr);
+    if (res >= 0)
+      return unsigned(res);
+
+    if (errno != EAGAIN)
+      return nonstd::make_unexpected(from_errno());
+
+    // Pending socket errors, e.g. icmp unreachable, are returned by the next recvmmsg call.
+    if (SuspendMyself(read_context_, &ec) && ec)
+      return nonstd::make_unexpected(std::move(ec));
+  }
+}
+
+auto EpollSocket::SendMMsg(mmsghdr* msgs, unsigned len) -> Result<unsigned> {
+  CHECK(proactor());
+  CHECK_GE(fd_, 0);
+  CHECK(write_context_ == NULL);
+
+  int fd = native_handle();
+  write_context_ = detail::FiberActive();
+  absl::Cleanup clean = [this]() { write_context_ = nullptr; };
+
+  error_code ec;
+  while (true) {
+    if (fd_ & IS_SHUTDOWN)
+      return nonstd::make_unexpected(make_error_code(errc::connection_aborted));
+
+    int res = sendmmsg(fd, msgs, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (res >= 0)
+      return unsigned(res);
+
+    if (errno != EAGAIN)
+      return nonstd::make_unexpected(from_errno());
+
+    if (SuspendMyself(write_context_, &ec) && ec)
+      return nonstd::make_unexpected(std::move(ec));
+  }
+}
+
+auto EpollSocket::SendFile(int fd, off_t offset, size_t len) -> Result<size_t> {
+  CHECK(proactor());
+  CHECK_GE(fd_, 0);
+
+  // The coalesced data precedes the file.
+  if (error_code ec = Flush(); ec)
+    return nonstd::make_unexpected(ec);
+
+  CHECK(write_context_ == NULL);
+
+  int sock_fd = native_handle();
+  write_context_ = detail::FiberActive();
+  absl::Cleanup clean = [this]() { write_context_ = nullptr; };
+
+  error_code ec;
+  size_t sent = 0;
+  while (sent < len) {
+    if (fd_ & IS_SHUTDOWN)
+      return MakeUnexpected(errc::connection_aborted);
+
+    // Advances offset rather than the file offset.
+    ssize_t res = sendfile(sock_fd, fd, &offset, len - sent);
+    if (res > 0) {
+      OnSent(0, res);
+      sent += res;
+      continue;
+    }
+    if (res == 0)  // end of file.
+      break;
+
+    int err = errno;
+    if (err == EINTR)
+      continue;
+
+    if (err == EAGAIN) {
+      if (SuspendMyself(write_context_, &ec) && ec)
+        return nonstd::make_unexpected(std::move(ec));
+      continue;
+    }
+
+    if ((err == EINVAL || err == ENOSYS) && sent == 0) {
+      std::move(clean).Invoke();
+      return FiberSocketBase::SendFile(fd, offset, len);
+    }
+
+    if (err == EPIPE)
+      err = ECONNABORTED;
+    return nonstd::make_unexpected(error_code(err, system_category()));
+  }
+
+  return sent;
+}
+#endif
+
 io::Result<size_t> EpollSocket::Recv(const io::MutableBytes& mb, int flags) {
+  if (HasRxTimestamps())
+    return RecvTimestamped(mb, flags);
+
   msghdr msg;
   memset(&msg, 0, sizeof(msg));
   iovec vec[1];
@@ -391,6 +567,14 @@ auto EpollSocket::Shutdown(int how) -> error_code {
   return ec;
 }
 
+void EpollSocket::StopAccepting() {
+  if (fd_ < 0 || (fd_ & IS_SHUTDOWN))
+    return;
+
+  fd_ |= IS_SHUTDOWN;
+  Wakey(EpollProactor::EPOLL_IN, 0, nullptr);  // Accept checks IS_SHUTDOWN once woken.
+}
+
 void EpollSocket::RegisterOnErrorCb(std::function<void(uint32_t)> cb) {
   DCHECK(!error_cb_);
   error_cb_ = std::move(cb);
@@ -408,7 +592,7 @@ bool EpollSocket::SuspendMyself(detail::FiberInterface* cntx, std::error_code* e
   if (timeout() == UINT32_MAX) {
     cntx->Suspend();
   } else {
-    cntx->WaitUntil(chrono::steady_clock::now() + chrono::milliseconds(timeout()));
+    cntx->WaitUntil(chrono::steady_clock::now() + chrono::milliseconds(timeout()), true);
   }
 
   DVSOCK(2) << "Resuming " << cntx->name() << " em: " << epoll_mask_ << ", errno: " << kev_error_;
@@ -433,6 +617,22 @@ void EpollSocket::Wakey(uint32_t ev_mask, int error, EpollProactor* cntr) {
   constexpr uint32_t kErrMask = POLLERR | POLLHUP;
 #endif
 
+#ifdef __linux__
+  if ((zc_threshold_ > 0 || timestamp_stats()) && (ev_mask & EPOLLERR)) {
+    // Zero-copy notifications and tx timestamps are delivered via the error queue and raise
+    // EPOLLERR. Treat it as a write event unless the socket has a real pending error.
+    DrainErrorQueue();
+    int sock_err = 0;
+    socklen_t optlen = sizeof(sock_err);
+    getsockopt(native_handle(), SOL_SOCKET, SO_ERROR, &sock_err, &optlen);
+    if (sock_err) {
+      error = sock_err;
+    } else {
+      ev_mask = (ev_mask & ~EPOLLERR) | EpollProactor::EPOLL_OUT;
+    }
+  }
+#endif
+
   if (error)
     kev_error_ = error;
 
@@ -10,7 +10,7 @@
 namespace util {
 namespace fb2 {
 
-class EpollSocket : public LinuxSocketBase {
+class EpollSocket final : public LinuxSocketBase {
  public:
   template <typename T> using Result = io::Result<T>;
 
@@ -31,6 +31,18 @@ class EpollSocket : public LinuxSocketBase {
   Result<size_t> Recv(const io::MutableBytes& mb, int flags = 0) override;
 
   error_code Shutdown(int how) override;
+  void StopAccepting() final;
+
+#ifdef __linux__
+  Result<unsigned> RecvMMsg(mmsghdr* msgs, unsigned len) final;
+  Result<unsigned> SendMMsg(mmsghdr* msgs, unsigned len) final;
+
+  // Uses sendfile(2). Falls back to the default implementation if the file does not support it.
+  Result<size_t> SendFile(int fd, off_t offset, size_t len) final;
+#endif
+
+  // Uses MSG_ZEROCOPY, Linux only. Completion notifications are read from the socket error queue.
+  error_code EnableZeroCopySend(size_t threshold) final;
 
   void RegisterOnErrorCb(std::function<void(uint32_t)> cb) final;
   void CancelOnErrorCb() final;
@@ -50,12 +62,21 @@ class EpollSocket : public LinuxSocketBase {
   // kevent pass error code together with completion event.
   void Wakey(uint32_t event_flags, int error, EpollProactor* cntr);
 
+#ifdef __linux__
+  // Advances zc_done_ upon MSG_ZEROCOPY notifications, see DrainErrorQueue.
+  void OnErrorQueue(const sock_extended_err& serr) final;
+#endif
+
   detail::FiberInterface* write_context_ = nullptr;
   detail::FiberInterface* read_context_ = nullptr;
   int32_t arm_index_ = -1;
   uint16_t epoll_mask_ = 0;
   uint16_t kev_error_ = 0;
 
+  size_t zc_threshold_ = 0;  // 0 if zero-copy sends are disabled.
+  uint32_t zc_sent_ = 0;     // number of zero-copy sendmsg calls that succeeded.
+  uint32_t zc_done_ = 0;     // number of zero-copy sends that were released by the kernel.
+
   std::function<void(uint32_t)> error_cb_;
 };
 
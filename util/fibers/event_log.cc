@@ -0,0 +1,420 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/fibers/event_log.h"
+
+#include <absl/flags/flag.h>
+#include <absl/numeric/bits.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <mutex>
+#include <vector>
+
+#include "base/init.h"
+#include "base/logging.h"
+#include "base/ring_buffer.h"
+#include "base/spinlock.h"
+#include "util/fibers/cycle_clock.h"
+#include "util/fibers/proactor_base.h"
+
+ABSL_FLAG(bool, fiber_event_log, false, "If true, records the scheduling events of the threads");
+ABSL_FLAG(uint32_t, fiber_event_log_size, 8192,
+          "Number of the last events kept by each thread, must be a power of 2");
+ABSL_FLAG(std::string, fiber_event_log_crash_file, "",
+          "If set, enables the event log and dumps it into this file in Chrome trace format "
+          "when the process crashes");
+
+namespace util {
+namespace fb2 {
+
+using namespace std;
+
+namespace detail {
+
+std::atomic_bool event_log_enabled{false};
+
+}  // namespace detail
+
+namespace {
+
+// The ring is written by its thread and read by the dumps, so the lock is not contended in
+// practice.
+struct ThreadLog {
+  explicit ThreadLog(unsigned size) : ring(size) {
+  }
+
+  base::SpinLock mu;
+  base::RingBuffer<EventRecord> ring;
+  int32_t thread_index = -1;  // pool index of the proactor thread.
+  pid_t tid = syscall(SYS_gettid);
+};
+
+struct LogRegistry {
+  mutex mu;
+  vector<ThreadLog*> logs;
+};
+
+LogRegistry& Registry() {
+  static LogRegistry* registry = new LogRegistry;
+  return *registry;
+}
+
+// Registers the log of the thread upon its first event and unregisters it when the thread
+// exits.
+class ThreadLogHolder {
+ public:
+  ThreadLogHolder() : log_(absl::GetFlag(FLAGS_fiber_event_log_size)) {
+    LogRegistry& reg = Registry();
+    lock_guard lk(reg.mu);
+    reg.logs.push_back(&log_);
+  }
+
+  ~ThreadLogHolder() {
+    LogRegistry& reg = Registry();
+    lock_guard lk(reg.mu);
+    reg.logs.erase(find(reg.logs.begin(), reg.logs.end(), &log_));
+  }
+
+  ThreadLog& log() {
+    return log_;
+  }
+
+ private:
+  ThreadLog log_;
+};
+
+// Formats the json into a fixed buffer that is flushed either into a string or into a file
+// descriptor, so that the signal handler does not allocate.
+class TraceWriter {
+ public:
+  explicit TraceWriter(int fd) : fd_(fd) {
+  }
+
+  explicit TraceWriter(string* dest) : dest_(dest) {
+  }
+
+  void Append(const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+  bool Flush();
+
+ private:
+  // An event takes less than that, including the escaped name.
+  static constexpr size_t kMaxEntry = 512;
+
+  int fd_ = -1;
+  string* dest_ = nullptr;
+  bool ok_ = true;
+  size_t len_ = 0;
+  char buf_[4096];
+};
+
+void TraceWriter::Append(const char* fmt, ...) {
+  if (len_ + kMaxEntry > sizeof(buf_))
+    Flush();
+
+  va_list args;
+  va_start(args, fmt);
+  int res = vsnprintf(buf_ + len_, sizeof(buf_) - len_, fmt, args);
+  va_end(args);
+  if (res > 0)
+    len_ = min(len_ + res, sizeof(buf_) - 1);
+}
+
+bool TraceWriter::Flush() {
+  if (dest_) {
+    dest_->append(buf_, len_);
+  } else {
+    for (size_t written = 0; ok_ && written < len_;) {
+      ssize_t res = write(fd_, buf_ + written, len_ - written);
+      if (res > 0)
+        written += res;
+      else if (res < 0 && errno != EINTR)
+        ok_ = false;
+    }
+  }
+  len_ = 0;
+  return ok_;
+}
+
+constexpr size_t kEscapedNameLen = sizeof(EventRecord::name) * 6 + 1;
+
+// Escapes name into dest, which must hold kEscapedNameLen chars. Stops at the end of the
+// array, the crash dump may read a name that is being written.
+const char* EscapeName(const char (&name)[sizeof(EventRecord::name)], char* dest) {
+  char* next = dest;
+  for (const char* c = name; c < name + sizeof(name) && *c; ++c) {
+    if (*c == '"' || *c == '\\') {
+      *next++ = '\\';
+      *next++ = *c;
+    } else if (static_cast<unsigned char>(*c) < 0x20) {
+      next += sprintf(next, "\\u%04x", static_cast<unsigned char>(*c));
+    } else {
+      *next++ = *c;
+    }
+  }
+  *next = '\0';
+  return dest;
+}
+
+class ChromeTraceFormatter {
+ public:
+  ChromeTraceFormatter(uint64_t base_tsc, TraceWriter* writer)
+      : base_tsc_(base_tsc), pid_(getpid()), writer_(writer) {
+  }
+
+  void Begin() {
+    writer_->Append("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  }
+
+  // at(i) returns the i-th oldest event of the thread.
+  template <typename At>
+  void AddThread(int32_t thread_index, pid_t tid, At&& at, unsigned count);
+
+  bool End() {
+    writer_->Append("\n]}\n");
+    return writer_->Flush();
+  }
+
+ private:
+  void Event(const char* name, const char* cat, const EventRecord& rec, int32_t tid);
+
+  double Usec(uint64_t tsc) const {
+    return tsc > base_tsc_ ? CycleClock::ToNsec(tsc - base_tsc_) / 1000.0 : 0;
+  }
+
+  uint64_t base_tsc_;
+  pid_t pid_;
+  TraceWriter* writer_;
+  bool first_ = true;
+};
+
+template <typename At>
+void ChromeTraceFormatter::AddThread(int32_t thread_index, pid_t tid, At&& at, unsigned count) {
+  char thread_name[32];
+  if (thread_index >= 0)
+    snprintf(thread_name, sizeof(thread_name), "proactor %d", thread_index);
+  else
+    snprintf(thread_name, sizeof(thread_name), "thread %d", tid);
+  writer_->Append(
+      "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+      "\"args\":{\"name\":\"%s\"}}",
+      first_ ? "" : ",", pid_, tid, thread_name);
+  first_ = false;
+
+  char escaped[kEscapedNameLen];
+  const EventRecord* running = nullptr;  // the last fiber switch.
+  for (unsigned i = 0; i < count; ++i) {
+    const EventRecord& rec = at(i);
+    switch (rec.type) {
+      case EventType::kFiberSwitch:
+        if (running) {
+          writer_->Append(
+              ",\n{\"name\":\"%s\",\"cat\":\"fiber\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+              "\"pid\":%d,\"tid\":%d,\"args\":{\"fiber\":\"0x%" PRIx64 "\"}}",
+              EscapeName(running->name, escaped), Usec(running->tsc),
+              Usec(rec.tsc) - Usec(running->tsc), pid_, tid, running->arg);
+        }
+        running = &rec;
+        break;
+      case EventType::kIoSubmit:
+        Event("io_submit", "io", rec, tid);
+        writer_->Append("\"op\":%" PRIu64 ",\"tag\":%d}}", rec.arg, rec.res);
+        break;
+      case EventType::kIoComplete:
+        Event("io_complete", "io", rec, tid);
+        writer_->Append("\"op\":%" PRIu64 ",\"res\":%d}}", rec.arg, rec.res);
+        break;
+      case EventType::kDispatch:
+        Event("dispatch", "dispatch", rec, tid);
+        writer_->Append("\"to\":%d}}", rec.res);
+        break;
+      case EventType::kTaskBatch:
+        Event("tasks", "dispatch", rec, tid);
+        writer_->Append("\"count\":%" PRIu64 "}}", rec.arg);
+        break;
+    }
+  }
+
+  // The fiber that still runs, or ran when the log was disabled.
+  if (running) {
+    Event(EscapeName(running->name, escaped), "fiber", *running, tid);
+    writer_->Append("\"fiber\":\"0x%" PRIx64 "\"}}", running->arg);
+  }
+}
+
+// Appends the beginning of an instant event, up to its args object.
+void ChromeTraceFormatter::Event(const char* name, const char* cat, const EventRecord& rec,
+                                 int32_t tid) {
+  writer_->Append(
+      ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%d,"
+      "\"tid\":%d,\"args\":{",
+      name, cat, Usec(rec.tsc), pid_, tid);
+}
+
+constexpr int kCrashSignals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+struct sigaction prev_actions[size(kCrashSignals)];
+std::atomic_bool crash_dumped{false};
+
+void CrashHandler(int sig, siginfo_t* info, void* ucontext) {
+  if (!crash_dumped.exchange(true)) {
+    int fd = open(absl::GetFlag(FLAGS_fiber_event_log_crash_file).c_str(),
+                  O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+      WriteEventLogChromeTrace(fd);
+      close(fd);
+    }
+  }
+
+  // Chains to the handler that was installed before, i.e. to the failure signal handler.
+  unsigned index = find(begin(kCrashSignals), end(kCrashSignals), sig) - begin(kCrashSignals);
+  const struct sigaction& prev = prev_actions[index];
+  if (prev.sa_flags & SA_SIGINFO) {
+    prev.sa_sigaction(sig, info, ucontext);
+  } else if (prev.sa_handler == SIG_DFL) {
+    signal(sig, SIG_DFL);
+    raise(sig);
+  } else if (prev.sa_handler != SIG_IGN) {
+    prev.sa_handler(sig);
+  }
+}
+
+void InstallCrashHandler() {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sigemptyset(&sa.sa_mask);
+  sa.sa_sigaction = CrashHandler;
+  sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+  for (size_t i = 0; i < size(kCrashSignals); ++i) {
+    CHECK_EQ(0, sigaction(kCrashSignals[i], &sa, &prev_actions[i]));
+  }
+}
+
+}  // namespace
+
+namespace detail {
+
+void LogEventSlow(EventType type, uint64_t arg, int32_t res, const char* name) {
+  thread_local ThreadLogHolder holder;
+  ThreadLog& log = holder.log();
+
+  std::lock_guard lk(log.mu);
+  EventRecord* rec = log.ring.GetTail(/*override=*/true);
+  rec->tsc = CycleClock::Now();
+  rec->arg = arg;
+  rec->res = res;
+  rec->type = type;
+  if (name) {
+    strncpy(rec->name, name, sizeof(rec->name) - 1);
+    rec->name[sizeof(rec->name) - 1] = '\0';
+  } else {
+    rec->name[0] = '\0';
+  }
+
+  if (ABSL_PREDICT_FALSE(log.thread_index < 0)) {
+    if (ProactorBase* proactor = ProactorBase::me())
+      log.thread_index = proactor->GetPoolIndex();
+  }
+}
+
+}  // namespace detail
+
+void EnableEventLog(bool enable) {
+  if (enable) {
+    CHECK(absl::has_single_bit(absl::GetFlag(FLAGS_fiber_event_log_size)));
+
+    // Calibrates the clock before the dumps need it, which may run in a signal handler.
+    CycleClock::FrequencyUsec();
+  }
+  detail::event_log_enabled.store(enable, memory_order_relaxed);
+}
+
+string EventLogChromeTrace() {
+  struct Snapshot {
+    int32_t thread_index;
+    pid_t tid;
+    vector<EventRecord> events;
+  };
+
+  vector<Snapshot> snapshots;
+  {
+    LogRegistry& reg = Registry();
+    lock_guard lk(reg.mu);
+    for (ThreadLog* log : reg.logs) {
+      Snapshot& snapshot = snapshots.emplace_back();
+      lock_guard ring_lk(log->mu);
+      snapshot.thread_index = log->thread_index;
+      snapshot.tid = log->tid;
+      snapshot.events.reserve(log->ring.size());
+      for (unsigned i = 0; i < log->ring.size(); ++i)
+        snapshot.events.push_back(log->ring[i]);
+    }
+  }
+
+  uint64_t base_tsc = UINT64_MAX;
+  for (const Snapshot& snapshot : snapshots) {
+    if (!snapshot.events.empty())
+      base_tsc = min(base_tsc, snapshot.events.front().tsc);
+  }
+
+  string res;
+  TraceWriter writer(&res);
+  ChromeTraceFormatter formatter(base_tsc, &writer);
+  formatter.Begin();
+  for (const Snapshot& snapshot : snapshots) {
+    formatter.AddThread(
+        snapshot.thread_index, snapshot.tid,
+        [&](unsigned i) -> const EventRecord& { return snapshot.events[i]; },
+        snapshot.events.size());
+  }
+  formatter.End();
+  return res;
+}
+
+bool WriteEventLogChromeTrace(int fd) {
+  LogRegistry& reg = Registry();
+
+  // The registry is not modified by a crashing process in practice, but a thread that holds
+  // its lock might be the one that crashed.
+  unique_lock lk(reg.mu, try_to_lock);
+  if (!lk.owns_lock())
+    return false;
+
+  // Reads the rings without their locks, so the events that are being written are garbage.
+  uint64_t base_tsc = UINT64_MAX;
+  for (const ThreadLog* log : reg.logs) {
+    if (!log->ring.empty())
+      base_tsc = min(base_tsc, log->ring[0].tsc);
+  }
+
+  TraceWriter writer(fd);
+  ChromeTraceFormatter formatter(base_tsc, &writer);
+  formatter.Begin();
+  for (const ThreadLog* log : reg.logs) {
+    formatter.AddThread(
+        log->thread_index, log->tid,
+        [log](unsigned i) -> const EventRecord& { return log->ring[i]; }, log->ring.size());
+  }
+  return formatter.End();
+}
+
+}  // namespace fb2
+}  // namespace util
+
+REGISTER_MODULE_INITIALIZER(fiber_event_log, {
+  if (!absl::GetFlag(FLAGS_fiber_event_log_crash_file).empty()) {
+    util::fb2::InstallCrashHandler();
+    util::fb2::EnableEventLog(true);
+  } else if (absl::GetFlag(FLAGS_fiber_event_log)) {
+    util::fb2::EnableEventLog(true);
+  }
+});
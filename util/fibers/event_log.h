@@ -0,0 +1,71 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/base/optimization.h>
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace util {
+namespace fb2 {
+
+// Flight recorder of the scheduling events of the process. When enabled, each thread records
+// binary, fixed size events with their cycle counter timestamps into its own ring of the last
+// --fiber_event_log_size events, overriding the oldest ones. The recording is a few stores
+// and does not format anything, so it can stay enabled in production. The rings are dumped
+// in Chrome trace format (chrome://tracing, perfetto) by EventLogChromeTrace, see
+// RegisterEventzHandler for the http export, and into --fiber_event_log_crash_file when the
+// process crashes.
+enum class EventType : uint8_t {
+  kFiberSwitch,  // a fiber starts running. name is the fiber, arg its address.
+  kIoSubmit,     // an io_uring submission with a callback. arg is its index, res its tag.
+  kIoComplete,   // a completion of kIoSubmit. arg is its index, res the result.
+  kDispatch,     // ProactorBase::DispatchBrief. res is the pool index of the target.
+  kTaskBatch,    // a proactor ran arg tasks of its task queue.
+};
+
+struct EventRecord {
+  uint64_t tsc;  // CycleClock::Now()
+  uint64_t arg;
+  int32_t res;
+  EventType type;
+  char name[24];  // truncated copy, empty for the events without a name.
+};
+
+namespace detail {
+
+extern std::atomic_bool event_log_enabled;
+
+void LogEventSlow(EventType type, uint64_t arg, int32_t res, const char* name);
+
+}  // namespace detail
+
+inline bool EventLogEnabled() {
+  return detail::event_log_enabled.load(std::memory_order_relaxed);
+}
+
+// Records an event into the ring of the calling thread if the log is enabled.
+inline void LogEvent(EventType type, uint64_t arg = 0, int32_t res = 0,
+                     const char* name = nullptr) {
+  if (ABSL_PREDICT_FALSE(EventLogEnabled()))
+    detail::LogEventSlow(type, arg, res, name);
+}
+
+// Starts or stops the recording. The recorded events stay in the rings.
+void EnableEventLog(bool enable);
+
+// Returns the events in the rings of the live threads as a Chrome trace json object. The runs
+// of the fibers are complete events that last until the next switch of their thread and the
+// other events are instant ones.
+std::string EventLogChromeTrace();
+
+// Writes the trace of EventLogChromeTrace into fd without taking locks or allocating memory,
+// so it can be called from a signal handler. Returns false if a write failed.
+bool WriteEventLogChromeTrace(int fd);
+
+}  // namespace fb2
+}  // namespace util
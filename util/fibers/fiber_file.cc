@@ -5,16 +5,26 @@
 
 #include <absl/time/clock.h>
 #include <absl/time/time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/uio.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <atomic>
 
 #include "base/hash.h"
 #include "base/histogram.h"
 #include "base/logging.h"
 
+#include "util/fibers/proactor_base.h"
 #include "util/fibers/synchronization.h"
 
+#ifdef __linux__
+#include "util/fibers/uring_file.h"
+#endif
+
 namespace util {
 using namespace io;
 using namespace std;
@@ -48,6 +58,11 @@ class FiberReadFile : public ReadonlyFile {
 
   void HandleActivePrefetch();
 
+  // Reads the range with RWF_NOWAIT if it is in the page cache. Returns the number of bytes
+  // read if they cover at least `need` bytes or reach the end of the file, otherwise -1 and
+  // the read should be offloaded to tp_.
+  ssize_t TryReadCached(size_t offset, const iovec* v, uint32_t len, size_t need);
+
   MutableBytes prefetch_;
   size_t file_prefetch_offset_ = -1;
   std::unique_ptr<uint8_t[]> buf_;
@@ -62,6 +77,7 @@ class FiberReadFile : public ReadonlyFile {
   std::atomic<ssize_t> prefetch_res_{0};
   uint8_t* prefetch_ptr_ = nullptr;
   absl::Time prefetch_start_ts_;
+  bool try_nowait_;
 };
 
 class WriteFileImpl : public WriteFile {
@@ -98,10 +114,61 @@ class WriteFileImpl : public WriteFile {
   atomic_bool has_error_{false};
 };
 
+class MappedReadFile final : public ReadonlyFile {
+ public:
+  MappedReadFile(int fd, uint8_t* base, size_t size, const MappedReadOptions& opts,
+                 FiberQueueThreadPool* tp);
+
+  ~MappedReadFile() {
+    std::ignore = Close();
+  }
+
+  SizeOrError Read(size_t offset, const iovec* v, uint32_t len) final;
+  Result<Bytes> ReadView(size_t offset, size_t len) final;
+
+  error_code Close() final;
+
+  size_t Size() const final {
+    return size_;
+  }
+
+  int Handle() const final {
+    return fd_;
+  }
+
+ private:
+  bool PrefetchActive() const {
+    return prefetch_end_ > prefetch_begin_;
+  }
+
+  // Makes sure that [offset, end) is resident and prefetches the range that follows it.
+  void Prepare(size_t offset, size_t end);
+
+  void StartPrefetch(size_t offset, size_t end);
+
+  // Waits for the active prefetch and marks its range as resident.
+  void HandleActivePrefetch();
+  void MarkResident(size_t offset, size_t end);
+
+  int fd_;
+  uint8_t* base_;
+  const size_t size_;
+  const size_t prefetch_size_;
+  const bool sequential_, drop_cache_;
+  FiberQueueThreadPool* tp_;
+  MappedReadOptions::Stats* stats_;
+
+  // The range that we populated. We do not track the evictions.
+  size_t resident_begin_ = 0, resident_end_ = 0;
+  size_t prefetch_begin_ = 0, prefetch_end_ = 0;
+  atomic_bool prefetch_done_{false};
+  Done done_;
+};
+
 /**** Implementation *********************/
 FiberReadFile::FiberReadFile(const FiberReadOptions& opts, ReadonlyFile* next,
                              FiberQueueThreadPool* tp)
-    : next_(next), tp_(tp) {
+    : next_(next), tp_(tp), try_nowait_(opts.try_nowait) {
   buf_size_ = opts.prefetch_size;
   if (buf_size_) {
     buf_.reset(new uint8_t[buf_size_]);
@@ -142,26 +209,29 @@ auto FiberReadFile::ReadAndPrefetch(size_t offset, const MutableBytes& range) ->
                  {buf_.get() + prefetch_.size(), buf_size_ - prefetch_.size()}};
 
   if (copied < range.size()) {  // We need to issue request to fill this read.
-    absl::Time start = absl::Now();
-
     DCHECK(prefetch_.empty());
 
-    ssize_t total_read = -1;
-
-    // We issue 2 read requests: to fill user buffer and our prefetch buffer.
-    tp_->Add([&] {
-      total_read = ReadAllPosix(next_->Handle(), offset, io, 2);
-      done_.Notify();
-    });
-    done_.Wait(Done::AND_RESET);
-    if (VLOG_IS_ON(1)) {
-      auto dur = absl::Now() - start;
-      tp_wait_hist_.Add(absl::ToInt64Microseconds(dur));
-    }
+    // If the user range is cached, we take whatever part of the prefetch range is cached too.
+    ssize_t total_read = TryReadCached(offset, io, 2, io[0].iov_len);
+    if (total_read < 0) {
+      absl::Time start = absl::Now();
+
+      // We issue 2 read requests: to fill user buffer and our prefetch buffer.
+      tp_->Add([&] {
+        total_read = ReadAllPosix(next_->Handle(), offset, io, 2);
+        done_.Notify();
+      });
+      done_.Wait(Done::AND_RESET);
+      if (VLOG_IS_ON(1)) {
+        auto dur = absl::Now() - start;
+        tp_wait_hist_.Add(absl::ToInt64Microseconds(dur));
+      }
 
-    if (stats_) {
-      ++stats_->preempt_cnt;
-      stats_->disk_bytes += io[0].iov_len;
+      if (stats_) {
+        ++stats_->preempt_cnt;
+        ++stats_->offload_cnt;
+        stats_->disk_bytes += io[0].iov_len;
+      }
     }
     if (total_read < 0)
       return make_unexpected(io::StatusFileError());
@@ -264,6 +334,38 @@ void FiberReadFile::HandleActivePrefetch() {
   prefetch_ptr_ = nullptr;
 }
 
+ssize_t FiberReadFile::TryReadCached(size_t offset, const iovec* v, uint32_t len, size_t need) {
+#ifdef RWF_NOWAIT
+  if (!try_nowait_)
+    return -1;
+
+  ssize_t res;
+  do {
+    res = preadv2(next_->Handle(), v, len, offset, RWF_NOWAIT);
+  } while (res < 0 && errno == EINTR);
+
+  if (res < 0) {
+    // EAGAIN means that the range is not cached. The real errors are reported by the
+    // offloaded read.
+    if (errno == EOPNOTSUPP || errno == EINVAL || errno == ENOSYS) {
+      VLOG(1) << "RWF_NOWAIT is not supported: " << strerror(errno);
+      try_nowait_ = false;
+    }
+    return -1;
+  }
+
+  // A short read stops either at EOF or at the first page that is not cached.
+  if (size_t(res) < need && offset + res < next_->Size())
+    return -1;
+
+  if (stats_)
+    ++stats_->nowait_hit_cnt;
+  return res;
+#else
+  return -1;
+#endif
+}
+
 auto FiberReadFile::Read(size_t offset, const iovec* v, uint32_t len) -> SizeOrError {
   SizeOrError res;
 
@@ -275,12 +377,21 @@ auto FiberReadFile::Read(size_t offset, const iovec* v, uint32_t len) -> SizeOrE
     return res;
   }
 
+  size_t total = 0;
+  for (uint32_t i = 0; i < len; ++i)
+    total += v[i].iov_len;
+
+  if (ssize_t cached = TryReadCached(offset, v, len, total); cached >= 0)
+    return cached;
+
   tp_->Add([&] {
     res = next_->Read(offset, v, len);
     done_.Notify();
   });
 
   done_.Wait(Done::AND_RESET);
+  if (stats_)
+    ++stats_->offload_cnt;
   VLOG(1) << "Read " << offset << "/" << res.value();
   return res;
 }
@@ -330,19 +441,220 @@ void WriteFileImpl::AsyncWrite(std::string blob) {
 }
 #endif
 
+bool OnUring() {
+#ifdef __linux__
+  ProactorBase* me = ProactorBase::me();
+  DCHECK(me) << "must be called from a proactor thread";
+  return me->GetKind() == ProactorBase::IOURING;
+#else
+  return false;
+#endif
+}
+
+// Runs the blocking call f in tp or inline if tp is null.
+template <typename F> auto Offload(FiberQueueThreadPool* tp, F&& f) -> decltype(f()) {
+  return tp ? tp->Await(std::forward<F>(f)) : f();
+}
+
+error_code ErrnoCode(int res) {
+  return res < 0 ? error_code{errno, system_category()} : error_code{};
+}
+
+// Faults in the pages of [begin, end) of the mapping. Runs in the thread pool.
+void Populate(uint8_t* base, size_t begin, size_t end) {
+  static const size_t kPageSize = sysconf(_SC_PAGESIZE);
+  begin &= ~(kPageSize - 1);
+#ifdef MADV_POPULATE_READ
+  if (madvise(base + begin, end - begin, MADV_POPULATE_READ) == 0)
+    return;
+#endif
+
+  // Before Linux 5.14: WILLNEED starts the readahead and touching the pages maps them.
+  madvise(base + begin, end - begin, MADV_WILLNEED);
+  volatile uint8_t sink = 0;
+  for (size_t i = begin; i < end; i += kPageSize)
+    sink += base[i];
+}
+
+MappedReadFile::MappedReadFile(int fd, uint8_t* base, size_t size, const MappedReadOptions& opts,
+                               FiberQueueThreadPool* tp)
+    : fd_(fd),
+      base_(base),
+      size_(size),
+      prefetch_size_(opts.prefetch_size),
+      sequential_(opts.sequential),
+      drop_cache_(opts.drop_cache_on_close),
+      tp_(tp),
+      stats_(opts.stats) {
+  if (opts.populate && size_)
+    StartPrefetch(0, size_);
+}
+
+error_code MappedReadFile::Close() {
+  if (fd_ < 0)
+    return {};
+
+  if (PrefetchActive())
+    HandleActivePrefetch();
+  if (base_) {
+    munmap(base_, size_);
+    base_ = nullptr;
+  }
+
+#ifndef __APPLE__
+  if (drop_cache_)
+    posix_fadvise(fd_, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+  int res = close(fd_);
+  fd_ = -1;
+  return ErrnoCode(res);
+}
+
+auto MappedReadFile::Read(size_t offset, const iovec* v, uint32_t len) -> SizeOrError {
+  if (offset > size_)
+    return make_unexpected(make_error_code(errc::argument_out_of_domain));
+
+  size_t total = 0;
+  for (uint32_t i = 0; i < len; ++i)
+    total += v[i].iov_len;
+  size_t end = offset + min(total, size_ - offset);
+  if (end == offset)
+    return 0;
+
+  Prepare(offset, end);
+  const uint8_t* src = base_ + offset;
+  for (uint32_t i = 0; i < len && src < base_ + end; ++i) {
+    size_t sz = min<size_t>(v[i].iov_len, base_ + end - src);
+    memcpy(v[i].iov_base, src, sz);
+    src += sz;
+  }
+  return end - offset;
+}
+
+auto MappedReadFile::ReadView(size_t offset, size_t len) -> Result<Bytes> {
+  if (offset > size_)
+    return make_unexpected(make_error_code(errc::argument_out_of_domain));
+
+  len = min(len, size_ - offset);
+  if (len)
+    Prepare(offset, offset + len);
+  return Bytes{base_ + offset, len};
+}
+
+void MappedReadFile::Prepare(size_t offset, size_t end) {
+  if (PrefetchActive() && (prefetch_done_.load(memory_order_acquire) ||
+                           (offset < prefetch_end_ && end > prefetch_begin_))) {
+    HandleActivePrefetch();
+  }
+
+  if (offset < resident_begin_ || end > resident_end_) {
+    // Otherwise we would page-fault in the proactor thread.
+    tp_->Await([&] { Populate(base_, offset, end); });
+    if (stats_)
+      stats_->sync_bytes += end - offset;
+    MarkResident(offset, end);
+  }
+
+  if (sequential_ && !PrefetchActive() && resident_end_ < size_ &&
+      resident_end_ - end < prefetch_size_ / 2) {
+    StartPrefetch(resident_end_, min(size_, resident_end_ + prefetch_size_));
+  }
+}
+
+void MappedReadFile::StartPrefetch(size_t offset, size_t end) {
+  prefetch_begin_ = offset;
+  prefetch_end_ = end;
+  if (stats_)
+    ++stats_->prefetch_cnt;
+
+  // Close waits for the prefetch, hence the task may reference this.
+  tp_->Add([this, offset, end] {
+    Populate(base_, offset, end);
+    prefetch_done_.store(true, memory_order_release);
+    done_.Notify();
+  });
+}
+
+void MappedReadFile::HandleActivePrefetch() {
+  done_.Wait(Done::AND_RESET);
+  prefetch_done_.store(false, memory_order_relaxed);
+  MarkResident(prefetch_begin_, prefetch_end_);
+  if (stats_)
+    stats_->prefetch_bytes += prefetch_end_ - prefetch_begin_;
+  prefetch_begin_ = prefetch_end_ = 0;
+}
+
+void MappedReadFile::MarkResident(size_t offset, size_t end) {
+  if (offset <= resident_end_ && end >= resident_begin_) {
+    resident_begin_ = min(resident_begin_, offset);
+    resident_end_ = max(resident_end_, end);
+  } else {
+    resident_begin_ = offset;
+    resident_end_ = end;
+  }
+}
+
+#ifdef __linux__
+constexpr unsigned kStatxMask = STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME;
+
+StatShort FromStatx(string path, const struct statx& stx) {
+  time_t ns = stx.stx_mtime.tv_sec * 1000000000ULL + stx.stx_mtime.tv_nsec;
+  return StatShort{std::move(path), ns, stx.stx_size, mode_t(stx.stx_mode)};
+}
+#endif
+
+StatShort FromStat(string path, const struct stat& sb) {
+#if defined(__APPLE__) || defined(__FreeBSD__)
+  const auto& st_mt = sb.st_mtimespec;
+#else
+  const auto& st_mt = sb.st_mtim;
+#endif
+  time_t ns = st_mt.tv_sec * 1000000000ULL + st_mt.tv_nsec;
+  return StatShort{std::move(path), ns, uint64_t(sb.st_size), sb.st_mode};
+}
+
 }  // namespace
 
 ReadonlyFileOrError OpenFiberReadFile(std::string_view name, FiberQueueThreadPool* tp,
                                       const FiberReadOptions& opts) {
-  ReadonlyFileOrError res = OpenRead(name, opts);
+  ReadonlyFileOrError res = io::OpenRead(name, opts);
   if (!res)
     return res;
   return new FiberReadFile(opts, res.value(), tp);
 }
 
+ReadonlyFileOrError OpenFiberMappedFile(std::string_view name, FiberQueueThreadPool* tp,
+                                        const MappedReadOptions& opts) {
+  int fd = open(string(name).c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return make_unexpected(io::StatusFileError());
+
+  struct stat sb;
+  if (fstat(fd, &sb) < 0) {
+    error_code ec = io::StatusFileError();
+    close(fd);
+    return make_unexpected(ec);
+  }
+
+  // mmap fails on empty files.
+  size_t size = sb.st_size;
+  uint8_t* base = nullptr;
+  if (size) {
+    void* ptr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED) {
+      error_code ec = io::StatusFileError();
+      close(fd);
+      return make_unexpected(ec);
+    }
+    madvise(ptr, size, opts.sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+    base = reinterpret_cast<uint8_t*>(ptr);
+  }
+  return new MappedReadFile(fd, base, size, opts, tp);
+}
+
 WriteFileOrError OpenFiberWriteFile(std::string_view name, FiberQueueThreadPool* tp,
                                     const FiberWriteOptions& opts) {
-  WriteFileOrError res = OpenWrite(name, opts);
+  WriteFileOrError res = io::OpenWrite(name, opts);
   if (!res)
     return res;
 
@@ -352,4 +664,111 @@ WriteFileOrError OpenFiberWriteFile(std::string_view name, FiberQueueThreadPool*
   return new WriteFileImpl(res.value(), hash, tp);
 }
 
+Result<int> FiberOpen(std::string_view path, FiberQueueThreadPool* tp, int flags, mode_t mode) {
+#ifdef __linux__
+  if (OnUring())
+    return fb2::OpenAt(AT_FDCWD, path, flags, mode);
+#endif
+  string cpath(path);
+  return Offload(tp, [&]() -> Result<int> {
+    int fd = open(cpath.c_str(), flags, mode);
+    if (fd < 0)
+      return make_unexpected(error_code{errno, system_category()});
+    return fd;
+  });
+}
+
+Result<StatShort> FiberStat(std::string_view path, FiberQueueThreadPool* tp) {
+#ifdef __linux__
+  if (OnUring()) {
+    struct statx stx;
+    if (error_code ec = fb2::Statx(AT_FDCWD, path, 0, kStatxMask, &stx); ec)
+      return make_unexpected(ec);
+    return FromStatx(string(path), stx);
+  }
+#endif
+  string cpath(path);
+  return Offload(tp, [&]() -> Result<StatShort> {
+    struct stat sb;
+    if (stat(cpath.c_str(), &sb) < 0)
+      return make_unexpected(error_code{errno, system_category()});
+    return FromStat(std::move(cpath), sb);
+  });
+}
+
+error_code FiberUnlink(std::string_view path, FiberQueueThreadPool* tp, int flags) {
+#ifdef __linux__
+  if (OnUring())
+    return fb2::UnlinkAt(AT_FDCWD, path, flags);
+#endif
+  string cpath(path);
+  return Offload(tp, [&] { return ErrnoCode(unlinkat(AT_FDCWD, cpath.c_str(), flags)); });
+}
+
+error_code FiberRename(std::string_view from, std::string_view to, FiberQueueThreadPool* tp) {
+#ifdef __linux__
+  if (OnUring())
+    return fb2::RenameAt(AT_FDCWD, from, AT_FDCWD, to);
+#endif
+  string cfrom(from), cto(to);
+  return Offload(tp, [&] { return ErrnoCode(rename(cfrom.c_str(), cto.c_str())); });
+}
+
+error_code FiberStatFiles(std::string_view glob, FiberQueueThreadPool* tp, const StatShortCb& cb,
+                          unsigned max_in_flight) {
+  string pattern(glob);
+
+  // glob reads the directories, which is cheap relative to stating every file.
+  Result<vector<string>> paths = Offload(tp, [&] { return ExpandGlob(pattern); });
+  if (!paths)
+    return paths.error();
+
+#ifdef __linux__
+  if (OnUring()) {
+    fb2::StatxMany(*paths, 0, kStatxMask, max_in_flight,
+                   [&](size_t index, int res, const struct statx& stx) {
+                     string& path = (*paths)[index];
+                     if (res == 0) {
+                       cb(FromStatx(std::move(path), stx));
+                     } else {
+                       LOG(WARNING) << "Bad stat for " << path << " " << strerror(-res);
+                     }
+                   });
+    return {};
+  }
+#endif
+
+  size_t chunk = std::max(max_in_flight, 1u);
+  vector<StatShort> stats;
+  for (size_t start = 0; start < paths->size(); start += chunk) {
+    size_t end = std::min(paths->size(), start + chunk);
+    Offload(tp, [&] {
+      struct stat sb;
+      for (size_t i = start; i < end; ++i) {
+        string& path = (*paths)[i];
+        if (stat(path.c_str(), &sb) == 0) {
+          stats.push_back(FromStat(std::move(path), sb));
+        } else {
+          LOG(WARNING) << "Bad stat for " << path << " " << strerror(errno);
+        }
+      }
+    });
+    for (StatShort& st : stats)
+      cb(std::move(st));
+    stats.clear();
+  }
+  return {};
+}
+
+Result<StatShortVec> FiberStatFiles(std::string_view glob, FiberQueueThreadPool* tp) {
+  StatShortVec res;
+  error_code ec = FiberStatFiles(glob, tp, [&](StatShort st) { res.push_back(std::move(st)); });
+  if (ec)
+    return make_unexpected(ec);
+
+  sort(res.begin(), res.end(),
+       [](const StatShort& a, const StatShort& b) { return a.name < b.name; });
+  return res;
+}
+
 }  // namespace util
@@ -2,7 +2,10 @@
 // See LICENSE for licensing terms.
 //
 
+#include <functional>
+
 #include "io/file.h"
+#include "io/file_util.h"
 #include "util/fibers/fiberqueue_threadpool.h"
 
 namespace util {
@@ -10,17 +13,24 @@ namespace util {
 namespace fb_namesp = fb2;
 
 // Fiber-friendly file handler. Returns ReadonlyFile* instance that does not block the current
-// thread unlike the regular posix implementation. All the read opearations will run
-// in FiberQueueThreadPool.
+// thread unlike the regular posix implementation. The read operations that can not be served
+// from the page cache run in FiberQueueThreadPool.
 struct FiberReadOptions : public io::ReadonlyFile::Options {
   struct Stats {
     size_t cache_bytes = 0;  // read because of prefetch logic.
     size_t disk_bytes = 0;   // read via  ThreadPool calls.
     size_t read_prefetch_cnt = 0;
     size_t preempt_cnt = 0;
+    size_t nowait_hit_cnt = 0;  // reads served inline from the page cache.
+    size_t offload_cnt = 0;     // reads that ran in the thread pool.
   };
 
   size_t prefetch_size = 1 << 16;  // 65K
+
+  // Reads first try preadv2(RWF_NOWAIT) in the calling thread and are offloaded to the thread
+  // pool only if the range is not in the page cache. Saves two thread hops for cached files.
+  // Disabled automatically if the kernel or the filesystem does not support RWF_NOWAIT.
+  bool try_nowait = true;
   Stats* stats = nullptr;
 };
 
@@ -28,6 +38,29 @@ ABSL_MUST_USE_RESULT io::ReadonlyFileOrError OpenFiberReadFile(
     std::string_view name, fb_namesp::FiberQueueThreadPool* tp,
     const FiberReadOptions& opts = FiberReadOptions{});
 
+// Memory-mapped file. Read() copies from the mapped pages and ReadView() returns them without
+// copying. The pages are faulted in by the threads of tp, so neither the reads nor the
+// accesses to the returned views page-fault in the proactor thread as long as the pages stay
+// resident. The range that is accessed is populated synchronously unless it is already resident,
+// and with the sequential hint the following prefetch_size bytes are populated in background.
+struct MappedReadOptions : public io::ReadonlyFile::Options {
+  struct Stats {
+    size_t sync_bytes = 0;      // populated while the reader waited.
+    size_t prefetch_bytes = 0;  // populated in background.
+    size_t prefetch_cnt = 0;
+  };
+
+  size_t prefetch_size = 1 << 20;
+
+  // Populates the whole file in background upon open, e.g. for index files.
+  bool populate = false;
+  Stats* stats = nullptr;
+};
+
+ABSL_MUST_USE_RESULT io::ReadonlyFileOrError OpenFiberMappedFile(
+    std::string_view name, fb_namesp::FiberQueueThreadPool* tp,
+    const MappedReadOptions& opts = MappedReadOptions{});
+
 struct FiberWriteOptions : public io::WriteFile::Options {
   bool consistent_thread = true;  // whether to send the write request to the thread in the pool.
 };
@@ -36,4 +69,31 @@ ABSL_MUST_USE_RESULT io::Result<io::WriteFile*> OpenFiberWriteFile(
     std::string_view name, fb_namesp::FiberQueueThreadPool* tp,
     const FiberWriteOptions& opts = FiberWriteOptions());
 
+// Fiber-friendly metadata calls. On io_uring proactors they are submitted as
+// IORING_OP_OPENAT/STATX/UNLINKAT/RENAMEAT and suspend only the calling fiber. Otherwise, the
+// blocking syscalls run in tp, or in the calling thread if tp is null.
+// Must be called from a proactor thread. FiberOpen returns the file descriptor.
+io::Result<int> FiberOpen(std::string_view path, fb_namesp::FiberQueueThreadPool* tp, int flags,
+                          mode_t mode = 0644);
+io::Result<io::StatShort> FiberStat(std::string_view path, fb_namesp::FiberQueueThreadPool* tp);
+
+// flags can be AT_REMOVEDIR to remove a directory.
+std::error_code FiberUnlink(std::string_view path, fb_namesp::FiberQueueThreadPool* tp,
+                            int flags = 0);
+std::error_code FiberRename(std::string_view from, std::string_view to,
+                            fb_namesp::FiberQueueThreadPool* tp);
+
+// Same as io::StatFiles but on io_uring the matched files are stated concurrently, hence
+// a glob over thousands of files does not block the proactor thread. Sorted by name.
+io::Result<io::StatShortVec> FiberStatFiles(std::string_view glob,
+                                            fb_namesp::FiberQueueThreadPool* tp);
+
+// Streaming version for globs that match very many files. Passes the stats to cb in the
+// calling fiber as they complete, in no particular order, with up to max_in_flight stats
+// in flight. Without io_uring, the stats run in tp in chunks of max_in_flight files.
+// The files that fail to stat are skipped.
+using StatShortCb = std::function<void(io::StatShort)>;
+std::error_code FiberStatFiles(std::string_view glob, fb_namesp::FiberQueueThreadPool* tp,
+                               const StatShortCb& cb, unsigned max_in_flight = 256);
+
 }  // namespace util
@@ -0,0 +1,75 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/fibers/fiber_group.h"
+
+#include <algorithm>
+#include <mutex>
+
+#include "base/logging.h"
+#include "util/fiber_socket_base.h"
+
+namespace util {
+namespace fb2 {
+
+using namespace std;
+
+CancellationToken::CancellationToken() : state_(make_shared<State>()) {
+}
+
+void CancellationToken::Cancel() {
+  lock_guard lk(state_->mu);
+  if (state_->cancelled.exchange(true, memory_order_acq_rel))
+    return;
+
+  for (Registration* reg : state_->regs)
+    reg->cb_();
+}
+
+CancellationToken::Registration::Registration(const CancellationToken& token,
+                                              std::function<void()> cb)
+    : state_(token.state_), cb_(std::move(cb)) {
+  unique_lock lk(state_->mu);
+  if (state_->cancelled.load(memory_order_relaxed)) {
+    lk.unlock();
+    cb_();
+    state_.reset();
+    return;
+  }
+  state_->regs.push_back(this);
+}
+
+CancellationToken::Registration::~Registration() {
+  if (!state_)
+    return;
+
+  // Waits for the callback if the token is being cancelled right now.
+  lock_guard lk(state_->mu);
+  auto it = find(state_->regs.begin(), state_->regs.end(), this);
+  DCHECK(it != state_->regs.end());
+  state_->regs.erase(it);
+}
+
+CancelIoGuard::CancelIoGuard(const CancellationToken& token, FiberSocketBase* sock)
+    : reg_(token, [sock] { sock->proactor()->AwaitBrief([sock] { sock->CancelPendingIo(); }); }) {
+}
+
+FiberGroup::FiberGroup(const CancellationToken& parent) {
+  parent_reg_.emplace(parent, [this] { token_.Cancel(); });
+}
+
+FiberGroup::~FiberGroup() {
+  if (any_of(fibers_.begin(), fibers_.end(), [](const Fiber& fb) { return fb.IsJoinable(); }))
+    Cancel();
+  Join();
+}
+
+void FiberGroup::Join() {
+  for (auto& fb : fibers_)
+    fb.JoinIfNeeded();
+  fibers_.clear();
+}
+
+}  // namespace fb2
+}  // namespace util
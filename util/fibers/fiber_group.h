@@ -0,0 +1,184 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include "base/logging.h"
+#include "util/fibers/future.h"
+#include "util/fibers/proactor_base.h"
+#include "util/fibers/synchronization.h"
+
+namespace util {
+
+class FiberSocketBase;
+
+namespace fb2 {
+
+// Cooperative cancellation flag. Copies share the same state. The cancelled code either
+// polls IsCancelled or registers callbacks that interrupt its blocking operations.
+class CancellationToken {
+  struct State;
+
+ public:
+  CancellationToken();
+
+  bool IsCancelled() const {
+    return state_->cancelled.load(std::memory_order_acquire);
+  }
+
+  // Cancels the token and runs the registered callbacks. Only the first call has an effect.
+  // Must be called from a fiber.
+  void Cancel();
+
+  // Runs cb once the token is cancelled, for as long as the registration lives, or
+  // immediately if the token has already been cancelled. cb runs in the fiber that cancels
+  // the token while holding a fiber mutex of the token. Therefore cb may fiber-block, but
+  // must not create or destroy registrations for the same token.
+  class Registration {
+    Registration(const Registration&) = delete;
+    void operator=(const Registration&) = delete;
+
+   public:
+    Registration(const CancellationToken& token, std::function<void()> cb);
+    ~Registration();
+
+   private:
+    friend class CancellationToken;
+
+    std::shared_ptr<State> state_;
+    std::function<void()> cb_;
+  };
+
+ private:
+  struct State {
+    std::atomic_bool cancelled{false};
+    Mutex mu;
+    std::vector<Registration*> regs;
+  };
+
+  std::shared_ptr<State> state_;
+};
+
+// Cancels the I/O that is pending on sock when token is cancelled, see
+// FiberSocketBase::CancelPendingIo. The I/O that starts after the cancellation is not
+// affected, so the guarded code should check IsCancelled between operations.
+// sock must outlive the guard.
+class CancelIoGuard {
+ public:
+  CancelIoGuard(const CancellationToken& token, FiberSocketBase* sock);
+
+ private:
+  CancellationToken::Registration reg_;
+};
+
+// Structured concurrency scope: runs fibers that share a cancellation token and makes sure
+// that they finish before the scope ends.
+// Not thread-safe, Spawn and Join should be called from the same fiber.
+class FiberGroup {
+  FiberGroup(const FiberGroup&) = delete;
+  void operator=(const FiberGroup&) = delete;
+
+ public:
+  FiberGroup() = default;
+
+  // The group is cancelled together with parent.
+  explicit FiberGroup(const CancellationToken& parent);
+
+  // Cancels the fibers that are still running and joins them.
+  ~FiberGroup();
+
+  // Runs f(const CancellationToken&) in a fiber of the calling thread.
+  template <typename F> void Spawn(F&& f) {
+    fibers_.emplace_back(Wrap(std::forward<F>(f)));
+  }
+
+  // Runs f(const CancellationToken&) in a fiber of proactor p.
+  template <typename F> void Spawn(ProactorBase* p, F&& f) {
+    fibers_.push_back(p->LaunchFiber(Wrap(std::forward<F>(f))));
+  }
+
+  void Cancel() {
+    token_.Cancel();
+  }
+
+  // Waits for all the spawned fibers to finish.
+  void Join();
+
+  const CancellationToken& token() const {
+    return token_;
+  }
+
+ private:
+  template <typename F> auto Wrap(F&& f) {
+    return [f = std::forward<F>(f), token = token_]() mutable { f(token); };
+  }
+
+  CancellationToken token_;
+  std::vector<Fiber> fibers_;
+  std::optional<CancellationToken::Registration> parent_reg_;
+};
+
+template <typename R> using CancellableTask = std::function<R(const CancellationToken&)>;
+
+// Waits for all the futures and returns their values in order.
+template <typename T> std::vector<T> WhenAll(std::vector<Future<T>> futures) {
+  std::vector<T> res;
+  res.reserve(futures.size());
+  for (auto& future : futures)
+    res.push_back(future.Get());
+  return res;
+}
+
+// Runs the tasks concurrently in fibers of the calling thread and returns their results
+// in order. The tasks are cancelled together with parent.
+template <typename R>
+std::vector<R> WhenAll(std::vector<CancellableTask<R>> tasks,
+                       const CancellationToken& parent = CancellationToken{}) {
+  std::vector<Future<R>> futures(tasks.size());
+  {
+    FiberGroup group(parent);
+    for (size_t i = 0; i < tasks.size(); ++i) {
+      group.Spawn([task = std::move(tasks[i]), future = futures[i]](
+                      const CancellationToken& token) mutable { future.Resolve(task(token)); });
+    }
+    group.Join();
+  }
+  return WhenAll(std::move(futures));
+}
+
+// Runs the tasks concurrently in fibers of the calling thread. Returns the index and the
+// result of the first task to finish, e.g. of the fastest replica for hedged requests.
+// Then cancels the other tasks and waits for them, so that their resources are released
+// before returning.
+template <typename R>
+std::pair<size_t, R> WhenAny(std::vector<CancellableTask<R>> tasks,
+                             const CancellationToken& parent = CancellationToken{}) {
+  DCHECK(!tasks.empty());
+  Future<std::pair<size_t, R>> first;
+  bool done = false;
+
+  FiberGroup group(parent);
+  for (size_t i = 0; i < tasks.size(); ++i) {
+    group.Spawn([&, i](const CancellationToken& token) {
+      R res = tasks[i](token);
+      if (!done) {
+        done = true;
+        first.Resolve({i, std::move(res)});
+        group.Cancel();
+      }
+    });
+  }
+
+  auto res = first.Get();
+  group.Join();
+  return res;
+}
+
+}  // namespace fb2
+}  // namespace util
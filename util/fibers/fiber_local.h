@@ -0,0 +1,80 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include "base/pmr/arena.h"
+#include "util/fibers/detail/fiber_interface.h"
+
+namespace util {
+namespace fb2 {
+
+// Fiber-local variable. Each fiber has its own instance of T which is default constructed
+// upon the first access and destroyed when the fiber terminates. The values are kept
+// inside the fiber, so they are moved with it by Migrate and by work stealing, unlike
+// thread_local variables. Access is an indexed load from the active fiber.
+// FiberLocal instances reserve slots that are never released and there can be at most
+// detail::kMaxFiberLocals of them, so they should be static, for example:
+//   static FiberLocal<TraceContext> trace_ctx;
+template <typename T> class FiberLocal {
+  FiberLocal(const FiberLocal&) = delete;
+  void operator=(const FiberLocal&) = delete;
+
+ public:
+  FiberLocal() : slot_(detail::AllocateFiberLocalSlot(&Destroy)) {
+  }
+
+  // Returns the value of the active fiber.
+  T* get() {
+    detail::FiberInterface* fi = detail::FiberActive();
+    void* val = fi->GetLocal(slot_);
+    if (!val) {
+      val = new T();
+      fi->SetLocal(slot_, val);
+    }
+    return static_cast<T*>(val);
+  }
+
+  T* operator->() {
+    return get();
+  }
+
+  T& operator*() {
+    return *get();
+  }
+
+  // Returns nullptr if the active fiber has not accessed its value yet.
+  T* GetIfExists() const {
+    return static_cast<T*>(detail::FiberActive()->GetLocal(slot_));
+  }
+
+  // Destroys the value of the active fiber.
+  void reset() {
+    detail::FiberInterface* fi = detail::FiberActive();
+    if (void* val = fi->GetLocal(slot_)) {
+      fi->SetLocal(slot_, nullptr);
+      Destroy(val);
+    }
+  }
+
+ private:
+  static void Destroy(void* val) {
+    delete static_cast<T*>(val);
+  }
+
+  unsigned slot_;
+};
+
+}  // namespace fb2
+
+namespace ThisFiber {
+
+// Scratch arena of the calling fiber, e.g. for per-request allocations. It is created on
+// first access and all its memory is released when the fiber terminates.
+inline base::PmrArena* Arena() {
+  return fb2::detail::FiberActive()->arena();
+}
+
+}  // namespace ThisFiber
+}  // namespace util
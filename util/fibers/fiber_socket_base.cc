@@ -5,12 +5,30 @@
 #include "util/fiber_socket_base.h"
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <netinet/udp.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#endif
 
 #include <boost/fiber/context.hpp>
 
 #include "base/logging.h"
 #include "base/stl_util.h"
+#include "util/fibers/detail/fiber_interface.h"
+#include "util/fibers/proactor_base.h"
+#include "util/fibers/synchronization.h"
 
 #define VSOCK(verbosity) VLOG(verbosity) << "sock[" << native_handle() << "] "
 #define DVSOCK(verbosity) DVLOG(verbosity) << "sock[" << native_handle() << "] "
@@ -31,12 +49,67 @@ inline ssize_t posix_err_wrap(ssize_t res, FiberSocketBase::error_code* ec) {
   return res;
 }
 
+thread_local SocketTimestampStats tl_timestamp_stats;
+
+inline uint64_t ToNsec(const timespec& ts) {
+  return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// The timestamps are in CLOCK_REALTIME.
+uint64_t RealtimeNs() {
+  timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ToNsec(ts);
+}
+
+// Records the delay between the timestamps from and to, if it is not negative due to
+// clock adjustments.
+void AddDelay(uint64_t from, uint64_t to, fb2::CycleHistogram SocketTimestampStats::*hist,
+              SocketTimestampStats* stats) {
+  if (to < from)
+    return;
+  uint64_t cycles = (to - from) * fb2::CycleClock::FrequencyUsec() / 1000;
+  (stats->*hist).Add(cycles);
+  (tl_timestamp_stats.*hist).Add(cycles);
+}
+
 }  // namespace
 
+const SocketTimestampStats& ThreadSocketTimestampStats() {
+  return tl_timestamp_stats;
+}
+
+struct FiberSocketBase::Cork {
+  size_t limit = 0;
+  std::string pending;    // coalesced writes that have not been sent yet.
+  std::string in_flight;  // data of the current async send.
+  error_code ec;          // sticky error of the deferred sends.
+  bool scheduled = false;
+  bool sending = false;
+
+  // The fiber that currently writes the coalesced data synchronously.
+  fb2::detail::FiberInterface* flusher = nullptr;
+  fb2::EventCount sent_ec;
+};
+
+FiberSocketBase::FiberSocketBase(fb2::ProactorBase* pb) : proactor_(pb) {
+}
+
+FiberSocketBase::~FiberSocketBase() {
+  if (cork_) {
+    DCHECK(!cork_->sending);
+    if (cork_->scheduled)
+      proactor_->CancelCorkFlush(this);
+  }
+}
+
 void FiberSocketBase::SetProactor(ProactorBase* p) {
   if (p == proactor_)
     return;
 
+  DCHECK(!cork_ || (!cork_->scheduled && !cork_->sending))
+      << "Coalesced writes must be flushed before migrating the socket";
+
   if (proactor_) {  // migration path
     OnResetProactor();
     proactor_ = nullptr;
@@ -57,6 +130,203 @@ Result<size_t> FiberSocketBase::Recv(const iovec* ptr, size_t len) {
   return RecvMsg(msg, 0);
 }
 
+Result<unsigned> FiberSocketBase::RecvProvided(unsigned max_bufs, ProvidedBuffer* dest) {
+  return nonstd::make_unexpected(make_error_code(errc::operation_not_supported));
+}
+
+void FiberSocketBase::ReturnProvided(const ProvidedBuffer& pbuf) {
+  LOG(DFATAL) << "ReturnProvided is not supported by this socket";
+}
+
+auto FiberSocketBase::EnableAcceptMultishot(unsigned max_queued) -> error_code {
+  return make_error_code(errc::operation_not_supported);
+}
+
+auto FiberSocketBase::WaitReadable() -> error_code {
+  uint8_t byte;
+  Result<size_t> res = Recv(io::MutableBytes{&byte, 1}, MSG_PEEK);
+  return res ? error_code{} : res.error();
+}
+
+void FiberSocketBase::CancelPendingIo() {
+  std::ignore = Shutdown(SHUT_RDWR);
+}
+
+auto FiberSocketBase::EnableZeroCopySend(size_t threshold) -> error_code {
+  return make_error_code(errc::operation_not_supported);
+}
+
+Result<size_t> FiberSocketBase::SendFile(int fd, off_t offset, size_t len) {
+  constexpr size_t kBufSize = 1 << 16;
+  unique_ptr<uint8_t[]> buf(new uint8_t[std::min(len, kBufSize)]);
+
+  size_t sent = 0;
+  while (sent < len) {
+    ssize_t res = pread(fd, buf.get(), std::min(len - sent, kBufSize), offset + sent);
+    if (res < 0) {
+      if (errno == EINTR)
+        continue;
+      return nonstd::make_unexpected(error_code(errno, system_category()));
+    }
+    if (res == 0)  // end of file.
+      break;
+
+    error_code ec = Write(io::Bytes(buf.get(), res));
+    if (ec)
+      return nonstd::make_unexpected(ec);
+    sent += res;
+  }
+  return sent;
+}
+
+#ifdef __linux__
+Result<unsigned> FiberSocketBase::RecvMMsg(mmsghdr* msgs, unsigned len) {
+  return nonstd::make_unexpected(make_error_code(errc::operation_not_supported));
+}
+
+Result<unsigned> FiberSocketBase::SendMMsg(mmsghdr* msgs, unsigned len) {
+  return nonstd::make_unexpected(make_error_code(errc::operation_not_supported));
+}
+#endif
+
+auto FiberSocketBase::SetWriteCoalescing(size_t limit) -> error_code {
+  if (limit == 0) {
+    if (!cork_)
+      return {};
+    error_code ec = FlushInternal();
+    ResetCork();
+    return ec;
+  }
+
+  if (!cork_)
+    cork_.reset(new Cork);
+  cork_->limit = limit;
+  return {};
+}
+
+auto FiberSocketBase::Flush() -> error_code {
+  return cork_ ? FlushInternal() : error_code{};
+}
+
+void FiberSocketBase::ResetCork() {
+  if (!cork_)
+    return;
+
+  error_code ec = FlushInternal();
+  VLOG_IF(1, ec) << "Error flushing coalesced writes " << ec;
+  if (cork_->scheduled)
+    proactor_->CancelCorkFlush(this);
+  cork_.reset();
+}
+
+bool FiberSocketBase::CorkWriteInternal(const iovec* v, uint32_t len, Result<size_t>* res) {
+  Cork* cork = cork_.get();
+  if (cork->flusher && cork->flusher == fb2::detail::FiberActive())
+    return false;  // The write of the coalesced data itself.
+
+  if (cork->ec) {
+    *res = nonstd::make_unexpected(cork->ec);
+    return true;
+  }
+
+  size_t total = 0;
+  for (uint32_t i = 0; i < len; ++i) {
+    total += v[i].iov_len;
+  }
+
+  if (cork->pending.size() + total > cork->limit) {
+    error_code ec = FlushInternal();
+    if (ec) {
+      *res = nonstd::make_unexpected(ec);
+      return true;
+    }
+
+    // Large writes gain nothing from copying.
+    if (total > cork->limit)
+      return false;
+  }
+
+  for (uint32_t i = 0; i < len; ++i) {
+    cork->pending.append(reinterpret_cast<const char*>(v[i].iov_base), v[i].iov_len);
+  }
+  ScheduleCorkFlush();
+  *res = total;
+  return true;
+}
+
+auto FiberSocketBase::FlushInternal() -> error_code {
+  Cork* cork = cork_.get();
+
+  // Wait for the previous sends, to preserve the order of the data.
+  cork->sent_ec.await([cork] { return !cork->sending; });
+
+  if (!cork->ec && !cork->pending.empty()) {
+    std::string data;
+    data.swap(cork->pending);
+
+    cork->sending = true;
+    cork->flusher = fb2::detail::FiberActive();
+    cork->ec = Write(io::Buffer(data));
+    cork->flusher = nullptr;
+    cork->sending = false;
+    cork->sent_ec.notifyAll();
+
+    // Other fibers could have written while we were blocked.
+    if (!cork->pending.empty())
+      ScheduleCorkFlush();
+  }
+
+  return cork->ec;
+}
+
+void FiberSocketBase::ScheduleCorkFlush() {
+  if (!cork_->scheduled) {
+    cork_->scheduled = true;
+    proactor_->ScheduleCorkFlush(this);
+  }
+}
+
+// Called from the proactor loop, hence must not block.
+void FiberSocketBase::FlushCorkAsync() {
+  Cork* cork = cork_.get();
+  cork->scheduled = false;
+  if (cork->sending || cork->ec || cork->pending.empty())
+    return;
+
+  if (!HasAsyncWriteSome()) {
+    ssize_t res = ::send(native_handle(), cork->pending.data(), cork->pending.size(),
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (res >= 0) {
+      cork->pending.erase(0, res);
+    } else if (errno != EAGAIN && errno != EINTR) {
+      cork->ec = error_code(errno == EPIPE ? ECONNABORTED : errno, system_category());
+      return;
+    }
+
+    // The socket buffer is full, retry on the next loop iteration.
+    if (!cork->pending.empty())
+      ScheduleCorkFlush();
+    return;
+  }
+
+  cork->in_flight.swap(cork->pending);
+  cork->sending = true;
+  AsyncWrite(io::Buffer(cork->in_flight), [this](error_code ec) {
+    Cork* cork = cork_.get();
+    cork->in_flight.clear();
+    cork->sending = false;
+    if (ec)
+      cork->ec = ec;
+    cork->sent_ec.notifyAll();
+    if (!cork->ec && !cork->pending.empty())
+      ScheduleCorkFlush();
+  });
+}
+
+LinuxSocketBase::LinuxSocketBase(int fd, ProactorBase* pb)
+    : FiberSocketBase(pb), fd_(fd > 0 ? fd << kFdShift : fd) {
+}
+
 LinuxSocketBase::~LinuxSocketBase() {
   int fd = native_handle();
 
@@ -69,14 +339,184 @@ LinuxSocketBase::~LinuxSocketBase() {
   }
 }
 
+struct LinuxSocketBase::TimestampState {
+  SocketTimestampStats stats;
+  uint64_t bytes_sent = 0;  // since the tx timestamps were enabled.
+
+  // The sampled write: its start time, 0 if none, and the id of its last byte.
+  uint64_t tx_start = 0;
+  uint32_t tx_id = 0;
+};
+
+auto LinuxSocketBase::EnableTimestamping(uint8_t flags) -> error_code {
+#ifdef __linux__
+  int val = 0;
+  if (flags & TS_RX_SOFTWARE)
+    val |= SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+  if (flags & TS_RX_HARDWARE)
+    val |= SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+  if (flags & TS_TX_SOFTWARE) {
+    // OPT_ID identifies the stamped data by its offset, OPT_TSONLY omits the data itself.
+    val |= SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_ID |
+           SOF_TIMESTAMPING_OPT_TSONLY;
+  }
+
+  error_code ec;
+  posix_err_wrap(setsockopt(native_handle(), SOL_SOCKET, SO_TIMESTAMPING, &val, sizeof(val)),
+                 &ec);
+  if (ec)
+    return ec;
+
+  if (flags == 0) {
+    ts_.reset();
+  } else if (!ts_) {
+    ts_.reset(new TimestampState);
+  } else if ((flags & TS_TX_SOFTWARE) && !(ts_flags_ & TS_TX_SOFTWARE)) {
+    // The ids of the sent data start at 0 when OPT_ID is set on a socket that did not have it.
+    ts_->bytes_sent = 0;
+    ts_->tx_start = 0;
+  }
+  ts_flags_ = flags;
+  return ec;
+#else
+  return make_error_code(errc::operation_not_supported);
+#endif
+}
+
+const SocketTimestampStats* LinuxSocketBase::timestamp_stats() const {
+  return ts_ ? &ts_->stats : nullptr;
+}
+
+uint64_t LinuxSocketBase::TxStartInternal() const {
+  return (ts_flags_ & TS_TX_SOFTWARE) && ts_->tx_start == 0 ? RealtimeNs() : 0;
+}
+
+void LinuxSocketBase::OnSentInternal(uint64_t tx_start, size_t bytes) {
+  if ((ts_flags_ & TS_TX_SOFTWARE) == 0 || bytes == 0)
+    return;
+
+  ts_->bytes_sent += bytes;
+  if (tx_start && ts_->tx_start == 0) {
+    ts_->tx_start = tx_start;
+    ts_->tx_id = ts_->bytes_sent - 1;
+  }
+
+#ifdef __linux__
+  // The timestamp of the sampled write usually arrives during the write itself or by the time
+  // of the next one.
+  if (ts_->tx_start)
+    DrainErrorQueue();
+#endif
+}
+
+void LinuxSocketBase::OnRecvInternal(const msghdr& msg) {
+#ifdef __linux__
+  if (!HasRxTimestamps() || msg.msg_controllen == 0)
+    return;
+
+  for (const cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+       cmsg = CMSG_NXTHDR(const_cast<msghdr*>(&msg), const_cast<cmsghdr*>(cmsg))) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPING)
+      continue;
+
+    // ts[0] is the software timestamp and ts[2] is the hardware one.
+    timespec ts[3];
+    memcpy(ts, CMSG_DATA(cmsg), sizeof(ts));
+    uint64_t sw = ToNsec(ts[0]), hw = ToNsec(ts[2]);
+    uint64_t now = RealtimeNs();
+    if (sw) {
+      AddDelay(sw, now, &SocketTimestampStats::rx_wakeup, &ts_->stats);
+      if (hw)
+        AddDelay(hw, sw, &SocketTimestampStats::rx_nic, &ts_->stats);
+    } else if (hw) {
+      AddDelay(hw, now, &SocketTimestampStats::rx_wakeup, &ts_->stats);
+    }
+    break;
+  }
+#endif
+}
+
+auto LinuxSocketBase::RecvTimestamped(const io::MutableBytes& mb, int flags) -> Result<size_t> {
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  iovec vec{mb.data(), mb.size()};
+  msg.msg_iov = &vec;
+  msg.msg_iovlen = 1;
+
+#ifdef __linux__
+  char control[kTimestampControlLen];
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+#endif
+
+  return RecvMsg(msg, flags);
+}
+
+#ifdef __linux__
+void LinuxSocketBase::DrainErrorQueue() {
+  int fd = native_handle();
+  char control[256];
+  msghdr msg;
+
+  while (true) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)  // EAGAIN when the queue is empty.
+      break;
+
+    // A tx timestamp comes as SCM_TIMESTAMPING followed by the error that holds its id.
+    uint64_t stamp = 0;
+    for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+      if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING) {
+        timespec ts;
+        memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+        stamp = ToNsec(ts);
+        continue;
+      }
+
+      if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+          !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+        continue;
+
+      sock_extended_err serr;
+      memcpy(&serr, CMSG_DATA(cm), sizeof(serr));
+      if (serr.ee_errno != ENOMSG || serr.ee_origin != SO_EE_ORIGIN_TIMESTAMPING) {
+        OnErrorQueue(serr);
+        continue;
+      }
+
+      if (ts_ && ts_->tx_start && stamp && int32_t(serr.ee_data - ts_->tx_id) >= 0) {
+        AddDelay(ts_->tx_start, stamp, &SocketTimestampStats::tx_send, &ts_->stats);
+        ts_->tx_start = 0;
+      }
+    }
+  }
+}
+#endif
+
 error_code LinuxSocketBase::Create(unsigned short pfamily) {
+  return CreateWithType(pfamily, SOCK_STREAM);
+}
+
+error_code LinuxSocketBase::CreateDatagram(unsigned short pfamily) {
+  error_code ec = CreateWithType(pfamily, SOCK_DGRAM);
+
+  // Datagram sockets do not listen or connect, hence they are registered with the proactor
+  // upon creation.
+  if (!ec && proactor())
+    OnSetProactor();
+  return ec;
+}
+
+error_code LinuxSocketBase::CreateWithType(unsigned short pfamily, int type) {
   DCHECK_EQ(fd_, -1);
 
   error_code ec;
 #ifdef __linux__
-  constexpr auto kMask = SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC;
+  const int kMask = type | SOCK_NONBLOCK | SOCK_CLOEXEC;
 #else
-  constexpr auto kMask = SOCK_STREAM;
+  const int kMask = type;
 #endif
 
   int fd = socket(pfamily, kMask, 0);
@@ -91,6 +531,32 @@ error_code LinuxSocketBase::Create(unsigned short pfamily) {
   if (pfamily == AF_UNIX) {
     fd_ |= IS_UDS;
   }
+#ifdef SO_BUSY_POLL
+  else if (ProactorBase* p = proactor(); p && p->idle_policy().busy_poll_usec > 0) {
+    int val = p->idle_policy().busy_poll_usec;
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &val, sizeof(val)) < 0) {
+      LOG_FIRST_N(WARNING, 1) << "Could not set SO_BUSY_POLL: " << strerror(errno);
+    }
+  }
+#endif
+  return ec;
+}
+
+error_code LinuxSocketBase::Attach(int fd) {
+  DCHECK_EQ(fd_, -1);
+  DCHECK(proactor() && proactor()->InMyThread());
+
+  error_code ec;
+  sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  if (posix_err_wrap(getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len), &ec) < 0)
+    return ec;
+
+  SetNonBlocking(fd);
+  fd_ = fd << kFdShift;
+  if (addr.ss_family == AF_UNIX)
+    fd_ |= IS_UDS;
+  OnSetProactor();
   return ec;
 }
 
@@ -168,6 +634,40 @@ error_code LinuxSocketBase::Listen(unsigned backlog) {
   return ec;
 }
 
+auto LinuxSocketBase::ConnectDatagram(const endpoint_type& ep) -> error_code {
+  error_code ec;
+  posix_err_wrap(::connect(native_handle(), (const sockaddr*)ep.data(), ep.size()), &ec);
+  return ec;
+}
+
+#ifdef __linux__
+auto LinuxSocketBase::SetUdpSegmentSize(uint16_t segment_size) -> error_code {
+  error_code ec;
+  int val = segment_size;
+  posix_err_wrap(setsockopt(native_handle(), SOL_UDP, UDP_SEGMENT, &val, sizeof(val)), &ec);
+  return ec;
+}
+
+auto LinuxSocketBase::EnableUdpGro(bool enable) -> error_code {
+  error_code ec;
+  int val = enable;
+  posix_err_wrap(setsockopt(native_handle(), SOL_UDP, UDP_GRO, &val, sizeof(val)), &ec);
+  return ec;
+}
+
+uint16_t UdpGroSegmentSize(const msghdr& msg) {
+  for (const cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+       cmsg = CMSG_NXTHDR(const_cast<msghdr*>(&msg), const_cast<cmsghdr*>(cmsg))) {
+    if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+      int val;
+      memcpy(&val, CMSG_DATA(cmsg), sizeof(val));
+      return val;
+    }
+  }
+  return 0;
+}
+#endif
+
 auto LinuxSocketBase::Shutdown(int how) -> error_code {
   CHECK_GE(fd_, 0);
 
@@ -177,6 +677,9 @@ auto LinuxSocketBase::Shutdown(int how) -> error_code {
   if (fd_ & IS_SHUTDOWN)
     return ec;
 
+  if (how != SHUT_RD)
+    FlushCork();
+
   int fd = native_handle();
 
   posix_err_wrap(::shutdown(fd, how), &ec);
@@ -227,4 +730,20 @@ void SetCloexec(int fd) {
   CHECK_EQ(0, fcntl(fd, F_SETFD, flags | FD_CLOEXEC));
 }
 
+error_code GetTcpInfo(int fd, TcpInfo* info) {
+  struct tcp_info ti;
+  socklen_t len = sizeof(ti);
+  error_code ec;
+  if (posix_err_wrap(getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len), &ec) < 0)
+    return ec;
+
+  info->rtt_usec = ti.tcpi_rtt;
+  info->rtt_var_usec = ti.tcpi_rttvar;
+  info->snd_cwnd = ti.tcpi_snd_cwnd;
+  info->unacked = ti.tcpi_unacked;
+  info->lost = ti.tcpi_lost;
+  info->total_retrans = ti.tcpi_total_retrans;
+  return ec;
+}
+
 }  // namespace util
@@ -2,13 +2,20 @@
 // Author: Roman Gershman (romange@gmail.com)
 //
 
+#include <absl/strings/str_cat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <thread>
 
 #include "base/gtest.h"
 #include "base/logging.h"
 #include "util/fiber_socket_base.h"
+#include "util/fibers/fiber_group.h"
 #include "util/fibers/fibers.h"
+#include "util/fibers/rate_limited_socket.h"
 #include "util/fibers/synchronization.h"
+#include "util/socket_dispatch.h"
 
 #ifdef __linux__
 #include "util/fibers/uring_proactor.h"
@@ -164,6 +171,42 @@ TEST_P(FiberSocketTest, Basic) {
   });
 }
 
+TEST_P(FiberSocketTest, VisitSocket) {
+  unique_ptr<FiberSocketBase> sock(proactor_->CreateSocket());
+  bool use_uring = GetParam() == "uring";
+
+  proactor_->Await([&] {
+    error_code ec = sock->Connect(listen_ep_);
+    accept_fb_.Join();
+    ASSERT_FALSE(ec) << ec.message();
+
+    bool concrete = VisitSocket(sock.get(), [&](auto* s) {
+      using S = std::remove_pointer_t<decltype(s)>;
+      const char msg[] = "ping";
+      EXPECT_FALSE(WriteExactly(s, io::Bytes(reinterpret_cast<const uint8_t*>(msg), 4)));
+#ifdef __linux__
+      if (use_uring)
+        return std::is_same_v<S, UringSocket>;
+#endif
+      return std::is_same_v<S, EpollSocket>;
+    });
+    EXPECT_TRUE(concrete);
+
+    uint8_t buf[4];
+    auto res = conn_socket_->Recv(io::MutableBytes(buf));
+    ASSERT_TRUE(res);
+    EXPECT_EQ("ping", io::View(io::Bytes(buf, *res)));
+
+    // Unknown wrappers are visited as FiberSocketBase.
+    RateLimitedSocket limited(std::move(sock), RateLimitedSocket::Limits{});
+    bool generic = VisitSocket(&limited, [](auto* s) {
+      return std::is_same_v<std::remove_pointer_t<decltype(s)>, FiberSocketBase>;
+    });
+    EXPECT_TRUE(generic);
+    std::ignore = limited.Close();
+  });
+}
+
 TEST_P(FiberSocketTest, Timeout) {
 #ifdef __APPLE__
   GTEST_SKIP() << "Skipped FiberSocketTest.Timeout test on MacOS";
@@ -384,7 +427,713 @@ TEST_P(FiberSocketTest, NotEmpty) {
 
   proactor_->Await([&] { std::ignore = sock->Close(); });
 }
+
+TEST_P(FiberSocketTest, WaitReadable) {
+  unique_ptr<FiberSocketBase> sock;
+  error_code ec;
+  proactor_->Await([&] {
+    sock.reset(proactor_->CreateSocket());
+    ec = sock->Connect(listen_ep_);
+  });
+  ASSERT_FALSE(ec);
+  accept_fb_.Join();
+  ASSERT_FALSE(accept_ec_);
+
+  bool readable = false;
+  Fiber fb = proactor_->LaunchFiber([&] {
+    ec = conn_socket_->WaitReadable();
+    readable = true;
+  });
+
+  proactor_->Await([&] {
+    ThisFiber::SleepFor(10ms);
+    EXPECT_FALSE(readable);
+    ec = sock->Write(io::Bytes(reinterpret_cast<const uint8_t*>("abc"), 3));
+  });
+  fb.Join();
+  ASSERT_FALSE(ec) << ec.message();
+  EXPECT_TRUE(readable);
+
+  // The data is not consumed.
+  proactor_->Await([&] {
+    uint8_t buf[8];
+    io::Result<size_t> res = conn_socket_->Recv(io::MutableBytes(buf));
+    ASSERT_TRUE(res);
+    EXPECT_EQ(3u, *res);
+
+    std::ignore = sock->Close();
+    ec = conn_socket_->WaitReadable();
+  });
+  EXPECT_TRUE(FiberSocketBase::IsConnClosed(ec)) << ec.message();
+}
+
+TEST_P(FiberSocketTest, CancelPendingIo) {
+  unique_ptr<FiberSocketBase> sock;
+  error_code ec;
+  proactor_->Await([&] {
+    sock.reset(proactor_->CreateSocket());
+    ec = sock->Connect(listen_ep_);
+  });
+  ASSERT_FALSE(ec);
+  accept_fb_.Join();
+  ASSERT_FALSE(accept_ec_);
+
+  CancellationToken token;
+  io::Result<size_t> res;
+  Fiber fb = proactor_->LaunchFiber([&] {
+    CancelIoGuard guard(token, conn_socket_.get());
+    uint8_t buf[8];
+    res = conn_socket_->Recv(io::MutableBytes(buf));
+  });
+
+  proactor_->Await([&] {
+    ThisFiber::SleepFor(10ms);
+    token.Cancel();
+  });
+  fb.Join();
+  ASSERT_FALSE(res);
+  if (GetParam() == "uring") {
+    EXPECT_EQ(errc::operation_canceled, res.error()) << res.error().message();
+  }
+  proactor_->Await([&] { std::ignore = sock->Close(); });
+}
+
+TEST_P(FiberSocketTest, RecvMultishot) {
+  bool use_uring = GetParam() == "uring";
+  if (!use_uring || !static_cast<UringProactor*>(proactor_.get())->HasRecvMultishot()) {
+    GTEST_SKIP() << "RecvMultishot test is supported only on uring";
+    return;
+  }
+
+  constexpr uint16_t kGroupId = 3;
+  constexpr unsigned kEntrySize = 16;
+  UringProactor* up = static_cast<UringProactor*>(proactor_.get());
+  int res = proactor_->Await([&] { return up->RegisterBufferRing(kGroupId, 4, kEntrySize); });
+  ASSERT_EQ(0, res);
+
+  unique_ptr<FiberSocketBase> sock;
+  error_code ec;
+  proactor_->Await([&] {
+    sock.reset(proactor_->CreateSocket());
+    ec = sock->Connect(listen_ep_);
+  });
+  ASSERT_FALSE(ec);
+  accept_fb_.Join();
+  ASSERT_FALSE(accept_ec_);
+
+  UringSocket* uring_sock = static_cast<UringSocket*>(conn_socket_.get());
+  uint8_t buf[100];
+  for (unsigned i = 0; i < sizeof(buf); ++i)
+    buf[i] = i;
+
+  proactor_->Await([&] {
+    ec = uring_sock->EnableRecvMultishot(kGroupId);
+    ASSERT_FALSE(ec) << ec.message();
+
+    ec = sock->Write(io::Bytes(buf, 40));
+    ASSERT_FALSE(ec);
+
+    // 40 bytes span at least 3 buffers of 16 bytes.
+    FiberSocketBase::ProvidedBuffer pbufs[8];
+    size_t total = 0;
+    while (total < 40) {
+      io::Result<unsigned> recv_res = uring_sock->RecvProvided(8, pbufs);
+      ASSERT_TRUE(recv_res) << recv_res.error();
+      for (unsigned i = 0; i < *recv_res; ++i) {
+        ASSERT_LE(pbufs[i].buffer.size(), kEntrySize);
+        EXPECT_EQ(0, memcmp(buf + total, pbufs[i].buffer.data(), pbufs[i].buffer.size()));
+        total += pbufs[i].buffer.size();
+        uring_sock->ReturnProvided(pbufs[i]);
+      }
+    }
+    EXPECT_EQ(40u, total);
+
+    // More data than the ring can hold at once. The request is re-armed once the
+    // buffers are returned.
+    ec = sock->Write(io::Bytes(buf, sizeof(buf)));
+    ASSERT_FALSE(ec);
+
+    uint8_t dest[sizeof(buf)];
+    total = 0;
+    while (total < sizeof(buf)) {
+      io::Result<size_t> recv_res = uring_sock->Recv(io::MutableBytes(dest + total, 7));
+      ASSERT_TRUE(recv_res) << recv_res.error();
+      total += *recv_res;
+    }
+    EXPECT_EQ(0, memcmp(buf, dest, sizeof(buf)));
+
+    std::ignore = sock->Close();
+    io::Result<size_t> recv_res = uring_sock->Recv(io::MutableBytes(dest));
+    ASSERT_FALSE(recv_res);
+    EXPECT_TRUE(FiberSocketBase::IsConnClosed(recv_res.error()));
+  });
+}
+
+// The test proactors do not register a zero-copy receive queue, hence the socket falls back
+// to the buffer ring.
+TEST_P(FiberSocketTest, RecvZeroCopyFallback) {
+  bool use_uring = GetParam() == "uring";
+  if (!use_uring || !static_cast<UringProactor*>(proactor_.get())->HasRecvMultishot()) {
+    GTEST_SKIP() << "RecvZeroCopyFallback test is supported only on uring";
+    return;
+  }
+
+  constexpr uint16_t kGroupId = 4;
+  UringProactor* up = static_cast<UringProactor*>(proactor_.get());
+  ASSERT_FALSE(up->HasZcrx());
+  int res = proactor_->Await([&] { return up->RegisterBufferRing(kGroupId, 4, 16); });
+  ASSERT_EQ(0, res);
+
+  unique_ptr<FiberSocketBase> sock;
+  error_code ec;
+  proactor_->Await([&] {
+    sock.reset(proactor_->CreateSocket());
+    ec = sock->Connect(listen_ep_);
+  });
+  ASSERT_FALSE(ec);
+  accept_fb_.Join();
+  ASSERT_FALSE(accept_ec_);
+
+  UringSocket* uring_sock = static_cast<UringSocket*>(conn_socket_.get());
+  proactor_->Await([&] {
+    ec = uring_sock->EnableRecvZeroCopy(kGroupId);
+    ASSERT_FALSE(ec) << ec.message();
+
+    ec = sock->Write(io::Buffer("hello world"));
+    ASSERT_FALSE(ec);
+
+    string received;
+    FiberSocketBase::ProvidedBuffer pbufs[4];
+    while (received.size() < 11) {
+      io::Result<unsigned> recv_res = uring_sock->RecvProvided(4, pbufs);
+      ASSERT_TRUE(recv_res) << recv_res.error();
+      for (unsigned i = 0; i < *recv_res; ++i) {
+        received.append(io::View(pbufs[i].buffer));
+        uring_sock->ReturnProvided(pbufs[i]);
+      }
+    }
+    EXPECT_EQ("hello world", received);
+    std::ignore = sock->Close();
+  });
+}
+
+TEST_P(FiberSocketTest, ZeroCopySend) {
+  unique_ptr<FiberSocketBase> sock;
+  error_code ec;
+  proactor_->Await([&] {
+    sock.reset(proactor_->CreateSocket());
+    ec = sock->Connect(listen_ep_);
+  });
+  ASSERT_FALSE(ec);
+  accept_fb_.Join();
+  ASSERT_FALSE(accept_ec_);
+
+  ec = proactor_->Await([&] { return sock->EnableZeroCopySend(1024); });
+  if (ec == errc::operation_not_supported) {
+    proactor_->Await([&] { std::ignore = sock->Close(); });
+    GTEST_SKIP() << "Zero-copy send is not supported";
+  }
+  ASSERT_FALSE(ec) << ec.message();
+
+  // Both below and above the threshold.
+  vector<uint8_t> buf(64 * 1024);
+  for (size_t i = 0; i < buf.size(); ++i)
+    buf[i] = i % 251;
+
+  Fiber reader = proactor_->LaunchFiber([&] {
+    vector<uint8_t> dest(buf.size() + 16);
+    size_t total = 0;
+    while (total < dest.size()) {
+      io::Result<size_t> res = conn_socket_->Recv(io::MutableBytes(dest.data() + total,
+                                                                   dest.size() - total));
+      ASSERT_TRUE(res) << res.error();
+      total += *res;
+    }
+    EXPECT_EQ(0, memcmp(buf.data(), dest.data(), 16));
+    EXPECT_EQ(0, memcmp(buf.data(), dest.data() + 16, buf.size()));
+  });
+
+  proactor_->Await([&] {
+    ec = sock->Write(io::Bytes(buf.data(), 16));
+    EXPECT_FALSE(ec);
+    ec = sock->Write(io::Bytes(buf.data(), buf.size()));
+    EXPECT_FALSE(ec) << ec.message();
+  });
+  reader.Join();
+
+  proactor_->Await([&] { std::ignore = sock->Close(); });
+}
+
+TEST_P(FiberSocketTest, Timestamping) {
+  unique_ptr<LinuxSocketBase> sock;
+  error_code ec;
+  proactor_->Await([&] {
+    sock.reset(static_cast<LinuxSocketBase*>(proactor_->CreateSocket()));
+    ec = sock->Connect(listen_ep_);
+  });
+  ASSERT_FALSE(ec);
+  accept_fb_.Join();
+  ASSERT_FALSE(accept_ec_);
+
+  auto* conn = static_cast<LinuxSocketBase*>(conn_socket_.get());
+  ec = proactor_->Await([&] {
+    if (auto ec = conn->EnableTimestamping(LinuxSocketBase::TS_RX_SOFTWARE); ec)
+      return ec;
+    return sock->EnableTimestamping(LinuxSocketBase::TS_TX_SOFTWARE);
+  });
+  if (ec) {
+    proactor_->Await([&] { std::ignore = sock->Close(); });
+    GTEST_SKIP() << "Timestamping is not supported: " << ec.message();
+  }
+  EXPECT_EQ(nullptr, static_cast<LinuxSocketBase*>(listen_socket_.get())->timestamp_stats());
+
+  constexpr unsigned kNum = 10;
+  Fiber reader = proactor_->LaunchFiber([&] {
+    uint8_t buf[16];
+    for (unsigned i = 0; i < kNum; ++i) {
+      io::Result<size_t> res = conn->Recv(io::MutableBytes(buf));
+      ASSERT_TRUE(res) << res.error();
+    }
+  });
+
+  proactor_->Await([&] {
+    uint8_t buf[16] = {};
+    for (unsigned i = 0; i < kNum; ++i) {
+      ec = sock->Write(io::Bytes(buf));
+      ASSERT_FALSE(ec) << ec.message();
+      ThisFiber::SleepFor(1ms);  // so that the reader wakes up for every write.
+    }
+  });
+  reader.Join();
+
+  auto count = [](const CycleHistogram& hist) {
+    uint64_t res = 0;
+    for (uint64_t cnt : hist.buckets)
+      res += cnt;
+    return res;
+  };
+
+  proactor_->Await([&] {
+    const SocketTimestampStats* rx = conn->timestamp_stats();
+    ASSERT_TRUE(rx);
+    EXPECT_GT(count(rx->rx_wakeup), 0u);
+    EXPECT_EQ(0u, count(rx->rx_nic));
+    EXPECT_GE(count(ThreadSocketTimestampStats().rx_wakeup), count(rx->rx_wakeup));
+
+    // The sampled writes are timed once the following ones drain the error queue.
+    const SocketTimestampStats* tx = sock->timestamp_stats();
+    ASSERT_TRUE(tx);
+    EXPECT_GT(count(tx->tx_send), 0u);
+    std::ignore = sock->Close();
+  });
+}
+
+TEST_P(FiberSocketTest, TcpInfo) {
+  unique_ptr<LinuxSocketBase> sock;
+  error_code ec;
+  proactor_->Await([&] {
+    sock.reset(static_cast<LinuxSocketBase*>(proactor_->CreateSocket()));
+    ec = sock->Connect(listen_ep_);
+  });
+  ASSERT_FALSE(ec);
+  accept_fb_.Join();
+  ASSERT_FALSE(accept_ec_);
+
+  TcpInfo info;
+  proactor_->Await([&] {
+    uint8_t buf[16] = {};
+    ec = sock->Write(io::Bytes(buf));
+    ASSERT_FALSE(ec) << ec.message();
+    io::Result<size_t> res = conn_socket_->Recv(io::MutableBytes(buf));  // acks the write.
+    ASSERT_TRUE(res) << res.error();
+    ec = sock->GetTcpInfo(&info);
+  });
+  ASSERT_FALSE(ec) << ec.message();
+  EXPECT_GT(info.rtt_usec, 0u);
+  EXPECT_GT(info.snd_cwnd, 0u);
+  EXPECT_EQ(0u, info.lost);
+
+  // Datagram sockets are not tcp.
+  ec = proactor_->Await([&] {
+    unique_ptr<LinuxSocketBase> udp(static_cast<LinuxSocketBase*>(proactor_->CreateSocket()));
+    error_code res = udp->CreateDatagram();
+    if (!res)
+      res = udp->GetTcpInfo(&info);
+    std::ignore = udp->Close();
+    std::ignore = sock->Close();
+    return res;
+  });
+  EXPECT_TRUE(ec);
+}
+
+TEST_P(FiberSocketTest, Datagram) {
+  constexpr unsigned kNum = 10;
+  unique_ptr<LinuxSocketBase> receiver, sender;
+  error_code ec = proactor_->Await([&] {
+    receiver.reset(static_cast<LinuxSocketBase*>(proactor_->CreateSocket()));
+    sender.reset(static_cast<LinuxSocketBase*>(proactor_->CreateSocket()));
+    if (auto ec = receiver->CreateDatagram(); ec)
+      return ec;
+    if (auto ec = sender->CreateDatagram(); ec)
+      return ec;
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (auto ec = receiver->Bind((const sockaddr*)&addr, sizeof(addr)); ec)
+      return ec;
+    return sender->ConnectDatagram(receiver->LocalEndpoint());
+  });
+  ASSERT_FALSE(ec) << ec.message();
+
+  // Receives datagrams until total bytes arrive, returns the datagram payloads, splitting
+  // the coalesced messages by their GRO segment size.
+  auto receive = [&](size_t total) {
+    vector<string> res;
+    char bufs[kNum][64];
+    char control[kNum][kUdpGroControlLen];
+    mmsghdr msgs[kNum];
+    iovec vecs[kNum];
+    size_t received = 0;
+    while (received < total) {
+      memset(msgs, 0, sizeof(msgs));
+      for (unsigned i = 0; i < kNum; ++i) {
+        vecs[i] = iovec{bufs[i], sizeof(bufs[i])};
+        msgs[i].msg_hdr.msg_iov = &vecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = control[i];
+        msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+      }
+      io::Result<unsigned> num = receiver->RecvMMsg(msgs, kNum);
+      EXPECT_TRUE(num) << num.error().message();
+      if (!num)
+        break;
+      for (unsigned i = 0; i < *num; ++i) {
+        size_t len = msgs[i].msg_len;
+        size_t segment = UdpGroSegmentSize(msgs[i].msg_hdr);
+        if (segment == 0)
+          segment = len;
+        for (size_t pos = 0; pos < len; pos += segment)
+          res.emplace_back(bufs[i] + pos, min(segment, len - pos));
+        received += len;
+      }
+    }
+    return res;
+  };
+
+  Fiber reader = proactor_->LaunchFiber([&] {
+    vector<string> res = receive(kNum * 5);
+    ASSERT_EQ(kNum, res.size());
+    for (unsigned i = 0; i < kNum; ++i)
+      EXPECT_EQ(absl::StrCat("msg-", i), res[i]);
+  });
+
+  proactor_->Await([&] {
+    string payloads[kNum];
+    iovec vecs[kNum];
+    mmsghdr msgs[kNum];
+    memset(msgs, 0, sizeof(msgs));
+    for (unsigned i = 0; i < kNum; ++i) {
+      payloads[i] = absl::StrCat("msg-", i);
+      vecs[i] = iovec{payloads[i].data(), payloads[i].size()};
+      msgs[i].msg_hdr.msg_iov = &vecs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    for (unsigned sent = 0; sent < kNum;) {
+      io::Result<unsigned> res = sender->SendMMsg(msgs + sent, kNum - sent);
+      ASSERT_TRUE(res) << res.error().message();
+      sent += *res;
+    }
+  });
+  reader.Join();
+
+  // With segmentation offload a single message carries several datagrams.
+  ec = proactor_->Await([&] { return sender->SetUdpSegmentSize(8); });
+  if (!ec) {
+    proactor_->Await([&] { std::ignore = receiver->EnableUdpGro(true); });
+    reader = proactor_->LaunchFiber([&] {
+      vector<string> res = receive(32);
+      ASSERT_EQ(4u, res.size());
+      for (unsigned i = 0; i < 4; ++i)
+        EXPECT_EQ(string(8, 'a' + i), res[i]);
+    });
+
+    proactor_->Await([&] {
+      string payload = absl::StrCat(string(8, 'a'), string(8, 'b'), string(8, 'c'), string(8, 'd'));
+      iovec vec{payload.data(), payload.size()};
+      mmsghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_hdr.msg_iov = &vec;
+      msg.msg_hdr.msg_iovlen = 1;
+      io::Result<unsigned> res = sender->SendMMsg(&msg, 1);
+      ASSERT_TRUE(res) << res.error().message();
+      EXPECT_EQ(1u, *res);
+    });
+    reader.Join();
+  } else {
+    LOG(WARNING) << "UDP_SEGMENT is not supported: " << ec.message();
+  }
+
+  proactor_->Await([&] {
+    std::ignore = sender->Close();
+    std::ignore = receiver->Close();
+  });
+}
 #endif
 
+TEST_P(FiberSocketTest, SendFile) {
+  // Larger than the splice pipe, so that several chunks are sent.
+  string content(3 << 20, '\0');
+  for (size_t i = 0; i < content.size(); ++i)
+    content[i] = i % 251;
+
+  string path = base::GetTestTempPath("sendfile.bin");
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(ssize_t(content.size()), write(fd, content.data(), content.size()));
+
+  unique_ptr<FiberSocketBase> sock;
+  error_code ec;
+  proactor_->Await([&] {
+    sock.reset(proactor_->CreateSocket());
+    ec = sock->Connect(listen_ep_);
+  });
+  ASSERT_FALSE(ec);
+  accept_fb_.Join();
+  ASSERT_FALSE(accept_ec_);
+
+  constexpr size_t kOffset = 1000;
+  const size_t expected = content.size() - kOffset;
+  Fiber reader = proactor_->LaunchFiber([&] {
+    string dest(expected, '\0');
+    size_t total = 0;
+    while (total < dest.size()) {
+      io::Result<size_t> res = conn_socket_->Recv(
+          io::MutableBytes(reinterpret_cast<uint8_t*>(dest.data()) + total, dest.size() - total));
+      ASSERT_TRUE(res) << res.error();
+      total += *res;
+    }
+    EXPECT_TRUE(dest == content.substr(kOffset));
+  });
+
+  proactor_->Await([&] {
+    // Asks for more than the file holds, hence stops at the end of the file.
+    io::Result<size_t> res = sock->SendFile(fd, kOffset, content.size());
+    ASSERT_TRUE(res) << res.error().message();
+    EXPECT_EQ(expected, *res);
+  });
+  reader.Join();
+
+  // The file offset is not changed.
+  EXPECT_EQ(off_t(content.size()), lseek(fd, 0, SEEK_CUR));
+
+  proactor_->Await([&] { std::ignore = sock->Close(); });
+  close(fd);
+  unlink(path.c_str());
+}
+
+TEST_P(FiberSocketTest, AcceptMultishot) {
+  constexpr unsigned kNum = 5;
+  error_code ec = proactor_->Await([&] { return listen_socket_->EnableAcceptMultishot(2); });
+  if (ec == errc::operation_not_supported) {
+    accept_fb_.JoinIfNeeded();
+    GTEST_SKIP() << "Multishot accept is not supported";
+  }
+  ASSERT_FALSE(ec) << ec.message();
+
+  // The first connection is accepted by accept_fb_.
+  vector<unique_ptr<FiberSocketBase>> clients(kNum + 1);
+  proactor_->Await([&] {
+    for (auto& client : clients) {
+      client.reset(proactor_->CreateSocket());
+      ec = client->Connect(listen_ep_);
+      ASSERT_FALSE(ec) << ec.message();
+    }
+  });
+  accept_fb_.Join();
+  ASSERT_FALSE(accept_ec_);
+
+  proactor_->Await([&] {
+    for (unsigned i = 0; i < kNum; ++i) {
+      // Disables the multishot request midway, the rest are accepted one by one.
+      if (i == kNum - 1) {
+        ec = listen_socket_->EnableAcceptMultishot(0);
+        ASSERT_FALSE(ec);
+      }
+      FiberSocketBase::AcceptResult res = listen_socket_->Accept();
+      ASSERT_TRUE(res) << res.error().message();
+      unique_ptr<FiberSocketBase> peer(*res);
+      peer->SetProactor(proactor_.get());
+      EXPECT_TRUE(peer->IsOpen());
+      std::ignore = peer->Close();
+    }
+
+    for (auto& client : clients)
+      std::ignore = client->Close();
+  });
+}
+
+TEST_P(FiberSocketTest, WriteCoalescing) {
+  unique_ptr<FiberSocketBase> sock;
+  error_code ec;
+  proactor_->Await([&] {
+    sock.reset(proactor_->CreateSocket());
+    ec = sock->Connect(listen_ep_);
+  });
+  ASSERT_FALSE(ec);
+  accept_fb_.Join();
+  ASSERT_FALSE(accept_ec_);
+
+  string expected;
+  for (unsigned i = 0; i < 100; ++i) {
+    expected.append(absl::StrCat("msg", i, "\n"));
+  }
+  string large(8192, 'x');
+  expected.append(large).append("end");
+
+  Fiber reader = proactor_->LaunchFiber([&] {
+    string dest(expected.size(), '\0');
+    size_t total = 0;
+    while (total < dest.size()) {
+      io::Result<size_t> res =
+          conn_socket_->Recv(io::MutableBytes(reinterpret_cast<uint8_t*>(dest.data()) + total,
+                                              dest.size() - total));
+      ASSERT_TRUE(res) << res.error();
+      total += *res;
+    }
+    EXPECT_EQ(expected, dest);
+  });
+
+  proactor_->Await([&] {
+    ASSERT_FALSE(sock->SetWriteCoalescing(4096));
+
+    // The small writes are absorbed by the buffer, the large one flushes it and goes directly.
+    for (unsigned i = 0; i < 100; ++i) {
+      string msg = absl::StrCat("msg", i, "\n");
+      ec = sock->Write(io::Buffer(msg));
+      EXPECT_FALSE(ec);
+    }
+    ec = sock->Write(io::Buffer(large));
+    EXPECT_FALSE(ec);
+
+    // Sent by the proactor loop once we suspend.
+    ec = sock->Write(io::Buffer("end"));
+    EXPECT_FALSE(ec);
+  });
+  reader.Join();
+
+  proactor_->Await([&] {
+    EXPECT_FALSE(sock->Flush());
+    std::ignore = sock->Close();
+  });
+}
+
+TEST_P(FiberSocketTest, RateLimited) {
+  // 10KB burst, 30KB more take 300ms.
+  RateLimitedSocket::Limits limits;
+  limits.send_bytes_per_sec = 100000;
+  limits.burst = 100ms;
+  constexpr size_t kTotal = 40000;
+
+  unique_ptr<RateLimitedSocket> sock;
+  error_code ec;
+  proactor_->Await([&] {
+    sock = make_unique<RateLimitedSocket>(unique_ptr<FiberSocketBase>(proactor_->CreateSocket()),
+                                          limits);
+    ec = sock->Connect(listen_ep_);
+  });
+  ASSERT_FALSE(ec);
+  accept_fb_.Join();
+  ASSERT_FALSE(accept_ec_);
+
+  Fiber reader = proactor_->LaunchFiber([&] {
+    string dest(kTotal, '\0');
+    size_t total = 0;
+    while (total < dest.size()) {
+      io::Result<size_t> res =
+          conn_socket_->Recv(io::MutableBytes(reinterpret_cast<uint8_t*>(dest.data()) + total,
+                                              dest.size() - total));
+      ASSERT_TRUE(res) << res.error();
+      total += *res;
+    }
+    EXPECT_EQ(string(kTotal, 'x'), dest);
+  });
+
+  string payload(kTotal, 'x');
+  auto start = chrono::steady_clock::now();
+  proactor_->Await([&] {
+    ec = sock->Write(io::Buffer(payload));
+    EXPECT_FALSE(ec);
+  });
+  reader.Join();
+  auto elapsed = chrono::steady_clock::now() - start;
+
+  EXPECT_GE(elapsed, 250ms);
+  EXPECT_LT(elapsed, 2s);
+  EXPECT_GT(sock->stats().throttled_calls, 0u);
+  EXPECT_GE(sock->stats().throttled_usec, 250000u);
+
+  proactor_->Await([&] { std::ignore = sock->Close(); });
+}
+
+TEST_P(FiberSocketTest, RateLimitedAsync) {
+  // The first write drains the 10KB burst, the second one waits for about 100ms.
+  RateLimitedSocket::Limits limits;
+  limits.send_bytes_per_sec = 100000;
+  limits.burst = 100ms;
+  constexpr size_t kChunk = 10000;
+
+  unique_ptr<RateLimitedSocket> sock;
+  error_code ec;
+  proactor_->Await([&] {
+    sock = make_unique<RateLimitedSocket>(unique_ptr<FiberSocketBase>(proactor_->CreateSocket()),
+                                          limits);
+    ec = sock->Connect(listen_ep_);
+  });
+  ASSERT_FALSE(ec);
+  accept_fb_.Join();
+  ASSERT_FALSE(accept_ec_);
+
+  Fiber reader = proactor_->LaunchFiber([&] {
+    string dest(2 * kChunk, '\0');
+    size_t total = 0;
+    while (total < dest.size()) {
+      io::Result<size_t> res =
+          conn_socket_->Recv(io::MutableBytes(reinterpret_cast<uint8_t*>(dest.data()) + total,
+                                              dest.size() - total));
+      ASSERT_TRUE(res) << res.error();
+      total += *res;
+    }
+  });
+
+  string payload(kChunk, 'x');
+  Done done;
+  size_t written = 0;
+  auto start = chrono::steady_clock::now();
+  proactor_->Await([&] {
+    ec = sock->Write(io::Buffer(payload));
+    ASSERT_FALSE(ec);
+
+    iovec v{payload.data(), payload.size()};
+    bool returned = false;
+    sock->AsyncWriteSome(&v, 1, [&](io::Result<size_t> res) {
+      EXPECT_TRUE(returned);
+      ASSERT_TRUE(res) << res.error();
+      written = *res;
+      done.Notify();
+    });
+    returned = true;
+  });
+  done.Wait();
+  reader.Join();
+
+  EXPECT_EQ(kChunk, written);
+  EXPECT_GE(chrono::steady_clock::now() - start, 50ms);
+  EXPECT_GT(sock->stats().throttled_calls, 0u);
+
+  proactor_->Await([&] { std::ignore = sock->Close(); });
+}
+
 }  // namespace fb2
 }  // namespace util
@@ -5,6 +5,7 @@
 
 #include <absl/strings/str_cat.h>
 
+#include <algorithm>
 #include <thread>
 
 #include "base/pthread_utils.h"
@@ -53,19 +54,43 @@ void FiberQueue::Shutdown() {
   pull_ec_.notify();
 }
 
-FiberQueueThreadPool::FiberQueueThreadPool(unsigned num_threads, unsigned queue_size) {
-  if (num_threads == 0) {
-    num_threads = std::thread::hardware_concurrency();
+namespace {
+
+FiberQueueThreadPool::Options Normalize(FiberQueueThreadPool::Options opts) {
+  if (opts.min_threads == 0) {
+    opts.min_threads = std::thread::hardware_concurrency();
   }
-  worker_size_ = num_threads;
-  workers_.reset(new Worker[num_threads]);
+  opts.max_threads = std::max(opts.max_threads, opts.min_threads);
+  opts.grow_depth = std::max(opts.grow_depth, 1u);
+  return opts;
+}
+
+size_t SharedQueueSize(const FiberQueueThreadPool::Options& opts) {
+  size_t size = 2;
+  while (size < size_t(opts.queue_size) * opts.max_threads)
+    size *= 2;
+  return size;
+}
+
+}  // namespace
+
+FiberQueueThreadPool::FiberQueueThreadPool(unsigned num_threads, unsigned queue_size)
+    : FiberQueueThreadPool(Options{num_threads, num_threads, queue_size}) {
+}
 
-  for (unsigned i = 0; i < num_threads; ++i) {
-    string name = absl::StrCat("fq_pool", i);
+FiberQueueThreadPool::FiberQueueThreadPool(const Options& opts)
+    : opts_(Normalize(opts)),
+      min_threads_(opts_.min_threads),
+      max_threads_(opts_.max_threads),
+      shared_q_(SharedQueueSize(opts_)) {
+  workers_.reset(new Worker[max_threads_]);
 
-    auto fn = std::bind(&FiberQueueThreadPool::WorkerFunction, this, i);
-    workers_[i].q.reset(new FiberQueue(queue_size));
-    workers_[i].tid = base::StartThread(name.c_str(), fn);
+  for (unsigned i = 0; i < max_threads_; ++i) {
+    workers_[i].q.reset(new FiberQueue(opts_.queue_size));
+  }
+
+  for (unsigned i = 0; i < min_threads_; ++i) {
+    StartWorker(i);
   }
 }
 
@@ -79,20 +104,113 @@ void FiberQueueThreadPool::Shutdown() {
   if (!workers_)
     return;
 
-  for (size_t i = 0; i < worker_size_; ++i) {
+  lock_guard lk(grow_mu_);
+  closed_.store(true, memory_order_seq_cst);
+  for (size_t i = 0; i < max_threads_; ++i) {
     workers_[i].q->is_closed_.store(true, memory_order_seq_cst);
     workers_[i].q->pull_ec_.notifyAll();
   }
 
-  for (size_t i = 0; i < worker_size_; ++i) {
+  for (size_t i = 0; i < max_threads_; ++i) {
     auto& w = workers_[i];
-    pthread_join(w.tid, nullptr);
+    if (w.state.load(memory_order_acquire) != kEmpty)
+      pthread_join(w.tid, nullptr);
   }
 
   workers_.reset();
   VLOG(1) << "FiberQueueThreadPool::ShutdownEnd";
 }
 
+auto FiberQueueThreadPool::GetStats() const -> Stats {
+  Stats stats;
+  stats.tasks = tasks_.load(memory_order_relaxed);
+  stats.wait_ns = wait_ns_.load(memory_order_relaxed);
+  stats.max_wait_ns = max_wait_ns_.load(memory_order_relaxed);
+  stats.threads = running_.load(memory_order_relaxed);
+  return stats;
+}
+
+void FiberQueueThreadPool::StartWorker(unsigned index) {
+  string name = absl::StrCat("fq_pool", index);
+
+  auto fn = std::bind(&FiberQueueThreadPool::WorkerFunction, this, index);
+  running_.fetch_add(1, memory_order_relaxed);
+  workers_[index].state.store(kRunning, memory_order_release);
+  workers_[index].tid = base::StartThread(name.c_str(), fn);
+}
+
+void FiberQueueThreadPool::Dispatch() {
+  int64_t depth = shared_depth_.fetch_add(1, memory_order_relaxed) + 1;
+
+  // Pairs with the fence in WorkerFunction: either we see the idle worker or it sees the task.
+  atomic_thread_fence(memory_order_seq_cst);
+
+  size_t start = next_index_.fetch_add(1, memory_order_relaxed);
+  for (unsigned i = 0; i < max_threads_; ++i) {
+    Worker& w = workers_[(start + i) % max_threads_];
+    // Claims the worker, so that the following tasks look for another one.
+    if (w.idle.load(memory_order_relaxed) && w.idle.exchange(false, memory_order_relaxed)) {
+      w.q->pull_ec_.notify();
+      return;
+    }
+  }
+
+  if (running_.load(memory_order_relaxed) < max_threads_ && depth >= opts_.grow_depth)
+    Grow();
+}
+
+void FiberQueueThreadPool::Grow() {
+  unique_lock lk(grow_mu_, try_to_lock);
+  if (!lk.owns_lock() || closed_.load(memory_order_relaxed))
+    return;
+
+  for (unsigned i = min_threads_; i < max_threads_; ++i) {
+    Worker& w = workers_[i];
+    WorkerState state = w.state.load(memory_order_acquire);
+    if (state == kRunning)
+      continue;
+    if (state == kExited)
+      pthread_join(w.tid, nullptr);
+    VLOG(1) << "Growing FiberQueueThreadPool to " << running_.load() + 1 << " threads";
+    StartWorker(i);
+    return;
+  }
+}
+
+bool FiberQueueThreadPool::Pull(Worker* w, bool* pinned_turn, CbFunc* func) {
+  auto pull_pinned = [&] {
+    if (!w->q->queue_.try_dequeue(*func))
+      return false;
+    w->q->push_ec_.notify();
+    return true;
+  };
+
+  auto pull_shared = [&] {
+    Task task;
+    if (!shared_q_.try_dequeue(task))
+      return false;
+    push_ec_.notify();
+    shared_depth_.fetch_sub(1, memory_order_relaxed);
+    OnTaskStart(task.enqueue_tsc);
+    *func = std::move(task.func);
+    return true;
+  };
+
+  *pinned_turn = !*pinned_turn;
+  return *pinned_turn ? (pull_pinned() || pull_shared()) : (pull_shared() || pull_pinned());
+}
+
+void FiberQueueThreadPool::OnTaskStart(uint64_t enqueue_tsc) {
+  uint64_t wait_ns = CycleClock::NsecSince(enqueue_tsc);
+  tasks_.fetch_add(1, memory_order_relaxed);
+  wait_ns_.fetch_add(wait_ns, memory_order_relaxed);
+
+  uint64_t max_wait = max_wait_ns_.load(memory_order_relaxed);
+  while (wait_ns > max_wait &&
+         !max_wait_ns_.compare_exchange_weak(max_wait, wait_ns, memory_order_relaxed)) {
+  }
+}
+
 void FiberQueueThreadPool::WorkerFunction(unsigned index) {
   /*
   sched_param param;
@@ -102,8 +220,54 @@ void FiberQueueThreadPool::WorkerFunction(unsigned index) {
     LOG(INFO) << "Could not set FIFO priority in fiber-queue-thread";
   }*/
 
-  workers_[index].q->Run();
+  Worker* w = &workers_[index];
+  bool elastic = index >= min_threads_;
+  bool pinned_turn = false;
+  CbFunc func;
+
+  while (true) {
+    if (!Pull(w, &pinned_turn, &func)) {
+      w->idle.store(true, memory_order_relaxed);
+      atomic_thread_fence(memory_order_seq_cst);
+
+      bool has_task = false;
+      auto cb = [&] {
+        has_task = Pull(w, &pinned_turn, &func);
+        return has_task || closed_.load(memory_order_acquire);
+      };
+
+      if (elastic) {
+        auto tp = chrono::steady_clock::now() + opts_.idle_timeout;
+        w->q->pull_ec_.await_until(cb, tp);
+      } else {
+        w->q->pull_ec_.await(cb);
+      }
+
+      w->idle.store(false, memory_order_relaxed);
+      if (!has_task) {
+        // A task could be dispatched to us after we timed out, we take it before exiting.
+        atomic_thread_fence(memory_order_seq_cst);
+        has_task = Pull(w, &pinned_turn, &func);
+      }
+
+      if (!has_task) {
+        if (closed_.load(memory_order_acquire) || elastic)
+          break;
+        continue;
+      }
+    }
+
+    try {
+      func();
+    } catch (std::exception& e) {
+      // std::exception_ptr p = std::current_exception();
+      LOG(FATAL) << "Exception " << e.what();
+    }
+    func = nullptr;
+  }
 
+  running_.fetch_sub(1, memory_order_relaxed);
+  w->state.store(kExited, memory_order_release);
   VLOG(1) << "FiberQueueThreadPool::Exit";
 }
 
@@ -3,9 +3,17 @@
 //
 #pragma once
 
+#include <absl/base/optimization.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
 #include "base/mpmc_bounded_queue.h"
+#include "util/fibers/cycle_clock.h"
 #include "util/fibers/detail/result_mover.h"
 #include "util/fibers/synchronization.h"
+#include "util/fibers/trace.h"
 
 namespace util {
 namespace fb2 {
@@ -36,23 +44,12 @@ class FiberQueue {
    * @tparam F - callback type
    * @param f  - callback object
    * @return true if Add() had to preempt, false is fast path without preemptions was followed.
+   * f runs under the trace context of the caller, see trace.h.
    */
   template <typename F> bool Add(F&& f) {
-    if (TryAdd(std::forward<F>(f))) {
-      return false;
-    }
-
-    bool result = false;
-    while (true) {
-      auto key = push_ec_.prepareWait();
-
-      if (TryAdd(std::forward<F>(f))) {
-        break;
-      }
-      result = true;
-      push_ec_.wait(key.epoch());
-    }
-    return result;
+    if (TraceContext ctx = CurrentTrace(); ABSL_PREDICT_FALSE(bool(ctx)))
+      return AddInternal(detail::TraceWrap(ctx, std::forward<F>(f)));
+    return AddInternal(std::forward<F>(f));
   }
 
   /**
@@ -87,6 +84,24 @@ class FiberQueue {
  private:
   typedef std::function<void()> CbFunc;
 
+  template <typename F> bool AddInternal(F&& f) {
+    if (TryAdd(std::forward<F>(f))) {
+      return false;
+    }
+
+    bool result = false;
+    while (true) {
+      auto key = push_ec_.prepareWait();
+
+      if (TryAdd(std::forward<F>(f))) {
+        break;
+      }
+      result = true;
+      push_ec_.wait(key.epoch());
+    }
+    return result;
+  }
+
   using FuncQ = base::mpmc_bounded_queue<CbFunc>;
   FuncQ queue_;
 
@@ -94,10 +109,42 @@ class FiberQueue {
   std::atomic_bool is_closed_{false};
 };
 
-// This thread pool has a global fiber-friendly queue for incoming tasks.
+// A pool of threads for offloading blocking calls, e.g. file I/O or compression, from fibers.
+//
+// Unpinned tasks (Add(f), Await(f)) go to a shared queue that all the workers pull from, so an
+// idle worker picks up the next task instead of it waiting behind a slow task of a busy worker.
+// Pinned tasks (Add(index, f), Await(index, f)) keep their affinity: the tasks of an index run
+// on the same worker in order, hence they are never taken by other workers.
+//
+// The pool starts min_threads workers and adds workers up to max_threads while the shared
+// queue is deep and no worker is idle. The added workers exit after they are idle for
+// idle_timeout. Pinned tasks run on the first min_threads workers only.
 class FiberQueueThreadPool {
  public:
+  struct Options {
+    unsigned min_threads = 0;  // 0 means std::thread::hardware_concurrency().
+    unsigned max_threads = 0;  // 0 means min_threads, i.e. a fixed size pool.
+
+    // Capacity of the queue of each worker and of the shared queue per max_threads,
+    // rounded up to a power of 2.
+    unsigned queue_size = 128;
+
+    // The pool grows when a task finds no idle worker and there are at least this many
+    // pending shared tasks.
+    unsigned grow_depth = 2;
+
+    std::chrono::milliseconds idle_timeout{1000};
+  };
+
+  struct Stats {
+    uint64_t tasks = 0;        // tasks that started running.
+    uint64_t wait_ns = 0;      // total time the tasks spent in the queues.
+    uint64_t max_wait_ns = 0;  // the longest time a task spent in a queue.
+    unsigned threads = 0;      // running workers.
+  };
+
   explicit FiberQueueThreadPool(unsigned num_threads = 0, unsigned queue_size = 128);
+  explicit FiberQueueThreadPool(const Options& opts);
   ~FiberQueueThreadPool();
 
   template <typename F> auto Await(F&& f) -> decltype(f()) {
@@ -128,17 +175,24 @@ class FiberQueueThreadPool {
     return std::move(mover).get();
   }
 
+  // Runs f on any worker. Blocks while the shared queue is full.
+  // f runs under the trace context of the caller, see trace.h.
   template <typename F> void Add(F&& f) {
-    size_t start = next_index_.fetch_add(1, std::memory_order_relaxed) % worker_size_;
-    Worker& main_w = workers_[start];
-    while (true) {
-      auto key = main_w.q->push_ec_.prepareWait();
-      if (AddAnyWorker(start, std::forward<F>(f))) {
-        break;
+    Task task{nullptr, CycleClock::Now()};
+    if (TraceContext ctx = CurrentTrace(); ABSL_PREDICT_FALSE(bool(ctx)))
+      task.func = detail::TraceWrap(ctx, std::forward<F>(f));
+    else
+      task.func = std::forward<F>(f);
+
+    if (!shared_q_.try_enqueue(std::move(task))) {
+      while (true) {
+        auto key = push_ec_.prepareWait();
+        if (shared_q_.try_enqueue(std::move(task)))
+          break;
+        push_ec_.wait(key.epoch());
       }
-
-      main_w.q->push_ec_.wait(key.epoch());
     }
+    Dispatch();
   }
 
   /**
@@ -150,41 +204,67 @@ class FiberQueueThreadPool {
    * @return true if Add() had to preempt, false is fast path without preemptions was executed.
    */
   template <typename F> bool Add(size_t index, F&& f) {
-    return workers_[index % worker_size_].q->Add(std::forward<F>(f));
+    return GetQueue(index)->Add([this, f = std::forward<F>(f), start = CycleClock::Now()]() mutable {
+      OnTaskStart(start);
+      f();
+    });
   }
 
   FiberQueue* GetQueue(size_t index) {
-    return workers_[index % worker_size_].q.get();
+    return workers_[index % min_threads_].q.get();
+  }
+
+  // Number of the workers that run the pinned tasks.
+  unsigned size() const {
+    return min_threads_;
   }
 
+  Stats GetStats() const;
+
   void Shutdown();
 
  private:
-  size_t wrapped_idx(size_t i) {
-    return i < worker_size_ ? i : i - worker_size_;
-  }
+  typedef std::function<void()> CbFunc;
 
-  template <typename F> bool AddAnyWorker(size_t start, F&& f) {
-    for (size_t i = 0; i < worker_size_; ++i) {
-      auto& w = workers_[wrapped_idx(start + i)];
-      if (w.q->TryAdd(std::forward<F>(f))) {
-        return true;
-      }
-    }
-    return false;
-  }
+  struct Task {
+    CbFunc func;
+    uint64_t enqueue_tsc = 0;  // CycleClock::Now() upon Add.
+  };
 
-  void WorkerFunction(unsigned index);
+  enum WorkerState : uint8_t { kEmpty = 0, kRunning = 1, kExited = 2 };
 
   struct Worker {
     pthread_t tid;
-    std::unique_ptr<FiberQueue> q;
+    std::unique_ptr<FiberQueue> q;  // the pinned tasks, notifies the worker.
+    std::atomic_bool idle{false};
+    std::atomic<WorkerState> state{kEmpty};
   };
 
+  // Wakes an idle worker for the task that was added to the shared queue, or grows the pool.
+  void Dispatch();
+  void StartWorker(unsigned index);
+  void Grow();
+
+  // Takes the next task of the worker, alternating between its pinned and the shared tasks.
+  bool Pull(Worker* w, bool* pinned_turn, CbFunc* func);
+  void OnTaskStart(uint64_t enqueue_tsc);
+
+  void WorkerFunction(unsigned index);
+
+  Options opts_;
   std::unique_ptr<Worker[]> workers_;
-  size_t worker_size_;
+  unsigned min_threads_, max_threads_;
 
+  base::mpmc_bounded_queue<Task> shared_q_;
+  EventCount push_ec_;  // Add waits for the shared queue to have space.
+  std::atomic_int64_t shared_depth_{0};
+
+  std::mutex grow_mu_;
+  std::atomic_uint running_{0};
+  std::atomic_bool closed_{false};
   std::atomic_ulong next_index_{0};
+
+  std::atomic_uint64_t tasks_{0}, wait_ns_{0}, max_wait_ns_{0};
 };
 
 }  // namespace fb2
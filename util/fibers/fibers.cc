@@ -4,6 +4,8 @@
 
 #include "util/fibers/fibers.h"
 
+#include <mutex>
+
 #include "base/logging.h"
 
 using namespace std;
@@ -11,6 +13,45 @@ using namespace std;
 namespace util {
 namespace fb2 {
 
+namespace {
+
+using StackSizeMap = absl::flat_hash_map<string, size_t>;
+
+// The stack size overrides are read upon every fiber creation and written rarely, hence every
+// update publishes a new copy of the map. The old copies are kept since the readers do not
+// synchronize with the writers.
+mutex stack_sizes_mu;
+vector<unique_ptr<StackSizeMap>>* stack_size_maps = new vector<unique_ptr<StackSizeMap>>;
+atomic<const StackSizeMap*> stack_sizes{nullptr};
+
+}  // namespace
+
+namespace detail {
+
+size_t StackSizeOverride(string_view name) {
+  const StackSizeMap* sizes = stack_sizes.load(memory_order_acquire);
+  if (!sizes)
+    return 0;
+  auto it = sizes->find(name.substr(0, kMaxFiberNameLen));
+  return it == sizes->end() ? 0 : it->second;
+}
+
+}  // namespace detail
+
+void SetFiberStackSize(string_view name, size_t size) {
+  lock_guard lk(stack_sizes_mu);
+  const StackSizeMap* cur = stack_sizes.load(memory_order_relaxed);
+  auto next = cur ? make_unique<StackSizeMap>(*cur) : make_unique<StackSizeMap>();
+  string key(name.substr(0, detail::kMaxFiberNameLen));
+  if (size)
+    (*next)[key] = size;
+  else
+    next->erase(key);
+
+  stack_sizes.store(next->empty() ? nullptr : next.get(), memory_order_release);
+  stack_size_maps->push_back(std::move(next));
+}
+
 Fiber::~Fiber() {
   CHECK(!IsJoinable());
 }
@@ -4,9 +4,13 @@
 
 #pragma once
 
+#include <absl/container/flat_hash_map.h>
+
 #include <chrono>
+#include <string>
 #include <string_view>
 
+#include "util/fibers/cycle_clock.h"
 #include "util/fibers/detail/fiber_interface.h"
 
 namespace util {
@@ -36,16 +40,23 @@ class Fiber {
 
   template <typename Fn, typename... Arg>
   Fiber(Launch policy, std::string_view name, Fn&& fn, Arg&&... arg)
-      : impl_{detail::default_stack_resource
-                  ? detail::MakeWorkerFiberImpl(name,
-                                                FixedStackAllocator(detail::default_stack_resource,
-                                                                    detail::default_stack_size),
-                                                std::forward<Fn>(fn), std::forward<Arg>(arg)...)
-                  : detail::MakeWorkerFiberImpl(name, boost::context::fixedsize_stack(),
-                                                std::forward<Fn>(fn), std::forward<Arg>(arg)...)} {
+      : impl_{MakeImpl(name, std::forward<Fn>(fn), std::forward<Arg>(arg)...)} {
     Start(policy);
   }
 
+  struct Opts {
+    Launch launch = Launch::post;
+    FiberPriority priority = FiberPriority::NORMAL;
+    std::string_view name;
+  };
+
+  template <typename Fn, typename... Arg>
+  Fiber(const Opts& opts, Fn&& fn, Arg&&... arg)
+      : impl_{MakeImpl(opts.name, std::forward<Fn>(fn), std::forward<Arg>(arg)...)} {
+    impl_->SetPriority(opts.priority);
+    Start(opts.launch);
+  }
+
   template <typename Fn, typename StackAlloc, typename... Arg>
   Fiber(Launch policy, StackAlloc&& stack_alloc, std::string_view name, Fn&& fn, Arg&&... arg)
       : impl_{util::fb2::detail::MakeWorkerFiberImpl(name, std::forward<StackAlloc>(stack_alloc),
@@ -89,7 +100,29 @@ class Fiber {
 
   void Detach();
 
+  // Must be called from the thread of the fiber, see FiberPriority.
+  void SetPriority(FiberPriority prio) {
+    impl_->SetPriority(prio);
+  }
+
  private:
+  template <typename Fn, typename... Arg>
+  static detail::FiberInterface* MakeImpl(std::string_view name, Fn&& fn, Arg&&... arg) {
+    size_t stack_size = detail::StackSizeOverride(name);
+    if (detail::default_stack_resource) {
+      return detail::MakeWorkerFiberImpl(
+          name,
+          FixedStackAllocator(detail::default_stack_resource,
+                              stack_size ? stack_size : detail::default_stack_size),
+          std::forward<Fn>(fn), std::forward<Arg>(arg)...);
+    }
+    return detail::MakeWorkerFiberImpl(
+        name,
+        stack_size ? boost::context::fixedsize_stack(stack_size)
+                   : boost::context::fixedsize_stack(),
+        std::forward<Fn>(fn), std::forward<Arg>(arg)...);
+  }
+
   void Start(Launch launch) {
     impl_->Start(launch);
   }
@@ -104,12 +137,76 @@ uint64_t FiberSwitchEpoch() noexcept;
 // the time they were switched to in microseconds.
 uint64_t FiberSwitchDelayUsec() noexcept;
 
+// Returns the distribution of the delays between activation of the worker fibers of this
+// thread and the time they were switched to.
+const CycleHistogram& FiberReadyDelayHistogram() noexcept;
+
 // Exposes the number of times fiber were running for a "long" time (longer than 1ms).
 uint64_t FiberLongRunCnt() noexcept;
 
 // Exposes total duration of fibers running for a "long" time (longer than 1ms).
 uint64_t FiberLongRunSumUsec() noexcept;
 
+// Returns the number of yields by ThisFiber::MaybeYield() in this thread.
+uint64_t FiberAutoYieldCnt() noexcept;
+
+// Sets the time slice of the fibers with priority prio for all threads,
+// see ThisFiber::MaybeYield(). The defaults are 1ms for NORMAL and 200us for BACKGROUND fibers.
+void SetFiberTimeSlice(FiberPriority prio, std::chrono::microseconds slice);
+std::chrono::microseconds GetFiberTimeSlice(FiberPriority prio);
+
+// Runtime statistics of fibers that share the same name.
+struct FiberTypeStats {
+  uint64_t num_fibers = 0;   // number of live and terminated fibers that contributed.
+  uint64_t run_usec = 0;     // cumulative running time.
+  uint64_t switches = 0;     // number of times the fibers were switched to.
+  uint64_t ready_usec = 0;   // cumulative time spent in the ready queue before running.
+  uint64_t auto_yields = 0;  // number of yields by ThisFiber::MaybeYield().
+};
+
+using FiberTypeStatsMap = absl::flat_hash_map<std::string, FiberTypeStats>;
+
+// Enables or disables per-fiber run statistics for all threads. Disabled by default.
+void EnableFiberRunStats(bool enable);
+bool FiberRunStatsEnabled();
+
+// Returns the statistics of the calling thread aggregated by fiber name.
+// Includes the live fibers and the fibers that terminated while the stats were enabled.
+FiberTypeStatsMap GetFiberTypeStats();
+
+// Enables or disables the run-next handoff for all threads. Disabled by default.
+// When enabled, a fiber that is woken by another fiber of the same thread, e.g. a SimpleChannel
+// consumer woken by Push, runs right after the waker suspends instead of waiting behind all
+// the ready fibers. Benefits producer-consumer pipelines within a proactor.
+void EnableRunNext(bool enable);
+bool RunNextEnabled();
+
+// Stack usage of the fibers that share the same name, sampled when they terminate.
+struct FiberStackStats {
+  uint64_t num_fibers = 0;  // number of terminated fibers with painted stacks.
+  uint64_t max_used = 0;    // the highest stack watermark in bytes.
+  uint64_t sum_used = 0;
+  uint64_t stack_size = 0;  // the largest stack size of the fibers.
+};
+
+using FiberStackStatsMap = absl::flat_hash_map<std::string, FiberStackStats>;
+
+// Enables or disables the painting of the stacks of new worker fibers for all threads.
+// Disabled by default. The fibers with painted stacks record the high watermarks of their
+// stacks when they terminate, which tells how large their stacks should be, see
+// SetFiberStackSize(). Painting writes the whole stack, so it costs cpu and resident memory
+// and should be enabled only while profiling.
+void EnableStackPainting(bool enable);
+bool StackPaintingEnabled();
+
+// Returns the stack usage of the calling thread aggregated by fiber name.
+FiberStackStatsMap GetFiberStackStats();
+
+// Sets the stack size of the fibers named name that are created without an explicit stack
+// allocator. 0 restores the default size. Thread-safe, applies to the fibers created after
+// the call.
+void SetFiberStackSize(std::string_view name, size_t size);
+
 // Injects a custom memory resource for stack allocation. Can be called only once.
 // It is advised to call this function when a program starts.
 void SetDefaultStackResource(PMR_NS::memory_resource* mr, size_t default_size = 64 * 1024);
@@ -122,6 +219,10 @@ size_t WorkerFibersStackSize();
 // Returns number of worker fibers for the current thread.
 size_t WorkerFibersCount();
 
+// Returns the number of fibers of the current thread that are ready to run, excluding the
+// calling one. Linear in the number of the ready fibers.
+size_t ReadyFibersCount();
+
 class StdMallocResource : public PMR_NS::memory_resource {
  private:
   void* do_allocate(std::size_t size, std::size_t align) final;
@@ -157,6 +258,14 @@ inline void Yield() {
   fb2::detail::FiberActive()->Yield();
 }
 
+// Yields if the calling fiber has been running for longer than the time slice of its priority,
+// see SetFiberTimeSlice(). Costs a cycle counter read otherwise, hence can be called on every
+// iteration of cpu-heavy loops. Does not yield inside of FiberAtomicGuard.
+// Returns true if it yielded.
+inline bool MaybeYield() {
+  return fb2::detail::FiberActive()->MaybeYield();
+}
+
 template <typename Rep, typename Period>
 void SleepFor(const std::chrono::duration<Rep, Period>& timeout_duration) {
   SleepUntil(std::chrono::steady_clock::now() + timeout_duration);
@@ -170,6 +279,23 @@ inline std::string_view GetName() {
   return fb2::detail::FiberActive()->name();
 }
 
+// Marks the calling fiber as a candidate for work stealing: when it yields, an idle proactor
+// in the same pool may pick it up (see ProactorPool::EnableWorkStealing).
+// Only fibers that do not use thread-affine resources, like sockets, should be migratable.
+inline void SetMigratable(bool migratable) {
+  fb2::detail::FiberActive()->SetMigratable(migratable);
+}
+
+// Changes the scheduling class of the calling fiber, e.g. for background work that should
+// give way to the serving fibers. See FiberPriority.
+inline void SetPriority(fb2::FiberPriority prio) {
+  fb2::detail::FiberActive()->SetPriority(prio);
+}
+
+inline fb2::FiberPriority GetPriority() {
+  return fb2::detail::FiberActive()->priority();
+}
+
 };  // namespace ThisFiber
 
 class FiberAtomicGuard {
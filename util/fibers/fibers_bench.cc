@@ -0,0 +1,386 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+// Benchmarks of the fiber runtime. Runs the google benchmark suite on a pool of proactors.
+// Use the standard benchmark flags to filter and export the results, for example:
+//   fibers_bench --benchmark_filter=Mutex --bench_json=res.json
+// Time is measured as wall time since the work happens in the proactor threads.
+
+#include <benchmark/benchmark.h>
+
+#include <absl/flags/flag.h>
+
+#include <mutex>
+
+#include "base/bench_json.h"
+#include "base/init.h"
+#include "base/logging.h"
+#include "util/fibers/pool.h"
+#include "util/fibers/simple_channel.h"
+#include "util/fibers/synchronization.h"
+
+ABSL_FLAG(bool, epoll, false, "If true, use epoll proactors instead of io_uring");
+ABSL_FLAG(uint32_t, threads, 4, "Number of proactor threads");
+
+#ifdef __linux__
+ABSL_DECLARE_FLAG(bool, uring_ext_arg_wait);
+ABSL_DECLARE_FLAG(uint32_t, uring_min_wait_usec);
+#endif
+
+namespace util {
+namespace fb2 {
+
+using namespace std;
+
+namespace {
+
+ProactorPool* pool = nullptr;
+
+unsigned NumThreads(const benchmark::State& state) {
+  return std::min<size_t>(state.range(0), pool->size());
+}
+
+// Runs f(index) for index in [0, n) in fibers spread over the proactors and waits for all.
+template <typename F> void RunOnThreads(unsigned n, F&& f) {
+  vector<Fiber> fibers(n);
+  for (unsigned i = 0; i < n; ++i)
+    fibers[i] = pool->at(i % pool->size())->LaunchFiber([&f, i] { f(i); });
+  for (auto& fb : fibers)
+    fb.Join();
+}
+
+}  // namespace
+
+void BM_FiberCreateJoin(benchmark::State& state) {
+  pool->at(0)->Await([&] {
+    for (auto _ : state) {
+      Fiber fb([] {});
+      fb.Join();
+    }
+  });
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FiberCreateJoin)->UseRealTime();
+
+void BM_FiberDispatchJoin(benchmark::State& state) {
+  pool->at(0)->Await([&] {
+    for (auto _ : state) {
+      Fiber fb(Launch::dispatch, [] {});
+      fb.Join();
+    }
+  });
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FiberDispatchJoin)->UseRealTime();
+
+// Creates and destroys short-lived fibers, optionally on recycled stacks and with a name.
+void BM_FiberCreateDestroy(benchmark::State& state) {
+  bool recycled = state.range(0), named = state.range(1);
+  string_view name = named ? "bench_fiber" : "";
+  pool->at(0)->Await([&] {
+    for (auto _ : state) {
+      Fiber fb = recycled ? Fiber(Launch::dispatch, RecyclingStackAllocator{}, name, [] {})
+                          : Fiber(Launch::dispatch, name, [] {});
+      fb.Join();
+    }
+  });
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FiberCreateDestroy)
+    ->ArgsProduct({{0, 1}, {0, 1}})
+    ->ArgNames({"recycled", "named"})
+    ->UseRealTime();
+
+// Context switches between fibers of the same thread.
+void BM_FiberSwitch(benchmark::State& state) {
+  unsigned num_fibers = state.range(0);
+  pool->at(0)->Await([&] {
+    bool done = false;
+    vector<Fiber> fibers(num_fibers - 1);
+    for (auto& fb : fibers) {
+      fb = Fiber([&] {
+        while (!done)
+          ThisFiber::Yield();
+      });
+    }
+
+    for (auto _ : state) {
+      ThisFiber::Yield();
+    }
+    done = true;
+    for (auto& fb : fibers)
+      fb.Join();
+  });
+  state.SetItemsProcessed(state.iterations() * num_fibers);
+}
+BENCHMARK(BM_FiberSwitch)->Arg(2)->Arg(16)->UseRealTime();
+
+void BM_AwaitBrief(benchmark::State& state) {
+  ProactorBase* p = pool->at(0);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(p->AwaitBrief([] { return 1; }));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_AwaitBrief)->UseRealTime();
+
+// Throughput of DispatchBrief: batches of callbacks followed by a single wait.
+void BM_DispatchBrief(benchmark::State& state) {
+  ProactorBase* p = pool->at(0);
+  unsigned batch = state.range(0);
+  for (auto _ : state) {
+    BlockingCounter bc(batch);
+    for (unsigned i = 0; i < batch; ++i)
+      p->DispatchBrief([bc]() mutable { bc->Dec(); });
+    bc->Wait();
+  }
+  state.SetItemsProcessed(state.iterations() * batch);
+}
+BENCHMARK(BM_DispatchBrief)->Arg(1)->Arg(64)->UseRealTime();
+
+// Cross-thread round trip from a proactor fiber to another proactor.
+void BM_AwaitBriefProactor(benchmark::State& state) {
+  ProactorBase* dest = pool->at(1 % pool->size());
+  pool->at(0)->Await([&] {
+    for (auto _ : state) {
+      benchmark::DoNotOptimize(dest->AwaitBrief([] { return 1; }));
+    }
+  });
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_AwaitBriefProactor)->UseRealTime();
+
+#ifdef __linux__
+// The idle wait of an io_uring proactor that is woken by another thread, or by the timer of
+// a sleeping fiber if range(0) is set. range(1) waits with IORING_ENTER_EXT_ARG on
+// the registered ring fd, otherwise via liburing. range(2) is the min-wait timeout in usec.
+void BM_UringIdleWait(benchmark::State& state) {
+  bool timer = state.range(0);
+  absl::SetFlag(&FLAGS_uring_ext_arg_wait, state.range(1) != 0);
+  absl::SetFlag(&FLAGS_uring_min_wait_usec, state.range(2));
+  unique_ptr<ProactorPool> pp(Pool::IOUring(256, 1));
+  pp->Run();
+  absl::SetFlag(&FLAGS_uring_ext_arg_wait, true);
+  absl::SetFlag(&FLAGS_uring_min_wait_usec, 0);
+
+  ProactorBase* p = pp->at(0);
+  if (timer) {
+    p->Await([&] {
+      for (auto _ : state)
+        ThisFiber::SleepFor(10us);
+    });
+  } else {
+    for (auto _ : state)
+      benchmark::DoNotOptimize(p->AwaitBrief([] { return 1; }));
+  }
+  pp->Stop();
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_UringIdleWait)
+    ->ArgsProduct({{0, 1}, {0, 1}, {0}})
+    ->Args({0, 1, 50})
+    ->ArgNames({"timer", "ext_arg", "min_wait"})
+    ->UseRealTime();
+#endif
+
+void BM_AwaitFiberOnAll(benchmark::State& state) {
+  for (auto _ : state) {
+    pool->AwaitFiberOnAll([](ProactorBase*) {});
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_AwaitFiberOnAll)->UseRealTime();
+
+// Ping-pong between two threads that notify each other via EventCount.
+void BM_EventCountPingPong(benchmark::State& state) {
+  EventCount ec[2];
+  atomic_uint64_t turn{0};
+  uint64_t iters = state.max_iterations;
+  ProactorBase* peer = pool->at(1 % pool->size());
+
+  Fiber pong = peer->LaunchFiber([&] {
+    for (uint64_t i = 0; i < iters; ++i) {
+      ec[1].await([&] { return turn.load(memory_order_acquire) == 2 * i + 1; });
+      turn.store(2 * i + 2, memory_order_release);
+      ec[0].notify();
+    }
+  });
+
+  pool->at(0)->Await([&] {
+    uint64_t i = 0;
+    for (auto _ : state) {
+      turn.store(2 * i + 1, memory_order_release);
+      ec[1].notify();
+      ec[0].await([&] { return turn.load(memory_order_acquire) == 2 * i + 2; });
+      ++i;
+    }
+  });
+  pong.Join();
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_EventCountPingPong)->UseRealTime();
+
+// Fibers on range(0) threads, range(1) fibers per thread, all locking the same mutex.
+void BM_MutexContention(benchmark::State& state) {
+  constexpr unsigned kOps = 1000;
+  unsigned num_threads = NumThreads(state);
+  unsigned fibers_per_thread = state.range(1);
+  Mutex mu;
+  uint64_t counter = 0;
+
+  for (auto _ : state) {
+    RunOnThreads(num_threads, [&](unsigned) {
+      vector<Fiber> fibers(fibers_per_thread);
+      for (auto& fb : fibers) {
+        fb = Fiber([&] {
+          for (unsigned j = 0; j < kOps; ++j) {
+            std::lock_guard lk(mu);
+            ++counter;
+          }
+        });
+      }
+      for (auto& fb : fibers)
+        fb.Join();
+    });
+  }
+  CHECK_EQ(state.iterations() * num_threads * fibers_per_thread * kOps, counter);
+  state.SetItemsProcessed(counter);
+}
+BENCHMARK(BM_MutexContention)
+    ->ArgsProduct({{1, 2, 4}, {1, 8}})
+    ->ArgNames({"threads", "fibers"})
+    ->UseRealTime();
+
+// Producer fiber on the first thread passes items one by one to consumers on the other
+// threads via Mutex and CondVar.
+void BM_CondVarHandoff(benchmark::State& state) {
+  constexpr unsigned kItems = 1000;
+  unsigned num_consumers = std::max(1u, NumThreads(state) - 1);
+  Mutex mu;
+  CondVar cv_ready, cv_free;
+  unsigned pending = 0;
+  bool closed = false;
+  uint64_t consumed = 0;
+
+  for (auto _ : state) {
+    closed = false;
+    RunOnThreads(num_consumers + 1, [&](unsigned index) {
+      if (index == 0) {
+        for (unsigned i = 0; i < kItems; ++i) {
+          std::unique_lock lk(mu);
+          cv_free.wait(lk, [&] { return pending == 0; });
+          pending = 1;
+          cv_ready.notify_one();
+        }
+        std::unique_lock lk(mu);
+        cv_free.wait(lk, [&] { return pending == 0; });
+        closed = true;
+        cv_ready.notify_all();
+        return;
+      }
+
+      std::unique_lock lk(mu);
+      while (true) {
+        cv_ready.wait(lk, [&] { return pending > 0 || closed; });
+        if (pending == 0)
+          break;
+        pending = 0;
+        ++consumed;
+        cv_free.notify_one();
+      }
+    });
+  }
+  CHECK_EQ(state.iterations() * kItems, consumed);
+  state.SetItemsProcessed(consumed);
+}
+BENCHMARK(BM_CondVarHandoff)->Arg(2)->Arg(4)->ArgName("threads")->UseRealTime();
+
+// One producer thread, range(0) - 1 consumer threads.
+void BM_SimpleChannel(benchmark::State& state) {
+  constexpr unsigned kItems = 10000;
+  unsigned num_consumers = std::max(1u, NumThreads(state) - 1);
+  atomic_uint64_t consumed{0};
+
+  for (auto _ : state) {
+    SimpleChannel<uint64_t> channel(256);
+    RunOnThreads(num_consumers + 1, [&](unsigned index) {
+      if (index == 0) {
+        for (uint64_t i = 0; i < kItems; ++i)
+          channel.Push(i);
+        channel.StartClosing();
+        return;
+      }
+      uint64_t val, cnt = 0;
+      while (channel.Pop(val))
+        ++cnt;
+      consumed.fetch_add(cnt, memory_order_relaxed);
+    });
+  }
+  CHECK_EQ(state.iterations() * kItems, consumed.load());
+  state.SetItemsProcessed(consumed.load());
+}
+BENCHMARK(BM_SimpleChannel)->Arg(2)->Arg(4)->ArgName("threads")->UseRealTime();
+
+// Ping-pong between two fibers of the same thread over channels of capacity 1, with range(1)
+// fibers that keep yielding. range(0) enables the run-next handoff.
+void BM_SimpleChannelPingPong(benchmark::State& state) {
+  unsigned num_busy = state.range(1);
+  EnableRunNext(state.range(0));
+  pool->at(0)->Await([&] {
+    SimpleChannel<uint64_t> ping(1), pong(1);
+    bool done = false;
+    vector<Fiber> busy(num_busy);
+    for (auto& fb : busy) {
+      fb = Fiber([&] {
+        while (!done)
+          ThisFiber::Yield();
+      });
+    }
+
+    Fiber echo([&] {
+      uint64_t val;
+      while (ping.Pop(val))
+        pong.Push(val);
+    });
+
+    uint64_t i = 0, val;
+    for (auto _ : state) {
+      ping.Push(i++);
+      pong.Pop(val);
+    }
+    ping.StartClosing();
+    echo.Join();
+    done = true;
+    for (auto& fb : busy)
+      fb.Join();
+  });
+  EnableRunNext(false);
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SimpleChannelPingPong)
+    ->ArgsProduct({{0, 1}, {0, 16}})
+    ->ArgNames({"run_next", "busy"})
+    ->UseRealTime();
+
+}  // namespace fb2
+}  // namespace util
+
+int main(int argc, char** argv) {
+  if (!base::InitBenchJson(&argc, argv))
+    benchmark::Initialize(&argc, argv);
+  MainInitGuard guard(&argc, &argv);
+
+  using util::fb2::Pool;
+  uint32_t threads = absl::GetFlag(FLAGS_threads);
+  std::unique_ptr<util::ProactorPool> pp(absl::GetFlag(FLAGS_epoll) ? Pool::Epoll(threads)
+                                                                    : Pool::IOUring(256, threads));
+  pp->Run();
+  util::fb2::pool = pp.get();
+
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+
+  pp->Stop();
+  return 0;
+}
@@ -4,23 +4,54 @@
 
 #include "util/fibers/fibers.h"
 
+#include <absl/container/flat_hash_set.h>
+#include <absl/flags/flag.h>
+#include <absl/flags/reflection.h>
 #include <absl/strings/str_cat.h>
 
 #include <condition_variable>
 #include <mutex>
+#include <numeric>
+#include <random>
+#include <shared_mutex>
 #include <thread>
 
+#include <gmock/gmock.h>
+
 #include "base/gtest.h"
 #include "base/logging.h"
+#include "util/fibers/cycle_clock.h"
 #include "util/fibers/epoll_proactor.h"
+#include "util/fibers/event_log.h"
+#include "util/fibers/fiber_group.h"
+#include "util/fibers/fiber_local.h"
+#include "util/fibers/fiberqueue_threadpool.h"
 #include "util/fibers/future.h"
+#include "util/fibers/memory_pressure.h"
+#include "util/fibers/message_lanes.h"
+#include "util/fibers/parallel.h"
+#include "util/fibers/pool.h"
+#include "util/fibers/rcu.h"
+#include "util/fibers/read_buffer_pool.h"
+#include "util/fibers/sampling_profiler.h"
+#include "util/fibers/sharded_cache.h"
+#include "util/fibers/simple_channel.h"
+#include "util/fibers/stack_cache.h"
+#include "util/fibers/stall_detector.h"
 #include "util/fibers/synchronization.h"
+#include "util/fibers/task.h"
+#include "util/fibers/trace.h"
+#include "util/fibers/write_queue.h"
 
 #ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/syscall.h>
 
 #include "util/fibers/uring_proactor.h"
 
+ABSL_DECLARE_FLAG(bool, uring_futex_wakeup);
+
 // older linux systems do not expose this system call so we wrap it in our own function.
 int my_gettid() {
   return syscall(SYS_gettid);
@@ -369,6 +400,121 @@ TEST_F(FiberTest, Future) {
   fb.Join();
 }
 
+TEST_F(FiberTest, Promise) {
+  // T does not need to be default constructible.
+  struct Value {
+    explicit Value(int v) : val(v) {
+    }
+    int val;
+  };
+
+  ProactorThread pth(0, ProactorBase::EPOLL);
+  {
+    EmbeddedFuture<Value> fut;
+    Promise<Value> promise = fut.GetPromise();
+    pth.get()->DispatchBrief(
+        [promise = std::move(promise)]() mutable { promise.Resolve(Value{42}); });
+    EXPECT_EQ(42, fut.Get().val);
+  }
+
+  // The continuation runs inline in the resolving thread.
+  Future<int> fut;
+  Done done;
+  std::thread::id cont_thread;
+  fut.Then([&](int&& val) {
+    EXPECT_EQ(7, val);
+    cont_thread = std::this_thread::get_id();
+    done.Notify();
+  });
+  pth.get()->DispatchBrief([promise = fut.GetPromise()]() mutable { promise.Resolve(7); });
+  done.Wait();
+  EXPECT_EQ(pth.proactor_thread.get_id(), cont_thread);
+
+  // Resolved futures run the continuation right away.
+  Future<int> ready;
+  ready.Resolve(3);
+  int res = 0;
+  ready.Then([&](int&& val) { res = val; });
+  EXPECT_EQ(3, res);
+
+  // Neither a spare promise nor a promise that outlives Future::Resolve breaks the future.
+  Future<int> multi;
+  Promise<int> keep = multi.GetPromise();
+  {
+    Promise<int> spare = multi.GetPromise();
+  }
+  EXPECT_FALSE(multi.IsReady());
+  multi.Resolve(5);
+  {
+    Promise<int> late = std::move(keep);
+  }
+  EXPECT_EQ(5, multi.Get());
+}
+
+TEST_F(FiberTest, BrokenPromise) {
+  Future<int> fut;
+  Fiber fb("consumer", [fut]() mutable { EXPECT_FALSE(fut.TryGet()); });
+  {
+    Promise<int> promise = fut.GetPromise();
+  }
+  fb.Join();
+  EXPECT_TRUE(fut.IsBroken());
+  EXPECT_THROW(fut.Get(), std::future_error);
+
+  {
+    EmbeddedFuture<int> embedded;
+    embedded.GetPromise();
+    EXPECT_TRUE(embedded.IsBroken());
+    EXPECT_THROW(embedded.Get(), std::future_error);
+  }
+
+  // The continuation of a broken future is dropped, which releases its captures.
+  Future<int> first, second;
+  bool ran = false;
+  first.Then([&ran, promise = second.GetPromise()](int&& val) mutable {
+    ran = true;
+    promise.Resolve(val);
+  });
+  first.GetPromise();
+  EXPECT_FALSE(ran);
+  EXPECT_TRUE(second.IsBroken());
+}
+
+#if defined(__linux__) && defined(HELIO_HAS_TASKS)
+
+namespace {
+
+Task NopTask(UringProactor* p, TaskEvent* ev, BlockingCounter bc, unsigned* cnt) {
+  int res = co_await AwaitIo(p, [](SubmitEntry& se) { se.PrepNOP(); });
+  EXPECT_EQ(0, res);
+  co_await SleepFor(p, 1ms);
+  co_await ev->Wait();
+  ++*cnt;
+  bc->Dec();
+}
+
+}  // namespace
+
+TEST_F(FiberTest, Tasks) {
+  constexpr unsigned kNumTasks = 10000;
+  ProactorThread pth(0, ProactorBase::IOURING);
+  UringProactor* up = static_cast<UringProactor*>(pth.get());
+
+  vector<TaskEvent> events(kNumTasks);
+  BlockingCounter bc(kNumTasks);
+  unsigned cnt = 0;
+  for (unsigned i = 0; i < kNumTasks; ++i)
+    SpawnTask(up, NopTask(up, &events[i], bc, &cnt));
+
+  // Notified from another thread, before or after the tasks reached the wait.
+  for (auto& ev : events)
+    ev.Notify();
+  bc->Wait();
+  EXPECT_EQ(kNumTasks, cnt);
+}
+
+#endif
+
 #ifdef __linux__
 
 TEST_F(FiberTest, AsyncEvent) {
@@ -413,6 +559,215 @@ TEST_F(FiberTest, RegisteredBuffers) {
   });
 }
 
+TEST_F(FiberTest, RegisteredBuffersHugepages) {
+  ProactorThread pth(0, ProactorBase::IOURING);
+  pth.get()->AwaitBrief([&] {
+    UringProactor* up = static_cast<UringProactor*>(pth.proactor.get());
+    constexpr size_t k2MB = 1 << 21;
+    ASSERT_EQ(up->RegisterBuffers(k2MB), 0);
+
+    // Falls back to regular pages if the system has no free hugepages.
+    auto stats = up->GetRegisteredBufferStats();
+    EXPECT_EQ(stats.total_bytes, k2MB);
+    EXPECT_TRUE(stats.hugepage_bytes == 0 || stats.hugepage_bytes == k2MB);
+
+    auto buf = up->RequestBuffer(8192);
+    ASSERT_TRUE(buf.has_value());
+    memset(buf->bytes.data(), 'a', buf->bytes.size());
+    EXPECT_EQ(up->FindRegisteredBuffer(buf->bytes.data() + 1, 100), buf->buf_idx);
+
+    char local[16];
+    EXPECT_FALSE(up->FindRegisteredBuffer(local, sizeof(local)).has_value());
+    up->ReturnBuffer(*buf);
+  });
+}
+
+TEST_F(FiberTest, PostMsg) {
+  ProactorThread src(0, ProactorBase::IOURING), dest(1, ProactorBase::IOURING);
+  UringProactor* src_up = static_cast<UringProactor*>(src.proactor.get());
+  UringProactor* dest_up = static_cast<UringProactor*>(dest.proactor.get());
+  if (!src_up->HasMsgRing()) {
+    GTEST_SKIP() << "MSG_RING is not supported";
+  }
+
+  static pid_t handler_tid;
+  static Done* handler_done;
+  static uint64_t handler_data;
+  static int32_t handler_arg;
+
+  uint16_t id = UringProactor::RegisterMsgHandler([](uint64_t data, int32_t arg) {
+    handler_tid = my_gettid();
+    handler_data = data;
+    handler_arg = arg;
+    handler_done->Notify();
+  });
+
+  Done done;
+  handler_done = &done;
+  pid_t dest_tid = dest.get()->AwaitBrief([] { return my_gettid(); });
+  src.get()->AwaitBrief(
+      [&] { EXPECT_TRUE(src_up->PostMsg(dest_up, id, (1ULL << 48) - 1, -5)); });
+  done.Wait();
+
+  EXPECT_EQ(dest_tid, handler_tid);
+  EXPECT_EQ((1ULL << 48) - 1, handler_data);
+  EXPECT_EQ(-5, handler_arg);
+}
+
+TEST_F(FiberTest, RegisteredBuffersGrow) {
+  ProactorThread pth(0, ProactorBase::IOURING);
+  pth.get()->DispatchBrief([&] {
+    UringProactor* up = static_cast<UringProactor*>(pth.proactor.get());
+    ASSERT_EQ(up->RegisterBuffers(4 * 4096, 16 * 4096), 0);
+
+    auto first = up->RequestBuffer(4 * 4096);
+    ASSERT_TRUE(first.has_value());
+    EXPECT_EQ(*first->buf_idx, 0u);
+
+    // Grows into a second region.
+    auto second = up->RequestBuffer(2 * 4096);
+    ASSERT_TRUE(second.has_value());
+    EXPECT_EQ(*second->buf_idx, 1u);
+    memset(second->bytes.data(), 'a', second->bytes.size());
+
+    // Exceeds max_size.
+    EXPECT_FALSE(up->RequestBuffer(16 * 4096).has_value());
+
+    auto stats = up->GetRegisteredBufferStats();
+    EXPECT_EQ(stats.regions, 2u);
+    EXPECT_EQ(stats.grow_cnt, 1u);
+    EXPECT_EQ(stats.total_bytes, 8 * 4096);
+    EXPECT_EQ(stats.used_bytes, 6 * 4096);
+    EXPECT_EQ(stats.requests, 3u);
+    EXPECT_EQ(stats.failures, 1u);
+
+    up->ReturnBuffer(*first);
+    up->ReturnBuffer(*second);
+    EXPECT_EQ(up->GetRegisteredBufferStats().used_bytes, 0u);
+  });
+}
+
+TEST_F(FiberTest, FutexWakeup) {
+  absl::FlagSaver saver;
+  absl::SetFlag(&FLAGS_uring_futex_wakeup, true);
+  ProactorThread pth(0, ProactorBase::IOURING);
+  UringProactor* proactor = static_cast<UringProactor*>(pth.get());
+  if (!proactor->AwaitBrief([&] { return proactor->HasFutexWakeup(); })) {
+    GTEST_SKIP() << "IORING_OP_FUTEX_WAIT is not supported";
+  }
+
+  // Plain threads have no ring and wake the proactor via the futex. Some of the wakeups
+  // coincide with the ring consuming the previous one.
+  constexpr unsigned kNumThreads = 4, kNumTasks = 2000;
+  atomic_uint cnt{0};
+  vector<thread> threads;
+  for (unsigned i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([&, i] {
+      for (unsigned j = 0; j < kNumTasks; ++j) {
+        proactor->DispatchBrief([&] { cnt.fetch_add(1, memory_order_relaxed); });
+        if ((i + j) % 64 == 0)
+          this_thread::sleep_for(50us);
+      }
+    });
+  }
+  for (auto& th : threads)
+    th.join();
+
+  // The proactor sleeps in between, each Await wakes it up again.
+  for (unsigned i = 0; i < 100; ++i) {
+    this_thread::sleep_for(100us);
+    proactor->AwaitBrief([] {});
+  }
+  EXPECT_EQ(kNumThreads * kNumTasks, cnt.load());
+}
+
+TEST_F(FiberTest, EpollStaleEvent) {
+  ProactorThread pth(0, ProactorBase::EPOLL);
+  EpollProactor* proactor = static_cast<EpollProactor*>(pth.get());
+  int fds[3];
+  for (int& fd : fds) {
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ASSERT_GE(fd, 0);
+  }
+
+  // Both eventfds become readable before the proactor polls, hence their events arrive in
+  // the same batch. Whichever is dispatched first moves the entry of the other one to
+  // fds[2], which must not receive the pending event of the old fd.
+  unsigned index[2];
+  int moved = -1;
+  unsigned fired = 0, stale = 0;
+  Done done;
+  proactor->Await([&] {
+    for (unsigned i = 0; i < 2; ++i) {
+      auto cb = [&, i](uint32_t, int, EpollProactor*) {
+        uint64_t val;
+        EXPECT_EQ(8, read(fds[i], &val, 8));
+        ++fired;
+
+        unsigned other = 1 - i;
+        moved = other;
+        proactor->Disarm(fds[other], index[other]);
+        unsigned prev = index[other];
+        index[other] = proactor->Arm(
+            fds[2], [&](uint32_t, int, EpollProactor*) { ++stale; }, EPOLLIN);
+        EXPECT_EQ(prev, index[other]);
+        done.Notify();
+      };
+      index[i] = proactor->Arm(fds[i], std::move(cb), EPOLLIN);
+    }
+
+    uint64_t val = 1;
+    for (unsigned i = 0; i < 2; ++i)
+      ASSERT_EQ(8, write(fds[i], &val, 8));
+  });
+
+  done.Wait();
+  proactor->Await([&] {
+    ThisFiber::SleepFor(1ms);
+    EXPECT_EQ(1u, fired);
+    EXPECT_EQ(0u, stale);
+
+    ASSERT_GE(moved, 0);
+    proactor->Disarm(fds[1 - moved], index[1 - moved]);
+    proactor->Disarm(fds[2], index[moved]);
+  });
+  for (int fd : fds)
+    close(fd);
+}
+
+TEST_F(FiberTest, EpollPreciseTimeout) {
+#ifdef SYS_epoll_pwait2
+  int efd = epoll_create1(EPOLL_CLOEXEC);
+  ASSERT_GE(efd, 0);
+  epoll_event ev;
+  timespec ts{0, 0};
+  int res = syscall(SYS_epoll_pwait2, efd, &ev, 1, &ts, nullptr, 0);
+  int err = errno;
+  close(efd);
+  if (res < 0 && err == ENOSYS) {
+    GTEST_SKIP() << "epoll_pwait2 is not supported";
+  }
+
+  ProactorThread pth(0, ProactorBase::EPOLL);
+  ProactorBase* proactor = pth.get();
+  proactor->Await([&] {
+    // epoll_wait would round each of the sleeps up to a millisecond.
+    constexpr unsigned kNum = 20;
+    uint64_t stalls = proactor->stats().num_stalls;
+    auto start = chrono::steady_clock::now();
+    for (unsigned i = 0; i < kNum; ++i)
+      ThisFiber::SleepFor(200us);
+    auto elapsed = chrono::steady_clock::now() - start;
+
+    EXPECT_GT(proactor->stats().num_stalls, stalls);
+    EXPECT_GE(elapsed, kNum * 200us);
+    EXPECT_LT(elapsed, kNum * 1ms);
+  });
+#else
+  GTEST_SKIP() << "epoll_pwait2 is not available";
+#endif
+}
+
 #if 0
 TEST_F(FiberTest, CleanExit) {
   ASSERT_EXIT(
@@ -503,6 +858,433 @@ TEST_F(FiberTest, StackSize) {
   fb1.Join();
 }
 
+TEST_F(FiberTest, StackCache) {
+  for (bool hugepages : {false, true}) {
+    StackCacheResource::Options opts;
+    opts.use_hugepages = hugepages;
+    opts.max_cached_per_thread = 4;
+    StackCacheResource resource(opts);
+
+    for (unsigned i = 0; i < 100; ++i) {
+      Fiber fb(Launch::dispatch, FixedStackAllocator(&resource, opts.stack_size), "fb",
+               [] { ThisFiber::Yield(); });
+      fb.Join();
+    }
+
+    // Terminated fibers are released lazily by the scheduler, so a stack or two may still
+    // be in flight.
+    StackCacheResource::Stats stats = resource.GetThreadStats();
+    EXPECT_EQ(100u, stats.hits + stats.misses);
+    EXPECT_LE(stats.misses, 2u);
+    EXPECT_EQ(stats.misses, stats.in_use + stats.cached);
+    EXPECT_EQ(stats.cached * opts.stack_size, stats.resident_bytes);
+  }
+}
+
+TEST_F(FiberTest, RecyclingStackAllocator) {
+  absl::flat_hash_set<detail::FiberInterface*> blocks;
+  for (unsigned i = 0; i < 100; ++i) {
+    Fiber fb(Launch::dispatch, RecyclingStackAllocator{}, "recycled",
+             [&] { blocks.insert(detail::FiberActive()); });
+    fb.Join();
+  }
+
+  // The control blocks live on the stacks, hence they are recycled as well. Terminated fibers
+  // are released lazily by the scheduler, so a stack or two may still be in flight.
+  EXPECT_LE(blocks.size(), 3u);
+}
+
+TEST_F(FiberTest, FiberNames) {
+  const char* name = nullptr;
+  Fiber fb("named_fb", [&] {
+    name = detail::FiberActive()->name();
+    ThisFiber::SetName(string(100, 'x'));
+    EXPECT_EQ(detail::kMaxFiberNameLen, strlen(detail::FiberActive()->name()));
+  });
+  fb.Join();
+
+  // Equal names share their storage.
+  EXPECT_STREQ("named_fb", name);
+  EXPECT_EQ(name, detail::InternFiberName("named_fb"));
+  EXPECT_STREQ("", detail::InternFiberName(""));
+}
+
+TEST_F(FiberTest, StackWatermark) {
+  EnableStackPainting(true);
+  SetFiberStackSize("stack_fb", 128 * 1024);
+  Fiber fb("stack_fb", [] {
+    char buf[16384];
+    memset(buf, 1, sizeof(buf));
+    benchmark::DoNotOptimize(buf);
+  });
+  fb.Join();
+  SetFiberStackSize("stack_fb", 0);
+
+  FiberStackStatsMap stats = GetFiberStackStats();
+  EnableStackPainting(false);
+
+  auto it = stats.find("stack_fb");
+  ASSERT_TRUE(it != stats.end());
+  EXPECT_EQ(1u, it->second.num_fibers);
+  EXPECT_GE(it->second.max_used, 16384u);
+  EXPECT_LT(it->second.max_used, 32768u);
+  EXPECT_EQ(128u * 1024, it->second.stack_size);
+}
+
+TEST_F(FiberTest, RunStats) {
+  EnableFiberRunStats(true);
+  Fiber fb("stats_fb", [] {
+    for (unsigned i = 0; i < 10; ++i)
+      ThisFiber::Yield();
+  });
+  fb.Join();
+
+  FiberTypeStatsMap stats = GetFiberTypeStats();
+  EnableFiberRunStats(false);
+
+  auto it = stats.find("stats_fb");
+  ASSERT_TRUE(it != stats.end());
+  EXPECT_EQ(1u, it->second.num_fibers);
+  EXPECT_GE(it->second.switches, 11u);
+}
+
+struct LocalCounter {
+  static unsigned destroyed;
+
+  ~LocalCounter() {
+    ++destroyed;
+  }
+
+  unsigned val = 0;
+};
+
+unsigned LocalCounter::destroyed = 0;
+
+TEST_F(FiberTest, FiberLocal) {
+  static FiberLocal<LocalCounter> counter;
+
+  counter->val = 1;
+  EXPECT_EQ(1u, counter.GetIfExists()->val);
+
+  Fiber fb1([&] {
+    EXPECT_EQ(nullptr, counter.GetIfExists());
+    for (unsigned i = 0; i < 3; ++i) {
+      ++counter->val;
+      ThisFiber::Yield();
+    }
+    EXPECT_EQ(3u, counter->val);
+    auto* arena = ThisFiber::Arena();
+    EXPECT_EQ(arena, ThisFiber::Arena());
+    EXPECT_NE(nullptr, arena->Allocate(100));
+  });
+  Fiber fb2([&] {
+    for (unsigned i = 0; i < 3; ++i) {
+      counter->val += 10;
+      ThisFiber::Yield();
+    }
+    EXPECT_EQ(30u, counter->val);
+  });
+
+  fb1.Join();
+  fb2.Join();
+  EXPECT_EQ(2u, LocalCounter::destroyed);
+  EXPECT_EQ(1u, counter->val);
+
+  counter.reset();
+  EXPECT_EQ(3u, LocalCounter::destroyed);
+  EXPECT_EQ(nullptr, counter.GetIfExists());
+}
+
+TEST_F(FiberTest, FiberGroup) {
+  // Returns after the timeout or once cancelled.
+  auto sleeper = [](chrono::milliseconds timeout, unsigned val) {
+    return [=](const CancellationToken& token) -> unsigned {
+      auto deadline = chrono::steady_clock::now() + timeout;
+      while (!token.IsCancelled() && chrono::steady_clock::now() < deadline)
+        ThisFiber::SleepFor(1ms);
+      return token.IsCancelled() ? 0 : val;
+    };
+  };
+
+  vector<CancellableTask<unsigned>> tasks = {sleeper(1s, 1), sleeper(5ms, 2), sleeper(1s, 3)};
+  auto start = chrono::steady_clock::now();
+  auto [index, res] = WhenAny(std::move(tasks));
+  EXPECT_EQ(1u, index);
+  EXPECT_EQ(2u, res);
+  EXPECT_LT(chrono::steady_clock::now() - start, 500ms);
+
+  tasks = {sleeper(1ms, 1), sleeper(2ms, 2)};
+  EXPECT_THAT(WhenAll(std::move(tasks)), testing::ElementsAre(1, 2));
+
+  // Cancellation propagates from the parent and runs the registered callbacks.
+  CancellationToken parent;
+  unsigned cancelled = 0;
+  {
+    FiberGroup group(parent);
+    for (unsigned i = 0; i < 3; ++i) {
+      group.Spawn([&](const CancellationToken& token) {
+        EventCount ec;
+        CancellationToken::Registration reg(token, [&] {
+          ++cancelled;
+          ec.notify();
+        });
+        ec.await([&] { return token.IsCancelled(); });
+      });
+    }
+    ThisFiber::Yield();
+    parent.Cancel();
+  }
+  EXPECT_EQ(3u, cancelled);
+
+  // Registering on a cancelled token runs the callback right away.
+  CancellationToken::Registration reg(parent, [&] { ++cancelled; });
+  EXPECT_EQ(4u, cancelled);
+}
+
+TEST_F(FiberTest, Priority) {
+  vector<string> order;
+  auto record = [&](string name) { return [&order, name] { order.push_back(name); }; };
+  Fiber::Opts bg_opts;
+  bg_opts.priority = FiberPriority::BACKGROUND;
+
+  Fiber bg1(bg_opts, record("bg1"));
+  Fiber n1(record("n1"));
+  Fiber bg2(bg_opts, record("bg2"));
+  Fiber n2(record("n2"));
+  Fiber n3(record("n3"));
+  n3.SetPriority(FiberPriority::BACKGROUND);  // moves the ready fiber to the background queue.
+  bg2.SetPriority(FiberPriority::NORMAL);
+
+  bg1.Join();
+  n1.Join();
+  bg2.Join();
+  n2.Join();
+  n3.Join();
+  EXPECT_THAT(order, testing::ElementsAre("n1", "n2", "bg2", "bg1", "n3"));
+
+  // A background fiber is not starved by normal fibers that keep yielding.
+  bool bg_done = false;
+  Fiber bg(bg_opts, [&] { bg_done = true; });
+  Fiber busy([&] {
+    auto deadline = chrono::steady_clock::now() + 2s;
+    while (!bg_done && chrono::steady_clock::now() < deadline)
+      ThisFiber::Yield();
+  });
+  busy.Join();
+  EXPECT_TRUE(bg_done);
+  bg.Join();
+
+  ThisFiber::SetPriority(FiberPriority::BACKGROUND);
+  EXPECT_EQ(FiberPriority::BACKGROUND, ThisFiber::GetPriority());
+  ThisFiber::SetPriority(FiberPriority::NORMAL);
+}
+
+TEST_F(FiberTest, RunNext) {
+  EnableRunNext(true);
+  vector<string> order;
+  auto record = [&](string name) { return [&order, name] { order.push_back(name); }; };
+
+  // The woken fiber runs before the fibers that were ready before it.
+  Fiber waker([&] {
+    EventCount ec;
+    bool ready = false;
+    Fiber a([&] {
+      ec.await([&] { return ready; });
+      order.push_back("a");
+    });
+    ThisFiber::Yield();  // a blocks.
+
+    Fiber b(record("b")), c(record("c"));
+    ready = true;
+    ec.notify();
+    a.Join();
+    b.Join();
+    c.Join();
+  });
+  waker.Join();
+  EXPECT_THAT(order, testing::ElementsAre("a", "b", "c"));
+
+  // A pair of fibers that wake each other does not starve a yielding fiber.
+  EventCount ec[2];
+  unsigned turn = 0, busy_runs = 0;
+  bool done = false;
+  constexpr unsigned kRounds = 1000;
+  Fiber busy([&] {
+    while (!done) {
+      ++busy_runs;
+      ThisFiber::Yield();
+    }
+  });
+  Fiber pong([&] {
+    for (unsigned i = 0; i < kRounds; ++i) {
+      ec[1].await([&] { return turn == 2 * i + 1; });
+      turn = 2 * i + 2;
+      ec[0].notify();
+    }
+  });
+  Fiber ping([&] {
+    for (unsigned i = 0; i < kRounds; ++i) {
+      turn = 2 * i + 1;
+      ec[1].notify();
+      ec[0].await([&] { return turn == 2 * i + 2; });
+    }
+    done = true;
+  });
+  ping.Join();
+  pong.Join();
+  busy.Join();
+  EXPECT_GE(busy_runs, kRounds / detail::Scheduler::kRunNextMaxStreak);
+  EnableRunNext(false);
+}
+
+TEST_F(FiberTest, MaybeYield) {
+  EXPECT_EQ(1000us, GetFiberTimeSlice(FiberPriority::NORMAL));
+  SetFiberTimeSlice(FiberPriority::NORMAL, 100us);
+
+  unsigned other_runs = 0;
+  bool done = false;
+  Fiber other([&] {
+    while (!done) {
+      ++other_runs;
+      ThisFiber::Yield();
+    }
+  });
+
+  uint64_t start_cnt = FiberAutoYieldCnt();
+  Fiber busy([&] {
+    {
+      FiberAtomicGuard guard;
+      auto until = chrono::steady_clock::now() + 1ms;
+      while (chrono::steady_clock::now() < until)
+        EXPECT_FALSE(ThisFiber::MaybeYield());
+    }
+
+    unsigned yields = 0;
+    auto until = chrono::steady_clock::now() + 5ms;
+    while (chrono::steady_clock::now() < until)
+      yields += ThisFiber::MaybeYield();
+    EXPECT_GT(yields, 0u);
+    EXPECT_LE(yields, 60u);  // at most one per slice.
+    done = true;
+  });
+  busy.Join();
+  other.Join();
+
+  EXPECT_GT(other_runs, 1u);
+  EXPECT_GT(FiberAutoYieldCnt(), start_cnt);
+  SetFiberTimeSlice(FiberPriority::NORMAL, 1000us);
+}
+
+TEST_F(FiberTest, CycleClock) {
+  ASSERT_GT(CycleClock::FrequencyUsec(), 0u);
+  EXPECT_NEAR(1000.0, CycleClock::ToUsec(CycleClock::FrequencyUsec() * 1000), 1.0);
+
+  auto start = chrono::steady_clock::now();
+  uint64_t start_tsc = CycleClock::Now();
+  ThisFiber::SleepFor(20ms);
+  uint64_t tsc_ns = CycleClock::NsecSince(start_tsc);
+  uint64_t steady_ns = chrono::nanoseconds(chrono::steady_clock::now() - start).count();
+
+  // Within 2% of the steady clock.
+  EXPECT_NEAR(double(tsc_ns), double(steady_ns), steady_ns * 0.02);
+  EXPECT_EQ(0u, CycleClock::NsecSince(CycleClock::Now() + 1000000));
+}
+
+// Completes the writes when the test calls Complete, i.e. a consumer of a controlled speed.
+class FakeAsyncSink : public io::AsyncSink {
+ public:
+  void AsyncWriteSome(const iovec* v, uint32_t len, AsyncProgressCb cb) final {
+    ASSERT_FALSE(cb_);
+    pending_.assign(v, v + len);
+    cb_ = std::move(cb);
+    ++writes;
+    max_iovecs = max<size_t>(max_iovecs, len);
+  }
+
+  bool HasPending() const {
+    return bool(cb_);
+  }
+
+  // Writes up to limit bytes of the pending write.
+  void Complete(size_t limit) {
+    ASSERT_TRUE(cb_);
+    size_t written = 0;
+    for (const iovec& v : pending_) {
+      size_t sz = min(limit - written, v.iov_len);
+      data.append(reinterpret_cast<const char*>(v.iov_base), sz);
+      written += sz;
+    }
+    auto cb = std::move(cb_);
+    cb_ = nullptr;
+    cb(written);
+  }
+
+  void Fail() {
+    auto cb = std::move(cb_);
+    cb_ = nullptr;
+    cb(nonstd::make_unexpected(make_error_code(errc::connection_reset)));
+  }
+
+  string data;
+  unsigned writes = 0;
+  size_t max_iovecs = 0;
+
+ private:
+  vector<iovec> pending_;
+  AsyncProgressCb cb_;
+};
+
+TEST_F(FiberTest, WriteQueue) {
+  FakeAsyncSink sink;
+  WriteQueue::Options opts;
+  opts.high_watermark = 1000;
+  opts.low_watermark = 200;
+  opts.max_iovecs = 4;
+  opts.merge_size = 64;
+  WriteQueue queue(&sink, opts);
+
+  string expected;
+  bool done = false;
+  Fiber producer("producer", [&] {
+    for (unsigned i = 0; i < 20; ++i) {
+      string buf(100, 'a' + i);
+      expected += buf;
+      ASSERT_FALSE(queue.Write(std::move(buf)));
+      EXPECT_LE(queue.pending_bytes(), opts.high_watermark + 100);
+    }
+
+    // Small buffers are merged while the write is in flight.
+    for (unsigned i = 0; i < 10; ++i) {
+      expected += "xyz";
+      ASSERT_FALSE(queue.Write(io::Buffer("xyz")));
+    }
+    ASSERT_FALSE(queue.Flush());
+    done = true;
+  });
+
+  while (!done) {
+    if (sink.HasPending())
+      sink.Complete(150);
+    ThisFiber::Yield();
+  }
+  producer.Join();
+
+  EXPECT_EQ(expected, sink.data);
+  EXPECT_EQ(0u, queue.pending_bytes());
+  EXPECT_EQ(4u, sink.max_iovecs);
+  EXPECT_GT(queue.stats().throttled, 0u);
+  EXPECT_LE(queue.stats().max_pending, opts.high_watermark + 100);
+  EXPECT_EQ(expected.size(), queue.stats().bytes);
+
+  // A failed write fails the producers.
+  ASSERT_FALSE(queue.Write(string(100, 'f')));
+  ASSERT_TRUE(sink.HasPending());
+  sink.Fail();
+  EXPECT_EQ(errc::connection_reset, queue.Write(io::Buffer("x")));
+  EXPECT_EQ(errc::connection_reset, queue.Flush());
+  EXPECT_EQ(0u, queue.pending_bytes());
+}
+
 // EXPECT_DEATH does not work well with freebsd, also it does not work well with gtest_repeat.
 #if 0
 TEST_F(FiberTest, AtomicGuard) {
@@ -535,6 +1317,41 @@ TEST_P(ProactorTest, AsyncCall) {
   EXPECT_EQ(std::cv_status::no_timeout, ec.await_until([&] { return signal; }, next));
 }
 
+TEST_P(ProactorTest, DispatchBatch) {
+  vector<unsigned> order;
+  ProactorBase::TaskBatch batch;
+  for (unsigned i = 0; i < 10; ++i)
+    batch.emplace_back([&order, i] { order.push_back(i); });
+
+  uint32_t wakeups = proactor()->wakeup_event_count() + proactor()->wakeup_skipped_event_count();
+  proactor()->DispatchBatch(std::move(batch));
+  proactor()->AwaitBrief([] {});
+  ASSERT_EQ(10u, order.size());
+  for (unsigned i = 0; i < 10; ++i)
+    EXPECT_EQ(i, order[i]);
+
+  // One queue entry for the batch and one for the AwaitBrief.
+  EXPECT_EQ(wakeups + 2,
+            proactor()->wakeup_event_count() + proactor()->wakeup_skipped_event_count());
+
+  // Coalesced dispatches from another proactor.
+  ProactorThread src(1, proactor()->GetKind());
+  order.clear();
+  src.get()->Await([&] {
+    ProactorBase::me()->SetDispatchCoalescing(true);
+    for (unsigned i = 0; i < 100; ++i)
+      proactor()->DispatchBrief([&order, i] { order.push_back(i); });
+    EXPECT_EQ(1, proactor()->AwaitBrief([] { return 1; }));
+  });
+
+  ASSERT_EQ(100u, order.size());
+  for (unsigned i = 0; i < 100; ++i)
+    EXPECT_EQ(i, order[i]);
+  const auto& stats = src.get()->stats();
+  EXPECT_EQ(101u, stats.coalesced_tasks);
+  EXPECT_EQ(1u, stats.coalesced_batches);
+}
+
 TEST_P(ProactorTest, Await) {
   thread_local int val = 5;
 
@@ -545,6 +1362,103 @@ TEST_P(ProactorTest, Await) {
   EXPECT_EQ(15, j);
 }
 
+TEST_P(ProactorTest, LoopStats) {
+  auto total = [](const CycleHistogram& hist) {
+    uint64_t res = 0;
+    for (uint64_t cnt : hist.buckets)
+      res += cnt;
+    return res;
+  };
+
+  // Lets the loop block in the io wait.
+  ThisFiber::SleepFor(20ms);
+  proactor()->Await([] {
+    for (unsigned i = 0; i < 10; ++i) {
+      Fiber("yield", [] { ThisFiber::Yield(); }).Join();
+    }
+  });
+
+  auto [ls, ready_delay] = proactor()->AwaitBrief(
+      [&] { return make_pair(proactor()->loop_stats(), FiberReadyDelayHistogram()); });
+  EXPECT_GT(total(ls.iteration), 0u);
+  EXPECT_GT(total(ls.wait), 0u);
+  EXPECT_GT(ls.wait.sum, 0u);
+  EXPECT_GE(total(ready_delay), 10u);
+  EXPECT_EQ(0u, proactor()->AwaitBrief([&] { return proactor()->task_queue_depth(); }));
+}
+
+TEST_P(ProactorTest, TracePropagation) {
+  TraceContext ctx = NewTrace(true);
+  uint64_t root_id = 0, child_id = 0;
+  {
+    TraceScope scope(ctx);
+    TraceSpan span("root");
+    root_id = CurrentTrace().span_id;
+    ASSERT_NE(0u, root_id);
+
+    TraceContext brief = proactor()->AwaitBrief([] { return CurrentTrace(); });
+    EXPECT_EQ(ctx.trace_id, brief.trace_id);
+    EXPECT_EQ(root_id, brief.span_id);
+    EXPECT_TRUE(brief.sampled);
+
+    // The fibers inherit the context of the fiber that launches them.
+    TraceContext inherited = proactor()->Await([&] {
+      TraceSpan span("child");
+      child_id = CurrentTrace().span_id;
+      TraceContext res;
+      Fiber("traced", [&] { res = CurrentTrace(); }).Join();
+      return res;
+    });
+    EXPECT_EQ(ctx.trace_id, inherited.trace_id);
+    EXPECT_EQ(child_id, inherited.span_id);
+
+    Done done;
+    TraceContext dispatched;
+    proactor()->Dispatch([&] {
+      dispatched = CurrentTrace();
+      done.Notify();
+    });
+    done.Wait();
+    EXPECT_EQ(root_id, dispatched.span_id);
+  }
+  EXPECT_FALSE(CurrentTrace());
+  EXPECT_FALSE(proactor()->AwaitBrief([] { return bool(CurrentTrace()); }));
+
+  vector<SpanRecord> spans = CollectSpans(ctx.trace_id);
+  ASSERT_EQ(2u, spans.size());
+  EXPECT_STREQ("root", spans[0].name);
+  EXPECT_EQ(0u, spans[0].parent_id);
+  EXPECT_EQ(-1, spans[0].thread_index);
+  EXPECT_STREQ("child", spans[1].name);
+  EXPECT_EQ(child_id, spans[1].span_id);
+  EXPECT_EQ(root_id, spans[1].parent_id);
+  EXPECT_LE(spans[1].end_ns, spans[0].end_ns);
+
+  // The spans of the traces that are not sampled are not recorded.
+  TraceContext unsampled = NewTrace(false);
+  {
+    TraceScope scope(unsampled);
+    proactor()->AwaitBrief([] { TraceSpan span("unsampled"); });
+  }
+  EXPECT_TRUE(CollectSpans(unsampled.trace_id).empty());
+}
+
+TEST_P(ProactorTest, EventLog) {
+  EnableEventLog(true);
+  proactor()->Await([] { Fiber("logged", [] { ThisFiber::Yield(); }).Join(); });
+  EnableEventLog(false);
+
+  // Not recorded.
+  proactor()->Await([] { Fiber("unlogged", [] {}).Join(); });
+
+  string trace = EventLogChromeTrace();
+  EXPECT_THAT(trace, testing::StartsWith("{\"displayTimeUnit\":\"ns\",\"traceEvents\":["));
+  EXPECT_THAT(trace, testing::HasSubstr("\"name\":\"logged\",\"cat\":\"fiber\",\"ph\":\"X\""));
+  EXPECT_THAT(trace, testing::HasSubstr("\"name\":\"dispatch\""));
+  EXPECT_THAT(trace, testing::HasSubstr("\"args\":{\"name\":\"proactor 0\"}"));
+  EXPECT_THAT(trace, testing::Not(testing::HasSubstr("unlogged")));
+}
+
 TEST_P(ProactorTest, DispatchTest) {
   CondVarAny cnd1, cnd2;
   Mutex mu;
@@ -580,6 +1494,42 @@ TEST_P(ProactorTest, Sleep) {
   });
 }
 
+TEST_P(ProactorTest, CoarseTimeout) {
+  proactor()->Await([] {
+    // The deadlines cross a few level 0 wraps of the timer wheel. The first one
+    // is out of the wheel range and is kept in the precise queue.
+    constexpr unsigned kNum = 32;
+    Fiber fbs[kNum];
+    detail::FiberInterface* waiters[kNum] = {};
+    bool timed_out[kNum] = {};
+
+    for (unsigned i = 0; i < kNum; ++i) {
+      fbs[i] = Fiber(StrCat("waiter", i), [&, i] {
+        auto now = chrono::steady_clock::now();
+        auto tp = i == 0 ? now + 24h : now + chrono::microseconds(i * 5100);
+        waiters[i] = detail::FiberActive();
+        timed_out[i] = waiters[i]->WaitUntil(tp, true);
+        if (timed_out[i]) {
+          EXPECT_GE(chrono::steady_clock::now(), tp);
+        }
+      });
+    }
+    ThisFiber::Yield();
+
+    // Wake the odd ones and the first one before their deadlines.
+    detail::FiberInterface* me = detail::FiberActive();
+    for (unsigned i = 0; i < kNum; i += (i == 0 ? 1 : 2)) {
+      ASSERT_TRUE(waiters[i]);
+      me->ActivateOther(waiters[i]);
+    }
+
+    for (unsigned i = 0; i < kNum; ++i) {
+      fbs[i].Join();
+      EXPECT_EQ(i > 0 && i % 2 == 0, timed_out[i]) << i;
+    }
+  });
+}
+
 TEST_P(ProactorTest, LocalCond) {
   CondVarAny cond;
   NoOpLock lock;
@@ -724,6 +1674,106 @@ TEST_P(ProactorTest, Migrate) {
   fb.Join();
 }
 
+TEST_P(ProactorTest, WorkStealing) {
+  ProactorThread pth(0, proactor()->GetKind());
+  ProactorBase* thief = pth.get();
+
+  pid_t thief_tid = thief->AwaitBrief([&] { return my_gettid(); });
+  proactor()->AwaitBrief([&] { proactor()->SetStealPeers({thief}); });
+  thief->AwaitBrief([&] { thief->SetStealPeers({proactor()}); });
+
+  // The hog keeps the source proactor busy, so it will not resume the shared fiber itself.
+  atomic_bool stolen{false};
+  Fiber hog = proactor()->LaunchFiber([&] {
+    while (!stolen.load(memory_order_relaxed)) {
+      ThisFiber::Yield();
+    }
+  });
+
+  Fiber fb = proactor()->LaunchFiber([&] {
+    ThisFiber::SetMigratable(true);
+    for (unsigned i = 0; i < 100000 && my_gettid() != thief_tid; ++i) {
+      ThisFiber::Yield();
+    }
+    stolen.store(true, memory_order_relaxed);
+    EXPECT_EQ(thief_tid, my_gettid());
+  });
+  fb.Join();
+  hog.Join();
+
+  uint64_t steal_cnt = thief->AwaitBrief([&] { return thief->stats().steal_cnt; });
+  EXPECT_GT(steal_cnt, 0u);
+
+  proactor()->AwaitBrief([&] { proactor()->SetStealPeers({}); });
+  thief->AwaitBrief([&] { thief->SetStealPeers({}); });
+}
+
+TEST_P(ProactorTest, WorkStealingBusyPeer) {
+  ProactorThread pth(0, proactor()->GetKind());
+  ProactorBase* peer = pth.get();
+  proactor()->AwaitBrief([&] { proactor()->SetStealPeers({peer}); });
+  peer->AwaitBrief([&] { peer->SetStealPeers({proactor()}); });
+
+  // The peer is never idle, so the yielding fiber stays on its proactor.
+  atomic_bool done{false};
+  Fiber hog = peer->LaunchFiber([&] {
+    while (!done.load(memory_order_relaxed)) {
+      ThisFiber::Yield();
+    }
+  });
+
+  pid_t tid = proactor()->AwaitBrief([&] { return my_gettid(); });
+  Fiber fb = proactor()->LaunchFiber([&] {
+    ThisFiber::SetMigratable(true);
+    for (unsigned i = 0; i < 1000; ++i) {
+      ThisFiber::Yield();
+      ASSERT_EQ(tid, my_gettid());
+    }
+  });
+  fb.Join();
+  done.store(true, memory_order_relaxed);
+  hog.Join();
+
+  EXPECT_EQ(0u, peer->AwaitBrief([&] { return peer->stats().steal_cnt; }));
+  proactor()->AwaitBrief([&] { proactor()->SetStealPeers({}); });
+  peer->AwaitBrief([&] { peer->SetStealPeers({}); });
+}
+
+TEST_P(ProactorTest, ChannelBatch) {
+  constexpr unsigned kBatch = 16, kNumBatches = 1000;
+  SimpleChannel<unsigned, base::mpmc_bounded_queue<unsigned>> channel(64);
+  ProactorThread pth(0, proactor()->GetKind());
+
+  Fiber producer = pth.get()->LaunchFiber([&] {
+    vector<unsigned> batch(kBatch);
+    for (unsigned i = 0; i < kNumBatches; ++i) {
+      for (unsigned j = 0; j < kBatch; ++j)
+        batch[j] = i * kBatch + j;
+      channel.PushBatch(absl::MakeSpan(batch));
+    }
+    channel.StartClosing();
+  });
+
+  uint64_t sum = 0;
+  unsigned expected = 0;
+  Fiber consumer = proactor()->LaunchFiber([&] {
+    unsigned buf[kBatch / 2];
+    while (size_t n = channel.PopBatch(absl::MakeSpan(buf))) {
+      for (size_t i = 0; i < n; ++i) {
+        EXPECT_EQ(expected++, buf[i]);
+        sum += buf[i];
+      }
+    }
+  });
+
+  producer.Join();
+  consumer.Join();
+
+  const uint64_t total = kBatch * kNumBatches;
+  EXPECT_EQ(total, expected);
+  EXPECT_EQ(total * (total - 1) / 2, sum);
+}
+
 TEST_P(ProactorTest, NotifyRemote) {
   EventCount ec;
   Done done;
@@ -801,6 +1851,50 @@ TEST_P(ProactorTest, Mutex) {
     th.reset();
 }
 
+TEST_P(ProactorTest, SharedMutex) {
+  unique_ptr<ProactorThread> ths[kNumThreads];
+  Fiber readers[kNumThreads];
+
+  for (unsigned i = 0; i < kNumThreads; ++i) {
+    ths[i] = CreateProactorThread();
+  }
+
+  SharedMutex mu;
+  atomic_bool stop{false};
+  atomic_uint active_readers{0};
+  unsigned value = 0;
+
+  // Readers overlap continuously, so a writer would starve without writer preference.
+  for (unsigned i = 0; i < kNumThreads; ++i) {
+    readers[i] = ths[i]->get()->LaunchFiber([&] {
+      while (!stop.load(memory_order_relaxed)) {
+        shared_lock lk(mu);
+        active_readers.fetch_add(1, memory_order_relaxed);
+        ThisFiber::SleepFor(10us);
+        active_readers.fetch_sub(1, memory_order_relaxed);
+      }
+    });
+  }
+
+  ThisFiber::SleepFor(1ms);
+  Fiber writer = proactor()->LaunchFiber([&] {
+    for (unsigned i = 0; i < 100; ++i) {
+      lock_guard lk(mu);
+      EXPECT_EQ(0u, active_readers.load(memory_order_relaxed));
+      ++value;
+    }
+  });
+  writer.Join();
+  stop.store(true, memory_order_relaxed);
+
+  for (auto& fb : readers)
+    fb.Join();
+  EXPECT_EQ(100u, value);
+
+  for (auto& th : ths)
+    th.reset();
+}
+
 TEST_P(ProactorTest, DragonflyBug1591) {
   auto sock = std::unique_ptr<FiberSocketBase>(proactor()->CreateSocket());
   auto sock2 = std::unique_ptr<FiberSocketBase>(proactor()->CreateSocket());
@@ -899,5 +1993,477 @@ TEST_P(ProactorTest, Periodic) {
   EXPECT_GT(cnt, 0u);
 }
 
+TEST_P(ProactorTest, PeriodicMany) {
+  // With io_uring, enough tasks with coarse periods share a single timeout.
+  constexpr unsigned kNumTasks = 8;
+  unsigned cnt[kNumTasks] = {};
+
+  proactor()->Await([&] {
+    vector<uint32_t> ids;
+    for (unsigned i = 0; i < kNumTasks; ++i)
+      ids.push_back(proactor()->AddPeriodic(100, [&cnt, i] { ++cnt[i]; }));
+    ThisFiber::SleepFor(350ms);
+
+    for (unsigned i = 0; i < kNumTasks; ++i) {
+      ProactorBase::PeriodicStats stats;
+      ASSERT_TRUE(proactor()->GetPeriodicStats(ids[i], &stats));
+      EXPECT_EQ(cnt[i], stats.runs);
+      EXPECT_GE(stats.runs, 2u);
+      EXPECT_LE(stats.runs, 4u);
+      EXPECT_LT(stats.max_drift_usec, 50000u);
+      proactor()->CancelPeriodic(ids[i]);
+    }
+
+    ProactorBase::PeriodicStats stats;
+    EXPECT_FALSE(proactor()->GetPeriodicStats(ids[0], &stats));
+  });
+
+  // Cancelled tasks do not run anymore.
+  vector<unsigned> prev(cnt, cnt + kNumTasks);
+  proactor()->Await([] { ThisFiber::SleepFor(150ms); });
+  EXPECT_THAT(prev, ElementsAreArray(cnt));
+}
+
+TEST_P(ProactorTest, MessageLanes) {
+  constexpr unsigned kNumThreads = 3, kNumMessages = 1000;
+  unique_ptr<ProactorPool> pool(GetParam() == "epoll" ? Pool::Epoll(kNumThreads)
+                                                      : Pool::IOUring(16, kNumThreads));
+  pool->Run();
+
+  // next[src][dest] is the sequence number of the next message from src to dest.
+  uint64_t next[kNumThreads][kNumThreads] = {};
+  {
+    // Small lanes, so that the senders block.
+    MessageLanes lanes(pool.get(), 8);
+    LaneMessage msg;
+    msg.handler = [](const LaneMessage& msg, unsigned src) {
+      auto* next = reinterpret_cast<uint64_t(*)[kNumThreads]>(msg.arg[0]);
+      unsigned dest = ProactorBase::me()->GetPoolIndex();
+      EXPECT_EQ(next[src][dest], msg.arg[1]);
+      next[src][dest] = msg.arg[1] + 1;
+    };
+    msg.arg[0] = reinterpret_cast<uint64_t>(next);
+
+    pool->AwaitFiberOnAll([&](unsigned, ProactorBase*) {
+      LaneMessage m = msg;
+      for (unsigned i = 0; i < kNumMessages; ++i) {
+        m.arg[1] = i;
+        for (unsigned dest = 0; dest < kNumThreads; ++dest)
+          lanes.Send(dest, m);
+      }
+    });
+
+    for (unsigned i = 0; i < kNumThreads; ++i) {
+      auto received = [&] { return lanes.stats(i).received; };
+      while (pool->at(i)->AwaitBrief(received) < kNumMessages * kNumThreads)
+        usleep(100);
+      EXPECT_EQ(kNumMessages * kNumThreads, pool->at(i)->AwaitBrief([&] {
+        return lanes.stats(i).sent;
+      }));
+    }
+  }
+
+  for (unsigned src = 0; src < kNumThreads; ++src) {
+    for (unsigned dest = 0; dest < kNumThreads; ++dest)
+      EXPECT_EQ(kNumMessages, next[src][dest]);
+  }
+  pool->Stop();
+}
+
+TEST_P(ProactorTest, Rcu) {
+  constexpr unsigned kNumThreads = 3, kNumUpdates = 200;
+  unique_ptr<ProactorPool> pool(GetParam() == "epoll" ? Pool::Epoll(kNumThreads)
+                                                      : Pool::IOUring(16, kNumThreads));
+  pool->Run();
+
+  struct Snapshot {
+    uint64_t val = 0, twice = 0;
+
+    ~Snapshot() {
+      twice = 1;  // makes the reads of freed snapshots more likely to fail.
+    }
+  };
+
+  {
+    Rcu rcu(pool.get());
+    RcuPtr<Snapshot> ptr(make_unique<Snapshot>());
+    atomic_bool done{false};
+    BlockingCounter bc(kNumThreads);
+
+    pool->DispatchOnAll([&](ProactorBase*) {
+      while (!done.load(memory_order_relaxed)) {
+        const Snapshot* s = ptr.Read();
+        EXPECT_EQ(s->val * 2, s->twice);
+        ThisFiber::SleepFor(10us);
+      }
+      bc->Dec();
+    });
+
+    for (unsigned i = 1; i <= kNumUpdates; ++i) {
+      auto s = make_unique<Snapshot>();
+      s->val = i;
+      s->twice = i * 2;
+      ptr.Update(std::move(s), &rcu);
+      if (i % 50 == 0)
+        rcu.Synchronize();
+    }
+    rcu.Barrier();
+
+    Rcu::Stats stats = rcu.GetStats();
+    EXPECT_EQ(kNumUpdates, stats.retired);
+    EXPECT_EQ(kNumUpdates, stats.reclaimed);
+    EXPECT_GT(stats.grace_periods, 0u);
+    EXPECT_LE(stats.grace_periods, kNumUpdates);
+
+    done = true;
+    bc->Wait();
+  }
+  pool->Stop();
+}
+
+TEST_P(ProactorTest, StallDetector) {
+  unique_ptr<ProactorPool> pool(GetParam() == "epoll" ? Pool::Epoll(2) : Pool::IOUring(16, 2));
+  pool->Run();
+
+  StallDetector::Options opts;
+  opts.stall_ms = 50;
+  StallDetector detector(pool.get(), opts);
+  detector.Start();
+
+  // Idle proactors do not stall.
+  usleep(200000);
+  EXPECT_EQ(0u, detector.GetStats().stalls);
+
+  pool->at(0)->Await([] {
+    ThisFiber::SetName("spinner");
+    auto start = chrono::steady_clock::now();
+    while (chrono::steady_clock::now() - start < 300ms) {  // spins without yielding.
+    }
+  });
+
+  StallDetector::Stats stats = detector.GetStats();
+  EXPECT_EQ(1u, stats.stalls);
+  EXPECT_EQ(1u, stats.reports);
+  EXPECT_GE(stats.max_stall_ms, 50u);
+  EXPECT_EQ(1u, detector.GetStallCounts()["spinner"]);
+
+  detector.Stop();
+  pool->Stop();
+}
+
+TEST_P(ProactorTest, MemoryPressureMonitor) {
+  unique_ptr<ProactorPool> pool(GetParam() == "epoll" ? Pool::Epoll(2) : Pool::IOUring(16, 2));
+  pool->Run();
+
+  MemoryPressureMonitor monitor(pool.get());
+  atomic_uint calls{0};
+  unsigned id = monitor.AddShrinkCallback([&](MemoryPressureMonitor::Level level) {
+    EXPECT_TRUE(ProactorBase::me() != nullptr);
+    EXPECT_EQ(MemoryPressureMonitor::kCritical, level);
+    calls.fetch_add(1, memory_order_relaxed);
+  });
+  monitor.Start();
+
+  // The callbacks run on every proactor.
+  monitor.Shrink(MemoryPressureMonitor::kCritical);
+  EXPECT_EQ(2u, calls.load());
+
+  monitor.RemoveShrinkCallback(id);
+  monitor.Shrink(MemoryPressureMonitor::kCritical);
+  EXPECT_EQ(2u, calls.load());
+  EXPECT_EQ(2u, monitor.GetStats().shrinks[MemoryPressureMonitor::kCritical]);
+
+  monitor.Stop();
+  pool->Stop();
+}
+
+TEST_P(ProactorTest, Warmup) {
+  unique_ptr<ProactorPool> pool(GetParam() == "epoll" ? Pool::Epoll(2) : Pool::IOUring(16, 2));
+  pool->set_warmup(true);
+  pool->Run();
+
+  // Every thread has a full cache of stacks for the dispatched fibers.
+  pool->AwaitBrief([](unsigned, ProactorBase*) {
+    EXPECT_EQ(RecyclingStackAllocator::kMaxCached, RecyclingStackAllocator::Prefill(0));
+  });
+
+  atomic_uint dispatched{0};
+  pool->at(0)->Await([&] {
+    for (unsigned i = 0; i < 10; ++i)
+      ProactorBase::me()->Dispatch([&] { dispatched.fetch_add(1, memory_order_relaxed); });
+  });
+  while (dispatched.load(memory_order_relaxed) < 10)
+    ThisFiber::SleepFor(1ms);
+  pool->Stop();
+}
+
+TEST_P(ProactorTest, ShardedCache) {
+  unique_ptr<ProactorPool> pool(GetParam() == "epoll" ? Pool::Epoll(2) : Pool::IOUring(16, 2));
+  pool->Run();
+
+  {
+    ShardedCache<string> cache(pool.get(), 1 << 20);
+    for (unsigned i = 0; i < 100; ++i)
+      ASSERT_TRUE(cache.Set(absl::StrCat("key", i), absl::StrCat("val", i)));
+
+    // Both shards own keys and every key is found regardless of the calling thread.
+    unsigned shard_keys[2] = {0, 0};
+    for (unsigned i = 0; i < 100; ++i)
+      ++shard_keys[cache.ShardOf(absl::StrCat("key", i))];
+    EXPECT_GT(shard_keys[0], 0u);
+    EXPECT_GT(shard_keys[1], 0u);
+
+    pool->at(1)->Await([&] {
+      for (unsigned i = 0; i < 100; ++i)
+        EXPECT_EQ(absl::StrCat("val", i), cache.Get(absl::StrCat("key", i)));
+    });
+    EXPECT_TRUE(cache.Erase("key0"));
+    EXPECT_FALSE(cache.Get("key0"));
+
+    size_t used = 0;
+    ShardedCache<string>::Stats stats = cache.GetStats(&used);
+    EXPECT_EQ(100u, stats.hits);
+    EXPECT_EQ(1u, stats.misses);
+    EXPECT_GT(used, 0u);
+  }
+  pool->Stop();
+}
+
+TEST_P(ProactorTest, ParallelAlgorithms) {
+  unique_ptr<ProactorPool> pool(GetParam() == "epoll" ? Pool::Epoll(3) : Pool::IOUring(16, 3));
+  pool->Run();
+
+  constexpr size_t kNum = 100000;
+  vector<atomic_uint8_t> visits(kNum);
+  ParallelFor(pool.get(), 0, kNum, 0, [&](size_t from, size_t to) {
+    for (size_t i = from; i < to; ++i)
+      visits[i].fetch_add(1, memory_order_relaxed);
+  });
+  for (size_t i = 0; i < kNum; ++i)
+    ASSERT_EQ(1u, visits[i].load()) << i;
+
+  auto sum = [](size_t from, size_t to) {
+    uint64_t res = 0;
+    for (size_t i = from; i < to; ++i)
+      res += i;
+    return res;
+  };
+  uint64_t res = ParallelReduce(pool.get(), 0, kNum, 100, uint64_t(0), sum, std::plus<uint64_t>());
+  EXPECT_EQ(kNum * (kNum - 1) / 2, res);
+
+  // Small runs, so that the sort goes through several merge rounds.
+  base::PODArray<uint32_t> arr;
+  arr.resize_uninitialized(kNum);
+  mt19937 rng(42);
+  for (size_t i = 0; i < kNum; ++i)
+    arr[i] = rng();
+  vector<uint32_t> expected(arr.data(), arr.data() + kNum);
+  sort(expected.begin(), expected.end());
+
+  // Runs from a proactor fiber, which keeps serving its other fibers during the sort.
+  pool->at(0)->Await([&] {
+    ParallelSort(pool.get(), arr.data(), arr.size(), std::less<uint32_t>(), 1000);
+  });
+  EXPECT_TRUE(equal(expected.begin(), expected.end(), arr.data()));
+
+  // Descending via the PODArray overload.
+  ParallelSort(pool.get(), &arr, std::greater<uint32_t>());
+  EXPECT_TRUE(equal(expected.rbegin(), expected.rend(), arr.data()));
+  pool->Stop();
+}
+
+TEST_P(ProactorTest, SamplingProfiler) {
+  unique_ptr<ProactorPool> pool(GetParam() == "epoll" ? Pool::Epoll(2) : Pool::IOUring(16, 2));
+  pool->Run();
+
+  SamplingProfiler profiler(pool.get());
+  error_code ec = profiler.Start(1000);
+  if (ec) {
+    pool->Stop();
+    GTEST_SKIP() << "Sampling is not supported: " << ec.message();
+  }
+
+  pool->AwaitFiberOnAll([](ProactorBase*) {
+    ThisFiber::SetName("burner");
+    auto deadline = chrono::steady_clock::now() + 200ms;
+    while (chrono::steady_clock::now() < deadline) {
+    }
+  });
+  profiler.Stop();
+
+  EXPECT_GT(profiler.GetStats().samples, 0u);
+  EXPECT_THAT(profiler.FoldedStacks(), HasSubstr("burner;"));
+
+  profiler.Reset();
+  EXPECT_EQ("", profiler.FoldedStacks());
+  pool->Stop();
+}
+
+TEST(FiberQueueThreadPoolTest, SlowTask) {
+  FiberQueueThreadPool pool(2, 16);
+
+  // A slow task does not delay the tasks that are added after it.
+  Done slow_done;
+  pool.Add([slow_done]() mutable {
+    this_thread::sleep_for(300ms);
+    slow_done.Notify();
+  });
+
+  auto start = chrono::steady_clock::now();
+  for (unsigned i = 0; i < 20; ++i)
+    pool.Await([] {});
+  EXPECT_LT(chrono::steady_clock::now() - start, 200ms);
+  slow_done.Wait();
+
+  FiberQueueThreadPool::Stats stats = pool.GetStats();
+  EXPECT_EQ(21u, stats.tasks);
+  EXPECT_EQ(2u, stats.threads);
+}
+
+TEST(FiberQueueThreadPoolTest, Pinned) {
+  FiberQueueThreadPool pool(4, 16);
+
+  vector<pthread_t> tids;
+  vector<unsigned> order;
+  for (unsigned i = 0; i < 10; ++i) {
+    pool.Add(5, [&, i] {
+      tids.push_back(pthread_self());
+      order.push_back(i);
+    });
+  }
+  pool.Await(5, [] {});
+
+  ASSERT_EQ(10u, order.size());
+  for (unsigned i = 0; i < 10; ++i) {
+    EXPECT_EQ(i, order[i]);
+    EXPECT_TRUE(pthread_equal(tids[0], tids[i]));
+  }
+}
+
+TEST(FiberQueueThreadPoolTest, TracePropagation) {
+  FiberQueueThreadPool pool(2, 16);
+
+  TraceContext ctx = NewTrace(false);
+  TraceScope scope(ctx);
+  EXPECT_EQ(ctx.trace_id, pool.Await([] { return CurrentTrace().trace_id; }));
+  EXPECT_EQ(ctx.trace_id, pool.Await(1, [] { return CurrentTrace().trace_id; }));
+}
+
+TEST(FiberQueueThreadPoolTest, ParallelFor) {
+  FiberQueueThreadPool pool(4, 16);
+
+  vector<uint64_t> vals(10000);
+  ParallelFor(&pool, 0, vals.size(), 64, [&](size_t from, size_t to) {
+    for (size_t i = from; i < to; ++i)
+      vals[i] = i * i;
+  });
+  uint64_t res = ParallelReduce(
+      &pool, 0, vals.size(), 0, uint64_t(0),
+      [&](size_t from, size_t to) { return accumulate(&vals[from], &vals[to - 1] + 1, 0UL); },
+      std::plus<uint64_t>());
+  EXPECT_EQ(accumulate(vals.begin(), vals.end(), 0UL), res);
+}
+
+TEST(FiberQueueThreadPoolTest, Elastic) {
+  FiberQueueThreadPool::Options opts;
+  opts.min_threads = 1;
+  opts.max_threads = 4;
+  opts.grow_depth = 1;
+  opts.idle_timeout = 200ms;
+  FiberQueueThreadPool pool(opts);
+
+  // The tasks wait for each other, hence they complete only if the pool grows to 4 threads.
+  atomic_uint started{0};
+  BlockingCounter bc(4);
+  for (unsigned i = 0; i < 4; ++i) {
+    pool.Add([&, bc]() mutable {
+      started.fetch_add(1);
+      auto deadline = chrono::steady_clock::now() + 5s;
+      while (started.load() < 4 && chrono::steady_clock::now() < deadline)
+        this_thread::sleep_for(1ms);
+      bc->Dec();
+    });
+  }
+  bc->Wait();
+  EXPECT_EQ(4u, started.load());
+  EXPECT_EQ(4u, pool.GetStats().threads);
+
+  // The added workers exit once idle.
+  auto deadline = chrono::steady_clock::now() + 5s;
+  while (pool.GetStats().threads > 1 && chrono::steady_clock::now() < deadline)
+    this_thread::sleep_for(10ms);
+  EXPECT_EQ(1u, pool.GetStats().threads);
+
+  // And are started again on demand.
+  pool.Await([] {});
+}
+
+TEST(ReadBufferPoolTest, Shrink) {
+  ReadBufferPool* pool = ReadBufferPool::Local();
+  size_t capacity = 0;
+  void* bufs[8];
+  for (auto& b : bufs)
+    b = pool->Borrow(3000, &capacity);
+  EXPECT_EQ(4096u, capacity);
+  EXPECT_EQ(8 * 4096u, pool->stats().borrowed_bytes);
+
+  for (auto b : bufs)
+    pool->Return(b, 3000);
+  EXPECT_EQ(8 * 4096u, pool->stats().pooled_bytes);
+
+  // Reused regardless of the requested size within the class.
+  void* ptr = pool->Borrow(4096);
+  EXPECT_EQ(bufs[7], ptr);
+  uint64_t hits = pool->stats().hits;
+  EXPECT_GE(hits, 1u);
+
+  // The watermark of the first period was 8 buffers, one is still borrowed.
+  pool->Shrink();
+  EXPECT_EQ(7 * 4096u, pool->stats().pooled_bytes);
+
+  // Nothing was borrowed beyond the one buffer during the second period.
+  pool->Shrink();
+  EXPECT_EQ(0u, pool->stats().pooled_bytes);
+  pool->Return(ptr, 4096);
+
+  ptr = pool->Borrow(ReadBufferPool::kMaxSize + 1);
+  pool->Return(ptr, ReadBufferPool::kMaxSize + 1);
+  EXPECT_EQ(0u, pool->stats().borrowed_bytes);
+
+  // Trim releases the buffers regardless of the watermark.
+  ptr = pool->Borrow(4096);
+  pool->Return(ptr, 4096);
+  EXPECT_EQ(4096u, pool->stats().pooled_bytes);
+  pool->Trim();
+  EXPECT_EQ(0u, pool->stats().pooled_bytes);
+}
+
+TEST(ReadBufferPoolTest, ReturnFromOtherThread) {
+  ReadBufferPool* pool = ReadBufferPool::Local();
+  void* small = pool->Borrow(4096);
+  void* large = pool->Borrow(ReadBufferPool::kMaxSize + 1);
+
+  // E.g. a connection that migrated to another proactor.
+  ReadBufferPool::Stats other_stats;
+  thread th([&] {
+    ReadBufferPool* other = ReadBufferPool::Local();
+    other->Return(small, 4096);
+    other->Return(large, ReadBufferPool::kMaxSize + 1);
+    other_stats = other->stats();
+  });
+  th.join();
+
+  EXPECT_EQ(0u, other_stats.borrowed_bytes);
+  EXPECT_EQ(0u, other_stats.pooled_bytes);
+
+  // The buffers are taken back by the next call of the owner.
+  EXPECT_EQ(4096u + ReadBufferPool::kMaxSize + 1, pool->stats().borrowed_bytes);
+  EXPECT_EQ(small, pool->Borrow(4096));
+  EXPECT_EQ(4096u, pool->stats().borrowed_bytes);
+  EXPECT_EQ(0u, pool->stats().pooled_bytes);
+  pool->Return(small, 4096);
+  pool->Trim();
+}
+
 }  // namespace fb2
 }  // namespace util
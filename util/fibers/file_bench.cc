@@ -0,0 +1,411 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+// fio-like disk benchmark of LinuxFile. It sweeps all the combinations of the comma separated
+// lists below and prints one json object per configuration, e.g.
+//   file_bench --path=/mnt/nvme/bench.dat --modes=randread --bs=4096 --qd=1,32,128 \
+//       --engines=uring,pread --direct=true --fixed=false,true
+// {"engine":"uring","mode":"randread","bs":4096,"qd":32,"threads":1,"direct":true,
+//  "fixed":true,"direct_fd":false,"ops":1862312,"iops":372462,"mb_s":1454.9,
+//  "p50_usec":84.1,"p99_usec":141.3,...}
+//
+// The uring engine runs qd fibers per proactor thread, each with a single outstanding request,
+// so the queue depth of every thread is qd. With --fixed the fibers use the registered buffers
+// of the proactor (ReadFixed and WriteFixedAsync), with --direct_fd the file is registered
+// with the ring. The pread engine runs qd plain threads per thread, each calling pread(2) or
+// pwrite(2), as the baseline of the same queue depth.
+// The file is created with --file_mb of data if it is smaller. The writes overwrite it in place.
+
+#include <absl/flags/declare.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+#include <absl/time/clock.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <thread>
+
+#include "base/histogram.h"
+#include "base/init.h"
+#include "base/logging.h"
+#include "util/fibers/pool.h"
+#include "util/fibers/synchronization.h"
+#include "util/fibers/uring_file.h"
+#include "util/fibers/uring_proactor.h"
+
+ABSL_DECLARE_FLAG(bool, enable_direct_fd);
+
+ABSL_FLAG(std::string, path, "/tmp/file_bench.dat", "Path of the benchmark file");
+ABSL_FLAG(uint32_t, file_mb, 1024, "Size of the benchmark file in MB");
+ABSL_FLAG(std::string, engines, "uring,pread", "Engines to sweep: uring, pread");
+ABSL_FLAG(std::string, modes, "randread,read", "Modes to sweep: read, randread, write, randwrite");
+ABSL_FLAG(std::string, bs, "4096,131072", "Block sizes to sweep, multiples of 4KB for O_DIRECT");
+ABSL_FLAG(std::string, qd, "1,32", "Queue depths per thread to sweep");
+ABSL_FLAG(std::string, direct, "true", "O_DIRECT modes to sweep");
+ABSL_FLAG(std::string, fixed, "false,true", "Registered buffer modes to sweep, uring only");
+ABSL_FLAG(std::string, direct_fd, "false", "Direct fd modes to sweep, uring only");
+ABSL_FLAG(uint32_t, threads, 1, "Number of proactor threads or pread thread groups");
+ABSL_FLAG(uint32_t, duration_sec, 5, "Duration of every configuration");
+ABSL_FLAG(std::string, out, "", "If set, appends the json results to this file");
+
+using namespace util;
+using namespace std;
+
+using absl::GetFlag;
+using fb2::Fiber;
+
+namespace {
+
+constexpr size_t kAlign = 4096;
+
+struct Config {
+  string engine;
+  string mode;
+  uint32_t bs = 0;
+  uint32_t qd = 1;
+  bool direct = false;
+  bool fixed = false;
+  bool direct_fd = false;
+
+  bool is_write() const {
+    return mode == "write" || mode == "randwrite";
+  }
+
+  bool is_random() const {
+    return mode == "randread" || mode == "randwrite";
+  }
+};
+
+template <typename T> vector<T> ParseList(const string& flag_val);
+
+template <> vector<string> ParseList(const string& flag_val) {
+  return absl::StrSplit(flag_val, ',', absl::SkipEmpty());
+}
+
+template <> vector<uint32_t> ParseList(const string& flag_val) {
+  vector<uint32_t> res;
+  for (string_view item : absl::StrSplit(flag_val, ',', absl::SkipEmpty())) {
+    uint32_t val;
+    CHECK(absl::SimpleAtoi(item, &val)) << "Invalid number " << item;
+    res.push_back(val);
+  }
+  return res;
+}
+
+template <> vector<bool> ParseList(const string& flag_val) {
+  vector<bool> res;
+  for (string_view item : absl::StrSplit(flag_val, ',', absl::SkipEmpty())) {
+    bool val;
+    CHECK(absl::SimpleAtob(item, &val)) << "Invalid bool " << item;
+    res.push_back(val);
+  }
+  return res;
+}
+
+const char* JsonBool(bool b) {
+  return b ? "true" : "false";
+}
+
+uint64_t FileSize() {
+  return uint64_t(GetFlag(FLAGS_file_mb)) << 20;
+}
+
+// Fills the file up to its configured size, so that the reads do not hit holes.
+void PrepareFile(const string& path) {
+  int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  CHECK_GE(fd, 0) << "Could not open " << path << ": " << strerror(errno);
+
+  struct stat st;
+  CHECK_EQ(0, fstat(fd, &st));
+  constexpr size_t kChunk = 1 << 20;
+  vector<uint8_t> buf(kChunk);
+  mt19937_64 rng(42);
+  for (uint64_t offs = st.st_size & ~uint64_t(kChunk - 1); offs < FileSize(); offs += kChunk) {
+    for (size_t i = 0; i < kChunk; i += 8)
+      *reinterpret_cast<uint64_t*>(buf.data() + i) = rng();
+    CHECK_EQ(ssize_t(kChunk), pwrite(fd, buf.data(), kChunk, offs));
+  }
+  CHECK_EQ(0, fsync(fd));
+  close(fd);
+}
+
+// Generates the offsets of the requests. The sequential offsets are shared by all the workers
+// of a thread, so together they read or write a single sequential stream.
+class OffsetGen {
+ public:
+  OffsetGen(const Config& cfg, uint64_t* next_seq, uint64_t seed)
+      : cfg_(cfg), next_seq_(next_seq), rng_(seed) {
+  }
+
+  off_t Next() {
+    uint64_t num_blocks = FileSize() / cfg_.bs;
+    if (cfg_.is_random())
+      return (rng_() % num_blocks) * cfg_.bs;
+    off_t res = *next_seq_;
+    *next_seq_ = (*next_seq_ + cfg_.bs) % (num_blocks * cfg_.bs);
+    return res;
+  }
+
+ private:
+  const Config& cfg_;
+  uint64_t* next_seq_;
+  mt19937_64 rng_;
+};
+
+struct Result {
+  mutex mu;
+  base::Histogram hist;
+  uint64_t ops = 0;
+  uint64_t errors = 0;
+
+  void Merge(const base::Histogram& h, uint64_t num_ops, uint64_t num_errors) {
+    lock_guard lk(mu);
+    hist.Merge(h);
+    ops += num_ops;
+    errors += num_errors;
+  }
+};
+
+struct AlignedDeleter {
+  void operator()(uint8_t* ptr) const {
+    free(ptr);
+  }
+};
+
+using AlignedBuf = unique_ptr<uint8_t[], AlignedDeleter>;
+
+size_t AlignUp(size_t size) {
+  return (size + kAlign - 1) & ~(kAlign - 1);
+}
+
+AlignedBuf AllocBuf(size_t size) {
+  AlignedBuf res(static_cast<uint8_t*>(aligned_alloc(kAlign, AlignUp(size))));
+  memset(res.get(), 'x', size);
+  return res;
+}
+
+error_code WriteFixed(fb2::LinuxFile* file, io::Bytes src, off_t offset, unsigned buf_index) {
+  fb2::Done done;
+  int res = 0;
+  file->WriteFixedAsync(src, offset, buf_index, [&](int io_res) {
+    res = io_res;
+    done.Notify();
+  });
+  done.Wait();
+  if (res < 0)
+    return error_code(-res, system_category());
+  return {};
+}
+
+void RunUringWorker(const Config& cfg, fb2::LinuxFile* file, OffsetGen* gen, uint64_t deadline,
+                    Result* result) {
+  fb2::UringProactor* proactor = static_cast<fb2::UringProactor*>(ProactorBase::me());
+  optional<fb2::UringBuf> fixed_buf;
+  AlignedBuf buf;
+  io::MutableBytes dest;
+  if (cfg.fixed) {
+    fixed_buf = proactor->RequestBuffer(cfg.bs);
+    CHECK(fixed_buf && fixed_buf->buf_idx) << "Could not get a registered buffer";
+    dest = fixed_buf->bytes.subspan(0, cfg.bs);
+    memset(dest.data(), 'x', dest.size());
+  } else {
+    buf = AllocBuf(cfg.bs);
+    dest = io::MutableBytes(buf.get(), cfg.bs);
+  }
+
+  base::Histogram hist;
+  uint64_t ops = 0, errors = 0;
+  for (uint64_t start = absl::GetCurrentTimeNanos(); start < deadline; ++ops) {
+    off_t offset = gen->Next();
+    error_code ec;
+    if (cfg.is_write()) {
+      ec = cfg.fixed ? WriteFixed(file, dest, offset, *fixed_buf->buf_idx)
+                     : file->Write(dest, offset, 0);
+    } else if (cfg.fixed) {
+      ec = file->ReadFixed(dest, offset, *fixed_buf->buf_idx);
+    } else {
+      iovec v{dest.data(), dest.size()};
+      ec = file->Read(&v, 1, offset, 0);
+    }
+    uint64_t now = absl::GetCurrentTimeNanos();
+    hist.Add((now - start) / 1000.0);
+    start = now;
+    if (ec) {
+      LOG_FIRST_N(ERROR, 10) << "IO failed " << ec.message();
+      ++errors;
+    }
+  }
+
+  if (fixed_buf)
+    proactor->ReturnBuffer(*fixed_buf);
+  result->Merge(hist, ops, errors);
+}
+
+void RunUring(const Config& cfg, uint64_t duration_ns, Result* result) {
+  // Read when the proactors are initialized.
+  absl::SetFlag(&FLAGS_enable_direct_fd, cfg.direct_fd);
+
+  unique_ptr<ProactorPool> pool(fb2::Pool::IOUring(max(256u, cfg.qd * 2), GetFlag(FLAGS_threads)));
+  pool->Run();
+
+  const string& path = GetFlag(FLAGS_path);
+  int flags = (cfg.is_write() ? O_RDWR : O_RDONLY) | (cfg.direct ? O_DIRECT : 0);
+  uint64_t deadline = absl::GetCurrentTimeNanos() + duration_ns;
+
+  pool->AwaitFiberOnAll([&](unsigned index, ProactorBase* p) {
+    auto* proactor = static_cast<fb2::UringProactor*>(p);
+    if (cfg.fixed)
+      CHECK_EQ(0, proactor->RegisterBuffers(cfg.qd * AlignUp(cfg.bs)));
+
+    auto file = fb2::OpenLinux(path, flags, 0);
+    CHECK(file) << "Could not open " << path << ": " << file.error().message();
+
+    uint64_t next_seq = FileSize() / GetFlag(FLAGS_threads) * index / cfg.bs * cfg.bs;
+    vector<OffsetGen> gens;
+    gens.reserve(cfg.qd);
+    for (uint32_t i = 0; i < cfg.qd; ++i)
+      gens.emplace_back(cfg, &next_seq, index * cfg.qd + i);
+
+    vector<Fiber> fibers;
+    for (uint32_t i = 0; i < cfg.qd; ++i) {
+      fibers.emplace_back("worker", [&, gen = &gens[i]] {
+        RunUringWorker(cfg, file->get(), gen, deadline, result);
+      });
+    }
+    for (auto& fb : fibers)
+      fb.Join();
+    std::ignore = (*file)->Close();
+  });
+
+  pool->Stop();
+}
+
+void RunPread(const Config& cfg, uint64_t duration_ns, Result* result) {
+  const string& path = GetFlag(FLAGS_path);
+  int flags = (cfg.is_write() ? O_RDWR : O_RDONLY) | (cfg.direct ? O_DIRECT : 0);
+  int fd = open(path.c_str(), flags);
+  CHECK_GE(fd, 0) << "Could not open " << path << ": " << strerror(errno);
+
+  uint32_t num_groups = GetFlag(FLAGS_threads);
+  vector<uint64_t> next_seq(num_groups);
+  vector<mutex> seq_mu(num_groups);
+  uint64_t deadline = absl::GetCurrentTimeNanos() + duration_ns;
+
+  vector<thread> threads;
+  for (uint32_t group = 0; group < num_groups; ++group) {
+    next_seq[group] = FileSize() / num_groups * group / cfg.bs * cfg.bs;
+    for (uint32_t i = 0; i < cfg.qd; ++i) {
+      threads.emplace_back([&, group, seed = group * cfg.qd + i] {
+        OffsetGen gen(cfg, &next_seq[group], seed);
+        AlignedBuf buf = AllocBuf(cfg.bs);
+        base::Histogram hist;
+        uint64_t ops = 0, errors = 0;
+        for (uint64_t start = absl::GetCurrentTimeNanos(); start < deadline; ++ops) {
+          off_t offset;
+          if (cfg.is_random()) {
+            offset = gen.Next();
+          } else {
+            lock_guard lk(seq_mu[group]);
+            offset = gen.Next();
+          }
+          ssize_t res = cfg.is_write() ? pwrite(fd, buf.get(), cfg.bs, offset)
+                                       : pread(fd, buf.get(), cfg.bs, offset);
+          uint64_t now = absl::GetCurrentTimeNanos();
+          hist.Add((now - start) / 1000.0);
+          start = now;
+          if (res != ssize_t(cfg.bs)) {
+            LOG_FIRST_N(ERROR, 10) << "IO failed " << (res < 0 ? strerror(errno) : "short io");
+            ++errors;
+          }
+        }
+        result->Merge(hist, ops, errors);
+      });
+    }
+  }
+  for (auto& t : threads)
+    t.join();
+  close(fd);
+}
+
+string RunConfig(const Config& cfg) {
+  uint64_t duration_ns = uint64_t(GetFlag(FLAGS_duration_sec)) * 1000000000;
+  Result result;
+  if (cfg.engine == "uring") {
+    RunUring(cfg, duration_ns, &result);
+  } else {
+    CHECK_EQ(cfg.engine, "pread") << "Unknown engine";
+    RunPread(cfg, duration_ns, &result);
+  }
+
+  // The workers stop at the deadline.
+  double dur_sec = duration_ns * 1e-9;
+
+  const base::Histogram& hist = result.hist;
+  return absl::StrCat(
+      R"({"engine":")", cfg.engine, R"(","mode":")", cfg.mode, R"(","bs":)", cfg.bs,
+      R"(,"qd":)", cfg.qd, R"(,"threads":)", GetFlag(FLAGS_threads), R"(,"direct":)",
+      JsonBool(cfg.direct), R"(,"fixed":)", JsonBool(cfg.fixed), R"(,"direct_fd":)",
+      JsonBool(cfg.direct_fd), R"(,"ops":)", result.ops, R"(,"errors":)", result.errors,
+      R"(,"iops":)", uint64_t(result.ops / dur_sec), R"(,"mb_s":)",
+      result.ops * cfg.bs / dur_sec / (1 << 20), R"(,"p50_usec":)", hist.Percentile(50),
+      R"(,"p90_usec":)", hist.Percentile(90), R"(,"p99_usec":)", hist.Percentile(99),
+      R"(,"p999_usec":)", hist.Percentile(99.9), R"(,"max_usec":)", hist.max(), "}");
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  MainInitGuard guard(&argc, &argv);
+
+  PrepareFile(GetFlag(FLAGS_path));
+
+  ofstream out;
+  if (!GetFlag(FLAGS_out).empty()) {
+    out.open(GetFlag(FLAGS_out), ios::app);
+    CHECK(out) << "Could not open " << GetFlag(FLAGS_out);
+  }
+
+  Config cfg;
+  for (const string& engine : ParseList<string>(GetFlag(FLAGS_engines))) {
+    cfg.engine = engine;
+    bool uring = engine == "uring";
+    for (const string& mode : ParseList<string>(GetFlag(FLAGS_modes))) {
+      CHECK(mode == "read" || mode == "randread" || mode == "write" || mode == "randwrite")
+          << "Unknown mode " << mode;
+      cfg.mode = mode;
+      for (bool direct : ParseList<bool>(GetFlag(FLAGS_direct))) {
+        cfg.direct = direct;
+        for (bool fixed : ParseList<bool>(GetFlag(FLAGS_fixed))) {
+          if (fixed && !uring)
+            continue;
+          cfg.fixed = fixed;
+          for (bool direct_fd : ParseList<bool>(GetFlag(FLAGS_direct_fd))) {
+            if (direct_fd && !uring)
+              continue;
+            cfg.direct_fd = direct_fd;
+            for (uint32_t bs : ParseList<uint32_t>(GetFlag(FLAGS_bs))) {
+              CHECK(!direct || bs % kAlign == 0) << "O_DIRECT requires 4KB aligned blocks";
+              cfg.bs = bs;
+              for (uint32_t qd : ParseList<uint32_t>(GetFlag(FLAGS_qd))) {
+                cfg.qd = qd;
+                string res = RunConfig(cfg);
+                cout << res << endl;
+                if (out.is_open())
+                  out << res << endl;
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+
+  return 0;
+}
@@ -5,39 +5,295 @@
 #pragma once
 
 #include <atomic>
-#include <memory>
+#include <future>
 #include <optional>
 
+#include "base/logging.h"
+#include "base/small_function.h"
+#include "util/fibers/fibers.h"
 #include "util/fibers/synchronization.h"
 
 namespace util {
 namespace fb2 {
 
-// Simple thread-safe fiber-blocking future for waiting for value. Pass by value.
-template <typename T> struct Future {
-  Future() : block{std::make_shared<Block>()} {
+template <typename T> class Promise;
+template <typename T> class EmbeddedFuture;
+
+namespace detail {
+
+// The state shared by a future and its promises, refcounted intrusively. A single consumer
+// either waits for the value with Get() or attaches a continuation with Then().
+template <typename T> class FutureState {
+ public:
+  using Continuation = base::SmallFunction<48, void(T&&)>;
+
+  FutureState(bool embedded) : embedded_(embedded) {
+  }
+
+  bool IsReady() const {
+    return state_.load(std::memory_order_acquire) >= kReady;
+  }
+
+  void Resolve(T value) {
+    value_.emplace(std::move(value));
+    Publish(kReady);
+  }
+
+  // Breaks the state unless it is already resolved, e.g. by another promise or by
+  // Future::Resolve.
+  void Break() {
+    uint8_t prev = state_.load(std::memory_order_acquire);
+    while (prev < kReady) {
+      if (state_.compare_exchange_weak(prev, kBroken, std::memory_order_acq_rel)) {
+        Notify(prev, kBroken);
+        return;
+      }
+    }
+  }
+
+  bool IsBroken() const {
+    return state_.load(std::memory_order_acquire) == kBroken;
+  }
+
+  std::optional<T> TryGet() {
+    waker_.await([this] { return IsReady(); });
+    if (state_.load(std::memory_order_relaxed) == kBroken)
+      return std::nullopt;
+    return std::move(value_);
   }
 
   T Get() {
-    block->waker.await(
-        [this] { return block->has_value.exchange(false, std::memory_order_relaxed); });
-    return std::move(block->value);
+    std::optional<T> res = TryGet();
+    if (!res)
+      throw std::future_error(std::future_errc::broken_promise);
+    return std::move(*res);
+  }
+
+  template <typename F> void Then(F&& f) {
+    DCHECK(!cont_) << "Then can be called once";
+    cont_ = std::forward<F>(f);
+    uint8_t expected = kEmpty;
+    if (!state_.compare_exchange_strong(expected, kThen, std::memory_order_acq_rel)) {
+      // Already resolved, run it here.
+      RunContinuation(expected);
+    }
+  }
+
+  void AddRef() {
+    refs_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void Release() {
+    if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1 && !embedded_)
+      delete this;
+  }
+
+  // The promises are counted apart from the references, so that the state breaks only when
+  // the last promise goes away.
+  void AddPromise() {
+    promises_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void DropPromise() {
+    if (promises_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      Break();
+  }
+
+  // For the embedded states, waits until the promises are resolved or destroyed and have
+  // stopped touching the state.
+  void WaitReleased() {
+    if (refs_.load(std::memory_order_acquire) == 0)
+      return;
+    waker_.await([this] { return IsReady(); });
+
+    // The resolver releases its reference right after notifying.
+    while (refs_.load(std::memory_order_acquire) != 0)
+      ThisFiber::Yield();
+  }
+
+  friend void intrusive_ptr_add_ref(FutureState* s) noexcept {
+    s->AddRef();
+  }
+
+  friend void intrusive_ptr_release(FutureState* s) noexcept {
+    s->Release();
+  }
+
+ private:
+  enum : uint8_t { kEmpty = 0, kThen = 1, kReady = 2, kBroken = 3 };
+
+  void Publish(uint8_t result) {
+    uint8_t prev = state_.exchange(result, std::memory_order_acq_rel);
+    DCHECK_LT(prev, kReady) << "resolved twice";
+    Notify(prev, result);
+  }
+
+  void Notify(uint8_t prev, uint8_t result) {
+    if (prev == kThen)
+      RunContinuation(result);
+    else
+      waker_.notify();
+  }
+
+  // A broken state destroys the continuation without running it, which releases its
+  // captures, e.g. the promises of the futures that depend on it.
+  void RunContinuation(uint8_t result) {
+    Continuation cont = std::move(cont_);
+    if (result != kBroken)
+      cont(std::move(*value_));
+  }
+
+  std::optional<T> value_;
+  std::atomic_uint8_t state_{kEmpty};
+  const bool embedded_;
+  std::atomic_uint32_t refs_{0};
+  std::atomic_uint32_t promises_{0};
+  EventCount waker_;
+  Continuation cont_;
+};
+
+}  // namespace detail
+
+// Thread-safe fiber-blocking future for waiting for value. Pass by value: the copies share
+// the state, which is allocated once and refcounted intrusively. Either Get() or Then() may be
+// called, by a single consumer. T does not have to be default constructible.
+template <typename T> class Future {
+ public:
+  Future() : state_(new detail::FutureState<T>(false)) {
+  }
+
+  // Blocks the calling fiber until the value is set and moves it out. Throws
+  // std::future_error with broken_promise if the future broke.
+  T Get() {
+    return state_->Get();
+  }
+
+  // Same as Get, but returns nullopt if the future broke.
+  std::optional<T> TryGet() {
+    return state_->TryGet();
+  }
+
+  // Runs f(T&&) inline in the context that resolves the future, e.g. a proactor callback,
+  // or right away if the future is already resolved. f must not block. If the future breaks,
+  // f is destroyed without being called.
+  template <typename F> void Then(F&& f) {
+    state_->Then(std::forward<F>(f));
+  }
+
+  bool IsReady() const {
+    return state_->IsReady();
+  }
+
+  // True if the future is ready because its last promise went away unresolved.
+  bool IsBroken() const {
+    return state_->IsBroken();
   }
 
   void Resolve(T result) {
-    block->value = std::move(result);
-    block->has_value.store(true, std::memory_order_relaxed);
-    block->waker.notify();
+    state_->Resolve(std::move(result));
   }
 
+  Promise<T> GetPromise();
+
  private:
-  struct Block {
-    T value{};  // replace with aligned_storage or optional if T is not default-constructible
-    std::atomic_bool has_value = false;
-    util::fb2::EventCount waker{};
-  };
-  std::shared_ptr<Block> block;
+  boost::intrusive_ptr<detail::FutureState<T>> state_;
 };
 
+// Future whose state is embedded in the object, e.g. in the stack of the calling fiber, so that
+// it does not allocate. The promises may be resolved in other threads. The destructor waits
+// until all the promises are resolved or destroyed.
+template <typename T> class EmbeddedFuture {
+ public:
+  EmbeddedFuture() : state_(true) {
+  }
+
+  EmbeddedFuture(const EmbeddedFuture&) = delete;
+  EmbeddedFuture& operator=(const EmbeddedFuture&) = delete;
+
+  ~EmbeddedFuture() {
+    state_.WaitReleased();
+  }
+
+  T Get() {
+    return state_.Get();
+  }
+
+  std::optional<T> TryGet() {
+    return state_.TryGet();
+  }
+
+  template <typename F> void Then(F&& f) {
+    state_.Then(std::forward<F>(f));
+  }
+
+  bool IsReady() const {
+    return state_.IsReady();
+  }
+
+  bool IsBroken() const {
+    return state_.IsBroken();
+  }
+
+  // At most one promise may be taken.
+  Promise<T> GetPromise() {
+    return Promise<T>(&state_);
+  }
+
+ private:
+  detail::FutureState<T> state_;
+};
+
+// The producer side of a Future or EmbeddedFuture. Move-only, resolves the future once.
+// If the last promise of an unresolved future is destroyed without resolving it, the future
+// breaks: Get throws, TryGet returns nullopt and the continuation is dropped.
+template <typename T> class Promise {
+ public:
+  Promise() = default;
+
+  Promise(Promise&& o) noexcept : state_(o.state_) {
+    o.state_ = nullptr;
+  }
+
+  Promise& operator=(Promise&& o) noexcept {
+    std::swap(state_, o.state_);
+    return *this;
+  }
+
+  ~Promise() {
+    if (state_) {
+      state_->DropPromise();
+      state_->Release();
+    }
+  }
+
+  bool valid() const {
+    return state_ != nullptr;
+  }
+
+  // Runs the continuation of the future, if any, inline. The promise becomes invalid.
+  void Resolve(T value) {
+    DCHECK(state_);
+    detail::FutureState<T>* state = std::exchange(state_, nullptr);
+    state->Resolve(std::move(value));
+    state->DropPromise();
+    state->Release();
+  }
+
+ private:
+  friend class Future<T>;
+  friend class EmbeddedFuture<T>;
+
+  explicit Promise(detail::FutureState<T>* state) : state_(state) {
+    state_->AddRef();
+    state_->AddPromise();
+  }
+
+  detail::FutureState<T>* state_ = nullptr;
+};
+
+template <typename T> Promise<T> Future<T>::GetPromise() {
+  return Promise<T>(state_.get());
+}
+
 }  // namespace fb2
 }  // namespace util
@@ -6,9 +6,11 @@
 
 #include <signal.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
 
 #include "base/logging.h"
 #include "util/accept_server.h"
+#include "util/admission_controller.h"
 #include "util/proactor_pool.h"
 
 #define VSOCK(verbosity, sock) VLOG(verbosity) << "sock[" << native_handle(sock) << "] "
@@ -34,6 +36,16 @@ auto native_handle(const Connection& conn) {
 using ListType =
     intrusive::list<Connection, Connection::member_hook_t, intrusive::constant_time_size<true>>;
 
+// auto_unlink hooks require constant_time_size<false>.
+using IdleListType = intrusive::list<Connection, Connection::idle_member_hook_t,
+                                     intrusive::constant_time_size<false>>;
+
+// Ticks per idle timeout. The connections are closed at most one tick late.
+constexpr uint64_t kIdleTicksPerTimeout = 16;
+
+// More than the ticks per timeout, so that the wheel makes a full round rarely.
+constexpr unsigned kIdleSlots = 64;
+
 }  // namespace
 
 thread_local ListenerInterface::ListenerConnMap ListenerInterface::listener_map;
@@ -43,10 +55,34 @@ struct ListenerInterface::TLConnList {
   fb2::CondVarAny empty_cv;
   int pool_index = -1;
 
-  void Link(Connection* c);
+  // Idle wheel, allocated if the listener has an idle timeout. A connection is placed into
+  // the slot of the tick at which it becomes idle, unless it calls MarkActive before.
+  // The reaper checks the timestamps only when it reaches the slot.
+  std::unique_ptr<IdleListType[]> idle_slots;
+  uint64_t idle_timeout_ns = 0, tick_ns = 0;
+  uint64_t cur_tick = 0;  // the last tick that the reaper processed.
+  fb2::Fiber reaper;
+  fb2::Done reaper_done;
+
+  // Closed connections that are kept for reuse, see SetConnectionRecycling.
+  vector<intrusive_ptr<Connection>> free_conns;
+
+  void Link(Connection* c, ListenerInterface* l);
 
   void Unlink(Connection* c, ListenerInterface* l);
 
+  void InitIdleWheel(uint64_t timeout_ns) {
+    idle_slots.reset(new IdleListType[kIdleSlots]);
+    idle_timeout_ns = timeout_ns;
+    tick_ns = max<uint64_t>(timeout_ns / kIdleTicksPerTimeout, 1);
+    cur_tick = ProactorBase::GetMonotonicTimeNs() / tick_ns;
+  }
+
+  void IdleInsert(Connection* c) {
+    uint64_t tick = (c->last_active_ns_ + idle_timeout_ns + tick_ns - 1) / tick_ns;
+    idle_slots[max(tick, cur_tick + 1) % kIdleSlots].push_back(*c);
+  }
+
   void AwaitEmpty() {
     if (list.empty())
       return;
@@ -58,10 +94,14 @@ struct ListenerInterface::TLConnList {
   }
 };
 
-void ListenerInterface::TLConnList::Link(Connection* c) {
+void ListenerInterface::TLConnList::Link(Connection* c, ListenerInterface* l) {
   DCHECK(!c->hook_.is_linked());
   list.push_back(*c);
   CHECK_EQ(c->socket()->proactor()->GetPoolIndex(), this->pool_index);
+  l->proactor_conns_[pool_index].fetch_add(1, memory_order_relaxed);
+  c->memory_.set_parent(&l->thread_memory_[pool_index]);
+  if (idle_slots)
+    IdleInsert(c);
 
   DVLOG(3) << "List size " << list.size();
 }
@@ -75,6 +115,10 @@ void ListenerInterface::TLConnList::Unlink(Connection* c, ListenerInterface* l)
 
   DCHECK(!list.empty());
   list.erase(it);
+  l->proactor_conns_[pool_index].fetch_sub(1, memory_order_relaxed);
+  c->memory_.set_parent(nullptr);
+  if (c->idle_hook_.is_linked())
+    c->idle_hook_.unlink();
 
   DVLOG(2) << "Unlink conn, new list size: " << list.size();
   if (list.empty()) {
@@ -107,72 +151,44 @@ void ListenerInterface::RunAcceptLoop() {
     DVLOG(1) << "Emplacing listener " << this;
     auto res = listener_map.emplace(this, new TLConnList{});
     CHECK(res.second);
-    res.first->second->pool_index = index;
-  });
-
-  while (true) {
-    FiberSocketBase::AcceptResult res = sock_->Accept();
-    if (!res.has_value()) {
-      FiberSocketBase::error_code ec = res.error();
-      if (ec != errc::connection_aborted) {
-        LOG(ERROR) << "Error calling accept " << ec << "/" << ec.message();
-      }
-      break;
+    TLConnList* clist = res.first->second;
+    clist->pool_index = index;
+    if (idle_timeout_ns_) {
+      clist->InitIdleWheel(idle_timeout_ns_);
+      clist->reaper = fb2::Fiber("IdleReaper", [this, clist] { RunIdleReaper(clist); });
     }
+  });
 
-    unique_ptr<FiberSocketBase> peer{res.value()};
-
-    if (pause_accepting_) {
-      // Immediately closes the incoming connection.
-      // Please note that this mode could trigger a dangerous dynamic like a connection storm,
-      // where many clients try to reconnect again and again, causing a pressure on the host's
-      // firewall. Must be enabled only in special cases.
-      peer->SetProactor(sock_->proactor());
-      std::ignore = peer->Close();
-      continue;
+  if (shard_socks_.empty()) {
+    AcceptConnections(sock_.get(), false);
+  } else {
+    vector<fb2::Fiber> shard_fibers;
+    for (auto& shard : shard_socks_) {
+      shard_fibers.push_back(shard->proactor()->LaunchFiber(
+          "AcceptShard", [this, sock = shard.get()] { AcceptConnections(sock, true); }));
     }
-
-    VSOCK(2, *peer) << "Accepted " << peer->RemoteEndpoint();
-
-    uint32_t prev_connections = open_connections_.fetch_add(1, memory_order_acquire);
-    if (prev_connections >= max_clients_) {
-      // In general, we do not handle max client limit correctly for case where we experience
-      // connection storms. The reason is that we immediately close the just-accepted socket,
-      // which causes clients just to retry again and again, and increases the load on the server.
-      // What we need to do is to start throttling the accept queue by NOT handling
-      // the accept requests. Then the accept queue overflows and the linux OS
-      // starts blocking connection requests by dropping SYN packets, effectively stalling
-      // the connecting clients.
-      // Here is the great article explaining the dynamics of the connection storms:
-      // https://veithen.io/2014/01/01/how-tcp-backlog-works-in-linux.html
-      // There is this one as well: https://blog.cloudflare.com/when-tcp-sockets-refuse-to-die/
-      peer->SetProactor(sock_->proactor());
-      OnMaxConnectionsReached(peer.get());
-      (void)peer->Close();
-      open_connections_.fetch_sub(1, memory_order_release);
-      continue;
+    AcceptConnections(sock_.get(), true);
+
+    // The listener is shut down via sock_, we stop the rest of the shards.
+    for (size_t i = 0; i < shard_socks_.size(); ++i) {
+      FiberSocketBase* shard = shard_socks_[i].get();
+      shard->proactor()->Await([shard] { std::ignore = shard->Shutdown(SHUT_RDWR); });
+      shard_fibers[i].Join();
+      shard->proactor()->Await([shard] {
+        error_code ec = shard->Close();
+        LOG_IF(WARNING, ec) << "Socket close failed: " << ec.message();
+      });
     }
+    shard_socks_.clear();
+  }
 
-    // Most probably next is in another thread.
-    fb2::ProactorBase* next = PickConnectionProactor(peer.get());
-
-    Connection* conn = NewConnection(next);
-    conn->listener_ = this;
-    conn->SetSocket(peer.release());
-
-    // Run cb in its Proactor thread.
-    next->DispatchBrief([this, conn] {
-      fb2::Fiber(fb2::Launch::post, fb2::FixedStackAllocator(mr_, conn_fiber_stack_size_),
-                 "Connection",
-                 [this, conn] {
-                   conn->socket()->SetProactor(fb2::ProactorBase::me());
-                   RunSingleConnection(conn);
-                 })
-          .Detach();
-    });
+  // The sockets are shared with the successor process, hence they must not be shut down.
+  if (handed_over_) {
+    VSOCK(1, *sock_) << "Handed over, serving the connections until the server stops";
+    stop_handed_over_.Wait();
   }
 
-  error_code ec = sock_->Shutdown(SHUT_RDWR);
+  error_code ec = handed_over_ ? error_code{} : sock_->Shutdown(SHUT_RDWR);
   PreShutdown();
 
   atomic_uint32_t cur_conn_cnt{0};
@@ -182,6 +198,11 @@ void ListenerInterface::RunAcceptLoop() {
     DCHECK(it != listener_map.end());
     TLConnList* clist = it->second;
 
+    if (clist->reaper.IsJoinable()) {
+      clist->reaper_done.Notify();
+      clist->reaper.Join();
+    }
+
     // we iterate over list but Shutdown serves as a preemption point so we must handle the
     // invalidation case inside the loop;
     auto iter = clist->list.begin();
@@ -219,18 +240,130 @@ void ListenerInterface::RunAcceptLoop() {
   LOG(INFO) << "Listener stopped for port " << ep.port();
 }
 
+void ListenerInterface::AcceptConnections(FiberSocketBase* sock, bool local) {
+  // The limit of connections that a multishot accept request may queue ahead of us.
+  constexpr uint32_t kMaxQueuedAccepts = 64;
+  bool multishot = true;
+  uint32_t queue_limit = UINT32_MAX;
+
+  while (true) {
+    if (multishot) {
+      // Connections are accepted in bulk only while we have room for them. At the limit
+      // the accepts are issued one by one, and the connections above it are rejected below.
+      uint32_t open = open_connections_.load(memory_order_relaxed);
+      uint32_t limit = open < max_clients_ ? min(max_clients_ - open, kMaxQueuedAccepts) : 0;
+      if (limit != queue_limit) {
+        queue_limit = limit;
+        multishot = !sock->EnableAcceptMultishot(limit);
+      }
+    }
+
+    FiberSocketBase::AcceptResult res = sock->Accept();
+    if (!res.has_value()) {
+      FiberSocketBase::error_code ec = res.error();
+      if (ec != errc::connection_aborted) {
+        LOG(ERROR) << "Error calling accept " << ec << "/" << ec.message();
+      }
+      break;
+    }
+
+    unique_ptr<FiberSocketBase> peer{res.value()};
+
+    if (pause_accepting_) {
+      // Immediately closes the incoming connection.
+      // Please note that this mode could trigger a dangerous dynamic like a connection storm,
+      // where many clients try to reconnect again and again, causing a pressure on the host's
+      // firewall. Must be enabled only in special cases.
+      peer->SetProactor(sock->proactor());
+      std::ignore = peer->Close();
+      continue;
+    }
+
+    VSOCK(2, *peer) << "Accepted " << peer->RemoteEndpoint();
+
+    uint32_t prev_connections = open_connections_.fetch_add(1, memory_order_acquire);
+    if (prev_connections >= max_clients_) {
+      // In general, we do not handle max client limit correctly for case where we experience
+      // connection storms. The reason is that we immediately close the just-accepted socket,
+      // which causes clients just to retry again and again, and increases the load on the server.
+      // What we need to do is to start throttling the accept queue by NOT handling
+      // the accept requests. Then the accept queue overflows and the linux OS
+      // starts blocking connection requests by dropping SYN packets, effectively stalling
+      // the connecting clients.
+      // Here is the great article explaining the dynamics of the connection storms:
+      // https://veithen.io/2014/01/01/how-tcp-backlog-works-in-linux.html
+      // There is this one as well: https://blog.cloudflare.com/when-tcp-sockets-refuse-to-die/
+      peer->SetProactor(sock->proactor());
+      OnMaxConnectionsReached(peer.get());
+      (void)peer->Close();
+      open_connections_.fetch_sub(1, memory_order_release);
+      continue;
+    }
+
+    // Most probably next is in another thread, unless we accept locally.
+    // Parked proactors do not take new connections, even from their own shard socket.
+    fb2::ProactorBase* next = local && pool_->IsActive(sock->proactor()->GetPoolIndex())
+                                  ? sock->proactor()
+                                  : PickConnectionProactor(peer.get());
+
+    if (admission_ && !admission_->AdmitConnection(&next)) {
+      peer->SetProactor(sock->proactor());
+      OnOverloaded(peer.get());
+      (void)peer->Close();
+      open_connections_.fetch_sub(1, memory_order_release);
+      continue;
+    }
+
+    // The recycled connections are kept per thread, hence with recycling the connection
+    // is acquired by the thread that runs it.
+    Connection* conn = nullptr;
+    if (recycle_limit_ == 0) {
+      conn = NewConnection(next);
+      conn->listener_ = this;
+    }
+
+    auto launch = [this, conn, peer = peer.release()] {
+      fb2::Fiber(fb2::Launch::post, fb2::FixedStackAllocator(mr_, conn_fiber_stack_size_),
+                 "Connection",
+                 [this, conn, peer] {
+                   intrusive_ptr<Connection> guard = conn ? conn : AcquireConnection();
+                   guard->SetSocket(peer);
+                   peer->SetProactor(fb2::ProactorBase::me());
+                   RunSingleConnection(std::move(guard));
+                 })
+          .Detach();
+    };
+
+    // Run cb in its Proactor thread.
+    if (next == fb2::ProactorBase::me()) {
+      launch();
+    } else {
+      next->DispatchBrief(std::move(launch));
+    }
+  }
+
+}
+
 ListenerInterface::~ListenerInterface() {
   VLOG(1) << "Destroying ListenerInterface " << this;
 }
 
-void ListenerInterface::RunSingleConnection(Connection* conn) {
+void ListenerInterface::RunSingleConnection(intrusive_ptr<Connection> guard) {
+  Connection* conn = guard.get();
   VSOCK(2, *conn) << "Running connection ";
 
-  boost::intrusive_ptr<Connection> guard(conn);
+  conn->fiber_ = fb2::detail::FiberActive();
+  conn->MarkActive();
+  if (conn->memory_.used() == 0) {
+    if (conn_memory_factory_ && !conn->heap_)
+      conn->heap_ = conn_memory_factory_();
+    conn->memory_.set_upstream(conn->heap_ ? conn->heap_.get() : mr_);
+  }
+  conn->memory_.set_limit(conn_memory_limit_);
 
   ListenerConnMap* conn_map = GetSafeTlsConnMap();
   TLConnList* clist = conn_map->find(this)->second;
-  clist->Link(conn);
+  clist->Link(conn, this);
   OnConnectionStart(conn);
 
   try {
@@ -267,10 +400,48 @@ void ListenerInterface::RunSingleConnection(Connection* conn) {
       clist->Unlink(conn, this);
     }
   }
+  conn->fiber_ = nullptr;
+  uint64_t rejected = conn->memory_.rejected();
+  memory_rejected_.fetch_add(rejected - conn->reported_rejected_, memory_order_relaxed);
+  conn->reported_rejected_ = rejected;
+  if (recycle_limit_)
+    MaybeRecycle(std::move(guard));
   guard.reset();
   open_connections_.fetch_sub(1, memory_order_release);
 }
 
+auto ListenerInterface::AcquireConnection() -> intrusive_ptr<Connection> {
+  TLConnList* clist = GetSafeTlsConnMap()->find(this)->second;
+  if (!clist->free_conns.empty()) {
+    intrusive_ptr<Connection> conn = std::move(clist->free_conns.back());
+    clist->free_conns.pop_back();
+    recycle_reused_.fetch_add(1, memory_order_relaxed);
+    return conn;
+  }
+
+  Connection* conn = NewConnection(fb2::ProactorBase::me());
+  conn->listener_ = this;
+  return conn;
+}
+
+void ListenerInterface::MaybeRecycle(intrusive_ptr<Connection> conn) {
+  ListenerConnMap* conn_map = GetSafeTlsConnMap();
+  auto it = conn_map->find(this);
+
+  // Other references, e.g. of a traversal, could observe the connection while it is reused.
+  // The listener is not found if it is shutting down.
+  bool reuse = conn->use_count() == 1 && !conn->heap_ && it != conn_map->end() &&
+               it->second->free_conns.size() < recycle_limit_ && conn->Recycle();
+  if (!reuse) {
+    recycle_discarded_.fetch_add(1, memory_order_relaxed);
+    return;
+  }
+
+  conn->ResetForReuse();
+  it->second->free_conns.push_back(std::move(conn));
+  recycle_recycled_.fetch_add(1, memory_order_relaxed);
+}
+
 void ListenerInterface::InitByAcceptServer(ProactorPool* pool, PMR_NS::memory_resource* mr) {
   // In tests we might relaunch AcceptServer with the same listener, so we allow
   // reassigning the same pool.
@@ -278,6 +449,37 @@ void ListenerInterface::InitByAcceptServer(ProactorPool* pool, PMR_NS::memory_re
 
   pool_ = pool;
   mr_ = mr ? mr : &fb2::std_malloc_resource;
+  if (!proactor_conns_)
+    proactor_conns_.reset(new atomic_uint32_t[pool->size()]());
+  if (!thread_memory_) {
+    thread_memory_.reset(new base::CountingMemoryResource[pool->size()]);
+    for (unsigned i = 0; i < pool->size(); ++i) {
+      thread_memory_[i].set_upstream(mr_);
+      thread_memory_[i].set_limit(thread_memory_limit_);
+    }
+  }
+}
+
+void ListenerInterface::SetMemoryLimits(size_t per_connection, size_t per_thread) {
+  conn_memory_limit_ = per_connection;
+  thread_memory_limit_ = per_thread;
+  if (thread_memory_) {
+    for (unsigned i = 0; i < pool_->size(); ++i)
+      thread_memory_[i].set_limit(per_thread);
+  }
+}
+
+auto ListenerInterface::GetMemoryStats() const -> MemoryStats {
+  MemoryStats res;
+  res.rejected = memory_rejected_.load(memory_order_relaxed);
+  if (!thread_memory_)
+    return res;
+
+  for (unsigned i = 0; i < pool_->size(); ++i) {
+    res.used += thread_memory_[i].used();
+    res.peak += thread_memory_[i].peak();
+  }
+  return res;
 }
 
 error_code ListenerInterface::ConfigureServerSocket(int fd) {
@@ -289,9 +491,131 @@ error_code ListenerInterface::ConfigureServerSocket(int fd) {
 }
 
 fb2::ProactorBase* ListenerInterface::PickConnectionProactor(FiberSocketBase* sock) {
+  ConnectionPlacement placement = placement_.value_or(
+      pool_->numa_spread() ? ConnectionPlacement::NUMA_NODE : ConnectionPlacement::ROUND_ROBIN);
+  if (placement == ConnectionPlacement::ROUND_ROBIN)
+    return pool_->GetNextProactor();
+
+#ifdef __linux__
+  int fd = sock->native_handle();
+
+#ifdef SO_INCOMING_NAPI_ID
+  if (placement == ConnectionPlacement::RX_QUEUE) {
+    uint32_t napi_id = 0;
+    socklen_t len = sizeof(napi_id);
+
+    // The id is 0 for the devices without napi.
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_NAPI_ID, &napi_id, &len) == 0 && napi_id) {
+      auto it = napi_proactors_.find(napi_id);
+      if (it == napi_proactors_.end() || !pool_->IsActive(it->second)) {
+        ProactorBase* pb = PickByIncomingCpu(fd);
+        VLOG(1) << "Placing rx queue " << napi_id << " on proactor " << pb->GetPoolIndex();
+        it = napi_proactors_.insert_or_assign(napi_id, pb->GetPoolIndex()).first;
+      }
+      return pool_->at(it->second);
+    }
+  }
+#endif
+
+  if (placement != ConnectionPlacement::NUMA_NODE)
+    return PickByIncomingCpu(fd);
+
+  if (pool_->num_numa_nodes() > 1) {
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 && cpu >= 0) {
+      return pool_->GetNextProactorOnNode(pool_->CpuToNumaNode(cpu));
+    }
+  }
+#endif
+
   return pool_->GetNextProactor();
 }
 
+fb2::ProactorBase* ListenerInterface::PickLeastLoaded(const vector<unsigned>* ids, int node) {
+  size_t count = ids ? ids->size() : pool_->size();
+  unsigned offset = pick_offset_++;
+  int best = -1;
+  uint32_t best_conns = UINT32_MAX;
+
+  for (size_t i = 0; i < count; ++i) {
+    unsigned index = ids ? (*ids)[(offset + i) % count] : (offset + i) % count;
+    if ((node >= 0 && pool_->numa_node(index) != node) || !pool_->IsActive(index))
+      continue;
+    uint32_t conns = proactor_conns_[index].load(memory_order_relaxed);
+    if (conns < best_conns) {
+      best = index;
+      best_conns = conns;
+    }
+  }
+
+  return best < 0 ? pool_->GetNextProactor() : pool_->at(best);
+}
+
+fb2::ProactorBase* ListenerInterface::PickByIncomingCpu(int fd) {
+#ifdef __linux__
+  int cpu = -1;
+  socklen_t len = sizeof(cpu);
+  if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 && cpu >= 0) {
+    const vector<unsigned>& ids = pool_->MapCpuToThreads(cpu);
+    if (!ids.empty())
+      return PickLeastLoaded(&ids, -1);
+
+    // No proactor runs on that cpu, at least stay on its node.
+    if (pool_->num_numa_nodes() > 1)
+      return PickLeastLoaded(nullptr, pool_->CpuToNumaNode(cpu));
+  }
+#endif
+
+  return PickLeastLoaded(nullptr, -1);
+}
+
+auto ListenerInterface::GetThreadConnections() -> vector<intrusive_ptr<Connection>> {
+  vector<intrusive_ptr<Connection>> res;
+  auto it = listener_map.find(this);
+  if (it == listener_map.end())
+    return res;
+
+  res.reserve(it->second->list.size());
+  for (Connection& conn : it->second->list)
+    res.emplace_back(&conn);
+  return res;
+}
+
+void ListenerInterface::MigrateParkedConnections() {
+  pool_->AwaitFiberOnAll([this](unsigned index, ProactorBase*) {
+    if (pool_->IsActive(index))
+      return;
+
+    vector<intrusive_ptr<Connection>> conns = GetThreadConnections();
+    VLOG_IF(1, !conns.empty()) << "Moving " << conns.size() << " connections off proactor "
+                               << index;
+    for (auto& conn : conns)
+      conn->RequestMigration(pool_->GetNextProactor());
+  });
+}
+
+void ListenerInterface::DrainConnectionsOnThread() {
+  // OnDrain may preempt and the connections may close meanwhile, hence we hold them.
+  for (auto& conn : GetThreadConnections()) {
+    if (conn->hook_.is_linked())
+      conn->OnDrain();
+  }
+}
+
+void ListenerInterface::CancelConnectionsOnThread() {
+  vector<intrusive_ptr<Connection>> conns = GetThreadConnections();
+
+  // The cancellations are submitted together before the first Shutdown preempts.
+  for (auto& conn : conns) {
+    conn->socket()->CancelPendingIoAsync();
+  }
+  for (auto& conn : conns) {
+    if (conn->hook_.is_linked())
+      conn->Shutdown();
+  }
+}
+
 void ListenerInterface::TraverseConnections(TraverseCB cb) {
   pool_->AwaitFiberOnAll([&](unsigned index, auto* pb) { TraverseConnectionsOnThread(cb); });
 }
@@ -382,7 +706,7 @@ void ListenerInterface::Migrate(Connection* conn, fb2::ProactorBase* dest) {
     TLConnList* dst_clist = it->second;
     CHECK(dst_clist != src_clist);
     CHECK_EQ(dst_clist->pool_index, dest_index);
-    dst_clist->Link(conn);
+    dst_clist->Link(conn, this);
   }
 
   // Release the lock.
@@ -417,6 +741,112 @@ uint32_t ListenerInterface::GetMaxClients() const {
   return max_clients_;
 }
 
+void ListenerInterface::SetIdleTimeout(chrono::milliseconds timeout,
+                                       uint32_t max_closes_per_tick) {
+  CHECK_GT(max_closes_per_tick, 0u);
+  idle_timeout_ns_ = chrono::duration_cast<chrono::nanoseconds>(timeout).count();
+  idle_max_closes_ = max_closes_per_tick;
+}
+
+auto ListenerInterface::GetIdleStats() const -> IdleStats {
+  IdleStats res;
+  res.closed = idle_closed_.load(memory_order_relaxed);
+  res.rescheduled = idle_rescheduled_.load(memory_order_relaxed);
+  res.deferred = idle_deferred_.load(memory_order_relaxed);
+  return res;
+}
+
+auto ListenerInterface::GetRecycleStats() const -> RecycleStats {
+  RecycleStats res;
+  res.reused = recycle_reused_.load(memory_order_relaxed);
+  res.recycled = recycle_recycled_.load(memory_order_relaxed);
+  res.discarded = recycle_discarded_.load(memory_order_relaxed);
+  return res;
+}
+
+void ListenerInterface::RunIdleReaper(TLConnList* clist) {
+  while (!clist->reaper_done.WaitFor(chrono::nanoseconds(clist->tick_ns))) {
+    ReapIdle(clist);
+  }
+}
+
+void ListenerInterface::ReapIdle(TLConnList* clist) {
+  uint64_t now = ProactorBase::GetMonotonicTimeNs();
+  uint64_t target = now / clist->tick_ns;
+
+  // A single round visits every slot.
+  if (target > clist->cur_tick + kIdleSlots)
+    clist->cur_tick = target - kIdleSlots;
+
+  vector<boost::intrusive_ptr<Connection>> victims;
+  uint64_t rescheduled = 0, deferred = 0;
+  IdleListType pending;
+
+  while (clist->cur_tick < target) {
+    ++clist->cur_tick;
+    IdleListType& slot = clist->idle_slots[clist->cur_tick % kIdleSlots];
+
+    // The connections that we put back may land in the same slot.
+    pending.splice(pending.end(), slot);
+    while (!pending.empty()) {
+      Connection& conn = pending.front();
+      pending.pop_front();
+      if (conn.last_active_ns_ + idle_timeout_ns_ > now) {
+        clist->IdleInsert(&conn);
+        ++rescheduled;
+      } else if (victims.size() < idle_max_closes_) {
+        victims.emplace_back(&conn);
+      } else {
+        // Closed on the next tick.
+        clist->idle_slots[(target + 1) % kIdleSlots].push_back(conn);
+        ++deferred;
+      }
+    }
+  }
+
+  idle_rescheduled_.fetch_add(rescheduled, memory_order_relaxed);
+  idle_deferred_.fetch_add(deferred, memory_order_relaxed);
+  idle_closed_.fetch_add(victims.size(), memory_order_relaxed);
+
+  // Shutdown may preempt, the connection fibers unlink their connections once they exit.
+  for (auto& conn : victims) {
+    VSOCK(1, *conn) << "Closing idle connection";
+    conn->Shutdown();
+  }
+
+  // A connection that still runs after the shutdown, e.g. because its HandleRequests does not
+  // read from the socket, is checked again one timeout later.
+  for (auto& conn : victims) {
+    if (conn->hook_.is_linked() && !conn->idle_hook_.is_linked() &&
+        conn->socket()->proactor() == ProactorBase::me()) {
+      clist->idle_slots[(clist->cur_tick + kIdleTicksPerTimeout) % kIdleSlots].push_back(*conn);
+    }
+  }
+}
+
+bool Connection::MaybeMigrate() {
+  fb2::ProactorBase* dest = std::exchange(migration_dest_, nullptr);
+  if (!dest || dest == socket_->proactor() || !socket_->IsOpen())
+    return false;
+
+  listener_->Migrate(this, dest);
+  return true;
+}
+
+bool Connection::IsDraining() const {
+  return listener_ && listener_->draining_.load(memory_order_relaxed);
+}
+
+void Connection::OnDrain() {
+  // Unlike socket_->Shutdown(SHUT_RD), keeps the socket writable.
+  if (socket_ && socket_->IsOpen())
+    ::shutdown(socket_->native_handle(), SHUT_RD);
+}
+
+bool Connection::ShouldShedRequest() {
+  return listener_ && listener_->shed_requests_ && listener_->admission_->ShouldShed();
+}
+
 void Connection::Shutdown() {
   CHECK(socket_);
   auto ec = socket_->Shutdown(SHUT_RDWR);
@@ -0,0 +1,262 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/fibers/memory_pressure.h"
+
+#include <absl/strings/str_cat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include "base/logging.h"
+#include "util/fibers/epoll_proactor.h"
+#include "util/fibers/read_buffer_pool.h"
+#include "util/proactor_pool.h"
+
+#ifdef __linux__
+#include "util/fibers/uring_proactor.h"
+#endif
+
+namespace util {
+namespace fb2 {
+
+using namespace std;
+
+namespace {
+
+uint64_t NowMs() {
+  return chrono::duration_cast<chrono::milliseconds>(
+             chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+const char* LevelName(MemoryPressureMonitor::Level level) {
+  return level == MemoryPressureMonitor::kCritical ? "critical" : "moderate";
+}
+
+}  // namespace
+
+MemoryPressureMonitor::MemoryPressureMonitor(ProactorPool* pool, const Options& opts)
+    : pool_(pool), opts_(opts) {
+  if (opts_.shrink_read_buffers) {
+    AddShrinkCallback([](Level level) {
+      if (level == kCritical)
+        ReadBufferPool::Local()->Trim();
+      else
+        ReadBufferPool::Local()->Shrink();
+    });
+  }
+}
+
+MemoryPressureMonitor::~MemoryPressureMonitor() {
+  Stop();
+}
+
+unsigned MemoryPressureMonitor::AddShrinkCallback(ShrinkCb cb) {
+  lock_guard lk(mu_);
+  callbacks_.emplace_back(next_id_, std::move(cb));
+  return next_id_++;
+}
+
+void MemoryPressureMonitor::RemoveShrinkCallback(unsigned id) {
+  lock_guard lk(mu_);
+  auto it = find_if(callbacks_.begin(), callbacks_.end(),
+                    [id](const auto& p) { return p.first == id; });
+  if (it != callbacks_.end())
+    callbacks_.erase(it);
+}
+
+void MemoryPressureMonitor::Start() {
+  CHECK(!fiber_.IsJoinable());
+  CHECK(ProactorBase::me() == nullptr);
+
+  stopped_.store(false, memory_order_relaxed);
+  fiber_ = pool_->at(0)->LaunchFiber("MemoryPressure", [this] { Run(); });
+}
+
+void MemoryPressureMonitor::Stop() {
+  if (!fiber_.IsJoinable())
+    return;
+
+  stopped_.store(true, memory_order_relaxed);
+  ec_.notify();
+  fiber_.Join();
+}
+
+void MemoryPressureMonitor::Shrink(Level level) {
+  vector<ShrinkCb> cbs;
+  {
+    lock_guard lk(mu_);
+    ++stats_.shrinks[level];
+    for (const auto& [id, cb] : callbacks_)
+      cbs.push_back(cb);
+  }
+
+  pool_->AwaitFiberOnAll([&cbs, level](unsigned index, ProactorBase*) {
+    for (const auto& cb : cbs)
+      cb(level);
+  });
+}
+
+auto MemoryPressureMonitor::GetStats() const -> Stats {
+  lock_guard lk(mu_);
+  return stats_;
+}
+
+void MemoryPressureMonitor::Run() {
+  int fd = OpenTrigger();
+  has_trigger_ = fd >= 0;
+  if (has_trigger_)
+    ArmTrigger(fd);
+
+  {
+    lock_guard lk(mu_);
+    stats_.psi_trigger = has_trigger_;
+  }
+
+  auto events = io::ReadCgroupMemoryEvents();
+  has_events_ = bool(events);
+  if (has_events_)
+    events_ = *events;
+
+  LOG(INFO) << "Monitoring memory pressure, psi trigger: " << has_trigger_
+            << ", cgroup events: " << has_events_;
+
+  while (!stopped_.load(memory_order_relaxed)) {
+    auto tp = chrono::steady_clock::now() + chrono::milliseconds(opts_.poll_ms);
+    ec_.await_until([this] { return triggered_ || stopped_.load(memory_order_relaxed); }, tp);
+    if (stopped_.load(memory_order_relaxed))
+      break;
+
+    int level = Poll(exchange(triggered_, false));
+    if (level >= 0)
+      MaybeShrink(Level(level));
+  }
+
+  if (has_trigger_) {
+    DisarmTrigger(fd);
+    close(fd);
+  }
+}
+
+int MemoryPressureMonitor::OpenTrigger() {
+  int fd = open(opts_.psi_path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+    LOG(WARNING) << "Could not open " << opts_.psi_path << ": " << strerror(errno);
+    return -1;
+  }
+
+  // The kernel expects the terminating null character as well.
+  string trigger = absl::StrCat("some ", opts_.psi_stall_us, " ", opts_.psi_window_us);
+  if (write(fd, trigger.c_str(), trigger.size() + 1) < 0) {
+    LOG(WARNING) << "Could not create the psi trigger \"" << trigger << "\": " << strerror(errno)
+                 << ", polling the averages instead";
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+void MemoryPressureMonitor::ArmTrigger(int fd) {
+  ProactorBase* proactor = ProactorBase::me();
+
+  // The kernel signals POLLPRI once per window in which the stall time exceeded the threshold.
+  if (proactor->GetKind() == ProactorBase::EPOLL) {
+    auto cb = [this](uint32_t event_mask, int err, EpollProactor* me) {
+      triggered_ = true;
+      ec_.notify();
+    };
+    arm_index_ = static_cast<EpollProactor*>(proactor)->Arm(fd, std::move(cb), POLLPRI);
+  } else {
+    CHECK_EQ(proactor->GetKind(), ProactorBase::IOURING);
+#ifdef __linux__
+    auto cb = [this](uint32_t event_mask) {
+      triggered_ = true;
+      ec_.notify();
+    };
+    arm_index_ = static_cast<UringProactor*>(proactor)->EpollAdd(fd, std::move(cb), POLLPRI);
+#endif
+  }
+}
+
+void MemoryPressureMonitor::DisarmTrigger(int fd) {
+  ProactorBase* proactor = ProactorBase::me();
+  if (proactor->GetKind() == ProactorBase::EPOLL) {
+    static_cast<EpollProactor*>(proactor)->Disarm(fd, arm_index_);
+  } else {
+#ifdef __linux__
+    static_cast<UringProactor*>(proactor)->EpollDel(arm_index_);
+#endif
+  }
+}
+
+int MemoryPressureMonitor::Poll(bool triggered) {
+  int level = -1;
+  Stats delta;
+
+  if (triggered || !has_trigger_) {
+    // A trigger signals the pressure even if the averages did not catch up yet.
+    if (triggered)
+      level = kModerate;
+
+    auto pressure = io::ReadMemoryPressure();
+    if (pressure) {
+      if (pressure->full_avg10 >= opts_.full_avg10_threshold)
+        level = kCritical;
+      else if (pressure->some_avg10 >= opts_.some_avg10_threshold)
+        level = kModerate;
+    }
+    if (level >= 0)
+      delta.psi_events = 1;
+  }
+
+  if (has_events_) {
+    auto events = io::ReadCgroupMemoryEvents();
+    if (events) {
+      // The counters are monotonic unless the process moved to another cgroup.
+      if (events->high > events_.high)
+        delta.high_events = events->high - events_.high;
+      if (events->max > events_.max)
+        delta.max_events = events->max - events_.max;
+      if (events->oom_kill > events_.oom_kill)
+        delta.oom_kills = events->oom_kill - events_.oom_kill;
+      events_ = *events;
+    }
+
+    if (delta.oom_kills)
+      LOG(WARNING) << "The OOM killer killed " << delta.oom_kills << " tasks of the cgroup";
+    if (delta.max_events)
+      level = kCritical;
+    else if (delta.high_events)
+      level = max(level, int(kModerate));
+  }
+
+  lock_guard lk(mu_);
+  stats_.psi_events += delta.psi_events;
+  stats_.high_events += delta.high_events;
+  stats_.max_events += delta.max_events;
+  stats_.oom_kills += delta.oom_kills;
+  return level;
+}
+
+void MemoryPressureMonitor::MaybeShrink(Level level) {
+  uint64_t now = NowMs();
+
+  // A critical shrink is not suppressed by a recent moderate one.
+  for (unsigned l = level; l <= kCritical; ++l) {
+    if (last_shrink_ms_[l] + opts_.min_shrink_interval_ms > now)
+      return;
+  }
+  last_shrink_ms_[level] = now;
+
+  LOG(INFO) << "Memory pressure is " << LevelName(level) << ", shrinking the caches";
+  Shrink(level);
+}
+
+}  // namespace fb2
+}  // namespace util
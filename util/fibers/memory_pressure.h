@@ -0,0 +1,135 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "io/proc_reader.h"
+#include "util/fibers/fibers.h"
+#include "util/fibers/synchronization.h"
+
+namespace util {
+
+class ProactorPool;
+
+namespace fb2 {
+
+// Watches the memory pressure of the process and runs the registered shrink callbacks on every
+// proactor of the pool, so that the caches are trimmed in the seconds before the OOM killer
+// would step in. The sources of the pressure are:
+//   - a PSI trigger on /proc/pressure/memory, which the kernel signals when the tasks were
+//     stalled on memory for psi_stall_us within psi_window_us. If the trigger can not be
+//     created (old kernels, no permissions), the PSI averages are polled instead.
+//   - the high and max counters of memory.events of the cgroup v2 of the process, which grow
+//     when the cgroup is throttled or reclaimed at its limits.
+// The monitor runs in a fiber on the first proactor of the pool and waits for the trigger
+// with the proactor, so it costs nothing until the pressure rises.
+// The callbacks run in a fiber on each proactor, hence they may use the thread local state
+// of the proactor, i.e. its buffer pools, arenas and the mimalloc heap. ReadBufferPool is
+// shrunk by default.
+class MemoryPressureMonitor {
+ public:
+  enum Level : uint8_t {
+    kModerate,  // the process is stalled on memory, release what is cheap to rebuild.
+    kCritical,  // the cgroup is at its limit, release everything that can be released.
+  };
+
+  using ShrinkCb = std::function<void(Level)>;
+
+  struct Options {
+    std::string psi_path = "/proc/pressure/memory";
+
+    // Unprivileged processes can create triggers only with windows that are multiples of 2s.
+    uint32_t psi_stall_us = 150000;
+    uint32_t psi_window_us = 2000000;
+
+    // The period of polling memory.events and the PSI averages without a trigger.
+    uint32_t poll_ms = 1000;
+
+    // Without a trigger, the percent of the stalled time over 10s that signals the pressure.
+    double some_avg10_threshold = 10;
+
+    // The percent of the time all the tasks were stalled over 10s that makes the PSI
+    // pressure critical.
+    double full_avg10_threshold = 10;
+
+    // Shrinks of the same or a lower level are not repeated more often than that.
+    uint32_t min_shrink_interval_ms = 1000;
+
+    bool shrink_read_buffers = true;
+  };
+
+  struct Stats {
+    uint64_t psi_events = 0;       // PSI triggers or polled averages above the threshold.
+    uint64_t high_events = 0;      // increments of memory.events high.
+    uint64_t max_events = 0;       // increments of memory.events max.
+    uint64_t oom_kills = 0;        // increments of memory.events oom_kill.
+    uint64_t shrinks[2] = {0, 0};  // per Level.
+    bool psi_trigger = false;      // whether the PSI trigger is armed.
+  };
+
+  explicit MemoryPressureMonitor(ProactorPool* pool)
+      : MemoryPressureMonitor(pool, Options{}) {
+  }
+
+  MemoryPressureMonitor(ProactorPool* pool, const Options& opts);
+  ~MemoryPressureMonitor();
+
+  // Returns an id for RemoveShrinkCallback. Can be called at any time from any thread.
+  unsigned AddShrinkCallback(ShrinkCb cb);
+  void RemoveShrinkCallback(unsigned id);
+
+  // Must not be called from a proactor thread.
+  void Start();
+  void Stop();
+
+  // Runs the shrink callbacks on all the proactors and waits for them to finish.
+  // Called by the monitor, can be called explicitly from a non-proactor thread or a fiber.
+  void Shrink(Level level);
+
+  Stats GetStats() const;
+
+ private:
+  void Run();
+
+  // Opens psi_path and writes the trigger into it, returns -1 on failure.
+  int OpenTrigger();
+  void ArmTrigger(int fd);
+  void DisarmTrigger(int fd);
+
+  // Polls the sources and returns the level of the pressure, or -1 if there is none.
+  // triggered is true if the PSI trigger fired since the previous poll.
+  int Poll(bool triggered);
+  void MaybeShrink(Level level);
+
+  ProactorPool* pool_;
+  Options opts_;
+  Fiber fiber_;
+
+  EventCount ec_;
+  std::atomic_bool stopped_{false};
+  // Accessed by the monitor proactor only.
+  bool triggered_ = false;
+  bool has_trigger_ = false;
+  unsigned arm_index_ = 0;
+
+  io::CgroupMemoryEvents events_;
+  bool has_events_ = false;
+  uint64_t last_shrink_ms_[2] = {0, 0};
+
+  mutable std::mutex mu_;
+  std::vector<std::pair<unsigned, ShrinkCb>> callbacks_;
+  unsigned next_id_ = 0;
+  Stats stats_;
+};
+
+}  // namespace fb2
+}  // namespace util
@@ -0,0 +1,117 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/fibers/message_lanes.h"
+
+#include "base/logging.h"
+#include "util/fibers/proactor_base.h"
+#include "util/proactor_pool.h"
+
+namespace util {
+namespace fb2 {
+
+using namespace std;
+
+MessageLanes::MessageLanes(ProactorPool* pool, uint32_t lane_size)
+    : pool_(pool), size_(pool->size()) {
+  CHECK_GE(lane_size, 2u);
+
+  lanes_.reset(new unique_ptr<Lane>[size_ * size_]);
+  for (unsigned i = 0; i < size_ * size_; ++i)
+    lanes_[i] = make_unique<Lane>(lane_size);
+  inbox_.reset(new Inbox[size_]);
+
+  pool_->AwaitBrief([this](unsigned index, ProactorBase* p) {
+    CHECK(p->lanes_ == nullptr) << "Only one MessageLanes per pool is supported";
+    DCHECK_EQ(int32_t(index), p->GetPoolIndex());
+    inbox_[index].proactor = p;
+    p->lanes_ = this;
+  });
+}
+
+MessageLanes::~MessageLanes() {
+  pool_->AwaitBrief([this](unsigned, ProactorBase* p) {
+    DCHECK(p->lanes_ == this);
+    p->lanes_ = nullptr;
+  });
+}
+
+bool MessageLanes::TrySend(unsigned dest, const LaneMessage& msg) {
+  DCHECK_LT(dest, size_);
+  DCHECK(msg.handler);
+  ProactorBase* me = ProactorBase::me();
+  DCHECK(me && me->lanes_ == this);
+
+  unsigned src = me->GetPoolIndex();
+  if (!lane(src, dest).queue.write(msg))
+    return false;
+
+  Stats& stats = inbox_[src].stats;
+  ++stats.sent;
+
+  // Pairs with the fence in Drain: either the receiver sees the message in its current drain
+  // or we see that it reset woken and wake it up again.
+  Inbox& inbox = inbox_[dest];
+  atomic_thread_fence(memory_order_seq_cst);
+  if (!inbox.woken.load(memory_order_relaxed) &&
+      !inbox.woken.exchange(true, memory_order_acq_rel)) {
+    ++stats.wakeups;
+    inbox.proactor->WakeupIfNeeded();
+  }
+  return true;
+}
+
+void MessageLanes::Send(unsigned dest, const LaneMessage& msg) {
+  if (TrySend(dest, msg))
+    return;
+
+  ++inbox_[ProactorBase::me()->GetPoolIndex()].stats.lane_full;
+  Inbox& inbox = inbox_[dest];
+  inbox.blocked_senders.fetch_add(1, memory_order_seq_cst);
+  inbox.space_avail.await([&] { return TrySend(dest, msg); });
+  inbox.blocked_senders.fetch_sub(1, memory_order_relaxed);
+}
+
+bool MessageLanes::Drain(unsigned index) {
+  Inbox& inbox = inbox_[index];
+
+  // Without a wakeup there is nothing new in the lanes, so the idle loop does not touch them.
+  if (inbox.woken.load(memory_order_relaxed)) {
+    inbox.woken.store(false, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+  } else if (!inbox.leftover) {
+    return false;
+  }
+
+  bool leftover = false;
+  uint64_t received = 0;
+  LaneMessage msg;
+  for (unsigned src = 0; src < size_; ++src) {
+    auto& queue = lane(src, index).queue;
+    unsigned cnt = 0;
+
+    // Bounded, so that a busy sender does not starve the rest of the loop.
+    while (cnt < kDrainBatch && queue.read(msg)) {
+      msg.handler(msg, src);
+      ++cnt;
+    }
+    received += cnt;
+    if (cnt == kDrainBatch && !queue.isEmpty())
+      leftover = true;
+  }
+
+  inbox.leftover = leftover;
+  inbox.stats.received += received;
+
+  if (received) {
+    // Pairs with the increment in Send, that happens before a blocked sender retries.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (inbox.blocked_senders.load(memory_order_relaxed))
+      inbox.space_avail.notifyAll();
+  }
+  return leftover;
+}
+
+}  // namespace fb2
+}  // namespace util
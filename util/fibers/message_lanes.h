@@ -0,0 +1,113 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include "base/ProducerConsumerQueue.h"
+#include "util/fibers/synchronization.h"
+
+namespace util {
+
+class ProactorPool;
+
+namespace fb2 {
+
+class ProactorBase;
+
+// Fixed-size message that is copied by value through a lane. handler runs in the proactor
+// loop of the receiver with the message and the pool index of its sender, so similarly to
+// DispatchBrief callbacks it must not block.
+struct LaneMessage {
+  using Handler = void (*)(const LaneMessage& msg, unsigned src);
+
+  Handler handler = nullptr;
+  uint64_t arg[3] = {0, 0, 0};  // payload, interpreted by handler.
+};
+
+static_assert(sizeof(LaneMessage) == 32);
+
+// N x N mesh of single-producer single-consumer rings between the proactors of a pool.
+// Lane (i, j) carries the messages from proactor i to proactor j, so sending involves
+// neither CAS loops nor allocations as opposed to DispatchBrief. The receiving proactor
+// loop drains its incoming lanes in batches, in the same stage where it runs the task queue.
+// A sender wakes up the receiver only for the first message after the receiver drained its
+// lanes. Messages of the same lane are handled in order.
+// The pool must be running while the mesh exists. There can be one mesh per pool.
+class MessageLanes {
+ public:
+  // Stats of a proactor, updated by its thread only.
+  struct Stats {
+    uint64_t sent = 0, received = 0;
+    uint64_t lane_full = 0;  // Send calls that blocked because the lane was full.
+    uint64_t wakeups = 0;    // wakeups sent to receivers.
+  };
+
+  // lane_size is the capacity of each lane, must be at least 2.
+  explicit MessageLanes(ProactorPool* pool, uint32_t lane_size = 256);
+
+  // Detaches the mesh from the proactors, pending messages are dropped. Must not be called
+  // concurrently with Send calls.
+  ~MessageLanes();
+
+  // Sends msg to the proactor with pool index dest. Must be called from a proactor thread
+  // of the pool. Returns false if the lane is full.
+  bool TrySend(unsigned dest, const LaneMessage& msg);
+
+  // Like TrySend, but blocks the calling fiber while the lane is full.
+  void Send(unsigned dest, const LaneMessage& msg);
+
+  unsigned size() const {
+    return size_;
+  }
+
+  const Stats& stats(unsigned index) const {
+    return inbox_[index].stats;
+  }
+
+ private:
+  friend class ProactorBase;
+
+  static constexpr unsigned kDrainBatch = 64;
+
+  struct alignas(64) Lane {
+    explicit Lane(uint32_t size) : queue(size) {
+    }
+
+    folly::ProducerConsumerQueue<LaneMessage> queue;
+  };
+
+  struct alignas(64) Inbox {
+    // Set by the first sender after the receiver drained its lanes, reset by the receiver.
+    std::atomic_bool woken{false};
+
+    // Senders that wait in Send for a lane of this receiver.
+    std::atomic_uint32_t blocked_senders{0};
+    EventCount space_avail;
+
+    ProactorBase* proactor = nullptr;
+
+    // Accessed by the thread of the proactor only.
+    alignas(64) Stats stats;
+    bool leftover = false;  // whether the last Drain left messages in the lanes.
+  };
+
+  Lane& lane(unsigned src, unsigned dest) {
+    return *lanes_[src * size_ + dest];
+  }
+
+  // Called by the loop of proactor index. Returns true if messages are left in its lanes.
+  bool Drain(unsigned index);
+
+  ProactorPool* pool_;
+  unsigned size_;
+  std::unique_ptr<std::unique_ptr<Lane>[]> lanes_;
+  std::unique_ptr<Inbox[]> inbox_;
+};
+
+}  // namespace fb2
+}  // namespace util
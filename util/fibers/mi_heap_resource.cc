@@ -0,0 +1,121 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/fibers/mi_heap_resource.h"
+
+#include <mimalloc.h>
+
+#include <new>
+
+#include "base/logging.h"
+#include "util/listener_interface.h"
+#include "util/proactor_pool.h"
+
+namespace util {
+namespace fb2 {
+
+using namespace std;
+
+namespace {
+
+thread_local MiHeapResource* tl_proactor_heap = nullptr;
+
+}  // namespace
+
+MiHeapResource::MiHeapResource(bool bulk_free)
+    : heap_(mi_heap_new()),
+      owner_(ProactorBase::me()),
+      owner_tid_(pthread_self()),
+      bulk_free_(bulk_free) {
+  CHECK(heap_);
+}
+
+MiHeapResource::~MiHeapResource() {
+  auto release = [heap = heap_, bulk_free = bulk_free_] {
+    if (bulk_free)
+      mi_heap_destroy(heap);
+    else
+      mi_heap_delete(heap);
+  };
+
+  if (IsOwner()) {
+    release();
+  } else if (owner_) {
+    owner_->DispatchBrief(std::move(release));
+  } else {
+    LOG(DFATAL) << "mimalloc heap is destroyed outside of its thread, leaking it";
+  }
+}
+
+void MiHeapResource::Collect(bool force) {
+  DCHECK(IsOwner());
+  mi_heap_collect(heap_, force);
+}
+
+void* MiHeapResource::do_allocate(size_t size, size_t align) {
+  void* res = IsOwner() ? mi_heap_malloc_aligned(heap_, size, align)
+                        : mi_malloc_aligned(size, align);
+  if (!res)
+    throw bad_alloc();
+  return res;
+}
+
+void MiHeapResource::do_deallocate(void* ptr, size_t size, size_t align) {
+  mi_free_size_aligned(ptr, size, align);
+}
+
+MiHeapBinding::~MiHeapBinding() {
+  CHECK(idle_tasks_.empty()) << "Stop must be called before destruction";
+}
+
+void MiHeapBinding::Start(const Options& opts) {
+  CHECK(idle_tasks_.empty());
+  opts_ = opts;
+  idle_tasks_.resize(pool_->size());
+
+  pool_->AwaitBrief([this](unsigned index, ProactorBase* pb) {
+    MiHeapResource* heap = new MiHeapResource(false);
+    tl_proactor_heap = heap;
+
+    uint64_t interval_ns = uint64_t(opts_.collect_interval_ms) * 1000000;
+    uint64_t next_ns = ProactorBase::GetMonotonicTimeNs() + interval_ns;
+    idle_tasks_[index] = pb->AddOnIdleTask([heap, interval_ns, next_ns]() mutable -> uint32_t {
+      uint64_t now = ProactorBase::GetMonotonicTimeNs();
+      if (now >= next_ns) {
+        heap->Collect(false);
+
+        // The default heap of the thread and the abandoned segments of the exited threads.
+        mi_collect(false);
+        next_ns = now + interval_ns;
+      }
+
+      // Level 0 runs the task at most once per second.
+      return 0;
+    });
+  });
+}
+
+void MiHeapBinding::Stop() {
+  if (idle_tasks_.empty())
+    return;
+
+  pool_->AwaitBrief([this](unsigned index, ProactorBase* pb) {
+    pb->RemoveOnIdleTask(idle_tasks_[index]);
+    delete tl_proactor_heap;
+    tl_proactor_heap = nullptr;
+  });
+  idle_tasks_.clear();
+}
+
+void MiHeapBinding::BindListener(ListenerInterface* listener) {
+  listener->SetConnectionMemoryFactory(
+      [] { return std::make_unique<MiHeapResource>(true); });
+}
+
+MiHeapResource* MiHeapBinding::ProactorHeap() {
+  return tl_proactor_heap;
+}
+
+}  // namespace fb2
+}  // namespace util
@@ -0,0 +1,110 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <pthread.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "base/pmr/memory_resource.h"
+
+// Lives in fibers_mimalloc, so that fibers2 does not depend on mimalloc.
+
+struct mi_heap_s;
+
+namespace util {
+
+class ListenerInterface;
+class ProactorPool;
+
+namespace fb2 {
+
+class ProactorBase;
+
+// Memory resource over a mimalloc heap. mimalloc heaps are thread local, hence the heap
+// is owned by the thread that creates the resource. Blocks can be freed from any thread, but
+// only the owner thread allocates from the heap, the other threads allocate from their
+// default heaps, e.g. after a connection has migrated.
+//
+// If bulk_free is set, the destructor frees the blocks that are still allocated with
+// mi_heap_destroy, otherwise they are moved to the default heap of the owner with
+// mi_heap_delete. If the resource is destroyed on another thread, the heap is destroyed by
+// the owner proactor.
+class MiHeapResource : public PMR_NS::memory_resource {
+ public:
+  explicit MiHeapResource(bool bulk_free);
+  ~MiHeapResource();
+
+  MiHeapResource(const MiHeapResource&) = delete;
+  MiHeapResource& operator=(const MiHeapResource&) = delete;
+
+  mi_heap_s* heap() const {
+    return heap_;
+  }
+
+  // Returns the free pages of the heap to the OS. Must be called from the owner thread.
+  void Collect(bool force);
+
+ private:
+  void* do_allocate(std::size_t size, std::size_t align) final;
+  void do_deallocate(void* ptr, std::size_t size, std::size_t align) final;
+
+  bool do_is_equal(const PMR_NS::memory_resource& o) const noexcept final {
+    return this == &o;
+  }
+
+  bool IsOwner() const {
+    return pthread_equal(owner_tid_, pthread_self());
+  }
+
+  mi_heap_s* heap_;
+  ProactorBase* owner_;
+  pthread_t owner_tid_;
+  bool bulk_free_;
+};
+
+// Binds mimalloc heaps to the proactors of a pool. Every proactor gets a heap for the
+// allocations of its thread that should not mix with the rest of the process, see
+// ProactorHeap(), and the free pages of its heaps are returned to the OS from an idle task,
+// so that long running processes do not hold on to fragmented pages.
+// With BindListener, every connection of the listener allocates Connection::memory() from
+// a heap of its own, which frees the connection's allocations in bulk when it is destroyed.
+class MiHeapBinding {
+ public:
+  struct Options {
+    // The minimal interval between the collections of a proactor, which run only when the
+    // proactor is idle.
+    uint32_t collect_interval_ms = 1000;
+  };
+
+  explicit MiHeapBinding(ProactorPool* pool) : pool_(pool) {
+  }
+
+  ~MiHeapBinding();
+
+  void Start(const Options& opts);
+  void Start() {
+    Start(Options{});
+  }
+
+  // Must be called after the listeners that were bound stopped. Moves the blocks that are
+  // still allocated from the proactor heaps to the default heaps.
+  void Stop();
+
+  // Must be called before the listener starts accepting.
+  void BindListener(ListenerInterface* listener);
+
+  // The heap of the calling proactor, null if the binding is not started.
+  static MiHeapResource* ProactorHeap();
+
+ private:
+  ProactorPool* pool_;
+  Options opts_;
+  std::vector<uint32_t> idle_tasks_;
+};
+
+}  // namespace fb2
+}  // namespace util
@@ -0,0 +1,68 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/fibers/mi_heap_resource.h"
+
+#include <mimalloc.h>
+
+#include <thread>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "util/fibers/pool.h"
+
+namespace util {
+namespace fb2 {
+
+using namespace std;
+
+class MiHeapResourceTest : public testing::Test {};
+
+TEST_F(MiHeapResourceTest, Basic) {
+  MiHeapResource mr(true);
+  void* p1 = mr.allocate(100, 64);
+  EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(p1) % 64);
+  EXPECT_TRUE(mi_heap_check_owned(mr.heap(), p1));
+  mr.deallocate(p1, 100, 64);
+
+  // The blocks that are not freed are destroyed with the heap.
+  for (unsigned i = 0; i < 100; ++i)
+    mr.allocate(256);
+
+  // Other threads allocate from their default heaps.
+  void* p2 = nullptr;
+  thread([&] { p2 = mr.allocate(64); }).join();
+  EXPECT_FALSE(mi_heap_check_owned(mr.heap(), p2));
+  mr.deallocate(p2, 64);
+}
+
+TEST_F(MiHeapResourceTest, Binding) {
+  unique_ptr<ProactorPool> pool(fb2::Pool::Epoll(2));
+  pool->Run();
+
+  MiHeapBinding binding(pool.get());
+  binding.Start();
+  EXPECT_EQ(nullptr, MiHeapBinding::ProactorHeap());
+
+  pool->AwaitBrief([](unsigned, ProactorBase*) {
+    MiHeapResource* heap = MiHeapBinding::ProactorHeap();
+    ASSERT_TRUE(heap);
+    void* ptr = heap->allocate(1000);
+    heap->deallocate(ptr, 1000);
+    heap->Collect(true);
+  });
+
+  // A connection heap destroyed on another thread is released by its proactor.
+  unique_ptr<MiHeapResource> conn_heap =
+      pool->at(0)->AwaitBrief([] { return make_unique<MiHeapResource>(true); });
+  conn_heap->allocate(128);
+  conn_heap.reset();
+  pool->at(0)->AwaitBrief([] {});
+
+  binding.Stop();
+  pool->Stop();
+}
+
+}  // namespace fb2
+}  // namespace util
@@ -0,0 +1,226 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "base/pod_array.h"
+#include "util/fibers/fiberqueue_threadpool.h"
+#include "util/fibers/fibers.h"
+#include "util/proactor_pool.h"
+
+// Data-parallel loops over the threads of a ProactorPool or of a FiberQueueThreadPool.
+// The range is split into a slice per worker thread, and every worker claims grain sized
+// chunks from its own slice. A worker that exhausted its slice steals the chunks of the slices
+// of the other workers, so that a slow or a busy thread does not delay the whole loop.
+// The workers call ThisFiber::MaybeYield() between the chunks, hence the proactors keep serving
+// I/O while the loop runs, provided that a chunk takes less than a time slice.
+// The calls block the calling fiber until the loop finishes, they must not be called from
+// the threads of a FiberQueueThreadPool that they run on.
+
+namespace util {
+namespace fb2 {
+
+namespace detail {
+
+// The ranges of the workers of a parallel loop.
+class ParallelRange {
+ public:
+  ParallelRange(size_t begin, size_t end, size_t grain, unsigned num_workers)
+      : slices_(new Slice[num_workers]), num_workers_(num_workers), grain_(grain) {
+    size_t len = end - begin;
+    for (unsigned i = 0; i < num_workers; ++i) {
+      slices_[i].next.store(begin + len * i / num_workers, std::memory_order_relaxed);
+      slices_[i].end = begin + len * (i + 1) / num_workers;
+    }
+  }
+
+  // Claims the next chunk [*from, *to) for worker, from its own slice first.
+  // Returns false once all the slices are exhausted.
+  bool Next(unsigned worker, size_t* from, size_t* to) {
+    for (unsigned i = 0; i < num_workers_; ++i) {
+      Slice& slice = slices_[(worker + i) % num_workers_];
+      if (slice.next.load(std::memory_order_relaxed) >= slice.end)
+        continue;
+      size_t start = slice.next.fetch_add(grain_, std::memory_order_relaxed);
+      if (start < slice.end) {
+        *from = start;
+        *to = std::min(start + grain_, slice.end);
+        return true;
+      }
+    }
+    return false;
+  }
+
+ private:
+  struct alignas(64) Slice {
+    std::atomic_size_t next{0};
+    size_t end = 0;
+  };
+
+  std::unique_ptr<Slice[]> slices_;
+  unsigned num_workers_;
+  size_t grain_;
+};
+
+inline unsigned NumWorkers(ProactorPool* pool) {
+  return pool->size();
+}
+
+inline unsigned NumWorkers(FiberQueueThreadPool* pool) {
+  return pool->size();
+}
+
+// Runs f(worker_index) on every worker and waits for them to finish.
+template <typename F> void RunOnWorkers(ProactorPool* pool, F& f) {
+  pool->AwaitFiberOnAll([&f](unsigned index, ProactorBase*) { f(index); });
+}
+
+template <typename F> void RunOnWorkers(FiberQueueThreadPool* pool, F& f) {
+  BlockingCounter bc(pool->size());
+  for (unsigned i = 0; i < pool->size(); ++i) {
+    pool->Add(i, [&f, i, bc]() mutable {
+      f(i);
+      bc->Dec();
+    });
+  }
+  bc->Wait();
+}
+
+inline size_t DefaultGrain(size_t len, unsigned num_workers) {
+  return std::max<size_t>(1, len / (num_workers * 16));
+}
+
+// Returns the number of elements of a among the first d elements of std::merge(a, b).
+template <typename T, typename Less>
+size_t MergeCoRank(size_t d, const T* a, size_t na, const T* b, size_t nb, Less& less) {
+  size_t lo = d > nb ? d - nb : 0, hi = std::min(d, na);
+  while (lo < hi) {
+    size_t i = lo + (hi - lo) / 2;
+    size_t j = d - i;
+
+    // std::merge takes b[j - 1] before a[i] only if it is less.
+    if (j > 0 && !less(b[j - 1], a[i]))
+      lo = i + 1;
+    else
+      hi = i;
+  }
+  return lo;
+}
+
+}  // namespace detail
+
+// Calls fn(from, to) for grain sized chunks that cover [begin, end). 0 grain chooses one
+// that gives every worker a few chunks to balance.
+template <typename Pool, typename F>
+void ParallelFor(Pool* pool, size_t begin, size_t end, size_t grain, F&& fn) {
+  if (begin >= end)
+    return;
+
+  unsigned num_workers = detail::NumWorkers(pool);
+  if (grain == 0)
+    grain = detail::DefaultGrain(end - begin, num_workers);
+
+  detail::ParallelRange range(begin, end, grain, num_workers);
+  auto worker = [&](unsigned index) {
+    size_t from, to;
+    while (range.Next(index, &from, &to)) {
+      fn(from, to);
+      ThisFiber::MaybeYield();
+    }
+  };
+  detail::RunOnWorkers(pool, worker);
+}
+
+// Reduces [begin, end): map(from, to) returns the T of a chunk and combine(T, T) folds two
+// results. The chunks are grouped non-deterministically, hence combine must be associative
+// and commutative, and identity must be its neutral element.
+template <typename Pool, typename T, typename Map, typename Combine>
+T ParallelReduce(Pool* pool, size_t begin, size_t end, size_t grain, T identity, Map&& map,
+                 Combine&& combine) {
+  if (begin >= end)
+    return identity;
+
+  unsigned num_workers = detail::NumWorkers(pool);
+  if (grain == 0)
+    grain = detail::DefaultGrain(end - begin, num_workers);
+
+  detail::ParallelRange range(begin, end, grain, num_workers);
+  std::vector<T> partial(num_workers, identity);
+  auto worker = [&](unsigned index) {
+    T acc = identity;
+    size_t from, to;
+    while (range.Next(index, &from, &to)) {
+      acc = combine(std::move(acc), map(from, to));
+      ThisFiber::MaybeYield();
+    }
+    partial[index] = std::move(acc);
+  };
+  detail::RunOnWorkers(pool, worker);
+
+  T res = std::move(identity);
+  for (T& val : partial)
+    res = combine(std::move(res), std::move(val));
+  return res;
+}
+
+// Sorts data[0, n) with a parallel merge sort, which is not stable. The runs of up to
+// max_run elements are sorted with std::sort and then merged in rounds of doubling width.
+// Every merge is split into grain sized pieces of its output, so that all the workers take
+// part in the last rounds as well. Allocates a buffer of n elements.
+template <typename Pool, typename T, typename Less = std::less<T>>
+void ParallelSort(Pool* pool, T* data, size_t n, Less less = Less(), size_t max_run = 1 << 16) {
+  unsigned num_workers = detail::NumWorkers(pool);
+  size_t run = std::min(std::max<size_t>(1, (n + num_workers - 1) / num_workers), max_run);
+  if (n <= run) {
+    std::sort(data, data + n, less);
+    return;
+  }
+
+  size_t num_runs = (n + run - 1) / run;
+  ParallelFor(pool, 0, num_runs, 1, [&](size_t from, size_t to) {
+    for (size_t i = from; i < to; ++i)
+      std::sort(data + i * run, data + std::min(n, (i + 1) * run), less);
+  });
+
+  std::unique_ptr<T[]> buf(new T[n]);
+  T* src = data;
+  T* dest = buf.get();
+  for (size_t width = run; width < n; width *= 2) {
+    ParallelFor(pool, 0, n, max_run, [&](size_t from, size_t to) {
+      // Splits the piece at the boundaries of the merged pairs of runs.
+      while (from < to) {
+        size_t lo = from / (2 * width) * (2 * width);
+        size_t mid = std::min(lo + width, n), hi = std::min(lo + 2 * width, n);
+        size_t end = std::min(to, hi);
+        const T* a = src + lo;
+        const T* b = src + mid;
+        size_t i0 = detail::MergeCoRank(from - lo, a, mid - lo, b, hi - mid, less);
+        size_t i1 = detail::MergeCoRank(end - lo, a, mid - lo, b, hi - mid, less);
+        std::merge(a + i0, a + i1, b + (from - lo - i0), b + (end - lo - i1), dest + from,
+                   less);
+        from = end;
+      }
+    });
+    std::swap(src, dest);
+  }
+
+  if (src != data) {
+    ParallelFor(pool, 0, n, max_run,
+                [&](size_t from, size_t to) { std::copy(src + from, src + to, data + from); });
+  }
+}
+
+template <typename Pool, typename T, size_t A, typename Less = std::less<T>>
+void ParallelSort(Pool* pool, base::PODArray<T, A>* arr, Less less = Less()) {
+  ParallelSort(pool, arr->data(), arr->size(), less);
+}
+
+}  // namespace fb2
+}  // namespace util
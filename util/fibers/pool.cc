@@ -8,6 +8,8 @@
 #include "util/fibers/epoll_proactor.h"
 
 #ifdef __linux__
+#include <net/if.h>
+
 #include "util/fibers/uring_proactor.h"
 #endif
 
@@ -21,8 +23,13 @@ Pool* Pool::Epoll(size_t pool_size) {
 
 #ifdef __linux__
 Pool* Pool::IOUring(size_t ring_depth, size_t pool_size) {
+  return IOUring(ring_depth, pool_size, UringOptions{});
+}
+
+Pool* Pool::IOUring(size_t ring_depth, size_t pool_size, const UringOptions& opts) {
   Pool* res = new Pool(ProactorBase::Kind::IOURING, pool_size);
   res->ring_depth_ = ring_depth;
+  res->uring_opts_ = opts;
   return res;
 }
 #endif
@@ -30,10 +37,10 @@ Pool* Pool::IOUring(size_t ring_depth, size_t pool_size) {
 ProactorBase* Pool::CreateProactor() {
   switch (kind_) {
     case ProactorBase::Kind::EPOLL:
-      return new EpollProactor;
+      return new EpollProactor(task_queue_len_);
     case ProactorBase::Kind::IOURING:
 #ifdef __linux__
-      return new UringProactor;
+      return new UringProactor(task_queue_len_);
 #else
       LOG(FATAL) << "IOUring is not supported on this platform";
 #endif
@@ -52,7 +59,41 @@ void Pool::InitInThread(unsigned pool_index) {
     case ProactorBase::Kind::IOURING: {
 #ifdef __linux__
       UringProactor* p = static_cast<UringProactor*>(proactor_[pool_index]);
-      p->Init(pool_index, ring_depth_);
+      if (uring_opts_.sqpoll) {
+        UringProactor::SqPollConfig cfg;
+        cfg.enabled = true;
+        cfg.idle_msec = uring_opts_.sqpoll_idle_msec;
+        if (!uring_opts_.sqpoll_cpus.empty()) {
+          cfg.cpu = uring_opts_.sqpoll_cpus[pool_index % uring_opts_.sqpoll_cpus.size()];
+        }
+        p->SetSqPoll(cfg);
+      }
+
+      if (!uring_opts_.zcrx_ifname.empty() && pool_index < uring_opts_.zcrx_rxqs.size()) {
+        UringProactor::ZcrxConfig cfg;
+        cfg.if_idx = if_nametoindex(uring_opts_.zcrx_ifname.c_str());
+        cfg.rxq = uring_opts_.zcrx_rxqs[pool_index];
+        cfg.area_size = uring_opts_.zcrx_area_size;
+        LOG_IF(WARNING, cfg.if_idx == 0) << "Unknown interface " << uring_opts_.zcrx_ifname;
+        p->SetZcrx(cfg);
+      }
+
+      if (!uring_opts_.shared_wq) {
+        p->Init(pool_index, ring_depth_);
+      } else if (pool_index == 0) {
+        p->Init(pool_index, ring_depth_);
+        std::lock_guard lk(wq_mu_);
+        wq_fd_ = p->ring_fd();
+        wq_cv_.notify_all();
+      } else {
+        int wq_fd;
+        {
+          std::unique_lock lk(wq_mu_);
+          wq_cv_.wait(lk, [this] { return wq_fd_ >= 0; });
+          wq_fd = wq_fd_;
+        }
+        p->Init(pool_index, ring_depth_, wq_fd);
+      }
 #else
       CHECK(false);
 #endif
@@ -4,6 +4,10 @@
 
 #pragma once
 
+#include <condition_variable>
+#include <mutex>
+#include <string>
+
 #include "util/proactor_pool.h"
 
 namespace util {
@@ -11,8 +15,32 @@ namespace fb2 {
 
 class Pool : public ProactorPool {
  public:
+  struct UringOptions {
+    // Runs each ring in SQPOLL mode, with the kernel thread polling the submission queue.
+    bool sqpoll = false;
+    uint32_t sqpoll_idle_msec = 1000;
+
+    // If not empty, the sq thread of proactor i is pinned to sqpoll_cpus[i % size].
+    std::vector<int> sqpoll_cpus;
+
+    // All the rings share the async worker pool of the first ring.
+    bool shared_wq = false;
+
+    // Zero-copy receive on the interface zcrx_ifname, see UringProactor::SetZcrx. Proactor i
+    // registers the rx queue zcrx_rxqs[i], the proactors beyond zcrx_rxqs do not register any.
+    std::string zcrx_ifname;
+    std::vector<uint32_t> zcrx_rxqs;
+    size_t zcrx_area_size = 64 << 20;
+  };
+
   static Pool* Epoll(size_t pool_size = 0);
   static Pool* IOUring(size_t ring_depth, size_t pool_size = 0);
+  static Pool* IOUring(size_t ring_depth, size_t pool_size, const UringOptions& opts);
+
+  // Length of the task queue of each proactor, must be a power of 2. Must be called before Run.
+  void set_task_queue_len(size_t len) {
+    task_queue_len_ = len;
+  }
 
  private:
   Pool(ProactorBase::Kind kind, size_t pool_size) : ProactorPool(pool_size), kind_(kind) {
@@ -20,6 +48,13 @@ class Pool : public ProactorPool {
 
   ProactorBase::Kind kind_;
   unsigned ring_depth_ = 0;
+  size_t task_queue_len_ = ProactorBase::kTaskQueueLen;
+  UringOptions uring_opts_;
+
+  // The ring fd of the first proactor, used with UringOptions::shared_wq.
+  std::mutex wq_mu_;
+  std::condition_variable wq_cv_;
+  int wq_fd_ = -1;
 
   ProactorBase* CreateProactor() final;
   void InitInThread(unsigned index) final;
@@ -5,7 +5,6 @@
 #include "util/fibers/proactor_base.h"
 
 #include <absl/base/attributes.h>
-#include <absl/base/internal/cycleclock.h>
 #include <signal.h>
 
 #if __linux__
@@ -15,9 +14,12 @@ constexpr int kNumSig = _NSIG;
 constexpr int kNumSig = NSIG;
 #endif
 
+#include <algorithm>
 #include <mutex>  // once_flag
 
 #include "base/logging.h"
+#include "util/fibers/cycle_clock.h"
+#include "util/fibers/message_lanes.h"
 
 using namespace std;
 
@@ -55,7 +57,7 @@ void SigAction(int signal, siginfo_t*, void*) {
 }
 
 inline uint64_t GetCPUCycleCount() {
-  return absl::base_internal::CycleClock::Now();
+  return CycleClock::Now();
 }
 
 unsigned pause_amplifier = 50;
@@ -68,7 +70,7 @@ std::once_flag module_init;
 // in cc file that does not define it.
 __thread ProactorBase::TLInfo ProactorBase::tl_info_;
 
-ProactorBase::ProactorBase() : task_queue_(kTaskQueueLen) {
+ProactorBase::ProactorBase(size_t task_queue_len) : task_queue_(task_queue_len) {
   call_once(module_init, &ModuleInit);
 
 #ifdef __linux__
@@ -126,6 +128,78 @@ uint32_t ProactorBase::AddOnIdleTask(OnIdleTask f) {
   return res;
 }
 
+void ProactorBase::CancelCorkFlush(FiberSocketBase* sock) {
+  auto it = std::find(cork_flush_list_.begin(), cork_flush_list_.end(), sock);
+  if (it != cork_flush_list_.end()) {
+    cork_flush_list_.erase(it);
+  }
+}
+
+void ProactorBase::FlushCorkedSocketsInternal() {
+  // Flushing may schedule sockets again, so we iterate over a copy.
+  cork_flush_scratch_.swap(cork_flush_list_);
+  for (FiberSocketBase* sock : cork_flush_scratch_) {
+    sock->FlushCorkAsync();
+  }
+  cork_flush_scratch_.clear();
+}
+
+bool ProactorBase::DispatchBatch(TaskBatch batch) {
+  if (batch.empty())
+    return false;
+
+  if (batch.size() == 1)
+    return DispatchBrief(std::move(batch.front()));
+
+  return DispatchBrief([b = std::make_unique<TaskBatch>(std::move(batch))] {
+    for (auto& f : *b)
+      f();
+  });
+}
+
+void ProactorBase::CoalesceDispatch(ProactorBase* dest, TaskBatch::value_type task) {
+  DCHECK(InMyThread());
+  ++stats_.coalesced_tasks;
+
+  for (auto& entry : dispatch_batches_) {
+    if (entry.dest == dest) {
+      entry.tasks.push_back(std::move(task));
+      return;
+    }
+  }
+  dispatch_batches_.push_back(DispatchBatchEntry{dest, {}});
+  dispatch_batches_.back().tasks.push_back(std::move(task));
+}
+
+bool ProactorBase::FlushDispatchBatchesInternal() {
+  size_t pending = 0;
+  for (auto& entry : dispatch_batches_) {
+    auto batch = std::make_unique<TaskBatch>(std::move(entry.tasks));
+    TaskBatch* ptr = batch.get();
+    auto cb = [b = std::move(batch)] {
+      for (auto& f : *b)
+        f();
+    };
+
+    // We can not block the loop, so if the queue is full we retry on the next iteration.
+    if (entry.dest->EmplaceTaskQueue(std::move(cb))) {
+      ++stats_.coalesced_batches;
+    } else {
+      entry.dest->tq_full_ev_.fetch_add(1, std::memory_order_relaxed);
+      entry.tasks = std::move(*ptr);
+      if (&dispatch_batches_[pending] != &entry)
+        dispatch_batches_[pending] = std::move(entry);
+      ++pending;
+    }
+  }
+  dispatch_batches_.resize(pending);
+  return pending > 0;
+}
+
+bool ProactorBase::DrainLanesInternal() {
+  return lanes_->Drain(pool_index_);
+}
+
 bool ProactorBase::RunOnIdleTasks() {
   if (on_idle_arr_.empty())
     return false;
@@ -167,6 +241,62 @@ bool ProactorBase::RunOnIdleTasks() {
   return should_spin;
 }
 
+void ProactorBase::SetIdlePolicy(const IdlePolicy& policy) {
+  idle_policy_ = policy;
+  spin_window_ns_ = uint64_t(policy.max_spin_usec) * 1000;
+}
+
+bool ProactorBase::ContinueIdleSpin(bool min_spin) {
+  // The loop reads the TSC at the start of every iteration, so spinning does not read the
+  // clock again.
+  uint64_t now = loop_start_cycles_;
+  if (idle_since_cycles_ == 0) {
+    idle_since_cycles_ = now;
+    idle_.store(true, std::memory_order_relaxed);
+  }
+
+  uint64_t elapsed = now > idle_since_cycles_ ? CycleClock::ToNsec(now - idle_since_cycles_) : 0;
+  if (min_spin || elapsed < spin_window_ns_)
+    return true;
+
+  stats_.spin_usec += elapsed / 1000;
+  ++stats_.spin_misses;
+  last_spin_ns_ = elapsed;
+  idle_since_cycles_ = 0;
+  return false;
+}
+
+void ProactorBase::OnIdleSpinHit() {
+  stats_.spin_usec += CycleClock::NsecSince(idle_since_cycles_) / 1000;
+  ++stats_.spin_hits;
+  idle_since_cycles_ = 0;
+  idle_.store(false, std::memory_order_relaxed);
+}
+
+void ProactorBase::OnIdleWakeup(uint64_t start_ns) {
+  idle_.store(false, std::memory_order_relaxed);
+  uint64_t sleep_ns = GetClockNanos() - start_ns;
+  stats_.sleep_usec += sleep_ns / 1000;
+
+  // The wait does not count as the time of the iteration.
+  uint64_t sleep_cycles = sleep_ns * CycleClock::FrequencyUsec() / 1000;
+  loop_stats_.wait.Add(sleep_cycles);
+  loop_start_cycles_ += sleep_cycles;
+
+  if (!idle_policy_.adaptive || idle_policy_.max_spin_usec == 0)
+    return;
+
+  // If the work arrived within the max window, spinning a bit longer would have caught it
+  // without the wakeup latency. Otherwise the loop is really idle and we spin less.
+  const uint64_t max_ns = uint64_t(idle_policy_.max_spin_usec) * 1000;
+  const uint64_t gap_ns = last_spin_ns_ + sleep_ns;
+  if (gap_ns < max_ns) {
+    spin_window_ns_ = std::min(max_ns, std::max(spin_window_ns_, gap_ns + gap_ns / 4));
+  } else {
+    spin_window_ns_ /= 2;
+  }
+}
+
 bool ProactorBase::RemoveOnIdleTask(uint32_t id) {
   if (id >= on_idle_arr_.size() || !on_idle_arr_[id].task)
     return false;
@@ -207,23 +337,144 @@ void ProactorBase::CancelPeriodic(uint32_t id) {
   CancelPeriodicInternal(item);
 }
 
+bool ProactorBase::GetPeriodicStats(uint32_t id, PeriodicStats* stats) const {
+  DCHECK(InMyThread());
+
+  auto it = periodic_map_.find(id);
+  if (it == periodic_map_.end())
+    return false;
+  *stats = it->second->stats;
+  return true;
+}
+
+uint64_t ProactorBase::RunPeriodic(PeriodicItem* item) {
+  uint64_t now = GetClockNanos();
+  uint64_t drift_usec = now > item->deadline_ns ? (now - item->deadline_ns) / 1000 : 0;
+
+  PeriodicStats& stats = item->stats;
+  ++stats.runs;
+  stats.total_drift_usec += drift_usec;
+  stats.max_drift_usec = std::max<uint64_t>(stats.max_drift_usec, drift_usec);
+
+  DCHECK(item->task);
+  item->task();
+  return now;
+}
+
 void ProactorBase::Migrate(ProactorBase* dest) {
   CHECK(dest != this);
   detail::FiberInterface* fiber = detail::FiberActive();
   fiber->scheduler()->SuspendAndExecuteOnDispatcher([fiber, dest, this] {
     fiber->DetachScheduler();
+    if (!PostFiberAttach(dest, fiber))
+      EnqueueAttach(dest, fiber);
+  });
+}
 
-    auto cb = [fiber] { fiber->AttachScheduler(); };
+void ProactorBase::EnqueueAttach(ProactorBase* dest, detail::FiberInterface* fiber) {
+  auto cb = [fiber] { fiber->AttachScheduler(); };
 
-    // We can not use DispatchBrief because it may block dispatch fiber, which is forbidden.
-    // While this state is theoretically possible but it's very improbable, so we should not reach
-    // usleep in the normal state.
-    while (!dest->EmplaceTaskQueue(cb)) {
-      tq_full_ev_.fetch_add(1, std::memory_order_relaxed);
-      LOG_FIRST_N(WARNING, 10000) << "Retrying task emplace";
-      usleep(0);
-    };
+  // We can not use DispatchBrief because it may block dispatch fiber, which is forbidden.
+  // While this state is theoretically possible but it's very improbable, so we should not reach
+  // usleep in the normal state.
+  while (!dest->EmplaceTaskQueue(cb)) {
+    tq_full_ev_.fetch_add(1, std::memory_order_relaxed);
+    LOG_FIRST_N(WARNING, 10000) << "Retrying task emplace";
+    usleep(0);
+  };
+}
+
+void ProactorBase::SetStealPeers(std::vector<ProactorBase*> peers) {
+  DCHECK(InMyThread());
+  steal_peers_ = std::move(peers);
+  next_steal_peer_ = 0;
+}
+
+void ProactorBase::Warmup() {
+  DCHECK(InMyThread());
+  RecyclingStackAllocator::Prefill();
+}
+
+bool ProactorBase::ShareYieldedFiber(detail::FiberInterface* fiber) {
+  // Sharing costs a lock and a cross-thread wakeup, so unless a peer is idle and may steal
+  // the fiber, it goes back to our ready queue as with a plain yield.
+  ProactorBase* peer = nullptr;
+  for (size_t i = 0; i < steal_peers_.size(); ++i) {
+    ProactorBase* candidate = steal_peers_[next_steal_peer_++ % steal_peers_.size()];
+    if (candidate->idle_.load(std::memory_order_relaxed)) {
+      peer = candidate;
+      break;
+    }
+  }
+  if (!peer)
+    return false;
+
+  fiber->scheduler()->SuspendAndExecuteOnDispatcher([fiber, peer, this] {
+    fiber->DetachScheduler();
+    {
+      std::lock_guard lk(shared_mu_);
+      shared_fibers_.push_back(fiber);
+    }
+    shared_cnt_.fetch_add(1, std::memory_order_release);
+
+    // We will pick up the fiber ourselves if we have nothing else to do.
+    // In addition, wake a peer in case it is sleeping.
+    peer->WakeupIfNeeded();
   });
+
+  return true;
+}
+
+detail::FiberInterface* ProactorBase::PopSharedFiber() {
+  if (shared_cnt_.load(std::memory_order_acquire) == 0)
+    return nullptr;
+
+  detail::FiberInterface* res = nullptr;
+  {
+    std::lock_guard lk(shared_mu_);
+    if (!shared_fibers_.empty()) {
+      res = shared_fibers_.front();
+      shared_fibers_.pop_front();
+    }
+  }
+  if (res)
+    shared_cnt_.fetch_sub(1, std::memory_order_relaxed);
+  return res;
+}
+
+bool ProactorBase::TryStealFiber() {
+  // Our own shared fibers have priority. We check them even without peers, since work
+  // stealing may have been disabled after they were shared.
+  detail::FiberInterface* fiber = PopSharedFiber();
+  if (!fiber) {
+    for (ProactorBase* peer : steal_peers_) {
+      if (peer->shared_cnt_.load(std::memory_order_relaxed) == 0)
+        continue;
+
+      fiber = peer->PopSharedFiber();
+      if (fiber) {
+        ++stats_.steal_cnt;
+        break;
+      }
+      ++stats_.steal_fail_cnt;
+    }
+  }
+
+  if (!fiber)
+    return false;
+
+  DVLOG(2) << "Attaching shared fiber " << fiber->name();
+  fiber->AttachScheduler();
+  return true;
+}
+
+bool ProactorBase::ReclaimSharedFibers() {
+  bool res = false;
+  while (detail::FiberInterface* fiber = PopSharedFiber()) {
+    fiber->AttachScheduler();
+    res = true;
+  }
+  return res;
 }
 
 void ProactorBase::RegisterSignal(std::initializer_list<uint16_t> l, std::function<void(int)> cb) {
@@ -294,7 +545,7 @@ void ProactorBase::Pause(unsigned count) {
 
 void ProactorBase::ModuleInit() {
   uint64_t delta;
-  cycles_per_10us = absl::base_internal::CycleClock::Frequency() / 100'000;
+  cycles_per_10us = CycleClock::FrequencyUsec() * 10;
 
   while (true) {
     uint64_t now = GetClockNanos();
@@ -318,5 +569,9 @@ void ProactorDispatcher::Notify() {
   proactor_->WakeupIfNeeded();
 }
 
+bool ProactorDispatcher::ShareYielded(detail::FiberInterface* fi) {
+  return proactor_->ShareYieldedFiber(fi);
+}
+
 }  // namespace fb2
 }  // namespace util
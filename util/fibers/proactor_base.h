@@ -9,17 +9,24 @@
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Waddress"
 #include "base/function2.hpp"
+#include "base/small_function.h"
 #pragma GCC diagnostic pop
 
 #include <absl/container/flat_hash_map.h>
 
+#include <deque>
 #include <functional>
+#include <vector>
 
 #include "base/mpmc_bounded_queue.h"
+#include "base/spinlock.h"
 #include "util/fiber_socket_base.h"
+#include "util/fibers/cycle_clock.h"
 #include "util/fibers/detail/result_mover.h"
+#include "util/fibers/event_log.h"
 #include "util/fibers/fibers.h"
 #include "util/fibers/synchronization.h"
+#include "util/fibers/trace.h"
 
 namespace util {
 class LinuxSocketBase;
@@ -28,11 +35,13 @@ namespace fb2 {
 
 // A proxy class that binds ProactorBase to fibers scheduler.
 class ProactorDispatcher;
+class MessageLanes;
 
 class ProactorBase {
   ProactorBase(const ProactorBase&) = delete;
   void operator=(const ProactorBase&) = delete;
   friend class ProactorDispatcher;
+  friend class MessageLanes;
 
  public:
   enum { kTaskQueueLen = 256 };
@@ -48,7 +57,8 @@ class ProactorBase {
   // In that case, proactor will always spin calling that task until it will cool down.
   static const uint32_t kOnIdleMaxLevel = 21;
 
-  ProactorBase();
+  // task_queue_len must be a power of 2.
+  explicit ProactorBase(size_t task_queue_len = kTaskQueueLen);
   virtual ~ProactorBase();
 
   // Runs the poll-loop. Stalls the calling thread which will become the "Proactor" thread.
@@ -113,19 +123,38 @@ class ProactorBase {
   //! Fire and forget - does not wait for the function to run called.
   //! `f` should not block, lock on mutexes or Await.
   //! Might block the calling fiber if the queue is full.
+  //! `f` runs under the trace context of the caller, see trace.h.
   template <typename Func> bool DispatchBrief(Func&& brief);
 
   //! Similarly to DispatchBrief but 'f' is wrapped in fiber.
-  //! f is allowed to fiber-block or await.
+  //! f is allowed to fiber-block or await. The fibers run on recycled stacks, see
+  //! RecyclingStackAllocator.
   template <typename Func, typename... Args> void Dispatch(Func&& f, Args&&... args) {
     // Ideally we want to forward args into lambda but it's too complicated before C++20.
     // So I just copy them into capture.
     // We forward captured variables so we need lambda to be mutable.
     DispatchBrief([f = std::forward<Func>(f), args...]() mutable {
-      Fiber("Dispatched", std::forward<Func>(f), std::forward<Args>(args)...).Detach();
+      Fiber(Launch::post, RecyclingStackAllocator{}, "Dispatched", std::forward<Func>(f),
+            std::forward<Args>(args)...)
+          .Detach();
     });
   }
 
+  // Functions that DispatchBatch runs in order in the proactor thread.
+  using TaskBatch = std::vector<fu2::unique_function<void()>>;
+
+  //! Like DispatchBrief for all the functions of batch, but with a single task queue
+  //! entry and at most one wakeup. Returns true if the calling fiber was blocked.
+  bool DispatchBatch(TaskBatch batch);
+
+  //! If enabled, DispatchBrief calls from this proactor thread to other proactors are
+  //! coalesced per destination and sent as a single DispatchBatch when the loop finishes
+  //! its current iteration, before it polls for io. The tasks keep their order but may
+  //! run up to one loop iteration later. Must be called from the proactor thread.
+  void SetDispatchCoalescing(bool enable) {
+    coalesce_dispatch_ = enable;
+  }
+
   //! Similarly to DispatchBrief but waits 'f' to return.
   template <typename Func> auto AwaitBrief(Func&& brief) -> decltype(brief());
 
@@ -146,8 +175,8 @@ class ProactorBase {
     return fb;
   }
 
-  using OnIdleTask = std::function<uint32_t()>;
-  using PeriodicTask = std::function<void()>;
+  using OnIdleTask = base::SmallFunction<48, uint32_t()>;
+  using PeriodicTask = base::SmallFunction<48, void()>;
 
   /**
    * @brief Adds a task that should run when Proactor loop is idle. The task should return
@@ -169,14 +198,45 @@ class ProactorBase {
   //! i.e. only from Await or another fiber.
   void CancelPeriodic(uint32_t id);
 
+  struct PeriodicStats {
+    uint64_t runs = 0;
+
+    // How late the runs started relative to their deadlines.
+    uint64_t total_drift_usec = 0;
+    uint32_t max_drift_usec = 0;
+  };
+
+  //! Must be called from the proactor thread. Returns false if there is no such task.
+  bool GetPeriodicStats(uint32_t id, PeriodicStats* stats) const;
+
   bool RemoveOnIdleTask(uint32_t id);
 
+  // Registers a socket with coalesced writes (see FiberSocketBase::SetWriteCoalescing) that
+  // should be flushed before the proactor polls for io. Must be called from the proactor thread.
+  void ScheduleCorkFlush(FiberSocketBase* sock) {
+    cork_flush_list_.push_back(sock);
+  }
+
+  void CancelCorkFlush(FiberSocketBase* sock);
+
   // Migrates the calling fibers to the destination proactor.
   // Calling fiber must belong to this proactor.
   void Migrate(ProactorBase* dest);
 
+  // Enables work stealing with the given peers. Migratable fibers (see ThisFiber::SetMigratable)
+  // that yield while one of the peers is idle are put into the shared queue of this proactor,
+  // from which either this proactor or an idle peer resumes them. Otherwise they yield as
+  // usual. Empty peers disable work stealing.
+  // Must be called from the proactor thread. peers must outlive this proactor.
+  void SetStealPeers(std::vector<ProactorBase*> peers);
+
   virtual Kind GetKind() const = 0;
 
+  // Faults in the memory that the proactor touches when it starts serving, e.g. the stacks of
+  // the dispatched fibers, so that the first requests do not pay for the page faults.
+  // Must be called from the proactor thread, see ProactorPool::set_warmup.
+  virtual void Warmup();
+
   uint32_t task_queue_full_event_count() const {
     return tq_full_ev_.load(std::memory_order_relaxed);
   }
@@ -194,12 +254,67 @@ class ProactorBase {
     uint64_t num_task_runs = 0, task_interrupts = 0;
     uint64_t cqe_count = 0;
     uint64_t uring_submit_calls = 0;
+    uint64_t sqpoll_wakeups = 0;  // how often the SQPOLL thread needed to be woken up.
+
+    // Fibers that this thread took over from its peers and attempts that found
+    // a peer's shared queue already drained by someone else.
+    uint64_t steal_cnt = 0, steal_fail_cnt = 0;
+
+    // Time the idle loop spent spinning and blocked waiting for I/O.
+    uint64_t spin_usec = 0, sleep_usec = 0;
+
+    // Idle spins that ended with new work (hits) and that ended by blocking (misses).
+    uint64_t spin_hits = 0, spin_misses = 0;
+
+    // DispatchBrief calls that were coalesced by this thread and the batches they
+    // were sent with, see SetDispatchCoalescing.
+    uint64_t coalesced_tasks = 0, coalesced_batches = 0;
+  };
+
+  // Durations of the loop, in cycles.
+  struct LoopStats {
+    CycleHistogram iteration;  // of the loop iterations, excluding the blocking io wait.
+    CycleHistogram wait;       // blocked in io_uring_wait_cqe or epoll_wait.
   };
 
+  // Controls how long the loop spins when it becomes idle before it blocks on I/O.
+  struct IdlePolicy {
+    // Upper bound of the spin window in microseconds. 0 only spins a few loop iterations.
+    uint32_t max_spin_usec = 0;
+
+    // If set, the spin window is learned: it grows to cover the idle gaps after which
+    // new work arrived and shrinks when the loop had to block anyway.
+    // Otherwise the loop always spins for max_spin_usec.
+    bool adaptive = true;
+
+    // If positive, sockets created by this proactor set SO_BUSY_POLL with this value,
+    // so the kernel busy polls the device queue on blocking reads. Accepted sockets
+    // inherit the value of their listener. Usually requires CAP_NET_ADMIN.
+    uint32_t busy_poll_usec = 0;
+  };
+
+  // Must be called from the proactor thread or before it starts running.
+  void SetIdlePolicy(const IdlePolicy& policy);
+
+  const IdlePolicy& idle_policy() const {
+    return idle_policy_;
+  }
+
   const Stats& stats() const {
     return stats_;
   }
 
+  // Must be read from the proactor thread.
+  const LoopStats& loop_stats() const {
+    return loop_stats_;
+  }
+
+  // Number of the functions in the task queue, i.e. dispatched by other threads and not
+  // yet run.
+  size_t task_queue_depth() const {
+    return task_queue_.size_approx();
+  }
+
  protected:
   enum { WAIT_SECTION_STATE = 1UL << 31 };
   static constexpr unsigned kMaxSpinLimit = 5;
@@ -217,6 +332,13 @@ class ProactorBase {
     // for iouring the completions arrive asynchronously. We need to keep the reference count
     // to make sure this record is alive when the completion arrives.
     uint8_t ref_cnt = 1;
+
+    uint64_t deadline_ns = 0;  // when the task is expected to run next, set by the implementation.
+    PeriodicStats stats;
+
+    uint64_t period_ns() const {
+      return uint64_t(period.tv_sec) * 1000000000 + period.tv_nsec;
+    }
   };
 
   // Called only from external threads.
@@ -228,9 +350,71 @@ class ProactorBase {
   virtual void SchedulePeriodic(uint32_t id, PeriodicItem* item) = 0;
   virtual void CancelPeriodicInternal(PeriodicItem* item) = 0;
 
+  // Runs the task and accounts its drift from item->deadline_ns. Returns the clock at the start
+  // of the run.
+  uint64_t RunPeriodic(PeriodicItem* item);
+
+  // Called by Migrate on the dispatcher of this proactor. Implementations may hand the detached
+  // fiber to dest through a faster channel than its task queue and return true, otherwise
+  // Migrate falls back to EnqueueAttach.
+  virtual bool PostFiberAttach(ProactorBase* dest, detail::FiberInterface* fiber) {
+    return false;
+  }
+
+  // Attaches fiber to dest via the task queue of dest.
+  void EnqueueAttach(ProactorBase* dest, detail::FiberInterface* fiber);
+
   // Returns true if we should continue spinning or false otherwise.
   bool RunOnIdleTasks();
 
+  // Called by the loop when it has nothing to do. Returns true if the loop should spin
+  // more according to the idle policy or if min_spin is set, false if it should block.
+  bool ContinueIdleSpin(bool min_spin);
+
+  // Called by the loop when it finds work.
+  void EndIdleSpin() {
+    if (idle_since_cycles_)
+      OnIdleSpinHit();
+  }
+
+  void OnIdleSpinHit();
+
+  // Called by the loop at the start of every iteration.
+  void OnLoopIteration() {
+    uint64_t now = CycleClock::Now();
+    if (now > loop_start_cycles_ && loop_start_cycles_)
+      loop_stats_.iteration.Add(now - loop_start_cycles_);
+    loop_start_cycles_ = now;
+  }
+
+  // Accounts the time blocked in the io wait that started at start_ns and learns
+  // the spin window from it.
+  void OnIdleWakeup(uint64_t start_ns);
+
+  // Starts the sends of the coalesced writes. Called by the loop before it polls for io.
+  void FlushCorkedSockets() {
+    if (!cork_flush_list_.empty())
+      FlushCorkedSocketsInternal();
+  }
+
+  void FlushCorkedSocketsInternal();
+
+  // Sends the coalesced dispatches. Called by the loop before it polls for io.
+  // Returns true if some destination queue was full, in which case the loop should not block.
+  bool FlushDispatchBatches() {
+    return !dispatch_batches_.empty() && FlushDispatchBatchesInternal();
+  }
+
+  bool FlushDispatchBatchesInternal();
+
+  // Handles the messages of the incoming MessageLanes. Called by the loop after it runs
+  // the task queue. Returns true if messages are left, in which case the loop should not block.
+  bool DrainLanes() {
+    return lanes_ && DrainLanesInternal();
+  }
+
+  bool DrainLanesInternal();
+
   static void Pause(unsigned strength);
   static void ModuleInit();
 
@@ -243,6 +427,14 @@ class ProactorBase {
   // Returns number of sleeping fibers being activated.
   unsigned ProcessSleepFibers(detail::Scheduler* scheduler);
 
+  // Attaches a shared fiber from this proactor or from one of its steal peers to
+  // the calling thread. Returns true if a fiber became ready.
+  bool TryStealFiber();
+
+  // Attaches the fibers that this proactor has shared and no peer has stolen back to it.
+  // Called before the loop exits. Returns true if a fiber became ready.
+  bool ReclaimSharedFibers();
+
   pthread_t thread_id_ = 0U;
   int sys_thread_id_ = 0;
   int32_t pool_index_ = -1;
@@ -256,17 +448,14 @@ class ProactorBase {
 
   Stats stats_;
 
-  // We use fu2 function to allow moveable semantics.
-  using Fu2Fun =
-      fu2::function_base<true /*owns*/, false /*non-copyable*/, fu2::capacity_fixed<16, 8>,
-                         false /* non-throwing*/, false /* strong exceptions guarantees*/, void()>;
-  struct Tasklet : public Fu2Fun {
-    using Fu2Fun::Fu2Fun;
-    using Fu2Fun::operator=;
-  };
-  static_assert(sizeof(Tasklet) == 32, "");
+  // Move-only, so that tasks can capture moveable state. 48 bytes hold the closures of
+  // AwaitBrief and Dispatch for the typical captures without allocating.
+  using Tasklet = base::SmallFunction<48, void()>;
+  static_assert(sizeof(Tasklet) == 64, "");
 
-  using FuncQ = base::mpmc_bounded_queue<Tasklet>;
+  // The cells are padded, since the remote threads enqueue the tasks that the proactor dequeues
+  // from the neighbouring cells.
+  using FuncQ = base::mpmc_bounded_queue<Tasklet, true>;
 
   FuncQ task_queue_;
   EventCount task_queue_avail_;
@@ -282,6 +471,18 @@ class ProactorBase {
   std::vector<OnIdleWrapper> on_idle_arr_;
   uint32_t on_idle_next_ = 0;
 
+  std::vector<FiberSocketBase*> cork_flush_list_, cork_flush_scratch_;
+
+  // Pending coalesced dispatches of this thread, one entry per destination.
+  struct DispatchBatchEntry {
+    ProactorBase* dest;
+    TaskBatch tasks;
+  };
+  std::vector<DispatchBatchEntry> dispatch_batches_;
+  bool coalesce_dispatch_ = false;
+
+  MessageLanes* lanes_ = nullptr;
+
   absl::flat_hash_map<uint32_t, PeriodicItem*> periodic_map_;
 
   struct TLInfo {
@@ -291,6 +492,8 @@ class ProactorBase {
   static __thread TLInfo tl_info_;
 
  private:
+  template <typename Func> bool DispatchBriefInternal(Func&& f);
+
   template <typename Func> bool EmplaceTaskQueue(Func&& f) {
     if (task_queue_.try_enqueue(std::forward<Func>(f))) {
       WakeupIfNeeded();
@@ -300,7 +503,33 @@ class ProactorBase {
     return false;
   }
 
+  void CoalesceDispatch(ProactorBase* dest, TaskBatch::value_type task);
+
+  // Called by ProactorDispatcher::ShareYielded.
+  bool ShareYieldedFiber(detail::FiberInterface* fi);
+  detail::FiberInterface* PopSharedFiber();
+
   uint64_t last_sleep_cycle_ = 0;
+
+  IdlePolicy idle_policy_;
+  uint64_t idle_since_cycles_ = 0;  // when the current idle spin started, 0 if not spinning.
+  uint64_t last_spin_ns_ = 0;       // duration of the spin that preceded the last block.
+  uint64_t spin_window_ns_ = 0;     // learned spin window, see IdlePolicy::adaptive.
+
+  LoopStats loop_stats_;
+  uint64_t loop_start_cycles_ = 0;  // when the current loop iteration started.
+
+  // Work stealing state, see SetStealPeers.
+  std::vector<ProactorBase*> steal_peers_;
+  unsigned next_steal_peer_ = 0;
+
+  base::SpinLock shared_mu_;
+  std::deque<detail::FiberInterface*> shared_fibers_;  // detached, ready to run fibers.
+  std::atomic_uint32_t shared_cnt_{0};                 // hint for peers, avoids locking.
+
+  // Set while the loop has nothing to run, i.e. spins or blocks. The peers share their
+  // yielding fibers only with idle proactors.
+  std::atomic_bool idle_{false};
 };
 
 class ProactorDispatcher : public DispatchPolicy {
@@ -311,6 +540,7 @@ class ProactorDispatcher : public DispatchPolicy {
  private:
   void Run(detail::Scheduler* sched);
   void Notify() final;
+  bool ShareYielded(detail::FiberInterface* fi) final;
 
   ProactorBase* proactor_;
 };
@@ -333,6 +563,18 @@ inline void ProactorBase::WakeupIfNeeded() {
 }
 
 template <typename Func> bool ProactorBase::DispatchBrief(Func&& f) {
+  if (TraceContext ctx = CurrentTrace(); ABSL_PREDICT_FALSE(bool(ctx)))
+    return DispatchBriefInternal(detail::TraceWrap(ctx, std::forward<Func>(f)));
+  return DispatchBriefInternal(std::forward<Func>(f));
+}
+
+template <typename Func> bool ProactorBase::DispatchBriefInternal(Func&& f) {
+  LogEvent(EventType::kDispatch, 0, pool_index_);
+  if (ProactorBase* src = tl_info_.owner; src && src->coalesce_dispatch_ && src != this) {
+    src->CoalesceDispatch(this, std::forward<Func>(f));
+    return false;
+  }
+
   if (EmplaceTaskQueue(std::forward<Func>(f)))
     return false;
 
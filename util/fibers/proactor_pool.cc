@@ -4,9 +4,25 @@
 
 #include "util/proactor_pool.h"
 
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+#include <absl/time/clock.h>
+
+#include <cmath>
+#include <condition_variable>
+#include <mutex>
+
 #include "base/flags.h"
 #include "base/logging.h"
+#include "base/proc_util.h"
 #include "base/pthread_utils.h"
+#include "io/file_util.h"
+
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#endif
 
 #ifdef __APPLE__
 #include <sys/sysctl.h>
@@ -19,17 +35,49 @@
 using namespace std;
 
 ABSL_FLAG(uint32_t, proactor_threads, 0, "Number of io threads in the pool");
-ABSL_FLAG(string, proactor_affinity_mode, "on", "can be on, off or auto");
+ABSL_FLAG(string, proactor_affinity_mode, "on",
+          "can be on, off, auto or numa. numa spreads the threads evenly across NUMA nodes "
+          "and binds their memory to the local node");
+ABSL_FLAG(bool, proactor_cgroup_quota, true,
+          "If true and --proactor_threads is 0, the pool has no more threads than the cpu quota "
+          "of the cgroup, rounded up, and does not pin its threads unless the affinity mode "
+          "is numa");
+ABSL_FLAG(bool, proactor_warmup, false,
+          "If true, the pool faults in the fiber stacks, the rings and the provided buffers of "
+          "its proactors before Run returns, see ProactorBase::Warmup");
 
 namespace util {
 
 using fb2::ProactorBase;
 
 namespace {
+
+// Holds the proactor threads back until the pool has pinned them, so that they initialize
+// their rings in parallel, on their own cpus and with their memory on the local node.
+class StartGate {
+ public:
+  void Open() {
+    lock_guard lk(mu_);
+    open_ = true;
+    cv_.notify_all();
+  }
+
+  void Wait() {
+    unique_lock lk(mu_);
+    cv_.wait(lk, [this] { return open_; });
+  }
+
+ private:
+  mutex mu_;
+  condition_variable cv_;
+  bool open_ = false;
+};
+
 enum class AffinityMode {
   ON,
   OFF,
   AUTO,
+  NUMA,
 };
 
 #if defined(__linux__) || defined(__FreeBSD__)
@@ -105,6 +153,62 @@ static unsigned NumOnlineCpus() {
   return CPU_COUNT(&cpus);
 }
 
+#ifdef __linux__
+
+// Parses lists like "0-3,8,10-11".
+static vector<unsigned> ParseCpuList(string_view list) {
+  vector<unsigned> res;
+  for (string_view part : absl::StrSplit(list, ',', absl::SkipWhitespace())) {
+    pair<string_view, string_view> range = absl::StrSplit(part, '-');
+    unsigned first = 0, last = 0;
+    if (!absl::SimpleAtoi(range.first, &first))
+      continue;
+    last = first;
+    if (!range.second.empty() && !absl::SimpleAtoi(range.second, &last))
+      continue;
+    for (unsigned cpu = first; cpu <= last; ++cpu)
+      res.push_back(cpu);
+  }
+  return res;
+}
+
+// Returns online cpus of each NUMA node. Nodes without online cpus are kept empty.
+static vector<vector<unsigned>> NumaNodeCpus(const cpu_set_t& online_cpus) {
+  vector<vector<unsigned>> res;
+  for (unsigned node = 0;; ++node) {
+    auto list = io::ReadFileToString(
+        absl::StrCat("/sys/devices/system/node/node", node, "/cpulist"));
+    if (!list)
+      break;
+
+    vector<unsigned>& cpus = res.emplace_back();
+    for (unsigned cpu : ParseCpuList(*list)) {
+      if (cpu < kTotalCpus && CPU_ISSET(cpu, &online_cpus))
+        cpus.push_back(cpu);
+    }
+  }
+  return res;
+}
+
+// Makes the calling thread allocate its memory on node when possible.
+static void BindMemoryToNode(unsigned node) {
+  constexpr unsigned kMaxNodes = 1024;
+  constexpr unsigned kBitsPerLong = sizeof(unsigned long) * 8;
+  unsigned long mask[kMaxNodes / kBitsPerLong] = {0};
+  if (node >= kMaxNodes)
+    return;
+
+  mask[node / kBitsPerLong] |= 1UL << (node % kBitsPerLong);
+
+  // The kernel reads maxnode - 1 bits.
+  if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, kMaxNodes + 1) != 0) {
+    LOG_FIRST_N(WARNING, 1) << "Could not bind memory to numa node " << node << ": "
+                            << strerror(errno);
+  }
+}
+
+#endif
+
 }  // namespace
 
 ProactorPool::ProactorPool(std::size_t pool_size) {
@@ -112,10 +216,27 @@ ProactorPool::ProactorPool(std::size_t pool_size) {
     auto num_pthreads = absl::GetFlag(FLAGS_proactor_threads);
     // thread::hardware_concurrency() returns number of online cpus but ignores taskset.
     pool_size = num_pthreads > 0 ? num_pthreads : NumOnlineCpus();
+
+#ifdef __linux__
+    // A container with a cpu quota sees all the cpus of its node, the threads beyond the quota
+    // only make CFS throttle all of them.
+    if (num_pthreads == 0 && absl::GetFlag(FLAGS_proactor_cgroup_quota)) {
+      double quota = base::sys::GetCgroupCpuQuota();
+      size_t quota_threads = std::max<size_t>(1, std::ceil(quota));
+      if (quota > 0 && quota_threads < pool_size) {
+        LOG(INFO) << "Limiting the pool size to " << quota_threads << " by the cgroup cpu quota "
+                  << quota << " out of " << pool_size << " cpus";
+        pool_size = quota_threads;
+        quota_limited_ = true;
+      }
+    }
+#endif
     VLOG(1) << "Setting pool size to " << pool_size;
   }
 
   pool_size_ = pool_size;
+  warmup_ = absl::GetFlag(FLAGS_proactor_warmup);
+  active_size_.store(pool_size, std::memory_order_relaxed);
   proactor_.reset(new ProactorBase*[pool_size]);
   std::fill(proactor_.get(), proactor_.get() + pool_size, nullptr);
 }
@@ -132,6 +253,7 @@ void ProactorPool::CheckRunningState() {
 }
 
 void ProactorPool::Run() {
+  uint64_t start = absl::GetCurrentTimeNanos();
   SetupProactors();
 
   // TODO: to remove this code.
@@ -144,7 +266,19 @@ void ProactorPool::Run() {
 #endif
   });
 
-  LOG(INFO) << "Running " << pool_size_ << " io threads";
+  // AwaitBrief has waited for all the threads to finish their initialization.
+  uint64_t now = absl::GetCurrentTimeNanos();
+  uint64_t total_usec = (now - start) / 1000;
+  size_t slowest = max_element(init_nanos_.begin(), init_nanos_.end()) - init_nanos_.begin();
+  LOG(INFO) << "Running " << pool_size_ << " io threads, started in " << total_usec / 1000
+            << "ms, slowest init " << init_nanos_[slowest] / 1000000 << "ms in thread "
+            << slowest;
+
+  if (warmup_) {
+    AwaitBrief([](unsigned, ProactorBase* proactor) { proactor->Warmup(); });
+    LOG(INFO) << "Proactors are warmed up and ready in "
+              << (absl::GetCurrentTimeNanos() - now) / 1000000 << "ms";
+  }
 }
 
 void ProactorPool::Stop() {
@@ -164,21 +298,74 @@ void ProactorPool::Stop() {
   state_ = STOPPED;
 }
 
+void ProactorPool::EnableWorkStealing() {
+  work_stealing_ = true;
+  UpdateStealPeers();
+}
+
+void ProactorPool::UpdateStealPeers() {
+  AwaitBrief([this](unsigned index, ProactorBase* proactor) {
+    // Parked proactors neither steal nor are stolen from.
+    size_t active = active_size();
+    vector<ProactorBase*> peers;
+    if (index < active) {
+      for (unsigned i = 1; i < active; ++i) {
+        peers.push_back(proactor_[(index + i) % active]);
+      }
+    }
+    proactor->SetStealPeers(std::move(peers));
+  });
+}
+
+void ProactorPool::SetActiveSize(size_t n) {
+  CheckRunningState();
+  CHECK(n > 0 && n <= pool_size_) << n;
+  size_t prev = active_size_.exchange(n, std::memory_order_relaxed);
+  if (prev == n)
+    return;
+
+  LOG(INFO) << "Active proactors: " << prev << " -> " << n << " out of " << pool_size_;
+  if (work_stealing_)
+    UpdateStealPeers();
+}
+
 ProactorBase* ProactorPool::GetNextProactor() {
   uint32_t index = next_io_context_.load(std::memory_order_relaxed);
+  uint32_t active = active_size();
+
   // Use a round-robin scheme to choose the next io_context to use.
-  DCHECK_LT(index, pool_size_);
+  // The index may be beyond the active proactors if the pool has just shrunk.
+  if (index >= active)
+    index = 0;
 
   ProactorBase* proactor = at(index++);
 
   // Not-perfect round-robin since this function is non-transactional but it "works".
-  if (index >= pool_size_)
+  if (index >= active)
     index = 0;
 
   next_io_context_.store(index, std::memory_order_relaxed);
   return proactor;
 }
 
+ProactorBase* ProactorPool::GetNextProactorOnNode(int numa_node) {
+  if (numa_node < 0 || size_t(numa_node) >= node_threads_.size() ||
+      node_threads_[numa_node].empty()) {
+    return GetNextProactor();
+  }
+
+  const vector<unsigned>& ids = node_threads_[numa_node];
+  uint32_t next = next_node_proactor_.fetch_add(1, std::memory_order_relaxed);
+  for (size_t i = 0; i < ids.size(); ++i) {
+    unsigned index = ids[(next + i) % ids.size()];
+    if (IsActive(index))
+      return at(index);
+  }
+
+  // All the proactors of the node are parked.
+  return GetNextProactor();
+}
+
 std::string_view ProactorPool::GetString(std::string_view source) {
   if (source.empty()) {
     return source;
@@ -221,6 +408,8 @@ void ProactorPool::SetupProactors() {
     mode = AffinityMode::OFF;
   } else if (affinity_flag == "auto") {
     mode = AffinityMode::AUTO;
+  } else if (affinity_flag == "numa") {
+    mode = AffinityMode::NUMA;
   } else {
     LOG(FATAL) << "Invalid proactor_affinity_mode flag value: " << affinity_flag;
   }
@@ -247,15 +436,64 @@ void ProactorPool::SetupProactors() {
   cpu_set_t cps;
   CPU_ZERO(&cps);
 
-  bool set_affinity = (mode == AffinityMode::ON) ||
+  bool set_affinity = (mode == AffinityMode::ON) || (mode == AffinityMode::NUMA) ||
                       (mode == AffinityMode::AUTO && pool_size_ > num_online_cpus / 2);
 
+  // The cpus of a quota limited pool are shared with other cgroups, the pinned threads could
+  // not move away from the busy ones.
+  if (quota_limited_ && mode != AffinityMode::NUMA)
+    set_affinity = false;
+
+  vector<vector<unsigned>> node_cpus;
+#ifdef __linux__
+  node_cpus = NumaNodeCpus(online_cpus);
+  cpu_node_.assign(cpu_threads_.size(), -1);
+  for (unsigned node = 0; node < node_cpus.size(); ++node) {
+    for (unsigned cpu : node_cpus[node]) {
+      if (cpu < cpu_node_.size())
+        cpu_node_[cpu] = node;
+    }
+  }
+  // Nodes without online cpus can not host proactors.
+  node_cpus.erase(remove_if(node_cpus.begin(), node_cpus.end(),
+                            [](const auto& cpus) { return cpus.empty(); }),
+                  node_cpus.end());
+#endif
+  bool spread_nodes = mode == AffinityMode::NUMA && node_cpus.size() > 1;
+  vector<unsigned> node_rank(node_cpus.size(), 0);
+
+  proactor_node_.assign(pool_size_, -1);
+  int max_node = -1;
+  for (int node : cpu_node_)
+    max_node = max(max_node, node);
+  node_threads_.assign(max_node + 1, {});
+  init_nanos_.assign(pool_size_, 0);
+  auto gate = make_shared<StartGate>();
+
   for (unsigned i = 0; i < pool_size_; ++i) {
     snprintf(buf, sizeof(buf), "Proactor%u", i);
 
+    // In numa mode consecutive threads are grouped on the same node.
+    unsigned node_index = spread_nodes ? i * node_cpus.size() / pool_size_ : 0;
+    int bind_node = -1;
+    unsigned abs_cpu = rel_to_abs_cpu[i % num_online_cpus];
+    if (spread_nodes) {
+      const vector<unsigned>& cpus = node_cpus[node_index];
+      abs_cpu = cpus[node_rank[node_index]++ % cpus.size()];
+      bind_node = cpu_node_[abs_cpu];
+    }
+
     proactor_[i] = CreateProactor();
-    auto cb = [this, i]() mutable {
+    auto cb = [this, i, bind_node, gate]() mutable {
+      gate->Wait();
+      gate.reset();
+#ifdef __linux__
+      if (bind_node >= 0)
+        BindMemoryToNode(bind_node);
+#endif
+      uint64_t start = absl::GetCurrentTimeNanos();
       this->InitInThread(i);
+      init_nanos_[i] = absl::GetCurrentTimeNanos() - start;
       proactor_[i]->Run();
     };
 
@@ -263,8 +501,6 @@ void ProactorPool::SetupProactors() {
 #if defined(__linux__) || defined(__FreeBSD__)
     if (set_affinity) {
       // Spread proactor threads across online CPUs.
-      int rel_indx = i % num_online_cpus;
-      unsigned abs_cpu = rel_to_abs_cpu[rel_indx];
       CHECK_LT(abs_cpu, cpu_threads_.size());
       CPU_SET(abs_cpu, &cps);
 
@@ -272,6 +508,11 @@ void ProactorPool::SetupProactors() {
       if (rc == 0) {
         VLOG(1) << "Setting affinity of thread " << i << " on cpu " << abs_cpu;
         cpu_threads_[abs_cpu].push_back(i);
+        int node = CpuToNumaNode(abs_cpu);
+        if (node >= 0) {
+          proactor_node_[i] = node;
+          node_threads_[node].push_back(i);
+        }
       } else {
         LOG(WARNING) << "Error calling pthread_setaffinity_np: " << strerror(rc) << "\n";
       }
@@ -284,6 +525,10 @@ void ProactorPool::SetupProactors() {
 #endif
   }
 
+  num_numa_nodes_ = count_if(node_threads_.begin(), node_threads_.end(),
+                             [](const auto& ids) { return !ids.empty(); });
+  numa_spread_ = spread_nodes;
+  gate->Open();
   state_ = RUN;
 }
 
@@ -0,0 +1,183 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/fibers/rate_limited_socket.h"
+
+#include <absl/container/inlined_vector.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+
+#include "base/logging.h"
+#include "util/fibers/fibers.h"
+#include "util/fibers/proactor_base.h"
+
+namespace util {
+namespace fb2 {
+
+using namespace std;
+
+namespace {
+
+uint64_t BurstTokens(uint64_t rate, chrono::milliseconds burst) {
+  return max<uint64_t>(rate * uint64_t(burst.count()) / 1000, 1);
+}
+
+size_t IovecLen(const iovec* v, uint32_t len) {
+  size_t res = 0;
+  for (uint32_t i = 0; i < len; ++i)
+    res += v[i].iov_len;
+  return res;
+}
+
+}  // namespace
+
+RateLimitedSocket::RateLimitedSocket(unique_ptr<FiberSocketBase> next, const Limits& limits,
+                                     TenantLimits tenant)
+    : FiberSocketBase(next ? next->proactor() : nullptr),
+      next_sock_(std::move(next)),
+      tenant_(std::move(tenant)),
+      send_{TokenBucket{limits.kernel_pacing ? 0 : limits.send_bytes_per_sec,
+                        BurstTokens(limits.send_bytes_per_sec, limits.burst)},
+            tenant_.send_bytes.get()},
+      recv_{TokenBucket{limits.recv_bytes_per_sec,
+                        BurstTokens(limits.recv_bytes_per_sec, limits.burst)},
+            tenant_.recv_bytes.get()},
+      ops_{TokenBucket{limits.ops_per_sec, BurstTokens(limits.ops_per_sec, limits.burst)},
+           tenant_.ops.get()} {
+  if (limits.kernel_pacing)
+    pacing_rate_ = limits.send_bytes_per_sec;
+
+  if (pacing_rate_ && next_sock_->IsOpen()) {
+    error_code ec = SetPacingRate(pacing_rate_);
+    LOG_IF(WARNING, ec) << "Could not set the pacing rate: " << ec.message();
+  }
+}
+
+auto RateLimitedSocket::SetPacingRate(uint64_t bytes_per_sec) -> error_code {
+  pacing_rate_ = bytes_per_sec;
+#ifdef SO_MAX_PACING_RATE
+  // ~0 disables pacing.
+  uint64_t val = bytes_per_sec ? bytes_per_sec : ~0ULL;
+  if (setsockopt(next_sock_->native_handle(), SOL_SOCKET, SO_MAX_PACING_RATE, &val,
+                 sizeof(val)) < 0) {
+    return error_code(errno, system_category());
+  }
+  return {};
+#else
+  return make_error_code(errc::operation_not_supported);
+#endif
+}
+
+auto RateLimitedSocket::Accept() -> AcceptResult {
+  return next_sock_->Accept();
+}
+
+auto RateLimitedSocket::Connect(const endpoint_type& ep) -> error_code {
+  error_code ec = next_sock_->Connect(ep);
+  if (!ec && pacing_rate_) {
+    error_code pec = SetPacingRate(pacing_rate_);
+    LOG_IF(WARNING, pec) << "Could not set the pacing rate: " << pec.message();
+  }
+  return ec;
+}
+
+void RateLimitedSocket::Throttle(Limiter* bytes) {
+  if (bytes->unlimited() && ops_.unlimited())
+    return;
+
+  // The cached loop time advances only if the fiber was suspended.
+  uint64_t start = ProactorBase::GetMonotonicTimeNs();
+  ops_.local.Wait();
+  if (ops_.tenant)
+    ops_.tenant->Wait();
+  bytes->local.Wait();
+  if (bytes->tenant)
+    bytes->tenant->Wait();
+  ops_.Consume(1);
+
+  uint64_t end = ProactorBase::GetMonotonicTimeNs();
+  if (end > start) {
+    ++stats_.throttled_calls;
+    stats_.throttled_usec += (end - start) / 1000;
+  }
+}
+
+size_t RateLimitedSocket::MaxTransfer(const Limiter& bytes) {
+  return bytes.local.unlimited() ? SIZE_MAX : bytes.local.burst();
+}
+
+io::Result<size_t> RateLimitedSocket::WriteSome(const iovec* v, uint32_t len) {
+  Throttle(&send_);
+
+  // Trims the write to the burst, so that a single call can not exceed the limit by much.
+  size_t limit = MaxTransfer(send_);
+  absl::InlinedVector<iovec, 4> trimmed;
+  if (IovecLen(v, len) > limit) {
+    for (uint32_t i = 0; i < len && limit > 0; ++i) {
+      size_t sz = min(v[i].iov_len, limit);
+      trimmed.push_back(iovec{v[i].iov_base, sz});
+      limit -= sz;
+    }
+    v = trimmed.data();
+    len = trimmed.size();
+  }
+
+  io::Result<size_t> res = next_sock_->WriteSome(v, len);
+  if (res)
+    send_.Consume(*res);
+  return res;
+}
+
+void RateLimitedSocket::AsyncWriteSome(const iovec* v, uint32_t len, AsyncProgressCb cb) {
+  // Throttle suspends, hence the write runs in its own fiber. It is posted, so that cb is
+  // never called before AsyncWriteSome returns. The buffers stay valid until cb, but the
+  // iovec array may not.
+  Fiber("RateLimitedWrite",
+        [this, vec = absl::InlinedVector<iovec, 4>(v, v + len), cb = std::move(cb)]() mutable {
+          io::Result<size_t> res = WriteSome(vec.data(), vec.size());
+          cb(res);
+        })
+      .Detach();
+}
+
+io::Result<size_t> RateLimitedSocket::Recv(const io::MutableBytes& mb, int flags) {
+  Throttle(&recv_);
+
+  size_t sz = min(mb.size(), MaxTransfer(recv_));
+  io::Result<size_t> res = next_sock_->Recv(mb.subspan(0, sz), flags);
+  if (res)
+    recv_.Consume(*res);
+  return res;
+}
+
+io::Result<size_t> RateLimitedSocket::RecvMsg(const msghdr& msg, int flags) {
+  Throttle(&recv_);
+
+  size_t limit = MaxTransfer(recv_);
+  absl::InlinedVector<iovec, 4> trimmed;
+  msghdr copy = msg;
+  if (IovecLen(msg.msg_iov, msg.msg_iovlen) > limit) {
+    for (size_t i = 0; i < msg.msg_iovlen && limit > 0; ++i) {
+      size_t sz = min(msg.msg_iov[i].iov_len, limit);
+      trimmed.push_back(iovec{msg.msg_iov[i].iov_base, sz});
+      limit -= sz;
+    }
+    copy.msg_iov = trimmed.data();
+    copy.msg_iovlen = trimmed.size();
+  }
+
+  io::Result<size_t> res = next_sock_->RecvMsg(copy, flags);
+  if (res)
+    recv_.Consume(*res);
+  return res;
+}
+
+void RateLimitedSocket::SetProactor(ProactorBase* p) {
+  next_sock_->SetProactor(p);
+  FiberSocketBase::SetProactor(p);
+}
+
+}  // namespace fb2
+}  // namespace util
@@ -0,0 +1,192 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <chrono>
+#include <memory>
+
+#include "util/fiber_socket_base.h"
+#include "util/fibers/token_bucket.h"
+
+namespace util {
+namespace fb2 {
+
+// Wraps a socket and throttles its traffic. The calls suspend the calling fiber while the
+// connection, or its tenant, exceeds the rates: the sent and received bytes and the number of
+// io calls (ops). The received bytes are charged after they arrive, so a read may overdraw
+// the budget by its size and the next one waits for the debt to be repaid. A single call
+// transfers at most the burst of the byte limit.
+class RateLimitedSocket final : public FiberSocketBase {
+ public:
+  // 0 disables a limit.
+  struct Limits {
+    uint64_t send_bytes_per_sec = 0;
+    uint64_t recv_bytes_per_sec = 0;
+    uint64_t ops_per_sec = 0;
+
+    // How long a limit may be exceeded after a quiet period, i.e. the bucket holds
+    // burst * rate tokens.
+    std::chrono::milliseconds burst{100};
+
+    // Paces the sends in the kernel with SO_MAX_PACING_RATE instead of suspending the
+    // writers, which smooths the traffic on the wire. The writes block once the socket buffer
+    // is full. Linux only, requires the fq qdisc or TCP internal pacing.
+    bool kernel_pacing = false;
+  };
+
+  // Limits shared by the connections of a tenant across the proactors of a pool.
+  // nullptr disables a limit.
+  struct TenantLimits {
+    std::shared_ptr<SharedTokenBucket> send_bytes, recv_bytes, ops;
+  };
+
+  struct Stats {
+    uint64_t throttled_calls = 0;  // calls that had to wait.
+    uint64_t throttled_usec = 0;  // the total time they waited.
+  };
+
+  RateLimitedSocket(std::unique_ptr<FiberSocketBase> next, const Limits& limits,
+                    TenantLimits tenant = {});
+
+  // Sets SO_MAX_PACING_RATE of the underlying socket. Applied automatically with
+  // Limits::kernel_pacing, once the socket is connected.
+  error_code SetPacingRate(uint64_t bytes_per_sec);
+
+  const Stats& stats() const {
+    return stats_;
+  }
+
+  FiberSocketBase* next() {
+    return next_sock_.get();
+  }
+
+  error_code Shutdown(int how) final {
+    return next_sock_->Shutdown(how);
+  }
+
+  AcceptResult Accept() final;
+  error_code Connect(const endpoint_type& ep) final;
+
+  error_code Close() final {
+    return next_sock_->Close();
+  }
+
+  bool IsOpen() const final {
+    return next_sock_->IsOpen();
+  }
+
+  io::Result<size_t> RecvMsg(const msghdr& msg, int flags) final;
+  io::Result<size_t> Recv(const io::MutableBytes& mb, int flags = 0) final;
+
+  error_code WaitReadable() final {
+    return next_sock_->WaitReadable();
+  }
+
+  void CancelPendingIo() final {
+    next_sock_->CancelPendingIo();
+  }
+
+  void CancelPendingIoAsync() final {
+    next_sock_->CancelPendingIoAsync();
+  }
+
+  error_code EnableZeroCopySend(size_t threshold) final {
+    return next_sock_->EnableZeroCopySend(threshold);
+  }
+
+  io::Result<size_t> WriteSome(const iovec* v, uint32_t len) final;
+
+  // Throttles and writes in a separate fiber, cb is always called asynchronously from it.
+  // The socket must outlive the pending writes.
+  void AsyncWriteSome(const iovec* v, uint32_t len, AsyncProgressCb cb) final;
+
+  void set_timeout(uint32_t msec) final {
+    next_sock_->set_timeout(msec);
+  }
+
+  uint32_t timeout() const final {
+    return next_sock_->timeout();
+  }
+
+  endpoint_type LocalEndpoint() const final {
+    return next_sock_->LocalEndpoint();
+  }
+
+  endpoint_type RemoteEndpoint() const final {
+    return next_sock_->RemoteEndpoint();
+  }
+
+  void RegisterOnErrorCb(std::function<void(uint32_t)> cb) final {
+    next_sock_->RegisterOnErrorCb(std::move(cb));
+  }
+
+  void CancelOnErrorCb() final {
+    next_sock_->CancelOnErrorCb();
+  }
+
+  bool IsUDS() const final {
+    return next_sock_->IsUDS();
+  }
+
+  native_handle_type native_handle() const final {
+    return next_sock_->native_handle();
+  }
+
+  error_code Create(unsigned short protocol_family = 2) final {
+    return next_sock_->Create(protocol_family);
+  }
+
+  ABSL_MUST_USE_RESULT error_code Bind(const struct sockaddr* bind_addr,
+                                       unsigned addr_len) final {
+    return next_sock_->Bind(bind_addr, addr_len);
+  }
+
+  ABSL_MUST_USE_RESULT error_code Listen(unsigned backlog) final {
+    return next_sock_->Listen(backlog);
+  }
+
+  ABSL_MUST_USE_RESULT error_code Listen(uint16_t port, unsigned backlog) final {
+    return next_sock_->Listen(port, backlog);
+  }
+
+  ABSL_MUST_USE_RESULT error_code ListenUDS(const char* path, mode_t permissions,
+                                            unsigned backlog) final {
+    return next_sock_->ListenUDS(path, permissions, backlog);
+  }
+
+  void SetProactor(ProactorBase* p) final;
+
+ private:
+  // A local bucket and optionally a bucket of the tenant.
+  struct Limiter {
+    TokenBucket local;
+    SharedTokenBucket* tenant;
+
+    bool unlimited() const {
+      return local.unlimited() && (!tenant || tenant->unlimited());
+    }
+
+    void Consume(uint64_t n) {
+      local.Consume(n);
+      if (tenant)
+        tenant->Consume(n);
+    }
+  };
+
+  // Waits until all the buckets have tokens.
+  void Throttle(Limiter* bytes);
+
+  // Returns how many bytes a single call may transfer.
+  static size_t MaxTransfer(const Limiter& bytes);
+
+  std::unique_ptr<FiberSocketBase> next_sock_;
+  TenantLimits tenant_;
+  Limiter send_, recv_, ops_;
+  uint64_t pacing_rate_ = 0;
+  Stats stats_;
+};
+
+}  // namespace fb2
+}  // namespace util
@@ -0,0 +1,122 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/fibers/rcu.h"
+
+#include "base/logging.h"
+#include "util/fibers/fibers.h"
+#include "util/proactor_pool.h"
+
+namespace util {
+namespace fb2 {
+
+using namespace std;
+
+Rcu::Rcu(ProactorPool* pool) : pool_(pool) {
+  CHECK_GT(pool_->size(), 0u);
+}
+
+Rcu::~Rcu() {
+  // The last batch is freed once in_flight_ is reset, under mu_.
+  gp_ec_.await([this] {
+    lock_guard lk(mu_);
+    return !in_flight_;
+  });
+  DCHECK(retired_.empty());
+}
+
+void Rcu::Synchronize() {
+  // Every proactor runs the tasklet between fiber runs, after the read-side sections that
+  // started before it.
+  pool_->AwaitBrief([](unsigned, ProactorBase*) {});
+}
+
+void Rcu::Retire(void* ptr, Deleter deleter) {
+  unique_ptr<Batch> batch;
+  {
+    lock_guard lk(mu_);
+    retired_.push_back(Entry{ptr, deleter});
+    ++stats_.retired;
+    if (in_flight_)
+      return;  // CompleteGracePeriod starts the next one.
+
+    in_flight_ = true;
+    batch = TakeBatch();
+  }
+
+  StartGracePeriod(batch.release());
+}
+
+void Rcu::Barrier() {
+  uint64_t target;
+  {
+    lock_guard lk(mu_);
+
+    // The entries in retired_ go with the grace period after the one in flight.
+    target = started_ + (retired_.empty() ? 0 : 1);
+  }
+
+  gp_ec_.await([&] {
+    lock_guard lk(mu_);
+    return completed_ >= target;
+  });
+}
+
+auto Rcu::GetStats() const -> Stats {
+  lock_guard lk(mu_);
+  return stats_;
+}
+
+auto Rcu::TakeBatch() -> unique_ptr<Batch> {
+  auto batch = make_unique<Batch>();
+  batch->entries.swap(retired_);
+  ++started_;
+  ++stats_.grace_periods;
+  return batch;
+}
+
+void Rcu::StartGracePeriod(Batch* batch) {
+  unsigned num = pool_->size();
+  batch->pending.store(num, memory_order_relaxed);
+
+  // The task queue is the quiescent point of the proactors, the loop runs it between fiber
+  // runs. Idle proactors are woken up by the dispatch, so the batch does not depend on their
+  // load.
+  for (unsigned i = 0; i < num; ++i) {
+    pool_->at(i)->DispatchBrief([this, batch] {
+      if (batch->pending.fetch_sub(1, memory_order_acq_rel) == 1)
+        CompleteGracePeriod(batch);
+    });
+  }
+}
+
+void Rcu::CompleteGracePeriod(Batch* batch) {
+  for (const Entry& e : batch->entries)
+    e.deleter(e.ptr);
+
+  size_t reclaimed = batch->entries.size();
+  delete batch;
+
+  unique_ptr<Batch> next;
+  {
+    lock_guard lk(mu_);
+    stats_.reclaimed += reclaimed;
+    ++completed_;
+    if (retired_.empty())
+      in_flight_ = false;
+    else
+      next = TakeBatch();
+
+    // Under mu_, so that the destructor can not return before we are done with this.
+    gp_ec_.notifyAll();
+  }
+
+  if (next) {
+    // DispatchBrief may block on a full task queue, which a tasklet must not do.
+    Fiber("rcu_gp", [this, batch = next.release()] { StartGracePeriod(batch); }).Detach();
+  }
+}
+
+}  // namespace fb2
+}  // namespace util
@@ -0,0 +1,132 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "util/fibers/synchronization.h"
+
+namespace util {
+
+class ProactorPool;
+
+namespace fb2 {
+
+// Epoch-based reclamation for the objects that the fibers of a proactor pool read without
+// locks, e.g. read-mostly routing tables or config snapshots published via RcuPtr.
+//
+// The proactor loops run the task queue between fiber runs, so once every proactor of the pool
+// has run a tasklet that was queued after an object was unpublished, no fiber can still hold a
+// reference to it. Hence the read side costs nothing, but read-side sections must run in the
+// proactor threads of the pool and must not suspend the fiber, i.e. the pointers must not be kept
+// across I/O, locks, sleeps, yields or Await calls.
+//
+// Synchronize blocks the calling fiber for one grace period. Retire does not wait: the retired
+// objects are batched and freed in a proactor thread after the grace period of their batch,
+// with at most one grace period in flight.
+class Rcu {
+ public:
+  using Deleter = void (*)(void*);
+
+  struct Stats {
+    uint64_t retired = 0, reclaimed = 0;
+    uint64_t grace_periods = 0;  // grace periods started by Retire.
+  };
+
+  // The pool must be running while Rcu exists.
+  explicit Rcu(ProactorPool* pool);
+
+  // Waits for the objects retired so far to be freed. Must not be called concurrently with
+  // Retire.
+  ~Rcu();
+
+  Rcu(const Rcu&) = delete;
+  Rcu& operator=(const Rcu&) = delete;
+
+  // Waits until all the read-side sections that started before the call have finished.
+  // Must not be called from a read-side section or a DispatchBrief callback.
+  void Synchronize();
+
+  // The deleter runs in a proactor thread of the pool once the read-side sections that could
+  // see ptr have finished, so it must not block. May block the calling fiber only if a task
+  // queue of the pool is full, like DispatchBrief.
+  void Retire(void* ptr, Deleter deleter);
+
+  template <typename T> void Retire(T* ptr) {
+    Retire(ptr, [](void* p) { delete static_cast<T*>(p); });
+  }
+
+  // Waits until the objects retired before the call have been freed.
+  void Barrier();
+
+  Stats GetStats() const;
+
+ private:
+  struct Entry {
+    void* ptr;
+    Deleter deleter;
+  };
+
+  struct Batch {
+    std::vector<Entry> entries;
+    std::atomic_uint32_t pending{0};  // proactors that did not pass a quiescent point yet.
+  };
+
+  // Called with mu_ locked.
+  std::unique_ptr<Batch> TakeBatch();
+
+  void StartGracePeriod(Batch* batch);
+  void CompleteGracePeriod(Batch* batch);
+
+  ProactorPool* pool_;
+
+  mutable std::mutex mu_;
+  std::vector<Entry> retired_;  // waiting for the next grace period.
+  bool in_flight_ = false;
+  uint64_t started_ = 0, completed_ = 0;
+  Stats stats_;
+  EventCount gp_ec_;
+};
+
+// Pointer to an immutable snapshot of T that readers load without locks and writers replace
+// as a whole, retiring the previous snapshot through Rcu. Writers must be serialized by the
+// caller.
+template <typename T> class RcuPtr {
+ public:
+  RcuPtr() = default;
+
+  explicit RcuPtr(std::unique_ptr<T> val) : ptr_(val.release()) {
+  }
+
+  // No readers may access the snapshot anymore.
+  ~RcuPtr() {
+    delete ptr_.load(std::memory_order_relaxed);
+  }
+
+  RcuPtr(const RcuPtr&) = delete;
+  RcuPtr& operator=(const RcuPtr&) = delete;
+
+  // The snapshot stays valid until the end of the read-side section, see Rcu.
+  const T* Read() const {
+    return ptr_.load(std::memory_order_acquire);
+  }
+
+  // Publishes val and retires the previous snapshot.
+  void Update(std::unique_ptr<T> val, Rcu* rcu) {
+    T* prev = ptr_.exchange(val.release(), std::memory_order_acq_rel);
+    if (prev)
+      rcu->Retire(prev);
+  }
+
+ private:
+  std::atomic<T*> ptr_{nullptr};
+};
+
+}  // namespace fb2
+}  // namespace util
@@ -0,0 +1,159 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/fibers/read_buffer_pool.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+#include "base/logging.h"
+#include "util/fibers/proactor_base.h"
+
+namespace util {
+namespace fb2 {
+
+ReadBufferPool* ReadBufferPool::Local() {
+  static thread_local ReadBufferPool pool;
+  return &pool;
+}
+
+ReadBufferPool::~ReadBufferPool() {
+  DrainRemote();
+  for (unsigned i = 0; i < kNumClasses; ++i)
+    Release(i, 0);
+}
+
+void* ReadBufferPool::Borrow(size_t size, size_t* capacity) {
+  DrainRemote();
+
+  if (size > kMaxSize) {
+    ++stats_.misses;
+    stats_.borrowed_bytes += size;
+    if (capacity)
+      *capacity = size;
+    return Allocate(size) + 1;
+  }
+
+  unsigned cls = ClassIndex(size);
+  size_t cls_size = kMinSize << cls;
+  SizeClass& sc = classes_[cls];
+  sc.peak = std::max(sc.peak, ++sc.in_use);
+  stats_.borrowed_bytes += cls_size;
+  if (capacity)
+    *capacity = cls_size;
+
+  if (sc.free.empty()) {
+    ++stats_.misses;
+    return Allocate(cls_size) + 1;
+  }
+
+  ++stats_.hits;
+  Header* res = sc.free.back();
+  sc.free.pop_back();
+  stats_.pooled_bytes -= cls_size;
+  return res + 1;
+}
+
+void ReadBufferPool::Return(void* ptr, size_t size) {
+  Header* hdr = static_cast<Header*>(ptr) - 1;
+  DCHECK_EQ(ClassIndex(size), ClassIndex(hdr->size));
+
+  if (hdr->owner != this) {
+    Header* head = hdr->owner->remote_.load(std::memory_order_relaxed);
+    do {
+      hdr->next = head;
+    } while (!hdr->owner->remote_.compare_exchange_weak(head, hdr, std::memory_order_release,
+                                                         std::memory_order_relaxed));
+    return;
+  }
+
+  DrainRemote();
+  ReturnLocal(hdr);
+}
+
+auto ReadBufferPool::Allocate(size_t size) -> Header* {
+  Header* hdr = static_cast<Header*>(malloc(sizeof(Header) + size));
+  hdr->owner = this;
+  hdr->size = size;
+  return hdr;
+}
+
+void ReadBufferPool::ReturnLocal(Header* hdr) {
+  if (hdr->size > kMaxSize) {
+    stats_.borrowed_bytes -= hdr->size;
+    free(hdr);
+    return;
+  }
+
+  unsigned cls = ClassIndex(hdr->size);
+  size_t cls_size = kMinSize << cls;
+  SizeClass& sc = classes_[cls];
+  DCHECK_GT(sc.in_use, 0u);
+  --sc.in_use;
+  stats_.borrowed_bytes -= cls_size;
+
+  if (stats_.pooled_bytes + cls_size > opts_.max_pooled_bytes) {
+    ++stats_.released;
+    free(hdr);
+  } else {
+    sc.free.push_back(hdr);
+    stats_.pooled_bytes += cls_size;
+  }
+
+  uint64_t now = ProactorBase::GetMonotonicTimeNs();
+  if (period_start_ns_ == 0) {
+    period_start_ns_ = now;
+  } else if (now > period_start_ns_ + uint64_t(opts_.shrink_period_ms) * 1000000) {
+    Shrink();
+  }
+}
+
+void ReadBufferPool::DrainRemote() {
+  if (remote_.load(std::memory_order_relaxed) == nullptr)
+    return;
+
+  Header* hdr = remote_.exchange(nullptr, std::memory_order_acquire);
+  while (hdr) {
+    Header* next = hdr->next;
+    ReturnLocal(hdr);
+    hdr = next;
+  }
+}
+
+void ReadBufferPool::Shrink() {
+  DrainRemote();
+  for (unsigned i = 0; i < kNumClasses; ++i) {
+    SizeClass& sc = classes_[i];
+
+    // Keep enough buffers to get back to the watermark without allocating.
+    Release(i, sc.peak - sc.in_use);
+    sc.peak = sc.in_use;
+  }
+  period_start_ns_ = ProactorBase::GetMonotonicTimeNs();
+}
+
+void ReadBufferPool::Trim() {
+  DrainRemote();
+  for (unsigned i = 0; i < kNumClasses; ++i) {
+    Release(i, 0);
+    classes_[i].peak = classes_[i].in_use;
+  }
+  period_start_ns_ = ProactorBase::GetMonotonicTimeNs();
+}
+
+void ReadBufferPool::Release(unsigned cls, size_t keep) {
+  SizeClass& sc = classes_[cls];
+  size_t cls_size = kMinSize << cls;
+  while (sc.free.size() > keep) {
+    free(sc.free.back());
+    sc.free.pop_back();
+    stats_.pooled_bytes -= cls_size;
+    ++stats_.released;
+  }
+  if (sc.free.empty())
+    sc.free.shrink_to_fit();
+}
+
+}  // namespace fb2
+}  // namespace util
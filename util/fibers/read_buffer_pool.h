@@ -0,0 +1,133 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace util {
+namespace fb2 {
+
+// Per-thread pool of read buffers for connections. A connection borrows its buffer only
+// while it has pending data and returns it when it goes idle, so idle connections cost
+// no buffer memory and busy ones reuse the buffers of the idle ones.
+// Sizes are rounded up to a power of 2 between kMinSize and kMaxSize, larger buffers are
+// not pooled. The pool keeps up to the high watermark of the borrowed buffers of the last
+// period and releases the rest once the period ends. Must be used from a proactor thread.
+// A buffer records the pool it was borrowed from and goes back to it even if it is returned
+// from another thread, e.g. by a connection that migrated to another proactor. The thread
+// of the pool must outlive its buffers.
+class ReadBufferPool {
+ public:
+  static constexpr size_t kMinSize = 512;
+  static constexpr size_t kMaxSize = 1 << 16;
+
+  struct Options {
+    uint32_t shrink_period_ms = 1000;
+
+    // Caps the memory of the free buffers regardless of the watermark.
+    size_t max_pooled_bytes = 64 << 20;
+  };
+
+  struct Stats {
+    uint64_t hits = 0, misses = 0;
+    uint64_t released = 0;  // free buffers that were released by shrinking.
+    size_t borrowed_bytes = 0;
+    size_t pooled_bytes = 0;
+  };
+
+  // Returns the pool of the calling thread.
+  static ReadBufferPool* Local();
+
+  ~ReadBufferPool();
+
+  // Returns a buffer of at least size bytes, its capacity is written into capacity.
+  void* Borrow(size_t size, size_t* capacity = nullptr);
+
+  // size must be the size passed to Borrow or its capacity. The buffers of other threads
+  // are handed over to their pools, which take them back upon their next call.
+  void Return(void* ptr, size_t size);
+
+  // Releases the free buffers above the watermark and starts a new period.
+  // Called automatically by Return once per shrink period.
+  void Shrink();
+
+  // Releases all the free buffers, e.g. under memory pressure.
+  void Trim();
+
+  void SetOptions(const Options& opts) {
+    opts_ = opts;
+  }
+
+  const Stats& stats() const {
+    return stats_;
+  }
+
+ private:
+  static constexpr unsigned kNumClasses = 8;  // kMinSize << (kNumClasses - 1) == kMaxSize.
+
+  // Precedes the memory of every buffer.
+  struct alignas(16) Header {
+    ReadBufferPool* owner;
+    Header* next;  // links the buffers returned from other threads.
+    size_t size;   // the capacity of the buffer.
+  };
+
+  struct SizeClass {
+    std::vector<Header*> free;
+    unsigned in_use = 0;
+    unsigned peak = 0;  // in_use high watermark of the current period.
+  };
+
+  ReadBufferPool() = default;
+
+  static unsigned ClassIndex(size_t size) {
+    return size <= kMinSize ? 0 : 64 - __builtin_clzl(size - 1) - 9;
+  }
+
+  Header* Allocate(size_t size);
+  void ReturnLocal(Header* hdr);
+
+  // Takes back the buffers that other threads returned.
+  void DrainRemote();
+
+  void Release(unsigned cls, size_t keep);
+
+  Options opts_;
+  Stats stats_;
+  uint64_t period_start_ns_ = 0;
+  SizeClass classes_[kNumClasses];
+  std::atomic<Header*> remote_{nullptr};
+};
+
+// Allocator that borrows from ReadBufferPool::Local(), allows using the pool with
+// containers like beast::basic_flat_buffer.
+template <typename T> struct ReadBufferAllocator {
+  using value_type = T;
+
+  ReadBufferAllocator() = default;
+  template <typename U> ReadBufferAllocator(const ReadBufferAllocator<U>&) {
+  }
+
+  T* allocate(size_t n) {
+    return reinterpret_cast<T*>(ReadBufferPool::Local()->Borrow(n * sizeof(T)));
+  }
+
+  void deallocate(T* p, size_t n) {
+    ReadBufferPool::Local()->Return(p, n * sizeof(T));
+  }
+
+  template <typename U> bool operator==(const ReadBufferAllocator<U>&) const {
+    return true;
+  }
+  template <typename U> bool operator!=(const ReadBufferAllocator<U>&) const {
+    return false;
+  }
+};
+
+}  // namespace fb2
+}  // namespace util
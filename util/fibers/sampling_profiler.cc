@@ -0,0 +1,321 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/fibers/sampling_profiler.h"
+
+#include <absl/debugging/stacktrace.h>
+#include <absl/debugging/symbolize.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_format.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <optional>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "base/logging.h"
+#include "util/fibers/detail/fiber_interface.h"
+#include "util/proactor_pool.h"
+
+namespace util {
+namespace fb2 {
+
+using namespace std;
+
+namespace {
+
+constexpr unsigned kMaxDepth = 32;
+constexpr unsigned kRingSize = 256;
+constexpr unsigned kDrainPeriodMs = 100;
+constexpr size_t kNameLen = 24;
+
+struct Sample {
+  char fiber[kNameLen];
+  uint32_t depth;
+  void* pc[kMaxDepth];
+};
+
+int SampleSignal() {
+  return SIGRTMIN + 3;
+}
+
+}  // namespace
+
+namespace detail {
+
+struct SamplerThreadState {
+  int perf_fd = -1;
+  bool has_timer = false;
+  timer_t timer;
+  optional<uint32_t> periodic_id;
+
+  // The signal handler is the producer, Drain is the consumer. Both run in the same thread.
+  atomic_uint32_t head{0}, tail{0};
+  atomic_uint64_t dropped{0};
+  uint64_t reported_dropped = 0;
+  Sample ring[kRingSize];
+};
+
+}  // namespace detail
+
+using ThreadState = detail::SamplerThreadState;
+
+namespace {
+
+// initial-exec, so that the signal handler does not call __tls_get_addr.
+__attribute__((tls_model("initial-exec"))) thread_local ThreadState* tl_sampler = nullptr;
+
+void SampleHandler(int sig, siginfo_t* info, void* ucontext) {
+  ThreadState* ts = tl_sampler;
+  if (!ts)
+    return;
+
+  int saved_errno = errno;
+  uint32_t head = ts->head.load(memory_order_relaxed);
+  if (head - ts->tail.load(memory_order_acquire) < kRingSize) {
+    Sample& sample = ts->ring[head % kRingSize];
+    sample.depth = absl::GetStackTraceWithContext(sample.pc, kMaxDepth, 1, ucontext, nullptr);
+
+    // The fiber state of the thread is initialized before it starts sampling.
+    const char* name = detail::FiberActive()->name();
+    size_t i = 0;
+    for (; i < kNameLen - 1 && name[i]; ++i)
+      sample.fiber[i] = name[i];
+    sample.fiber[i] = '\0';
+    ts->head.store(head + 1, memory_order_release);
+  } else {
+    ts->dropped.fetch_add(1, memory_order_relaxed);
+  }
+
+#ifdef __linux__
+  // Re-arms the event for the next overflow.
+  if (ts->perf_fd >= 0)
+    ioctl(ts->perf_fd, PERF_EVENT_IOC_REFRESH, 1);
+#endif
+  errno = saved_errno;
+}
+
+once_flag handler_once;
+
+void InstallHandler() {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = SampleHandler;
+  sa.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  CHECK_EQ(0, sigaction(SampleSignal(), &sa, nullptr));
+}
+
+#ifdef __linux__
+
+// Opens a cpu clock perf event of the calling thread that signals it upon overflow.
+int OpenPerfEvent(uint32_t frequency) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_SOFTWARE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_SW_TASK_CLOCK;
+  attr.sample_period = 1000000000ULL / frequency;  // in nanoseconds.
+  attr.disabled = 1;
+
+  int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  struct f_owner_ex owner;
+  owner.type = F_OWNER_TID;
+  owner.pid = syscall(SYS_gettid);
+  if (fcntl(fd, F_SETFL, O_ASYNC) < 0 || fcntl(fd, F_SETSIG, SampleSignal()) < 0 ||
+      fcntl(fd, F_SETOWN_EX, &owner) < 0 || ioctl(fd, PERF_EVENT_IOC_REFRESH, 1) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+#endif
+
+error_code StartThreadSampling(uint32_t frequency, ThreadState* ts) {
+  tl_sampler = ts;
+#ifdef __linux__
+  ts->perf_fd = OpenPerfEvent(frequency);
+  if (ts->perf_fd >= 0)
+    return {};
+  VLOG(1) << "perf_event_open failed: " << strerror(errno) << ", falling back to timer";
+
+  struct sigevent sev;
+  memset(&sev, 0, sizeof(sev));
+  sev.sigev_notify = SIGEV_THREAD_ID;
+  sev.sigev_signo = SampleSignal();
+  sev._sigev_un._tid = syscall(SYS_gettid);
+  if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &ts->timer) < 0)
+    return error_code{errno, system_category()};
+  ts->has_timer = true;
+
+  struct itimerspec spec;
+  spec.it_interval.tv_sec = 0;
+  spec.it_interval.tv_nsec = 1000000000L / frequency;
+  spec.it_value = spec.it_interval;
+  if (timer_settime(ts->timer, 0, &spec, nullptr) < 0)
+    return error_code{errno, system_category()};
+  return {};
+#else
+  return make_error_code(errc::operation_not_supported);
+#endif
+}
+
+void StopThreadSampling(ThreadState* ts) {
+  // Pending signals are ignored from now on.
+  tl_sampler = nullptr;
+  if (ts->perf_fd >= 0) {
+    close(ts->perf_fd);
+    ts->perf_fd = -1;
+  }
+#ifdef __linux__
+  if (ts->has_timer) {
+    timer_delete(ts->timer);
+    ts->has_timer = false;
+  }
+#endif
+}
+
+}  // namespace
+
+SamplingProfiler::SamplingProfiler(ProactorPool* pool) : pool_(pool) {
+}
+
+SamplingProfiler::~SamplingProfiler() {
+  CHECK(threads_.empty()) << "Stop must be called before destruction";
+}
+
+error_code SamplingProfiler::Start(uint32_t frequency) {
+  CHECK(!IsRunning());
+  CHECK_GT(frequency, 0u);
+  call_once(handler_once, InstallHandler);
+
+  threads_.resize(pool_->size());
+  for (auto& ts : threads_)
+    ts = new ThreadState;
+
+  mutex err_mu;
+  error_code res;
+  pool_->AwaitFiberOnAll([&, frequency](unsigned index, ProactorBase* pb) {
+    ThreadState* ts = threads_[index];
+    error_code ec = StartThreadSampling(frequency, ts);
+    if (ec) {
+      lock_guard lk(err_mu);
+      res = ec;
+      return;
+    }
+    ts->periodic_id = pb->AddPeriodic(kDrainPeriodMs, [this, ts] { Drain(ts); });
+  });
+
+  if (res) {
+    LOG(ERROR) << "Could not start sampling: " << res.message();
+    Stop();
+  }
+  return res;
+}
+
+void SamplingProfiler::Stop() {
+  if (threads_.empty())
+    return;
+
+  pool_->AwaitFiberOnAll([this](unsigned index, ProactorBase* pb) {
+    ThreadState* ts = threads_[index];
+    StopThreadSampling(ts);
+    if (ts->periodic_id)
+      pb->CancelPeriodic(*ts->periodic_id);
+    Drain(ts);
+    delete ts;
+  });
+  threads_.clear();
+}
+
+void SamplingProfiler::Drain(ThreadState* ts) {
+  uint32_t tail = ts->tail.load(memory_order_relaxed);
+  uint32_t head = ts->head.load(memory_order_acquire);
+  uint64_t dropped = ts->dropped.load(memory_order_relaxed);
+
+  lock_guard lk(mu_);
+  stats_.dropped += dropped - ts->reported_dropped;
+  ts->reported_dropped = dropped;
+
+  string key;
+  for (; tail != head; ++tail) {
+    const Sample& sample = ts->ring[tail % kRingSize];
+    key.assign(sample.fiber, strlen(sample.fiber) + 1);
+    key.append(reinterpret_cast<const char*>(sample.pc), sample.depth * sizeof(void*));
+    ++stacks_[key];
+    ++stats_.samples;
+  }
+  ts->tail.store(tail, memory_order_release);
+}
+
+string SamplingProfiler::FoldedStacks() const {
+  // Snapshot under the lock, symbolize outside of it.
+  vector<pair<string, uint64_t>> stacks;
+  {
+    lock_guard lk(mu_);
+    stacks.assign(stacks_.begin(), stacks_.end());
+  }
+
+  absl::flat_hash_map<void*, string> symbols;
+  auto symbolize = [&](void* pc) -> const string& {
+    auto [it, inserted] = symbols.try_emplace(pc);
+    if (inserted) {
+      char buf[1024];
+      if (absl::Symbolize(pc, buf, sizeof(buf))) {
+        it->second = buf;
+
+        // ';' separates the frames and ' ' the count in the folded format.
+        replace(it->second.begin(), it->second.end(), ';', ':');
+        replace(it->second.begin(), it->second.end(), ' ', '_');
+      } else {
+        it->second = absl::StrFormat("%p", pc);
+      }
+    }
+    return it->second;
+  };
+
+  string res;
+  for (const auto& [key, count] : stacks) {
+    size_t name_len = strlen(key.data());
+    const char* pcs = key.data() + name_len + 1;
+    size_t depth = (key.size() - name_len - 1) / sizeof(void*);
+
+    res.append(name_len ? key.data() : "unnamed", name_len ? name_len : 7);
+    for (size_t i = depth; i > 0; --i) {
+      void* pc;
+      memcpy(&pc, pcs + (i - 1) * sizeof(void*), sizeof(pc));
+      absl::StrAppend(&res, ";", symbolize(pc));
+    }
+    absl::StrAppend(&res, " ", count, "\n");
+  }
+  return res;
+}
+
+void SamplingProfiler::Reset() {
+  lock_guard lk(mu_);
+  stacks_.clear();
+  stats_ = Stats{};
+}
+
+SamplingProfiler::Stats SamplingProfiler::GetStats() const {
+  lock_guard lk(mu_);
+  return stats_;
+}
+
+}  // namespace fb2
+}  // namespace util
@@ -0,0 +1,78 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <vector>
+
+namespace util {
+
+class ProactorPool;
+
+namespace fb2 {
+
+namespace detail {
+struct SamplerThreadState;
+}  // namespace detail
+
+// Always-on cpu sampler of the proactor threads of a pool. Each thread gets a perf_event
+// cpu clock (or a thread cpu timer if perf events are not allowed) that interrupts it with
+// a signal frequency times per second of its cpu time. The signal handler records the stack
+// and the name of the active fiber into a per-thread ring, which the proactor drains
+// periodically into an aggregated profile held in memory.
+// FoldedStacks returns the profile in the folded format of flamegraph.pl, with the fiber
+// name as the root frame. The overhead is a signal per sample, i.e. negligible at the default
+// frequency. Uses a realtime signal, so it can run together with the gperftools profiler.
+// There can be one running profiler per process.
+class SamplingProfiler {
+ public:
+  struct Stats {
+    uint64_t samples = 0;
+    uint64_t dropped = 0;  // samples lost because a ring was full.
+  };
+
+  explicit SamplingProfiler(ProactorPool* pool);
+  ~SamplingProfiler();
+
+  // Starts sampling on all the proactor threads. Returns an error if a thread could not
+  // create its sampling timer. Must not be called from a proactor thread.
+  std::error_code Start(uint32_t frequency = 99);
+
+  // Must not be called from a proactor thread.
+  void Stop();
+
+  bool IsRunning() const {
+    return !threads_.empty();
+  }
+
+  // Returns "fiber;outer_frame;...;leaf_frame count" lines of the samples collected since
+  // the start or the last reset.
+  std::string FoldedStacks() const;
+
+  // Clears the aggregated profile.
+  void Reset();
+
+  Stats GetStats() const;
+
+ private:
+  void Drain(detail::SamplerThreadState* ts);
+
+  ProactorPool* pool_;
+  std::vector<detail::SamplerThreadState*> threads_;
+
+  mutable std::mutex mu_;
+
+  // Maps a fiber name followed by the raw program counters of its stack, leaf first,
+  // to the number of samples.
+  absl::flat_hash_map<std::string, uint64_t> stacks_;
+  Stats stats_;
+};
+
+}  // namespace fb2
+}  // namespace util
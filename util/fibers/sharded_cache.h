@@ -0,0 +1,123 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+#include "base/tiny_lfu_cache.h"
+#include "util/proactor_pool.h"
+
+namespace util {
+namespace fb2 {
+
+// base::TinyLfuCache sharded by the proactors of a pool. Every key is owned by the shard of a
+// single proactor, which is the only thread that touches the shard, so there are no locks.
+// The operations on the keys of other shards hop to the owning proactor with AwaitBrief,
+// hence they must not be called from a thread that is not allowed to block. Callers that
+// perform many operations should route their requests to the owning proactor, see ShardOf,
+// and use the shard directly with Local().
+// The budget is split evenly between the shards and each shard allocates from the memory
+// resource returned by mr_factory on its proactor, i.e. the thread local resource of the
+// proactor, if provided.
+template <typename V> class ShardedCache {
+ public:
+  using Cache = base::TinyLfuCache<V>;
+  using Stats = typename Cache::Stats;
+
+  ShardedCache(ProactorPool* pool, size_t max_bytes,
+               std::function<PMR_NS::memory_resource*()> mr_factory = nullptr)
+      : pool_(pool), shards_(pool->size()) {
+    size_t shard_bytes = max_bytes / pool->size();
+    pool->AwaitBrief([&](unsigned index, ProactorBase*) {
+      PMR_NS::memory_resource* mr = mr_factory ? mr_factory() : nullptr;
+      shards_[index].reset(new Cache(shard_bytes, mr));
+    });
+  }
+
+  // The shards are destroyed on their proactors.
+  ~ShardedCache() {
+    pool_->AwaitBrief([this](unsigned index, ProactorBase*) { shards_[index].reset(); });
+  }
+
+  ShardedCache(const ShardedCache&) = delete;
+  ShardedCache& operator=(const ShardedCache&) = delete;
+
+  unsigned ShardOf(std::string_view key) const {
+    // The high bits, since the low ones select the slots of the shard.
+    uint64_t hash = base::string_view_sso::Hash(key);
+    return ((hash >> 32) * shards_.size()) >> 32;
+  }
+
+  // Returns the shard of the calling proactor.
+  Cache* Local() {
+    return shards_[ProactorBase::me()->GetPoolIndex()].get();
+  }
+
+  // Runs f(Cache*) on the shard of key, in place if the shard belongs to the calling proactor,
+  // and returns its result.
+  template <typename F> auto Apply(std::string_view key, F&& f) -> decltype(f((Cache*)nullptr)) {
+    unsigned sid = ShardOf(key);
+    Cache* cache = shards_[sid].get();
+    return pool_->at(sid)->AwaitBrief([&] { return f(cache); });
+  }
+
+  // Returns a copy of the value of key.
+  std::optional<V> Get(std::string_view key) {
+    return Apply(key, [key](Cache* cache) -> std::optional<V> {
+      V* val = cache->Find(key);
+      return val ? std::optional<V>(*val) : std::nullopt;
+    });
+  }
+
+  bool Set(std::string_view key, V value, size_t charge = 0) {
+    return Apply(key, [&](Cache* cache) { return cache->Insert(key, std::move(value), charge); });
+  }
+
+  bool Erase(std::string_view key) {
+    return Apply(key, [key](Cache* cache) { return cache->Erase(key); });
+  }
+
+  // Changes the total budget, e.g. under memory pressure.
+  void SetMaxBytes(size_t max_bytes) {
+    size_t shard_bytes = max_bytes / shards_.size();
+    pool_->AwaitBrief(
+        [&](unsigned index, ProactorBase*) { shards_[index]->SetMaxBytes(shard_bytes); });
+  }
+
+  // The stats and the memory usage summed over the shards.
+  Stats GetStats(size_t* used_bytes = nullptr) const {
+    std::vector<Stats> stats(shards_.size());
+    std::vector<size_t> used(shards_.size());
+    pool_->AwaitBrief([&](unsigned index, ProactorBase*) {
+      stats[index] = shards_[index]->stats();
+      used[index] = shards_[index]->used_bytes();
+    });
+
+    Stats res;
+    for (size_t i = 0; i < stats.size(); ++i) {
+      res.hits += stats[i].hits;
+      res.misses += stats[i].misses;
+      res.evictions += stats[i].evictions;
+      res.rejections += stats[i].rejections;
+    }
+    if (used_bytes) {
+      *used_bytes = 0;
+      for (size_t u : used)
+        *used_bytes += u;
+    }
+    return res;
+  }
+
+ private:
+  ProactorPool* pool_;
+  std::vector<std::unique_ptr<Cache>> shards_;
+};
+
+}  // namespace fb2
+}  // namespace util
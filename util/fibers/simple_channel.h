@@ -4,6 +4,8 @@
 
 #pragma once
 
+#include <absl/types/span.h>
+
 #include <boost/fiber/context.hpp>
 
 #include "base/ProducerConsumerQueue.h"
@@ -41,6 +43,14 @@ template <typename T, typename Queue = folly::ProducerConsumerQueue<T>> class Si
   // Blocking call. Returns false if channel is closed, true otherwise with the popped value.
   bool Pop(T& dest);
 
+  //! Blocking batch push. Moves all the items from src into the channel.
+  //! Consumers are notified once per enqueued chunk rather than once per item.
+  void PushBatch(absl::Span<T> src) noexcept;
+
+  //! Blocking batch pop. Pops up to dest.size() items into dest, blocking until at least
+  //! one item is available. Returns the number of popped items or 0 if the channel is closed.
+  size_t PopBatch(absl::Span<T> dest);
+
   /*! /brief Should be called only from the producer side.
 
       Signals the consumers that the channel is going to be close.
@@ -63,6 +73,36 @@ template <typename T, typename Queue = folly::ProducerConsumerQueue<T>> class Si
     return false;
   }
 
+  //! Non blocking batch push. Returns the number of items moved from src, stops at
+  //! the first item that does not fit.
+  size_t TryPushBatch(absl::Span<T> src) noexcept {
+    size_t i = 0;
+    while (i < src.size() && QTraits::TryEnqueue(q_, std::move(src[i])))
+      ++i;
+
+    // A single notification for the whole batch. notifyAll so that all the idle consumers
+    // can share the batch. A waiter on the same thread is resumed via the local ready queue,
+    // so the remote wakeup is paid only for consumers on other threads.
+    if (i > 1)
+      pop_ec_.notifyAll();
+    else if (i == 1)
+      pop_ec_.notify();
+    return i;
+  }
+
+  //! Non blocking batch pop. Returns the number of items popped into dest.
+  size_t TryPopBatch(absl::Span<T> dest) {
+    size_t i = 0;
+    while (i < dest.size() && QTraits::TryDequeue(q_, dest[i]))
+      ++i;
+
+    // Once per batch, and only if we freed some space, so that polling an empty channel does
+    // not wake the producers.
+    if (i > 0)
+      push_ec_.notify();
+    return i;
+  }
+
   //! Non blocking pop.
   bool TryPop(T& val) {
     if (QTraits::TryDequeue(q_, val)) {
@@ -125,6 +165,44 @@ template <typename T, typename Q> bool SimpleChannel<T, Q>::Pop(T& dest) {
   }
 }
 
+template <typename T, typename Q>
+void SimpleChannel<T, Q>::PushBatch(absl::Span<T> src) noexcept {
+  size_t pushed = TryPushBatch(src);  // fast path.
+
+  while (pushed < src.size()) {
+    EventCount::Key key = push_ec_.prepareWait();
+    size_t res = TryPushBatch(src.subspan(pushed));
+    if (res) {
+      pushed += res;
+      continue;
+    }
+    push_ec_.wait(key.epoch());
+  }
+}
+
+template <typename T, typename Q> size_t SimpleChannel<T, Q>::PopBatch(absl::Span<T> dest) {
+  if (dest.empty())
+    return 0;
+
+  size_t res = TryPopBatch(dest);  // fast path
+  if (res)
+    return res;
+
+  while (true) {
+    EventCount::Key key = pop_ec_.prepareWait();
+    res = TryPopBatch(dest);
+    if (res) {
+      return res;
+    }
+
+    if (IsClosing()) {
+      return 0;
+    }
+
+    pop_ec_.wait(key.epoch());
+  }
+}
+
 template <typename T, typename Q> void SimpleChannel<T, Q>::StartClosing() {
   is_closing_.fetch_add(1, std::memory_order_acq_rel);
   pop_ec_.notifyAll();
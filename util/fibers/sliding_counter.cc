@@ -20,15 +20,5 @@ void SlidingCounterBase::CheckInit() const {
   CHECK_NOTNULL(pp_);
 }
 
-unsigned SlidingCounterBase::ProactorThreadIndex() const {
-  int32_t tnum = CHECK_NOTNULL(pp_)->size();
-
-  int32_t indx = fb2::ProactorBase::me()->GetPoolIndex();
-  CHECK_GE(indx, 0) << "Must be called from proactor thread!";
-  CHECK_LT(indx, tnum) << "Invalid thread index " << indx;
-
-  return unsigned(indx);
-}
-
 }  // namespace detail
 }  // namespace util
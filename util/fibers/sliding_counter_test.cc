@@ -0,0 +1,121 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/sliding_counter.h"
+
+#include <atomic>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "util/fibers/pool.h"
+
+namespace util {
+
+using namespace std;
+
+class SlidingCounterTest : public testing::Test {
+ protected:
+  void SetUp() final {
+    now_ms_.store(1000000, memory_order_relaxed);
+    detail::window_clock = [] { return now_ms_.load(memory_order_relaxed); };
+  }
+
+  void TearDown() final {
+    detail::window_clock = nullptr;
+  }
+
+  static void Advance(uint64_t ms) {
+    now_ms_.fetch_add(ms, memory_order_relaxed);
+  }
+
+  static atomic_uint64_t now_ms_;
+};
+
+atomic_uint64_t SlidingCounterTest::now_ms_{0};
+
+TEST_F(SlidingCounterTest, SubSecondBins) {
+  SlidingCounter<4, int32_t, 50> counter;
+  counter.IncBy(5);
+  EXPECT_EQ(5, counter.Sum());
+  EXPECT_EQ(0, counter.SumTail());
+
+  Advance(49);
+  counter.IncBy(1);
+  EXPECT_EQ(6, counter.Sum());
+  EXPECT_EQ(0, counter.SumTail());
+
+  Advance(1);
+  counter.IncBy(3);
+  EXPECT_EQ(9, counter.Sum());
+  EXPECT_EQ(6, counter.SumTail());
+
+  // The window spans 200ms.
+  Advance(150);
+  EXPECT_EQ(3, counter.Sum());
+  Advance(50);
+  EXPECT_EQ(0, counter.Sum());
+}
+
+TEST_F(SlidingCounterTest, SecondBins) {
+  SlidingCounter<3> counter;
+  counter.Inc();
+  Advance(1000);
+  counter.Inc();
+  EXPECT_EQ(2, counter.Sum());
+  EXPECT_EQ(1, counter.SumTail());
+
+  // Idle for longer than the window clears all the bins at once.
+  Advance(10000);
+  EXPECT_EQ(0, counter.Sum());
+}
+
+TEST_F(SlidingCounterTest, Histogram) {
+  SlidingHistogram<4, 50> hist;
+  for (unsigned i = 1; i <= 100; ++i)
+    hist.Add(i);
+
+  base::FixedHistogram res;
+  hist.Merge(&res);
+  EXPECT_EQ(100u, res.count());
+  EXPECT_NEAR(50, res.Median(), 2);
+  EXPECT_NEAR(99, res.Percentile(99), 2);
+
+  base::FixedHistogram tail;
+  hist.MergeTail(&tail);
+  EXPECT_EQ(0u, tail.count());
+
+  Advance(50);
+  tail.Clear();
+  hist.MergeTail(&tail);
+  EXPECT_EQ(100u, tail.count());
+
+  Advance(200);
+  res.Clear();
+  hist.Merge(&res);
+  EXPECT_EQ(0u, res.count());
+}
+
+TEST_F(SlidingCounterTest, HistogramDist) {
+  unique_ptr<ProactorPool> pool(fb2::Pool::Epoll(2));
+  pool->Run();
+
+  SlidingHistogramDist<4, 50> hist;
+  hist.Init(pool.get());
+
+  pool->AwaitBrief([&](unsigned index, auto*) {
+    for (unsigned i = 0; i < 100; ++i)
+      hist.Add(index == 0 ? 10 : 1000);
+  });
+
+  Advance(50);
+  base::FixedHistogram res = hist.MergeTail();
+  EXPECT_EQ(200u, res.count());
+  EXPECT_NEAR(10, res.Percentile(25), 2);
+  EXPECT_NEAR(1000, res.Percentile(99), 100);
+
+  hist.Shutdown();
+  pool->Stop();
+}
+
+}  // namespace util
@@ -0,0 +1,220 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/fibers/stack_cache.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <new>
+
+#include "base/logging.h"
+
+namespace util {
+namespace fb2 {
+
+using namespace std;
+
+namespace {
+
+constexpr size_t kHugePageSize = 1ULL << 21;
+
+inline size_t AlignUp(size_t sz, size_t alignment) {
+  return (sz + alignment - 1) & ~(alignment - 1);
+}
+
+// Fast path lookup of the thread cache for the most recently used resource.
+// Resources are identified by a unique id rather than by address, so that a new resource
+// allocated at the address of a destroyed one won't pick its stale cache.
+atomic_uint64_t next_resource_id{1};
+thread_local uint64_t tl_owner = 0;
+thread_local void* tl_cache = nullptr;
+
+}  // namespace
+
+StackCacheResource::StackCacheResource(const Options& opts)
+    : opts_(opts), id_(next_resource_id.fetch_add(1, memory_order_relaxed)) {
+  page_size_ = sysconf(_SC_PAGESIZE);
+  CHECK_GT(opts_.stack_size, 0u);
+
+  opts_.stack_size = AlignUp(opts_.stack_size, page_size_);
+  guard_size_ = opts_.guard_page ? page_size_ : 0;
+  slot_size_ = opts_.stack_size + guard_size_;
+}
+
+StackCacheResource::~StackCacheResource() {
+  for (ThreadCache* tc : caches_) {
+    LOG_IF(WARNING, tc->stats.in_use > 0) << "Destroying stack resource with stacks in use";
+
+    if (!opts_.use_hugepages) {
+      for (const Slot& slot : tc->free_list)
+        UnmapStack(slot.base, opts_.stack_size);
+    }
+    delete tc;
+  }
+
+  for (const auto& [ptr, size] : chunks_) {
+    munmap(ptr, size);
+  }
+
+  if (tl_owner == id_) {
+    tl_owner = 0;
+    tl_cache = nullptr;
+  }
+}
+
+auto StackCacheResource::GetThreadStats() const -> Stats {
+  return GetThreadCache()->stats;
+}
+
+auto StackCacheResource::GetThreadCache() const -> ThreadCache* {
+  if (tl_owner == id_)
+    return static_cast<ThreadCache*>(tl_cache);
+
+  thread::id tid = this_thread::get_id();
+  ThreadCache* res = nullptr;
+
+  unique_lock lk(mu_);
+  for (ThreadCache* tc : caches_) {
+    if (tc->tid == tid) {
+      res = tc;
+      break;
+    }
+  }
+
+  if (!res) {
+    res = new ThreadCache;
+    res->tid = tid;
+    res->free_list.reserve(opts_.max_cached_per_thread);
+    caches_.push_back(res);
+  }
+  lk.unlock();
+
+  tl_owner = id_;
+  tl_cache = res;
+  return res;
+}
+
+// Returns the stack base, i.e. the address right above the guard page.
+char* StackCacheResource::MapStack(size_t size) {
+  size_t total = size + guard_size_;
+  void* ptr = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED) {
+    throw bad_alloc();
+  }
+
+  char* base = static_cast<char*>(ptr);
+  if (guard_size_) {
+    CHECK_EQ(0, mprotect(base, guard_size_, PROT_NONE));
+  }
+
+  return base + guard_size_;
+}
+
+void StackCacheResource::UnmapStack(char* ptr, size_t size) {
+  munmap(ptr - guard_size_, size + guard_size_);
+}
+
+char* StackCacheResource::CarveStack(ThreadCache* tc) {
+  if (tc->chunk_next + slot_size_ > tc->chunk_end) {
+    size_t chunk_size = AlignUp(slot_size_, kHugePageSize);
+
+    // Over-allocate in order to align the chunk to the hugepage boundary.
+    size_t map_size = chunk_size + kHugePageSize;
+    void* ptr =
+        mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+      throw bad_alloc();
+    }
+
+    char* start = static_cast<char*>(ptr);
+    char* aligned =
+        reinterpret_cast<char*>(AlignUp(reinterpret_cast<uintptr_t>(start), kHugePageSize));
+    if (aligned > start)
+      munmap(start, aligned - start);
+
+    char* tail = aligned + chunk_size;
+    size_t tail_size = start + map_size - tail;
+    if (tail_size)
+      munmap(tail, tail_size);
+
+#ifdef MADV_HUGEPAGE
+    if (madvise(aligned, chunk_size, MADV_HUGEPAGE) != 0) {
+      VLOG(1) << "madvise(MADV_HUGEPAGE) failed " << errno;
+    }
+#endif
+
+    {
+      lock_guard lk(mu_);
+      chunks_.emplace_back(aligned, chunk_size);
+    }
+
+    tc->chunk_next = aligned;
+    tc->chunk_end = aligned + chunk_size;
+  }
+
+  char* base = tc->chunk_next;
+  tc->chunk_next += slot_size_;
+  if (guard_size_) {
+    CHECK_EQ(0, mprotect(base, guard_size_, PROT_NONE));
+  }
+
+  return base + guard_size_;
+}
+
+void* StackCacheResource::do_allocate(size_t size, size_t align) {
+  if (size != opts_.stack_size) {
+    return MapStack(AlignUp(size, page_size_));
+  }
+
+  ThreadCache* tc = GetThreadCache();
+  ++tc->stats.in_use;
+
+  if (!tc->free_list.empty()) {
+    Slot slot = tc->free_list.back();
+    tc->free_list.pop_back();
+    ++tc->stats.hits;
+    --tc->stats.cached;
+    if (slot.resident)
+      tc->stats.resident_bytes -= opts_.stack_size;
+    return slot.base;
+  }
+
+  ++tc->stats.misses;
+  return opts_.use_hugepages ? CarveStack(tc) : MapStack(size);
+}
+
+void StackCacheResource::do_deallocate(void* ptr, size_t size, size_t align) {
+  char* base = static_cast<char*>(ptr);
+  if (size != opts_.stack_size) {
+    UnmapStack(base, AlignUp(size, page_size_));
+    return;
+  }
+
+  ThreadCache* tc = GetThreadCache();
+
+  // The stack could have been allocated by another thread.
+  if (tc->stats.in_use > 0)
+    --tc->stats.in_use;
+
+  bool resident = tc->stats.cached < opts_.max_cached_per_thread;
+  if (!resident) {
+    if (!opts_.use_hugepages) {
+      UnmapStack(base, size);
+      return;
+    }
+
+    // Carved stacks can not be unmapped individually, so we only release their pages.
+    madvise(base, size, MADV_DONTNEED);
+  }
+
+  tc->free_list.push_back(Slot{base, resident});
+  ++tc->stats.cached;
+  if (resident)
+    tc->stats.resident_bytes += size;
+}
+
+}  // namespace fb2
+}  // namespace util
@@ -0,0 +1,111 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "base/pmr/memory_resource.h"
+
+namespace util {
+namespace fb2 {
+
+/**
+ * @brief Memory resource for fiber stacks that recycles the stacks of terminated fibers.
+ *
+ * Every thread keeps its own free list, so allocations and deallocations do not synchronize
+ * with other threads. A stack that is deallocated on a different thread than the one it was
+ * allocated on (i.e. a migrated fiber) just joins the free list of the deallocating thread.
+ * Only allocations of exactly Options::stack_size bytes are cached, other sizes are served
+ * directly by mmap.
+ *
+ * Can be passed to SetDefaultStackResource() or to FixedStackAllocator. The resource must
+ * outlive all the fibers that use it.
+ */
+class StackCacheResource : public PMR_NS::memory_resource {
+ public:
+  struct Options {
+    size_t stack_size = 64 * 1024;
+
+    // Maximal number of free stacks that a thread keeps resident.
+    // With hugepages, excessive stacks are kept but their memory is returned to the OS.
+    // Without hugepages, excessive stacks are unmapped.
+    unsigned max_cached_per_thread = 256;
+
+    // Carve stacks from 2MB transparent hugepage chunks. Chunks are released only when
+    // the resource is destroyed.
+    bool use_hugepages = false;
+
+    // Protect the lowest page of every stack to catch stack overflows.
+    // Please note that guard pages split the hugepage mappings of the chunk.
+    bool guard_page = true;
+  };
+
+  // Per-thread statistics.
+  struct Stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t in_use = 0;         // number of stacks handed out by this thread.
+    uint64_t cached = 0;         // number of free stacks in the thread cache.
+    uint64_t resident_bytes = 0;  // bytes of cached stacks that were not returned to the OS.
+  };
+
+  StackCacheResource() : StackCacheResource(Options{}) {
+  }
+
+  explicit StackCacheResource(const Options& opts);
+  ~StackCacheResource();
+
+  StackCacheResource(const StackCacheResource&) = delete;
+  StackCacheResource& operator=(const StackCacheResource&) = delete;
+
+  // Returns statistics of the calling thread.
+  Stats GetThreadStats() const;
+
+  const Options& options() const {
+    return opts_;
+  }
+
+ private:
+  struct Slot {
+    char* base;     // stack pointer returned to the caller.
+    bool resident;  // false if the memory was returned to the OS.
+  };
+
+  struct ThreadCache {
+    std::thread::id tid;
+    std::vector<Slot> free_list;
+    char* chunk_next = nullptr;
+    char* chunk_end = nullptr;
+    Stats stats;
+  };
+
+  void* do_allocate(std::size_t size, std::size_t align) final;
+  void do_deallocate(void* ptr, std::size_t size, std::size_t align) final;
+
+  bool do_is_equal(const PMR_NS::memory_resource& o) const noexcept final {
+    return this == &o;
+  }
+
+  ThreadCache* GetThreadCache() const;
+
+  char* MapStack(size_t size);
+  void UnmapStack(char* ptr, size_t size);
+  char* CarveStack(ThreadCache* tc);
+
+  Options opts_;
+  uint64_t id_;
+  size_t page_size_ = 0;
+  size_t guard_size_ = 0;
+  size_t slot_size_ = 0;  // stack_size + guard_size_.
+
+  mutable std::mutex mu_;
+  mutable std::vector<ThreadCache*> caches_;
+  std::vector<std::pair<char*, size_t>> chunks_;
+};
+
+}  // namespace fb2
+}  // namespace util
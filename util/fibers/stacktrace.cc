@@ -21,14 +21,18 @@ std::string util::fb2::GetStacktrace() {
   int size = absl::GetStackTrace(addresses, sizeof(addresses) / sizeof(void*),
                                  /*skip_count=*/SKIP_COUNT_TOP);
 
+  return SymbolizeStacktrace(addresses, size - SKIP_COUNT_BOTTOM);
+}
+
+std::string util::fb2::SymbolizeStacktrace(void* const* pcs, int depth) {
   std::string rv;
-  for (int i = 0; i < size - SKIP_COUNT_BOTTOM; i++) {
+  for (int i = 0; i < depth; i++) {
     char symbol_buf[1024];
     const char* symbol = "(unknown)";
-    if (absl::Symbolize(addresses[i], symbol_buf, sizeof(symbol_buf))) {
+    if (absl::Symbolize(pcs[i], symbol_buf, sizeof(symbol_buf))) {
       symbol = symbol_buf;
     }
-    rv += absl::StrFormat("%p  %s\n", addresses[i], symbol);
+    rv += absl::StrFormat("%p  %s\n", pcs[i], symbol);
   }
 
   return rv;
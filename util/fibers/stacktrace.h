@@ -10,4 +10,8 @@ namespace util::fb2 {
 
 std::string GetStacktrace();
 
+// Formats the program counters of a stack that was captured elsewhere, e.g. in a signal
+// handler, one "address symbol" line per frame. Not async-signal-safe.
+std::string SymbolizeStacktrace(void* const* pcs, int depth);
+
 }
@@ -0,0 +1,236 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/fibers/stall_detector.h"
+
+#include <absl/debugging/stacktrace.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+
+#include "base/logging.h"
+#include "util/fibers/detail/fiber_interface.h"
+#include "util/fibers/stacktrace.h"
+#include "util/proactor_pool.h"
+
+namespace util {
+namespace fb2 {
+
+using namespace std;
+
+namespace {
+
+constexpr unsigned kMaxDepth = 32;
+constexpr size_t kNameLen = 24;
+
+// How long the watchdog waits for the signal handler of a stalled thread.
+constexpr auto kCaptureTimeout = chrono::milliseconds(20);
+
+int StallSignal() {
+  return SIGRTMIN + 4;
+}
+
+uint64_t NowMs() {
+  return chrono::duration_cast<chrono::milliseconds>(
+             chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+}  // namespace
+
+namespace detail {
+
+struct alignas(64) StallThreadState {
+  ProactorBase* proactor = nullptr;
+  pthread_t tid;
+
+  // Heartbeats are numbered, acked is the last one that the proactor ran.
+  atomic_uint64_t acked{0};
+
+  // Accessed by the watchdog only.
+  uint64_t sent = 0;
+  uint64_t sent_ms = 0;
+  bool stalled = false;  // whether the pending heartbeat was counted as a stall.
+
+  // Written by the signal handler, read by the watchdog once captured is set.
+  atomic_bool captured{false};
+  char fiber[kNameLen];
+  int depth = 0;
+  void* pc[kMaxDepth];
+};
+
+}  // namespace detail
+
+using ThreadState = detail::StallThreadState;
+
+namespace {
+
+// initial-exec, so that the signal handler does not call __tls_get_addr.
+__attribute__((tls_model("initial-exec"))) thread_local ThreadState* tl_stall = nullptr;
+
+void StallHandler(int sig, siginfo_t* info, void* ucontext) {
+  ThreadState* ts = tl_stall;
+  if (!ts || ts->captured.load(memory_order_relaxed))
+    return;
+
+  int saved_errno = errno;
+  ts->depth = absl::GetStackTraceWithContext(ts->pc, kMaxDepth, 1, ucontext, nullptr);
+
+  const char* name = detail::FiberActive()->name();
+  size_t i = 0;
+  for (; i < kNameLen - 1 && name[i]; ++i)
+    ts->fiber[i] = name[i];
+  ts->fiber[i] = '\0';
+  ts->captured.store(true, memory_order_release);
+  errno = saved_errno;
+}
+
+once_flag handler_once;
+
+void InstallHandler() {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = StallHandler;
+  sa.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  CHECK_EQ(0, sigaction(StallSignal(), &sa, nullptr));
+}
+
+}  // namespace
+
+StallDetector::StallDetector(ProactorPool* pool, const Options& opts) : pool_(pool), opts_(opts) {
+  CHECK_GT(opts_.stall_ms, 0u);
+}
+
+StallDetector::~StallDetector() {
+  Stop();
+}
+
+void StallDetector::Start() {
+  CHECK(!IsRunning());
+  call_once(handler_once, InstallHandler);
+
+  threads_.resize(pool_->size());
+  for (auto& ts : threads_)
+    ts = new ThreadState;
+
+  pool_->AwaitBrief([this](unsigned index, ProactorBase* pb) {
+    ThreadState* ts = threads_[index];
+    ts->proactor = pb;
+    ts->tid = pthread_self();
+    tl_stall = ts;
+  });
+
+  stopped_ = false;
+  watchdog_ = thread{[this] { Watchdog(); }};
+}
+
+void StallDetector::Stop() {
+  if (!IsRunning())
+    return;
+
+  {
+    lock_guard lk(mu_);
+    stopped_ = true;
+  }
+  stop_cv_.notify_one();
+  watchdog_.join();
+
+  // Runs after the pending heartbeats, which reference the thread states.
+  pool_->AwaitBrief([](unsigned, ProactorBase*) { tl_stall = nullptr; });
+  for (ThreadState* ts : threads_)
+    delete ts;
+  threads_.clear();
+}
+
+absl::flat_hash_map<string, uint64_t> StallDetector::GetStallCounts() const {
+  lock_guard lk(mu_);
+  return stall_counts_;
+}
+
+auto StallDetector::GetStats() const -> Stats {
+  lock_guard lk(mu_);
+  return stats_;
+}
+
+void StallDetector::Watchdog() {
+  auto period = chrono::milliseconds(max(opts_.stall_ms / 4, 1u));
+
+  unique_lock lk(mu_);
+  while (!stop_cv_.wait_for(lk, period, [this] { return stopped_; })) {
+    lk.unlock();
+
+    uint64_t now = NowMs();
+    for (unsigned i = 0; i < threads_.size(); ++i) {
+      ThreadState* ts = threads_[i];
+      if (ts->acked.load(memory_order_acquire) == ts->sent) {
+        ts->stalled = false;
+
+        // The queue is full only if the proactor is overloaded or stalled. Skip the heartbeat
+        // rather than block the watchdog, the pending one detects the stall.
+        if (ts->proactor->IsTaskQueueFull())
+          continue;
+
+        uint64_t seq = ++ts->sent;
+        ts->sent_ms = now;
+        ts->proactor->DispatchBrief([ts, seq] { ts->acked.store(seq, memory_order_release); });
+        continue;
+      }
+
+      uint64_t late_ms = now - ts->sent_ms;
+      if (late_ms < opts_.stall_ms)
+        continue;
+
+      if (ts->stalled) {
+        lock_guard lk2(mu_);
+        stats_.max_stall_ms = max(stats_.max_stall_ms, late_ms);
+      } else {
+        ts->stalled = true;
+        OnStall(i, ts, late_ms);
+      }
+    }
+
+    lk.lock();
+  }
+}
+
+void StallDetector::OnStall(unsigned index, ThreadState* ts, uint64_t stall_ms) {
+  ts->captured.store(false, memory_order_relaxed);
+  pthread_kill(ts->tid, StallSignal());
+
+  auto deadline = chrono::steady_clock::now() + kCaptureTimeout;
+  bool captured = false;
+  while (!(captured = ts->captured.load(memory_order_acquire)) &&
+         chrono::steady_clock::now() < deadline) {
+    this_thread::sleep_for(chrono::microseconds(100));
+  }
+
+  // If the handler did not run in time, the thread has probably advanced anyway.
+  string name = captured ? (ts->fiber[0] ? ts->fiber : "unnamed") : "unknown";
+  uint64_t now = NowMs();
+  bool report = false;
+  {
+    lock_guard lk(mu_);
+    ++stall_counts_[name];
+    ++stats_.stalls;
+    stats_.max_stall_ms = max(stats_.max_stall_ms, stall_ms);
+    if (stats_.reports == 0 || now - last_report_ms_ >= opts_.report_interval_ms) {
+      report = true;
+      ++stats_.reports;
+      last_report_ms_ = now;
+    }
+  }
+
+  if (report) {
+    LOG(WARNING) << "Proactor " << index << " has not advanced for " << stall_ms
+                 << "ms, running fiber " << name << " at:\n"
+                 << (captured ? SymbolizeStacktrace(ts->pc, ts->depth) : "(not captured)\n");
+  }
+}
+
+}  // namespace fb2
+}  // namespace util
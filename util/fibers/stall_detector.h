@@ -0,0 +1,87 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace util {
+
+class ProactorPool;
+
+namespace fb2 {
+
+namespace detail {
+struct StallThreadState;
+}  // namespace detail
+
+// Watchdog that detects the proactor loops that do not advance, usually because a fiber runs
+// without yielding. A watchdog thread sends a heartbeat tasklet to every proactor and waits
+// for it to run, so idle proactors just wake up once per heartbeat. If a heartbeat is pending
+// for longer than stall_ms, the watchdog interrupts the stalled thread with a signal, whose
+// handler records the name and the stack of the running fiber. Each stall is counted once per
+// fiber name and reported to the log, at most once per report_interval_ms.
+// There can be one running detector per process.
+class StallDetector {
+ public:
+  struct Options {
+    uint32_t stall_ms = 100;
+    uint32_t report_interval_ms = 10000;
+  };
+
+  struct Stats {
+    uint64_t stalls = 0;
+    uint64_t reports = 0;  // stalls that were logged.
+    uint64_t max_stall_ms = 0;
+  };
+
+  explicit StallDetector(ProactorPool* pool) : StallDetector(pool, Options{}) {
+  }
+
+  StallDetector(ProactorPool* pool, const Options& opts);
+  ~StallDetector();
+
+  // Must not be called from a proactor thread.
+  void Start();
+  void Stop();
+
+  bool IsRunning() const {
+    return watchdog_.joinable();
+  }
+
+  // Number of stalls per name of the fiber that was running when they were detected.
+  absl::flat_hash_map<std::string, uint64_t> GetStallCounts() const;
+
+  Stats GetStats() const;
+
+ private:
+  using ThreadState = detail::StallThreadState;
+
+  void Watchdog();
+
+  // Called by the watchdog for a thread whose heartbeat is late by stall_ms.
+  void OnStall(unsigned index, ThreadState* ts, uint64_t stall_ms);
+
+  ProactorPool* pool_;
+  Options opts_;
+  std::vector<ThreadState*> threads_;
+  std::thread watchdog_;
+
+  mutable std::mutex mu_;
+  std::condition_variable stop_cv_;
+  bool stopped_ = false;
+  uint64_t last_report_ms_ = 0;
+
+  absl::flat_hash_map<std::string, uint64_t> stall_counts_;
+  Stats stats_;
+};
+
+}  // namespace fb2
+}  // namespace util
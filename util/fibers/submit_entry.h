@@ -5,6 +5,7 @@
 #pragma once
 
 #include <liburing/io_uring.h>
+#include <sys/stat.h>  // for struct statx
 
 namespace util {
 namespace fb2 {
@@ -32,6 +33,29 @@ class SubmitEntry {
     sqe_->len = mode;
   }
 
+  void PrepStatx(int dfd, const char* path, int flags, unsigned mask, struct statx* statxbuf) {
+    PrepFd(IORING_OP_STATX, dfd);
+    sqe_->addr = (__u64)path;
+    sqe_->len = mask;
+    sqe_->off = (__u64)statxbuf;
+    sqe_->statx_flags = flags;
+  }
+
+  void PrepUnlinkAt(int dfd, const char* path, int flags) {
+    PrepFd(IORING_OP_UNLINKAT, dfd);
+    sqe_->addr = (__u64)path;
+    sqe_->unlink_flags = flags;
+  }
+
+  void PrepRenameAt(int olddfd, const char* oldpath, int newdfd, const char* newpath,
+                    unsigned flags) {
+    PrepFd(IORING_OP_RENAMEAT, olddfd);
+    sqe_->addr = (__u64)oldpath;
+    sqe_->addr2 = (__u64)newpath;
+    sqe_->len = newdfd;
+    sqe_->rename_flags = flags;
+  }
+
   // mask is a bit-OR of POLLXXX flags.
   void PrepPollAdd(int fd, unsigned mask) {
     PrepFd(IORING_OP_POLL_ADD, fd);
@@ -47,13 +71,20 @@ class SubmitEntry {
     sqe_->addr = uid;
   }
 
-  void PrepAccept(int listen_fd, struct sockaddr* addr, unsigned addrlen, unsigned flags) {
+  // addrlen is a value-result argument, like with accept4(2). Both may be null.
+  void PrepAccept(int listen_fd, struct sockaddr* addr, socklen_t* addrlen, unsigned flags) {
     PrepFd(IORING_OP_ACCEPT, listen_fd);
     sqe_->addr = (__u64)addr;
-    sqe_->len = addrlen;
+    sqe_->addr2 = (__u64)addrlen;
     sqe_->accept_flags = flags;
   }
 
+  // Produces a completion with a new fd per accepted connection while IORING_CQE_F_MORE is set.
+  void PrepAcceptMultishot(int listen_fd, unsigned flags) {
+    PrepAccept(listen_fd, nullptr, nullptr, flags);
+    sqe_->ioprio |= IORING_ACCEPT_MULTISHOT;
+  }
+
   void PrepRecv(int fd, void* buf, size_t len, unsigned flags) {
     PrepFd(IORING_OP_RECV, fd);
     sqe_->addr = (__u64)buf;
@@ -61,6 +92,23 @@ class SubmitEntry {
     sqe_->msg_flags = flags;
   }
 
+  // Multishot recv that selects its buffers from the provided buffer ring buf_group.
+  void PrepRecvMultishot(int fd, uint16_t buf_group, unsigned flags) {
+    PrepRecv(fd, nullptr, 0, flags);
+    sqe_->ioprio |= IORING_RECV_MULTISHOT;
+    sqe_->flags |= IOSQE_BUFFER_SELECT;
+    sqe_->buf_group = buf_group;
+  }
+
+  // Multishot zero-copy receive (IORING_OP_RECV_ZC, linux 6.15) into the area of the
+  // interface queue zcrx_id. The completions are 32 bytes long and carry the area offset.
+  void PrepRecvZc(int fd, uint32_t zcrx_id) {
+    PrepFd(kOpRecvZc, fd);
+    sqe_->ioprio |= IORING_RECV_MULTISHOT;
+    sqe_->len = 0;  // unlimited.
+    sqe_->file_index = zcrx_id;
+  }
+
   void PrepRecvMsg(int fd, const struct msghdr* msg, unsigned flags) {
     PrepFd(IORING_OP_RECVMSG, fd);
     sqe_->addr = (__u64)msg;
@@ -116,6 +164,20 @@ class SubmitEntry {
     sqe_->rw_flags = flags;
   }
 
+  // flags: 0 or IORING_FSYNC_DATASYNC.
+  void PrepFsync(int fd, unsigned flags) {
+    PrepFd(IORING_OP_FSYNC, fd);
+    sqe_->fsync_flags = flags;
+  }
+
+  // flags is a bit-OR of SYNC_FILE_RANGE_XXX constants, see sync_file_range(2).
+  void PrepSyncFileRange(int fd, off_t offset, unsigned len, unsigned flags) {
+    PrepFd(IORING_OP_SYNC_FILE_RANGE, fd);
+    sqe_->off = offset;
+    sqe_->len = len;
+    sqe_->sync_range_flags = flags;
+  }
+
   void PrepFallocate(int fd, int mode, off_t offset, off_t len) {
     PrepFd(IORING_OP_FALLOCATE, fd);
     sqe_->off = offset;
@@ -144,6 +206,31 @@ class SubmitEntry {
     sqe_->msg_flags = flags;
   }
 
+  // Zero-copy send. Produces two completions: the result and, if it has IORING_CQE_F_MORE set,
+  // a notification with IORING_CQE_F_NOTIF once the kernel does not reference buf anymore.
+  void PrepSendZc(int fd, const void* buf, size_t len, unsigned flags, unsigned zc_flags = 0) {
+    PrepSend(fd, buf, len, flags);
+    sqe_->opcode = IORING_OP_SEND_ZC;
+    sqe_->ioprio = zc_flags;
+  }
+
+  void PrepSendMsgZc(int fd, const struct msghdr* msg, unsigned flags) {
+    PrepSendMsg(fd, msg, flags);
+    sqe_->opcode = IORING_OP_SENDMSG_ZC;
+  }
+
+  // Moves nbytes from fd_in to fd_out, one of which must be a pipe. The offset of a pipe
+  // must be -1.
+  void PrepSplice(int fd_in, int64_t off_in, int fd_out, int64_t off_out, unsigned nbytes,
+                  unsigned splice_flags) {
+    PrepFd(IORING_OP_SPLICE, fd_out);
+    sqe_->splice_fd_in = fd_in;
+    sqe_->splice_off_in = off_in;
+    sqe_->off = off_out;
+    sqe_->len = nbytes;
+    sqe_->splice_flags = splice_flags;
+  }
+
   void PrepConnect(int fd, const struct sockaddr* addr, socklen_t addrlen) {
     PrepFd(IORING_OP_CONNECT, fd);
     sqe_->addr = (__u64)addr;
@@ -194,6 +281,13 @@ class SubmitEntry {
     sqe_->cancel_flags = flags;
   }
 
+  // Cancels the request that was submitted with user_data.
+  void PrepCancel64(uint64_t user_data, unsigned flags) {
+    PrepFd(IORING_OP_ASYNC_CANCEL, -1);
+    sqe_->addr = user_data;
+    sqe_->cancel_flags = flags;
+  }
+
   void PrepMadvise(void* addr, off_t len, int advice) {
     PrepFd(IORING_OP_MADVISE, -1);
     sqe_->addr = (__u64)addr;
@@ -215,6 +309,9 @@ class SubmitEntry {
   }
 
  private:
+  // Spelled out because older uapi headers do not have it.
+  static constexpr uint8_t kOpRecvZc = 58;
+
   void PrepFd(int op, int fd) {
     sqe_->opcode = op;
     sqe_->fd = fd;
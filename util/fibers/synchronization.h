@@ -88,7 +88,9 @@ class EventCount {
   // waiter count in the least significant 32 bits.
   std::atomic_uint64_t val_;
 
-  base::SpinLock lock_;
+  // A queued lock, because a notification storm makes the threads of all the notifiers and
+  // the waiters contend for it.
+  base::MCSLock lock_;
   detail::WaitQueue wait_queue_;
 
   static constexpr uint64_t kAddWaiter = 1ULL;
@@ -388,44 +390,77 @@ class BlockingCounter {
   std::shared_ptr<EmbeddedBlockingCounter> counter_;
 };
 
+// Writer-preferring shared mutex. Readers do not enter while a writer holds the lock or
+// waits for it, so a stream of readers can not starve writers.
+// Readers and writers wait on separate event counts and unlock wakes only the side that can
+// make progress: the last reader wakes a single writer, a writer wakes the next writer if there
+// is one, and all the readers otherwise.
 class SharedMutex {
  public:
   bool try_lock() {
-    uint32_t expect = 0;
-    return state_.compare_exchange_strong(expect, WRITER, std::memory_order_acq_rel);
+    uint64_t value = state_.load(std::memory_order_relaxed);
+    while ((value & (WRITER | READER_MASK)) == 0) {
+      if (state_.compare_exchange_weak(value, value | WRITER, std::memory_order_acq_rel))
+        return true;
+    }
+    return false;
   }
 
   void lock() {
-    ec_.await([this] { return try_lock(); });
+    if (try_lock())
+      return;
+
+    state_.fetch_add(WAITER, std::memory_order_relaxed);
+    writer_ec_.await([this] { return try_lock(); });
+    state_.fetch_sub(WAITER, std::memory_order_relaxed);
   }
 
   bool try_lock_shared() {
-    uint32_t value = state_.fetch_add(READER, std::memory_order_acquire);
-    if (value & WRITER) {
-      state_.fetch_add(-READER, std::memory_order_release);
+    uint64_t value = state_.fetch_add(READER, std::memory_order_acquire);
+    if (value & (WRITER | WAITER_MASK)) {
+      ReleaseReader();
       return false;
     }
     return true;
   }
 
   void lock_shared() {
-    ec_.await([this] { return try_lock_shared(); });
+    reader_ec_.await([this] { return try_lock_shared(); });
   }
 
   void unlock() {
-    state_.fetch_and(~(WRITER), std::memory_order_relaxed);
-    ec_.notifyAll();
+    uint64_t prev = state_.fetch_and(~uint64_t(WRITER), std::memory_order_release);
+    if (prev & WAITER_MASK) {
+      writer_ec_.notify();
+    } else {
+      reader_ec_.notifyAll();
+    }
   }
 
   void unlock_shared() {
-    state_.fetch_add(-READER, std::memory_order_relaxed);
-    ec_.notifyAll();
+    ReleaseReader();
   }
 
  private:
-  enum : int32_t { READER = 4, WRITER = 1 };
-  EventCount ec_;
-  std::atomic_uint32_t state_{0};
+  // bit 0 - writer holds the lock, bits 1-31 - number of waiting writers,
+  // bits 32-63 - number of readers.
+  static constexpr uint64_t WRITER = 1;
+  static constexpr uint64_t WAITER = 2;
+  static constexpr uint64_t WAITER_MASK = 0xFFFFFFFEULL;
+  static constexpr uint64_t READER = 1ULL << 32;
+  static constexpr uint64_t READER_MASK = ~0xFFFFFFFFULL;
+
+  void ReleaseReader() {
+    uint64_t prev = state_.fetch_sub(READER, std::memory_order_release);
+
+    // The last reader hands the lock over to a waiting writer.
+    if ((prev & READER_MASK) == READER && (prev & WAITER_MASK)) {
+      writer_ec_.notify();
+    }
+  }
+
+  EventCount reader_ec_, writer_ec_;
+  std::atomic_uint64_t state_{0};
 };
 
 inline bool EventCount::notify() noexcept {
@@ -0,0 +1,267 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+// Stackless tasks based on C++20 coroutines. Available only when the compiler supports them,
+// see HELIO_HAS_TASKS.
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#define HELIO_HAS_TASKS 1
+
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+
+#include "base/logging.h"
+#include "util/fibers/proactor_base.h"
+
+#ifdef __linux__
+#include "util/fibers/uring_proactor.h"
+#endif
+
+namespace util {
+namespace fb2 {
+
+// Fire-and-forget stackless task. A suspended task keeps only its coroutine frame, usually
+// a few hundred bytes, instead of the stack of a fiber, so millions of them may be in flight.
+// Tasks run in the proactor loop beside the fibers: they are started and resumed by the
+// proactor callbacks, hence they should only briefly compute and co_await the awaitables
+// below. Calling fiber-blocking functions from a task blocks the proactor. Notifying
+// fiber primitives, e.g. Done::Notify or EventCount::notify, is fine.
+//
+//   Task Echo(UringProactor* p, int fd) {
+//     char buf[64];
+//     int res = co_await AwaitIo(p, [&](SubmitEntry& se) { se.PrepRecv(fd, buf, 64, 0); });
+//     ...
+//   }
+//
+//   SpawnTask(p, Echo(p, fd));
+class Task {
+ public:
+  struct promise_type {
+    Task get_return_object() noexcept {
+      return Task{std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+
+    // Started by SpawnTask.
+    std::suspend_always initial_suspend() const noexcept {
+      return {};
+    }
+
+    // Destroys the frame once the task completes.
+    std::suspend_never final_suspend() const noexcept {
+      return {};
+    }
+
+    void return_void() const noexcept {
+    }
+
+    void unhandled_exception() const noexcept {
+      LOG(FATAL) << "Unhandled exception in a task";
+    }
+  };
+
+  Task(Task&& o) noexcept : handle_(std::exchange(o.handle_, nullptr)) {
+  }
+
+  Task(const Task&) = delete;
+  Task& operator=(const Task&) = delete;
+
+  ~Task() {
+    if (handle_)
+      handle_.destroy();
+  }
+
+ private:
+  friend void SpawnTask(ProactorBase* p, Task task);
+
+  explicit Task(std::coroutine_handle<promise_type> h) : handle_(h) {
+  }
+
+  std::coroutine_handle<promise_type> handle_;
+};
+
+// Starts the task in the proactor thread of p. Can be called from any thread.
+inline void SpawnTask(ProactorBase* p, Task task) {
+  std::coroutine_handle<> h = std::exchange(task.handle_, nullptr);
+  p->DispatchBrief([h] { h.resume(); });
+}
+
+// co_await ResumeOn(p) continues the task in the proactor thread of p, in the next
+// loop iteration if it already runs there. Hence it also serves as a yield.
+class ResumeOn {
+ public:
+  explicit ResumeOn(ProactorBase* p) : proactor_(p) {
+  }
+
+  bool await_ready() const noexcept {
+    return false;
+  }
+
+  void await_suspend(std::coroutine_handle<> h) const {
+    proactor_->DispatchBrief([h] { h.resume(); });
+  }
+
+  void await_resume() const noexcept {
+  }
+
+ private:
+  ProactorBase* proactor_;
+};
+
+// Auto-reset event with a single waiting task. Notify() can be called from any thread or
+// fiber and resumes the waiting task in the proactor thread where it waits. A notification
+// without a waiter is kept until the next Wait().
+class TaskEvent {
+  class Awaiter;
+
+ public:
+  TaskEvent() = default;
+  TaskEvent(const TaskEvent&) = delete;
+  TaskEvent& operator=(const TaskEvent&) = delete;
+
+  void Notify() {
+    uintptr_t cur = state_.load(std::memory_order_acquire);
+    while (true) {
+      if (cur == kNotified)
+        return;
+      uintptr_t next = cur == kEmpty ? kNotified : kEmpty;
+      if (state_.compare_exchange_weak(cur, next, std::memory_order_acq_rel))
+        break;
+    }
+    if (cur != kEmpty) {
+      Awaiter* waiter = reinterpret_cast<Awaiter*>(cur);
+      waiter->proactor->DispatchBrief([h = waiter->handle] { h.resume(); });
+    }
+  }
+
+  // Must be awaited from a proactor thread by one task at a time.
+  Awaiter Wait() {
+    return Awaiter{this};
+  }
+
+ private:
+  static constexpr uintptr_t kEmpty = 0, kNotified = 1;
+
+  class Awaiter {
+   public:
+    explicit Awaiter(TaskEvent* ev) : ev_(ev) {
+    }
+
+    bool await_ready() noexcept {
+      uintptr_t expected = kNotified;
+      return ev_->state_.compare_exchange_strong(expected, kEmpty, std::memory_order_acq_rel);
+    }
+
+    // Returns false and continues if a notification arrived in the meantime.
+    bool await_suspend(std::coroutine_handle<> h) noexcept {
+      proactor = ProactorBase::me();
+      handle = h;
+      uintptr_t expected = kEmpty;
+      if (ev_->state_.compare_exchange_strong(expected, reinterpret_cast<uintptr_t>(this),
+                                              std::memory_order_acq_rel)) {
+        return true;
+      }
+      DCHECK_EQ(expected, kNotified) << "TaskEvent supports a single waiter";
+      ev_->state_.store(kEmpty, std::memory_order_relaxed);
+      return false;
+    }
+
+    void await_resume() const noexcept {
+    }
+
+    ProactorBase* proactor = nullptr;
+    std::coroutine_handle<> handle;
+
+   private:
+    TaskEvent* ev_;
+  };
+
+  std::atomic<uintptr_t> state_{kEmpty};
+};
+
+#ifdef __linux__
+
+// co_await AwaitIo(p, prep) submits an io_uring request prepared by prep(SubmitEntry&) and
+// returns its IoResult. The task is resumed inline in the completion callback, in the proactor
+// thread of p, which must be the calling thread.
+template <typename Prep> class UringOp {
+ public:
+  UringOp(UringProactor* p, Prep prep) : proactor_(p), prep_(std::move(prep)) {
+  }
+
+  bool await_ready() const noexcept {
+    return false;
+  }
+
+  void await_suspend(std::coroutine_handle<> h) {
+    DCHECK(ProactorBase::me() == proactor_);
+    handle_ = h;
+    SubmitEntry se =
+        proactor_->GetSubmitEntry([this](detail::FiberInterface*, UringProactor::IoResult res,
+                                         uint32_t flags) {
+          res_ = res;
+          flags_ = flags;
+          handle_.resume();
+        });
+    prep_(se);
+  }
+
+  UringProactor::IoResult await_resume() const noexcept {
+    return res_;
+  }
+
+  // The completion flags, valid after the operation resumed.
+  uint32_t flags() const {
+    return flags_;
+  }
+
+ private:
+  UringProactor* proactor_;
+  Prep prep_;
+  std::coroutine_handle<> handle_;
+  UringProactor::IoResult res_ = 0;
+  uint32_t flags_ = 0;
+};
+
+template <typename Prep> UringOp<Prep> AwaitIo(UringProactor* p, Prep prep) {
+  return UringOp<Prep>(p, std::move(prep));
+}
+
+// co_await SleepFor(p, duration) suspends the task with an io_uring timeout.
+class SleepFor {
+ public:
+  SleepFor(UringProactor* p, std::chrono::nanoseconds d) : proactor_(p) {
+    ts_.tv_sec = d.count() / 1000000000;
+    ts_.tv_nsec = d.count() % 1000000000;
+  }
+
+  bool await_ready() const noexcept {
+    return false;
+  }
+
+  void await_suspend(std::coroutine_handle<> h) {
+    DCHECK(ProactorBase::me() == proactor_);
+    handle_ = h;
+    SubmitEntry se = proactor_->GetSubmitEntry(
+        [this](detail::FiberInterface*, UringProactor::IoResult, uint32_t) { handle_.resume(); });
+    se.PrepTimeout(&ts_, false);
+  }
+
+  void await_resume() const noexcept {
+  }
+
+ private:
+  UringProactor* proactor_;
+  timespec ts_;
+  std::coroutine_handle<> handle_;
+};
+
+#endif  // __linux__
+
+}  // namespace fb2
+}  // namespace util
+
+#endif  // __cpp_impl_coroutine
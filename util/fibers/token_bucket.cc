@@ -0,0 +1,113 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/fibers/token_bucket.h"
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+
+#include "base/logging.h"
+#include "util/fibers/proactor_base.h"
+
+namespace util {
+namespace fb2 {
+
+using namespace std;
+
+namespace {
+
+uint64_t NowNanos() {
+  return chrono::duration_cast<chrono::nanoseconds>(
+             chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+}  // namespace
+
+TokenBucket::TokenBucket(uint64_t rate, uint64_t burst)
+    : rate_(rate), burst_(max<uint64_t>(burst, 1)), tokens_(burst_), last_ns_(NowNanos()) {
+}
+
+void TokenBucket::Refill() {
+  uint64_t now = NowNanos();
+  if (now <= last_ns_)
+    return;
+
+  // Advances last_ns_ only by the time that produced whole tokens, so that frequent refills
+  // do not lose the fractions.
+  unsigned __int128 tokens = (unsigned __int128)(now - last_ns_) * rate_ / 1000000000;
+  if (tokens == 0)
+    return;
+
+  if (tokens >= static_cast<unsigned __int128>(int64_t(burst_) - tokens_)) {
+    tokens_ = burst_;
+    last_ns_ = now;
+  } else {
+    tokens_ += int64_t(tokens);
+    last_ns_ += uint64_t(tokens * 1000000000 / rate_);
+  }
+}
+
+int64_t TokenBucket::Available() {
+  if (unlimited())
+    return INT64_MAX;
+  Refill();
+  return tokens_;
+}
+
+uint64_t TokenBucket::NanosUntilAvailable() {
+  int64_t avail = Available();
+  if (avail > 0)
+    return 0;
+  return uint64_t(((unsigned __int128)(1 - avail) * 1000000000 + rate_ - 1) / rate_);
+}
+
+void TokenBucket::Wait() {
+  while (uint64_t ns = NanosUntilAvailable()) {
+    ThisFiber::SleepFor(chrono::nanoseconds(ns));
+  }
+}
+
+SharedTokenBucket::SharedTokenBucket(uint64_t rate, uint64_t burst, unsigned num_threads,
+                                     uint64_t cache_tokens)
+    : unlimited_(rate == 0),
+      num_threads_(num_threads),
+      cache_tokens_(max<uint64_t>(cache_tokens ? cache_tokens : burst / 16, 1)),
+      caches_(new Cache[num_threads]),
+      shared_(rate, burst) {
+}
+
+int64_t& SharedTokenBucket::LocalCache() {
+  int32_t index = ProactorBase::me()->GetPoolIndex();
+  DCHECK(index >= 0 && unsigned(index) < num_threads_) << index;
+  return caches_[index].tokens;
+}
+
+void SharedTokenBucket::Wait() {
+  if (unlimited_)
+    return;
+
+  int64_t& local = LocalCache();
+  while (local <= 0) {
+    uint64_t wait_ns = 0;
+    {
+      lock_guard lk(mu_);
+      int64_t avail = shared_.Available();
+      if (avail > 0) {
+        // Repays the local debt and refills the cache.
+        int64_t grant = min(avail, cache_tokens_ - local);
+        shared_.Consume(grant);
+        local += grant;
+      } else {
+        wait_ns = shared_.NanosUntilAvailable();
+      }
+    }
+    if (wait_ns)
+      ThisFiber::SleepFor(chrono::nanoseconds(wait_ns));
+  }
+}
+
+}  // namespace fb2
+}  // namespace util
@@ -0,0 +1,91 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+#include "base/spinlock.h"
+
+namespace util {
+namespace fb2 {
+
+// Tokens accrue at rate per second up to burst. Consumers may overdraw the bucket, e.g. charge
+// the bytes after they were received, and the following Wait calls suspend the calling fiber
+// until the debt is repaid. Not thread-safe. rate 0 makes the bucket unlimited.
+class TokenBucket {
+ public:
+  TokenBucket(uint64_t rate, uint64_t burst);
+
+  bool unlimited() const {
+    return rate_ == 0;
+  }
+
+  uint64_t burst() const {
+    return burst_;
+  }
+
+  // Returns the tokens that can be consumed now, negative if the bucket is in debt.
+  int64_t Available();
+
+  // Returns how long it takes until Available() becomes positive, 0 if it is already.
+  uint64_t NanosUntilAvailable();
+
+  void Consume(uint64_t n) {
+    tokens_ -= int64_t(n);
+  }
+
+  // Suspends the calling fiber until Available() is positive.
+  void Wait();
+
+ private:
+  void Refill();
+
+  uint64_t rate_, burst_;
+  int64_t tokens_;
+  uint64_t last_ns_;
+};
+
+// Token bucket shared by the proactor threads of a pool, e.g. by all the connections of
+// a tenant. Every thread takes tokens from the shared bucket in chunks of cache_tokens and
+// serves its consumers from the local cache, so that the shared state is touched once per
+// chunk. The idle threads may keep up to cache_tokens each, hence cache_tokens should be
+// small compared to burst. Must be used from the threads of a pool with at most
+// num_threads proactors.
+class SharedTokenBucket {
+ public:
+  // cache_tokens 0 picks burst / 16.
+  SharedTokenBucket(uint64_t rate, uint64_t burst, unsigned num_threads,
+                    uint64_t cache_tokens = 0);
+
+  bool unlimited() const {
+    return unlimited_;
+  }
+
+  void Consume(uint64_t n) {
+    LocalCache() -= int64_t(n);
+  }
+
+  // Suspends the calling fiber until the cache of its thread has tokens.
+  void Wait();
+
+ private:
+  struct alignas(64) Cache {
+    int64_t tokens = 0;
+  };
+
+  int64_t& LocalCache();
+
+  const bool unlimited_;
+  const unsigned num_threads_;
+  const int64_t cache_tokens_;
+  std::unique_ptr<Cache[]> caches_;
+
+  base::SpinLock mu_;
+  TokenBucket shared_;  // guarded by mu_.
+};
+
+}  // namespace fb2
+}  // namespace util
@@ -0,0 +1,165 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/fibers/trace.h"
+
+#include <absl/flags/flag.h>
+#include <absl/time/clock.h>
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+
+#include "util/fibers/cycle_clock.h"
+#include "util/fibers/proactor_base.h"
+
+ABSL_FLAG(double, fiber_trace_sample_rate, 0.001,
+          "Probability of recording the spans of a trace created by NewTrace()");
+
+namespace util {
+namespace fb2 {
+
+using namespace std;
+
+namespace {
+
+// Ring of the last spans recorded by a thread. The mutex is taken by the owning thread and by
+// CollectSpans, so it's not contended in practice.
+struct SpanRing {
+  mutex mu;
+  uint64_t next = 0;
+  SpanRecord records[kTraceRingSize];
+};
+
+struct RingRegistry {
+  mutex mu;
+  vector<SpanRing*> rings;
+};
+
+RingRegistry& Registry() {
+  static RingRegistry* registry = new RingRegistry;
+  return *registry;
+}
+
+// Registers the ring of the thread upon the first recorded span and unregisters it when the
+// thread exits.
+class ThreadRing {
+ public:
+  ThreadRing() {
+    RingRegistry& reg = Registry();
+    lock_guard lk(reg.mu);
+    reg.rings.push_back(&ring_);
+  }
+
+  ~ThreadRing() {
+    RingRegistry& reg = Registry();
+    lock_guard lk(reg.mu);
+    reg.rings.erase(find(reg.rings.begin(), reg.rings.end(), &ring_));
+  }
+
+  SpanRing& ring() {
+    return ring_;
+  }
+
+ private:
+  SpanRing ring_;
+};
+
+SpanRing& LocalRing() {
+  thread_local ThreadRing thread_ring;
+  return thread_ring.ring();
+}
+
+// splitmix64, ids do not have to be cryptographically random.
+uint64_t NextId() {
+  thread_local uint64_t state = CycleClock::Now() ^ reinterpret_cast<uintptr_t>(&state);
+  uint64_t z;
+  do {
+    z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+  } while (z == 0);
+  return z;
+}
+
+uint64_t NowNs() {
+  return absl::GetCurrentTimeNanos();
+}
+
+}  // namespace
+
+TraceContext NewTrace() {
+  double rate = absl::GetFlag(FLAGS_fiber_trace_sample_rate);
+  uint64_t id = NextId();
+
+  // Compares the id, which is uniformly distributed, with the rate scaled to the range of ids.
+  bool sampled = rate >= 1 || (rate > 0 && double(id) < rate * 18446744073709551616.0);
+  return TraceContext{id, 0, sampled};
+}
+
+TraceContext NewTrace(bool sampled) {
+  return TraceContext{NextId(), 0, sampled};
+}
+
+TraceSpan::TraceSpan(const char* name) : fi_(detail::FiberActive()), name_(name) {
+  TraceContext ctx = fi_->trace_context();
+  if (!ctx.sampled)
+    return;
+
+  span_id_ = NextId();
+  parent_id_ = ctx.span_id;
+  start_ns_ = NowNs();
+  ctx.span_id = span_id_;
+  fi_->set_trace_context(ctx);
+}
+
+TraceSpan::~TraceSpan() {
+  if (span_id_ == 0)
+    return;
+
+  TraceContext ctx = fi_->trace_context();
+  ctx.span_id = parent_id_;
+  fi_->set_trace_context(ctx);
+
+  SpanRecord rec;
+  rec.trace_id = ctx.trace_id;
+  rec.span_id = span_id_;
+  rec.parent_id = parent_id_;
+  rec.name = name_;
+  rec.start_ns = start_ns_;
+  rec.end_ns = NowNs();
+  ProactorBase* proactor = ProactorBase::me();
+  rec.thread_index = proactor ? proactor->GetPoolIndex() : -1;
+  strncpy(rec.fiber, fi_->name(), sizeof(rec.fiber) - 1);
+  rec.fiber[sizeof(rec.fiber) - 1] = '\0';
+
+  SpanRing& ring = LocalRing();
+  lock_guard lk(ring.mu);
+  ring.records[ring.next++ % kTraceRingSize] = rec;
+}
+
+vector<SpanRecord> CollectSpans(uint64_t trace_id) {
+  vector<SpanRecord> res;
+  RingRegistry& reg = Registry();
+  {
+    lock_guard lk(reg.mu);
+    for (SpanRing* ring : reg.rings) {
+      lock_guard ring_lk(ring->mu);
+      size_t count = min<uint64_t>(ring->next, kTraceRingSize);
+      for (size_t i = 0; i < count; ++i) {
+        const SpanRecord& rec = ring->records[i];
+        if (trace_id == 0 || rec.trace_id == trace_id)
+          res.push_back(rec);
+      }
+    }
+  }
+
+  sort(res.begin(), res.end(),
+       [](const SpanRecord& a, const SpanRecord& b) { return a.start_ns < b.start_ns; });
+  return res;
+}
+
+}  // namespace fb2
+}  // namespace util
@@ -0,0 +1,103 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "util/fibers/detail/fiber_interface.h"
+
+namespace util {
+namespace fb2 {
+
+// Lightweight request tracing. A TraceContext is kept inside the active fiber, new fibers
+// inherit it from the fiber that starts them and ProactorBase::DispatchBrief (hence Dispatch,
+// Await and AwaitBrief) and the FiberQueue and FiberQueueThreadPool queues run their functions
+// under the context of the caller. For example:
+//   TraceScope scope(NewTrace());
+//   TraceSpan span("handle_request");
+//   shard->Await([] { TraceSpan span("lookup"); ... });  // "lookup" is a child of the request.
+// The spans of the sampled traces are recorded into per-thread rings of kTraceRingSize spans,
+// which CollectSpans() reads, see RegisterTracezHandler for their http export.
+
+constexpr unsigned kTraceRingSize = 1024;
+
+// Returns the context of the active fiber.
+inline TraceContext CurrentTrace() {
+  return detail::FiberActive()->trace_context();
+}
+
+// Returns a context with a new trace id, sampled with the probability of the
+// --fiber_trace_sample_rate flag.
+TraceContext NewTrace();
+TraceContext NewTrace(bool sampled);
+
+// Sets the context of the active fiber for the lifetime of the scope.
+class TraceScope {
+  TraceScope(const TraceScope&) = delete;
+  void operator=(const TraceScope&) = delete;
+
+ public:
+  explicit TraceScope(const TraceContext& ctx)
+      : fi_(detail::FiberActive()), prev_(fi_->trace_context()) {
+    fi_->set_trace_context(ctx);
+  }
+
+  ~TraceScope() {
+    fi_->set_trace_context(prev_);
+  }
+
+ private:
+  detail::FiberInterface* fi_;
+  TraceContext prev_;
+};
+
+// A child span of the current span of the active fiber. If the trace is sampled, the span is
+// the current one for its lifetime and is recorded by the thread it ends in.
+// name must outlive the recorded span, i.e. should be a string literal.
+class TraceSpan {
+  TraceSpan(const TraceSpan&) = delete;
+  void operator=(const TraceSpan&) = delete;
+
+ public:
+  explicit TraceSpan(const char* name);
+  ~TraceSpan();
+
+ private:
+  detail::FiberInterface* fi_;
+  const char* name_;
+  uint64_t span_id_ = 0;
+  uint64_t parent_id_ = 0;
+  uint64_t start_ns_ = 0;
+};
+
+struct SpanRecord {
+  uint64_t trace_id;
+  uint64_t span_id;
+  uint64_t parent_id;  // 0 for the root spans.
+  const char* name;
+  uint64_t start_ns;  // wall time.
+  uint64_t end_ns;
+  int32_t thread_index;  // pool index of the proactor that ended the span, -1 for other threads.
+  char fiber[24];
+};
+
+// Returns the spans in the rings of the live threads ordered by their start time, only the
+// spans of trace_id if it's not 0.
+std::vector<SpanRecord> CollectSpans(uint64_t trace_id = 0);
+
+namespace detail {
+
+// Returns a function that runs f under ctx.
+template <typename F> auto TraceWrap(const TraceContext& ctx, F&& f) {
+  return [ctx, f = std::forward<F>(f)]() mutable {
+    TraceScope scope(ctx);
+    f();
+  };
+}
+
+}  // namespace detail
+}  // namespace fb2
+}  // namespace util
@@ -7,8 +7,13 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 
+#include <atomic>
+#include <limits>
+#include <mutex>
+
 #include "base/logging.h"
 #include "util/fibers/uring_proactor.h"
+#include "util/proactor_pool.h"
 
 namespace util {
 
@@ -21,6 +26,12 @@ using nonstd::make_unexpected;
 
 namespace {
 
+Proactor* GetProactor() {
+  ProactorBase* me = ProactorBase::me();
+  DCHECK(me->GetKind() == ProactorBase::IOURING);
+  return static_cast<Proactor*>(CHECK_NOTNULL(me));
+}
+
 class ReadFileImpl : public ReadonlyFile {
  public:
   ReadFileImpl(int fd, size_t sz, Proactor* proactor)
@@ -65,6 +76,43 @@ class WriteFileImpl final : public WriteFile {
   Proactor* proactor_;
 };
 
+class DirectWriteFileImpl final : public WriteFile {
+ public:
+  DirectWriteFileImpl(Proactor* p, std::string_view file_name, const DirectWriteOptions& opts);
+
+  virtual ~DirectWriteFileImpl();
+
+  error_code Close() final;
+
+  Result<size_t> WriteSome(const iovec* v, uint32_t len) final;
+
+  error_code Open(int flags, bool append);
+
+ private:
+  struct Buffer {
+    uint8_t* data = nullptr;
+    std::optional<unsigned> buf_idx;  // set if the buffer is registered.
+    bool in_flight = false;
+  };
+
+  // Writes the current buffer and switches to the next one.
+  void Submit(uint32_t len);
+  void OnComplete(detail::FiberInterface* current, unsigned index, uint32_t len,
+                  Proactor::IoResult res);
+  void ReleaseBuffers();
+
+  int fd_ = -1;
+  Proactor* proactor_;
+  std::vector<Buffer> bufs_;
+  size_t buf_size_;
+  unsigned cur_ = 0;
+  size_t cur_len_ = 0;  // bytes filled in the current buffer.
+  off_t offset_ = 0;    // file offset of the current buffer.
+  unsigned pending_ = 0;
+  int error_ = 0;
+  detail::FiberInterface* waiter_ = nullptr;
+};
+
 /* generated by: http://ascii.gaetanroger.fr/ with Big font
 //  _____                 _                           _        _   _
 // |_   _|               | |                         | |      | | (_)
@@ -239,6 +287,198 @@ Result<size_t> WriteFileImpl::WriteSome(const iovec* v, uint32_t len) {
   return res;
 }
 
+DirectWriteFileImpl::DirectWriteFileImpl(Proactor* p, std::string_view file_name,
+                                         const DirectWriteOptions& opts)
+    : WriteFile(file_name), proactor_(p) {
+  buf_size_ = (std::max<size_t>(opts.buf_size, 1) + UringBuf::kAlign - 1) / UringBuf::kAlign *
+              UringBuf::kAlign;
+  bufs_.resize(std::max(opts.num_buffers, 2u));
+
+  bool registered = proactor_->GetRegisteredBufferStats().regions > 0;
+  for (Buffer& buf : bufs_) {
+    if (registered) {
+      if (auto ubuf = proactor_->RequestBuffer(buf_size_); ubuf) {
+        buf.data = ubuf->bytes.data();
+        buf.buf_idx = ubuf->buf_idx;
+        continue;
+      }
+    }
+    buf.data = static_cast<uint8_t*>(aligned_alloc(UringBuf::kAlign, buf_size_));
+    CHECK(buf.data);
+  }
+}
+
+DirectWriteFileImpl::~DirectWriteFileImpl() {
+  if (fd_ >= 0) {
+    error_code ec = Close();
+    LOG_IF(WARNING, ec) << "Error closing " << create_file_name_ << ": " << ec;
+  }
+  ReleaseBuffers();
+}
+
+error_code DirectWriteFileImpl::Open(int flags, bool append) {
+  CHECK_EQ(fd_, -1);
+
+  FiberCall fc(proactor_);
+  fc->PrepOpenAt(AT_FDCWD, create_file_name_.c_str(), flags, 0644);
+  FiberCall::IoResult io_res = fc.Get();
+
+  if (io_res < 0) {
+    return error_code{-io_res, system_category()};
+  }
+  fd_ = io_res;
+
+  if (append) {
+    struct statx stx;
+    FiberCall stat_fc(proactor_);
+    stat_fc->PrepStatx(fd_, "", AT_EMPTY_PATH, STATX_SIZE, &stx);
+    io_res = stat_fc.Get();
+    if (io_res < 0) {
+      return error_code{-io_res, system_category()};
+    }
+    if (stx.stx_size % UringBuf::kAlign != 0) {
+      return make_error_code(errc::invalid_argument);
+    }
+    offset_ = stx.stx_size;
+  }
+
+  return error_code{};
+}
+
+Result<size_t> DirectWriteFileImpl::WriteSome(const iovec* v, uint32_t len) {
+  if (error_)
+    return make_unexpected(error_code{error_, system_category()});
+
+  size_t total = 0;
+  for (uint32_t i = 0; i < len; ++i) {
+    const uint8_t* src = reinterpret_cast<const uint8_t*>(v[i].iov_base);
+    size_t left = v[i].iov_len;
+    while (left > 0) {
+      size_t sz = std::min(left, buf_size_ - cur_len_);
+      memcpy(bufs_[cur_].data + cur_len_, src, sz);
+      cur_len_ += sz;
+      src += sz;
+      left -= sz;
+      if (cur_len_ == buf_size_) {
+        Submit(buf_size_);
+        if (error_)
+          return make_unexpected(error_code{error_, system_category()});
+      }
+    }
+    total += v[i].iov_len;
+  }
+  return total;
+}
+
+void DirectWriteFileImpl::Submit(uint32_t len) {
+  Buffer& buf = bufs_[cur_];
+  DCHECK(!buf.in_flight);
+
+  auto cb = [this, index = cur_, len](detail::FiberInterface* current, Proactor::IoResult res,
+                                      uint32_t) { OnComplete(current, index, len, res); };
+  SubmitEntry se = proactor_->GetSubmitEntry(std::move(cb));
+  if (buf.buf_idx) {
+    se.PrepWriteFixed(fd_, buf.data, len, offset_, *buf.buf_idx);
+  } else {
+    se.PrepWrite(fd_, buf.data, len, offset_);
+  }
+  buf.in_flight = true;
+  ++pending_;
+
+  offset_ += len;
+  cur_len_ = 0;
+  cur_ = (cur_ + 1) % bufs_.size();
+
+  // Wait until the next buffer is written. We may be woken up by completions of other buffers.
+  while (bufs_[cur_].in_flight) {
+    waiter_ = detail::FiberActive();
+    waiter_->Suspend();
+  }
+  waiter_ = nullptr;
+}
+
+void DirectWriteFileImpl::OnComplete(detail::FiberInterface* current, unsigned index,
+                                     uint32_t len, Proactor::IoResult res) {
+  bufs_[index].in_flight = false;
+  --pending_;
+
+  if (error_ == 0) {
+    if (res < 0)
+      error_ = -res;
+    else if (uint32_t(res) < len)  // short writes happen only when the device is full.
+      error_ = ENOSPC;
+  }
+
+  if (waiter_) {
+    detail::FiberInterface* waiter = waiter_;
+    waiter_ = nullptr;
+    ActivateSameThread(current, waiter);
+  }
+}
+
+error_code DirectWriteFileImpl::Close() {
+  if (fd_ < 0)
+    return error_code{};
+
+  // The aligned part of the last buffer is written directly. The buffer is not reused
+  // afterwards, so the tail stays in place while the write is in flight.
+  const uint8_t* tail = bufs_[cur_].data;
+  size_t aligned = cur_len_ / UringBuf::kAlign * UringBuf::kAlign;
+  size_t tail_len = cur_len_ - aligned;
+  if (aligned > 0 && error_ == 0) {
+    Submit(aligned);
+    tail += aligned;
+  }
+
+  while (pending_ > 0) {
+    waiter_ = detail::FiberActive();
+    waiter_->Suspend();
+  }
+  waiter_ = nullptr;
+
+  // O_DIRECT can not write the unaligned tail, so we write it through the page cache.
+  // Clearing the flag does not block, unlike padding the tail and truncating the file back.
+  if (tail_len > 0 && error_ == 0) {
+    int flags = fcntl(fd_, F_GETFL);
+    if (flags < 0 || fcntl(fd_, F_SETFL, flags & ~O_DIRECT) < 0) {
+      error_ = errno;
+    }
+    while (tail_len > 0 && error_ == 0) {
+      FiberCall fc(proactor_);
+      fc->PrepWrite(fd_, tail, tail_len, offset_);
+      FiberCall::IoResult io_res = fc.Get();
+      if (io_res <= 0) {
+        error_ = io_res < 0 ? -io_res : ENOSPC;
+        break;
+      }
+      tail += io_res;
+      tail_len -= io_res;
+      offset_ += io_res;
+    }
+  }
+
+  error_code ec = CloseFile(fd_, proactor_);
+  fd_ = -1;
+  ReleaseBuffers();
+
+  if (error_)
+    return error_code{error_, system_category()};
+  return ec;
+}
+
+void DirectWriteFileImpl::ReleaseBuffers() {
+  for (Buffer& buf : bufs_) {
+    if (!buf.data)
+      continue;
+    if (buf.buf_idx) {
+      proactor_->ReturnBuffer(UringBuf{{buf.data, buf_size_}, buf.buf_idx});
+    } else {
+      free(buf.data);
+    }
+    buf.data = nullptr;
+  }
+}
+
 }  // namespace
 
 io::Result<io::WriteFile*> OpenWrite(std::string_view path, io::WriteFile::Options opts) {
@@ -261,6 +501,25 @@ io::Result<io::WriteFile*> OpenWrite(std::string_view path, io::WriteFile::Optio
   return impl.release();
 }
 
+io::Result<io::WriteFile*> OpenDirectWrite(std::string_view path,
+                                           const DirectWriteOptions& opts) {
+  int flags = O_CREAT | O_WRONLY | O_CLOEXEC | O_DIRECT;
+  if (!opts.append)
+    flags |= O_TRUNC;
+
+  ProactorBase* me = ProactorBase::me();
+  DCHECK(me->GetKind() == ProactorBase::IOURING);
+
+  Proactor* p = static_cast<Proactor*>(CHECK_NOTNULL(me));
+
+  unique_ptr<DirectWriteFileImpl> impl(new DirectWriteFileImpl{p, path, opts});
+  error_code ec = impl->Open(flags, opts.append);
+  if (ec)
+    return make_unexpected(ec);
+
+  return impl.release();
+}
+
 io::Result<io::ReadonlyFile*> OpenRead(std::string_view path) {
   int flags = O_RDONLY | O_CLOEXEC;
 
@@ -369,6 +628,50 @@ std::error_code LinuxFile::ReadFixed(io::MutableBytes dest, off_t offset, unsign
   return error_code{};
 }
 
+error_code LinuxFile::Sync() {
+  FiberCall fc(proactor_);
+  fc->PrepFsync(fd_, 0);
+  if (is_direct_)
+    fc->sqe()->flags |= IOSQE_FIXED_FILE;
+  FiberCall::IoResult io_res = fc.Get();
+
+  return io_res < 0 ? error_code{-io_res, system_category()} : error_code{};
+}
+
+error_code LinuxFile::DataSync() {
+  FiberCall fc(proactor_);
+  fc->PrepFsync(fd_, IORING_FSYNC_DATASYNC);
+  if (is_direct_)
+    fc->sqe()->flags |= IOSQE_FIXED_FILE;
+  FiberCall::IoResult io_res = fc.Get();
+
+  return io_res < 0 ? error_code{-io_res, system_category()} : error_code{};
+}
+
+error_code LinuxFile::WriteBehind(off_t offset, off_t len) {
+  DCHECK_GE(offset, 0);
+  DCHECK_GE(len, 0);
+
+  // The length of a request is 32 bit wide.
+  constexpr off_t kMaxRange = 1u << 30;
+  do {
+    off_t range = len == 0 ? 0 : std::min(len, kMaxRange);
+
+    FiberCall fc(proactor_);
+    fc->PrepSyncFileRange(fd_, offset, range, SYNC_FILE_RANGE_WRITE);
+    if (is_direct_)
+      fc->sqe()->flags |= IOSQE_FIXED_FILE;
+    FiberCall::IoResult io_res = fc.Get();
+    if (io_res < 0)
+      return error_code{-io_res, system_category()};
+
+    offset += range;
+    len -= range;
+  } while (len > 0);
+
+  return {};
+}
+
 error_code LinuxFile::Write(const iovec* iov, unsigned iovcnt, off_t offset, unsigned flags) {
   auto cb = [this, flags, offset](const iovec* iov, unsigned iovcnt) mutable {
     auto res = this->WriteSome(iov, iovcnt, offset, flags);
@@ -433,23 +736,628 @@ void LinuxFile::WriteAsync(io::Bytes src, off_t offset, AsyncCb cb) {
     se.sqe()->flags |= IOSQE_FIXED_FILE;
 }
 
+error_code GroupSync::Sync() {
+  ++num_requests_;
+
+  // Any sync that starts from now on covers the writes that preceded this call.
+  const uint64_t target = started_ + 1;
+  while (done_ < target && !ec_) {
+    if (in_flight_) {
+      done_ec_.await([&] { return !in_flight_; });
+      continue;
+    }
+
+    // Become the leader for all the fibers that wait for this sync.
+    in_flight_ = true;
+    uint64_t seq = ++started_;
+    error_code ec = datasync_ ? file_->DataSync() : file_->Sync();
+    if (ec && !ec_)
+      ec_ = ec;
+    done_ = seq;
+    in_flight_ = false;
+    done_ec_.notifyAll();
+  }
+
+  return ec_;
+}
+
+IoBatch::IoBatch(LinuxFile* file) : file_(file) {
+  DCHECK(file_->fd_ >= 0);
+}
+
+IoBatch::~IoBatch() {
+  CHECK_EQ(pending_, 0u) << "IoBatch destroyed with pending operations";
+}
+
+unsigned IoBatch::AddOp(const Op& op) {
+  ops_.push_back(op);
+  results_.push_back(0);
+  return ops_.size() - 1;
+}
+
+unsigned IoBatch::AddRead(io::MutableBytes dest, off_t offset) {
+  return AddOp(Op{.opcode = IORING_OP_READ, .buf = dest.data(), .len = unsigned(dest.size()),
+                  .offset = offset});
+}
+
+unsigned IoBatch::AddWrite(io::Bytes src, off_t offset) {
+  return AddOp(Op{.opcode = IORING_OP_WRITE,
+                  .buf = const_cast<uint8_t*>(src.data()),
+                  .len = unsigned(src.size()),
+                  .offset = offset});
+}
+
+unsigned IoBatch::AddFsync(bool datasync) {
+  return AddOp(
+      Op{.opcode = IORING_OP_FSYNC, .fsync_flags = datasync ? IORING_FSYNC_DATASYNC : 0u});
+}
+
+void IoBatch::Link() {
+  DCHECK_GT(ops_.size(), next_submit_);
+  ops_.back().link = true;
+}
+
+void IoBatch::Submit() {
+  UringProactor* proactor = file_->proactor_;
+
+  while (next_submit_ < ops_.size()) {
+    // Linked operations must occupy consecutive submission entries, so we reserve the space
+    // for the whole chain before queuing it.
+    size_t chain_end = next_submit_;
+    while (chain_end + 1 < ops_.size() && ops_[chain_end].link)
+      ++chain_end;
+    uint32_t chain_len = chain_end - next_submit_ + 1;
+    if (chain_len > 1) {
+      proactor->WaitTillAvailable(chain_len);
+    }
+
+    for (; next_submit_ <= chain_end; ++next_submit_) {
+      const Op& op = ops_[next_submit_];
+      unsigned index = next_submit_;
+
+      auto cb = [this, index](detail::FiberInterface* current, UringProactor::IoResult res,
+                              uint32_t) {
+        results_[index] = res;
+        if (--pending_ == 0 && waiter_) {
+          detail::FiberInterface* waiter = waiter_;
+          waiter_ = nullptr;
+          ActivateSameThread(current, waiter);
+        }
+      };
+
+      SubmitEntry se = proactor->GetSubmitEntry(std::move(cb));
+      switch (op.opcode) {
+        case IORING_OP_READ:
+          se.PrepRead(file_->fd_, op.buf, op.len, op.offset);
+          break;
+        case IORING_OP_WRITE:
+          se.PrepWrite(file_->fd_, op.buf, op.len, op.offset);
+          break;
+        case IORING_OP_FSYNC:
+          se.PrepFsync(file_->fd_, op.fsync_flags);
+          break;
+        default:
+          LOG(DFATAL) << "Unsupported opcode " << int(op.opcode);
+      }
+
+      if (file_->is_direct_)
+        se.sqe()->flags |= IOSQE_FIXED_FILE;
+
+      // The last operation in the batch can not link to anything.
+      if (op.link && next_submit_ < chain_end)
+        se.sqe()->flags |= IOSQE_IO_LINK;
+      ++pending_;
+    }
+  }
+}
+
+void IoBatch::Wait() {
+  Submit();
+
+  // We may be woken up by other notifiers, so we check pending_ upon each resume.
+  while (pending_ > 0) {
+    waiter_ = detail::FiberActive();
+    waiter_->Suspend();
+  }
+  waiter_ = nullptr;
+}
+
+error_code IoBatch::GetError() const {
+  for (size_t i = 0; i < next_submit_; ++i) {
+    if (results_[i] < 0)
+      return error_code{-results_[i], system_category()};
+  }
+  return error_code{};
+}
+
+void IoBatch::Clear() {
+  CHECK_EQ(pending_, 0u);
+  ops_.clear();
+  results_.clear();
+  next_submit_ = 0;
+}
+
+ReadaheadSource::ReadaheadSource(LinuxFile* file, const Options& opts)
+    : file_(file), next_offset_(opts.offset) {
+  DCHECK(file_->fd_ >= 0);
+
+  uint64_t max_length = numeric_limits<off_t>::max() - opts.offset;
+  end_offset_ = opts.offset + off_t(std::min(opts.length, max_length));
+
+  chunk_size_ = (std::max<size_t>(opts.chunk_size, 1) + UringBuf::kAlign - 1) /
+                UringBuf::kAlign * UringBuf::kAlign;
+  chunks_.resize(std::max(opts.num_chunks, 1u));
+
+  UringProactor* proactor = file_->proactor_;
+  bool registered = proactor->GetRegisteredBufferStats().regions > 0;
+  for (Chunk& chunk : chunks_) {
+    if (registered) {
+      if (auto ubuf = proactor->RequestBuffer(chunk_size_); ubuf) {
+        chunk.data = ubuf->bytes.data();
+        chunk.buf_idx = ubuf->buf_idx;
+        continue;
+      }
+    }
+
+    // Aligned, so that the reads work also for files opened with O_DIRECT.
+    chunk.data = static_cast<uint8_t*>(aligned_alloc(UringBuf::kAlign, chunk_size_));
+    CHECK(chunk.data);
+  }
+}
+
+ReadaheadSource::~ReadaheadSource() {
+  // The kernel may still write into the chunks.
+  while (pending_ > 0) {
+    waiter_ = detail::FiberActive();
+    waiter_->Suspend();
+  }
+  waiter_ = nullptr;
+
+  for (Chunk& chunk : chunks_) {
+    if (chunk.buf_idx) {
+      file_->proactor_->ReturnBuffer(UringBuf{{chunk.data, chunk_size_}, chunk.buf_idx});
+    } else {
+      free(chunk.data);
+    }
+  }
+}
+
+void ReadaheadSource::Issue(unsigned index, off_t offset) {
+  Chunk& chunk = chunks_[index];
+  DCHECK(!chunk.in_flight);
+
+  chunk.offset = offset;
+  chunk.consumed = 0;
+  chunk.skip = 0;
+
+  // Past the end of the source, the chunk reads as eof.
+  if (offset >= end_offset_) {
+    chunk.res = 0;
+    return;
+  }
+
+  chunk.in_flight = true;
+  ++pending_;
+
+  auto cb = [this, index](detail::FiberInterface* current, UringProactor::IoResult res,
+                          uint32_t) {
+    chunks_[index].res = res;
+    chunks_[index].in_flight = false;
+    --pending_;
+    if (waiter_) {
+      detail::FiberInterface* waiter = waiter_;
+      waiter_ = nullptr;
+      ActivateSameThread(current, waiter);
+    }
+  };
+
+  SubmitEntry se = file_->proactor_->GetSubmitEntry(std::move(cb));
+  if (chunk.buf_idx) {
+    se.PrepReadFixed(file_->fd_, chunk.data, chunk_size_, offset, *chunk.buf_idx);
+  } else {
+    se.PrepRead(file_->fd_, chunk.data, chunk_size_, offset);
+  }
+  if (file_->is_direct_)
+    se.sqe()->flags |= IOSQE_FIXED_FILE;
+}
+
+void ReadaheadSource::WaitForChunk(const Chunk& chunk) {
+  // We may be woken up by completions of other chunks.
+  while (chunk.in_flight) {
+    waiter_ = detail::FiberActive();
+    waiter_->Suspend();
+  }
+  waiter_ = nullptr;
+}
+
+void ReadaheadSource::Restart(off_t offset) {
+  for (const Chunk& chunk : chunks_)
+    WaitForChunk(chunk);
+
+  size_t skip = offset % UringBuf::kAlign;
+  offset -= skip;
+
+  head_ = 0;
+  for (unsigned i = 0; i < chunks_.size(); ++i) {
+    Issue(i, offset);
+    offset += chunk_size_;
+  }
+  next_offset_ = offset;
+  chunks_[0].consumed = chunks_[0].skip = skip;
+}
+
+io::Result<size_t> ReadaheadSource::ReadSome(const iovec* v, uint32_t len) {
+  if (!started_) {
+    started_ = true;
+    Restart(next_offset_);
+  }
+
+  size_t copied = 0, iov_pos = 0;
+  while (len > 0 && !eof_) {
+    Chunk& chunk = chunks_[head_];
+
+    // Return what we have instead of blocking.
+    if (chunk.in_flight && copied > 0)
+      break;
+    WaitForChunk(chunk);
+
+    if (chunk.res < 0) {
+      if (copied > 0)
+        break;
+
+      // Keep the error for the following calls.
+      return make_unexpected(error_code{-chunk.res, system_category()});
+    }
+
+    off_t pos = chunk.offset + chunk.consumed;
+
+    // A read that ends before the restart offset is at the end of file.
+    if (pos >= end_offset_ || size_t(chunk.res) <= chunk.skip) {
+      eof_ = true;
+      break;
+    }
+
+    size_t sz = std::min<size_t>(chunk.res - chunk.consumed, v->iov_len - iov_pos);
+    sz = std::min<size_t>(sz, end_offset_ - pos);
+    memcpy(reinterpret_cast<uint8_t*>(v->iov_base) + iov_pos, chunk.data + chunk.consumed, sz);
+    chunk.consumed += sz;
+    copied += sz;
+    iov_pos += sz;
+    if (iov_pos == v->iov_len) {
+      ++v;
+      --len;
+      iov_pos = 0;
+    }
+
+    if (chunk.consumed < size_t(chunk.res))
+      continue;
+
+    if (size_t(chunk.res) < chunk_size_) {
+      // Short reads happen at the end of file, but the following chunks were issued at
+      // offsets that assumed a full read. Issue the reads again from the actual position.
+      Restart(chunk.offset + chunk.res);
+    } else {
+      Issue(head_, next_offset_);
+      next_offset_ += chunk_size_;
+      head_ = (head_ + 1) % chunks_.size();
+    }
+  }
+
+  return copied;
+}
+
+namespace {
+
+// Returns the offset that follows the first '\n' at or after pos - 1, or size if there is none.
+io::Result<off_t> FindLineStart(LinuxFile* file, off_t pos, off_t size) {
+  char buf[1024];
+  for (off_t offset = pos - 1; offset < size;) {
+    iovec v{buf, sizeof(buf)};
+    io::Result<size_t> res = file->ReadSome(&v, 1, offset, 0);
+    if (!res)
+      return make_unexpected(res.error());
+    if (*res == 0)
+      break;
+    if (const char* eol = static_cast<const char*>(memchr(buf, '\n', *res)); eol)
+      return offset + (eol - buf) + 1;
+    offset += *res;
+  }
+  return size;
+}
+
+// Lines that a range parses ahead of its turn in the ordered mode.
+struct PendingLines {
+  string data;
+  vector<size_t> ends;  // end offsets of the lines in data.
+
+  size_t bytes() const {
+    return data.size() + ends.size() * sizeof(size_t);
+  }
+
+  void Append(absl::Span<const string_view> lines) {
+    for (string_view line : lines) {
+      data.append(line);
+      ends.push_back(data.size());
+    }
+  }
+
+  // Passes the lines to cb as a single batch.
+  void Flush(unsigned range, uint64_t* next_line, const LineBatchCb& cb) {
+    if (ends.empty())
+      return;
+
+    vector<string_view> lines(ends.size());
+    size_t start = 0;
+    for (size_t i = 0; i < ends.size(); ++i) {
+      lines[i] = string_view(data).substr(start, ends[i] - start);
+      start = ends[i];
+    }
+    cb(LineBatch{range, *next_line, lines});
+    *next_line += lines.size();
+    data.clear();
+    ends.clear();
+  }
+};
+
+// Shared state of ReadLinesParallel.
+class ParallelLines {
+ public:
+  ParallelLines(string_view path, const ParallelLinesOptions& opts, const LineBatchCb& cb)
+      : path_(path), opts_(opts), cb_(cb) {
+  }
+
+  // Splits [0, size) into the ranges, the range starts are found by FindBounds.
+  void Init(off_t size) {
+    range_size_ = std::max<size_t>(opts_.range_size, 1);
+    unsigned num_ranges = std::max<off_t>((size + range_size_ - 1) / range_size_, 1);
+    bounds_.assign(num_ranges + 1, 0);
+    bounds_[num_ranges] = size;
+  }
+
+  unsigned num_ranges() const {
+    return bounds_.size() - 1;
+  }
+
+  // Finds the starts of the ranges first, first + step, ...
+  void FindBounds(unsigned first, unsigned step);
+
+  // Takes the ranges in the file order until none is left.
+  void ReadRanges();
+
+  void SetError(error_code ec) {
+    lock_guard lk(mu_);
+    if (!ec_)
+      ec_ = ec;
+    failed_.store(true, memory_order_relaxed);
+  }
+
+  error_code error() const {
+    return ec_;
+  }
+
+ private:
+  void ReadRange(LinuxFile* file, unsigned range);
+
+  string path_;
+  const ParallelLinesOptions& opts_;
+  const LineBatchCb& cb_;
+  size_t range_size_ = 0;
+  vector<off_t> bounds_;  // range i is [bounds_[i], bounds_[i + 1]).
+
+  atomic_uint next_range_{0};
+  atomic_uint turn_{0};  // ordered mode: the range that passes its batches to cb.
+  EventCount turn_ec_;
+
+  mutex mu_;
+  error_code ec_;
+  atomic_bool failed_{false};
+};
+
+void ParallelLines::FindBounds(unsigned first, unsigned step) {
+  if (first >= num_ranges())
+    return;
+
+  auto res = OpenLinux(path_, O_RDONLY | O_CLOEXEC, 0);
+  if (!res) {
+    SetError(res.error());
+    return;
+  }
+
+  off_t size = bounds_.back();
+  for (unsigned i = first; i < num_ranges(); i += step) {
+    io::Result<off_t> start = FindLineStart(res->get(), off_t(i) * range_size_, size);
+    if (!start) {
+      SetError(start.error());
+      break;
+    }
+    bounds_[i] = *start;
+  }
+  (*res)->Close();
+}
+
+void ParallelLines::ReadRanges() {
+  unique_ptr<LinuxFile> file;
+  if (auto res = OpenLinux(path_, O_RDONLY | O_CLOEXEC, 0); res) {
+    file = std::move(*res);
+  } else {
+    SetError(res.error());
+  }
+
+  // Even after an error, the ranges are taken so that the ordered mode passes the turns on.
+  while (true) {
+    unsigned range = next_range_.fetch_add(1, memory_order_relaxed);
+    if (range >= num_ranges())
+      break;
+    ReadRange(file.get(), range);
+  }
+
+  if (file)
+    file->Close();
+}
+
+void ParallelLines::ReadRange(LinuxFile* file, unsigned range) {
+  PendingLines pending;
+  uint64_t next_line = 0;  // of the next batch that is passed to cb.
+  auto is_turn = [&] { return turn_.load(memory_order_acquire) == range; };
+
+  off_t start = bounds_[range], end = bounds_[range + 1];
+  if (file && start < end && !failed_.load(memory_order_relaxed)) {
+    ReadaheadSource::Options ro = opts_.readahead;
+    ro.offset = start;
+    ro.length = end - start;
+    ReadaheadSource source(file, ro);
+    io::LineReader lr(&source, DO_NOT_TAKE_OWNERSHIP, opts_.buf_log);
+
+    for (auto lines = lr.NextBatch(); !lines.empty(); lines = lr.NextBatch()) {
+      if (opts_.ordered && !is_turn()) {
+        pending.Append(lines);
+        if (pending.bytes() < opts_.max_pending)
+          continue;
+        turn_ec_.await(is_turn);
+        pending.Flush(range, &next_line, cb_);
+        continue;
+      }
+
+      pending.Flush(range, &next_line, cb_);
+      cb_(LineBatch{range, next_line, lines});
+      next_line += lines.size();
+    }
+
+    if (lr.status())
+      SetError(lr.status());
+  }
+
+  if (opts_.ordered) {
+    turn_ec_.await(is_turn);
+    pending.Flush(range, &next_line, cb_);
+    turn_.store(range + 1, memory_order_release);
+    turn_ec_.notifyAll();
+  }
+}
+
+}  // namespace
+
+error_code ReadLinesParallel(string_view path, ProactorPool* pool,
+                             const ParallelLinesOptions& opts, const LineBatchCb& cb) {
+  struct statx stx;
+  error_code ec = pool->at(0)->Await([&] { return Statx(AT_FDCWD, path, 0, STATX_SIZE, &stx); });
+  if (ec)
+    return ec;
+
+  ParallelLines pl(path, opts, cb);
+  pl.Init(stx.stx_size);
+
+  unsigned pool_size = pool->size();
+  pool->AwaitFiberOnAll(
+      [&](unsigned index, ProactorBase*) { pl.FindBounds(index + 1, pool_size); });
+  if (pl.error())
+    return pl.error();
+
+  pool->AwaitFiberOnAll([&](ProactorBase*) { pl.ReadRanges(); });
+  return pl.error();
+}
+
 io::Result<std::unique_ptr<LinuxFile>> OpenLinux(std::string_view path, int flags, mode_t mode) {
-  ProactorBase* me = ProactorBase::me();
-  DCHECK(me->GetKind() == ProactorBase::IOURING);
+  io::Result<int> fd = OpenAt(AT_FDCWD, path, flags, mode);
+  if (!fd)
+    return make_unexpected(fd.error());
+  return make_unique<LinuxFile>(*fd, GetProactor());
+}
 
-  Proactor* p = static_cast<Proactor*>(CHECK_NOTNULL(me));
-  FiberCall::IoResult io_res;
+io::Result<int> OpenAt(int dfd, string_view path, int flags, mode_t mode) {
+  string cpath(path);
+  FiberCall fc(GetProactor());
+  fc->PrepOpenAt(dfd, cpath.c_str(), flags, mode);
+  FiberCall::IoResult io_res = fc.Get();
+  if (io_res < 0)
+    return make_unexpected(error_code{-io_res, system_category()});
+  return io_res;
+}
 
-  {
-    FiberCall fc(p);
-    fc->PrepOpenAt(AT_FDCWD, path.data(), flags, mode);
-    io_res = fc.Get();
+error_code Statx(int dfd, string_view path, int flags, unsigned mask, struct statx* dest) {
+  string cpath(path);
+  FiberCall fc(GetProactor());
+  fc->PrepStatx(dfd, cpath.c_str(), flags, mask, dest);
+  FiberCall::IoResult io_res = fc.Get();
+  return io_res < 0 ? error_code{-io_res, system_category()} : error_code{};
+}
 
-    if (io_res < 0) {
-      return make_unexpected(error_code{-io_res, system_category()});
+error_code UnlinkAt(int dfd, string_view path, int flags) {
+  string cpath(path);
+  FiberCall fc(GetProactor());
+  fc->PrepUnlinkAt(dfd, cpath.c_str(), flags);
+  FiberCall::IoResult io_res = fc.Get();
+  return io_res < 0 ? error_code{-io_res, system_category()} : error_code{};
+}
+
+error_code RenameAt(int olddfd, string_view oldpath, int newdfd, string_view newpath,
+                    unsigned flags) {
+  string cold(oldpath), cnew(newpath);
+  FiberCall fc(GetProactor());
+  fc->PrepRenameAt(olddfd, cold.c_str(), newdfd, cnew.c_str(), flags);
+  FiberCall::IoResult io_res = fc.Get();
+  return io_res < 0 ? error_code{-io_res, system_category()} : error_code{};
+}
+
+void StatxMany(const vector<string>& paths, int flags, unsigned mask, unsigned max_in_flight,
+               const StatxCb& cb) {
+  struct Slot {
+    struct statx stx;
+    size_t index;
+    int res;
+  };
+
+  struct State {
+    vector<Slot> slots;
+    vector<unsigned> completed;
+    detail::FiberInterface* waiter = nullptr;
+  } state;
+
+  state.slots.resize(std::min<size_t>(std::max(max_in_flight, 1u), paths.size()));
+  vector<unsigned> free_slots(state.slots.size()), batch;
+  for (unsigned i = 0; i < free_slots.size(); ++i)
+    free_slots[i] = i;
+
+  Proactor* p = GetProactor();
+  size_t next = 0;
+  unsigned pending = 0;
+  while (next < paths.size() || pending > 0) {
+    for (; next < paths.size() && !free_slots.empty(); ++next) {
+      unsigned slot = free_slots.back();
+      free_slots.pop_back();
+      state.slots[slot].index = next;
+
+      auto io_cb = [st = &state, slot](detail::FiberInterface* current,
+                                       UringProactor::IoResult res, uint32_t) {
+        st->slots[slot].res = res;
+        st->completed.push_back(slot);
+        if (st->waiter) {
+          detail::FiberInterface* waiter = st->waiter;
+          st->waiter = nullptr;
+          ActivateSameThread(current, waiter);
+        }
+      };
+      SubmitEntry se = p->GetSubmitEntry(std::move(io_cb));
+      se.PrepStatx(AT_FDCWD, paths[next].c_str(), flags, mask, &state.slots[slot].stx);
+      ++pending;
+    }
+
+    while (state.completed.empty()) {
+      state.waiter = detail::FiberActive();
+      state.waiter->Suspend();
+    }
+    state.waiter = nullptr;
+
+    // cb may suspend, during which more completions are queued.
+    batch.swap(state.completed);
+    for (unsigned slot : batch) {
+      const Slot& s = state.slots[slot];
+      --pending;
+      cb(s.index, s.res, s.stx);
+      free_slots.push_back(slot);
     }
+    batch.clear();
   }
-  return make_unique<LinuxFile>(io_res, p);
 }
 
 }  // namespace fb2
@@ -4,15 +4,30 @@
 
 #pragma once
 
+#include <sys/stat.h>   // for struct statx
 #include <sys/types.h>  // for mode_t
 
+#include <functional>
+#include <optional>
+#include <vector>
+
 #include "io/file.h"
+#include "io/line_reader.h"
+#include "util/fibers/synchronization.h"
 
 namespace util {
 
+class ProactorPool;
+
 namespace fb2 {
 
 class UringProactor;
+class IoBatch;
+class ReadaheadSource;
+
+namespace detail {
+class FiberInterface;
+}  // namespace detail
 
 // The following functions must be called in the context of Proactor thread.
 // The objects should be accessed and used in the context of the same thread where
@@ -22,9 +37,28 @@ io::Result<io::WriteFile*> OpenWrite(std::string_view path,
 
 io::Result<io::ReadonlyFile*> OpenRead(std::string_view path);
 
+struct DirectWriteOptions : public io::WriteFile::Options {
+  // Size of a single write, rounded up to 4KB.
+  size_t buf_size = 1 << 18;
+
+  // Number of buffers: one is filled while the others are being written.
+  unsigned num_buffers = 2;
+};
+
+// Opens the file with O_DIRECT, bypassing the page cache. Data is accumulated in 4KB-aligned
+// buffers that are written asynchronously, so the caller blocks only when all the buffers are
+// in flight. The buffers are taken from the registered buffers of the proactor if possible.
+// The unaligned tail is written upon Close() through the page cache.
+// With append option, the size of the existing file must be aligned to 4KB.
+io::Result<io::WriteFile*> OpenDirectWrite(std::string_view path,
+                                           const DirectWriteOptions& opts = DirectWriteOptions());
+
 // Uring based linux file. Similarly, works only within the same proactor thread where it has
 // been open. Unlike classic IO classes can read and write at specified offsets.
 class LinuxFile {
+  friend class IoBatch;
+  friend class ReadaheadSource;
+
  public:
   LinuxFile(int fd, UringProactor* proactor);
   ~LinuxFile();
@@ -63,6 +97,17 @@ class LinuxFile {
 
   std::error_code ReadFixed(io::MutableBytes dest, off_t offset, unsigned buf_index);
 
+  // fsync(2) and fdatasync(2) via IORING_OP_FSYNC, they suspend only the calling fiber.
+  // See also GroupSync.
+  std::error_code Sync();
+  std::error_code DataSync();
+
+  // Starts the writeback of the dirty pages in [offset, offset + len) without waiting for it,
+  // see SYNC_FILE_RANGE_WRITE of sync_file_range(2). Calling it after each written chunk keeps
+  // the dirty pages of an append-only file bounded, so that the following Sync is short.
+  // Does not make the data durable. len 0 means until the end of the file.
+  std::error_code WriteBehind(off_t offset, off_t len);
+
   // int - io result.
   using AsyncCb = std::function<void(int)>;
 
@@ -84,8 +129,217 @@ class LinuxFile {
   UringProactor* proactor_;
 };
 
+// A batch of LinuxFile operations at arbitrary offsets that are queued together, so that
+// they reach io_uring in a single submission, and are awaited as a whole.
+// Operations can be linked into IOSQE_IO_LINK chains (e.g. write followed by fsync): a linked
+// operation starts only after the previous one succeeded, otherwise it fails with -ECANCELED.
+// Must be used in the proactor thread of the file. The batch and the buffers must stay valid
+// until Wait() returns.
+class IoBatch {
+ public:
+  explicit IoBatch(LinuxFile* file);
+  ~IoBatch();
+
+  IoBatch(const IoBatch&) = delete;
+  IoBatch& operator=(const IoBatch&) = delete;
+
+  // Add functions return the index of the operation in results().
+  unsigned AddRead(io::MutableBytes dest, off_t offset);
+  unsigned AddWrite(io::Bytes src, off_t offset);
+  unsigned AddFsync(bool datasync = false);
+
+  // Links the last added operation with the next one.
+  void Link();
+
+  // Submits the operations that were added since the last call without waiting for them.
+  void Submit();
+
+  // Submits the remaining operations and suspends until all of them complete.
+  void Wait();
+
+  // Per-operation io results: number of bytes transferred or -errno.
+  const std::vector<int>& results() const {
+    return results_;
+  }
+
+  // Returns the error of the first failed operation or an empty error code.
+  std::error_code GetError() const;
+
+  // Resets the batch, so it can be reused. Must not have pending operations.
+  void Clear();
+
+ private:
+  struct Op {
+    uint8_t opcode;
+    bool link = false;
+    unsigned fsync_flags = 0;
+    void* buf = nullptr;
+    unsigned len = 0;
+    off_t offset = 0;
+  };
+
+  unsigned AddOp(const Op& op);
+
+  LinuxFile* file_;
+  std::vector<Op> ops_;
+  std::vector<int> results_;
+  size_t next_submit_ = 0;
+  unsigned pending_ = 0;
+  detail::FiberInterface* waiter_ = nullptr;
+};
+
+// Merges the concurrent sync requests of many fibers into as few fsync calls as possible,
+// e.g. for group commit of a write-ahead log. Sync() returns once a sync that started after
+// the call has completed, hence the data written before the call is durable. While a sync is
+// in flight, all the fibers that call Sync() wait for it and then share a single next sync.
+// The first failure is sticky, since the kernel may drop the dirty pages upon a writeback
+// error. Must be used in the proactor thread of the file. Does not own the file.
+class GroupSync {
+ public:
+  // If datasync is true, uses fdatasync semantics.
+  explicit GroupSync(LinuxFile* file, bool datasync = true) : file_(file), datasync_(datasync) {
+  }
+
+  GroupSync(const GroupSync&) = delete;
+  GroupSync& operator=(const GroupSync&) = delete;
+
+  std::error_code Sync();
+
+  // Number of Sync() calls and of the syncs that were issued for them.
+  uint64_t num_requests() const {
+    return num_requests_;
+  }
+
+  uint64_t num_syncs() const {
+    return started_;
+  }
+
+ private:
+  LinuxFile* file_;
+  bool datasync_;
+  bool in_flight_ = false;
+  uint64_t started_ = 0;  // number of the issued syncs.
+  uint64_t done_ = 0;     // number of the completed syncs.
+  uint64_t num_requests_ = 0;
+  std::error_code ec_;
+  EventCount done_ec_;
+};
+
+// Sequential source over LinuxFile that keeps up to num_chunks reads of chunk_size bytes in
+// flight ahead of the consumer, so that reading large files is bound by the disk bandwidth
+// rather than by the latency of individual requests. Can be passed to io::LineReader.
+// Chunks are taken from the registered buffers of the proactor if possible.
+// Must be used in the proactor thread of the file. Does not own the file.
+class ReadaheadSource : public io::Source {
+ public:
+  struct Options {
+    size_t chunk_size = 1 << 20;  // rounded up to 4KB.
+    unsigned num_chunks = 4;
+    off_t offset = 0;  // initial file offset.
+
+    // The source ends after length bytes, the reads past offset + length are not issued.
+    uint64_t length = UINT64_MAX;
+  };
+
+  explicit ReadaheadSource(LinuxFile* file) : ReadaheadSource(file, Options{}) {
+  }
+
+  ReadaheadSource(LinuxFile* file, const Options& opts);
+  ~ReadaheadSource();
+
+  ReadaheadSource(const ReadaheadSource&) = delete;
+  ReadaheadSource& operator=(const ReadaheadSource&) = delete;
+
+  using io::Source::ReadSome;
+  io::Result<size_t> ReadSome(const iovec* v, uint32_t len) final;
+
+ private:
+  struct Chunk {
+    uint8_t* data = nullptr;
+    std::optional<unsigned> buf_idx;  // set if the buffer is registered.
+    off_t offset = 0;
+    int res = 0;        // io result of the read.
+    size_t consumed = 0;
+    size_t skip = 0;  // the bytes before the restart offset, see Restart.
+    bool in_flight = false;
+  };
+
+  void Issue(unsigned index, off_t offset);
+
+  // Waits for all the reads and issues them again starting from offset. The reads start at
+  // offset rounded down to UringBuf::kAlign, as O_DIRECT requires, and the first chunk skips
+  // the bytes before it.
+  void Restart(off_t offset);
+  void WaitForChunk(const Chunk& chunk);
+
+  LinuxFile* file_;
+  std::vector<Chunk> chunks_;
+  size_t chunk_size_;
+  unsigned head_ = 0;
+  off_t next_offset_;  // offset of the next chunk to issue.
+  off_t end_offset_;
+  bool started_ = false;
+  bool eof_ = false;
+  unsigned pending_ = 0;
+  detail::FiberInterface* waiter_ = nullptr;
+};
+
+// A batch of lines passed to the callback of ReadLinesParallel.
+struct LineBatch {
+  unsigned range;       // index of the byte range, the ranges follow in the file order.
+  uint64_t first_line;  // number of the first line within its range, starting from 0.
+  absl::Span<const std::string_view> lines;
+};
+
+struct ParallelLinesOptions {
+  // The file is split into ranges of about range_size bytes that end at line boundaries.
+  // The proactors take the ranges in the file order as they become free.
+  size_t range_size = 64 << 20;
+
+  // If true, cb receives the batches one at a time in the file order, otherwise it is called
+  // concurrently from the proactor threads.
+  bool ordered = false;
+
+  // Ordered mode: bytes of lines that a range parses ahead while the preceding ranges are
+  // consumed. The lines are copied, and the range blocks once it has buffered that much.
+  size_t max_pending = 8 << 20;
+
+  // Of the source of every range, offset and length are ignored.
+  ReadaheadSource::Options readahead;
+  uint32_t buf_log = io::LineReader::DEFAULT_BUF_LOG;
+};
+
+using LineBatchCb = std::function<void(const LineBatch& batch)>;
+
+// Reads the lines of the file at path with io::LineReader on all the proactors of pool, which
+// must be io_uring proactors. The proactors first find the line boundaries of the ranges and
+// then parse the ranges in parallel, each one with its own LinuxFile and ReadaheadSource.
+// The lines of a batch are valid only during the call to cb. Returns the first error.
+std::error_code ReadLinesParallel(std::string_view path, ProactorPool* pool,
+                                  const ParallelLinesOptions& opts, const LineBatchCb& cb);
+
 // Equivalent to open(2) call. "flags" is the OR mask of O_XXX constants.
 io::Result<std::unique_ptr<LinuxFile>> OpenLinux(std::string_view path, int flags, mode_t mode);
 
+// Path based calls that mirror openat(2), statx(2), unlinkat(2) and renameat2(2), e.g. dfd
+// can be AT_FDCWD. They are submitted to io_uring and suspend only the calling fiber.
+// Require kernel 5.6 for statx and 5.11 for unlinkat and renameat, fail with EINVAL on older
+// kernels. OpenAt returns the file descriptor.
+io::Result<int> OpenAt(int dfd, std::string_view path, int flags, mode_t mode);
+std::error_code Statx(int dfd, std::string_view path, int flags, unsigned mask,
+                      struct statx* dest);
+std::error_code UnlinkAt(int dfd, std::string_view path, int flags);
+std::error_code RenameAt(int olddfd, std::string_view oldpath, int newdfd,
+                         std::string_view newpath, unsigned flags = 0);
+
+// Stats the paths relative to the current directory with up to max_in_flight concurrent
+// statx calls, which io_uring runs in its worker threads, so that the scans of network
+// filesystems are not bound by the latency of a single call. Calls cb(index, res, stx) in the
+// calling fiber as the calls complete, where res is 0 or -errno for paths[index].
+// Completions that arrive while cb runs are queued, hence cb may suspend.
+using StatxCb = std::function<void(size_t index, int res, const struct statx& stx)>;
+void StatxMany(const std::vector<std::string>& paths, int flags, unsigned mask,
+               unsigned max_in_flight, const StatxCb& cb);
+
 }  // namespace fb2
 }  // namespace util
@@ -4,10 +4,18 @@
 
 #include "util/fibers/uring_file.h"
 
+#include <absl/strings/str_cat.h>
+
+#include <map>
+#include <mutex>
 #include <thread>
 
 #include "base/gtest.h"
 #include "base/logging.h"
+#include "io/line_reader.h"
+#include "util/fibers/append_log.h"
+#include "util/fibers/fiber_file.h"
+#include "util/fibers/pool.h"
 #include "util/fibers/uring_proactor.h"
 
 using namespace std;
@@ -102,5 +110,540 @@ TEST_F(UringFileTest, WriteAsync) {
   });
 }
 
+TEST_F(UringFileTest, OpTracing) {
+  string path = base::GetTestTempPath("trace.log");
+  constexpr uint16_t kTag = 1000;
+  constexpr unsigned kNumWrites = 10;
+
+  proactor_->Await([&] {
+    auto res = OpenLinux(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    ASSERT_TRUE(res);
+    unique_ptr<LinuxFile> lf = std::move(*res);
+
+    unsigned hook_calls = 0;
+    proactor_->EnableOpTracing(true, [&](uint8_t, uint16_t, uint64_t, uint64_t) {
+      ++hook_calls;
+    });
+
+    BlockingCounter bc{kNumWrites};
+    for (unsigned i = 0; i < kNumWrites; ++i) {
+      lf->WriteAsync(io::Buffer("hello"), i * 5, [bc](int res) mutable {
+        EXPECT_EQ(5, res);
+        bc->Dec();
+      });
+    }
+    bc->Wait();
+
+    // Tagged entries are also accounted per tag.
+    Done done;
+    SubmitEntry se = proactor_->GetSubmitEntry(
+        [done](detail::FiberInterface*, int, uint32_t) mutable { done.Notify(); }, kTag);
+    se.PrepFsync(lf->fd(), 0);
+    done.Wait();
+
+    const auto& stats = proactor_->op_trace_stats();
+    ASSERT_EQ(1u, stats.by_opcode.count(IORING_OP_WRITE));
+    EXPECT_EQ(kNumWrites, stats.by_opcode.at(IORING_OP_WRITE)->kernel_usec.count());
+    EXPECT_EQ(kNumWrites, stats.by_opcode.at(IORING_OP_WRITE)->queue_usec.count());
+    ASSERT_EQ(1u, stats.by_opcode.count(IORING_OP_FSYNC));
+    ASSERT_EQ(1u, stats.by_tag.size());
+    EXPECT_EQ(1u, stats.by_tag.at(kTag)->kernel_usec.count());
+    EXPECT_GE(hook_calls, kNumWrites + 1);
+
+    proactor_->EnableOpTracing(false);
+    bc->Add(1);
+    lf->WriteAsync(io::Buffer("hello"), 0, [bc](int) mutable { bc->Dec(); });
+    bc->Wait();
+    EXPECT_EQ(kNumWrites, stats.by_opcode.at(IORING_OP_WRITE)->kernel_usec.count());
+    ASSERT_FALSE(lf->Close());
+  });
+}
+
+TEST_F(UringFileTest, Batch) {
+  string path = base::GetTestTempPath("batch.log");
+  proactor_->Await([&] {
+    auto res = OpenLinux(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    ASSERT_TRUE(res);
+    unique_ptr<LinuxFile> lf = std::move(*res);
+
+    constexpr unsigned kNumBlocks = 8;
+    char wbuf[kNumBlocks][64];
+    IoBatch batch(lf.get());
+    for (unsigned i = 0; i < kNumBlocks; ++i) {
+      memset(wbuf[i], 'a' + i, sizeof(wbuf[i]));
+      batch.AddWrite(io::Buffer(wbuf[i]), i * sizeof(wbuf[i]));
+    }
+    batch.Link();
+    unsigned fsync_index = batch.AddFsync(true);
+    batch.Wait();
+
+    ASSERT_FALSE(batch.GetError());
+    for (unsigned i = 0; i < kNumBlocks; ++i) {
+      EXPECT_EQ(int(sizeof(wbuf[i])), batch.results()[i]);
+    }
+    EXPECT_EQ(0, batch.results()[fsync_index]);
+
+    // Read the blocks back in reverse order.
+    char rbuf[kNumBlocks][64];
+    batch.Clear();
+    for (unsigned i = 0; i < kNumBlocks; ++i) {
+      unsigned block = kNumBlocks - 1 - i;
+      batch.AddRead(io::MutableBuffer(rbuf[i]), block * sizeof(rbuf[i]));
+    }
+    batch.Wait();
+    ASSERT_FALSE(batch.GetError());
+
+    for (unsigned i = 0; i < kNumBlocks; ++i) {
+      EXPECT_EQ(int(sizeof(rbuf[i])), batch.results()[i]);
+      EXPECT_EQ(0, memcmp(rbuf[i], wbuf[kNumBlocks - 1 - i], sizeof(rbuf[i])));
+    }
+
+    EXPECT_FALSE(lf->Close());
+  });
+}
+
+TEST_F(UringFileTest, DirectWrite) {
+  string path = base::GetTestTempPath("direct.log");
+  string expected;
+  for (unsigned i = 0; i < 5000; ++i) {
+    expected.append(to_string(i)).push_back(',');
+  }
+
+  proactor_->Await([&] {
+    DirectWriteOptions opts;
+    opts.buf_size = 8192;
+    opts.num_buffers = 3;
+    auto res = OpenDirectWrite(path, opts);
+    if (!res && res.error() == errc::invalid_argument) {
+      GTEST_SKIP() << "O_DIRECT is not supported by the filesystem";
+    }
+    ASSERT_TRUE(res);
+    unique_ptr<io::WriteFile> wf(*res);
+
+    // Write in uneven chunks to cross the buffer boundaries.
+    string_view src = expected;
+    while (!src.empty()) {
+      size_t sz = std::min<size_t>(src.size(), 3001);
+      ASSERT_FALSE(wf->Write(src.substr(0, sz)));
+      src.remove_prefix(sz);
+    }
+    ASSERT_FALSE(wf->Close());
+
+    auto rres = OpenRead(path);
+    ASSERT_TRUE(rres);
+    unique_ptr<io::ReadonlyFile> rf(*rres);
+    ASSERT_EQ(expected.size(), rf->Size());
+
+    string actual(expected.size(), '\0');
+    auto read_res =
+        rf->Read(0, io::MutableBytes{reinterpret_cast<uint8_t*>(actual.data()), actual.size()});
+    ASSERT_TRUE(read_res);
+    EXPECT_EQ(expected.size(), *read_res);
+    EXPECT_EQ(expected, actual);
+    EXPECT_FALSE(rf->Close());
+  });
+}
+
+TEST_F(UringFileTest, Readahead) {
+  string path = base::GetTestTempPath("readahead.log");
+  constexpr unsigned kNumLines = 20000;
+
+  proactor_->Await([&] {
+    auto res = OpenLinux(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    ASSERT_TRUE(res);
+    unique_ptr<LinuxFile> lf = std::move(*res);
+
+    string contents;
+    for (unsigned i = 0; i < kNumLines; ++i) {
+      contents.append(to_string(i)).push_back('\n');
+    }
+    ASSERT_FALSE(lf->Write(io::Buffer(contents), 0, 0));
+
+    ReadaheadSource::Options opts;
+    opts.chunk_size = 4096;
+    opts.num_chunks = 3;
+    ReadaheadSource source(lf.get(), opts);
+
+    io::LineReader lr(&source, DO_NOT_TAKE_OWNERSHIP, 10);
+    string_view line;
+    unsigned num_lines = 0;
+    while (lr.Next(&line)) {
+      ASSERT_EQ(to_string(num_lines), line);
+      ++num_lines;
+    }
+    EXPECT_FALSE(lr.status());
+    EXPECT_EQ(kNumLines, num_lines);
+
+    // Stays at eof.
+    char buf[16];
+    auto read_res = source.ReadSome(io::MutableBuffer(buf));
+    ASSERT_TRUE(read_res);
+    EXPECT_EQ(0u, *read_res);
+
+    EXPECT_FALSE(lf->Close());
+  });
+}
+
+TEST_F(UringFileTest, ReadaheadDirect) {
+  string path = base::GetTestTempPath("readahead_direct.log");
+  string contents;
+  for (unsigned i = 0; contents.size() < 50000; ++i) {
+    contents.append(to_string(i)).push_back(',');
+  }
+
+  proactor_->Await([&] {
+    auto res = OpenLinux(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    ASSERT_TRUE(res);
+    ASSERT_FALSE((*res)->Write(io::Buffer(contents), 0, 0));
+    EXPECT_FALSE((*res)->Close());
+
+    res = OpenLinux(path, O_RDONLY | O_DIRECT, 0);
+    if (!res && res.error() == errc::invalid_argument) {
+      GTEST_SKIP() << "O_DIRECT is not supported by the filesystem";
+    }
+    ASSERT_TRUE(res);
+    unique_ptr<LinuxFile> lf = std::move(*res);
+
+    // Both the initial offset and the end of file are not aligned, the latter restarts
+    // the reads in the middle of a block.
+    ReadaheadSource::Options opts;
+    opts.chunk_size = 4096;
+    opts.num_chunks = 3;
+    opts.offset = 1234;
+    ReadaheadSource source(lf.get(), opts);
+
+    string actual;
+    char buf[1000];
+    while (true) {
+      auto read_res = source.ReadSome(io::MutableBuffer(buf));
+      ASSERT_TRUE(read_res) << read_res.error();
+      if (*read_res == 0)
+        break;
+      actual.append(buf, *read_res);
+    }
+    EXPECT_EQ(contents.substr(1234), actual);
+    EXPECT_FALSE(lf->Close());
+  });
+}
+
+TEST_F(UringFileTest, ReadLinesParallel) {
+  string path = base::GetTestTempPath("parallel_lines.txt");
+  vector<string> expected;
+  string contents;
+  for (unsigned i = 0; i < 5000; ++i) {
+    // Some of the lines are longer than a range.
+    string line = absl::StrCat(i, string(i % 100 == 0 ? 3000 : i % 7, 'x'));
+    contents.append(line).append(i % 3 ? "\n" : "\r\n");
+    expected.push_back(std::move(line));
+  }
+
+  proactor_->Await([&] {
+    auto res = OpenLinux(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    ASSERT_TRUE(res);
+    ASSERT_FALSE((*res)->Write(io::Buffer(contents), 0, 0));
+    EXPECT_FALSE((*res)->Close());
+  });
+
+  unique_ptr<ProactorPool> pool(Pool::IOUring(16, 3));
+  pool->Run();
+
+  ParallelLinesOptions opts;
+  opts.range_size = 2000;
+  opts.readahead.chunk_size = 4096;
+
+  // The batches of every range arrive in order.
+  mutex mu;
+  map<unsigned, vector<string>> ranges;
+  error_code ec = ReadLinesParallel(path, pool.get(), opts, [&](const LineBatch& batch) {
+    lock_guard lk(mu);
+    vector<string>& lines = ranges[batch.range];
+    EXPECT_EQ(lines.size(), batch.first_line);
+    lines.insert(lines.end(), batch.lines.begin(), batch.lines.end());
+  });
+  ASSERT_FALSE(ec);
+
+  vector<string> all;
+  for (const auto& [range, lines] : ranges)
+    all.insert(all.end(), lines.begin(), lines.end());
+  EXPECT_EQ(expected, all);
+
+  // The ranges block on max_pending while they wait for their turn.
+  opts.ordered = true;
+  opts.max_pending = 512;
+  all.clear();
+  unsigned last_range = 0;
+  ec = ReadLinesParallel(path, pool.get(), opts, [&](const LineBatch& batch) {
+    EXPECT_GE(batch.range, last_range);
+    last_range = batch.range;
+    all.insert(all.end(), batch.lines.begin(), batch.lines.end());
+  });
+  ASSERT_FALSE(ec);
+  EXPECT_EQ(expected, all);
+
+  ec = ReadLinesParallel(base::GetTestTempPath("none.txt"), pool.get(), opts,
+                         [](const LineBatch&) {});
+  EXPECT_EQ(ENOENT, ec.value());
+  pool->Stop();
+}
+
+TEST_F(UringFileTest, SqPollPool) {
+  Pool::UringOptions opts;
+  opts.sqpoll = true;
+  opts.sqpoll_idle_msec = 1;
+  opts.shared_wq = true;
+  unique_ptr<ProactorPool> pool(Pool::IOUring(16, 2, opts));
+  pool->Run();
+
+  pool->AwaitFiberOnAll([](unsigned index, ProactorBase* pb) {
+    string path = base::GetTestTempPath(absl::StrCat("sqpoll", index, ".bin"));
+    auto res = OpenLinux(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    ASSERT_TRUE(res);
+    unique_ptr<LinuxFile> lf = std::move(*res);
+
+    // The sq thread sleeps after 1ms without submissions, the writes that follow wake it up.
+    for (unsigned i = 0; i < 5; ++i) {
+      ASSERT_FALSE(lf->Write(io::Buffer("abc"), i * 3, 0));
+      ThisFiber::SleepFor(10ms);
+    }
+
+    string buf(15, '\0');
+    iovec v{buf.data(), buf.size()};
+    auto read_res = lf->ReadSome(&v, 1, 0, 0);
+    ASSERT_TRUE(read_res);
+    EXPECT_EQ(15u, *read_res);
+    EXPECT_EQ("abcabcabcabcabc", buf);
+    EXPECT_FALSE(lf->Close());
+
+    // Older kernels run the ring without SQPOLL.
+    UringProactor* proactor = static_cast<UringProactor*>(pb);
+    if (proactor->HasSqPoll()) {
+      EXPECT_GT(proactor->stats().sqpoll_wakeups, 0u);
+    }
+  });
+  pool->Stop();
+}
+
+TEST_F(UringFileTest, GroupSync) {
+  string path = base::GetTestTempPath("group_sync.log");
+  constexpr unsigned kNumFibers = 10;
+
+  proactor_->Await([&] {
+    auto res = OpenLinux(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    ASSERT_TRUE(res);
+    unique_ptr<LinuxFile> lf = std::move(*res);
+
+    ASSERT_FALSE(lf->Write(io::Buffer("header"), 0, 0));
+    EXPECT_FALSE(lf->WriteBehind(0, 0));
+    EXPECT_FALSE(lf->Sync());
+
+    GroupSync group(lf.get());
+    vector<Fiber> fibers;
+    for (unsigned i = 0; i < kNumFibers; ++i) {
+      fibers.push_back(Fiber([&, i] {
+        string line = absl::StrCat(i, "\n");
+        ASSERT_FALSE(lf->Write(io::Buffer(line), 6 + i * 2, 0));
+        EXPECT_FALSE(group.Sync());
+      }));
+    }
+    for (auto& fb : fibers)
+      fb.Join();
+
+    EXPECT_EQ(kNumFibers, group.num_requests());
+    EXPECT_LT(group.num_syncs(), group.num_requests());
+
+    EXPECT_FALSE(lf->Close());
+  });
+}
+
+TEST_F(UringFileTest, AppendLog) {
+  string path = base::GetTestTempPath("append.log");
+  constexpr unsigned kNumFibers = 20;
+  constexpr size_t kRecordSize = 8;
+
+  proactor_->Await([&] {
+    auto res = OpenLinux(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    ASSERT_TRUE(res);
+    unique_ptr<LinuxFile> lf = std::move(*res);
+
+    AppendLog log(lf.get(), 0);
+    vector<off_t> offsets(kNumFibers, -1);
+    vector<Fiber> fibers;
+    for (unsigned i = 0; i < kNumFibers; ++i) {
+      fibers.push_back(Fiber([&, i] {
+        string record = absl::StrCat("rec", 10000 + i);
+        auto offset = log.Append(io::Buffer(record));
+        ASSERT_TRUE(offset);
+        offsets[i] = *offset;
+      }));
+    }
+    for (auto& fb : fibers)
+      fb.Join();
+
+    AppendLog::Stats stats = log.GetStats();
+    EXPECT_EQ(kNumFibers, stats.records);
+    EXPECT_LT(stats.batches, stats.records);
+    EXPECT_EQ(kNumFibers * kRecordSize, stats.bytes);
+    EXPECT_FALSE(log.Close());
+
+    string content(kNumFibers * kRecordSize, '\0');
+    iovec vec{.iov_base = content.data(), .iov_len = content.size()};
+    ASSERT_FALSE(lf->Read(&vec, 1, 0, 0));
+    for (unsigned i = 0; i < kNumFibers; ++i) {
+      ASSERT_EQ(0, offsets[i] % kRecordSize);
+      EXPECT_EQ(absl::StrCat("rec", 10000 + i), content.substr(offsets[i], kRecordSize));
+    }
+
+    EXPECT_FALSE(lf->Close());
+  });
+}
+
+TEST_F(UringFileTest, MetadataOps) {
+  string dir = base::GetTestTempPath("metadata_ops");
+  ASSERT_TRUE(mkdir(dir.c_str(), 0755) == 0 || errno == EEXIST);
+  constexpr unsigned kNumFiles = 100;
+
+  proactor_->Await([&] {
+    for (unsigned i = 0; i < kNumFiles; ++i) {
+      auto fd = OpenAt(AT_FDCWD, absl::StrCat(dir, "/", i, ".tmp"), O_RDWR | O_CREAT | O_TRUNC,
+                       0666);
+      ASSERT_TRUE(fd) << fd.error();
+      ASSERT_EQ(int(i), write(*fd, string(i, 'a').data(), i));
+      close(*fd);
+    }
+
+    struct statx stx;
+    ASSERT_FALSE(Statx(AT_FDCWD, dir + "/5.tmp", 0, STATX_SIZE, &stx));
+    EXPECT_EQ(5u, stx.stx_size);
+    EXPECT_EQ(ENOENT, Statx(AT_FDCWD, dir + "/none", 0, STATX_SIZE, &stx).value());
+
+    auto files = FiberStatFiles(dir + "/*.tmp", nullptr);
+    ASSERT_TRUE(files);
+    ASSERT_EQ(kNumFiles, files->size());
+    uint64_t total = 0;
+    for (const auto& file : *files)
+      total += file.size;
+    EXPECT_EQ(kNumFiles * (kNumFiles - 1) / 2, total);
+    EXPECT_TRUE(is_sorted(files->begin(), files->end(),
+                          [](const auto& a, const auto& b) { return a.name < b.name; }));
+
+    unsigned streamed = 0;
+    total = 0;
+    auto ec = FiberStatFiles(dir + "/*.tmp", nullptr, [&](io::StatShort st) {
+      ++streamed;
+      total += st.size;
+    }, 8);
+    EXPECT_FALSE(ec);
+    EXPECT_EQ(kNumFiles, streamed);
+    EXPECT_EQ(kNumFiles * (kNumFiles - 1) / 2, total);
+
+    ASSERT_FALSE(RenameAt(AT_FDCWD, dir + "/5.tmp", AT_FDCWD, dir + "/5.renamed"));
+    auto renamed = FiberStat(dir + "/5.renamed", nullptr);
+    ASSERT_TRUE(renamed);
+    EXPECT_EQ(5u, renamed->size);
+
+    ASSERT_FALSE(UnlinkAt(AT_FDCWD, dir + "/5.renamed", 0));
+    for (unsigned i = 0; i < kNumFiles; ++i) {
+      if (i != 5)
+        ASSERT_FALSE(FiberUnlink(absl::StrCat(dir, "/", i, ".tmp"), nullptr));
+    }
+    EXPECT_FALSE(UnlinkAt(AT_FDCWD, dir, AT_REMOVEDIR));
+  });
+}
+
+TEST_F(UringFileTest, Mapped) {
+  string path = base::GetTestTempPath("mapped.log");
+  constexpr size_t kSize = 1 << 20;
+  string contents(kSize, '\0');
+  for (size_t i = 0; i < kSize; ++i)
+    contents[i] = 'a' + i % 26;
+
+  FiberQueueThreadPool tp(2, 16);
+  proactor_->Await([&] {
+    auto wres = io::OpenWrite(path);
+    ASSERT_TRUE(wres);
+    unique_ptr<io::WriteFile> wf(*wres);
+    ASSERT_FALSE(wf->Write(contents));
+    ASSERT_FALSE(wf->Close());
+
+    MappedReadOptions::Stats stats;
+    MappedReadOptions opts;
+    opts.prefetch_size = 1 << 16;
+    opts.stats = &stats;
+    auto res = OpenFiberMappedFile(path, &tp, opts);
+    ASSERT_TRUE(res) << res.error();
+    unique_ptr<io::ReadonlyFile> file(*res);
+    ASSERT_EQ(kSize, file->Size());
+
+    // Sequential reads are served from the prefetched pages.
+    string dest(4096, '\0');
+    for (size_t offs = 0; offs < kSize; offs += dest.size()) {
+      auto rres = file->Read(offs, io::MutableBytes(reinterpret_cast<uint8_t*>(dest.data()),
+                                                     dest.size()));
+      ASSERT_TRUE(rres);
+      ASSERT_EQ(dest.size(), *rres);
+      ASSERT_EQ(string_view(contents).substr(offs, dest.size()), dest);
+    }
+    EXPECT_GT(stats.prefetch_cnt, 0u);
+    EXPECT_GT(stats.prefetch_bytes, stats.sync_bytes);
+
+    auto view = file->ReadView(kSize - 10, 100);
+    ASSERT_TRUE(view);
+    EXPECT_EQ(contents.substr(kSize - 10),
+              string_view(reinterpret_cast<const char*>(view->data()), view->size()));
+
+    view = file->ReadView(kSize, 1);
+    ASSERT_TRUE(view);
+    EXPECT_TRUE(view->empty());
+    EXPECT_FALSE(file->ReadView(kSize + 1, 1));
+
+    EXPECT_FALSE(file->Close());
+  });
+  tp.Shutdown();
+}
+
+TEST_F(UringFileTest, ReadNoWait) {
+  string path = base::GetTestTempPath("nowait.log");
+  constexpr size_t kSize = 1 << 18;
+  string contents(kSize, '\0');
+  for (size_t i = 0; i < kSize; ++i)
+    contents[i] = 'a' + i % 26;
+
+  FiberQueueThreadPool tp(2, 16);
+  proactor_->Await([&] {
+    auto wres = io::OpenWrite(path);
+    ASSERT_TRUE(wres);
+    unique_ptr<io::WriteFile> wf(*wres);
+    ASSERT_FALSE(wf->Write(contents));
+    ASSERT_FALSE(wf->Close());
+
+    for (size_t prefetch_size : {size_t(0), size_t(1) << 14}) {
+      FiberReadOptions::Stats stats;
+      FiberReadOptions opts;
+      opts.prefetch_size = prefetch_size;
+      opts.stats = &stats;
+      auto res = OpenFiberReadFile(path, &tp, opts);
+      ASSERT_TRUE(res) << res.error();
+      unique_ptr<io::ReadonlyFile> file(*res);
+
+      // The file was just written, hence it is served from the page cache on most filesystems.
+      string dest(4000, '\0');
+      size_t reads = 0;
+      for (size_t offs = 0; offs < kSize; offs += dest.size(), ++reads) {
+        auto rres = file->Read(offs, io::MutableBytes(reinterpret_cast<uint8_t*>(dest.data()),
+                                                       dest.size()));
+        ASSERT_TRUE(rres);
+        size_t expected = min(dest.size(), kSize - offs);
+        ASSERT_EQ(expected, *rres);
+        ASSERT_EQ(string_view(contents).substr(offs, expected), dest.substr(0, expected));
+      }
+      EXPECT_LE(stats.nowait_hit_cnt + stats.offload_cnt, reads);
+      if (prefetch_size == 0)
+        EXPECT_EQ(reads, stats.nowait_hit_cnt + stats.offload_cnt);
+      EXPECT_FALSE(file->Close());
+    }
+  });
+  tp.Shutdown();
+}
+
 }  // namespace fb2
 }  // namespace util
@@ -5,6 +5,8 @@
 #include "util/fibers/uring_proactor.h"
 
 #include <absl/base/attributes.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
 #include <liburing.h>
 #include <poll.h>
 #include <string.h>
@@ -16,13 +18,34 @@
 #include "base/histogram.h"
 #include "base/logging.h"
 #include "base/proc_util.h"
+#include "util/fibers/cycle_clock.h"
 #include "util/fibers/detail/scheduler.h"
+#include "util/fibers/event_log.h"
 #include "util/fibers/uring_socket.h"
 
 // TODO: we need to fix register_fds_ resize flow.
 // Also we must ensure that there is no leakage of socket descriptors with enable_direct_fd enabled.
 // See AcceptServerTest.Shutdown to trigger direct fd resize.
 ABSL_FLAG(bool, enable_direct_fd, false, "If true tries to register file descriptors");
+ABSL_FLAG(bool, uring_futex_wakeup, true,
+          "If true and the kernel supports it, threads without a ring wake proactors via a "
+          "futex that the ring waits on, instead of the eventfd");
+ABSL_FLAG(uint32_t, uring_periodic_tick_ms, 10,
+          "Tick of the timeout that is shared by the periodic tasks with coarse periods. "
+          "0 gives every periodic task its own timeout.");
+ABSL_FLAG(bool, uring_ext_arg_wait, true,
+          "If true, the idle proactor waits with a single io_uring_enter on the registered ring "
+          "fd and passes the timeout with IORING_ENTER_EXT_ARG. Otherwise it waits via liburing");
+ABSL_FLAG(uint32_t, uring_min_wait_usec, 0,
+          "If positive and the kernel supports min-wait timeouts (6.12), the idle proactor waits "
+          "up to this long for uring_wait_batch completions before it wakes up with fewer, "
+          "trading latency for fewer wakeups. 0 wakes up upon the first completion");
+ABSL_FLAG(uint32_t, uring_wait_batch, 16,
+          "Number of completions that the idle wait gathers, see uring_min_wait_usec");
+ABSL_FLAG(bool, uring_buf_hugepages, true,
+          "If true, backs the registered buffers and the buffer rings with hugepages: the sizes "
+          "that are multiples of 1GB or 2MB with explicit hugepages if there are free ones, "
+          "the other large sizes with transparent hugepages");
 
 #define URING_CHECK(x)                                                        \
   do {                                                                        \
@@ -66,28 +89,193 @@ constexpr uint64_t kUserDataCbIndex = 1024;
 constexpr uint16_t kMsgRingSubmitTag = 1;
 constexpr uint16_t kTimeoutSubmitTag = 2;
 constexpr uint16_t kCqeBatchLen = 128;
+constexpr size_t kInitialCentries = 256;
+
+// IORING_OP_FUTEX_WAIT and the futex2 flags from linux 6.7, spelled out because older uapi
+// headers do not have them.
+constexpr uint8_t kOpFutexWait = 51;
+constexpr uint32_t kFutex2SizeU32 = 0x02;
+constexpr uint32_t kFutex2Private = 128;
+
+// IORING_TIMEOUT_MULTISHOT from linux 6.4.
+constexpr uint32_t kTimeoutMultishot = 1U << 6;
+
+// IORING_FEAT_MIN_TIMEOUT from linux 6.12, which also renamed the padding of
+// io_uring_getevents_arg to min_wait_usec.
+constexpr uint32_t kFeatMinTimeout = 1U << 15;
+
+struct GeteventsArg {
+  uint64_t sigmask;
+  uint32_t sigmask_sz;
+  uint32_t min_wait_usec;
+  uint64_t ts;
+};
+
+// IORING_REGISTER_ZCRX_IFQ and its structures from linux 6.15.
+constexpr unsigned kRegisterZcrxIfq = 32;
+constexpr uint32_t kMemRegionTypeUser = 1;
+
+struct ZcrxRqe {
+  uint64_t off;
+  uint32_t len;
+  uint32_t pad;
+};
+
+struct ZcrxOffsets {
+  uint32_t head;
+  uint32_t tail;
+  uint32_t rqes;
+  uint32_t resv2;
+  uint64_t resv[2];
+};
+
+struct ZcrxAreaReg {
+  uint64_t addr;
+  uint64_t len;
+  uint64_t rq_area_token;
+  uint32_t flags;
+  uint32_t dmabuf_fd;
+  uint64_t resv2[2];
+};
+
+struct RegionDesc {
+  uint64_t user_addr;
+  uint64_t size;
+  uint32_t flags;
+  uint32_t id;
+  uint64_t mmap_offset;
+  uint64_t resv[4];
+};
+
+struct ZcrxIfqReg {
+  uint32_t if_idx;
+  uint32_t if_rxq;
+  uint32_t rq_entries;
+  uint32_t flags;
+  uint64_t area_ptr;
+  uint64_t region_ptr;
+  ZcrxOffsets offsets;
+  uint32_t zcrx_id;
+  uint32_t resv2;
+  uint64_t resv[3];
+};
+
+static_assert(sizeof(ZcrxIfqReg) == 96);
+
+// Periodic tasks share the wheel if their periods are at least kWheelMinTicks ticks, so that
+// rounding the deadlines to ticks delays them by at most 10% of the period. The wheel costs
+// a completion per tick, so it is used only once there are kWheelMinTasks such tasks.
+constexpr uint64_t kWheelMinTicks = 10;
+constexpr uint32_t kWheelMinTasks = 4;
+
+// val1 of the items that are in the wheel. Timeout user_data values are never 0.
+constexpr uint32_t kWheelItem = 0;
+
+// user_data of the completions posted by PostMsg: the flag, 15 bits of the handler id and
+// 48 bits of the payload. Our own user_data never has the high bits set.
+constexpr uint64_t kMsgFlag = 1ULL << 63;
+constexpr unsigned kMsgHandlerShift = 48;
+constexpr unsigned kMaxMsgHandlers = 256;
+
+std::atomic<UringProactor::MsgHandler> msg_handlers[kMaxMsgHandlers];
+std::atomic_uint16_t num_msg_handlers{0};
+
+// MAP_HUGE_2MB and MAP_HUGE_1GB, spelled out because older libc headers do not have them.
+constexpr int kMapHugeShift = 26;
+constexpr int kMapHuge2MB = 21 << kMapHugeShift;
+constexpr int kMapHuge1GB = 30 << kMapHugeShift;
+constexpr size_t k2MB = 1ULL << 21;
+constexpr size_t k1GB = 1ULL << 30;
+
+// The size of the sparse table of the registered buffers. The regions grow by doubling, so
+// it is never the limit in practice.
+constexpr unsigned kMaxBufRegions = 32;
+
+// Prefers the numa node of the calling thread for the pages of [ptr, ptr + size). The pages
+// are faulted in when the buffers are registered, so the policy must be set before that.
+void BindToLocalNode(void* ptr, size_t size) {
+  unsigned cpu = 0, node = 0;
+  if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0 || node >= 63)
+    return;
+
+  unsigned long mask = 1UL << node;
+  if (syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0) != 0)
+    VLOG(1) << "mbind failed: " << SafeErrorMessage(errno);
+}
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+// Faults in the pages of [ptr, ptr + size) for writing without modifying them, hence it is safe
+// even if the kernel writes into them concurrently. MADV_POPULATE_WRITE requires 5.14.
+void PopulateWrite(void* ptr, size_t size) {
+  if (madvise(ptr, size, MADV_POPULATE_WRITE) != 0)
+    VLOG(1) << "MADV_POPULATE_WRITE failed: " << SafeErrorMessage(errno);
+}
+
+// Reads a byte per page of [ptr, ptr + size).
+void ReadPages(const void* ptr, size_t size) {
+  const volatile char* p = static_cast<const volatile char*>(ptr);
+  for (size_t offs = 0; offs < size; offs += 4096)
+    (void)p[offs];
+}
 
-constexpr size_t kBufRingEntriesCnt = 8192;
-constexpr size_t kBufRingEntrySize = 64;  // TODO: should be configurable.
+// Maps the backing of registered buffers, see --uring_buf_hugepages. Explicit hugepages
+// reduce the TLB misses of the large regions and the cost of pinning them upon registration.
+// Sets *huge if the mapping has explicit hugepages. Returns MAP_FAILED on failure.
+void* MapBufferBacking(size_t size, bool* huge) {
+  constexpr int kFlags = MAP_PRIVATE | MAP_ANONYMOUS;
+  bool use_huge = absl::GetFlag(FLAGS_uring_buf_hugepages);
+  *huge = false;
+
+  if (use_huge) {
+    for (auto [page_size, page_flag] : {pair{k1GB, kMapHuge1GB}, pair{k2MB, kMapHuge2MB}}) {
+      if (size % page_size != 0)
+        continue;
+
+      // Fails with ENOMEM if the hugetlb pool does not have enough free pages.
+      void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, kFlags | MAP_HUGETLB | page_flag,
+                       -1, 0);
+      if (ptr != MAP_FAILED) {
+        *huge = true;
+        return ptr;
+      }
+    }
+  }
+
+  void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, kFlags, -1, 0);
+  if (ptr != MAP_FAILED && use_huge && size >= k2MB)
+    madvise(ptr, size, MADV_HUGEPAGE);
+  return ptr;
+}
+
+uint16_t AttachFiberMsgId() {
+  static const uint16_t id = UringProactor::RegisterMsgHandler([](uint64_t data, int32_t) {
+    reinterpret_cast<detail::FiberInterface*>(data)->AttachScheduler();
+  });
+  return id;
+}
 
 }  // namespace
 
-UringProactor::UringProactor() : ProactorBase() {
+UringProactor::UringProactor(size_t task_queue_len) : ProactorBase(task_queue_len) {
 }
 
 UringProactor::~UringProactor() {
   CHECK(is_stopped_);
   if (thread_id_ != -1U) {
-    if (buf_pool_.backing) {
-      munmap(buf_pool_.backing, buf_pool_.segments.Size() * UringBuf::kAlign);
+    if (!buf_pool_.regions.empty()) {
       io_uring_unregister_buffers(&ring_);
+      for (const iovec& vec : buf_pool_.regions)
+        munmap(vec.iov_base, vec.iov_len);
     }
 
     for (size_t i = 0; i < bufring_groups_.size(); ++i) {
       const auto& group = bufring_groups_[i];
       if (group.ring != nullptr) {
-        io_uring_free_buf_ring(&ring_, group.ring, kBufRingEntriesCnt, i);
-        delete group.buf;
+        io_uring_free_buf_ring(&ring_, group.ring, group.nentries, i);
+        munmap(group.buf, size_t(group.nentries) * group.esize);
       }
     }
 
@@ -95,6 +283,12 @@ UringProactor::~UringProactor() {
       io_uring_unregister_files(&ring_);
     }
     io_uring_queue_exit(&ring_);
+
+    // The interface queue is released together with the ring.
+    if (zcrx_.area) {
+      munmap(zcrx_.area, zcrx_.area_size);
+      munmap(zcrx_.region, zcrx_.region_size);
+    }
   }
   VLOG(1) << "Closing wake_fd " << wake_fd_ << " ring fd: " << ring_.ring_fd;
 }
@@ -105,6 +299,7 @@ void UringProactor::Init(unsigned pool_index, size_t ring_size, int wq_fd) {
   CHECK_EQ(0U, thread_id_) << "Init was already called";
 
   pool_index_ = pool_index;
+  uint64_t start = GetClockNanos();
 
   base::sys::KernelVersion kver;
   base::sys::GetKernelVersion(&kver);
@@ -116,9 +311,19 @@ void UringProactor::Init(unsigned pool_index, size_t ring_size, int wq_fd) {
   memset(&params, 0, sizeof(params));
 
   msgring_f_ = 0;
+  futex_f_ = 0;
+  timeout_multishot_f_ = 0;
+  ext_wait_f_ = 0;
+  reg_ring_f_ = 0;
+  min_wait_usec_ = 0;
+  wait_batch_ = 1;
   poll_first_ = 0;
   direct_fd_ = 0;
   buf_ring_f_ = 0;
+  recv_multishot_f_ = 0;
+  accept_multishot_f_ = 0;
+  send_zc_f_ = 0;
+  sqpoll_f_ = 0;
 
   if (kver.kernel > 5 || (kver.kernel == 5 && kver.major >= 15)) {
     direct_fd_ = absl::GetFlag(FLAGS_enable_direct_fd);  // failswitch to disable direct fds.
@@ -132,19 +337,61 @@ void UringProactor::Init(unsigned pool_index, size_t ring_size, int wq_fd) {
 
     // io_uring_register_buf_ring is supported since 5.19.
     buf_ring_f_ = 1;
+    accept_multishot_f_ = 1;
+  }
+
+  if (kver.kernel >= 6) {
+    // IORING_RECV_MULTISHOT together with provided buffer rings.
+    recv_multishot_f_ = 1;
+  }
+
+  if (kver.kernel > 6 || (kver.kernel == 6 && kver.major >= 1)) {
+    send_zc_f_ = 1;
+  }
+
+  if (kver.kernel > 6 || (kver.kernel == 6 && kver.major >= 4)) {
+    timeout_multishot_f_ = 1;
+  }
+
+  // Before 5.11 SQPOLL required registering each fd, including sockets fds.
+  if (sqpoll_cfg_.enabled && (kver.kernel > 5 || (kver.kernel == 5 && kver.major >= 11))) {
+    sqpoll_f_ = 1;
+    params.flags |= IORING_SETUP_SQPOLL;
+    params.sq_thread_idle = sqpoll_cfg_.idle_msec;
+    if (sqpoll_cfg_.cpu >= 0) {
+      params.flags |= IORING_SETUP_SQ_AFF;
+      params.sq_thread_cpu = sqpoll_cfg_.cpu;
+    }
+  } else {
+    LOG_IF(WARNING, sqpoll_cfg_.enabled) << "SQPOLL requires kernel 5.11 or later";
   }
 
-  if (kver.kernel >= 6 && kver.major >= 1) {
+  // DEFER_TASKRUN requires that the completions are processed by the submitting thread,
+  // which is not the case with SQPOLL.
+  if (kver.kernel >= 6 && kver.major >= 1 && !sqpoll_f_) {
     // This has a positive effect on CPU usage, latency and throughput.
     params.flags |=
         (IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_TASKRUN_FLAG | IORING_SETUP_SINGLE_ISSUER);
   }
 
-  // it seems that SQPOLL requires registering each fd, including sockets fds.
-  // need to check if its worth pursuing.
-  // For sure not in short-term.
-  // params.flags = IORING_SETUP_SQPOLL;
-  VLOG(1) << "Create uring of size " << ring_size;
+  // The zero-copy receive completions carry the area offset in the second half of
+  // a 32 byte completion. The kernel requires DEFER_TASKRUN for them.
+  if (zcrx_cfg_.if_idx) {
+    if ((kver.kernel > 6 || (kver.kernel == 6 && kver.major >= 15)) &&
+        (params.flags & IORING_SETUP_DEFER_TASKRUN)) {
+      params.flags |= IORING_SETUP_CQE32;
+    } else {
+      LOG(WARNING) << "Zero-copy receive requires kernel 6.15 or later without SQPOLL";
+    }
+  }
+
+  if (wq_fd >= 0) {
+    params.flags |= IORING_SETUP_ATTACH_WQ;
+    params.wq_fd = wq_fd;
+  }
+
+  VLOG(1) << "Create uring of size " << ring_size << " sqpoll: " << sqpoll_f_
+          << " wq_fd: " << wq_fd;
 
   // If this fails with 'can not allocate memory' most probably you need to increase maxlock limit.
   int init_res = io_uring_queue_init_params(ring_size, &ring_, &params);
@@ -160,19 +407,33 @@ void UringProactor::Init(unsigned pool_index, size_t ring_size, int wq_fd) {
     LOG(FATAL) << "Error initializing io_uring: (" << init_res << ") "
                << SafeErrorMessage(init_res);
   }
+  uint64_t ring_ready = GetClockNanos();
 
   io_uring_probe* uring_probe = io_uring_get_probe_ring(&ring_);
 
   msgring_f_ = io_uring_opcode_supported(uring_probe, IORING_OP_MSG_RING);
+  futex_f_ = absl::GetFlag(FLAGS_uring_futex_wakeup) &&
+             io_uring_opcode_supported(uring_probe, kOpFutexWait);
   io_uring_free_probe(uring_probe);
   VLOG_IF(1, msgring_f_) << "msgring supported!";
+  VLOG_IF(1, futex_f_) << "futex wait supported!";
 
   unsigned req_feats = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_FAST_POLL | IORING_FEAT_NODROP;
   CHECK_EQ(req_feats, params.features & req_feats)
       << "required feature feature is not present in the kernel";
 
+  // Saves the fget/fput of the ring file on every io_uring_enter.
   int res = io_uring_register_ring_fd(&ring_);
   VLOG_IF(1, res < 0) << "io_uring_register_ring_fd failed: " << -res;
+  reg_ring_f_ = res == 1;
+
+  // Without IORING_FEAT_EXT_ARG, liburing waits with a timeout by submitting a timeout sqe.
+  ext_wait_f_ = absl::GetFlag(FLAGS_uring_ext_arg_wait) && (params.features & IORING_FEAT_EXT_ARG);
+  if (ext_wait_f_ && (params.features & kFeatMinTimeout)) {
+    min_wait_usec_ = absl::GetFlag(FLAGS_uring_min_wait_usec);
+    if (min_wait_usec_)
+      wait_batch_ = std::max(absl::GetFlag(FLAGS_uring_wait_batch), 1u);
+  }
 
   if (direct_fd_) {
     register_fds_.resize(512, -1);
@@ -180,12 +441,31 @@ void UringProactor::Init(unsigned pool_index, size_t ring_size, int wq_fd) {
     CHECK_EQ(0, res);
   }
 
+  if (params.flags & IORING_SETUP_CQE32) {
+    int res = RegisterZcrx();
+    LOG_IF(WARNING, res) << "Could not register zero-copy receive on interface "
+                         << zcrx_cfg_.if_idx << " queue " << zcrx_cfg_.rxq << ": "
+                         << SafeErrorMessage(res) << ", falling back to the buffer rings";
+  }
+  uint64_t registered = GetClockNanos();
+
   size_t sz = ring_.sq.ring_sz + params.sq_entries * sizeof(struct io_uring_sqe);
   LOG_FIRST_N(INFO, 1) << "IORing with " << params.sq_entries << " entries, allocated " << sz
                        << " bytes, cq_entries is " << *ring_.cq.kring_entries;
 
   ArmWakeupEvent();
-  centries_.resize(params.sq_entries);  // .val = -1
+
+  uint32_t tick_ms = absl::GetFlag(FLAGS_uring_periodic_tick_ms);
+  wheel_.tick_ns = uint64_t(tick_ms) * 1000000;
+  wheel_.tick_ts.tv_sec = tick_ms / 1000;
+  wheel_.tick_ts.tv_nsec = (tick_ms % 1000) * 1000000;
+  wheel_.start_ns = GetClockNanos();
+
+  // Large rings rarely have all their entries in flight, so centries_ starts small and
+  // RegrowCentries doubles it on demand.
+  centries_.resize(min<size_t>(params.sq_entries, kInitialCentries));  // .val = -1
+  if (op_tracing_)
+    op_traces_.resize(centries_.size());
   next_free_ce_ = 0;
   for (size_t i = 0; i < centries_.size() - 1; ++i) {
     centries_[i].index = i + 1;
@@ -195,6 +475,11 @@ void UringProactor::Init(unsigned pool_index, size_t ring_size, int wq_fd) {
   sys_thread_id_ = syscall(SYS_gettid);
 
   tl_info_.owner = this;
+
+  uint64_t end = GetClockNanos();
+  VLOG(1) << "Proactor " << pool_index << " initialized in " << (end - start) / 1000
+          << "us: ring setup " << (ring_ready - start) / 1000 << "us, registration "
+          << (registered - ring_ready) / 1000 << "us";
 }
 
 void UringProactor::ProcessCqeBatch(unsigned count, io_uring_cqe** cqes,
@@ -203,6 +488,18 @@ void UringProactor::ProcessCqeBatch(unsigned count, io_uring_cqe** cqes,
     // copy cqe (16 bytes) because it helps when debugging, gdb can not access memory in kernel
     // space.
     io_uring_cqe cqe = *cqes[i];
+    if (ABSL_PREDICT_FALSE(zcrx_.area != nullptr))
+      cqe_extra_ = reinterpret_cast<const uint64_t*>(cqes[i]->big_cqe);
+
+    // UINT64_MAX is not a message, it is handled below.
+    if ((cqe.user_data & kMsgFlag) && cqe.user_data != UINT64_MAX) {
+      uint16_t id = (cqe.user_data & ~kMsgFlag) >> kMsgHandlerShift;
+      DCHECK_LT(id, kMaxMsgHandlers);
+      MsgHandler handler = msg_handlers[id].load(memory_order_acquire);
+      DCHECK(handler) << id;
+      handler(cqe.user_data & ((1ULL << kMsgHandlerShift) - 1), cqe.res);
+      continue;
+    }
 
     uint32_t user_data = cqe.user_data & 0xFFFFFFFF;
     if (user_data >= kUserDataCbIndex) {  // our heap range surely starts higher than 1k.
@@ -225,11 +522,16 @@ void UringProactor::ProcessCqeBatch(unsigned count, io_uring_cqe** cqes,
       auto& e = centries_[index];
 
       DCHECK(e.cb) << index;
+      LogEvent(EventType::kIoComplete, index, cqe.res);
 
       if (cqe.flags & IORING_CQE_F_MORE) {
         // multishot operation. we keep the callback intact.
+        if (ABSL_PREDICT_FALSE(op_tracing_))
+          op_traces_[index].start_tsc = 0;
         e.cb(current, cqe.res, cqe.flags);
       } else {
+        if (ABSL_PREDICT_FALSE(op_tracing_))
+          RecordOpLatency(index);
         CbType func = std::move(e.cb);
 
         // Set e to be the head of free-list.
@@ -241,6 +543,28 @@ void UringProactor::ProcessCqeBatch(unsigned count, io_uring_cqe** cqes,
       continue;
     }
 
+    if (user_data == kWakeIndex) {
+      // We were woken up by a thread that could not use MSG_RING. Need to rearm the waiter.
+      if (futex_f_) {
+        // -EAGAIN if the futex was set before the wait was armed, -ECANCELED if the wait was
+        // cancelled when the ring is torn down.
+        DCHECK(cqe.res == 0 || cqe.res == -EAGAIN || cqe.res == -ECANCELED) << cqe.res;
+        if (cqe.res == -ECANCELED && is_stopped_)
+          continue;
+
+        // seq_cst pairs with the exchange in WakeRing: the reset must not be reordered with
+        // the reads of the task queue that follow it, otherwise a waker that saw the pending
+        // wakeup and skipped FUTEX_WAKE could be lost.
+        wake_futex_.store(0, memory_order_seq_cst);
+      } else {
+        DCHECK_EQ(cqe.res, 8);
+      }
+      DVLOG(2) << "PRO[" << GetPoolIndex() << "] Wakeup " << cqe.res << "/" << cqe.flags;
+
+      ArmWakeupEvent();
+      continue;
+    }
+
     // We ignore ECANCELED because submissions with link_timeout that finish successfully generate
     // CQE with ECANCELED for the subsequent linked submission. See io_uring_enter(2) for more info.
     // ETIME is when a timer cqe fully completes.
@@ -251,15 +575,6 @@ void UringProactor::ProcessCqeBatch(unsigned count, io_uring_cqe** cqes,
     if (user_data == kIgnoreIndex)
       continue;
 
-    if (user_data == kWakeIndex) {
-      // Path relevant only for older kernels. For new kernels we use MSG_RING.
-      // We were woken up. Need to rearm wakeup poller.
-      DCHECK_EQ(cqe.res, 8);
-      DVLOG(2) << "PRO[" << GetPoolIndex() << "] Wakeup " << cqe.res << "/" << cqe.flags;
-
-      ArmWakeupEvent();
-      continue;
-    }
     LOG(ERROR) << "Unrecognized user_data " << cqe.user_data;
   }
 }
@@ -276,11 +591,24 @@ void UringProactor::ReapCompletions(unsigned init_count, io_uring_cqe** cqes,
     batch_count = io_uring_peek_batch_cqe(&ring_, cqes, kCqeBatchLen);
   }
 
+  // The kernel has consumed some of the refill queue.
+  if (ABSL_PREDICT_FALSE(!zcrx_.pending.empty()))
+    FlushZcrxReturns();
+
   // In case some of the timer completions filled schedule_periodic_list_.
   for (auto& task_pair : schedule_periodic_list_) {
     SchedulePeriodic(task_pair.first, task_pair.second);
   }
   schedule_periodic_list_.clear();
+
+  if (wheel_.due) {
+    wheel_.due = false;
+    AdvanceWheel();
+  }
+  if (wheel_.size > 0 && wheel_.timer_ud == 0)
+    ArmWheelTimer();
+  else if (wheel_.size == 0 && wheel_.timer_ud != 0 && !wheel_.stopping)
+    StopWheelTimer();
   sqe_avail_.notifyAll();
 }
 
@@ -288,6 +616,7 @@ SubmitEntry UringProactor::GetSubmitEntry(CbType cb, uint16_t submit_tag) {
   io_uring_sqe* res = io_uring_get_sqe(&ring_);
   if (res == NULL) {
     ++get_entry_sq_full_;
+    MarkTracedSubmitted();
     int submitted = io_uring_submit(&ring_);
     if (submitted > 0) {
       res = io_uring_get_sqe(&ring_);
@@ -310,6 +639,15 @@ SubmitEntry UringProactor::GetSubmitEntry(CbType cb, uint16_t submit_tag) {
     DCHECK(!e.cb);  // cb is undefined.
     DVLOG(3) << "GetSubmitEntry: index: " << next_free_ce_;
 
+    if (ABSL_PREDICT_FALSE(op_tracing_)) {
+      OpTrace& t = op_traces_[next_free_ce_];
+      t.start_tsc = CycleClock::Now();
+      t.sqe = res;
+      t.tag = submit_tag;
+      trace_unsubmitted_.push_back(next_free_ce_);
+    }
+    LogEvent(EventType::kIoSubmit, next_free_ce_, submit_tag);
+
     next_free_ce_ = e.index;
     e.cb = std::move(cb);
     ++pending_cb_cnt_;
@@ -320,43 +658,145 @@ SubmitEntry UringProactor::GetSubmitEntry(CbType cb, uint16_t submit_tag) {
   return SubmitEntry{res};
 }
 
-int UringProactor::RegisterBuffers(size_t size) {
+int UringProactor::RegisterBuffers(size_t size, size_t max_size) {
+  DCHECK(buf_pool_.regions.empty());
+
   size = (size + UringBuf::kAlign - 1) / UringBuf::kAlign * UringBuf::kAlign;
+  buf_pool_.max_size = std::max(size, max_size);
+  return AddBufferRegion(size);
+}
 
-  // Use mmap to create the backing
-  void* ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+// The regions are registered into a sparse table, which is created with the first region, so
+// that the next regions are added with an update of the table instead of re-registering all of
+// them. Re-registration quiesces the ring and would stall the fixed-buffer operations in flight.
+// Kernels before 5.13 do not support sparse tables, so there the first region is registered
+// the old way and the backing does not grow.
+int UringProactor::AddBufferRegion(size_t size) {
+  auto& regions = buf_pool_.regions;
+  if (regions.size() >= kMaxBufRegions)
+    return -ENOSPC;
+
+  bool huge;
+  void* ptr = MapBufferBacking(size, &huge);
   if (ptr == MAP_FAILED)
     return -errno;
+  if (InMyThread())
+    BindToLocalNode(ptr, size);
+
+  iovec vec{ptr, size};
+  int res;
+  if (regions.empty()) {
+    res = io_uring_register_buffers_sparse(&ring_, kMaxBufRegions);
+    if (res == 0) {
+      res = io_uring_register_buffers_update_tag(&ring_, 0, &vec, nullptr, 1);
+      if (res < 0)
+        io_uring_unregister_buffers(&ring_);
+    } else {
+      VLOG(1) << "Sparse buffer registration is not supported: " << -res;
+      res = io_uring_register_buffers(&ring_, &vec, 1);
+      if (res == 0)
+        buf_pool_.max_size = size;
+    }
+  } else {
+    res = io_uring_register_buffers_update_tag(&ring_, regions.size(), &vec, nullptr, 1);
+  }
 
-  buf_pool_.backing = reinterpret_cast<uint8_t*>(ptr);
-  buf_pool_.segments.Grow(size / UringBuf::kAlign);
+  if (res < 0) {
+    munmap(ptr, size);
+    return res;
+  }
 
-  iovec vec{buf_pool_.backing, size};
-  return io_uring_register_buffers(&ring_, &vec, 1);
+  regions.push_back(vec);
+  buf_pool_.segments.emplace_back(size / UringBuf::kAlign);
+  buf_pool_.total_size += size;
+  if (huge)
+    buf_pool_.huge_size += size;
+  return 0;
 }
 
 std::optional<UringBuf> UringProactor::RequestBuffer(size_t size) {
-  DCHECK(buf_pool_.backing);
+  DCHECK(!buf_pool_.regions.empty());
   // We keep track not of bytes, but 4kb segments and round up
   size_t segments = (size + UringBuf::kAlign - 1) / UringBuf::kAlign;
-  if (auto offset = buf_pool_.segments.Request(segments)) {
-    uint8_t* ptr = buf_pool_.backing + *offset * UringBuf::kAlign;
-    return UringBuf{{ptr, segments * UringBuf::kAlign}, 0};
+  auto& pools = buf_pool_.segments;
+  ++buf_pool_.requests;
+
+  // Newer regions are larger, so try them first.
+  for (unsigned i = pools.size(); i > 0; --i) {
+    if (auto offset = pools[i - 1].Request(segments)) {
+      uint8_t* ptr = reinterpret_cast<uint8_t*>(buf_pool_.regions[i - 1].iov_base);
+      return UringBuf{{ptr + *offset * UringBuf::kAlign, segments * UringBuf::kAlign}, i - 1};
+    }
   }
+
+  // Grow by doubling the total size, but not beyond max_size.
+  size_t bytes = segments * UringBuf::kAlign;
+  size_t grow_size = std::min(std::max(buf_pool_.total_size, bytes),
+                              buf_pool_.max_size - buf_pool_.total_size);
+  if (grow_size >= bytes) {
+    int res = AddBufferRegion(grow_size);
+    if (res == 0) {
+      ++buf_pool_.grow_cnt;
+      unsigned idx = pools.size() - 1;
+      auto offset = pools[idx].Request(segments);
+      DCHECK(offset);
+      uint8_t* ptr = reinterpret_cast<uint8_t*>(buf_pool_.regions[idx].iov_base);
+      return UringBuf{{ptr + *offset * UringBuf::kAlign, bytes}, idx};
+    }
+    LOG_FIRST_N(WARNING, 10) << "Could not grow registered buffers: " << -res;
+  }
+
+  ++buf_pool_.failures;
   return std::nullopt;
 }
 
 void UringProactor::ReturnBuffer(UringBuf buf) {
   DCHECK(buf.buf_idx);
 
-  size_t segments = (buf.bytes.data() - buf_pool_.backing) / UringBuf::kAlign;
-  buf_pool_.segments.Return(segments);
+  unsigned idx = *buf.buf_idx;
+  DCHECK_LT(idx, buf_pool_.regions.size());
+  uint8_t* backing = reinterpret_cast<uint8_t*>(buf_pool_.regions[idx].iov_base);
+  size_t segments = (buf.bytes.data() - backing) / UringBuf::kAlign;
+  buf_pool_.segments[idx].Return(segments);
+}
+
+auto UringProactor::GetRegisteredBufferStats() const -> RegisteredBufferStats {
+  RegisteredBufferStats res;
+  res.total_bytes = buf_pool_.total_size;
+  res.hugepage_bytes = buf_pool_.huge_size;
+  res.regions = buf_pool_.regions.size();
+  res.requests = buf_pool_.requests;
+  res.failures = buf_pool_.failures;
+  res.grow_cnt = buf_pool_.grow_cnt;
+
+  for (const auto& pool : buf_pool_.segments) {
+    const auto& stats = pool.stats();
+    res.used_bytes += size_t(stats.used_units) * UringBuf::kAlign;
+    res.free_ranges += stats.free_ranges;
+    res.largest_free_bytes =
+        std::max(res.largest_free_bytes, size_t(pool.LargestFreeRange()) * UringBuf::kAlign);
+  }
+
+  return res;
 }
 
-int UringProactor::RegisterBufferRing(unsigned group_id) {
+std::optional<unsigned> UringProactor::FindRegisteredBuffer(const void* ptr, size_t len) const {
+  const uint8_t* start = reinterpret_cast<const uint8_t*>(ptr);
+  for (unsigned i = 0; i < buf_pool_.regions.size(); ++i) {
+    const uint8_t* base = reinterpret_cast<const uint8_t*>(buf_pool_.regions[i].iov_base);
+    if (start >= base && start + len <= base + buf_pool_.regions[i].iov_len)
+      return i;
+  }
+  return std::nullopt;
+}
+
+int UringProactor::RegisterBufferRing(uint16_t group_id, uint16_t nentries, unsigned esize) {
   if (buf_ring_f_ == 0)
     return EOPNOTSUPP;
 
+  if (nentries == 0 || (nentries & (nentries - 1)) != 0 || nentries > 32768 || esize == 0)
+    return EINVAL;
+
   if (bufring_groups_.size() <= group_id) {
     bufring_groups_.resize(group_id + 1);
   }
@@ -364,38 +804,181 @@ int UringProactor::RegisterBufferRing(unsigned group_id) {
   auto& ring_group = bufring_groups_[group_id];
   CHECK(ring_group.ring == nullptr);
 
-  int err = 0;
+  size_t backing_size = size_t(nentries) * esize;
+  bool huge;
+  void* ptr = MapBufferBacking(backing_size, &huge);
+  if (ptr == MAP_FAILED)
+    return errno;
+  if (InMyThread())
+    BindToLocalNode(ptr, backing_size);
 
-  ring_group.ring = io_uring_setup_buf_ring(&ring_, kBufRingEntriesCnt, group_id, 0, &err);
+  int err = 0;
+  ring_group.ring = io_uring_setup_buf_ring(&ring_, nentries, group_id, 0, &err);
   if (ring_group.ring == nullptr) {
+    munmap(ptr, backing_size);
     return -err;  // err is negative.
   }
 
-  unsigned mask = kBufRingEntriesCnt - 1;
-  ring_group.buf = new uint8_t[kBufRingEntriesCnt * kBufRingEntrySize];
+  ring_group.buf = reinterpret_cast<uint8_t*>(ptr);
+  ring_group.esize = esize;
+  ring_group.nentries = nentries;
+  ring_group.return_epoch = 0;
+
+  unsigned mask = io_uring_buf_ring_mask(nentries);
   uint8_t* next = ring_group.buf;
-  for (unsigned i = 0; i < kBufRingEntriesCnt; ++i) {
-    io_uring_buf_ring_add(ring_group.ring, next, kBufRingEntrySize, i, mask, i);
-    next += 64;
+  for (unsigned i = 0; i < nentries; ++i) {
+    io_uring_buf_ring_add(ring_group.ring, next, esize, i, mask, i);
+    next += esize;
   }
-  io_uring_buf_ring_advance(ring_group.ring, kBufRingEntriesCnt);
+  io_uring_buf_ring_advance(ring_group.ring, nentries);
 
   return 0;
 }
 
-uint8_t* UringProactor::GetBufRingPtr(unsigned group_id, unsigned bufid) {
+void UringProactor::Warmup() {
+  ProactorBase::Warmup();
+
+  // The kernel shares the rings with us, so we only read them.
+  ReadPages(ring_.sq.ring_ptr, ring_.sq.ring_sz);
+  ReadPages(ring_.sq.sqes, *ring_.sq.kring_entries * sizeof(io_uring_sqe));
+  if (ring_.cq.ring_ptr != ring_.sq.ring_ptr)
+    ReadPages(ring_.cq.ring_ptr, ring_.cq.ring_sz);
+
+  // Unlike the registered buffers, which are pinned upon registration, the provided buffers
+  // are faulted in by the receives.
+  for (const auto& group : bufring_groups_) {
+    if (group.ring)
+      PopulateWrite(group.buf, size_t(group.nentries) * group.esize);
+  }
+}
+
+uint8_t* UringProactor::GetBufRingPtr(uint16_t group_id, uint16_t bufid) {
   DCHECK_LT(group_id, bufring_groups_.size());
-  DCHECK_LT(bufid, kBufRingEntriesCnt);
+  DCHECK_LT(bufid, bufring_groups_[group_id].nentries);
   DCHECK(bufring_groups_[group_id].buf);
-  return bufring_groups_[group_id].buf + bufid * kBufRingEntrySize;
+  return bufring_groups_[group_id].buf + size_t(bufid) * bufring_groups_[group_id].esize;
 }
 
-void UringProactor::ConsumeBufRing(unsigned group_id, unsigned len) {
+void UringProactor::ConsumeBufRing(uint16_t group_id, uint16_t bufid) {
   DCHECK_LT(group_id, bufring_groups_.size());
-  DCHECK_LE(len, kBufRingEntriesCnt);
-  DCHECK(bufring_groups_[group_id].ring);
+  auto& group = bufring_groups_[group_id];
+  DCHECK(group.ring);
+  DCHECK_LT(bufid, group.nentries);
+
+  io_uring_buf_ring_add(group.ring, group.buf + size_t(bufid) * group.esize, group.esize, bufid,
+                        io_uring_buf_ring_mask(group.nentries), 0);
+  io_uring_buf_ring_advance(group.ring, 1);
+  ++group.return_epoch;
+  bufring_cv_.notify_all();
+}
+
+bool UringProactor::AwaitBufRingReturn(uint16_t group_id, uint32_t epoch,
+                                       chrono::steady_clock::time_point tp) {
+  DCHECK_LT(group_id, bufring_groups_.size());
+  NoOpLock lock;
+  return bufring_cv_.wait_until(lock, tp, [&] {
+    return bufring_groups_[group_id].return_epoch != epoch;
+  });
+}
+
+int UringProactor::RegisterZcrx() {
+  const size_t page_size = getpagesize();
+  size_t area_size = (zcrx_cfg_.area_size + page_size - 1) / page_size * page_size;
+  uint32_t rq_entries = zcrx_cfg_.rq_entries;
+  if (area_size == 0 || rq_entries == 0 || (rq_entries & (rq_entries - 1)) != 0)
+    return EINVAL;
+
+  bool huge;
+  void* area = MapBufferBacking(area_size, &huge);
+  if (area == MAP_FAILED)
+    return errno;
+  BindToLocalNode(area, area_size);
+
+  // The refill queue: a page for the head and the tail followed by the entries.
+  size_t region_size = page_size + size_t(rq_entries) * sizeof(ZcrxRqe);
+  region_size = (region_size + page_size - 1) / page_size * page_size;
+  void* region =
+      mmap(nullptr, region_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (region == MAP_FAILED) {
+    int err = errno;
+    munmap(area, area_size);
+    return err;
+  }
+
+  ZcrxAreaReg area_reg;
+  memset(&area_reg, 0, sizeof(area_reg));
+  area_reg.addr = reinterpret_cast<uint64_t>(area);
+  area_reg.len = area_size;
+
+  RegionDesc region_desc;
+  memset(&region_desc, 0, sizeof(region_desc));
+  region_desc.user_addr = reinterpret_cast<uint64_t>(region);
+  region_desc.size = region_size;
+  region_desc.flags = kMemRegionTypeUser;
+
+  ZcrxIfqReg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.if_idx = zcrx_cfg_.if_idx;
+  reg.if_rxq = zcrx_cfg_.rxq;
+  reg.rq_entries = rq_entries;
+  reg.area_ptr = reinterpret_cast<uint64_t>(&area_reg);
+  reg.region_ptr = reinterpret_cast<uint64_t>(&region_desc);
+
+  int res = io_uring_register(ring_.ring_fd, kRegisterZcrxIfq, &reg, 1);
+  if (res < 0) {
+    munmap(region, region_size);
+    munmap(area, area_size);
+    return -res;
+  }
+
+  // The kernel may round rq_entries up.
+  uint8_t* rbase = reinterpret_cast<uint8_t*>(region);
+  zcrx_.area = reinterpret_cast<uint8_t*>(area);
+  zcrx_.area_size = area_size;
+  zcrx_.region = rbase;
+  zcrx_.region_size = region_size;
+  zcrx_.rq_head = reinterpret_cast<uint32_t*>(rbase + reg.offsets.head);
+  zcrx_.rq_tail = reinterpret_cast<uint32_t*>(rbase + reg.offsets.tail);
+  zcrx_.rqes = rbase + reg.offsets.rqes;
+  zcrx_.rq_mask = reg.rq_entries - 1;
+  zcrx_.tail = 0;
+  zcrx_.area_token = area_reg.rq_area_token;
+  zcrx_.id = reg.zcrx_id;
+
+  VPRO(1) << "Registered zero-copy receive on interface " << reg.if_idx << " queue "
+          << reg.if_rxq << ", area " << area_size << " bytes, huge: " << huge;
+  return 0;
+}
+
+void UringProactor::ReturnZcrx(uint64_t off, uint32_t len) {
+  DCHECK(zcrx_.area);
+  zcrx_.pending.emplace_back(off, len);
+  FlushZcrxReturns();
+  ++zcrx_.return_epoch;
+  bufring_cv_.notify_all();
+}
+
+void UringProactor::FlushZcrxReturns() {
+  uint32_t head = __atomic_load_n(zcrx_.rq_head, __ATOMIC_ACQUIRE);
+  uint32_t room = zcrx_.rq_mask + 1 - (zcrx_.tail - head);
+  size_t n = min<size_t>(room, zcrx_.pending.size());
+  if (n == 0)
+    return;
 
-  io_uring_buf_ring_advance(bufring_groups_[group_id].ring, len);
+  ZcrxRqe* rqes = reinterpret_cast<ZcrxRqe*>(zcrx_.rqes);
+  for (size_t i = 0; i < n; ++i) {
+    ZcrxRqe& rqe = rqes[zcrx_.tail++ & zcrx_.rq_mask];
+    rqe.off = (zcrx_.pending[i].first & ~kZcrxAreaMask) | zcrx_.area_token;
+    rqe.len = zcrx_.pending[i].second;
+    rqe.pad = 0;
+  }
+  __atomic_store_n(zcrx_.rq_tail, zcrx_.tail, __ATOMIC_RELEASE);
+  zcrx_.pending.erase(zcrx_.pending.begin(), zcrx_.pending.begin() + n);
+}
+
+bool UringProactor::AwaitZcrxReturn(uint32_t epoch, chrono::steady_clock::time_point tp) {
+  NoOpLock lock;
+  return bufring_cv_.wait_until(lock, tp, [&] { return zcrx_.return_epoch != epoch; });
 }
 
 int UringProactor::CancelRequests(int fd, unsigned flags) {
@@ -456,15 +1039,83 @@ void UringProactor::RegrowCentries() {
           << " pending cb-cnt: " << pending_cb_cnt_;
 
   centries_.resize(prev * 2);  // grow by 2.
+  if (op_tracing_)
+    op_traces_.resize(centries_.size());
   next_free_ce_ = prev;
   for (; prev < centries_.size() - 1; ++prev)
     centries_[prev].index = prev + 1;
 }
 
+void UringProactor::EnableOpTracing(bool enable, OpTraceHook hook) {
+  op_tracing_ = enable;
+  op_trace_hook_ = std::move(hook);
+  if (enable) {
+    op_traces_.resize(centries_.size());
+  } else {
+    trace_unsubmitted_.clear();
+    for (auto& t : op_traces_)
+      t.start_tsc = 0;
+  }
+}
+
+void UringProactor::MarkTracedSubmittedInternal() {
+  uint64_t now = CycleClock::Now();
+  for (uint32_t index : trace_unsubmitted_) {
+    OpTrace& t = op_traces_[index];
+
+    // The opcode is set by SubmitEntry after GetSubmitEntry and the sqe is reused once
+    // submitted, so this is the last point where we can read it.
+    t.opcode = t.sqe->opcode;
+    t.sqe = nullptr;
+    t.submit_tsc = now;
+  }
+  trace_unsubmitted_.clear();
+}
+
+void UringProactor::RecordOpLatency(size_t index) {
+  OpTrace& t = op_traces_[index];
+  if (t.start_tsc == 0 || t.sqe)  // not traced or enabled after the submission.
+    return;
+
+  uint64_t now = CycleClock::Now();
+  uint64_t queue_cycles = t.submit_tsc - t.start_tsc;
+  uint64_t kernel_cycles = now > t.submit_tsc ? now - t.submit_tsc : 0;
+  t.start_tsc = 0;
+
+  double queue_usec = CycleClock::ToNsec(queue_cycles) * 1e-3;
+  double kernel_usec = CycleClock::ToNsec(kernel_cycles) * 1e-3;
+  auto add = [&](auto& map, auto key) {
+    auto& lat = map[key];
+    if (!lat)
+      lat = std::make_unique<OpLatency>();
+    lat->queue_usec.Add(queue_usec);
+    lat->kernel_usec.Add(kernel_usec);
+  };
+
+  add(op_trace_stats_.by_opcode, t.opcode);
+  if (t.tag)
+    add(op_trace_stats_.by_tag, t.tag);
+
+  if (op_trace_hook_)
+    op_trace_hook_(t.opcode, t.tag, queue_cycles, kernel_cycles);
+}
+
 void UringProactor::ArmWakeupEvent() {
   struct io_uring_sqe* sqe = io_uring_get_sqe(&ring_);
   CHECK_NOTNULL(sqe);
 
+  if (futex_f_) {
+    // Waits while wake_futex_ is 0, see WakeRing.
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = kOpFutexWait;
+    sqe->fd = kFutex2SizeU32 | kFutex2Private;
+    sqe->addr = reinterpret_cast<uintptr_t>(&wake_futex_);
+    sqe->off = 0;
+    sqe->addr3 = FUTEX_BITSET_MATCH_ANY;
+    sqe->user_data = kWakeIndex;
+    return;
+  }
+
   io_uring_prep_poll_add(sqe, wake_fd_, POLLIN);
   uint8_t flag = 0;
   sqe->user_data = kIgnoreIndex;
@@ -483,6 +1134,17 @@ void UringProactor::ArmWakeupEvent() {
 void UringProactor::SchedulePeriodic(uint32_t id, PeriodicItem* item) {
   VPRO(2) << "SchedulePeriodic " << id;
 
+  if (item->ref_cnt == 1 && IsCoarse(*item))  // a new task.
+    ++wheel_.coarse_cnt;
+
+  item->deadline_ns = GetClockNanos() + item->period_ns();
+  if (UseWheel(*item)) {
+    WheelInsert(id, item);
+    if (wheel_.timer_ud == 0)
+      ArmWheelTimer();
+    return;
+  }
+
   SubmitEntry se =
       GetSubmitEntry([this, id, item](detail::FiberInterface*, IoResult res, uint32_t flags) {
         this->PeriodicCb(res, id, std::move(item));
@@ -504,13 +1166,19 @@ void UringProactor::PeriodicCb(IoResult res, uint32 task_id, PeriodicItem* item)
   CHECK_EQ(res, -ETIME);
 
   DCHECK(periodic_map_.find(task_id) != periodic_map_.end());
-  DCHECK(item->task);
-  item->task();
+  RunPeriodic(item);
 
   schedule_periodic_list_.emplace_back(task_id, item);
 }
 
 void UringProactor::CancelPeriodicInternal(PeriodicItem* item) {
+  if (IsCoarse(*item))
+    --wheel_.coarse_cnt;
+
+  // The wheel deletes the item when it reaches its slot, it never runs the task again.
+  if (item->val1 == kWheelItem)
+    return;
+
   auto* me = detail::FiberActive();
   auto cb = [me](detail::FiberInterface* current, IoResult res, uint32_t flags) {
     ActivateSameThread(current, me);
@@ -523,6 +1191,120 @@ void UringProactor::CancelPeriodicInternal(PeriodicItem* item) {
   me->Suspend();
 }
 
+bool UringProactor::IsCoarse(const PeriodicItem& item) const {
+  return wheel_.tick_ns > 0 && item.period_ns() >= kWheelMinTicks * wheel_.tick_ns;
+}
+
+bool UringProactor::UseWheel(const PeriodicItem& item) const {
+  return wheel_.coarse_cnt >= kWheelMinTasks && IsCoarse(item);
+}
+
+uint64_t UringProactor::WheelTick(uint64_t ns) const {
+  return ns <= wheel_.start_ns ? 0 : (ns - wheel_.start_ns + wheel_.tick_ns - 1) / wheel_.tick_ns;
+}
+
+void UringProactor::WheelInsert(uint32_t id, PeriodicItem* item) {
+  if (wheel_.size == 0)  // the wheel did not advance while it was empty.
+    wheel_.cur_tick = CurrentWheelTick();
+
+  uint64_t tick = std::max(WheelTick(item->deadline_ns), wheel_.cur_tick + 1);
+  wheel_.slots[tick % TimerWheel::kSlots].emplace_back(id, item);
+  ++wheel_.size;
+  item->ref_cnt = 2;  // one for the map and one for the wheel.
+  item->val1 = kWheelItem;
+}
+
+uint64_t UringProactor::CurrentWheelTick() const {
+  uint64_t now = GetClockNanos();
+  return now > wheel_.start_ns ? (now - wheel_.start_ns) / wheel_.tick_ns : 0;
+}
+
+void UringProactor::AdvanceWheel() {
+  uint64_t target = CurrentWheelTick();
+
+  // A single round visits every slot.
+  if (target > wheel_.cur_tick + TimerWheel::kSlots)
+    wheel_.cur_tick = target - TimerWheel::kSlots;
+
+  while (wheel_.cur_tick < target && wheel_.size > 0) {
+    ++wheel_.cur_tick;
+    auto& slot = wheel_.slots[wheel_.cur_tick % TimerWheel::kSlots];
+    if (slot.empty())
+      continue;
+
+    // The tasks may insert into the slot that we iterate over.
+    wheel_.scratch.swap(slot);
+    for (auto [id, item] : wheel_.scratch) {
+      if (item->ref_cnt <= 1) {  // cancelled.
+        --wheel_.size;
+        delete item;
+        continue;
+      }
+
+      if (WheelTick(item->deadline_ns) > target) {  // due in one of the next rounds.
+        slot.emplace_back(id, item);
+        continue;
+      }
+
+      --wheel_.size;
+      uint64_t start = RunPeriodic(item);
+      if (item->ref_cnt <= 1) {
+        delete item;
+        continue;
+      }
+
+      if (UseWheel(*item)) {
+        // Keep the phase of the task unless it fell behind by more than a period.
+        item->deadline_ns = std::max(item->deadline_ns, start) + item->period_ns();
+        WheelInsert(id, item);
+      } else {
+        SchedulePeriodic(id, item);
+      }
+    }
+    wheel_.scratch.clear();
+  }
+}
+
+void UringProactor::ArmWheelTimer() {
+  DCHECK_EQ(wheel_.timer_ud, 0u);
+
+  SubmitEntry se = GetSubmitEntry(
+      [this](detail::FiberInterface*, IoResult res, uint32_t flags) { WheelTimerCb(res, flags); });
+  se.PrepTimeout(&wheel_.tick_ts, false);
+  if (timeout_multishot_f_)
+    se.sqe()->timeout_flags |= kTimeoutMultishot;  // off == 0 repeats it until it is removed.
+  wheel_.timer_ud = se.sqe()->user_data;
+  wheel_.stopping = false;
+}
+
+void UringProactor::StopWheelTimer() {
+  if (!timeout_multishot_f_)  // a single shot timeout is just not rearmed.
+    return;
+
+  SubmitEntry se = GetSubmitEntry(nullptr);
+  se.PrepTimeoutRemove(wheel_.timer_ud);
+  wheel_.stopping = true;
+}
+
+// Runs from ProcessCqeBatch, which may not submit from multishot callbacks, so the wheel is
+// advanced and rearmed later in ReapCompletions.
+void UringProactor::WheelTimerCb(IoResult res, uint32_t flags) {
+  if (flags & IORING_CQE_F_MORE) {
+    wheel_.due = true;
+    return;
+  }
+
+  wheel_.timer_ud = 0;
+  if (res == -ETIME) {
+    wheel_.due = true;
+  } else if (res == -EINVAL && timeout_multishot_f_) {
+    LOG(WARNING) << "Multishot timeouts are not supported, falling back to single shot";
+    timeout_multishot_f_ = 0;
+  } else {
+    LOG_IF(ERROR, res != -ECANCELED) << "Unexpected wheel timeout result " << res;
+  }
+}
+
 unsigned UringProactor::RegisterFd(int source_fd) {
   if (!direct_fd_)
     return kInvalidDirectFd;
@@ -598,6 +1380,41 @@ int UringProactor::UnregisterFd(unsigned fixed_fd) {
   return fd;
 }
 
+void UringProactor::WaitIdle(__kernel_timespec* ts) {
+  if (!ext_wait_f_) {
+    wait_for_cqe(&ring_, 1, ts);
+    return;
+  }
+
+  // The wait below does not submit, hence we submit what the tasks have queued, if anything.
+  if (io_uring_sq_ready(&ring_))
+    io_uring_submit(&ring_);
+  if (io_uring_cq_ready(&ring_))
+    return;
+
+  GeteventsArg arg{0, _NSIG / 8, min_wait_usec_, reinterpret_cast<uintptr_t>(ts)};
+  unsigned flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+  int fd = ring_.ring_fd;
+  if (reg_ring_f_) {
+    flags |= IORING_ENTER_REGISTERED_RING;
+    fd = ring_.enter_ring_fd;
+  }
+
+  int res = io_uring_enter2(fd, 0, wait_batch_, flags, reinterpret_cast<sigset_t*>(&arg),
+                            sizeof(arg));
+  if (res < 0) {
+    res = -res;
+    if (res == EINVAL && min_wait_usec_) {
+      LOG(WARNING) << "Min-wait timeouts are not supported, waiting for single completions";
+      min_wait_usec_ = 0;
+      wait_batch_ = 1;
+    } else {
+      LOG_IF(ERROR, res != EAGAIN && res != EINTR && res != ETIME && res != EBUSY)
+          << SafeErrorMessage(res);
+    }
+  }
+}
+
 LinuxSocketBase* UringProactor::CreateSocket() {
   return new UringSocket{-1, this};
 }
@@ -627,14 +1444,26 @@ void UringProactor::MainLoop(detail::Scheduler* scheduler) {
 
   while (true) {
     ++stats_.loop_cnt;
+    OnLoopIteration();
     bool has_cpu_work = false;
 
+    // The sends of the coalesced writes are submitted together with the rest of the sqes.
+    FlushCorkedSockets();
+    has_cpu_work = FlushDispatchBatches();
+
     // io_uring_submit should be more performant in some case than io_uring_submit_and_get_events
     // because when there no sqes to flush io_submit may save
     // a syscall, while io_uring_submit_and_get_events will always do a syscall.
     // Unfortunately I did not see the impact of it.
     // Another observation:
     // AvgCqe/ReapCall goes up if we call here io_uring_submit_and_get_events.
+    if (sqpoll_f_ && io_uring_sq_ready(&ring_) > 0 &&
+        (IO_URING_READ_ONCE(*ring_.sq.kflags) & IORING_SQ_NEED_WAKEUP)) {
+      // The sq thread went to sleep, the submit call below wakes it up via a syscall.
+      ++stats_.sqpoll_wakeups;
+    }
+
+    MarkTracedSubmitted();
     int num_submitted = io_uring_submit_and_get_events(&ring_);
     bool ring_busy = false;
 
@@ -658,6 +1487,7 @@ void UringProactor::MainLoop(detail::Scheduler* scheduler) {
     // calls. We allocate quota of 500K nsec (500usec) of CPU time per iteration
     // To save redundant timer-calls we start measuring time only when if the queue is not empty.
     if (task_queue_.try_dequeue(task)) {
+      EndIdleSpin();
       uint32_t cnt = 0;
       uint64_t task_start = GetClockNanos();
 
@@ -675,6 +1505,7 @@ void UringProactor::MainLoop(detail::Scheduler* scheduler) {
         }
       } while (task_queue_.try_dequeue(task));
       stats_.num_task_runs += cnt;
+      LogEvent(EventType::kTaskBatch, cnt);
       DVLOG(2) << "Tasks runs " << stats_.num_task_runs << "/" << spin_loops;
 
       // We notify second time to avoid deadlocks.
@@ -682,6 +1513,9 @@ void UringProactor::MainLoop(detail::Scheduler* scheduler) {
       task_queue_avail_.notifyAll();
     }
 
+    if (DrainLanes())
+      has_cpu_work = true;
+
     scheduler->ProcessRemoteReady(nullptr);
 
     // Traverses one or more fibers because a worker fiber does not necessarily returns
@@ -691,6 +1525,7 @@ void UringProactor::MainLoop(detail::Scheduler* scheduler) {
     // We can not iterate in while loop here because fibers that yield will make the loop
     // never ending.
     if (scheduler->HasReady()) {
+      EndIdleSpin();
       FiberInterface* fi = scheduler->PopReady();
       DCHECK(!fi->list_hook.is_linked());
       DCHECK(!fi->sleep_hook.is_linked());
@@ -710,6 +1545,7 @@ void UringProactor::MainLoop(detail::Scheduler* scheduler) {
 
     uint32_t cqe_count = io_uring_peek_batch_cqe(&ring_, cqes, kCqeBatchLen);
     if (cqe_count) {
+      EndIdleSpin();
       ++stats_.completions_fetches;
 
       // cqe tail (ring->cq.ktail) can be updated asynchronously by the kernel even if we
@@ -719,6 +1555,11 @@ void UringProactor::MainLoop(detail::Scheduler* scheduler) {
       continue;
     }
 
+    // The tasks and the fibers that ran above may have coalesced dispatches, which must not
+    // wait in the batches while we block. The next iteration flushes them.
+    if (!dispatch_batches_.empty())
+      has_cpu_work = true;
+
     if (has_cpu_work || io_uring_sq_ready(&ring_) > 0) {
       continue;
     }
@@ -733,6 +1574,10 @@ void UringProactor::MainLoop(detail::Scheduler* scheduler) {
       }
     }
 
+    if (TryStealFiber()) {
+      continue;
+    }
+
     DCHECK(!scheduler->HasReady());
     DCHECK_EQ(io_uring_sq_ready(&ring_), 0u);
 
@@ -746,8 +1591,8 @@ void UringProactor::MainLoop(detail::Scheduler* scheduler) {
 
     // Lets spin a bit to make a system a bit more responsive.
     // Important to spin a bit, otherwise we put too much pressure on  eventfd_write.
-    // and we enter too often into kernel space.
-    if (!ring_busy && spin_loops++ < 10) {
+    // and we enter too often into kernel space. The idle policy may extend the spinning.
+    if (!ring_busy && ContinueIdleSpin(spin_loops++ < 10)) {
       DVLOG(3) << "spin_loops " << spin_loops;
 
       // We should not spin too much using sched_yield or it burns a fuckload of cpu.
@@ -784,6 +1629,8 @@ void UringProactor::MainLoop(detail::Scheduler* scheduler) {
         tq_seq_.compare_exchange_weak(tq_seq, WAIT_SECTION_STATE, std::memory_order_acquire)) {
       if (is_stopped_) {
         tq_seq_.store(0, std::memory_order_release);  // clear WAIT section
+        if (ReclaimSharedFibers())
+          continue;
         break;
       }
 
@@ -791,7 +1638,10 @@ void UringProactor::MainLoop(detail::Scheduler* scheduler) {
 
       VPRO(2) << "wait_for_cqe " << stats_.loop_cnt;
 
-      wait_for_cqe(&ring_, 1, ts_arg);
+      uint64_t wait_start = GetClockNanos();
+      MarkTracedSubmitted();  // the wait submits the sqes that the tasks have queued.
+      WaitIdle(ts_arg);
+      OnIdleWakeup(wait_start);
       VPRO(2) << "Woke up after wait_for_cqe ";
 
       ++stats_.num_stalls;
@@ -828,12 +1678,52 @@ void UringProactor::WakeRing() {
   if (caller && caller->msgring_f_) {
     SubmitEntry se = caller->GetSubmitEntry(nullptr, kMsgRingSubmitTag);
     se.PrepMsgRing(ring_.ring_fd, 0, 0);
+  } else if (futex_f_) {
+    // A single FUTEX_WAKE completes the wait of the ring, unless a wakeup is already pending.
+    if (wake_futex_.exchange(1, std::memory_order_seq_cst) == 0)
+      syscall(SYS_futex, &wake_futex_, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
   } else {
     // it's wake_fd_ and not wake_fixed_fd_ deliberately since we use plain write and not iouring.
     CHECK_EQ(8, write(wake_fd_, &wake_val, sizeof(wake_val)));
   }
 }
 
+uint16_t UringProactor::RegisterMsgHandler(MsgHandler handler) {
+  uint16_t id = num_msg_handlers.fetch_add(1, memory_order_relaxed);
+  CHECK_LT(id, kMaxMsgHandlers);
+  msg_handlers[id].store(handler, memory_order_release);
+  return id;
+}
+
+bool UringProactor::PostMsg(UringProactor* dest, uint16_t handler_id, uint64_t data, int32_t arg,
+                            CbType on_sent) {
+  DCHECK(InMyThread());
+  DCHECK_LT(handler_id, num_msg_handlers.load(memory_order_relaxed));
+  DCHECK_LT(data, 1ULL << kMsgHandlerShift);
+  if (!msgring_f_)
+    return false;
+
+  SubmitEntry se = GetSubmitEntry(std::move(on_sent), kMsgRingSubmitTag);
+  se.PrepMsgRing(dest->ring_fd(), uint32_t(arg),
+                 kMsgFlag | (uint64_t(handler_id) << kMsgHandlerShift) | data);
+  return true;
+}
+
+bool UringProactor::PostFiberAttach(ProactorBase* dest, detail::FiberInterface* fiber) {
+  if (dest->GetKind() != IOURING)
+    return false;
+
+  // The destination ring is woken by the completion itself, the task queue is not involved.
+  auto on_sent = [dest, fiber](detail::FiberInterface*, IoResult res, uint32_t) {
+    if (res < 0) {
+      LOG(WARNING) << "Could not post a migrated fiber: " << -res;
+      static_cast<UringProactor*>(ProactorBase::me())->EnqueueAttach(dest, fiber);
+    }
+  };
+  return PostMsg(static_cast<UringProactor*>(dest), AttachFiberMsgId(),
+                 reinterpret_cast<uintptr_t>(fiber), 0, std::move(on_sent));
+}
+
 void UringProactor::EpollAddInternal(EpollIndex id) {
   auto uring_cb = [id, this](detail::FiberInterface* p, IoResult res, uint32_t flags) {
     auto& epoll = epoll_entries_[id];
@@ -4,12 +4,14 @@
 
 #pragma once
 
+#include <absl/container/flat_hash_map.h>
 #include <liburing.h>
 #include <pthread.h>
 
+#include "base/histogram.h"
+#include "base/size_class_pool.h"
 #include "util/fibers/proactor_base.h"
 #include "util/fibers/submit_entry.h"
-#include "base/segment_pool.h"
 
 namespace util {
 namespace fb2 {
@@ -33,9 +35,23 @@ class UringProactor : public ProactorBase {
  public:
   static constexpr unsigned kInvalidDirectFd = -1;
 
-  UringProactor();
+  explicit UringProactor(size_t task_queue_len = kTaskQueueLen);
   ~UringProactor();
 
+  struct SqPollConfig {
+    bool enabled = false;
+    uint32_t idle_msec = 1000;  // how long the sq thread spins before going to sleep.
+    int cpu = -1;               // cpu to pin the sq thread to, -1 to disable pinning.
+  };
+
+  // Runs the ring in IORING_SETUP_SQPOLL mode. Must be called before Init.
+  // Requires kernel 5.11 or later, ignored otherwise.
+  void SetSqPoll(const SqPollConfig& cfg) {
+    sqpoll_cfg_ = cfg;
+  }
+
+  // If wq_fd is a valid ring fd, the ring shares the async worker pool of that ring
+  // (IORING_SETUP_ATTACH_WQ).
   void Init(unsigned pool_index, size_t ring_size, int wq_fd = -1);
 
   using IoResult = int;
@@ -45,10 +61,7 @@ class UringProactor : public ProactorBase {
   // uint32_t - epoll flags.
   // int64_t is the payload supplied during event submission. See GetSubmitEntry below.
   // using CbType = std::function<void(IoResult, uint32_t)>;
-  using CbType =
-      fu2::function_base<true /*owns*/, false /*non-copyable*/, fu2::capacity_fixed<16, 8>,
-                         false /* non-throwing*/, false /* strong exceptions guarantees*/,
-                         void(detail::FiberInterface*, IoResult, uint32_t)>;
+  using CbType = base::SmallFunction<16, void(detail::FiberInterface*, IoResult, uint32_t)>;
   /**
    * @brief Get the Submit Entry object in order to issue I/O request.
    *
@@ -99,51 +112,262 @@ class UringProactor : public ProactorBase {
     return IOURING;
   }
 
-  // Register buffer with given size and allocate backing, calls io_uring_register_buffers
-  int RegisterBuffers(size_t size);
+  // Register buffer with given size and allocate backing, registers a sparse buffer table.
+  // If max_size is greater than size, RequestBuffer grows the backing on demand by allocating
+  // additional regions and adding them to the table, until max_size bytes are registered.
+  // The backing does not grow on kernels without sparse tables (before 5.13).
+  // The regions whose sizes are multiples of 2MB or 1GB are backed by explicit hugepages
+  // if the system has free ones (see --uring_buf_hugepages), and the regions allocated in
+  // the proactor thread prefer its numa node.
+  // Returns 0 on success, -errno on failure.
+  int RegisterBuffers(size_t size, size_t max_size = 0);
 
   // Request buffer of given size, returns none if there's no space left in the backing.
   // Must be returned with ReturnBuffer
   std::optional<UringBuf> RequestBuffer(size_t size);
   void ReturnBuffer(UringBuf buf);
 
+  struct RegisteredBufferStats {
+    size_t total_bytes = 0;
+    size_t hugepage_bytes = 0;  // part of total_bytes backed by explicit hugepages.
+    size_t used_bytes = 0;
+    size_t largest_free_bytes = 0;  // total - used - largest is wasted on fragmentation.
+    unsigned free_ranges = 0;
+    unsigned regions = 0;
+    uint64_t requests = 0;
+    uint64_t failures = 0;  // requests that returned none.
+    uint64_t grow_cnt = 0;
+  };
+
+  RegisteredBufferStats GetRegisteredBufferStats() const;
+
   // Wrapper interface around io_uring_(un)register_buffers.
   // Returns 0 on success, -errno on failure.
   int RegisterBuffers(const struct iovec* iovecs, unsigned nr_vecs);
   int UnregisterBuffers();
 
-  // Experimental. should not be called in production.
-  // Registers an iouring buffer ring (see io_uring_register_buf_ring(3)).
-  // Registers a predefined 16K buffer ring with specified buffer group_id.
+  // Returns the buf_idx of the region of RequestBuffer buffers that contains [ptr, ptr + len)
+  // or none. Allows the sockets to send from the registered buffers.
+  std::optional<unsigned> FindRegisteredBuffer(const void* ptr, size_t len) const;
+
+  // Registers an iouring buffer ring (see io_uring_register_buf_ring(3)) with nentries
+  // buffers of esize bytes each under the specified buffer group_id. nentries must be a power
+  // of 2 and not greater than 32768. The backing memory is mmapped, so pages are committed only
+  // when the kernel fills them, unless the backing gets explicit hugepages like the registered
+  // buffers. Used by UringSocket::EnableRecvMultishot.
   // Returns 0 on success, errno on failure.
-  int RegisterBufferRing(unsigned group_id);
-  uint8_t* GetBufRingPtr(unsigned group_id, unsigned bufid);
-  void ConsumeBufRing(unsigned group_id, unsigned len);
+  int RegisterBufferRing(uint16_t group_id, uint16_t nentries, unsigned esize);
+
+  bool HasBufferRing(uint16_t group_id) const {
+    return group_id < bufring_groups_.size() && bufring_groups_[group_id].ring != nullptr;
+  }
+
+  unsigned GetBufRingEntrySize(uint16_t group_id) const {
+    return bufring_groups_[group_id].esize;
+  }
+
+  uint8_t* GetBufRingPtr(uint16_t group_id, uint16_t bufid);
+
+  // Returns the buffer bufid, previously selected by the kernel, back to the ring.
+  void ConsumeBufRing(uint16_t group_id, uint16_t bufid);
+
+  // Counts how many buffers were returned to the ring of group_id via ConsumeBufRing.
+  uint32_t BufRingReturnEpoch(uint16_t group_id) const {
+    return bufring_groups_[group_id].return_epoch;
+  }
+
+  // Suspends the calling fiber until BufRingReturnEpoch(group_id) differs from epoch or
+  // until tp is reached. Returns false on timeout.
+  bool AwaitBufRingReturn(uint16_t group_id, uint32_t epoch,
+                          std::chrono::steady_clock::time_point tp);
+
+  struct ZcrxConfig {
+    unsigned if_idx = 0;          // the network interface, 0 disables zero-copy receive.
+    uint32_t rxq = 0;             // the hardware rx queue of the interface.
+    uint32_t rq_entries = 8192;   // entries of the refill queue, a power of 2.
+    size_t area_size = 64 << 20;  // the memory that the NIC receives into.
+  };
+
+  // Registers an io_uring zero-copy receive interface queue (ZCRX) for the rx queue rxq of
+  // the interface during Init, so that the sockets in UringSocket::EnableRecvZeroCopy mode
+  // receive the payloads directly into the area that is mapped to the NIC. Requires kernel
+  // 6.15 and a ring without SQPOLL, which is then set up with 32 byte completions. The NIC
+  // must split the headers and the flows of the sockets must be steered to rxq, otherwise
+  // the kernel copies into the area. If the registration fails, Init logs a warning and the
+  // sockets fall back to the buffer rings. Must be called before Init.
+  void SetZcrx(const ZcrxConfig& cfg) {
+    zcrx_cfg_ = cfg;
+  }
+
+  bool HasZcrx() const {
+    return zcrx_.area != nullptr;
+  }
+
+  uint32_t zcrx_id() const {
+    return zcrx_.id;
+  }
+
+  // Returns the payload of a zero-copy receive completion with the area offset off.
+  const uint8_t* GetZcrxPtr(uint64_t off) const {
+    return zcrx_.area + (off & ~kZcrxAreaMask);
+  }
+
+  // Hands the received buffer at off back to the NIC via the refill queue.
+  void ReturnZcrx(uint64_t off, uint32_t len);
+
+  // Counts how many buffers were handed back via ReturnZcrx.
+  uint32_t ZcrxReturnEpoch() const {
+    return zcrx_.return_epoch;
+  }
+
+  // Suspends the calling fiber until ZcrxReturnEpoch() differs from epoch or until tp is
+  // reached. Returns false on timeout.
+  bool AwaitZcrxReturn(uint32_t epoch, std::chrono::steady_clock::time_point tp);
+
+  // The second half of the 32 byte completion that is being dispatched. Valid only inside
+  // the completion callbacks and only if the zero-copy receive is registered, nullptr
+  // otherwise.
+  const uint64_t* cqe_extra() const {
+    return cqe_extra_;
+  }
+
+  // In addition to the fiber stacks, populates the backing of the buffer rings, which the
+  // kernel would otherwise fault in upon the first receives, and reads the pages of the
+  // submission and completion rings.
+  void Warmup() final;
+
+  // Recv multishot with provided buffers is supported since 6.0.
+  bool HasRecvMultishot() const {
+    return recv_multishot_f_;
+  }
+
+  // IORING_ACCEPT_MULTISHOT is supported since 5.19.
+  bool HasAcceptMultishot() const {
+    return accept_multishot_f_;
+  }
+
+  // IORING_OP_SEND_ZC and IORING_OP_SENDMSG_ZC are supported since 6.1.
+  bool HasSendZc() const {
+    return send_zc_f_;
+  }
+
+  // Whether the ring runs in IORING_SETUP_SQPOLL mode, see SetSqPoll.
+  bool HasSqPoll() const {
+    return sqpoll_f_;
+  }
+
+  // IORING_OP_MSG_RING is supported since 5.18.
+  bool HasMsgRing() const {
+    return msgring_f_;
+  }
+
+  // Whether the threads without a ring wake this proactor via a futex, see
+  // --uring_futex_wakeup.
+  bool HasFutexWakeup() const {
+    return futex_f_;
+  }
+
+  // Handles the messages posted with PostMsg. Runs in the thread of the receiving proactor,
+  // from its completion loop, so it must not block.
+  using MsgHandler = void (*)(uint64_t data, int32_t arg);
+
+  // Registers a handler for PostMsg and returns its id. Thread-safe.
+  static uint16_t RegisterMsgHandler(MsgHandler handler);
+
+  // Passes (data, arg) to the handler handler_id in the thread of dest. The message is posted
+  // with IORING_OP_MSG_RING directly as a completion of the ring of dest, bypassing its task
+  // queue. data must be less than 2^48, so it can hold a pointer.
+  // on_sent, if set, is called in this thread with the result of the send, which is negative
+  // if the message could not be posted. Must be called from the proactor thread.
+  // Returns false without posting if MSG_RING is not supported, in which case the caller
+  // should use the task queue.
+  bool PostMsg(UringProactor* dest, uint16_t handler_id, uint64_t data, int32_t arg = 0,
+               CbType on_sent = nullptr);
 
   // Returns 0 on success, errno on failure.
   // See io_uring_prep_cancel(3) for flags.
   int CancelRequests(int fd, unsigned flags);
 
-  using EpollCB = std::function<void(uint32_t)>;
+  using EpollCB = base::SmallFunction<48, void(uint32_t)>;
   using EpollIndex = unsigned;
   EpollIndex EpollAdd(int fd, EpollCB cb, uint32_t event_mask);
   void EpollDel(EpollIndex id);
 
+  // Latencies of the traced operations in microseconds. queue_usec is the time between
+  // GetSubmitEntry and the submission of the sqe to the kernel, i.e. our own scheduling delay,
+  // and kernel_usec the time between the submission and the reaping of its cqe.
+  struct OpLatency {
+    base::FixedHistogram queue_usec;
+    base::FixedHistogram kernel_usec;
+  };
+
+  struct OpTraceStats {
+    absl::flat_hash_map<uint8_t, std::unique_ptr<OpLatency>> by_opcode;
+    absl::flat_hash_map<uint16_t, std::unique_ptr<OpLatency>> by_tag;  // non-zero tags only.
+  };
+
+  // Called upon each traced completion with the opcode and the submit tag of the operation and
+  // its latencies in fb2::CycleClock cycles, e.g. to feed metrics::HistogramFamily::ObserveCycles.
+  // Runs in the proactor thread, so it must not block.
+  using OpTraceHook = std::function<void(uint8_t opcode, uint16_t submit_tag,
+                                         uint64_t queue_cycles, uint64_t kernel_cycles)>;
+
+  // Records the latency of every operation that has a completion callback. Multishot
+  // operations are not traced. Costs two cycle clock reads per operation.
+  // Must be called from the proactor thread or before it starts running.
+  void EnableOpTracing(bool enable, OpTraceHook hook = {});
+
+  // Accumulated since tracing was first enabled. Must be called from the proactor thread.
+  const OpTraceStats& op_trace_stats() const {
+    return op_trace_stats_;
+  }
+
  private:
   void ProcessCqeBatch(unsigned count, io_uring_cqe** cqes, detail::FiberInterface* current);
   void ReapCompletions(unsigned count, io_uring_cqe** cqes, detail::FiberInterface* current);
 
   void RegrowCentries();
 
-  // Used with older kernels with msgring_f_ == 0.
+  // Stamps the traced entries that are about to be submitted. Must be called before the sqes
+  // are passed to the kernel.
+  void MarkTracedSubmitted() {
+    if (ABSL_PREDICT_FALSE(!trace_unsubmitted_.empty()))
+      MarkTracedSubmittedInternal();
+  }
+
+  void MarkTracedSubmittedInternal();
+  void RecordOpLatency(size_t index);
+
+  // Arms the waiter for the wakeups from threads that can not use MSG_RING: a futex wait on
+  // wake_futex_ if the kernel supports it, otherwise a poll on the eventfd.
   void ArmWakeupEvent();
   void SchedulePeriodic(uint32_t id, PeriodicItem* item) final;
   void CancelPeriodicInternal(PeriodicItem* item) final;
 
   void PeriodicCb(IoResult res, uint32_t task_id, PeriodicItem* item);
 
+  bool IsCoarse(const PeriodicItem& item) const;
+  bool UseWheel(const PeriodicItem& item) const;
+
+  // Returns the first tick that is not earlier than ns.
+  uint64_t WheelTick(uint64_t ns) const;
+
+  // Returns the last tick that has passed.
+  uint64_t CurrentWheelTick() const;
+  void WheelInsert(uint32_t id, PeriodicItem* item);
+
+  // Runs the wheel tasks that became due.
+  void AdvanceWheel();
+  void ArmWheelTimer();
+  void StopWheelTimer();
+  void WheelTimerCb(IoResult res, uint32_t flags);
+
+  // Blocks until a completion arrives or until the timeout ts, if not null, expires.
+  void WaitIdle(__kernel_timespec* ts);
+
   void MainLoop(detail::Scheduler* sched) final;
   void WakeRing() final;
+  bool PostFiberAttach(ProactorBase* dest, detail::FiberInterface* fiber) final;
   void EpollAddInternal(EpollIndex id);
   void EpollDelInternal(EpollIndex id);
 
@@ -153,10 +377,26 @@ class UringProactor : public ProactorBase {
   uint8_t poll_first_ : 1;
   uint8_t direct_fd_ : 1;
   uint8_t buf_ring_f_ : 1;
-  uint8_t : 4;
-
+  uint8_t recv_multishot_f_ : 1;
+  uint8_t send_zc_f_ : 1;
+  uint8_t sqpoll_f_ : 1;
+  uint8_t accept_multishot_f_ : 1;
+  uint8_t futex_f_ : 1;
+  uint8_t timeout_multishot_f_ : 1;
+  uint8_t ext_wait_f_ : 1;  // the idle loop waits with IORING_ENTER_EXT_ARG, see WaitIdle.
+  uint8_t reg_ring_f_ : 1;  // the ring fd is registered.
+
+  // Min-wait timeout of the idle wait and the number of completions that it waits for.
+  uint32_t min_wait_usec_ = 0;
+  uint32_t wait_batch_ = 1;
+
+  SqPollConfig sqpoll_cfg_;
   EventCount sqe_avail_;
 
+  // Set by WakeRing when futex_f_ is on, reset when the ring consumes the wakeup.
+  std::atomic_uint32_t wake_futex_{0};
+  CondVarAny bufring_cv_;
+
   struct CompletionEntry {
     CbType cb;
 
@@ -168,22 +408,98 @@ class UringProactor : public ProactorBase {
   std::vector<CompletionEntry> centries_;
   std::vector<int> register_fds_;
 
+  // Per completion entry, allocated once tracing is enabled.
+  struct OpTrace {
+    uint64_t start_tsc = 0;  // 0 if the entry is not traced.
+    uint64_t submit_tsc = 0;
+    io_uring_sqe* sqe = nullptr;  // until the entry is submitted.
+    uint16_t tag = 0;
+    uint8_t opcode = 0;
+  };
+
+  bool op_tracing_ = false;
+  std::vector<OpTrace> op_traces_;
+  std::vector<uint32_t> trace_unsubmitted_;  // indices of the traced entries.
+  OpTraceStats op_trace_stats_;
+  OpTraceHook op_trace_hook_;
+
   // we keep this vector only for iouring because its timers are one shot.
   // For epoll, periodic timers are refreshed automatically.
-  // TODO: start using IORING_TIMEOUT_MULTISHOT (see io_uring_prep_timeout(3)).
   std::vector<std::pair<uint32_t, PeriodicItem*>> schedule_periodic_list_;
 
+  // Periodic tasks with coarse periods share a single timeout, multishot if the kernel supports
+  // it, that advances the wheel every tick. The due tasks run together, so the wheel costs a
+  // completion per tick rather than per task.
+  struct TimerWheel {
+    static constexpr unsigned kSlots = 256;
+
+    // Slot i holds the items due at the ticks t with t % kSlots == i.
+    std::vector<std::pair<uint32_t, PeriodicItem*>> slots[kSlots];
+    std::vector<std::pair<uint32_t, PeriodicItem*>> scratch;
+
+    timespec tick_ts;
+    uint64_t tick_ns = 0;  // 0 if the wheel is disabled.
+    uint64_t start_ns = 0;  // the clock at tick 0.
+    uint64_t cur_tick = 0;  // the last tick that was processed.
+    uint64_t timer_ud = 0;  // user_data of the armed timeout, 0 if none is armed.
+    uint32_t size = 0;  // items in the slots, including the cancelled ones.
+    uint32_t coarse_cnt = 0;  // live periodic tasks with periods long enough for the wheel.
+    bool due = false;  // the timeout expired since the last AdvanceWheel.
+    bool stopping = false;  // the timeout is being removed.
+  } wheel_;
+
   struct BufRingGroup {
     io_uring_buf_ring* ring = nullptr;
     uint8_t* buf = nullptr;
+    uint32_t esize = 0;
+    uint32_t return_epoch = 0;
+    uint16_t nentries = 0;
   };
 
   std::vector<BufRingGroup> bufring_groups_;
 
-  // Keeps track of requested buffers
+  // The high bits of the zero-copy receive offsets hold the area id.
+  static constexpr uint64_t kZcrxAreaMask = ~((uint64_t(1) << 48) - 1);
+
+  // Registers zcrx_cfg_, returns 0 on success, errno on failure.
+  int RegisterZcrx();
+
+  // Pushes the pending returns to the refill queue while it has room.
+  void FlushZcrxReturns();
+
+  struct Zcrx {
+    uint8_t* area = nullptr;  // nullptr if zero-copy receive is not registered.
+    size_t area_size = 0;
+    uint8_t* region = nullptr;  // the refill queue mapping.
+    size_t region_size = 0;
+    uint32_t* rq_head = nullptr;  // written by the kernel.
+    uint32_t* rq_tail = nullptr;
+    void* rqes = nullptr;
+    uint32_t rq_mask = 0;
+    uint32_t tail = 0;
+    uint64_t area_token = 0;
+    uint32_t id = 0;
+    uint32_t return_epoch = 0;
+
+    // Returns that did not fit into the refill queue, (offset, len) pairs.
+    std::vector<std::pair<uint64_t, uint32_t>> pending;
+  } zcrx_;
+
+  ZcrxConfig zcrx_cfg_;
+  const uint64_t* cqe_extra_ = nullptr;
+
+  int AddBufferRegion(size_t size);
+
+  // Keeps track of requested buffers. Each region is registered under its own buf_idx.
   struct {
-    uint8_t* backing = nullptr;
-    base::SegmentPool segments{};
+    std::vector<iovec> regions;
+    std::vector<base::SizeClassPool> segments;  // per region, measured in UringBuf::kAlign units.
+    size_t total_size = 0;
+    size_t huge_size = 0;
+    size_t max_size = 0;
+    uint64_t requests = 0;
+    uint64_t failures = 0;
+    uint64_t grow_cnt = 0;
   } buf_pool_{};
 
   int32_t next_free_ce_ = -1;
@@ -4,9 +4,11 @@
 
 #include "util/fibers/uring_socket.h"
 
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <poll.h>
 
+#include "absl/cleanup/cleanup.h"
 #include "base/logging.h"
 #include "base/stl_util.h"
 
@@ -22,6 +24,10 @@ using nonstd::make_unexpected;
 
 namespace {
 
+// IORING_RECVSEND_FIXED_BUF from linux 6.0, spelled out because older uapi headers do not
+// have it.
+constexpr unsigned kRecvSendFixedBuf = 1U << 2;
+
 inline ssize_t posix_err_wrap(ssize_t res, UringSocket::error_code* ec) {
   if (res == -1) {
     *ec = UringSocket::error_code(errno, system_category());
@@ -35,6 +41,16 @@ auto Unexpected(std::errc e) {
   return make_unexpected(make_error_code(e));
 }
 
+// How often a reader that waits for the exhausted buffer ring re-checks the socket state.
+constexpr auto kNoBufsRecheck = chrono::milliseconds(10);
+
+// ProvidedBuffer::cookie of the zero-copy receive buffers. The buffer ring cookies never have
+// it since their buffer ids are less than 32768.
+constexpr uint32_t kZcrxCookie = UINT32_MAX;
+
+// Capacity of the pipe that SendFile splices through, i.e. the maximal size of a splice.
+constexpr int kSplicePipeSize = 1 << 20;
+
 }  // namespace
 
 UringSocket::UringSocket(int fd, Proactor* p) : LinuxSocketBase(fd, p), flags_(0) {
@@ -83,6 +99,16 @@ auto UringSocket::Close() -> error_code {
   DCHECK(proactor()->InMyThread());
   DVSOCK(1) << "Closing socket";
 
+  ResetCork();
+
+  if (multishot_) {
+    DisableRecvMultishot();
+  }
+
+  if (accept_ms_) {
+    DisableAcceptMultishot();
+  }
+
   int fd;
   if (is_direct_fd_) {
     UringProactor* proactor = GetProactor();
@@ -106,37 +132,42 @@ auto UringSocket::Close() -> error_code {
 auto UringSocket::Accept() -> AcceptResult {
   CHECK(proactor());
 
-  error_code ec;
-
-  int fd = native_handle();
   VSOCK(2) << "Accept";
 
-  int res = -1;
-  while (true) {
-    res = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
-    if (res >= 0) {
-      break;
-    }
+  // The accepted socket gets a regular fd rather than a slot allocated in the direct table
+  // of this ring, since connections are usually migrated to other proactors. It is registered
+  // by OnSetProactor of its proactor.
+  IoResult res = -1;
+  if (accept_ms_) {
+    Result<int> queued = AcceptQueued();
+    if (!queued)
+      return make_unexpected(queued.error());
+    res = *queued;
+  }
 
-    DCHECK_EQ(-1, res);
+  while (res < 0) {
+    if (fd_ & IS_SHUTDOWN)
+      return Unexpected(errc::connection_aborted);
 
-    if (errno == EAGAIN) {
-      // TODO: to add support for iouring direct file descriptors.
-      FiberCall fc(GetProactor());
-      fc->PrepPollAdd(ShiftedFd(), POLLIN);
-      fc->sqe()->flags |= register_flag();
-      IoResult io_res = fc.Get();
+    FiberCall fc(GetProactor());
+    fc->PrepAccept(ShiftedFd(), nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    fc->sqe()->flags |= register_flag();
 
-      // tcp sockets set POLLERR but UDS set POLLHUP.
-      if ((io_res & (POLLERR | POLLHUP)) != 0) {
-        return Unexpected(errc::connection_aborted);
-      }
+    is_accepting_ = 1;
+    res = fc.Get();
+    is_accepting_ = 0;
+
+    if (res >= 0)
+      break;
 
+    if (res == -EAGAIN || res == -EINTR)
       continue;
-    }
 
-    posix_err_wrap(res, &ec);
-    return make_unexpected(ec);
+    // Shutdown makes the pending accept fail, with EINVAL if it was not canceled.
+    if (res == -ECANCELED || res == -EINVAL)
+      return Unexpected(errc::connection_aborted);
+
+    return make_unexpected(error_code(-res, system_category()));
   }
 
   UringSocket* fs = new UringSocket{nullptr};
@@ -146,6 +177,142 @@ auto UringSocket::Accept() -> AcceptResult {
   return fs;
 }
 
+auto UringSocket::EnableAcceptMultishot(unsigned max_queued) -> error_code {
+  CHECK(proactor() && proactor()->InMyThread());
+  CHECK_GE(fd_, 0);
+
+  if (!GetProactor()->HasAcceptMultishot())
+    return make_error_code(errc::operation_not_supported);
+
+  if (!accept_ms_) {
+    if (max_queued == 0)
+      return {};
+    accept_ms_ = new AcceptState;
+  }
+
+  // The request is armed lazily by Accept.
+  accept_ms_->max_queued = max_queued;
+  if (accept_ms_->size() >= max_queued)
+    CancelAcceptMultishot();
+  return {};
+}
+
+auto UringSocket::AcceptQueued() -> Result<int> {
+  AcceptState* st = accept_ms_;
+  while (true) {
+    if (fd_ & IS_SHUTDOWN)
+      return Unexpected(errc::connection_aborted);
+
+    if (st->size() > 0) {
+      // Stop the kernel from accepting more connections than we are allowed to queue.
+      if (st->size() >= st->max_queued)
+        CancelAcceptMultishot();
+
+      int fd = st->queue[st->head++];
+      if (st->head == st->queue.size()) {
+        st->queue.clear();
+        st->head = 0;
+      }
+      return fd;
+    }
+
+    if (st->error) {
+      int err = std::exchange(st->error, 0);
+      return make_unexpected(error_code(err, system_category()));
+    }
+
+    if (!st->armed) {
+      if (st->max_queued == 0)
+        return -1;
+      ArmAcceptMultishot();
+    }
+
+    st->waiter = detail::FiberActive();
+    st->waiter->Suspend();
+  }
+}
+
+void UringSocket::OnAcceptMultishot(AcceptState* state, detail::FiberInterface* current,
+                                    IoResult res, uint32_t flags) {
+  if (res >= 0) {
+    if (state->detached) {
+      close(res);
+    } else {
+      state->queue.push_back(res);
+    }
+  } else if (res != -ECANCELED) {
+    state->error = -res;
+  }
+
+  // Without IORING_CQE_F_MORE the request is terminated and this callback is released.
+  if ((flags & IORING_CQE_F_MORE) == 0) {
+    state->armed = false;
+    state->canceling = false;
+    if (state->detached) {
+      delete state;
+      return;
+    }
+  }
+
+  if (state->waiter) {
+    detail::FiberInterface* waiter = state->waiter;
+    state->waiter = nullptr;
+    ActivateSameThread(current, waiter);
+  }
+}
+
+void UringSocket::ArmAcceptMultishot() {
+  AcceptState* st = accept_ms_;
+  DCHECK(!st->armed);
+
+  auto cb = [st](detail::FiberInterface* current, IoResult res, uint32_t flags) {
+    OnAcceptMultishot(st, current, res, flags);
+  };
+
+  SubmitEntry se = GetProactor()->GetSubmitEntry(std::move(cb));
+  se.PrepAcceptMultishot(ShiftedFd(), SOCK_NONBLOCK | SOCK_CLOEXEC);
+  se.sqe()->flags |= register_flag();
+  st->user_data = se.sqe()->user_data;
+  st->armed = true;
+}
+
+void UringSocket::CancelAcceptMultishot() {
+  AcceptState* st = accept_ms_;
+  if (!st->armed || st->canceling)
+    return;
+
+  st->canceling = true;
+  SubmitEntry se = GetProactor()->GetSubmitEntry(nullptr);
+  se.PrepCancel64(st->user_data, 0);
+}
+
+void UringSocket::DisableAcceptMultishot() {
+  AcceptState* st = accept_ms_;
+  accept_ms_ = nullptr;
+
+  for (unsigned i = st->head; i < st->queue.size(); ++i) {
+    close(st->queue[i]);
+  }
+  st->queue.clear();
+  st->head = 0;
+
+  if (st->waiter) {
+    ActivateSameThread(detail::FiberActive(), st->waiter);
+    st->waiter = nullptr;
+  }
+
+  if (st->armed) {
+    // The state is deleted by the completion callback once the request is terminated.
+    st->detached = true;
+    if (!st->canceling) {
+      SubmitEntry se = GetProactor()->GetSubmitEntry(nullptr);
+      se.PrepCancel64(st->user_data, 0);
+    }
+  } else {
+    delete st;
+  }
+}
+
 auto UringSocket::Connect(const endpoint_type& ep) -> error_code {
   CHECK_EQ(fd_, -1);
   CHECK(proactor() && proactor()->InMyThread());
@@ -159,15 +326,22 @@ auto UringSocket::Connect(const endpoint_type& ep) -> error_code {
   VSOCK(1) << "Connect [" << fd << "] " << ep.address().to_string() << ":" << ep.port();
 
   UringProactor* proactor = GetProactor();
-
-  // TODO: support direct descriptors. For now client sockets always use regular linux fds.
   fd_ = fd << kFdShift;
 
+  // Client sockets do not migrate, hence they are registered before the first request.
+  if (proactor->HasDirectFD()) {
+    unsigned direct_fd = proactor->RegisterFd(fd);
+    if (direct_fd != UringProactor::kInvalidDirectFd) {
+      UpdateDfVal(direct_fd);
+      is_direct_fd_ = 1;
+    }
+  }
+
   IoResult io_res;
-  ep.data();
 
   FiberCall fc(proactor, timeout());
-  fc->PrepConnect(fd, (const sockaddr*)ep.data(), ep.size());
+  fc->PrepConnect(ShiftedFd(), (const sockaddr*)ep.data(), ep.size());
+  fc->sqe()->flags |= register_flag();
   io_res = fc.Get();
 
   if (io_res < 0) {  // In that case connect returns -errno.
@@ -185,9 +359,18 @@ auto UringSocket::WriteSome(const iovec* ptr, uint32_t len) -> Result<size_t> {
     return Unexpected(errc::connection_aborted);
   }
 
+  Result<size_t> cork_res;
+  if (CorkWrite(ptr, len, &cork_res))
+    return cork_res;
+
+  if (UseZeroCopy(ptr, len)) {
+    return WriteSomeZc(ptr, len);
+  }
+
   int fd = ShiftedFd();
   Proactor* p = GetProactor();
   ssize_t res = 0;
+  uint64_t tx_start = TxStart();
   VSOCK(2) << "WriteSome [" << fd << "] " << len;
 
   if (len == 1) {
@@ -198,6 +381,7 @@ auto UringSocket::WriteSome(const iovec* ptr, uint32_t len) -> Result<size_t> {
 
       res = fc.Get();  // Interrupt point
       if (res >= 0) {
+        OnSent(tx_start, res);
         return res;  // Fastpath
       }
 
@@ -224,6 +408,7 @@ auto UringSocket::WriteSome(const iovec* ptr, uint32_t len) -> Result<size_t> {
 
       res = fc.Get();  // Interrupt point
       if (res >= 0) {
+        OnSent(tx_start, res);
         return res;  // Fastpath
       }
 
@@ -251,20 +436,41 @@ void UringSocket::AsyncWriteSome(const iovec* v, uint32_t len, AsyncProgressCb c
     return;
   }
 
-  // this time we can not store it on stack.
-  //
-  msghdr* msg = new msghdr;
-  memset(msg, 0, sizeof(msghdr));
-  msg->msg_iov = const_cast<iovec*>(v);
-  msg->msg_iovlen = len;
+  // this time we can not store it on stack. We keep cb with msghdr, so that the completion
+  // callback captures a single pointer and fits inline.
+  struct Request {
+    msghdr msg;
+    IoResult send_res = 0;
+    UringSocket* sock;
+    AsyncProgressCb cb;
+  };
+
+  Request* req = new Request;
+  req->sock = this;
+  memset(&req->msg, 0, sizeof(msghdr));
+  req->msg.msg_iov = const_cast<iovec*>(v);
+  req->msg.msg_iovlen = len;
+  req->cb = std::move(cb);
 
   int fd = native_handle();
   Proactor* proactor = GetProactor();
-  auto mycb = [msg, cb = std::move(cb)](detail::FiberInterface*, Proactor::IoResult res,
-                                        uint32_t flags) {
-    delete msg;
+  bool zero_copy = UseZeroCopy(v, len);
+
+  // For zero-copy sends the callback runs twice: with the send result and then with
+  // the notification that releases the buffers. cb is called only after the latter.
+  auto mycb = [req](detail::FiberInterface*, Proactor::IoResult res, uint32_t flags) {
+    if ((flags & IORING_CQE_F_NOTIF) == 0)
+      req->send_res = res;
+    if (flags & IORING_CQE_F_MORE)
+      return;
+
+    res = req->send_res;
+    UringSocket* sock = req->sock;
+    AsyncProgressCb cb = std::move(req->cb);
+    delete req;
 
     if (res >= 0) {
+      sock->OnSent(0, res);
       cb(res);
       return;
     }
@@ -276,10 +482,107 @@ void UringSocket::AsyncWriteSome(const iovec* v, uint32_t len, AsyncProgressCb c
   };
 
   SubmitEntry se = proactor->GetSubmitEntry(std::move(mycb));
-  se.PrepSendMsg(fd, msg, MSG_NOSIGNAL);
+  if (zero_copy) {
+    se.PrepSendMsgZc(fd, &req->msg, MSG_NOSIGNAL);
+  } else {
+    se.PrepSendMsg(fd, &req->msg, MSG_NOSIGNAL);
+  }
   se.sqe()->flags |= register_flag();
 }
 
+auto UringSocket::EnableZeroCopySend(size_t threshold) -> error_code {
+  if (threshold > 0 && !GetProactor()->HasSendZc())
+    return make_error_code(errc::operation_not_supported);
+
+  zc_threshold_ = threshold;
+  return {};
+}
+
+bool UringSocket::UseZeroCopy(const iovec* v, uint32_t len) const {
+  if (zc_threshold_ == 0)
+    return false;
+
+  size_t total = 0;
+  for (uint32_t i = 0; i < len; ++i) {
+    total += v[i].iov_len;
+  }
+  return total >= zc_threshold_;
+}
+
+auto UringSocket::WriteSomeZc(const iovec* ptr, uint32_t len) -> Result<size_t> {
+  int fd = ShiftedFd();
+  Proactor* p = GetProactor();
+  VSOCK(2) << "WriteSomeZc [" << fd << "] " << len;
+
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = const_cast<iovec*>(ptr);
+  msg.msg_iovlen = len;
+
+  struct {
+    detail::FiberInterface* me;
+    IoResult res;
+    bool done;
+  } call{detail::FiberActive(), 0, false};
+
+  // The sends from the registered buffers of the proactor skip pinning the pages.
+  optional<unsigned> buf_idx;
+  if (len == 1)
+    buf_idx = p->FindRegisteredBuffer(ptr->iov_base, ptr->iov_len);
+
+  ssize_t res = 0;
+  while (true) {
+    call.res = 0;
+    call.done = false;
+
+    auto cb = [&call](detail::FiberInterface* current, IoResult res, uint32_t flags) {
+      if ((flags & IORING_CQE_F_NOTIF) == 0)
+        call.res = res;
+      if ((flags & IORING_CQE_F_MORE) == 0) {
+        call.done = true;
+        ActivateSameThread(current, call.me);
+      }
+    };
+
+    SubmitEntry se = p->GetSubmitEntry(std::move(cb));
+    if (len == 1) {
+      se.PrepSendZc(fd, ptr->iov_base, ptr->iov_len, MSG_NOSIGNAL,
+                    buf_idx ? kRecvSendFixedBuf : 0);
+      if (buf_idx)
+        se.sqe()->buf_index = *buf_idx;
+    } else {
+      se.PrepSendMsgZc(fd, &msg, MSG_NOSIGNAL);
+    }
+    se.sqe()->flags |= register_flag();
+
+    // See FiberCall::Get() on why we may be woken up before our own callback runs.
+    do {
+      call.me->Suspend();
+    } while (!call.done);
+
+    res = call.res;
+    if (res >= 0) {
+      OnSent(0, res);
+      return res;
+    }
+
+    DVSOCK(2) << "Got " << res;
+    res = -res;
+    if (res == EAGAIN)  // EAGAIN can happen in case of CQ overflow.
+      continue;
+
+    if (res == EPIPE)  // We do not care about EPIPE that can happen when we shutdown our socket.
+      res = ECONNABORTED;
+
+    break;
+  }
+
+  error_code ec(res, system_category());
+  VSOCK(1) << "Error " << ec << " on " << RemoteEndpoint();
+
+  return make_unexpected(std::move(ec));
+}
+
 auto UringSocket::RecvMsg(const msghdr& msg, int flags) -> Result<size_t> {
   CHECK(proactor());
   CHECK_GE(fd_, 0);
@@ -287,6 +590,15 @@ auto UringSocket::RecvMsg(const msghdr& msg, int flags) -> Result<size_t> {
   if (fd_ & IS_SHUTDOWN) {
     return Unexpected(errc::connection_aborted);
   }
+
+  FlushCork();
+
+  if (multishot_) {
+    error_code ec = WaitRecvMultishot(flags);
+    if (ec)
+      return make_unexpected(ec);
+    return CopyRecvMultishot(msg.msg_iov, msg.msg_iovlen);
+  }
   int fd = ShiftedFd();
   Proactor* p = GetProactor();
   DCHECK(ProactorBase::me() == p);
@@ -307,6 +619,7 @@ auto UringSocket::RecvMsg(const msghdr& msg, int flags) -> Result<size_t> {
     res = fc.Get();
 
     if (res > 0) {
+      OnRecv(msg);
       return res;
     }
     DVSOCK(2) << "Got " << res;
@@ -328,12 +641,154 @@ auto UringSocket::RecvMsg(const msghdr& msg, int flags) -> Result<size_t> {
   return make_unexpected(std::move(ec));
 }
 
+auto UringSocket::RecvMMsg(mmsghdr* msgs, unsigned len) -> Result<unsigned> {
+  CHECK(proactor());
+  CHECK_GE(fd_, 0);
+  DCHECK(ProactorBase::me() == GetProactor());
+
+  int fd = native_handle();
+  while (true) {
+    if (fd_ & IS_SHUTDOWN)
+      return Unexpected(errc::connection_aborted);
+
+    int res = recvmmsg(fd, msgs, len, MSG_DONTWAIT, nullptr);
+    if (res >= 0)
+      return unsigned(res);
+
+    if (errno != EAGAIN)
+      return make_unexpected(error_code(errno, system_category()));
+
+    // Pending socket errors, e.g. icmp unreachable, are returned by the next recvmmsg call.
+    if (error_code ec = WaitPoll(POLLIN); ec)
+      return make_unexpected(ec);
+  }
+}
+
+auto UringSocket::SendMMsg(mmsghdr* msgs, unsigned len) -> Result<unsigned> {
+  CHECK(proactor());
+  CHECK_GE(fd_, 0);
+  DCHECK(ProactorBase::me() == GetProactor());
+
+  int fd = native_handle();
+  while (true) {
+    if (fd_ & IS_SHUTDOWN)
+      return Unexpected(errc::connection_aborted);
+
+    int res = sendmmsg(fd, msgs, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (res >= 0)
+      return unsigned(res);
+
+    if (errno != EAGAIN)
+      return make_unexpected(error_code(errno, system_category()));
+
+    if (error_code ec = WaitPoll(POLLOUT); ec)
+      return make_unexpected(ec);
+  }
+}
+
+auto UringSocket::SendFile(int fd, off_t offset, size_t len) -> Result<size_t> {
+  CHECK(proactor());
+  CHECK_GE(fd_, 0);
+  DCHECK(ProactorBase::me() == GetProactor());
+
+  if (fd_ & IS_SHUTDOWN)
+    return Unexpected(errc::connection_aborted);
+
+  // The coalesced data precedes the file.
+  if (error_code ec = Flush(); ec)
+    return make_unexpected(ec);
+
+  int pipe_fds[2];
+  if (pipe2(pipe_fds, O_CLOEXEC) < 0)
+    return make_unexpected(error_code(errno, system_category()));
+  absl::Cleanup close_pipe = [&pipe_fds] {
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+  };
+
+  // The default capacity is 64KB, fewer splices are needed with a larger pipe.
+  int pipe_size = fcntl(pipe_fds[1], F_SETPIPE_SZ, kSplicePipeSize);
+  if (pipe_size < 0)
+    pipe_size = fcntl(pipe_fds[1], F_GETPIPE_SZ);
+
+  Proactor* p = GetProactor();
+  size_t sent = 0;
+  while (sent < len) {
+    unsigned chunk = std::min<size_t>(len - sent, pipe_size);
+    IoResult res;
+    {
+      FiberCall fc(p);
+      fc->PrepSplice(fd, offset + sent, pipe_fds[1], -1, chunk, 0);
+      res = fc.Get();
+    }
+
+    if (res == 0)  // end of file.
+      break;
+
+    if (res < 0) {
+      if (res == -EAGAIN || res == -EINTR)
+        continue;
+      if (res == -EINVAL && sent == 0)  // the kernel or the file does not support splicing.
+        return FiberSocketBase::SendFile(fd, offset, len);
+      return make_unexpected(error_code(-res, system_category()));
+    }
+
+    // Drain the pipe into the socket.
+    unsigned in_pipe = res;
+    while (in_pipe > 0) {
+      FiberCall fc(p, timeout());
+      fc->PrepSplice(pipe_fds[0], -1, ShiftedFd(), -1, in_pipe, 0);
+      fc->sqe()->flags |= register_flag();
+      res = fc.Get();  // Interrupt point
+      if (res > 0) {
+        OnSent(0, res);
+        in_pipe -= res;
+        sent += res;
+        continue;
+      }
+
+      if (res == -EAGAIN)  // EAGAIN can happen in case of CQ overflow.
+        continue;
+
+      // We do not care about EPIPE that can happen when we shutdown our socket.
+      int err = (res == 0 || res == -EPIPE) ? ECONNABORTED : -res;
+      error_code ec(err, system_category());
+      VSOCK(1) << "Error " << ec << " on " << RemoteEndpoint();
+      return make_unexpected(std::move(ec));
+    }
+  }
+
+  return sent;
+}
+
+auto UringSocket::WaitPoll(uint32_t events) -> error_code {
+  FiberCall fc(GetProactor(), timeout());
+  fc->PrepPollAdd(ShiftedFd(), events);
+  fc->sqe()->flags |= register_flag();
+  IoResult res = fc.Get();
+  return res < 0 ? error_code(-res, system_category()) : error_code{};
+}
+
 io::Result<size_t> UringSocket::Recv(const io::MutableBytes& mb, int flags) {
   int fd = ShiftedFd();
   Proactor* p = GetProactor();
   DCHECK(ProactorBase::me() == p);
 
   VSOCK(2) << "Recv [" << fd << "] " << flags;
+
+  if (HasRxTimestamps() && !multishot_)
+    return RecvTimestamped(mb, flags);
+
+  FlushCork();
+
+  if (multishot_) {
+    error_code ec = WaitRecvMultishot(flags);
+    if (ec)
+      return make_unexpected(ec);
+    iovec v{mb.data(), mb.size()};
+    return CopyRecvMultishot(&v, 1);
+  }
+
   ssize_t res;
   while (true) {
     FiberCall fc(p, timeout());
@@ -368,6 +823,349 @@ io::Result<size_t> UringSocket::Recv(const io::MutableBytes& mb, int flags) {
   return make_unexpected(std::move(ec));
 }
 
+auto UringSocket::EnableRecvMultishot(uint16_t group_id) -> error_code {
+  CHECK(proactor() && proactor()->InMyThread());
+  CHECK_GE(fd_, 0);
+  CHECK(multishot_ == nullptr) << "Multishot mode is already enabled";
+
+  UringProactor* p = GetProactor();
+  if (!p->HasRecvMultishot())
+    return make_error_code(errc::operation_not_supported);
+
+  if (!p->HasBufferRing(group_id))
+    return make_error_code(errc::invalid_argument);
+
+  multishot_ = new MultishotState;
+  multishot_->group_id = group_id;
+  ArmRecvMultishot();
+
+  return {};
+}
+
+auto UringSocket::EnableRecvZeroCopy(uint16_t fallback_group_id) -> error_code {
+  CHECK(proactor() && proactor()->InMyThread());
+  CHECK_GE(fd_, 0);
+  CHECK(multishot_ == nullptr) << "Multishot mode is already enabled";
+
+  UringProactor* p = GetProactor();
+  if (!p->HasZcrx())
+    return EnableRecvMultishot(fallback_group_id);
+
+  multishot_ = new MultishotState;
+  multishot_->group_id = fallback_group_id;
+  multishot_->zc = true;
+  ArmRecvMultishot();
+
+  return {};
+}
+
+auto UringSocket::RecvProvided(unsigned max_bufs, ProvidedBuffer* dest) -> Result<unsigned> {
+  DCHECK_GT(max_bufs, 0u);
+
+  if (!multishot_)
+    return Unexpected(errc::operation_not_supported);
+
+  if (fd_ & IS_SHUTDOWN) {
+    return Unexpected(errc::connection_aborted);
+  }
+
+  FlushCork();
+
+  error_code ec = WaitRecvMultishot(0);
+  if (ec)
+    return make_unexpected(ec);
+
+  UringProactor* p = GetProactor();
+  MultishotState* st = multishot_;
+  unsigned res = 0;
+  while (res < max_bufs && !st->empty()) {
+    const auto& entry = st->queue[st->head];
+    const uint8_t* src = EntryData(p, *st, entry) + st->front_offset;
+    dest[res].buffer = io::Bytes{src, entry.len - st->front_offset};
+    dest[res].cookie = entry.zc ? kZcrxCookie : (uint32_t(st->group_id) << 16) | entry.id;
+    st->PopFront();
+    ++res;
+  }
+  DVSOCK(2) << "RecvProvided " << res << " buffers";
+
+  return res;
+}
+
+void UringSocket::ReturnProvided(const ProvidedBuffer& pbuf) {
+  UringProactor* p = GetProactor();
+  if (pbuf.cookie == kZcrxCookie) {
+    // The kernel finds the buffer by any offset within it.
+    p->ReturnZcrx(pbuf.buffer.data() - p->GetZcrxPtr(0), pbuf.buffer.size());
+  } else {
+    p->ConsumeBufRing(pbuf.cookie >> 16, pbuf.cookie & 0xFFFF);
+  }
+}
+
+auto UringSocket::WaitReadable() -> error_code {
+  if (!multishot_)
+    return LinuxSocketBase::WaitReadable();
+
+  if (fd_ & IS_SHUTDOWN)
+    return make_error_code(errc::connection_aborted);
+
+  FlushCork();
+  return WaitRecvMultishot(0);
+}
+
+void UringSocket::CancelPendingIo() {
+  if (fd_ < 0 || (fd_ & IS_SHUTDOWN))
+    return;
+
+  if (!CancelRequests())
+    LinuxSocketBase::CancelPendingIo();
+}
+
+void UringSocket::CancelPendingIoAsync() {
+  if (fd_ < 0 || (fd_ & IS_SHUTDOWN))
+    return;
+
+  if (!CancelRequests(false))
+    LinuxSocketBase::CancelPendingIo();
+}
+
+auto UringSocket::Shutdown(int how) -> error_code {
+  error_code ec = LinuxSocketBase::Shutdown(how);
+
+  // The shutdown of a listening socket does not reliably wake the pending IORING_OP_ACCEPT.
+  WakeAccept();
+  return ec;
+}
+
+void UringSocket::StopAccepting() {
+  if (fd_ < 0 || (fd_ & IS_SHUTDOWN))
+    return;
+
+  fd_ |= IS_SHUTDOWN;
+  WakeAccept();
+}
+
+void UringSocket::WakeAccept() {
+  if (is_accepting_) {
+    DCHECK(proactor()->InMyThread());
+    CancelRequests();
+  }
+
+  if (accept_ms_) {
+    CancelAcceptMultishot();
+    if (AcceptState* st = accept_ms_; st->waiter) {
+      ActivateSameThread(detail::FiberActive(), st->waiter);
+      st->waiter = nullptr;
+    }
+  }
+}
+
+bool UringSocket::CancelRequests(bool wait) {
+  unsigned flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  if (is_direct_fd_) {
+#ifdef IORING_ASYNC_CANCEL_FD_FIXED
+    flags |= IORING_ASYNC_CANCEL_FD_FIXED;
+#else
+    return false;
+#endif
+  }
+
+  if (!wait) {
+    SubmitEntry se = GetProactor()->GetSubmitEntry(nullptr);
+    se.PrepCancel(ShiftedFd(), flags);
+    DVSOCK(1) << "CancelRequests queued";
+    return true;
+  }
+
+  int res = GetProactor()->CancelRequests(ShiftedFd(), flags);
+  DVSOCK(1) << "CancelRequests " << res;
+  return true;
+}
+
+void UringSocket::OnRecvMultishot(MultishotState* state, detail::FiberInterface* current,
+                                  IoResult res, uint32_t flags) {
+  UringProactor* p = static_cast<UringProactor*>(ProactorBase::me());
+  if (res > 0) {
+    MultishotState::Entry entry{0, uint32_t(res), state->zc};
+    if (state->zc) {
+      entry.id = p->cqe_extra()[0];
+    } else {
+      DCHECK(flags & IORING_CQE_F_BUFFER);
+      entry.id = flags >> IORING_CQE_BUFFER_SHIFT;
+    }
+
+    if (state->detached) {
+      ReleaseEntry(p, *state, entry);
+    } else {
+      state->queue.push_back(entry);
+    }
+  } else if (res == 0) {
+    state->error = ECONNABORTED;
+  } else if (res == -ENOBUFS || (state->zc && res == -ENOMEM)) {
+    state->no_bufs = true;
+  } else if (state->zc && (res == -EINVAL || res == -EOPNOTSUPP)) {
+    // The kernel or the device does not support zero-copy receive for this socket.
+    LOG_FIRST_N(WARNING, 1) << "Zero-copy receive failed with " << -res
+                            << ", falling back to the buffer ring";
+    state->zc = false;
+    if (!p->HasBufferRing(state->group_id) || !p->HasRecvMultishot())
+      state->error = -res;
+  } else if (res != -ECANCELED) {
+    state->error = -res;
+  }
+
+  // Without IORING_CQE_F_MORE the request is terminated and this callback is released.
+  if ((flags & IORING_CQE_F_MORE) == 0) {
+    state->armed = false;
+    if (state->detached) {
+      delete state;
+      return;
+    }
+  }
+
+  if (state->waiter) {
+    detail::FiberInterface* waiter = state->waiter;
+    state->waiter = nullptr;
+    ActivateSameThread(current, waiter);
+  }
+}
+
+void UringSocket::ArmRecvMultishot() {
+  MultishotState* st = multishot_;
+  DCHECK(!st->armed);
+
+  UringProactor* p = GetProactor();
+  auto cb = [st](detail::FiberInterface* current, IoResult res, uint32_t flags) {
+    OnRecvMultishot(st, current, res, flags);
+  };
+
+  SubmitEntry se = p->GetSubmitEntry(std::move(cb));
+  if (st->zc) {
+    se.PrepRecvZc(ShiftedFd(), p->zcrx_id());
+    st->arm_epoch = p->ZcrxReturnEpoch();
+  } else {
+    se.PrepRecvMultishot(ShiftedFd(), st->group_id, 0);
+    st->arm_epoch = p->BufRingReturnEpoch(st->group_id);
+  }
+  se.sqe()->flags |= register_flag();
+  st->user_data = se.sqe()->user_data;
+  st->armed = true;
+  st->no_bufs = false;
+}
+
+void UringSocket::DisableRecvMultishot() {
+  MultishotState* st = multishot_;
+  multishot_ = nullptr;
+
+  UringProactor* p = GetProactor();
+  for (unsigned i = st->head; i < st->queue.size(); ++i) {
+    ReleaseEntry(p, *st, st->queue[i]);
+  }
+  st->queue.clear();
+  st->head = 0;
+
+  if (st->waiter) {
+    ActivateSameThread(detail::FiberActive(), st->waiter);
+    st->waiter = nullptr;
+  }
+
+  if (st->armed) {
+    // The state is deleted by the completion callback once the request is terminated.
+    st->detached = true;
+    SubmitEntry se = p->GetSubmitEntry(nullptr);
+    se.PrepCancel64(st->user_data, 0);
+  } else {
+    delete st;
+  }
+}
+
+auto UringSocket::WaitRecvMultishot(int flags) -> error_code {
+  UringProactor* p = GetProactor();
+  DCHECK(ProactorBase::me() == p);
+
+  uint32_t tmo = timeout();
+  auto tp = tmo == UINT32_MAX ? chrono::steady_clock::time_point::max()
+                              : chrono::steady_clock::now() + chrono::milliseconds(tmo);
+
+  // multishot_ is re-read on each iteration since the socket can be closed while we wait.
+  while (multishot_ && multishot_->empty()) {
+    MultishotState* st = multishot_;
+    if (st->error)
+      return error_code(st->error, system_category());
+
+    if (fd_ & IS_SHUTDOWN)
+      return make_error_code(errc::connection_aborted);
+
+    if (!st->armed) {
+      if (st->no_bufs) {
+        // The buffer ring or the zero-copy area was exhausted. Wait until the application
+        // returns some buffers.
+        if ((flags & MSG_DONTWAIT) != 0)
+          return make_error_code(errc::resource_unavailable_try_again);
+
+        if (chrono::steady_clock::now() >= tp)
+          return make_error_code(errc::operation_canceled);
+
+        auto next = min(tp, chrono::steady_clock::now() + kNoBufsRecheck);
+        bool returned = st->zc ? p->AwaitZcrxReturn(st->arm_epoch, next)
+                               : p->AwaitBufRingReturn(st->group_id, st->arm_epoch, next);
+        if (!returned)
+          continue;
+      }
+      ArmRecvMultishot();
+    }
+
+    if ((flags & MSG_DONTWAIT) != 0)
+      return make_error_code(errc::resource_unavailable_try_again);
+
+    detail::FiberInterface* me = detail::FiberActive();
+    st->waiter = me;
+    if (tp == chrono::steady_clock::time_point::max()) {
+      me->Suspend();
+    } else if (me->WaitUntil(tp, true)) {
+      if (multishot_)
+        multishot_->waiter = nullptr;
+      if (!multishot_ || multishot_->empty())
+        return make_error_code(errc::operation_canceled);
+    }
+  }
+
+  if (!multishot_)
+    return make_error_code(errc::operation_canceled);
+
+  return {};
+}
+
+size_t UringSocket::CopyRecvMultishot(const iovec* v, size_t len) {
+  MultishotState* st = multishot_;
+  UringProactor* p = GetProactor();
+  size_t copied = 0, iov_offs = 0;
+
+  while (len > 0 && !st->empty()) {
+    const auto& entry = st->queue[st->head];
+    const uint8_t* src = EntryData(p, *st, entry) + st->front_offset;
+    size_t sz = std::min<size_t>(entry.len - st->front_offset, v->iov_len - iov_offs);
+    memcpy(reinterpret_cast<uint8_t*>(v->iov_base) + iov_offs, src, sz);
+    copied += sz;
+    iov_offs += sz;
+    st->front_offset += sz;
+
+    if (st->front_offset == entry.len) {
+      MultishotState::Entry done = entry;
+      st->PopFront();
+      ReleaseEntry(p, *st, done);
+    }
+
+    if (iov_offs == v->iov_len) {
+      ++v;
+      --len;
+      iov_offs = 0;
+    }
+  }
+  DVSOCK(2) << "Copied " << copied << " multishot bytes";
+
+  return copied;
+}
+
 void UringSocket::RegisterOnErrorCb(std::function<void(uint32_t)> cb) {
   CHECK(!error_cb_wrapper_);
   DCHECK(IsOpen());
@@ -441,6 +1239,14 @@ void UringSocket::OnSetProactor() {
 
 void UringSocket::OnResetProactor() {
   DCHECK(proactor()->InMyThread());
+  if (multishot_) {
+    // Provided buffers belong to the ring of the current proactor.
+    LOG_IF(DFATAL, !multishot_->empty()) << "Migrating socket with pending multishot data";
+    DisableRecvMultishot();
+  }
+  if (accept_ms_) {
+    DisableAcceptMultishot();
+  }
   if (is_direct_fd_) {
     UringProactor* proactor = GetProactor();
     unsigned direct_fd = ShiftedFd();
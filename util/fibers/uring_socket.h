@@ -13,7 +13,7 @@ namespace util {
 
 namespace fb2 {
 
-class UringSocket : public LinuxSocketBase {
+class UringSocket final : public LinuxSocketBase {
  public:
   using Proactor = UringProactor;
 
@@ -30,17 +30,34 @@ class UringSocket : public LinuxSocketBase {
   // using Connect or created via Accept.
   error_code Create(unsigned short protocol_family = 2) final;
 
+  // Uses IORING_OP_ACCEPT, see also EnableAcceptMultishot.
   ABSL_MUST_USE_RESULT AcceptResult Accept() final;
 
+  // Requires kernel 5.19.
+  error_code EnableAcceptMultishot(unsigned max_queued) final;
+
   ABSL_MUST_USE_RESULT error_code Connect(const endpoint_type& ep) final;
   ABSL_MUST_USE_RESULT error_code Close() final;
 
+  // Also cancels the pending Accept.
+  error_code Shutdown(int how) final;
+  void StopAccepting() final;
+
   io::Result<size_t> WriteSome(const iovec* v, uint32_t len) override;
   void AsyncWriteSome(const iovec* v, uint32_t len, AsyncProgressCb cb) override;
 
   Result<size_t> RecvMsg(const msghdr& msg, int flags) override;
   Result<size_t> Recv(const io::MutableBytes& mb, int flags = 0) override;
 
+  // io_uring has no batched datagram opcode, hence these call recvmmsg/sendmmsg and wait
+  // for the socket readiness with IORING_OP_POLL_ADD when it is not ready.
+  Result<unsigned> RecvMMsg(mmsghdr* msgs, unsigned len) final;
+  Result<unsigned> SendMMsg(mmsghdr* msgs, unsigned len) final;
+
+  // Splices the file into a pipe and the pipe into the socket with IORING_OP_SPLICE.
+  // Requires kernel 5.7, falls back to the default implementation otherwise.
+  Result<size_t> SendFile(int fd, off_t offset, size_t len) final;
+
   using FiberSocketBase::IsConnClosed;
 
   void RegisterOnErrorCb(std::function<void(uint32_t)> cb) final;
@@ -53,6 +70,37 @@ class UringSocket : public LinuxSocketBase {
     return has_recv_data_;
   }
 
+  // Switches the socket into multishot receive mode: a single IORING_RECV_MULTISHOT request
+  // stays armed and the kernel fills buffers selected from the provided buffer ring group_id.
+  // The ring must be registered on the socket's proactor via RegisterBufferRing.
+  // Received data is consumed with RecvProvided/ReturnProvided or, with a copy, via Recv/RecvMsg.
+  // The mode stays active until the socket is closed. Sockets in this mode should not be
+  // migrated to another proactor.
+  error_code EnableRecvMultishot(uint16_t group_id);
+
+  // Switches the socket into zero-copy receive mode: a single IORING_OP_RECV_ZC request stays
+  // armed and the NIC receives the payloads into the zero-copy area of the proactor, see
+  // UringProactor::SetZcrx. RecvProvided hands out views into the area that go back to the NIC
+  // via ReturnProvided, Recv/RecvMsg copy them. Falls back to
+  // EnableRecvMultishot(fallback_group_id) if the proactor has no zero-copy area or if the
+  // kernel rejects the request. The same restrictions as for EnableRecvMultishot apply.
+  error_code EnableRecvZeroCopy(uint16_t fallback_group_id);
+
+  Result<unsigned> RecvProvided(unsigned max_bufs, ProvidedBuffer* dest) final;
+  void ReturnProvided(const ProvidedBuffer& pbuf) final;
+
+  // In multishot mode waits for the armed request to deliver data.
+  error_code WaitReadable() final;
+
+  // Cancels the requests of the socket via UringProactor::CancelRequests, they fail with
+  // operation_canceled.
+  void CancelPendingIo() final;
+  void CancelPendingIoAsync() final;
+
+  // Requires kernel 6.1 or later. Zero-copy writes ignore the socket timeout because
+  // the kernel keeps referencing the buffers until the notification arrives.
+  error_code EnableZeroCopySend(size_t threshold) final;
+
  private:
   UringProactor* GetProactor() {
     return static_cast<Proactor*>(proactor());
@@ -65,6 +113,13 @@ class UringSocket : public LinuxSocketBase {
   void OnSetProactor() final;
   void OnResetProactor() final;
 
+  // Wakes the fiber blocked in Accept, which returns connection_aborted in the shutdown state.
+  void WakeAccept();
+
+  bool HasAsyncWriteSome() const final {
+    return true;
+  }
+
   uint8_t register_flag() const {
     return is_direct_fd_ ? IOSQE_FIXED_FILE : 0;
   }
@@ -93,7 +148,109 @@ class UringSocket : public LinuxSocketBase {
     }
   };
 
+  // State of the armed multishot receive request. Allocated on heap since the completion
+  // callback may outlive the socket until the kernel delivers the final completion.
+  struct MultishotState {
+    struct Entry {
+      uint64_t id;  // the buffer id, or the area offset for zero-copy receives.
+      uint32_t len;
+      bool zc;
+    };
+
+    std::vector<Entry> queue;   // received buffers that were not handed out yet.
+    unsigned head = 0;          // index of the first pending entry in queue.
+    uint32_t front_offset = 0;  // bytes of queue[head] that were already copied out.
+    detail::FiberInterface* waiter = nullptr;
+    uint64_t user_data = 0;  // of the armed request, used for its cancellation.
+    uint32_t arm_epoch = 0;  // Buf ring or zcrx return epoch when the request was armed.
+    uint16_t group_id = 0;
+    bool zc = false;  // the request is a zero-copy receive.
+    bool armed = false;
+    bool detached = false;  // the socket does not reference this state anymore.
+    bool no_bufs = false;   // the request was terminated because it ran out of buffers.
+    int error = 0;          // sticky errno, ECONNABORTED on EOF.
+
+    bool empty() const {
+      return head == queue.size();
+    }
+
+    void PopFront() {
+      front_offset = 0;
+      if (++head == queue.size()) {
+        queue.clear();
+        head = 0;
+      }
+    }
+  };
+
+  // State of the armed multishot accept request. Similarly to MultishotState, it is deleted
+  // by the completion callback if the socket is closed while the request is armed.
+  struct AcceptState {
+    std::vector<int> queue;  // accepted fds that were not handed out yet.
+    unsigned head = 0;
+    unsigned max_queued = 0;
+    detail::FiberInterface* waiter = nullptr;
+    uint64_t user_data = 0;  // of the armed request, used for its cancellation.
+    bool armed = false;
+    bool canceling = false;
+    bool detached = false;
+    int error = 0;  // errno of the last failed accept, returned once.
+
+    unsigned size() const {
+      return queue.size() - head;
+    }
+  };
+
+  static void OnAcceptMultishot(AcceptState* state, detail::FiberInterface* current,
+                                UringProactor::IoResult res, uint32_t flags);
+  void ArmAcceptMultishot();
+  void CancelAcceptMultishot();
+  void DisableAcceptMultishot();
+
+  // Returns an accepted fd, or -1 if the multishot request is disabled and the connection
+  // should be accepted with a regular request.
+  Result<int> AcceptQueued();
+
+  static const uint8_t* EntryData(UringProactor* p, const MultishotState& st,
+                                  const MultishotState::Entry& entry) {
+    return entry.zc ? p->GetZcrxPtr(entry.id) : p->GetBufRingPtr(st.group_id, entry.id);
+  }
+
+  // Hands the buffer of entry back to the kernel.
+  static void ReleaseEntry(UringProactor* p, const MultishotState& st,
+                           const MultishotState::Entry& entry) {
+    if (entry.zc)
+      p->ReturnZcrx(entry.id, entry.len);
+    else
+      p->ConsumeBufRing(st.group_id, entry.id);
+  }
+
+  static void OnRecvMultishot(MultishotState* state, detail::FiberInterface* current,
+                              UringProactor::IoResult res, uint32_t flags);
+  void ArmRecvMultishot();
+  void DisableRecvMultishot();
+
+  // Waits until the multishot request delivers data. Returns an error if the stream has ended
+  // or if the socket timeout has passed.
+  error_code WaitRecvMultishot(int flags);
+
+  // Copies pending multishot data into v. Returns number of bytes copied.
+  size_t CopyRecvMultishot(const iovec* v, size_t len);
+
+  // Waits until the socket has any of the poll events, returns an error upon timeout.
+  error_code WaitPoll(uint32_t events);
+
+  // Cancels all the requests of the socket. If wait is false, only queues the cancellation
+  // request. Returns false if the kernel headers do not support the cancellation of direct fds.
+  bool CancelRequests(bool wait = true);
+
+  bool UseZeroCopy(const iovec* v, uint32_t len) const;
+  Result<size_t> WriteSomeZc(const iovec* v, uint32_t len);
+
   ErrorCbRefWrapper* error_cb_wrapper_ = nullptr;
+  MultishotState* multishot_ = nullptr;
+  AcceptState* accept_ms_ = nullptr;
+  size_t zc_threshold_ = 0;  // 0 if zero-copy sends are disabled.
 
   union {
     uint32_t flags_;
@@ -101,6 +258,7 @@ class UringSocket : public LinuxSocketBase {
       uint32_t has_pollfirst_ : 1;
       uint32_t has_recv_data_ : 1;
       uint32_t is_direct_fd_ : 1;
+      uint32_t is_accepting_ : 1;
     };
   };
 };
@@ -5,16 +5,12 @@
 #include "util/varz.h"
 
 #include "base/logging.h"
-#include "util/fibers/synchronization.h"
 
 using base::VarzValue;
 using namespace std;
 
 namespace util {
 
-using fb2::Mutex;
-using fb2::ProactorBase;
-
 VarzValue VarzQps::GetData() const {
   uint32_t qps = val_.SumTail() / (Counter::WIN_SIZE - 1);  // Average over kWinSize values.
   return VarzValue::FromInt(qps);
@@ -34,19 +30,9 @@ void VarzMapAverage::Shutdown() {
   pp_ = nullptr;
 }
 
-unsigned VarzMapAverage::ProactorThreadIndex() const {
-  unsigned tnum = CHECK_NOTNULL(pp_)->size();
-
-  int32_t indx = ProactorBase::me()->GetPoolIndex();
-  CHECK_GE(indx, 0) << "Must be called from proactor thread!";
-  CHECK_LT(unsigned(indx), tnum) << "Invalid thread index " << indx;
-
-  return unsigned(indx);
-}
-
 auto VarzMapAverage::FindSlow(string_view key) -> Map::iterator {
   auto str = pp_->GetString(key);
-  auto& map = avg_map_[ProactorBase::me()->GetPoolIndex()];
+  auto& map = avg_map_[ProactorThreadIndex()];
   auto res = map.emplace(str, SumCnt{});
 
   CHECK(res.second);
@@ -56,29 +42,39 @@ auto VarzMapAverage::FindSlow(string_view key) -> Map::iterator {
 VarzValue VarzMapAverage::GetData() const {
   CHECK(pp_);
 
-  AnyValue::Map result;
-  Mutex mu;
-
-  auto cb = [&](unsigned index, auto*) {
-    auto& map = avg_map_[index];
-
-    for (const auto& k_v : map) {
-      AnyValue::Map items;
-      int64 count = k_v.second.second.Sum();
-      int64 sum = k_v.second.first.Sum();
-      items.emplace_back("count", VarzValue::FromInt(count));
-      items.emplace_back("sum", VarzValue::FromInt(sum));
-
-      if (count) {
-        double avg = count > 0 ? double(sum) / count : 0;
-        items.emplace_back("average", VarzValue::FromDouble(avg));
-      }
+  // The key strings are owned by the pool, hence the views outlive the shards.
+  using SumCount = pair<int64_t, int64_t>;
+  vector<vector<pair<string_view, SumCount>>> shards(pp_->size());
+  pp_->AwaitBrief([&](unsigned index, auto*) {
+    const Map& map = avg_map_[index];
+    auto& dest = shards[index];
+    dest.reserve(map.size());
+    for (const auto& k_v : map)
+      dest.emplace_back(k_v.first, SumCount{k_v.second.first.Sum(), k_v.second.second.Sum()});
+  });
+
+  absl::flat_hash_map<string_view, SumCount> merged;
+  for (const auto& shard : shards) {
+    for (const auto& [key, sum_cnt] : shard) {
+      SumCount& dest = merged[key];
+      dest.first += sum_cnt.first;
+      dest.second += sum_cnt.second;
+    }
+  }
 
-      lock_guard lk(mu);
-      result.emplace_back(string(k_v.first), std::move(items));
+  AnyValue::Map result;
+  for (const auto& [key, sum_cnt] : merged) {
+    auto [sum, count] = sum_cnt;
+    AnyValue::Map items;
+    items.emplace_back("count", VarzValue::FromInt(count));
+    items.emplace_back("sum", VarzValue::FromInt(sum));
+
+    if (count) {
+      double avg = count > 0 ? double(sum) / count : 0;
+      items.emplace_back("average", VarzValue::FromDouble(avg));
     }
-  };
-  pp_->AwaitFiberOnAll(cb);
+    result.emplace_back(string(key), std::move(items));
+  }
 
   return result;
 }
@@ -89,15 +85,30 @@ VarzValue VarzFunction::GetData() const {
 }
 
 void VarzCount::Init(ProactorPool* pp) {
-  CHECK_NOTNULL(pp);
+  CHECK(pp_ == nullptr);
+  pp_ = CHECK_NOTNULL(pp);
+  shards_.reset(new Shard[pp->size()]);
 }
 
 void VarzCount::Shutdown() {
+  if (!shards_)
+    return;
+
+  // Folds the shards, so that the count survives the shutdown.
+  for (unsigned i = 0; i < pp_->size(); ++i)
+    count_.fetch_add(shards_[i].count, memory_order_relaxed);
+  shards_.reset();
+  pp_ = nullptr;
 }
 
 VarzValue VarzCount::GetData() const {
-  AnyValue res = VarzValue::FromInt(count_.load(memory_order_relaxed));
-  return res;
+  atomic_int64_t res{count_.load(memory_order_relaxed)};
+  if (shards_) {
+    pp_->AwaitBrief([&](unsigned index, auto*) {
+      res.fetch_add(shards_[index].count, memory_order_relaxed);
+    });
+  }
+  return VarzValue::FromInt(res.load(memory_order_relaxed));
 }
 
 VarzCount::~VarzCount() {
@@ -0,0 +1,120 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/fibers/write_queue.h"
+
+#include "base/logging.h"
+
+namespace util {
+namespace fb2 {
+
+using namespace std;
+
+WriteQueue::WriteQueue(io::AsyncSink* sink, const Options& opts) : sink_(sink), opts_(opts) {
+  CHECK_GT(opts_.max_iovecs, 0u);
+  CHECK_LE(opts_.low_watermark, opts_.high_watermark);
+  iov_.reset(new iovec[opts_.max_iovecs]);
+}
+
+WriteQueue::~WriteQueue() {
+  closing_ = true;
+  drain_ec_.await([this] { return !in_flight_; });
+}
+
+error_code WriteQueue::Write(string buf) {
+  if (ec_)
+    return ec_;
+  if (buf.empty())
+    return {};
+
+  ++stats_.buffers;
+  pending_ += buf.size();
+  stats_.max_pending = max(stats_.max_pending, pending_);
+
+  if (buf.size() <= opts_.merge_size && queue_.size() > inflight_bufs_ &&
+      queue_.back().size() + buf.size() <= opts_.merge_size) {
+    queue_.back().append(buf);
+  } else {
+    queue_.push_back(std::move(buf));
+  }
+
+  Pump();
+  return Throttle();
+}
+
+error_code WriteQueue::Write(io::Bytes buf) {
+  return Write(string{reinterpret_cast<const char*>(buf.data()), buf.size()});
+}
+
+error_code WriteQueue::Flush() {
+  drain_ec_.await([this] { return pending_ == 0 || ec_; });
+  return ec_;
+}
+
+error_code WriteQueue::Throttle() {
+  if (pending_ > opts_.high_watermark && !ec_) {
+    ++stats_.throttled;
+    space_ec_.await([this] { return pending_ <= opts_.low_watermark || ec_; });
+  }
+  return ec_;
+}
+
+void WriteQueue::Pump() {
+  if (pumping_)
+    return;  // OnWritten was called synchronously, the loop below continues.
+
+  pumping_ = true;
+  while (!in_flight_ && !queue_.empty() && !ec_ && !closing_) {
+    unsigned cnt = 0;
+    for (auto it = queue_.begin(); it != queue_.end() && cnt < opts_.max_iovecs; ++it, ++cnt) {
+      size_t offs = cnt == 0 ? front_offset_ : 0;
+      iov_[cnt].iov_base = it->data() + offs;
+      iov_[cnt].iov_len = it->size() - offs;
+    }
+
+    inflight_bufs_ = cnt;
+    in_flight_ = true;
+    ++stats_.writes;
+    sink_->AsyncWriteSome(iov_.get(), cnt, [this](io::Result<size_t> res) { OnWritten(res); });
+  }
+  pumping_ = false;
+}
+
+void WriteQueue::OnWritten(io::Result<size_t> res) {
+  DCHECK(in_flight_);
+  in_flight_ = false;
+  inflight_bufs_ = 0;
+
+  if (!res) {
+    ec_ = res.error();
+    queue_.clear();
+    front_offset_ = 0;
+    pending_ = 0;
+  } else {
+    size_t written = *res;
+    DCHECK_LE(written, pending_);
+    stats_.bytes += written;
+    pending_ -= written;
+    while (written > 0) {
+      size_t left = queue_.front().size() - front_offset_;
+      if (written < left) {
+        front_offset_ += written;
+        break;
+      }
+      written -= left;
+      front_offset_ = 0;
+      queue_.pop_front();
+    }
+  }
+
+  if (pending_ <= opts_.low_watermark || ec_)
+    space_ec_.notifyAll();
+  if (pending_ == 0 || ec_ || closing_)
+    drain_ec_.notifyAll();
+
+  Pump();
+}
+
+}  // namespace fb2
+}  // namespace util
@@ -0,0 +1,107 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <sys/uio.h>
+
+#include <deque>
+#include <memory>
+#include <string>
+
+#include "io/io.h"
+#include "util/fibers/synchronization.h"
+
+namespace util {
+namespace fb2 {
+
+// Per-connection queue of outgoing buffers that are written via io::AsyncSink::AsyncWriteSome,
+// e.g. of a socket, with at most one write in flight. The queued buffers are sent together
+// as a single writev batch of up to max_iovecs buffers and small buffers are merged upon
+// queuing. Write suspends the producing fiber once more than high_watermark bytes are pending
+// and resumes it when the queue drains to low_watermark, so a slow consumer bounds the memory
+// that is buffered for it instead of letting it grow. Must be used from the proactor thread
+// of the sink. Once a write fails, the pending data is dropped and all the calls return the
+// error.
+class WriteQueue {
+ public:
+  struct Options {
+    size_t high_watermark = 1 << 20;
+    size_t low_watermark = 256 << 10;
+    unsigned max_iovecs = 64;
+
+    // Buffers up to this size are appended to the last queued buffer if it is not being
+    // written, so that many small writes do not turn into as many iovecs.
+    size_t merge_size = 4096;
+  };
+
+  struct Stats {
+    uint64_t writes = 0;     // AsyncWriteSome calls.
+    uint64_t buffers = 0;    // buffers passed to Write, including the merged ones.
+    uint64_t bytes = 0;      // bytes written.
+    uint64_t throttled = 0;  // Write calls that suspended at the high watermark.
+    size_t max_pending = 0;
+  };
+
+  explicit WriteQueue(io::AsyncSink* sink) : WriteQueue(sink, Options{}) {
+  }
+
+  WriteQueue(io::AsyncSink* sink, const Options& opts);
+
+  // Waits for the write in flight, the data that was not passed to the sink yet is dropped.
+  // Call Flush before to write everything.
+  ~WriteQueue();
+
+  WriteQueue(const WriteQueue&) = delete;
+  WriteQueue& operator=(const WriteQueue&) = delete;
+
+  // Queues buf and returns immediately unless more than high_watermark bytes are pending.
+  // Returns the error of a failed write.
+  std::error_code Write(std::string buf);
+
+  // Copies buf into the queue.
+  std::error_code Write(io::Bytes buf);
+
+  // Waits until the queued data has been written.
+  std::error_code Flush();
+
+  size_t pending_bytes() const {
+    return pending_;
+  }
+
+  const Stats& stats() const {
+    return stats_;
+  }
+
+ private:
+  std::error_code Throttle();
+
+  // Starts writing if no write is in flight. Loops while the sink completes the writes
+  // synchronously, e.g. with epoll sockets.
+  void Pump();
+  void OnWritten(io::Result<size_t> res);
+
+  io::AsyncSink* sink_;
+  Options opts_;
+
+  std::deque<std::string> queue_;
+  size_t front_offset_ = 0;  // bytes of queue_.front() that were already written.
+  size_t pending_ = 0;
+
+  // The first inflight_bufs_ buffers of queue_ are referenced by iov_ while a write is in
+  // flight, so they must not change.
+  std::unique_ptr<iovec[]> iov_;
+  unsigned inflight_bufs_ = 0;
+  bool in_flight_ = false;
+  bool pumping_ = false;
+  bool closing_ = false;
+
+  std::error_code ec_;
+  EventCount space_ec_;  // producers wait for the low watermark.
+  EventCount drain_ec_;  // Flush and the destructor wait for the queue to drain.
+  Stats stats_;
+};
+
+}  // namespace fb2
+}  // namespace util
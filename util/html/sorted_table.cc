@@ -3,6 +3,7 @@
 //
 #include "util/html/sorted_table.h"
 
+#include "absl/strings/str_cat.h"
 #include "absl/strings/str_join.h"
 
 namespace util {
@@ -21,6 +22,82 @@ struct THFormatter {
 };
 
 const char kCdnPrefix[] = "https://cdn.jsdelivr.net/gh/romange/async/util/html";
+
+// Appends str as a JSON string that is safe to embed into a <script> element.
+void AppendJsonString(std::string_view str, string* dest) {
+  static const char kHex[] = "0123456789abcdef";
+
+  dest->push_back('"');
+  for (char c : str) {
+    unsigned char uc = c;
+    switch (c) {
+      case '"':
+        dest->append("\\\"");
+        break;
+      case '\\':
+        dest->append("\\\\");
+        break;
+      case '<':  // Prevents closing the script element with "</script>".
+        dest->append("\\u003c");
+        break;
+      default:
+        if (uc < 0x20) {
+          dest->append("\\u00");
+          dest->push_back(kHex[uc >> 4]);
+          dest->push_back(kHex[uc & 0xf]);
+        } else {
+          dest->push_back(c);
+        }
+    }
+  }
+  dest->push_back('"');
+}
+
+const char kJsonTableStyle[] = R"(
+<style>
+  body { font-family: sans-serif; font-size: 14px; }
+  table.jsontable { border-collapse: collapse; }
+  table.jsontable th { cursor: pointer; background: #343a40; color: white; }
+  table.jsontable th, table.jsontable td { border: 1px solid #ccc; padding: 3px 8px; }
+  table.jsontable tr:nth-child(even) { background: #f2f2f2; }
+</style>
+)";
+
+// Renders jt_rows into the table and sorts them by the clicked column, numerically if all
+// its values are numbers.
+const char kJsonTableScript[] = R"(
+<script>
+(function() {
+  const tbody = document.querySelector('table.jsontable tbody');
+  function render() {
+    const frag = document.createDocumentFragment();
+    for (const row of jt_rows) {
+      const tr = document.createElement('tr');
+      for (const cell of row) {
+        const td = document.createElement('td');
+        td.textContent = cell;
+        tr.appendChild(td);
+      }
+      frag.appendChild(tr);
+    }
+    tbody.replaceChildren(frag);
+  }
+  let sort_col = -1, sort_dir = 1;
+  document.querySelectorAll('table.jsontable th').forEach((th, col) => {
+    th.addEventListener('click', () => {
+      sort_dir = (sort_col === col) ? -sort_dir : 1;
+      sort_col = col;
+      const numeric = jt_rows.every(r => r[col] !== '' && !isNaN(r[col]));
+      jt_rows.sort((a, b) =>
+          sort_dir * (numeric ? a[col] - b[col] : a[col].localeCompare(b[col])));
+      render();
+    });
+  });
+  render();
+})();
+</script>
+)";
+
 }  // namespace
 
 string SortedTable::HtmlStart() {
@@ -84,5 +161,65 @@ void SortedTable::Row(const std::vector<std::string_view>& row, std::string* des
   absl::StrAppend(dest, "<tr>\n", absl::StrJoin(row, "\n", THFormatter{"td"}), "</tr>\n");
 }
 
+JsonTable::JsonTable(Writer writer, Page page) : writer_(std::move(writer)), page_(page) {
+  if (page_.limit == 0)
+    page_.limit = 1;
+}
+
+void JsonTable::Start(std::string_view title, const std::vector<std::string_view>& header) {
+  absl::StrAppend(&buf_, "<html>\n<head>\n  <meta charset=\"UTF-8\">\n  <title>", title,
+                  "</title>", kJsonTableStyle, "</head>\n<body>\n<h3>", title,
+                  "</h3>\n<table class=\"jsontable\">\n<thead><tr>",
+                  absl::StrJoin(header, "", THFormatter{"th"}),
+                  "</tr></thead>\n<tbody></tbody>\n</table>\n<script>\nconst jt_rows = [\n");
+}
+
+void JsonTable::Row(const std::vector<std::string_view>& row) {
+  if (!NeedRow()) {
+    SkipRow();
+    return;
+  }
+
+  ++index_;
+  buf_.push_back('[');
+  for (size_t i = 0; i < row.size(); ++i) {
+    if (i > 0)
+      buf_.push_back(',');
+    AppendJsonString(row[i], &buf_);
+  }
+  buf_.append("],\n");
+  MaybeFlush(false);
+}
+
+void JsonTable::End() {
+  buf_.append("];\n</script>\n");
+  buf_.append(kJsonTableScript);
+
+  size_t first = page_.offset, last = std::min(index_, page_.offset + page_.limit);
+  buf_.append("<p>");
+  if (first < last) {
+    absl::StrAppend(&buf_, "Rows ", first + 1, "-", last, " of ", index_);
+  } else {
+    absl::StrAppend(&buf_, "No rows at offset ", first, ", the table has ", index_, " rows");
+  }
+  if (first > 0) {
+    size_t prev = first > page_.limit ? first - page_.limit : 0;
+    absl::StrAppend(&buf_, " <a href=\"?offset=", prev, "&limit=", page_.limit,
+                    "\">previous</a>");
+  }
+  if (last < index_) {
+    absl::StrAppend(&buf_, " <a href=\"?offset=", last, "&limit=", page_.limit, "\">next</a>");
+  }
+  buf_.append("</p>\n</body>\n</html>\n");
+  MaybeFlush(true);
+}
+
+void JsonTable::MaybeFlush(bool force) {
+  if (buf_.size() >= kFlushSize || (force && !buf_.empty())) {
+    writer_(buf_);
+    buf_.clear();
+  }
+}
+
 }  // namespace html
 }  // namespace util
@@ -1,6 +1,11 @@
 // Copyright 2018, Beeri 15.  All rights reserved.
 // Author: Roman Gershman (romange@gmail.com)
 //
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <string>
 #include <string_view>
 #include <vector>
 
@@ -18,6 +23,61 @@ class SortedTable {
   static void EndTable(std::string* dest);
 };
 
+// Streams a large table page by page. The browser receives the rows of the page as a compact
+// JSON payload that a small script renders and sorts, rather than html rows. The output is
+// passed to writer in pieces of about kFlushSize bytes, e.g. to HttpContext::WriteChunk, so
+// the page is not materialized in memory. For example:
+//   JsonTable table([&](std::string_view s) { cntx->WriteChunk(s); }, {offset, limit});
+//   table.Start("Connections", {"id", "peer"});
+//   for (const auto& c : conns) {
+//     if (table.NeedRow())
+//       table.Row({absl::StrCat(c.id), c.peer});
+//     else
+//       table.SkipRow();
+//   }
+//   table.End();
+class JsonTable {
+ public:
+  using Writer = std::function<void(std::string_view)>;
+
+  static constexpr size_t kFlushSize = 16384;
+
+  // The range of the rows that are sent.
+  struct Page {
+    size_t offset = 0;
+    size_t limit = 1000;
+  };
+
+  JsonTable(Writer writer, Page page);
+
+  // Writes the html up to the rows.
+  void Start(std::string_view title, const std::vector<std::string_view>& header);
+
+  // Returns true if the next row is on the page. Otherwise Row() only counts it.
+  bool NeedRow() const {
+    return index_ >= page_.offset && index_ - page_.offset < page_.limit;
+  }
+
+  void Row(const std::vector<std::string_view>& row);
+
+  // Counts a row that is not on the page without formatting it.
+  void SkipRow() {
+    ++index_;
+  }
+
+  // Writes the rest of the page, including the links to the neighbour pages, which pass
+  // the "offset" and "limit" query arguments to the same path.
+  void End();
+
+ private:
+  void MaybeFlush(bool force);
+
+  Writer writer_;
+  Page page_;
+  size_t index_ = 0;
+  std::string buf_;
+};
+
 /*
 std::string SortedTable::Start(const Container& header) {
   std::string res(
@@ -0,0 +1,492 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/http/client_pool.h"
+
+#include <absl/strings/str_cat.h>
+
+#include <boost/beast/http/buffer_body.hpp>
+#include <boost/beast/http/empty_body.hpp>
+#include <boost/beast/http/parser.hpp>
+#include <boost/beast/http/read.hpp>
+#include <boost/beast/http/write.hpp>
+
+#include "base/logging.h"
+#include "util/asio_stream_adapter.h"
+#include "util/fiber_socket_base.h"
+#include "util/fibers/dns_resolve.h"
+#include "util/tls/tls_session_cache.h"
+#include "util/tls/tls_socket.h"
+
+namespace util {
+namespace http {
+
+using namespace std;
+using nonstd::make_unexpected;
+namespace h2 = ::boost::beast::http;
+
+namespace {
+
+constexpr size_t kBodyBufSize = 1 << 15;
+
+inline ::boost::beast::string_view ToBeast(string_view s) {
+  return ::boost::beast::string_view(s.data(), s.size());
+}
+
+error_code ToStd(const ::boost::system::error_code& ec) {
+  if (ec == h2::error::end_of_stream || ec == h2::error::partial_message)
+    return make_error_code(errc::connection_aborted);
+  if (ec.category() == ::boost::system::system_category() ||
+      ec.category() == ::boost::system::generic_category())
+    return error_code(ec.value(), system_category());
+  return make_error_code(errc::bad_message);  // the parser errors.
+}
+
+template <typename Pred>
+bool AwaitUntil(fb2::EventCount* ec, Pred pred, chrono::steady_clock::time_point deadline) {
+  if (deadline == chrono::steady_clock::time_point::max()) {
+    ec->await(pred);
+    return true;
+  }
+  ec->await_until(pred, deadline);
+  return pred();
+}
+
+bool IsIdempotent(const ClientPool::Request& req) {
+  if (req.body)
+    return false;
+  return req.hedge || req.verb == h2::verb::get || req.verb == h2::verb::head ||
+         req.verb == h2::verb::options;
+}
+
+}  // namespace
+
+struct ClientPool::Conn {
+  explicit Conn(Host* h) : host(h) {
+  }
+
+  Host* host;
+  unique_ptr<FiberSocketBase> socket;
+  ::boost::beast::flat_buffer read_buf;  // holds the bytes of the following responses.
+
+  unsigned inflight = 0;
+  uint64_t next_seq = 0;   // assigned to the next request.
+  uint64_t write_seq = 0;  // the request that writes.
+  uint64_t read_seq = 0;   // the request that reads its response.
+  bool broken = false;     // no more requests, closed once the inflight ones are done.
+
+  fb2::EventCount turn_ec;
+};
+
+struct ClientPool::Host {
+  string name;
+  uint16_t port;
+  vector<unique_ptr<Conn>> conns;
+  unsigned connecting = 0;
+  fb2::EventCount slot_ec;
+};
+
+// The state of a hedged request, shared by its attempts that may outlive Send.
+struct ClientPool::Hedge {
+  string target;
+  Fields fields;
+  Request req;  // references target and fields.
+  io::Sink* sink = nullptr;
+
+  int winner = -1;  // the attempt that received its response header first.
+  unsigned started = 0;
+  bool finished[2] = {false, false};
+  io::Result<ResponseHeader> results[2];
+  fb2::EventCount ec;
+
+  unsigned num_finished() const {
+    return unsigned(finished[0]) + unsigned(finished[1]);
+  }
+};
+
+ClientPool::ClientPool(fb2::ProactorBase* proactor, const Options& opts)
+    : proactor_(proactor), opts_(opts) {
+  CHECK_GT(opts_.max_conns_per_host, 0u);
+  CHECK_GT(opts_.pipeline_depth, 0u);
+}
+
+ClientPool::~ClientPool() {
+  attempts_ec_.await([this] { return detached_attempts_ == 0; });
+  for (auto& [key, host] : hosts_) {
+    DCHECK_EQ(0u, host->connecting);
+    for (auto& conn : host->conns) {
+      DCHECK_EQ(0u, conn->inflight);
+      if (conn->socket)
+        std::ignore = conn->socket->Close();
+    }
+  }
+}
+
+auto ClientPool::GetHost(string_view host, uint16_t port) -> Host* {
+  auto [it, inserted] = hosts_.try_emplace(absl::StrCat(host, ":", port));
+  if (inserted) {
+    it->second = make_unique<Host>();
+    it->second->name = host;
+    it->second->port = port;
+  }
+  return it->second.get();
+}
+
+auto ClientPool::Send(string_view host, uint16_t port, const Request& req, io::Sink* body_sink)
+    -> io::Result<ResponseHeader> {
+  DCHECK(proactor_->InMyThread());
+  ++stats_.requests;
+
+  Clock::time_point deadline = Clock::time_point::max();
+  if (req.timeout.count() > 0)
+    deadline = Clock::now() + req.timeout;
+
+  Host* h = GetHost(host, port);
+  if (opts_.hedge_delay_ms > 0 && req.hedge && !req.body)
+    return SendHedged(h, req, deadline, body_sink);
+
+  return Exchange(h, req, deadline, body_sink, nullptr, 0);
+}
+
+auto ClientPool::SendHedged(Host* host, const Request& req, Clock::time_point deadline,
+                            io::Sink* body_sink) -> io::Result<ResponseHeader> {
+  auto hedge = make_shared<Hedge>();
+  hedge->target = req.target;
+  hedge->req = req;
+  hedge->req.target = hedge->target;
+  if (req.fields) {
+    hedge->fields = *req.fields;
+    hedge->req.fields = &hedge->fields;
+  }
+  hedge->sink = body_sink;
+
+  // The attempts run detached, so that the loser does not delay the response.
+  auto launch = [&](unsigned attempt) {
+    ++hedge->started;
+    ++detached_attempts_;
+    fb2::Fiber("http_hedge", [this, hedge, host, deadline, attempt] {
+      hedge->results[attempt] =
+          Exchange(host, hedge->req, deadline, hedge->sink, hedge.get(), attempt);
+      hedge->finished[attempt] = true;
+      hedge->ec.notifyAll();
+
+      --detached_attempts_;
+      attempts_ec_.notifyAll();
+    }).Detach();
+  };
+
+  launch(0);
+  Clock::time_point hedge_tp =
+      std::min(deadline, Clock::now() + chrono::milliseconds(opts_.hedge_delay_ms));
+  auto decided = [&] { return hedge->winner >= 0 || hedge->num_finished() == hedge->started; };
+  hedge->ec.await_until(decided, hedge_tp);
+  if (!decided() && Clock::now() < deadline) {
+    ++stats_.hedged;
+    launch(1);
+  }
+
+  // The sink is used only by the winner, hence it is done with it once it finishes.
+  hedge->ec.await([&] {
+    return (hedge->winner >= 0 && hedge->finished[hedge->winner]) ||
+           hedge->num_finished() == hedge->started;
+  });
+
+  if (hedge->winner < 0)
+    return std::move(hedge->results[hedge->started - 1]);
+
+  if (hedge->winner == 1)
+    ++stats_.hedge_won;
+  hedge->sink = nullptr;
+  return std::move(hedge->results[hedge->winner]);
+}
+
+auto ClientPool::Exchange(Host* host, const Request& req, Clock::time_point deadline,
+                          io::Sink* body_sink, Hedge* hedge, unsigned attempt)
+    -> io::Result<ResponseHeader> {
+  auto lost = [&] { return hedge && hedge->winner >= 0 && hedge->winner != int(attempt); };
+
+  io::Result<ResponseHeader> res;
+  for (unsigned i = 0; i < 2; ++i) {
+    io::Result<Conn*> conn = Acquire(host, deadline);
+    if (!conn)
+      return make_unexpected(conn.error());
+
+    if (lost()) {
+      Release(*conn);
+      return make_unexpected(make_error_code(errc::operation_canceled));
+    }
+
+    bool retry = false;
+    res = ExchangeOn(*conn, req, deadline, body_sink, hedge, attempt, &retry);
+    Release(*conn);
+    if (res || !retry || lost())
+      break;
+    VLOG(1) << "Retrying on a new connection to " << host->name << ": " << res.error();
+  }
+  return res;
+}
+
+auto ClientPool::ExchangeOn(Conn* conn, const Request& req, Clock::time_point deadline,
+                            io::Sink* body_sink, Hedge* hedge, unsigned attempt, bool* retry)
+    -> io::Result<ResponseHeader> {
+  FiberSocketBase* sock = conn->socket.get();
+  bool reused = conn->next_seq > 0;
+  uint64_t seq = conn->next_seq++;
+
+  // Fails the pipelined requests of the connection as well, since its stream position is lost.
+  auto fail = [&](error_code ec) -> io::Result<ResponseHeader> {
+    if (!conn->broken) {
+      conn->broken = true;
+      sock->CancelPendingIo();
+    }
+    conn->turn_ec.notifyAll();
+    return make_unexpected(ec);
+  };
+
+  auto set_timeout = [&]() -> bool {
+    if (deadline == Clock::time_point::max())
+      return true;
+    auto left = chrono::duration_cast<chrono::milliseconds>(deadline - Clock::now()).count();
+    if (left <= 0)
+      return false;
+    sock->set_timeout(left);
+    return true;
+  };
+
+  auto my_turn = [&](const uint64_t& turn) {
+    return AwaitUntil(
+        &conn->turn_ec, [&] { return conn->broken || turn == seq; }, deadline);
+  };
+
+  if (!my_turn(conn->write_seq))
+    return fail(make_error_code(errc::timed_out));
+  if (conn->broken) {
+    *retry = IsIdempotent(req);
+    return make_unexpected(make_error_code(errc::connection_aborted));
+  }
+
+  // Writes the request.
+  AsioStreamAdapter<> adapter(*sock);
+  ::boost::system::error_code bec;
+
+  h2::request<h2::empty_body> msg{req.verb, ToBeast(req.target), 11};
+  if (req.fields) {
+    for (const auto& f : *req.fields)
+      msg.insert(f.name_string(), f.value());
+  }
+  msg.set(h2::field::host, ToBeast(conn->host->name));
+  if (req.body) {
+    if (req.body_size)
+      msg.content_length(*req.body_size);
+    else
+      msg.chunked(true);
+  }
+
+  if (!set_timeout())
+    return fail(make_error_code(errc::timed_out));
+
+  h2::request_serializer<h2::empty_body> sr{msg};
+  h2::write_header(adapter, sr, bec);
+  if (bec) {
+    *retry = reused && IsIdempotent(req);
+    return fail(ToStd(bec));
+  }
+
+  if (req.body) {
+    unique_ptr<uint8_t[]> buf(new uint8_t[kBodyBufSize]);
+    while (true) {
+      io::Result<size_t> n = req.body->ReadSome(io::MutableBytes{buf.get(), kBodyBufSize});
+      if (!n)
+        return fail(n.error());
+      if (!set_timeout())
+        return fail(make_error_code(errc::timed_out));
+
+      error_code ec;
+      if (msg.chunked()) {
+        char prefix[24];
+        int prefix_len = snprintf(prefix, sizeof(prefix), "%zx\r\n", *n);
+        iovec v[3] = {{prefix, size_t(prefix_len)}, {buf.get(), *n}, {const_cast<char*>("\r\n"), 2}};
+        ec = *n ? sock->Write(v, 3) : sock->Write(io::Buffer("0\r\n\r\n"));
+      } else if (*n) {
+        ec = sock->Write(io::Bytes{buf.get(), *n});
+      }
+      if (ec)
+        return fail(ec);
+      if (*n == 0)
+        break;
+    }
+  }
+
+  ++conn->write_seq;
+  conn->turn_ec.notifyAll();
+
+  // Reads the response.
+  if (!my_turn(conn->read_seq))
+    return fail(make_error_code(errc::timed_out));
+  if (conn->broken) {
+    *retry = IsIdempotent(req);
+    return make_unexpected(make_error_code(errc::connection_aborted));
+  }
+
+  h2::response_parser<h2::buffer_body> parser;
+  parser.body_limit(std::numeric_limits<uint64_t>::max());
+  if (req.verb == h2::verb::head)
+    parser.skip(true);
+
+  if (!set_timeout())
+    return fail(make_error_code(errc::timed_out));
+  h2::read_header(adapter, conn->read_buf, parser, bec);
+  if (bec) {
+    *retry = reused && IsIdempotent(req);
+    return fail(ToStd(bec));
+  }
+
+  io::Sink* sink = body_sink;
+  if (hedge) {
+    if (hedge->winner < 0) {
+      hedge->winner = attempt;
+      hedge->ec.notifyAll();
+    }
+    if (hedge->winner != int(attempt))
+      sink = nullptr;  // drains the body to keep the connection.
+  }
+
+  unique_ptr<uint8_t[]> buf;
+  while (!parser.is_done()) {
+    if (!buf)
+      buf.reset(new uint8_t[kBodyBufSize]);
+    auto& body = parser.get().body();
+    body.data = buf.get();
+    body.size = kBodyBufSize;
+
+    if (!set_timeout())
+      return fail(make_error_code(errc::timed_out));
+    h2::read(adapter, conn->read_buf, parser, bec);
+    if (bec == h2::error::need_buffer)
+      bec.clear();
+    if (bec)
+      return fail(ToStd(bec));
+
+    size_t n = kBodyBufSize - body.size;
+    if (sink && n > 0) {
+      if (error_code ec = sink->Write(io::Bytes{buf.get(), n}); ec)
+        return fail(ec);
+    }
+  }
+  if (deadline != Clock::time_point::max())
+    sock->set_timeout(UINT32_MAX);
+
+  if (!parser.get().keep_alive())
+    conn->broken = true;
+  ++conn->read_seq;
+  conn->turn_ec.notifyAll();
+
+  if (hedge && sink == nullptr)
+    return make_unexpected(make_error_code(errc::operation_canceled));
+
+  return ResponseHeader(std::move(parser.get().base()));
+}
+
+auto ClientPool::Acquire(Host* host, Clock::time_point deadline) -> io::Result<Conn*> {
+  auto pick = [&]() -> Conn* {
+    Conn* best = nullptr;
+    for (auto& conn : host->conns) {
+      if (conn->broken || conn->inflight >= opts_.pipeline_depth)
+        continue;
+      if (!best || conn->inflight < best->inflight)
+        best = conn.get();
+    }
+    return best;
+  };
+  auto can_connect = [&] {
+    return host->conns.size() + host->connecting < opts_.max_conns_per_host;
+  };
+
+  while (true) {
+    Conn* conn = pick();
+
+    // Prefers new connections to pipelining on the busy ones.
+    if (conn && (conn->inflight == 0 || !can_connect())) {
+      ++conn->inflight;
+      return conn;
+    }
+
+    if (can_connect()) {
+      auto fresh = make_unique<Conn>(host);
+      ++host->connecting;
+      error_code ec = Connect(host, fresh.get(), deadline);
+      --host->connecting;
+      host->slot_ec.notifyAll();
+      if (ec) {
+        if (fresh->socket)
+          std::ignore = fresh->socket->Close();
+        return make_unexpected(ec);
+      }
+
+      fresh->inflight = 1;
+      host->conns.push_back(std::move(fresh));
+      return host->conns.back().get();
+    }
+
+    if (!AwaitUntil(
+            &host->slot_ec, [&] { return pick() != nullptr || can_connect(); }, deadline))
+      return make_unexpected(make_error_code(errc::timed_out));
+  }
+}
+
+void ClientPool::Release(Conn* conn) {
+  DCHECK_GT(conn->inflight, 0u);
+  Host* host = conn->host;
+  if (--conn->inflight == 0 && conn->broken) {
+    std::ignore = conn->socket->Close();
+    auto it = find_if(host->conns.begin(), host->conns.end(),
+                      [conn](const auto& c) { return c.get() == conn; });
+    DCHECK(it != host->conns.end());
+    host->conns.erase(it);
+  }
+  host->slot_ec.notifyAll();
+}
+
+error_code ClientPool::Connect(Host* host, Conn* conn, Clock::time_point deadline) {
+  uint32_t timeout = opts_.connect_timeout_ms;
+  if (deadline != Clock::time_point::max()) {
+    auto left = chrono::duration_cast<chrono::milliseconds>(deadline - Clock::now()).count();
+    if (left <= 0)
+      return make_error_code(errc::timed_out);
+    timeout = std::min<uint32_t>(timeout, left);
+  }
+
+  auto addrs = fb2::DnsCache::Local()->Resolve(host->name, timeout);
+  if (!addrs)
+    return addrs.error();
+
+  conn->socket.reset(proactor_->CreateSocket());
+  conn->socket->set_timeout(timeout);
+  error_code ec = conn->socket->Connect(FiberSocketBase::endpoint_type{(*addrs)->front(), host->port});
+  if (ec)
+    return ec;
+  ++stats_.connects;
+
+  if (opts_.ssl_ctx) {
+    auto tls_socket = make_unique<tls::TlsSocket>(conn->socket.release());
+    tls_socket->InitSSL(opts_.ssl_ctx);
+
+    SSL* ssl = tls_socket->ssl_handle();
+    SSL_set_tlsext_host_name(ssl, host->name.c_str());
+    SSL_dane_enable(ssl, host->name.c_str());
+    if (auto* cache = tls::ClientSessionCache::Get(opts_.ssl_ctx))
+      cache->Attach(ssl, absl::StrCat(host->name, ":", host->port));
+
+    ec = tls_socket->Connect(FiberSocketBase::endpoint_type{});
+    conn->socket = std::move(tls_socket);
+    if (ec)
+      return ec;
+  }
+
+  conn->socket->set_timeout(UINT32_MAX);
+  return {};
+}
+
+}  // namespace http
+}  // namespace util
@@ -0,0 +1,146 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+#include <openssl/ssl.h>  // required by SSL_CTX
+
+#include <boost/beast/core/flat_buffer.hpp>
+#include <boost/beast/http/fields.hpp>
+#include <boost/beast/http/message.hpp>
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+#include "io/io.h"
+#include "util/fibers/proactor_base.h"
+#include "util/fibers/synchronization.h"
+
+namespace util {
+
+class FiberSocketBase;
+
+namespace http {
+
+/*
+  HTTP/1.1 client that keeps a bounded set of keep-alive connections per host and shares
+  them between the fibers of its proactor. Must be used from the proactor thread only, i.e.
+  one pool per proactor.
+
+  Requests acquire a connection of their host, waiting while all the connections are busy
+  and the limit is reached. With pipelining, up to pipeline_depth requests are in flight on
+  each connection: they are written in the order they acquired the connection, without
+  waiting for the preceding responses, and the responses are read in the same order.
+  The request bodies are read from io::Source and the response bodies are written into
+  io::Sink as they arrive, so neither is buffered in full.
+*/
+class ClientPool {
+ public:
+  using Verb = ::boost::beast::http::verb;
+  using Fields = ::boost::beast::http::fields;
+  using ResponseHeader = ::boost::beast::http::response_header<>;
+
+  struct Options {
+    unsigned max_conns_per_host = 8;
+
+    // Requests in flight per connection, 1 disables pipelining.
+    unsigned pipeline_depth = 1;
+
+    uint32_t connect_timeout_ms = 2000;
+
+    // If set, the hedged requests that did not receive a response header after this delay
+    // are sent again on another connection, see Request::hedge. 0 disables hedging.
+    uint32_t hedge_delay_ms = 0;
+
+    // If set, connects with TLS. Not owned, see TlsClient::CreateSslContext.
+    SSL_CTX* ssl_ctx = nullptr;
+  };
+
+  struct Request {
+    Verb verb = Verb::get;
+    std::string_view target = "/";
+
+    // Additional header fields. Host and the body framing fields are set by the pool.
+    const Fields* fields = nullptr;
+
+    // The body is sent with Content-Length if body_size is set, chunked otherwise.
+    io::Source* body = nullptr;
+    std::optional<size_t> body_size;
+
+    // Deadline of the whole request, including the wait for a connection and the response
+    // body. The connection of a timed out request is closed. 0 means no deadline.
+    std::chrono::milliseconds timeout{0};
+
+    // Whether the request is idempotent and can be hedged. Requests with a body are never
+    // hedged.
+    bool hedge = false;
+  };
+
+  struct Stats {
+    uint64_t requests = 0;
+    uint64_t connects = 0;
+    uint64_t hedged = 0;     // requests that were sent twice.
+    uint64_t hedge_won = 0;  // hedged requests that the second attempt served.
+  };
+
+  explicit ClientPool(fb2::ProactorBase* proactor) : ClientPool(proactor, Options{}) {
+  }
+
+  ClientPool(fb2::ProactorBase* proactor, const Options& opts);
+
+  // Waits for the hedged attempts that are still running and closes the connections.
+  ~ClientPool();
+
+  ClientPool(const ClientPool&) = delete;
+  ClientPool& operator=(const ClientPool&) = delete;
+
+  // Sends req to host:port and returns the response header once the response body has been
+  // written into body_sink, which may be null to discard it. Requests without a body that
+  // fail on a reused connection before receiving a response are retried on a new one, since
+  // the server may have closed the idle connection.
+  io::Result<ResponseHeader> Send(std::string_view host, uint16_t port, const Request& req,
+                                  io::Sink* body_sink);
+
+  Stats GetStats() const {
+    return stats_;
+  }
+
+ private:
+  using Clock = std::chrono::steady_clock;
+  struct Conn;
+  struct Host;
+  struct Hedge;
+
+  Host* GetHost(std::string_view host, uint16_t port);
+
+  // Returns a connection with a free pipeline slot, which the caller must release via Release.
+  io::Result<Conn*> Acquire(Host* host, Clock::time_point deadline);
+  void Release(Conn* conn);
+  std::error_code Connect(Host* host, Conn* conn, Clock::time_point deadline);
+
+  // Runs req on a connection of host. If hedge is set, the attempt writes into body_sink only
+  // if it receives its response header first.
+  io::Result<ResponseHeader> Exchange(Host* host, const Request& req, Clock::time_point deadline,
+                                      io::Sink* body_sink, Hedge* hedge, unsigned attempt);
+  io::Result<ResponseHeader> ExchangeOn(Conn* conn, const Request& req,
+                                        Clock::time_point deadline, io::Sink* body_sink,
+                                        Hedge* hedge, unsigned attempt, bool* retry);
+
+  io::Result<ResponseHeader> SendHedged(Host* host, const Request& req,
+                                        Clock::time_point deadline, io::Sink* body_sink);
+
+  fb2::ProactorBase* proactor_;
+  Options opts_;
+  absl::flat_hash_map<std::string, std::unique_ptr<Host>> hosts_;
+
+  unsigned detached_attempts_ = 0;
+  fb2::EventCount attempts_ec_;
+  Stats stats_;
+};
+
+}  // namespace http
+}  // namespace util
@@ -0,0 +1,267 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/http/client_pool.h"
+
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "util/accept_server.h"
+#include "util/fibers/pool.h"
+#include "util/http/http_handler.h"
+
+namespace util::http {
+
+using namespace std;
+namespace h2 = ::boost::beast::http;
+
+class ClientPoolTest : public testing::Test {
+ protected:
+  void SetUp() override;
+  void TearDown() override;
+
+  // Sends req from the proactor of the pool and returns the status and the body.
+  pair<unsigned, string> Send(ClientPool* pool, const ClientPool::Request& req) {
+    io::StringSink sink;
+    auto res = pool->Send("localhost", port_, req, &sink);
+    EXPECT_TRUE(res) << res.error();
+    return {res ? res->result_int() : 0, sink.str()};
+  }
+
+  unique_ptr<ProactorPool> pp_;
+  unique_ptr<AcceptServer> server_;
+  HttpListener<>* listener_ = nullptr;
+  uint16_t port_ = 0;
+  atomic_uint flaky_calls_{0};
+};
+
+void ClientPoolTest::SetUp() {
+  pp_.reset(fb2::Pool::IOUring(16, 2));
+  pp_->Run();
+  server_.reset(new AcceptServer{pp_.get()});
+
+  auto* listener = listener_ = new HttpListener<>;
+  listener->RegisterCb("/hello", [](const QueryArgs& args, HttpContext* cntx) {
+    auto resp = MakeStringResponse();
+    resp.body() = "hello";
+    for (const auto& [key, val] : args)
+      absl::StrAppend(&resp.body(), " ", key);
+    cntx->Invoke(std::move(resp));
+  });
+
+  listener->RegisterCb("/echo", [](const QueryArgs& args, HttpListenerBase::RequestType&& req,
+                                   HttpContext* cntx) {
+    auto resp = MakeStringResponse();
+    resp.body() = std::move(req.body());
+    cntx->Invoke(std::move(resp));
+  });
+
+  listener->RegisterCb("/sleep", [](const QueryArgs& args, HttpContext* cntx) {
+    unsigned ms = 0;
+    CHECK(absl::SimpleAtoi(args.front().second, &ms));
+    ThisFiber::SleepFor(chrono::milliseconds(ms));
+    cntx->Invoke(MakeStringResponse());
+  });
+
+  // The first call is slow, the following ones respond immediately.
+  listener->RegisterCb("/flaky", [this](const QueryArgs& args, HttpContext* cntx) {
+    if (flaky_calls_.fetch_add(1) == 0)
+      ThisFiber::SleepFor(500ms);
+    auto resp = MakeStringResponse();
+    resp.body() = "flaky";
+    cntx->Invoke(std::move(resp));
+  });
+
+  port_ = server_->AddListener(0, listener);
+  server_->Run();
+}
+
+void ClientPoolTest::TearDown() {
+  server_->Stop(true);
+  pp_->Stop();
+}
+
+TEST_F(ClientPoolTest, Reuse) {
+  pp_->at(0)->Await([&] {
+    ClientPool pool(pp_->at(0));
+    ClientPool::Request req;
+    req.target = "/hello";
+
+    for (unsigned i = 0; i < 3; ++i) {
+      auto [status, body] = Send(&pool, req);
+      EXPECT_EQ(200u, status);
+      EXPECT_EQ("hello", body);
+    }
+    EXPECT_EQ(1u, pool.GetStats().connects);
+    EXPECT_EQ(3u, pool.GetStats().requests);
+  });
+}
+
+TEST_F(ClientPoolTest, StreamedBody) {
+  string payload(100000, 'x');
+  for (size_t i = 0; i < payload.size(); i += 7)
+    payload[i] = 'a' + i % 26;
+
+  pp_->at(0)->Await([&] {
+    ClientPool pool(pp_->at(0));
+    ClientPool::Request req;
+    req.verb = h2::verb::post;
+    req.target = "/echo";
+
+    // Chunked.
+    io::BytesSource src(payload);
+    req.body = &src;
+    auto [status, body] = Send(&pool, req);
+    EXPECT_EQ(200u, status);
+    EXPECT_TRUE(body == payload);
+
+    // With Content-Length.
+    io::BytesSource src2(payload);
+    req.body = &src2;
+    req.body_size = payload.size();
+    tie(status, body) = Send(&pool, req);
+    EXPECT_EQ(200u, status);
+    EXPECT_TRUE(body == payload);
+  });
+}
+
+TEST_F(ClientPoolTest, Pipelining) {
+  pp_->at(0)->Await([&] {
+    ClientPool::Options opts;
+    opts.max_conns_per_host = 1;
+    opts.pipeline_depth = 4;
+    ClientPool pool(pp_->at(0), opts);
+
+    vector<fb2::Fiber> fibers;
+    vector<string> targets(8), bodies(8);
+    for (unsigned i = 0; i < 8; ++i) {
+      targets[i] = absl::StrCat("/hello?", i);
+      fibers.emplace_back("client", [&, i] {
+        ClientPool::Request req;
+        req.target = targets[i];
+        bodies[i] = Send(&pool, req).second;
+      });
+    }
+    for (auto& fb : fibers)
+      fb.Join();
+
+    for (unsigned i = 0; i < 8; ++i)
+      EXPECT_EQ(absl::StrCat("hello ", i), bodies[i]);
+    EXPECT_EQ(1u, pool.GetStats().connects);
+  });
+}
+
+TEST_F(ClientPoolTest, Deadline) {
+  pp_->at(0)->Await([&] {
+    ClientPool pool(pp_->at(0));
+    ClientPool::Request req;
+    req.target = "/sleep?ms=1000";
+    req.timeout = 50ms;
+
+    io::StringSink sink;
+    auto res = pool.Send("localhost", port_, req, &sink);
+    ASSERT_FALSE(res);
+
+    // The connection of the timed out request is replaced.
+    req.target = "/sleep?ms=0";
+    req.timeout = 1000ms;
+    EXPECT_EQ(200u, Send(&pool, req).first);
+    EXPECT_EQ(2u, pool.GetStats().connects);
+  });
+}
+
+TEST_F(ClientPoolTest, Hedging) {
+  pp_->at(0)->Await([&] {
+    ClientPool::Options opts;
+    opts.hedge_delay_ms = 20;
+    ClientPool pool(pp_->at(0), opts);
+
+    ClientPool::Request req;
+    req.target = "/flaky";
+    req.hedge = true;
+
+    uint64_t start = fb2::ProactorBase::GetMonotonicTimeNs();
+    auto [status, body] = Send(&pool, req);
+    uint64_t took_ms = (fb2::ProactorBase::GetMonotonicTimeNs() - start) / 1000000;
+
+    EXPECT_EQ(200u, status);
+    EXPECT_EQ("flaky", body);
+    EXPECT_LT(took_ms, 400u);
+
+    ClientPool::Stats stats = pool.GetStats();
+    EXPECT_EQ(1u, stats.hedged);
+    EXPECT_EQ(1u, stats.hedge_won);
+  });
+}
+
+// A keep-alive connection that keeps sending requests is not closed as idle.
+TEST_F(ClientPoolTest, IdleTimeout) {
+  AcceptServer server{pp_.get(), false};
+  auto* listener = new HttpListener<>;
+  listener->SetIdleTimeout(100ms);
+  listener->RegisterCb("/hello", [](const QueryArgs& args, HttpContext* cntx) {
+    cntx->Invoke(MakeStringResponse());
+  });
+  uint16_t port = server.AddListener(0, listener);
+  server.Run();
+
+  pp_->at(0)->Await([&] {
+    ClientPool pool(pp_->at(0));
+    ClientPool::Request req;
+    req.target = "/hello";
+    for (unsigned i = 0; i < 15; ++i) {
+      io::StringSink sink;
+      auto res = pool.Send("localhost", port, req, &sink);
+      ASSERT_TRUE(res) << res.error();
+      ThisFiber::SleepFor(20ms);
+    }
+    EXPECT_EQ(1u, pool.GetStats().connects);
+  });
+
+  EXPECT_EQ(0u, listener->GetIdleStats().closed);
+  server.Stop(true);
+}
+
+// The HTTP connections leave the parked proactors when they handle their next request.
+TEST_F(ClientPoolTest, ParkProactors) {
+  constexpr unsigned kNumPools = 4;
+  auto count_parked = [&] {
+    atomic_uint parked{0};
+    listener_->TraverseConnections([&](unsigned index, Connection*) {
+      if (!pp_->IsActive(index))
+        ++parked;
+    });
+    return parked.load();
+  };
+
+  vector<unique_ptr<ClientPool>> pools;
+  ClientPool::Request req;
+  req.target = "/hello";
+  auto send_all = [&] {
+    for (auto& pool : pools)
+      EXPECT_EQ(200u, Send(pool.get(), req).first);
+  };
+
+  pp_->at(0)->Await([&] {
+    for (unsigned i = 0; i < kNumPools; ++i)
+      pools.emplace_back(new ClientPool(pp_->at(0)));
+    send_all();
+  });
+
+  server_->SetActiveProactors(1);
+  EXPECT_GT(count_parked(), 0u);
+  pp_->at(0)->Await(send_all);
+  EXPECT_EQ(0u, count_parked());
+
+  pp_->at(0)->Await([&] {
+    for (auto& pool : pools)
+      EXPECT_EQ(1u, pool->GetStats().connects);
+    pools.clear();
+  });
+  server_->SetActiveProactors(2);
+}
+
+}  // namespace util::http
@@ -4,10 +4,19 @@
 
 #include "util/http/encoding.h"
 
+#include <absl/strings/ascii.h>
+#include <absl/strings/match.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_split.h>
+#include <zlib.h>
+
 #include <algorithm>
 #include <array>
 #include <cctype>
 
+#include "base/logging.h"
+#include "io/compress.h"
+
 namespace {
 
 inline bool IsValidUrlChar(char ch) {
@@ -19,6 +28,93 @@ inline bool IsValidUrlChar(char ch) {
 
 namespace util::http {
 
+using namespace std;
+
+namespace {
+
+// Metrics and status pages are text, fast levels already compress them by 5-10x.
+constexpr int kZstdLevel = 3;
+constexpr int kGzipLevel = 6;
+
+class ZstdEncoder final : public BodyEncoder {
+ public:
+  explicit ZstdEncoder(io::Sink* upstream) : sink_(upstream, MakeOptions()) {
+  }
+
+  error_code Write(io::Bytes data) final {
+    return sink_.Write(data);
+  }
+
+  error_code Finish() final {
+    return sink_.Flush();
+  }
+
+ private:
+  static io::CompressOptions MakeOptions() {
+    io::CompressOptions opts;
+    opts.codec = io::Codec::ZSTD;
+    opts.level = kZstdLevel;
+    opts.block_size = 1 << 16;
+    return opts;
+  }
+
+  io::CompressingSink sink_;
+};
+
+class GzipEncoder final : public BodyEncoder {
+ public:
+  explicit GzipEncoder(io::Sink* upstream);
+  ~GzipEncoder() {
+    deflateEnd(&zs_);
+  }
+
+  error_code Write(io::Bytes data) final {
+    return Deflate(data, Z_NO_FLUSH);
+  }
+
+  error_code Finish() final {
+    return Deflate({}, Z_FINISH);
+  }
+
+ private:
+  error_code Deflate(io::Bytes data, int flush);
+
+  io::Sink* upstream_;
+  z_stream zs_;
+  uint8_t out_[1 << 14];
+};
+
+GzipEncoder::GzipEncoder(io::Sink* upstream) : upstream_(upstream) {
+  zs_ = z_stream{};
+
+  // 16 + MAX_WBITS selects the gzip wrapper.
+  int res = deflateInit2(&zs_, kGzipLevel, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+  CHECK_EQ(Z_OK, res);
+}
+
+error_code GzipEncoder::Deflate(io::Bytes data, int flush) {
+  zs_.next_in = const_cast<uint8_t*>(data.data());
+  zs_.avail_in = data.size();
+
+  do {
+    zs_.next_out = out_;
+    zs_.avail_out = sizeof(out_);
+    int res = deflate(&zs_, flush);
+    if (res == Z_STREAM_ERROR)
+      return make_error_code(errc::invalid_argument);
+
+    size_t len = sizeof(out_) - zs_.avail_out;
+    if (len > 0) {
+      if (error_code ec = upstream_->Write(io::Bytes{out_, len}); ec)
+        return ec;
+    }
+  } while (zs_.avail_out == 0);
+
+  return {};
+}
+
+}  // namespace
+
 std::string UrlEncode(std::string_view src) {
   static const char digits[] = "0123456789ABCDEF";
 
@@ -38,4 +134,74 @@ std::string UrlEncode(std::string_view src) {
   return out;
 }
 
+ContentEncoding NegotiateEncoding(std::string_view accept_encoding) {
+  double gzip_q = -1, zstd_q = -1, any_q = 0;
+
+  for (string_view item : absl::StrSplit(accept_encoding, ',', absl::SkipWhitespace())) {
+    vector<string_view> params = absl::StrSplit(item, ';');
+    string_view name = absl::StripAsciiWhitespace(params[0]);
+    double q = 1;
+    for (size_t i = 1; i < params.size(); ++i) {
+      string_view param = absl::StripAsciiWhitespace(params[i]);
+      if (absl::StartsWithIgnoreCase(param, "q=") && !absl::SimpleAtod(param.substr(2), &q))
+        q = 0;
+    }
+
+    if (absl::EqualsIgnoreCase(name, "zstd")) {
+      zstd_q = q;
+    } else if (absl::EqualsIgnoreCase(name, "gzip") || absl::EqualsIgnoreCase(name, "x-gzip")) {
+      gzip_q = q;
+    } else if (name == "*") {
+      any_q = q;
+    }
+  }
+
+  // "*" covers the encodings that are not listed explicitly.
+  if (zstd_q < 0)
+    zstd_q = any_q;
+  if (gzip_q < 0)
+    gzip_q = any_q;
+
+  if (zstd_q > 0 && zstd_q >= gzip_q)
+    return ContentEncoding::kZstd;
+  if (gzip_q > 0)
+    return ContentEncoding::kGzip;
+  return ContentEncoding::kIdentity;
+}
+
+std::string_view EncodingName(ContentEncoding enc) {
+  switch (enc) {
+    case ContentEncoding::kGzip:
+      return "gzip";
+    case ContentEncoding::kZstd:
+      return "zstd";
+    case ContentEncoding::kIdentity:
+      break;
+  }
+  return "identity";
+}
+
+unique_ptr<BodyEncoder> BodyEncoder::Create(ContentEncoding enc, io::Sink* upstream) {
+  switch (enc) {
+    case ContentEncoding::kGzip:
+      return make_unique<GzipEncoder>(upstream);
+    case ContentEncoding::kZstd:
+      return make_unique<ZstdEncoder>(upstream);
+    case ContentEncoding::kIdentity:
+      break;
+  }
+  LOG(DFATAL) << "Unsupported encoding " << int(enc);
+  return nullptr;
+}
+
+std::string EncodeBody(ContentEncoding enc, std::string_view body) {
+  io::StringSink sink;
+  unique_ptr<BodyEncoder> encoder = BodyEncoder::Create(enc, &sink);
+  error_code ec = encoder->Write(io::Buffer(body));
+  if (!ec)
+    ec = encoder->Finish();
+  DCHECK(!ec) << ec;  // the string sink does not fail.
+  return std::move(sink).str();
+}
+
 }  // namespace util::http
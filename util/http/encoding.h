@@ -4,11 +4,41 @@
 
 #pragma once
 
+#include <memory>
 #include <string>
+#include <string_view>
+
+#include "io/io.h"
 
 namespace util::http {
 
 // Replace all invalid characters with percent encoding.
 std::string UrlEncode(std::string_view part);
 
+enum class ContentEncoding : uint8_t { kIdentity, kGzip, kZstd };
+
+// Returns the encoding with the highest q-value in the Accept-Encoding header value,
+// preferring zstd over gzip on ties, or kIdentity if neither is accepted.
+ContentEncoding NegotiateEncoding(std::string_view accept_encoding);
+
+// The name for the Content-Encoding header.
+std::string_view EncodingName(ContentEncoding enc);
+
+// Streaming compressor of response bodies that writes into upstream.
+class BodyEncoder {
+ public:
+  virtual ~BodyEncoder() = default;
+
+  virtual std::error_code Write(io::Bytes data) = 0;
+
+  // Ends the compressed stream. Must be called once after the last Write.
+  virtual std::error_code Finish() = 0;
+
+  // enc must not be kIdentity.
+  static std::unique_ptr<BodyEncoder> Create(ContentEncoding enc, io::Sink* upstream);
+};
+
+// Compresses body in one go.
+std::string EncodeBody(ContentEncoding enc, std::string_view body);
+
 }  // namespace util::http
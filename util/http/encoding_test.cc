@@ -0,0 +1,91 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/http/encoding.h"
+
+#include <absl/strings/str_cat.h>
+#include <zlib.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "io/compress.h"
+
+namespace util::http {
+
+using namespace std;
+
+class EncodingTest : public testing::Test {
+ protected:
+  static string Gunzip(string_view src) {
+    z_stream zs{};
+    CHECK_EQ(Z_OK, inflateInit2(&zs, 16 + MAX_WBITS));
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(src.data()));
+    zs.avail_in = src.size();
+
+    string res;
+    char buf[4096];
+    int rc;
+    do {
+      zs.next_out = reinterpret_cast<Bytef*>(buf);
+      zs.avail_out = sizeof(buf);
+      rc = inflate(&zs, Z_NO_FLUSH);
+      res.append(buf, sizeof(buf) - zs.avail_out);
+    } while (rc == Z_OK);
+    EXPECT_EQ(Z_STREAM_END, rc);
+    inflateEnd(&zs);
+    return res;
+  }
+
+  static string Unzstd(string_view src) {
+    io::BytesSource source(src);
+    io::DecompressingSource dsrc(&source, io::DecompressOptions{});
+    string res(1 << 20, '\0');
+    auto n = dsrc.Read(io::MutableBytes{reinterpret_cast<uint8_t*>(res.data()), res.size()});
+    EXPECT_TRUE(n);
+    res.resize(n.value_or(0));
+    return res;
+  }
+};
+
+TEST_F(EncodingTest, Negotiate) {
+  EXPECT_EQ(ContentEncoding::kIdentity, NegotiateEncoding(""));
+  EXPECT_EQ(ContentEncoding::kIdentity, NegotiateEncoding("br, deflate"));
+  EXPECT_EQ(ContentEncoding::kGzip, NegotiateEncoding("gzip"));
+  EXPECT_EQ(ContentEncoding::kGzip, NegotiateEncoding("deflate, gzip"));
+  EXPECT_EQ(ContentEncoding::kZstd, NegotiateEncoding("gzip, deflate, br, zstd"));
+  EXPECT_EQ(ContentEncoding::kGzip, NegotiateEncoding("zstd;q=0.5, gzip;q=0.8"));
+  EXPECT_EQ(ContentEncoding::kGzip, NegotiateEncoding("zstd;q=0, GZIP"));
+  EXPECT_EQ(ContentEncoding::kZstd, NegotiateEncoding("*"));
+  EXPECT_EQ(ContentEncoding::kGzip, NegotiateEncoding("zstd;q=0, *;q=0.1"));
+  EXPECT_EQ(ContentEncoding::kIdentity, NegotiateEncoding("*;q=0, identity"));
+}
+
+TEST_F(EncodingTest, EncodeBody) {
+  string body;
+  for (unsigned i = 0; i < 2000; ++i)
+    absl::StrAppend(&body, "metric_total{label=\"", i % 10, "\"} ", i, "\n");
+
+  string gz = EncodeBody(ContentEncoding::kGzip, body);
+  EXPECT_LT(gz.size(), body.size() / 3);
+  EXPECT_EQ(body, Gunzip(gz));
+
+  string zs = EncodeBody(ContentEncoding::kZstd, body);
+  EXPECT_LT(zs.size(), body.size() / 3);
+  EXPECT_EQ(body, Unzstd(zs));
+}
+
+TEST_F(EncodingTest, Streaming) {
+  io::StringSink sink;
+  auto encoder = BodyEncoder::Create(ContentEncoding::kGzip, &sink);
+  string expected;
+  for (unsigned i = 0; i < 100; ++i) {
+    string piece = absl::StrCat("line ", i, "\n");
+    expected += piece;
+    ASSERT_FALSE(encoder->Write(io::Buffer(piece)));
+  }
+  ASSERT_FALSE(encoder->Finish());
+  EXPECT_EQ(expected, Gunzip(sink.str()));
+}
+
+}  // namespace util::http
@@ -0,0 +1,95 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+// Replaces mimalloc-new-delete.h: overrides the global new and delete operators with mimalloc
+// and reports the allocations to base::HeapSampler, which /heapz serves.
+// Include it in exactly one translation unit of the binary.
+
+#include <mimalloc.h>
+
+#include <new>
+
+#include "base/heap_sampler.h"
+
+namespace util {
+namespace http {
+namespace detail {
+
+inline void* SampledNew(void* ptr, std::size_t n) {
+  base::HeapSampler::OnAlloc(ptr, n);
+  return ptr;
+}
+
+inline void SampledFree(void* ptr) {
+  base::HeapSampler::OnFree(ptr);
+  mi_free(ptr);
+}
+
+}  // namespace detail
+}  // namespace http
+}  // namespace util
+
+void operator delete(void* p) noexcept {
+  util::http::detail::SampledFree(p);
+}
+void operator delete[](void* p) noexcept {
+  util::http::detail::SampledFree(p);
+}
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+  util::http::detail::SampledFree(p);
+}
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+  util::http::detail::SampledFree(p);
+}
+void operator delete(void* p, std::size_t) noexcept {
+  util::http::detail::SampledFree(p);
+}
+void operator delete[](void* p, std::size_t) noexcept {
+  util::http::detail::SampledFree(p);
+}
+void operator delete(void* p, std::align_val_t) noexcept {
+  util::http::detail::SampledFree(p);
+}
+void operator delete[](void* p, std::align_val_t) noexcept {
+  util::http::detail::SampledFree(p);
+}
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept {
+  util::http::detail::SampledFree(p);
+}
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept {
+  util::http::detail::SampledFree(p);
+}
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept {
+  util::http::detail::SampledFree(p);
+}
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept {
+  util::http::detail::SampledFree(p);
+}
+
+void* operator new(std::size_t n) noexcept(false) {
+  return util::http::detail::SampledNew(mi_new(n), n);
+}
+void* operator new[](std::size_t n) noexcept(false) {
+  return util::http::detail::SampledNew(mi_new(n), n);
+}
+void* operator new(std::size_t n, const std::nothrow_t&) noexcept {
+  return util::http::detail::SampledNew(mi_new_nothrow(n), n);
+}
+void* operator new[](std::size_t n, const std::nothrow_t&) noexcept {
+  return util::http::detail::SampledNew(mi_new_nothrow(n), n);
+}
+void* operator new(std::size_t n, std::align_val_t al) noexcept(false) {
+  return util::http::detail::SampledNew(mi_new_aligned(n, static_cast<size_t>(al)), n);
+}
+void* operator new[](std::size_t n, std::align_val_t al) noexcept(false) {
+  return util::http::detail::SampledNew(mi_new_aligned(n, static_cast<size_t>(al)), n);
+}
+void* operator new(std::size_t n, std::align_val_t al, const std::nothrow_t&) noexcept {
+  return util::http::detail::SampledNew(mi_new_aligned_nothrow(n, static_cast<size_t>(al)), n);
+}
+void* operator new[](std::size_t n, std::align_val_t al, const std::nothrow_t&) noexcept {
+  return util::http::detail::SampledNew(mi_new_aligned_nothrow(n, static_cast<size_t>(al)), n);
+}
@@ -0,0 +1,170 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/http/heapz_handler.h"
+
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_format.h>
+#include <mimalloc.h>
+
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#include "base/heap_sampler.h"
+#include "base/logging.h"
+#include "util/http/http_common.h"
+#include "util/http/http_handler.h"
+#include "util/proactor_pool.h"
+
+namespace util {
+namespace http {
+
+using namespace std;
+using base::HeapSampler;
+
+namespace {
+
+struct ThreadHeap {
+  size_t used = 0, committed = 0, reserved = 0, blocks = 0;
+  string stats;
+};
+
+struct HeapzState {
+  mutex mu;
+  optional<HeapSampler::Profile> snapshot;
+};
+
+bool VisitArea(const mi_heap_t*, const mi_heap_area_t* area, void*, size_t, void* arg) {
+  ThreadHeap* heap = static_cast<ThreadHeap*>(arg);
+  heap->used += area->used * area->block_size;
+  heap->committed += area->committed;
+  heap->reserved += area->reserved;
+  heap->blocks += area->used;
+  return true;
+}
+
+void AppendOutput(const char* msg, void* arg) {
+  static_cast<string*>(arg)->append(msg);
+}
+
+string HeapReport(ProactorPool* pool, bool verbose) {
+  vector<ThreadHeap> heaps(pool->size());
+
+  // mimalloc heaps are thread local, hence each proactor visits its own heap.
+  pool->AwaitFiberOnAll([&](unsigned index, ProactorBase*) {
+    ThreadHeap& heap = heaps[index];
+    mi_heap_visit_blocks(mi_heap_get_default(), false, VisitArea, &heap);
+    if (verbose)
+      mi_thread_stats_print_out(AppendOutput, &heap.stats);
+  });
+
+  size_t elapsed_ms, user_ms, system_ms, rss, peak_rss, commit, peak_commit, page_faults;
+  mi_process_info(&elapsed_ms, &user_ms, &system_ms, &rss, &peak_rss, &commit, &peak_commit,
+                  &page_faults);
+
+  string res;
+  absl::StrAppendFormat(&res, "mimalloc %d\n", mi_version());
+  absl::StrAppendFormat(&res, "rss: %zu peak_rss: %zu commit: %zu peak_commit: %zu\n", rss,
+                        peak_rss, commit, peak_commit);
+  absl::StrAppendFormat(&res, "user_ms: %zu system_ms: %zu page_faults: %zu\n\n", user_ms,
+                        system_ms, page_faults);
+
+  HeapSampler::Stats stats = HeapSampler::GetStats();
+  absl::StrAppendFormat(&res, "sampling_rate: %zu sampled: %u live: %u dropped: %u\n\n",
+                        HeapSampler::sampling_rate(), stats.sampled, stats.live, stats.dropped);
+
+  absl::StrAppendFormat(&res, "%-8s %14s %14s %14s %12s\n", "thread", "used", "committed",
+                        "reserved", "blocks");
+  ThreadHeap total;
+  for (size_t i = 0; i < heaps.size(); ++i) {
+    const ThreadHeap& heap = heaps[i];
+    absl::StrAppendFormat(&res, "%-8d %14zu %14zu %14zu %12zu\n", i, heap.used, heap.committed,
+                          heap.reserved, heap.blocks);
+    total.used += heap.used;
+    total.committed += heap.committed;
+    total.reserved += heap.reserved;
+    total.blocks += heap.blocks;
+  }
+  absl::StrAppendFormat(&res, "%-8s %14zu %14zu %14zu %12zu\n", "total", total.used,
+                        total.committed, total.reserved, total.blocks);
+
+  if (verbose) {
+    for (size_t i = 0; i < heaps.size(); ++i)
+      absl::StrAppend(&res, "\nthread ", i, ":\n", heaps[i].stats);
+    res.append("\nprocess:\n");
+    mi_stats_print_out(AppendOutput, &res);
+  }
+  return res;
+}
+
+void HeapzHandler(const QueryArgs& args, ProactorPool* pool, HeapzState* state,
+                  HttpContext* send) {
+  bool profile = false, save = false, diff = false, verbose = false;
+  for (const auto& k_v : args) {
+    bool enabled = k_v.second == "1" || k_v.second == "true";
+    if (k_v.first == "rate") {
+      size_t rate;
+      if (absl::SimpleAtoi(k_v.second, &rate)) {
+        LOG(INFO) << "Setting heap sampling rate to " << rate;
+        HeapSampler::SetSamplingRate(rate);
+      }
+    } else if (k_v.first == "profile") {
+      profile = enabled;
+    } else if (k_v.first == "save") {
+      save = enabled;
+    } else if (k_v.first == "diff") {
+      diff = enabled;
+    } else if (k_v.first == "verbose") {
+      verbose = enabled;
+    }
+  }
+
+  StringResponse res = MakeStringResponse();
+  SetMime(kTextMime, &res);
+
+  if (!profile && !save && !diff) {
+    res.body() = HeapReport(pool, verbose);
+    return send->Invoke(std::move(res));
+  }
+
+  HeapSampler::Profile current = HeapSampler::GetProfile();
+  if (diff) {
+    optional<HeapSampler::Profile> snapshot;
+    {
+      lock_guard lk(state->mu);
+      snapshot = state->snapshot;
+    }
+    if (snapshot) {
+      res.body() = HeapSampler::FoldedDiff(*snapshot, current);
+    } else {
+      res.result(::boost::beast::http::status::bad_request);
+      res.body() = "No snapshot, use /heapz?save=1 to take one\n";
+    }
+  } else if (profile) {
+    res.body() = HeapSampler::FoldedStacks(current);
+  } else {
+    res.body() = absl::StrCat("Saved a snapshot of ", current.size(), " stacks\n");
+  }
+
+  if (save) {
+    lock_guard lk(state->mu);
+    state->snapshot = std::move(current);
+  }
+  return send->Invoke(std::move(res));
+}
+
+}  // namespace
+
+void RegisterHeapzHandler(ProactorPool* pool, HttpListenerBase* listener) {
+  auto state = make_shared<HeapzState>();
+  listener->RegisterCb("/heapz", [pool, state](const QueryArgs& args, HttpContext* send) {
+    HeapzHandler(args, pool, state.get(), send);
+  });
+}
+
+}  // namespace http
+}  // namespace util
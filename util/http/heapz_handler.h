@@ -0,0 +1,25 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+namespace util {
+
+class HttpListenerBase;
+class ProactorPool;
+
+namespace http {
+
+// Registers /heapz on listener, which reports the mimalloc heap of each proactor thread of
+// pool and the process.
+// The live allocation stacks sampled by base::HeapSampler are served as folded stacks with
+// "?profile=1", "?save=1" keeps the current profile as a snapshot and "?diff=1" serves the
+// bytes per stack of the snapshot versus the current profile.
+// "?rate=N" sets the sampling rate in bytes, 0 disables sampling.
+// The allocations are reported to the sampler by the operators of heap_sampling_new_delete.h.
+// Lives in http_heapz_lib, so that http_server_lib does not depend on mimalloc.
+void RegisterHeapzHandler(ProactorPool* pool, HttpListenerBase* listener);
+
+}  // namespace http
+}  // namespace util
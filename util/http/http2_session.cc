@@ -0,0 +1,402 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/http/http2_session.h"
+
+#include <absl/strings/ascii.h>
+#include <absl/strings/str_cat.h>
+#include <nghttp2/nghttp2.h>
+
+#include <cstring>
+
+#include "base/logging.h"
+#include "util/fiber_socket_base.h"
+#include "util/http/http_handler.h"
+
+namespace util {
+namespace http {
+
+using namespace std;
+namespace h2 = ::boost::beast::http;
+
+namespace {
+
+constexpr size_t kReadBufSize = 1 << 14;
+constexpr size_t kMaxWriteBatch = 1 << 16;
+
+// Header fields that must not appear in HTTP/2 messages, RFC 9113 section 8.2.2.
+bool IsConnectionSpecific(h2::field f) {
+  switch (f) {
+    case h2::field::connection:
+    case h2::field::keep_alive:
+    case h2::field::proxy_connection:
+    case h2::field::transfer_encoding:
+    case h2::field::upgrade:
+      return true;
+    default:
+      return false;
+  }
+}
+
+inline string_view AsView(const uint8_t* data, size_t len) {
+  return string_view(reinterpret_cast<const char*>(data), len);
+}
+
+inline ::boost::beast::string_view ToBeast(string_view s) {
+  return ::boost::beast::string_view(s.data(), s.size());
+}
+
+inline nghttp2_nv MakeNv(string_view name, string_view value) {
+  return nghttp2_nv{reinterpret_cast<uint8_t*>(const_cast<char*>(name.data())),
+                    reinterpret_cast<uint8_t*>(const_cast<char*>(value.data())), name.size(),
+                    value.size(), NGHTTP2_NV_FLAG_NONE};
+}
+
+error_code Nghttp2Error(int rv) {
+  LOG(WARNING) << "nghttp2 error: " << nghttp2_strerror(rv);
+  return make_error_code(errc::protocol_error);
+}
+
+}  // namespace
+
+// nghttp2 callbacks. They run inside nghttp2_session_mem_recv and nghttp2_session_mem_send.
+struct Http2Session::Callbacks {
+  static Http2Stream* GetStream(nghttp2_session* session, int32_t id) {
+    return static_cast<Http2Stream*>(nghttp2_session_get_stream_user_data(session, id));
+  }
+
+  static int OnBeginHeaders(nghttp2_session* session, const nghttp2_frame* frame, void* ud) {
+    if (frame->hd.type != NGHTTP2_HEADERS || frame->headers.cat != NGHTTP2_HCAT_REQUEST)
+      return 0;
+
+    Http2Session* me = static_cast<Http2Session*>(ud);
+    int32_t id = frame->hd.stream_id;
+    Http2Stream* stream = new Http2Stream(me, id);
+    me->streams_[id].reset(stream);
+    nghttp2_session_set_stream_user_data(session, id, stream);
+    return 0;
+  }
+
+  static int OnHeader(nghttp2_session* session, const nghttp2_frame* frame, const uint8_t* name,
+                      size_t namelen, const uint8_t* value, size_t valuelen, uint8_t flags,
+                      void* ud) {
+    Http2Stream* stream = GetStream(session, frame->hd.stream_id);
+    if (!stream || frame->hd.type != NGHTTP2_HEADERS)
+      return 0;
+
+    // nghttp2 validates the pseudo headers and lower-cases the names.
+    string_view key = AsView(name, namelen), val = AsView(value, valuelen);
+    RequestType& req = stream->request_;
+    if (key == ":method") {
+      req.method_string(ToBeast(val));
+    } else if (key == ":path") {
+      req.target(ToBeast(val));
+    } else if (key == ":authority") {
+      req.set(h2::field::host, ToBeast(val));
+    } else if (key[0] != ':') {
+      req.insert(ToBeast(key), ToBeast(val));
+    }
+    return 0;
+  }
+
+  static int OnDataChunk(nghttp2_session* session, uint8_t flags, int32_t id, const uint8_t* data,
+                         size_t len, void* ud) {
+    Http2Session* me = static_cast<Http2Session*>(ud);
+    Http2Stream* stream = GetStream(session, id);
+    if (!stream)
+      return 0;
+
+    string& body = stream->request_.body();
+    if (stream->closed_)
+      return 0;
+    if (body.size() + len > me->opts_.max_body_size) {
+      // The handler is not started for the stream.
+      stream->closed_ = true;
+      nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, id, NGHTTP2_REFUSED_STREAM);
+      return 0;
+    }
+    body.append(AsView(data, len));
+    return 0;
+  }
+
+  static int OnFrameRecv(nghttp2_session* session, const nghttp2_frame* frame, void* ud) {
+    if ((frame->hd.flags & NGHTTP2_FLAG_END_STREAM) == 0)
+      return 0;
+    if (frame->hd.type != NGHTTP2_HEADERS && frame->hd.type != NGHTTP2_DATA)
+      return 0;
+
+    Http2Stream* stream = GetStream(session, frame->hd.stream_id);
+    if (stream && !stream->running_ && !stream->closed_)
+      static_cast<Http2Session*>(ud)->StartHandler(stream);
+    return 0;
+  }
+
+  static int OnStreamClose(nghttp2_session* session, int32_t id, uint32_t error_code, void* ud) {
+    Http2Session* me = static_cast<Http2Session*>(ud);
+    auto it = me->streams_.find(id);
+    if (it == me->streams_.end())
+      return 0;
+
+    Http2Stream* stream = it->second.get();
+    stream->closed_ = true;
+    stream->space_ec_.notifyAll();
+
+    // Otherwise the handler erases the stream once it returns.
+    if (!stream->running_)
+      me->streams_.erase(it);
+    return 0;
+  }
+
+  static ssize_t ReadBody(nghttp2_session* session, int32_t id, uint8_t* buf, size_t length,
+                          uint32_t* data_flags, nghttp2_data_source* source, void* ud) {
+    Http2Stream* stream = static_cast<Http2Stream*>(source->ptr);
+    size_t avail = stream->pending();
+    size_t n = std::min(avail, length);
+    memcpy(buf, stream->pending_.data() + stream->pending_pos_, n);
+    stream->pending_pos_ += n;
+    if (stream->pending() == 0) {
+      stream->pending_.clear();
+      stream->pending_pos_ = 0;
+    }
+
+    if (n == avail && stream->ended_) {
+      *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+    } else if (n == 0) {
+      return NGHTTP2_ERR_DEFERRED;  // resumed by Write or End.
+    }
+
+    stream->space_ec_.notify();
+    return n;
+  }
+};
+
+error_code Http2Stream::Begin(unsigned status, const Fields& fields) {
+  DCHECK(!begun_);
+  if (closed_)
+    return make_error_code(errc::connection_reset);
+
+  string status_str = absl::StrCat(status);
+  vector<string> names;
+  vector<nghttp2_nv> nva;
+
+  // nva references names.
+  names.reserve(distance(fields.begin(), fields.end()));
+  nva.push_back(MakeNv(":status", status_str));
+
+  for (const auto& f : fields) {
+    if (IsConnectionSpecific(f.name()))
+      continue;
+
+    // HTTP/2 field names are lower-case.
+    names.push_back(absl::AsciiStrToLower(string_view(f.name_string().data(),
+                                                      f.name_string().size())));
+    nva.push_back(MakeNv(names.back(), string_view(f.value().data(), f.value().size())));
+  }
+
+  nghttp2_data_provider prd;
+  prd.source.ptr = this;
+  prd.read_callback = Http2Session::Callbacks::ReadBody;
+
+  // nghttp2 copies the header fields.
+  int rv = nghttp2_submit_response(session_->session_, id_, nva.data(), nva.size(), &prd);
+  if (rv != 0)
+    return Nghttp2Error(rv);
+
+  begun_ = true;
+  session_->ScheduleWrite();
+  return {};
+}
+
+error_code Http2Stream::Write(const iovec* v, uint32_t len) {
+  DCHECK(begun_ && !ended_);
+  if (closed_)
+    return make_error_code(errc::connection_reset);
+
+  for (uint32_t i = 0; i < len; ++i)
+    pending_.append(static_cast<const char*>(v[i].iov_base), v[i].iov_len);
+
+  nghttp2_session_resume_data(session_->session_, id_);
+  session_->ScheduleWrite();
+
+  size_t limit = session_->opts_.stream_buffer;
+  space_ec_.await([&] { return closed_ || pending() <= limit; });
+  return closed_ ? make_error_code(errc::connection_reset) : error_code{};
+}
+
+error_code Http2Stream::End() {
+  DCHECK(begun_ && !ended_);
+  if (closed_)
+    return make_error_code(errc::connection_reset);
+
+  ended_ = true;
+  nghttp2_session_resume_data(session_->session_, id_);
+  session_->ScheduleWrite();
+  return {};
+}
+
+Http2Session::Http2Session(FiberSocketBase* socket, Handler handler, const Options& opts)
+    : socket_(socket), handler_(std::move(handler)), opts_(opts) {
+  nghttp2_session_callbacks* cbs;
+  CHECK_EQ(0, nghttp2_session_callbacks_new(&cbs));
+  nghttp2_session_callbacks_set_on_begin_headers_callback(cbs, Callbacks::OnBeginHeaders);
+  nghttp2_session_callbacks_set_on_header_callback(cbs, Callbacks::OnHeader);
+  nghttp2_session_callbacks_set_on_data_chunk_recv_callback(cbs, Callbacks::OnDataChunk);
+  nghttp2_session_callbacks_set_on_frame_recv_callback(cbs, Callbacks::OnFrameRecv);
+  nghttp2_session_callbacks_set_on_stream_close_callback(cbs, Callbacks::OnStreamClose);
+
+  CHECK_EQ(0, nghttp2_session_server_new(&session_, cbs, this));
+  nghttp2_session_callbacks_del(cbs);
+}
+
+Http2Session::~Http2Session() {
+  DCHECK_EQ(0u, running_handlers_);
+  streams_.clear();
+  nghttp2_session_del(session_);
+}
+
+error_code Http2Session::Run(io::Bytes preread, void* user_data) {
+  user_data_ = user_data;
+
+  nghttp2_settings_entry iv[] = {
+      {NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, opts_.max_concurrent_streams},
+      {NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE, opts_.window_size},
+  };
+  int rv = nghttp2_submit_settings(session_, NGHTTP2_FLAG_NONE, iv, ABSL_ARRAYSIZE(iv));
+  if (rv == 0)
+    rv = nghttp2_session_set_local_window_size(session_, NGHTTP2_FLAG_NONE, 0, opts_.window_size);
+  if (rv != 0)
+    return Nghttp2Error(rv);
+
+  write_pending_ = true;
+  writer_ = fb2::Fiber("h2_writer", [this] { WriteLoop(); });
+
+  error_code ec = Receive(preread);
+  unique_ptr<uint8_t[]> buf(new uint8_t[kReadBufSize]);
+  while (!ec && !closing_ &&
+         (nghttp2_session_want_read(session_) || nghttp2_session_want_write(session_))) {
+    io::Result<size_t> res = socket_->Recv(io::MutableBytes{buf.get(), kReadBufSize});
+    if (!res) {
+      ec = res.error();
+      break;
+    }
+    if (*res == 0)
+      break;
+    ec = Receive(io::Bytes{buf.get(), *res});
+  }
+
+  // If the writer stopped the connection, the read error is caused by the cancellation.
+  if (closing_)
+    ec = ec_;
+
+  // Wake up the writer and the handlers that wait for the peer, and wait for them.
+  closing_ = true;
+  write_ec_.notify();
+  for (auto& [id, stream] : streams_) {
+    stream->closed_ = true;
+    stream->space_ec_.notifyAll();
+  }
+  writer_.JoinIfNeeded();
+  handler_ec_.await([this] { return running_handlers_ == 0; });
+
+  return ec;
+}
+
+error_code Http2Session::Receive(io::Bytes data) {
+  if (data.empty())
+    return {};
+
+  ssize_t rv = nghttp2_session_mem_recv(session_, data.data(), data.size());
+  if (rv < 0)
+    return Nghttp2Error(rv);
+
+  // Receiving produces the acks and the window updates.
+  ScheduleWrite();
+  return {};
+}
+
+void Http2Session::ScheduleWrite() {
+  write_pending_ = true;
+  write_ec_.notify();
+}
+
+void Http2Session::WriteLoop() {
+  string out;
+  while (true) {
+    write_ec_.await([this] { return closing_ || write_pending_; });
+    if (closing_)
+      break;
+
+    // Handlers and the reader may queue more frames while the batch is being written,
+    // which schedules the next batch.
+    write_pending_ = false;
+    while (out.size() < kMaxWriteBatch) {
+      const uint8_t* data;
+      ssize_t n = nghttp2_session_mem_send(session_, &data);
+      if (n < 0) {
+        ec_ = Nghttp2Error(n);
+        break;
+      }
+      if (n == 0)
+        break;
+      out.append(AsView(data, n));
+    }
+
+    if (!ec_ && out.size() >= kMaxWriteBatch)
+      write_pending_ = true;
+
+    if (!ec_ && !out.empty())
+      ec_ = socket_->Write(io::Buffer(out));
+    out.clear();
+
+    if (ec_) {
+      // Unblocks the reader.
+      closing_ = true;
+      socket_->CancelPendingIo();
+      break;
+    }
+
+    // nghttp2 asks to close the connection, e.g. after sending GOAWAY.
+    if (!nghttp2_session_want_read(session_) && !nghttp2_session_want_write(session_)) {
+      socket_->CancelPendingIo();
+      break;
+    }
+  }
+}
+
+void Http2Session::StartHandler(Http2Stream* stream) {
+  stream->running_ = true;
+  ++running_handlers_;
+  fb2::Fiber("h2_stream", [this, stream] { RunHandler(stream); }).Detach();
+}
+
+void Http2Session::RunHandler(Http2Stream* stream) {
+  RequestType req = std::move(stream->request_);
+  req.version(20);
+
+  {
+    HttpContext cntx(stream);
+    cntx.set_user_data(user_data_);
+    handler_(std::move(req), &cntx);
+  }
+
+  if (!stream->closed_) {
+    if (!stream->begun_) {
+      // The handler did not respond.
+      nghttp2_submit_rst_stream(session_, NGHTTP2_FLAG_NONE, stream->id_, NGHTTP2_INTERNAL_ERROR);
+      ScheduleWrite();
+    } else if (!stream->ended_) {
+      stream->End();
+    }
+  }
+
+  stream->running_ = false;
+  if (stream->closed_ && !closing_)
+    streams_.erase(stream->id_);
+
+  --running_handlers_;
+  handler_ec_.notify();
+}
+
+}  // namespace http
+}  // namespace util
@@ -0,0 +1,142 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+
+#include <boost/beast/http/message.hpp>
+#include <boost/beast/http/string_body.hpp>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "io/io.h"
+#include "util/fibers/fibers.h"
+#include "util/fibers/synchronization.h"
+
+typedef struct nghttp2_session nghttp2_session;
+
+namespace util {
+
+class FiberSocketBase;
+class HttpContext;
+
+namespace http {
+
+// The connection preface that HTTP/2 clients send first, RFC 9113 section 3.4.
+constexpr std::string_view kHttp2Preface{"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"};
+
+class Http2Session;
+
+// The response side of an HTTP/2 stream. Used by HttpContext, whose handler fiber owns the
+// stream between Begin and End. The calls fail once the peer resets the stream or the
+// connection ends.
+class Http2Stream {
+ public:
+  using Fields = ::boost::beast::http::fields;
+
+  // Submits the response headers. Drops the headers that are specific to HTTP/1.1 connections,
+  // e.g. Connection and Transfer-Encoding.
+  std::error_code Begin(unsigned status, const Fields& fields);
+
+  // Queues the body bytes. Suspends while more than the stream buffer limit is queued,
+  // i.e. until the flow control window of the peer lets the bytes out.
+  std::error_code Write(const iovec* v, uint32_t len);
+
+  // Ends the body.
+  std::error_code End();
+
+ private:
+  friend class Http2Session;
+  using RequestType = ::boost::beast::http::request<::boost::beast::http::string_body>;
+
+  Http2Stream(Http2Session* session, int32_t id) : session_(session), id_(id) {
+  }
+
+  size_t pending() const {
+    return pending_.size() - pending_pos_;
+  }
+
+  Http2Session* session_;
+  int32_t id_;
+  RequestType request_;
+
+  std::string pending_;  // body bytes that were not sent yet, starting at pending_pos_.
+  size_t pending_pos_ = 0;
+
+  bool begun_ = false, ended_ = false;
+  bool running_ = false;  // whether the handler fiber runs.
+  bool closed_ = false;   // nghttp2 closed the stream or the connection ended.
+  fb2::EventCount space_ec_;
+};
+
+// Serves an HTTP/2 connection with nghttp2. The connection fiber, which calls Run, reads and
+// parses the frames, a writer fiber sends the frames that nghttp2 produces, and each request
+// runs in its own fiber, so the streams of the connection are multiplexed. HPACK and the flow
+// control of both directions are handled by nghttp2.
+class Http2Session {
+ public:
+  using RequestType = ::boost::beast::http::request<::boost::beast::http::string_body>;
+
+  // Runs in the fiber of the stream. The responses go through HttpContext as with HTTP/1.1.
+  using Handler = std::function<void(RequestType&&, HttpContext*)>;
+
+  struct Options {
+    uint32_t max_concurrent_streams = 128;
+
+    // Receive window of each stream and of the connection.
+    uint32_t window_size = 1 << 20;
+
+    // Requests with larger bodies are reset.
+    size_t max_body_size = 1 << 20;
+
+    // Queued response bytes per stream, after which Http2Stream::Write suspends.
+    size_t stream_buffer = 1 << 16;
+  };
+
+  Http2Session(FiberSocketBase* socket, Handler handler, const Options& opts);
+  ~Http2Session();
+
+  Http2Session(const Http2Session&) = delete;
+  Http2Session& operator=(const Http2Session&) = delete;
+
+  // Serves the connection until the peer closes it or an error occurs, and waits for the
+  // handlers of the open streams. preread holds the bytes that were already read from socket,
+  // and must start with the connection preface unless the preface follows on the socket.
+  // user_data is passed to the HttpContext of each request.
+  std::error_code Run(io::Bytes preread, void* user_data = nullptr);
+
+ private:
+  friend class Http2Stream;
+  struct Callbacks;
+
+  // Feeds the received bytes to nghttp2.
+  std::error_code Receive(io::Bytes data);
+  void WriteLoop();
+  void ScheduleWrite();
+
+  void StartHandler(Http2Stream* stream);
+  void RunHandler(Http2Stream* stream);
+
+  FiberSocketBase* socket_;
+  Handler handler_;
+  Options opts_;
+  nghttp2_session* session_ = nullptr;
+  void* user_data_ = nullptr;
+
+  absl::flat_hash_map<int32_t, std::unique_ptr<Http2Stream>> streams_;
+  unsigned running_handlers_ = 0;
+
+  bool write_pending_ = false;
+  bool closing_ = false;
+  std::error_code ec_;
+
+  fb2::EventCount write_ec_;    // the writer waits for frames.
+  fb2::EventCount handler_ec_;  // Run waits for the handlers upon exit.
+  fb2::Fiber writer_;
+};
+
+}  // namespace http
+}  // namespace util
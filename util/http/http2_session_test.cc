@@ -0,0 +1,329 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/http/http2_session.h"
+
+#include <absl/strings/match.h>
+#include <absl/strings/numbers.h>
+#include <nghttp2/nghttp2.h>
+
+#include <iterator>
+#include <map>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "util/accept_server.h"
+#include "util/fibers/pool.h"
+#include "util/http/http_handler.h"
+
+namespace util::http {
+
+using namespace std;
+
+namespace {
+
+nghttp2_nv MakeNv(string_view name, string_view value) {
+  return nghttp2_nv{reinterpret_cast<uint8_t*>(const_cast<char*>(name.data())),
+                    reinterpret_cast<uint8_t*>(const_cast<char*>(value.data())), name.size(),
+                    value.size(), NGHTTP2_NV_FLAG_NONE};
+}
+
+// HTTP/2 client with prior knowledge, i.e. it starts with the connection preface.
+class Http2Client {
+ public:
+  struct Response {
+    unsigned status = 0;
+    string body;
+    uint32_t error_code = NGHTTP2_NO_ERROR;  // of the RST_STREAM frame that closed the stream.
+  };
+
+  explicit Http2Client(FiberSocketBase* sock);
+  ~Http2Client();
+
+  // Returns the id of the stream of the request.
+  int32_t Submit(string_view method, string_view path, string body = {});
+
+  // Exchanges frames until all the submitted streams close.
+  error_code Run();
+
+  const Response& response(int32_t id) {
+    return responses_[id];
+  }
+
+  // The stream ids in the order of their completion.
+  const vector<int32_t>& closed() const {
+    return closed_;
+  }
+
+ private:
+  struct Body {
+    string data;
+    size_t pos = 0;
+  };
+
+  static int OnHeader(nghttp2_session* session, const nghttp2_frame* frame, const uint8_t* name,
+                      size_t namelen, const uint8_t* value, size_t valuelen, uint8_t flags,
+                      void* ud);
+  static int OnDataChunk(nghttp2_session* session, uint8_t flags, int32_t id, const uint8_t* data,
+                         size_t len, void* ud);
+  static int OnStreamClose(nghttp2_session* session, int32_t id, uint32_t error_code, void* ud);
+  static ssize_t ReadBody(nghttp2_session* session, int32_t id, uint8_t* buf, size_t length,
+                          uint32_t* data_flags, nghttp2_data_source* source, void* ud);
+
+  FiberSocketBase* sock_;
+  nghttp2_session* session_ = nullptr;
+  map<int32_t, Response> responses_;
+  vector<unique_ptr<Body>> bodies_;
+  vector<int32_t> closed_;
+  unsigned open_ = 0;
+};
+
+Http2Client::Http2Client(FiberSocketBase* sock) : sock_(sock) {
+  nghttp2_session_callbacks* cbs;
+  CHECK_EQ(0, nghttp2_session_callbacks_new(&cbs));
+  nghttp2_session_callbacks_set_on_header_callback(cbs, OnHeader);
+  nghttp2_session_callbacks_set_on_data_chunk_recv_callback(cbs, OnDataChunk);
+  nghttp2_session_callbacks_set_on_stream_close_callback(cbs, OnStreamClose);
+  CHECK_EQ(0, nghttp2_session_client_new(&session_, cbs, this));
+  nghttp2_session_callbacks_del(cbs);
+  CHECK_EQ(0, nghttp2_submit_settings(session_, NGHTTP2_FLAG_NONE, nullptr, 0));
+}
+
+Http2Client::~Http2Client() {
+  nghttp2_session_del(session_);
+}
+
+int32_t Http2Client::Submit(string_view method, string_view path, string body) {
+  nghttp2_nv nva[] = {MakeNv(":method", method), MakeNv(":scheme", "http"),
+                      MakeNv(":authority", "localhost"), MakeNv(":path", path)};
+
+  nghttp2_data_provider prd;
+  nghttp2_data_provider* prd_ptr = nullptr;
+  if (!body.empty()) {
+    bodies_.emplace_back(new Body{std::move(body)});
+    prd.source.ptr = bodies_.back().get();
+    prd.read_callback = ReadBody;
+    prd_ptr = &prd;
+  }
+
+  int32_t id = nghttp2_submit_request(session_, nullptr, nva, size(nva), prd_ptr, this);
+  CHECK_GT(id, 0) << nghttp2_strerror(id);
+  responses_[id];
+  ++open_;
+  return id;
+}
+
+error_code Http2Client::Run() {
+  uint8_t buf[1 << 14];
+  while (true) {
+    const uint8_t* data;
+    ssize_t n;
+    while ((n = nghttp2_session_mem_send(session_, &data)) > 0) {
+      if (error_code ec = sock_->Write(io::Bytes{data, size_t(n)}); ec)
+        return ec;
+    }
+    if (n < 0)
+      return make_error_code(errc::protocol_error);
+    if (open_ == 0)
+      return {};
+
+    io::Result<size_t> res = sock_->Recv(io::MutableBytes{buf, sizeof(buf)});
+    if (!res)
+      return res.error();
+    if (*res == 0)
+      return make_error_code(errc::connection_aborted);
+    if (nghttp2_session_mem_recv(session_, buf, *res) < 0)
+      return make_error_code(errc::protocol_error);
+  }
+}
+
+int Http2Client::OnHeader(nghttp2_session* session, const nghttp2_frame* frame,
+                          const uint8_t* name, size_t namelen, const uint8_t* value,
+                          size_t valuelen, uint8_t flags, void* ud) {
+  string_view key(reinterpret_cast<const char*>(name), namelen);
+  string_view val(reinterpret_cast<const char*>(value), valuelen);
+  Http2Client* me = static_cast<Http2Client*>(ud);
+  if (frame->hd.type == NGHTTP2_HEADERS && key == ":status")
+    CHECK(absl::SimpleAtoi(val, &me->responses_[frame->hd.stream_id].status));
+  return 0;
+}
+
+int Http2Client::OnDataChunk(nghttp2_session* session, uint8_t flags, int32_t id,
+                             const uint8_t* data, size_t len, void* ud) {
+  Http2Client* me = static_cast<Http2Client*>(ud);
+  me->responses_[id].body.append(reinterpret_cast<const char*>(data), len);
+  return 0;
+}
+
+int Http2Client::OnStreamClose(nghttp2_session* session, int32_t id, uint32_t error_code,
+                               void* ud) {
+  Http2Client* me = static_cast<Http2Client*>(ud);
+  me->responses_[id].error_code = error_code;
+  me->closed_.push_back(id);
+  --me->open_;
+  return 0;
+}
+
+ssize_t Http2Client::ReadBody(nghttp2_session* session, int32_t id, uint8_t* buf, size_t length,
+                              uint32_t* data_flags, nghttp2_data_source* source, void* ud) {
+  Body* body = static_cast<Body*>(source->ptr);
+  size_t n = min(length, body->data.size() - body->pos);
+  memcpy(buf, body->data.data() + body->pos, n);
+  body->pos += n;
+  if (body->pos == body->data.size())
+    *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+  return n;
+}
+
+}  // namespace
+
+class Http2SessionTest : public testing::Test {
+ protected:
+  static constexpr size_t kMaxBodySize = 1 << 16;
+
+  void SetUp() override;
+  void TearDown() override;
+
+  unique_ptr<FiberSocketBase> Connect(ProactorBase* pb) {
+    unique_ptr<FiberSocketBase> sock(pb->CreateSocket());
+    FiberSocketBase::endpoint_type ep{boost::asio::ip::make_address("127.0.0.1"), port_};
+    error_code ec = sock->Connect(ep);
+    EXPECT_FALSE(ec) << ec.message();
+    return sock;
+  }
+
+  unique_ptr<ProactorPool> pp_;
+  unique_ptr<AcceptServer> server_;
+  uint16_t port_ = 0;
+};
+
+void Http2SessionTest::SetUp() {
+  pp_.reset(fb2::Pool::IOUring(16, 2));
+  pp_->Run();
+  server_.reset(new AcceptServer{pp_.get()});
+
+  auto* listener = new HttpListener<>;
+  Http2Session::Options opts;
+  opts.max_body_size = kMaxBodySize;
+  listener->enable_http2(opts);
+
+  listener->RegisterCb("/hello", [](const QueryArgs& args, HttpContext* cntx) {
+    auto resp = MakeStringResponse();
+    resp.body() = "hello";
+    cntx->Invoke(std::move(resp));
+  });
+
+  listener->RegisterCb("/echo", [](const QueryArgs& args, HttpListenerBase::RequestType&& req,
+                                   HttpContext* cntx) {
+    auto resp = MakeStringResponse();
+    resp.body() = std::move(req.body());
+    cntx->Invoke(std::move(resp));
+  });
+
+  listener->RegisterCb("/sleep", [](const QueryArgs& args, HttpContext* cntx) {
+    unsigned ms = 0;
+    CHECK(absl::SimpleAtoi(args.front().second, &ms));
+    ThisFiber::SleepFor(chrono::milliseconds(ms));
+    auto resp = MakeStringResponse();
+    resp.body() = "slept";
+    cntx->Invoke(std::move(resp));
+  });
+
+  port_ = server_->AddListener(0, listener);
+  server_->Run();
+}
+
+void Http2SessionTest::TearDown() {
+  server_->Stop(true);
+  pp_->Stop();
+}
+
+TEST_F(Http2SessionTest, PriorKnowledge) {
+  string payload(50000, 'x');
+  for (size_t i = 0; i < payload.size(); i += 7)
+    payload[i] = 'a' + i % 26;
+
+  ProactorBase* pb = pp_->at(0);
+  pb->Await([&] {
+    auto sock = Connect(pb);
+    Http2Client client(sock.get());
+    int32_t hello = client.Submit("GET", "/hello");
+    int32_t echo = client.Submit("POST", "/echo", payload);
+    ASSERT_FALSE(client.Run());
+
+    EXPECT_EQ(200u, client.response(hello).status);
+    EXPECT_EQ("hello", client.response(hello).body);
+    EXPECT_EQ(uint32_t(NGHTTP2_NO_ERROR), client.response(hello).error_code);
+    EXPECT_EQ(200u, client.response(echo).status);
+    EXPECT_TRUE(client.response(echo).body == payload);
+    std::ignore = sock->Close();
+  });
+}
+
+// The streams of a connection are served concurrently, so a slow request does not hold
+// the following ones.
+TEST_F(Http2SessionTest, ConcurrentStreams) {
+  ProactorBase* pb = pp_->at(0);
+  pb->Await([&] {
+    auto sock = Connect(pb);
+    Http2Client client(sock.get());
+    int32_t slow = client.Submit("GET", "/sleep?ms=300");
+    int32_t fast1 = client.Submit("GET", "/hello");
+    int32_t fast2 = client.Submit("GET", "/sleep?ms=10");
+    ASSERT_FALSE(client.Run());
+
+    ASSERT_EQ(3u, client.closed().size());
+    EXPECT_EQ(slow, client.closed().back());
+    EXPECT_EQ(200u, client.response(slow).status);
+    EXPECT_EQ("slept", client.response(slow).body);
+    EXPECT_EQ("hello", client.response(fast1).body);
+    EXPECT_EQ("slept", client.response(fast2).body);
+    std::ignore = sock->Close();
+  });
+}
+
+// A request with a body above max_body_size is reset, the connection keeps serving.
+TEST_F(Http2SessionTest, OversizedBody) {
+  ProactorBase* pb = pp_->at(0);
+  pb->Await([&] {
+    auto sock = Connect(pb);
+    Http2Client client(sock.get());
+    int32_t big = client.Submit("POST", "/echo", string(kMaxBodySize + 1, 'x'));
+    ASSERT_FALSE(client.Run());
+
+    EXPECT_EQ(uint32_t(NGHTTP2_REFUSED_STREAM), client.response(big).error_code);
+    EXPECT_EQ(0u, client.response(big).status);
+
+    int32_t hello = client.Submit("GET", "/hello");
+    ASSERT_FALSE(client.Run());
+    EXPECT_EQ(200u, client.response(hello).status);
+    EXPECT_EQ("hello", client.response(hello).body);
+    std::ignore = sock->Close();
+  });
+}
+
+// HTTP/1.1 requests are served by the listener with HTTP/2 enabled, including those that
+// start like the preface and arrive in pieces.
+TEST_F(Http2SessionTest, Http1Fallback) {
+  ProactorBase* pb = pp_->at(0);
+  pb->Await([&] {
+    auto sock = Connect(pb);
+    ASSERT_FALSE(sock->Write(io::Buffer("P")));
+    ThisFiber::SleepFor(10ms);
+    ASSERT_FALSE(sock->Write(io::Buffer(
+        "OST /echo HTTP/1.1\r\nHost: localhost\r\nContent-Length: 6\r\n\r\nfoobar")));
+
+    string resp;
+    uint8_t buf[256];
+    while (!absl::EndsWith(resp, "foobar")) {
+      io::Result<size_t> res = sock->Recv(io::MutableBytes{buf, sizeof(buf)});
+      ASSERT_TRUE(res && *res > 0);
+      resp.append(reinterpret_cast<const char*>(buf), *res);
+    }
+    EXPECT_TRUE(absl::StartsWith(resp, "HTTP/1.1 200")) << resp;
+    std::ignore = sock->Close();
+  });
+}
+
+}  // namespace util::http
@@ -0,0 +1,274 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+// Instrumented http server for benchmarking the http stack with wrk or similar tools, e.g.
+//   http_bench --port=8080 --handler_cost_usec=5
+//   wrk -t8 -c256 -d30s http://localhost:8080/plaintext
+//
+// Endpoints:
+//   /plaintext  - "Hello, World!" as text/plain.
+//   /json       - {"message":"Hello, World!"} as application/json.
+//   /bytes      - text/plain body of --body_size bytes, or of size=N bytes if the query has it.
+//
+// Every handler spins for --handler_cost_usec to emulate the application work. The server
+// measures the latency of every request from the start of its handler until its response is
+// written and publishes it as the http_bench_latency_seconds histogram at /metrics, together
+// with the cpu time of every proactor thread (http_bench_cpu_seconds_total). With
+// --report_sec > 0 it also prints the qps, the latency percentiles and the utilization of
+// every proactor periodically.
+
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_join.h>
+#include <openssl/ssl.h>
+
+#include <atomic>
+#include <ctime>
+#include <thread>
+
+#include "base/init.h"
+#include "util/accept_server.h"
+#include "util/fibers/cycle_clock.h"
+#include "util/fibers/pool.h"
+#include "util/http/http_common.h"
+#include "util/http/http_handler.h"
+#include "util/metrics/metrics.h"
+#include "util/sliding_counter.h"
+#include "util/tls/tls_engine.h"
+#include "util/tls/tls_socket.h"
+#include "util/varz.h"
+
+using namespace std;
+using namespace util;
+using absl::GetFlag;
+using fb2::CycleClock;
+namespace h2 = boost::beast::http;
+
+ABSL_FLAG(uint32_t, port, 8080, "Port number.");
+ABSL_FLAG(bool, epoll, false, "If true, uses epoll api instead of iouring");
+ABSL_FLAG(uint32_t, iouring_depth, 512, "Io uring depth");
+ABSL_FLAG(bool, tls, false, "Serves https, requires tls_cert and tls_key");
+ABSL_FLAG(string, tls_cert, "", "Certificate chain file in PEM format");
+ABSL_FLAG(string, tls_key, "", "Private key file in PEM format");
+ABSL_FLAG(bool, http2, false, "Serves HTTP/2 to the clients that ask for it");
+ABSL_FLAG(bool, compress, false, "Compresses the /bytes responses if the client accepts it");
+ABSL_FLAG(uint32_t, body_size, 1024, "Default body size of /bytes");
+ABSL_FLAG(uint32_t, handler_cost_usec, 0, "Cpu time that every handler spins for");
+ABSL_FLAG(uint32_t, report_sec, 5, "Period of the console reports, 0 disables them");
+
+namespace {
+
+constexpr size_t kMaxBodySize = 16 << 20;
+
+VarzQps http_qps("http-bench-qps");
+metrics::HistogramFamily latency_hist("http_bench_latency_seconds",
+                                      "Server side latency of the requests", 1e-6, 10);
+metrics::CounterFamily cpu_seconds("http_bench_cpu_seconds_total",
+                                   "Cpu time of the proactor threads");
+
+// 5 seconds window for the console reports, in usec.
+SlidingHistogramDist<6> report_hist;
+
+string hello_body = "Hello, World!";
+string json_body = R"({"message":"Hello, World!"})";
+string default_bytes;
+
+uint64_t ThreadCpuNs() {
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Emulates the application work.
+void Spin(uint64_t cycles) {
+  uint64_t start = CycleClock::Now();
+  while (CycleClock::Now() - start < cycles) {
+  }
+}
+
+class BenchListener : public HttpListener<> {
+ public:
+  // Takes ownership of ctx, nullptr serves plain http.
+  explicit BenchListener(SSL_CTX* ctx) : ctx_(ctx) {
+  }
+
+  ~BenchListener() {
+    if (ctx_)
+      SSL_CTX_free(ctx_);
+  }
+
+ protected:
+  // Runs in the connection fiber before HandleRequests.
+  void OnConnectionStart(Connection* conn) final;
+
+ private:
+  SSL_CTX* ctx_;
+};
+
+void BenchListener::OnConnectionStart(Connection* conn) {
+  if (!ctx_)
+    return;
+
+  unique_ptr<tls::TlsSocket> tls_sock(new tls::TlsSocket(conn->ReleaseSocket()));
+  tls_sock->InitSSL(ctx_);
+  FiberSocketBase::AcceptResult res = tls_sock->Accept();
+  LOG_IF(WARNING, !res) << "TLS handshake failed: " << res.error().message();
+
+  // HandleRequests fails on the first read if the handshake did not succeed.
+  conn->SetSocket(tls_sock.release());
+}
+
+SSL_CTX* CreateSslCntx() {
+  string cert = GetFlag(FLAGS_tls_cert), key = GetFlag(FLAGS_tls_key);
+  CHECK(!cert.empty() && !key.empty()) << "--tls requires --tls_cert and --tls_key";
+
+  SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+  CHECK_EQ(1, SSL_CTX_use_certificate_chain_file(ctx, cert.c_str()));
+  CHECK_EQ(1, SSL_CTX_use_PrivateKey_file(ctx, key.c_str(), SSL_FILETYPE_PEM));
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+  SSL_CTX_set_options(ctx, SSL_OP_DONT_INSERT_EMPTY_FRAGMENTS);
+  if (GetFlag(FLAGS_http2))
+    tls::SslSetServerAlpn(ctx, {"h2", "http/1.1"});
+  return ctx;
+}
+
+// Wraps a handler that returns the response body with the cost emulation and the latency
+// accounting.
+template <typename F> auto MakeHandler(string_view path, const char* mime, F body_fn) {
+  uint64_t cost_cycles = CycleClock::FrequencyUsec() * GetFlag(FLAGS_handler_cost_usec);
+  return [path, mime, body_fn, cost_cycles](const http::QueryArgs& args, HttpContext* send) {
+    uint64_t start = CycleClock::Now();
+    if (cost_cycles)
+      Spin(cost_cycles);
+
+    http::StringResponse resp = http::MakeStringResponse(h2::status::ok);
+    resp.body() = body_fn(args);
+    http::SetMime(mime, &resp);
+    resp.set(h2::field::server, "http_bench");
+    send->Invoke(std::move(resp));
+
+    uint64_t cycles = CycleClock::Now() - start;
+    latency_hist.ObserveCycles({path}, cycles);
+    report_hist.Add(CycleClock::ToUsec(cycles));
+    http_qps.Inc();
+  };
+}
+
+void RegisterHandlers(HttpListenerBase* listener) {
+  auto hello = [](const http::QueryArgs&) { return hello_body; };
+  auto json = [](const http::QueryArgs&) { return json_body; };
+  auto bytes = [](const http::QueryArgs& args) {
+    for (const auto& [name, val] : args) {
+      size_t size;
+      if (name == "size" && absl::SimpleAtoi(val, &size) && size <= kMaxBodySize)
+        return string(size, 'x');
+    }
+    return default_bytes;
+  };
+
+  listener->RegisterCb("/plaintext", MakeHandler("/plaintext", http::kTextMime, hello));
+  listener->RegisterCb("/json", MakeHandler("/json", http::kJsonMime, json));
+  listener->RegisterCb("/bytes", MakeHandler("/bytes", http::kTextMime, bytes),
+                       GetFlag(FLAGS_compress));
+}
+
+// Prints the stats of the last period every period until stop is set.
+void RunReporter(ProactorPool* pool, chrono::seconds period, const atomic_bool* stop) {
+  using Clock = chrono::steady_clock;
+
+  // Samples the cpu time of every proactor thread and exports the progress since the last
+  // sample.
+  vector<uint64_t> cpu_ns(pool->size());
+  auto sample_cpu = [&](vector<double>* utilization, double wall_ns) {
+    pool->AwaitBrief([&](unsigned index, auto*) {
+      uint64_t now = ThreadCpuNs();
+      uint64_t delta = now - cpu_ns[index];
+      cpu_ns[index] = now;
+      cpu_seconds.IncBy({absl::StrCat(index)}, delta * 1e-9);
+      if (utilization)
+        (*utilization)[index] = delta / wall_ns;
+    });
+  };
+
+  sample_cpu(nullptr, 0);
+  Clock::time_point last = Clock::now();
+  while (!stop->load(memory_order_relaxed)) {
+    this_thread::sleep_for(100ms);
+    Clock::time_point now = Clock::now();
+    if (now - last < period)
+      continue;
+
+    vector<double> utilization(pool->size());
+    double wall_ns = chrono::duration<double, nano>(now - last).count();
+    sample_cpu(&utilization, wall_ns);
+    last = now;
+
+    base::FixedHistogram hist = report_hist.MergeTail();
+    string cpu = absl::StrJoin(utilization, " ", [](string* out, double u) {
+      absl::StrAppend(out, unsigned(u * 100), "%");
+    });
+    CONSOLE_INFO << "qps " << uint64_t(hist.count() / double(report_hist.WIN_SIZE - 1))
+                 << ", latency (usec) p50 " << hist.Percentile(50) << " p99 "
+                 << hist.Percentile(99) << " p99.9 " << hist.Percentile(99.9) << " max "
+                 << hist.max() << ", cpu [" << cpu << "]";
+  }
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  MainInitGuard guard(&argc, &argv);
+
+  default_bytes.assign(GetFlag(FLAGS_body_size), 'x');
+  SSL_CTX* ctx = GetFlag(FLAGS_tls) ? CreateSslCntx() : nullptr;
+
+  unique_ptr<ProactorPool> pool;
+#ifdef __linux__
+  if (GetFlag(FLAGS_epoll)) {
+    pool.reset(fb2::Pool::Epoll());
+  } else {
+    pool.reset(fb2::Pool::IOUring(GetFlag(FLAGS_iouring_depth)));
+  }
+#else
+  pool.reset(fb2::Pool::Epoll());
+#endif
+  pool->Run();
+
+  http_qps.Init(pool.get());
+  report_hist.Init(pool.get());
+  latency_hist.Init(pool.get(), {"path"});
+  cpu_seconds.Init(pool.get(), {"thread"});
+
+  AcceptServer server(pool.get());
+  BenchListener* listener = new BenchListener(ctx);
+  RegisterHandlers(listener);
+  listener->enable_metrics();
+  if (GetFlag(FLAGS_compress))
+    listener->enable_compression();
+  if (GetFlag(FLAGS_http2))
+    listener->enable_http2();
+
+  uint16_t port = server.AddListener(GetFlag(FLAGS_port), listener);
+  LOG(INFO) << "Listening on port " << port << (ctx ? " with tls" : "");
+
+  atomic_bool stop{false};
+  thread reporter;
+  if (uint32_t report_sec = GetFlag(FLAGS_report_sec); report_sec > 0)
+    reporter = thread(RunReporter, pool.get(), chrono::seconds(report_sec), &stop);
+
+  server.Run();
+  server.Wait();
+
+  stop.store(true);
+  if (reporter.joinable())
+    reporter.join();
+
+  latency_hist.Shutdown();
+  cpu_seconds.Shutdown();
+  report_hist.Shutdown();
+  http_qps.Shutdown();
+  pool->Stop();
+
+  return 0;
+}
@@ -5,6 +5,7 @@
 #include "util/http/http_client.h"
 
 #include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
 #include <openssl/err.h>
 
 #include <boost/asio/connect.hpp>
@@ -19,6 +20,7 @@
 #include "util/fibers/dns_resolve.h"
 #include "util/fibers/proactor_base.h"
 #include "util/tls/tls_engine.h"
+#include "util/tls/tls_session_cache.h"
 #include "util/tls/tls_socket.h"
 
 namespace util {
@@ -70,16 +72,11 @@ std::error_code Client::Reconnect() {
     socket_.reset();
   }
 
-  char ip[INET6_ADDRSTRLEN];
-  error_code ec = fb2::DnsResolve(host_.data(), 2000, ip, proactor_);
-  if (ec) {
-    return ec;
+  auto addrs = fb2::DnsCache::Local()->Resolve(host_, 2000);
+  if (!addrs) {
+    return addrs.error();
   }
-
-  boost_error berr;
-  auto address = ip::make_address(ip, berr);
-  if (berr)
-    return berr;
+  auto address = (*addrs)->front();
 
   FiberSocketBase* sock = proactor_->CreateSocket();
   if (on_connect_cb_) {
@@ -154,6 +151,9 @@ SSL_CTX* TlsClient::CreateSslContext() {
     // this default is for Security level set to 112 bits of security
     SSL_CTX_set_security_level(ctx, 2);
     SSL_CTX_dane_enable(ctx);  // see https://www.internetsociety.org/resources/deploy360/dane/
+
+    // Allows reconnects to resume their sessions.
+    tls::ClientSessionCache::Enable(ctx);
   }
   return ctx;
 }
@@ -180,6 +180,9 @@ std::error_code TlsClient::Connect(string_view host, string_view service, SSL_CT
     SSL_set_tlsext_host_name(ssl_handle, host);
     // verify server cert using server hostname
     SSL_dane_enable(ssl_handle, host);
+    if (auto* cache = tls::ClientSessionCache::Get(context)) {
+      cache->Attach(ssl_handle, absl::StrCat(hn, ":", service));
+    }
     ec = tls_socket->Connect(FiberSocketBase::endpoint_type{});
     if (!ec) {
       socket_.reset(tls_socket.release());
@@ -3,6 +3,7 @@
 //
 #include "util/http/http_handler.h"
 
+#include <absl/container/inlined_vector.h>
 #include <absl/flags/reflection.h>
 #include <absl/strings/match.h>
 #include <absl/strings/str_split.h>
@@ -12,15 +13,18 @@
 
 #include "absl/strings/escaping.h"
 #include "base/logging.h"
+#include "util/fibers/fibers.h"
+#include "util/fibers/sampling_profiler.h"
+#include "util/http/http2_session.h"
 #include "util/http/http_common.h"
 #include "util/metrics/family.h"
+#include "util/proactor_pool.h"
 
 namespace util {
 
 using namespace http;
 using namespace std;
 namespace h2 = boost::beast::http;
-using metrics::MetricType;
 namespace fs = std::filesystem;
 
 namespace {
@@ -83,17 +87,6 @@ QueryParam ParseQuery(std::string_view str) {
   return res;
 }
 
-QueryArgs SplitQuery(std::string_view query) {
-  vector<std::string_view> args = absl::StrSplit(query, '&');
-  vector<std::pair<std::string_view, std::string_view>> res(args.size());
-  for (size_t i = 0; i < args.size(); ++i) {
-    size_t pos = args[i].find('=');
-    res[i].first = args[i].substr(0, pos);
-    res[i].second = (pos == std::string_view::npos) ? std::string_view() : args[i].substr(pos + 1);
-  }
-  return res;
-}
-
 h2::response<h2::string_body> ParseFlagz(const QueryArgs& args) {
   h2::response<h2::string_body> response(h2::status::ok, 11);
 
@@ -175,68 +168,300 @@ void FilezHandler(const QueryArgs& args, HttpContext* send) {
   return send->Invoke(std::move(fresp));
 }
 
-/*# HELP go_gc_duration_seconds A summary of the pause duration of garbage collection cycles.
-# TYPE go_gc_duration_seconds summary
-go_gc_duration_seconds{quantile="0"} 0
-go_gc_duration_seconds{quantile="0.25"} 0
-go_gc_duration_seconds{quantile="0.5"} 0
-go_gc_duration_seconds{quantile="0.75"} 0
-go_gc_duration_seconds{quantile="1"} 0
-go_gc_duration_seconds_sum 0
-go_gc_duration_seconds_count 0
-*/
-
-const char* MetricTypeName(MetricType type) {
-  switch (type) {
-    case MetricType::COUNTER:
-      return "counter";
-    case MetricType::GAUGE:
-      return "gauge";
-    case MetricType::SUMMARY:
-      return "summary";
-    case MetricType::HISTOGRAM:
-      return "histogram";
-  }
-  return "unknown";
-}
-
-void AppendLabelTupple(absl::Span<const metrics::Label> label_names,
-                       absl::Span<const string_view> label_values, string* dest) {
-  if (label_names.empty())
-    return;
+// The output can be tens of megabytes, hence we stream it in chunks.
+void MetricsHandler(const QueryArgs& args, HttpContext* send) {
+  h2::response<h2::empty_body> res{h2::status::ok, 11};
+  res.set(h2::field::content_type, kTextMime);
+  std::error_code ec = send->BeginChunked(std::move(res));
+
+  metrics::FormatText([&](string_view piece) {
+    if (!ec)
+      ec = send->WriteChunk(piece);
+  });
+
+  if (!ec)
+    ec = send->EndChunked();
+  VLOG_IF(1, ec) << "Failed to send metrics: " << ec.message();
+}
+
+// Shows fiber run statistics aggregated by fiber name over all the pool threads.
+// "?enable=1" or "?enable=0" toggles the collection.
+void FiberszHandler(const QueryArgs& args, ProactorPool* pool, HttpContext* send) {
+  for (const auto& k_v : args) {
+    if (k_v.first == "enable") {
+      fb2::EnableFiberRunStats(k_v.second == "1" || k_v.second == "true");
+    }
+  }
+
+  StringResponse res = MakeStringResponse();
+  SetMime(kTextMime, &res);
+
+  if (!fb2::FiberRunStatsEnabled()) {
+    res.body() = "Fiber stats are disabled, use /fibersz?enable=1 to enable them\n";
+    return send->Invoke(std::move(res));
+  }
+
+  fb2::Mutex mu;
+  fb2::FiberTypeStatsMap total;
+  pool->AwaitFiberOnAll([&](unsigned, auto*) {
+    fb2::FiberTypeStatsMap local = fb2::GetFiberTypeStats();
+    lock_guard lk(mu);
+    for (const auto& [name, fs] : local) {
+      fb2::FiberTypeStats& dest = total[name];
+      dest.num_fibers += fs.num_fibers;
+      dest.run_usec += fs.run_usec;
+      dest.switches += fs.switches;
+      dest.ready_usec += fs.ready_usec;
+    }
+  });
 
-  for (size_t i = 0; i < label_names.size(); ++i) {
-    absl::StrAppend(dest, label_names[i].name(), "=\"", label_values[i], "\",");
+  vector<pair<string_view, fb2::FiberTypeStats>> sorted(total.begin(), total.end());
+  sort(sorted.begin(), sorted.end(),
+       [](const auto& l, const auto& r) { return l.second.run_usec > r.second.run_usec; });
+
+  string& body = res.body();
+  absl::StrAppend(&body, "name\tfibers\trun_usec\tswitches\tready_usec\n");
+  for (const auto& [name, fs] : sorted) {
+    absl::StrAppend(&body, name.empty() ? "<unnamed>" : name, "\t", fs.num_fibers, "\t",
+                    fs.run_usec, "\t", fs.switches, "\t", fs.ready_usec, "\n");
   }
-  dest->pop_back();
+
+  return send->Invoke(std::move(res));
 }
 
-void AppendObservation(const metrics::ObservationDescriptor& od, absl::Span<const double> vals,
-                       StringResponse* resp) {
-  absl::StrAppend(&resp->body(), "# HELP ", od.metric_name, " ", od.metric_help, "\n");
-  absl::StrAppend(&resp->body(), "# TYPE ", od.metric_name, " ", MetricTypeName(od.type), "\n");
+// Shows the stack high watermarks of the terminated fibers aggregated by fiber name over all
+// the pool threads. "?enable=1" or "?enable=0" toggles the stack painting and
+// "?name=X&size=N" sets the stack size of the new fibers named X, 0 restores the default.
+void StackszHandler(const QueryArgs& args, ProactorPool* pool, HttpContext* send) {
+  string_view fiber_name;
+  size_t size = 0;
+  bool set_size = false;
+  for (const auto& k_v : args) {
+    if (k_v.first == "enable") {
+      fb2::EnableStackPainting(k_v.second == "1" || k_v.second == "true");
+    } else if (k_v.first == "name") {
+      fiber_name = k_v.second;
+    } else if (k_v.first == "size") {
+      set_size = absl::SimpleAtoi(k_v.second, &size);
+    }
+  }
 
-  if (od.adjustments.empty()) {
-    for (size_t i = 0; i < od.label_values.size(); ++i) {
-      absl::StrAppend(&resp->body(), od.metric_name, "{");
-      AppendLabelTupple(od.label_names, {od.label_values[i], od.label_names.size()}, &resp->body());
-      absl::StrAppend(&resp->body(), "} ", vals[i], "\n");
+  StringResponse res = MakeStringResponse();
+  SetMime(kTextMime, &res);
+  if (set_size && !fiber_name.empty()) {
+    fb2::SetFiberStackSize(fiber_name, size);
+    absl::StrAppend(&res.body(), "Stack size of ", fiber_name, " set to ", size, "\n");
+  }
+
+  if (!fb2::StackPaintingEnabled()) {
+    absl::StrAppend(&res.body(),
+                    "Stack painting is disabled, use /stacksz?enable=1 to enable it\n");
+    return send->Invoke(std::move(res));
+  }
+
+  fb2::Mutex mu;
+  fb2::FiberStackStatsMap total;
+  pool->AwaitFiberOnAll([&](unsigned, auto*) {
+    fb2::FiberStackStatsMap local = fb2::GetFiberStackStats();
+    lock_guard lk(mu);
+    for (const auto& [name, ss] : local) {
+      fb2::FiberStackStats& dest = total[name];
+      dest.num_fibers += ss.num_fibers;
+      dest.max_used = max(dest.max_used, ss.max_used);
+      dest.sum_used += ss.sum_used;
+      dest.stack_size = max(dest.stack_size, ss.stack_size);
+    }
+  });
+
+  vector<pair<string_view, fb2::FiberStackStats>> sorted(total.begin(), total.end());
+  sort(sorted.begin(), sorted.end(),
+       [](const auto& l, const auto& r) { return l.second.max_used > r.second.max_used; });
+
+  string& body = res.body();
+  absl::StrAppend(&body, "name\tfibers\tstack_size\tmax_used\tavg_used\n");
+  for (const auto& [name, ss] : sorted) {
+    absl::StrAppend(&body, name.empty() ? "<unnamed>" : name, "\t", ss.num_fibers, "\t",
+                    ss.stack_size, "\t", ss.max_used, "\t",
+                    ss.num_fibers ? ss.sum_used / ss.num_fibers : 0, "\n");
+  }
+
+  return send->Invoke(std::move(res));
+}
+
+// Serves the folded stacks of the sampling profiler, ready for flamegraph.pl.
+// "?seconds=N" resets the profile and returns the samples collected during the next N seconds,
+// "?reset=1" clears the profile after serving it.
+void SamplezHandler(const QueryArgs& args, fb2::SamplingProfiler* profiler, HttpContext* send) {
+  uint32_t seconds = 0;
+  bool reset = false;
+  for (const auto& k_v : args) {
+    if (k_v.first == "seconds") {
+      if (!absl::SimpleAtoi(k_v.second, &seconds))
+        seconds = 0;
+    } else if (k_v.first == "reset") {
+      reset = k_v.second == "1" || k_v.second == "true";
     }
   }
-};
 
-void MetricsHandler(const QueryArgs& args, HttpContext* send) {
   StringResponse res = MakeStringResponse();
   SetMime(kTextMime, &res);
-  metrics::Iterate(
-      [&res](const auto& od, auto vals) { AppendObservation(od, std::move(vals), &res); });
+  if (!profiler->IsRunning()) {
+    res.body() = "The sampling profiler is not running\n";
+    return send->Invoke(std::move(res));
+  }
+
+  if (seconds > 0) {
+    profiler->Reset();
+    ThisFiber::SleepFor(chrono::seconds(std::min(seconds, 600u)));
+  }
+
+  res.body() = profiler->FoldedStacks();
+  if (reset)
+    profiler->Reset();
   return send->Invoke(std::move(res));
 }
 
 using ParserType = ::boost::beast::http::parser<true, HttpConnection::RequestType::body_type>;
 
+// Coalescing limit for the responses of pipelined requests.
+constexpr size_t kPipelineCorkLimit = 1 << 16;
+
+// Request bodies of at least this size are read directly into the request.
+constexpr size_t kDirectBodyMinSize = 1 << 14;
+
+// The body limit of beast request parsers.
+constexpr uint64_t kDefaultBodyLimit = 1 << 20;
+
+// Limits the body of the next request by the memory budget of the connection. The body
+// reuses the capacity that is already charged to the connection.
+uint64_t BodyLimit(const base::CountingMemoryResource* mr, size_t charged) {
+  size_t avail = mr->Available();
+  if (avail == SIZE_MAX)
+    return kDefaultBodyLimit;
+  return min<uint64_t>(kDefaultBodyLimit, charged + avail);
+}
+
+// Prepares request, which was handled by the previous iteration, for parsing the next one
+// into it, so that the body keeps its capacity across the requests of a connection.
+void ResetRequest(HttpConnection::RequestType* request) {
+  request->clear();
+  request->body().clear();
+}
+
 }  // namespace
 
+namespace http {
+
+QueryArgs SplitQuery(std::string_view query) {
+  QueryArgs res;
+  if (query.empty())
+    return res;
+
+  res.reserve(std::count(query.begin(), query.end(), '&') + 1);
+  for (std::string_view arg : absl::StrSplit(query, '&')) {
+    size_t pos = arg.find('=');
+    res.emplace_back(arg.substr(0, pos),
+                     pos == std::string_view::npos ? std::string_view() : arg.substr(pos + 1));
+  }
+  return res;
+}
+
+}  // namespace http
+
+std::error_code HttpContext::BeginChunked(Response<h2::empty_body>&& msg) {
+  chunk_encoder_.reset();
+  if (encoding_ != ContentEncoding::kIdentity) {
+    msg.set(h2::field::content_encoding, string{EncodingName(encoding_)});
+    msg.set(h2::field::vary, "Accept-Encoding");
+    chunk_encoder_ = BodyEncoder::Create(encoding_, &chunk_sink_);
+  }
+
+  if (h2_stream_)
+    return BeginHttp2(msg.result_int(), msg.base());
+
+  msg.chunked(true);
+  h2::response_serializer<h2::empty_body> sr{msg};
+
+  error_code ec;
+  h2::write_header(*asa_, sr, ec);
+  return ec;
+}
+
+std::error_code HttpContext::WriteChunk(const iovec* v, uint32_t len) {
+  if (chunk_encoder_) {
+    for (uint32_t i = 0; i < len; ++i) {
+      io::Bytes data{static_cast<const uint8_t*>(v[i].iov_base), v[i].iov_len};
+      if (std::error_code ec = chunk_encoder_->Write(data); ec)
+        return ec;
+    }
+    return {};
+  }
+  return WriteRawChunk(v, len);
+}
+
+std::error_code HttpContext::WriteRawChunk(const iovec* v, uint32_t len) {
+  if (h2_stream_)
+    return WriteHttp2Data(v, len);
+
+  size_t total = 0;
+  for (uint32_t i = 0; i < len; ++i)
+    total += v[i].iov_len;
+
+  // An empty chunk would terminate the body.
+  if (total == 0)
+    return {};
+
+  char prefix[24];
+  int prefix_len = snprintf(prefix, sizeof(prefix), "%zx\r\n", total);
+  static char kCrlf[] = "\r\n";
+
+  absl::InlinedVector<iovec, 16> vec;
+  vec.reserve(len + 2);
+  vec.push_back(iovec{prefix, size_t(prefix_len)});
+  vec.insert(vec.end(), v, v + len);
+  vec.push_back(iovec{kCrlf, 2});
+
+  return asa_->socket().Write(vec.data(), vec.size());
+}
+
+std::error_code HttpContext::EndChunked() {
+  if (chunk_encoder_) {
+    std::error_code ec = chunk_encoder_->Finish();
+    chunk_encoder_.reset();
+    if (ec)
+      return ec;
+  }
+
+  if (h2_stream_)
+    return EndHttp2();
+
+  static char kLastChunk[] = "0\r\n\r\n";
+  iovec v{kLastChunk, sizeof(kLastChunk) - 1};
+  return asa_->socket().Write(&v, 1);
+}
+
+std::error_code HttpContext::BeginHttp2(unsigned status, const h2::fields& fields) {
+  return h2_stream_->Begin(status, fields);
+}
+
+std::error_code HttpContext::WriteHttp2Data(const iovec* v, uint32_t len) {
+  return h2_stream_->Write(v, len);
+}
+
+std::error_code HttpContext::EndHttp2() {
+  return h2_stream_->End();
+}
+
+io::Result<size_t> HttpContext::ChunkSink::WriteSome(const iovec* v, uint32_t len) {
+  if (std::error_code ec = cntx_->WriteRawChunk(v, len); ec)
+    return nonstd::make_unexpected(ec);
+
+  size_t total = 0;
+  for (uint32_t i = 0; i < len; ++i)
+    total += v[i].iov_len;
+  return total;
+}
+
 HttpListenerBase::HttpListenerBase() {
   favicon_url_ =
       "https://rawcdn.githack.com/romange/helio/master/util/http/"
@@ -244,9 +469,9 @@ HttpListenerBase::HttpListenerBase() {
   resource_prefix_ = "https://cdn.jsdelivr.net/gh/romange/helio/util/http";
 }
 
-bool HttpListenerBase::HandleRoot(const RequestType& request, HttpContext* cntx) const {
-  std::string_view target = ToStd(request.target());
-  if (target == "/favicon.ico") {
+bool HttpListenerBase::HandleRoot(const RequestType& request, std::string_view path,
+                                  std::string_view query, HttpContext* cntx) const {
+  if (path == "/favicon.ico") {
     h2::response<h2::string_body> resp = MakeStringResponse(h2::status::moved_permanently);
     resp.set(h2::field::location, favicon_url_);
     resp.set(h2::field::server, "HELIO");
@@ -256,13 +481,12 @@ bool HttpListenerBase::HandleRoot(const RequestType& request, HttpContext* cntx)
     return true;
   }
 
-  std::string_view path, query;
-  tie(path, query) = ParseQuery(target);
-  auto args = SplitQuery(query);
+  // The query is split only for the built-in pages.
+  auto args = [query] { return SplitQuery(query); };
 
   if (path == "/") {
     if (root_response_.empty()) {
-      cntx->Invoke(BuildStatusPage(args, resource_prefix_));
+      cntx->Invoke(BuildStatusPage(args(), resource_prefix_));
     } else {
       auto resp = MakeStringResponse();
       resp.body() = root_response_;
@@ -273,36 +497,52 @@ bool HttpListenerBase::HandleRoot(const RequestType& request, HttpContext* cntx)
 
   if (path == "/flagz") {
     h2::response<h2::string_body> resp(h2::status::ok, request.version());
-    cntx->Invoke(ParseFlagz(args));
+    cntx->Invoke(ParseFlagz(args()));
     return true;
   }
 
   if (path == "/filez") {
-    FilezHandler(args, cntx);
+    FilezHandler(args(), cntx);
     return true;
   }
 
   if (path == "/profilez") {
-    cntx->Invoke(ProfilezHandler(args));
+    cntx->Invoke(ProfilezHandler(args()));
+    return true;
+  }
+
+  if (path == "/fibersz" && pool()) {
+    FiberszHandler(args(), pool(), cntx);
+    return true;
+  }
+
+  if (path == "/stacksz" && pool()) {
+    StackszHandler(args(), pool(), cntx);
+    return true;
+  }
+
+  if (sampling_profiler_ && path == "/samplez") {
+    SamplezHandler(args(), sampling_profiler_, cntx);
     return true;
   }
 
   if (enable_metrics_ && path == "/metrics") {
-    MetricsHandler(args, cntx);
+    MetricsHandler(args(), cntx);
     return true;
   }
   return false;
 }
 
-bool HttpListenerBase::RegisterCb(std::string_view path, RequestCb cb) {
+bool HttpListenerBase::RegisterCb(std::string_view path, RequestCb cb, bool compress) {
+  return router_.Add(path, CbInfo{std::move(cb), compress});
+}
 
-  auto res = cb_map_.emplace(path, std::move(cb));
-  return res.second;
+bool HttpListenerBase::RegisterCb(std::string_view path, RequestCbExt cb, bool compress) {
+  return router_.Add(path, CbInfo{std::move(cb), compress});
 }
 
-bool HttpListenerBase::RegisterCb(std::string_view path, RequestCbExt cb) {
-  auto res = cb_map_.emplace(path, std::move(cb));
-  return res.second;
+bool HttpListenerBase::RegisterCb(std::string_view path, RequestCbRaw cb, bool compress) {
+  return router_.Add(path, CbInfo{std::move(cb), compress});
 }
 
 // Limit the parsing buffer to 4K.
@@ -320,8 +560,10 @@ error_code HttpConnection::ParseFromBuffer(io::Bytes buf) {
   HttpContext cntx(asa);
   cntx.set_user_data(user_data_);
 
+  bool corked = false;
   while (!buf.empty()) {
-    ParserType parser;
+    ResetRequest(&request);
+    ParserType parser(std::move(request));
     parser.eager(true);
 
     size_t consumed = parser.put(boost::asio::const_buffer{buf.data(), buf.size()}, ec);
@@ -335,8 +577,22 @@ error_code HttpConnection::ParseFromBuffer(io::Bytes buf) {
 
     request = parser.release();
 
+    // Pipelined requests follow, send their responses together.
+    if (!buf.empty() && !corked) {
+      corked = true;
+      socket_->SetWriteCoalescing(kPipelineCorkLimit);
+    }
+
+    // A request that is being served does not count as idle time, see SetIdleTimeout.
     VLOG(1) << "Full Url: " << request.target();
+    MarkActive();
     HandleSingleRequest(std::move(request), &cntx);
+    MarkActive();
+  }
+
+  if (corked) {
+    if (error_code flush_ec = socket_->SetWriteCoalescing(0); flush_ec)
+      return flush_ec;
   }
 
   if (ec == h2::error::need_more) {
@@ -355,37 +611,136 @@ error_code HttpConnection::ParseFromBuffer(io::Bytes buf) {
   return ec;
 }
 
+io::Result<bool> HttpConnection::ReadHttp2Preface() {
+  while (req_buffer_.size() < kHttp2Preface.size()) {
+    string_view data{static_cast<const char*>(req_buffer_.data().data()), req_buffer_.size()};
+    if (!absl::StartsWith(kHttp2Preface, data))
+      return false;
+
+    auto mb = req_buffer_.prepare(kHttp2Preface.size() - data.size());
+    io::Result<size_t> res =
+        socket_->Recv(io::MutableBytes{static_cast<uint8_t*>(mb.data()), mb.size()});
+    if (!res)
+      return nonstd::make_unexpected(res.error());
+    if (*res == 0)
+      return nonstd::make_unexpected(make_error_code(errc::connection_aborted));
+    req_buffer_.commit(*res);
+  }
+
+  string_view data{static_cast<const char*>(req_buffer_.data().data()), req_buffer_.size()};
+  return absl::StartsWith(data, kHttp2Preface);
+}
+
+void HttpConnection::HandleHttp2() {
+  // The session reads directly from the socket, so req_buffer_ is released.
+  string preread{static_cast<const char*>(req_buffer_.data().data()), req_buffer_.size()};
+  req_buffer_.consume(req_buffer_.size());
+  req_buffer_.shrink_to_fit();
+
+  auto handler = [this](RequestType&& req, HttpContext* cntx) {
+    VLOG(1) << "Full Url: " << req.target();
+    MarkActive();
+    HandleSingleRequest(std::move(req), cntx);
+    MarkActive();
+  };
+  http::Http2Session session(socket_.get(), std::move(handler), *owner_->http2_opts_);
+  error_code ec = session.Run(io::Buffer(preread), user_data_);
+
+  VLOG(1) << "Http2 connection exit " << ec.message();
+  LOG_IF(INFO, ec && !FiberSocketBase::IsConnClosed(ec)) << "Http2 error " << ec.message();
+}
+
 void HttpConnection::HandleRequests() {
   CHECK(socket_->IsOpen());
 
   ::boost::system::error_code ec;
 
+  if (owner_->http2_opts_) {
+    io::Result<bool> is_h2 = ReadHttp2Preface();
+    if (!is_h2) {
+      VLOG(1) << "HttpConnection exit " << is_h2.error().message();
+      return;
+    }
+    if (*is_h2)
+      return HandleHttp2();
+  }
+
   AsioStreamAdapter<> asa(*socket_);
   RequestType request;
 
   HttpContext cntx(asa);
   cntx.set_user_data(user_data_);
 
+  bool corked = false;
+  size_t body_charged = 0;  // the body capacity accounted to the connection.
   while (true) {
-    ParserType parser;
+    // Parses the request into the object of the previous one to reuse its allocations.
+    ResetRequest(&request);
+    ParserType parser(std::move(request));
+    parser.body_limit(BodyLimit(memory(), body_charged));
+
+    // Do not hold a read buffer while the connection is idle.
+    if (req_buffer_.size() == 0) {
+      req_buffer_.shrink_to_fit();
+      if (error_code wait_ec = socket_->WaitReadable(); wait_ec) {
+        VLOG(1) << "HttpConnection exit " << wait_ec.message();
+        LOG_IF(INFO, !FiberSocketBase::IsConnClosed(wait_ec)) << "Http error " << wait_ec.message();
+        memory()->Release(body_charged);
+        return;
+      }
 
-    // h2::read sets parser.eager=true
-    // This function reads from the socket until parser reaches done state or error is encountered.
-    h2::read(asa, req_buffer_, parser, ec);
-    if (ec) {
-      break;
+      // The connection holds no buffers of its proactor between requests, so it moves to
+      // another one here if the rebalancer or the server asked for it.
+      MaybeMigrate();
     }
 
-    if (!parser.is_done()) {
-      LOG(DFATAL) << "Incomplete http parsing";
+    // Reads from the socket until the request is complete or an error is encountered.
+    ReadStringMessage(asa, req_buffer_, parser, kDirectBodyMinSize, ec);
+    if (ec) {
       break;
     }
     request = parser.release();
 
+    size_t body_cap = request.body().capacity();
+    if (body_cap > body_charged) {
+      if (!memory()->TryCharge(body_cap - body_charged)) {
+        ec = h2::error::body_limit;
+        break;
+      }
+    } else {
+      memory()->Release(body_charged - body_cap);
+    }
+    body_charged = body_cap;
+
+    // If the client pipelines, the next requests are already in req_buffer_ and h2::read
+    // parses them without reading from the socket. Their responses are coalesced and sent
+    // with a single write once the buffered requests are handled.
+    if (req_buffer_.size() > 0) {
+      if (!corked) {
+        corked = true;
+        socket_->SetWriteCoalescing(kPipelineCorkLimit);
+      }
+    }
+
+    // A request that is being served does not count as idle time, see SetIdleTimeout.
     VLOG(1) << "Full Url: " << request.target();
+    MarkActive();
     HandleSingleRequest(std::move(request), &cntx);
+    MarkActive();
+
+    if (corked && req_buffer_.size() == 0) {
+      corked = false;
+      if (error_code flush_ec = socket_->SetWriteCoalescing(0); flush_ec) {
+        ec = boost::system::error_code{flush_ec.value(), boost::system::system_category()};
+        break;
+      }
+    }
   }
 
+  if (corked)
+    socket_->SetWriteCoalescing(0);
+  memory()->Release(body_charged);
+
   VLOG(1) << "HttpConnection exit " << ec.message();
   LOG_IF(INFO, !FiberSocketBase::IsConnClosed(ec)) << "Http error " << ec.message();
 }
@@ -429,27 +784,43 @@ bool HttpConnection::CheckRequestAuthorization(const RequestType& req, HttpConte
 void HttpConnection::HandleSingleRequest(RequestType&& req, HttpContext* cntx) {
   CHECK(owner_);
 
-  std::string target{ToStd(req.target())};
-  auto [path, query] = ParseQuery(target);
+  // path and query reference the request, which stays intact unless it is passed to
+  // a RequestCbExt callback.
+  auto [path, query] = ParseQuery(ToStd(req.target()));
 
+  cntx->set_encoding(ContentEncoding::kIdentity, 0);
   if (!CheckRequestAuthorization(req, cntx, path))
     return;
 
-  if (owner_->HandleRoot(req, cntx)) {
+  ContentEncoding encoding = ContentEncoding::kIdentity;
+  size_t min_size = owner_->compress_min_size_.value_or(0);
+  if (owner_->compress_min_size_)
+    encoding = NegotiateEncoding(ToStd(req[h2::field::accept_encoding]));
+
+  cntx->set_encoding(encoding, min_size);
+  if (owner_->HandleRoot(req, path, query, cntx)) {
     return;
   }
   VLOG(2) << "Searching for " << path;
 
-  auto it = owner_->cb_map_.find(path);
-  if (it == owner_->cb_map_.end()) {
+  const HttpListenerBase::CbInfo* info = owner_->router_.Find(path);
+  if (!info) {
     h2::response<h2::string_body> resp(h2::status::unauthorized, req.version());
     return cntx->Invoke(std::move(resp));
   }
-  auto args = SplitQuery(query);
-  if (std::holds_alternative<HttpListenerBase::RequestCb>(it->second)) {
-    std::get<HttpListenerBase::RequestCb>(it->second)(args, cntx);
+
+  if (!info->compress)
+    cntx->set_encoding(ContentEncoding::kIdentity, 0);
+
+  const auto& cb = info->cb;
+  if (std::holds_alternative<HttpListenerBase::RequestCbRaw>(cb)) {
+    std::get<HttpListenerBase::RequestCbRaw>(cb)(query, cntx);
+  } else if (std::holds_alternative<HttpListenerBase::RequestCb>(cb)) {
+    std::get<HttpListenerBase::RequestCb>(cb)(SplitQuery(query), cntx);
   } else {
-    std::get<HttpListenerBase::RequestCbExt>(it->second)(args, std::move(req), cntx);
+    // The callback may release the request before it is done with the args.
+    std::string query_copy{query};
+    std::get<HttpListenerBase::RequestCbExt>(cb)(SplitQuery(query_copy), std::move(req), cntx);
   }
 }
 
@@ -7,25 +7,61 @@
 #include <absl/container/flat_hash_map.h>
 
 #include <boost/beast/core.hpp>  // for flat_buffer.
+#include <boost/beast/http/empty_body.hpp>
 #include <boost/beast/http/serializer.hpp>
 #include <boost/beast/http/write.hpp>
+#include <memory>
+#include <optional>
 #include <string_view>
+#include <variant>
 
 #include "util/asio_stream_adapter.h"
 #include "util/connection.h"
+#include "util/fibers/read_buffer_pool.h"
+#include "util/http/encoding.h"
+#include "util/http/http2_session.h"
 #include "util/http/http_server_utils.h"
+#include "util/http/path_router.h"
 #include "util/listener_interface.h"
 
 namespace util {
 
+namespace fb2 {
+class SamplingProfiler;
+}  // namespace fb2
+
 class HttpContext {
   template <typename Body> using Response = ::boost::beast::http::response<Body>;
   using error_code = ::boost::system::error_code;
 
-  AsioStreamAdapter<>& asa_;
+  // Passes the compressed chunks to WriteRawChunk.
+  class ChunkSink : public ::io::Sink {
+   public:
+    explicit ChunkSink(HttpContext* cntx) : cntx_(cntx) {
+    }
+
+    ::io::Result<size_t> WriteSome(const iovec* v, uint32_t len) final;
+
+   private:
+    HttpContext* cntx_;
+  };
+
+  // Exactly one of them is set.
+  AsioStreamAdapter<>* asa_ = nullptr;
+  http::Http2Stream* h2_stream_ = nullptr;
   void* user_data_ = nullptr;
+
+  http::ContentEncoding encoding_ = http::ContentEncoding::kIdentity;
+  size_t min_encode_size_ = 0;
+  ChunkSink chunk_sink_{this};
+  std::unique_ptr<http::BodyEncoder> chunk_encoder_;
+
  public:
-  explicit HttpContext(AsioStreamAdapter<>& asa) : asa_(asa) {
+  explicit HttpContext(AsioStreamAdapter<>& asa) : asa_(&asa) {
+  }
+
+  // The context of a request of an HTTP/2 connection, see http::Http2Session.
+  explicit HttpContext(http::Http2Stream* stream) : h2_stream_(stream) {
   }
 
   void set_user_data(void* ud) {
@@ -36,6 +72,13 @@ class HttpContext {
     return user_data_;
   }
 
+  // Set by HttpConnection for each request. String bodies of at least min_size bytes and
+  // all the chunked bodies are compressed with enc.
+  void set_encoding(http::ContentEncoding enc, size_t min_size) {
+    encoding_ = enc;
+    min_encode_size_ = min_size;
+  }
+
   template <typename Body> void Invoke(Response<Body>&& msg) {
     // Determine if we should close the connection after
     // close_ = msg.need_eof();
@@ -44,22 +87,91 @@ class HttpContext {
     // a non-const file_body, and the message oriented version of
     // http::write only works with const messages.
     namespace h2 = ::boost::beast::http;
+    if constexpr (std::is_same_v<Body, h2::string_body>) {
+      if (encoding_ != http::ContentEncoding::kIdentity &&
+          msg.body().size() >= min_encode_size_ && msg[h2::field::content_encoding].empty()) {
+        msg.body() = http::EncodeBody(encoding_, msg.body());
+        msg.set(h2::field::content_encoding, std::string{http::EncodingName(encoding_)});
+        msg.set(h2::field::vary, "Accept-Encoding");
+      }
+    }
+
     msg.prepare_payload();
     h2::response_serializer<Body> sr{msg};
 
     ::boost::system::error_code ec;
-    h2::write(asa_, sr, ec);
+    if (h2_stream_) {
+      // HTTP/2 frames the body itself.
+      msg.chunked(false);
+      WriteHttp2(msg.result_int(), msg.base(), &sr);
+      return;
+    }
+    h2::write(*asa_, sr, ec);
   }
 
+  // Not supported for HTTP/2 requests.
   template <typename Serializer>::boost::system::error_code Write(const Serializer& ser) {
     namespace h2 = ::boost::beast::http;
 
     ::boost::system::error_code ec;
-    h2::write(asa_, ser, ec);
+    if (h2_stream_)
+      return ::boost::system::errc::make_error_code(::boost::system::errc::not_supported);
+    h2::write(*asa_, ser, ec);
     return ec;
   }
+
+  // Streams the response body with chunked transfer encoding, so large responses are not
+  // materialized in memory. Sends the header of msg, which must not have a body, then
+  // each WriteChunk call sends its buffers directly to the socket and blocks until the
+  // socket accepts them. EndChunked terminates the response.
+  // If compression is negotiated, the chunks pass through a streaming compressor instead.
+  // The errors of the socket or the stream are returned as they are.
+  std::error_code BeginChunked(Response<::boost::beast::http::empty_body>&& msg);
+  std::error_code WriteChunk(const iovec* v, uint32_t len);
+  std::error_code WriteChunk(std::string_view str) {
+    iovec v{const_cast<char*>(str.data()), str.size()};
+    return WriteChunk(&v, 1);
+  }
+  std::error_code EndChunked();
+
+ private:
+  std::error_code WriteRawChunk(const iovec* v, uint32_t len);
+
+  // Sends the response as HTTP/2 headers and data. The serializer produces an HTTP/1.1
+  // message, whose header part is skipped.
+  template <typename Serializer>
+  void WriteHttp2(unsigned status, const ::boost::beast::http::fields& fields, Serializer* sr);
+  std::error_code BeginHttp2(unsigned status, const ::boost::beast::http::fields& fields);
+  std::error_code WriteHttp2Data(const iovec* v, uint32_t len);
+  std::error_code EndHttp2();
 };
 
+template <typename Serializer>
+void HttpContext::WriteHttp2(unsigned status, const ::boost::beast::http::fields& fields,
+                             Serializer* sr) {
+  if (BeginHttp2(status, fields))
+    return;
+
+  sr->split(true);
+  error_code ec;
+  std::error_code write_ec;
+  while (!ec && !write_ec && !sr->is_done()) {
+    sr->next(ec, [&](error_code& ec, const auto& buffers) {
+      size_t n = 0;
+      for (const auto& buf : ::boost::beast::buffers_range_ref(buffers)) {
+        if (!write_ec && sr->is_header_done()) {
+          iovec v{const_cast<void*>(buf.data()), buf.size()};
+          write_ec = WriteHttp2Data(&v, 1);
+        }
+        n += buf.size();
+      }
+      sr->consume(n);
+    });
+  }
+  if (!ec && !write_ec)
+    EndHttp2();
+}
+
 // Should be one per process. Represents http server interface.
 // Currently does not support on the fly updates - requires
 // multi-threading support.
@@ -75,13 +187,21 @@ class HttpListenerBase : public ListenerInterface {
   // Extended callback that allows to pass the request object.
   typedef std::function<void(const http::QueryArgs&, RequestType&&,  HttpContext*)> RequestCbExt;
 
+  // Receives the raw query string, so the query args are not split for handlers that do not
+  // read them. Use http::SplitQuery to parse it.
+  typedef std::function<void(std::string_view query, HttpContext*)> RequestCbRaw;
+
   HttpListenerBase();
 
-  // Returns true if a callback was registered.
-  bool RegisterCb(std::string_view path, RequestCb cb);
+  // Returns true if a callback was registered. If compress is true, the responses of cb are
+  // compressed when compression is enabled, see enable_compression.
+  // path may contain "*" segments, see http::PathRouter. For example, "/api/*" handles all
+  // the paths under /api that no other callback matches more specifically.
+  bool RegisterCb(std::string_view path, RequestCb cb, bool compress = false);
 
   // Returns true if a callback was registered.
-  bool RegisterCb(std::string_view path, RequestCbExt cb);
+  bool RegisterCb(std::string_view path, RequestCbExt cb, bool compress = false);
+  bool RegisterCb(std::string_view path, RequestCbRaw cb, bool compress = false);
 
   void set_resource_prefix(std::string_view prefix) {
     resource_prefix_ = prefix;
@@ -95,6 +215,25 @@ class HttpListenerBase : public ListenerInterface {
     enable_metrics_ = true;
   }
 
+  // Compresses the responses of the built-in pages, e.g. /metrics and the status page, and of
+  // the callbacks registered with compress=true, if the client accepts zstd or gzip.
+  // String bodies smaller than min_size are sent as is.
+  void enable_compression(size_t min_size = 1024) {
+    compress_min_size_ = min_size;
+  }
+
+  // Serves HTTP/2 on the connections that start with the HTTP/2 connection preface, i.e.
+  // the clients with prior knowledge and the TLS clients that negotiated "h2", see
+  // tls::SslSetServerAlpn. The callbacks handle both protocols.
+  void enable_http2(const http::Http2Session::Options& opts = {}) {
+    http2_opts_ = opts;
+  }
+
+  // Serves the folded stacks of profiler at /samplez. The profiler must outlive the listener.
+  void set_sampling_profiler(fb2::SamplingProfiler* profiler) {
+    sampling_profiler_ = profiler;
+  }
+
   // Overrides the http response send by the backend.
   void set_root_response(const std::string& response) {
     root_response_ = response;
@@ -108,16 +247,23 @@ class HttpListenerBase : public ListenerInterface {
   }
 
  private:
-  bool HandleRoot(const RequestType& rt, HttpContext* cntx) const;
+  bool HandleRoot(const RequestType& rt, std::string_view path, std::string_view query,
+                  HttpContext* cntx) const;
 
-  using CbInfo = std::variant<RequestCb, RequestCbExt>;
+  struct CbInfo {
+    std::variant<RequestCb, RequestCbExt, RequestCbRaw> cb;
+    bool compress = false;
+  };
 
-  absl::flat_hash_map<std::string_view, CbInfo> cb_map_;
+  http::PathRouter<CbInfo> router_;
 
   std::string favicon_url_;
   std::string resource_prefix_;
   std::string root_response_;
   bool enable_metrics_ = false;
+  std::optional<size_t> compress_min_size_;
+  std::optional<http::Http2Session::Options> http2_opts_;
+  fb2::SamplingProfiler* sampling_profiler_ = nullptr;
 
   std::function<bool(std::string_view path, std::string_view username, std::string_view password)>
       auth_functor_;
@@ -147,8 +293,15 @@ class HttpConnection : public Connection {
   bool CheckRequestAuthorization(const RequestType& req, HttpContext* cntx, std::string_view path);
 
  private:
+  // Reads the first bytes of the connection into req_buffer_ and returns whether they are
+  // the HTTP/2 connection preface.
+  ::io::Result<bool> ReadHttp2Preface();
+  void HandleHttp2();
+
   const HttpListenerBase* owner_;
-  ::boost::beast::flat_buffer req_buffer_;
+
+  // Borrowed from the thread ReadBufferPool only while a request is being read.
+  ::boost::beast::basic_flat_buffer<fb2::ReadBufferAllocator<char>> req_buffer_;
   void* user_data_ = nullptr;
 };
 
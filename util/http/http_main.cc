@@ -5,15 +5,20 @@
 #include <absl/flags/usage.h>
 #include <absl/flags/usage_config.h>
 #include <absl/strings/match.h>
+#include <absl/strings/numbers.h>
 #include <absl/strings/str_join.h>
-#include <mimalloc-new-delete.h>
 
 #include <boost/beast/http/span_body.hpp>
 
 #include "base/init.h"
 #include "util/accept_server.h"
+#include "util/fibers/memory_pressure.h"
+#include "util/fibers/mi_heap_resource.h"
 #include "util/fibers/pool.h"
+#include "util/fibers/sampling_profiler.h"
 #include "util/html/sorted_table.h"
+#include "util/http/heap_sampling_new_delete.h"
+#include "util/http/heapz_handler.h"
 #include "util/http/http_common.h"
 #include "util/http/http_handler.h"
 #include "util/metrics/metrics.h"
@@ -30,43 +35,26 @@ ABSL_FLAG(bool, use_incoming_cpu, false,
           "If true uses incoming cpu of a socket in order to distribute incoming connections");
 ABSL_FLAG(string, password, "", "Protect the web interface with this password.");
 ABSL_FLAG(string, root_resp, "", "If set, overrides root page response");
+ABSL_FLAG(uint32_t, sampling_hz, 0,
+          "If positive, runs the sampling profiler with this frequency and serves it at /samplez");
+ABSL_FLAG(uint64_t, heap_sample_rate, 0,
+          "If positive, samples an allocation per that many bytes on average, see /heapz");
+ABSL_FLAG(bool, mi_heaps, false,
+          "If true, binds mimalloc heaps to the proactors and to the connections");
 
 VarzQps http_qps("bar-qps");
 metrics::CounterFamily http_req("http_requests_total", "Number of served http requests");
 
 namespace {
-class MyListener : public HttpListener<> {
- public:
-  ProactorBase* PickConnectionProactor(FiberSocketBase* sock);
-};
-
-ProactorBase* MyListener::PickConnectionProactor(FiberSocketBase* sock) {
-#ifdef __linux__
-  int fd = sock->native_handle();
-
-  int cpu;
-  socklen_t len = sizeof(cpu);
-
-  CHECK_EQ(0, getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len));
-  VLOG(1) << "Got socket from cpu " << cpu;
-
-  bool use_incoming = GetFlag(FLAGS_use_incoming_cpu);
-  if (use_incoming) {
-    vector<unsigned> ids = pool()->MapCpuToThreads(cpu);
-    if (!ids.empty()) {
-      return pool()->at(ids.front());
-    }
-  }
-#endif
-
-  return pool()->GetNextProactor();
-}
 
 void ServerRun(ProactorPool* pool) {
   AcceptServer server(pool);
   http_req.Init(pool, {"type", "handle"});
+  metrics::CounterFamily::Handle foo_req = http_req.Bind({"get", "foo"});
 
-  HttpListener<>* listener = new MyListener;
+  HttpListener<>* listener = new HttpListener<>;
+  if (GetFlag(FLAGS_use_incoming_cpu))
+    listener->SetConnectionPlacement(ListenerInterface::ConnectionPlacement::INCOMING_CPU);
   std::string pass = GetFlag(FLAGS_password);
   listener->SetAuthFunctor([pass = std::move(pass)](std::string_view path,
                                                     std::string_view username,
@@ -76,14 +64,14 @@ void ServerRun(ProactorPool* pool) {
     }
     return password == pass && username == "default";
   });
-  auto cb = [](const http::QueryArgs& args, HttpContext* send) {
+  auto cb = [&foo_req](const http::QueryArgs& args, HttpContext* send) {
     http::StringResponse resp = http::MakeStringResponse(h2::status::ok);
     resp.body() = "Bar";
 
     http::SetMime(http::kTextMime, &resp);
     resp.set(h2::field::server, "http_main");
     http_qps.Inc();
-    http_req.IncBy({"get", "foo"}, 1);
+    foo_req.Inc();
 
     return send->Invoke(std::move(resp));
   };
@@ -121,6 +109,41 @@ void ServerRun(ProactorPool* pool) {
   };
   listener->RegisterCb("/table", table_cb);
 
+  // Streams a page of a large table, e.g. /jsontable?offset=1000&limit=500.
+  auto json_table_cb = [](const http::QueryArgs& args, HttpContext* send) {
+    html::JsonTable::Page page;
+    for (const auto& [name, value] : args) {
+      if (name == "offset")
+        (void)absl::SimpleAtoi(value, &page.offset);
+      else if (name == "limit")
+        (void)absl::SimpleAtoi(value, &page.limit);
+    }
+
+    h2::response<h2::empty_body> resp{h2::status::ok, 11};
+    resp.set(h2::field::content_type, http::kHtmlMime);
+    std::error_code ec = send->BeginChunked(std::move(resp));
+
+    html::JsonTable table(
+        [&](string_view piece) {
+          if (!ec)
+            ec = send->WriteChunk(piece);
+        },
+        page);
+    table.Start("Large table", {"Row", "Col1", "Col2"});
+    for (size_t i = 0; i < 500000; ++i) {
+      if (table.NeedRow())
+        table.Row({absl::StrCat(i), absl::StrCat("Val1_", i), absl::StrCat("Val2_", i % 97)});
+      else
+        table.SkipRow();
+    }
+    table.End();
+
+    if (!ec)
+      ec = send->EndChunked();
+    http_req.IncBy({"get", "jsontable"}, 1);
+  };
+  listener->RegisterCb("/jsontable", json_table_cb);
+
   auto post_cb = [](const http::QueryArgs& args, util::HttpListenerBase::RequestType&& req,
                     HttpContext* send) {
     if (req.method() != h2::verb::post) {
@@ -139,13 +162,36 @@ void ServerRun(ProactorPool* pool) {
   listener->RegisterCb("/post", post_cb);
 
   listener->enable_metrics();
+  listener->enable_compression();
+  listener->enable_http2();
+  http::RegisterHeapzHandler(pool, listener);
   listener->set_root_response(GetFlag(FLAGS_root_resp));
 
+  fb2::SamplingProfiler profiler(pool);
+  if (uint32_t hz = GetFlag(FLAGS_sampling_hz); hz > 0 && !profiler.Start(hz))
+    listener->set_sampling_profiler(&profiler);
+
+  // Returns the free pages of the mimalloc heap of each proactor to the OS under pressure.
+  fb2::MemoryPressureMonitor memory_monitor(pool);
+  memory_monitor.AddShrinkCallback([](fb2::MemoryPressureMonitor::Level level) {
+    mi_collect(level == fb2::MemoryPressureMonitor::kCritical);
+  });
+  memory_monitor.Start();
+
+  fb2::MiHeapBinding heap_binding(pool);
+  if (GetFlag(FLAGS_mi_heaps)) {
+    heap_binding.Start();
+    heap_binding.BindListener(listener);
+  }
+
   uint16_t port = server.AddListener(GetFlag(FLAGS_port), listener);
   LOG(INFO) << "Listening on port " << port;
 
   server.Run();
   server.Wait();
+  heap_binding.Stop();
+  memory_monitor.Stop();
+  profiler.Stop();
 }
 
 string LabelTuple(const metrics::ObservationDescriptor& od, unsigned label_index,
@@ -203,6 +249,7 @@ int main(int argc, char** argv) {
   pool.reset(fb2::Pool::Epoll());
 #endif
 
+  base::HeapSampler::SetSamplingRate(GetFlag(FLAGS_heap_sample_rate));
   pool->Run();
   http_qps.Init(pool.get());
   ServerRun(pool.get());
@@ -17,6 +17,9 @@ namespace http {
 using QueryParam = std::pair<std::string_view, std::string_view>;
 typedef std::vector<QueryParam> QueryArgs;
 
+// Splits the query part of the url into args. The args reference query.
+QueryArgs SplitQuery(std::string_view query);
+
 typedef ::boost::beast::http::response<::boost::beast::http::string_body> StringResponse;
 
 inline StringResponse MakeStringResponse(
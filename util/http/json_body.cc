@@ -0,0 +1,55 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/http/json_body.h"
+
+#include <absl/strings/str_cat.h>
+
+#include "base/logging.h"
+#include "util/asio_stream_adapter.h"
+#include "util/fibers/fiber_local.h"
+#include "util/http/http_common.h"
+
+namespace util {
+namespace http {
+
+using namespace std;
+namespace h2 = boost::beast::http;
+
+static_assert(kBodyTailRoom >= simdjson::SIMDJSON_PADDING);
+
+namespace {
+
+fb2::FiberLocal<simdjson::ondemand::parser> json_parser;
+
+}  // namespace
+
+JsonResult ParseJsonBody(HttpListenerBase::RequestType* req) {
+  string& body = req->body();
+  if (body.capacity() < body.size() + simdjson::SIMDJSON_PADDING)
+    body.reserve(body.size() + simdjson::SIMDJSON_PADDING);
+
+  return json_parser->iterate(
+      simdjson::padded_string_view(body.data(), body.size(), body.capacity()));
+}
+
+bool RegisterJsonCb(HttpListenerBase* listener, string_view path, JsonRequestCb cb) {
+  HttpListenerBase::RequestCbExt ext_cb = [cb = std::move(cb)](const QueryArgs& args,
+                                                               HttpListenerBase::RequestType&& req,
+                                                               HttpContext* cntx) {
+    JsonResult doc = ParseJsonBody(&req);
+    if (doc.error()) {
+      VLOG(1) << "Invalid json body: " << simdjson::error_message(doc.error());
+      StringResponse resp = MakeStringResponse(h2::status::bad_request);
+      SetMime(kTextMime, &resp);
+      resp.body() = absl::StrCat("Invalid json: ", simdjson::error_message(doc.error()), "\n");
+      return cntx->Invoke(std::move(resp));
+    }
+    cb(args, req, doc.value_unsafe(), cntx);
+  };
+  return listener->RegisterCb(path, std::move(ext_cb));
+}
+
+}  // namespace http
+}  // namespace util
@@ -0,0 +1,39 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <simdjson.h>
+
+#include <functional>
+#include <string_view>
+
+#include "util/http/http_handler.h"
+
+// Lives in http_json_lib, so that http_server_lib does not depend on simdjson.
+
+namespace util {
+namespace http {
+
+using JsonDocument = ::simdjson::ondemand::document;
+using JsonResult = ::simdjson::simdjson_result<JsonDocument>;
+
+// Parses the body of req in place with the simdjson on-demand parser of the calling fiber,
+// i.e. of the connection that handles the request, which keeps its buffers between the
+// requests. The bodies that HttpConnection reads directly from the socket have room for the
+// simdjson padding, smaller ones are grown first. The document refers to the body and to
+// the parser, hence it is valid until the body changes or the fiber parses the next body.
+JsonResult ParseJsonBody(HttpListenerBase::RequestType* req);
+
+// Handles a request with a json body that was parsed with ParseJsonBody.
+using JsonRequestCb = std::function<void(const QueryArgs&, const HttpListenerBase::RequestType&,
+                                         JsonDocument&, HttpContext*)>;
+
+// Registers cb as a RequestCbExt at path. Requests whose body is not a json document are
+// answered with 400 Bad Request. On-demand parsing validates the document lazily, hence cb
+// must still check the errors of the values it reads.
+bool RegisterJsonCb(HttpListenerBase* listener, std::string_view path, JsonRequestCb cb);
+
+}  // namespace http
+}  // namespace util
@@ -0,0 +1,72 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/http/json_body.h"
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "util/fibers/fibers.h"
+
+namespace util::http {
+
+using namespace std;
+
+class JsonBodyTest : public testing::Test {
+ protected:
+  static HttpListenerBase::RequestType MakeRequest(string_view body) {
+    HttpListenerBase::RequestType req;
+    req.body() = body;
+    req.body().shrink_to_fit();
+    return req;
+  }
+};
+
+TEST_F(JsonBodyTest, Parse) {
+  HttpListenerBase::RequestType req = MakeRequest(R"({"name": "foo", "ids": [1, 2, 3]})");
+  JsonResult doc = ParseJsonBody(&req);
+  ASSERT_FALSE(doc.error());
+  EXPECT_GE(req.body().capacity(), req.body().size() + simdjson::SIMDJSON_PADDING);
+
+  string_view name;
+  ASSERT_FALSE(doc["name"].get_string().get(name));
+  EXPECT_EQ("foo", name);
+
+  int64_t sum = 0;
+  for (auto id : doc["ids"].get_array()) {
+    sum += id.get_int64().value();
+  }
+  EXPECT_EQ(6, sum);
+}
+
+TEST_F(JsonBodyTest, Invalid) {
+  HttpListenerBase::RequestType req = MakeRequest(R"({"name": "foo)");
+  EXPECT_TRUE(ParseJsonBody(&req).error());
+
+  req = MakeRequest("");
+  EXPECT_TRUE(ParseJsonBody(&req).error());
+}
+
+// Every fiber, i.e. every connection, parses with its own parser.
+TEST_F(JsonBodyTest, Fibers) {
+  HttpListenerBase::RequestType req1 = MakeRequest(R"({"id": 1})");
+  HttpListenerBase::RequestType req2 = MakeRequest(R"({"id": 2})");
+  int64_t id1 = 0, id2 = 0;
+
+  fb2::Fiber fb1("json1", [&] {
+    JsonResult doc = ParseJsonBody(&req1);
+    ThisFiber::Yield();
+    id1 = doc["id"].get_int64().value();
+  });
+  fb2::Fiber fb2("json2", [&] {
+    JsonResult doc = ParseJsonBody(&req2);
+    ThisFiber::Yield();
+    id2 = doc["id"].get_int64().value();
+  });
+  fb1.Join();
+  fb2.Join();
+  EXPECT_EQ(1, id1);
+  EXPECT_EQ(2, id2);
+}
+
+}  // namespace util::http
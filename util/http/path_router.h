@@ -0,0 +1,120 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace util {
+namespace http {
+
+// Maps url paths to values with a trie of the path segments, so that a lookup costs a hash
+// probe per segment and does not allocate.
+// Patterns are paths, e.g. "/metrics", whose segments may be "*":
+//   "/shards/*/stats" - a "*" segment matches any single segment.
+//   "/static/*"       - a trailing "*" matches the rest of the path, including "/static".
+// Literal segments take precedence over "*" segments, which take precedence over the
+// trailing ones. Empty segments are literals, i.e. "/a/" and "/a" are different paths.
+template <typename T> class PathRouter {
+ public:
+  // Returns false if the pattern is already registered.
+  bool Add(std::string_view pattern, T value);
+
+  // Returns the value of the best matching pattern or null. path must not contain the query.
+  const T* Find(std::string_view path) const {
+    path = StripSlash(path);
+    return Find(root_, path, path.empty());
+  }
+
+ private:
+  struct Node {
+    absl::flat_hash_map<std::string, std::unique_ptr<Node>> children;
+    std::unique_ptr<Node> any;  // the "*" segment.
+    std::optional<T> value;     // a pattern ends at this node.
+    std::optional<T> rest;      // a pattern ends with "*" below this node.
+  };
+
+  static std::string_view StripSlash(std::string_view path) {
+    if (!path.empty() && path.front() == '/')
+      path.remove_prefix(1);
+    return path;
+  }
+
+  // Splits the first segment off path. Sets at_end if it was the last one.
+  static std::string_view NextSegment(std::string_view* path, bool* at_end) {
+    size_t pos = path->find('/');
+    std::string_view seg = path->substr(0, pos);
+    *at_end = pos == std::string_view::npos;
+    path->remove_prefix(*at_end ? path->size() : pos + 1);
+    return seg;
+  }
+
+  static const T* Find(const Node& node, std::string_view path, bool at_end);
+
+  Node root_;
+};
+
+template <typename T> bool PathRouter<T>::Add(std::string_view pattern, T value) {
+  Node* node = &root_;
+  std::string_view path = StripSlash(pattern);
+  bool at_end = path.empty();
+
+  while (!at_end) {
+    std::string_view seg = NextSegment(&path, &at_end);
+    if (seg == "*") {
+      if (at_end) {
+        if (node->rest)
+          return false;
+        node->rest.emplace(std::move(value));
+        return true;
+      }
+      if (!node->any)
+        node->any = std::make_unique<Node>();
+      node = node->any.get();
+      continue;
+    }
+
+    auto [it, inserted] = node->children.try_emplace(seg);
+    if (inserted)
+      it->second = std::make_unique<Node>();
+    node = it->second.get();
+  }
+
+  if (node->value)
+    return false;
+  node->value.emplace(std::move(value));
+  return true;
+}
+
+template <typename T>
+const T* PathRouter<T>::Find(const Node& node, std::string_view path, bool at_end) {
+  if (at_end) {
+    if (node.value)
+      return &*node.value;
+    return node.rest ? &*node.rest : nullptr;
+  }
+
+  bool next_end;
+  std::string_view seg = NextSegment(&path, &next_end);
+
+  if (auto it = node.children.find(seg); it != node.children.end()) {
+    if (const T* res = Find(*it->second, path, next_end); res)
+      return res;
+  }
+
+  if (node.any) {
+    if (const T* res = Find(*node.any, path, next_end); res)
+      return res;
+  }
+
+  return node.rest ? &*node.rest : nullptr;
+}
+
+}  // namespace http
+}  // namespace util
@@ -0,0 +1,72 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/http/path_router.h"
+
+#include "base/gtest.h"
+#include "base/logging.h"
+#include "util/http/http_server_utils.h"
+
+namespace util::http {
+
+using namespace std;
+
+class PathRouterTest : public testing::Test {
+ protected:
+  int Find(string_view path) const {
+    const int* res = router_.Find(path);
+    return res ? *res : -1;
+  }
+
+  PathRouter<int> router_;
+};
+
+TEST_F(PathRouterTest, Exact) {
+  EXPECT_TRUE(router_.Add("/", 1));
+  EXPECT_TRUE(router_.Add("/health", 2));
+  EXPECT_TRUE(router_.Add("/api/v1/meta", 3));
+  EXPECT_FALSE(router_.Add("/health", 4));
+
+  EXPECT_EQ(1, Find("/"));
+  EXPECT_EQ(2, Find("/health"));
+  EXPECT_EQ(3, Find("/api/v1/meta"));
+  EXPECT_EQ(-1, Find("/health/"));
+  EXPECT_EQ(-1, Find("/healthz"));
+  EXPECT_EQ(-1, Find("/api/v1"));
+  EXPECT_EQ(-1, Find("/api/v1/meta/x"));
+}
+
+TEST_F(PathRouterTest, Wildcards) {
+  EXPECT_TRUE(router_.Add("/static/*", 1));
+  EXPECT_TRUE(router_.Add("/static/index.html", 2));
+  EXPECT_TRUE(router_.Add("/shards/*/stats", 3));
+  EXPECT_TRUE(router_.Add("/shards/0/stats", 4));
+  EXPECT_TRUE(router_.Add("/*", 5));
+  EXPECT_FALSE(router_.Add("/static/*", 6));
+
+  EXPECT_EQ(1, Find("/static"));
+  EXPECT_EQ(1, Find("/static/a/b.js"));
+  EXPECT_EQ(2, Find("/static/index.html"));
+  EXPECT_EQ(1, Find("/static/index.html/x"));
+  EXPECT_EQ(3, Find("/shards/7/stats"));
+  EXPECT_EQ(4, Find("/shards/0/stats"));
+
+  // Backtracks to the trailing wildcard of the root.
+  EXPECT_EQ(5, Find("/shards/7"));
+  EXPECT_EQ(5, Find("/shards/7/stats/x"));
+  EXPECT_EQ(5, Find("/"));
+  EXPECT_EQ(5, Find("/other"));
+}
+
+TEST_F(PathRouterTest, SplitQuery) {
+  EXPECT_TRUE(SplitQuery("").empty());
+
+  QueryArgs args = SplitQuery("a=1&b&c=");
+  ASSERT_EQ(3u, args.size());
+  EXPECT_EQ(QueryParam("a", "1"), args[0]);
+  EXPECT_EQ(QueryParam("b", ""), args[1]);
+  EXPECT_EQ(QueryParam("c", ""), args[2]);
+}
+
+}  // namespace util::http
@@ -0,0 +1,136 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <cassert>
+#include <memory>
+#include <string_view>
+
+#include "io/io.h"
+#include "util/http/http_handler.h"
+
+namespace util {
+namespace http {
+
+// Output stream for rapidjson::Writer that fills a fixed buffer and writes it out whenever
+// it is full, so that a document is streamed with the memory of the buffer instead of being
+// built in a StringBuffer first. Put is inlined and does not allocate, the buffer is
+// allocated once by the constructor. rapidjson calls Flush when the root value is complete.
+// The writes block the calling fiber. rapidjson has no way to report errors, hence the first
+// error stops the stream and the rest of the output is dropped, see the error accessors of
+// the derived streams.
+class RjOutputStreamBase {
+ public:
+  using Ch = char;
+
+  static constexpr size_t kDefaultBufSize = 16384;
+
+  RjOutputStreamBase(const RjOutputStreamBase&) = delete;
+  RjOutputStreamBase& operator=(const RjOutputStreamBase&) = delete;
+
+  void Put(Ch c) {
+    if (cur_ == end_)
+      Drain();
+    *cur_++ = c;
+  }
+
+  void Flush() {
+    Drain();
+  }
+
+  // Bytes passed to Put so far.
+  size_t Tell() const {
+    return written_ + (cur_ - buf_.get());
+  }
+
+  // The input part of the rapidjson stream concept, not supported.
+  Ch Peek() const {
+    assert(0);
+    return 0;
+  }
+  Ch Take() {
+    assert(0);
+    return 0;
+  }
+  Ch* PutBegin() {
+    assert(0);
+    return nullptr;
+  }
+  size_t PutEnd(Ch*) {
+    assert(0);
+    return 0;
+  }
+
+ protected:
+  explicit RjOutputStreamBase(size_t buf_size)
+      : buf_(new char[buf_size]), cur_(buf_.get()), end_(cur_ + buf_size) {
+    assert(buf_size > 0);
+  }
+
+  virtual ~RjOutputStreamBase() = default;
+
+  // Writes the buffered bytes out. Returns false on error.
+  virtual bool WriteOut(std::string_view data) = 0;
+
+ private:
+  void Drain() {
+    size_t len = cur_ - buf_.get();
+    cur_ = buf_.get();
+    written_ += len;
+    if (len && !failed_)
+      failed_ = !WriteOut({buf_.get(), len});
+  }
+
+  std::unique_ptr<char[]> buf_;
+  char *cur_, *end_;
+  size_t written_ = 0;
+  bool failed_ = false;
+};
+
+// Streams the json into an io::Sink, e.g. a file or a socket.
+class RjSinkStream final : public RjOutputStreamBase {
+ public:
+  explicit RjSinkStream(io::Sink* sink, size_t buf_size = kDefaultBufSize)
+      : RjOutputStreamBase(buf_size), sink_(sink) {
+  }
+
+  std::error_code ec() const {
+    return ec_;
+  }
+
+ private:
+  bool WriteOut(std::string_view data) final {
+    ec_ = sink_->Write(io::Buffer(data));
+    return !ec_;
+  }
+
+  io::Sink* sink_;
+  std::error_code ec_;
+};
+
+// Streams the json as the chunks of an http response. The caller starts the response with
+// HttpContext::BeginChunked and ends it with HttpContext::EndChunked after the last Flush.
+class RjChunkedStream final : public RjOutputStreamBase {
+ public:
+  explicit RjChunkedStream(HttpContext* cntx, size_t buf_size = kDefaultBufSize)
+      : RjOutputStreamBase(buf_size), cntx_(cntx) {
+  }
+
+  std::error_code ec() const {
+    return ec_;
+  }
+
+ private:
+  bool WriteOut(std::string_view data) final {
+    ec_ = cntx_->WriteChunk(data);
+    return !ec_;
+  }
+
+  HttpContext* cntx_;
+  std::error_code ec_;
+};
+
+}  // namespace http
+}  // namespace util
@@ -0,0 +1,83 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/http/rj_output_stream.h"
+
+#include <absl/strings/str_cat.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include "base/gtest.h"
+#include "base/logging.h"
+
+namespace util::http {
+
+using namespace std;
+namespace rj = rapidjson;
+
+class RjOutputStreamTest : public testing::Test {
+ protected:
+  template <typename Writer> static void WriteDoc(Writer* writer) {
+    writer->StartObject();
+    for (unsigned i = 0; i < 100; ++i) {
+      writer->Key(absl::StrCat("key", i).c_str());
+      writer->StartArray();
+      writer->Int(i);
+      writer->Double(i / 4.0);
+      writer->String("a \"quoted\" string");
+      writer->EndArray();
+    }
+    writer->EndObject();
+  }
+};
+
+// A sink that fails the writes beyond limit bytes.
+class LimitedSink final : public io::Sink {
+ public:
+  explicit LimitedSink(size_t limit) : limit_(limit) {
+  }
+
+  io::Result<size_t> WriteSome(const iovec* v, uint32_t len) final {
+    if (str_.size() + v->iov_len > limit_)
+      return nonstd::make_unexpected(make_error_code(errc::no_space_on_device));
+    str_.append(static_cast<const char*>(v->iov_base), v->iov_len);
+    ++writes_;
+    return v->iov_len;
+  }
+
+  string str_;
+  unsigned writes_ = 0;
+
+ private:
+  size_t limit_;
+};
+
+TEST_F(RjOutputStreamTest, Sink) {
+  rj::StringBuffer expected;
+  rj::Writer<rj::StringBuffer> sb_writer(expected);
+  WriteDoc(&sb_writer);
+
+  LimitedSink sink(SIZE_MAX);
+  RjSinkStream stream(&sink, 64);
+  rj::Writer<RjSinkStream> writer(stream);
+  WriteDoc(&writer);
+
+  // The writer flushes the stream when the root value is complete.
+  EXPECT_EQ(expected.GetString(), sink.str_);
+  EXPECT_EQ(sink.str_.size(), stream.Tell());
+  EXPECT_EQ((sink.str_.size() + 63) / 64, sink.writes_);
+  EXPECT_FALSE(stream.ec());
+}
+
+TEST_F(RjOutputStreamTest, Error) {
+  LimitedSink sink(100);
+  RjSinkStream stream(&sink, 64);
+  rj::Writer<RjSinkStream> writer(stream);
+  WriteDoc(&writer);
+
+  EXPECT_EQ(errc::no_space_on_device, stream.ec());
+  EXPECT_EQ(64, sink.str_.size());
+}
+
+}  // namespace util::http
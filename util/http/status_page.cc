@@ -33,10 +33,30 @@ string GetTimerString(uint64 seconds) {
   return buf;
 }
 
-string StatusLine(const string& name, const string& val) {
-  string res("<div>");
-  res.append(name).append(":<span class='key_text'>").append(val).append("</span></div>\n");
-  return res;
+void AppendStatusLine(string_view name, string_view val, string* dest) {
+  absl::StrAppend(dest, "<div>", name, ":<span class='key_text'>", val, "</span></div>\n");
+}
+
+// The page header depends only on the resource prefix, so it is rendered once per thread.
+const string& PageHeader(string_view resource_prefix) {
+  static thread_local string prefix, header;
+  if (header.empty() || prefix != resource_prefix) {
+    string a = "<!DOCTYPE html>\n<html><head>\n";
+    a += R"(<meta http-equiv='Content-Type' content='text/html; charset=UTF-8'/>
+    <link href='https://fonts.googleapis.com/css?family=Roboto:400,300' rel='stylesheet'
+     type='text/css'>
+    <link rel='stylesheet' href='{s3_path}/status_page.css'>
+    <script type="text/javascript" src="{s3_path}/status_page.js"></script>
+</head>
+<body>
+<div><img src='{s3_path}/logo.png' width="160"/></div>)";
+
+    header = absl::StrReplaceAll(a, {{"{s3_path}", resource_prefix}});
+    header += "\n<div class='left_panel'></div>\n";
+    header += "<div class='styled_border'>\n";
+    prefix = resource_prefix;
+  }
+  return header;
 }
 
 }  // namespace
@@ -46,12 +66,15 @@ StringResponse BuildStatusPage(const QueryArgs& args, string_view resource_prefi
 
   bool output_json = false;
 
-  string varz;
+  // The buffers are reserved after the size of the previous page, so rendering usually does
+  // not reallocate. varz must not be shared between the requests, because AppendValues
+  // suspends the fiber while it collects the values from the proactors.
+  static std::atomic_size_t last_size{0};
   auto start = absl::Now();
 
-  VarzListNode::IterateValues([&varz](const string& nm, const string& val) {
-    absl::StrAppend(&varz, "\"", nm, "\": ", val, ",\n");
-  });
+  string varz;
+  varz.reserve(last_size.load(std::memory_order_relaxed));
+  VarzListNode::AppendValues(&varz);
   absl::StrAppend(&varz, "\"current-time\": ", time(nullptr), ",\n");
   varz.resize(varz.size() - 2);
 
@@ -61,27 +84,17 @@ StringResponse BuildStatusPage(const QueryArgs& args, string_view resource_prefi
   }
 
   auto delta_usec = absl::ToInt64Microseconds(absl::Now() - start);
+  string& a = response.body();
+
   if (output_json) {
     response.set(field::content_type, kJsonMime);
-    response.body() = "{" + varz + "}\n";
+    absl::StrAppend(&a, "{", varz, "}\n");
     return response;
   }
 
-  string a = "<!DOCTYPE html>\n<html><head>\n";
-  a += R"(<meta http-equiv='Content-Type' content='text/html; charset=UTF-8'/>
-    <link href='https://fonts.googleapis.com/css?family=Roboto:400,300' rel='stylesheet'
-     type='text/css'>
-    <link rel='stylesheet' href='{s3_path}/status_page.css'>
-    <script type="text/javascript" src="{s3_path}/status_page.js"></script>
-</head>
-<body>
-<div><img src='{s3_path}/logo.png' width="160"/></div>)";
-
-  a = absl::StrReplaceAll(a, {{"{s3_path}", resource_prefix}});
-
-  a += "\n<div class='left_panel'></div>\n";
-  a += "<div class='styled_border'>\n";
-  a += StatusLine("Status", "OK");
+  a.reserve(last_size.load(std::memory_order_relaxed));
+  a += PageHeader(resource_prefix);
+  AppendStatusLine("Status", "OK", &a);
 
   static std::atomic<time_t> start_time_cached{0};
   time_t start_time = start_time_cached.load(std::memory_order_relaxed);
@@ -93,22 +106,23 @@ StringResponse BuildStatusPage(const QueryArgs& args, string_view resource_prefi
     }
   }
   absl::Time atime = absl::FromUnixSeconds(start_time);
-  string str_fmt = absl::FormatTime("%Y-%m-%dT%H:%M:%S", atime, absl::UTCTimeZone());
-  a += StatusLine("Started on", str_fmt);
-  a += StatusLine("Uptime", GetTimerString(time(NULL) - start_time));
-  a += StatusLine("Render Latency", absl::StrCat(delta_usec, " us"));
+  AppendStatusLine("Started on", absl::FormatTime("%Y-%m-%dT%H:%M:%S", atime, absl::UTCTimeZone()),
+                   &a);
+  AppendStatusLine("Uptime", GetTimerString(time(NULL) - start_time), &a);
+  AppendStatusLine("Render Latency", absl::StrCat(delta_usec, " us"), &a);
 
   a += R"(</div>
 </body>
 <script>
 var json_text1 = {)";
-  a += varz + R"(};
+  a += varz;
+  a += R"(};
 document.querySelector('.left_panel').innerHTML = JsonToHTML(json_text1);
 </script>
 </html>)";
 
+  last_size.store(a.size(), std::memory_order_relaxed);
   response.set(field::content_type, kHtmlMime);
-  response.body() = std::move(a);
   return response;
 }
 
@@ -0,0 +1,109 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/http/tracez_handler.h"
+
+#include <absl/flags/declare.h>
+#include <absl/flags/flag.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+
+#include "base/logging.h"
+#include "util/fibers/event_log.h"
+#include "util/fibers/trace.h"
+#include "util/http/http_common.h"
+#include "util/http/http_handler.h"
+
+ABSL_DECLARE_FLAG(double, fiber_trace_sample_rate);
+
+namespace util {
+namespace http {
+
+using namespace std;
+
+namespace {
+
+void AppendJsonString(string_view str, string* dest) {
+  dest->push_back('"');
+  for (char c : str) {
+    if (c == '"' || c == '\\') {
+      dest->push_back('\\');
+      dest->push_back(c);
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      absl::StrAppend(dest, "\\u00", absl::Hex(static_cast<unsigned char>(c), absl::kZeroPad2));
+    } else {
+      dest->push_back(c);
+    }
+  }
+  dest->push_back('"');
+}
+
+void TracezHandler(const QueryArgs& args, HttpContext* send) {
+  uint64_t trace_id = 0, min_usec = 0;
+  for (const auto& k_v : args) {
+    if (k_v.first == "trace") {
+      absl::SimpleHexAtoi(k_v.second, &trace_id);
+    } else if (k_v.first == "min_usec") {
+      absl::SimpleAtoi(k_v.second, &min_usec);
+    } else if (k_v.first == "rate") {
+      double rate;
+      if (absl::SimpleAtod(k_v.second, &rate)) {
+        LOG(INFO) << "Setting trace sampling rate to " << rate;
+        absl::SetFlag(&FLAGS_fiber_trace_sample_rate, rate);
+      }
+    }
+  }
+
+  string body = "[";
+  bool first = true;
+  for (const fb2::SpanRecord& span : fb2::CollectSpans(trace_id)) {
+    uint64_t dur_usec = (span.end_ns - span.start_ns) / 1000;
+    if (dur_usec < min_usec)
+      continue;
+
+    absl::StrAppend(&body, first ? "\n" : ",\n", R"({"trace":")", absl::Hex(span.trace_id),
+                    R"(","span":")", absl::Hex(span.span_id), R"(","parent":")",
+                    absl::Hex(span.parent_id), R"(","name":)");
+    AppendJsonString(span.name, &body);
+    absl::StrAppend(&body, R"(,"fiber":)");
+    AppendJsonString(span.fiber, &body);
+    absl::StrAppend(&body, R"(,"thread":)", span.thread_index, R"(,"start_usec":)",
+                    span.start_ns / 1000, R"(,"dur_usec":)", dur_usec, "}");
+    first = false;
+  }
+  body.append("\n]\n");
+
+  StringResponse res = MakeStringResponse();
+  SetMime(kJsonMime, &res);
+  res.body() = std::move(body);
+  send->Invoke(std::move(res));
+}
+
+void EventzHandler(const QueryArgs& args, HttpContext* send) {
+  for (const auto& k_v : args) {
+    bool enable;
+    if (k_v.first == "enable" && absl::SimpleAtob(k_v.second, &enable)) {
+      LOG(INFO) << (enable ? "Enabling" : "Disabling") << " the event log";
+      fb2::EnableEventLog(enable);
+    }
+  }
+
+  StringResponse res = MakeStringResponse();
+  SetMime(kJsonMime, &res);
+  res.body() = fb2::EventLogChromeTrace();
+  send->Invoke(std::move(res));
+}
+
+}  // namespace
+
+void RegisterTracezHandler(HttpListenerBase* listener) {
+  listener->RegisterCb("/tracez", TracezHandler);
+}
+
+void RegisterEventzHandler(HttpListenerBase* listener) {
+  listener->RegisterCb("/eventz", EventzHandler);
+}
+
+}  // namespace http
+}  // namespace util
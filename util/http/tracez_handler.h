@@ -0,0 +1,28 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+namespace util {
+
+class HttpListenerBase;
+
+namespace http {
+
+// Registers /tracez on listener, which serves the spans that the threads of the process
+// recorded for the sampled traces, see util/fibers/trace.h, as a json array ordered by the
+// start time of the spans. The ids are hex strings and the times are in microseconds since
+// the epoch.
+// "?trace=<id>" serves only the spans of the trace, "?min_usec=N" only the spans that took
+// at least N microseconds and "?rate=R" sets the sampling rate of the new traces.
+void RegisterTracezHandler(HttpListenerBase* listener);
+
+// Registers /eventz on listener, which serves the event logs of the threads, see
+// util/fibers/event_log.h, in Chrome trace format. Save the response into a file and open it
+// in chrome://tracing or ui.perfetto.dev.
+// "?enable=1" starts the recording and "?enable=0" stops it.
+void RegisterEventzHandler(HttpListenerBase* listener);
+
+}  // namespace http
+}  // namespace util
@@ -4,18 +4,26 @@
 
 #pragma once
 
+#include <atomic>
+#include <boost/smart_ptr/intrusive_ptr.hpp>
+#include <chrono>
 #include <cstdint>
+#include <functional>
 #include <memory>
+#include <optional>
 #include <unordered_map>
+#include <vector>
 
-#include "base/pmr/memory_resource.h"
+#include "base/pmr/counting_resource.h"
 #include "util/fiber_socket_base.h"
+#include "util/fibers/synchronization.h"
 
 namespace util {
 
 class ProactorPool;
 class Connection;
 class AcceptServer;
+class AdmissionController;
 
 /**
  * @brief Abstracts away connections implementation and their life-cycle.
@@ -50,6 +58,36 @@ class ListenerInterface {
   // bind is called.
   virtual std::error_code ConfigureServerSocket(int fd);
 
+  enum class ConnectionPlacement : uint8_t {
+    // Round-robin across the active proactors.
+    ROUND_ROBIN,
+
+    // Round-robin across the proactors pinned to the NUMA node of the cpu that received the
+    // connection (SO_INCOMING_CPU), usually the node of the NIC. Falls back to ROUND_ROBIN if
+    // the pool is not pinned to several nodes.
+    NUMA_NODE,
+
+    // The proactor pinned to the cpu that received the connection (SO_INCOMING_CPU), so that
+    // the connection is handled where the kernel processes its packets.
+    INCOMING_CPU,
+
+    // All the connections of a NIC rx queue (SO_INCOMING_NAPI_ID) go to the same proactor,
+    // the one pinned to the cpu that received the first of them. Sockets of devices without
+    // napi, e.g. loopback, are placed by INCOMING_CPU.
+    RX_QUEUE,
+  };
+
+  // Sets the policy of the default PickConnectionProactor. The policies based on the incoming
+  // cpu pick the least loaded proactor, the one with the fewest connections of this listener,
+  // if no proactor is pinned to that cpu. Must be called before the listener starts accepting.
+  // The default is NUMA_NODE if the pool was spread by --proactor_affinity_mode=numa and
+  // ROUND_ROBIN otherwise.
+  void SetConnectionPlacement(ConnectionPlacement placement) {
+    placement_ = placement;
+  }
+
+  // Returns the proactor that will handle the accepted connection, by default according to
+  // the ConnectionPlacement policy.
   virtual fb2::ProactorBase* PickConnectionProactor(FiberSocketBase* sock);
 
   // This callback should not preempt because we traverse the list of connections
@@ -95,8 +133,80 @@ class ListenerInterface {
     pause_accepting_ = false;
   }
 
+  // Closes the connections that did not call Connection::MarkActive for at least timeout.
+  // Every proactor keeps its connections in a coarse timer wheel that is advanced by a single
+  // fiber, so the idleness costs nothing per connection until the wheel reaches it. Connections
+  // are closed with Connection::Shutdown, at most max_closes_per_tick on each proactor per tick.
+  // A tick is 1/16 of the timeout. Disabled by default. Must be called before the listener
+  // starts accepting.
+  void SetIdleTimeout(std::chrono::milliseconds timeout, uint32_t max_closes_per_tick = 256);
+
+  struct IdleStats {
+    uint64_t closed = 0;  // connections closed by the reaper.
+    uint64_t rescheduled = 0;  // active connections that the reaper visited and put back.
+    uint64_t deferred = 0;  // idle connections postponed to the next tick by the batch limit.
+  };
+
+  // Can be called from any thread.
+  IdleStats GetIdleStats() const;
+
+  // Limits the memory that is allocated through Connection::memory() by every connection and
+  // by all the connections of the listener on every proactor thread, 0 means unlimited.
+  // The memory is counted per thread without synchronization, so the limits are cheap to
+  // enforce. Must be called before the listener starts accepting.
+  void SetMemoryLimits(size_t per_connection, size_t per_thread);
+
+  // Creates the memory resource that backs Connection::memory() of a new connection, instead
+  // of the resource of the accept server. Called on the thread of the connection before
+  // HandleRequests. The resource is destroyed with the connection, hence it may free what is
+  // left of the allocations of the connection in bulk, see fb2::MiHeapBinding.
+  // Must be called before the listener starts accepting.
+  using ConnectionMemoryFactory = std::function<std::unique_ptr<PMR_NS::memory_resource>()>;
+  void SetConnectionMemoryFactory(ConnectionMemoryFactory factory) {
+    conn_memory_factory_ = std::move(factory);
+  }
+
+  struct MemoryStats {
+    size_t used = 0;
+    size_t peak = 0;  // the sum of the peaks of the threads.
+    uint64_t rejected = 0;  // allocations of the connections that failed due to the limits.
+  };
+
+  // Can be called from any thread. rejected is updated when the connections close.
+  MemoryStats GetMemoryStats() const;
+
+  // Keeps up to max_per_thread closed connections on every proactor and reuses them for the
+  // new connections of that proactor, instead of destroying them and calling NewConnection.
+  // Only the connections whose Connection::Recycle returns true are kept, together with
+  // the buffers that they allocated. With recycling, NewConnection is called on the thread of
+  // the connection. Connections that have their own heap, see SetConnectionMemoryFactory, are
+  // not recycled since the heap frees their memory in bulk. 0 disables the recycling, which
+  // is the default. Must be called before the listener starts accepting.
+  void SetConnectionRecycling(uint32_t max_per_thread) {
+    recycle_limit_ = max_per_thread;
+  }
+
+  struct RecycleStats {
+    uint64_t reused = 0;     // new connections that were served by a recycled object.
+    uint64_t recycled = 0;   // closed connections that were kept for reuse.
+    uint64_t discarded = 0;  // closed connections that were destroyed, e.g. above the limit.
+  };
+
+  // Can be called from any thread.
+  RecycleStats GetRecycleStats() const;
+
+  // New connections assigned to an overloaded proactor are moved to another one, delayed or
+  // rejected, as AdmissionController::AdmitConnection decides. If shed_requests is true,
+  // Connection::ShouldShedRequest reports the overload of the connection's proactor to
+  // the connections. ac is not owned and must stay running while the listener accepts.
+  // Must be called before the listener starts accepting.
+  void SetAdmissionController(AdmissionController* ac, bool shed_requests = false) {
+    admission_ = ac;
+    shed_requests_ = shed_requests && ac;
+  }
+
  protected:
-  ProactorPool* pool() {
+  ProactorPool* pool() const {
     return pool_;
   }
 
@@ -111,19 +221,64 @@ class ListenerInterface {
   virtual void OnMaxConnectionsReached(FiberSocketBase* sock) {
   }
 
+  // Called when a connection is rejected by the admission controller, see
+  // SetAdmissionController. Override to send an error message to the socket.
+  virtual void OnOverloaded(FiberSocketBase* sock) {
+  }
+
  private:
   struct TLConnList;  // threadlocal connection list. contains connections for that thread.
   using ListenerConnMap = std::unordered_map<ListenerInterface*, TLConnList*>;
 
   void RunAcceptLoop();
 
-  void RunSingleConnection(Connection* conn);
+  // Accepts connections on sock until it is shut down. If local is set, the connections are
+  // handled by the proactor of sock, otherwise by PickConnectionProactor.
+  void AcceptConnections(FiberSocketBase* sock, bool local);
+
+  void RunSingleConnection(boost::intrusive_ptr<Connection> conn);
+
+  // Returns a recycled connection of the calling proactor or a new one.
+  boost::intrusive_ptr<Connection> AcquireConnection();
+
+  // Keeps the closed connection in the free list of the calling proactor if it can be reused.
+  void MaybeRecycle(boost::intrusive_ptr<Connection> conn);
+
+  // Asks the connections of the parked proactors, see ProactorPool::SetActiveSize, to
+  // migrate to the active ones. The connections move when they call MaybeMigrate.
+  void MigrateParkedConnections();
+
+  // Graceful drain steps of AcceptServer::Drain for the connections of the calling proactor.
+  // Calls Connection::OnDrain.
+  void DrainConnectionsOnThread();
+
+  // Cancels the io of the connections in bulk and shuts them down.
+  void CancelConnectionsOnThread();
+
+  // Returns the connections of the calling proactor.
+  std::vector<boost::intrusive_ptr<Connection>> GetThreadConnections();
+
+  // Returns the active proactor among ids, or among all the proactors if ids is null, that has
+  // the fewest connections of this listener. If node is not negative, only its proactors are
+  // considered.
+  fb2::ProactorBase* PickLeastLoaded(const std::vector<unsigned>* ids, int node);
+
+  // Returns the proactor pinned to the incoming cpu of sock, or the least loaded one.
+  fb2::ProactorBase* PickByIncomingCpu(int fd);
+
+  // Runs on every proactor while the idle timeout is set.
+  void RunIdleReaper(TLConnList* clist);
+  void ReapIdle(TLConnList* clist);
 
   static ListenerConnMap* GetSafeTlsConnMap();
 
   static thread_local ListenerConnMap listener_map;
 
   std::unique_ptr<FiberSocketBase> sock_;
+
+  // SO_REUSEPORT sockets of the other proactors when accept sharding is enabled,
+  // see AcceptServer::set_reuseport_sharding.
+  std::vector<std::unique_ptr<FiberSocketBase>> shard_socks_;
   // Number of max connections. Unlimited by default.
   uint32_t max_clients_{UINT32_MAX};
 
@@ -136,6 +291,39 @@ class ListenerInterface {
   ProactorPool* pool_ = nullptr;
   PMR_NS::memory_resource* mr_;
   bool pause_accepting_ = false;
+  std::atomic_bool draining_{false};
+
+  // Set when the listening sockets were handed over to another process, see
+  // AcceptServer::HandOverListeners. Then the accept loop keeps serving the connections
+  // until stop_handed_over_ is notified.
+  bool handed_over_ = false;
+  fb2::Done stop_handed_over_;
+
+  AdmissionController* admission_ = nullptr;
+  bool shed_requests_ = false;
+
+  std::optional<ConnectionPlacement> placement_;  // unset for the default placement.
+
+  // Open connections of this listener per proactor, indexed by the pool index.
+  std::unique_ptr<std::atomic_uint32_t[]> proactor_conns_;
+  unsigned pick_offset_ = 0;  // rotates the least loaded scans to spread the ties.
+
+  // Memory of the connections per proactor, indexed by the pool index. The connections are
+  // the children of the counter of their thread.
+  std::unique_ptr<base::CountingMemoryResource[]> thread_memory_;
+  size_t conn_memory_limit_ = 0, thread_memory_limit_ = 0;
+  ConnectionMemoryFactory conn_memory_factory_;
+  std::atomic_uint64_t memory_rejected_{0};
+
+  // napi id -> pool index for RX_QUEUE. Accessed by the accept fiber only.
+  std::unordered_map<uint32_t, unsigned> napi_proactors_;
+
+  uint64_t idle_timeout_ns_ = 0;  // 0 if the idle reaper is disabled.
+  uint32_t idle_max_closes_ = 0;
+  std::atomic_uint64_t idle_closed_{0}, idle_rescheduled_{0}, idle_deferred_{0};
+
+  uint32_t recycle_limit_ = 0;  // 0 if the connections are not recycled.
+  std::atomic_uint64_t recycle_reused_{0}, recycle_recycled_{0}, recycle_discarded_{0};
 
   // we want to prevent from migrations running in parallel to traversals using
   // the following rules:
@@ -151,6 +339,7 @@ class ListenerInterface {
   constexpr static uint64_t kMigrateVal = 1ULL << 32;
   constexpr static uint64_t kTraverseVal = 1ULL;
   friend class AcceptServer;
+  friend class Connection;
 };
 
 }  // namespace util
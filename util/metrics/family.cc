@@ -3,6 +3,8 @@
 //
 #include "util/metrics/family.h"
 
+#include <absl/strings/str_cat.h>
+
 #include <shared_mutex>
 
 #include "base/logging.h"
@@ -19,8 +21,51 @@ namespace {
 shared_mutex list_mu;
 Family* family_list = nullptr;
 
+/*# HELP go_gc_duration_seconds A summary of the pause duration of garbage collection cycles.
+# TYPE go_gc_duration_seconds summary
+go_gc_duration_seconds{quantile="0"} 0
+go_gc_duration_seconds{quantile="0.25"} 0
+go_gc_duration_seconds{quantile="0.5"} 0
+go_gc_duration_seconds{quantile="0.75"} 0
+go_gc_duration_seconds{quantile="1"} 0
+go_gc_duration_seconds_sum 0
+go_gc_duration_seconds_count 0
+*/
+
+const char* MetricTypeName(MetricType type) {
+  switch (type) {
+    case MetricType::COUNTER:
+      return "counter";
+    case MetricType::GAUGE:
+      return "gauge";
+    case MetricType::SUMMARY:
+      return "summary";
+    case MetricType::HISTOGRAM:
+      return "histogram";
+  }
+  return "unknown";
+}
+
+void AppendLabelTuple(absl::Span<const Label> label_names,
+                      absl::Span<const string_view> label_values, string* dest) {
+  if (label_names.empty())
+    return;
+
+  for (size_t i = 0; i < label_names.size(); ++i) {
+    absl::StrAppend(dest, label_names[i].name(), "=\"", label_values[i], "\",");
+  }
+  dest->pop_back();
+}
+
 }  // namespace
 
+struct Family::Snapshot {
+  vector<const Family*> families;
+  vector<ObservationDescriptor> descrs;
+  vector<ObservationDescriptor::Adjustment> adjustments;
+  vector<double> values;
+};
+
 Family::Family(const char* name, const char* help) : name_(name), help_(help) {
 }
 
@@ -66,39 +111,45 @@ void Family::ShutdownBase() {
   label_names_.shrink_to_fit();
   label_map_.clear();
   label_map_.rehash(0);
-}
 
-auto Family::Emplace(uint64_t hash, absl::Span<const std::string_view> label_values,
-                     LabelMap* label_map) -> pair<DenseId, bool> {
-  auto it = label_map->find(hash);
-
-  if (it != label_map->end())  // quick path
-    return make_pair(it->second, false);
+  lock_guard text_lk(text_mu_);
+  text_rows_.clear();
+}
 
-  // opportunistically create LabelValues outside the lock even if at the end we won't add it.
-  LabelValues lvals(new string_view[label_values.size()]);
-  for (size_t i = 0; i < label_values.size(); ++i) {
-    lvals[i] = pp_->GetString(label_values[i]);
+auto Family::Intern(uint64_t hash, absl::Span<const std::string_view> label_values,
+                    LocalLabels* local) -> pair<DenseId, bool> {
+  auto [it, inserted] = local->map.emplace(hash, local->size());
+  if (inserted) {
+    // Copy the values since the caller may pass temporary strings. They are moved to the
+    // global storage upon reconciliation.
+    LocalLabels::Pending pending{hash, make_unique<string[]>(label_values.size())};
+    for (size_t i = 0; i < label_values.size(); ++i) {
+      pending.values[i] = label_values[i];
+    }
+    local->pending.push_back(std::move(pending));
   }
 
-  lock_guard lk(mu_);
+  return make_pair(it->second, inserted);
+}
 
-  bool inserted;
-  DenseId dense_id = label_values_.size();
+void Family::ReconcileLabels(LocalLabels* local) {
+  if (local->pending.empty())
+    return;
 
-  // verify again because we have preempted on mu_, therefore other fibers could
-  // already update local_map.
-  tie(it, inserted) = label_map->emplace(hash, dense_id);
-  if (inserted) {
-    auto [global_it, inserted] = label_map_.emplace(hash, dense_id);
+  const size_t num_labels = label_names_.size();
+  lock_guard lk(mu_);
+  for (const auto& pending : local->pending) {
+    auto [it, inserted] = label_map_.emplace(pending.hash, label_values_.size());
     if (inserted) {  // new hash value
+      LabelValues lvals(new string_view[num_labels]);
+      for (size_t i = 0; i < num_labels; ++i) {
+        lvals[i] = pp_->GetString(pending.values[i]);
+      }
       label_values_.emplace_back(std::move(lvals));
-    } else {
-      it->second = global_it->second;  // update the local map.
     }
+    local->dense_ids.push_back(it->second);
   }
-
-  return make_pair(it->second, inserted);
+  local->pending.clear();
 }
 
 ObservationDescriptor Family::GetDescriptor() const {
@@ -113,12 +164,51 @@ ObservationDescriptor Family::GetDescriptor() const {
   return res;
 }
 
-void Iterate(MetricRowCb cb) {
-  shared_lock lk(list_mu);
-  if (!family_list)
-    return;
+void Family::AppendText(const ObservationDescriptor& od, absl::Span<const double> vals,
+                        string* dest) const {
+  absl::StrAppend(dest, "# HELP ", od.metric_name, " ", od.metric_help, "\n");
+  absl::StrAppend(dest, "# TYPE ", od.metric_name, " ", MetricTypeName(od.type), "\n");
+
+  // Rows are ordered by adjustment first, then by label tuple.
+  const size_t num_tuples = od.label_values.size();
+  const size_t num_adjustments = od.adjustments.empty() ? 1 : od.adjustments.size();
+
+  lock_guard lk(text_mu_);
+  text_rows_.resize(num_adjustments);
+  for (size_t a = 0; a < num_adjustments; ++a) {
+    TextRows& rows = text_rows_[a];
+    for (size_t i = rows.ends.size(); i < num_tuples; ++i) {
+      absl::StrAppend(&rows.blob, od.metric_name);
+      if (!od.adjustments.empty())
+        absl::StrAppend(&rows.blob, od.adjustments[a].suffix);
+      rows.blob.push_back('{');
+      AppendLabelTuple(od.label_names, {od.label_values[i], od.label_names.size()}, &rows.blob);
+      if (!od.adjustments.empty() && !od.adjustments[a].label.first.name().empty()) {
+        const LabelInstance& label = od.adjustments[a].label;
+        if (!od.label_names.empty())
+          rows.blob.push_back(',');
+        absl::StrAppend(&rows.blob, label.first.name(), "=\"", label.second, "\"");
+      }
+      rows.blob.append("} ");
+      rows.ends.push_back(rows.blob.size());
+    }
+
+    for (size_t i = 0; i < num_tuples; ++i) {
+      size_t start = i ? rows.ends[i - 1] : 0;
+      dest->append(rows.blob, start, rows.ends[i] - start);
+      absl::StrAppend(dest, vals[a * num_tuples + i], "\n");
+    }
+  }
+}
+
+void Family::TakeSnapshot(Snapshot* snap) {
+  // Publish the label tuples interned by each thread since the previous snapshot.
+  family_list->pp_->AwaitFiberOnAll([](unsigned tindex, auto*) {
+    for (Family* cur = family_list; cur; cur = cur->next_) {
+      cur->Reconcile(tindex);
+    }
+  });
 
-  vector<ObservationDescriptor> descrs;
   uint32_t total_metrics = 0;
   uint32_t total_adjustments = 0;
 
@@ -134,47 +224,93 @@ void Iterate(MetricRowCb cb) {
     cur->mu_.unlock_shared();
 
     total_metrics += cur->cardinality_ * num_tuples;
-    descrs.push_back(std::move(od));
+    snap->families.push_back(cur);
+    snap->descrs.push_back(std::move(od));
     total_adjustments += (cur->cardinality_ > 1) ? cur->cardinality_ : 0;
   }
 
-  vector<ObservationDescriptor::Adjustment> adjustments(total_adjustments);
+  snap->adjustments.resize(total_adjustments);
   unsigned offset = 0;
   unsigned index = 0;
   for (Family* cur = family_list; cur; cur = cur->next_) {
     if (cur->metric_type_ == SUMMARY || cur->metric_type_ == HISTOGRAM) {
-      absl::Span<ObservationDescriptor::Adjustment> span{adjustments.data() + offset,
+      absl::Span<ObservationDescriptor::Adjustment> span{snap->adjustments.data() + offset,
                                                          cur->cardinality_};
-      descrs[index].adjustments = span;
+      cur->SetAdjustments(span);
+      snap->descrs[index].adjustments = span;
       offset += cur->cardinality_;
     }
     ++index;
   }
 
   Mutex mu;
-  vector<double> result(total_metrics, 0.0);
+  snap->values.assign(total_metrics, 0.0);
   auto per_thread_cb = [&](unsigned tindex, auto*) {
     uint32_t offset = 0;
     uint32_t descr_index = 0;
     for (Family* cur = family_list; cur; cur = cur->next_) {
-      unsigned len = descrs[descr_index].metrics_len();
+      unsigned len = snap->descrs[descr_index].metrics_len();
 
       lock_guard res_lk(mu);
-      cur->Combine(tindex, absl::Span<double>{result.data() + offset, len});
+      cur->Combine(tindex, absl::Span<double>{snap->values.data() + offset, len});
       ++descr_index;
       offset += len;
     }
   };
 
   family_list->pp_->AwaitFiberOnAll(per_thread_cb);
+}
+
+void Iterate(MetricRowCb cb) {
+  shared_lock lk(list_mu);
+  if (!family_list)
+    return;
+
+  Family::Snapshot snap;
+  Family::TakeSnapshot(&snap);
   lk.unlock();
 
-  offset = 0;
-  for (const auto& descr : descrs) {
-    cb(descr, absl::Span{result.data() + offset, descr.metrics_len()});
+  size_t offset = 0;
+  for (const auto& descr : snap.descrs) {
+    cb(descr, absl::Span{snap.values.data() + offset, descr.metrics_len()});
     offset += descr.metrics_len();
   }
 }
 
+void FormatText(absl::FunctionRef<void(string_view)> cb) {
+  shared_lock lk(list_mu);
+  if (!family_list)
+    return;
+
+  Family::Snapshot snap;
+  Family::TakeSnapshot(&snap);
+
+  // Split the families into contiguous shards with roughly the same number of rows.
+  ProactorPool* pp = family_list->pp_;
+  const size_t num_shards = pp->size();
+  const size_t total_rows = std::max<size_t>(snap.values.size(), 1);
+  vector<size_t> offsets(snap.descrs.size());
+  for (size_t i = 1; i < offsets.size(); ++i) {
+    offsets[i] = offsets[i - 1] + snap.descrs[i - 1].metrics_len();
+  }
+
+  vector<string> shards(num_shards);
+  pp->AwaitFiberOnAll([&](unsigned tindex, auto*) {
+    for (size_t i = 0; i < snap.descrs.size(); ++i) {
+      if (offsets[i] * num_shards / total_rows != tindex)
+        continue;
+      const ObservationDescriptor& od = snap.descrs[i];
+      snap.families[i]->AppendText(od, {snap.values.data() + offsets[i], od.metrics_len()},
+                                   &shards[tindex]);
+    }
+  });
+  lk.unlock();
+
+  for (const string& shard : shards) {
+    if (!shard.empty())
+      cb(shard);
+  }
+}
+
 }  // namespace metrics
 }  // namespace util
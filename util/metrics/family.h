@@ -5,6 +5,7 @@
 #pragma once
 
 #include <absl/container/flat_hash_map.h>
+#include <absl/functional/function_ref.h>
 #include <absl/types/span.h>
 #include <util/fibers/synchronization.h>
 
@@ -86,8 +87,15 @@ struct ObservationDescriptor {
 using MetricRowCb = std::function<void(const ObservationDescriptor&, absl::Span<const double>)>;
 void Iterate(MetricRowCb cb);
 
+// Formats all the families in Prometheus text exposition format and passes the output
+// to cb in order, possibly in multiple pieces. The families are formatted in parallel on
+// the pool threads. The metric names and labels of each row are cached between the calls,
+// so only the values are formatted.
+void FormatText(absl::FunctionRef<void(std::string_view)> cb);
+
 class Family {
   friend void Iterate(MetricRowCb cb);
+  friend void FormatText(absl::FunctionRef<void(std::string_view)> cb);
 
  public:
   Family(const char* name, const char* help);
@@ -107,19 +115,60 @@ class Family {
   void InitBase(ProactorPool* pp, std::initializer_list<Label> list);
   void ShutdownBase();
 
-  std::pair<DenseId, bool> Emplace(uint64_t hash, absl::Span<const std::string_view> label_values,
-                                   LabelMap* per_thread);
+  // Label tuples interned by a single thread. The thread assigns its own local ids without
+  // any locking, the local ids are mapped to the global dense ids by Reconcile, which runs
+  // in the owner thread before its values are combined. Therefore new label tuples become
+  // visible in the exposition lazily.
+  struct LocalLabels {
+    LabelMap map;  // hash(label_values) -> local id.
+
+    // Local id -> dense id, for all the reconciled local ids.
+    std::vector<DenseId> dense_ids;
+
+    // Label tuples interned since the last reconciliation, in local id order.
+    struct Pending {
+      uint64_t hash;
+      std::unique_ptr<std::string[]> values;
+    };
+    std::vector<Pending> pending;
+
+    size_t size() const {
+      return dense_ids.size() + pending.size();
+    }
+  };
+
+  // Returns the local id of the label tuple and whether it has been just interned.
+  // Must be called only by the thread owning local.
+  std::pair<DenseId, bool> Intern(uint64_t hash, absl::Span<const std::string_view> label_values,
+                                  LocalLabels* local);
+
+  // Assigns dense ids to the pending tuples of local.
+  void ReconcileLabels(LocalLabels* local);
+
+  // Reconciles the label tuples of the given thread. Called in that thread.
+  virtual void Reconcile(unsigned thread_index) = 0;
 
   ObservationDescriptor GetDescriptor() const;
 
   // Combines values into dest. Dest is ordered by cardinality,
   // i.e. first metric and all its tuples, then the next one and so on.
+  // Values of label tuples that have not been reconciled yet are skipped.
   virtual void Combine(unsigned thread_index, absl::Span<double> dest) const = 0;
 
   // Fills up family adjustments for SUMMARY/HISTOGRAM families.
   virtual void SetAdjustments(absl::Span<ObservationDescriptor::Adjustment> dest) const {
   }
 
+  // Snapshot of all the families and their combined values.
+  struct Snapshot;
+
+  // Must be called under the family list lock.
+  static void TakeSnapshot(Snapshot* snap);
+
+  // Appends the observation in Prometheus text format to dest.
+  void AppendText(const ObservationDescriptor& od, absl::Span<const double> vals,
+                  std::string* dest) const;
+
   std::string_view name_, help_;
   std::vector<Label> label_names_;  // label names initialized once in Init().
 
@@ -131,6 +180,16 @@ class Family {
 
   fb2::SharedMutex mu_;
 
+  // Encoded row prefixes, i.e. the metric name and its labels, for each adjustment.
+  // Label values are never removed, so the cache only grows with new label tuples.
+  struct TextRows {
+    std::string blob;
+    std::vector<uint32_t> ends;  // end offset of each row in blob.
+  };
+
+  mutable fb2::Mutex text_mu_;
+  mutable std::vector<TextRows> text_rows_;  // Guarded by text_mu_
+
   ProactorPool* pp_;
   Family* next_ = nullptr;
   Family* prev_ = nullptr;
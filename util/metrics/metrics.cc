@@ -4,8 +4,13 @@
 
 #include "util/metrics/metrics.h"
 
+#include <absl/strings/str_cat.h>
+
+#include <cmath>
+
 #include "base/hash.h"
 #include "base/logging.h"
+#include "util/fibers/cycle_clock.h"
 #include "util/proactor_pool.h"
 
 namespace util {
@@ -17,18 +22,55 @@ using namespace std;
 
 namespace {
 thread_local XXH3_state_t xxh3_state;
+
+// Assume that there is 0 chance that different labels will have the same 64bit hash.
+// In practice it's not zero. Don't do it if you design a banking system or a space ship.
+// For metrics I assume it's fine - noone will die.
+uint64_t HashLabels(absl::Span<const std::string_view> label_values) {
+  XXH3_64bits_reset(&xxh3_state);
+  for (auto s : label_values) {
+    XXH3_64bits_update(&xxh3_state, s.data(), s.size());
+  }
+  return XXH3_64bits_digest(&xxh3_state);
 }
 
+}  // namespace
+
 namespace detail {
 
 void SingleFamily::Init(ProactorPool* pp, initializer_list<Label> list) {
   InitBase(pp, list);
   per_thread_.reset(new PerThread[pp->size()]);
+  ++generation_;
 }
 
 void SingleFamily::Shutdown() {
   ShutdownBase();
   per_thread_.reset();
+  ++generation_;
+}
+
+auto SingleFamily::Bind(absl::Span<const std::string_view> label_values) -> Handle {
+  CHECK(pp_);
+  CHECK_EQ(label_names_.size(), label_values.size());
+
+  Handle res;
+  res.family_ = this;
+  res.num_slots_ = pp_->size();
+  res.slots_.reset(new Handle::Slot[res.num_slots_]);
+  res.label_values_.assign(label_values.begin(), label_values.end());
+  return res;
+}
+
+bool SingleFamily::Handle::Resolve(unsigned thread_index) {
+  if (!family_->per_thread_)  // shut down.
+    return false;
+
+  vector<string_view> label_values(label_values_.begin(), label_values_.end());
+  Slot& slot = slots_[thread_index];
+  slot.local_id = family_->GetLocalId(thread_index, label_values);
+  slot.generation = family_->generation_;
+  return true;
 }
 
 void SingleFamily::IncBy(absl::Span<const std::string_view> labels, double val) {
@@ -37,37 +79,36 @@ void SingleFamily::IncBy(absl::Span<const std::string_view> labels, double val)
   if (index < 0)  // not in proactor thread, silently exit.
     return;
 
-  DenseId dense_id = GetDenseId(index, labels);
-  per_thread_[index].metric_vec[dense_id].IncBy(val);
+  DenseId local_id = GetLocalId(index, labels);
+  per_thread_[index].metric_vec[local_id].IncBy(val);
 }
 
 void SingleFamily::Combine(unsigned thread_index, absl::Span<double> dest) const {
   const PerThread& pt = per_thread_[thread_index];
-  // there may be case that pt.metric_vec is smaller or larger that dest, because family
-  // metrics could grow since they were snapshoted or because current thread does not
-  // have all the tuples present in central data-structures.
-  // however we can merge the minimum indices and this will be correct (eventually consistent).
-  size_t sz = min(dest.size(), pt.metric_vec.size());
-  for (size_t i = 0; i < sz; ++i) {
-    dest[i] += pt.metric_vec[i].val();
+  const vector<DenseId>& dense_ids = pt.labels.dense_ids;
+
+  // dest may be smaller than the number of reconciled ids because family metrics could grow
+  // since they were snapshotted. However we can merge the ids that fit and this will be
+  // correct (eventually consistent).
+  for (size_t i = 0; i < dense_ids.size(); ++i) {
+    if (dense_ids[i] < dest.size())
+      dest[dense_ids[i]] += pt.metric_vec[i].val();
   }
 }
 
-auto SingleFamily::GetDenseId(unsigned thread_index,
+void SingleFamily::Reconcile(unsigned thread_index) {
+  ReconcileLabels(&per_thread_[thread_index].labels);
+}
+
+auto SingleFamily::GetLocalId(unsigned thread_index,
                               absl::Span<const std::string_view> label_values) -> DenseId {
-  // Assume that there is 0 chance that different labels will have the same 64bit hash.
-  // In practice it's not zero. Don't do it if you design a banking system or a space ship.
-  // For metrics I assume it's fine - noone will die.
-  XXH3_64bits_reset(&xxh3_state);
-  for (auto s : label_values) {
-    XXH3_64bits_update(&xxh3_state, s.data(), s.size());
-  }
-  XXH64_hash_t hash = XXH3_64bits_digest(&xxh3_state);
-  auto [dense_id, inserted] = Emplace(hash, label_values, &per_thread_[thread_index].label_map);
+  uint64_t hash = HashLabels(label_values);
+  PerThread& pt = per_thread_[thread_index];
+  auto [local_id, inserted] = Intern(hash, label_values, &pt.labels);
   if (inserted) {
-    per_thread_[thread_index].metric_vec.resize(dense_id + 1);
+    pt.metric_vec.resize(local_id + 1);
   }
-  return dense_id;
+  return local_id;
 }
 
 }  // namespace detail
@@ -78,8 +119,156 @@ void GaugeFamily::Set(absl::Span<const std::string_view> label_values, double va
   if (index < 0)  // not in proactor thread, silently exit.
     return;
 
-  DenseId dense_id = GetDenseId(index, label_values);
-  per_thread_[index].metric_vec[dense_id].set_val(val);
+  DenseId local_id = GetLocalId(index, label_values);
+  per_thread_[index].metric_vec[local_id].set_val(val);
+}
+
+HistogramFamily::HistogramFamily(const char* name, const char* help, double min_val,
+                                 double max_val, unsigned sub_buckets)
+    : Family(name, help), min_val_(min_val), sub_buckets_(sub_buckets) {
+  CHECK_GT(min_val, 0);
+  CHECK_GT(max_val, min_val);
+  CHECK_GT(sub_buckets, 0u);
+
+  metric_type_ = HISTOGRAM;
+
+  bounds_.push_back(min_val);
+  for (double base = min_val; base < max_val; base *= 2) {
+    for (unsigned j = 1; j <= sub_buckets; ++j) {
+      bounds_.push_back(base * (1 + double(j) / sub_buckets));
+    }
+  }
+
+  le_values_.reserve(bounds_.size());
+  for (double b : bounds_) {
+    le_values_.push_back(absl::StrCat(b));
+  }
+
+  // buckets, +Inf bucket, _sum and _count.
+  cardinality_ = num_buckets() + 2;
+}
+
+void HistogramFamily::Init(ProactorPool* pp, initializer_list<Label> list) {
+  InitBase(pp, list);
+  per_thread_.reset(new PerThread[pp->size()]);
+}
+
+void HistogramFamily::Shutdown() {
+  ShutdownBase();
+  per_thread_.reset();
+}
+
+unsigned HistogramFamily::BucketIndex(double val) const {
+  if (val <= min_val_)
+    return 0;
+
+  // r = m * 2^e, where m is in [0.5, 1), i.e. r is in [2^k, 2^(k+1)) for k = e - 1.
+  int e;
+  double m = frexp(val / min_val_, &e);
+  double frac = 2 * m - 1;
+  size_t index = size_t(e - 1) * sub_buckets_ + size_t(ceil(frac * sub_buckets_));
+
+  // Fix possible rounding errors around the bounds.
+  if (index >= bounds_.size())
+    return bounds_.size();
+  if (val > bounds_[index])
+    ++index;
+  else if (index > 0 && val <= bounds_[index - 1])
+    --index;
+  return index;
+}
+
+void HistogramFamily::Observe(absl::Span<const std::string_view> label_values, double val) {
+  CHECK_EQ(label_names_.size(), label_values.size());
+  int32_t index = ProactorBase::me()->GetPoolIndex();
+  if (index < 0)  // not in proactor thread, silently exit.
+    return;
+
+  DenseId local_id = GetLocalId(index, label_values);
+  PerThread& pt = per_thread_[index];
+  ++pt.buckets[local_id * num_buckets() + BucketIndex(val)];
+  pt.sum[local_id] += val;
+}
+
+void HistogramFamily::ObserveCycles(absl::Span<const std::string_view> label_values,
+                                    uint64_t cycles) {
+  Observe(label_values, fb2::CycleClock::ToNsec(cycles) * 1e-9);
+}
+
+void HistogramFamily::ObserveCycles(absl::Span<const std::string_view> label_values,
+                                    const fb2::CycleHistogram& hist) {
+  CHECK_EQ(label_names_.size(), label_values.size());
+  int32_t index = ProactorBase::me()->GetPoolIndex();
+  if (index < 0)  // not in proactor thread, silently exit.
+    return;
+
+  DenseId local_id = GetLocalId(index, label_values);
+  PerThread& pt = per_thread_[index];
+  uint64_t* buckets = &pt.buckets[local_id * num_buckets()];
+  for (unsigned i = 0; i < fb2::CycleHistogram::kNumBuckets; ++i) {
+    if (hist.buckets[i] == 0)
+      continue;
+
+    // Bucket i covers [2^(i-1), 2^i) cycles.
+    uint64_t mid_cycles = i == 0 ? 0 : (3ULL << i) / 4;
+    buckets[BucketIndex(fb2::CycleClock::ToNsec(mid_cycles) * 1e-9)] += hist.buckets[i];
+  }
+  pt.sum[local_id] += fb2::CycleClock::ToNsec(hist.sum) * 1e-9;
+}
+
+auto HistogramFamily::GetLocalId(unsigned thread_index,
+                                 absl::Span<const std::string_view> label_values) -> DenseId {
+  uint64_t hash = HashLabels(label_values);
+  PerThread& pt = per_thread_[thread_index];
+  auto [local_id, inserted] = Intern(hash, label_values, &pt.labels);
+  if (inserted) {
+    pt.buckets.resize((local_id + 1) * num_buckets());
+    pt.sum.resize(local_id + 1);
+  }
+  return local_id;
+}
+
+void HistogramFamily::Reconcile(unsigned thread_index) {
+  ReconcileLabels(&per_thread_[thread_index].labels);
+}
+
+void HistogramFamily::Combine(unsigned thread_index, absl::Span<double> dest) const {
+  const PerThread& pt = per_thread_[thread_index];
+  const vector<DenseId>& dense_ids = pt.labels.dense_ids;
+  const unsigned nb = num_buckets();
+
+  // dest is ordered by adjustment, then by label tuple. See ObservationDescriptor.
+  size_t num_tuples = dest.size() / cardinality_;
+
+  for (size_t i = 0; i < dense_ids.size(); ++i) {
+    const size_t id = dense_ids[i];
+    if (id >= num_tuples)
+      continue;
+
+    const uint64_t* buckets = pt.buckets.data() + i * nb;
+    uint64_t cumulative = 0;
+    for (unsigned b = 0; b < nb; ++b) {
+      cumulative += buckets[b];
+      dest[b * num_tuples + id] += cumulative;
+    }
+    dest[nb * num_tuples + id] += pt.sum[i];
+    dest[(nb + 1) * num_tuples + id] += cumulative;
+  }
+}
+
+void HistogramFamily::SetAdjustments(absl::Span<ObservationDescriptor::Adjustment> dest) const {
+  DCHECK_EQ(dest.size(), cardinality_);
+
+  for (size_t b = 0; b < bounds_.size(); ++b) {
+    dest[b].suffix = "_bucket";
+    dest[b].label = LabelInstance{Label("le"), le_values_[b]};
+  }
+
+  const unsigned nb = num_buckets();
+  dest[nb - 1].suffix = "_bucket";
+  dest[nb - 1].label = LabelInstance{Label("le"), "+Inf"};
+  dest[nb].suffix = "_sum";
+  dest[nb + 1].suffix = "_count";
 }
 
 }  // namespace metrics
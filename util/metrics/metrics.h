@@ -4,6 +4,11 @@
 
 #pragma once
 
+#include <string>
+#include <vector>
+
+#include "util/fibers/cycle_clock.h"
+#include "util/fibers/proactor_base.h"
 #include "util/metrics/family.h"
 
 namespace util {
@@ -37,6 +42,8 @@ class Metric {
 
 class SingleFamily : public Family {
  public:
+  class Handle;
+
   SingleFamily(const char* name, const char* help) : Family(name, help) {
   }
 
@@ -49,18 +56,81 @@ class SingleFamily : public Family {
 
   void IncBy(absl::Span<const std::string_view> label_values, double val);
 
+  // Returns a handle of the metric of label_values, see Handle. Must be called after Init.
+  Handle Bind(absl::Span<const std::string_view> label_values);
+
  protected:
-  DenseId GetDenseId(unsigned thread_index, absl::Span<const std::string_view> label_values);
+  // Returns the thread local id of label_values.
+  DenseId GetLocalId(unsigned thread_index, absl::Span<const std::string_view> label_values);
   void Combine(unsigned thread_index, absl::Span<double> dest) const final;
+  void Reconcile(unsigned thread_index) final;
 
   struct PerThread {
-    LabelMap label_map;  // mapping from hash(label_values) to dense_id controlled by label_values_
-    std::vector<detail::Metric> metric_vec;  // map from dense_id to Counter.
+    LocalLabels labels;
+    std::vector<detail::Metric> metric_vec;  // map from local id to Counter.
   };
 
   // array of cardinality ProactorPool::size() and each proactor thread accesses its
   // own per-thread instance.
   std::unique_ptr<PerThread[]> per_thread_;
+
+  // Incremented by Init and Shutdown, invalidates the ids resolved by the handles.
+  uint32_t generation_ = 0;
+};
+
+// A metric of a label tuple that resolves its local id once per proactor thread, hence its
+// updates are a plain add into the metric vector of the thread, without hashing the labels
+// and looking them up. Handles must not outlive their family but survive its Shutdown and
+// Init: the updates are dropped while the family is shut down and the ids are resolved again
+// after it is initialized, though the updates of the threads beyond the pool size at the
+// time of Bind are dropped. Like the family updates, the updates from non-proactor threads
+// are dropped.
+class SingleFamily::Handle {
+ public:
+  Handle() = default;
+  Handle(Handle&&) = default;
+  Handle& operator=(Handle&&) = default;
+
+  void Inc() {
+    IncBy(1);
+  }
+
+  void IncBy(double val) {
+    if (Metric* metric = LocalMetric())
+      metric->IncBy(val);
+  }
+
+  // For gauges.
+  void Set(double val) {
+    if (Metric* metric = LocalMetric())
+      metric->set_val(val);
+  }
+
+ private:
+  friend class SingleFamily;
+
+  struct Slot {
+    uint32_t generation = 0;  // 0 if not resolved, family generations start from 1.
+    DenseId local_id = 0;
+  };
+
+  Metric* LocalMetric() {
+    int32_t index = fb2::ProactorBase::me()->GetPoolIndex();
+    if (unsigned(index) >= num_slots_)  // also for non-proactor threads.
+      return nullptr;
+
+    Slot& slot = slots_[index];
+    if (ABSL_PREDICT_FALSE(slot.generation != family_->generation_) && !Resolve(index))
+      return nullptr;
+    return &family_->per_thread_[index].metric_vec[slot.local_id];
+  }
+
+  bool Resolve(unsigned thread_index);
+
+  SingleFamily* family_ = nullptr;
+  unsigned num_slots_ = 0;
+  std::unique_ptr<Slot[]> slots_;
+  std::vector<std::string> label_values_;
 };
 
 }  // namespace detail
@@ -89,7 +159,7 @@ class GaugeFamily : public detail::SingleFamily {
   void Set(absl::Span<const std::string_view> label_values, double val);
 };
 
-// TODO: for overview of Histogram vs Summaries see
+// For overview of Histogram vs Summaries see
 // https://prometheus.io/docs/practices/histograms/#quantiles and
 // https://www.robustperception.io/how-does-a-prometheus-histogram-work
 // Seems like histograms are better choice for efficient server side implementation.
@@ -97,5 +167,66 @@ class GaugeFamily : public detail::SingleFamily {
 // http://dimacs.rutgers.edu/~graham/pubs/slides/bquant-long.pdf
 //
 
+// Histogram with log-linear buckets: every power-of-2 range between min_val and max_val
+// is split into sub_buckets linear buckets, so the bucket index is computed in O(1).
+// Each proactor thread updates its own buckets without atomics, they are merged
+// during Combine and exported as Prometheus _bucket/_sum/_count series.
+class HistogramFamily : public Family {
+ public:
+  HistogramFamily(const char* name, const char* help, double min_val = 1e-6, double max_val = 10,
+                  unsigned sub_buckets = 4);
+
+  void Init(ProactorPool* pp, std::initializer_list<Label> list);
+  void Shutdown();
+
+  void Observe(absl::Span<const std::string_view> label_values, double val);
+
+  // Observes the duration of cycles, measured with fb2::CycleClock, in seconds. Cheap enough
+  // to time every I/O operation: start = CycleClock::Now() ... ObserveCycles(labels,
+  // CycleClock::Now() - start).
+  void ObserveCycles(absl::Span<const std::string_view> label_values, uint64_t cycles);
+
+  // Observes the durations counted by hist, e.g. the difference between two snapshots of
+  // ProactorBase::LoopStats. The durations of each power-of-2 bucket of hist are observed
+  // as its midpoint, the sum is exact.
+  void ObserveCycles(absl::Span<const std::string_view> label_values,
+                     const fb2::CycleHistogram& hist);
+
+  // Upper bounds of the finite buckets. The last implicit bucket is +Inf.
+  const std::vector<double>& bounds() const {
+    return bounds_;
+  }
+
+  // Returns the bucket index for val, bounds().size() for +Inf.
+  unsigned BucketIndex(double val) const;
+
+ private:
+  void Combine(unsigned thread_index, absl::Span<double> dest) const final;
+  void SetAdjustments(absl::Span<ObservationDescriptor::Adjustment> dest) const final;
+  void Reconcile(unsigned thread_index) final;
+
+  // Returns the thread local id of label_values.
+  DenseId GetLocalId(unsigned thread_index, absl::Span<const std::string_view> label_values);
+
+  unsigned num_buckets() const {
+    return bounds_.size() + 1;
+  }
+
+  struct PerThread {
+    LocalLabels labels;
+
+    // Bucket counters, num_buckets() per local id. Not cumulative.
+    std::vector<uint64_t> buckets;
+    std::vector<double> sum;  // indexed by local id.
+  };
+
+  double min_val_;
+  unsigned sub_buckets_;
+  std::vector<double> bounds_;
+  std::vector<std::string> le_values_;  // formatted bounds for the "le" label.
+
+  std::unique_ptr<PerThread[]> per_thread_;
+};
+
 }  // namespace metrics
 }  // namespace util
@@ -0,0 +1,170 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/metrics/proactor_metrics.h"
+
+#include <absl/strings/str_cat.h>
+
+#include "base/logging.h"
+#include "util/fiber_socket_base.h"
+#include "util/fibers/fibers.h"
+#include "util/proactor_pool.h"
+
+namespace util {
+namespace metrics {
+
+using namespace std;
+using fb2::CycleHistogram;
+
+struct ProactorMetrics::PerThread {
+  string label;
+  ProactorBase* proactor = nullptr;
+  uint32_t periodic_id = 0;
+
+  // The histograms as of the previous export.
+  CycleHistogram iteration, wait, ready_delay;
+  SocketTimestampStats sockets;
+};
+
+namespace {
+
+// Returns cur - *prev and updates *prev to cur.
+CycleHistogram Advance(const CycleHistogram& cur, CycleHistogram* prev) {
+  CycleHistogram delta;
+  for (unsigned i = 0; i < CycleHistogram::kNumBuckets; ++i)
+    delta.buckets[i] = cur.buckets[i] - prev->buckets[i];
+  delta.sum = cur.sum - prev->sum;
+  *prev = cur;
+  return delta;
+}
+
+}  // namespace
+
+ProactorMetrics::ProactorMetrics()
+    : iteration_hist_("proactor_loop_iteration_seconds",
+                      "Durations of the proactor loop iterations excluding the io wait", 1e-7, 10),
+      wait_hist_("proactor_io_wait_seconds", "Durations of the proactor waits for io", 1e-6,
+                 100),
+      ready_delay_hist_("proactor_ready_delay_seconds",
+                        "Delays between the activation of the fibers and their run", 1e-7, 10),
+      rx_wakeup_hist_("proactor_socket_rx_wakeup_seconds",
+                      "Delays between the reception of data by the kernel and its read", 1e-6,
+                      10),
+      rx_nic_hist_("proactor_socket_rx_nic_seconds",
+                   "Delays between the reception of data by the NIC and by the kernel", 1e-7, 1),
+      tx_send_hist_("proactor_socket_tx_send_seconds",
+                    "Delays between the writes and the handoff of the data to the NIC driver",
+                    1e-7, 1),
+      ready_fibers_("proactor_ready_fibers", "Fibers in the ready queue of the proactor"),
+      task_queue_depth_("proactor_task_queue_depth",
+                        "Functions dispatched to the proactor that did not run yet"),
+      cgroup_quota_("cgroup_cpu_quota", "Cpus the cgroup of the process may use, 0 if unlimited"),
+      cgroup_periods_("cgroup_cpu_periods_total", "Cpu quota enforcement periods of the cgroup"),
+      cgroup_throttled_periods_("cgroup_cpu_throttled_periods_total",
+                                "Enforcement periods in which the cgroup was throttled"),
+      cgroup_throttled_seconds_("cgroup_cpu_throttled_seconds_total",
+                                "Time the cgroup was throttled by its cpu quota") {
+}
+
+ProactorMetrics::~ProactorMetrics() {
+  CHECK(!pp_) << "Shutdown must be called before destruction";
+}
+
+void ProactorMetrics::Init(ProactorPool* pp, chrono::milliseconds period) {
+  CHECK(!pp_);
+  CHECK_GT(period.count(), 0);
+
+  pp_ = pp;
+  iteration_hist_.Init(pp, {"proactor"});
+  wait_hist_.Init(pp, {"proactor"});
+  ready_delay_hist_.Init(pp, {"proactor"});
+  rx_wakeup_hist_.Init(pp, {"proactor"});
+  rx_nic_hist_.Init(pp, {"proactor"});
+  tx_send_hist_.Init(pp, {"proactor"});
+  ready_fibers_.Init(pp, {"proactor"});
+  task_queue_depth_.Init(pp, {"proactor"});
+  cgroup_quota_.Init(pp, {});
+  cgroup_periods_.Init(pp, {});
+  cgroup_throttled_periods_.Init(pp, {});
+  cgroup_throttled_seconds_.Init(pp, {});
+  has_cgroup_stats_ = base::sys::GetCgroupCpuStats(&cgroup_stats_);
+
+  per_thread_.reset(new PerThread[pp->size()]);
+  pp->AwaitBrief([this, period](unsigned index, ProactorBase* pb) {
+    PerThread* pt = &per_thread_[index];
+    pt->label = absl::StrCat(index);
+    pt->proactor = pb;
+    pt->iteration = pb->loop_stats().iteration;
+    pt->wait = pb->loop_stats().wait;
+    pt->ready_delay = fb2::FiberReadyDelayHistogram();
+    pt->sockets = ThreadSocketTimestampStats();
+    pt->periodic_id = pb->AddPeriodic(period.count(), [this, pt] { Export(pt); });
+  });
+}
+
+void ProactorMetrics::Shutdown() {
+  if (!pp_)
+    return;
+
+  // CancelPeriodic must run in a fiber.
+  pp_->AwaitFiberOnAll([this](unsigned index, ProactorBase* pb) {
+    pb->CancelPeriodic(per_thread_[index].periodic_id);
+  });
+
+  cgroup_throttled_seconds_.Shutdown();
+  cgroup_throttled_periods_.Shutdown();
+  cgroup_periods_.Shutdown();
+  cgroup_quota_.Shutdown();
+  task_queue_depth_.Shutdown();
+  ready_fibers_.Shutdown();
+  tx_send_hist_.Shutdown();
+  rx_nic_hist_.Shutdown();
+  rx_wakeup_hist_.Shutdown();
+  ready_delay_hist_.Shutdown();
+  wait_hist_.Shutdown();
+  iteration_hist_.Shutdown();
+  per_thread_.reset();
+  pp_ = nullptr;
+}
+
+void ProactorMetrics::Export(PerThread* pt) {
+  const ProactorBase::LoopStats& ls = pt->proactor->loop_stats();
+  string_view label = pt->label;
+
+  iteration_hist_.ObserveCycles({label}, Advance(ls.iteration, &pt->iteration));
+  wait_hist_.ObserveCycles({label}, Advance(ls.wait, &pt->wait));
+  ready_delay_hist_.ObserveCycles({label},
+                                  Advance(fb2::FiberReadyDelayHistogram(), &pt->ready_delay));
+
+  const SocketTimestampStats& ss = ThreadSocketTimestampStats();
+  rx_wakeup_hist_.ObserveCycles({label}, Advance(ss.rx_wakeup, &pt->sockets.rx_wakeup));
+  rx_nic_hist_.ObserveCycles({label}, Advance(ss.rx_nic, &pt->sockets.rx_nic));
+  tx_send_hist_.ObserveCycles({label}, Advance(ss.tx_send, &pt->sockets.tx_send));
+
+  ready_fibers_.Set({label}, fb2::ReadyFibersCount());
+  task_queue_depth_.Set({label}, pt->proactor->task_queue_depth());
+
+  if (pt != &per_thread_[0])
+    return;
+
+  // The quota may change at runtime, e.g. when the container is resized.
+  cgroup_quota_.Set({}, base::sys::GetCgroupCpuQuota());
+
+  base::sys::CgroupCpuStats cur;
+  if (!has_cgroup_stats_ || !base::sys::GetCgroupCpuStats(&cur))
+    return;
+
+  // The counters are monotonic unless the process moved to another cgroup.
+  if (cur.periods >= cgroup_stats_.periods &&
+      cur.throttled_periods >= cgroup_stats_.throttled_periods &&
+      cur.throttled_usec >= cgroup_stats_.throttled_usec) {
+    cgroup_periods_.IncBy({}, cur.periods - cgroup_stats_.periods);
+    cgroup_throttled_periods_.IncBy({}, cur.throttled_periods - cgroup_stats_.throttled_periods);
+    cgroup_throttled_seconds_.IncBy({}, (cur.throttled_usec - cgroup_stats_.throttled_usec) * 1e-6);
+  }
+  cgroup_stats_ = cur;
+}
+
+}  // namespace metrics
+}  // namespace util
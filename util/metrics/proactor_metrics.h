@@ -0,0 +1,66 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include "base/proc_util.h"
+#include "util/metrics/metrics.h"
+
+namespace util {
+namespace metrics {
+
+// Exports the event loop metrics of the proactors of a pool, labeled by the proactor index:
+//   proactor_loop_iteration_seconds - histogram of the loop iterations excluding the blocking
+//                                     io wait, i.e. how late the loop reacts to new events.
+//   proactor_io_wait_seconds        - histogram of the waits in io_uring_wait_cqe or
+//                                     epoll_wait.
+//   proactor_ready_delay_seconds    - histogram of the delays between the activation of a
+//                                     fiber and the time it runs.
+//   proactor_ready_fibers           - gauge of the fibers in the ready queue.
+//   proactor_task_queue_depth       - gauge of the functions that other threads dispatched
+//                                     to the proactor and that did not run yet.
+//   proactor_socket_rx_wakeup_seconds, proactor_socket_rx_nic_seconds,
+//   proactor_socket_tx_send_seconds - histograms of the delays measured by the sockets with
+//                                     kernel timestamping, see SocketTimestampStats.
+// In addition, the first proactor exports the cpu controller of the cgroup of the process,
+// without labels:
+//   cgroup_cpu_quota                       - gauge of the cpus the cgroup may use, 0 if unlimited.
+//   cgroup_cpu_periods_total               - counter of the enforcement periods.
+//   cgroup_cpu_throttled_periods_total     - counter of the periods in which it was throttled.
+//   cgroup_cpu_throttled_seconds_total     - counter of the time it was throttled.
+// The proactors measure the durations all the time and every proactor exports its progress
+// since the previous export and samples the gauges each period.
+class ProactorMetrics {
+ public:
+  ProactorMetrics();
+  ~ProactorMetrics();
+
+  void Init(ProactorPool* pp, std::chrono::milliseconds period = std::chrono::seconds(1));
+  void Shutdown();
+
+ private:
+  struct PerThread;
+
+  void Export(PerThread* pt);
+
+  HistogramFamily iteration_hist_, wait_hist_, ready_delay_hist_;
+  HistogramFamily rx_wakeup_hist_, rx_nic_hist_, tx_send_hist_;
+  GaugeFamily ready_fibers_, task_queue_depth_;
+  GaugeFamily cgroup_quota_;
+  CounterFamily cgroup_periods_, cgroup_throttled_periods_, cgroup_throttled_seconds_;
+
+  // The cgroup stats as of the previous export, accessed by the first proactor.
+  base::sys::CgroupCpuStats cgroup_stats_{};
+  bool has_cgroup_stats_ = false;
+
+  ProactorPool* pp_ = nullptr;
+  std::unique_ptr<PerThread[]> per_thread_;
+};
+
+}  // namespace metrics
+}  // namespace util
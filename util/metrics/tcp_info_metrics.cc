@@ -0,0 +1,180 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/metrics/tcp_info_metrics.h"
+
+#include <absl/strings/str_cat.h>
+
+#include <algorithm>
+
+#include "base/logging.h"
+#include "util/connection.h"
+#include "util/listener_interface.h"
+#include "util/proactor_pool.h"
+
+namespace util {
+namespace metrics {
+
+using namespace std;
+using base::VarzValue;
+
+namespace {
+
+struct SlowConnection {
+  string remote;
+  TcpInfo info;
+};
+
+}  // namespace
+
+struct TcpInfoMetrics::PerThread {
+  string label;
+  uint32_t periodic_id = 0;
+
+  // Position of the next connection to sample in the connection list of the proactor.
+  size_t cursor = 0;
+
+  // Reused between the periods.
+  vector<Connection*> conns, sampled;
+
+  vector<SlowConnection> slowest;
+};
+
+TcpInfoMetrics::TcpInfoMetrics()
+    : rtt_hist_("tcp_rtt_seconds", "Smoothed round trip times of the sampled connections", 1e-5,
+                10),
+      retransmits_("tcp_retransmits_total", "Segments retransmitted by the sampled connections"),
+      cwnd_("tcp_cwnd_segments", "Mean congestion window of the sampled connections"),
+      unacked_("tcp_unacked_segments", "Segments in flight of the sampled connections"),
+      lost_("tcp_lost_segments", "Segments in flight of the sampled connections that are lost"),
+      sampled_("tcp_sampled_connections", "Connections sampled in the last period"),
+      varz_("tcp-info", [this] { return GetVarz(); }) {
+}
+
+TcpInfoMetrics::~TcpInfoMetrics() {
+  CHECK(!pp_) << "Shutdown must be called before destruction";
+}
+
+void TcpInfoMetrics::Init(ProactorPool* pp, ListenerInterface* listener, const Options& opts) {
+  CHECK(!pp_);
+  CHECK_GT(opts.period.count(), 0);
+  CHECK_GT(opts.max_samples, 0u);
+
+  listener_ = listener;
+  opts_ = opts;
+  rtt_hist_.Init(pp, {"proactor"});
+  retransmits_.Init(pp, {"proactor"});
+  cwnd_.Init(pp, {"proactor"});
+  unacked_.Init(pp, {"proactor"});
+  lost_.Init(pp, {"proactor"});
+  sampled_.Init(pp, {"proactor"});
+
+  per_thread_.reset(new PerThread[pp->size()]);
+  pp->AwaitBrief([this](unsigned index, ProactorBase* pb) {
+    PerThread* pt = &per_thread_[index];
+    pt->label = absl::StrCat(index);
+    pt->periodic_id = pb->AddPeriodic(opts_.period.count(), [this, pt] { Sample(pt); });
+  });
+  pp_ = pp;
+}
+
+void TcpInfoMetrics::Shutdown() {
+  if (!pp_)
+    return;
+
+  // CancelPeriodic must run in a fiber.
+  pp_->AwaitFiberOnAll([this](unsigned index, ProactorBase* pb) {
+    pb->CancelPeriodic(per_thread_[index].periodic_id);
+  });
+
+  sampled_.Shutdown();
+  lost_.Shutdown();
+  unacked_.Shutdown();
+  cwnd_.Shutdown();
+  retransmits_.Shutdown();
+  rtt_hist_.Shutdown();
+  pp_ = nullptr;
+  per_thread_.reset();
+}
+
+void TcpInfoMetrics::Sample(PerThread* pt) {
+  string_view label = pt->label;
+  vector<Connection*>& conns = pt->conns;
+  vector<Connection*>& sampled = pt->sampled;
+
+  // The traversal and the sampling below do not preempt, hence the connections stay alive.
+  conns.clear();
+  listener_->TraverseConnectionsOnThread(
+      [&conns](unsigned, Connection* conn) { conns.push_back(conn); });
+
+  size_t start = conns.empty() ? 0 : pt->cursor % conns.size();
+  size_t num = min<size_t>(conns.size(), opts_.max_samples);
+  pt->cursor = start + num;
+
+  sampled.clear();
+  uint64_t cwnd = 0, unacked = 0, lost = 0, retransmits = 0;
+  for (size_t i = 0; i < num; ++i) {
+    Connection* conn = conns[(start + i) % conns.size()];
+    const FiberSocketBase* sock = conn->socket();
+    TcpInfo info;
+    if (!sock || !sock->IsOpen() || sock->IsUDS() || GetTcpInfo(sock->native_handle(), &info))
+      continue;
+
+    // The counter of the socket is monotonic, the previous sample is zero for new connections.
+    if (info.total_retrans > conn->tcp_info_.total_retrans)
+      retransmits += info.total_retrans - conn->tcp_info_.total_retrans;
+    conn->tcp_info_ = info;
+
+    rtt_hist_.Observe({label}, info.rtt_usec * 1e-6);
+    cwnd += info.snd_cwnd;
+    unacked += info.unacked;
+    lost += info.lost;
+    sampled.push_back(conn);
+  }
+
+  retransmits_.IncBy({label}, retransmits);
+  cwnd_.Set({label}, sampled.empty() ? 0 : double(cwnd) / sampled.size());
+  unacked_.Set({label}, unacked);
+  lost_.Set({label}, lost);
+  sampled_.Set({label}, sampled.size());
+
+  size_t num_slowest = min<size_t>(sampled.size(), opts_.num_slowest);
+  partial_sort(sampled.begin(), sampled.begin() + num_slowest, sampled.end(),
+               [](const Connection* l, const Connection* r) {
+                 return l->tcp_info_.rtt_usec > r->tcp_info_.rtt_usec;
+               });
+  pt->slowest.resize(num_slowest);
+  for (size_t i = 0; i < num_slowest; ++i) {
+    auto ep = sampled[i]->socket()->RemoteEndpoint();
+    pt->slowest[i].remote = absl::StrCat(ep.address().to_string(), ":", ep.port());
+    pt->slowest[i].info = sampled[i]->tcp_info_;
+  }
+}
+
+VarzFunction::KeyValMap TcpInfoMetrics::GetVarz() const {
+  VarzFunction::KeyValMap res;
+  if (!pp_)
+    return res;
+
+  vector<vector<SlowConnection>> slowest(pp_->size());
+  pp_->AwaitBrief(
+      [&](unsigned index, ProactorBase*) { slowest[index] = per_thread_[index].slowest; });
+
+  for (unsigned index = 0; index < slowest.size(); ++index) {
+    for (const SlowConnection& conn : slowest[index]) {
+      const TcpInfo& info = conn.info;
+      VarzValue::Map vals{{"rtt_usec", VarzValue::FromInt(info.rtt_usec)},
+                          {"rtt_var_usec", VarzValue::FromInt(info.rtt_var_usec)},
+                          {"snd_cwnd", VarzValue::FromInt(info.snd_cwnd)},
+                          {"unacked", VarzValue::FromInt(info.unacked)},
+                          {"lost", VarzValue::FromInt(info.lost)},
+                          {"total_retrans", VarzValue::FromInt(info.total_retrans)}};
+      res.emplace_back(absl::StrCat(index, "/", conn.remote), std::move(vals));
+    }
+  }
+  return res;
+}
+
+}  // namespace metrics
+}  // namespace util
@@ -0,0 +1,77 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "util/metrics/metrics.h"
+#include "util/varz.h"
+
+namespace util {
+
+class ListenerInterface;
+
+namespace metrics {
+
+// Samples TCP_INFO of the connections of a listener and exports, labeled by the proactor index:
+//   tcp_rtt_seconds          - histogram of the smoothed round trip times of the sampled
+//                              connections.
+//   tcp_retransmits_total    - counter of the segments that the sampled connections
+//                              retransmitted since their previous sample.
+//   tcp_cwnd_segments        - gauge of the mean congestion window of the sampled connections.
+//   tcp_unacked_segments     - gauge of the segments in flight of the sampled connections.
+//   tcp_lost_segments        - gauge of the segments in flight that are considered lost.
+//   tcp_sampled_connections  - gauge of the connections sampled in the last period.
+// Every proactor samples its connections from a periodic task, at most max_samples of them per
+// period and resuming from where the previous period stopped, so that the cost of the
+// getsockopt calls stays bounded with many connections. The last sample of every connection is
+// kept in Connection::tcp_info(). The connections of every proactor with the highest round trip
+// times in the last period are shown on the status page under the "tcp-info" varz.
+class TcpInfoMetrics {
+ public:
+  struct Options {
+    std::chrono::milliseconds period{1000};
+
+    // Connections sampled per proactor and period.
+    unsigned max_samples = 256;
+
+    // Connections per proactor shown on the status page.
+    unsigned num_slowest = 4;
+  };
+
+  TcpInfoMetrics();
+  ~TcpInfoMetrics();
+
+  // The listener must already be accepting connections.
+  void Init(ProactorPool* pp, ListenerInterface* listener, const Options& opts);
+  void Init(ProactorPool* pp, ListenerInterface* listener) {
+    Init(pp, listener, Options{});
+  }
+
+  // Must be called before the listener shuts down.
+  void Shutdown();
+
+ private:
+  struct PerThread;
+
+  void Sample(PerThread* pt);
+  VarzFunction::KeyValMap GetVarz() const;
+
+  HistogramFamily rtt_hist_;
+  CounterFamily retransmits_;
+  GaugeFamily cwnd_, unacked_, lost_, sampled_;
+  VarzFunction varz_;
+
+  ProactorPool* pp_ = nullptr;
+  ListenerInterface* listener_ = nullptr;
+  Options opts_;
+  std::unique_ptr<PerThread[]> per_thread_;
+};
+
+}  // namespace metrics
+}  // namespace util
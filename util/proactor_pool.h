@@ -33,9 +33,17 @@ class ProactorPool {
   virtual ~ProactorPool();
 
   //! Starts running all Proactor objects in the pool.
-  //! Blocks until all the proactors up and spinning.
+  //! Blocks until all the proactors up and spinning and, if the warm-up is enabled, until
+  //! all of them are warmed up.
   void Run();
 
+  //! Enables or disables the warm-up phase of Run, which calls ProactorBase::Warmup in every
+  //! proactor thread so that the first requests do not fault in the stacks and the buffers.
+  //! Defaults to --proactor_warmup. Must be called before Run.
+  void set_warmup(bool enable) {
+    warmup_ = enable;
+  }
+
   /*! @brief Stops all io_context objects in the pool.
    *
    *  Waits for all the threads to finish. Requires that Run has been called.
@@ -43,9 +51,36 @@ class ProactorPool {
    */
   void Stop();
 
-  //! Get a Proactor to use. Thread-safe.
+  //! Enables work stealing between all the proactors of the pool: migratable fibers
+  //! (see ThisFiber::SetMigratable) that yield can be resumed by idle proactors.
+  //! Requires that Run has been called.
+  void EnableWorkStealing();
+
+  //! Get an active Proactor to use. Thread-safe.
   ProactorBase* GetNextProactor();
 
+  //! Like GetNextProactor but prefers the active proactors pinned to numa_node.
+  //! Falls back to GetNextProactor if there are none. Thread-safe.
+  ProactorBase* GetNextProactorOnNode(int numa_node);
+
+  //! Shrinks or grows the pool at runtime: only the first n proactors stay active and get
+  //! new work from GetNextProactor, GetNextProactorOnNode, work stealing and the connection
+  //! placement of the listeners. The threads of the other proactors keep running but park:
+  //! without work they block in the kernel and give their cpus back. Parking does not change
+  //! size(), hence the per-thread structures that are indexed by the pool index, e.g. of
+  //! metrics::Family or SlidingCounter, stay valid. The work that is already on a parked
+  //! proactor stays there, see AcceptServer::SetActiveProactors to move the connections off.
+  //! 1 <= n <= size(). Requires that Run has been called.
+  void SetActiveSize(size_t n);
+
+  size_t active_size() const {
+    return active_size_.load(std::memory_order_relaxed);
+  }
+
+  bool IsActive(unsigned index) const {
+    return index < active_size();
+  }
+
   ProactorBase& operator[](size_t i) {
     return *at(i);
   }
@@ -213,6 +248,33 @@ class ProactorPool {
     return cpu_threads_;
   }
 
+  // Returns the NUMA node of cpu_id or -1 if the topology is unknown.
+  int CpuToNumaNode(unsigned cpu_id) const {
+    return cpu_id < cpu_node_.size() ? cpu_node_[cpu_id] : -1;
+  }
+
+  // Returns the NUMA node the proactor thread is pinned to or -1 if it is not pinned.
+  int numa_node(unsigned index) const {
+    return index < proactor_node_.size() ? proactor_node_[index] : -1;
+  }
+
+  // Number of NUMA nodes that have proactor threads pinned to them.
+  unsigned num_numa_nodes() const {
+    return num_numa_nodes_;
+  }
+
+  // True if --proactor_affinity_mode=numa spread the proactor threads across several NUMA
+  // nodes.
+  bool numa_spread() const {
+    return numa_spread_;
+  }
+
+  // True if the automatic pool size was reduced to the cpu quota of the cgroup, see the
+  // --proactor_cgroup_quota flag.
+  bool quota_limited() const {
+    return quota_limited_;
+  }
+
  protected:
   virtual ProactorBase* CreateProactor() = 0;
   virtual void InitInThread(unsigned index) = 0;
@@ -225,9 +287,15 @@ class ProactorPool {
   void WrapLoop(size_t index, BlockingCounter* bc);
   void CheckRunningState();
 
+  // Sets the steal peers of every proactor to the active proactors.
+  void UpdateStealPeers();
+
   /// The next io_context to use for a connection.
   std::atomic_uint_fast32_t next_io_context_{0};
   uint32_t pool_size_;
+  std::atomic_uint32_t active_size_;
+  bool work_stealing_ = false;
+  bool warmup_ = false;
 
   folly::RWSpinLock str_lock_;
   absl::flat_hash_set<std::string_view> str_set_;
@@ -241,6 +309,17 @@ class ProactorPool {
 
   // maps cpu_id to thread array.
   std::vector<std::vector<unsigned>> cpu_threads_;
+
+  // NUMA topology: cpu_id to node and node to the threads pinned to it.
+  std::vector<int> cpu_node_, proactor_node_;
+  std::vector<std::vector<unsigned>> node_threads_;
+  unsigned num_numa_nodes_ = 0;
+  bool numa_spread_ = false;
+  bool quota_limited_ = false;
+  std::atomic_uint32_t next_node_proactor_{0};
+
+  // Duration of InitInThread per proactor thread, for the startup log.
+  std::vector<uint64_t> init_nanos_;
 };
 
 }  // namespace util
@@ -4,11 +4,16 @@
 
 #pragma once
 
+#include <absl/base/optimization.h>
+#include <time.h>
+
 #include <array>
 #include <cstdint>
 #include <memory>
 #include <numeric>
 
+#include "base/histogram.h"
+#include "base/logging.h"
 #include "util/proactor_pool.h"
 
 namespace util {
@@ -19,21 +24,74 @@ class SlidingCounterBase {
  protected:
   void InitInternal(ProactorPool* pp);
   void CheckInit() const;
-  unsigned ProactorThreadIndex() const;
+
+  // Runs on every update, hence checks only in debug builds.
+  unsigned ProactorThreadIndex() const {
+    DCHECK(pp_);
+    int32_t indx = fb2::ProactorBase::me()->GetPoolIndex();
+    DCHECK_GE(indx, 0) << "Must be called from proactor thread!";
+    DCHECK_LT(unsigned(indx), pp_->size()) << "Invalid thread index " << indx;
+    return unsigned(indx);
+  }
 
   ProactorPool* pp_ = nullptr;
 };
 
+// Milliseconds clock that replaces the real clocks of WindowTick, e.g. to step the time in
+// tests. Set it before the counters are used and reset it to nullptr afterwards.
+using WindowClock = uint64_t (*)();
+inline WindowClock window_clock = nullptr;
+
+// Returns the current time in units of RES_MS milliseconds. Second bins follow the wall
+// clock, shorter bins the coarse monotonic clock, which is as cheap as time().
+template <unsigned RES_MS> uint64_t WindowTick() {
+  if (ABSL_PREDICT_FALSE(window_clock))
+    return window_clock() / RES_MS;
+
+  if constexpr (RES_MS == 1000) {
+    return time(NULL);
+  } else {
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000) / RES_MS;
+  }
+}
+
+// Moves the window of NUM bins to the current tick and returns the current bin.
+// Calls clear_bin for every bin that expired since last_tick.
+template <unsigned NUM, unsigned RES_MS, typename F>
+uint32_t AdvanceWindow(uint64_t* last_tick, F&& clear_bin) {
+  uint64_t current = WindowTick<RES_MS>();
+  if (*last_tick + NUM <= current) {
+    for (unsigned i = 0; i < NUM; ++i)
+      clear_bin(i);
+  } else {
+    // Reset delta upto current_time including.
+    for (uint64_t i = *last_tick + 1; i <= current; ++i)
+      clear_bin(i % NUM);
+  }
+  *last_tick = current;
+  return current % NUM;
+}
+
 }  // namespace detail
 
 /**
  * @brief Sliding window data structure that can aggregate moving statistics.
  *        It's implmented using ring-buffer with size specified at compile time.
  *
- * @tparam NUM
+ * @tparam NUM number of bins in the window.
+ * @tparam RES_MS the time span of a bin in milliseconds. Bins shorter than a second,
+ *         e.g. 100ms, expose bursts that second bins average out.
+ *         The resolution of the clock limits it to 10ms.
  */
-template <unsigned NUM, typename T = int32_t> class SlidingCounter {
+template <unsigned NUM, typename T = int32_t, unsigned RES_MS = 1000> class SlidingCounter {
   static_assert(NUM > 1, "Invalid window size");
+  static_assert(RES_MS >= 10, "Invalid bin resolution");
 
   mutable std::array<T, NUM> count_;
 
@@ -56,7 +114,7 @@ template <unsigned NUM, typename T = int32_t> class SlidingCounter {
 
   T Sum() const {
     MoveTsIfNeeded();
-    return std::accumulate(count_.begin(), count_.end(), 0);
+    return std::accumulate(count_.begin(), count_.end(), T{});
   }
 
   void Reset() {
@@ -64,17 +122,55 @@ template <unsigned NUM, typename T = int32_t> class SlidingCounter {
   }
 
  private:
-  // Returns the bin corresponding to the current timestamp. Has second precision.
+  // Returns the bin corresponding to the current timestamp. Has RES_MS precision.
   // updates last_ts_ according to the current timestamp and returns the latest bin.
   // has const semantics even though it updates mutable last_ts_.
-  uint32_t MoveTsIfNeeded() const;
+  uint32_t MoveTsIfNeeded() const {
+    return detail::AdvanceWindow<NUM, RES_MS>(&last_ts_, [this](unsigned i) { count_[i] = 0; });
+  }
+
+  mutable uint64_t last_ts_ = 0;
+};
+
+// Sliding window of histograms, one per bin, for windowed percentiles.
+// A bin takes about 1.3KB, see base::FixedHistogram.
+template <unsigned NUM, unsigned RES_MS = 1000> class SlidingHistogram {
+  static_assert(NUM > 1, "Invalid window size");
+  static_assert(RES_MS >= 10, "Invalid bin resolution");
+
+ public:
+  void Add(double value) {
+    bins_[MoveTsIfNeeded()].Add(value);
+  }
+
+  // Merges the bins into dest, not including the last bin that is currently being filled.
+  void MergeTail(base::FixedHistogram* dest) const;
+
+  // Merges all the bins into dest.
+  void Merge(base::FixedHistogram* dest) const {
+    MoveTsIfNeeded();
+    for (const auto& bin : bins_)
+      dest->Merge(bin);
+  }
+
+  void Reset() {
+    for (auto& bin : bins_)
+      bin.Clear();
+  }
+
+ private:
+  uint32_t MoveTsIfNeeded() const {
+    return detail::AdvanceWindow<NUM, RES_MS>(&last_ts_, [this](unsigned i) { bins_[i].Clear(); });
+  }
 
-  mutable uint32_t last_ts_ = 0;
+  mutable std::array<base::FixedHistogram, NUM> bins_;
+  mutable uint64_t last_ts_ = 0;
 };
 
 // Requires proactor_pool initialize all the proactors.
-template <unsigned NUM> class SlidingCounterDist : protected detail::SlidingCounterBase {
-  using Counter = SlidingCounter<NUM>;
+template <unsigned NUM, unsigned RES_MS = 1000>
+class SlidingCounterDist : protected detail::SlidingCounterBase {
+  using Counter = SlidingCounter<NUM, int32_t, RES_MS>;
 
  public:
   enum { WIN_SIZE = NUM };
@@ -95,6 +191,10 @@ template <unsigned NUM> class SlidingCounterDist : protected detail::SlidingCoun
     sc_thread_map_[ProactorThreadIndex()].Inc();
   }
 
+  void IncBy(int32_t delta) {
+    sc_thread_map_[ProactorThreadIndex()].IncBy(delta);
+  }
+
   uint32_t Sum() const {
     CheckInit();
 
@@ -121,11 +221,53 @@ template <unsigned NUM> class SlidingCounterDist : protected detail::SlidingCoun
   std::unique_ptr<Counter[]> sc_thread_map_;
 };
 
+// Per-proactor sliding histograms, merged across the pool upon read.
+// Requires proactor_pool initialize all the proactors.
+template <unsigned NUM, unsigned RES_MS = 1000>
+class SlidingHistogramDist : protected detail::SlidingCounterBase {
+  using Hist = SlidingHistogram<NUM, RES_MS>;
+
+ public:
+  enum { WIN_SIZE = NUM };
+
+  void Init(ProactorPool* pp) {
+    InitInternal(pp);
+    thread_hist_.reset(new Hist[pp_->size()]);
+  }
+
+  void Shutdown() {
+    thread_hist_.reset();
+    pp_ = nullptr;
+  }
+
+  void Add(double value) {
+    thread_hist_[ProactorThreadIndex()].Add(value);
+  }
+
+  // Returns the histogram of the window, not including the bins that are currently being
+  // filled. Use Percentile() of the result for windowed percentiles.
+  base::FixedHistogram MergeTail() const {
+    CheckInit();
+
+    std::unique_ptr<base::FixedHistogram[]> parts(new base::FixedHistogram[pp_->size()]);
+    pp_->AwaitBrief([&](unsigned i, auto*) { thread_hist_[i].MergeTail(&parts[i]); });
+
+    base::FixedHistogram res;
+    for (unsigned i = 0; i < pp_->size(); ++i)
+      res.Merge(parts[i]);
+    return res;
+  }
+
+ private:
+  std::unique_ptr<Hist[]> thread_hist_;
+};
+
 /*********************************************
  Implementation section.
 **********************************************/
 
-template <unsigned NUM, typename T> auto SlidingCounter<NUM, T>::SumTail() const -> T {
+template <unsigned NUM, typename T, unsigned RES_MS>
+auto SlidingCounter<NUM, T, RES_MS>::SumTail() const -> T {
   int32_t start = MoveTsIfNeeded() + 1;  // the tail is one after head.
 
   T sum = 0;
@@ -135,19 +277,12 @@ template <unsigned NUM, typename T> auto SlidingCounter<NUM, T>::SumTail() const
   return sum;
 }
 
-template <unsigned NUM, typename T> uint32_t SlidingCounter<NUM, T>::MoveTsIfNeeded() const {
-  uint32_t current_sec = time(NULL);
-  if (last_ts_ + NUM <= current_sec) {
-    count_.fill(0);
-  } else {
-    // Reset delta upto current_time including.
-    for (uint32_t i = last_ts_ + 1; i <= current_sec; ++i) {
-      count_[i % NUM] = 0;
-    }
+template <unsigned NUM, unsigned RES_MS>
+void SlidingHistogram<NUM, RES_MS>::MergeTail(base::FixedHistogram* dest) const {
+  unsigned start = MoveTsIfNeeded() + 1;  // the tail is one after head.
+  for (unsigned i = 0; i < NUM - 1; ++i) {
+    dest->Merge(bins_[(start + i) % NUM]);
   }
-  last_ts_ = current_sec;
-
-  return current_sec % NUM;
 }
 
 }  // namespace util
@@ -0,0 +1,76 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <type_traits>
+#include <typeinfo>
+
+#include "io/io.h"
+#include "util/fiber_socket_base.h"
+#include "util/fibers/epoll_socket.h"
+
+#ifdef __linux__
+#include "util/fibers/uring_socket.h"
+#endif
+
+namespace util {
+
+namespace detail {
+
+template <typename... Sockets> struct SocketVisitor;
+
+template <> struct SocketVisitor<> {
+  template <typename F> static auto Visit(FiberSocketBase* sock, F&& f) {
+    return f(sock);
+  }
+};
+
+template <typename S, typename... Rest> struct SocketVisitor<S, Rest...> {
+  static_assert(std::is_final_v<S>, "only calls on final classes are bound statically");
+
+  template <typename F> static auto Visit(FiberSocketBase* sock, F&& f) {
+    if (typeid(*sock) == typeid(S))
+      return f(static_cast<S*>(sock));
+    return SocketVisitor<Rest...>::Visit(sock, std::forward<F>(f));
+  }
+};
+
+}  // namespace detail
+
+// Calls f with sock cast to its concrete type, so that the socket calls that f makes are bound
+// statically instead of going through the virtual table of FiberSocketBase. f is usually a
+// generic lambda, and the connection loop that it runs is instantiated per socket type.
+// The type is checked once per call, hence VisitSocket should wrap the whole loop rather than
+// a single operation. UringSocket and EpollSocket are always visited, Extra adds final socket
+// types of the other libraries, e.g. tls::TlsSocket. Other sockets are passed as
+// FiberSocketBase*. f must return the same type for all the socket types.
+template <typename... Extra, typename F> auto VisitSocket(FiberSocketBase* sock, F&& f) {
+#ifdef __linux__
+  using Visitor = detail::SocketVisitor<Extra..., fb2::UringSocket, fb2::EpollSocket>;
+#else
+  using Visitor = detail::SocketVisitor<Extra..., fb2::EpollSocket>;
+#endif
+  return Visitor::Visit(sock, std::forward<F>(f));
+}
+
+// Like io::Sink::Write, but calls S::WriteSome directly when S is a concrete socket type.
+template <typename S> std::error_code WriteExactly(S* sock, const iovec* v, uint32_t len) {
+  return io::ApplyExactly(v, len, [sock](const iovec* v, uint32_t len) -> io::Result<size_t> {
+    io::Result<size_t> res;
+    do {
+      res = sock->WriteSome(v, len);
+      if (res && *res == 0)
+        return nonstd::make_unexpected(std::make_error_code(std::errc::io_error));
+    } while (!res && res.error() == std::errc::interrupted);
+    return res;
+  });
+}
+
+template <typename S> std::error_code WriteExactly(S* sock, io::Bytes buf) {
+  iovec v{const_cast<uint8_t*>(buf.data()), buf.size()};
+  return WriteExactly(sock, &v, 1);
+}
+
+}  // namespace util
@@ -0,0 +1,564 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+// TLS benchmark that runs the server and the clients in the same process over loopback tcp.
+// It sweeps the comma separated lists below and prints one json object per configuration.
+//
+// The handshake mode measures the rate of the handshakes with self-signed RSA 2048 or ECDSA
+// P-256 certificates generated at startup, with full or resumed handshakes. Every client
+// fiber connects, waits for the first server byte, which follows the session tickets,
+// and closes the connection in a loop:
+//   tls_bench --modes=handshake --certs=rsa,ecdsa --resume=false,true
+// {"mode":"handshake","backend":"epoll","cert":"rsa","tls":"1.3","resume":true,"c":16,
+//  "handshakes":6400,"full":16,"resumed":6384,"hps":5123,"hps_per_core":5301,...}
+//
+// The bulk mode streams --bulk_mb per connection in writes of the given size, either from
+// the server to the clients (send) or from the clients to the server (recv), with or without
+// the kTLS offload of the server sockets:
+//   tls_bench --modes=bulk --ktls=false,true --directions=send,recv
+// {"mode":"bulk","backend":"uring","ktls":true,"ktls_tx":1,"ktls_rx":1,"direction":"send",
+//  "size":16384,"c":1,"mb_s":2210.5,"mb_s_per_core":2301.3,...}
+//
+// The per core rates divide the totals by the cpu time of the server threads, so that
+// the numbers of a single loaded server thread project to the cores of a TLS terminating
+// tier.
+
+#include <absl/container/flat_hash_map.h>
+#include <absl/strings/numbers.h>
+#include <absl/strings/str_cat.h>
+#include <absl/strings/str_split.h>
+#include <absl/time/clock.h>
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include <ctime>
+#include <fstream>
+#include <iostream>
+
+#include "base/init.h"
+#include "util/accept_server.h"
+#include "util/fibers/pool.h"
+#include "util/listener_interface.h"
+#include "util/tls/tls_session_cache.h"
+#include "util/tls/tls_socket.h"
+
+ABSL_FLAG(std::string, modes, "handshake,bulk", "Benchmarks to run: handshake, bulk");
+ABSL_FLAG(std::string, backends, "epoll,uring", "Proactor backends to sweep: epoll, uring");
+ABSL_FLAG(std::string, tls_versions, "1.3", "TLS versions to sweep: 1.2, 1.3");
+ABSL_FLAG(std::string, certs, "rsa,ecdsa", "Server certificates to sweep: rsa, ecdsa");
+ABSL_FLAG(std::string, resume, "false,true", "Session resumption modes to sweep");
+ABSL_FLAG(std::string, ktls, "false,true", "kTLS modes of the server sockets to sweep");
+ABSL_FLAG(std::string, directions, "send,recv", "Bulk directions relative to the server");
+ABSL_FLAG(std::string, sizes, "16384,262144", "Bulk write sizes to sweep");
+ABSL_FLAG(std::string, c, "1,16", "Connections per client thread to sweep");
+ABSL_FLAG(uint32_t, n, 200, "Number of handshakes per connection fiber");
+ABSL_FLAG(uint32_t, bulk_mb, 512, "Megabytes to transfer per bulk connection");
+ABSL_FLAG(std::string, bulk_cert, "ecdsa", "Server certificate of the bulk runs");
+ABSL_FLAG(uint32_t, server_threads, 1, "Number of server proactor threads");
+ABSL_FLAG(uint32_t, client_threads, 2, "Number of client proactor threads");
+ABSL_FLAG(std::string, out, "", "If set, appends the json results to this file");
+ABSL_FLAG(uint32_t, engine_pool, 0,
+          "If positive, the server threads pool up to that many tls engines each");
+ABSL_FLAG(bool, engine_large_buffers, false,
+          "If true, the pooled tls engines have BIO buffers of 4 full records");
+ABSL_FLAG(bool, ctx_per_proactor, false, "If true, each server thread has its own SSL_CTX");
+
+using namespace util;
+using namespace std;
+
+using absl::GetFlag;
+using fb2::Fiber;
+using fb2::Pool;
+using tcp = ::boost::asio::ip::tcp;
+
+namespace {
+
+struct Config {
+  string mode;
+  string backend;
+  string tls_version;
+  string cert;
+  bool resume = false;
+  bool ktls = false;
+  string direction;
+  uint32_t size = 0;
+  uint32_t conns = 1;
+
+  uint64_t bulk_bytes() const {
+    return uint64_t(GetFlag(FLAGS_bulk_mb)) << 20;
+  }
+};
+
+template <typename T> vector<T> ParseList(const string& flag_val);
+
+template <> vector<string> ParseList(const string& flag_val) {
+  return absl::StrSplit(flag_val, ',', absl::SkipEmpty());
+}
+
+template <> vector<uint32_t> ParseList(const string& flag_val) {
+  vector<uint32_t> res;
+  for (string_view item : absl::StrSplit(flag_val, ',', absl::SkipEmpty())) {
+    uint32_t val;
+    CHECK(absl::SimpleAtoi(item, &val)) << "Invalid number " << item;
+    res.push_back(val);
+  }
+  return res;
+}
+
+template <> vector<bool> ParseList(const string& flag_val) {
+  vector<bool> res;
+  for (string_view item : absl::StrSplit(flag_val, ',', absl::SkipEmpty())) {
+    bool val;
+    CHECK(absl::SimpleAtob(item, &val)) << "Invalid bool " << item;
+    res.push_back(val);
+  }
+  return res;
+}
+
+const char* JsonBool(bool b) {
+  return b ? "true" : "false";
+}
+
+// Self-signed certificate with its key.
+struct Identity {
+  EVP_PKEY* pkey = nullptr;
+  X509* cert = nullptr;
+};
+
+EVP_PKEY* GenerateKey(const string& type) {
+  EVP_PKEY_CTX* kctx = EVP_PKEY_CTX_new_id(type == "rsa" ? EVP_PKEY_RSA : EVP_PKEY_EC, nullptr);
+  CHECK(kctx);
+  CHECK_EQ(1, EVP_PKEY_keygen_init(kctx));
+  if (type == "rsa") {
+    CHECK_EQ(1, EVP_PKEY_CTX_set_rsa_keygen_bits(kctx, 2048));
+  } else {
+    CHECK_EQ(type, "ecdsa") << "Unknown certificate type";
+    CHECK_EQ(1, EVP_PKEY_CTX_set_ec_paramgen_curve_nid(kctx, NID_X9_62_prime256v1));
+  }
+
+  EVP_PKEY* pkey = nullptr;
+  CHECK_EQ(1, EVP_PKEY_keygen(kctx, &pkey));
+  EVP_PKEY_CTX_free(kctx);
+  return pkey;
+}
+
+Identity CreateIdentity(const string& type) {
+  Identity res;
+  res.pkey = GenerateKey(type);
+  res.cert = X509_new();
+  X509_set_version(res.cert, 2);
+  ASN1_INTEGER_set(X509_get_serialNumber(res.cert), 1);
+  X509_gmtime_adj(X509_getm_notBefore(res.cert), 0);
+  X509_gmtime_adj(X509_getm_notAfter(res.cert), 86400);
+  X509_set_pubkey(res.cert, res.pkey);
+
+  X509_NAME* name = X509_get_subject_name(res.cert);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                             reinterpret_cast<const unsigned char*>("localhost"), -1, -1, 0);
+  X509_set_issuer_name(res.cert, name);
+  CHECK_GT(X509_sign(res.cert, res.pkey, EVP_sha256()), 0);
+  return res;
+}
+
+int TlsVersion(const string& version) {
+  if (version == "1.2")
+    return TLS1_2_VERSION;
+  CHECK_EQ(version, "1.3") << "Unknown tls version";
+  return TLS1_3_VERSION;
+}
+
+SSL_CTX* CreateServerCntx(const Identity& id, const string& version) {
+  SSL_CTX* ctx = SSL_CTX_new(TLS_server_method());
+  CHECK_EQ(1, SSL_CTX_use_certificate(ctx, id.cert));
+  CHECK_EQ(1, SSL_CTX_use_PrivateKey(ctx, id.pkey));
+  SSL_CTX_set_min_proto_version(ctx, TlsVersion(version));
+  SSL_CTX_set_max_proto_version(ctx, TlsVersion(version));
+  SSL_CTX_set_options(ctx, SSL_OP_DONT_INSERT_EMPTY_FRAGMENTS);
+
+  // Session ids of TLS 1.2 need the server cache, the tickets work without it.
+  const unsigned char kSidCtx[] = "tls_bench";
+  SSL_CTX_set_session_id_context(ctx, kSidCtx, sizeof(kSidCtx) - 1);
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+  return ctx;
+}
+
+SSL_CTX* CreateClientCntx(const string& version) {
+  SSL_CTX* ctx = SSL_CTX_new(TLS_client_method());
+  SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, nullptr);
+  SSL_CTX_set_min_proto_version(ctx, TlsVersion(version));
+  SSL_CTX_set_max_proto_version(ctx, TlsVersion(version));
+  return ctx;
+}
+
+uint64_t ThreadCpuNs() {
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Returns the cpu time of all the threads of the pool.
+uint64_t PoolCpuNs(ProactorPool* pool) {
+  atomic_uint64_t res{0};
+  pool->AwaitBrief([&](unsigned, auto*) { res.fetch_add(ThreadCpuNs(), memory_order_relaxed); });
+  return res.load();
+}
+
+// Reads exactly len bytes into buf, which may be shorter than len, in which case the data
+// is overwritten.
+error_code ReadFull(FiberSocketBase* sock, uint8_t* buf, size_t buf_len, uint64_t len) {
+  while (len > 0) {
+    io::Result<size_t> res = sock->Recv(io::MutableBytes(buf, min<uint64_t>(buf_len, len)));
+    if (!res)
+      return res.error();
+    len -= *res;
+  }
+  return {};
+}
+
+error_code WriteFull(FiberSocketBase* sock, const uint8_t* buf, size_t buf_len, uint64_t len) {
+  while (len > 0) {
+    size_t chunk = min<uint64_t>(buf_len, len);
+    if (error_code ec = sock->Write(io::Bytes(buf, chunk)); ec)
+      return ec;
+    len -= chunk;
+  }
+  return {};
+}
+
+struct ServerStats {
+  atomic_uint64_t full{0}, resumed{0}, failed{0};
+  atomic_uint64_t ktls_tx{0}, ktls_rx{0};
+};
+
+class BenchConnection : public Connection {
+ public:
+  BenchConnection(const Config& cfg, const tls::SslCtxShards* ssl_ctxs, ServerStats* stats)
+      : cfg_(cfg), ssl_ctxs_(ssl_ctxs), stats_(stats) {
+  }
+
+ private:
+  void HandleRequests() final;
+  void RunBulk(tls::TlsSocket* sock);
+
+  const Config& cfg_;
+  const tls::SslCtxShards* ssl_ctxs_;
+  ServerStats* stats_;
+};
+
+void BenchConnection::HandleRequests() {
+  auto* tls_sock = new tls::TlsSocket(socket_.release());
+  tls_sock->InitSSL(ssl_ctxs_->Get());
+  if (cfg_.ktls)
+    tls_sock->EnableKtls();
+  SetSocket(tls_sock);
+
+  auto res = tls_sock->Accept();
+  if (!res) {
+    VLOG(1) << "TLS handshake failed " << res.error().message();
+    stats_->failed.fetch_add(1, memory_order_relaxed);
+    return;
+  }
+  bool reused = SSL_session_reused(tls_sock->ssl_handle()) == 1;
+  (reused ? stats_->resumed : stats_->full).fetch_add(1, memory_order_relaxed);
+
+  if (cfg_.mode == "bulk") {
+    stats_->ktls_tx.fetch_add(tls_sock->IsKtlsTx(), memory_order_relaxed);
+    stats_->ktls_rx.fetch_add(tls_sock->IsKtlsRx(), memory_order_relaxed);
+    RunBulk(tls_sock);
+  } else {
+    // The client waits for this byte, which follows the session tickets of TLS 1.3.
+    uint8_t ack = 1;
+    std::ignore = tls_sock->Write(io::Bytes(&ack, 1));
+  }
+
+  // Waits until the client closes the connection.
+  uint8_t buf[64];
+  while (tls_sock->Recv(io::MutableBytes(buf, sizeof(buf)))) {
+  }
+}
+
+void BenchConnection::RunBulk(tls::TlsSocket* sock) {
+  unique_ptr<uint8_t[]> buf(new uint8_t[cfg_.size]);
+  memset(buf.get(), 'x', cfg_.size);
+
+  error_code ec;
+  if (cfg_.direction == "send") {
+    ec = WriteFull(sock, buf.get(), cfg_.size, cfg_.bulk_bytes());
+  } else {
+    ec = ReadFull(sock, buf.get(), cfg_.size, cfg_.bulk_bytes());
+    if (!ec)
+      ec = sock->Write(io::Bytes(buf.get(), 1));
+  }
+  LOG_IF(ERROR, ec) << "Bulk transfer failed " << ec.message();
+}
+
+class BenchListener : public ListenerInterface {
+ public:
+  BenchListener(const Config& cfg, const tls::SslCtxShards* ssl_ctxs, ServerStats* stats)
+      : cfg_(cfg), ssl_ctxs_(ssl_ctxs), stats_(stats) {
+  }
+
+  Connection* NewConnection(ProactorBase*) final {
+    return new BenchConnection(cfg_, ssl_ctxs_, stats_);
+  }
+
+ private:
+  const Config& cfg_;
+  const tls::SslCtxShards* ssl_ctxs_;
+  ServerStats* stats_;
+};
+
+// Connects a tls client socket. If cache is not null, the session is resumed from
+// the previous connection with the same key.
+io::Result<unique_ptr<tls::TlsSocket>> Connect(ProactorBase* p, const tcp::endpoint& ep,
+                                               SSL_CTX* ctx, tls::ClientSessionCache* cache,
+                                               string_view key) {
+  unique_ptr<FiberSocketBase> sock(p->CreateSocket());
+  if (error_code ec = sock->Connect(ep); ec)
+    return nonstd::make_unexpected(ec);
+
+  unique_ptr<tls::TlsSocket> tls_sock(new tls::TlsSocket(std::move(sock)));
+  tls_sock->InitSSL(ctx);
+  if (cache)
+    cache->Attach(tls_sock->ssl_handle(), key);
+  if (error_code ec = tls_sock->Connect(ep); ec)
+    return nonstd::make_unexpected(ec);
+  return tls_sock;
+}
+
+unique_ptr<ProactorPool> CreatePool(const Config& cfg, uint32_t threads) {
+  if (cfg.backend == "uring") {
+#ifdef __linux__
+    return unique_ptr<ProactorPool>(Pool::IOUring(256, threads));
+#else
+    LOG(FATAL) << "io_uring is not supported";
+#endif
+  }
+  CHECK_EQ(cfg.backend, "epoll") << "Unknown backend";
+  return unique_ptr<ProactorPool>(Pool::Epoll(threads));
+}
+
+// Returns the number of handshakes that the clients completed.
+uint64_t RunHandshakeClients(const Config& cfg, const tcp::endpoint& ep, SSL_CTX* ctx,
+                             ProactorPool* pool) {
+  tls::ClientSessionCache* cache = cfg.resume ? tls::ClientSessionCache::Get(ctx) : nullptr;
+  atomic_uint64_t num_handshakes{0};
+
+  pool->AwaitFiberOnAll([&](unsigned index, ProactorBase* p) {
+    vector<Fiber> fibers;
+    for (uint32_t i = 0; i < cfg.conns; ++i) {
+      fibers.emplace_back([&, key = absl::StrCat("127.0.0.1:", ep.port(), "/", index, "/", i)] {
+        for (uint32_t j = 0; j < GetFlag(FLAGS_n); ++j) {
+          auto sock = Connect(p, ep, ctx, cache, key);
+          if (!sock) {
+            LOG(ERROR) << "Connect failed " << sock.error().message();
+            return;
+          }
+          uint8_t ack;
+          error_code ec = ReadFull(sock->get(), &ack, 1, 1);
+          std::ignore = (*sock)->Close();
+          if (ec) {
+            LOG(ERROR) << "Handshake failed " << ec.message();
+            return;
+          }
+          num_handshakes.fetch_add(1, memory_order_relaxed);
+        }
+      });
+    }
+    for (auto& fb : fibers)
+      fb.Join();
+  });
+  return num_handshakes.load();
+}
+
+// Returns the number of bytes that the clients transferred.
+uint64_t RunBulkClients(const Config& cfg, const vector<vector<unique_ptr<tls::TlsSocket>>>& socks,
+                        ProactorPool* pool) {
+  atomic_uint64_t num_bytes{0};
+  pool->AwaitFiberOnAll([&](unsigned index, ProactorBase* p) {
+    vector<Fiber> fibers;
+    for (const auto& sock : socks[index]) {
+      fibers.emplace_back([&, s = sock.get()] {
+        unique_ptr<uint8_t[]> buf(new uint8_t[cfg.size]);
+        memset(buf.get(), 'x', cfg.size);
+
+        error_code ec;
+        if (cfg.direction == "send") {
+          ec = ReadFull(s, buf.get(), cfg.size, cfg.bulk_bytes());
+        } else {
+          ec = WriteFull(s, buf.get(), cfg.size, cfg.bulk_bytes());
+          if (!ec)
+            ec = ReadFull(s, buf.get(), cfg.size, 1);
+        }
+        if (ec) {
+          LOG(ERROR) << "Bulk transfer failed " << ec.message();
+          return;
+        }
+        num_bytes.fetch_add(cfg.bulk_bytes(), memory_order_relaxed);
+      });
+    }
+    for (auto& fb : fibers)
+      fb.Join();
+  });
+  return num_bytes.load();
+}
+
+string RunConfig(const Config& cfg, const Identity& id) {
+  unique_ptr<ProactorPool> server_pool = CreatePool(cfg, GetFlag(FLAGS_server_threads));
+  unique_ptr<ProactorPool> client_pool = CreatePool(cfg, GetFlag(FLAGS_client_threads));
+  server_pool->Run();
+  client_pool->Run();
+
+  unsigned num_shards = GetFlag(FLAGS_ctx_per_proactor) ? server_pool->size() : 1;
+  auto server_ctxs = make_unique<tls::SslCtxShards>(num_shards, [&] {
+    SSL_CTX* ctx = CreateServerCntx(id, cfg.tls_version);
+    if (uint32_t pool_size = GetFlag(FLAGS_engine_pool); pool_size > 0)
+      tls::EnableEnginePool(ctx, pool_size, GetFlag(FLAGS_engine_large_buffers));
+    return ctx;
+  });
+  SSL_CTX* client_ctx = CreateClientCntx(cfg.tls_version);
+  if (cfg.resume)
+    tls::ClientSessionCache::Enable(client_ctx);
+
+  ServerStats stats;
+  string res;
+  {
+    AcceptServer acceptor(server_pool.get(), false);
+    acceptor.set_back_log(1024);
+    uint16_t port = acceptor.AddListener(0, new BenchListener(cfg, server_ctxs.get(), &stats));
+    tcp::endpoint ep{boost::asio::ip::make_address("127.0.0.1"), port};
+    acceptor.Run();
+
+    // The bulk connections are established before the measurement.
+    vector<vector<unique_ptr<tls::TlsSocket>>> socks(client_pool->size());
+    if (cfg.mode == "bulk") {
+      client_pool->AwaitFiberOnAll([&](unsigned index, ProactorBase* p) {
+        for (uint32_t i = 0; i < cfg.conns; ++i) {
+          auto sock = Connect(p, ep, client_ctx, nullptr, {});
+          CHECK(sock) << "Connect failed: " << sock.error().message();
+          socks[index].push_back(std::move(*sock));
+        }
+      });
+    }
+
+    uint64_t server_cpu = PoolCpuNs(server_pool.get());
+    uint64_t client_cpu = PoolCpuNs(client_pool.get());
+    uint64_t start = absl::GetCurrentTimeNanos();
+
+    uint64_t total = cfg.mode == "bulk"
+                         ? RunBulkClients(cfg, socks, client_pool.get())
+                         : RunHandshakeClients(cfg, ep, client_ctx, client_pool.get());
+
+    double dur_sec = std::max<uint64_t>(1, absl::GetCurrentTimeNanos() - start) * 1e-9;
+    double server_cpu_sec = std::max<uint64_t>(1, PoolCpuNs(server_pool.get()) - server_cpu) * 1e-9;
+    double client_cpu_sec = (PoolCpuNs(client_pool.get()) - client_cpu) * 1e-9;
+
+    client_pool->AwaitFiberOnAll([&](unsigned index, ProactorBase*) {
+      for (auto& sock : socks[index])
+        std::ignore = sock->Close();
+      socks[index].clear();
+    });
+    acceptor.Stop(true);
+
+    res = absl::StrCat(R"({"mode":")", cfg.mode, R"(","backend":")", cfg.backend,
+                       R"(","tls":")", cfg.tls_version, R"(","cert":")", cfg.cert, R"(")");
+    if (cfg.mode == "bulk") {
+      double mb = total / double(1 << 20);
+      absl::StrAppend(&res, R"(,"ktls":)", JsonBool(cfg.ktls), R"(,"ktls_tx":)",
+                      stats.ktls_tx.load(), R"(,"ktls_rx":)", stats.ktls_rx.load(),
+                      R"(,"direction":")", cfg.direction, R"(","size":)", cfg.size,
+                      R"(,"c":)", cfg.conns, R"(,"mb":)", uint64_t(mb), R"(,"mb_s":)",
+                      mb / dur_sec, R"(,"mb_s_per_core":)", mb / server_cpu_sec);
+    } else {
+      absl::StrAppend(&res, R"(,"resume":)", JsonBool(cfg.resume), R"(,"c":)", cfg.conns,
+                      R"(,"handshakes":)", total, R"(,"full":)", stats.full.load(),
+                      R"(,"resumed":)", stats.resumed.load(), R"(,"failed":)",
+                      stats.failed.load(), R"(,"hps":)", uint64_t(total / dur_sec),
+                      R"(,"hps_per_core":)", uint64_t(total / server_cpu_sec));
+    }
+    absl::StrAppend(&res, R"(,"server_threads":)", server_pool->size(), R"(,"client_threads":)",
+                    client_pool->size(), R"(,"server_cpu_sec":)", server_cpu_sec,
+                    R"(,"client_cpu_sec":)", client_cpu_sec, R"(,"duration_sec":)", dur_sec,
+                    R"(,"ctx_shards":)", num_shards, R"(,"engine_pool":)",
+                    GetFlag(FLAGS_engine_pool), "}");
+  }
+
+  SSL_CTX_free(client_ctx);
+  server_ctxs.reset();
+  client_pool->Stop();
+  server_pool->Stop();
+  return res;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  MainInitGuard guard(&argc, &argv);
+
+  ofstream out;
+  if (!GetFlag(FLAGS_out).empty()) {
+    out.open(GetFlag(FLAGS_out), ios::app);
+    CHECK(out) << "Could not open " << GetFlag(FLAGS_out);
+  }
+  auto report = [&](const string& res) {
+    cout << res << endl;
+    if (out.is_open())
+      out << res << endl;
+  };
+
+  // The key generation is slow, hence the identities are created once.
+  vector<string> certs = ParseList<string>(GetFlag(FLAGS_certs));
+  certs.push_back(GetFlag(FLAGS_bulk_cert));
+  absl::flat_hash_map<string, Identity> identities;
+  for (const string& cert : certs) {
+    if (!identities.contains(cert))
+      identities[cert] = CreateIdentity(cert);
+  }
+
+  Config cfg;
+  for (const string& mode : ParseList<string>(GetFlag(FLAGS_modes))) {
+    cfg = Config{};
+    cfg.mode = mode;
+    CHECK(mode == "handshake" || mode == "bulk") << "Unknown mode " << mode;
+
+    for (const string& backend : ParseList<string>(GetFlag(FLAGS_backends))) {
+      cfg.backend = backend;
+      for (const string& version : ParseList<string>(GetFlag(FLAGS_tls_versions))) {
+        cfg.tls_version = version;
+        for (uint32_t c : ParseList<uint32_t>(GetFlag(FLAGS_c))) {
+          cfg.conns = c;
+          if (mode == "handshake") {
+            for (const string& cert : ParseList<string>(GetFlag(FLAGS_certs))) {
+              cfg.cert = cert;
+              for (bool resume : ParseList<bool>(GetFlag(FLAGS_resume))) {
+                cfg.resume = resume;
+                report(RunConfig(cfg, identities[cert]));
+              }
+            }
+            continue;
+          }
+
+          cfg.cert = GetFlag(FLAGS_bulk_cert);
+          for (bool ktls : ParseList<bool>(GetFlag(FLAGS_ktls))) {
+            cfg.ktls = ktls;
+            for (const string& direction : ParseList<string>(GetFlag(FLAGS_directions))) {
+              cfg.direction = direction;
+              for (uint32_t size : ParseList<uint32_t>(GetFlag(FLAGS_sizes))) {
+                cfg.size = size;
+                report(RunConfig(cfg, identities[cfg.cert]));
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+
+  for (auto& [name, id] : identities) {
+    X509_free(id.cert);
+    EVP_PKEY_free(id.pkey);
+  }
+  return 0;
+}
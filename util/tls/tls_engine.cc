@@ -4,9 +4,14 @@
 
 #include "util/tls/tls_engine.h"
 
+#include <absl/strings/escaping.h>
 #include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
 #include <sys/stat.h>
 
+#include <string_view>
+
 #include "base/logging.h"
 
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
@@ -74,6 +79,87 @@ static Engine::OpResult ToOpResult(const SSL* ssl, int result, const char* locat
   return Engine::EOF_STREAM;
 }
 
+struct Engine::TrafficSecrets {
+  std::string client, server;  // CLIENT/SERVER_TRAFFIC_SECRET_0 of TLS 1.3.
+};
+
+static int TrafficSecretsIndex() {
+  static int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+  return index;
+}
+
+void Engine::KeylogCallback(const SSL* ssl, const char* line) {
+  auto* secrets = static_cast<TrafficSecrets*>(SSL_get_ex_data(ssl, TrafficSecretsIndex()));
+  if (!secrets)
+    return;
+
+  // The line has NSS key log format: "<label> <client random> <secret>" in hex.
+  std::string_view sv{line};
+  size_t pos = sv.find(' ');
+  size_t pos2 = sv.rfind(' ');
+  if (pos == std::string_view::npos || pos == pos2)
+    return;
+
+  std::string_view label = sv.substr(0, pos);
+  std::string_view secret = sv.substr(pos2 + 1);
+  if (label == "CLIENT_TRAFFIC_SECRET_0") {
+    secrets->client = absl::HexStringToBytes(secret);
+  } else if (label == "SERVER_TRAFFIC_SECRET_0") {
+    secrets->server = absl::HexStringToBytes(secret);
+  }
+}
+
+// HKDF-Expand-Label from RFC 8446, section 7.1.
+static bool HkdfExpandLabel(const EVP_MD* md, std::string_view secret, std::string_view label,
+                            uint8_t* dest, size_t len) {
+  uint8_t info[2 + 1 + 255 + 1];
+  std::string_view prefix = "tls13 ";
+  size_t label_len = prefix.size() + label.size();
+
+  info[0] = len >> 8;
+  info[1] = len & 0xFF;
+  info[2] = label_len;
+  memcpy(info + 3, prefix.data(), prefix.size());
+  memcpy(info + 3 + prefix.size(), label.data(), label.size());
+  info[3 + label_len] = 0;  // empty context.
+
+  EVP_PKEY_CTX* pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, nullptr);
+  size_t out_len = len;
+  bool res = pctx && EVP_PKEY_derive_init(pctx) > 0 &&
+             EVP_PKEY_CTX_hkdf_mode(pctx, EVP_PKEY_HKDEF_MODE_EXPAND_ONLY) > 0 &&
+             EVP_PKEY_CTX_set_hkdf_md(pctx, md) > 0 &&
+             EVP_PKEY_CTX_set1_hkdf_key(pctx, reinterpret_cast<const uint8_t*>(secret.data()),
+                                        secret.size()) > 0 &&
+             EVP_PKEY_CTX_add1_hkdf_info(pctx, info, 4 + label_len) > 0 &&
+             EVP_PKEY_derive(pctx, dest, &out_len) > 0 && out_len == len;
+  EVP_PKEY_CTX_free(pctx);
+  return res;
+}
+
+// The key block of RFC 5246, section 6.3.
+static bool Tls12KeyBlock(const SSL* ssl, const EVP_MD* md, uint8_t* dest, size_t len) {
+  uint8_t master[SSL_MAX_MASTER_KEY_LENGTH];
+  uint8_t client_random[SSL3_RANDOM_SIZE], server_random[SSL3_RANDOM_SIZE];
+  size_t master_len = SSL_SESSION_get_master_key(SSL_get_session(ssl), master, sizeof(master));
+  SSL_get_client_random(ssl, client_random, sizeof(client_random));
+  SSL_get_server_random(ssl, server_random, sizeof(server_random));
+
+  constexpr std::string_view kLabel = "key expansion";
+  EVP_PKEY_CTX* pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_TLS1_PRF, nullptr);
+  size_t out_len = len;
+  bool res = pctx && master_len > 0 && EVP_PKEY_derive_init(pctx) > 0 &&
+             EVP_PKEY_CTX_set_tls1_prf_md(pctx, md) > 0 &&
+             EVP_PKEY_CTX_set1_tls1_prf_secret(pctx, master, master_len) > 0 &&
+             EVP_PKEY_CTX_add1_tls1_prf_seed(
+                 pctx, reinterpret_cast<const uint8_t*>(kLabel.data()), kLabel.size()) > 0 &&
+             EVP_PKEY_CTX_add1_tls1_prf_seed(pctx, server_random, sizeof(server_random)) > 0 &&
+             EVP_PKEY_CTX_add1_tls1_prf_seed(pctx, client_random, sizeof(client_random)) > 0 &&
+             EVP_PKEY_derive(pctx, dest, &out_len) > 0 && out_len == len;
+  EVP_PKEY_CTX_free(pctx);
+  OPENSSL_cleanse(master, sizeof(master));
+  return res;
+}
+
 #define S1(x) #x
 #define S2(x) S1(x)
 #define LOCATION __FILE__ " : " S2(__LINE__)
@@ -83,7 +169,7 @@ static Engine::OpResult ToOpResult(const SSL* ssl, int result, const char* locat
     return res;            \
   return ToOpResult(ssl_, res, LOCATION)
 
-Engine::Engine(SSL_CTX* context) : ssl_(::SSL_new(context)) {
+Engine::Engine(SSL_CTX* context, unsigned bio_buf_size) : ssl_(::SSL_new(context)) {
   CHECK(ssl_);
 
   SSL_set_mode(ssl_, SSL_MODE_ENABLE_PARTIAL_WRITE);
@@ -92,7 +178,7 @@ Engine::Engine(SSL_CTX* context) : ssl_(::SSL_new(context)) {
 
   ::BIO* int_bio = 0;
 
-  BIO_new_bio_pair(&int_bio, 0, &external_bio_, 0);
+  BIO_new_bio_pair(&int_bio, bio_buf_size, &external_bio_, bio_buf_size);
 
   // SSL_set0_[rw]bio take ownership of the passed reference,
   // so if we call both with the same BIO, we need the refcount to be 2.
@@ -104,12 +190,48 @@ Engine::Engine(SSL_CTX* context) : ssl_(::SSL_new(context)) {
 Engine::~Engine() {
   CHECK(!SSL_get_app_data(ssl_));
 
+  if (secrets_) {
+    SSL_set_ex_data(ssl_, TrafficSecretsIndex(), nullptr);
+    OPENSSL_cleanse(secrets_->client.data(), secrets_->client.size());
+    OPENSSL_cleanse(secrets_->server.data(), secrets_->server.size());
+  }
+
   ::BIO_free(external_bio_);
   ::SSL_free(ssl_);
   external_bio_ = nullptr;
   ssl_ = nullptr;
 }
 
+bool Engine::Reset() {
+  if (SSL_get_app_data(ssl_))
+    return false;
+
+  if (secrets_) {
+    SSL_set_ex_data(ssl_, TrafficSecretsIndex(), nullptr);
+    OPENSSL_cleanse(secrets_->client.data(), secrets_->client.size());
+    OPENSSL_cleanse(secrets_->server.data(), secrets_->server.size());
+    secrets_.reset();
+  }
+
+  // Otherwise SSL_clear keeps the session for a reconnect to the same peer.
+  SSL_set_session(ssl_, nullptr);
+  if (SSL_clear(ssl_) != 1) {
+    ClearSslError();
+    return false;
+  }
+
+  SSL_CTX* ctx = SSL_get_SSL_CTX(ssl_);
+  SSL_set_verify(ssl_, SSL_CTX_get_verify_mode(ctx), SSL_CTX_get_verify_callback(ctx));
+  SSL_clear_options(ssl_, SSL_get_options(ssl_) & ~SSL_CTX_get_options(ctx));
+  SSL_set_options(ssl_, SSL_CTX_get_options(ctx));
+  SSL_set_num_tickets(ssl_, SSL_CTX_get_num_tickets(ctx));
+
+  // Drops the data that the previous connection left in both directions of the pair.
+  BIO_reset(external_bio_);
+  BIO_reset(SSL_get_rbio(ssl_));
+  return true;
+}
+
 
 auto Engine::FetchOutputBuf() -> BufResult {
   char* buf = nullptr;
@@ -214,6 +336,68 @@ auto Engine::Read(uint8_t* dest, size_t len) -> OpResult {
   RETURN_RESULT(result);
 }
 
+void Engine::CaptureTrafficSecrets() {
+  SSL_CTX* ctx = SSL_get_SSL_CTX(ssl_);
+  if (!SSL_CTX_get_keylog_callback(ctx)) {
+    SSL_CTX_set_keylog_callback(ctx, KeylogCallback);
+  }
+
+  if (!secrets_) {
+    secrets_.reset(new TrafficSecrets);
+    SSL_set_ex_data(ssl_, TrafficSecretsIndex(), secrets_.get());
+  }
+}
+
+bool Engine::ExportTrafficKeys(bool write, TrafficKeys* dest) const {
+  const SSL_CIPHER* cipher = SSL_get_current_cipher(ssl_);
+  if (!cipher || !SSL_is_init_finished(ssl_))
+    return false;
+
+  switch (SSL_CIPHER_get_cipher_nid(cipher)) {
+    case NID_aes_128_gcm:
+      dest->key_len = 16;
+      break;
+    case NID_aes_256_gcm:
+      dest->key_len = 32;
+      break;
+    default:
+      return false;
+  }
+
+  const EVP_MD* md = SSL_CIPHER_get_handshake_digest(cipher);
+  bool client_keys = (SSL_is_server(ssl_) == 0) == write;
+  dest->version = SSL_version(ssl_);
+
+  if (dest->version == TLS1_3_VERSION) {
+    if (!secrets_)
+      return false;
+    const std::string& secret = client_keys ? secrets_->client : secrets_->server;
+    if (secret.empty())
+      return false;
+
+    return HkdfExpandLabel(md, secret, "key", dest->key, dest->key_len) &&
+           HkdfExpandLabel(md, secret, "iv", dest->iv, sizeof(dest->iv));
+  }
+
+  if (dest->version != TLS1_2_VERSION)
+    return false;
+
+  // AEAD ciphers do not have MAC keys, so the block consists of
+  // client_write_key, server_write_key, client_write_IV, server_write_IV.
+  constexpr unsigned kSaltLen = 4;
+  uint8_t block[2 * 32 + 2 * kSaltLen];
+  unsigned block_len = 2 * (dest->key_len + kSaltLen);
+  if (!Tls12KeyBlock(ssl_, md, block, block_len))
+    return false;
+
+  unsigned index = client_keys ? 0 : 1;
+  memcpy(dest->key, block + index * dest->key_len, dest->key_len);
+  memcpy(dest->iv, block + 2 * dest->key_len + index * kSaltLen, kSaltLen);
+  memset(dest->iv + kSaltLen, 0, sizeof(dest->iv) - kSaltLen);
+  OPENSSL_cleanse(block, sizeof(block));
+  return true;
+}
+
 // returns -1 if failed to load any CA certificates, 0 if loaded successfully
 int SslProbeSetDefaultCALocation(SSL_CTX* ctx) {
   /* The probe paths are based on:
@@ -263,5 +447,44 @@ int SslProbeSetDefaultCALocation(SSL_CTX* ctx) {
   return -1;
 }
 
+static void FreeAlpn(void* parent, void* ptr, CRYPTO_EX_DATA* ad, int index, long argl,
+                     void* argp) {
+  delete static_cast<std::string*>(ptr);
+}
+
+static int SelectAlpnCb(SSL* ssl, const unsigned char** out, unsigned char* outlen,
+                        const unsigned char* in, unsigned int inlen, void* arg) {
+  const std::string& protos = *static_cast<const std::string*>(arg);
+
+  // The preference order is ours, so that clients offering http/1.1 first still get h2.
+  for (size_t i = 0; i < protos.size(); i += 1 + uint8_t(protos[i])) {
+    std::string_view proto(protos.data() + i, 1 + uint8_t(protos[i]));
+    for (unsigned j = 0; j < inlen; j += 1 + in[j]) {
+      if (std::string_view(reinterpret_cast<const char*>(in) + j, 1 + in[j]) == proto) {
+        *out = in + j + 1;
+        *outlen = in[j];
+        return SSL_TLSEXT_ERR_OK;
+      }
+    }
+  }
+  return SSL_TLSEXT_ERR_NOACK;
+}
+
+void SslSetServerAlpn(SSL_CTX* ctx, const std::vector<std::string_view>& protos) {
+  static int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, FreeAlpn);
+
+  // The wire format: each protocol prefixed with its length.
+  std::string* wire = new std::string;
+  for (std::string_view proto : protos) {
+    CHECK(!proto.empty() && proto.size() < 256) << proto;
+    wire->push_back(char(proto.size()));
+    wire->append(proto);
+  }
+
+  delete static_cast<std::string*>(SSL_CTX_get_ex_data(ctx, index));
+  CHECK_EQ(1, SSL_CTX_set_ex_data(ctx, index, wire));
+  SSL_CTX_set_alpn_select_cb(ctx, SelectAlpnCb, wire);
+}
+
 }  // namespace tls
 }  // namespace util
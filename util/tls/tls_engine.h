@@ -7,6 +7,10 @@
 #include <absl/types/span.h>
 #include <openssl/ssl.h>
 
+#include <memory>
+#include <string_view>
+#include <vector>
+
 #include "io/io.h"
 
 namespace util {
@@ -35,12 +39,38 @@ class Engine {
   using OpResult = io::Result<int, unsigned long>;
   using BufResult = io::Result<Buffer, unsigned long>;
 
-  // Construct a new engine for the specified context.
-  explicit Engine(SSL_CTX* context);
+  // AES-GCM record protection keys of one direction of an established session,
+  // for offloading the record layer, for example to the kernel (kTLS).
+  struct TrafficKeys {
+    uint16_t version = 0;  // TLS1_2_VERSION or TLS1_3_VERSION.
+    uint8_t key_len = 0;   // 16 for AES-128-GCM, 32 for AES-256-GCM.
+    uint8_t key[32];
+    uint8_t iv[12];  // TLS 1.2 uses only the first 4 bytes, the implicit part of the nonce.
+  };
+
+  // Large capacity of each direction of the BIO pair, which holds 4 full TLS records, so that
+  // a large write is encrypted into full records that are flushed with a single socket write,
+  // and a single socket read fetches several records. It takes about 67KB per direction,
+  // hence it suits the engines that are pooled, see EnableEnginePool.
+  static constexpr unsigned kLargeBioBufSize =
+      4 * (SSL3_RT_MAX_PLAIN_LENGTH + SSL3_RT_MAX_ENCRYPTED_OVERHEAD + SSL3_RT_HEADER_LENGTH);
+
+  // Construct a new engine for the specified context. bio_buf_size is the capacity of each
+  // direction of the BIO pair that connects the engine to the socket, 0 for the OpenSSL
+  // default that fits a single record.
+  explicit Engine(SSL_CTX* context, unsigned bio_buf_size = 0);
 
   // Destructor.
   ~Engine();
 
+  // Prepares the engine for a new connection of the same context without reallocating its SSL
+  // object and BIO pair: drops the session and the buffered data, resets the SSL with
+  // SSL_clear and restores the verify mode, options and number of tickets of the context.
+  // Other per-connection state, e.g. the ex data, callbacks or the SNI host name set directly
+  // on the SSL object, is kept. Returns false if the engine can not be reused, in which case
+  // it should be destroyed.
+  bool Reset();
+
   // Get the underlying implementation in the native type.
   SSL* native_handle() {
     return ssl_;
@@ -103,7 +133,21 @@ class Engine {
     return BIO_ctrl(external_bio_, BIO_CTRL_WPENDING, 0, NULL);
   }
 
+  //! Must be called before the handshake for ExportTrafficKeys to support TLS 1.3.
+  //! TLS 1.3 traffic secrets are available only via the keylog callback of the context,
+  //! so this installs one unless the context already has a keylog callback.
+  void CaptureTrafficSecrets();
+
+  //! Derives the record keys of the established session. write selects the keys
+  //! we encrypt with, otherwise the keys of the peer. Returns false if the session does not
+  //! use AES-GCM or its secrets are not available.
+  bool ExportTrafficKeys(bool write, TrafficKeys* dest) const;
+
  private:
+  struct TrafficSecrets;
+
+  static void KeylogCallback(const SSL* ssl, const char* line);
+
   // Disallow copying and assignment.
   Engine(const Engine&) = delete;
   Engine& operator=(const Engine&) = delete;
@@ -113,11 +157,17 @@ class Engine {
 
   SSL* ssl_;
   BIO* external_bio_;
+  std::unique_ptr<TrafficSecrets> secrets_;
 };
 
 /// Tries to load CA certificates from predefined (hardcoded) locations.
 /// Returns 0 on success, -1 on failure.
 int SslProbeSetDefaultCALocation(SSL_CTX* ctx);
 
+/// Makes the server connections of ctx select the first of protos, in the order of preference,
+/// that the client offers via ALPN, e.g. {"h2", "http/1.1"}. The handshakes of clients that
+/// offer none of them proceed without ALPN.
+void SslSetServerAlpn(SSL_CTX* ctx, const std::vector<std::string_view>& protos);
+
 }  // namespace tls
 }  // namespace util
@@ -5,12 +5,14 @@
 #include "util/tls/tls_engine.h"
 
 #include <openssl/err.h>
+#include <openssl/evp.h>
 
 #include <string_view>
 
 #include "base/gtest.h"
 #include "base/logging.h"
 #include "util/fibers/fibers.h"
+#include "util/tls/tls_session_cache.h"
 #include "util/tls/tls_socket.h"
 
 namespace util {
@@ -88,6 +90,9 @@ class SslStreamTest : public testing::Test {
   }
   void SetUp() override;
 
+  // bio_buf_size is passed to the Engine constructor.
+  void CreateEngines(unsigned bio_buf_size);
+
   void TearDown() override {
     client_engine_.reset();
     server_engine_.reset();
@@ -104,17 +109,21 @@ class SslStreamTest : public testing::Test {
   size_t read_sz_ = 0;
 };
 
-void SslStreamTest::SetUp() {
+void SslStreamTest::CreateEngines(unsigned bio_buf_size) {
   SSL_CTX* ctx = CreateSslCntx();
 
-  client_engine_.reset(new Engine(ctx));
-  server_engine_.reset(new Engine(ctx));
+  client_engine_.reset(new Engine(ctx, bio_buf_size));
+  server_engine_.reset(new Engine(ctx, bio_buf_size));
   SSL_CTX_free(ctx);
 
   // Configure server side.
   SSL* ssl = server_engine_->native_handle();
   SSL_set_options(ssl, SSL_OP_CIPHER_SERVER_PREFERENCE);
   CHECK_EQ(1, SSL_set_dh_auto(ssl, 1));
+}
+
+void SslStreamTest::SetUp() {
+  CreateEngines(0);
 
   tmp_buf_.reset(new uint8_t[TMP_CAPACITY]);
 
@@ -256,6 +265,42 @@ TEST_F(SslStreamTest, Handshake) {
   ASSERT_EQ(0, srv_err);
 }
 
+TEST_F(SslStreamTest, Reset) {
+  auto handshake = [&] {
+    unsigned long cl_err = 0, srv_err = 0;
+    auto client_fb = Fiber([&] {
+      cl_err = RunPeer(client_opts_, client_handshake_, client_engine_.get(), server_engine_.get());
+    });
+    auto server_fb = Fiber([&] {
+      srv_err = RunPeer(srv_opts_, srv_handshake_, server_engine_.get(), client_engine_.get());
+    });
+    client_fb.Join();
+    server_fb.Join();
+    EXPECT_EQ(0, cl_err);
+    EXPECT_EQ(0, srv_err);
+  };
+
+  client_engine_->set_verify_mode(SSL_VERIFY_PEER);
+  handshake();
+  ASSERT_TRUE(SSL_is_init_finished(server_engine_->native_handle()));
+
+  // Leaves the output of the client pending in its pair.
+  ASSERT_TRUE(client_engine_->Write(Engine::Buffer{tmp_buf_.get(), 16}));
+
+  SSL* ssl = client_engine_->native_handle();
+  ASSERT_TRUE(client_engine_->Reset());
+  ASSERT_TRUE(server_engine_->Reset());
+  EXPECT_EQ(ssl, client_engine_->native_handle());
+  EXPECT_EQ(SSL_VERIFY_NONE, SSL_get_verify_mode(ssl));
+  EXPECT_FALSE(SSL_is_init_finished(server_engine_->native_handle()));
+  EXPECT_EQ(0u, client_engine_->OutputPending());
+  EXPECT_EQ(0u, server_engine_->OutputPending());
+
+  SSL_set_options(server_engine_->native_handle(), SSL_OP_CIPHER_SERVER_PREFERENCE);
+  handshake();
+  EXPECT_TRUE(SSL_is_init_finished(server_engine_->native_handle()));
+}
+
 TEST_F(SslStreamTest, HandshakeErrServer) {
   unsigned long cl_err = 0, srv_err = 0;
 
@@ -352,6 +397,156 @@ TEST_F(SslStreamTest, Write) {
   }
 }
 
+TEST_F(SslStreamTest, FullRecords) {
+  CreateEngines(Engine::kLargeBioBufSize);
+  unsigned long cl_err = 0, srv_err = 0;
+
+  auto client_fb = Fiber([&] {
+    cl_err = RunPeer(client_opts_, client_handshake_, client_engine_.get(), server_engine_.get());
+  });
+
+  auto server_fb = Fiber([&] {
+    srv_err = RunPeer(srv_opts_, srv_handshake_, server_engine_.get(), client_engine_.get());
+  });
+
+  client_fb.Join();
+  server_fb.Join();
+  ASSERT_EQ(0, cl_err);
+  ASSERT_EQ(0, srv_err);
+  ASSERT_EQ(0u, client_engine_->OutputPending());
+
+  // A large write is encrypted into several full records that are available contiguously.
+  string payload(3 * SSL3_RT_MAX_PLAIN_LENGTH, 'a');
+  Engine::Buffer src{reinterpret_cast<const uint8_t*>(payload.data()), payload.size()};
+  Engine::OpResult op_result;
+  while (!src.empty()) {
+    op_result = client_engine_->Write(src);  // returns after each record.
+    ASSERT_TRUE(op_result);
+    ASSERT_GT(*op_result, 0);
+    src.remove_prefix(*op_result);
+  }
+
+  size_t pending = client_engine_->OutputPending();
+  EXPECT_GT(pending, payload.size());
+  auto buf_result = client_engine_->PeekOutputBuf();
+  ASSERT_TRUE(buf_result);
+  EXPECT_EQ(pending, buf_result->size());
+
+  // The peer receives the records with a single input write.
+  auto write_result = server_engine_->WriteBuf(*buf_result);
+  ASSERT_TRUE(write_result);
+  EXPECT_EQ(int(pending), *write_result);
+  client_engine_->ConsumeOutputBuf(pending);
+
+  string received(payload.size(), '\0');
+  size_t read_total = 0;
+  while (read_total < received.size()) {
+    op_result = server_engine_->Read(reinterpret_cast<uint8_t*>(received.data()) + read_total,
+                                     received.size() - read_total);
+    ASSERT_TRUE(op_result);
+    ASSERT_GT(*op_result, 0);
+    read_total += *op_result;
+  }
+  EXPECT_TRUE(received == payload);
+}
+
+TEST_F(SslStreamTest, ExportTrafficKeys) {
+  unsigned long cl_err = 0, srv_err = 0;
+
+  auto client_fb = Fiber([&] {
+    cl_err = RunPeer(client_opts_, client_handshake_, client_engine_.get(), server_engine_.get());
+  });
+
+  auto server_fb = Fiber([&] {
+    srv_err = RunPeer(srv_opts_, srv_handshake_, server_engine_.get(), client_engine_.get());
+  });
+
+  client_fb.Join();
+  server_fb.Join();
+  ASSERT_EQ(0, cl_err);
+  ASSERT_EQ(0, srv_err);
+
+  Engine::TrafficKeys srv_tx, srv_rx, cl_tx, cl_rx;
+  ASSERT_TRUE(server_engine_->ExportTrafficKeys(true, &srv_tx));
+  ASSERT_TRUE(server_engine_->ExportTrafficKeys(false, &srv_rx));
+  ASSERT_TRUE(client_engine_->ExportTrafficKeys(true, &cl_tx));
+  ASSERT_TRUE(client_engine_->ExportTrafficKeys(false, &cl_rx));
+  ASSERT_EQ(TLS1_2_VERSION, srv_tx.version);  // anonymous ciphers are not part of TLS 1.3.
+
+  EXPECT_EQ(0, memcmp(srv_tx.key, cl_rx.key, srv_tx.key_len));
+  EXPECT_EQ(0, memcmp(srv_tx.iv, cl_rx.iv, 4));
+  EXPECT_EQ(0, memcmp(cl_tx.key, srv_rx.key, cl_tx.key_len));
+  EXPECT_NE(0, memcmp(cl_tx.key, srv_tx.key, cl_tx.key_len));
+
+  // Decrypt an application record with the exported keys. The first one has sequence number 1
+  // and consists of: header(5), explicit nonce(8), ciphertext, tag(16).
+  constexpr string_view kMsg = "hello";
+  ASSERT_EQ(int(kMsg.size()), *server_engine_->Write(io::Buffer(kMsg)));
+  auto record = server_engine_->PeekOutputBuf();
+  ASSERT_TRUE(record);
+  ASSERT_EQ(5 + 8 + kMsg.size() + 16, record->size());
+
+  const uint8_t* data = record->data();
+  uint8_t nonce[12];
+  memcpy(nonce, srv_tx.iv, 4);
+  memcpy(nonce + 4, data + 5, 8);
+  uint8_t aad[13] = {0, 0, 0, 0, 0, 0, 0, 1, data[0], data[1], data[2], 0, kMsg.size()};
+  uint8_t plain[kMsg.size()];
+  int len = 0;
+
+  EVP_CIPHER_CTX* cctx = EVP_CIPHER_CTX_new();
+  const EVP_CIPHER* cipher = srv_tx.key_len == 16 ? EVP_aes_128_gcm() : EVP_aes_256_gcm();
+  ASSERT_EQ(1, EVP_DecryptInit_ex(cctx, cipher, nullptr, srv_tx.key, nonce));
+  ASSERT_EQ(1, EVP_DecryptUpdate(cctx, nullptr, &len, aad, sizeof(aad)));
+  ASSERT_EQ(1, EVP_DecryptUpdate(cctx, plain, &len, data + 13, kMsg.size()));
+  ASSERT_EQ(1, EVP_CIPHER_CTX_ctrl(cctx, EVP_CTRL_GCM_SET_TAG, 16,
+                                   const_cast<uint8_t*>(data + 13 + kMsg.size())));
+  EXPECT_EQ(1, EVP_DecryptFinal_ex(cctx, plain + len, &len));
+  EVP_CIPHER_CTX_free(cctx);
+  EXPECT_EQ(kMsg, string_view(reinterpret_cast<char*>(plain), kMsg.size()));
+}
+
+TEST_F(SslStreamTest, SessionResumption) {
+  SSL_CTX* client_ctx = CreateSslCntx();
+  SSL_CTX* srv_ctx = CreateSslCntx();
+  ClientSessionCache* cache = ClientSessionCache::Enable(client_ctx);
+  ASSERT_EQ(cache, ClientSessionCache::Get(client_ctx));
+
+  for (unsigned i = 0; i < 3; ++i) {
+    client_engine_.reset(new Engine(client_ctx));
+    server_engine_.reset(new Engine(srv_ctx));
+    CHECK_EQ(1, SSL_set_dh_auto(server_engine_->native_handle(), 1));
+    cache->Attach(client_engine_->native_handle(), "localhost:443");
+
+    unsigned long cl_err = 0, srv_err = 0;
+    auto client_fb = Fiber([&] {
+      cl_err = RunPeer(client_opts_, client_handshake_, client_engine_.get(), server_engine_.get());
+    });
+
+    auto server_fb = Fiber([&] {
+      srv_err = RunPeer(srv_opts_, srv_handshake_, server_engine_.get(), client_engine_.get());
+    });
+
+    client_fb.Join();
+    server_fb.Join();
+    ASSERT_EQ(0, cl_err);
+    ASSERT_EQ(0, srv_err);
+
+    // The engines are destroyed without a shutdown, like dropped idle connections.
+    EXPECT_EQ(i > 0, SSL_session_reused(client_engine_->native_handle()) == 1) << i;
+  }
+
+  ClientSessionCache::Stats stats = cache->GetStats();
+  EXPECT_EQ(1u, stats.full_handshakes);
+  EXPECT_EQ(2u, stats.resumed_handshakes);
+  EXPECT_EQ(1u, stats.sessions);
+
+  client_engine_.reset();
+  server_engine_.reset();
+  SSL_CTX_free(client_ctx);
+  SSL_CTX_free(srv_ctx);
+}
+
 void BM_TlsWrite(benchmark::State& state) {
   unique_ptr<Engine> client_engine, server_engine;
   SslStreamTest::Options sopts{"srv"}, copts{"client"};
@@ -0,0 +1,170 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#include "util/tls/tls_session_cache.h"
+
+#include <ctime>
+
+#include "base/logging.h"
+
+namespace util {
+namespace tls {
+
+using namespace std;
+
+namespace {
+
+// Per connection state, attached to SSL.
+struct ConnInfo {
+  string key;
+  bool counted = false;  // whether the handshake was accounted in the stats.
+};
+
+void FreeCache(void* parent, void* ptr, CRYPTO_EX_DATA* ad, int idx, long argl, void* argp) {
+  delete static_cast<ClientSessionCache*>(ptr);
+}
+
+void FreeConnInfo(void* parent, void* ptr, CRYPTO_EX_DATA* ad, int idx, long argl, void* argp) {
+  delete static_cast<ConnInfo*>(ptr);
+}
+
+int CacheIndex() {
+  static int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, FreeCache);
+  return index;
+}
+
+int ConnInfoIndex() {
+  static int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr, FreeConnInfo);
+  return index;
+}
+
+bool IsExpired(const SSL_SESSION* session) {
+  return SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session) < time(nullptr);
+}
+
+}  // namespace
+
+ClientSessionCache* ClientSessionCache::Enable(SSL_CTX* ctx, size_t capacity) {
+  CHECK(!Get(ctx));
+  CHECK_GT(capacity, 0u);
+
+  ClientSessionCache* cache = new ClientSessionCache(capacity);
+  CHECK_EQ(1, SSL_CTX_set_ex_data(ctx, CacheIndex(), cache));
+
+  // We keep the sessions ourselves, keyed by peer. OpenSSL's internal client cache is not
+  // used for lookups anyway.
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ctx, NewSessionCb);
+  SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+
+  return cache;
+}
+
+ClientSessionCache* ClientSessionCache::Get(SSL_CTX* ctx) {
+  return static_cast<ClientSessionCache*>(SSL_CTX_get_ex_data(ctx, CacheIndex()));
+}
+
+ClientSessionCache::~ClientSessionCache() {
+  for (const auto& [key, session] : sessions_) {
+    SSL_SESSION_free(session);
+  }
+}
+
+void ClientSessionCache::Attach(SSL* ssl, string_view key) {
+  DCHECK(!SSL_get_ex_data(ssl, ConnInfoIndex()));
+
+  ConnInfo* info = new ConnInfo{string(key)};
+  SSL_set_ex_data(ssl, ConnInfoIndex(), info);
+  SSL_set_info_callback(ssl, InfoCb);
+
+  SSL_SESSION* session = nullptr;
+  {
+    lock_guard lk(mu_);
+    auto it = sessions_.find(info->key);
+    if (it != sessions_.end()) {
+      session = it->second;
+      if (IsExpired(session) || SSL_SESSION_get_protocol_version(session) == TLS1_3_VERSION) {
+        sessions_.erase(it);  // we take the ownership.
+      } else {
+        SSL_SESSION_up_ref(session);
+      }
+    }
+  }
+
+  if (session) {
+    // Each connection gets its own copy, see NewSessionCb.
+    SSL_SESSION* copy = IsExpired(session) ? nullptr : SSL_SESSION_dup(session);
+    if (copy) {
+      VLOG(1) << "Resuming TLS session for " << key;
+      SSL_set_session(ssl, copy);
+      SSL_SESSION_free(copy);
+    }
+    SSL_SESSION_free(session);
+  }
+}
+
+auto ClientSessionCache::GetStats() const -> Stats {
+  Stats res;
+  res.full_handshakes = full_handshakes_.load(memory_order_relaxed);
+  res.resumed_handshakes = resumed_handshakes_.load(memory_order_relaxed);
+
+  lock_guard lk(mu_);
+  res.sessions = sessions_.size();
+  return res;
+}
+
+void ClientSessionCache::Store(const string& key, SSL_SESSION* session) {
+  lock_guard lk(mu_);
+  auto [it, inserted] = sessions_.emplace(key, session);
+  if (!inserted) {
+    SSL_SESSION_free(it->second);
+    it->second = session;
+    return;
+  }
+
+  if (sessions_.size() > capacity_) {
+    // We prefer simplicity over LRU here, reconnects are rare compared to requests.
+    auto victim = sessions_.begin();
+    if (victim == it)
+      ++victim;
+    SSL_SESSION_free(victim->second);
+    sessions_.erase(victim);
+  }
+}
+
+int ClientSessionCache::NewSessionCb(SSL* ssl, SSL_SESSION* session) {
+  ClientSessionCache* cache = Get(SSL_get_SSL_CTX(ssl));
+  ConnInfo* info = static_cast<ConnInfo*>(SSL_get_ex_data(ssl, ConnInfoIndex()));
+  if (!cache || !info || !SSL_SESSION_is_resumable(session))
+    return 0;
+
+  // OpenSSL marks the session as not resumable if the connection is freed without
+  // a proper shutdown, which is common when idle connections are dropped. Hence we store
+  // a copy that is not tied to this connection.
+  SSL_SESSION* copy = SSL_SESSION_dup(session);
+  if (copy)
+    cache->Store(info->key, copy);
+  return 0;
+}
+
+void ClientSessionCache::InfoCb(const SSL* ssl, int where, int ret) {
+  if ((where & SSL_CB_HANDSHAKE_DONE) == 0)
+    return;
+
+  // TLS 1.3 reports post-handshake messages as handshakes as well.
+  ConnInfo* info = static_cast<ConnInfo*>(SSL_get_ex_data(ssl, ConnInfoIndex()));
+  ClientSessionCache* cache = Get(SSL_get_SSL_CTX(ssl));
+  if (!info || !cache || info->counted)
+    return;
+
+  info->counted = true;
+  if (SSL_session_reused(ssl)) {
+    cache->resumed_handshakes_.fetch_add(1, memory_order_relaxed);
+  } else {
+    cache->full_handshakes_.fetch_add(1, memory_order_relaxed);
+  }
+}
+
+}  // namespace tls
+}  // namespace util
@@ -0,0 +1,66 @@
+// Copyright 2024, Roman Gershman.  All rights reserved.
+// See LICENSE for licensing terms.
+//
+
+#pragma once
+
+#include <absl/container/flat_hash_map.h>
+#include <openssl/ssl.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+namespace util {
+namespace tls {
+
+// Client side cache of TLS sessions that allows reconnects to the same peer to resume
+// the session instead of doing a full handshake. Supports both session ids and tickets.
+// A cache is attached to SSL_CTX and shared by all the connections created with it,
+// hence it is thread-safe. TLS 1.3 tickets are used at most once, as RFC 8446 recommends,
+// the servers usually issue new ones upon each handshake.
+class ClientSessionCache {
+ public:
+  struct Stats {
+    uint64_t full_handshakes = 0;
+    uint64_t resumed_handshakes = 0;
+    size_t sessions = 0;  // number of cached sessions.
+  };
+
+  // Attaches a new cache to ctx, overriding its client session cache mode and
+  // its new session callback. Must be called before ctx is used for connections.
+  // The cache is owned by ctx and is destroyed together with it.
+  static ClientSessionCache* Enable(SSL_CTX* ctx, size_t capacity = 1024);
+
+  // Returns the cache attached to ctx or null.
+  static ClientSessionCache* Get(SSL_CTX* ctx);
+
+  // Prepares ssl for connecting to the peer identified by key, for example "host:port".
+  // Must be called before the handshake. If the cache has a session for key, the handshake
+  // tries to resume it. Any new sessions issued by the peer are stored under key.
+  void Attach(SSL* ssl, std::string_view key);
+
+  Stats GetStats() const;
+
+  ~ClientSessionCache();
+
+ private:
+  explicit ClientSessionCache(size_t capacity) : capacity_(capacity) {
+  }
+
+  static int NewSessionCb(SSL* ssl, SSL_SESSION* session);
+  static void InfoCb(const SSL* ssl, int where, int ret);
+
+  void Store(const std::string& key, SSL_SESSION* session);
+
+  const size_t capacity_;
+
+  mutable std::mutex mu_;
+  absl::flat_hash_map<std::string, SSL_SESSION*> sessions_;
+
+  std::atomic_uint64_t full_handshakes_{0}, resumed_handshakes_{0};
+};
+
+}  // namespace tls
+}  // namespace util
@@ -6,11 +6,23 @@
 
 #include <openssl/err.h>
 
+#ifdef __linux__
+#include <linux/tls.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#endif
+
+#include <absl/container/flat_hash_map.h>
+
 #include <algorithm>
+#include <vector>
 
 #include "base/logging.h"
+#include "util/fibers/fiberqueue_threadpool.h"
 #include "util/fibers/fibers.h"
+#include "util/fibers/proactor_base.h"
 #include "util/tls/tls_engine.h"
+#include "util/tls/tls_session_cache.h"
 
 namespace util {
 namespace tls {
@@ -57,6 +69,151 @@ inline error_code SSL2Error(unsigned long err) {
   return error_code{int(err), tls_category};
 }
 
+// Plaintext buffer of a full record that WriteSome coalesces small buffers into.
+// Borrowed from a per-thread, i.e. per-proactor, free list for the duration of a write,
+// so that idle sockets do not hold one, and allocated only if needed.
+class RecordBuf {
+ public:
+  static constexpr size_t kSize = SSL3_RT_MAX_PLAIN_LENGTH;
+
+  RecordBuf() = default;
+  RecordBuf(const RecordBuf&) = delete;
+  RecordBuf& operator=(const RecordBuf&) = delete;
+
+  ~RecordBuf() {
+    auto& free_list = FreeList();
+    if (buf_ && free_list.size() < kMaxFree)
+      free_list.push_back(std::move(buf_));
+  }
+
+  uint8_t* get() {
+    if (!buf_) {
+      auto& free_list = FreeList();
+      if (free_list.empty()) {
+        buf_.reset(new uint8_t[kSize]);
+      } else {
+        buf_ = std::move(free_list.back());
+        free_list.pop_back();
+      }
+    }
+    return buf_.get();
+  }
+
+ private:
+  static constexpr size_t kMaxFree = 64;
+
+  static vector<unique_ptr<uint8_t[]>>& FreeList() {
+    static thread_local vector<unique_ptr<uint8_t[]>> free_list;
+    return free_list;
+  }
+
+  unique_ptr<uint8_t[]> buf_;
+};
+
+int EnginePoolIndex() {
+  static int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+  return index;
+}
+
+// The ex data of the pool holds the capacity shifted left by one, and the large buffers bit.
+uintptr_t EnginePoolData(SSL_CTX* ctx) {
+  return reinterpret_cast<uintptr_t>(SSL_CTX_get_ex_data(ctx, EnginePoolIndex()));
+}
+
+// Maximal number of the pooled engines per thread, 0 if the pool is disabled.
+unsigned EnginePoolCapacity(SSL_CTX* ctx) {
+  return EnginePoolData(ctx) >> 1;
+}
+
+// The BIO buffer size of the engines of the pool.
+unsigned EnginePoolBioBufSize(SSL_CTX* ctx) {
+  return (EnginePoolData(ctx) & 1) ? Engine::kLargeBioBufSize : 0;
+}
+
+// The engines of a thread, by their contexts. Each engine holds a reference to its context,
+// so the keys are not reused while the engines are pooled.
+using EnginePool = absl::flat_hash_map<SSL_CTX*, vector<unique_ptr<Engine>>>;
+
+EnginePool& ThreadEnginePool() {
+  static thread_local EnginePool pool;
+  return pool;
+}
+
+#ifdef __linux__
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+template <typename Info>
+error_code SetCryptoInfo(int fd, int direction, uint16_t cipher_type,
+                         const Engine::TrafficKeys& keys, uint64_t seq) {
+  static_assert(sizeof(Info::salt) + sizeof(Info::iv) == sizeof(keys.iv));
+  Info info;
+  memset(&info, 0, sizeof(info));
+
+  info.info.version = keys.version == TLS1_3_VERSION ? TLS_1_3_VERSION : TLS_1_2_VERSION;
+  info.info.cipher_type = cipher_type;
+  for (unsigned i = 0; i < sizeof(info.rec_seq); ++i) {
+    info.rec_seq[i] = seq >> (8 * (sizeof(info.rec_seq) - 1 - i));
+  }
+
+  memcpy(info.key, keys.key, sizeof(info.key));
+  memcpy(info.salt, keys.iv, sizeof(info.salt));
+
+  // TLS 1.2 sends the rest of the nonce explicitly, the kernel derives it from iv.
+  if (keys.version == TLS1_3_VERSION) {
+    memcpy(info.iv, keys.iv + sizeof(info.salt), sizeof(info.iv));
+  } else {
+    memcpy(info.iv, info.rec_seq, sizeof(info.iv));
+  }
+
+  error_code ec;
+  if (setsockopt(fd, SOL_TLS, direction, &info, sizeof(info)) < 0)
+    ec = error_code(errno, system_category());
+  OPENSSL_cleanse(&info, sizeof(info));
+  return ec;
+}
+
+error_code SetCryptoInfo(int fd, int direction, const Engine::TrafficKeys& keys, uint64_t seq) {
+  if (keys.key_len == 16) {
+    return SetCryptoInfo<tls12_crypto_info_aes_gcm_128>(fd, direction, TLS_CIPHER_AES_GCM_128,
+                                                        keys, seq);
+  }
+  return SetCryptoInfo<tls12_crypto_info_aes_gcm_256>(fd, direction, TLS_CIPHER_AES_GCM_256, keys,
+                                                      seq);
+}
+
+// Sends close_notify alert via the kernel TLS layer.
+void SendKtlsCloseNotify(int fd) {
+  uint8_t alert[2] = {1, 0};  // warning level, close_notify.
+  char control[CMSG_SPACE(sizeof(uint8_t))];
+  memset(control, 0, sizeof(control));
+
+  iovec v{alert, sizeof(alert)};
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &v;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_TLS;
+  cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(uint8_t));
+  *CMSG_DATA(cmsg) = 21;  // alert record type.
+
+  // Best effort, similarly to the user space engine we do not wait for the peer.
+  sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+#endif
+
 }  // namespace
 
 TlsSocket::TlsSocket(std::unique_ptr<FiberSocketBase> next)
@@ -69,11 +226,27 @@ TlsSocket::TlsSocket(FiberSocketBase* next) : TlsSocket(std::unique_ptr<FiberSoc
 TlsSocket::~TlsSocket() {
   // sanity check that all pending ops are done.
   DCHECK_EQ(state_ & (WRITE_IN_PROGRESS | READ_IN_PROGRESS | SHUTDOWN_IN_PROGRESS), 0);
+
+  // The SNI callback of a server may switch the context of the engine.
+  if (pool_ctx_ && SSL_get_SSL_CTX(engine_->native_handle()) == pool_ctx_) {
+    auto& engines = ThreadEnginePool()[pool_ctx_];
+    if (engines.size() < EnginePoolCapacity(pool_ctx_) && engine_->Reset())
+      engines.push_back(std::move(engine_));
+  }
 }
 
 void TlsSocket::InitSSL(SSL_CTX* context, Buffer prefix) {
   CHECK(!engine_);
-  engine_.reset(new Engine{context});
+  if (EnginePoolCapacity(context) > 0) {
+    pool_ctx_ = context;
+    auto& engines = ThreadEnginePool()[context];
+    if (!engines.empty()) {
+      engine_ = std::move(engines.back());
+      engines.pop_back();
+    }
+  }
+  if (!engine_)
+    engine_.reset(new Engine{context, pool_ctx_ ? EnginePoolBioBufSize(context) : 0});
   if (!prefix.empty()) {
     Engine::OpResult op_result = engine_->WriteBuf(prefix);
     CHECK(op_result);
@@ -81,6 +254,18 @@ void TlsSocket::InitSSL(SSL_CTX* context, Buffer prefix) {
   }
 }
 
+void TlsSocket::EnableKtls() {
+  CHECK(engine_);
+  SSL* ssl = engine_->native_handle();
+
+  // Tickets and handshake messages would be protected with the keys the engine no longer
+  // tracks, so we make the kernel the only producer and consumer of the records.
+  SSL_set_num_tickets(ssl, 0);
+  SSL_set_options(ssl, SSL_OP_NO_RENEGOTIATION);
+  engine_->CaptureTrafficSecrets();
+  state_ |= KTLS_REQUESTED;
+}
+
 auto TlsSocket::Shutdown(int how) -> error_code {
   DCHECK(engine_);
   if (state_ & (SHUTDOWN_DONE | SHUTDOWN_IN_PROGRESS)) {
@@ -88,10 +273,16 @@ auto TlsSocket::Shutdown(int how) -> error_code {
   }
 
   state_ |= SHUTDOWN_IN_PROGRESS;
-  Engine::OpResult op_result = engine_->Shutdown();
-  if (op_result) {
-    // engine_ could send notification messages to the peer.
-    MaybeSendOutput();
+  if (state_ & KTLS_TX) {
+#ifdef __linux__
+    SendKtlsCloseNotify(native_handle());
+#endif
+  } else {
+    Engine::OpResult op_result = engine_->Shutdown();
+    if (op_result) {
+      // engine_ could send notification messages to the peer.
+      MaybeSendOutput();
+    }
   }
 
   // In any case we should also shutdown the underlying TCP socket without relying on the
@@ -114,7 +305,7 @@ auto TlsSocket::Accept() -> AcceptResult {
   DCHECK(engine_);
 
   while (true) {
-    Engine::OpResult op_result = engine_->Handshake(Engine::SERVER);
+    Engine::OpResult op_result = DoHandshake(Engine::SERVER);
 
     // it is important to send output (protocol errors) before we return from this function.
     error_code ec = MaybeSendOutput();
@@ -142,12 +333,17 @@ auto TlsSocket::Accept() -> AcceptResult {
     }
   }
 
+  if (state_ & KTLS_REQUESTED) {
+    error_code ec = InstallKtls();
+    VLOG_IF(1, ec) << "kTLS is not available: " << ec.message();
+  }
+
   return nullptr;
 }
 
 auto TlsSocket::Connect(const endpoint_type& endpoint) -> error_code {
   DCHECK(engine_);
-  auto io_result = engine_->Handshake(Engine::HandshakeType::CLIENT);
+  auto io_result = DoHandshake(Engine::HandshakeType::CLIENT);
   if (!io_result.has_value()) {
     return std::error_code(io_result.error(), std::system_category());
   }
@@ -165,6 +361,19 @@ auto TlsSocket::Close() -> error_code {
   return next_sock_->Close();
 }
 
+Engine::OpResult TlsSocket::DoHandshake(Engine::HandshakeType type) {
+  // Without the peer's input the engine can not make progress, hence the step is cheap.
+  if (!handshake_pool_ || engine_->InputPending() == 0)
+    return engine_->Handshake(type);
+
+  Engine* engine = engine_.get();
+  return handshake_pool_->Await([engine, type] {
+    // The error queue is thread-local, do not pick up errors left by other sockets.
+    ERR_clear_error();
+    return engine->Handshake(type);
+  });
+}
+
 class SpinCounter {
  public:
   explicit SpinCounter(size_t limit) : limit_(limit) {
@@ -192,6 +401,9 @@ io::Result<size_t> TlsSocket::RecvMsg(const msghdr& msg, int flags) {
   DCHECK(engine_);
   DCHECK_GT(size_t(msg.msg_iovlen), 0u);
 
+  if (state_ & KTLS_RX)
+    return next_sock_->RecvMsg(msg, flags);
+
   DLOG_IF(INFO, flags) << "Flags argument is not supported " << flags;
 
   auto* io = msg.msg_iov;
@@ -269,35 +481,70 @@ io::Result<size_t> TlsSocket::Recv(const io::MutableBytes& mb, int flags) {
   return RecvMsg(msg, flags);
 }
 
+auto TlsSocket::WaitReadable() -> error_code {
+  if ((state_ & KTLS_RX) == 0) {
+    DCHECK(engine_);
+    if (SSL_pending(engine_->native_handle()) > 0 || engine_->InputPending() > 0)
+      return {};
+  }
+  return next_sock_->WaitReadable();
+}
+
+void TlsSocket::CancelPendingIo() {
+  next_sock_->CancelPendingIo();
+}
+
+void TlsSocket::CancelPendingIoAsync() {
+  next_sock_->CancelPendingIoAsync();
+}
+
 io::Result<size_t> TlsSocket::WriteSome(const iovec* ptr, uint32_t len) {
-  // Chosen to be sufficiently smaller than the usual MTU (1500) and a multiple of 16.
-  // IP - max 24 bytes. TCP - max 60 bytes. TLS - max 21 bytes.
-  constexpr size_t kBufferSize = 1392;
-  io::Result<size_t> ec;
+  if (state_ & KTLS_TX)
+    return next_sock_->WriteSome(ptr, len);
+
+  // Small buffers are coalesced into full records, larger ones are passed to the engine
+  // as is. The engine splits them into full records by itself.
+  RecordBuf scratch;
+  size_t buffered_size = 0, offset = 0;  // offset - the consumed prefix of *ptr.
   size_t total_sent = 0;
 
   while (len) {
-    if (ptr->iov_len > kBufferSize || len == 1) {
-      ec = SendBuffer(Engine::Buffer{reinterpret_cast<uint8_t*>(ptr->iov_base), ptr->iov_len});
+    Engine::Buffer buf{reinterpret_cast<uint8_t*>(ptr->iov_base) + offset, ptr->iov_len - offset};
+    if (buffered_size == 0 && (buf.size() >= RecordBuf::kSize || len == 1)) {
       ptr++;
       len--;
+      offset = 0;
     } else {
-      alignas(64) uint8_t scratch[kBufferSize];
-      size_t buffered_size = 0;
-      while (len && (buffered_size + ptr->iov_len) <= kBufferSize) {
-        std::memcpy(scratch + buffered_size, ptr->iov_base, ptr->iov_len);
-        buffered_size += ptr->iov_len;
+      size_t copy_sz = std::min(buf.size(), RecordBuf::kSize - buffered_size);
+      std::memcpy(scratch.get() + buffered_size, buf.data(), copy_sz);
+      buffered_size += copy_sz;
+      offset += copy_sz;
+      if (offset == ptr->iov_len) {
         ptr++;
         len--;
+        offset = 0;
       }
-      ec = SendBuffer({scratch, buffered_size});
-    }
-    if (!ec.has_value()) {
-      return ec;
-    } else {
-      total_sent += ec.value();
+      if (len && buffered_size < RecordBuf::kSize)
+        continue;
+
+      buf = Engine::Buffer{scratch.get(), buffered_size};
+      buffered_size = 0;
     }
+
+    if (buf.empty())
+      continue;
+
+    io::Result<size_t> res = SendBuffer(buf);
+    if (!res)
+      return res;
+    total_sent += *res;
   }
+
+  // SendBuffer flushes only when the engine output is full, the rest is flushed here.
+  error_code ec = MaybeSendOutput();
+  if (ec)
+    return make_unexpected(ec);
+
   return total_sent;
 }
 
@@ -314,28 +561,30 @@ io::Result<size_t> TlsSocket::SendBuffer(Engine::Buffer buf) {
       return make_unexpected(SSL2Error(op_result.error()));
     }
 
+    // With partial writes the engine returns after each record. We keep feeding it until
+    // its output is full, so that the records are flushed together.
+    int op_val = *op_result;
+    if (op_val > 0) {
+      send_total += op_val;
+
+      if (size_t(op_val) == buf.size()) {
+        break;
+      }
+      buf.remove_prefix(op_val);
+      continue;
+    }
+
     error_code ec = MaybeSendOutput();
     if (ec) {
       return make_unexpected(ec);
     }
 
-    int op_val = *op_result;
     if (spin_count.Check(op_val <= 0)) {
       // Once every 30 seconds.
       LOG_EVERY_T(WARNING, 30) << "IO loop spin limit reached. Limit: " << spin_count.Limit()
                                << " Spins: " << spin_count.Spins();
     }
 
-    if (op_val > 0) {
-      send_total += op_val;
-
-      if (size_t(op_val) == buf.size()) {
-        break;
-      } else {
-        buf.remove_prefix(op_val);
-      }
-    }
-
     if (op_val == Engine::EOF_STREAM) {
       return make_unexpected(make_error_code(errc::connection_reset));
     }
@@ -352,10 +601,21 @@ io::Result<size_t> TlsSocket::SendBuffer(Engine::Buffer buf) {
 
 // TODO: to implement async functionality.
 void TlsSocket::AsyncWriteSome(const iovec* v, uint32_t len, AsyncProgressCb cb) {
+  if (state_ & KTLS_TX) {
+    next_sock_->AsyncWriteSome(v, len, std::move(cb));
+    return;
+  }
+
   io::Result<size_t> res = WriteSome(v, len);
   cb(res);
 }
 
+auto TlsSocket::EnableZeroCopySend(size_t threshold) -> error_code {
+  if (state_ & KTLS_TX)
+    return next_sock_->EnableZeroCopySend(threshold);
+  return make_error_code(errc::operation_not_supported);
+}
+
 SSL* TlsSocket::ssl_handle() {
   return engine_ ? engine_->native_handle() : nullptr;
 }
@@ -381,25 +641,31 @@ auto TlsSocket::MaybeSendOutput() -> error_code {
     return error_code{};
   }
 
-  auto buf_result = engine_->PeekOutputBuf();
-  CHECK(buf_result);
+  // we do not allow concurrent writes from multiple fibers.
+  state_ |= WRITE_IN_PROGRESS;
 
-  if (!buf_result->empty()) {
-    // we do not allow concurrent writes from multiple fibers.
-    state_ |= WRITE_IN_PROGRESS;
-    io::Result<size_t> write_result = next_sock_->WriteSome(*buf_result);
+  // Drains the output, including the records that other fibers add while we write. The output
+  // buffer of the engine rewinds once it is empty, so the records usually go out contiguously
+  // with a single write.
+  error_code ec;
+  while (true) {
+    auto buf_result = engine_->PeekOutputBuf();
+    CHECK(buf_result);
+    if (buf_result->empty())
+      break;
 
-    // Safe to clear here since the code below is atomic fiber-wise.
-    state_ &= ~WRITE_IN_PROGRESS;
+    io::Result<size_t> write_result = next_sock_->WriteSome(*buf_result);
     DCHECK(engine_);
     if (!write_result) {
-      return write_result.error();
+      ec = write_result.error();
+      break;
     }
     CHECK_GT(*write_result, 0u);
     engine_->ConsumeOutputBuf(*write_result);
   }
+  state_ &= ~WRITE_IN_PROGRESS;
 
-  return error_code{};
+  return ec;
 }
 
 auto TlsSocket::HandleRead() -> error_code {
@@ -423,6 +689,43 @@ auto TlsSocket::HandleRead() -> error_code {
   return error_code{};
 }
 
+auto TlsSocket::InstallKtls() -> error_code {
+#ifdef __linux__
+  Engine::TrafficKeys tx, rx;
+  if (!engine_->ExportTrafficKeys(true, &tx) || !engine_->ExportTrafficKeys(false, &rx))
+    return make_error_code(errc::operation_not_supported);
+
+  int fd = native_handle();
+  if (setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0)
+    return error_code(errno, system_category());
+
+  // No application records were exchanged yet. In TLS 1.2 the Finished messages are
+  // the first records protected by these keys, in TLS 1.3 they use the handshake keys.
+  uint64_t seq = tx.version == TLS1_2_VERSION ? 1 : 0;
+
+  // A direction can move to the kernel only if the engine does not buffer its records.
+  error_code ec;
+  if (engine_->OutputPending() == 0) {
+    ec = SetCryptoInfo(fd, TLS_TX, tx, seq);
+    if (!ec)
+      state_ |= KTLS_TX;
+  }
+
+  SSL* ssl = engine_->native_handle();
+  if (!ec && engine_->InputPending() == 0 && !SSL_has_pending(ssl)) {
+    ec = SetCryptoInfo(fd, TLS_RX, rx, seq);
+    if (!ec)
+      state_ |= KTLS_RX;
+  }
+
+  OPENSSL_cleanse(&tx, sizeof(tx));
+  OPENSSL_cleanse(&rx, sizeof(rx));
+  return ec;
+#else
+  return make_error_code(errc::operation_not_supported);
+#endif
+}
+
 TlsSocket::endpoint_type TlsSocket::LocalEndpoint() const {
   return next_sock_->LocalEndpoint();
 }
@@ -472,5 +775,41 @@ void TlsSocket::SetProactor(ProactorBase* p) {
   FiberSocketBase::SetProactor(p);
 }
 
+void EnableEnginePool(SSL_CTX* ctx, unsigned max_per_thread, bool large_buffers) {
+  CHECK(!ClientSessionCache::Get(ctx));
+  uintptr_t data = (uintptr_t(max_per_thread) << 1) | uintptr_t(large_buffers);
+  CHECK_EQ(1, SSL_CTX_set_ex_data(ctx, EnginePoolIndex(), reinterpret_cast<void*>(data)));
+}
+
+SslCtxShards::SslCtxShards(unsigned num_shards, const std::function<SSL_CTX*()>& factory) {
+  CHECK_GT(num_shards, 0u);
+  ctxs_.reserve(num_shards);
+  for (unsigned i = 0; i < num_shards; ++i) {
+    SSL_CTX* ctx = factory();
+    CHECK(ctx);
+    ctxs_.push_back(ctx);
+  }
+
+  // name, hmac and aes keys.
+  uint8_t keys[80];
+  if (SSL_CTX_get_tlsext_ticket_keys(ctxs_[0], keys, sizeof(keys)) == 1) {
+    for (unsigned i = 1; i < num_shards; ++i) {
+      CHECK_EQ(1, SSL_CTX_set_tlsext_ticket_keys(ctxs_[i], keys, sizeof(keys)));
+    }
+  }
+  OPENSSL_cleanse(keys, sizeof(keys));
+}
+
+SslCtxShards::~SslCtxShards() {
+  for (SSL_CTX* ctx : ctxs_)
+    SSL_CTX_free(ctx);
+}
+
+SSL_CTX* SslCtxShards::Get() const {
+  ProactorBase* proactor = ProactorBase::me();
+  int32_t index = proactor ? proactor->GetPoolIndex() : -1;
+  return unsigned(index) < ctxs_.size() ? ctxs_[index] : ctxs_[0];
+}
+
 }  // namespace tls
 }  // namespace util
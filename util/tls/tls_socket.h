@@ -6,12 +6,19 @@
 
 #include <openssl/ssl.h>
 
+#include <functional>
 #include <memory>
+#include <vector>
 
 #include "util/fiber_socket_base.h"
 #include "util/tls/tls_engine.h"
 
 namespace util {
+
+namespace fb2 {
+class FiberQueueThreadPool;
+}  // namespace fb2
+
 namespace tls {
 
 class Engine;
@@ -31,6 +38,31 @@ class TlsSocket final : public FiberSocketBase {
   // prefix points to the buffer that optionally holds first bytes from the TLS data stream.
   void InitSSL(SSL_CTX* context, Buffer prefix = {});
 
+  // Requests offloading of the record layer to the kernel (kTLS) once Accept completes
+  // the handshake. Must be called after InitSSL and before Accept. Supported for AES-GCM
+  // sessions of TLS 1.2 and 1.3 on Linux. Disables TLS 1.3 session tickets and renegotiation,
+  // since the kernel must see only application records. If the kernel or the session do not
+  // support the offload, the socket continues with the user space engine.
+  // The offloaded directions bypass the engine and go directly to the underlying socket,
+  // which also allows zero-copy sends. Receiving a non-data record (an alert or a key update)
+  // in kTLS mode fails the read.
+  void EnableKtls();
+
+  // Runs the CPU heavy handshake steps (key exchange and signatures) on the threads of pool
+  // while the calling fiber waits, so that the proactor keeps serving other sockets during
+  // reconnect storms. pool must outlive the handshake, nullptr restores inline handshakes.
+  void set_handshake_offload(fb2::FiberQueueThreadPool* pool) {
+    handshake_pool_ = pool;
+  }
+
+  bool IsKtlsTx() const {
+    return state_ & KTLS_TX;
+  }
+
+  bool IsKtlsRx() const {
+    return state_ & KTLS_RX;
+  }
+
   error_code Shutdown(int how) final;
 
   AcceptResult Accept() final;
@@ -56,9 +88,18 @@ class TlsSocket final : public FiberSocketBase {
   io::Result<size_t> RecvMsg(const msghdr& msg, int flags) final;
   io::Result<size_t> Recv(const io::MutableBytes& mb, int flags = 0) override;
 
+  // Returns immediately if the engine holds received data.
+  error_code WaitReadable() final;
+
+  void CancelPendingIo() final;
+  void CancelPendingIoAsync() final;
+
   ::io::Result<size_t> WriteSome(const iovec* ptr, uint32_t len) final;
   void AsyncWriteSome(const iovec* v, uint32_t len, AsyncProgressCb cb) final;
 
+  // Supported only if the sends are offloaded to the kernel.
+  error_code EnableZeroCopySend(size_t threshold) final;
+
   SSL* ssl_handle();
 
   endpoint_type LocalEndpoint() const override;
@@ -94,17 +135,67 @@ class TlsSocket final : public FiberSocketBase {
   /// Read encrypted data from the network socket and feed it into the TLS engine.
   error_code HandleRead();
 
+  /// Performs a handshake step, possibly on handshake_pool_.
+  Engine::OpResult DoHandshake(Engine::HandshakeType type);
+
+  /// Installs the session keys into the kernel, for the directions that have no data
+  /// buffered in the engine.
+  error_code InstallKtls();
+
   std::unique_ptr<FiberSocketBase> next_sock_;
   std::unique_ptr<Engine> engine_;
+  SSL_CTX* pool_ctx_ = nullptr;  // set if engine_ returns to the engine pool of the context.
+  fb2::FiberQueueThreadPool* handshake_pool_ = nullptr;
 
   enum {
     WRITE_IN_PROGRESS = 1,
     READ_IN_PROGRESS = 2,
     SHUTDOWN_IN_PROGRESS = 4,
-    SHUTDOWN_DONE = 8
+    SHUTDOWN_DONE = 8,
+    KTLS_REQUESTED = 16,
+    KTLS_TX = 32,
+    KTLS_RX = 64,
   };
   uint8_t state_{0};
 };
 
+// Makes the TlsSockets of ctx take their engines from per-thread, i.e. per-proactor, pools
+// of up to max_per_thread engines and return them there when they are destroyed, so that
+// the connection churn does not allocate SSL objects and BIO pairs. The returned engines are
+// reset with Engine::Reset, which keeps the state set directly on their SSL objects, hence
+// the pools suit server contexts and can not be enabled for contexts with a
+// ClientSessionCache. With large_buffers the engines have BIO pairs of
+// Engine::kLargeBioBufSize, which speed up bulk transfers, and the pools keep the buffers
+// allocated across the connections. Must be called before the sockets of ctx are initialized.
+void EnableEnginePool(SSL_CTX* ctx, unsigned max_per_thread, bool large_buffers = false);
+
+// Copies of a context for each proactor of a pool, created by the same factory. The
+// connections of all the threads take the locks of a shared context, e.g. of its session
+// cache, and update its reference count, the copies keep them thread local. The session
+// ticket keys of the first copy are installed into the others so that the tickets resume on
+// any thread, but the session ids of TLS 1.2 resume only on the thread that issued them.
+class SslCtxShards {
+ public:
+  SslCtxShards(unsigned num_shards, const std::function<SSL_CTX*()>& factory);
+  ~SslCtxShards();
+
+  SslCtxShards(const SslCtxShards&) = delete;
+  SslCtxShards& operator=(const SslCtxShards&) = delete;
+
+  // Returns the copy of the calling proactor thread, the first copy for other threads.
+  SSL_CTX* Get() const;
+
+  SSL_CTX* at(unsigned index) const {
+    return ctxs_[index];
+  }
+
+  size_t size() const {
+    return ctxs_.size();
+  }
+
+ private:
+  std::vector<SSL_CTX*> ctxs_;
+};
+
 }  // namespace tls
 }  // namespace util
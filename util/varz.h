@@ -32,6 +32,10 @@ class VarzQps : public base::VarzListNode {
     val_.Inc();
   }
 
+  void IncBy(int32_t delta) {
+    val_.IncBy(delta);
+  }
+
  private:
   virtual AnyValue GetData() const override;
 
@@ -70,13 +74,24 @@ class VarzMapAverage : public base::VarzListNode {
   }
 
   virtual AnyValue GetData() const override;
-  unsigned ProactorThreadIndex() const;
+
+  unsigned ProactorThreadIndex() const {
+    DCHECK(pp_) << "Must be initialized";
+    int32_t indx = fb2::ProactorBase::me()->GetPoolIndex();
+    DCHECK_GE(indx, 0) << "Must be called from proactor thread!";
+    return unsigned(indx);
+  }
+
   Map::iterator FindSlow(std::string_view key);
 
   ProactorPool* pp_ = nullptr;
+
+  // Each proactor updates its own map, the maps are merged by key upon read.
   std::unique_ptr<Map[]> avg_map_;
 };
 
+// Proactor threads of the pool passed to Init update their own shard without atomics,
+// other threads, or any thread before Init, update a shared atomic counter.
 class VarzCount : public base::VarzListNode {
  public:
   explicit VarzCount(const char* varname) : base::VarzListNode(varname) {
@@ -84,15 +99,32 @@ class VarzCount : public base::VarzListNode {
   ~VarzCount();
 
   void Init(ProactorPool* pp);
+
+  // Must be called after the proactors stop updating the counter.
   void Shutdown();
 
   void IncBy(int64_t delta) {
-    count_.fetch_add(delta, std::memory_order_relaxed);
+    fb2::ProactorBase* pb = fb2::ProactorBase::me();
+    int32_t idx = pb ? pb->GetPoolIndex() : -1;
+
+    // The proactors of other pools may have the same or larger indices, they update the
+    // atomic counter as well.
+    if (shards_ && idx >= 0 && unsigned(idx) < pp_->size() && pp_->at(idx) == pb) {
+      shards_[idx].count += delta;
+    } else {
+      count_.fetch_add(delta, std::memory_order_relaxed);
+    }
   }
 
  private:
+  struct alignas(64) Shard {
+    int64_t count = 0;
+  };
+
   AnyValue GetData() const override;
 
+  ProactorPool* pp_ = nullptr;
+  std::unique_ptr<Shard[]> shards_;
   std::atomic_int64_t count_{0};
 };
 